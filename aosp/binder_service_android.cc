@@ -28,13 +28,22 @@
 
 using android::binder::Status;
 using android::os::IUpdateEngineCallback;
+using android::os::IUpdateEngineStatsCallback;
 using android::os::ParcelFileDescriptor;
 using std::string;
 using std::vector;
+using update_engine::UpdateEngineStats;
 using update_engine::UpdateEngineStatus;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// The calls a client can fail in a row before it is dropped.
+constexpr int kMaxCallbackFailures = 3;
+
+}  // namespace
+
 BinderUpdateEngineAndroidService::BinderUpdateEngineAndroidService(
     ServiceDelegateAndroidInterface* service_delegate)
     : service_delegate_(service_delegate) {}
@@ -43,15 +52,80 @@ void BinderUpdateEngineAndroidService::SendStatusUpdate(
     const UpdateEngineStatus& update_engine_status) {
   last_status_ = static_cast<int>(update_engine_status.status);
   last_progress_ = update_engine_status.progress;
+  vector<android::sp<IBinder>> dropped;
   for (auto& callback : callbacks_) {
-    callback->onStatusUpdate(last_status_, last_progress_);
+    auto binder = IUpdateEngineCallback::asBinder(callback);
+    if (RecordCallbackStatus(
+            binder.get(),
+            callback->onStatusUpdate(last_status_, last_progress_))) {
+      dropped.push_back(binder);
+    }
   }
+  DropCallbacks(dropped, false);
 }
 
 void BinderUpdateEngineAndroidService::SendPayloadApplicationComplete(
     ErrorCode error_code) {
+  vector<android::sp<IBinder>> dropped;
   for (auto& callback : callbacks_) {
-    callback->onPayloadApplicationComplete(static_cast<int>(error_code));
+    auto binder = IUpdateEngineCallback::asBinder(callback);
+    if (RecordCallbackStatus(binder.get(),
+                             callback->onPayloadApplicationComplete(
+                                 static_cast<int>(error_code)))) {
+      dropped.push_back(binder);
+    }
+  }
+  DropCallbacks(dropped, false);
+}
+
+void BinderUpdateEngineAndroidService::SendStatsUpdate(
+    const UpdateEngineStats& stats) {
+  if (stats_callbacks_.empty())
+    return;
+  android::os::UpdateEngineStats parcel;
+  parcel.status = static_cast<int>(stats.status);
+  parcel.partition = android::String16(stats.partition.c_str());
+  parcel.operationsApplied = stats.operations_applied;
+  parcel.operationsTotal = stats.operations_total;
+  parcel.bytesDownloaded = stats.bytes_downloaded;
+  parcel.bytesTotal = stats.bytes_total;
+  parcel.downloadBytesPerSecond = stats.download_rate;
+  parcel.applyBytesPerSecond = stats.apply_rate;
+  parcel.verifyBytesPerSecond = stats.verify_rate;
+  parcel.etaSeconds = stats.eta_seconds;
+  vector<android::sp<IBinder>> dropped;
+  for (auto& callback : stats_callbacks_) {
+    auto binder = IUpdateEngineStatsCallback::asBinder(callback);
+    if (RecordCallbackStatus(binder.get(), callback->onStatsUpdate(parcel))) {
+      dropped.push_back(binder);
+    }
+  }
+  DropCallbacks(dropped, true);
+}
+
+bool BinderUpdateEngineAndroidService::RecordCallbackStatus(
+    const IBinder* callback, const Status& status) {
+  if (status.isOk()) {
+    callback_failures_.erase(callback);
+    return false;
+  }
+  const int failures = ++callback_failures_[callback];
+  LOG(WARNING) << "Callback call failed " << failures
+               << " time(s) in a row: " << status.toString8();
+  return failures >= kMaxCallbackFailures;
+}
+
+void BinderUpdateEngineAndroidService::DropCallbacks(
+    const vector<android::sp<IBinder>>& callbacks, bool stats) {
+  auto binder_wrapper = android::BinderWrapper::Get();
+  for (const auto& callback : callbacks) {
+    LOG(ERROR) << "Dropping a callback which keeps failing.";
+    binder_wrapper->UnregisterForDeathNotifications(callback);
+    if (stats) {
+      UnbindStatsCallback(callback.get());
+    } else {
+      UnbindCallback(callback.get());
+    }
   }
 }
 
@@ -98,6 +172,37 @@ Status BinderUpdateEngineAndroidService::unbind(
   return Status::ok();
 }
 
+Status BinderUpdateEngineAndroidService::bindStats(
+    const android::sp<IUpdateEngineStatsCallback>& callback,
+    bool* return_value) {
+  stats_callbacks_.emplace_back(callback);
+
+  const android::sp<IBinder>& callback_binder =
+      IUpdateEngineStatsCallback::asBinder(callback);
+  auto binder_wrapper = android::BinderWrapper::Get();
+  binder_wrapper->RegisterForDeathNotifications(
+      callback_binder,
+      base::Bind(base::IgnoreResult(
+                     &BinderUpdateEngineAndroidService::UnbindStatsCallback),
+                 base::Unretained(this),
+                 base::Unretained(callback_binder.get())));
+
+  *return_value = true;
+  return Status::ok();
+}
+
+Status BinderUpdateEngineAndroidService::unbindStats(
+    const android::sp<IUpdateEngineStatsCallback>& callback,
+    bool* return_value) {
+  const android::sp<IBinder>& callback_binder =
+      IUpdateEngineStatsCallback::asBinder(callback);
+  auto binder_wrapper = android::BinderWrapper::Get();
+  binder_wrapper->UnregisterForDeathNotifications(callback_binder);
+
+  *return_value = UnbindStatsCallback(callback_binder.get());
+  return Status::ok();
+}
+
 Status BinderUpdateEngineAndroidService::applyPayload(
     const android::String16& url,
     int64_t payload_offset,
@@ -201,6 +306,24 @@ bool BinderUpdateEngineAndroidService::UnbindCallback(const IBinder* callback) {
     return false;
   }
   callbacks_.erase(it);
+  callback_failures_.erase(callback);
+  return true;
+}
+
+bool BinderUpdateEngineAndroidService::UnbindStatsCallback(
+    const IBinder* callback) {
+  auto it = std::find_if(
+      stats_callbacks_.begin(),
+      stats_callbacks_.end(),
+      [&callback](const android::sp<IUpdateEngineStatsCallback>& elem) {
+        return IUpdateEngineStatsCallback::asBinder(elem).get() == callback;
+      });
+  if (it == stats_callbacks_.end()) {
+    LOG(ERROR) << "Unable to unbind unknown stats callback.";
+    return false;
+  }
+  stats_callbacks_.erase(it);
+  callback_failures_.erase(callback);
   return true;
 }
 
@@ -265,4 +388,26 @@ Status BinderUpdateEngineAndroidService::setPerformanceMode(bool enable) {
   return Status::ok();
 }
 
+Status BinderUpdateEngineAndroidService::setMaxDownloadRate(
+    int64_t bytes_per_second) {
+  brillo::ErrorPtr error;
+  if (bytes_per_second < 0) {
+    return Status::fromExceptionCode(Status::EX_ILLEGAL_ARGUMENT,
+                                     "Negative download rate");
+  }
+  if (!service_delegate_->SetMaxDownloadRate(bytes_per_second, &error))
+    return ErrorPtrToStatus(error);
+  return Status::ok();
+}
+
+Status BinderUpdateEngineAndroidService::getLastPerformanceReport(
+    android::String16* return_value) {
+  brillo::ErrorPtr error;
+  string report;
+  if (!service_delegate_->GetLastPerformanceReport(&report, &error))
+    return ErrorPtrToStatus(error);
+  *return_value = android::String16{report.data(), report.size()};
+  return Status::ok();
+}
+
 }  // namespace chromeos_update_engine
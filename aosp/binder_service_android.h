@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -28,6 +29,7 @@
 
 #include "android/os/BnUpdateEngine.h"
 #include "android/os/IUpdateEngineCallback.h"
+#include "android/os/IUpdateEngineStatsCallback.h"
 #include "update_engine/aosp/service_delegate_android_interface.h"
 #include "update_engine/common/service_observer_interface.h"
 
@@ -46,6 +48,7 @@ class BinderUpdateEngineAndroidService : public android::os::BnUpdateEngine,
   void SendStatusUpdate(
       const update_engine::UpdateEngineStatus& update_engine_status) override;
   void SendPayloadApplicationComplete(ErrorCode error_code) override;
+  void SendStatsUpdate(const update_engine::UpdateEngineStats& stats) override;
 
   // android::os::BnUpdateEngine overrides.
   android::binder::Status applyPayload(
@@ -80,15 +83,39 @@ class BinderUpdateEngineAndroidService : public android::os::BnUpdateEngine,
   android::binder::Status cleanupSuccessfulUpdate(
       const android::sp<android::os::IUpdateEngineCallback>& callback) override;
   android::binder::Status setPerformanceMode(bool enable) override;
+  android::binder::Status setMaxDownloadRate(int64_t bytes_per_second) override;
+  android::binder::Status bindStats(
+      const android::sp<android::os::IUpdateEngineStatsCallback>& callback,
+      bool* return_value) override;
+  android::binder::Status unbindStats(
+      const android::sp<android::os::IUpdateEngineStatsCallback>& callback,
+      bool* return_value) override;
+  android::binder::Status getLastPerformanceReport(
+      android::String16* return_value) override;
 
  private:
   // Remove the passed |callback| from the list of registered callbacks. Called
   // on unbind() or whenever the callback object is destroyed.
   // Returns true on success.
   bool UnbindCallback(const IBinder* callback);
+  bool UnbindStatsCallback(const IBinder* callback);
+
+  // Records the |status| of a oneway call to |callback|. Returns whether the
+  // client failed too many calls in a row, e.g. because it doesn't consume
+  // them and its binder buffer is full, in which case it must be dropped.
+  bool RecordCallbackStatus(const IBinder* callback,
+                            const android::binder::Status& status);
+  // Unbinds the |callbacks| dropped by RecordCallbackStatus(), which are stats
+  // callbacks if |stats| is true.
+  void DropCallbacks(const std::vector<android::sp<IBinder>>& callbacks,
+                     bool stats);
 
   // List of currently bound callbacks.
   std::vector<android::sp<android::os::IUpdateEngineCallback>> callbacks_;
+  std::vector<android::sp<android::os::IUpdateEngineStatsCallback>>
+      stats_callbacks_;
+  // The number of calls failed in a row by each callback, if any.
+  std::map<const IBinder*, int> callback_failures_;
 
   // Cached copy of the last status update sent. Used to send an initial
   // notification when bind() is called from the client.
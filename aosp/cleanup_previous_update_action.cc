@@ -15,14 +15,17 @@
 //
 #include "update_engine/aosp/cleanup_previous_update_action.h"
 
+#include <algorithm>
 #include <chrono>  // NOLINT(build/c++11) -- for merge times
 #include <functional>
 #include <string>
+#include <thread>  // NOLINT(build/c++11) -- for the property watch
 #include <type_traits>
 
 #include <android-base/chrono_utils.h>
 #include <android-base/properties.h>
 #include <base/bind.h>
+#include <base/threading/thread_task_runner_handle.h>
 
 #ifndef __ANDROID_RECOVERY__
 #include <statslog.h>
@@ -38,13 +41,26 @@ using android::snapshot::UpdateState;
 using brillo::MessageLoop;
 
 constexpr char kBootCompletedProp[] = "sys.boot_completed";
-// Interval to check sys.boot_completed.
+// Interval to check sys.boot_completed, when it can't be watched.
 constexpr auto kCheckBootCompletedInterval = base::TimeDelta::FromSeconds(2);
+// How long a watch of sys.boot_completed waits before checking again that the
+// action is still running.
+constexpr auto kBootCompletedWatchTimeout = std::chrono::minutes(1);
 // Interval to check IBootControl::isSlotMarkedSuccessful
 constexpr auto kCheckSlotMarkedSuccessfulInterval =
     base::TimeDelta::FromSeconds(2);
-// Interval to call SnapshotManager::ProcessUpdateState
+// Interval to call SnapshotManager::ProcessUpdateState, until the merge rate
+// is known. The interval then follows the rate, within these bounds.
 constexpr auto kWaitForMergeInterval = base::TimeDelta::FromSeconds(2);
+constexpr auto kMinWaitForMergeInterval =
+    base::TimeDelta::FromMilliseconds(500);
+constexpr auto kMaxWaitForMergeInterval = base::TimeDelta::FromSeconds(10);
+// The merge isn't started while tasks stall on I/O for more than this share
+// of the time, in percent, checking again every interval, at most this many
+// times.
+constexpr double kMergeDeferIoPressure = 10.0;
+constexpr auto kCheckIoPressureInterval = base::TimeDelta::FromSeconds(5);
+constexpr unsigned int kMaxMergeDeferrals = 36;
 
 #ifdef __ANDROID_RECOVERY__
 static constexpr bool kIsRecovery = true;
@@ -129,6 +145,7 @@ void CleanupPreviousUpdateAction::CheckTaskScheduled(std::string_view name) {
 void CleanupPreviousUpdateAction::StopActionInternal() {
   LOG(INFO) << "Stopping/suspending/completing CleanupPreviousUpdateAction";
   running_ = false;
+  watch_weak_factory_.InvalidateWeakPtrs();
 
   if (scheduled_task_ != MessageLoop::kTaskIdNull) {
     if (MessageLoop::current()->CancelTask(scheduled_task_)) {
@@ -159,6 +176,8 @@ void CleanupPreviousUpdateAction::StartActionInternal() {
   CHECK(snapshot_ != nullptr);
   merge_stats_ = snapshot_->GetSnapshotMergeStatsInstance();
   CHECK(merge_stats_ != nullptr);
+  merge_check_percentage_ = -1.0;
+  merge_deferrals_ = 0;
   WaitBootCompletedOrSchedule();
 }
 
@@ -172,13 +191,31 @@ void CleanupPreviousUpdateAction::ScheduleWaitBootCompleted() {
   CheckTaskScheduled("WaitBootCompleted");
 }
 
+bool CleanupPreviousUpdateAction::WatchBootCompleted() {
+  TEST_AND_RETURN_FALSE(running_);
+  // The property is watched on its own thread, which posts back to this one.
+  if (!base::ThreadTaskRunnerHandle::IsSet())
+    return false;
+  auto task_runner = base::ThreadTaskRunnerHandle::Get();
+  auto callback =
+      base::Bind(&CleanupPreviousUpdateAction::WaitBootCompletedOrSchedule,
+                 watch_weak_factory_.GetWeakPtr());
+  std::thread([task_runner, callback]() {
+    android::base::WaitForProperty(
+        kBootCompletedProp, "1", kBootCompletedWatchTimeout);
+    task_runner->PostTask(FROM_HERE, callback);
+  }).detach();
+  return true;
+}
+
 void CleanupPreviousUpdateAction::WaitBootCompletedOrSchedule() {
   AcknowledgeTaskExecuted();
   TEST_AND_RETURN(running_);
   if (!kIsRecovery &&
       !android::base::GetBoolProperty(kBootCompletedProp, false)) {
     // repeat
-    ScheduleWaitBootCompleted();
+    if (!WatchBootCompleted())
+      ScheduleWaitBootCompleted();
     return;
   }
 
@@ -263,16 +300,41 @@ void CleanupPreviousUpdateAction::CheckSlotMarkedSuccessfulOrSchedule() {
   WaitForMergeOrSchedule();
 }
 
-void CleanupPreviousUpdateAction::ScheduleWaitForMerge() {
+void CleanupPreviousUpdateAction::ScheduleWaitForMerge(base::TimeDelta delay) {
   TEST_AND_RETURN(running_);
   scheduled_task_ = MessageLoop::current()->PostDelayedTask(
       FROM_HERE,
       base::Bind(&CleanupPreviousUpdateAction::WaitForMergeOrSchedule,
                  base::Unretained(this)),
-      kWaitForMergeInterval);
+      delay);
   CheckTaskScheduled("WaitForMerge");
 }
 
+base::TimeDelta CleanupPreviousUpdateAction::NextMergeCheckDelay() {
+  auto now = base::TimeTicks::Now();
+  auto delay = kWaitForMergeInterval;
+  if (merge_check_percentage_ >= 0) {
+    double progress = merge_percentage_ - merge_check_percentage_;
+    auto elapsed = now - merge_check_time_;
+    if (progress > 0 && elapsed > base::TimeDelta()) {
+      // Check again half way to the completion predicted from the rate since
+      // the last check, so that the end of the merge is seen soon after it.
+      double remaining = (100.0 - merge_percentage_) / progress;
+      delay = base::TimeDelta::FromSecondsD(elapsed.InSecondsF() * remaining /
+                                            2);
+    } else {
+      // The merge is stalled or hasn't started; back off.
+      delay = merge_check_delay_ * 2;
+    }
+    delay = std::clamp(
+        delay, kMinWaitForMergeInterval, kMaxWaitForMergeInterval);
+  }
+  merge_check_percentage_ = merge_percentage_;
+  merge_check_time_ = now;
+  merge_check_delay_ = delay;
+  return delay;
+}
+
 void CleanupPreviousUpdateAction::WaitForMergeOrSchedule() {
   AcknowledgeTaskExecuted();
   TEST_AND_RETURN(running_);
@@ -316,7 +378,7 @@ void CleanupPreviousUpdateAction::WaitForMergeOrSchedule() {
     }
 
     case UpdateState::Merging: {
-      ScheduleWaitForMerge();
+      ScheduleWaitForMerge(NextMergeCheckDelay());
       return;
     }
 
@@ -360,6 +422,7 @@ void CleanupPreviousUpdateAction::WaitForMergeOrSchedule() {
 bool CleanupPreviousUpdateAction::OnMergePercentageUpdate() {
   double percentage = 0.0;
   snapshot_->GetUpdateState(&percentage);
+  merge_percentage_ = percentage;
   if (delegate_) {
     // libsnapshot uses [0, 100] percentage but update_engine uses [0, 1].
     delegate_->OnCleanupProgressUpdate(percentage / 100);
@@ -412,6 +475,12 @@ void CleanupPreviousUpdateAction::InitiateMergeAndWait() {
     return;
   }
 
+  if (ShouldDeferMerge()) {
+    // Check the update state again later, it may have been merged meanwhile.
+    ScheduleWaitForMerge(kCheckIoPressureInterval);
+    return;
+  }
+
   snapshot_->UpdateCowStats(merge_stats_);
 
   auto merge_start_time = std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -460,6 +529,19 @@ void CleanupPreviousUpdateAction::InitiateMergeAndWait() {
   return;
 }
 
+bool CleanupPreviousUpdateAction::ShouldDeferMerge() {
+  if (kIsRecovery || merge_deferrals_ >= kMaxMergeDeferrals)
+    return false;
+  double io_pressure = 0;
+  if (!utils::GetIoPressure(&io_pressure) ||
+      io_pressure <= kMergeDeferIoPressure) {
+    return false;
+  }
+  merge_deferrals_++;
+  LOG(INFO) << "Deferring merge, I/O pressure is " << io_pressure << "%.";
+  return true;
+}
+
 void CleanupPreviousUpdateAction::ReportMergeStats() {
   auto result = merge_stats_->Finish();
   if (result == nullptr) {
@@ -22,6 +22,8 @@
 #include <string>
 #include <string_view>
 
+#include <base/memory/weak_ptr.h>
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
 #include <libsnapshot/snapshot.h>
 #include <libsnapshot/snapshot_stats.h>
@@ -78,6 +80,19 @@ class CleanupPreviousUpdateAction : public Action<CleanupPreviousUpdateAction> {
   android::snapshot::ISnapshotMergeStats* merge_stats_;
   brillo::MessageLoop::TaskId scheduled_task_{brillo::MessageLoop::kTaskIdNull};
 
+  // The merge percentage reported by the last ProcessUpdateState, and the
+  // percentage and time of the check before, to pace the next check.
+  double merge_percentage_{0.0};
+  double merge_check_percentage_{-1.0};
+  base::TimeTicks merge_check_time_;
+  base::TimeDelta merge_check_delay_;
+  // The times the merge was deferred because of foreground I/O.
+  unsigned int merge_deferrals_{0};
+
+  // Invalidated when the action stops, so that a pending property watch
+  // doesn't call back into a stopped action.
+  base::WeakPtrFactory<CleanupPreviousUpdateAction> watch_weak_factory_{this};
+
   // Helpers for task management.
   void AcknowledgeTaskExecuted();
   void CheckTaskScheduled(std::string_view name);
@@ -85,12 +100,21 @@ class CleanupPreviousUpdateAction : public Action<CleanupPreviousUpdateAction> {
   void StopActionInternal();
   void StartActionInternal();
   void ScheduleWaitBootCompleted();
+  // Waits for sys.boot_completed on a background thread and calls
+  // WaitBootCompletedOrSchedule() on this thread once it is set, or after a
+  // timeout. Returns false if there's no task runner to post back to.
+  bool WatchBootCompleted();
   void WaitBootCompletedOrSchedule();
   void ScheduleWaitMarkBootSuccessful();
   void CheckSlotMarkedSuccessfulOrSchedule();
-  void ScheduleWaitForMerge();
+  void ScheduleWaitForMerge(base::TimeDelta delay);
+  // The delay until the next ProcessUpdateState, from the merge rate.
+  base::TimeDelta NextMergeCheckDelay();
   void WaitForMergeOrSchedule();
   void InitiateMergeAndWait();
+  // Whether to wait before starting the merge, so that it doesn't compete
+  // with the I/O of the apps launched after boot.
+  bool ShouldDeferMerge();
   void ReportMergeStats();
 
   // Callbacks to ProcessUpdateState.
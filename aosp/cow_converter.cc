@@ -15,12 +15,16 @@
 //
 
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <memory>
+#include <thread>  // NOLINT(build/c++11) -- for hardware_concurrency
+#include <vector>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -30,6 +34,7 @@
 
 #include "update_engine/common/cow_operation_convert.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_generator/cow_size_estimator.h"
@@ -51,11 +56,20 @@ bool ProcessPartition(const chromeos_update_engine::PartitionUpdate& partition,
     return false;
   }
   android::base::unique_fd output_fd{
-      open(output_cow.value().c_str(), O_RDWR | O_CREAT, 0744)};
+      open(output_cow.value().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0744)};
   if (output_fd < 0) {
     PLOG(ERROR) << "Failed to open " << output_cow.value();
     return false;
   }
+  // Reserve the estimated size up front so the file doesn't grow one
+  // allocation at a time, the space past the end is released below.
+  if (partition.estimate_cow_size() > 0 &&
+      fallocate(output_fd,
+                FALLOC_FL_KEEP_SIZE,
+                0,
+                partition.estimate_cow_size()) != 0) {
+    PLOG(WARNING) << "Failed to preallocate " << output_cow.value();
+  }
 
   android::snapshot::CowWriter cow_writer{
       {.block_size = static_cast<uint32_t>(block_size), .compression = "gz"}};
@@ -69,6 +83,9 @@ bool ProcessPartition(const chromeos_update_engine::PartitionUpdate& partition,
                                   partition.new_partition_info().size(),
                                   false));
   TEST_AND_RETURN_FALSE(cow_writer.Finalize());
+  struct stat output_stat;
+  TEST_AND_RETURN_FALSE_ERRNO(fstat(output_fd, &output_stat) == 0);
+  TEST_AND_RETURN_FALSE_ERRNO(ftruncate(output_fd, output_stat.st_size) == 0);
   return true;
 }
 
@@ -124,30 +141,54 @@ int main(int argc, const char* argv[]) {
     return 5;
   }
 
-  size_t estimated_total_cow_size = 0;
-  size_t actual_total_cow_size = 0;
-
+  // The partitions are converted in parallel, each one compressing its COW on
+  // its own worker, the largest ones first.
+  std::vector<const chromeos_update_engine::PartitionUpdate*> partitions;
   for (const auto& partition : manifest.partitions()) {
-    if (partition.estimate_cow_size() == 0) {
-      continue;
+    if (partition.estimate_cow_size() != 0) {
+      partitions.push_back(&partition);
+    }
+  }
+  std::stable_sort(partitions.begin(),
+                   partitions.end(),
+                   [](const auto* a, const auto* b) {
+                     return a->estimate_cow_size() > b->estimate_cow_size();
+                   });
+  if (!partitions.empty()) {
+    chromeos_update_engine::WorkerPool pool(
+        std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u),
+                         partitions.size()),
+        partitions.size());
+    for (const auto* partition : partitions) {
+      auto task = [partition, images_dir, &manifest]() {
+        LOG(INFO) << partition->partition_name();
+        return ProcessPartition(*partition, images_dir, manifest.block_size());
+      };
+      if (!pool.Post(std::move(task)))
+        break;
     }
-    LOG(INFO) << partition.partition_name();
-    if (!ProcessPartition(partition, images_dir, manifest.block_size())) {
+    if (!pool.Wait()) {
       return 6;
     }
+  }
+
+  size_t estimated_total_cow_size = 0;
+  size_t actual_total_cow_size = 0;
+
+  for (const auto* partition : partitions) {
     base::FilePath img_dir{images_dir};
     const auto output_cow =
-        img_dir.Append(partition.partition_name() + ".cow").value();
+        img_dir.Append(partition->partition_name() + ".cow").value();
     const auto actual_cow_size =
         chromeos_update_engine::utils::FileSize(output_cow);
-    LOG(INFO) << partition.partition_name()
-              << ": estimated COW size is: " << partition.estimate_cow_size()
+    LOG(INFO) << partition->partition_name()
+              << ": estimated COW size is: " << partition->estimate_cow_size()
               << ", actual COW size is: " << actual_cow_size
               << ", estimated COW size is "
-              << (actual_cow_size - partition.estimate_cow_size()) * 100.0f /
+              << (actual_cow_size - partition->estimate_cow_size()) * 100.0f /
                      actual_cow_size
               << "% smaller";
-    estimated_total_cow_size += partition.estimate_cow_size();
+    estimated_total_cow_size += partition->estimate_cow_size();
     actual_total_cow_size += actual_cow_size;
   }
 
@@ -76,8 +76,9 @@ bool DaemonStateAndroid::Initialize() {
 
 bool DaemonStateAndroid::StartUpdater() {
   // The DaemonState in Android is a passive daemon. It will only start applying
-  // an update when instructed to do so from the exposed binder API.
-  update_attempter_->Init();
+  // an update when instructed to do so from the exposed binder API. The work
+  // left by the previous boot doesn't delay the start of the binder service.
+  update_attempter_->InitDeferred();
   return true;
 }
 
@@ -16,6 +16,8 @@
 
 #include "update_engine/aosp/dynamic_partition_control_android.h"
 
+#include <string.h>
+
 #include <algorithm>
 #include <chrono>  // NOLINT(build/c++11) - using libsnapshot / liblp API
 #include <cstdint>
@@ -33,6 +35,7 @@
 #include <base/logging.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
+#include <base/sys_info.h>
 #include <bootloader_message/bootloader_message.h>
 #include <fs_mgr.h>
 #include <fs_mgr_dm_linear.h>
@@ -50,6 +53,7 @@
 #include "update_engine/common/dynamic_partition_control_interface.h"
 #include "update_engine/common/platform_constants.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 #include "update_engine/payload_consumer/cow_writer_file_descriptor.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 
@@ -62,6 +66,7 @@ using android::fs_mgr::CreateLogicalPartition;
 using android::fs_mgr::CreateLogicalPartitionParams;
 using android::fs_mgr::DestroyLogicalPartition;
 using android::fs_mgr::Fstab;
+using android::fs_mgr::LpMetadata;
 using android::fs_mgr::MetadataBuilder;
 using android::fs_mgr::Partition;
 using android::fs_mgr::PartitionOpener;
@@ -84,6 +89,10 @@ constexpr char kVirtualAbCompressionEnabled[] =
     "ro.virtual_ab.compression.enabled";
 constexpr auto&& kVirtualAbCompressionXorEnabled =
     "ro.virtual_ab.compression.xor.enabled";
+// When set, VABC updates are applied without compressing the COW if /data has
+// plenty of space for it. See UseUncompressedCowIfSpaceAllows().
+constexpr char kVirtualAbCompressionAdaptive[] =
+    "ro.virtual_ab.compression.adaptive";
 
 // Currently, android doesn't have a retrofit prop for VAB Compression. However,
 // struct FeatureFlag forces us to determine if a feature is 'retrofit'. So this
@@ -96,6 +105,13 @@ constexpr std::chrono::milliseconds kMapTimeout{1000};
 // Map timeout for dynamic partitions with snapshots. Since several devices
 // needs to be mapped, this timeout is longer than |kMapTimeout|.
 constexpr std::chrono::milliseconds kMapSnapshotTimeout{10000};
+// The most partitions mapped or unmapped at once.
+constexpr size_t kMaxMapThreads = 4;
+// Where the COW images of snapshots are allocated.
+constexpr char kCowImageDir[] = "/data";
+// More than the on disk size of the header of a COW operation, and of the
+// label written after each install operation.
+constexpr uint64_t kCowOpSizeBound = 64;
 
 DynamicPartitionControlAndroid::~DynamicPartitionControlAndroid() {
   Cleanup();
@@ -214,6 +230,7 @@ bool DynamicPartitionControlAndroid::MapPartitionInternal(
   LOG(INFO) << "Succesfully mapped " << target_partition_name
             << " to device mapper (force_writable = " << force_writable
             << "); device path at " << *path;
+  std::lock_guard<std::mutex> lock(mapped_devices_mutex_);
   mapped_devices_.insert(target_partition_name);
   return true;
 }
@@ -290,6 +307,7 @@ bool DynamicPartitionControlAndroid::UnmapPartitionOnDeviceMapper(
     LOG(INFO) << "Successfully unmapped " << target_partition_name
               << " from device mapper.";
   }
+  std::lock_guard<std::mutex> lock(mapped_devices_mutex_);
   mapped_devices_.erase(target_partition_name);
   return true;
 }
@@ -303,9 +321,14 @@ bool DynamicPartitionControlAndroid::UnmapAllPartitions() {
   // a copy is needed for the loop.
   std::set<std::string> mapped = mapped_devices_;
   LOG(INFO) << "Destroying [" << Join(mapped, ", ") << "] from device mapper";
+  WorkerPool pool(std::min(mapped.size(), kMaxMapThreads), mapped.size());
   for (const auto& partition_name : mapped) {
-    ignore_result(UnmapPartitionOnDeviceMapper(partition_name));
+    CHECK(pool.Post([this, &partition_name]() {
+      ignore_result(UnmapPartitionOnDeviceMapper(partition_name));
+      return true;
+    }));
   }
+  pool.Wait();
   return true;
 }
 
@@ -365,6 +388,25 @@ DynamicPartitionControlAndroid::LoadMetadataBuilder(
   return builder;
 }
 
+namespace {
+template <typename T>
+bool SameEntries(const std::vector<T>& a, const std::vector<T>& b) {
+  return a.size() == b.size() &&
+         (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+}
+
+// Whether writing |metadata| over |current| would change its tables.
+bool SameMetadataTables(const LpMetadata& current, const LpMetadata& metadata) {
+  return current.header.major_version == metadata.header.major_version &&
+         current.header.minor_version == metadata.header.minor_version &&
+         current.header.flags == metadata.header.flags &&
+         SameEntries(current.partitions, metadata.partitions) &&
+         SameEntries(current.extents, metadata.extents) &&
+         SameEntries(current.groups, metadata.groups) &&
+         SameEntries(current.block_devices, metadata.block_devices);
+}
+}  // namespace
+
 bool DynamicPartitionControlAndroid::StoreMetadata(
     const std::string& super_device,
     MetadataBuilder* builder,
@@ -384,6 +426,16 @@ bool DynamicPartitionControlAndroid::StoreMetadata(
     }
     LOG(INFO) << "Written metadata to " << super_device;
   } else {
+    // Each write rewrites the whole metadata slot, which is slow on eMMC. A
+    // resumed or repeated preparation for the same payload produces the same
+    // tables, already in place.
+    auto current = ReadMetadata(PartitionOpener(), super_device, target_slot);
+    if (current && SameMetadataTables(*current, *metadata)) {
+      LOG(INFO) << "Metadata in slot "
+                << BootControlInterface::SlotName(target_slot) << " in "
+                << super_device << " is already up to date.";
+      return true;
+    }
     if (!UpdatePartitionTable(super_device, *metadata, target_slot)) {
       LOG(ERROR) << "Cannot write metadata to slot "
                  << BootControlInterface::SlotName(target_slot) << " in "
@@ -810,12 +862,23 @@ bool DynamicPartitionControlAndroid::PrepareDynamicPartitionsForUpdate(
 
   // Unmap all the target dynamic partitions because they would become
   // inconsistent with the new metadata.
+  std::vector<std::string> to_unmap;
   for (const auto& group : manifest.dynamic_partition_metadata().groups()) {
     for (const auto& partition_name : group.partition_names()) {
-      if (!UnmapPartitionOnDeviceMapper(partition_name + target_suffix)) {
-        return false;
+      to_unmap.push_back(partition_name + target_suffix);
+    }
+  }
+  if (!to_unmap.empty()) {
+    WorkerPool pool(std::min(to_unmap.size(), kMaxMapThreads),
+                    to_unmap.size());
+    for (const auto& partition_name_suffix : to_unmap) {
+      if (!pool.Post([this, &partition_name_suffix]() {
+            return UnmapPartitionOnDeviceMapper(partition_name_suffix);
+          })) {
+        break;
       }
     }
+    TEST_AND_RETURN_FALSE(pool.Wait());
   }
 
   std::string device_dir_str;
@@ -955,11 +1018,25 @@ bool DynamicPartitionControlAndroid::PrepareSnapshotPartitionsForUpdate(
   TEST_AND_RETURN_FALSE(
       CheckSuperPartitionAllocatableSpace(builder.get(), manifest, true));
 
+  const DeltaArchiveManifest* snapshot_manifest = &manifest;
+  DeltaArchiveManifest uncompressed_manifest;
+  const auto& metadata = manifest.dynamic_partition_metadata();
+  if (metadata.vabc_enabled() && metadata.vabc_compression_param() != "none" &&
+      GetBoolProperty(kVirtualAbCompressionAdaptive, false)) {
+    const int64_t free_space =
+        base::SysInfo::AmountOfFreeDiskSpace(base::FilePath(kCowImageDir));
+    uncompressed_manifest = manifest;
+    if (free_space > 0 &&
+        UseUncompressedCowIfSpaceAllows(free_space, &uncompressed_manifest)) {
+      snapshot_manifest = &uncompressed_manifest;
+    }
+  }
+
   if (!snapshot_->BeginUpdate()) {
     LOG(ERROR) << "Cannot begin new update.";
     return false;
   }
-  auto ret = snapshot_->CreateUpdateSnapshots(manifest);
+  auto ret = snapshot_->CreateUpdateSnapshots(*snapshot_manifest);
   if (!ret) {
     LOG(ERROR) << "Cannot create update snapshots: " << ret.string();
     if (required_size != nullptr &&
@@ -971,6 +1048,43 @@ bool DynamicPartitionControlAndroid::PrepareSnapshotPartitionsForUpdate(
   return true;
 }
 
+bool DynamicPartitionControlAndroid::UseUncompressedCowIfSpaceAllows(
+    uint64_t free_space, DeltaArchiveManifest* manifest) {
+  const uint64_t block_size = manifest->block_size();
+  TEST_AND_RETURN_FALSE(block_size > 0);
+  // Every block of a partition is written at most once to its COW, either as
+  // data or as a copy/zero operation which takes less space.
+  std::vector<uint64_t> cow_sizes;
+  uint64_t total_cow_size = 0;
+  for (const auto& partition : manifest->partitions()) {
+    const uint64_t num_blocks =
+        partition.new_partition_info().size() / block_size;
+    const uint64_t num_ops =
+        partition.operations_size() + partition.merge_operations_size() + 1;
+    cow_sizes.push_back(num_blocks * (block_size + kCowOpSizeBound) +
+                        num_ops * kCowOpSizeBound);
+    total_cow_size += cow_sizes.back();
+  }
+  if (total_cow_size > free_space / 2) {
+    LOG(INFO) << "Keeping compression "
+              << manifest->dynamic_partition_metadata().vabc_compression_param()
+              << " for the COW, an uncompressed one could take "
+              << total_cow_size << " bytes and only " << free_space
+              << " bytes are free.";
+    return false;
+  }
+  LOG(INFO) << "Using an uncompressed COW of up to " << total_cow_size
+            << " bytes instead of compression "
+            << manifest->dynamic_partition_metadata().vabc_compression_param()
+            << ", " << free_space << " bytes are free.";
+  manifest->mutable_dynamic_partition_metadata()->set_vabc_compression_param(
+      "none");
+  for (int i = 0; i < manifest->partitions_size(); i++) {
+    manifest->mutable_partitions(i)->set_estimate_cow_size(cow_sizes[i]);
+  }
+  return true;
+}
+
 std::string DynamicPartitionControlAndroid::GetSuperPartitionName(
     uint32_t slot) {
   return fs_mgr_get_super_partition_name(slot);
@@ -1372,14 +1486,22 @@ bool DynamicPartitionControlAndroid::VerifyExtentsForUntouchedPartitions(
   TEST_AND_RETURN_FALSE(GetDeviceDir(&device_dir_str));
   base::FilePath device_dir(device_dir_str);
 
+  // The metadata of both slots is read at the same time, as they are on
+  // different super partitions on retrofit devices.
+  auto target_super_device =
+      device_dir.Append(GetSuperPartitionName(target_slot)).value();
+  std::unique_ptr<MetadataBuilder> target_builder;
+  WorkerPool pool(1, 1);
+  CHECK(pool.Post([&]() {
+    target_builder = LoadMetadataBuilder(target_super_device, target_slot);
+    return true;
+  }));
+
   auto source_super_device =
       device_dir.Append(GetSuperPartitionName(source_slot)).value();
   auto source_builder = LoadMetadataBuilder(source_super_device, source_slot);
+  pool.Wait();
   TEST_AND_RETURN_FALSE(source_builder != nullptr);
-
-  auto target_super_device =
-      device_dir.Append(GetSuperPartitionName(target_slot)).value();
-  auto target_builder = LoadMetadataBuilder(target_super_device, target_slot);
   TEST_AND_RETURN_FALSE(target_builder != nullptr);
 
   return MetadataBuilder::VerifyExtentsAgainstSourceMetadata(
@@ -1472,6 +1594,55 @@ bool DynamicPartitionControlAndroid::MapAllPartitions() {
   return snapshot_->MapAllSnapshots(kMapSnapshotTimeout);
 }
 
+bool DynamicPartitionControlAndroid::MapTargetPartitions(
+    const std::vector<std::string>& partition_names, uint32_t target_slot) {
+  if (!GetDynamicPartitionsFeatureFlag().IsEnabled() || !is_target_dynamic_ ||
+      UpdateUsesSnapshotCompression()) {
+    return true;
+  }
+  std::string device_dir_str;
+  TEST_AND_RETURN_FALSE(GetDeviceDir(&device_dir_str));
+  const std::string super_device =
+      base::FilePath(device_dir_str)
+          .Append(GetSuperPartitionName(target_slot))
+          .value();
+  auto builder = LoadMetadataBuilder(super_device, target_slot);
+  TEST_AND_RETURN_FALSE(builder != nullptr);
+
+  // Only the partitions GetPartitionDevice() would map from scratch, the
+  // others are left to it.
+  std::vector<std::string> to_map;
+  for (const auto& partition_name : partition_names) {
+    std::string partition_name_suffix =
+        partition_name + SlotSuffixForSlotNumber(target_slot);
+    if (builder->FindPartition(partition_name_suffix) != nullptr &&
+        mapped_devices_.count(partition_name_suffix) == 0 &&
+        GetState(partition_name_suffix) == DmDeviceState::INVALID) {
+      to_map.push_back(std::move(partition_name_suffix));
+    }
+  }
+  if (to_map.empty()) {
+    return true;
+  }
+  LOG(INFO) << "Mapping [" << Join(to_map, ", ") << "] on device mapper";
+  WorkerPool pool(std::min(to_map.size(), kMaxMapThreads), to_map.size());
+  for (const auto& partition_name_suffix : to_map) {
+    auto map_partition = [this, &super_device, &partition_name_suffix,
+                          target_slot]() {
+      std::string path;
+      return MapPartitionInternal(super_device,
+                                  partition_name_suffix,
+                                  target_slot,
+                                  true /* force_writable */,
+                                  &path);
+    };
+    if (!pool.Post(map_partition)) {
+      break;
+    }
+  }
+  return pool.Wait();
+}
+
 bool DynamicPartitionControlAndroid::IsDynamicPartition(
     const std::string& partition_name, uint32_t slot) {
   if (slot >= dynamic_partition_list_.size()) {
@@ -18,6 +18,7 @@
 #define UPDATE_ENGINE_AOSP_DYNAMIC_PARTITION_CONTROL_ANDROID_H_
 
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <string_view>
@@ -111,6 +112,11 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
       bool is_append = false) override;
 
   bool MapAllPartitions() override;
+  // Maps the partitions not mapped yet, up to four at a time. Nothing is
+  // mapped for VABC updates, whose target devices are the snapshots.
+  bool MapTargetPartitions(const std::vector<std::string>& partition_names,
+                           uint32_t target_slot) override;
+  // Unmaps the partitions several at a time.
   bool UnmapAllPartitions() override;
 
   bool IsDynamicPartition(const std::string& part_name, uint32_t slot) override;
@@ -119,6 +125,14 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
 
   std::optional<base::FilePath> GetSuperDevice();
 
+  // Switches the VABC update in |manifest| to an uncompressed COW, so that no
+  // CPU is spent compressing blocks while applying it, if an upper bound of
+  // the size of the uncompressed COW of all the partitions is at most half of
+  // |free_space|. The COW size estimates are replaced by that bound. Returns
+  // false and leaves |manifest| untouched otherwise.
+  static bool UseUncompressedCowIfSpaceAllows(uint64_t free_space,
+                                              DeltaArchiveManifest* manifest);
+
  protected:
   // These functions are exposed for testing.
 
@@ -337,6 +351,9 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
   bool SetTargetBuildVars(const DeltaArchiveManifest& manifest);
 
   std::set<std::string> mapped_devices_;
+  // Guards |mapped_devices_| while MapTargetPartitions() and
+  // UnmapAllPartitions() map or unmap several partitions at once.
+  std::mutex mapped_devices_mutex_;
   const FeatureFlag dynamic_partitions_;
   const FeatureFlag virtual_ab_;
   const FeatureFlag virtual_ab_compression_;
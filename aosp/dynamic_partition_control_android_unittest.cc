@@ -1126,4 +1126,37 @@ INSTANTIATE_TEST_CASE_P(DynamicPartitionControlAndroidTest,
                         SnapshotPartitionTestP,
                         testing::Values(TestParam{0, 1}, TestParam{1, 0}));
 
+TEST(DynamicPartitionControlAndroidCowTest, UseUncompressedCowIfSpaceAllows) {
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(4096);
+  manifest.mutable_dynamic_partition_metadata()->set_vabc_enabled(true);
+  manifest.mutable_dynamic_partition_metadata()->set_vabc_compression_param(
+      "gz");
+  for (const auto& name : {"system", "vendor"}) {
+    auto partition = manifest.add_partitions();
+    partition->set_partition_name(name);
+    partition->mutable_new_partition_info()->set_size(1_GiB);
+    partition->set_estimate_cow_size(100_MiB);
+    partition->add_operations();
+  }
+
+  // 2 GiB of data doesn't fit in half of 4 GiB with the headers.
+  DeltaArchiveManifest unchanged = manifest;
+  ASSERT_FALSE(DynamicPartitionControlAndroid::UseUncompressedCowIfSpaceAllows(
+      4_GiB, &unchanged));
+  ASSERT_EQ("gz",
+            unchanged.dynamic_partition_metadata().vabc_compression_param());
+  ASSERT_EQ(100_MiB, unchanged.partitions(0).estimate_cow_size());
+
+  ASSERT_TRUE(DynamicPartitionControlAndroid::UseUncompressedCowIfSpaceAllows(
+      5_GiB, &manifest));
+  ASSERT_EQ("none",
+            manifest.dynamic_partition_metadata().vabc_compression_param());
+  for (const auto& partition : manifest.partitions()) {
+    // Room for all the blocks of the partition.
+    ASSERT_GT(partition.estimate_cow_size(), 1_GiB);
+    ASSERT_LT(partition.estimate_cow_size(), 1_GiB + 32_MiB);
+  }
+}
+
 }  // namespace chromeos_update_engine
@@ -17,7 +17,9 @@
 #include "update_engine/aosp/hardware_android.h"
 
 #include <sys/types.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <string_view>
@@ -38,6 +40,7 @@
 #include "update_engine/common/utils.h"
 
 #ifndef __ANDROID_RECOVERY__
+#include <android/performance_hint.h>
 #include <android/sysprop/OtaProperties.sysprop.h>
 #endif
 
@@ -58,6 +61,55 @@ const char kPropBootHardwareSKU[] = "ro.boot.hardware.sku";
 const char kPropBootRevision[] = "ro.boot.revision";
 const char kPropBuildDateUTC[] = "ro.build.date.utc";
 
+// The memory budget of update_engine in MiB, see GetMemoryBudget().
+const char kPropMemoryBudgetMb[] = "ro.update_engine.memory_budget_mb";
+
+// Without |kPropMemoryBudgetMb|, update_engine may use this fraction of the
+// physical memory for its buffers.
+constexpr uint64_t kDefaultMemoryBudgetDivisor = 8;
+
+// The thermal zones, see GetThermalHeadroom().
+const char kThermalZonesDir[] = "/sys/class/thermal";
+
+bool ReadSysfsInt(const base::FilePath& path, int64_t* value) {
+  string content;
+  return base::ReadFileToString(path, &content) &&
+         base::StringToInt64(base::TrimWhitespaceASCII(content, base::TRIM_ALL),
+                             value);
+}
+
+#ifndef __ANDROID_RECOVERY__
+// A session of the Android Dynamic Performance Framework.
+class PerformanceHintSessionAndroid : public PerformanceHintSession {
+ public:
+  explicit PerformanceHintSessionAndroid(APerformanceHintSession* session)
+      : session_(session) {}
+  ~PerformanceHintSessionAndroid() override {
+    APerformanceHint_closeSession(session_);
+  }
+
+  void ReportActualWorkDuration(base::TimeDelta duration) override {
+    // Tasks so short they round down to nothing say nothing about the load.
+    if (duration.InNanoseconds() <= 0)
+      return;
+    const int ret = APerformanceHint_reportActualWorkDuration(
+        session_, duration.InNanoseconds());
+    if (ret != 0 && !report_failed_) {
+      LOG(WARNING) << "Unable to report a work duration to the performance "
+                   << "hint session: " << ret;
+      report_failed_ = true;
+    }
+  }
+
+ private:
+  APerformanceHintSession* session_;
+  // Only the first failure is logged, there would be one per task.
+  bool report_failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(PerformanceHintSessionAndroid);
+};
+#endif  // __ANDROID_RECOVERY__
+
 string GetPartitionBuildDate(const string& partition_name) {
   return android::base::GetProperty("ro." + partition_name + ".build.date.utc",
                                     "");
@@ -371,4 +423,69 @@ const char* HardwareAndroid::GetPartitionMountOptions(
   }
 }
 
+uint64_t HardwareAndroid::GetMemoryBudget() const {
+  const uint64_t budget_mb = GetIntProperty<uint64_t>(kPropMemoryBudgetMb, 0);
+  if (budget_mb > 0) {
+    return budget_mb * 1024 * 1024;
+  }
+  const auto pages = sysconf(_SC_PHYS_PAGES);
+  const auto page_size = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || page_size <= 0) {
+    PLOG(WARNING) << "Unable to get the physical memory size, not limiting "
+                     "the memory budget.";
+    return 0;
+  }
+  return static_cast<uint64_t>(pages) * page_size /
+         kDefaultMemoryBudgetDivisor;
+}
+
+float HardwareAndroid::GetThermalHeadroom() const {
+  // The ratio of the temperature of each thermal zone to its first passive
+  // trip point, where the kernel starts throttling, for the hottest zone.
+  float headroom = -1;
+  for (int zone = 0;; zone++) {
+    const base::FilePath zone_dir =
+        base::FilePath(kThermalZonesDir)
+            .Append("thermal_zone" + std::to_string(zone));
+    int64_t temp = 0;
+    if (!ReadSysfsInt(zone_dir.Append("temp"), &temp))
+      break;
+    for (int trip = 0;; trip++) {
+      const string prefix = "trip_point_" + std::to_string(trip);
+      string type;
+      if (!base::ReadFileToString(zone_dir.Append(prefix + "_type"), &type))
+        break;
+      int64_t trip_temp = 0;
+      if (base::TrimWhitespaceASCII(type, base::TRIM_ALL) != "passive" ||
+          !ReadSysfsInt(zone_dir.Append(prefix + "_temp"), &trip_temp) ||
+          trip_temp <= 0) {
+        continue;
+      }
+      headroom = std::max(headroom, static_cast<float>(temp) / trip_temp);
+      break;
+    }
+  }
+  return headroom;
+}
+
+std::unique_ptr<PerformanceHintSession>
+HardwareAndroid::CreatePerformanceHintSession(int32_t tid,
+                                              base::TimeDelta target) const {
+#ifdef __ANDROID_RECOVERY__
+  return nullptr;
+#else
+  APerformanceHintManager* manager = APerformanceHint_getManager();
+  if (manager == nullptr)
+    return nullptr;
+  APerformanceHintSession* session = APerformanceHint_createSession(
+      manager, &tid, 1, target.InNanoseconds());
+  if (session == nullptr) {
+    LOG(WARNING) << "Unable to open a performance hint session for thread "
+                 << tid << ".";
+    return nullptr;
+  }
+  return std::make_unique<PerformanceHintSessionAndroid>(session);
+#endif  // __ANDROID_RECOVERY__
+}
+
 }  // namespace chromeos_update_engine
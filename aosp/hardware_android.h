@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_AOSP_HARDWARE_ANDROID_H_
 #define UPDATE_ENGINE_AOSP_HARDWARE_ANDROID_H_
 
+#include <memory>
 #include <string>
 #include <string_view>
 
@@ -66,6 +67,10 @@ class HardwareAndroid : public HardwareInterface {
       const std::string& new_version) const override;
   [[nodiscard]] const char* GetPartitionMountOptions(
       const std::string& partition_name) const override;
+  uint64_t GetMemoryBudget() const override;
+  float GetThermalHeadroom() const override;
+  std::unique_ptr<PerformanceHintSession> CreatePerformanceHintSession(
+      int32_t tid, base::TimeDelta target) const override;
 
  private:
   DISALLOW_COPY_AND_ASSIGN(HardwareAndroid);
@@ -20,10 +20,15 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <condition_variable>
 #include <functional>
 #include <iomanip>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -117,14 +122,90 @@ const char* LogPriorityToCString(int priority) {
 
 using LoggerFunction = std::function<void(const struct __android_log_message*)>;
 
+// Writes the lines of the log file from a background thread, so that the log
+// calls don't wait for the synchronous writes to the file. The lines queued
+// while a write is in progress are written together by the next one.
+class AsyncLogWriter {
+ public:
+  explicit AsyncLogWriter(android::base::unique_fd fd)
+      : fd_(std::move(fd)), thread_(&AsyncLogWriter::Run, this) {}
+  ~AsyncLogWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+  }
+
+  // Queues |line|, or drops it if too many bytes are queued already. Waits
+  // for it to be written if |sync|, e.g. before an abort.
+  void Write(string line, bool sync) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (pending_.size() + line.size() > kMaxPendingBytes) {
+      dropped_lines_++;
+    } else {
+      pending_ += line;
+    }
+    const uint64_t sequence = ++queued_;
+    cond_.notify_one();
+    if (sync) {
+      written_cond_.wait(lock, [this, sequence] {
+        return written_ >= sequence || stopping_;
+      });
+    }
+  }
+
+ private:
+  // The most bytes queued. The lines logged past that are dropped and
+  // counted, the update must not wait for the disk.
+  static constexpr size_t kMaxPendingBytes = 1024 * 1024;
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cond_.wait(lock, [this] { return !pending_.empty() || stopping_; });
+      if (pending_.empty() && stopping_) {
+        return;
+      }
+      string data;
+      data.swap(pending_);
+      if (dropped_lines_ > 0) {
+        data += base::StringPrintf("[%" PRIu64 " log lines dropped]\n",
+                                   dropped_lines_);
+        dropped_lines_ = 0;
+      }
+      const uint64_t sequence = queued_;
+      lock.unlock();
+      ignore_result(android::base::WriteFully(fd_, data.data(), data.size()));
+      lock.lock();
+      written_ = sequence;
+      written_cond_.notify_all();
+    }
+  }
+
+  android::base::unique_fd fd_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::condition_variable written_cond_;
+  // The lines queued and not written yet.
+  string pending_;
+  uint64_t dropped_lines_{0};
+  // The number of lines queued so far, and of those written.
+  uint64_t queued_{0};
+  uint64_t written_{0};
+  bool stopping_{false};
+  std::thread thread_;
+};
+
 class FileLogger {
  public:
   explicit FileLogger(const string& path) {
-    fd_.reset(TEMP_FAILURE_RETRY(
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(
         open(path.c_str(),
              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW | O_SYNC,
              0644)));
-    if (fd_ == -1) {
+    if (fd == -1) {
       // Use ALOGE that logs to logd before __android_log_set_logger.
       ALOGE("Cannot open persistent log %s: %s", path.c_str(), strerror(errno));
       return;
@@ -132,35 +213,60 @@ class FileLogger {
     // The log file will have AID_LOG as group ID; this GID is inherited from
     // the parent directory "/data/misc/update_engine_log" which sets the SGID
     // bit.
-    if (fchmod(fd_.get(), 0640) == -1) {
+    if (fchmod(fd.get(), 0640) == -1) {
       // Use ALOGE that logs to logd before __android_log_set_logger.
       ALOGE("Cannot chmod 0640 persistent log %s: %s",
             path.c_str(),
             strerror(errno));
       return;
     }
+    state_ = std::make_shared<State>(std::move(fd));
   }
-  // Copy-constructor needed to be converted to std::function.
-  FileLogger(const FileLogger& other) { fd_.reset(dup(other.fd_)); }
+  // Copy-constructor needed to be converted to std::function. The copies
+  // share the same writer.
+  FileLogger(const FileLogger& other) = default;
   void operator()(const struct __android_log_message* log_message) {
-    if (fd_ == -1) {
+    if (!state_) {
       return;
     }
 
     std::string_view message_str =
         log_message->message != nullptr ? log_message->message : "";
+    const bool sync = log_message->priority >= ANDROID_LOG_FATAL;
 
-    WriteToFd(GetPrefix(log_message));
-    WriteToFd(message_str);
-    WriteToFd("\n");
+    // The same message logged over and over, e.g. by a retry loop, is only
+    // written once with the number of repeats.
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    if (!sync && message_str == state_->last_message) {
+      state_->repeats++;
+      return;
+    }
+    string line = GetPrefix(log_message);
+    if (state_->repeats > 0) {
+      line = base::StringPrintf("%s[last message repeated %" PRIu64
+                                " times]\n%s",
+                                line.c_str(),
+                                state_->repeats,
+                                line.c_str());
+      state_->repeats = 0;
+    }
+    line.append(message_str);
+    line += "\n";
+    state_->last_message.assign(message_str);
+    state_->writer.Write(std::move(line), sync);
   }
 
  private:
-  android::base::unique_fd fd_;
-  void WriteToFd(std::string_view message) {
-    ignore_result(
-        android::base::WriteFully(fd_, message.data(), message.size()));
-  }
+  // Shared by the copies of a FileLogger.
+  struct State {
+    explicit State(android::base::unique_fd fd) : writer(std::move(fd)) {}
+    std::mutex mutex;
+    string last_message;
+    uint64_t repeats{0};
+    AsyncLogWriter writer;
+  };
+
+  std::shared_ptr<State> state_;
 
   string GetPrefix(const struct __android_log_message* log_message) {
     std::stringstream ss;
@@ -190,6 +190,15 @@ void MetricsReporterAndroid::ReportSuccessfulUpdateMetrics(
       IsFECEnabled(install_plan_));
 }
 
+void MetricsReporterAndroid::ReportPerformanceMetrics(
+    const PerformanceReport& report) {
+  if (report.empty())
+    return;
+  // There is no statsd atom for it, so the report goes to the log, one line
+  // per entry.
+  LOG(INFO) << "Update performance report:\n" << report.ToString();
+}
+
 void MetricsReporterAndroid::ReportAbnormallyTerminatedUpdateAttemptMetrics() {
   int attempt_result =
       static_cast<int>(metrics::AttemptResult::kAbnormalTermination);
@@ -95,6 +95,8 @@ class MetricsReporterAndroid : public MetricsReporterInterface {
   void ReportEnterpriseUpdateSeenToDownloadDays(
       bool has_time_restriction_policy, int time_to_update_days) override {}
 
+  void ReportPerformanceMetrics(const PerformanceReport& report) override;
+
  private:
   DynamicPartitionControlInterface* dynamic_partition_control_{};
   const InstallPlan* install_plan_{};
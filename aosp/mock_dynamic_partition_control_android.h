@@ -19,6 +19,7 @@
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 #include <gmock/gmock.h>
 
@@ -105,6 +106,10 @@ class MockDynamicPartitionControlAndroid
                bool is_append),
               (override));
   MOCK_METHOD(bool, MapAllPartitions, (), (override));
+  MOCK_METHOD(bool,
+              MapTargetPartitions,
+              (const std::vector<std::string>&, uint32_t),
+              (override));
   MOCK_METHOD(bool, UnmapAllPartitions, (), (override));
   MOCK_METHOD(bool,
               IsDynamicPartition,
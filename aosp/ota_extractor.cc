@@ -14,24 +14,30 @@
 // limitations under the License.
 //
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <iterator>
 #include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11) -- for hardware_concurrency
+#include <vector>
 
 #include <fcntl.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <android-base/strings.h>
 #include <base/files/file_path.h>
+#include <curl/curl.h>
 #include <gflags/gflags.h>
 #include <unistd.h>
 #include <xz.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/worker_pool.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
@@ -39,7 +45,10 @@
 #include "update_engine/payload_consumer/verity_writer_android.h"
 #include "update_engine/update_metadata.pb.h"
 
-DEFINE_string(payload, "", "Path to payload.bin");
+DEFINE_string(payload,
+              "",
+              "Path to payload.bin, or an http(s) URL of it. Only the ranges "
+              "needed for the extracted partitions are fetched from a URL");
 DEFINE_string(
     input_dir,
     "",
@@ -53,12 +62,112 @@ DEFINE_string(partitions,
               "",
               "Comma separated list of partitions to extract, leave empty for "
               "extracting all partitions");
+DEFINE_int32(jobs,
+             0,
+             "Number of partitions to extract at the same time, 0 for one per "
+             "CPU core");
+DEFINE_bool(sparse,
+            false,
+            "Leave the blocks of ZERO and DISCARD operations as holes in the "
+            "output images instead of writing zeros");
 
 using chromeos_update_engine::DeltaArchiveManifest;
 using chromeos_update_engine::PayloadMetadata;
 
 namespace chromeos_update_engine {
 
+// Reads ranges of the payload, from several threads at once.
+class PayloadReader {
+ public:
+  virtual ~PayloadReader() = default;
+
+  // Reads exactly |count| bytes at |offset| into |buffer|.
+  virtual bool ReadAt(uint64_t offset, void* buffer, size_t count) = 0;
+};
+
+class FilePayloadReader : public PayloadReader {
+ public:
+  explicit FilePayloadReader(int fd) : fd_(fd) {}
+
+  bool ReadAt(uint64_t offset, void* buffer, size_t count) override {
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(
+        utils::PReadAll(fd_, buffer, count, offset, &bytes_read));
+    return static_cast<size_t>(bytes_read) == count;
+  }
+
+ private:
+  int fd_;
+};
+
+// Fetches each range with an HTTP range request.
+class HttpPayloadReader : public PayloadReader {
+ public:
+  explicit HttpPayloadReader(std::string url) : url_(std::move(url)) {}
+
+  bool ReadAt(uint64_t offset, void* buffer, size_t count) override {
+    static constexpr int kMaxAttempts = 3;
+    if (count == 0)
+      return true;
+    for (int attempt = 1; attempt <= kMaxAttempts; attempt++) {
+      if (Fetch(offset, static_cast<uint8_t*>(buffer), count))
+        return true;
+      LOG(WARNING) << "Attempt " << attempt << " to fetch " << count
+                   << " bytes at " << offset << " of " << url_ << " failed.";
+    }
+    return false;
+  }
+
+ private:
+  struct Sink {
+    uint8_t* data;
+    size_t size;
+    size_t received;
+  };
+
+  static size_t OnData(char* data, size_t size, size_t nmemb, void* userdata) {
+    auto sink = static_cast<Sink*>(userdata);
+    const size_t length = size * nmemb;
+    // More than the range asked for, the server ignored the range.
+    if (length > sink->size - sink->received)
+      return 0;
+    memcpy(sink->data + sink->received, data, length);
+    sink->received += length;
+    return length;
+  }
+
+  bool Fetch(uint64_t offset, uint8_t* buffer, size_t count) {
+    std::unique_ptr<CURL, decltype(&curl_easy_cleanup)> curl(
+        curl_easy_init(), curl_easy_cleanup);
+    TEST_AND_RETURN_FALSE(curl);
+    const std::string range =
+        std::to_string(offset) + "-" + std::to_string(offset + count - 1);
+    Sink sink{buffer, count, 0};
+    curl_easy_setopt(curl.get(), CURLOPT_URL, url_.c_str());
+    curl_easy_setopt(curl.get(), CURLOPT_RANGE, range.c_str());
+    curl_easy_setopt(curl.get(), CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl.get(), CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, &OnData);
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &sink);
+    const CURLcode result = curl_easy_perform(curl.get());
+    if (result != CURLE_OK) {
+      LOG(ERROR) << "Failed to fetch range " << range << " of " << url_
+                 << ": " << curl_easy_strerror(result);
+      return false;
+    }
+    long http_code = 0;  // NOLINT(runtime/int) -- curl's type
+    curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code != 206) {
+      LOG(ERROR) << url_ << " doesn't support range requests, HTTP code "
+                 << http_code;
+      return false;
+    }
+    return sink.received == count;
+  }
+
+  const std::string url_;
+};
+
 void WriteVerity(const PartitionUpdate& partition,
                  FileDescriptorPtr fd,
                  const size_t block_size) {
@@ -93,14 +202,128 @@ void WriteVerity(const PartitionUpdate& partition,
   return;
 }
 
+bool ExtractPartition(const DeltaArchiveManifest& manifest,
+                      const PartitionUpdate& partition,
+                      PayloadReader* payload,
+                      size_t data_begin,
+                      const base::FilePath& input_dir_path,
+                      const base::FilePath& output_dir_path,
+                      bool sparse) {
+  InstallOperationExecutor executor(manifest.block_size());
+  LOG(INFO) << "Extracting partition " << partition.partition_name()
+            << " size: " << partition.new_partition_info().size();
+  const auto output_path =
+      output_dir_path.Append(partition.partition_name() + ".img").value();
+  auto out_fd =
+      std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
+  // The blocks left out in sparse mode must read as zeros, so the image is
+  // truncated rather than overwritten.
+  TEST_AND_RETURN_FALSE_ERRNO(out_fd->Open(
+      output_path.c_str(), O_RDWR | O_CREAT | (sparse ? O_TRUNC : 0), 0644));
+  auto in_fd =
+      std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
+  if (partition.has_old_partition_info()) {
+    const auto input_path =
+        input_dir_path.Append(partition.partition_name() + ".img").value();
+    LOG(INFO) << "Incremental OTA detected for partition "
+              << partition.partition_name() << " opening source image "
+              << input_path;
+    CHECK(in_fd->Open(input_path.c_str(), O_RDONLY))
+        << " failed to open " << input_path;
+  }
+
+  // The data of the operations of a partition is usually contiguous, it is
+  // read in large windows rather than one request per operation.
+  static constexpr uint64_t kReadWindowSize = 16 * 1024 * 1024;
+  uint64_t data_end = data_begin;
+  for (const auto& op : partition.operations()) {
+    data_end =
+        std::max(data_end, data_begin + op.data_offset() + op.data_length());
+  }
+  brillo::Blob window;
+  uint64_t window_offset = 0;
+  for (const auto& op : partition.operations()) {
+    if (sparse && (op.type() == InstallOperation::ZERO ||
+                   op.type() == InstallOperation::DISCARD)) {
+      continue;
+    }
+    if (op.has_src_sha256_hash()) {
+      brillo::Blob actual_hash;
+      TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
+          in_fd, op.src_extents(), manifest.block_size(), &actual_hash));
+      CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+               HexEncode(op.src_sha256_hash()));
+    }
+
+    const uint8_t* data = nullptr;
+    const size_t data_length = op.data_length();
+    if (data_length > 0) {
+      const uint64_t op_data_offset = data_begin + op.data_offset();
+      if (op_data_offset < window_offset ||
+          op_data_offset + data_length > window_offset + window.size()) {
+        window_offset = op_data_offset;
+        window.resize(std::max<uint64_t>(
+            data_length,
+            std::min(kReadWindowSize, data_end - op_data_offset)));
+        TEST_AND_RETURN_FALSE(
+            payload->ReadAt(window_offset, window.data(), window.size()));
+      }
+      data = window.data() + (op_data_offset - window_offset);
+    }
+    if (op.has_data_sha256_hash()) {
+      brillo::Blob actual_hash;
+      TEST_AND_RETURN_FALSE(
+          HashCalculator::RawHashOfBytes(data, data_length, &actual_hash));
+      CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+               HexEncode(op.data_sha256_hash()));
+    }
+    auto direct_writer = std::make_unique<DirectExtentWriter>(out_fd);
+    if (op.type() == InstallOperation::ZERO) {
+      TEST_AND_RETURN_FALSE(executor.ExecuteZeroOrDiscardOperation(
+          op, std::move(direct_writer)));
+    } else if (op.type() == InstallOperation::REPLACE ||
+               op.type() == InstallOperation::REPLACE_BZ ||
+               op.type() == InstallOperation::REPLACE_XZ ||
+               op.type() == InstallOperation::REPLACE_ZSTD) {
+      TEST_AND_RETURN_FALSE(executor.ExecuteReplaceOperation(
+          op, std::move(direct_writer), data, data_length));
+    } else if (op.type() == InstallOperation::SOURCE_COPY) {
+      CHECK(in_fd->IsOpen());
+      TEST_AND_RETURN_FALSE(executor.ExecuteSourceCopyOperation(
+          op, std::move(direct_writer), in_fd));
+    } else {
+      CHECK(in_fd->IsOpen());
+      TEST_AND_RETURN_FALSE(executor.ExecuteDiffOperation(
+          op, std::move(direct_writer), in_fd, data, data_length));
+    }
+  }
+  WriteVerity(partition, out_fd, manifest.block_size());
+  int err =
+      truncate64(output_path.c_str(), partition.new_partition_info().size());
+  if (err) {
+    PLOG(ERROR) << "Failed to truncate " << output_path << " to "
+                << partition.new_partition_info().size();
+  }
+  brillo::Blob actual_hash;
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfFile(output_path, &actual_hash));
+  CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+           HexEncode(partition.new_partition_info().hash()))
+      << " Partition " << partition.partition_name()
+      << " hash mismatches. Either the source image or OTA package is "
+         "corrupted.";
+  return true;
+}
+
 bool ExtractImagesFromOTA(const DeltaArchiveManifest& manifest,
                           const PayloadMetadata& metadata,
-                          int payload_fd,
+                          PayloadReader* payload,
                           size_t payload_offset,
                           std::string_view input_dir,
                           std::string_view output_dir,
-                          const std::set<std::string>& partitions) {
-  InstallOperationExecutor executor(manifest.block_size());
+                          const std::set<std::string>& partitions,
+                          size_t jobs,
+                          bool sparse) {
   const size_t data_begin = metadata.GetMetadataSize() +
                             metadata.GetMetadataSignatureSize() +
                             payload_offset;
@@ -108,89 +331,40 @@ bool ExtractImagesFromOTA(const DeltaArchiveManifest& manifest,
       base::StringPiece(output_dir.data(), output_dir.size()));
   const base::FilePath input_dir_path(
       base::StringPiece(input_dir.data(), input_dir.size()));
-  std::vector<unsigned char> blob;
+  std::vector<const PartitionUpdate*> selected;
   for (const auto& partition : manifest.partitions()) {
-    if (!partitions.empty() &&
-        partitions.count(partition.partition_name()) == 0) {
-      continue;
-    }
-    LOG(INFO) << "Extracting partition " << partition.partition_name()
-              << " size: " << partition.new_partition_info().size();
-    const auto output_path =
-        output_dir_path.Append(partition.partition_name() + ".img").value();
-    auto out_fd =
-        std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
-    TEST_AND_RETURN_FALSE_ERRNO(
-        out_fd->Open(output_path.c_str(), O_RDWR | O_CREAT, 0644));
-    auto in_fd =
-        std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
-    if (partition.has_old_partition_info()) {
-      const auto input_path =
-          input_dir_path.Append(partition.partition_name() + ".img").value();
-      LOG(INFO) << "Incremental OTA detected for partition "
-                << partition.partition_name() << " opening source image "
-                << input_path;
-      CHECK(in_fd->Open(input_path.c_str(), O_RDONLY))
-          << " failed to open " << input_path;
+    if (partitions.empty() || partitions.count(partition.partition_name())) {
+      selected.push_back(&partition);
     }
+  }
+  if (selected.empty())
+    return true;
 
-    for (const auto& op : partition.operations()) {
-      if (op.has_src_sha256_hash()) {
-        brillo::Blob actual_hash;
-        TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
-            in_fd, op.src_extents(), manifest.block_size(), &actual_hash));
-        CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-                 HexEncode(op.src_sha256_hash()));
-      }
-
-      blob.resize(op.data_length());
-      const auto op_data_offset = data_begin + op.data_offset();
-      ssize_t bytes_read = 0;
-      TEST_AND_RETURN_FALSE(utils::PReadAll(
-          payload_fd, blob.data(), blob.size(), op_data_offset, &bytes_read));
-      if (op.has_data_sha256_hash()) {
-        brillo::Blob actual_hash;
-        TEST_AND_RETURN_FALSE(
-            HashCalculator::RawHashOfData(blob, &actual_hash));
-        CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-                 HexEncode(op.data_sha256_hash()));
-      }
-      auto direct_writer = std::make_unique<DirectExtentWriter>(out_fd);
-      if (op.type() == InstallOperation::ZERO) {
-        TEST_AND_RETURN_FALSE(executor.ExecuteZeroOrDiscardOperation(
-            op, std::move(direct_writer)));
-      } else if (op.type() == InstallOperation::REPLACE ||
-                 op.type() == InstallOperation::REPLACE_BZ ||
-                 op.type() == InstallOperation::REPLACE_XZ) {
-        TEST_AND_RETURN_FALSE(executor.ExecuteReplaceOperation(
-            op, std::move(direct_writer), blob.data(), blob.size()));
-      } else if (op.type() == InstallOperation::SOURCE_COPY) {
-        CHECK(in_fd->IsOpen());
-        TEST_AND_RETURN_FALSE(executor.ExecuteSourceCopyOperation(
-            op, std::move(direct_writer), in_fd));
-      } else {
-        CHECK(in_fd->IsOpen());
-        TEST_AND_RETURN_FALSE(executor.ExecuteDiffOperation(
-            op, std::move(direct_writer), in_fd, blob.data(), blob.size()));
-      }
-    }
-    WriteVerity(partition, out_fd, manifest.block_size());
-    int err =
-        truncate64(output_path.c_str(), partition.new_partition_info().size());
-    if (err) {
-      PLOG(ERROR) << "Failed to truncate " << output_path << " to "
-                  << partition.new_partition_info().size();
-    }
-    brillo::Blob actual_hash;
-    TEST_AND_RETURN_FALSE(
-        HashCalculator::RawHashOfFile(output_path, &actual_hash));
-    CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-             HexEncode(partition.new_partition_info().hash()))
-        << " Partition " << partition.partition_name()
-        << " hash mismatches. Either the source image or OTA package is "
-           "corrupted.";
+  // The partitions are independent, each one is extracted by its own worker.
+  // The largest ones go first so that they don't end up last, alone.
+  std::stable_sort(selected.begin(),
+                   selected.end(),
+                   [](const PartitionUpdate* a, const PartitionUpdate* b) {
+                     return a->new_partition_info().size() >
+                            b->new_partition_info().size();
+                   });
+  if (jobs == 0)
+    jobs = std::max(std::thread::hardware_concurrency(), 1u);
+  WorkerPool pool(std::min(jobs, selected.size()), selected.size());
+  for (const auto* partition : selected) {
+    auto task = [&, partition]() {
+      return ExtractPartition(manifest,
+                              *partition,
+                              payload,
+                              data_begin,
+                              input_dir_path,
+                              output_dir_path,
+                              sparse);
+    };
+    if (!pool.Post(std::move(task)))
+      break;
   }
-  return true;
+  return pool.Wait();
 }
 
 }  // namespace chromeos_update_engine
@@ -224,44 +398,41 @@ int main(int argc, char* argv[]) {
   if (!partitions.empty()) {
     LOG(INFO) << "Extracting " << android::base::Join(partitions, ", ");
   }
-  int payload_fd = open(FLAGS_payload.c_str(), O_RDONLY | O_CLOEXEC);
-  if (payload_fd < 0) {
-    PLOG(ERROR) << "Failed to open payload file";
-    return 1;
-  }
+  std::unique_ptr<chromeos_update_engine::PayloadReader> reader;
+  int payload_fd = -1;
   chromeos_update_engine::ScopedFdCloser closer{&payload_fd};
-  auto payload_size = chromeos_update_engine::utils::FileSize(payload_fd);
-  if (payload_size <= 0) {
-    PLOG(ERROR)
-        << "Couldn't determine size of payload file, or payload file is empty";
-    return 1;
+  if (android::base::StartsWith(FLAGS_payload, "http://") ||
+      android::base::StartsWith(FLAGS_payload, "https://")) {
+    curl_global_init(CURL_GLOBAL_ALL);
+    reader = std::make_unique<chromeos_update_engine::HttpPayloadReader>(
+        FLAGS_payload);
+  } else {
+    payload_fd = open(FLAGS_payload.c_str(), O_RDONLY | O_CLOEXEC);
+    if (payload_fd < 0) {
+      PLOG(ERROR) << "Failed to open payload file";
+      return 1;
+    }
+    reader = std::make_unique<chromeos_update_engine::FilePayloadReader>(
+        payload_fd);
   }
 
+  // Only the metadata is read here, the data of the operations is read when
+  // each partition is extracted.
   PayloadMetadata payload_metadata;
-  auto payload = static_cast<unsigned char*>(
-      mmap(nullptr, payload_size, PROT_READ, MAP_PRIVATE, payload_fd, 0));
-
-  if (payload == MAP_FAILED) {
-    PLOG(ERROR) << "Failed to mmap() payload file";
-    return 1;
-  }
-
-  auto munmap_deleter = [payload_size](auto payload) {
-    munmap(payload, payload_size);
-  };
-  std::unique_ptr<unsigned char, decltype(munmap_deleter)> munmapper{
-      payload, munmap_deleter};
-  if (payload_metadata.ParsePayloadHeader(payload + FLAGS_payload_offset,
-                                          payload_size - FLAGS_payload_offset,
-                                          nullptr) !=
-      chromeos_update_engine::MetadataParseResult::kSuccess) {
+  chromeos_update_engine::ErrorCode error;
+  brillo::Blob metadata(PayloadMetadata::kDeltaManifestSizeOffset +
+                        PayloadMetadata::kDeltaManifestSizeSize +
+                        PayloadMetadata::kDeltaMetadataSignatureSizeSize);
+  if (!reader->ReadAt(FLAGS_payload_offset, metadata.data(), metadata.size()) ||
+      payload_metadata.ParsePayloadHeader(metadata, &error) !=
+          chromeos_update_engine::MetadataParseResult::kSuccess) {
     LOG(ERROR) << "Payload header parse failed!";
     return 1;
   }
+  metadata.resize(payload_metadata.GetMetadataSize());
   DeltaArchiveManifest manifest;
-  if (!payload_metadata.GetManifest(payload + FLAGS_payload_offset,
-                                    payload_size - FLAGS_payload_offset,
-                                    &manifest)) {
+  if (!reader->ReadAt(FLAGS_payload_offset, metadata.data(), metadata.size()) ||
+      !payload_metadata.GetManifest(metadata, &manifest)) {
     LOG(ERROR) << "Failed to parse manifest!";
     return 1;
   }
@@ -272,9 +443,11 @@ int main(int argc, char* argv[]) {
   }
   return !ExtractImagesFromOTA(manifest,
                                payload_metadata,
-                               payload_fd,
+                               reader.get(),
                                FLAGS_payload_offset,
                                FLAGS_input_dir,
                                FLAGS_output_dir,
-                               partitions);
+                               partitions,
+                               std::max(FLAGS_jobs, 0),
+                               FLAGS_sparse);
 }
@@ -0,0 +1,456 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// A host side simulation of an OTA update: applies a full or incremental
+// payload to image files, all the partitions at once, verifies the results
+// and reports how long each phase took. This is the C++ counterpart of
+// scripts/simulate_ota.py, without a round trip through delta_generator for
+// each payload.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11) -- for hardware_concurrency
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <android-base/unique_fd.h>
+#include <base/files/file_path.h>
+#include <base/logging.h>
+#include <base/time/time.h>
+#include <gflags/gflags.h>
+#include <libsnapshot/cow_writer.h>
+#include <xz.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/install_operation_executor.h"
+#include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_consumer/verity_writer_android.h"
+#include "update_engine/payload_generator/cow_size_estimator.h"
+#include "update_engine/update_metadata.pb.h"
+
+DEFINE_string(payload, "", "Path to payload.bin");
+DEFINE_int64(payload_offset,
+             0,
+             "Offset to start of payload.bin. Useful if payload path actually "
+             "points to a .zip file containing payload.bin");
+DEFINE_string(source_dir,
+              "",
+              "Directory of the source images <partition>.img. Only required "
+              "for incremental payloads");
+DEFINE_string(target_dir,
+              "",
+              "Directory of the expected target images <partition>.img, "
+              "compared with the applied ones if set");
+DEFINE_string(output_dir, "", "Directory to put the applied images");
+DEFINE_int32(jobs,
+             0,
+             "Number of partitions applied at the same time, 0 for one per "
+             "CPU core");
+DEFINE_bool(vabc,
+            false,
+            "Also write the COW file <partition>.cow of each partition, as a "
+            "Virtual A/B device with compression would");
+DEFINE_string(cow_compression,
+              "gz",
+              "The compression of the COW files written with --vabc");
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// How long each phase of a partition took, and how it ended.
+struct PartitionResult {
+  std::string name;
+  uint64_t size{0};
+  TimeDelta apply;
+  TimeDelta verity;
+  TimeDelta verify;
+  TimeDelta cow;
+  uint64_t cow_size{0};
+  bool success{false};
+};
+
+bool ReadPayload(int fd, uint64_t offset, void* buffer, size_t count) {
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(
+      utils::PReadAll(fd, buffer, count, offset, &bytes_read));
+  return static_cast<size_t>(bytes_read) == count;
+}
+
+bool ApplyOperations(const PartitionUpdate& partition,
+                     size_t block_size,
+                     int payload_fd,
+                     uint64_t data_begin,
+                     FileDescriptorPtr source_fd,
+                     FileDescriptorPtr target_fd) {
+  InstallOperationExecutor executor(block_size);
+  brillo::Blob data;
+  for (const auto& op : partition.operations()) {
+    if (op.has_src_sha256_hash()) {
+      TEST_AND_RETURN_FALSE(source_fd->IsOpen());
+      brillo::Blob source_hash;
+      TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
+          source_fd, op.src_extents(), block_size, &source_hash));
+      if (ToStringView(source_hash) != op.src_sha256_hash()) {
+        LOG(ERROR) << "Source hash mismatch in partition "
+                   << partition.partition_name()
+                   << ", the source image doesn't match the payload.";
+        return false;
+      }
+    }
+    data.resize(op.data_length());
+    TEST_AND_RETURN_FALSE(ReadPayload(
+        payload_fd, data_begin + op.data_offset(), data.data(), data.size()));
+    if (op.has_data_sha256_hash()) {
+      brillo::Blob data_hash;
+      TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(data, &data_hash));
+      TEST_AND_RETURN_FALSE(ToStringView(data_hash) == op.data_sha256_hash());
+    }
+
+    auto writer = std::make_unique<DirectExtentWriter>(target_fd);
+    switch (op.type()) {
+      case InstallOperation::ZERO:
+      case InstallOperation::DISCARD:
+        TEST_AND_RETURN_FALSE(
+            executor.ExecuteZeroOrDiscardOperation(op, std::move(writer)));
+        break;
+      case InstallOperation::REPLACE:
+      case InstallOperation::REPLACE_BZ:
+      case InstallOperation::REPLACE_XZ:
+      case InstallOperation::REPLACE_ZSTD:
+        TEST_AND_RETURN_FALSE(executor.ExecuteReplaceOperation(
+            op, std::move(writer), data.data(), data.size()));
+        break;
+      case InstallOperation::SOURCE_COPY:
+        TEST_AND_RETURN_FALSE(source_fd->IsOpen());
+        TEST_AND_RETURN_FALSE(executor.ExecuteSourceCopyOperation(
+            op, std::move(writer), source_fd));
+        break;
+      default:
+        TEST_AND_RETURN_FALSE(source_fd->IsOpen());
+        TEST_AND_RETURN_FALSE(executor.ExecuteDiffOperation(
+            op, std::move(writer), source_fd, data.data(), data.size()));
+        break;
+    }
+  }
+  return true;
+}
+
+// Writes the hash tree and FEC data of |partition|, as
+// FilesystemVerifierAction does on the device.
+bool WriteVerity(const PartitionUpdate& partition,
+                 size_t block_size,
+                 FileDescriptorPtr fd) {
+  if (partition.hash_tree_extent().num_blocks() == 0 &&
+      partition.fec_extent().num_blocks() == 0) {
+    return true;
+  }
+  InstallPlan::Partition install_part;
+  install_part.block_size = block_size;
+  TEST_AND_RETURN_FALSE(install_part.ParseVerityConfig(partition));
+  VerityWriterAndroid writer;
+  TEST_AND_RETURN_FALSE(writer.Init(install_part));
+  static constexpr size_t kBufferSize = 1024 * 1024;
+  brillo::Blob buffer(kBufferSize);
+  const uint64_t data_size =
+      install_part.hash_tree_data_offset + install_part.hash_tree_data_size;
+  for (uint64_t offset = 0; offset < data_size;) {
+    const size_t count = std::min<uint64_t>(kBufferSize, data_size - offset);
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(
+        utils::ReadAll(fd, buffer.data(), count, offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == count);
+    TEST_AND_RETURN_FALSE(writer.Update(offset, buffer.data(), count));
+    offset += count;
+  }
+  return writer.Finalize(fd.get(), fd.get());
+}
+
+// Checks the applied image at |path| against the hash in the manifest and, if
+// there is one, against the expected image at |expected_path|.
+bool VerifyImage(const PartitionUpdate& partition,
+                 const std::string& path,
+                 const std::string& expected_path) {
+  brillo::Blob actual_hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfFile(path, &actual_hash));
+  if (ToStringView(actual_hash) != partition.new_partition_info().hash()) {
+    LOG(ERROR) << "Partition " << partition.partition_name()
+               << " hash mismatch, expected "
+               << HexEncode(partition.new_partition_info().hash())
+               << ", got " << HexEncode(actual_hash);
+    return false;
+  }
+  if (expected_path.empty())
+    return true;
+  brillo::Blob expected_hash;
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfFile(expected_path, &expected_hash));
+  if (actual_hash != expected_hash) {
+    LOG(ERROR) << "Partition " << partition.partition_name()
+               << " differs from the expected image " << expected_path;
+    return false;
+  }
+  return true;
+}
+
+// Writes the COW file of the image applied to |target_fd|, the way a
+// Virtual A/B device with compression stores the update until it's merged.
+bool WriteCow(const PartitionUpdate& partition,
+              size_t block_size,
+              FileDescriptorPtr target_fd,
+              const std::string& cow_path) {
+  android::base::unique_fd cow_fd(
+      open(cow_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+  if (cow_fd < 0) {
+    PLOG(ERROR) << "Failed to open " << cow_path;
+    return false;
+  }
+  // Reserve the estimated size up front, the space past the end is released
+  // below.
+  const uint64_t estimated_size = partition.estimate_cow_size();
+  if (estimated_size > 0 &&
+      fallocate(cow_fd, FALLOC_FL_KEEP_SIZE, 0, estimated_size) != 0) {
+    PLOG(WARNING) << "Failed to preallocate " << cow_path;
+  }
+  android::snapshot::CowWriter cow_writer{
+      {.block_size = static_cast<uint32_t>(block_size),
+       .compression = FLAGS_cow_compression}};
+  TEST_AND_RETURN_FALSE(cow_writer.Initialize(cow_fd));
+  TEST_AND_RETURN_FALSE(CowDryRun(nullptr,
+                                  target_fd,
+                                  partition.operations(),
+                                  partition.merge_operations(),
+                                  block_size,
+                                  &cow_writer,
+                                  partition.new_partition_info().size(),
+                                  false));
+  TEST_AND_RETURN_FALSE(cow_writer.Finalize());
+  struct stat cow_stat;
+  TEST_AND_RETURN_FALSE_ERRNO(fstat(cow_fd, &cow_stat) == 0);
+  TEST_AND_RETURN_FALSE_ERRNO(ftruncate(cow_fd, cow_stat.st_size) == 0);
+  return true;
+}
+
+bool SimulatePartition(const DeltaArchiveManifest& manifest,
+                       const PartitionUpdate& partition,
+                       int payload_fd,
+                       uint64_t data_begin,
+                       PartitionResult* result) {
+  const size_t block_size = manifest.block_size();
+  const std::string image_name = partition.partition_name() + ".img";
+  const std::string output_path =
+      base::FilePath(FLAGS_output_dir).Append(image_name).value();
+  result->name = partition.partition_name();
+  result->size = partition.new_partition_info().size();
+
+  auto source_fd = std::make_shared<EintrSafeFileDescriptor>();
+  if (partition.has_old_partition_info()) {
+    const std::string source_path =
+        base::FilePath(FLAGS_source_dir).Append(image_name).value();
+    if (!source_fd->Open(source_path.c_str(), O_RDONLY)) {
+      PLOG(ERROR) << "Failed to open " << source_path;
+      return false;
+    }
+  }
+  // Truncated, so the blocks the operations don't write read as zeros like
+  // on a freshly allocated partition.
+  auto target_fd = std::make_shared<EintrSafeFileDescriptor>();
+  if (!target_fd->Open(output_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) {
+    PLOG(ERROR) << "Failed to open " << output_path;
+    return false;
+  }
+  TEST_AND_RETURN_FALSE_ERRNO(
+      truncate64(output_path.c_str(), partition.new_partition_info().size()) ==
+      0);
+
+  TimeTicks start = TimeTicks::Now();
+  TEST_AND_RETURN_FALSE(ApplyOperations(
+      partition, block_size, payload_fd, data_begin, source_fd, target_fd));
+  result->apply = TimeTicks::Now() - start;
+
+  start = TimeTicks::Now();
+  TEST_AND_RETURN_FALSE(WriteVerity(partition, block_size, target_fd));
+  result->verity = TimeTicks::Now() - start;
+
+  start = TimeTicks::Now();
+  const std::string expected_path =
+      FLAGS_target_dir.empty()
+          ? ""
+          : base::FilePath(FLAGS_target_dir).Append(image_name).value();
+  TEST_AND_RETURN_FALSE(VerifyImage(partition, output_path, expected_path));
+  result->verify = TimeTicks::Now() - start;
+
+  if (FLAGS_vabc) {
+    start = TimeTicks::Now();
+    const std::string cow_path =
+        base::FilePath(FLAGS_output_dir)
+            .Append(partition.partition_name() + ".cow")
+            .value();
+    TEST_AND_RETURN_FALSE(WriteCow(partition, block_size, target_fd, cow_path));
+    result->cow = TimeTicks::Now() - start;
+    result->cow_size = utils::FileSize(cow_path);
+  }
+  result->success = true;
+  return true;
+}
+
+void PrintResults(const std::vector<PartitionResult>& results,
+                  TimeDelta total) {
+  printf("%-20s %14s %10s %10s %10s %10s %14s %s\n",
+         "partition",
+         "size",
+         "apply",
+         "verity",
+         "verify",
+         "cow",
+         "cow_size",
+         "result");
+  for (const auto& result : results) {
+    printf("%-20s %14" PRIu64 " %9.3fs %9.3fs %9.3fs %9.3fs %14" PRIu64
+           " %s\n",
+           result.name.c_str(),
+           result.size,
+           result.apply.InSecondsF(),
+           result.verity.InSecondsF(),
+           result.verify.InSecondsF(),
+           result.cow.InSecondsF(),
+           result.cow_size,
+           result.success ? "OK" : "FAILED");
+  }
+  printf("Total: %.3fs\n", total.InSecondsF());
+}
+
+bool SimulateOta(const DeltaArchiveManifest& manifest,
+                 const PayloadMetadata& metadata,
+                 int payload_fd,
+                 size_t jobs) {
+  const uint64_t data_begin = FLAGS_payload_offset +
+                              metadata.GetMetadataSize() +
+                              metadata.GetMetadataSignatureSize();
+  std::vector<const PartitionUpdate*> partitions;
+  for (const auto& partition : manifest.partitions())
+    partitions.push_back(&partition);
+  if (partitions.empty())
+    return true;
+  // The largest partitions go first so that they don't end up last, alone.
+  std::stable_sort(partitions.begin(),
+                   partitions.end(),
+                   [](const PartitionUpdate* a, const PartitionUpdate* b) {
+                     return a->new_partition_info().size() >
+                            b->new_partition_info().size();
+                   });
+
+  const TimeTicks start = TimeTicks::Now();
+  std::vector<PartitionResult> results(partitions.size());
+  {
+    if (jobs == 0)
+      jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    WorkerPool pool(std::min(jobs, partitions.size()), partitions.size());
+    for (size_t i = 0; i < partitions.size(); i++) {
+      // A failed partition doesn't stop the others, they are all reported.
+      pool.Post([&, i]() {
+        if (!SimulatePartition(
+                manifest, *partitions[i], payload_fd, data_begin, &results[i]))
+          LOG(ERROR) << "Failed to simulate " << results[i].name;
+        return true;
+      });
+    }
+    pool.Wait();
+  }
+  PrintResults(results, TimeTicks::Now() - start);
+  return std::all_of(results.begin(), results.end(), [](const auto& result) {
+    return result.success;
+  });
+}
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char* argv[]) {
+  using chromeos_update_engine::DeltaArchiveManifest;
+  using chromeos_update_engine::MetadataParseResult;
+  using chromeos_update_engine::PayloadMetadata;
+
+  gflags::SetUsageMessage(
+      "Applies an Android OTA payload to images on the host and reports the "
+      "time of each phase");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  xz_crc32_init();
+  if (FLAGS_payload.empty() || FLAGS_output_dir.empty()) {
+    LOG(ERROR) << "--payload and --output_dir are required";
+    return 1;
+  }
+  int payload_fd = open(FLAGS_payload.c_str(), O_RDONLY | O_CLOEXEC);
+  if (payload_fd < 0) {
+    PLOG(ERROR) << "Failed to open " << FLAGS_payload;
+    return 1;
+  }
+  chromeos_update_engine::ScopedFdCloser closer{&payload_fd};
+
+  PayloadMetadata payload_metadata;
+  chromeos_update_engine::ErrorCode error;
+  brillo::Blob metadata(PayloadMetadata::kDeltaManifestSizeOffset +
+                        PayloadMetadata::kDeltaManifestSizeSize +
+                        PayloadMetadata::kDeltaMetadataSignatureSizeSize);
+  if (!chromeos_update_engine::ReadPayload(payload_fd,
+                                           FLAGS_payload_offset,
+                                           metadata.data(),
+                                           metadata.size()) ||
+      payload_metadata.ParsePayloadHeader(metadata, &error) !=
+          MetadataParseResult::kSuccess) {
+    LOG(ERROR) << "Payload header parse failed!";
+    return 1;
+  }
+  metadata.resize(payload_metadata.GetMetadataSize());
+  DeltaArchiveManifest manifest;
+  if (!chromeos_update_engine::ReadPayload(payload_fd,
+                                           FLAGS_payload_offset,
+                                           metadata.data(),
+                                           metadata.size()) ||
+      !payload_metadata.GetManifest(metadata, &manifest)) {
+    LOG(ERROR) << "Failed to parse manifest!";
+    return 1;
+  }
+  for (const auto& partition : manifest.partitions()) {
+    if (partition.has_old_partition_info() && FLAGS_source_dir.empty()) {
+      LOG(ERROR) << FLAGS_payload
+                 << " is an incremental payload, --source_dir is required.";
+      return 1;
+    }
+  }
+  return chromeos_update_engine::SimulateOta(
+             manifest, payload_metadata, payload_fd, std::max(FLAGS_jobs, 0))
+             ? 0
+             : 1;
+}
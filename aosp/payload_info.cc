@@ -0,0 +1,433 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// A fast equivalent of scripts/payload_info.py, for auditing many payloads:
+// each payload is mapped in memory and indexed by its operations, extents and
+// data blobs, several payloads (or the partitions of a single one) at once.
+
+#include <algorithm>
+#include <array>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <thread>  // NOLINT(build/c++11) -- for hardware_concurrency
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <android-base/stringprintf.h>
+#include <gflags/gflags.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/update_metadata.pb.h"
+
+DEFINE_int32(jobs,
+             0,
+             "Number of payloads, or partitions of a single payload, to "
+             "index at the same time, 0 for one per CPU core");
+DEFINE_bool(stats, true, "Show the operation and blob statistics");
+DEFINE_bool(list_ops, false, "List the operations of each partition");
+
+using android::base::StringAppendF;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Blob sizes are counted in power of two buckets.
+constexpr size_t kNumBlobSizeBuckets = 64;
+
+struct PartitionIndex {
+  size_t num_operations{0};
+  // The number of operations and the bytes of their data, by operation type.
+  std::map<int, size_t> op_counts;
+  std::map<int, uint64_t> op_data_bytes;
+  uint64_t blocks_read{0};
+  uint64_t blocks_written{0};
+  uint64_t num_write_seeks{0};
+  // The blocks written by more than one operation.
+  uint64_t overlapping_dst_blocks{0};
+};
+
+// A data blob, by the partition and operation using it.
+struct BlobRef {
+  uint64_t offset;
+  uint64_t length;
+  size_t partition;
+  size_t operation;
+};
+
+// A read-only mapping of a payload file.
+class MappedPayload {
+ public:
+  MappedPayload() = default;
+  ~MappedPayload() {
+    if (data_ != MAP_FAILED)
+      munmap(data_, size_);
+  }
+
+  bool Map(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    ScopedFdCloser closer(&fd);
+    struct stat st {};
+    TEST_AND_RETURN_FALSE_ERRNO(fstat(fd, &st) == 0);
+    TEST_AND_RETURN_FALSE(st.st_size > 0);
+    size_ = st.st_size;
+    data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    TEST_AND_RETURN_FALSE_ERRNO(data_ != MAP_FAILED);
+    return true;
+  }
+
+  const unsigned char* data() const {
+    return static_cast<const unsigned char*>(data_);
+  }
+  uint64_t size() const { return size_; }
+
+ private:
+  void* data_{MAP_FAILED};
+  size_t size_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(MappedPayload);
+};
+
+void AppendValue(string* out, const string& key, const string& value) {
+  StringAppendF(out, "%-28s %s\n", (key + ":").c_str(), value.c_str());
+}
+
+void AppendValue(string* out, const string& key, uint64_t value) {
+  AppendValue(out, key, std::to_string(value));
+}
+
+string TypeName(int type) {
+  return InstallOperation::Type_Name(
+      static_cast<InstallOperation::Type>(type));
+}
+
+uint64_t NumBlocks(
+    const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  uint64_t num_blocks = 0;
+  for (const auto& extent : extents)
+    num_blocks += extent.num_blocks();
+  return num_blocks;
+}
+
+// Indexes the operations of |partition|.
+void IndexPartition(const PartitionUpdate& partition,
+                    uint64_t block_size,
+                    PartitionIndex* index) {
+  index->num_operations = partition.operations_size();
+  // The written extents, as [start, end) block ranges.
+  vector<std::pair<uint64_t, uint64_t>> dst_ranges;
+  const Extent* last_extent = nullptr;
+  for (const auto& op : partition.operations()) {
+    index->op_counts[op.type()]++;
+    index->op_data_bytes[op.type()] += op.data_length();
+    index->blocks_read += NumBlocks(op.src_extents());
+    index->blocks_written += NumBlocks(op.dst_extents());
+    for (const auto& extent : op.dst_extents()) {
+      // Like payload_info.py, a seek is a written extent not contiguous with
+      // the previous one.
+      if (last_extent && extent.start_block() != last_extent->start_block() +
+                                                     last_extent->num_blocks())
+        index->num_write_seeks++;
+      last_extent = &extent;
+      dst_ranges.emplace_back(extent.start_block(),
+                              extent.start_block() + extent.num_blocks());
+    }
+  }
+  // The old and new partitions are read once during verification.
+  index->blocks_read += partition.old_partition_info().size() / block_size;
+  index->blocks_read += partition.new_partition_info().size() / block_size;
+
+  std::sort(dst_ranges.begin(), dst_ranges.end());
+  uint64_t covered_end = 0;
+  for (const auto& [start, end] : dst_ranges) {
+    if (start < covered_end)
+      index->overlapping_dst_blocks += std::min(end, covered_end) - start;
+    covered_end = std::max(covered_end, end);
+  }
+}
+
+void AppendOperations(const PartitionUpdate& partition, string* out) {
+  StringAppendF(
+      out, "%s install operations:\n", partition.partition_name().c_str());
+  auto append_extents = [out](const auto& extents, const char* name) {
+    StringAppendF(out, "    %s: %d extents (%" PRIu64 " blocks)\n      ",
+                  name,
+                  extents.size(),
+                  NumBlocks(extents));
+    for (const auto& extent : extents) {
+      StringAppendF(out,
+                    "(%" PRIu64 ",%" PRIu64 ")",
+                    extent.start_block(),
+                    extent.num_blocks());
+    }
+    out->append("\n");
+  };
+  for (int i = 0; i < partition.operations_size(); i++) {
+    const auto& op = partition.operations(i);
+    StringAppendF(out, "  %d: %s\n", i, TypeName(op.type()).c_str());
+    if (op.has_data_offset())
+      StringAppendF(out, "    Data offset: %" PRIu64 "\n", op.data_offset());
+    if (op.has_data_length())
+      StringAppendF(out, "    Data length: %" PRIu64 "\n", op.data_length());
+    if (op.src_extents_size())
+      append_extents(op.src_extents(), "Source");
+    if (op.dst_extents_size())
+      append_extents(op.dst_extents(), "Destination");
+  }
+}
+
+// Indexes the payload at |path| and describes it in |out|. The partitions are
+// indexed on |pool| if not null. Returns false if the payload can't be parsed
+// or fails the checks.
+bool DescribePayload(const string& path, WorkerPool* pool, string* out) {
+  StringAppendF(out, "%s\n", path.c_str());
+  MappedPayload payload;
+  if (!payload.Map(path)) {
+    out->append("  Failed to map the payload\n");
+    return false;
+  }
+  PayloadMetadata metadata;
+  ErrorCode error;
+  if (metadata.ParsePayloadHeader(payload.data(), payload.size(), &error) !=
+          MetadataParseResult::kSuccess ||
+      metadata.GetMetadataSize() > payload.size()) {
+    out->append("  Failed to parse the payload header\n");
+    return false;
+  }
+  DeltaArchiveManifest manifest;
+  if (!metadata.GetManifest(payload.data(), payload.size(), &manifest)) {
+    out->append("  Failed to parse the manifest\n");
+    return false;
+  }
+  const uint64_t blobs_offset =
+      metadata.GetMetadataSize() + metadata.GetMetadataSignatureSize();
+  const uint64_t block_size = manifest.block_size();
+  if (block_size == 0) {
+    out->append("  Error: the block size is 0\n");
+    return false;
+  }
+
+  AppendValue(out, "Payload version", metadata.GetMajorVersion());
+  AppendValue(out, "Manifest length",
+              metadata.GetMetadataSize() - metadata.GetManifestOffset());
+  AppendValue(out, "Metadata signature size",
+              metadata.GetMetadataSignatureSize());
+  AppendValue(out, "Minor version", manifest.minor_version());
+  AppendValue(out, "Block size", block_size);
+  if (manifest.has_signatures_offset()) {
+    AppendValue(out, "Signatures offset", manifest.signatures_offset());
+    AppendValue(out, "Signatures size", manifest.signatures_size());
+  }
+  AppendValue(out, "Number of partitions", manifest.partitions_size());
+
+  const size_t num_partitions = manifest.partitions_size();
+  vector<PartitionIndex> indexes(num_partitions);
+  if (pool) {
+    for (size_t i = 0; i < num_partitions; i++) {
+      pool->Post([&manifest, block_size, &indexes, i] {
+        IndexPartition(manifest.partitions(i), block_size, &indexes[i]);
+        return true;
+      });
+    }
+    pool->Wait();
+  } else {
+    for (size_t i = 0; i < num_partitions; i++)
+      IndexPartition(manifest.partitions(i), block_size, &indexes[i]);
+  }
+
+  vector<BlobRef> blobs;
+  std::array<uint64_t, kNumBlobSizeBuckets> blob_sizes{};
+  for (size_t i = 0; i < num_partitions; i++) {
+    const auto& partition = manifest.partitions(i);
+    for (int j = 0; j < partition.operations_size(); j++) {
+      const auto& op = partition.operations(j);
+      if (op.data_length() == 0)
+        continue;
+      blobs.push_back(
+          {op.data_offset(), op.data_length(), i, static_cast<size_t>(j)});
+      blob_sizes[63 - __builtin_clzll(op.data_length())]++;
+    }
+  }
+
+  bool valid = true;
+  // Checks that the data blobs are in the payload and don't overlap.
+  const uint64_t blobs_end = manifest.has_signatures_offset()
+                                 ? manifest.signatures_offset()
+                                 : payload.size() - blobs_offset;
+  if (blobs_offset > payload.size() ||
+      blobs_end > payload.size() - blobs_offset) {
+    out->append("  Error: the payload is truncated\n");
+    valid = false;
+  }
+  std::sort(blobs.begin(), blobs.end(), [](const auto& a, const auto& b) {
+    return a.offset < b.offset;
+  });
+  auto op_name = [&manifest](const BlobRef& blob) {
+    return android::base::StringPrintf(
+        "%s operation %zu",
+        manifest.partitions(blob.partition).partition_name().c_str(),
+        blob.operation);
+  };
+  uint64_t blobs_size = 0;
+  for (size_t i = 0; i < blobs.size(); i++) {
+    blobs_size += blobs[i].length;
+    if (blobs[i].offset + blobs[i].length > blobs_end) {
+      StringAppendF(out,
+                    "  Error: the data of %s is past the data blobs\n",
+                    op_name(blobs[i]).c_str());
+      valid = false;
+    }
+    if (i > 0 && blobs[i].offset < blobs[i - 1].offset + blobs[i - 1].length) {
+      StringAppendF(out,
+                    "  Error: the data of %s overlaps the data of %s\n",
+                    op_name(blobs[i]).c_str(),
+                    op_name(blobs[i - 1]).c_str());
+      valid = false;
+    }
+  }
+
+  for (size_t i = 0; i < num_partitions; i++) {
+    const auto& partition = manifest.partitions(i);
+    const auto& index = indexes[i];
+    const string name = partition.partition_name();
+    AppendValue(out, "  Number of \"" + name + "\" ops", index.num_operations);
+    if (!partition.version().empty())
+      AppendValue(out, "  Timestamp for " + name, partition.version());
+    if (index.overlapping_dst_blocks) {
+      StringAppendF(out,
+                    "  Error: %" PRIu64 " blocks of %s are written by more "
+                    "than one operation\n",
+                    index.overlapping_dst_blocks,
+                    name.c_str());
+      valid = false;
+    }
+  }
+
+  if (FLAGS_stats) {
+    uint64_t blocks_read = 0, blocks_written = 0, num_write_seeks = 0;
+    std::map<int, size_t> op_counts;
+    std::map<int, uint64_t> op_data_bytes;
+    for (size_t i = 0; i < num_partitions; i++) {
+      const auto& index = indexes[i];
+      const string name = manifest.partitions(i).partition_name();
+      StringAppendF(out, "Partition %s:\n", name.c_str());
+      AppendValue(out, "  Blocks read", index.blocks_read);
+      AppendValue(out, "  Blocks written", index.blocks_written);
+      AppendValue(out, "  Seeks when writing", index.num_write_seeks);
+      for (const auto& [type, count] : index.op_counts) {
+        AppendValue(out,
+                    "  " + TypeName(type) + " ops",
+                    android::base::StringPrintf(
+                        "%zu (%" PRIu64 " data bytes)",
+                        count,
+                        index.op_data_bytes.at(type)));
+        op_counts[type] += count;
+        op_data_bytes[type] += index.op_data_bytes.at(type);
+      }
+      blocks_read += index.blocks_read;
+      blocks_written += index.blocks_written;
+      num_write_seeks += index.num_write_seeks;
+    }
+    out->append("Total:\n");
+    AppendValue(out, "  Blocks read", blocks_read);
+    AppendValue(out, "  Blocks written", blocks_written);
+    AppendValue(out, "  Seeks when writing", num_write_seeks);
+    for (const auto& [type, count] : op_counts) {
+      AppendValue(
+          out,
+          "  " + TypeName(type) + " ops",
+          android::base::StringPrintf(
+              "%zu (%" PRIu64 " data bytes)", count, op_data_bytes[type]));
+    }
+    AppendValue(out, "  Data blobs", blobs.size());
+    AppendValue(out, "  Data blob bytes", blobs_size);
+    out->append("Data blob sizes:\n");
+    for (size_t bucket = 0; bucket < kNumBlobSizeBuckets; bucket++) {
+      if (blob_sizes[bucket] == 0)
+        continue;
+      AppendValue(out,
+                  android::base::StringPrintf(
+                      "  [2^%zu, 2^%zu) bytes", bucket, bucket + 1),
+                  blob_sizes[bucket]);
+    }
+  }
+
+  if (FLAGS_list_ops) {
+    for (const auto& partition : manifest.partitions())
+      AppendOperations(partition, out);
+  }
+  return valid;
+}
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char* argv[]) {
+  gflags::SetUsageMessage(
+      "Show information about update payloads and check their operations.\n"
+      "Usage: payload_info [flags] <payload.bin>...");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc < 2) {
+    LOG(ERROR) << "At least one payload is required";
+    return 1;
+  }
+  const vector<string> payloads(argv + 1, argv + argc);
+  size_t jobs = FLAGS_jobs;
+  if (jobs == 0)
+    jobs = std::max(std::thread::hardware_concurrency(), 1u);
+
+  // A single payload has its partitions indexed in parallel, several payloads
+  // are each indexed on their own thread.
+  chromeos_update_engine::WorkerPool pool(jobs, jobs);
+  vector<string> reports(payloads.size());
+  // Not vector<bool>, the elements are set from several threads.
+  vector<char> valid(payloads.size(), false);
+  if (payloads.size() == 1) {
+    valid[0] = chromeos_update_engine::DescribePayload(
+        payloads[0], &pool, &reports[0]);
+  } else {
+    for (size_t i = 0; i < payloads.size(); i++) {
+      pool.Post([&payloads, &reports, &valid, i] {
+        valid[i] = chromeos_update_engine::DescribePayload(
+            payloads[i], nullptr, &reports[i]);
+        return true;
+      });
+    }
+    pool.Wait();
+  }
+
+  int ret = 0;
+  for (size_t i = 0; i < payloads.size(); i++) {
+    fputs(reports[i].c_str(), stdout);
+    if (!valid[i])
+      ret = 1;
+  }
+  return ret;
+}
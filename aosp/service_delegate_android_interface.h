@@ -131,6 +131,16 @@ class ServiceDelegateAndroidInterface {
 
   virtual bool SetPerformanceMode(bool enable, brillo::ErrorPtr* error) = 0;
 
+  // Limits the download of the current and later updates to
+  // |bytes_per_second| on average, 0 meaning no limit.
+  virtual bool SetMaxDownloadRate(uint64_t bytes_per_second,
+                                  brillo::ErrorPtr* error) = 0;
+
+  // Sets |report| to the throughput of each phase of the last update which
+  // finished, or to an empty string if none did.
+  virtual bool GetLastPerformanceReport(std::string* report,
+                                        brillo::ErrorPtr* error) = 0;
+
  protected:
   ServiceDelegateAndroidInterface() = default;
 };
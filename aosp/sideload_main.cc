@@ -16,11 +16,15 @@
 
 #include <xz.h>
 
+#include <algorithm>
 #include <string>
+#include <thread>  // NOLINT(build/c++11) -- for hardware_concurrency
+#include <utility>
 #include <vector>
 
 #include <base/command_line.h>
 #include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <brillo/asynchronous_signal_handler.h>
 #include <brillo/flag_helper.h>
@@ -30,6 +34,7 @@
 
 #include "update_engine/aosp/update_attempter_android.h"
 #include "update_engine/common/boot_control.h"
+#include "update_engine/common/constants.h"
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/hardware.h"
 #include "update_engine/common/logging.h"
@@ -46,6 +51,40 @@ using update_engine::UpdateStatus;
 namespace chromeos_update_engine {
 namespace {
 
+// The data read from the package ahead of the apply. Reads from the package
+// on FUSE are slow and serial, so they keep going while operations apply.
+constexpr uint64_t kRecoveryDownloadBufferSize = 32 * 1024 * 1024;
+
+// Adds to |headers| those of the recovery performance profile whose key isn't
+// there already. Nothing else runs in recovery, so the payload is read ahead
+// of the apply, applied by as many threads as there are CPUs, and each
+// partition is hashed for verity and verified while the next ones are applied.
+void AddRecoveryProfileHeaders(vector<string>* headers) {
+  const string threads =
+      std::to_string(std::max(std::thread::hardware_concurrency(), 1u));
+  const vector<std::pair<string, string>> profile = {
+      {kPayloadPropertyPipelinedApply, "1"},
+      {kPayloadPropertyApplyThreads, threads},
+      {kPayloadPropertyConcurrentPartitions, "1"},
+      {kPayloadPropertyWriteBehind, "1"},
+      {kPayloadPropertyWriteVerityDuringApply, "1"},
+      {kPayloadPropertyVerifyDuringApply, "1"},
+      {kPayloadPropertyVerifyThreads, threads},
+      {kPayloadPropertyDownloadBufferSize,
+       std::to_string(kRecoveryDownloadBufferSize)},
+  };
+  for (const auto& [key, value] : profile) {
+    const string prefix = key + "=";
+    if (std::none_of(
+            headers->begin(), headers->end(), [&prefix](const string& header) {
+              return base::StartsWith(
+                  header, prefix, base::CompareCase::SENSITIVE);
+            })) {
+      headers->push_back(prefix + value);
+    }
+  }
+}
+
 class SideloadDaemonState : public DaemonStateInterface,
                             public ServiceObserverInterface {
  public:
@@ -185,6 +224,11 @@ int main(int argc, char** argv) {
                 "",
                 "A list of key-value pairs, one element of the list per line.");
   DEFINE_int64(status_fd, -1, "A file descriptor to notify the update status.");
+  DEFINE_bool(recovery_profile,
+              true,
+              "Apply the payload as fast as the device allows, with the "
+              "operations applied and the partitions verified by as many "
+              "threads as there are CPUs, unless --headers says otherwise.");
 
   chromeos_update_engine::Terminator::Init();
   chromeos_update_engine::SetupLogging(true /* stderr */, false /* file */);
@@ -197,6 +241,8 @@ int main(int argc, char** argv) {
 
   vector<string> headers = base::SplitString(
       FLAGS_headers, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  if (FLAGS_recovery_profile)
+    chromeos_update_engine::AddRecoveryProfileHeaders(&headers);
 
   if (!chromeos_update_engine::ApplyUpdatePayload(
           FLAGS_payload, FLAGS_offset, FLAGS_size, headers, FLAGS_status_fd))
@@ -16,17 +16,24 @@
 
 #include "update_engine/aosp/update_attempter_android.h"
 
+#include <sys/statvfs.h>
+
 #include <algorithm>
 #include <map>
 #include <memory>
+#include <optional>
 #include <ostream>
+#include <thread>
 #include <utility>
 
 #include <android-base/properties.h>
 #include <android-base/unique_fd.h>
 #include <base/bind.h>
+#include <base/files/file_util.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
 #include <brillo/data_encoding.h>
 #include <brillo/message_loops/message_loop.h>
 #include <brillo/strings/string_utils.h>
@@ -34,14 +41,20 @@
 #include <processgroup/processgroup.h>
 
 #include "update_engine/aosp/cleanup_previous_update_action.h"
+#include "update_engine/common/caching_http_fetcher.h"
 #include "update_engine/common/constants.h"
+#include "update_engine/common/cpu_policy.h"
 #include "update_engine/common/daemon_state_interface.h"
 #include "update_engine/common/download_action.h"
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/file_fetcher.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/memory_budget.h"
 #include "update_engine/common/metrics_reporter_interface.h"
+#include "update_engine/common/performance_recorder.h"
 #include "update_engine/common/network_selector.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 #include "update_engine/metrics_utils.h"
 #include "update_engine/payload_consumer/certificate_parser_interface.h"
 #include "update_engine/payload_consumer/delta_performer.h"
@@ -52,6 +65,7 @@
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
 #include "update_engine/payload_consumer/postinstall_runner_action.h"
+#include "update_engine/payload_consumer/source_hash_cache.h"
 #include "update_engine/update_boot_flags_action.h"
 #include "update_engine/update_status_utils.h"
 
@@ -77,6 +91,14 @@ namespace {
 // Minimum threshold to broadcast an status update in progress and time.
 const double kBroadcastThresholdProgress = 0.01;  // 1%
 const int kBroadcastThresholdSeconds = 10;
+// Minimum interval between the live stats sent to the observers.
+const int kStatsUpdateIntervalSeconds = 1;
+// The most source partitions hashed at once by VerifyPayloadApplicable().
+const size_t kMaxSourceCheckThreads = 4;
+// How often the thermal headroom is passed to the CpuPolicy while processing.
+const int kThermalPollIntervalSeconds = 10;
+// The most connections downloading the parts of a split payload by default.
+const size_t kMaxSplitPayloadConnections = 4;
 
 const char* const kErrorDomain = "update_engine";
 // TODO(deymo): Convert the different errors to a numeric value to report them
@@ -128,6 +150,15 @@ string GetPayloadId(const std::map<string, string>& headers) {
               : "");
 }
 
+// The file an HTTP(S) payload is downloaded into with PREFETCH_TO_DISK.
+bool GetPayloadCachePath(const HardwareInterface* hardware, string* path) {
+  base::FilePath dir;
+  if (!hardware->GetNonVolatileDirectory(&dir))
+    return false;
+  *path = dir.Append("payload_cache").value();
+  return true;
+}
+
 }  // namespace
 
 UpdateAttempterAndroid::UpdateAttempterAndroid(
@@ -153,6 +184,12 @@ UpdateAttempterAndroid::~UpdateAttempterAndroid() {
   // Release ourselves as the ActionProcessor's delegate to prevent
   // re-scheduling the updates due to the processing stopped.
   processor_->set_delegate(nullptr);
+  if (startup_tasks_id_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(startup_tasks_id_);
+  }
+  if (thermal_poll_id_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(thermal_poll_id_);
+  }
 }
 
 [[nodiscard]] static bool DidSystemReboot(PrefsInterface* prefs) {
@@ -185,27 +222,66 @@ std::ostream& operator<<(std::ostream& out, OTAResult result) {
 }
 
 void UpdateAttempterAndroid::Init() {
+  startup_tasks_pending_ = RestoreStatus();
+  RunStartupTasks();
+}
+
+void UpdateAttempterAndroid::InitDeferred() {
+  startup_tasks_pending_ = RestoreStatus();
+  if (startup_tasks_pending_) {
+    startup_tasks_id_ = brillo::MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&UpdateAttempterAndroid::RunStartupTasks,
+                   base::Unretained(this)));
+  }
+}
+
+bool UpdateAttempterAndroid::RestoreStatus() {
+  const uint64_t memory_budget = hardware_->GetMemoryBudget();
+  LOG(INFO) << "Memory budget: " << memory_budget << " bytes (0: unlimited).";
+  MemoryBudget::Get()->SetLimit(memory_budget);
+  CpuPolicy::Get()->LoadCpuCapacities();
+  // The workers only open performance hint sessions in performance mode.
+  CpuPolicy::Get()->SetHintSessionFactory(
+      [hardware = hardware_](int32_t tid, base::TimeDelta target) {
+        return hardware->CreatePerformanceHintSession(tid, target);
+      });
+
   // In case of update_engine restart without a reboot we need to restore the
   // reboot needed state.
   if (UpdateCompletedOnThisBoot()) {
     LOG(INFO) << "Updated installed but update_engine is restarted without "
                  "device reboot. Resuming old state.";
     SetStatusAndNotify(UpdateStatus::UPDATED_NEED_REBOOT);
-  } else {
-    const auto result = GetOTAUpdateResult();
-    LOG(INFO) << result;
-    SetStatusAndNotify(UpdateStatus::IDLE);
-    if (DidSystemReboot(prefs_)) {
-      UpdateStateAfterReboot(result);
-    }
+    return false;
+  }
+  SetStatusAndNotify(UpdateStatus::IDLE);
+  return true;
+}
+
+void UpdateAttempterAndroid::RunStartupTasks() {
+  if (startup_tasks_id_ != brillo::MessageLoop::kTaskIdNull) {
+    // Either running from the task, or ahead of it.
+    brillo::MessageLoop::current()->CancelTask(startup_tasks_id_);
+    startup_tasks_id_ = brillo::MessageLoop::kTaskIdNull;
+  }
+  if (!startup_tasks_pending_) {
+    return;
+  }
+  startup_tasks_pending_ = false;
+
+  const auto result = GetOTAUpdateResult();
+  LOG(INFO) << result;
+  if (DidSystemReboot(prefs_)) {
+    UpdateStateAfterReboot(result);
+  }
 
 #ifdef _UE_SIDELOAD
-    LOG(INFO) << "Skip ScheduleCleanupPreviousUpdate in sideload because "
-              << "ApplyPayload will call it later.";
+  LOG(INFO) << "Skip ScheduleCleanupPreviousUpdate in sideload because "
+            << "ApplyPayload will call it later.";
 #else
-    ScheduleCleanupPreviousUpdate();
+  ScheduleCleanupPreviousUpdate();
 #endif
-  }
 }
 
 bool UpdateAttempterAndroid::ApplyPayload(
@@ -214,6 +290,7 @@ bool UpdateAttempterAndroid::ApplyPayload(
     int64_t payload_size,
     const vector<string>& key_value_pair_headers,
     brillo::ErrorPtr* error) {
+  RunStartupTasks();
   if (status_ == UpdateStatus::UPDATED_NEED_REBOOT) {
     return LogAndSetError(
         error, FROM_HERE, "An update already applied, waiting for reboot");
@@ -265,6 +342,14 @@ bool UpdateAttempterAndroid::ApplyPayload(
   install_plan_.is_resume = !payload_id.empty() &&
                             DeltaPerformer::CanResumeUpdate(prefs_, payload_id);
   if (!install_plan_.is_resume) {
+    // Applying the same payload again, the target blocks written by the
+    // previous attempt needn't be written again.
+    string previous_payload_id;
+    install_plan_.skip_written_operations =
+        !payload_id.empty() &&
+        prefs_->GetString(kPrefsUpdateCheckResponseHash,
+                          &previous_payload_id) &&
+        previous_payload_id == payload_id;
     // No need to reset dynamic_partititon_metadata_updated. If previous calls
     // to AllocateSpaceForPayload uses the same payload_id, reuse preallocated
     // space. Otherwise, DeltaPerformer re-allocates space when the payload is
@@ -291,6 +376,182 @@ bool UpdateAttempterAndroid::ApplyPayload(
   install_plan_.run_post_install =
       GetHeaderAsBool(headers[kPayloadPropertyRunPostInstall], true);
 
+  install_plan_.pipelined_apply =
+      GetHeaderAsBool(headers[kPayloadPropertyPipelinedApply], false);
+
+  if (!headers[kPayloadPropertyApplyThreads].empty()) {
+    unsigned apply_threads = 0;
+    if (!base::StringToUint(headers[kPayloadPropertyApplyThreads],
+                            &apply_threads) ||
+        apply_threads == 0) {
+      return LogAndSetError(
+          error,
+          FROM_HERE,
+          "Invalid apply_threads: " + headers[kPayloadPropertyApplyThreads]);
+    }
+    install_plan_.apply_threads = apply_threads;
+  }
+  install_plan_.concurrent_partitions =
+      GetHeaderAsBool(headers[kPayloadPropertyConcurrentPartitions], false);
+
+  if (!headers[kPayloadPropertyVerifyThreads].empty()) {
+    unsigned verify_threads = 0;
+    if (!base::StringToUint(headers[kPayloadPropertyVerifyThreads],
+                            &verify_threads) ||
+        verify_threads == 0) {
+      return LogAndSetError(
+          error,
+          FROM_HERE,
+          "Invalid verify_threads: " + headers[kPayloadPropertyVerifyThreads]);
+    }
+    install_plan_.verify_threads = verify_threads;
+  }
+
+  if (!headers[kPayloadPropertyDownloadConnections].empty()) {
+    unsigned download_connections = 0;
+    if (!base::StringToUint(headers[kPayloadPropertyDownloadConnections],
+                            &download_connections) ||
+        download_connections == 0) {
+      return LogAndSetError(error,
+                            FROM_HERE,
+                            "Invalid download_connections: " +
+                                headers[kPayloadPropertyDownloadConnections]);
+    }
+    install_plan_.download_connections = download_connections;
+  }
+
+  install_plan_.mirror_urls =
+      base::SplitString(headers[kPayloadPropertyMirrorUrls],
+                        base::kWhitespaceASCII,
+                        base::TRIM_WHITESPACE,
+                        base::SPLIT_WANT_NONEMPTY);
+  for (const string& url : install_plan_.mirror_urls) {
+    // Only the HTTP(S) transfers are split among mirrors.
+    if (FileFetcher::SupportedUrl(url) ||
+        FileFetcher::SupportedUrl(payload_url)) {
+      return LogAndSetError(error, FROM_HERE, "Invalid mirror URL: " + url);
+    }
+  }
+  // The peers are as untrusted as the mirrors: the payload is authenticated
+  // by its signed metadata and the hash of each operation's data.
+  install_plan_.peer_urls =
+      base::SplitString(headers[kPayloadPropertyPeerUrls],
+                        base::kWhitespaceASCII,
+                        base::TRIM_WHITESPACE,
+                        base::SPLIT_WANT_NONEMPTY);
+  for (const string& url : install_plan_.peer_urls) {
+    if (FileFetcher::SupportedUrl(url) ||
+        FileFetcher::SupportedUrl(payload_url)) {
+      return LogAndSetError(error, FROM_HERE, "Invalid peer URL: " + url);
+    }
+  }
+  // The parts hold the same bytes as the payload, authenticated the same way.
+  for (const string& entry :
+       base::SplitString(headers[kPayloadPropertySplitPayloadParts],
+                         base::kWhitespaceASCII,
+                         base::TRIM_WHITESPACE,
+                         base::SPLIT_WANT_NONEMPTY)) {
+    const auto& parts = install_plan_.split_payload_parts;
+    const size_t colon = entry.find(':');
+    uint64_t offset = 0;
+    if (FileFetcher::SupportedUrl(payload_url) || colon == string::npos ||
+        colon + 1 == entry.size() ||
+        !base::StringToUint64(entry.substr(0, colon), &offset) ||
+        (parts.empty() ? offset != 0 : offset <= parts.back().first)) {
+      return LogAndSetError(
+          error, FROM_HERE, "Invalid split payload part: " + entry);
+    }
+    install_plan_.split_payload_parts.emplace_back(offset,
+                                                   entry.substr(colon + 1));
+  }
+  const size_t num_extra_urls =
+      install_plan_.mirror_urls.size() + install_plan_.peer_urls.size();
+  if (headers[kPayloadPropertyDownloadConnections].empty()) {
+    if (num_extra_urls > 0) {
+      install_plan_.download_connections = 1 + num_extra_urls;
+    } else if (!install_plan_.split_payload_parts.empty()) {
+      // The parts are downloaded at the same time.
+      install_plan_.download_connections =
+          std::min(install_plan_.split_payload_parts.size(),
+                   kMaxSplitPayloadConnections);
+    }
+  }
+
+  if (!headers[kPayloadPropertyDownloadBufferSize].empty() &&
+      !base::StringToUint64(headers[kPayloadPropertyDownloadBufferSize],
+                            &install_plan_.download_buffer_size)) {
+    return LogAndSetError(error,
+                          FROM_HERE,
+                          "Invalid download_buffer_size: " +
+                              headers[kPayloadPropertyDownloadBufferSize]);
+  }
+
+  if (!headers[kPayloadPropertyVerifyReadBandwidth].empty() &&
+      !base::StringToUint64(headers[kPayloadPropertyVerifyReadBandwidth],
+                            &install_plan_.verify_read_bandwidth)) {
+    return LogAndSetError(error,
+                          FROM_HERE,
+                          "Invalid verify_read_bandwidth: " +
+                              headers[kPayloadPropertyVerifyReadBandwidth]);
+  }
+
+  install_plan_.stream_replace_operations = GetHeaderAsBool(
+      headers[kPayloadPropertyStreamReplaceOperations], false);
+  install_plan_.write_verity_during_apply = GetHeaderAsBool(
+      headers[kPayloadPropertyWriteVerityDuringApply], false);
+  install_plan_.reuse_source_verity =
+      GetHeaderAsBool(headers[kPayloadPropertyReuseSourceVerity], false);
+  install_plan_.verify_during_apply =
+      GetHeaderAsBool(headers[kPayloadPropertyVerifyDuringApply], false);
+  install_plan_.prepare_partitions_in_background = GetHeaderAsBool(
+      headers[kPayloadPropertyPreparePartitionsInBackground], false);
+  install_plan_.direct_target_writes =
+      GetHeaderAsBool(headers[kPayloadPropertyDirectTargetWrites], false);
+  install_plan_.write_behind =
+      GetHeaderAsBool(headers[kPayloadPropertyWriteBehind], false);
+  install_plan_.instrument_file_io =
+      GetHeaderAsBool(headers[kPayloadPropertyInstrumentFileIo], false);
+
+  // The cache file holds the payload at the offsets of its URL, not of the
+  // parts of a split one.
+  install_plan_.prefetch_to_disk =
+      GetHeaderAsBool(headers[kPayloadPropertyPrefetchToDisk], false) &&
+      !FileFetcher::SupportedUrl(payload_url) &&
+      install_plan_.split_payload_parts.empty();
+  if (install_plan_.prefetch_to_disk) {
+    // The cache file already keeps the download ahead of the apply, over a
+    // single connection.
+    LOG_IF(INFO,
+           install_plan_.download_connections > 1 ||
+               install_plan_.download_buffer_size > 0 ||
+               !install_plan_.mirror_urls.empty() ||
+               !install_plan_.peer_urls.empty())
+        << "Ignoring download_connections, download_buffer_size, mirror_urls "
+           "and peer_urls, the payload is prefetched to disk.";
+    install_plan_.download_connections = 1;
+    install_plan_.download_buffer_size = 0;
+    install_plan_.mirror_urls.clear();
+    install_plan_.peer_urls.clear();
+  }
+
+  if (!headers[kPayloadPropertyMaxDownloadRate].empty() &&
+      !base::StringToUint64(headers[kPayloadPropertyMaxDownloadRate],
+                            &install_plan_.max_download_rate)) {
+    return LogAndSetError(error,
+                          FROM_HERE,
+                          "Invalid max_download_rate: " +
+                              headers[kPayloadPropertyMaxDownloadRate]);
+  }
+
+  // The update runs in the background unless asked otherwise, the
+  // performance mode set for it is reset when it's done.
+  if (GetHeaderAsBool(headers[kPayloadPropertyPerformanceMode], false) &&
+      !performance_mode_) {
+    if (!SetPerformanceMode(true, error))
+      return false;
+    performance_mode_for_update_ = true;
+  }
+
   // Skip writing verity if we're resuming and verity has already been written.
   install_plan_.write_verity = true;
   if (install_plan_.is_resume && prefs_->Exists(kPrefsVerityWritten)) {
@@ -322,6 +583,7 @@ bool UpdateAttempterAndroid::ApplyPayload(
   install_plan_.Dump();
 
   HttpFetcher* fetcher = nullptr;
+  std::vector<HttpFetcher*> parallel_fetchers;
   if (FileFetcher::SupportedUrl(payload_url)) {
     DLOG(INFO) << "Using FileFetcher for file URL.";
     fetcher = new FileFetcher();
@@ -329,19 +591,37 @@ bool UpdateAttempterAndroid::ApplyPayload(
 #ifdef _UE_SIDELOAD
     LOG(FATAL) << "Unsupported sideload URI: " << payload_url;
 #else
-    LibcurlHttpFetcher* libcurl_fetcher =
-        new LibcurlHttpFetcher(&proxy_resolver_, hardware_);
-    libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
-    fetcher = libcurl_fetcher;
+    for (uint32_t i = 0; i < install_plan_.download_connections; i++) {
+      LibcurlHttpFetcher* libcurl_fetcher =
+          new LibcurlHttpFetcher(&proxy_resolver_, hardware_);
+      libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
+      if (!fetcher) {
+        fetcher = libcurl_fetcher;
+      } else {
+        parallel_fetchers.push_back(libcurl_fetcher);
+      }
+    }
+    string cache_path;
+    if (install_plan_.prefetch_to_disk &&
+        GetPayloadCachePath(hardware_, &cache_path)) {
+      fetcher = new CachingHttpFetcher(
+          fetcher, cache_path, payload_id.empty() ? payload_url : payload_id);
+    }
 #endif  // _UE_SIDELOAD
   }
   // Setup extra headers.
-  if (!headers[kPayloadPropertyAuthorization].empty())
-    fetcher->SetHeader("Authorization", headers[kPayloadPropertyAuthorization]);
-  if (!headers[kPayloadPropertyUserAgent].empty())
-    fetcher->SetHeader("User-Agent", headers[kPayloadPropertyUserAgent]);
+  std::vector<HttpFetcher*> all_fetchers{fetcher};
+  all_fetchers.insert(
+      all_fetchers.end(), parallel_fetchers.begin(), parallel_fetchers.end());
+  for (HttpFetcher* http_fetcher : all_fetchers) {
+    if (!headers[kPayloadPropertyAuthorization].empty())
+      http_fetcher->SetHeader("Authorization",
+                              headers[kPayloadPropertyAuthorization]);
+    if (!headers[kPayloadPropertyUserAgent].empty())
+      http_fetcher->SetHeader("User-Agent", headers[kPayloadPropertyUserAgent]);
+  }
 
-  BuildUpdateActions(fetcher);
+  BuildUpdateActions(fetcher, std::move(parallel_fetchers));
 
   SetStatusAndNotify(UpdateStatus::UPDATE_AVAILABLE);
 
@@ -358,6 +638,7 @@ bool UpdateAttempterAndroid::ApplyPayload(
     int64_t payload_size,
     const vector<string>& key_value_pair_headers,
     brillo::ErrorPtr* error) {
+  RunStartupTasks();
   // update_engine state must be checked before modifying payload_fd_ otherwise
   // already running update will be terminated (existing file descriptor will be
   // closed)
@@ -400,6 +681,7 @@ bool UpdateAttempterAndroid::CancelUpdate(brillo::ErrorPtr* error) {
 }
 
 bool UpdateAttempterAndroid::ResetStatus(brillo::ErrorPtr* error) {
+  RunStartupTasks();
   LOG(INFO) << "Attempting to reset state from "
             << UpdateStatusToString(status_) << " to UpdateStatus::IDLE";
   if (processor_->IsRunning()) {
@@ -517,13 +799,20 @@ bool UpdateAttempterAndroid::VerifyPayloadParseManifest(
 
 bool UpdateAttempterAndroid::VerifyPayloadApplicable(
     const std::string& metadata_filename, brillo::ErrorPtr* error) {
+  RunStartupTasks();
   DeltaArchiveManifest manifest;
   TEST_AND_RETURN_FALSE(
       VerifyPayloadParseManifest(metadata_filename, &manifest, error));
 
-  FileDescriptorPtr fd(new EintrSafeFileDescriptor);
-  ErrorCode errorcode;
-
+  // The source partitions to check, with a digest of the hashes they must
+  // match. Those already checked since the last reboot are skipped.
+  struct SourceCheck {
+    const PartitionUpdate* partition;
+    string path;
+    brillo::Blob digest;
+    string error;
+  };
+  std::vector<SourceCheck> checks;
   BootControlInterface::Slot current_slot = GetCurrentSlot();
   for (const PartitionUpdate& partition : manifest.partitions()) {
     if (!partition.has_old_partition_info())
@@ -536,11 +825,37 @@ bool UpdateAttempterAndroid::VerifyPayloadApplicable(
           FROM_HERE,
           "Failed to get partition device for " + partition.partition_name());
     }
-    if (!fd->Open(partition_path.c_str(), O_RDONLY)) {
-      return LogAndSetError(
-          error, FROM_HERE, "Failed to open " + partition_path);
-    }
+    string source_hashes = std::to_string(manifest.block_size());
     for (const InstallOperation& operation : partition.operations()) {
+      if (!operation.has_src_sha256_hash())
+        continue;
+      for (const Extent& extent : operation.src_extents())
+        source_hashes += extent.SerializeAsString();
+      source_hashes += operation.src_sha256_hash();
+    }
+    brillo::Blob digest;
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfBytes(source_hashes.data(),
+                                       source_hashes.size(),
+                                       &digest));
+    if (IsSourceHashVerified(prefs_, partition.partition_name(), digest)) {
+      LOG(INFO) << "Source partition " << partition.partition_name()
+                << " already verified since the last reboot.";
+      continue;
+    }
+    checks.push_back({&partition, partition_path, digest, ""});
+  }
+
+  // Hashing is bound by the reads of each partition, they are checked side by
+  // side.
+  auto check_partition = [&manifest](SourceCheck* check) {
+    FileDescriptorPtr fd(new EintrSafeFileDescriptor);
+    if (!fd->Open(check->path.c_str(), O_RDONLY)) {
+      check->error = "Failed to open " + check->path;
+      return false;
+    }
+    ErrorCode errorcode;
+    for (const InstallOperation& operation : check->partition->operations()) {
       if (!operation.has_src_sha256_hash())
         continue;
       brillo::Blob source_hash;
@@ -548,8 +863,8 @@ bool UpdateAttempterAndroid::VerifyPayloadApplicable(
                                         operation.src_extents(),
                                         manifest.block_size(),
                                         &source_hash)) {
-        return LogAndSetError(
-            error, FROM_HERE, "Failed to hash " + partition_path);
+        check->error = "Failed to hash " + check->path;
+        return false;
       }
       if (!PartitionWriter::ValidateSourceHash(
               source_hash, operation, fd, &errorcode)) {
@@ -557,6 +872,29 @@ bool UpdateAttempterAndroid::VerifyPayloadApplicable(
       }
     }
     fd->Close();
+    return true;
+  };
+  const size_t num_threads = std::min(checks.size(), kMaxSourceCheckThreads);
+  if (num_threads > 0) {
+    WorkerPool pool(num_threads, checks.size());
+    for (SourceCheck& check : checks) {
+      if (!pool.Post([&check_partition, check = &check]() {
+            return check_partition(check);
+          })) {
+        break;
+      }
+    }
+    if (!pool.Wait()) {
+      for (const SourceCheck& check : checks) {
+        if (!check.error.empty())
+          return LogAndSetError(error, FROM_HERE, check.error);
+      }
+      return false;
+    }
+  }
+  for (const SourceCheck& check : checks) {
+    SaveVerifiedSourceHash(
+        prefs_, check.partition->partition_name(), check.digest);
   }
   return true;
 }
@@ -575,6 +913,26 @@ bool UpdateAttempterAndroid::SetPerformanceMode(bool enable,
   if (!ret)
     return LogAndSetError(error, FROM_HERE, "Could not change profiles");
   performance_mode_ = enable;
+  performance_mode_for_update_ = false;
+  CpuPolicy::Get()->SetMode(enable ? CpuPolicy::Mode::kPerformance
+                                   : CpuPolicy::Mode::kBackground);
+  return true;
+}
+
+bool UpdateAttempterAndroid::SetMaxDownloadRate(uint64_t bytes_per_second,
+                                                brillo::ErrorPtr* error) {
+  LOG(INFO) << "Setting the download rate limit to " << bytes_per_second
+            << " bytes per second.";
+  install_plan_.max_download_rate = bytes_per_second;
+  AbstractAction* action = processor_->current_action();
+  if (action && action->Type() == DownloadAction::StaticType())
+    static_cast<DownloadAction*>(action)->SetMaxDownloadRate(bytes_per_second);
+  return true;
+}
+
+bool UpdateAttempterAndroid::GetLastPerformanceReport(
+    string* report, brillo::ErrorPtr* error) {
+  *report = last_performance_report_;
   return true;
 }
 
@@ -594,6 +952,11 @@ void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
         LOG(ERROR) << "Failed to write update completion marker";
       }
       prefs_->SetInt64(kPrefsDeltaUpdateFailures, 0);
+      if (install_plan_.prefetch_to_disk) {
+        string cache_path;
+        if (GetPayloadCachePath(hardware_, &cache_path))
+          CachingHttpFetcher::DeleteCache(cache_path);
+      }
 
       LOG(INFO) << "Update successfully applied, waiting to reboot.";
       break;
@@ -633,6 +996,7 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
   // Reset download progress regardless of whether or not the download
   // action succeeded.
   const string type = action->Type();
+  RecordPerformancePhase(type);
   if (type == CleanupPreviousUpdateAction::StaticType() ||
       (type == NoOpAction::StaticType() &&
        status_ == UpdateStatus::CLEANUP_PREVIOUS_UPDATE)) {
@@ -667,6 +1031,8 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
 void UpdateAttempterAndroid::BytesReceived(uint64_t bytes_progressed,
                                            uint64_t bytes_received,
                                            uint64_t total) {
+  stats_.bytes_downloaded = bytes_received;
+  stats_.bytes_total = total;
   double progress = 0;
   if (total)
     progress = static_cast<double>(bytes_received) / static_cast<double>(total);
@@ -698,6 +1064,15 @@ void UpdateAttempterAndroid::DownloadComplete() {
   // Nothing needs to be done when the download completes.
 }
 
+void UpdateAttempterAndroid::OperationsApplied(const string& partition,
+                                               uint64_t operations_applied,
+                                               uint64_t total_operations) {
+  stats_.partition = partition;
+  stats_.operations_applied = operations_applied;
+  stats_.operations_total = total_operations;
+  NotifyStats(false);
+}
+
 void UpdateAttempterAndroid::ProgressUpdate(double progress) {
   // Self throttle based on progress. Also send notifications if progress is
   // too slow.
@@ -708,6 +1083,7 @@ void UpdateAttempterAndroid::ProgressUpdate(double progress) {
     download_progress_ = progress;
     SetStatusAndNotify(status_);
   }
+  NotifyStats(false);
 }
 
 void UpdateAttempterAndroid::OnVerifyProgressUpdate(double progress) {
@@ -718,10 +1094,65 @@ void UpdateAttempterAndroid::OnVerifyProgressUpdate(double progress) {
 void UpdateAttempterAndroid::ScheduleProcessingStart() {
   LOG(INFO) << "Scheduling an action processor start.";
   processor_->set_delegate(this);
+  StartPerformancePhase();
+  stats_ = {};
+  last_stats_time_ = TimeTicks();
   brillo::MessageLoop::current()->PostTask(
       FROM_HERE,
       Bind([](ActionProcessor* processor) { processor->StartProcessing(); },
            base::Unretained(processor_.get())));
+  if (thermal_poll_id_ == brillo::MessageLoop::kTaskIdNull) {
+    thermal_poll_id_ = brillo::MessageLoop::current()->PostTask(
+        FROM_HERE,
+        Bind(&UpdateAttempterAndroid::PollThermalHeadroom,
+             base::Unretained(this)));
+  }
+}
+
+void UpdateAttempterAndroid::PollThermalHeadroom() {
+  thermal_poll_id_ = brillo::MessageLoop::kTaskIdNull;
+  // The processing starts in a task posted before this one.
+  if (!processor_->IsRunning()) {
+    CpuPolicy::Get()->SetThermalHeadroom(-1);
+    return;
+  }
+  CpuPolicy::Get()->SetThermalHeadroom(hardware_->GetThermalHeadroom());
+  thermal_poll_id_ = brillo::MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      Bind(&UpdateAttempterAndroid::PollThermalHeadroom,
+           base::Unretained(this)),
+      TimeDelta::FromSeconds(kThermalPollIntervalSeconds));
+}
+
+void UpdateAttempterAndroid::StartPerformancePhase() {
+  phase_start_time_ = base::TimeTicks::Now();
+  phase_start_cpu_time_ = PerformanceRecorder::ProcessCpuTime();
+}
+
+void UpdateAttempterAndroid::RecordPerformancePhase(
+    const string& action_type) {
+  const char* phase = nullptr;
+  if (action_type == CleanupPreviousUpdateAction::StaticType())
+    phase = "merge";
+  else if (action_type == DownloadAction::StaticType())
+    phase = "download";
+  else if (action_type == FilesystemVerifierAction::StaticType())
+    phase = "verify";
+  else if (action_type == PostinstallRunnerAction::StaticType())
+    phase = "postinstall";
+  const base::TimeTicks now = base::TimeTicks::Now();
+  const base::TimeDelta cpu_time = PerformanceRecorder::ProcessCpuTime();
+  if (phase) {
+    PerformanceRecorder::Get()->AddPhase(
+        phase, now - phase_start_time_, cpu_time - phase_start_cpu_time_);
+    // What the finished phase freed is returned to the system before the next
+    // one starts, so that the resident memory falls between the phases.
+    MemoryBudget::TrimFreeMemory();
+    PerformanceRecorder::Get()->SetPhaseRss(
+        phase, PerformanceRecorder::ResidentMemory());
+  }
+  phase_start_time_ = now;
+  phase_start_cpu_time_ = cpu_time;
 }
 
 void UpdateAttempterAndroid::TerminateUpdateAndNotify(ErrorCode error_code) {
@@ -733,6 +1164,8 @@ void UpdateAttempterAndroid::TerminateUpdateAndNotify(ErrorCode error_code) {
   if (status_ == UpdateStatus::CLEANUP_PREVIOUS_UPDATE) {
     ClearUpdateCompletedMarker();
     LOG(INFO) << "Terminating cleanup previous update.";
+    metrics_reporter_->ReportPerformanceMetrics(
+        PerformanceRecorder::Get()->TakeReport());
     SetStatusAndNotify(UpdateStatus::IDLE);
     for (auto observer : daemon_state_->service_observers())
       observer->SendPayloadApplicationComplete(error_code);
@@ -742,6 +1175,8 @@ void UpdateAttempterAndroid::TerminateUpdateAndNotify(ErrorCode error_code) {
   boot_control_->GetDynamicPartitionControl()->Cleanup();
 
   download_progress_ = 0;
+  if (performance_mode_for_update_)
+    SetPerformanceMode(false, nullptr);
   UpdateStatus new_status =
       (error_code == ErrorCode::kSuccess ? UpdateStatus::UPDATED_NEED_REBOOT
                                          : UpdateStatus::IDLE);
@@ -770,7 +1205,12 @@ void UpdateAttempterAndroid::TerminateUpdateAndNotify(ErrorCode error_code) {
 }
 
 void UpdateAttempterAndroid::SetStatusAndNotify(UpdateStatus status) {
+  const bool status_changed = status != status_;
   status_ = status;
+  if (status_changed) {
+    status_start_time_ = TimeTicks::Now();
+    status_start_progress_ = download_progress_;
+  }
   size_t payload_size =
       install_plan_.payloads.empty() ? 0 : install_plan_.payloads[0].size;
   UpdateEngineStatus status_to_send = {.status = status_,
@@ -781,9 +1221,54 @@ void UpdateAttempterAndroid::SetStatusAndNotify(UpdateStatus status) {
     observer->SendStatusUpdate(status_to_send);
   }
   last_notify_time_ = TimeTicks::Now();
+  if (status_changed)
+    NotifyStats(true);
+}
+
+void UpdateAttempterAndroid::NotifyStats(bool force) {
+  const TimeTicks now = TimeTicks::Now();
+  if (!force && !last_stats_time_.is_null() &&
+      now - last_stats_time_ <
+          TimeDelta::FromSeconds(kStatsUpdateIntervalSeconds)) {
+    return;
+  }
+  const PerformanceReport::PartitionIo io =
+      PerformanceRecorder::Get()->TotalPartitionIo();
+  const double seconds =
+      last_stats_time_.is_null() ? 0 : (now - last_stats_time_).InSecondsF();
+  // The counters start over with each attempt.
+  auto rate = [seconds](uint64_t value, uint64_t last_value) {
+    return seconds > 0 && value > last_value ? (value - last_value) / seconds
+                                             : 0;
+  };
+  stats_.status = status_;
+  stats_.download_rate = rate(stats_.bytes_downloaded,
+                              last_stats_bytes_downloaded_);
+  stats_.apply_rate = rate(io.bytes_written, last_stats_bytes_written_);
+  stats_.verify_rate = status_ == UpdateStatus::VERIFYING
+                           ? rate(io.bytes_read, last_stats_bytes_read_)
+                           : 0;
+  stats_.eta_seconds = -1;
+  const double status_seconds = (now - status_start_time_).InSecondsF();
+  const double progress_rate =
+      status_seconds > 0
+          ? (download_progress_ - status_start_progress_) / status_seconds
+          : 0;
+  if (progress_rate > 0) {
+    stats_.eta_seconds = static_cast<int64_t>(
+        std::max(0.0, 1.0 - download_progress_) / progress_rate);
+  }
+
+  for (auto observer : daemon_state_->service_observers())
+    observer->SendStatsUpdate(stats_);
+  last_stats_time_ = now;
+  last_stats_bytes_downloaded_ = stats_.bytes_downloaded;
+  last_stats_bytes_written_ = io.bytes_written;
+  last_stats_bytes_read_ = io.bytes_read;
 }
 
-void UpdateAttempterAndroid::BuildUpdateActions(HttpFetcher* fetcher) {
+void UpdateAttempterAndroid::BuildUpdateActions(
+    HttpFetcher* fetcher, std::vector<HttpFetcher*> parallel_fetchers) {
   CHECK(!processor_->IsRunning());
 
   // Actions:
@@ -800,12 +1285,16 @@ void UpdateAttempterAndroid::BuildUpdateActions(HttpFetcher* fetcher) {
                                        fetcher,  // passes ownership
                                        true /* interactive */,
                                        update_certificates_path_);
+  for (HttpFetcher* parallel_fetcher : parallel_fetchers) {
+    download_action->AddParallelFetcher(parallel_fetcher);  // passes ownership
+  }
   download_action->set_delegate(this);
   download_action->set_base_offset(base_offset_);
   auto filesystem_verifier_action = std::make_unique<FilesystemVerifierAction>(
-      boot_control_->GetDynamicPartitionControl());
+      boot_control_->GetDynamicPartitionControl(), prefs_);
   auto postinstall_runner_action =
-      std::make_unique<PostinstallRunnerAction>(boot_control_, hardware_);
+      std::make_unique<PostinstallRunnerAction>(
+          boot_control_, hardware_, prefs_);
   filesystem_verifier_action->set_delegate(this);
   postinstall_runner_action->set_delegate(this);
 
@@ -859,6 +1348,8 @@ bool UpdateAttempterAndroid::UpdateCompletedOnThisBoot() {
 // Collect and report the android metrics when we terminate the update.
 void UpdateAttempterAndroid::CollectAndReportUpdateMetricsOnUpdateFinished(
     ErrorCode error_code) {
+  const PerformanceReport performance_report =
+      PerformanceRecorder::Get()->TakeReport();
   int64_t attempt_number =
       metrics_utils::GetPersistedValue(kPrefsPayloadAttemptNumber, prefs_);
   PayloadType payload_type = kPayloadTypeFull;
@@ -874,6 +1365,8 @@ void UpdateAttempterAndroid::CollectAndReportUpdateMetricsOnUpdateFinished(
   if (payload_size == 0) {
     return;
   }
+  last_performance_report_ =
+      performance_report.ToThroughputString(payload_size);
 
   metrics::AttemptResult attempt_result =
       metrics_utils::GetAttemptResult(error_code);
@@ -901,6 +1394,7 @@ void UpdateAttempterAndroid::CollectAndReportUpdateMetricsOnUpdateFinished(
       DownloadSource::kNumDownloadSources,
       metrics::DownloadErrorCode::kUnset,
       metrics::ConnectionType::kUnset);
+  metrics_reporter_->ReportPerformanceMetrics(performance_report);
 
   if (error_code == ErrorCode::kSuccess) {
     int64_t reboot_count =
@@ -1094,6 +1588,7 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
     const std::string& metadata_filename,
     const vector<string>& key_value_pair_headers,
     brillo::ErrorPtr* error) {
+  RunStartupTasks();
   DeltaArchiveManifest manifest;
   if (!VerifyPayloadParseManifest(metadata_filename, &manifest, error)) {
     return 0;
@@ -1103,28 +1598,41 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
     return 0;
   }
 
+  // apexd computes the space needed by the compressed APEXes while the
+  // partitions are prepared, instead of delaying them with its round trip.
   std::vector<ApexInfo> apex_infos(manifest.apex_info().begin(),
                                    manifest.apex_info().end());
-  uint64_t apex_size_required = 0;
+  std::optional<android::base::Result<uint64_t>> apex_result;
+  std::thread apex_thread;
   if (apex_handler_android_ != nullptr) {
-    auto result = apex_handler_android_->CalculateSize(apex_infos);
-    if (!result.ok()) {
+    apex_thread = std::thread([this, &apex_infos, &apex_result] {
+      apex_result = apex_handler_android_->CalculateSize(apex_infos);
+    });
+  }
+
+  string payload_id = GetPayloadId(headers);
+  uint64_t required_size = 0;
+  const bool prepared =
+      DeltaPerformer::PreparePartitionsForUpdate(prefs_,
+                                                 boot_control_,
+                                                 GetTargetSlot(),
+                                                 manifest,
+                                                 payload_id,
+                                                 &required_size);
+
+  uint64_t apex_size_required = 0;
+  if (apex_thread.joinable()) {
+    apex_thread.join();
+    if (!apex_result->ok()) {
       LogAndSetError(error,
                      FROM_HERE,
                      "Failed to calculate size required for compressed APEX");
       return 0;
     }
-    apex_size_required = *result;
+    apex_size_required = **apex_result;
   }
 
-  string payload_id = GetPayloadId(headers);
-  uint64_t required_size = 0;
-  if (!DeltaPerformer::PreparePartitionsForUpdate(prefs_,
-                                                  boot_control_,
-                                                  GetTargetSlot(),
-                                                  manifest,
-                                                  payload_id,
-                                                  &required_size)) {
+  if (!prepared) {
     if (required_size == 0) {
       LogAndSetError(error, FROM_HERE, "Failed to allocate space for payload.");
       return 0;
@@ -1143,6 +1651,27 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
     return apex_size_required;
   }
 
+  // The payload cache isn't preallocated, only check that it fits.
+  uint64_t payload_size = 0;
+  string cache_path;
+  struct statvfs cache_fs;
+  if (GetHeaderAsBool(headers[kPayloadPropertyPrefetchToDisk], false) &&
+      base::StringToUint64(headers[kPayloadPropertyFileSize], &payload_size) &&
+      GetPayloadCachePath(hardware_, &cache_path) &&
+      statvfs(base::FilePath(cache_path).DirName().value().c_str(),
+              &cache_fs) == 0) {
+    int64_t cached_size = 0;
+    base::GetFileSize(base::FilePath(cache_path), &cached_size);
+    const uint64_t available =
+        static_cast<uint64_t>(cache_fs.f_bavail) * cache_fs.f_frsize +
+        cached_size;
+    if (available < payload_size) {
+      LOG(ERROR) << "Insufficient space for the payload cache: "
+                 << payload_size - available << " bytes";
+      return payload_size - available;
+    }
+  }
+
   LOG(INFO) << "Successfully allocated space for payload.";
   return 0;
 }
@@ -1150,6 +1679,7 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
 void UpdateAttempterAndroid::CleanupSuccessfulUpdate(
     std::unique_ptr<CleanupSuccessfulUpdateCallbackInterface> callback,
     brillo::ErrorPtr* error) {
+  RunStartupTasks();
   if (cleanup_previous_update_code_.has_value()) {
     LOG(INFO) << "CleanupSuccessfulUpdate has previously completed with "
               << utils::ErrorCodeToString(*cleanup_previous_update_code_);
@@ -1173,6 +1703,7 @@ void UpdateAttempterAndroid::CleanupSuccessfulUpdate(
 bool UpdateAttempterAndroid::setShouldSwitchSlotOnReboot(
     const std::string& metadata_filename, brillo::ErrorPtr* error) {
   LOG(INFO) << "setShouldSwitchSlotOnReboot(" << metadata_filename << ")";
+  RunStartupTasks();
   if (processor_->IsRunning()) {
     return LogAndSetError(
         error, FROM_HERE, "Already processing an update, cancel it first.");
@@ -1215,9 +1746,10 @@ bool UpdateAttempterAndroid::setShouldSwitchSlotOnReboot(
 
   auto install_plan_action = std::make_unique<InstallPlanAction>(install_plan_);
   auto filesystem_verifier_action = std::make_unique<FilesystemVerifierAction>(
-      boot_control_->GetDynamicPartitionControl());
+      boot_control_->GetDynamicPartitionControl(), prefs_);
   auto postinstall_runner_action =
-      std::make_unique<PostinstallRunnerAction>(boot_control_, hardware_);
+      std::make_unique<PostinstallRunnerAction>(
+          boot_control_, hardware_, prefs_);
   SetStatusAndNotify(UpdateStatus::VERIFYING);
   filesystem_verifier_action->set_delegate(this);
   postinstall_runner_action->set_delegate(this);
@@ -1237,6 +1769,7 @@ bool UpdateAttempterAndroid::setShouldSwitchSlotOnReboot(
 
 bool UpdateAttempterAndroid::resetShouldSwitchSlotOnReboot(
     brillo::ErrorPtr* error) {
+  RunStartupTasks();
   if (processor_->IsRunning()) {
     return LogAndSetError(
         error, FROM_HERE, "Already processing an update, cancel it first.");
@@ -1279,6 +1812,7 @@ void UpdateAttempterAndroid::ScheduleCleanupPreviousUpdate() {
   processor_->EnqueueAction(std::move(action));
   processor_->set_delegate(this);
   SetStatusAndNotify(UpdateStatus::CLEANUP_PREVIOUS_UPDATE);
+  StartPerformancePhase();
   processor_->StartProcessing();
 }
 
@@ -25,6 +25,7 @@
 
 #include <android-base/unique_fd.h>
 #include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
 
 #include "update_engine/aosp/apex_handler_interface.h"
 #include "update_engine/aosp/service_delegate_android_interface.h"
@@ -71,6 +72,11 @@ class UpdateAttempterAndroid
 
   // Further initialization to be done post construction.
   void Init();
+  // Same as Init(), but only restores the status right away. The bookkeeping
+  // of the previous boot and the cleanup of the previous update are posted to
+  // the message loop, or run by the first call which needs them, so that they
+  // don't delay the daemon start.
+  void InitDeferred();
 
   // ServiceDelegateAndroidInterface overrides.
   bool ApplyPayload(const std::string& payload_url,
@@ -101,6 +107,10 @@ class UpdateAttempterAndroid
   bool resetShouldSwitchSlotOnReboot(brillo::ErrorPtr* error) override;
 
   bool SetPerformanceMode(bool enable, brillo::ErrorPtr* error) override;
+  bool SetMaxDownloadRate(uint64_t bytes_per_second,
+                          brillo::ErrorPtr* error) override;
+  bool GetLastPerformanceReport(std::string* report,
+                                brillo::ErrorPtr* error) override;
 
   // ActionProcessorDelegate methods:
   void ProcessingDone(const ActionProcessor* processor,
@@ -116,6 +126,9 @@ class UpdateAttempterAndroid
                      uint64_t total) override;
   bool ShouldCancel(ErrorCode* cancel_reason) override;
   void DownloadComplete() override;
+  void OperationsApplied(const std::string& partition,
+                         uint64_t operations_applied,
+                         uint64_t total_operations) override;
 
   // FilesystemVerifyDelegate overrides
   void OnVerifyProgressUpdate(double progress) override;
@@ -153,6 +166,10 @@ class UpdateAttempterAndroid
   // scheduled asynchronously to unblock the event loop.
   void ScheduleProcessingStart();
 
+  // Passes the thermal headroom to the CpuPolicy, every
+  // kThermalPollIntervalSeconds while the action processor is running.
+  void PollThermalHeadroom();
+
   // Notifies an update request completed with the given error |code| to all
   // observers.
   void TerminateUpdateAndNotify(ErrorCode error_code);
@@ -161,10 +178,16 @@ class UpdateAttempterAndroid
   // all observers.
   void SetStatusAndNotify(UpdateStatus status);
 
+  // Sends the live stats of the update to all observers, unless they were
+  // sent less than kStatsUpdateIntervalSeconds ago and |force| is false.
+  void NotifyStats(bool force);
+
   // Helper method to construct the sequence of actions to be performed for
-  // applying an update using a given HttpFetcher. The ownership of |fetcher| is
-  // passed to this function.
-  void BuildUpdateActions(HttpFetcher* fetcher);
+  // applying an update using a given HttpFetcher. The ownership of |fetcher|
+  // and |parallel_fetchers|, downloading parts of the payload along with
+  // |fetcher|, is passed to this function.
+  void BuildUpdateActions(HttpFetcher* fetcher,
+                          std::vector<HttpFetcher*> parallel_fetchers = {});
 
   // Writes to the processing completed marker. Does nothing if
   // |update_completed_marker_| is empty.
@@ -194,6 +217,11 @@ class UpdateAttempterAndroid
   //   |kPrefsSystemUpdatedMarker|
   void CollectAndReportUpdateMetricsOnUpdateFinished(ErrorCode error_code);
 
+  // Starts timing the next action, and records the time of the one of
+  // |action_type| into its PerformanceReport phase, if it has one.
+  void StartPerformancePhase();
+  void RecordPerformancePhase(const std::string& action_type);
+
   // This function is called after update_engine is started after device
   // reboots. If update_engine is restarted w/o device reboot, this function
   // would not be called.
@@ -229,6 +257,13 @@ class UpdateAttempterAndroid
   // Enqueue and run a CleanupPreviousUpdateAction.
   void ScheduleCleanupPreviousUpdate();
 
+  // Restores the status of a previous update, and returns whether the
+  // startup tasks must run.
+  bool RestoreStatus();
+  // Runs the startup tasks left by InitDeferred(), if any: the bookkeeping
+  // after a reboot and the cleanup of the previous update.
+  void RunStartupTasks();
+
   // Notify and clear |cleanup_previous_update_callbacks_|.
   void NotifyCleanupPreviousUpdateCallbacksAndClear();
 
@@ -263,6 +298,17 @@ class UpdateAttempterAndroid
   UpdateStatus status_{UpdateStatus::IDLE};
   double download_progress_{0.0};
 
+  // The live stats of the update, see NotifyStats().
+  update_engine::UpdateEngineStats stats_{};
+  // When |stats_| were last sent, and the bytes counted then.
+  base::TimeTicks last_stats_time_;
+  int64_t last_stats_bytes_downloaded_{0};
+  uint64_t last_stats_bytes_written_{0};
+  uint64_t last_stats_bytes_read_{0};
+  // When |status_| was entered, and its progress then.
+  base::TimeTicks status_start_time_;
+  double status_start_progress_{0.0};
+
   // The offset in the payload file where the CrAU part starts.
   int64_t base_offset_{0};
 
@@ -281,10 +327,30 @@ class UpdateAttempterAndroid
   // CleanupPreviousUpdateAction has not been executed.
   std::optional<ErrorCode> cleanup_previous_update_code_{std::nullopt};
 
+  // Whether the startup tasks of Init() are still to be run, and the task
+  // posted to run them.
+  bool startup_tasks_pending_{false};
+  brillo::MessageLoop::TaskId startup_tasks_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
+  // The task posted to run PollThermalHeadroom(), if any.
+  brillo::MessageLoop::TaskId thermal_poll_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
   // The path to the zip file with X509 certificates.
   std::string update_certificates_path_{constants::kUpdateCertificatesPath};
 
   bool performance_mode_ = false;
+  // Whether |performance_mode_| was set by the PERFORMANCE_MODE property of
+  // the current update, and should be reset when it terminates.
+  bool performance_mode_for_update_ = false;
+
+  // When the running action started, see StartPerformancePhase().
+  base::TimeTicks phase_start_time_;
+  base::TimeDelta phase_start_cpu_time_;
+  // The PerformanceReport::ToThroughputString() of the last update which
+  // finished, returned by GetLastPerformanceReport().
+  std::string last_performance_report_;
 
   DISALLOW_COPY_AND_ASSIGN(UpdateAttempterAndroid);
 };
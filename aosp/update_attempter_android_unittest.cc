@@ -43,6 +43,7 @@
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/mock_action_processor.h"
 #include "update_engine/common/mock_metrics_reporter.h"
+#include "update_engine/common/mock_service_observer.h"
 #include "update_engine/common/prefs.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/testing_constants.h"
@@ -59,6 +60,7 @@
 using base::Time;
 using base::TimeDelta;
 using testing::_;
+using update_engine::UpdateEngineStats;
 using update_engine::UpdateStatus;
 
 namespace chromeos_update_engine {
@@ -85,6 +87,10 @@ class UpdateAttempterAndroidTest : public ::testing::Test {
     update_attempter_android_.status_ = status;
   }
 
+  const UpdateEngineStats& stats() const {
+    return update_attempter_android_.stats_;
+  }
+
   void AddPayload(InstallPlan::Payload&& payload) {
     update_attempter_android_.install_plan_.payloads.push_back(
         std::move(payload));
@@ -130,6 +136,29 @@ TEST_F(UpdateAttempterAndroidTest, UpdatePrefsSameBuildVersionOnInit) {
   ASSERT_EQ(2, reboot_count);
 }
 
+TEST_F(UpdateAttempterAndroidTest, UpdatePrefsDeferredOnInit) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  std::string build_version =
+      android::base::GetProperty("ro.build.version.incremental", "");
+  prefs_.SetString(kPrefsPreviousVersion, build_version);
+  prefs_.SetString(kPrefsBootId, "oldboot");
+  prefs_.SetInt64(kPrefsNumReboots, 1);
+  prefs_.SetInt64(kPrefsPreviousSlot, 1);
+  boot_control_.SetCurrentSlot(1);
+
+  update_attempter_android_.InitDeferred();
+  int64_t reboot_count;
+  ASSERT_TRUE(prefs_.GetInt64(kPrefsNumReboots, &reboot_count));
+  EXPECT_EQ(1, reboot_count);
+
+  // The bookkeeping runs from the message loop, only once.
+  EXPECT_TRUE(loop.RunOnce(false));
+  ASSERT_TRUE(prefs_.GetInt64(kPrefsNumReboots, &reboot_count));
+  EXPECT_EQ(2, reboot_count);
+  EXPECT_FALSE(loop.RunOnce(false));
+}
+
 TEST_F(UpdateAttempterAndroidTest, UpdatePrefsBuildVersionChangeOnInit) {
   prefs_.SetString(kPrefsPreviousVersion, "00001");  // Set the fake version
   prefs_.SetInt64(kPrefsPayloadAttemptNumber, 1);
@@ -248,6 +277,29 @@ TEST_F(UpdateAttempterAndroidTest, ReportMetricsForBytesDownloaded) {
       0, metrics_utils::GetPersistedValue(kPrefsTotalBytesDownloaded, &prefs_));
 }
 
+TEST_F(UpdateAttempterAndroidTest, SendsStatsAtMostOnceASecond) {
+  testing::NiceMock<MockServiceObserver> observer;
+  daemon_state_.AddObserver(&observer);
+  UpdateEngineStats stats{};
+  EXPECT_CALL(observer, SendStatsUpdate(_))
+      .WillOnce(testing::SaveArg<0>(&stats));
+
+  // Entering DOWNLOADING sends the stats immediately, the progress right
+  // after it only updates them.
+  update_attempter_android_.BytesReceived(20, 50, 200);
+  update_attempter_android_.OperationsApplied("system", 3, 10);
+  update_attempter_android_.BytesReceived(10, 60, 200);
+  daemon_state_.RemoveObserver(&observer);
+
+  EXPECT_EQ(UpdateStatus::DOWNLOADING, stats.status);
+  EXPECT_EQ(50, stats.bytes_downloaded);
+  EXPECT_EQ(200, stats.bytes_total);
+  EXPECT_EQ(-1, stats.eta_seconds);
+  EXPECT_EQ("system", stats().partition);
+  EXPECT_EQ(3, stats().operations_applied);
+  EXPECT_EQ(60, stats().bytes_downloaded);
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
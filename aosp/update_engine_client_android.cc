@@ -14,6 +14,7 @@
 // limitations under the License.
 //
 
+#include <stdio.h>
 #include <sysexits.h>
 #include <unistd.h>
 
@@ -38,6 +39,7 @@
 #include "android/os/BnUpdateEngineCallback.h"
 #include "android/os/IUpdateEngine.h"
 #include "update_engine/client_library/include/update_engine/update_status.h"
+#include "update_engine/common/constants.h"
 #include "update_engine/common/error_code.h"
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/update_status_utils.h"
@@ -55,6 +57,10 @@ class UpdateEngineClientAndroid : public brillo::Daemon {
   int ExitWhenIdle(const Status& status);
   int ExitWhenIdle(int return_code);
 
+  // Prints the performance report of the benchmarked update which finished
+  // with |code|, resets it and exits.
+  void FinishBenchmark(ErrorCode code);
+
  private:
   class UECallback : public android::os::BnUpdateEngineCallback {
    public:
@@ -85,6 +91,9 @@ class UpdateEngineClientAndroid : public brillo::Daemon {
   android::sp<android::os::BnUpdateEngineCallback> callback_;
   android::sp<android::os::BnUpdateEngineCallback> cleanup_callback_;
 
+  // Whether the update applied is a --benchmark one.
+  bool benchmark_{false};
+
   brillo::BinderWatcher binder_watcher_;
 };
 
@@ -102,6 +111,10 @@ Status UpdateEngineClientAndroid::UECallback::onPayloadApplicationComplete(
   ErrorCode code = static_cast<ErrorCode>(error_code);
   LOG(INFO) << "onPayloadApplicationComplete(" << utils::ErrorCodeToString(code)
             << " (" << error_code << "))";
+  if (client_->benchmark_) {
+    client_->FinishBenchmark(code);
+    return Status::ok();
+  }
   client_->ExitWhenIdle(
       (code == ErrorCode::kSuccess || code == ErrorCode::kUpdatedButNotActive)
           ? EX_OK
@@ -127,6 +140,11 @@ int UpdateEngineClientAndroid::OnInit() {
     return ret;
 
   DEFINE_bool(update, false, "Start a new update, if no update in progress.");
+  DEFINE_bool(benchmark,
+              false,
+              "Apply the payload to the inactive slot without switching to "
+              "it, print the throughput of each phase of the update and "
+              "reset it. Uses --payload, --offset, --size and --headers.");
   DEFINE_string(payload,
                 "http://127.0.0.1:8080/payload",
                 "The URI to the update payload to use.");
@@ -141,7 +159,7 @@ int UpdateEngineClientAndroid::OnInit() {
   DEFINE_string(headers,
                 "",
                 "A list of key-value pairs, one element of the list per line. "
-                "Used when --update or --allocate is passed.");
+                "Used when --update, --benchmark or --allocate is passed.");
 
   DEFINE_bool(verify,
               false,
@@ -170,6 +188,10 @@ int UpdateEngineClientAndroid::OnInit() {
               "Wait for previous update to merge. "
               "Only available after rebooting to new slot.");
   DEFINE_bool(perf_mode, false, "Enable perf mode.");
+  DEFINE_int64(max_download_rate,
+               -1,
+               "Limit the download to this many bytes per second, 0 for no "
+               "limit.");
   // Boilerplate init commands.
   base::CommandLine::Init(argc_, argv_);
   brillo::FlagHelper::Init(argc_, argv_, "Android Update Engine Client");
@@ -297,6 +319,40 @@ int UpdateEngineClientAndroid::OnInit() {
     return ExitWhenIdle(service_->setPerformanceMode(true));
   }
 
+  if (FLAGS_max_download_rate >= 0) {
+    return ExitWhenIdle(
+        service_->setMaxDownloadRate(FLAGS_max_download_rate));
+  }
+
+  if (FLAGS_benchmark) {
+    callback_ = new UECallback(this);
+    bool bound;
+    if (!service_->bind(callback_, &bound).isOk() || !bound) {
+      LOG(ERROR) << "Failed to bind() the UpdateEngine daemon.";
+      return 1;
+    }
+    benchmark_ = true;
+    // The benchmark never switches slots, whatever the headers say.
+    const std::string switch_slot_header =
+        std::string(kPayloadPropertySwitchSlotOnReboot) + "=";
+    std::vector<android::String16> and_headers;
+    for (const auto& header : ParseHeaders(FLAGS_headers)) {
+      if (!android::String8{header}.startsWith(switch_slot_header.c_str()))
+        and_headers.push_back(header);
+    }
+    const std::string no_switch_header = switch_slot_header + "0";
+    and_headers.push_back(android::String16{no_switch_header.data(),
+                                            no_switch_header.size()});
+    Status status = service_->applyPayload(
+        android::String16{FLAGS_payload.data(), FLAGS_payload.size()},
+        FLAGS_offset,
+        FLAGS_size,
+        and_headers);
+    if (!status.isOk())
+      return ExitWhenIdle(status);
+    keep_running = true;
+  }
+
   if (FLAGS_update) {
     auto and_headers = ParseHeaders(FLAGS_headers);
     Status status = service_->applyPayload(
@@ -330,6 +386,27 @@ int UpdateEngineClientAndroid::ExitWhenIdle(int return_code) {
   return EX_OK;
 }
 
+void UpdateEngineClientAndroid::FinishBenchmark(ErrorCode code) {
+  benchmark_ = false;
+  const bool success =
+      code == ErrorCode::kSuccess || code == ErrorCode::kUpdatedButNotActive;
+  android::String16 report;
+  Status status = service_->getLastPerformanceReport(&report);
+  if (status.isOk()) {
+    printf("Benchmark %s\n%s\n",
+           success ? "succeeded" : "failed",
+           android::String8{report}.string());
+  } else {
+    LOG(ERROR) << "Failed to get the performance report: "
+               << status.toString8();
+  }
+  status = service_->resetStatus();
+  if (!status.isOk() || !success)
+    ExitWhenIdle(status.isOk() ? 1 : status.exceptionCode());
+  else
+    ExitWhenIdle(EX_OK);
+}
+
 void UpdateEngineClientAndroid::UpdateEngineServiceDied() {
   LOG(ERROR) << "UpdateEngineService died.";
   QuitWithExitCode(1);
@@ -95,6 +95,28 @@ struct UpdateEngineStatus {
   bool will_powerwash_after_reboot;
 };
 
+// The live progress of an update, sent at most once a second while it
+// progresses.
+struct UpdateEngineStats {
+  UpdateStatus status;
+  // The partition whose operations are applied, empty before the first one.
+  std::string partition;
+  // The operations applied so far, of all the partitions.
+  int64_t operations_applied;
+  int64_t operations_total;
+  int64_t bytes_downloaded;
+  int64_t bytes_total;
+  // In bytes per second since the previous stats. |apply_rate| counts the
+  // bytes written to the target partitions and |verify_rate| the ones read
+  // back while VERIFYING.
+  double download_rate;
+  double apply_rate;
+  double verify_rate;
+  // The estimated seconds until the end of |status|, from the rate of its
+  // progress so far, or -1 if not known yet.
+  int64_t eta_seconds;
+};
+
 }  // namespace update_engine
 
 #endif  // UPDATE_ENGINE_CLIENT_LIBRARY_INCLUDE_UPDATE_ENGINE_UPDATE_STATUS_H_
@@ -16,6 +16,7 @@
 
 #include "update_engine/common/action_processor.h"
 
+#include <algorithm>
 #include <string>
 #include <utility>
 
@@ -23,9 +24,11 @@
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/error_code_utils.h"
+#include "update_engine/common/trace.h"
 
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 namespace chromeos_update_engine {
 
@@ -35,53 +38,108 @@ ActionProcessor::~ActionProcessor() {
 }
 
 void ActionProcessor::EnqueueAction(unique_ptr<AbstractAction> action) {
+  vector<AbstractAction*> dependencies;
+  if (last_enqueued_action_)
+    dependencies.push_back(last_enqueued_action_);
+  EnqueueAction(std::move(action), dependencies);
+}
+
+void ActionProcessor::EnqueueAction(
+    unique_ptr<AbstractAction> action,
+    const vector<AbstractAction*>& dependencies) {
   action->SetProcessor(this);
+  // Only keep the dependencies that didn't complete yet, they are removed from
+  // |dependencies_| as they complete.
+  vector<AbstractAction*> pending_dependencies;
+  for (AbstractAction* dependency : dependencies) {
+    const bool enqueued =
+        IsActionRunning(dependency) ||
+        std::any_of(actions_.begin(),
+                    actions_.end(),
+                    [dependency](const auto& action) {
+                      return action.get() == dependency;
+                    });
+    if (enqueued)
+      pending_dependencies.push_back(dependency);
+  }
+  if (!pending_dependencies.empty())
+    dependencies_[action.get()] = std::move(pending_dependencies);
+  last_enqueued_action_ = action.get();
   actions_.push_back(std::move(action));
 }
 
+vector<AbstractAction*> ActionProcessor::running_actions() const {
+  vector<AbstractAction*> actions;
+  for (const auto& action : running_actions_)
+    actions.push_back(action.get());
+  return actions;
+}
+
+bool ActionProcessor::IsActionRunning(const AbstractAction* action) const {
+  return std::any_of(
+      running_actions_.begin(),
+      running_actions_.end(),
+      [action](const auto& running) { return running.get() == action; });
+}
+
 bool ActionProcessor::IsRunning() const {
-  return current_action_ != nullptr || suspended_;
+  return !running_actions_.empty() || suspended_;
 }
 
 void ActionProcessor::StartProcessing() {
   CHECK(!IsRunning());
-  if (!actions_.empty()) {
-    current_action_ = std::move(actions_.front());
-    actions_.pop_front();
-    LOG(INFO) << "ActionProcessor: starting " << current_action_->Type();
-    current_action_->PerformAction();
-  }
+  stopped_ = false;
+  last_error_code_ = ErrorCode::kSuccess;
+  if (!actions_.empty())
+    StartReadyActionsOrFinish();
 }
 
 void ActionProcessor::StopProcessing() {
   CHECK(IsRunning());
-  if (current_action_) {
-    current_action_->TerminateProcessing();
-  }
-  LOG(INFO) << "ActionProcessor: aborted "
-            << (current_action_ ? current_action_->Type() : "")
+  string types;
+  for (const auto& action : running_actions_)
+    types += (types.empty() ? "" : ", ") + action->Type();
+  // Delete all the actions before calling the delegate.
+  TerminateActions();
+  LOG(INFO) << "ActionProcessor: aborted " << types
             << (suspended_ ? " while suspended" : "");
-  current_action_.reset();
   suspended_ = false;
-  // Delete all the actions before calling the delegate.
-  actions_.clear();
+  stopped_ = true;
   if (delegate_)
     delegate_->ProcessingStopped(this);
 }
 
+void ActionProcessor::TerminateActions() {
+  // Terminating an action must not start the next ones.
+  auto running_actions = std::move(running_actions_);
+  running_actions_.clear();
+  for (const auto& action : running_actions) {
+    action->TerminateProcessing();
+    UE_TRACE_ASYNC_END(action->Type().c_str(), 0);
+  }
+  running_actions.clear();
+  actions_.clear();
+  dependencies_.clear();
+  last_enqueued_action_ = nullptr;
+}
+
 void ActionProcessor::SuspendProcessing() {
-  // No current_action_ when not suspended means that the action processor was
+  // No running actions when not suspended means that the action processor was
   // never started or already finished.
-  if (suspended_ || !current_action_) {
+  if (suspended_ || running_actions_.empty()) {
     LOG(WARNING) << "Called SuspendProcessing while not processing.";
     return;
   }
   suspended_ = true;
 
-  // If there's a current action we should notify it that it should suspend, but
-  // the action can ignore that and terminate at any point.
-  LOG(INFO) << "ActionProcessor: suspending " << current_action_->Type();
-  current_action_->SuspendAction();
+  // If there are running actions we should notify them that they should
+  // suspend, but the actions can ignore that and terminate at any point.
+  for (AbstractAction* action : running_actions()) {
+    if (!IsActionRunning(action))
+      continue;
+    LOG(INFO) << "ActionProcessor: suspending " << action->Type();
+    action->SuspendAction();
+  }
 }
 
 void ActionProcessor::ResumeProcessing() {
@@ -90,58 +148,91 @@ void ActionProcessor::ResumeProcessing() {
     return;
   }
   suspended_ = false;
-  if (current_action_) {
-    // The current_action_ did not call ActionComplete while suspended, so we
-    // should notify it of the resume operation.
-    LOG(INFO) << "ActionProcessor: resuming " << current_action_->Type();
-    current_action_->ResumeAction();
-  } else {
-    // The last action called ActionComplete while suspended, so there is
-    // already a log message with the type of the finished action. We simply
-    // state that we are resuming processing and the next function will log the
-    // start of the next action or processing completion.
-    LOG(INFO) << "ActionProcessor: resuming processing";
-    StartNextActionOrFinish(suspended_error_code_);
+  // The running actions did not call ActionComplete while suspended, so we
+  // should notify them of the resume operation. The actions that called
+  // ActionComplete while suspended already logged their type, so we simply
+  // state that we are resuming processing and the next function will log the
+  // start of the next actions or processing completion.
+  LOG(INFO) << "ActionProcessor: resuming processing";
+  for (AbstractAction* action : running_actions()) {
+    if (!IsActionRunning(action))
+      continue;
+    LOG(INFO) << "ActionProcessor: resuming " << action->Type();
+    action->ResumeAction();
   }
+  if (!suspended_)
+    StartReadyActionsOrFinish();
 }
 
 void ActionProcessor::ActionComplete(AbstractAction* actionptr,
                                      ErrorCode code) {
-  CHECK_EQ(actionptr, current_action_.get());
+  auto it = std::find_if(
+      running_actions_.begin(),
+      running_actions_.end(),
+      [actionptr](const auto& action) { return action.get() == actionptr; });
+  CHECK(it != running_actions_.end());
   if (delegate_)
     delegate_->ActionCompleted(this, actionptr, code);
-  string old_type = current_action_->Type();
-  current_action_->ActionCompleted(code);
-  current_action_.reset();
-  LOG(INFO) << "ActionProcessor: finished "
-            << (actions_.empty() ? "last action " : "") << old_type
-            << (suspended_ ? " while suspended" : "") << " with code "
-            << utils::ErrorCodeToString(code);
-  if (!actions_.empty() && code != ErrorCode::kSuccess) {
+  string old_type = actionptr->Type();
+  UE_TRACE_ASYNC_END(old_type.c_str(), 0);
+  actionptr->ActionCompleted(code);
+  unique_ptr<AbstractAction> completed = std::move(*it);
+  running_actions_.erase(it);
+  for (auto dep = dependencies_.begin(); dep != dependencies_.end();) {
+    auto& pending = dep->second;
+    pending.erase(std::remove(pending.begin(), pending.end(), actionptr),
+                  pending.end());
+    dep = pending.empty() ? dependencies_.erase(dep) : std::next(dep);
+  }
+  if (last_enqueued_action_ == actionptr)
+    last_enqueued_action_ = nullptr;
+  completed.reset();
+  const bool last = actions_.empty() && running_actions_.empty();
+  LOG(INFO) << "ActionProcessor: finished " << (last ? "last action " : "")
+            << old_type << (suspended_ ? " while suspended" : "")
+            << " with code " << utils::ErrorCodeToString(code);
+  last_error_code_ = code;
+  if (!last && code != ErrorCode::kSuccess) {
     LOG(INFO) << "ActionProcessor: Aborting processing due to failure.";
-    actions_.clear();
+    TerminateActions();
   }
   if (suspended_) {
-    // If an action finished while suspended we don't start the next action (or
-    // terminate the processing) until the processor is resumed. This condition
-    // will be flagged by a nullptr current_action_ while suspended_ is true.
-    suspended_error_code_ = code;
+    // If an action finished while suspended we don't start the next actions
+    // (or terminate the processing) until the processor is resumed. This
+    // condition will be flagged by no running action while suspended_ is true.
     return;
   }
-  StartNextActionOrFinish(code);
+  StartReadyActionsOrFinish();
 }
 
-void ActionProcessor::StartNextActionOrFinish(ErrorCode code) {
-  if (actions_.empty()) {
-    if (delegate_) {
-      delegate_->ProcessingDone(this, code);
-    }
+void ActionProcessor::StartReadyActionsOrFinish() {
+  if (starting_actions_) {
+    // The actions completed right away, the outer call starts the next ones.
     return;
   }
-  current_action_ = std::move(actions_.front());
-  actions_.pop_front();
-  LOG(INFO) << "ActionProcessor: starting " << current_action_->Type();
-  current_action_->PerformAction();
+  starting_actions_ = true;
+  while (!suspended_) {
+    auto it = std::find_if(
+        actions_.begin(), actions_.end(), [this](const auto& action) {
+          return dependencies_.find(action.get()) == dependencies_.end();
+        });
+    if (it == actions_.end())
+      break;
+    running_actions_.push_back(std::move(*it));
+    actions_.erase(it);
+    AbstractAction* action = running_actions_.back().get();
+    LOG(INFO) << "ActionProcessor: starting " << action->Type();
+    UE_TRACE_ASYNC_BEGIN(action->Type().c_str(), 0);
+    action->PerformAction();
+  }
+  starting_actions_ = false;
+  if (suspended_ || stopped_ || !running_actions_.empty())
+    return;
+  // Actions can only depend on the actions enqueued before them, so no action
+  // is left once none is running.
+  CHECK(actions_.empty());
+  if (delegate_)
+    delegate_->ProcessingDone(this, last_error_code_);
 }
 
 }  // namespace chromeos_update_engine
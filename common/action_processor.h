@@ -18,6 +18,7 @@
 #define UPDATE_ENGINE_COMMON_ACTION_PROCESSOR_H_
 
 #include <deque>
+#include <map>
 #include <memory>
 #include <vector>
 
@@ -36,7 +37,9 @@
 
 // See action.h for an overview of this class and other Action* classes.
 
-// An ActionProcessor keeps a queue of Actions and processes them in order.
+// An ActionProcessor keeps a queue of Actions and processes them in order. An
+// Action can instead depend on any Actions enqueued before it, in which case
+// Actions that don't depend on each other run at the same time.
 
 namespace chromeos_update_engine {
 
@@ -54,17 +57,17 @@ class ActionProcessor {
   // delegate.
   virtual void StartProcessing();
 
-  // Aborts processing. If an Action is running, it will have
-  // TerminateProcessing() called on it. The Action that was running and all the
-  // remaining actions will be lost and must be re-enqueued if this Processor is
-  // to use it.
+  // Aborts processing. The running Actions will have TerminateProcessing()
+  // called on them. The Actions that were running and all the remaining
+  // actions will be lost and must be re-enqueued if this Processor is to use
+  // them.
   void StopProcessing();
 
-  // Suspend the processing. If an Action is running, it will have the
-  // SuspendProcessing() called on it, and it should suspend operations until
-  // ResumeProcessing() is called on this class to continue. While suspended,
-  // no new actions will be started. Calling SuspendProcessing while the
-  // processing is suspended or not running this method performs no action.
+  // Suspend the processing. The running Actions will have the
+  // SuspendProcessing() called on them, and they should suspend operations
+  // until ResumeProcessing() is called on this class to continue. While
+  // suspended, no new actions will be started. Calling SuspendProcessing while
+  // the processing is suspended or not running this method performs no action.
   void SuspendProcessing();
 
   // Resume the suspended processing. If the ActionProcessor is not suspended
@@ -75,45 +78,78 @@ class ActionProcessor {
   // stopped.
   bool IsRunning() const;
 
-  // Adds another Action to the end of the queue.
+  // Adds another Action to the end of the queue. It starts once the Action
+  // enqueued before it, if any, completed.
   virtual void EnqueueAction(std::unique_ptr<AbstractAction> action);
 
+  // Adds another Action to the end of the queue, which starts once all its
+  // |dependencies| completed instead. They must be Actions enqueued in this
+  // processor before it. With no |dependencies|, it starts right away.
+  void EnqueueAction(std::unique_ptr<AbstractAction> action,
+                     const std::vector<AbstractAction*>& dependencies);
+
   // Sets/gets the current delegate. Set to null to remove a delegate.
   ActionProcessorDelegate* delegate() const { return delegate_; }
   void set_delegate(ActionProcessorDelegate* delegate) { delegate_ = delegate; }
 
-  // Returns a pointer to the current Action that's processing.
-  AbstractAction* current_action() const { return current_action_.get(); }
+  // Returns a pointer to the Action processing for the longest time, if any.
+  AbstractAction* current_action() const {
+    return running_actions_.empty() ? nullptr : running_actions_.front().get();
+  }
+
+  // Returns the Actions that are processing, in the order they started.
+  std::vector<AbstractAction*> running_actions() const;
+
+  // Returns whether |action| is processing.
+  bool IsActionRunning(const AbstractAction* action) const;
 
   // Called by an action to notify processor that it's done. Caller passes self.
   // But this call deletes the action if there no other object has a reference
   // to it, so in that case, the caller should not try to access any of its
-  // member variables after this call.
+  // member variables after this call. An Action failing terminates the other
+  // running Actions and aborts the processing.
   virtual void ActionComplete(AbstractAction* actionptr, ErrorCode code);
 
  private:
   FRIEND_TEST(ActionProcessorTest, ChainActionsTest);
 
-  // Continue processing actions (if any) after the last action terminated with
-  // the passed error code. If there are no more actions to process, the
-  // processing will terminate.
-  void StartNextActionOrFinish(ErrorCode code);
+  // Starts the actions whose dependencies all completed, if any. If there are
+  // no more actions to process, the processing will terminate with the error
+  // code of the last action.
+  void StartReadyActionsOrFinish();
+
+  // Terminates and deletes the running actions and the remaining ones.
+  void TerminateActions();
 
   // Actions that have not yet begun processing, in the order in which
-  // they'll be processed.
+  // they were enqueued.
   std::deque<std::unique_ptr<AbstractAction>> actions_;
 
-  // A pointer to the currently processing Action, if any.
-  std::unique_ptr<AbstractAction> current_action_;
+  // The actions in |actions_| which still wait for other actions to complete,
+  // and those actions.
+  std::map<const AbstractAction*, std::vector<AbstractAction*>> dependencies_;
 
-  // The ErrorCode reported by an action that was suspended but finished while
-  // being suspended. This error code is stored here to be reported back to the
-  // delegate once the processor is resumed.
-  ErrorCode suspended_error_code_{ErrorCode::kSuccess};
+  // The last action enqueued, if it didn't complete yet.
+  AbstractAction* last_enqueued_action_{nullptr};
+
+  // The currently processing Actions, in the order they started.
+  std::vector<std::unique_ptr<AbstractAction>> running_actions_;
+
+  // The ErrorCode reported by the last action that finished. When an action
+  // finishes while being suspended, it's reported back to the delegate once
+  // the processor is resumed.
+  ErrorCode last_error_code_{ErrorCode::kSuccess};
 
   // Whether the action processor is or should be suspended.
   bool suspended_{false};
 
+  // Whether StartReadyActionsOrFinish() is starting actions, which might
+  // complete right away and get here again.
+  bool starting_actions_{false};
+
+  // Whether the processing was stopped since it last started.
+  bool stopped_{false};
+
   // A pointer to the delegate, or null if none.
   ActionProcessorDelegate* delegate_{nullptr};
 
@@ -185,6 +185,52 @@ TEST_F(ActionProcessorTest, ChainActionsTest) {
   EXPECT_FALSE(action_processor_.IsRunning());
 }
 
+TEST_F(ActionProcessorTest, ConcurrentActionsTest) {
+  // This test doesn't use a delegate since it completes several actions.
+  action_processor_.set_delegate(nullptr);
+
+  auto action0 = std::make_unique<ActionProcessorTestAction>();
+  auto action1 = std::make_unique<ActionProcessorTestAction>();
+  auto action2 = std::make_unique<ActionProcessorTestAction>();
+  auto action0_ptr = action0.get();
+  auto action1_ptr = action1.get();
+  auto action2_ptr = action2.get();
+  action_processor_.EnqueueAction(std::move(action0), {});
+  action_processor_.EnqueueAction(std::move(action1), {});
+  action_processor_.EnqueueAction(std::move(action2),
+                                  {action0_ptr, action1_ptr});
+
+  action_processor_.StartProcessing();
+  EXPECT_TRUE(action0_ptr->IsRunning());
+  EXPECT_TRUE(action1_ptr->IsRunning());
+  EXPECT_FALSE(action2_ptr->IsRunning());
+  action1_ptr->CompleteAction();
+  EXPECT_EQ(action0_ptr, action_processor_.current_action());
+  EXPECT_FALSE(action2_ptr->IsRunning());
+  action0_ptr->CompleteAction();
+  EXPECT_EQ(action2_ptr, action_processor_.current_action());
+  EXPECT_EQ(1u, action_processor_.running_actions().size());
+  action2_ptr->CompleteAction();
+  EXPECT_FALSE(action_processor_.IsRunning());
+}
+
+TEST_F(ActionProcessorTest, FailureTerminatesConcurrentActionsTest) {
+  action_processor_.EnqueueAction(std::move(mock_action_), {});
+  action_processor_.EnqueueAction(std::move(action_), {});
+  action_processor_.EnqueueAction(std::make_unique<ActionProcessorTestAction>(),
+                                  {action_ptr_});
+
+  EXPECT_CALL(*mock_action_ptr_, PerformAction());
+  action_processor_.StartProcessing();
+  EXPECT_EQ(2u, action_processor_.running_actions().size());
+
+  EXPECT_CALL(*mock_action_ptr_, TerminateProcessing());
+  action_processor_.ActionComplete(action_ptr_, ErrorCode::kError);
+  EXPECT_TRUE(delegate_.processing_done_called_);
+  EXPECT_EQ(ErrorCode::kError, delegate_.action_exit_code_);
+  EXPECT_FALSE(action_processor_.IsRunning());
+}
+
 TEST_F(ActionProcessorTest, DefaultDelegateTest) {
   // Just make sure it doesn't crash.
   action_processor_.EnqueueAction(std::move(action_));
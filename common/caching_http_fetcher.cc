@@ -0,0 +1,508 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/caching_http_fetcher.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/utils.h"
+
+using brillo::MessageLoop;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The most bytes passed to the delegate at once.
+constexpr uint64_t kDeliverySize = 256 * 1024;
+// The cached bytes are passed to the delegate straight from a mapping of this
+// many bytes of the cache file, instead of being copied out of it.
+constexpr uint64_t kMapWindowSize = 16 * 1024 * 1024;
+// How many downloaded bytes may be lost if the device reboots before the
+// cached ranges are recorded again.
+constexpr uint64_t kSaveRangesInterval = 16 * 1024 * 1024;
+
+string RangesPath(const string& cache_path) {
+  return cache_path + ".ranges";
+}
+}  // namespace
+
+CachingHttpFetcher::CachingHttpFetcher(HttpFetcher* base_fetcher,
+                                       const string& cache_path,
+                                       const string& cache_id)
+    : HttpFetcher(base_fetcher->proxy_resolver()),
+      base_fetcher_(base_fetcher),
+      cache_path_(cache_path),
+      cache_id_(cache_id) {
+  base_fetcher_->set_delegate(this);
+}
+
+CachingHttpFetcher::~CachingHttpFetcher() {
+  LOG_IF(ERROR, transfer_active_)
+      << "Destroying the fetcher while a transfer is in progress.";
+  if (deliver_task_id_ != MessageLoop::kTaskIdNull)
+    MessageLoop::current()->CancelTask(deliver_task_id_);
+  UnmapWindow();
+  if (cache_fd_ >= 0) {
+    SaveRanges();
+    IGNORE_EINTR(close(cache_fd_));
+  }
+}
+
+// static
+void CachingHttpFetcher::DeleteCache(const string& cache_path) {
+  for (const string& path : {RangesPath(cache_path), cache_path}) {
+    if (unlink(path.c_str()) != 0 && errno != ENOENT)
+      PLOG(WARNING) << "Unable to delete " << path;
+  }
+}
+
+uint64_t CachingHttpFetcher::cached_bytes() const {
+  uint64_t bytes = 0;
+  for (const auto& range : cached_ranges_)
+    bytes += range.second - range.first;
+  return bytes;
+}
+
+void CachingHttpFetcher::BeginTransfer(const string& url) {
+  CHECK(!transfer_active_) << "BeginTransfer but already active.";
+  CHECK(!passthrough_) << "BeginTransfer but already active.";
+  url_ = url;
+  http_response_code_ = 0;
+
+  if (length_ == 0 || !OpenCache()) {
+    passthrough_ = true;
+    base_fetcher_->SetOffset(offset_);
+    if (length_)
+      base_fetcher_->SetLength(length_);
+    else
+      base_fetcher_->UnsetLength();
+    base_fetcher_->BeginTransfer(url);
+    return;
+  }
+
+  transfer_active_ = true;
+  download_failed_ = false;
+  deliver_offset_ = offset_;
+  end_offset_ = offset_ + length_;
+  LOG(INFO) << "Serving bytes " << deliver_offset_ << " to " << end_offset_
+            << " through " << cache_path_ << ", " << cached_bytes()
+            << " bytes are cached.";
+  MaybeStartDownload();
+  ScheduleDelivery();
+}
+
+void CachingHttpFetcher::TerminateTransfer() {
+  if (passthrough_) {
+    base_fetcher_->TerminateTransfer();
+    return;
+  }
+  if (!transfer_active_) {
+    LOG(INFO) << "Called TerminateTransfer but not active.";
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+    return;
+  }
+  if (terminating_)
+    return;
+  terminating_ = true;
+  if (deliver_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(deliver_task_id_);
+    deliver_task_id_ = MessageLoop::kTaskIdNull;
+  }
+  if (download_active_) {
+    // The download ends in TransferTerminated().
+    base_fetcher_->TerminateTransfer();
+    return;
+  }
+  MaybeFinishTermination();
+}
+
+void CachingHttpFetcher::Pause() {
+  if (passthrough_) {
+    base_fetcher_->Pause();
+    return;
+  }
+  if (paused_) {
+    LOG(ERROR) << "Fetcher already paused.";
+    return;
+  }
+  paused_ = true;
+  if (deliver_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(deliver_task_id_);
+    deliver_task_id_ = MessageLoop::kTaskIdNull;
+  }
+  if (download_active_ && !base_paused_) {
+    base_paused_ = true;
+    base_fetcher_->Pause();
+  }
+}
+
+void CachingHttpFetcher::Unpause() {
+  if (passthrough_) {
+    base_fetcher_->Unpause();
+    return;
+  }
+  if (!paused_) {
+    LOG(ERROR) << "Resume attempted when fetcher not paused.";
+    return;
+  }
+  paused_ = false;
+  if (base_paused_) {
+    base_paused_ = false;
+    // Note that the base fetcher may call ReceivedBytes() from here.
+    base_fetcher_->Unpause();
+  }
+  MaybeStartDownload();
+  ScheduleDelivery();
+}
+
+bool CachingHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
+                                       const void* bytes,
+                                       size_t length) {
+  CHECK_EQ(fetcher, base_fetcher_.get());
+  if (passthrough_)
+    return !delegate_ || delegate_->ReceivedBytes(this, bytes, length);
+  if (!download_active_ || terminating_ || download_failed_)
+    return false;
+
+  // The base fetcher may not honor the length, only keep the requested range.
+  const size_t size = std::min(static_cast<uint64_t>(length),
+                               download_end_ - download_offset_);
+  if (!utils::PWriteAll(cache_fd_, bytes, size, download_offset_)) {
+    PLOG(ERROR) << "Unable to write to the payload cache " << cache_path_;
+    download_failed_ = true;
+    base_fetcher_->TerminateTransfer();
+    return false;
+  }
+  AddCachedRange(download_offset_, size);
+  download_offset_ += size;
+  unsaved_bytes_ += size;
+  if (unsaved_bytes_ >= kSaveRangesInterval)
+    SaveRanges();
+  ScheduleDelivery();
+
+  if (download_offset_ >= download_end_) {
+    // TransferTerminated() starts the next missing range, if any.
+    base_fetcher_->TerminateTransfer();
+    return false;
+  }
+  return true;
+}
+
+void CachingHttpFetcher::TransferComplete(HttpFetcher* fetcher,
+                                          bool successful) {
+  CHECK_EQ(fetcher, base_fetcher_.get());
+  http_response_code_ = fetcher->http_response_code();
+  if (passthrough_) {
+    passthrough_ = false;
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferComplete(this, successful);
+    return;
+  }
+  DownloadEnded();
+}
+
+void CachingHttpFetcher::TransferTerminated(HttpFetcher* fetcher) {
+  CHECK_EQ(fetcher, base_fetcher_.get());
+  if (passthrough_) {
+    passthrough_ = false;
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+    return;
+  }
+  http_response_code_ = fetcher->http_response_code();
+  DownloadEnded();
+}
+
+void CachingHttpFetcher::DownloadEnded() {
+  CHECK(download_active_) << "Download ended unexpectedly.";
+  download_active_ = false;
+  base_paused_ = false;
+  if (terminating_) {
+    MaybeFinishTermination();
+    return;
+  }
+  if (download_offset_ < download_end_) {
+    LOG(ERROR) << "Download of the payload failed at byte " << download_offset_
+               << ", code " << http_response_code_ << ".";
+    download_failed_ = true;
+  }
+  MaybeStartDownload();
+  if (!download_active_)
+    SaveRanges();
+  ScheduleDelivery();
+}
+
+bool CachingHttpFetcher::OpenCache() {
+  if (cache_fd_ >= 0)
+    return true;
+  cache_fd_ = HANDLE_EINTR(
+      open(cache_path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+  if (cache_fd_ < 0) {
+    PLOG(ERROR) << "Unable to open the payload cache " << cache_path_;
+    return false;
+  }
+
+  struct stat cache_stat;
+  string ranges;
+  vector<string> lines;
+  bool valid = fstat(cache_fd_, &cache_stat) == 0 &&
+               base::ReadFileToString(base::FilePath(RangesPath(cache_path_)),
+                                      &ranges);
+  if (valid) {
+    lines = base::SplitString(
+        ranges, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    valid = !lines.empty() && lines[0] == cache_id_;
+  }
+  for (size_t i = 1; valid && i < lines.size(); i++) {
+    vector<string> fields = base::SplitString(
+        lines[i], " ", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    uint64_t offset, length;
+    valid = fields.size() == 2 && base::StringToUint64(fields[0], &offset) &&
+            base::StringToUint64(fields[1], &length) &&
+            offset + length <= static_cast<uint64_t>(cache_stat.st_size);
+    if (valid)
+      AddCachedRange(offset, length);
+  }
+  if (!valid) {
+    LOG(INFO) << "Starting a new payload cache at " << cache_path_;
+    cached_ranges_.clear();
+    if (HANDLE_EINTR(ftruncate(cache_fd_, 0)) != 0) {
+      PLOG(ERROR) << "Unable to truncate the payload cache " << cache_path_;
+      IGNORE_EINTR(close(cache_fd_));
+      cache_fd_ = -1;
+      return false;
+    }
+  }
+  unsaved_bytes_ = 0;
+  return true;
+}
+
+void CachingHttpFetcher::SaveRanges() {
+  if (cache_fd_ < 0)
+    return;
+  // The ranges must not be recorded before the bytes in them are on disk.
+  if (HANDLE_EINTR(fdatasync(cache_fd_)) != 0) {
+    PLOG(ERROR) << "Unable to sync the payload cache " << cache_path_;
+    return;
+  }
+  string ranges = cache_id_ + "\n";
+  for (const auto& range : cached_ranges_) {
+    ranges += base::StringPrintf(
+        "%" PRIu64 " %" PRIu64 "\n", range.first, range.second - range.first);
+  }
+
+  const string ranges_path = RangesPath(cache_path_);
+  const string tmp_path = ranges_path + ".tmp";
+  int fd = HANDLE_EINTR(open(
+      tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to open " << tmp_path;
+    return;
+  }
+  bool written = utils::WriteAll(fd, ranges.data(), ranges.size()) &&
+                 HANDLE_EINTR(fsync(fd)) == 0;
+  IGNORE_EINTR(close(fd));
+  if (!written || rename(tmp_path.c_str(), ranges_path.c_str()) != 0) {
+    PLOG(ERROR) << "Unable to record the cached ranges in " << ranges_path;
+    return;
+  }
+  unsaved_bytes_ = 0;
+}
+
+void CachingHttpFetcher::AddCachedRange(uint64_t offset, uint64_t length) {
+  if (length == 0)
+    return;
+  uint64_t start = offset;
+  uint64_t end = offset + length;
+  // Merge with the ranges touching or overlapping [start, end).
+  auto it = cached_ranges_.upper_bound(start);
+  if (it != cached_ranges_.begin() && std::prev(it)->second >= start)
+    --it;
+  while (it != cached_ranges_.end() && it->first <= end) {
+    start = std::min(start, it->first);
+    end = std::max(end, it->second);
+    it = cached_ranges_.erase(it);
+  }
+  cached_ranges_[start] = end;
+}
+
+uint64_t CachingHttpFetcher::CachedEnd(uint64_t offset) const {
+  auto it = cached_ranges_.upper_bound(offset);
+  if (it == cached_ranges_.begin())
+    return offset;
+  --it;
+  return std::max(offset, it->second);
+}
+
+void CachingHttpFetcher::MaybeStartDownload() {
+  if (!transfer_active_ || download_active_ || download_failed_ ||
+      terminating_ || paused_) {
+    return;
+  }
+  // The ranges never touch, so this is the start of the first missing range.
+  const uint64_t start = CachedEnd(deliver_offset_);
+  if (start >= end_offset_)
+    return;
+  uint64_t end = end_offset_;
+  auto next = cached_ranges_.upper_bound(start);
+  if (next != cached_ranges_.end())
+    end = std::min(end, next->first);
+
+  LOG(INFO) << "Downloading bytes " << start << " to " << end
+            << " into the payload cache.";
+  download_active_ = true;
+  download_offset_ = start;
+  download_end_ = end;
+  base_fetcher_->SetOffset(start);
+  base_fetcher_->SetLength(end - start);
+  base_fetcher_->BeginTransfer(url_);
+}
+
+void CachingHttpFetcher::ScheduleDelivery() {
+  if (!transfer_active_ || terminating_ || paused_ || in_delivery_ ||
+      deliver_task_id_ != MessageLoop::kTaskIdNull) {
+    return;
+  }
+  const bool has_bytes = CachedEnd(deliver_offset_) > deliver_offset_;
+  const bool ended = deliver_offset_ >= end_offset_ ||
+                     (download_failed_ && !download_active_);
+  if (!has_bytes && !ended)
+    return;
+  deliver_task_id_ = MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&CachingHttpFetcher::Deliver, base::Unretained(this)));
+}
+
+void CachingHttpFetcher::Deliver() {
+  deliver_task_id_ = MessageLoop::kTaskIdNull;
+  const uint64_t available = CachedEnd(deliver_offset_) - deliver_offset_;
+  if (deliver_offset_ >= end_offset_ || available == 0) {
+    // Only the bytes before a failed download are passed to the delegate.
+    const bool successful = deliver_offset_ >= end_offset_;
+    if (!successful && download_active_)
+      return;
+    if (successful && http_response_code_ == 0)
+      http_response_code_ = kHttpResponsePartialContent;
+    Reset();
+    SaveRanges();
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferComplete(this, successful);
+    return;
+  }
+
+  // The cached ranges are always below the end of the cache file, so the
+  // bytes of the window being delivered are never past it.
+  const uint64_t window_end =
+      deliver_offset_ - deliver_offset_ % kMapWindowSize + kMapWindowSize;
+  const size_t size =
+      std::min({kDeliverySize, available, window_end - deliver_offset_});
+  const uint8_t* bytes = MapWindow(deliver_offset_);
+  if (bytes == nullptr) {
+    PLOG(ERROR) << "Unable to map the payload cache " << cache_path_;
+    // Nothing in the cache can be trusted any more.
+    cached_ranges_.clear();
+    SaveRanges();
+    download_failed_ = true;
+    if (download_active_)
+      base_fetcher_->TerminateTransfer();
+    else
+      ScheduleDelivery();
+    return;
+  }
+
+  deliver_offset_ += size;
+  in_delivery_ = true;
+  if (delegate_)
+    delegate_->ReceivedBytes(this, bytes, size);
+  in_delivery_ = false;
+  if (terminating_) {
+    MaybeFinishTermination();
+    return;
+  }
+  ScheduleDelivery();
+}
+
+void CachingHttpFetcher::MaybeFinishTermination() {
+  if (!terminating_ || download_active_ || in_delivery_)
+    return;
+  Reset();
+  SaveRanges();
+  // Note that after the callback returns this object may be destroyed.
+  if (delegate_)
+    delegate_->TransferTerminated(this);
+}
+
+void CachingHttpFetcher::Reset() {
+  if (deliver_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(deliver_task_id_);
+    deliver_task_id_ = MessageLoop::kTaskIdNull;
+  }
+  transfer_active_ = terminating_ = download_failed_ = false;
+  deliver_offset_ = end_offset_ = 0;
+  UnmapWindow();
+}
+
+const uint8_t* CachingHttpFetcher::MapWindow(uint64_t offset) {
+  const uint64_t window_offset = offset - offset % kMapWindowSize;
+  if (window_ == nullptr || window_offset_ != window_offset) {
+    UnmapWindow();
+    void* window = mmap64(nullptr,
+                          kMapWindowSize,
+                          PROT_READ,
+                          MAP_SHARED,
+                          cache_fd_,
+                          window_offset);
+    if (window == MAP_FAILED)
+      return nullptr;
+    // The window is delivered in order.
+    madvise(window, kMapWindowSize, MADV_SEQUENTIAL);
+    window_ = window;
+    window_offset_ = window_offset;
+  }
+  return static_cast<const uint8_t*>(window_) + (offset - window_offset_);
+}
+
+void CachingHttpFetcher::UnmapWindow() {
+  if (window_ == nullptr)
+    return;
+  munmap(window_, kMapWindowSize);
+  window_ = nullptr;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,182 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_CACHING_HTTP_FETCHER_H_
+#define UPDATE_ENGINE_COMMON_CACHING_HTTP_FETCHER_H_
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include <brillo/message_loops/message_loop.h>
+
+#include "update_engine/common/http_fetcher.h"
+
+// This class wraps an HttpFetcher to download the payload into a sparse cache
+// file, delivering the bytes to the delegate from that file. The download
+// runs ahead of the delegate, at the pace of the network, and the ranges
+// already in the cache file are never fetched again: a retried or resumed
+// update reads them locally. The bytes are passed to the delegate from a
+// mapping of the cache file, without being copied out of the page cache.
+//
+// The ranges in the cache file are recorded in a file next to it, along with
+// an id of the payload. A cache left by another payload is discarded. Only
+// transfers with a length go through the cache, the others are passed to the
+// wrapped fetcher.
+
+namespace chromeos_update_engine {
+
+class CachingHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
+ public:
+  // Takes ownership of |base_fetcher|. |cache_id| identifies the payload
+  // downloaded into |cache_path|.
+  CachingHttpFetcher(HttpFetcher* base_fetcher,
+                     const std::string& cache_path,
+                     const std::string& cache_id);
+  ~CachingHttpFetcher() override;
+
+  // Removes the cache file at |cache_path| and its list of ranges.
+  static void DeleteCache(const std::string& cache_path);
+
+  // HttpFetcher overrides.
+  void SetOffset(off_t offset) override { offset_ = offset; }
+  void SetLength(size_t length) override { length_ = length; }
+  void UnsetLength() override { SetLength(0); }
+
+  void BeginTransfer(const std::string& url) override;
+  void TerminateTransfer() override;
+
+  void SetHeader(const std::string& header_name,
+                 const std::string& header_value) override {
+    base_fetcher_->SetHeader(header_name, header_value);
+  }
+  bool GetHeader(const std::string& header_name,
+                 std::string* header_value) const override {
+    return base_fetcher_->GetHeader(header_name, header_value);
+  }
+
+  // Pauses both the delivery and the download.
+  void Pause() override;
+  void Unpause() override;
+
+  void set_idle_seconds(int seconds) override {
+    base_fetcher_->set_idle_seconds(seconds);
+  }
+  void set_retry_seconds(int seconds) override {
+    base_fetcher_->set_retry_seconds(seconds);
+  }
+  void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {
+    base_fetcher_->set_low_speed_limit(low_speed_bps, low_speed_sec);
+  }
+  void set_connect_timeout(int connect_timeout_seconds) override {
+    base_fetcher_->set_connect_timeout(connect_timeout_seconds);
+  }
+  void set_max_retry_count(int max_retry_count) override {
+    base_fetcher_->set_max_retry_count(max_retry_count);
+  }
+
+  // The bytes downloaded from the network, not counting the ones read from
+  // the cache.
+  size_t GetBytesDownloaded() override {
+    return base_fetcher_->GetBytesDownloaded();
+  }
+
+  // The bytes currently in the cache file.
+  uint64_t cached_bytes() const;
+
+ private:
+  // HttpFetcherDelegate overrides, for |base_fetcher_|.
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override;
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override;
+  void TransferTerminated(HttpFetcher* fetcher) override;
+  void DownloadEnded();
+
+  // Opens the cache file and loads its ranges, discarding them if they belong
+  // to another payload. Returns false if the cache can't be used.
+  bool OpenCache();
+  // Records the cached ranges, once the cache file is synced.
+  void SaveRanges();
+  void AddCachedRange(uint64_t offset, uint64_t length);
+  // The end of the cached range containing |offset|, or |offset| if it isn't
+  // cached.
+  uint64_t CachedEnd(uint64_t offset) const;
+
+  // Downloads the first range of the transfer missing from the cache, unless
+  // a download is in progress.
+  void MaybeStartDownload();
+
+  // Passes the next cached bytes to the delegate, and ends the transfer once
+  // they are all passed or the download failed.
+  void ScheduleDelivery();
+  void Deliver();
+  // Returns the byte at |offset| of the cache file, mapping the window of it
+  // which holds that byte in place of the last one. Returns nullptr if it
+  // can't be mapped.
+  const uint8_t* MapWindow(uint64_t offset);
+  void UnmapWindow();
+
+  // Tells the delegate the transfer is terminated, once |base_fetcher_| is
+  // done.
+  void MaybeFinishTermination();
+  void Reset();
+
+  std::unique_ptr<HttpFetcher> base_fetcher_;
+  const std::string cache_path_;
+  const std::string cache_id_;
+  int cache_fd_{-1};
+
+  // The cached ranges, from their start to their end offsets in the payload
+  // URL. They never touch or overlap.
+  std::map<uint64_t, uint64_t> cached_ranges_;
+  // The bytes added since SaveRanges().
+  uint64_t unsaved_bytes_{0};
+
+  // The requested transfer.
+  std::string url_;
+  off_t offset_{0};
+  size_t length_{0};
+
+  // Whether the transfer is passed to |base_fetcher_| as is.
+  bool passthrough_{false};
+  bool transfer_active_{false};
+  uint64_t deliver_offset_{0};
+  uint64_t end_offset_{0};
+  brillo::MessageLoop::TaskId deliver_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+  // The mapped window of the cache file, at |window_offset_|.
+  void* window_{nullptr};
+  uint64_t window_offset_{0};
+  // Set while the delegate's ReceivedBytes() runs.
+  bool in_delivery_{false};
+
+  // The range downloaded by |base_fetcher_|.
+  bool download_active_{false};
+  bool download_failed_{false};
+  uint64_t download_offset_{0};
+  uint64_t download_end_{0};
+
+  bool paused_{false};
+  bool base_paused_{false};
+  bool terminating_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(CachingHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_CACHING_HTTP_FETCHER_H_
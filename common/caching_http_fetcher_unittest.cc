@@ -0,0 +1,185 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/caching_http_fetcher.h"
+
+#include <memory>
+#include <string>
+
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/mock_http_fetcher.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+class RecordingDelegate : public HttpFetcherDelegate {
+ public:
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    received_.insert(received_.end(), data, data + length);
+    return true;
+  }
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    completed_ = true;
+    successful_ = successful;
+  }
+  void TransferTerminated(HttpFetcher* fetcher) override {
+    terminated_ = true;
+  }
+
+  brillo::Blob received_;
+  bool completed_{false};
+  bool successful_{false};
+  bool terminated_{false};
+};
+
+}  // namespace
+
+class CachingHttpFetcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    cache_path_ = temp_dir_.GetPath().Append("payload_cache").value();
+    for (size_t i = 0; i < data_.size(); i++)
+      data_[i] = static_cast<uint8_t>(i * 7 + i / 4096);
+  }
+
+  void TearDown() override { EXPECT_FALSE(loop_.PendingTasks()); }
+
+  // Fetches |length| bytes at |offset| through a cache of the payload
+  // |cache_id|, served by |base_fetcher|.
+  void Fetch(MockHttpFetcher* base_fetcher,
+             const string& cache_id,
+             off_t offset,
+             size_t length) {
+    fetcher_ = std::make_unique<CachingHttpFetcher>(
+        base_fetcher, cache_path_, cache_id);
+    base_fetcher_ = base_fetcher;
+    delegate_ = RecordingDelegate();
+    fetcher_->set_delegate(&delegate_);
+    fetcher_->SetOffset(offset);
+    fetcher_->SetLength(length);
+    fetcher_->BeginTransfer("http://fake/payload");
+    while (loop_.RunOnce(true)) {
+    }
+  }
+
+  MockHttpFetcher* NewBaseFetcher() {
+    return new MockHttpFetcher(data_.data(), data_.size(), nullptr);
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  base::ScopedTempDir temp_dir_;
+  string cache_path_;
+  brillo::Blob data_ = brillo::Blob(300 * 1024);
+
+  std::unique_ptr<CachingHttpFetcher> fetcher_;
+  MockHttpFetcher* base_fetcher_{nullptr};
+  RecordingDelegate delegate_;
+};
+
+TEST_F(CachingHttpFetcherTest, DownloadsIntoTheCacheTest) {
+  Fetch(NewBaseFetcher(), "payload", 0, data_.size());
+  EXPECT_TRUE(delegate_.completed_);
+  EXPECT_TRUE(delegate_.successful_);
+  EXPECT_EQ(data_, delegate_.received_);
+  EXPECT_EQ(data_.size(), fetcher_->cached_bytes());
+  EXPECT_EQ(data_.size(), fetcher_->GetBytesDownloaded());
+  EXPECT_TRUE(base::PathExists(base::FilePath(cache_path_ + ".ranges")));
+}
+
+TEST_F(CachingHttpFetcherTest, ServesCachedBytesLocallyTest) {
+  const size_t half = data_.size() / 2;
+  Fetch(NewBaseFetcher(), "payload", 0, half);
+  ASSERT_TRUE(delegate_.successful_);
+  fetcher_.reset();
+
+  // Only the second half is downloaded again.
+  Fetch(NewBaseFetcher(), "payload", 0, data_.size());
+  EXPECT_TRUE(delegate_.successful_);
+  EXPECT_EQ(data_, delegate_.received_);
+  EXPECT_EQ(data_.size() - half, fetcher_->GetBytesDownloaded());
+  fetcher_.reset();
+
+  // Everything is cached, the network isn't used.
+  MockHttpFetcher* base_fetcher = NewBaseFetcher();
+  base_fetcher->set_never_use(true);
+  Fetch(base_fetcher, "payload", half, data_.size() - half);
+  EXPECT_TRUE(delegate_.successful_);
+  EXPECT_EQ(brillo::Blob(data_.begin() + half, data_.end()),
+            delegate_.received_);
+  EXPECT_EQ(kHttpResponsePartialContent, fetcher_->http_response_code());
+}
+
+TEST_F(CachingHttpFetcherTest, DiscardsTheCacheOfAnotherPayloadTest) {
+  Fetch(NewBaseFetcher(), "payload", 0, data_.size());
+  ASSERT_TRUE(delegate_.successful_);
+  fetcher_.reset();
+
+  Fetch(NewBaseFetcher(), "other-payload", 0, data_.size());
+  EXPECT_TRUE(delegate_.successful_);
+  EXPECT_EQ(data_, delegate_.received_);
+  EXPECT_EQ(data_.size(), fetcher_->GetBytesDownloaded());
+}
+
+TEST_F(CachingHttpFetcherTest, DeliversCachedBytesBeforeFailingTest) {
+  const size_t half = data_.size() / 2;
+  Fetch(NewBaseFetcher(), "payload", 0, half);
+  ASSERT_TRUE(delegate_.successful_);
+  fetcher_.reset();
+
+  MockHttpFetcher* base_fetcher = NewBaseFetcher();
+  base_fetcher->FailTransfer(kHttpResponseNotFound);
+  Fetch(base_fetcher, "payload", 0, data_.size());
+  EXPECT_TRUE(delegate_.completed_);
+  EXPECT_FALSE(delegate_.successful_);
+  EXPECT_EQ(brillo::Blob(data_.begin(), data_.begin() + half),
+            delegate_.received_);
+  EXPECT_EQ(kHttpResponseNotFound, fetcher_->http_response_code());
+}
+
+// The bytes are delivered across the windows mapped from the cache file.
+TEST_F(CachingHttpFetcherTest, DeliversAcrossMappedWindowsTest) {
+  data_.resize(17 * 1024 * 1024);
+  for (size_t i = 0; i < data_.size(); i++)
+    data_[i] = static_cast<uint8_t>(i * 7 + i / 4096);
+  const size_t offset = 1024 * 1024 + 123;
+  Fetch(NewBaseFetcher(), "payload", offset, data_.size() - offset);
+  EXPECT_TRUE(delegate_.successful_);
+  EXPECT_EQ(brillo::Blob(data_.begin() + offset, data_.end()),
+            delegate_.received_);
+}
+
+TEST_F(CachingHttpFetcherTest, DeleteCacheTest) {
+  Fetch(NewBaseFetcher(), "payload", 0, data_.size());
+  fetcher_.reset();
+  CachingHttpFetcher::DeleteCache(cache_path_);
+  EXPECT_FALSE(base::PathExists(base::FilePath(cache_path_)));
+  EXPECT_FALSE(base::PathExists(base::FilePath(cache_path_ + ".ranges")));
+}
+
+}  // namespace chromeos_update_engine
@@ -94,6 +94,7 @@ static constexpr const auto& kPrefsPingLastRollcall = "date_last_rollcall";
 static constexpr const auto& kPrefsLastFp = "last-fp";
 static constexpr const auto& kPrefsPostInstallSucceeded =
     "post-install-succeeded";
+static constexpr const auto& kPrefsPostinstallDone = "postinstall-done";
 static constexpr const auto& kPrefsPreviousVersion = "previous-version";
 static constexpr const auto& kPrefsResumedUpdateFailures =
     "resumed-update-failures";
@@ -134,6 +135,12 @@ static constexpr const auto& kPrefsUpdateStateNextDataOffset =
     "update-state-next-data-offset";
 static constexpr const auto& kPrefsUpdateStateNextOperation =
     "update-state-next-operation";
+// The bytes of the blob of the next operation already written, and the
+// context of their hash, when the checkpoint is in the middle of it.
+static constexpr const auto& kPrefsUpdateStatePartialOperationBytes =
+    "update-state-partial-operation-bytes";
+static constexpr const auto& kPrefsUpdateStatePartialOperationSHA256Context =
+    "update-state-partial-operation-sha-256-context";
 static constexpr const auto& kPrefsUpdateStatePayloadIndex =
     "update-state-payload-index";
 static constexpr const auto& kPrefsUpdateStateSHA256Context =
@@ -147,12 +154,17 @@ static constexpr const auto& kPrefsUpdateBootTimestampStart =
 static constexpr const auto& kPrefsUpdateTimestampStart =
     "update-timestamp-start";
 static constexpr const auto& kPrefsUrlSwitchCount = "url-switch-count";
+static constexpr const auto& kPrefsVerifyCheckpoint = "verify-checkpoint";
+static constexpr const auto& kPrefsVerifiedSourceHashes =
+    "verified-source-hashes";
 static constexpr const auto& kPrefsVerityWritten = "verity-written";
 static constexpr const auto& kPrefsWallClockScatteringWaitPeriod =
     "wall-clock-wait-period";
 static constexpr const auto& kPrefsWallClockStagingWaitPeriod =
     "wall-clock-staging-wait-period";
 static constexpr const auto& kPrefsManifestBytes = "manifest-bytes";
+static constexpr const auto& kPrefsManifestValidatedHash =
+    "manifest-validated-hash";
 static constexpr const auto& kPrefsPreviousSlot = "previous-slot";
 
 // Keys used when storing and loading payload properties.
@@ -161,6 +173,15 @@ static constexpr const auto& kPayloadPropertyFileSize = "FILE_SIZE";
 static constexpr const auto& kPayloadPropertyFileHash = "FILE_HASH";
 static constexpr const auto& kPayloadPropertyMetadataSize = "METADATA_SIZE";
 static constexpr const auto& kPayloadPropertyMetadataHash = "METADATA_HASH";
+// The estimated cost of applying the payload, summed over its partitions, when
+// delta_generator was run with --annotate_apply_cost.
+static constexpr const auto& kPayloadPropertyApplyBytesRead =
+    "APPLY_BYTES_READ";
+static constexpr const auto& kPayloadPropertyApplyBytesWritten =
+    "APPLY_BYTES_WRITTEN";
+static constexpr const auto& kPayloadPropertyApplyDiffBytes =
+    "APPLY_DIFF_BYTES";
+static constexpr const auto& kPayloadPropertyApplyTimeMs = "APPLY_TIME_MS";
 // The Authorization: HTTP header to be sent when downloading the payload.
 static constexpr const auto& kPayloadPropertyAuthorization = "AUTHORIZATION";
 // The User-Agent HTTP header to be sent when downloading the payload.
@@ -180,6 +201,99 @@ static constexpr const auto& kPayloadPropertySwitchSlotOnReboot =
 // The default is 1 (always run post install).
 static constexpr const auto& kPayloadPropertyRunPostInstall =
     "RUN_POST_INSTALL";
+// Set "PIPELINED_APPLY=1" to apply the install operations in the background
+// while the rest of the payload is downloaded. The default is 0.
+static constexpr const auto& kPayloadPropertyPipelinedApply = "PIPELINED_APPLY";
+// The number of threads applying the operations of a partition when
+// "PIPELINED_APPLY=1" is set. The default is 1.
+static constexpr const auto& kPayloadPropertyApplyThreads = "APPLY_THREADS";
+// Set "CONCURRENT_PARTITIONS=1" to apply the operations of the next partition
+// while the last ones of the previous partition are still applied, when
+// "PIPELINED_APPLY=1" is set. The default is 0.
+static constexpr const auto& kPayloadPropertyConcurrentPartitions =
+    "CONCURRENT_PARTITIONS";
+// The number of threads hashing the target partitions after the update is
+// written, and the limit of their combined reads in bytes per second. The
+// defaults are 1 thread and no limit.
+static constexpr const auto& kPayloadPropertyVerifyThreads = "VERIFY_THREADS";
+static constexpr const auto& kPayloadPropertyVerifyReadBandwidth =
+    "VERIFY_READ_BANDWIDTH";
+// Set "STREAM_REPLACE_OPERATIONS=1" to write large REPLACE operations while
+// their data is downloaded, to lower the peak memory usage. The default is 0.
+static constexpr const auto& kPayloadPropertyStreamReplaceOperations =
+    "STREAM_REPLACE_OPERATIONS";
+// Set "WRITE_VERITY_DURING_APPLY=1" to hash the written blocks for the verity
+// hash tree while the operations are applied. The default is 0.
+static constexpr const auto& kPayloadPropertyWriteVerityDuringApply =
+    "WRITE_VERITY_DURING_APPLY";
+// Set "REUSE_SOURCE_VERITY=1" to copy the hash tree and FEC data of the blocks
+// copied unchanged from the source partitions instead of computing them again.
+// The default is 0.
+static constexpr const auto& kPayloadPropertyReuseSourceVerity =
+    "REUSE_SOURCE_VERITY";
+// Set "VERIFY_DURING_APPLY=1" to hash each target partition in the background
+// once it is written, while the next ones are applied. The default is 0.
+static constexpr const auto& kPayloadPropertyVerifyDuringApply =
+    "VERIFY_DURING_APPLY";
+// The number of HTTP connections downloading parts of the payload at the same
+// time. The default is 1.
+static constexpr const auto& kPayloadPropertyDownloadConnections =
+    "DOWNLOAD_CONNECTIONS";
+// Space separated HTTP(S) URLs serving the same payload, which the parts
+// downloaded by the connections are spread across based on their measured
+// throughput. Without DOWNLOAD_CONNECTIONS, there's one connection per URL.
+static constexpr const auto& kPayloadPropertyMirrorUrls = "MIRROR_URLS";
+// Space separated HTTP(S) URLs of peers on the local network serving the same
+// payload, such as another device which already downloaded it. The parts are
+// downloaded from them first, and from the payload and mirror URLs once they
+// all failed or stalled. Without DOWNLOAD_CONNECTIONS, there's one connection
+// per URL.
+static constexpr const auto& kPayloadPropertyPeerUrls = "PEER_URLS";
+// Space separated "<offset>:<url>" parts of a payload split in several files
+// by "delta_generator --split_payload_dir", in the order of their offset in
+// the payload, the first one being 0. The bytes of the payload from the offset
+// of a part up to the next one are downloaded from the start of its URL,
+// which is relative to the payload, mirror and peer URLs unless it has a
+// scheme. Only applies to HTTP(S) payload URLs.
+static constexpr const auto& kPayloadPropertySplitPayloadParts =
+    "SPLIT_PAYLOAD_PARTS";
+// The size in bytes of the buffer between the download and the apply of the
+// payload, so the download keeps going while an operation is applied. The
+// default is 0, for no buffer.
+static constexpr const auto& kPayloadPropertyDownloadBufferSize =
+    "DOWNLOAD_BUFFER_SIZE";
+// Set "PREFETCH_TO_DISK=1" to download an HTTP(S) payload into a file on /data
+// at the speed of the network, while it is applied from that file. A retried
+// or resumed update only downloads the parts missing from the file. The
+// default is 0.
+static constexpr const auto& kPayloadPropertyPrefetchToDisk =
+    "PREFETCH_TO_DISK";
+// Set "PREPARE_PARTITIONS_IN_BACKGROUND=1" to allocate and map the dynamic
+// partitions of a new update while its data keeps downloading, instead of
+// before. The default is 0.
+static constexpr const auto& kPayloadPropertyPreparePartitionsInBackground =
+    "PREPARE_PARTITIONS_IN_BACKGROUND";
+// Set "PERFORMANCE_MODE=1" to apply the update with the CPU and I/O priority of
+// the performance mode, instead of in the background. The default is 0.
+static constexpr const auto& kPayloadPropertyPerformanceMode =
+    "PERFORMANCE_MODE";
+// The most bytes per second downloaded, on average. The default is 0, for no
+// limit. It can be changed during the update with setMaxDownloadRate().
+static constexpr const auto& kPayloadPropertyMaxDownloadRate =
+    "MAX_DOWNLOAD_RATE";
+// Set "DIRECT_TARGET_WRITES=1" to write the target partitions with O_DIRECT,
+// without filling the page cache, and flush them progressively. The default
+// is 0.
+static constexpr const auto& kPayloadPropertyDirectTargetWrites =
+    "DIRECT_TARGET_WRITES";
+// Set "WRITE_BEHIND=1" to write the blocks gathered for the target partitions
+// in the background while the next operations are applied. The default is 0.
+static constexpr const auto& kPayloadPropertyWriteBehind = "WRITE_BEHIND";
+// Set "INSTRUMENT_FILE_IO=1" to count the reads and writes of each partition
+// device, their size and latency, in the performance report of the update.
+// The default is 0.
+static constexpr const auto& kPayloadPropertyInstrumentFileIo =
+    "INSTRUMENT_FILE_IO";
 
 static constexpr const auto& kOmahaUpdaterVersion = "0.1.0.0";
 
@@ -271,6 +385,10 @@ constexpr int kDownloadMaxRetryCountOobeNotComplete = 3;
 constexpr int kDownloadMaxRetryCountInteractive = 3;
 constexpr int kDownloadP2PMaxRetryCount = 5;
 
+// The longest wait between two reconnect attempts, which wait twice as long as
+// the previous one while they make no progress.
+constexpr int kDownloadMaxRetrySeconds = 160;
+
 // The connect timeout, in seconds.
 //
 // This is set high because some devices may have very poor
@@ -16,26 +16,150 @@
 
 #include "update_engine/common/cow_operation_convert.h"
 
+#include <algorithm>
+#include <utility>
+
 #include <base/logging.h>
 
-#include "update_engine/payload_generator/extent_ranges.h"
-#include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
 
 namespace {
 
-bool IsConsecutive(const CowOperation& op1, const CowOperation& op2) {
-  return op1.op == op2.op && op1.dst_block + op1.block_count == op2.dst_block &&
-         op1.src_block + op1.block_count == op2.src_block;
+// Sorted, disjoint and non-adjacent [start, end) ranges of blocks.
+using BlockRanges = std::vector<std::pair<uint64_t, uint64_t>>;
+
+uint64_t StartBlock(const Extent& extent) {
+  return extent.start_block();
+}
+uint64_t NumBlocks(const Extent& extent) {
+  return extent.num_blocks();
+}
+uint64_t StartBlock(const PackedExtent& extent) {
+  return extent.start_block;
+}
+uint64_t NumBlocks(const PackedExtent& extent) {
+  return extent.num_blocks;
 }
 
+// Appends |op|, extending the last operation instead if |op| continues it.
 void push_back(std::vector<CowOperation>* converted, const CowOperation& op) {
-  if (!converted->empty() && IsConsecutive(converted->back(), op)) {
-    converted->back().block_count++;
-  } else {
-    converted->push_back(op);
+  if (!converted->empty()) {
+    CowOperation& last = converted->back();
+    if (last.op == op.op && last.dst_block + last.block_count == op.dst_block &&
+        last.src_block + last.block_count == op.src_block) {
+      last.block_count += op.block_count;
+      return;
+    }
+  }
+  converted->push_back(op);
+}
+
+// Converts the COW_COPY operations of |merge_operations| to CowCopy, one per
+// merge operation, and returns their destination blocks.
+BlockRanges ConvertMergeOperations(
+    const ::google::protobuf::RepeatedPtrField<CowMergeOperation>&
+        merge_operations,
+    std::vector<CowOperation>* converted) {
+  BlockRanges merge_blocks;
+  for (const auto& merge_op : merge_operations) {
+    if (merge_op.type() != CowMergeOperation::COW_COPY) {
+      continue;
+    }
+    const auto& src_extent = merge_op.src_extent();
+    const auto& dst_extent = merge_op.dst_extent();
+    if (src_extent.num_blocks() == 0) {
+      continue;
+    }
+    merge_blocks.emplace_back(
+        dst_extent.start_block(),
+        dst_extent.start_block() + dst_extent.num_blocks());
+    // The blocks are written in reverse order, because snapuserd specifically
+    // prefers this ordering, see VABCPartitionWriter::WriteSourceCopyCowOps().
+    // Since we already eliminated all self-overlapping SOURCE_COPY during
+    // delta generation, this should be safe to do.
+    converted->push_back({CowOperation::CowCopy,
+                          src_extent.start_block(),
+                          dst_extent.start_block(),
+                          src_extent.num_blocks()});
+  }
+  std::sort(merge_blocks.begin(), merge_blocks.end());
+  BlockRanges merged;
+  for (const auto& range : merge_blocks) {
+    if (range.first >= range.second)
+      continue;
+    if (!merged.empty() && range.first <= merged.back().second) {
+      merged.back().second = std::max(merged.back().second, range.second);
+    } else {
+      merged.push_back(range);
+    }
+  }
+  return merged;
+}
+
+// Appends CowReplace operations for the |num_blocks| blocks copied from
+// |src_block| to |dst_block|, except for those in |merge_blocks|.
+void AppendReplaceRun(uint64_t src_block,
+                      uint64_t dst_block,
+                      uint64_t num_blocks,
+                      const BlockRanges& merge_blocks,
+                      std::vector<CowOperation>* converted) {
+  const uint64_t end = dst_block + num_blocks;
+  auto emit = [&](uint64_t begin, uint64_t run_end) {
+    if (begin < run_end) {
+      push_back(converted,
+                {CowOperation::CowReplace,
+                 src_block + (begin - dst_block),
+                 begin,
+                 run_end - begin});
+    }
+  };
+  // The first range ending after |dst_block|.
+  auto it = std::upper_bound(
+      merge_blocks.begin(),
+      merge_blocks.end(),
+      dst_block,
+      [](uint64_t block, const auto& range) { return block < range.second; });
+  uint64_t pos = dst_block;
+  for (; it != merge_blocks.end() && it->first < end && pos < end; ++it) {
+    emit(pos, std::min(it->first, end));
+    pos = std::max(pos, it->second);
+  }
+  emit(pos, end);
+}
+
+// Appends the CowReplace operations of a SOURCE_COPY whose source and
+// destination extents are [src, src_end) and [dst, dst_end), walking them in
+// lockstep one run of blocks contiguous on both sides at a time.
+template <typename It>
+void ConvertSourceCopy(It src,
+                       It src_end,
+                       It dst,
+                       It dst_end,
+                       const BlockRanges& merge_blocks,
+                       std::vector<CowOperation>* converted) {
+  uint64_t src_offset = 0, dst_offset = 0;
+  while (src != src_end && dst != dst_end) {
+    if (src_offset == NumBlocks(*src)) {
+      ++src;
+      src_offset = 0;
+      continue;
+    }
+    if (dst_offset == NumBlocks(*dst)) {
+      ++dst;
+      dst_offset = 0;
+      continue;
+    }
+    const uint64_t num_blocks =
+        std::min(NumBlocks(*src) - src_offset, NumBlocks(*dst) - dst_offset);
+    AppendReplaceRun(StartBlock(*src) + src_offset,
+                     StartBlock(*dst) + dst_offset,
+                     num_blocks,
+                     merge_blocks,
+                     converted);
+    src_offset += num_blocks;
+    dst_offset += num_blocks;
   }
 }
 
@@ -46,8 +170,8 @@ std::vector<CowOperation> ConvertToCowOperations(
         ::chromeos_update_engine::InstallOperation>& operations,
     const ::google::protobuf::RepeatedPtrField<CowMergeOperation>&
         merge_operations) {
-  ExtentRanges merge_extents;
   std::vector<CowOperation> converted;
+  converted.reserve(merge_operations.size() + operations.size());
 
   // We want all CowCopy ops to be done first, before any COW_REPLACE happen.
   // Therefore we add these ops in 2 separate loops. This is because during
@@ -56,42 +180,46 @@ std::vector<CowOperation> ConvertToCowOperations(
 
   // This loop handles CowCopy blocks within SOURCE_COPY, and the next loop
   // converts the leftover blocks to CowReplace?
-  for (const auto& merge_op : merge_operations) {
-    if (merge_op.type() != CowMergeOperation::COW_COPY) {
-      continue;
-    }
-    merge_extents.AddExtent(merge_op.dst_extent());
-    const auto& src_extent = merge_op.src_extent();
-    const auto& dst_extent = merge_op.dst_extent();
-    // Add blocks in reverse order, because snapused specifically prefers this
-    // ordering. Since we already eliminated all self-overlapping SOURCE_COPY
-    // during delta generation, this should be safe to do.
-    for (uint64_t i = src_extent.num_blocks(); i > 0; i--) {
-      auto src_block = src_extent.start_block() + i - 1;
-      auto dst_block = dst_extent.start_block() + i - 1;
-      converted.push_back({CowOperation::CowCopy, src_block, dst_block, 1});
-    }
-  }
+  const BlockRanges merge_blocks =
+      ConvertMergeOperations(merge_operations, &converted);
   // COW_REPLACE are added after COW_COPY, because replace might modify blocks
   // needed by COW_COPY. Please don't merge this loop with the previous one.
   for (const auto& operation : operations) {
     if (operation.type() != InstallOperation::SOURCE_COPY) {
       continue;
     }
-    const auto& src_extents = operation.src_extents();
-    const auto& dst_extents = operation.dst_extents();
-    BlockIterator it1{src_extents};
-    BlockIterator it2{dst_extents};
-    while (!it1.is_end() && !it2.is_end()) {
-      const auto src_block = *it1;
-      const auto dst_block = *it2;
-      if (!merge_extents.ContainsBlock(dst_block)) {
-        push_back(&converted,
-                  {CowOperation::CowReplace, src_block, dst_block, 1});
-      }
-      ++it1;
-      ++it2;
+    ConvertSourceCopy(operation.src_extents().begin(),
+                      operation.src_extents().end(),
+                      operation.dst_extents().begin(),
+                      operation.dst_extents().end(),
+                      merge_blocks,
+                      &converted);
+  }
+  return converted;
+}
+
+std::vector<CowOperation> ConvertToCowOperations(
+    const OperationIndex& operations,
+    const ::google::protobuf::RepeatedPtrField<CowMergeOperation>&
+        merge_operations) {
+  std::vector<CowOperation> converted;
+  converted.reserve(merge_operations.size() + operations.num_operations());
+  // Same order as above: all the CowCopy first, then the CowReplace.
+  const BlockRanges merge_blocks =
+      ConvertMergeOperations(merge_operations, &converted);
+  for (size_t i = 0; i < operations.num_operations(); i++) {
+    const PackedOperation& operation = operations.operation(i);
+    if (operation.type != InstallOperation::SOURCE_COPY) {
+      continue;
     }
+    const auto src_extents = operations.src_extents(operation);
+    const auto dst_extents = operations.dst_extents(operation);
+    ConvertSourceCopy(src_extents.begin(),
+                      src_extents.end(),
+                      dst_extents.begin(),
+                      dst_extents.end(),
+                      merge_blocks,
+                      &converted);
   }
   return converted;
 }
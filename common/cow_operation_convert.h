@@ -21,6 +21,7 @@
 
 #include <libsnapshot/cow_format.h>
 
+#include "update_engine/common/operation_index.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -53,5 +54,12 @@ std::vector<CowOperation> ConvertToCowOperations(
         ::chromeos_update_engine::InstallOperation>& operations,
     const ::google::protobuf::RepeatedPtrField<CowMergeOperation>&
         merge_operations);
+
+// Same as above, walking the packed |operations| of an operation index instead
+// of their protobuf messages.
+std::vector<CowOperation> ConvertToCowOperations(
+    const OperationIndex& operations,
+    const ::google::protobuf::RepeatedPtrField<CowMergeOperation>&
+        merge_operations);
 }  // namespace chromeos_update_engine
 #endif
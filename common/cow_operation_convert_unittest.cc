@@ -217,7 +217,7 @@ TEST_F(CowOperationConvertTest, InterleavingSrcExtent) {
 
   auto cow_ops = ConvertToCowOperations(operations_, merge_operations_);
   // Expect 4 COW_COPY
-  ASSERT_EQ(cow_ops.size(), 12UL);
+  ASSERT_EQ(cow_ops.size(), 4UL);
   ASSERT_TRUE(std::all_of(cow_ops.begin(), cow_ops.end(), [](auto&& cow_op) {
     return cow_op.op == CowOperation::CowCopy;
   }));
@@ -232,8 +232,9 @@ TEST_F(CowOperationConvertTest, SelfOverlappingOperation) {
       &merge_operations_, CowMergeOperation::COW_COPY, {20, 10}, {25, 10});
 
   auto cow_ops = ConvertToCowOperations(operations_, merge_operations_);
-  // Expect 10 COW_COPY
-  ASSERT_EQ(cow_ops.size(), 10UL);
+  // Expect a single COW_COPY of the 10 blocks.
+  ASSERT_EQ(cow_ops.size(), 1UL);
+  ASSERT_EQ(cow_ops[0].block_count, 10UL);
   ASSERT_TRUE(std::all_of(cow_ops.begin(), cow_ops.end(), [](auto&& cow_op) {
     return cow_op.op == CowOperation::CowCopy;
   }));
@@ -297,4 +298,34 @@ TEST_F(CowOperationConvertTest, CowReplaceDifferenceSrc) {
   VerifyCowMergeOp(cow_ops);
 }
 
+TEST_F(CowOperationConvertTest, CowReplaceRunsAroundMergeOps) {
+  AddOperation(&operations_,
+               InstallOperation::SOURCE_COPY,
+               {{1000, 600}, {2000, 400}},
+               {{0, 1000}});
+  // The merge ops cover [100, 110) and [590, 610), which crosses the boundary
+  // between the two source extents.
+  AddMergeOperation(
+      &merge_operations_, CowMergeOperation::COW_COPY, {1100, 10}, {100, 10});
+  AddMergeOperation(
+      &merge_operations_, CowMergeOperation::COW_COPY, {1590, 10}, {590, 10});
+  AddMergeOperation(
+      &merge_operations_, CowMergeOperation::COW_COPY, {2000, 10}, {600, 10});
+
+  auto cow_ops = ConvertToCowOperations(operations_, merge_operations_);
+  ASSERT_EQ(cow_ops.size(), 6UL);
+  EXPECT_EQ(cow_ops[0].op, CowOperation::CowCopy);
+  EXPECT_EQ(cow_ops[0].block_count, 10UL);
+  const std::vector<std::array<uint64_t, 3>> expected_replace = {
+      {1000, 0, 100}, {1110, 110, 480}, {2010, 610, 390}};
+  for (size_t i = 0; i < expected_replace.size(); i++) {
+    const CowOperation& op = cow_ops[3 + i];
+    EXPECT_EQ(op.op, CowOperation::CowReplace);
+    EXPECT_EQ(op.src_block, expected_replace[i][0]);
+    EXPECT_EQ(op.dst_block, expected_replace[i][1]);
+    EXPECT_EQ(op.block_count, expected_replace[i][2]);
+  }
+  VerifyCowMergeOp(cow_ops);
+}
+
 }  // namespace chromeos_update_engine
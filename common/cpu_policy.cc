@@ -0,0 +1,226 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/cpu_policy.h"
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_util.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+// The affinity generation applied to the calling worker thread.
+thread_local uint64_t applied_affinity_generation = 0;
+thread_local bool in_worker_task = false;
+
+// The hint generation applied to the calling worker thread, its session if it
+// has one, and when its current task started.
+thread_local uint64_t applied_hint_generation = 0;
+thread_local std::unique_ptr<PerformanceHintSession> hint_session;
+thread_local base::TimeTicks hint_task_start;
+
+// Where the hint generations of all the policies are taken from, so that a
+// thread never mistakes the generation of a policy for another one's.
+std::atomic<uint64_t> last_hint_generation{0};
+
+void SetThreadAffinity(const std::vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (cpus.empty()) {
+    const long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (long cpu = 0; cpu < num_cpus && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, &set);
+  } else {
+    for (int cpu : cpus)
+      CPU_SET(cpu, &set);
+  }
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    PLOG(WARNING) << "Unable to set the affinity of a worker thread.";
+}
+}  // namespace
+
+CpuPolicy* CpuPolicy::Get() {
+  static CpuPolicy* policy = new CpuPolicy();
+  return policy;
+}
+
+bool CpuPolicy::LoadCpuCapacities(const std::string& sysfs_cpu_dir) {
+  std::vector<uint32_t> capacities;
+  const long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  for (long cpu = 0; cpu < num_cpus && cpu < CPU_SETSIZE; cpu++) {
+    const base::FilePath path = base::FilePath(sysfs_cpu_dir)
+                                    .Append("cpu" + std::to_string(cpu))
+                                    .Append("cpu_capacity");
+    std::string content;
+    unsigned capacity = 0;
+    if (!base::ReadFileToString(path, &content) ||
+        !base::StringToUint(base::TrimWhitespaceASCII(content, base::TRIM_ALL),
+                            &capacity)) {
+      LOG(INFO) << "No capacity for CPU " << cpu
+                << ", not placing the worker threads.";
+      SetCpuCapacities({});
+      return false;
+    }
+    capacities.push_back(capacity);
+  }
+  SetCpuCapacities(capacities);
+  return true;
+}
+
+void CpuPolicy::SetCpuCapacities(const std::vector<uint32_t>& capacities) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacities_ = capacities;
+  affinity_generation_++;
+}
+
+void CpuPolicy::SetMode(Mode mode) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (mode_ == mode)
+    return;
+  mode_ = mode;
+  affinity_generation_++;
+  hint_generation_ = ++last_hint_generation;
+}
+
+CpuPolicy::Mode CpuPolicy::mode() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return mode_;
+}
+
+std::vector<int> CpuPolicy::PreferredCpus() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return PreferredCpusLocked();
+}
+
+std::vector<int> CpuPolicy::PreferredCpusLocked() const {
+  if (capacities_.empty())
+    return {};
+  const auto [min, max] =
+      std::minmax_element(capacities_.begin(), capacities_.end());
+  if (*min == *max)
+    return {};
+  std::vector<int> cpus;
+  for (size_t cpu = 0; cpu < capacities_.size(); cpu++) {
+    const bool little = capacities_[cpu] == *min;
+    if (little == (mode_ == Mode::kBackground))
+      cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+void CpuPolicy::SetThermalHeadroom(float headroom) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const size_t old_limit = MaxRunningTasksLocked();
+    thermal_headroom_ = headroom;
+    const size_t limit = MaxRunningTasksLocked();
+    if (limit == old_limit)
+      return;
+    LOG(INFO) << "Thermal headroom " << headroom << ", running "
+              << (limit ? std::to_string(limit) : "any number of")
+              << " worker tasks at the same time.";
+  }
+  slot_released_.notify_all();
+}
+
+size_t CpuPolicy::MaxRunningTasks() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return MaxRunningTasksLocked();
+}
+
+size_t CpuPolicy::MaxRunningTasksLocked() const {
+  if (thermal_headroom_ >= kSevereThermalHeadroom)
+    return 1;
+  if (thermal_headroom_ >= kModerateThermalHeadroom)
+    return 2;
+  return 0;
+}
+
+void CpuPolicy::SetHintSessionFactory(HintSessionFactory factory) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  hint_session_factory_ = std::move(factory);
+  hint_generation_ = ++last_hint_generation;
+}
+
+void CpuPolicy::BeginWorkerTask() {
+  std::vector<int> cpus;
+  bool move = false;
+  bool update_hint_session = false;
+  HintSessionFactory hint_session_factory;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    slot_released_.wait(lock, [this] {
+      const size_t limit = MaxRunningTasksLocked();
+      return limit == 0 || running_tasks_ < limit;
+    });
+    running_tasks_++;
+    if (applied_affinity_generation != affinity_generation_) {
+      applied_affinity_generation = affinity_generation_;
+      cpus = PreferredCpusLocked();
+      move = true;
+    }
+    if (applied_hint_generation != hint_generation_) {
+      applied_hint_generation = hint_generation_;
+      if (mode_ == Mode::kPerformance)
+        hint_session_factory = hint_session_factory_;
+      update_hint_session = true;
+    }
+  }
+  in_worker_task = true;
+  if (move)
+    SetThreadAffinity(cpus);
+  // Opening a session may take a binder call, so it is done without the lock.
+  if (update_hint_session) {
+    hint_session.reset();
+    if (hint_session_factory) {
+      hint_session = hint_session_factory(
+          static_cast<int32_t>(syscall(SYS_gettid)),
+          base::TimeDelta::FromMilliseconds(kHintTargetTaskMilliseconds));
+    }
+  }
+  if (hint_session)
+    hint_task_start = base::TimeTicks::Now();
+}
+
+void CpuPolicy::EndWorkerTask() {
+  in_worker_task = false;
+  if (hint_session) {
+    hint_session->ReportActualWorkDuration(base::TimeTicks::Now() -
+                                           hint_task_start);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_tasks_--;
+  }
+  slot_released_.notify_all();
+}
+
+bool CpuPolicy::InWorkerTask() {
+  return in_worker_task;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,135 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_CPU_POLICY_H_
+#define UPDATE_ENGINE_COMMON_CPU_POLICY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/common/performance_hint.h"
+
+namespace chromeos_update_engine {
+
+// Decides where and how many of the WorkerPool threads of the process run
+// their tasks. In performance mode the workers run on the big cores, in the
+// background mode on the little ones, and the more the device heats up the
+// fewer tasks run at the same time, across all the pools. In performance
+// mode, the worker threads also report how long their tasks take to a
+// performance hint session each, so that the governor boosts them.
+class CpuPolicy {
+ public:
+  enum class Mode {
+    kBackground,
+    kPerformance,
+  };
+
+  // Opens a performance hint session for the thread |tid|, targeting |target|
+  // per task, or returns null if the device has none.
+  using HintSessionFactory = std::function<std::unique_ptr<
+      PerformanceHintSession>(int32_t tid, base::TimeDelta target)>;
+
+  // The work duration the performance hint sessions target for each worker
+  // task. Most operations and hash batches take longer than this on a device
+  // at its lowest clocks, so the governor ramps up as soon as they start.
+  static constexpr int64_t kHintTargetTaskMilliseconds = 10;
+
+  // The thermal headroom from which at most two, then one, worker tasks run
+  // at the same time. See HardwareInterface::GetThermalHeadroom().
+  static constexpr float kModerateThermalHeadroom = 0.85f;
+  static constexpr float kSevereThermalHeadroom = 0.95f;
+
+  CpuPolicy() = default;
+
+  // The policy shared by the whole process. Until the CPU capacities are
+  // loaded and a thermal headroom is set, it leaves the workers alone.
+  static CpuPolicy* Get();
+
+  // Loads the capacity of each CPU from <sysfs_cpu_dir>/cpu<N>/cpu_capacity,
+  // as exposed by the kernel on asymmetric CPUs. Returns false, using no
+  // affinity, if some CPU has no capacity.
+  bool LoadCpuCapacities(
+      const std::string& sysfs_cpu_dir = "/sys/devices/system/cpu");
+  void SetCpuCapacities(const std::vector<uint32_t>& capacities);
+
+  void SetMode(Mode mode);
+  Mode mode() const;
+
+  // Returns the CPUs the workers should run on in the current mode: all but
+  // the smallest cores in performance mode, the smallest ones in background
+  // mode. Empty, for no affinity, when all the cores are the same.
+  std::vector<int> PreferredCpus() const;
+
+  // Sets how close the device is to throttling, 1 meaning severe throttling.
+  // A negative value means unknown.
+  void SetThermalHeadroom(float headroom);
+
+  // Returns how many worker tasks may run at the same time, 0 meaning no
+  // limit.
+  size_t MaxRunningTasks() const;
+
+  // Sets how the worker threads open their performance hint sessions. They
+  // open one when they start a task in performance mode, and close it when
+  // they start one in background mode.
+  void SetHintSessionFactory(HintSessionFactory factory);
+
+  // Called by the worker threads around each task. BeginWorkerTask() moves
+  // the calling thread to PreferredCpus() if they changed, and blocks while
+  // MaxRunningTasks() tasks are running. EndWorkerTask() reports the duration
+  // of the task to the performance hint session of the thread, if any.
+  void BeginWorkerTask();
+  void EndWorkerTask();
+
+  // Whether the calling thread is between BeginWorkerTask() and
+  // EndWorkerTask(). Such a thread waiting for other worker tasks must end its
+  // own task for that long, or it could hold the last running slot.
+  static bool InWorkerTask();
+
+ private:
+  std::vector<int> PreferredCpusLocked() const;
+  size_t MaxRunningTasksLocked() const;
+
+  mutable std::mutex mutex_;
+  // Signaled when a task ends or the limit changes.
+  std::condition_variable slot_released_;
+
+  std::vector<uint32_t> capacities_;
+  Mode mode_{Mode::kBackground};
+  float thermal_headroom_{-1};
+  size_t running_tasks_{0};
+  // Incremented whenever PreferredCpus() may have changed.
+  uint64_t affinity_generation_{0};
+  HintSessionFactory hint_session_factory_;
+  // Changed, to a value unique in the process, whenever the worker threads
+  // should open or close their performance hint sessions.
+  uint64_t hint_generation_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(CpuPolicy);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_CPU_POLICY_H_
@@ -0,0 +1,168 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/cpu_policy.h"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Counts the open sessions and the durations reported to them.
+class FakePerformanceHintSession : public PerformanceHintSession {
+ public:
+  FakePerformanceHintSession(int* open_sessions, int* reports)
+      : open_sessions_(open_sessions), reports_(reports) {
+    (*open_sessions_)++;
+  }
+  ~FakePerformanceHintSession() override { (*open_sessions_)--; }
+
+  void ReportActualWorkDuration(base::TimeDelta duration) override {
+    (*reports_)++;
+  }
+
+ private:
+  int* open_sessions_;
+  int* reports_;
+};
+}  // namespace
+
+TEST(CpuPolicyTest, PreferredCpusTest) {
+  CpuPolicy policy;
+  EXPECT_TRUE(policy.PreferredCpus().empty());
+  policy.SetCpuCapacities({1024, 1024});
+  EXPECT_TRUE(policy.PreferredCpus().empty());
+
+  policy.SetCpuCapacities({160, 160, 498, 1024});
+  EXPECT_EQ(CpuPolicy::Mode::kBackground, policy.mode());
+  EXPECT_EQ((std::vector<int>{0, 1}), policy.PreferredCpus());
+  policy.SetMode(CpuPolicy::Mode::kPerformance);
+  EXPECT_EQ((std::vector<int>{2, 3}), policy.PreferredCpus());
+}
+
+TEST(CpuPolicyTest, LoadCpuCapacitiesTest) {
+  base::ScopedTempDir sysfs_dir;
+  ASSERT_TRUE(sysfs_dir.CreateUniqueTempDir());
+  const long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  ASSERT_GT(num_cpus, 0);
+  CpuPolicy policy;
+  EXPECT_FALSE(policy.LoadCpuCapacities(sysfs_dir.GetPath().value()));
+
+  for (long cpu = 0; cpu < num_cpus; cpu++) {
+    const auto cpu_dir =
+        sysfs_dir.GetPath().Append("cpu" + std::to_string(cpu));
+    ASSERT_TRUE(base::CreateDirectory(cpu_dir));
+    ASSERT_TRUE(test_utils::WriteFileString(
+        cpu_dir.Append("cpu_capacity").value(), cpu == 0 ? "100\n" : "1024\n"));
+  }
+  EXPECT_TRUE(policy.LoadCpuCapacities(sysfs_dir.GetPath().value()));
+  if (num_cpus > 1)
+    EXPECT_EQ((std::vector<int>{0}), policy.PreferredCpus());
+}
+
+TEST(CpuPolicyTest, ThermalHeadroomTest) {
+  CpuPolicy policy;
+  EXPECT_EQ(0u, policy.MaxRunningTasks());
+  policy.SetThermalHeadroom(0.5);
+  EXPECT_EQ(0u, policy.MaxRunningTasks());
+  policy.SetThermalHeadroom(CpuPolicy::kModerateThermalHeadroom);
+  EXPECT_EQ(2u, policy.MaxRunningTasks());
+  policy.SetThermalHeadroom(1.2);
+  EXPECT_EQ(1u, policy.MaxRunningTasks());
+  policy.SetThermalHeadroom(-1);
+  EXPECT_EQ(0u, policy.MaxRunningTasks());
+}
+
+TEST(CpuPolicyTest, LimitsRunningTasksTest) {
+  CpuPolicy policy;
+  policy.SetThermalHeadroom(1);
+  policy.BeginWorkerTask();
+  EXPECT_TRUE(CpuPolicy::InWorkerTask());
+
+  std::atomic<bool> started{false};
+  std::thread worker([&policy, &started] {
+    policy.BeginWorkerTask();
+    started = true;
+    policy.EndWorkerTask();
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(started);
+  policy.EndWorkerTask();
+  EXPECT_FALSE(CpuPolicy::InWorkerTask());
+  worker.join();
+  EXPECT_TRUE(started);
+}
+
+TEST(CpuPolicyTest, HintSessionsTest) {
+  CpuPolicy policy;
+  int open_sessions = 0;
+  int reports = 0;
+  base::TimeDelta target;
+  policy.SetHintSessionFactory(
+      [&open_sessions, &reports, &target](int32_t tid, base::TimeDelta t) {
+        target = t;
+        return std::make_unique<FakePerformanceHintSession>(&open_sessions,
+                                                            &reports);
+      });
+
+  // The thread-local sessions of a new thread, closed when it exits.
+  std::thread worker([&policy, &open_sessions, &reports] {
+    // No hints in background mode.
+    policy.BeginWorkerTask();
+    policy.EndWorkerTask();
+    EXPECT_EQ(0, open_sessions);
+
+    policy.SetMode(CpuPolicy::Mode::kPerformance);
+    for (int i = 0; i < 2; i++) {
+      policy.BeginWorkerTask();
+      policy.EndWorkerTask();
+    }
+    EXPECT_EQ(1, open_sessions);
+    EXPECT_EQ(2, reports);
+
+    // Going back to the background drops the session.
+    policy.SetMode(CpuPolicy::Mode::kBackground);
+    policy.BeginWorkerTask();
+    policy.EndWorkerTask();
+    EXPECT_EQ(0, open_sessions);
+    EXPECT_EQ(2, reports);
+
+    policy.SetMode(CpuPolicy::Mode::kPerformance);
+    policy.BeginWorkerTask();
+    policy.EndWorkerTask();
+  });
+  worker.join();
+  EXPECT_EQ(0, open_sessions);
+  EXPECT_EQ(3, reports);
+  EXPECT_EQ(
+      base::TimeDelta::FromMilliseconds(CpuPolicy::kHintTargetTaskMilliseconds),
+      target);
+}
+
+}  // namespace chromeos_update_engine
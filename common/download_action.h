@@ -25,9 +25,14 @@
 #include <string>
 #include <utility>
 
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/secure_blob.h>
+
 #include "update_engine/common/action.h"
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/http_fetcher.h"
+#include "update_engine/common/memory_budget.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/install_plan.h"
@@ -60,6 +65,12 @@ class DownloadActionDelegate {
   // while applying or downloading the partial payload will result in this
   // method not being called.
   virtual void DownloadComplete() = 0;
+
+  // Called as the operations of the payload are applied, with the partition
+  // of the current one and the number applied out of |total_operations|.
+  virtual void OperationsApplied(const std::string& partition,
+                                 uint64_t operations_applied,
+                                 uint64_t total_operations) {}
 };
 
 class PrefsInterface;
@@ -111,6 +122,16 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
 
   HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
 
+  // Adds a fetcher downloading parts of the payload along with the one passed
+  // to the constructor. Takes ownership of |fetcher|.
+  void AddParallelFetcher(HttpFetcher* fetcher) {
+    http_fetcher_->AddParallelFetcher(fetcher);
+  }
+
+  // Limits the download to |bytes_per_second| on average, 0 meaning no limit.
+  // Starts from InstallPlan::max_download_rate and may be changed at any time.
+  void SetMaxDownloadRate(uint64_t bytes_per_second);
+
  private:
   // Attempt to load cached manifest data from prefs
   // return true on success, false otherwise.
@@ -119,6 +140,32 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // Start downloading the current payload using delta_performer.
   void StartDownloading();
 
+  // Passes |bytes| to |delta_performer_|, terminating the processing if it
+  // fails. Returns whether it succeeded.
+  bool WriteToDeltaPerformer(const void* bytes, size_t length);
+
+  // With a download buffer, writes the next bytes of |download_buffer_| to
+  // |delta_performer_| and schedules itself again until the buffer is empty.
+  // Each call writes a bounded amount, so that the fetcher gets to run in
+  // between.
+  void WriteBufferedBytes();
+  void ScheduleWriteBufferedBytes();
+  void CancelWriteBufferedBytes();
+  size_t BufferedBytes() const {
+    return download_buffer_.size() - download_buffer_offset_;
+  }
+  void ClearDownloadBuffer();
+
+  // Pauses or unpauses |http_fetcher_| as needed by |suspended_|,
+  // |download_buffer_full_| and |throttled_|.
+  void UpdateFetcherPause();
+
+  // Accounts the |length| bytes just received against |max_download_rate_|,
+  // pausing the download until it's back to that rate.
+  void ThrottleDownload(size_t length);
+  void EndThrottle();
+  void CancelThrottle();
+
   // Pointer to the current payload in install_plan_.payloads.
   InstallPlan::Payload* payload_{nullptr};
 
@@ -157,6 +204,34 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // The path to the zip file with X509 certificates.
   const std::string update_certificates_path_;
 
+  // With a download buffer, the bytes received and not written yet to
+  // |delta_performer_| start at |download_buffer_offset_|. The fetcher is
+  // paused once they reach the size of |download_buffer_reservation_|, which
+  // may be passed by the last bytes received, until half of them are written.
+  brillo::Blob download_buffer_;
+  size_t download_buffer_offset_{0};
+  MemoryBudget::Reservation download_buffer_reservation_;
+  bool download_buffer_full_{false};
+  brillo::MessageLoop::TaskId write_task_id_{brillo::MessageLoop::kTaskIdNull};
+  // Set when the transfer completed before the buffer was written, with the
+  // result of the transfer.
+  bool transfer_complete_pending_{false};
+  bool transfer_successful_{false};
+
+  // The download rate limit in bytes per second, or 0. The bytes received
+  // since |rate_window_start_| are |rate_window_bytes_|.
+  uint64_t max_download_rate_{0};
+  base::TimeTicks rate_window_start_;
+  uint64_t rate_window_bytes_{0};
+  bool throttled_{false};
+  brillo::MessageLoop::TaskId throttle_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
+  // Whether the action is suspended, and whether |http_fetcher_| is paused
+  // because of it, of the download buffer or of the rate limit.
+  bool suspended_{false};
+  bool fetcher_paused_{false};
+
   DISALLOW_COPY_AND_ASSIGN(DownloadAction);
 };
 
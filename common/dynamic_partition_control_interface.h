@@ -179,6 +179,13 @@ class DynamicPartitionControlInterface {
 
   // Create virtual block devices for all partitions.
   virtual bool MapAllPartitions() = 0;
+  // Maps the target devices of the dynamic partitions in |partition_names|
+  // at |target_slot| ahead of GetPartitionDevice(), several at a time. The
+  // ones that are not mapped are mapped by GetPartitionDevice() as usual.
+  // Returns false if any of them couldn't be mapped here.
+  virtual bool MapTargetPartitions(
+      const std::vector<std::string>& partition_names,
+      uint32_t target_slot) = 0;
   // Unmap virtual block devices for all partitions.
   virtual bool UnmapAllPartitions() = 0;
 
@@ -106,6 +106,11 @@ bool DynamicPartitionControlStub::MapAllPartitions() {
   return false;
 }
 
+bool DynamicPartitionControlStub::MapTargetPartitions(
+    const std::vector<std::string>& partition_names, uint32_t target_slot) {
+  return true;
+}
+
 bool DynamicPartitionControlStub::UnmapAllPartitions() {
   return false;
 }
@@ -74,6 +74,8 @@ class DynamicPartitionControlStub final : public DynamicPartitionControlInterfac
   }
 
   bool MapAllPartitions() override;
+  bool MapTargetPartitions(const std::vector<std::string>& partition_names,
+                           uint32_t target_slot) override;
   bool UnmapAllPartitions() override;
 
   bool IsDynamicPartition(const std::string& part_name, uint32_t slot) override;
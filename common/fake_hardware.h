@@ -227,6 +227,19 @@ class FakeHardware : public HardwareInterface {
 #endif
   }
 
+  uint64_t GetMemoryBudget() const override { return memory_budget_; }
+  void SetMemoryBudget(uint64_t memory_budget) {
+    memory_budget_ = memory_budget;
+  }
+
+  float GetThermalHeadroom() const override { return thermal_headroom_; }
+  void SetThermalHeadroom(float headroom) { thermal_headroom_ = headroom; }
+
+  std::unique_ptr<PerformanceHintSession> CreatePerformanceHintSession(
+      int32_t tid, base::TimeDelta target) const override {
+    return nullptr;
+  }
+
  private:
   bool is_official_build_{true};
   bool is_normal_boot_mode_{true};
@@ -248,6 +261,8 @@ class FakeHardware : public HardwareInterface {
   bool first_active_omaha_ping_sent_{false};
   bool warm_reset_{false};
   mutable std::map<std::string, std::string> partition_timestamps_;
+  uint64_t memory_budget_{0};
+  float thermal_headroom_{-1};
 
   DISALLOW_COPY_AND_ASSIGN(FakeHardware);
 };
@@ -21,14 +21,17 @@
 #include <string>
 #include <utility>
 
+#include <base/files/memory_mapped_file.h>
 #include <base/logging.h>
 #include <base/macros.h>
+#include <brillo/message_loops/message_loop.h>
 #include <brillo/streams/stream.h>
 
 #include "update_engine/common/http_fetcher.h"
 
 // This is a concrete implementation of HttpFetcher that reads files
-// asynchronously.
+// asynchronously. Local regular files are mapped and passed to the delegate
+// straight from the mapping, other files are read through a stream.
 
 namespace chromeos_update_engine {
 
@@ -83,10 +86,17 @@ class FileFetcher : public HttpFetcher {
   // Cleans up the fetcher, resetting its status to a newly constructed one.
   void CleanUp();
 
+  // Maps the requested range of the regular file |fd| into |mapped_file_|.
+  // Returns false if the file can't be mapped and should be streamed instead.
+  bool MapFile(int fd);
+
   // Schedule a new asynchronous read if the stream is not paused and no other
   // read is in process. This method can be called at any point.
   void ScheduleRead();
 
+  // Passes the next bytes of |mapped_file_| to the delegate.
+  void OnMappedReadCallback();
+
   // Called from the main loop when a single read from |stream_| succeeds or
   // fails, calling OnReadDoneCallback() and OnReadErrorCallback() respectively.
   void OnReadDoneCallback(size_t bytes_read);
@@ -99,7 +109,8 @@ class FileFetcher : public HttpFetcher {
   bool transfer_paused_{false};
 
   // Whether there's an ongoing asynchronous read. When this value is true, the
-  // the |buffer_| is being used by the |stream_|.
+  // the |buffer_| is being used by the |stream_|. Not used while the file is
+  // mapped.
   bool ongoing_read_{false};
 
   // Total number of bytes copied.
@@ -113,6 +124,11 @@ class FileFetcher : public HttpFetcher {
 
   brillo::StreamPtr stream_;
 
+  // The requested range of the file, when it is mapped instead of streamed.
+  std::unique_ptr<base::MemoryMappedFile> mapped_file_;
+  brillo::MessageLoop::TaskId mapped_read_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
   // The buffer used for reading from the stream.
   brillo::Blob buffer_;
 
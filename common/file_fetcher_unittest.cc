@@ -18,12 +18,40 @@
 
 #include <string>
 
+#include <brillo/message_loops/fake_message_loop.h>
+#include <brillo/secure_blob.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
 
 namespace chromeos_update_engine {
 
+namespace {
+
+class FileFetcherTestDelegate : public HttpFetcherDelegate {
+ public:
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    data_.insert(data_.end(), data, data + length);
+    chunks_++;
+    return true;
+  }
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    completed_ = true;
+    successful_ = successful;
+  }
+
+  brillo::Blob data_;
+  size_t chunks_{0};
+  bool completed_{false};
+  bool successful_{false};
+};
+
+}  // namespace
+
 class FileFetcherUnitTest : public ::testing::Test {};
 
 TEST_F(FileFetcherUnitTest, SupporterUrlsTest) {
@@ -34,4 +62,36 @@ TEST_F(FileFetcherUnitTest, SupporterUrlsTest) {
   EXPECT_FALSE(FileFetcher::SupportedUrl("http:///no_http_here"));
 }
 
+TEST_F(FileFetcherUnitTest, ReadsRangeOfRegularFileTest) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  ScopedTempFile file("file_fetcher.XXXXXX");
+  brillo::Blob contents(3 * 1024 * 1024 + 123);
+  for (size_t i = 0; i < contents.size(); i++)
+    contents[i] = static_cast<uint8_t>(i * 31 + i / 4096);
+  ASSERT_TRUE(utils::WriteFile(
+      file.path().c_str(), contents.data(), contents.size()));
+
+  // The range isn't aligned and ends before the end of the file.
+  const size_t offset = 4097;
+  const size_t length = contents.size() - offset - 100;
+  FileFetcher fetcher;
+  FileFetcherTestDelegate delegate;
+  fetcher.set_delegate(&delegate);
+  fetcher.SetOffset(offset);
+  fetcher.SetLength(length);
+  fetcher.BeginTransfer("file://" + file.path());
+  while (loop.RunOnce(true)) {
+  }
+  EXPECT_TRUE(delegate.completed_);
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_EQ(brillo::Blob(contents.begin() + offset,
+                         contents.begin() + offset + length),
+            delegate.data_);
+  EXPECT_EQ(length, fetcher.GetBytesDownloaded());
+  // Read in large chunks, not one task per 16 KiB.
+  EXPECT_LE(delegate.chunks_, 4u);
+  EXPECT_EQ(kHttpResponseOk, fetcher.http_response_code());
+}
+
 }  // namespace chromeos_update_engine
@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -26,6 +27,7 @@
 #include <base/time/time.h>
 
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/performance_hint.h"
 
 namespace chromeos_update_engine {
 
@@ -163,6 +165,21 @@ class HardwareInterface {
 
   virtual const char* GetPartitionMountOptions(
       const std::string& partition_name) const = 0;
+
+  // Returns how many bytes update_engine may use for its large buffers
+  // (download and operation buffers, writer caches, verifier buffers), see
+  // MemoryBudget. 0 means no limit.
+  virtual uint64_t GetMemoryBudget() const = 0;
+
+  // Returns how close the device is to thermal throttling, 1 meaning severe
+  // throttling, or a negative value if unknown. See CpuPolicy.
+  virtual float GetThermalHeadroom() const = 0;
+
+  // Opens a performance hint session for the thread |tid|, whose pieces of
+  // work should take |target|, or returns null if the device doesn't support
+  // them. See CpuPolicy.
+  virtual std::unique_ptr<PerformanceHintSession> CreatePerformanceHintSession(
+      int32_t tid, base::TimeDelta target) const = 0;
 };
 
 }  // namespace chromeos_update_engine
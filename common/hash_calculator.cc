@@ -22,6 +22,7 @@
 #include <base/posix/eintr_wrapper.h>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 
 using std::string;
 
@@ -95,6 +96,28 @@ bool HashCalculator::RawHashOfData(const brillo::Blob& data,
   return RawHashOfBytes(data.data(), data.size(), out_hash);
 }
 
+bool HashCalculator::RawHashOfBlobs(const std::vector<brillo::Blob>& blobs,
+                                    std::vector<brillo::Blob>* out_hashes,
+                                    WorkerPool* pool) {
+  out_hashes->clear();
+  out_hashes->resize(blobs.size());
+  if (!pool || pool->num_threads() < 2 || blobs.size() < 2) {
+    for (size_t i = 0; i < blobs.size(); i++) {
+      TEST_AND_RETURN_FALSE(RawHashOfData(blobs[i], &(*out_hashes)[i]));
+    }
+    return true;
+  }
+  bool posted = true;
+  for (size_t i = 0; i < blobs.size() && posted; i++) {
+    posted = pool->Post([&blobs, out_hashes, i] {
+      return RawHashOfData(blobs[i], &(*out_hashes)[i]);
+    });
+  }
+  // Wait even if posting failed, the queued tasks still reference |blobs|.
+  TEST_AND_RETURN_FALSE(pool->Wait());
+  return posted;
+}
+
 bool HashCalculator::RawHashOfFile(const string& name, brillo::Blob* out_hash) {
   const auto file_size = utils::FileSize(name);
   return RawHashOfFile(name, file_size, out_hash) == file_size;
@@ -35,6 +35,8 @@
 
 namespace chromeos_update_engine {
 
+class WorkerPool;
+
 class HashCalculator {
  public:
   HashCalculator();
@@ -72,6 +74,13 @@ class HashCalculator {
                              size_t length,
                              brillo::Blob* out_hash);
   static bool RawHashOfData(const brillo::Blob& data, brillo::Blob* out_hash);
+  // Hashes each of |blobs| on its own into the matching entry of |out_hashes|.
+  // When |pool| is given the blobs are hashed concurrently on its workers,
+  // which must not be running unrelated tasks since this waits for all of
+  // them.
+  static bool RawHashOfBlobs(const std::vector<brillo::Blob>& blobs,
+                             std::vector<brillo::Blob>* out_hashes,
+                             WorkerPool* pool = nullptr);
   static off_t RawHashOfFile(const std::string& name,
                              off_t length,
                              brillo::Blob* out_hash);
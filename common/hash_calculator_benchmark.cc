@@ -0,0 +1,85 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <base/logging.h>
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/worker_pool.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kDataSize = 16 * 1024 * 1024;
+
+// Argument: the size of the chunks given to Update(), from a single block to a
+// large downloaded chunk.
+void BM_HashCalculatorUpdate(benchmark::State& state) {
+  brillo::Blob data(kDataSize);
+  std::mt19937 rng(0);
+  std::generate(data.begin(), data.end(), rng);
+  const size_t chunk_size = state.range(0);
+  for (auto _ : state) {
+    HashCalculator hasher;
+    for (size_t pos = 0; pos < data.size(); pos += chunk_size) {
+      CHECK(hasher.Update(data.data() + pos,
+                          std::min(chunk_size, data.size() - pos)));
+    }
+    CHECK(hasher.Finalize());
+    benchmark::DoNotOptimize(hasher.raw_hash());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_HashCalculatorUpdate)
+    ->ArgName("chunk_size")
+    ->Arg(4096)
+    ->Arg(64 * 1024)
+    ->Arg(1024 * 1024);
+
+// Argument: the number of workers hashing 1024 independent 16 KiB blobs, the
+// way ReorderDataBlobs() hashes the operation blobs of a payload.
+void BM_HashCalculatorRawHashOfBlobs(benchmark::State& state) {
+  std::vector<brillo::Blob> blobs(1024, brillo::Blob(16 * 1024));
+  std::mt19937 rng(0);
+  for (auto& blob : blobs) {
+    std::generate(blob.begin(), blob.end(), rng);
+  }
+  WorkerPool pool(state.range(0), state.range(0));
+  std::vector<brillo::Blob> hashes;
+  for (auto _ : state) {
+    CHECK(HashCalculator::RawHashOfBlobs(blobs, &hashes, &pool));
+    benchmark::DoNotOptimize(hashes);
+  }
+  state.SetBytesProcessed(state.iterations() * blobs.size() *
+                          blobs[0].size());
+}
+BENCHMARK(BM_HashCalculatorRawHashOfBlobs)
+    ->ArgName("threads")
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(4)
+    ->Arg(8)
+    ->UseRealTime();
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
@@ -28,6 +28,7 @@
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 
 using std::string;
 using std::vector;
@@ -144,6 +145,30 @@ TEST_F(HashCalculatorTest, UpdateFileNonexistentTest) {
   EXPECT_EQ(-1, calc.UpdateFile("/some/non-existent/file", -1));
 }
 
+TEST_F(HashCalculatorTest, RawHashOfBlobsTest) {
+  vector<brillo::Blob> blobs{{'h', 'i'}, {}, {'h', 'i'}};
+  for (size_t i = 0; i < 32; i++) {
+    blobs.emplace_back(i * 1000, static_cast<uint8_t>(i));
+  }
+  vector<brillo::Blob> expected;
+  ASSERT_TRUE(HashCalculator::RawHashOfBlobs(blobs, &expected));
+  ASSERT_EQ(blobs.size(), expected.size());
+  brillo::Blob raw_hash(std::begin(kExpectedRawHash),
+                        std::end(kExpectedRawHash));
+  EXPECT_EQ(raw_hash, expected[0]);
+  EXPECT_EQ(raw_hash, expected[2]);
+  for (size_t i = 0; i < blobs.size(); i++) {
+    brillo::Blob hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfData(blobs[i], &hash));
+    EXPECT_EQ(hash, expected[i]);
+  }
+
+  WorkerPool pool(4, 8);
+  vector<brillo::Blob> hashes;
+  ASSERT_TRUE(HashCalculator::RawHashOfBlobs(blobs, &hashes, &pool));
+  EXPECT_EQ(expected, hashes);
+}
+
 TEST_F(HashCalculatorTest, AbortTest) {
   // Just make sure we don't crash and valgrind doesn't detect memory leaks
   { HashCalculator calc; }
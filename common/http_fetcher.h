@@ -20,6 +20,7 @@
 #include <deque>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <base/callback.h>
@@ -91,6 +92,20 @@ class HttpFetcher {
   virtual void SetLength(size_t length) = 0;
   virtual void UnsetLength() = 0;
 
+  // Downloads all the |ranges|, offsets and lengths in ascending order, with a
+  // single request instead of the range set by SetOffset() and SetLength().
+  // The body of a successful response is then multipart/byteranges, or
+  // whatever the server sent if it didn't honor the ranges. An empty |ranges|
+  // goes back to a single range. Returns false if the fetcher can't do it.
+  virtual bool SetMultipleRanges(
+      const std::vector<std::pair<off_t, size_t>>& ranges) {
+    return false;
+  }
+
+  // The Content-Type of the response being received, or an empty string if
+  // it isn't known.
+  virtual std::string GetResponseContentType() const { return ""; }
+
   // Begins the transfer to the specified URL. This fetcher instance should not
   // be destroyed until either TransferComplete, or TransferTerminated is
   // called.
@@ -219,6 +219,8 @@ class AnyHttpFetcherFactory {
 
   virtual bool IsMock() const = 0;
   virtual bool IsMulti() const = 0;
+  // Whether the ranges are split among parallel fetchers.
+  virtual bool IsParallel() const { return false; }
   virtual bool IsHttpSupported() const = 0;
   virtual bool IsFileFetcher() const = 0;
 
@@ -267,6 +269,7 @@ class LibcurlHttpFetcherFactory : public AnyHttpFetcherFactory {
     // Speed up test execution.
     ret->set_idle_seconds(1);
     ret->set_retry_seconds(1);
+    ret->set_max_retry_seconds(1);
     fake_hardware_.SetIsOfficialBuild(false);
     return ret;
   }
@@ -305,8 +308,10 @@ class MultiRangeHttpFetcherFactory : public LibcurlHttpFetcherFactory {
   // Necessary to unhide the definition in the base class.
   using AnyHttpFetcherFactory::NewLargeFetcher;
   HttpFetcher* NewLargeFetcher(ProxyResolver* proxy_resolver) override {
-    MultiRangeHttpFetcher* ret = new MultiRangeHttpFetcher(
-        new LibcurlHttpFetcher(proxy_resolver, &fake_hardware_));
+    LibcurlHttpFetcher* fetcher =
+        new LibcurlHttpFetcher(proxy_resolver, &fake_hardware_);
+    fetcher->set_max_retry_seconds(1);
+    MultiRangeHttpFetcher* ret = new MultiRangeHttpFetcher(fetcher);
     ret->ClearRanges();
     ret->AddRange(0);
     // Speed up test execution.
@@ -325,6 +330,30 @@ class MultiRangeHttpFetcherFactory : public LibcurlHttpFetcherFactory {
   bool IsMulti() const override { return true; }
 };
 
+// Splits the ranges with a length among three connections.
+class ParallelMultiRangeHttpFetcherFactory
+    : public MultiRangeHttpFetcherFactory {
+ public:
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherFactory::NewLargeFetcher;
+  HttpFetcher* NewLargeFetcher(ProxyResolver* proxy_resolver) override {
+    MultiRangeHttpFetcher* ret = static_cast<MultiRangeHttpFetcher*>(
+        MultiRangeHttpFetcherFactory::NewLargeFetcher(proxy_resolver));
+    for (int i = 0; i < 2; i++) {
+      LibcurlHttpFetcher* fetcher =
+          new LibcurlHttpFetcher(proxy_resolver, &fake_hardware_);
+      fetcher->set_idle_seconds(1);
+      fetcher->set_retry_seconds(1);
+      fetcher->set_max_retry_seconds(1);
+      ret->AddParallelFetcher(fetcher);
+    }
+    ret->set_parallel_chunk_size(4);
+    return ret;
+  }
+
+  bool IsParallel() const override { return true; }
+};
+
 class FileFetcherFactory : public AnyHttpFetcherFactory {
  public:
   // Necessary to unhide the definition in the base class.
@@ -439,6 +468,7 @@ class HttpFetcherTest : public ::testing::Test {
 typedef ::testing::Types<LibcurlHttpFetcherFactory,
                          MockHttpFetcherFactory,
                          MultiRangeHttpFetcherFactory,
+                         ParallelMultiRangeHttpFetcherFactory,
                          FileFetcherFactory,
                          MultiRangeHttpFetcherOverFileFetcherFactory>
     HttpFetcherTestTypes;
@@ -1183,6 +1213,30 @@ TYPED_TEST(HttpFetcherTest, MultiHttpFetcherSimpleTest) {
                                         : kHttpResponsePartialContent);
 }
 
+// The ranges are requested at once from a server sending multipart/byteranges
+// responses, while the test above falls back to a request per range.
+TYPED_TEST(HttpFetcherTest, MultiHttpFetcherMultipartTest) {
+  if (!this->test_.IsMulti() || this->test_.IsFileFetcher())
+    return;
+
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  vector<pair<off_t, off_t>> ranges;
+  ranges.push_back(make_pair(0, 25));
+  ranges.push_back(make_pair(99, 17));
+  ranges.push_back(make_pair(200, 3));
+  MultiTest(this->test_.NewLargeFetcher(),
+            this->test_.fake_hardware(),
+            LocalServerUrlForPath(
+                server->GetPort(),
+                base::StringPrintf("/multipart/%d", kBigLength)),
+            ranges,
+            "abcdefghijabcdefghijabcdejabcdefghijabcdefabc",
+            25 + 17 + 3,
+            kHttpResponsePartialContent);
+}
+
 TYPED_TEST(HttpFetcherTest, MultiHttpFetcherUnspecifiedEndTest) {
   if (!this->test_.IsMulti() || this->test_.IsFileFetcher())
     return;
@@ -1311,6 +1365,77 @@ TYPED_TEST(HttpFetcherTest, MultiHttpFetcherErrorIfOffsetUnrecoverableTest) {
             kHttpResponseUndefined);
 }
 
+// The chunks downloaded from a failing mirror are downloaded again from the
+// other URL.
+TYPED_TEST(HttpFetcherTest, MultiHttpFetcherMirrorFailoverTest) {
+  if (!this->test_.IsParallel())
+    return;
+
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  HttpFetcher* fetcher = this->test_.NewLargeFetcher();
+  static_cast<MultiRangeHttpFetcher*>(fetcher)->AddMirrorUrl(
+      this->test_.ErrorUrl(server->GetPort()));
+  vector<pair<off_t, off_t>> ranges;
+  ranges.push_back(make_pair(0, 25));
+  ranges.push_back(make_pair(99, 17));
+  MultiTest(fetcher,
+            this->test_.fake_hardware(),
+            this->test_.BigUrl(server->GetPort()),
+            ranges,
+            "abcdefghijabcdefghijabcdejabcdefghijabcdef",
+            25 + 17,
+            kHttpResponsePartialContent);
+}
+
+// The chunks downloaded from a failing peer are downloaded again from the
+// payload URL.
+TYPED_TEST(HttpFetcherTest, MultiHttpFetcherPeerFailoverTest) {
+  if (!this->test_.IsParallel())
+    return;
+
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  HttpFetcher* fetcher = this->test_.NewLargeFetcher();
+  static_cast<MultiRangeHttpFetcher*>(fetcher)->AddPeerUrl(
+      this->test_.ErrorUrl(server->GetPort()));
+  vector<pair<off_t, off_t>> ranges;
+  ranges.push_back(make_pair(0, 25));
+  ranges.push_back(make_pair(99, 17));
+  MultiTest(fetcher,
+            this->test_.fake_hardware(),
+            this->test_.BigUrl(server->GetPort()),
+            ranges,
+            "abcdefghijabcdefghijabcdejabcdefghijabcdef",
+            25 + 17,
+            kHttpResponsePartialContent);
+}
+
+// The bytes from the offset of a split part are downloaded from the start of
+// its URL, which is split in a range of its own.
+TYPED_TEST(HttpFetcherTest, MultiHttpFetcherSplitPartTest) {
+  if (!this->test_.IsMulti() || this->test_.IsFileFetcher())
+    return;
+
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  HttpFetcher* fetcher = this->test_.NewLargeFetcher();
+  static_cast<MultiRangeHttpFetcher*>(fetcher)->AddSplitPart(
+      25, this->test_.BigUrl(server->GetPort()));
+  vector<pair<off_t, off_t>> ranges;
+  ranges.push_back(make_pair(0, 40));
+  MultiTest(fetcher,
+            this->test_.fake_hardware(),
+            this->test_.BigUrl(server->GetPort()),
+            ranges,
+            "abcdefghijabcdefghijabcdeabcdefghijabcde",
+            40,
+            kHttpResponsePartialContent);
+}
+
 // This HttpFetcherDelegate calls TerminateTransfer at a configurable point.
 class MultiHttpFetcherTerminateTestDelegate : public HttpFetcherDelegate {
  public:
@@ -0,0 +1,168 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/memory_budget.h"
+
+#include <malloc.h>
+
+#include <algorithm>
+#include <limits>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+MemoryBudget::Reservation::Reservation(Reservation&& other) noexcept
+    : budget_(other.budget_), size_(other.size_), tag_(other.tag_) {
+  other.budget_ = nullptr;
+  other.size_ = 0;
+}
+
+MemoryBudget::Reservation& MemoryBudget::Reservation::operator=(
+    Reservation&& other) noexcept {
+  if (this != &other) {
+    Release();
+    budget_ = other.budget_;
+    size_ = other.size_;
+    tag_ = other.tag_;
+    other.budget_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+void MemoryBudget::Reservation::Release() {
+  if (budget_) {
+    budget_->Release(size_, tag_);
+  }
+  budget_ = nullptr;
+  size_ = 0;
+}
+
+MemoryBudget::~MemoryBudget() {
+  CHECK_EQ(reserved_, 0u) << "Memory budget destroyed with live reservations";
+}
+
+MemoryBudget* MemoryBudget::Get() {
+  // Leaked, so reservations held by late destructors never outlive it.
+  static MemoryBudget* budget = new MemoryBudget();
+  return budget;
+}
+
+void MemoryBudget::SetLimit(uint64_t limit) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  limit_ = limit;
+}
+
+uint64_t MemoryBudget::limit() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return limit_;
+}
+
+uint64_t MemoryBudget::reserved() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return reserved_;
+}
+
+uint64_t MemoryBudget::available() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return AvailableLocked();
+}
+
+uint64_t MemoryBudget::peak_reserved() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return peak_reserved_;
+}
+
+std::map<std::string, MemoryBudget::Usage> MemoryBudget::usage() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return usage_;
+}
+
+void MemoryBudget::ResetPeaks() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  peak_reserved_ = reserved_;
+  for (auto& [tag, usage] : usage_)
+    usage.peak_bytes = usage.bytes;
+}
+
+void MemoryBudget::TrimFreeMemory() {
+#if defined(__BIONIC__)
+  mallopt(M_PURGE, 0);
+#elif defined(__GLIBC__)
+  malloc_trim(0);
+#endif
+}
+
+uint64_t MemoryBudget::AvailableLocked() const {
+  if (limit_ == 0) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  return limit_ > reserved_ ? limit_ - reserved_ : 0;
+}
+
+void MemoryBudget::AddLocked(const char* tag, int64_t size) {
+  reserved_ += size;
+  peak_reserved_ = std::max(peak_reserved_, reserved_);
+  Usage& usage = usage_[tag];
+  usage.bytes += size;
+  usage.peak_bytes = std::max(usage.peak_bytes, usage.bytes);
+}
+
+bool MemoryBudget::TryReserve(size_t size,
+                              Reservation* reservation,
+                              const char* tag) {
+  // What |reservation| already holds from this budget is reused.
+  const size_t held = reservation->budget_ == this ? reservation->size_ : 0;
+  if (held > 0)
+    tag = reservation->tag_;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (size > held && size - held > AvailableLocked()) {
+      return false;
+    }
+    AddLocked(tag, static_cast<int64_t>(size) - static_cast<int64_t>(held));
+  }
+  if (held == 0) {
+    *reservation = Reservation(this, size, tag);
+  } else {
+    reservation->size_ = size;
+  }
+  return true;
+}
+
+MemoryBudget::Reservation MemoryBudget::Reserve(size_t min_size,
+                                                size_t preferred_size,
+                                                size_t granularity,
+                                                const char* tag) {
+  CHECK_GT(granularity, 0u);
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t size = std::min<uint64_t>(preferred_size, AvailableLocked());
+  size = std::max(min_size, size / granularity * granularity);
+  LOG_IF(WARNING, size > AvailableLocked())
+      << "Reserving " << size << " bytes, over the memory budget of " << limit_
+      << " bytes with " << reserved_ << " bytes reserved.";
+  AddLocked(tag, size);
+  return Reservation(this, size, tag);
+}
+
+void MemoryBudget::Release(size_t size, const char* tag) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CHECK_LE(size, reserved_);
+  AddLocked(tag, -static_cast<int64_t>(size));
+}
+
+}  // namespace chromeos_update_engine
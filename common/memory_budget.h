@@ -0,0 +1,142 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_MEMORY_BUDGET_H_
+#define UPDATE_ENGINE_COMMON_MEMORY_BUDGET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// Accounts for the large buffers of an update (download buffers, operation
+// blobs, writer caches, verifier buffers...) against a per-device limit, so
+// the pipelines using them can scale down instead of running out of memory.
+// Nothing is allocated here: callers reserve the size of the buffer they are
+// about to allocate and keep the Reservation alive as long as the buffer.
+// Each reservation is tagged with the subsystem holding it, whose current and
+// peak reserved bytes are accounted for separately.
+class MemoryBudget {
+ public:
+  // The tag of the reservations made without one.
+  static constexpr char kUntagged[] = "other";
+
+  // The bytes reserved under a tag.
+  struct Usage {
+    uint64_t bytes{0};
+    // The most reserved at once since the last ResetPeaks().
+    uint64_t peak_bytes{0};
+  };
+
+  // A share of the budget, returned to it on destruction. Move-only.
+  class Reservation {
+   public:
+    Reservation() = default;
+    Reservation(Reservation&& other) noexcept;
+    Reservation& operator=(Reservation&& other) noexcept;
+    ~Reservation() { Release(); }
+
+    // Returns the reserved bytes to the budget.
+    void Release();
+
+    size_t size() const { return size_; }
+    const char* tag() const { return tag_; }
+
+   private:
+    friend class MemoryBudget;
+    Reservation(MemoryBudget* budget, size_t size, const char* tag)
+        : budget_(budget), size_(size), tag_(tag) {}
+
+    MemoryBudget* budget_{nullptr};
+    size_t size_{0};
+    // A string literal.
+    const char* tag_{kUntagged};
+
+    DISALLOW_COPY_AND_ASSIGN(Reservation);
+  };
+
+  // A |limit| of 0 means unlimited.
+  explicit MemoryBudget(uint64_t limit = 0) : limit_(limit) {}
+  // All the reservations must be released before the budget is destroyed.
+  ~MemoryBudget();
+
+  // The budget shared by the whole process, unlimited until SetLimit() is
+  // called.
+  static MemoryBudget* Get();
+
+  // Changes the limit, 0 meaning unlimited. Existing reservations are kept
+  // even if they no longer fit.
+  void SetLimit(uint64_t limit);
+  uint64_t limit() const;
+
+  // The bytes currently reserved, and the bytes left for new reservations.
+  uint64_t reserved() const;
+  uint64_t available() const;
+
+  // The most bytes reserved at once since the last ResetPeaks().
+  uint64_t peak_reserved() const;
+  // The bytes reserved by tag, for all the tags reserved under since the
+  // budget was created.
+  std::map<std::string, Usage> usage() const;
+  // Starts the peaks over from the bytes currently reserved.
+  void ResetPeaks();
+
+  // Reserves exactly |size| bytes into |reservation| under |tag| if they are
+  // available, counting what |reservation| already holds as available. A
+  // reservation resized keeps its tag. Returns false and leaves |reservation|
+  // untouched if they aren't available.
+  bool TryReserve(size_t size,
+                  Reservation* reservation,
+                  const char* tag = kUntagged);
+
+  // Reserves as much of |preferred_size| as is available, rounded down to a
+  // multiple of |granularity|, but at least |min_size| bytes even if that goes
+  // over the limit: the caller can't make progress with less, and is expected
+  // to pick |min_size| small.
+  Reservation Reserve(size_t min_size,
+                      size_t preferred_size,
+                      size_t granularity = 1,
+                      const char* tag = kUntagged);
+
+  // Returns the memory freed by the process to the system, so that its
+  // resident memory falls when an update moves on to a phase which needs less
+  // of it.
+  static void TrimFreeMemory();
+
+ private:
+  uint64_t AvailableLocked() const;
+  // Adds |size| bytes, which may be negative, to what is reserved under |tag|.
+  void AddLocked(const char* tag, int64_t size);
+  void Release(size_t size, const char* tag);
+
+  mutable std::mutex mutex_;
+  uint64_t limit_;
+  uint64_t reserved_{0};
+  uint64_t peak_reserved_{0};
+  std::map<std::string, Usage> usage_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryBudget);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_MEMORY_BUDGET_H_
@@ -0,0 +1,128 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/memory_budget.h"
+
+#include <limits>
+#include <utility>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(MemoryBudgetTest, UnlimitedTest) {
+  MemoryBudget budget;
+  EXPECT_EQ(std::numeric_limits<uint64_t>::max(), budget.available());
+  MemoryBudget::Reservation reservation;
+  ASSERT_TRUE(budget.TryReserve(1 << 30, &reservation));
+  EXPECT_EQ(1u << 30, reservation.size());
+  EXPECT_EQ(1u << 30, budget.reserved());
+  reservation.Release();
+  EXPECT_EQ(0u, budget.reserved());
+}
+
+TEST(MemoryBudgetTest, TryReserveTest) {
+  MemoryBudget budget(100);
+  MemoryBudget::Reservation first, second;
+  ASSERT_TRUE(budget.TryReserve(60, &first));
+  EXPECT_EQ(40u, budget.available());
+  ASSERT_FALSE(budget.TryReserve(50, &second));
+  EXPECT_EQ(0u, second.size());
+  ASSERT_TRUE(budget.TryReserve(40, &second));
+  EXPECT_EQ(0u, budget.available());
+
+  // Reserving again into |first| releases its previous share first.
+  ASSERT_TRUE(budget.TryReserve(10, &first));
+  EXPECT_EQ(50u, budget.reserved());
+}
+
+TEST(MemoryBudgetTest, ReserveDegradesTest) {
+  MemoryBudget budget(100);
+  auto first = budget.Reserve(10, 80);
+  EXPECT_EQ(80u, first.size());
+  // Only 20 bytes left.
+  auto second = budget.Reserve(10, 80);
+  EXPECT_EQ(20u, second.size());
+  // Nothing left, but the minimum is always granted.
+  auto third = budget.Reserve(10, 80);
+  EXPECT_EQ(10u, third.size());
+  EXPECT_EQ(110u, budget.reserved());
+  EXPECT_EQ(0u, budget.available());
+}
+
+TEST(MemoryBudgetTest, ReserveGranularityTest) {
+  MemoryBudget budget(100);
+  auto first = budget.Reserve(30, 120, 30);
+  EXPECT_EQ(90u, first.size());
+  // 10 bytes left, less than the minimum.
+  auto second = budget.Reserve(30, 60, 30);
+  EXPECT_EQ(30u, second.size());
+  EXPECT_EQ(120u, budget.reserved());
+}
+
+TEST(MemoryBudgetTest, MoveTest) {
+  MemoryBudget budget(100);
+  MemoryBudget::Reservation outer;
+  {
+    auto inner = budget.Reserve(30, 30);
+    outer = std::move(inner);
+    EXPECT_EQ(0u, inner.size());
+  }
+  EXPECT_EQ(30u, budget.reserved());
+  MemoryBudget::Reservation moved(std::move(outer));
+  EXPECT_EQ(30u, moved.size());
+  EXPECT_EQ(30u, budget.reserved());
+  moved = MemoryBudget::Reservation();
+  EXPECT_EQ(0u, budget.reserved());
+}
+
+TEST(MemoryBudgetTest, SetLimitTest) {
+  MemoryBudget budget;
+  auto reservation = budget.Reserve(50, 50);
+  budget.SetLimit(40);
+  EXPECT_EQ(50u, reservation.size());
+  EXPECT_EQ(0u, budget.available());
+  reservation.Release();
+  EXPECT_EQ(40u, budget.available());
+}
+
+TEST(MemoryBudgetTest, UsageByTagTest) {
+  MemoryBudget budget;
+  auto download = budget.Reserve(30, 30, 1, "download");
+  MemoryBudget::Reservation cache;
+  ASSERT_TRUE(budget.TryReserve(20, &cache, "cache"));
+  // Resizing keeps the tag of the reservation.
+  ASSERT_TRUE(budget.TryReserve(50, &cache, "other_tag"));
+  EXPECT_STREQ("cache", cache.tag());
+  download.Release();
+  ASSERT_TRUE(budget.TryReserve(10, &cache));
+
+  auto usage = budget.usage();
+  EXPECT_EQ(0u, usage["download"].bytes);
+  EXPECT_EQ(30u, usage["download"].peak_bytes);
+  EXPECT_EQ(10u, usage["cache"].bytes);
+  EXPECT_EQ(50u, usage["cache"].peak_bytes);
+  EXPECT_EQ(0u, usage.count("other_tag"));
+  EXPECT_EQ(80u, budget.peak_reserved());
+
+  budget.ResetPeaks();
+  usage = budget.usage();
+  EXPECT_EQ(0u, usage["download"].peak_bytes);
+  EXPECT_EQ(10u, usage["cache"].peak_bytes);
+  EXPECT_EQ(10u, budget.peak_reserved());
+}
+
+}  // namespace chromeos_update_engine
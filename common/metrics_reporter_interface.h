@@ -26,6 +26,7 @@
 #include "update_engine/common/dynamic_partition_control_interface.h"
 #include "update_engine/common/error_code.h"
 #include "update_engine/common/metrics_constants.h"
+#include "update_engine/common/performance_recorder.h"
 #include "update_engine/payload_consumer/install_plan.h"
 
 namespace chromeos_update_engine {
@@ -233,6 +234,10 @@ class MetricsReporterInterface {
   //
   virtual void ReportEnterpriseUpdateSeenToDownloadDays(
       bool has_time_restriction_policy, int time_to_update_days) = 0;
+
+  // Helper function to report where the time and the I/O of an update attempt,
+  // or of a merge, went. See PerformanceReport.
+  virtual void ReportPerformanceMetrics(const PerformanceReport& report) = 0;
 };
 
 namespace metrics {
@@ -47,6 +47,10 @@ class MockDynamicPartitionControl : public DynamicPartitionControlInterface {
                bool is_append),
               (override));
   MOCK_METHOD(bool, MapAllPartitions, (), (override));
+  MOCK_METHOD(bool,
+              MapTargetPartitions,
+              (const std::vector<std::string>&, uint32_t),
+              (override));
   MOCK_METHOD(bool, UnmapAllPartitions, (), (override));
 
   MOCK_METHOD(bool,
@@ -90,6 +90,9 @@ class MockMetricsReporter : public MetricsReporterInterface {
 
   MOCK_METHOD2(ReportEnterpriseUpdateSeenToDownloadDays,
                void(bool has_time_restriction_policy, int time_to_update_days));
+
+  MOCK_METHOD1(ReportPerformanceMetrics,
+               void(const PerformanceReport& report));
 };
 
 }  // namespace chromeos_update_engine
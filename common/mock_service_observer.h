@@ -28,6 +28,8 @@ class MockServiceObserver : public ServiceObserverInterface {
       SendStatusUpdate,
       void(const update_engine::UpdateEngineStatus& update_engine_status));
   MOCK_METHOD1(SendPayloadApplicationComplete, void(ErrorCode error_code));
+  MOCK_METHOD1(SendStatsUpdate,
+               void(const update_engine::UpdateEngineStats& stats));
 };
 
 }  // namespace chromeos_update_engine
@@ -16,15 +16,40 @@
 
 #include "update_engine/common/multi_range_http_fetcher.h"
 
+#include <base/bind.h>
 #include <base/strings/stringprintf.h>
 
 #include <algorithm>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "update_engine/common/utils.h"
 
+using base::TimeDelta;
+using base::TimeTicks;
+using brillo::MessageLoop;
+
 namespace chromeos_update_engine {
 
+namespace {
+
+// How long a chunk may go without receiving anything before the rest of it is
+// downloaded from another mirror, well before the connection's low speed
+// timeout would fail it.
+constexpr TimeDelta kMirrorStallTimeout = TimeDelta::FromSeconds(10);
+constexpr TimeDelta kMirrorStallCheckInterval = TimeDelta::FromSeconds(2);
+
+// The weight of the last chunk in the measured throughput of a mirror.
+constexpr double kThroughputSmoothing = 0.3;
+
+}  // namespace
+
+MultiRangeHttpFetcher::~MultiRangeHttpFetcher() {
+  MessageLoop::current()->CancelTask(stall_check_task_);
+}
+
 // Begins the transfer to the specified URL.
 // State change: Stopped -> Downloading
 // (corner case: Stopped -> Stopped for an empty request)
@@ -42,6 +67,13 @@ void MultiRangeHttpFetcher::BeginTransfer(const std::string& url) {
   url_ = url;
   current_index_ = 0;
   bytes_received_this_range_ = 0;
+  if (!split_parts_.empty()) {
+    SplitRangesAtParts();
+  }
+  if (CanFetchInParallel()) {
+    BeginParallelTransfer();
+    return;
+  }
   LOG(INFO) << "starting first transfer";
   base_fetcher_->set_delegate(this);
   StartTransfer();
@@ -58,40 +90,257 @@ void MultiRangeHttpFetcher::TerminateTransfer() {
   }
   terminating_ = true;
 
+  if (parallel_) {
+    callback_depth_++;
+    TerminateParallelFetchers(0);
+    callback_depth_--;
+    MaybeEndParallelTransfer();
+    return;
+  }
+
   if (!pending_transfer_ended_) {
     pending_transfer_ended_ = true;
     base_fetcher_->TerminateTransfer();
   }
 }
 
+void MultiRangeHttpFetcher::Pause() {
+  if (!parallel_) {
+    base_fetcher_->Pause();
+    return;
+  }
+  // Paused transfers don't stall.
+  MessageLoop::current()->CancelTask(stall_check_task_);
+  stall_check_task_ = MessageLoop::kTaskIdNull;
+  for (HttpFetcher* fetcher : AllFetchers()) {
+    fetcher->Pause();
+  }
+}
+
+void MultiRangeHttpFetcher::Unpause() {
+  if (!parallel_) {
+    base_fetcher_->Unpause();
+    return;
+  }
+  const TimeTicks now = TimeTicks::Now();
+  for (auto& [fetcher, fetch] : active_fetches_) {
+    fetch.last_bytes_time = now;
+  }
+  ScheduleStallCheck();
+  for (HttpFetcher* fetcher : AllFetchers()) {
+    fetcher->Unpause();
+  }
+}
+
 // State change: Stopped or Downloading -> Downloading
 void MultiRangeHttpFetcher::StartTransfer() {
   if (current_index_ >= ranges_.size()) {
     return;
   }
 
+  if (CanFetchMultipart()) {
+    StartMultipartTransfer();
+    return;
+  }
+
   Range range = ranges_[current_index_];
   LOG(INFO) << "starting transfer of range " << range.ToString();
 
-  bytes_received_this_range_ = 0;
-  base_fetcher_->SetOffset(range.offset());
+  // The rest of a range cut short by a multipart transfer.
+  const off_t offset = range.offset() + bytes_received_this_range_;
+  off_t part_offset = offset;
+  const std::string url = ResolveSplitPart(url_, &part_offset);
+  base_fetcher_->SetOffset(part_offset);
   if (range.HasLength())
-    base_fetcher_->SetLength(range.length());
+    base_fetcher_->SetLength(range.length() - bytes_received_this_range_);
   else
     base_fetcher_->UnsetLength();
   if (delegate_)
-    delegate_->SeekToOffset(range.offset());
+    delegate_->SeekToOffset(offset);
+  base_fetcher_active_ = true;
+  base_fetcher_->BeginTransfer(url);
+}
+
+void MultiRangeHttpFetcher::SplitRangesAtParts() {
+  RangesVect ranges;
+  for (const Range& range : ranges_) {
+    off_t offset = range.offset();
+    const off_t end = range.offset() + range.length();
+    for (const auto& part : split_parts_) {
+      if (part.first <= offset) {
+        continue;
+      }
+      if (range.HasLength() && part.first >= end) {
+        break;
+      }
+      ranges.push_back(Range(offset, part.first - offset));
+      offset = part.first;
+    }
+    ranges.push_back(range.HasLength() ? Range(offset, end - offset)
+                                       : Range(offset));
+  }
+  ranges_ = std::move(ranges);
+}
+
+std::string MultiRangeHttpFetcher::ResolveSplitPart(const std::string& url,
+                                                    off_t* offset) const {
+  const auto next = std::upper_bound(
+      split_parts_.begin(),
+      split_parts_.end(),
+      *offset,
+      [](off_t value, const auto& part) { return value < part.first; });
+  if (next == split_parts_.begin()) {
+    return url;
+  }
+  const auto& [part_offset, part_url] = *(next - 1);
+  *offset -= part_offset;
+  if (part_url.find("://") != std::string::npos) {
+    return part_url;
+  }
+  // Relative to the directory of |url|.
+  const size_t slash = url.rfind('/', url.find('?'));
+  return url.substr(0, slash == std::string::npos ? 0 : slash + 1) + part_url;
+}
+
+bool MultiRangeHttpFetcher::CanFetchMultipart() const {
+  // The split parts are different files.
+  if (multipart_disabled_ || !split_parts_.empty() ||
+      current_index_ + 1 >= ranges_.size()) {
+    return false;
+  }
+  off_t end = 0;
+  for (size_t i = current_index_; i < ranges_.size(); i++) {
+    // The bytes of each part are matched with the ranges by their offset.
+    const Range& range = ranges_[i];
+    if (!range.HasLength() || range.offset() < end) {
+      return false;
+    }
+    end = range.offset() + range.length();
+  }
+  return true;
+}
+
+void MultiRangeHttpFetcher::StartMultipartTransfer() {
+  std::vector<std::pair<off_t, size_t>> ranges;
+  for (size_t i = current_index_; i < ranges_.size(); i++) {
+    const size_t received =
+        i == current_index_ ? bytes_received_this_range_ : 0;
+    ranges.emplace_back(ranges_[i].offset() + received,
+                        ranges_[i].length() - received);
+  }
+  if (!base_fetcher_->SetMultipleRanges(ranges)) {
+    multipart_disabled_ = true;
+    StartTransfer();
+    return;
+  }
+  LOG(INFO) << "starting transfer of " << ranges.size()
+            << " ranges in one request";
+  multipart_ = true;
+  if (delegate_)
+    delegate_->SeekToOffset(ranges[0].first);
   base_fetcher_active_ = true;
   base_fetcher_->BeginTransfer(url_);
 }
 
+bool MultiRangeHttpFetcher::ReceivedMultipartBytes(HttpFetcher* fetcher,
+                                                   const void* bytes,
+                                                   size_t length) {
+  if (!multipart_parser_) {
+    const std::string boundary = MultipartByterangesParser::GetBoundary(
+        fetcher->GetResponseContentType());
+    if (boundary.empty()) {
+      // The server ignored the ranges or only sent the first one.
+      LOG(WARNING) << "Not a multipart/byteranges response, requesting one "
+                      "range at a time.";
+      multipart_disabled_ = true;
+      pending_transfer_ended_ = true;
+      fetcher->TerminateTransfer();
+      return false;
+    }
+    multipart_parser_ = std::make_unique<MultipartByterangesParser>(
+        boundary, [this](uint64_t offset, const uint8_t* data, size_t size) {
+          return ReceivedPart(offset, data, size);
+        });
+  }
+  const bool parsed = multipart_parser_->Parse(bytes, length);
+  if (terminating_ || multipart_delivery_stopped_) {
+    return false;
+  }
+  if (parsed && current_index_ < ranges_.size()) {
+    return true;
+  }
+  if (!parsed) {
+    LOG(WARNING) << "Invalid multipart/byteranges response, requesting one "
+                    "range at a time.";
+    multipart_disabled_ = true;
+  }
+  // As for a single range, the fetcher is terminated once all the bytes are
+  // received.
+  pending_transfer_ended_ = true;
+  fetcher->TerminateTransfer();
+  return false;
+}
+
+bool MultiRangeHttpFetcher::ReceivedPart(uint64_t offset,
+                                         const uint8_t* data,
+                                         size_t size) {
+  while (size > 0 && current_index_ < ranges_.size()) {
+    const Range& range = ranges_[current_index_];
+    const uint64_t expected = range.offset() + bytes_received_this_range_;
+    if (offset > expected) {
+      LOG(ERROR) << "The multipart response skipped bytes " << expected << "-"
+                 << offset - 1 << ".";
+      return false;
+    }
+    // The server may merge close ranges into a single part.
+    const size_t skip = std::min<uint64_t>(expected - offset, size);
+    offset += skip;
+    data += skip;
+    size -= skip;
+    const size_t next_size =
+        std::min<uint64_t>(size, range.length() - bytes_received_this_range_);
+    if (next_size == 0) {
+      break;
+    }
+    bytes_received_this_range_ += next_size;
+    if (delegate_ && !delegate_->ReceivedBytes(this, data, next_size)) {
+      multipart_delivery_stopped_ = true;
+      return false;
+    }
+    if (terminating_) {
+      return false;
+    }
+    offset += next_size;
+    data += next_size;
+    size -= next_size;
+    if (bytes_received_this_range_ == range.length()) {
+      current_index_++;
+      bytes_received_this_range_ = 0;
+      if (current_index_ < ranges_.size() && delegate_)
+        delegate_->SeekToOffset(ranges_[current_index_].offset());
+    }
+  }
+  // The bytes past the last range are ignored.
+  return true;
+}
+
 // State change: Downloading -> Downloading or Pending transfer ended
 bool MultiRangeHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
                                           const void* bytes,
                                           size_t length) {
+  if (parallel_) {
+    callback_depth_++;
+    const bool result = ParallelReceivedBytes(fetcher, bytes, length);
+    callback_depth_--;
+    MaybeEndParallelTransfer();
+    return result;
+  }
   CHECK_LT(current_index_, ranges_.size());
   CHECK_EQ(fetcher, base_fetcher_.get());
   CHECK(!pending_transfer_ended_);
+  if (multipart_) {
+    return ReceivedMultipartBytes(fetcher, bytes, length);
+  }
   size_t next_size = length;
   Range range = ranges_[current_index_];
   if (range.HasLength()) {
@@ -123,6 +372,13 @@ bool MultiRangeHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
 void MultiRangeHttpFetcher::TransferEnded(HttpFetcher* fetcher,
                                           bool successful) {
   CHECK(base_fetcher_active_) << "Transfer ended unexpectedly.";
+  if (parallel_) {
+    callback_depth_++;
+    ParallelTransferEnded(fetcher, successful);
+    callback_depth_--;
+    MaybeEndParallelTransfer();
+    return;
+  }
   CHECK_EQ(fetcher, base_fetcher_.get());
   pending_transfer_ended_ = false;
   http_response_code_ = fetcher->http_response_code();
@@ -136,6 +392,27 @@ void MultiRangeHttpFetcher::TransferEnded(HttpFetcher* fetcher,
     return;
   }
 
+  if (multipart_) {
+    const bool delivery_stopped = multipart_delivery_stopped_;
+    multipart_ = multipart_delivery_stopped_ = false;
+    multipart_parser_.reset();
+    base_fetcher_->SetMultipleRanges({});
+    if (current_index_ >= ranges_.size() || delivery_stopped) {
+      LOG(INFO) << (delivery_stopped ? "Delivery stopped."
+                                     : "Done w/ all transfers");
+      Reset();
+      // Note that after the callback returns this object may be destroyed.
+      if (delegate_)
+        delegate_->TransferComplete(this, !delivery_stopped);
+      return;
+    }
+    LOG(INFO) << "Multipart transfer ended at range " << current_index_
+              << ", requesting the rest one range at a time.";
+    multipart_disabled_ = true;
+    StartTransfer();
+    return;
+  }
+
   // If we didn't get enough bytes, it's failure
   Range range = ranges_[current_index_];
   if (range.HasLength()) {
@@ -155,6 +432,7 @@ void MultiRangeHttpFetcher::TransferEnded(HttpFetcher* fetcher,
   // If we have another transfer, do that.
   if (current_index_ + 1 < ranges_.size()) {
     current_index_++;
+    bytes_received_this_range_ = 0;
     LOG(INFO) << "Starting next transfer (" << current_index_ << ").";
     StartTransfer();
     return;
@@ -182,6 +460,434 @@ void MultiRangeHttpFetcher::Reset() {
   base_fetcher_active_ = pending_transfer_ended_ = terminating_ = false;
   current_index_ = 0;
   bytes_received_this_range_ = 0;
+  if (multipart_) {
+    base_fetcher_->SetMultipleRanges({});
+  }
+  multipart_ = multipart_delivery_stopped_ = false;
+  multipart_parser_.reset();
+  parallel_ = false;
+  chunks_.clear();
+  active_fetches_.clear();
+  idle_fetchers_.clear();
+  next_chunk_to_fetch_ = next_chunk_to_deliver_ = 0;
+  max_buffered_chunks_ = 0;
+  buffer_reservation_.Release();
+  delivery_stopped_ = parallel_transfer_failed_ = false;
+  failed_chunk_ = 0;
+  mirrors_.clear();
+  reissued_chunks_.clear();
+  MessageLoop::current()->CancelTask(stall_check_task_);
+  stall_check_task_ = MessageLoop::kTaskIdNull;
+}
+
+std::vector<HttpFetcher*> MultiRangeHttpFetcher::AllFetchers() const {
+  std::vector<HttpFetcher*> fetchers{base_fetcher_.get()};
+  for (const auto& fetcher : parallel_fetchers_) {
+    fetchers.push_back(fetcher.get());
+  }
+  return fetchers;
+}
+
+bool MultiRangeHttpFetcher::CanFetchInParallel() const {
+  if (parallel_fetchers_.empty()) {
+    return false;
+  }
+  size_t total_length = 0;
+  for (const Range& range : ranges_) {
+    // Ranges without a length can't be split.
+    if (!range.HasLength()) {
+      return false;
+    }
+    total_length += range.length();
+  }
+  return total_length > parallel_chunk_size_;
+}
+
+// State change: Stopped -> Downloading
+void MultiRangeHttpFetcher::BeginParallelTransfer() {
+  chunks_.clear();
+  for (const Range& range : ranges_) {
+    for (size_t offset = 0; offset < range.length();
+         offset += parallel_chunk_size_) {
+      chunks_.push_back(
+          {static_cast<off_t>(range.offset() + offset),
+           std::min(parallel_chunk_size_, range.length() - offset),
+           offset == 0});
+    }
+  }
+  const size_t num_fetchers =
+      std::min(parallel_fetchers_.size() + 1, chunks_.size());
+  // The fetchers ahead of the one being delivered buffer their chunk, and
+  // more chunks are buffered if the memory allows it so that the fast
+  // connections don't wait for the slow ones.
+  buffer_reservation_ = MemoryBudget::Get()->Reserve(
+      parallel_chunk_size_,
+      2 * (num_fetchers - 1) * parallel_chunk_size_,
+      parallel_chunk_size_,
+      "download");
+  max_buffered_chunks_ = buffer_reservation_.size() / parallel_chunk_size_;
+  mirrors_.clear();
+  mirrors_.push_back({url_});
+  for (const std::string& url : mirror_urls_) {
+    mirrors_.push_back({url});
+  }
+  for (const std::string& url : peer_urls_) {
+    Mirror peer{url};
+    peer.peer = true;
+    mirrors_.push_back(peer);
+  }
+  LOG(INFO) << "Downloading " << chunks_.size() << " chunks of "
+            << parallel_chunk_size_ << " bytes with " << num_fetchers
+            << " fetchers from " << mirrors_.size()
+            << " URL(s), buffering up to " << max_buffered_chunks_
+            << " chunks.";
+
+  parallel_ = true;
+  base_fetcher_active_ = true;
+  std::vector<HttpFetcher*> fetchers = AllFetchers();
+  fetchers.resize(num_fetchers);
+  for (HttpFetcher* fetcher : fetchers) {
+    fetcher->set_delegate(this);
+  }
+  // Start from the last one, so that |base_fetcher_| is the first to be
+  // reused.
+  idle_fetchers_.assign(fetchers.rbegin(), fetchers.rend());
+  ScheduleStallCheck();
+  callback_depth_++;
+  StartIdleFetchers();
+  callback_depth_--;
+  MaybeEndParallelTransfer();
+}
+
+size_t MultiRangeHttpFetcher::PickMirror() const {
+  // The other URLs are only used once all the peers failed.
+  bool peers_only = false;
+  for (const Mirror& mirror : mirrors_) {
+    peers_only |= mirror.peer && !mirror.failed;
+  }
+  // The mirrors not measured yet are expected to be as fast as the others.
+  double total_rate = 0;
+  size_t num_measured = 0;
+  for (const Mirror& mirror : mirrors_) {
+    if (!mirror.failed && mirror.measured && mirror.peer == peers_only) {
+      total_rate += mirror.bytes_per_second;
+      num_measured++;
+    }
+  }
+  const double default_rate = num_measured ? total_rate / num_measured : 1;
+  size_t best = 0;
+  double best_rate = -1;
+  for (size_t i = 0; i < mirrors_.size(); i++) {
+    const Mirror& mirror = mirrors_[i];
+    if (mirror.failed || (peers_only && !mirror.peer)) {
+      continue;
+    }
+    if (!mirror.measured && mirror.active_fetches == 0) {
+      return i;
+    }
+    // The connections to a mirror are assumed to share its throughput.
+    const double rate =
+        (mirror.measured ? mirror.bytes_per_second : default_rate) /
+        (mirror.active_fetches + 1);
+    if (rate > best_rate) {
+      best = i;
+      best_rate = rate;
+    }
+  }
+  return best;
+}
+
+bool MultiRangeHttpFetcher::HasOtherMirror(size_t mirror) const {
+  for (size_t i = 0; i < mirrors_.size(); i++) {
+    if (i != mirror && !mirrors_[i].failed) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void MultiRangeHttpFetcher::RecordThroughput(const ActiveFetch& fetch) {
+  const double seconds = (TimeTicks::Now() - fetch.start_time).InSecondsF();
+  if (mirrors_.size() < 2 || seconds <= 0 || fetch.bytes_received == 0) {
+    return;
+  }
+  Mirror& mirror = mirrors_[fetch.mirror];
+  const double rate = fetch.bytes_received / seconds;
+  mirror.bytes_per_second =
+      mirror.measured ? (1 - kThroughputSmoothing) * mirror.bytes_per_second +
+                            kThroughputSmoothing * rate
+                      : rate;
+  mirror.measured = true;
+}
+
+void MultiRangeHttpFetcher::ScheduleStallCheck() {
+  if (mirrors_.size() < 2 ||
+      stall_check_task_ != MessageLoop::kTaskIdNull) {
+    return;
+  }
+  stall_check_task_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&MultiRangeHttpFetcher::CheckStalledFetches,
+                 base::Unretained(this)),
+      kMirrorStallCheckInterval);
+}
+
+void MultiRangeHttpFetcher::CheckStalledFetches() {
+  stall_check_task_ = MessageLoop::kTaskIdNull;
+  const TimeTicks now = TimeTicks::Now();
+  std::vector<HttpFetcher*> stalled;
+  for (auto& [fetcher, fetch] : active_fetches_) {
+    if (fetch.ending || now - fetch.last_bytes_time < kMirrorStallTimeout ||
+        !HasOtherMirror(fetch.mirror)) {
+      continue;
+    }
+    LOG(WARNING) << "Nothing received for chunk " << fetch.chunk
+                 << " from URL " << fetch.mirror << " in "
+                 << utils::FormatTimeDelta(now - fetch.last_bytes_time)
+                 << ", downloading the rest from another URL.";
+    // It's only picked again if the other mirrors are as slow. A peer isn't
+    // worth waiting for, the other URLs are used instead.
+    mirrors_[fetch.mirror].measured = true;
+    mirrors_[fetch.mirror].bytes_per_second = 0;
+    mirrors_[fetch.mirror].failed |= mirrors_[fetch.mirror].peer;
+    fetch.ending = true;
+    reissued_chunks_.push_back(fetch.chunk);
+    stalled.push_back(fetcher);
+  }
+  callback_depth_++;
+  // They may report the end of their transfer right away.
+  for (HttpFetcher* fetcher : stalled) {
+    fetcher->TerminateTransfer();
+  }
+  StartIdleFetchers();
+  callback_depth_--;
+  ScheduleStallCheck();
+  MaybeEndParallelTransfer();
+}
+
+bool MultiRangeHttpFetcher::StartNextChunk(HttpFetcher* fetcher) {
+  if (terminating_ || delivery_stopped_ || parallel_transfer_failed_) {
+    return false;
+  }
+  size_t index;
+  if (!reissued_chunks_.empty()) {
+    index = reissued_chunks_.front();
+    reissued_chunks_.pop_front();
+  } else if (next_chunk_to_fetch_ < chunks_.size() &&
+             next_chunk_to_fetch_ <=
+                 next_chunk_to_deliver_ + max_buffered_chunks_) {
+    index = next_chunk_to_fetch_++;
+  } else {
+    return false;
+  }
+  const Chunk& chunk = chunks_[index];
+  // A reissued chunk continues where its last transfer stopped.
+  const off_t offset = chunk.offset + chunk.bytes_received;
+  const size_t length = chunk.length - chunk.bytes_received;
+  const size_t mirror = PickMirror();
+  LOG(INFO) << "starting transfer of chunk " << index << ": " << offset << "+"
+            << length << " from URL " << mirror;
+  const TimeTicks now = TimeTicks::Now();
+  active_fetches_[fetcher] = {index, mirror, now, now};
+  mirrors_[mirror].active_fetches++;
+  off_t part_offset = offset;
+  const std::string url = ResolveSplitPart(mirrors_[mirror].url, &part_offset);
+  fetcher->SetOffset(part_offset);
+  fetcher->SetLength(length);
+  fetcher->BeginTransfer(url);
+  return true;
+}
+
+void MultiRangeHttpFetcher::StartIdleFetchers() {
+  while (!idle_fetchers_.empty()) {
+    HttpFetcher* fetcher = idle_fetchers_.back();
+    if (!StartNextChunk(fetcher)) {
+      return;
+    }
+    // |fetcher| may have ended already, and be idle again.
+    auto it = std::find(idle_fetchers_.begin(), idle_fetchers_.end(), fetcher);
+    if (it != idle_fetchers_.end()) {
+      idle_fetchers_.erase(it);
+    }
+  }
+}
+
+bool MultiRangeHttpFetcher::DeliverBytes(Chunk* chunk,
+                                         const void* bytes,
+                                         size_t length) {
+  if (chunk->starts_range && !chunk->seeked) {
+    chunk->seeked = true;
+    if (delegate_)
+      delegate_->SeekToOffset(chunk->offset);
+  }
+  if (length == 0 || !delegate_) {
+    return true;
+  }
+  if (!delegate_->ReceivedBytes(this, bytes, length)) {
+    delivery_stopped_ = true;
+    return false;
+  }
+  return true;
+}
+
+void MultiRangeHttpFetcher::AdvanceDelivery() {
+  // Like a serial transfer, deliver what was received up to the failed chunk.
+  const size_t end =
+      parallel_transfer_failed_ ? failed_chunk_ + 1 : chunks_.size();
+  while (!terminating_ && !delivery_stopped_ && next_chunk_to_deliver_ < end) {
+    Chunk& chunk = chunks_[next_chunk_to_deliver_];
+    if (!chunk.buffer.empty()) {
+      const brillo::Blob buffer = std::move(chunk.buffer);
+      chunk.buffer = {};
+      if (!DeliverBytes(&chunk, buffer.data(), buffer.size())) {
+        return;
+      }
+    }
+    if (!chunk.complete) {
+      break;
+    }
+    next_chunk_to_deliver_++;
+  }
+  StartIdleFetchers();
+}
+
+bool MultiRangeHttpFetcher::ParallelReceivedBytes(HttpFetcher* fetcher,
+                                                  const void* bytes,
+                                                  size_t length) {
+  auto it = active_fetches_.find(fetcher);
+  CHECK(it != active_fetches_.end());
+  if (it->second.ending) {
+    return false;
+  }
+  const size_t index = it->second.chunk;
+  Chunk& chunk = chunks_[index];
+  const size_t next_size =
+      std::min(length, chunk.length - std::min(chunk.length,
+                                               chunk.bytes_received));
+  chunk.bytes_received += length;
+  it->second.bytes_received += length;
+  mirrors_[it->second.mirror].bytes_received += next_size;
+  it->second.last_bytes_time = TimeTicks::Now();
+  if (terminating_ || delivery_stopped_) {
+    return false;
+  }
+  if (index == next_chunk_to_deliver_ && chunk.buffer.empty()) {
+    if (!DeliverBytes(&chunk, bytes, next_size)) {
+      return false;
+    }
+  } else {
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    chunk.buffer.insert(chunk.buffer.end(), data, data + next_size);
+  }
+  if (terminating_) {
+    return false;
+  }
+
+  if (chunk.bytes_received >= chunk.length) {
+    // As in a serial transfer, the fetcher is reused once it reports the end
+    // of this transfer.
+    chunk.complete = true;
+    it->second.ending = true;
+    RecordThroughput(it->second);
+    fetcher->TerminateTransfer();
+    if (index == next_chunk_to_deliver_) {
+      AdvanceDelivery();
+    }
+    return false;
+  }
+  return true;
+}
+
+void MultiRangeHttpFetcher::ParallelTransferEnded(HttpFetcher* fetcher,
+                                                  bool successful) {
+  auto it = active_fetches_.find(fetcher);
+  CHECK(it != active_fetches_.end()) << "Transfer ended unexpectedly.";
+  const size_t index = it->second.chunk;
+  const size_t mirror = it->second.mirror;
+  const bool terminated = it->second.ending;
+  active_fetches_.erase(it);
+  mirrors_[mirror].active_fetches--;
+  idle_fetchers_.push_back(fetcher);
+  const Chunk& chunk = chunks_[index];
+  if (terminating_) {
+    return;
+  }
+  if (terminated && !chunk.complete) {
+    // Either the transfer failed, or the rest of the chunk is downloaded
+    // again.
+    StartIdleFetchers();
+    return;
+  }
+  if (!chunk.complete && HasOtherMirror(mirror)) {
+    LOG(WARNING) << "Transfer of chunk " << index << " from URL " << mirror
+                 << " failed w/ code " << fetcher->http_response_code()
+                 << ", downloading the rest from another URL.";
+    mirrors_[mirror].failed = true;
+    reissued_chunks_.push_back(index);
+    AdvanceDelivery();
+    return;
+  }
+  http_response_code_ = fetcher->http_response_code();
+  LOG(INFO) << "TransferEnded w/ code " << http_response_code_;
+  if (!chunk.complete) {
+    LOG(INFO) << "Didn't get enough bytes for chunk " << chunk.offset << "+"
+              << chunk.length << ". Ending w/ failure.";
+    if (!parallel_transfer_failed_ || index < failed_chunk_) {
+      parallel_transfer_failed_ = true;
+      failed_chunk_ = index;
+    }
+    // The chunks before this one are still delivered.
+    TerminateParallelFetchers(failed_chunk_ + 1);
+  }
+  AdvanceDelivery();
+}
+
+void MultiRangeHttpFetcher::TerminateParallelFetchers(size_t first_chunk) {
+  std::vector<HttpFetcher*> fetchers;
+  for (auto& [fetcher, fetch] : active_fetches_) {
+    if (!fetch.ending && fetch.chunk >= first_chunk) {
+      fetch.ending = true;
+      fetchers.push_back(fetcher);
+    }
+  }
+  // They may report the end of their transfer right away.
+  for (HttpFetcher* fetcher : fetchers) {
+    fetcher->TerminateTransfer();
+  }
+}
+
+void MultiRangeHttpFetcher::MaybeEndParallelTransfer() {
+  if (!parallel_ || callback_depth_ > 0 || !active_fetches_.empty()) {
+    return;
+  }
+  // Note that after the callbacks return this object may be destroyed.
+  if (terminating_) {
+    LOG(INFO) << "Terminating.";
+    Reset();
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+  } else if (delivery_stopped_) {
+    // The delegate is about to terminate the transfer.
+    return;
+  } else if (parallel_transfer_failed_) {
+    Reset();
+    if (delegate_)
+      delegate_->TransferComplete(this, false);
+  } else if (next_chunk_to_deliver_ == chunks_.size()) {
+    LOG(INFO) << "Done w/ all transfers";
+    if (!peer_urls_.empty()) {
+      size_t peer_bytes = 0, total_bytes = 0;
+      for (const Mirror& mirror : mirrors_) {
+        peer_bytes += mirror.peer ? mirror.bytes_received : 0;
+        total_bytes += mirror.bytes_received;
+      }
+      LOG(INFO) << "Downloaded " << peer_bytes << " of " << total_bytes
+                << " bytes from peers.";
+    }
+    Reset();
+    if (delegate_)
+      delegate_->TransferComplete(this, true);
+  }
 }
 
 std::string MultiRangeHttpFetcher::Range::ToString() const {
@@ -18,12 +18,19 @@
 #define UPDATE_ENGINE_COMMON_MULTI_RANGE_HTTP_FETCHER_H_
 
 #include <deque>
+#include <map>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/secure_blob.h>
+
 #include "update_engine/common/http_fetcher.h"
+#include "update_engine/common/memory_budget.h"
+#include "update_engine/common/multipart_byteranges_parser.h"
 
 // This class is a simple wrapper around an HttpFetcher. The client
 // specifies a vector of byte ranges. MultiRangeHttpFetcher will fetch bytes
@@ -40,6 +47,24 @@
 // Various functions below that might change state indicate possible
 // state changes.
 
+// With fetchers added by AddParallelFetcher(), ranges that all have a length
+// are split into chunks downloaded by all the fetchers at the same time. The
+// chunks ahead of the one being delivered are buffered, up to what the
+// MemoryBudget allows, so the delegate still receives the bytes in order.
+// With mirror URLs, each chunk is downloaded from the URL with the best
+// measured throughput, and the rest of a chunk whose URL stalls or fails is
+// downloaded from another one. Peer URLs are picked before all the others, as
+// long as one of them didn't stall or fail.
+//
+// With split parts, the content is stored in several files, and the bytes of
+// each one are downloaded from its own URL: the ranges are split at the start
+// of each part, and so are the chunks of a parallel transfer.
+//
+// Otherwise, several ranges that all have a length are requested at once when
+// the fetcher supports it, saving a round trip per range. If the response
+// isn't a multipart/byteranges one, or it ends early, the rest is requested one
+// range at a time, as it then is for the following transfers too.
+
 namespace chromeos_update_engine {
 
 class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
@@ -53,7 +78,7 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
         terminating_(false),
         current_index_(0),
         bytes_received_this_range_(0) {}
-  ~MultiRangeHttpFetcher() override {}
+  ~MultiRangeHttpFetcher() override;
 
   void ClearRanges() { ranges_.clear(); }
 
@@ -64,6 +89,42 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   void AddRange(off_t offset) { ranges_.push_back(Range(offset)); }
 
+  // Adds a fetcher downloading chunks of the ranges along with the base
+  // fetcher. Takes ownership of |fetcher|, which must support the same kind
+  // of transfers as the base fetcher.
+  void AddParallelFetcher(HttpFetcher* fetcher) {
+    parallel_fetchers_.emplace_back(fetcher);
+  }
+
+  // Adds a URL serving the same content as the one passed to BeginTransfer(),
+  // which the chunks are also downloaded from when there are parallel
+  // fetchers.
+  void AddMirrorUrl(const std::string& url) { mirror_urls_.push_back(url); }
+  void ClearMirrorUrls() { mirror_urls_.clear(); }
+
+  // Adds a URL of a local peer serving the same content, which the chunks
+  // are downloaded from rather than from the other URLs while it works.
+  void AddPeerUrl(const std::string& url) { peer_urls_.push_back(url); }
+  void ClearPeerUrls() { peer_urls_.clear(); }
+
+  // Adds a file holding the bytes of the content from |offset| up to the next
+  // part, downloaded from |url| with |offset| as its start. |url| is relative
+  // to the one the bytes are downloaded from, unless it has a scheme. The
+  // parts are added in the order of their offset, the bytes before the first
+  // one are still downloaded from the URL passed to BeginTransfer().
+  void AddSplitPart(off_t offset, const std::string& url) {
+    CHECK(split_parts_.empty() || offset > split_parts_.back().first);
+    split_parts_.emplace_back(offset, url);
+  }
+  void ClearSplitParts() { split_parts_.clear(); }
+
+  // The size of the chunks downloaded by each fetcher, when there are
+  // parallel fetchers.
+  void set_parallel_chunk_size(size_t size) {
+    CHECK_GT(size, static_cast<size_t>(0));
+    parallel_chunk_size_ = size;
+  }
+
   // HttpFetcher overrides.
   void SetOffset(off_t offset) override;
 
@@ -80,7 +141,9 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   void SetHeader(const std::string& header_name,
                  const std::string& header_value) override {
-    base_fetcher_->SetHeader(header_name, header_value);
+    for (HttpFetcher* fetcher : AllFetchers()) {
+      fetcher->SetHeader(header_name, header_value);
+    }
   }
 
   bool GetHeader(const std::string& header_name,
@@ -88,37 +151,53 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
     return base_fetcher_->GetHeader(header_name, header_value);
   }
 
-  void Pause() override { base_fetcher_->Pause(); }
+  void Pause() override;
 
-  void Unpause() override { base_fetcher_->Unpause(); }
+  void Unpause() override;
 
   // These functions are overloaded in LibcurlHttp fetcher for testing purposes.
   void set_idle_seconds(int seconds) override {
-    base_fetcher_->set_idle_seconds(seconds);
+    for (HttpFetcher* fetcher : AllFetchers()) {
+      fetcher->set_idle_seconds(seconds);
+    }
   }
   void set_retry_seconds(int seconds) override {
-    base_fetcher_->set_retry_seconds(seconds);
+    for (HttpFetcher* fetcher : AllFetchers()) {
+      fetcher->set_retry_seconds(seconds);
+    }
   }
   // TODO(deymo): Determine if this method should be virtual in HttpFetcher so
   // this call is sent to the base_fetcher_.
   virtual void SetProxies(const std::deque<std::string>& proxies) {
-    base_fetcher_->SetProxies(proxies);
+    for (HttpFetcher* fetcher : AllFetchers()) {
+      fetcher->SetProxies(proxies);
+    }
   }
 
   inline size_t GetBytesDownloaded() override {
-    return base_fetcher_->GetBytesDownloaded();
+    size_t bytes_downloaded = 0;
+    for (HttpFetcher* fetcher : AllFetchers()) {
+      bytes_downloaded += fetcher->GetBytesDownloaded();
+    }
+    return bytes_downloaded;
   }
 
   void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {
-    base_fetcher_->set_low_speed_limit(low_speed_bps, low_speed_sec);
+    for (HttpFetcher* fetcher : AllFetchers()) {
+      fetcher->set_low_speed_limit(low_speed_bps, low_speed_sec);
+    }
   }
 
   void set_connect_timeout(int connect_timeout_seconds) override {
-    base_fetcher_->set_connect_timeout(connect_timeout_seconds);
+    for (HttpFetcher* fetcher : AllFetchers()) {
+      fetcher->set_connect_timeout(connect_timeout_seconds);
+    }
   }
 
   void set_max_retry_count(int max_retry_count) override {
-    base_fetcher_->set_max_retry_count(max_retry_count);
+    for (HttpFetcher* fetcher : AllFetchers()) {
+      fetcher->set_max_retry_count(max_retry_count);
+    }
   }
 
  private:
@@ -147,6 +226,28 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   // State change: Stopped or Downloading -> Downloading
   void StartTransfer();
 
+  // Splits the ranges at the start of each split part, so that a transfer
+  // only downloads from one file.
+  void SplitRangesAtParts();
+  // Returns the URL the byte at |*offset| of the content is downloaded from,
+  // with the content at |url|, and sets |*offset| to its offset there.
+  std::string ResolveSplitPart(const std::string& url, off_t* offset) const;
+
+  // Whether the ranges left, starting with the rest of the current one, can
+  // be requested all at once.
+  bool CanFetchMultipart() const;
+  // State change: Stopped or Downloading -> Downloading, for all the ranges
+  // left.
+  void StartMultipartTransfer();
+  // Parses the body of a multipart transfer, terminating it once all the
+  // ranges are received or if it isn't a valid multipart/byteranges body.
+  bool ReceivedMultipartBytes(HttpFetcher* fetcher,
+                              const void* bytes,
+                              size_t length);
+  // Delivers the bytes that belong to the ranges among the |size| bytes at
+  // |offset| received in a part.
+  bool ReceivedPart(uint64_t offset, const uint8_t* data, size_t size);
+
   // HttpFetcherDelegate overrides.
   // State change: Downloading -> Downloading or Pending transfer ended
   bool ReceivedBytes(HttpFetcher* fetcher,
@@ -161,6 +262,97 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   void Reset();
 
+  // A part of a range downloaded by one of the fetchers in a parallel
+  // transfer.
+  struct Chunk {
+    off_t offset;
+    size_t length;
+    // Whether the delegate is told to seek to |offset| before receiving the
+    // chunk, i.e. it starts a range.
+    bool starts_range;
+    bool seeked{false};
+    size_t bytes_received{0};
+    // The bytes received before the chunk is the next one to deliver.
+    brillo::Blob buffer;
+    bool complete{false};
+  };
+
+  // The fetcher downloading a chunk.
+  struct ActiveFetch {
+    size_t chunk;
+    // The index of the URL in |mirrors_|.
+    size_t mirror;
+    // When the transfer started and last received bytes, and how many.
+    base::TimeTicks start_time;
+    base::TimeTicks last_bytes_time;
+    size_t bytes_received{0};
+    // Whether TerminateTransfer() was called on the fetcher.
+    bool ending{false};
+  };
+
+  // A URL the chunks are downloaded from, the one passed to BeginTransfer() or
+  // a mirror.
+  struct Mirror {
+    std::string url;
+    // The throughput of one connection to the URL, once measured.
+    bool measured{false};
+    double bytes_per_second{0};
+    // Whether a transfer from the URL failed, so it isn't used anymore.
+    bool failed{false};
+    size_t active_fetches{0};
+    // Whether the URL is a peer URL, which a stall fails too.
+    bool peer{false};
+    size_t bytes_received{0};
+  };
+
+  // |base_fetcher_| followed by |parallel_fetchers_|.
+  std::vector<HttpFetcher*> AllFetchers() const;
+
+  // Whether the ranges can be split among the parallel fetchers.
+  bool CanFetchInParallel() const;
+
+  // State change: Stopped -> Downloading, for all the fetchers.
+  void BeginParallelTransfer();
+
+  // Returns the mirror the next chunk is downloaded from, the one where one
+  // more connection is expected to be the fastest, among the peers if one of
+  // them didn't fail. Each mirror is tried first.
+  size_t PickMirror() const;
+  // Whether a mirror other than |mirror| didn't fail.
+  bool HasOtherMirror(size_t mirror) const;
+  // Updates the throughput of the mirror of |fetch| once its chunk is done.
+  void RecordThroughput(const ActiveFetch& fetch);
+
+  // Every few seconds, downloads the rest of the chunks whose transfer didn't
+  // receive anything for a while from another mirror.
+  void ScheduleStallCheck();
+  void CheckStalledFetches();
+
+  // Starts downloading the rest of a chunk that was cut short, or else the
+  // next chunk, on |fetcher|, unless all the chunks are started or too many
+  // are buffered. Returns whether it did.
+  bool StartNextChunk(HttpFetcher* fetcher);
+  void StartIdleFetchers();
+
+  // Passes bytes of |chunk| to the delegate. Returns false if the delegate
+  // doesn't want more data.
+  bool DeliverBytes(Chunk* chunk, const void* bytes, size_t length);
+  // Delivers the buffered chunks following the last delivered one, until it
+  // reaches one that isn't complete.
+  void AdvanceDelivery();
+
+  // The parallel counterparts of ReceivedBytes() and TransferEnded().
+  bool ParallelReceivedBytes(HttpFetcher* fetcher,
+                             const void* bytes,
+                             size_t length);
+  void ParallelTransferEnded(HttpFetcher* fetcher, bool successful);
+  // Terminates the fetchers downloading |first_chunk| and the following ones.
+  void TerminateParallelFetchers(size_t first_chunk);
+
+  // Notifies the delegate once all the fetchers ended, unless called from
+  // within another callback: the delegate may destroy this object.
+  void MaybeEndParallelTransfer();
+
   std::unique_ptr<HttpFetcher> base_fetcher_;
 
   // If true, do not send any more data or TransferComplete to the delegate.
@@ -179,6 +371,51 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   RangesVect::size_type current_index_;  // index into ranges_
   size_t bytes_received_this_range_;
 
+  // Whether the current transfer requests all the ranges left at once, and
+  // the parser of its body once the response is known to be multipart.
+  bool multipart_{false};
+  std::unique_ptr<MultipartByterangesParser> multipart_parser_;
+  // Whether the delegate stopped the multipart transfer.
+  bool multipart_delivery_stopped_{false};
+  // Set once a multipart transfer failed, the ranges are then requested one
+  // at a time.
+  bool multipart_disabled_{false};
+
+  std::vector<std::unique_ptr<HttpFetcher>> parallel_fetchers_;
+  std::vector<std::string> mirror_urls_;
+  std::vector<std::string> peer_urls_;
+  // The offset and URL of each split part.
+  std::vector<std::pair<off_t, std::string>> split_parts_;
+  size_t parallel_chunk_size_{4 * 1024 * 1024};
+
+  // Whether the current transfer is split among the parallel fetchers.
+  bool parallel_{false};
+  std::vector<Chunk> chunks_;
+  std::map<HttpFetcher*, ActiveFetch> active_fetches_;
+  std::vector<HttpFetcher*> idle_fetchers_;
+  size_t next_chunk_to_fetch_{0};
+  size_t next_chunk_to_deliver_{0};
+  // The URL passed to BeginTransfer() followed by the mirror and peer URLs,
+  // for a parallel transfer.
+  std::vector<Mirror> mirrors_;
+  // The chunks whose transfer stalled or failed, to download the rest of from
+  // another mirror first.
+  std::deque<size_t> reissued_chunks_;
+  brillo::MessageLoop::TaskId stall_check_task_{
+      brillo::MessageLoop::kTaskIdNull};
+  // The most chunks buffered ahead of the one being delivered, and the memory
+  // they're allowed to use.
+  size_t max_buffered_chunks_{0};
+  MemoryBudget::Reservation buffer_reservation_;
+  // True once the delegate refused bytes, until it terminates the transfer.
+  bool delivery_stopped_{false};
+  // True once a chunk failed, the first of them being |failed_chunk_|. The
+  // chunks before it are still downloaded and delivered.
+  bool parallel_transfer_failed_{false};
+  size_t failed_chunk_{0};
+  // The number of parallel transfer callbacks on the stack.
+  int callback_depth_{0};
+
   DISALLOW_COPY_AND_ASSIGN(MultiRangeHttpFetcher);
 };
 
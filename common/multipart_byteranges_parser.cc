@@ -0,0 +1,165 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/multipart_byteranges_parser.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The delimiters and part headers are short, a longer line means the body
+// isn't what it should be.
+constexpr size_t kMaxLineLength = 4096;
+
+// Parses a "bytes <first>-<last>/<length>" Content-Range.
+bool ParseContentRange(const string& value, uint64_t* first, uint64_t* last) {
+  const string kUnit = "bytes ";
+  if (!base::StartsWith(value, kUnit, base::CompareCase::INSENSITIVE_ASCII))
+    return false;
+  const string range =
+      value.substr(kUnit.size(), value.find('/') - kUnit.size());
+  const size_t dash = range.find('-');
+  return dash != string::npos &&
+         base::StringToUint64(range.substr(0, dash), first) &&
+         base::StringToUint64(range.substr(dash + 1), last) && *first <= *last;
+}
+
+}  // namespace
+
+string MultipartByterangesParser::GetBoundary(const string& content_type) {
+  const std::vector<string> params = base::SplitString(
+      content_type, ";", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  if (params.empty() ||
+      !base::EqualsCaseInsensitiveASCII(params[0], "multipart/byteranges")) {
+    return "";
+  }
+  for (size_t i = 1; i < params.size(); i++) {
+    const size_t equal = params[i].find('=');
+    if (equal == string::npos)
+      continue;
+    string name, value;
+    base::TrimWhitespaceASCII(
+        params[i].substr(0, equal), base::TRIM_ALL, &name);
+    if (!base::EqualsCaseInsensitiveASCII(name, "boundary"))
+      continue;
+    base::TrimWhitespaceASCII(
+        params[i].substr(equal + 1), base::TRIM_ALL, &value);
+    if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+      value = value.substr(1, value.size() - 2);
+    return value;
+  }
+  return "";
+}
+
+bool MultipartByterangesParser::Parse(const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  while (size > 0 && state_ != State::kDone) {
+    if (state_ == State::kData) {
+      const size_t length = std::min<uint64_t>(size, remaining_);
+      if (!callback_(offset_, bytes, length))
+        return false;
+      offset_ += length;
+      remaining_ -= length;
+      bytes += length;
+      size -= length;
+      if (remaining_ == 0)
+        state_ = State::kDelimiter;
+      continue;
+    }
+    const uint8_t* newline =
+        static_cast<const uint8_t*>(memchr(bytes, '\n', size));
+    const size_t length = newline ? newline - bytes : size;
+    line_.append(reinterpret_cast<const char*>(bytes), length);
+    if (line_.size() > kMaxLineLength) {
+      LOG(ERROR) << "Line of more than " << kMaxLineLength
+                 << " bytes in a multipart/byteranges body.";
+      return false;
+    }
+    if (!newline)
+      break;
+    bytes += length + 1;
+    size -= length + 1;
+    if (!line_.empty() && line_.back() == '\r')
+      line_.pop_back();
+    TEST_AND_RETURN_FALSE(ParseLine());
+    line_.clear();
+  }
+  // Anything after the closing delimiter is ignored.
+  return true;
+}
+
+bool MultipartByterangesParser::ParseLine() {
+  if (state_ == State::kHeaders) {
+    if (line_.empty()) {
+      if (!has_range_) {
+        LOG(ERROR) << "Part without a Content-Range.";
+        return false;
+      }
+      state_ = State::kData;
+      return true;
+    }
+    const size_t colon = line_.find(':');
+    if (colon == string::npos) {
+      LOG(ERROR) << "Malformed part header: " << line_;
+      return false;
+    }
+    string name, value;
+    base::TrimWhitespaceASCII(line_.substr(0, colon), base::TRIM_ALL, &name);
+    if (!base::EqualsCaseInsensitiveASCII(name, "Content-Range"))
+      return true;
+    base::TrimWhitespaceASCII(line_.substr(colon + 1), base::TRIM_ALL, &value);
+    uint64_t first, last;
+    if (!ParseContentRange(value, &first, &last)) {
+      LOG(ERROR) << "Invalid Content-Range: " << value;
+      return false;
+    }
+    has_range_ = true;
+    offset_ = first;
+    remaining_ = last - first + 1;
+    return true;
+  }
+
+  // A delimiter may have trailing whitespace.
+  string line;
+  base::TrimWhitespaceASCII(line_, base::TRIM_TRAILING, &line);
+  if (line == delimiter_) {
+    state_ = State::kHeaders;
+    has_range_ = false;
+  } else if (line == delimiter_ + "--") {
+    state_ = State::kDone;
+  } else if (state_ == State::kDelimiter && !line.empty()) {
+    // Only the line break before the delimiter may follow a part.
+    LOG(ERROR) << "Expected a delimiter after a part, got: " << line_;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
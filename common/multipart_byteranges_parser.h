@@ -0,0 +1,84 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_MULTIPART_BYTERANGES_PARSER_H_
+#define UPDATE_ENGINE_COMMON_MULTIPART_BYTERANGES_PARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <utility>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// Parses a multipart/byteranges response body (RFC 7233, appendix A) as it is
+// received, passing the bytes of each part along with their offset in the
+// resource. The size of the parts comes from their Content-Range header, so
+// their content isn't searched for the boundary.
+class MultipartByterangesParser {
+ public:
+  // Called with the next |size| bytes of a part, |offset| being where they
+  // are in the resource. Returns false to stop the parsing.
+  using DataCallback =
+      std::function<bool(uint64_t offset, const uint8_t* data, size_t size)>;
+
+  MultipartByterangesParser(const std::string& boundary, DataCallback callback)
+      : delimiter_("--" + boundary), callback_(std::move(callback)) {}
+
+  // Returns the boundary of a multipart/byteranges |content_type|, or an empty
+  // string for another type.
+  static std::string GetBoundary(const std::string& content_type);
+
+  // Parses the next |size| bytes of the body. Returns false if they are
+  // malformed or the callback returned false, after which it must not be
+  // called again.
+  bool Parse(const void* data, size_t size);
+
+  // Whether the closing delimiter was parsed.
+  bool done() const { return state_ == State::kDone; }
+
+ private:
+  enum class State {
+    kPreamble,
+    kDelimiter,
+    kHeaders,
+    kData,
+    kDone,
+  };
+
+  // Handles the complete |line_|, without its line break.
+  bool ParseLine();
+
+  const std::string delimiter_;
+  const DataCallback callback_;
+
+  State state_{State::kPreamble};
+  std::string line_;
+  // The part being parsed, from its Content-Range header.
+  bool has_range_{false};
+  uint64_t offset_{0};
+  uint64_t remaining_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(MultipartByterangesParser);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_MULTIPART_BYTERANGES_PARSER_H_
@@ -0,0 +1,125 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/multipart_byteranges_parser.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr char kBody[] =
+    "\r\n"
+    "--THIS_STRING_SEPARATES\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Content-Range: bytes 10-14/100\r\n"
+    "\r\n"
+    "abcde\r\n"
+    "--THIS_STRING_SEPARATES\r\n"
+    "content-range: bytes 50-51/100\r\n"
+    "\r\n"
+    "\r\n"
+    "\r\n"
+    "--THIS_STRING_SEPARATES--\r\n";
+
+}  // namespace
+
+class MultipartByterangesParserTest : public ::testing::Test {
+ protected:
+  // Parses |body| in pieces of |piece_size| bytes, storing the parts in
+  // |offsets_| and |data_|.
+  bool Parse(const string& body, size_t piece_size) {
+    MultipartByterangesParser parser(
+        "THIS_STRING_SEPARATES",
+        [this](uint64_t offset, const uint8_t* data, size_t size) {
+          if (offsets_.empty() || offset != next_offset_) {
+            offsets_.push_back(offset);
+            data_.emplace_back();
+          }
+          data_.back().append(reinterpret_cast<const char*>(data), size);
+          next_offset_ = offset + size;
+          return true;
+        });
+    for (size_t i = 0; i < body.size(); i += piece_size) {
+      if (!parser.Parse(body.data() + i,
+                        std::min(piece_size, body.size() - i)))
+        return false;
+    }
+    return parser.done();
+  }
+
+  vector<uint64_t> offsets_;
+  vector<string> data_;
+  uint64_t next_offset_{0};
+};
+
+TEST_F(MultipartByterangesParserTest, GetBoundaryTest) {
+  EXPECT_EQ("abc",
+            MultipartByterangesParser::GetBoundary(
+                "multipart/byteranges; boundary=abc"));
+  EXPECT_EQ("a b",
+            MultipartByterangesParser::GetBoundary(
+                "Multipart/ByteRanges;charset=x; BOUNDARY=\"a b\""));
+  EXPECT_EQ("",
+            MultipartByterangesParser::GetBoundary(
+                "application/octet-stream; boundary=abc"));
+  EXPECT_EQ("", MultipartByterangesParser::GetBoundary("multipart/byteranges"));
+}
+
+TEST_F(MultipartByterangesParserTest, ParseTest) {
+  for (size_t piece_size : {1, 7, 1000}) {
+    offsets_.clear();
+    data_.clear();
+    ASSERT_TRUE(Parse(kBody, piece_size)) << piece_size;
+    EXPECT_EQ((vector<uint64_t>{10, 50}), offsets_);
+    EXPECT_EQ((vector<string>{"abcde", "\r\n"}), data_);
+  }
+}
+
+TEST_F(MultipartByterangesParserTest, InvalidBodyTest) {
+  const string body = kBody;
+  // No Content-Range.
+  string invalid = body;
+  invalid.replace(invalid.find("Content-Range"), 5, "X-Abc");
+  EXPECT_FALSE(Parse(invalid, 1000));
+  // Longer part than in its Content-Range.
+  invalid = body;
+  invalid.replace(invalid.find("abcde"), 5, "abcdef");
+  EXPECT_FALSE(Parse(invalid, 1000));
+  // Malformed Content-Range.
+  invalid = body;
+  invalid.replace(invalid.find("10-14"), 5, "14-10");
+  EXPECT_FALSE(Parse(invalid, 1000));
+  // Truncated.
+  EXPECT_FALSE(Parse(body.substr(0, body.size() - 10), 1000));
+}
+
+TEST_F(MultipartByterangesParserTest, CallbackStopsTest) {
+  MultipartByterangesParser parser(
+      "THIS_STRING_SEPARATES",
+      [](uint64_t offset, const uint8_t* data, size_t size) { return false; });
+  EXPECT_FALSE(parser.Parse(kBody, sizeof(kBody) - 1));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,156 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/operation_index.h"
+
+#include <limits>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+// The index is read in place, so its little endian fields must be in the host
+// byte order.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "The operation index needs a little endian host");
+
+namespace {
+
+template <typename T>
+void Append(const T& value, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool ExtentsMatch(const OperationIndex::Extents& packed,
+                  const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  if (packed.size() != static_cast<size_t>(extents.size()))
+    return false;
+  auto it = packed.begin();
+  for (const auto& extent : extents) {
+    if (it->start_block != extent.start_block() ||
+        it->num_blocks != extent.num_blocks())
+      return false;
+    ++it;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool BuildOperationIndex(const PartitionUpdate& partition,
+                         std::string* out_index) {
+  uint64_t num_extents = 0;
+  for (const auto& op : partition.operations())
+    num_extents += op.src_extents_size() + op.dst_extents_size();
+  if (num_extents > std::numeric_limits<uint32_t>::max()) {
+    LOG(ERROR) << "Partition " << partition.partition_name() << " has "
+               << num_extents << " extents, too many for an operation index.";
+    return false;
+  }
+
+  const uint64_t num_operations = partition.operations_size();
+  std::string index;
+  index.reserve(sizeof(OperationIndexHeader) +
+                num_operations * sizeof(PackedOperation) +
+                num_extents * sizeof(PackedExtent));
+  Append(OperationIndexHeader{kOperationIndexMagic,
+                              kOperationIndexVersion,
+                              num_operations,
+                              num_extents},
+         &index);
+  uint32_t next_extent = 0;
+  for (const auto& op : partition.operations()) {
+    PackedOperation packed{};
+    packed.type = op.type();
+    packed.data_offset = op.data_offset();
+    packed.data_length = op.data_length();
+    packed.src_extents_begin = next_extent;
+    packed.num_src_extents = op.src_extents_size();
+    next_extent += op.src_extents_size();
+    packed.dst_extents_begin = next_extent;
+    packed.num_dst_extents = op.dst_extents_size();
+    next_extent += op.dst_extents_size();
+    Append(packed, &index);
+  }
+  for (const auto& op : partition.operations()) {
+    for (const auto& extent : op.src_extents())
+      Append(PackedExtent{extent.start_block(), extent.num_blocks()}, &index);
+    for (const auto& extent : op.dst_extents())
+      Append(PackedExtent{extent.start_block(), extent.num_blocks()}, &index);
+  }
+  *out_index = std::move(index);
+  return true;
+}
+
+bool OperationIndex::Init(const void* data, size_t size) {
+  TEST_AND_RETURN_FALSE(reinterpret_cast<uintptr_t>(data) %
+                            alignof(OperationIndexHeader) ==
+                        0);
+  TEST_AND_RETURN_FALSE(size >= sizeof(OperationIndexHeader));
+  const auto header = static_cast<const OperationIndexHeader*>(data);
+  if (header->magic != kOperationIndexMagic ||
+      header->version != kOperationIndexVersion) {
+    LOG(ERROR) << "Unsupported operation index, version " << header->version;
+    return false;
+  }
+  // Checked one term at a time so that none of the products overflows.
+  size_t remaining = size - sizeof(OperationIndexHeader);
+  TEST_AND_RETURN_FALSE(header->num_operations <=
+                        remaining / sizeof(PackedOperation));
+  remaining -= header->num_operations * sizeof(PackedOperation);
+  TEST_AND_RETURN_FALSE(header->num_extents ==
+                        remaining / sizeof(PackedExtent));
+  TEST_AND_RETURN_FALSE(remaining % sizeof(PackedExtent) == 0);
+
+  auto operations = reinterpret_cast<const PackedOperation*>(header + 1);
+  auto extents = reinterpret_cast<const PackedExtent*>(
+      operations + header->num_operations);
+  for (uint64_t i = 0; i < header->num_operations; i++) {
+    const PackedOperation& op = operations[i];
+    TEST_AND_RETURN_FALSE(uint64_t{op.src_extents_begin} + op.num_src_extents <=
+                          header->num_extents);
+    TEST_AND_RETURN_FALSE(uint64_t{op.dst_extents_begin} + op.num_dst_extents <=
+                          header->num_extents);
+  }
+  operations_ = operations;
+  extents_ = extents;
+  num_operations_ = header->num_operations;
+  return true;
+}
+
+bool OperationIndex::Matches(const PartitionUpdate& partition) const {
+  if (num_operations_ != static_cast<size_t>(partition.operations_size()))
+    return false;
+  for (size_t i = 0; i < num_operations_; i++) {
+    if (!Matches(i, partition.operations(i)))
+      return false;
+  }
+  return true;
+}
+
+bool OperationIndex::Matches(size_t i, const InstallOperation& op) const {
+  const PackedOperation& packed = operations_[i];
+  return packed.type == static_cast<uint32_t>(op.type()) &&
+         packed.data_offset == op.data_offset() &&
+         packed.data_length == op.data_length() &&
+         ExtentsMatch(src_extents(packed), op.src_extents()) &&
+         ExtentsMatch(dst_extents(packed), op.dst_extents());
+}
+
+}  // namespace chromeos_update_engine
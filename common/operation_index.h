@@ -0,0 +1,128 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_OPERATION_INDEX_H_
+#define UPDATE_ENGINE_COMMON_OPERATION_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A packed, fixed layout copy of the operations of a partition, stored in
+// PartitionUpdate.operation_index by delta_generator --operation_index. Being
+// part of the manifest, it is covered by the metadata signature. It lets the
+// operations be walked in place, without any protobuf message or allocation.
+//
+// All the fields are little endian and 8 bytes aligned:
+//   OperationIndexHeader
+//   PackedOperation[num_operations]
+//   PackedExtent[num_extents]
+// The source and destination extents of each operation are ranges of the
+// array of extents.
+
+struct OperationIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t num_operations;
+  uint64_t num_extents;
+};
+
+struct PackedExtent {
+  uint64_t start_block;
+  uint64_t num_blocks;
+};
+
+struct PackedOperation {
+  uint32_t type;  // InstallOperation::Type
+  uint32_t reserved;
+  uint64_t data_offset;
+  uint64_t data_length;
+  uint32_t src_extents_begin;
+  uint32_t num_src_extents;
+  uint32_t dst_extents_begin;
+  uint32_t num_dst_extents;
+};
+
+static_assert(sizeof(OperationIndexHeader) == 24, "Unexpected padding");
+static_assert(sizeof(PackedExtent) == 16, "Unexpected padding");
+static_assert(sizeof(PackedOperation) == 40, "Unexpected padding");
+
+// "UEOI", little endian.
+constexpr uint32_t kOperationIndexMagic = 0x494f4555;
+constexpr uint32_t kOperationIndexVersion = 1;
+
+// Packs the operations of |partition| into |out_index|. Returns false if they
+// have too many extents for the index.
+bool BuildOperationIndex(const PartitionUpdate& partition,
+                         std::string* out_index);
+
+// A read-only view of an operation index, which must outlive it.
+class OperationIndex {
+ public:
+  // A range of the extents of the index.
+  class Extents {
+   public:
+    Extents(const PackedExtent* begin, size_t size)
+        : begin_(begin), size_(size) {}
+    const PackedExtent* begin() const { return begin_; }
+    const PackedExtent* end() const { return begin_ + size_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+   private:
+    const PackedExtent* begin_;
+    size_t size_;
+  };
+
+  OperationIndex() = default;
+
+  // Points the index to the |size| bytes at |data|, checking that they are a
+  // valid index. Returns false otherwise.
+  bool Init(const void* data, size_t size);
+  bool Init(const std::string& index) {
+    return Init(index.data(), index.size());
+  }
+
+  size_t num_operations() const { return num_operations_; }
+  const PackedOperation& operation(size_t i) const { return operations_[i]; }
+  Extents src_extents(const PackedOperation& op) const {
+    return Extents(extents_ + op.src_extents_begin, op.num_src_extents);
+  }
+  Extents dst_extents(const PackedOperation& op) const {
+    return Extents(extents_ + op.dst_extents_begin, op.num_dst_extents);
+  }
+
+  // Whether the index holds the same operations as |partition|, as far as the
+  // index has fields for them.
+  bool Matches(const PartitionUpdate& partition) const;
+  // Same for the operation |i| alone, which must be below num_operations(), so
+  // that it can be checked while walking the operations for something else.
+  bool Matches(size_t i, const InstallOperation& op) const;
+
+ private:
+  const PackedOperation* operations_{nullptr};
+  const PackedExtent* extents_{nullptr};
+  size_t num_operations_{0};
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_OPERATION_INDEX_H_
@@ -0,0 +1,125 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/operation_index.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/cow_operation_convert.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/update_metadata.pb.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class OperationIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    partition_.set_partition_name("system");
+    auto op = partition_.add_operations();
+    op->set_type(InstallOperation::REPLACE_BZ);
+    op->set_data_offset(0);
+    op->set_data_length(100);
+    *op->add_dst_extents() = ExtentForRange(0, 4);
+    *op->add_dst_extents() = ExtentForRange(10, 2);
+
+    op = partition_.add_operations();
+    op->set_type(InstallOperation::SOURCE_COPY);
+    *op->add_src_extents() = ExtentForRange(20, 3);
+    *op->add_src_extents() = ExtentForRange(30, 1);
+    *op->add_dst_extents() = ExtentForRange(4, 1);
+    *op->add_dst_extents() = ExtentForRange(6, 3);
+
+    auto merge_op = partition_.add_merge_operations();
+    merge_op->set_type(CowMergeOperation::COW_COPY);
+    *merge_op->mutable_src_extent() = ExtentForRange(21, 1);
+    *merge_op->mutable_dst_extent() = ExtentForRange(6, 1);
+  }
+
+  PartitionUpdate partition_;
+};
+
+TEST_F(OperationIndexTest, RoundTripTest) {
+  string data;
+  ASSERT_TRUE(BuildOperationIndex(partition_, &data));
+  OperationIndex index;
+  ASSERT_TRUE(index.Init(data));
+  EXPECT_TRUE(index.Matches(partition_));
+
+  ASSERT_EQ(2u, index.num_operations());
+  const PackedOperation& replace = index.operation(0);
+  EXPECT_EQ(InstallOperation::REPLACE_BZ, replace.type);
+  EXPECT_EQ(100u, replace.data_length);
+  EXPECT_TRUE(index.src_extents(replace).empty());
+  const auto dst_extents = index.dst_extents(replace);
+  ASSERT_EQ(2u, dst_extents.size());
+  EXPECT_EQ(10u, dst_extents.begin()[1].start_block);
+  EXPECT_EQ(2u, dst_extents.begin()[1].num_blocks);
+  EXPECT_EQ(2u, index.src_extents(index.operation(1)).size());
+}
+
+TEST_F(OperationIndexTest, MismatchTest) {
+  string data;
+  ASSERT_TRUE(BuildOperationIndex(partition_, &data));
+  OperationIndex index;
+  ASSERT_TRUE(index.Init(data));
+  partition_.mutable_operations(1)->mutable_dst_extents(1)->set_num_blocks(2);
+  EXPECT_FALSE(index.Matches(partition_));
+  EXPECT_TRUE(index.Matches(0, partition_.operations(0)));
+  EXPECT_FALSE(index.Matches(1, partition_.operations(1)));
+}
+
+TEST_F(OperationIndexTest, InvalidIndexTest) {
+  string data;
+  ASSERT_TRUE(BuildOperationIndex(partition_, &data));
+  OperationIndex index;
+  EXPECT_FALSE(index.Init(data.data(), data.size() - sizeof(PackedExtent)));
+  EXPECT_FALSE(index.Init(data.data(), sizeof(OperationIndexHeader) - 1));
+
+  // An operation pointing past the extents.
+  string corrupted = data;
+  auto op = reinterpret_cast<PackedOperation*>(corrupted.data() +
+                                               sizeof(OperationIndexHeader));
+  op->dst_extents_begin = 100;
+  EXPECT_FALSE(index.Init(corrupted));
+
+  corrupted = data;
+  corrupted[0] ^= 1;
+  EXPECT_FALSE(index.Init(corrupted));
+}
+
+TEST_F(OperationIndexTest, ConvertToCowOperationsTest) {
+  string data;
+  ASSERT_TRUE(BuildOperationIndex(partition_, &data));
+  OperationIndex index;
+  ASSERT_TRUE(index.Init(data));
+  const auto expected = ConvertToCowOperations(partition_.operations(),
+                                               partition_.merge_operations());
+  const auto converted =
+      ConvertToCowOperations(index, partition_.merge_operations());
+  ASSERT_EQ(expected.size(), converted.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].op, converted[i].op);
+    EXPECT_EQ(expected[i].src_block, converted[i].src_block);
+    EXPECT_EQ(expected[i].dst_block, converted[i].dst_block);
+    EXPECT_EQ(expected[i].block_count, converted[i].block_count);
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,38 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PERFORMANCE_HINT_H_
+#define UPDATE_ENGINE_COMMON_PERFORMANCE_HINT_H_
+
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// Tells the CPU governor how long the work of a thread takes compared to the
+// target duration the session was opened with, so that it raises the clocks
+// of the CPUs running the thread before the work falls behind. Closed when
+// destroyed. See HardwareInterface::CreatePerformanceHintSession().
+class PerformanceHintSession {
+ public:
+  virtual ~PerformanceHintSession() = default;
+
+  // Reports that a piece of work of the thread took |duration|.
+  virtual void ReportActualWorkDuration(base::TimeDelta duration) = 0;
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PERFORMANCE_HINT_H_
@@ -0,0 +1,360 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/performance_recorder.h"
+
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <base/files/file_util.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/memory_budget.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint64_t kMiB = 1024 * 1024;
+
+base::TimeDelta FromTimeVal(const struct timeval& tv) {
+  return base::TimeDelta::FromSeconds(tv.tv_sec) +
+         base::TimeDelta::FromMicroseconds(tv.tv_usec);
+}
+
+size_t ThroughputBucket(uint64_t bytes, base::TimeDelta wall_time) {
+  const double mib_per_second =
+      bytes / static_cast<double>(kMiB) /
+      std::max(wall_time.InSecondsF(), 1e-6);
+  size_t bucket = 0;
+  for (double limit = 1; bucket + 1 < PerformanceReport::kThroughputBuckets &&
+                         mib_per_second >= limit;
+       limit *= 2) {
+    bucket++;
+  }
+  return bucket;
+}
+
+// The first bucket of at most |first| << i, or the last one.
+size_t HistogramBucket(uint64_t value, uint64_t first) {
+  size_t bucket = 0;
+  while (bucket + 1 < PerformanceReport::FileIo::kHistogramBuckets &&
+         value > first << bucket) {
+    bucket++;
+  }
+  return bucket;
+}
+
+size_t SizeBucket(uint64_t bytes) {
+  return HistogramBucket(bytes, 512);
+}
+
+size_t LatencyBucket(base::TimeDelta latency) {
+  // Bucket i counts the latencies under 16 << i microseconds.
+  return HistogramBucket(std::max<int64_t>(latency.InMicroseconds() + 1, 0),
+                         16);
+}
+
+string FormatThroughput(uint64_t bytes, base::TimeDelta wall_time) {
+  if (wall_time.is_zero())
+    return "-";
+  return base::StringPrintf(
+      "%.1f MiB/s", bytes / static_cast<double>(kMiB) / wall_time.InSecondsF());
+}
+
+}  // namespace
+
+void PerformanceReport::FileIo::AddRead(uint64_t bytes,
+                                        base::TimeDelta latency) {
+  reads++;
+  bytes_read += bytes;
+  size_histogram[SizeBucket(bytes)]++;
+  latency_histogram[LatencyBucket(latency)]++;
+}
+
+void PerformanceReport::FileIo::AddWrite(uint64_t bytes,
+                                         base::TimeDelta latency) {
+  writes++;
+  bytes_written += bytes;
+  size_histogram[SizeBucket(bytes)]++;
+  latency_histogram[LatencyBucket(latency)]++;
+}
+
+void PerformanceReport::FileIo::Add(const FileIo& io) {
+  reads += io.reads;
+  writes += io.writes;
+  bytes_read += io.bytes_read;
+  bytes_written += io.bytes_written;
+  for (size_t i = 0; i < kHistogramBuckets; i++) {
+    size_histogram[i] += io.size_histogram[i];
+    latency_histogram[i] += io.latency_histogram[i];
+  }
+}
+
+base::TimeDelta PerformanceReport::FileIo::LatencyPercentile(
+    int percentile) const {
+  const uint64_t total = reads + writes;
+  if (total == 0)
+    return base::TimeDelta();
+  percentile = std::max(0, std::min(100, percentile));
+  // The rank of the percentile, from 1 to |total|.
+  const uint64_t rank = std::max<uint64_t>(1, (total * percentile + 99) / 100);
+  uint64_t count = 0;
+  size_t bucket = 0;
+  for (; bucket + 1 < kHistogramBuckets; bucket++) {
+    count += latency_histogram[bucket];
+    if (count >= rank)
+      break;
+  }
+  return base::TimeDelta::FromMicroseconds(16 << bucket);
+}
+
+string PerformanceReport::ToString() const {
+  std::vector<string> lines;
+  for (const auto& [name, phase] : phases) {
+    string line = base::StringPrintf(
+        "phase %s: wall %s, cpu %s",
+        name.c_str(),
+        utils::FormatTimeDelta(phase.wall_time).c_str(),
+        utils::FormatTimeDelta(phase.cpu_time).c_str());
+    if (phase.rss_bytes > 0)
+      line +=
+          base::StringPrintf(", rss %" PRIu64 " MiB", phase.rss_bytes / kMiB);
+    lines.push_back(std::move(line));
+  }
+  for (const auto& [type, ops] : operations) {
+    std::vector<string> histogram;
+    for (uint32_t count : ops.throughput_histogram)
+      histogram.push_back(base::NumberToString(count));
+    lines.push_back(base::StringPrintf(
+        "operations %s: %" PRIu64 " ops, %" PRIu64 " MiB written in %s, "
+        "MiB/s histogram [%s]",
+        type.c_str(),
+        ops.count,
+        ops.bytes_written / kMiB,
+        utils::FormatTimeDelta(ops.wall_time).c_str(),
+        base::JoinString(histogram, " ").c_str()));
+  }
+  for (const auto& [name, io] : partitions) {
+    lines.push_back(base::StringPrintf("partition %s: %" PRIu64
+                                       " MiB read, %" PRIu64 " MiB written",
+                                       name.c_str(),
+                                       io.bytes_read / kMiB,
+                                       io.bytes_written / kMiB));
+  }
+  for (const auto& [name, io] : file_io) {
+    std::vector<string> histogram;
+    for (uint32_t count : io.size_histogram)
+      histogram.push_back(base::NumberToString(count));
+    lines.push_back(base::StringPrintf(
+        "file io %s: %" PRIu64 " reads of %" PRIu64 " MiB, %" PRIu64
+        " writes of %" PRIu64 " MiB, latency p50 %s p99 %s, size histogram "
+        "[%s]",
+        name.c_str(),
+        io.reads,
+        io.bytes_read / kMiB,
+        io.writes,
+        io.bytes_written / kMiB,
+        utils::FormatTimeDelta(io.LatencyPercentile(50)).c_str(),
+        utils::FormatTimeDelta(io.LatencyPercentile(99)).c_str(),
+        base::JoinString(histogram, " ").c_str()));
+  }
+  for (const auto& [tag, bytes] : peak_memory) {
+    lines.push_back(base::StringPrintf(
+        "memory %s: peak %" PRIu64 " KiB", tag.c_str(), bytes / 1024));
+  }
+  lines.push_back(
+      base::StringPrintf("peak RSS: %" PRIu64 " MiB", peak_rss_bytes / kMiB));
+  return base::JoinString(lines, "\n");
+}
+
+string PerformanceReport::ToThroughputString(uint64_t payload_size) const {
+  std::vector<string> lines;
+  lines.push_back(base::StringPrintf(
+      "%-24s %12s %12s %14s", "phase", "wall", "cpu", "throughput"));
+  for (const auto& [name, phase] : phases) {
+    lines.push_back(base::StringPrintf(
+        "%-24s %12s %12s %14s",
+        name.c_str(),
+        utils::FormatTimeDelta(phase.wall_time).c_str(),
+        utils::FormatTimeDelta(phase.cpu_time).c_str(),
+        name == "download"
+            ? FormatThroughput(payload_size, phase.wall_time).c_str()
+            : ""));
+  }
+  lines.push_back(base::StringPrintf("%-24s %8s %10s %12s %14s",
+                                     "operations",
+                                     "count",
+                                     "MiB",
+                                     "wall",
+                                     "throughput"));
+  for (const auto& [type, ops] : operations) {
+    lines.push_back(base::StringPrintf(
+        "%-24s %8" PRIu64 " %10" PRIu64 " %12s %14s",
+        type.c_str(),
+        ops.count,
+        ops.bytes_written / kMiB,
+        utils::FormatTimeDelta(ops.wall_time).c_str(),
+        FormatThroughput(ops.bytes_written, ops.wall_time).c_str()));
+  }
+  if (!file_io.empty()) {
+    lines.push_back(base::StringPrintf("%-24s %8s %10s %8s %10s %10s %10s",
+                                       "file io",
+                                       "reads",
+                                       "read MiB",
+                                       "writes",
+                                       "write MiB",
+                                       "p50",
+                                       "p99"));
+  }
+  for (const auto& [name, io] : file_io) {
+    lines.push_back(base::StringPrintf(
+        "%-24s %8" PRIu64 " %10" PRIu64 " %8" PRIu64 " %10" PRIu64
+        " %10s %10s",
+        name.c_str(),
+        io.reads,
+        io.bytes_read / kMiB,
+        io.writes,
+        io.bytes_written / kMiB,
+        utils::FormatTimeDelta(io.LatencyPercentile(50)).c_str(),
+        utils::FormatTimeDelta(io.LatencyPercentile(99)).c_str()));
+  }
+  lines.push_back(
+      base::StringPrintf("peak RSS: %" PRIu64 " MiB", peak_rss_bytes / kMiB));
+  return base::JoinString(lines, "\n");
+}
+
+PerformanceRecorder* PerformanceRecorder::Get() {
+  static PerformanceRecorder recorder;
+  return &recorder;
+}
+
+base::TimeDelta PerformanceRecorder::ProcessCpuTime() {
+  base::TimeDelta cpu_time;
+  for (int who : {RUSAGE_SELF, RUSAGE_CHILDREN}) {
+    struct rusage usage;
+    if (getrusage(who, &usage) == 0)
+      cpu_time += FromTimeVal(usage.ru_utime) + FromTimeVal(usage.ru_stime);
+  }
+  return cpu_time;
+}
+
+base::TimeDelta PerformanceRecorder::ThreadCpuTime() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    return base::TimeDelta();
+  return base::TimeDelta::FromTimeSpec(ts);
+}
+
+uint64_t PerformanceRecorder::ResidentMemory() {
+  // The second field of statm is the resident size in pages.
+  string statm;
+  if (!base::ReadFileToString(base::FilePath("/proc/self/statm"), &statm))
+    return 0;
+  const auto fields = base::SplitStringPiece(
+      statm, " ", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  uint64_t pages;
+  if (fields.size() < 2 || !base::StringToUint64(fields[1], &pages))
+    return 0;
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+void PerformanceRecorder::AddPhase(const string& name,
+                                   base::TimeDelta wall_time,
+                                   base::TimeDelta cpu_time) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& phase = report_.phases[name];
+  phase.wall_time += wall_time;
+  phase.cpu_time += cpu_time;
+}
+
+void PerformanceRecorder::SetPhaseRss(const string& name, uint64_t rss_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  report_.phases[name].rss_bytes = rss_bytes;
+}
+
+void PerformanceRecorder::AddOperation(const string& type,
+                                       const string& partition,
+                                       uint64_t bytes_read,
+                                       uint64_t bytes_written,
+                                       base::TimeDelta wall_time,
+                                       base::TimeDelta cpu_time) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& ops = report_.operations[type];
+  ops.count++;
+  ops.bytes_written += bytes_written;
+  ops.wall_time += wall_time;
+  ops.throughput_histogram[ThroughputBucket(bytes_written, wall_time)]++;
+  auto& io = report_.partitions[partition];
+  io.bytes_read += bytes_read;
+  io.bytes_written += bytes_written;
+  report_.phases["apply/" + partition].cpu_time += cpu_time;
+}
+
+void PerformanceRecorder::AddPartitionIo(const string& partition,
+                                         uint64_t bytes_read,
+                                         uint64_t bytes_written) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& io = report_.partitions[partition];
+  io.bytes_read += bytes_read;
+  io.bytes_written += bytes_written;
+}
+
+void PerformanceRecorder::AddFileIo(const string& name,
+                                    const PerformanceReport::FileIo& io) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  report_.file_io[name].Add(io);
+}
+
+PerformanceReport::PartitionIo PerformanceRecorder::TotalPartitionIo() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  PerformanceReport::PartitionIo total;
+  for (const auto& [name, io] : report_.partitions) {
+    total.bytes_read += io.bytes_read;
+    total.bytes_written += io.bytes_written;
+  }
+  return total;
+}
+
+PerformanceReport PerformanceRecorder::TakeReport() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  PerformanceReport report = std::move(report_);
+  report_ = PerformanceReport();
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    report.peak_rss_bytes = static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+  MemoryBudget* budget = MemoryBudget::Get();
+  for (const auto& [tag, tag_usage] : budget->usage()) {
+    if (tag_usage.peak_bytes > 0)
+      report.peak_memory[tag] = tag_usage.peak_bytes;
+  }
+  report.peak_memory["total"] = budget->peak_reserved();
+  budget->ResetPeaks();
+  return report;
+}
+
+}  // namespace chromeos_update_engine
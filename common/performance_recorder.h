@@ -0,0 +1,172 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PERFORMANCE_RECORDER_H_
+#define UPDATE_ENGINE_COMMON_PERFORMANCE_RECORDER_H_
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// The performance of an update attempt, reported through
+// MetricsReporterInterface::ReportPerformanceMetrics().
+struct PerformanceReport {
+  // The number of buckets of Operations::throughput_histogram.
+  static constexpr size_t kThroughputBuckets = 12;
+
+  struct Phase {
+    base::TimeDelta wall_time;
+    // The CPU time of update_engine and of the programs it ran, or for the
+    // "apply/" phases the CPU time of their operations.
+    base::TimeDelta cpu_time;
+    // The resident memory of update_engine at the end of the phase, once what
+    // it freed was returned to the system, or 0 if not recorded.
+    uint64_t rss_bytes{0};
+  };
+
+  // The operations of a type.
+  struct Operations {
+    uint64_t count{0};
+    uint64_t bytes_written{0};
+    base::TimeDelta wall_time;
+    // The operations by throughput of their writes: the first bucket counts
+    // those under 1 MiB/s, bucket i those under 2^i MiB/s and the last one
+    // all the faster ones.
+    std::array<uint32_t, kThroughputBuckets> throughput_histogram{};
+  };
+
+  // The bytes read from the source partition and written to the target one,
+  // or read back while verifying it.
+  struct PartitionIo {
+    uint64_t bytes_read{0};
+    uint64_t bytes_written{0};
+  };
+
+  // The calls through an InstrumentedFileDescriptor, each Read(),
+  // ReadBatch(), Write(), WriteBatch() or CopyFrom() counting as one read or
+  // write of all its bytes.
+  struct FileIo {
+    // The number of buckets of |size_histogram| and |latency_histogram|.
+    static constexpr size_t kHistogramBuckets = 16;
+
+    uint64_t reads{0};
+    uint64_t writes{0};
+    uint64_t bytes_read{0};
+    uint64_t bytes_written{0};
+    // The reads and writes by size: the first bucket counts those of up to
+    // 512 bytes, bucket i those up to 512 << i bytes and the last one all the
+    // larger ones.
+    std::array<uint32_t, kHistogramBuckets> size_histogram{};
+    // The reads and writes by latency: bucket i counts those under 16 << i
+    // microseconds and the last one all the slower ones.
+    std::array<uint32_t, kHistogramBuckets> latency_histogram{};
+
+    void AddRead(uint64_t bytes, base::TimeDelta latency);
+    void AddWrite(uint64_t bytes, base::TimeDelta latency);
+    void Add(const FileIo& io);
+    // The upper bound of the bucket of |latency_histogram| the |percentile|
+    // (0 to 100) falls in, or 0 without any call.
+    base::TimeDelta LatencyPercentile(int percentile) const;
+  };
+
+  // The phases by name: "merge", "download", which includes applying the
+  // operations as they are downloaded, "apply/<partition>" from opening to
+  // closing the partition, "verify" and within it "verity/<partition>" and
+  // "verify/<partition>", and "postinstall".
+  std::map<std::string, Phase> phases;
+  // The operations by InstallOperationTypeName().
+  std::map<std::string, Operations> operations;
+  std::map<std::string, PartitionIo> partitions;
+  // The I/O by "<partition>/<role>", the role being "source", "target" or
+  // "cow", when instrumented.
+  std::map<std::string, FileIo> file_io;
+  // The peak resident memory of update_engine since it started.
+  uint64_t peak_rss_bytes{0};
+  // The most bytes reserved at once from the process MemoryBudget during the
+  // attempt, by reservation tag and by all of them as "total".
+  std::map<std::string, uint64_t> peak_memory;
+
+  bool empty() const { return phases.empty() && operations.empty(); }
+  std::string ToString() const;
+  // A table of the throughput of each phase and type of operations, with the
+  // download rate of the |payload_size| bytes of the update.
+  std::string ToThroughputString(uint64_t payload_size) const;
+};
+
+// Collects the PerformanceReport of the current attempt from the actions
+// running it, on any thread.
+class PerformanceRecorder {
+ public:
+  static PerformanceRecorder* Get();
+
+  // The CPU time of the process and of its waited for children, and of the
+  // calling thread.
+  static base::TimeDelta ProcessCpuTime();
+  static base::TimeDelta ThreadCpuTime();
+  // The current resident memory of the process, or 0 if unknown.
+  static uint64_t ResidentMemory();
+
+  // Adds to the phase |name|.
+  void AddPhase(const std::string& name,
+                base::TimeDelta wall_time,
+                base::TimeDelta cpu_time);
+
+  // Sets the resident memory at the end of the phase |name|.
+  void SetPhaseRss(const std::string& name, uint64_t rss_bytes);
+
+  // Records an operation of |type| on |partition|, which took |wall_time| and
+  // |cpu_time| to read |bytes_read| from the source partition and write
+  // |bytes_written|. Its CPU time is added to the "apply/<partition>" phase.
+  void AddOperation(const std::string& type,
+                    const std::string& partition,
+                    uint64_t bytes_read,
+                    uint64_t bytes_written,
+                    base::TimeDelta wall_time,
+                    base::TimeDelta cpu_time);
+
+  void AddPartitionIo(const std::string& partition,
+                      uint64_t bytes_read,
+                      uint64_t bytes_written);
+
+  // Adds |io| to the I/O of |name|, see PerformanceReport::file_io.
+  void AddFileIo(const std::string& name, const PerformanceReport::FileIo& io);
+
+  // The bytes of all the partitions so far in the attempt.
+  PerformanceReport::PartitionIo TotalPartitionIo();
+
+  // Returns the report of the attempt and starts a new one, as well as new
+  // MemoryBudget peaks.
+  PerformanceReport TakeReport();
+
+ private:
+  PerformanceRecorder() = default;
+
+  std::mutex mutex_;
+  PerformanceReport report_;
+
+  DISALLOW_COPY_AND_ASSIGN(PerformanceRecorder);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PERFORMANCE_RECORDER_H_
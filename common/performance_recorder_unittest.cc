@@ -0,0 +1,85 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/performance_recorder.h"
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+class PerformanceRecorderTest : public ::testing::Test {
+ protected:
+  void SetUp() override { PerformanceRecorder::Get()->TakeReport(); }
+  void TearDown() override { PerformanceRecorder::Get()->TakeReport(); }
+
+  PerformanceRecorder* recorder_ = PerformanceRecorder::Get();
+};
+
+TEST_F(PerformanceRecorderTest, AddOperationTest) {
+  constexpr uint64_t kMiB = 1024 * 1024;
+  const base::TimeDelta second = base::TimeDelta::FromSeconds(1);
+  recorder_->AddOperation("REPLACE", "system", 0, kMiB / 2, second, second);
+  recorder_->AddOperation("REPLACE", "system", 0, 3 * kMiB, second, second);
+  recorder_->AddOperation(
+      "SOURCE_COPY", "vendor", 4 * kMiB, 4 * kMiB, second, second);
+
+  PerformanceReport report = recorder_->TakeReport();
+  ASSERT_EQ(2u, report.operations.size());
+  const auto& replace = report.operations["REPLACE"];
+  EXPECT_EQ(2u, replace.count);
+  EXPECT_EQ(3 * kMiB + kMiB / 2, replace.bytes_written);
+  EXPECT_EQ(2 * second, replace.wall_time);
+  EXPECT_EQ(1u, replace.throughput_histogram[0]);
+  EXPECT_EQ(1u, replace.throughput_histogram[2]);
+  EXPECT_EQ(1u, report.operations["SOURCE_COPY"].throughput_histogram[3]);
+
+  EXPECT_EQ(0u, report.partitions["system"].bytes_read);
+  EXPECT_EQ(4 * kMiB, report.partitions["vendor"].bytes_read);
+  EXPECT_EQ(4 * kMiB, report.partitions["vendor"].bytes_written);
+  EXPECT_EQ(2 * second, report.phases["apply/system"].cpu_time);
+  EXPECT_EQ(second, report.phases["apply/vendor"].cpu_time);
+  EXPECT_GT(report.peak_rss_bytes, 0u);
+}
+
+TEST_F(PerformanceRecorderTest, TakeReportStartsANewReportTest) {
+  const base::TimeDelta second = base::TimeDelta::FromSeconds(1);
+  recorder_->AddPhase("download", second, second);
+  recorder_->AddPhase("download", second, base::TimeDelta());
+  recorder_->AddPartitionIo("system", 10, 0);
+
+  PerformanceReport report = recorder_->TakeReport();
+  EXPECT_FALSE(report.empty());
+  EXPECT_EQ(2 * second, report.phases["download"].wall_time);
+  EXPECT_EQ(second, report.phases["download"].cpu_time);
+  EXPECT_EQ(10u, report.partitions["system"].bytes_read);
+  EXPECT_NE(std::string::npos, report.ToString().find("phase download:"));
+
+  EXPECT_TRUE(recorder_->TakeReport().empty());
+}
+
+TEST_F(PerformanceRecorderTest, ToThroughputStringTest) {
+  constexpr uint64_t kMiB = 1024 * 1024;
+  const base::TimeDelta second = base::TimeDelta::FromSeconds(1);
+  recorder_->AddPhase("download", 4 * second, second);
+  recorder_->AddOperation("REPLACE", "system", 0, 6 * kMiB, 2 * second, second);
+
+  const std::string text =
+      recorder_->TakeReport().ToThroughputString(10 * kMiB);
+  EXPECT_NE(std::string::npos, text.find("2.5 MiB/s"));
+  EXPECT_NE(std::string::npos, text.find("3.0 MiB/s"));
+}
+
+}  // namespace chromeos_update_engine
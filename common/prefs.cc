@@ -16,15 +16,22 @@
 
 #include "update_engine/common/prefs.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <cstring>
+#include <set>
 
 #include <base/files/file_enumerator.h>
 #include <base/files/file_util.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 
 using std::string;
@@ -34,6 +41,116 @@ namespace chromeos_update_engine {
 
 namespace {
 
+// The journal of the transactions, which can't be mistaken for a key since
+// keys have no dots. It's a sequence of batches, each made of:
+//   'B', the size of the records as a uint32_t, the records, their SHA-256.
+// Each record is:
+//   'S' or 'D' to set or delete, the sizes of the key and the value as
+//   uint32_t, the key, the value.
+constexpr char kJournalFileName[] = ".journal";
+constexpr char kJournalBatch = 'B';
+constexpr char kJournalSet = 'S';
+constexpr char kJournalDelete = 'D';
+constexpr size_t kJournalHashSize = 32;
+// Once the journal is larger than this, its values are written to the key
+// files, which are synced, and it's emptied.
+constexpr off_t kMaxJournalSize = 64 * 1024;
+
+void AppendUint32(uint32_t value, string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool ReadUint32(std::string_view* data, uint32_t* value) {
+  if (data->size() < sizeof(*value))
+    return false;
+  memcpy(value, data->data(), sizeof(*value));
+  data->remove_prefix(sizeof(*value));
+  return true;
+}
+
+void AppendRecord(std::string_view key,
+                  const std::optional<string>& value,
+                  string* out) {
+  out->push_back(value ? kJournalSet : kJournalDelete);
+  AppendUint32(key.size(), out);
+  AppendUint32(value ? value->size() : 0, out);
+  out->append(key);
+  if (value)
+    out->append(*value);
+}
+
+// Frames |records| as a batch of the journal.
+string MakeBatch(const string& records) {
+  string batch(1, kJournalBatch);
+  AppendUint32(records.size(), &batch);
+  batch.append(records);
+  brillo::Blob hash;
+  HashCalculator::RawHashOfBytes(records.data(), records.size(), &hash);
+  batch.append(hash.begin(), hash.end());
+  return batch;
+}
+
+// Parses the records of the complete batches at the start of |journal|, the
+// last one for each key winning. Sets |valid_size| to the size of those
+// batches.
+std::map<string, std::optional<string>, std::less<>> ParseJournal(
+    std::string_view journal, size_t* valid_size) {
+  std::map<string, std::optional<string>, std::less<>> records;
+  const size_t journal_size = journal.size();
+  *valid_size = 0;
+  while (!journal.empty()) {
+    uint32_t size;
+    if (journal[0] != kJournalBatch)
+      break;
+    journal.remove_prefix(1);
+    if (!ReadUint32(&journal, &size) ||
+        journal.size() < size + kJournalHashSize)
+      break;
+    std::string_view batch = journal.substr(0, size);
+    brillo::Blob hash;
+    if (!HashCalculator::RawHashOfBytes(batch.data(), batch.size(), &hash) ||
+        memcmp(hash.data(), journal.data() + size, kJournalHashSize) != 0)
+      break;
+    journal.remove_prefix(size + kJournalHashSize);
+
+    std::map<string, std::optional<string>> batch_records;
+    bool valid = true;
+    while (valid && !batch.empty()) {
+      const char op = batch[0];
+      uint32_t key_size, value_size;
+      batch.remove_prefix(1);
+      valid = (op == kJournalSet || op == kJournalDelete) &&
+              ReadUint32(&batch, &key_size) &&
+              ReadUint32(&batch, &value_size) &&
+              batch.size() >= static_cast<uint64_t>(key_size) + value_size;
+      if (!valid)
+        break;
+      string key{batch.substr(0, key_size)};
+      if (op == kJournalSet)
+        batch_records[key] = string{batch.substr(key_size, value_size)};
+      else
+        batch_records[key] = std::nullopt;
+      batch.remove_prefix(key_size + value_size);
+    }
+    if (!valid)
+      break;
+    for (auto& [key, value] : batch_records)
+      records[key] = std::move(value);
+    *valid_size = journal_size - journal.size();
+  }
+  return records;
+}
+
+// Syncs the filesystem of |path|.
+bool SyncFilesystem(const base::FilePath& path) {
+  int fd = HANDLE_EINTR(open(path.value().c_str(), O_RDONLY | O_CLOEXEC));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  const bool synced = syncfs(fd) == 0;
+  PLOG_IF(ERROR, !synced) << "Unable to sync " << path.value();
+  IGNORE_EINTR(close(fd));
+  return synced;
+}
+
 void DeleteEmptyDirectories(const base::FilePath& path) {
   base::FileEnumerator path_enum(
       path, false /* recursive */, base::FileEnumerator::DIRECTORIES);
@@ -136,6 +253,14 @@ bool PrefsBase::GetSubKeys(std::string_view ns, vector<string>* keys) const {
   return storage_->GetSubKeys(ns, keys);
 }
 
+bool PrefsBase::StartTransaction() {
+  return storage_->StartTransaction();
+}
+
+bool PrefsBase::SubmitTransaction() {
+  return storage_->SubmitTransaction();
+}
+
 void PrefsBase::AddObserver(std::string_view key, ObserverInterface* observer) {
   observers_[std::string{key}].push_back(observer);
 }
@@ -160,8 +285,18 @@ bool Prefs::Init(const base::FilePath& prefs_dir) {
   return file_storage_.Init(prefs_dir);
 }
 
+Prefs::FileStorage::~FileStorage() {
+  CloseJournal();
+}
+
 bool Prefs::FileStorage::Init(const base::FilePath& prefs_dir) {
+  CloseJournal();
   prefs_dir_ = prefs_dir;
+  cache_.clear();
+  transaction_depth_ = 0;
+  pending_.clear();
+  journaled_.clear();
+  LoadJournal();
   // Delete empty directories. Ignore errors when deleting empty directories.
   DeleteEmptyDirectories(prefs_dir_);
   return true;
@@ -170,9 +305,29 @@ bool Prefs::FileStorage::Init(const base::FilePath& prefs_dir) {
 bool Prefs::FileStorage::GetKey(std::string_view key, string* value) const {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  auto pending = pending_.find(key);
+  if (pending != pending_.end()) {
+    if (!pending->second)
+      return false;
+    *value = *pending->second;
+    return true;
+  }
+  auto journaled = journaled_.find(key);
+  if (journaled != journaled_.end()) {
+    if (!journaled->second)
+      return false;
+    *value = *journaled->second;
+    return true;
+  }
+  auto cached = cache_.find(key);
+  if (cached != cache_.end()) {
+    *value = cached->second;
+    return true;
+  }
   if (!base::ReadFileToString(filename, value)) {
     return false;
   }
+  cache_.emplace(key, *value);
   return true;
 }
 
@@ -180,6 +335,7 @@ bool Prefs::FileStorage::GetSubKeys(std::string_view ns,
                                     vector<string>* keys) const {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(ns, &filename));
+  std::set<string> found;
   base::FileEnumerator namespace_enum(
       prefs_dir_, true, base::FileEnumerator::FILES);
   for (base::FilePath f = namespace_enum.Next(); !f.empty();
@@ -187,16 +343,81 @@ bool Prefs::FileStorage::GetSubKeys(std::string_view ns,
     auto filename_str = filename.value();
     if (f.value().compare(0, filename_str.length(), filename_str) == 0) {
       // Only return the key portion excluding the |prefs_dir_| with slash.
-      keys->push_back(f.value().substr(
+      found.insert(f.value().substr(
           prefs_dir_.AsEndingWithSeparator().value().length()));
     }
   }
+  // The keys of the journal and of the current transaction aren't in the
+  // files yet.
+  for (const auto* overlay : {&journaled_, &pending_}) {
+    for (const auto& [key, value] : *overlay) {
+      if (key.compare(0, ns.size(), ns) != 0)
+        continue;
+      if (value)
+        found.insert(key);
+      else
+        found.erase(key);
+    }
+  }
+  keys->insert(keys->end(), found.begin(), found.end());
   return true;
 }
 
 bool Prefs::FileStorage::SetKey(std::string_view key, std::string_view value) {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  if (transaction_depth_ > 0) {
+    pending_[string{key}] = string{value};
+    return true;
+  }
+  if (journaled_.count(key))
+    return AppendToJournal({{string{key}, string{value}}});
+  return WriteKeyFile(key, value);
+}
+
+bool Prefs::FileStorage::KeyExists(std::string_view key) const {
+  base::FilePath filename;
+  TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  auto pending = pending_.find(key);
+  if (pending != pending_.end())
+    return pending->second.has_value();
+  auto journaled = journaled_.find(key);
+  if (journaled != journaled_.end())
+    return journaled->second.has_value();
+  return cache_.count(key) || base::PathExists(filename);
+}
+
+bool Prefs::FileStorage::DeleteKey(std::string_view key) {
+  base::FilePath filename;
+  TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  if (transaction_depth_ > 0) {
+    pending_[string{key}] = std::nullopt;
+    return true;
+  }
+  if (journaled_.count(key))
+    return AppendToJournal({{string{key}, std::nullopt}});
+  return DeleteKeyFile(key);
+}
+
+bool Prefs::FileStorage::StartTransaction() {
+  transaction_depth_++;
+  return true;
+}
+
+bool Prefs::FileStorage::SubmitTransaction() {
+  TEST_AND_RETURN_FALSE(transaction_depth_ > 0);
+  if (--transaction_depth_ > 0 || pending_.empty())
+    return true;
+  auto pending = std::move(pending_);
+  pending_.clear();
+  return AppendToJournal(pending);
+}
+
+bool Prefs::FileStorage::WriteKeyFile(std::string_view key,
+                                      std::string_view value) {
+  base::FilePath filename;
+  TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  cache_.erase(std::string{key});
   if (!base::DirectoryExists(filename.DirName())) {
     // Only attempt to create the directory if it doesn't exist to avoid calls
     // to parent directories where we might not have permission to write to.
@@ -204,18 +425,14 @@ bool Prefs::FileStorage::SetKey(std::string_view key, std::string_view value) {
   }
   TEST_AND_RETURN_FALSE(base::WriteFile(filename, value.data(), value.size()) ==
                         static_cast<int>(value.size()));
+  cache_.emplace(key, value);
   return true;
 }
 
-bool Prefs::FileStorage::KeyExists(std::string_view key) const {
-  base::FilePath filename;
-  TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
-  return base::PathExists(filename);
-}
-
-bool Prefs::FileStorage::DeleteKey(std::string_view key) {
+bool Prefs::FileStorage::DeleteKeyFile(std::string_view key) {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  cache_.erase(std::string{key});
 #if BASE_VER < 800000
   TEST_AND_RETURN_FALSE(base::DeleteFile(filename, false));
 #else
@@ -224,6 +441,89 @@ bool Prefs::FileStorage::DeleteKey(std::string_view key) {
   return true;
 }
 
+bool Prefs::FileStorage::AppendToJournal(
+    const std::map<string, std::optional<string>, std::less<>>& records) {
+  string batch;
+  for (const auto& [key, value] : records)
+    AppendRecord(key, value, &batch);
+  batch = MakeBatch(batch);
+  TEST_AND_RETURN_FALSE(OpenJournal());
+  if (!utils::WriteAll(journal_fd_, batch.data(), batch.size()) ||
+      HANDLE_EINTR(fdatasync(journal_fd_)) != 0) {
+    PLOG(ERROR) << "Unable to write the prefs journal";
+    // A torn batch would hide the ones appended after it.
+    if (HANDLE_EINTR(ftruncate(journal_fd_, journal_size_)) != 0)
+      CloseJournal();
+    return false;
+  }
+  journal_size_ += batch.size();
+  for (const auto& [key, value] : records)
+    journaled_[key] = value;
+  // The values are stored once in the journal, a failed compaction is retried
+  // with the next batch.
+  if (journal_size_ > kMaxJournalSize)
+    CompactJournal();
+  return true;
+}
+
+void Prefs::FileStorage::LoadJournal() {
+  const base::FilePath journal_path = prefs_dir_.Append(kJournalFileName);
+  string journal;
+  if (!base::ReadFileToString(journal_path, &journal))
+    return;
+  size_t valid_size;
+  journaled_ = ParseJournal(journal, &valid_size);
+  LOG(INFO) << "Loaded " << journaled_.size()
+            << " keys from the prefs journal.";
+  // Later batches are appended after the complete ones.
+  if (valid_size < journal.size() &&
+      HANDLE_EINTR(truncate(journal_path.value().c_str(), valid_size)) != 0) {
+    PLOG(ERROR) << "Unable to truncate the prefs journal";
+    CompactJournal();
+  }
+}
+
+bool Prefs::FileStorage::CompactJournal() {
+  bool success = true;
+  for (const auto& [key, value] : journaled_) {
+    if (value)
+      success = WriteKeyFile(key, *value) && success;
+    else
+      success = DeleteKeyFile(key) && success;
+  }
+  // The journal is kept until the key files are known to be on disk.
+  TEST_AND_RETURN_FALSE(success && SyncFilesystem(prefs_dir_));
+  TEST_AND_RETURN_FALSE(OpenJournal());
+  if (HANDLE_EINTR(ftruncate(journal_fd_, 0)) != 0 ||
+      HANDLE_EINTR(fdatasync(journal_fd_)) != 0) {
+    PLOG(ERROR) << "Unable to empty the prefs journal";
+    return false;
+  }
+  journal_size_ = 0;
+  journaled_.clear();
+  return true;
+}
+
+bool Prefs::FileStorage::OpenJournal() {
+  if (journal_fd_ >= 0)
+    return true;
+  const base::FilePath journal_path = prefs_dir_.Append(kJournalFileName);
+  journal_fd_ = HANDLE_EINTR(open(journal_path.value().c_str(),
+                                  O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                                  0600));
+  TEST_AND_RETURN_FALSE_ERRNO(journal_fd_ >= 0);
+  journal_size_ = lseek(journal_fd_, 0, SEEK_END);
+  return true;
+}
+
+void Prefs::FileStorage::CloseJournal() {
+  if (journal_fd_ >= 0) {
+    IGNORE_EINTR(close(journal_fd_));
+    journal_fd_ = -1;
+  }
+  journal_size_ = 0;
+}
+
 bool Prefs::FileStorage::GetFileNameForKey(std::string_view key,
                                            base::FilePath* filename) const {
   // Allows only non-empty keys containing [A-Za-z0-9_-/].
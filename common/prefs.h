@@ -19,6 +19,7 @@
 
 #include <functional>
 #include <map>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -60,6 +61,11 @@ class PrefsBase : public PrefsInterface {
     // key was deleted.
     virtual bool DeleteKey(std::string_view key) = 0;
 
+    // Groups the SetKey() and DeleteKey() calls until SubmitTransaction(), see
+    // PrefsInterface::StartTransaction().
+    virtual bool StartTransaction() { return true; }
+    virtual bool SubmitTransaction() { return true; }
+
    private:
     DISALLOW_COPY_AND_ASSIGN(StorageInterface);
   };
@@ -86,6 +92,9 @@ class PrefsBase : public PrefsInterface {
   void RemoveObserver(std::string_view key,
                       ObserverInterface* observer) override;
 
+  bool StartTransaction() override;
+  bool SubmitTransaction() override;
+
  private:
   // The registered observers watching for changes.
   std::map<std::string, std::vector<ObserverInterface*>, std::less<>>
@@ -100,6 +109,12 @@ class PrefsBase : public PrefsInterface {
 // Implements a preference store by storing the value associated with
 // a key in a separate file named after the key under a preference
 // store directory.
+//
+// The keys of a transaction are appended to a journal file in that directory
+// with a single sync instead, which holds their values until the journal is
+// compacted into the key files once it grows large. The journal is loaded by
+// Init(), so a transaction is kept whole if the device went down. The values
+// are cached in memory after the first read.
 
 class Prefs : public PrefsBase {
  public:
@@ -118,6 +133,7 @@ class Prefs : public PrefsBase {
   class FileStorage : public PrefsBase::StorageInterface {
    public:
     FileStorage() = default;
+    ~FileStorage() override;
 
     bool Init(const base::FilePath& prefs_dir);
 
@@ -128,6 +144,8 @@ class Prefs : public PrefsBase {
     bool SetKey(std::string_view key, std::string_view value) override;
     bool KeyExists(std::string_view key) const override;
     bool DeleteKey(std::string_view key) override;
+    bool StartTransaction() override;
+    bool SubmitTransaction() override;
 
    private:
     FRIEND_TEST(PrefsTest, GetFileNameForKey);
@@ -139,8 +157,39 @@ class Prefs : public PrefsBase {
     bool GetFileNameForKey(std::string_view key,
                            base::FilePath* filename) const;
 
+    // Write or delete the file of |key|.
+    bool WriteKeyFile(std::string_view key, std::string_view value);
+    bool DeleteKeyFile(std::string_view key);
+
+    // Appends |records| to the journal as one batch and syncs it, then
+    // compacts the journal if it's too large.
+    bool AppendToJournal(
+        const std::map<std::string, std::optional<std::string>, std::less<>>&
+            records);
+    // Loads the values of the complete batches in the journal.
+    void LoadJournal();
+    // Writes the values of the journal to their key files, syncs them and
+    // empties the journal.
+    bool CompactJournal();
+    bool OpenJournal();
+    void CloseJournal();
+
     // Preference store directory.
     base::FilePath prefs_dir_;
+
+    // The values of the key files read or written so far.
+    mutable std::map<std::string, std::string, std::less<>> cache_;
+
+    // The keys set or deleted, if nullopt, by the current transaction.
+    int transaction_depth_{0};
+    std::map<std::string, std::optional<std::string>, std::less<>> pending_;
+
+    // The journal, and the values of the keys in it, nullopt for the deleted
+    // ones, which their key files don't have until it's compacted. Those keys
+    // are journaled even outside of a transaction.
+    int journal_fd_{-1};
+    off_t journal_size_{0};
+    std::map<std::string, std::optional<std::string>, std::less<>> journaled_;
   };
 
   // The concrete file storage implementation.
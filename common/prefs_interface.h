@@ -105,6 +105,13 @@ class PrefsInterface {
   virtual void RemoveObserver(std::string_view key,
                               ObserverInterface* observer) = 0;
 
+  // Groups the Set*() and Delete() calls made until SubmitTransaction(), so
+  // they are all stored or none is. The calls are visible to the Get*()
+  // methods right away. Transactions can be nested, only the outermost one is
+  // submitted. Stores without transactions store each call as it's made.
+  virtual bool StartTransaction() { return true; }
+  virtual bool SubmitTransaction() { return true; }
+
  protected:
   // Key separator used to create sub key and get file names,
   static const char kKeySeparator = '/';
@@ -584,6 +584,104 @@ TEST_F(PrefsTest, MultiNamespaceKeyTest) {
   MultiNamespaceKeyTest();
 }
 
+TEST_F(PrefsTest, TransactionWritesOnSubmit) {
+  const string key2 = "key2";
+  ASSERT_TRUE(prefs_.SetString(key2, "old"));
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 5));
+  EXPECT_TRUE(prefs_.Delete(key2));
+
+  // The transaction is visible, but not written yet.
+  int64_t value;
+  EXPECT_TRUE(prefs_.GetInt64(kKey, &value));
+  EXPECT_EQ(5, value);
+  EXPECT_FALSE(prefs_.Exists(key2));
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(kKey)));
+  EXPECT_TRUE(base::PathExists(prefs_dir_.Append(key2)));
+
+  // Only the journal is written.
+  EXPECT_TRUE(prefs_.SubmitTransaction());
+  EXPECT_TRUE(base::PathExists(prefs_dir_.Append(".journal")));
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(kKey)));
+  EXPECT_TRUE(prefs_.GetInt64(kKey, &value));
+  EXPECT_EQ(5, value);
+  EXPECT_FALSE(prefs_.Exists(key2));
+  EXPECT_FALSE(prefs_.SubmitTransaction());
+}
+
+TEST_F(PrefsTest, InitLoadsTheJournal) {
+  ASSERT_TRUE(SetValue(kKey, "previous"));
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "checkpoint"));
+  EXPECT_TRUE(prefs_.SubmitTransaction());
+
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("checkpoint", value);
+  vector<string> keys;
+  EXPECT_TRUE(prefs.GetSubKeys(kKey, &keys));
+  EXPECT_THAT(keys, ElementsAre(kKey));
+}
+
+TEST_F(PrefsTest, CompactsTheJournal) {
+  const string key2 = "key2";
+  ASSERT_TRUE(SetValue(key2, "deleted"));
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.Delete(key2));
+  EXPECT_TRUE(prefs_.SubmitTransaction());
+  // Enough checkpoints to outgrow the journal once.
+  for (int i = 0; i < 100; i++) {
+    ASSERT_TRUE(prefs_.StartTransaction());
+    EXPECT_TRUE(prefs_.SetString(kKey, string(1024, 'a' + i % 26)));
+    EXPECT_TRUE(prefs_.SubmitTransaction());
+  }
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(key2)));
+  EXPECT_TRUE(base::PathExists(prefs_dir_.Append(kKey)));
+  int64_t journal_size;
+  ASSERT_TRUE(
+      base::GetFileSize(prefs_dir_.Append(".journal"), &journal_size));
+  EXPECT_LT(journal_size, 64 * 1024);
+
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ(string(1024, 'a' + 99 % 26), value);
+  EXPECT_FALSE(prefs.Exists(key2));
+}
+
+TEST_F(PrefsTest, KeysOutsideTransactionsAreNotReverted) {
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "checkpoint"));
+  EXPECT_TRUE(prefs_.SubmitTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "later"));
+
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("later", value);
+}
+
+TEST_F(PrefsTest, InitIgnoresATornBatch) {
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "checkpoint"));
+  EXPECT_TRUE(prefs_.SubmitTransaction());
+  string journal;
+  ASSERT_TRUE(
+      base::ReadFileToString(prefs_dir_.Append(".journal"), &journal));
+  ASSERT_TRUE(SetValue(".journal", journal.substr(0, journal.size() - 1)));
+  ASSERT_TRUE(SetValue(kKey, "previous"));
+
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("previous", value);
+}
+
 class MemoryPrefsTest : public BasePrefsTest {
  protected:
   void SetUp() override { common_prefs_ = &prefs_; }
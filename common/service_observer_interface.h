@@ -37,6 +37,9 @@ class ServiceObserverInterface {
   // Called whenever an update attempt is completed.
   virtual void SendPayloadApplicationComplete(ErrorCode error_code) = 0;
 
+  // Called with the live stats of the update, at most once a second.
+  virtual void SendStatsUpdate(const update_engine::UpdateEngineStats& stats) {}
+
  protected:
   ServiceObserverInterface() = default;
 };
@@ -17,8 +17,11 @@
 #include "update_engine/common/subprocess.h"
 
 #include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <memory>
@@ -36,6 +39,13 @@
 
 #include "update_engine/common/utils.h"
 
+// posix_spawn() can close the descriptors the child must not inherit.
+#if (defined(__BIONIC__) && __ANDROID_API__ >= 34) ||   \
+    (defined(__GLIBC__) &&                              \
+     (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34)))
+#define UE_HAVE_SPAWN_CLOSEFROM 1
+#endif
+
 using brillo::MessageLoop;
 using std::string;
 using std::unique_ptr;
@@ -99,6 +109,113 @@ bool LaunchProcess(const vector<string>& cmd,
   return proc->Start();
 }
 
+#ifdef UE_HAVE_SPAWN_CLOSEFROM
+// Starts |cmd| like LaunchProcess() would, with posix_spawn(). Its vfork()
+// semantics don't copy the page tables of the parent, which fork() does and
+// which takes long in a large process like delta_generator. Returns the pid
+// and the read ends of the stdout and stderr pipes of the child, or -1.
+pid_t SpawnProcess(const vector<string>& cmd,
+                   uint32_t flags,
+                   int* stdout_fd,
+                   int* stderr_fd) {
+  int stdout_pipe[2];
+  int stderr_pipe[2];
+  if (pipe2(stdout_pipe, O_CLOEXEC) != 0) {
+    PLOG(ERROR) << "Failed to create a pipe";
+    return -1;
+  }
+  if (pipe2(stderr_pipe, O_CLOEXEC) != 0) {
+    PLOG(ERROR) << "Failed to create a pipe";
+    IGNORE_EINTR(close(stdout_pipe[0]));
+    IGNORE_EINTR(close(stdout_pipe[1]));
+    return -1;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(
+      &actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, stdout_pipe[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(
+      &actions,
+      (flags & Subprocess::kRedirectStderrToStdout) != 0 ? stdout_pipe[1]
+                                                         : stderr_pipe[1],
+      STDERR_FILENO);
+  posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+
+  // Only the required PATHs are passed to the child.
+  vector<string> env;
+  for (const char* key : {"LD_LIBRARY_PATH", "PATH"}) {
+    const char* value = getenv(key);
+    if (value)
+      env.push_back(string(key) + "=" + value);
+  }
+  vector<char*> envp;
+  for (string& var : env)
+    envp.push_back(var.data());
+  envp.push_back(nullptr);
+  vector<string> args = cmd;
+  vector<char*> argv;
+  for (string& arg : args)
+    argv.push_back(arg.data());
+  argv.push_back(nullptr);
+
+  LOG(INFO) << "Running \"" << base::JoinString(cmd, " ") << "\"";
+  pid_t pid = -1;
+  const int rc =
+      (flags & Subprocess::kSearchPath) != 0
+          ? posix_spawnp(
+                &pid, argv[0], &actions, nullptr, argv.data(), envp.data())
+          : posix_spawn(
+                &pid, argv[0], &actions, nullptr, argv.data(), envp.data());
+  posix_spawn_file_actions_destroy(&actions);
+  IGNORE_EINTR(close(stdout_pipe[1]));
+  IGNORE_EINTR(close(stderr_pipe[1]));
+  if (rc != 0) {
+    LOG(ERROR) << "Failed to spawn " << cmd[0] << ": " << strerror(rc);
+    IGNORE_EINTR(close(stdout_pipe[0]));
+    IGNORE_EINTR(close(stderr_pipe[0]));
+    return -1;
+  }
+  *stdout_fd = stdout_pipe[0];
+  *stderr_fd = stderr_pipe[0];
+  return pid;
+}
+#endif  // UE_HAVE_SPAWN_CLOSEFROM
+
+// Reads |stdout_fd| and |stderr_fd| until both are closed, appending their
+// contents to |stdout_str| and |stderr_str| if not null. They are polled
+// together so that a child filling one pipe doesn't block on it while the
+// other is read.
+void ReadChildOutput(int stdout_fd,
+                     int stderr_fd,
+                     string* stdout_str,
+                     string* stderr_str) {
+  vector<char> buffer(32 * 1024);
+  pollfd fds[2] = {{stdout_fd, POLLIN, 0}, {stderr_fd, POLLIN, 0}};
+  string* outputs[2] = {stdout_str, stderr_str};
+  const char* names[2] = {"stdout", "stderr"};
+  while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+    if (HANDLE_EINTR(poll(fds, 2, -1)) < 0) {
+      PLOG(ERROR) << "Polling the child's output";
+      return;
+    }
+    for (size_t i = 0; i < 2; i++) {
+      if (fds[i].fd < 0 || fds[i].revents == 0)
+        continue;
+      int rc = HANDLE_EINTR(read(fds[i].fd, buffer.data(), buffer.size()));
+      if (rc <= 0) {
+        if (rc < 0)
+          PLOG(ERROR) << "Reading from child's " << names[i];
+        // A negative fd is ignored by poll().
+        fds[i].fd = -1;
+      } else if (outputs[i] != nullptr) {
+        outputs[i]->append(buffer.data(), rc);
+      }
+    }
+  }
+}
+
 }  // namespace
 
 void Subprocess::Init(
@@ -243,12 +360,6 @@ bool Subprocess::SynchronousExecFlags(const vector<string>& cmd,
                                       int* return_code,
                                       string* stdout_str,
                                       string* stderr_str) {
-  brillo::ProcessImpl proc;
-  if (!LaunchProcess(cmd, flags, {STDERR_FILENO}, &proc)) {
-    LOG(ERROR) << "Failed to launch subprocess";
-    return false;
-  }
-
   if (stdout_str) {
     stdout_str->clear();
   }
@@ -256,38 +367,40 @@ bool Subprocess::SynchronousExecFlags(const vector<string>& cmd,
     stderr_str->clear();
   }
 
-  // Read from both stdout and stderr individually.
-  int stdout_fd = proc.GetPipe(STDOUT_FILENO);
-  int stderr_fd = proc.GetPipe(STDERR_FILENO);
-  vector<char> buffer(32 * 1024);
-  bool stdout_closed = false, stderr_closed = false;
-  while (!stdout_closed || !stderr_closed) {
-    if (!stdout_closed) {
-      int rc = HANDLE_EINTR(read(stdout_fd, buffer.data(), buffer.size()));
-      if (rc <= 0) {
-        stdout_closed = true;
-        if (rc < 0)
-          PLOG(ERROR) << "Reading from child's stdout";
-      } else if (stdout_str != nullptr) {
-        stdout_str->append(buffer.data(), rc);
-      }
-    }
+#ifdef UE_HAVE_SPAWN_CLOSEFROM
+  int stdout_fd = -1;
+  int stderr_fd = -1;
+  const pid_t pid = SpawnProcess(cmd, flags, &stdout_fd, &stderr_fd);
+  if (pid < 0) {
+    LOG(ERROR) << "Failed to launch subprocess";
+    return false;
+  }
+  ReadChildOutput(stdout_fd, stderr_fd, stdout_str, stderr_str);
+  IGNORE_EINTR(close(stdout_fd));
+  IGNORE_EINTR(close(stderr_fd));
 
-    if (!stderr_closed) {
-      int rc = HANDLE_EINTR(read(stderr_fd, buffer.data(), buffer.size()));
-      if (rc <= 0) {
-        stderr_closed = true;
-        if (rc < 0)
-          PLOG(ERROR) << "Reading from child's stderr";
-      } else if (stderr_str != nullptr) {
-        stderr_str->append(buffer.data(), rc);
-      }
-    }
+  int status = 0;
+  if (HANDLE_EINTR(waitpid(pid, &status, 0)) != pid) {
+    PLOG(ERROR) << "Failed to wait for " << pid;
+    return false;
+  }
+  // As brillo::Process::Wait(), -1 if the child was killed by a signal.
+  const int proc_return_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#else
+  brillo::ProcessImpl proc;
+  if (!LaunchProcess(cmd, flags, {STDERR_FILENO}, &proc)) {
+    LOG(ERROR) << "Failed to launch subprocess";
+    return false;
   }
+  ReadChildOutput(proc.GetPipe(STDOUT_FILENO),
+                  proc.GetPipe(STDERR_FILENO),
+                  stdout_str,
+                  stderr_str);
 
   // At this point, the subprocess already closed the output, so we only need to
   // wait for it to finish.
   int proc_return_code = proc.Wait();
+#endif
   if (return_code)
     *return_code = proc_return_code;
   return proc_return_code != brillo::Process::kErrorExitStatus;
@@ -220,6 +220,27 @@ TEST_F(SubprocessTest, SynchronousEchoTest) {
   EXPECT_EQ("stderr-there", stderr);
 }
 
+// A child filling its stderr pipe before writing to stdout must not block.
+TEST_F(SubprocessTest, SynchronousLargeStderrTest) {
+  vector<string> cmd = {
+      kBinPath "/sh",
+      "-c",
+      "i=0; while [ $i -lt 20000 ]; do echo stderr-line >&2; i=$((i+1)); "
+      "done; echo -n stdout-here"};
+  int rc = -1;
+  string stdout, stderr;
+  ASSERT_TRUE(Subprocess::SynchronousExec(cmd, &rc, &stdout, &stderr));
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ("stdout-here", stdout);
+  EXPECT_EQ(20000u * 12, stderr.size());
+}
+
+TEST_F(SubprocessTest, SynchronousUnknownCommandTest) {
+  int rc = 0;
+  EXPECT_FALSE(Subprocess::SynchronousExecFlags(
+      {"/non/existent/command"}, 0, &rc, nullptr, nullptr));
+}
+
 TEST_F(SubprocessTest, SynchronousEchoNoOutputTest) {
   int rc = -1;
   ASSERT_TRUE(Subprocess::SynchronousExec(
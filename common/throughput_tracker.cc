@@ -0,0 +1,112 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/throughput_tracker.h"
+
+#include <algorithm>
+#include <vector>
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const TimeDelta kSampleInterval = TimeDelta::FromSeconds(1);
+// The weight of the newest sample in the moving average.
+const double kAverageWeight = 0.2;
+
+double PercentileOf(std::vector<double> samples, int percentile) {
+  if (samples.empty())
+    return 0;
+  percentile = std::max(0, std::min(100, percentile));
+  auto nth = samples.begin() + (samples.size() - 1) * percentile / 100;
+  std::nth_element(samples.begin(), nth, samples.end());
+  return *nth;
+}
+
+}  // namespace
+
+void ThroughputTracker::Reset(TimeTicks now) {
+  interval_start_ = now;
+  interval_bytes_ = 0;
+  samples_.clear();
+  average_ = 0;
+}
+
+void ThroughputTracker::AddBytes(size_t bytes, TimeTicks now) {
+  Update(now);
+  interval_bytes_ += bytes;
+}
+
+void ThroughputTracker::Update(TimeTicks now) {
+  if (interval_start_.is_null()) {
+    interval_start_ = now;
+    return;
+  }
+  // After a long gap, the samples before it are all superseded.
+  if (now - interval_start_ > kSampleInterval * (kMaxSamples + 1)) {
+    AddSample(interval_bytes_ / kSampleInterval.InSecondsF());
+    interval_start_ = now - kSampleInterval * kMaxSamples;
+  }
+  while (now - interval_start_ >= kSampleInterval)
+    AddSample(interval_bytes_ / kSampleInterval.InSecondsF());
+}
+
+void ThroughputTracker::AddSample(double bytes_per_second) {
+  average_ = samples_.empty() ? bytes_per_second
+                              : kAverageWeight * bytes_per_second +
+                                    (1 - kAverageWeight) * average_;
+  samples_.push_back(bytes_per_second);
+  if (samples_.size() > kMaxSamples)
+    samples_.pop_front();
+  interval_start_ += kSampleInterval;
+  interval_bytes_ = 0;
+}
+
+double ThroughputTracker::Percentile(int percentile) const {
+  return PercentileOf({samples_.begin(), samples_.end()}, percentile);
+}
+
+bool ThroughputTracker::IsStalled() const {
+  if (samples_.size() < kMinBaselineSamples + kStallSamples)
+    return false;
+  const auto recent = samples_.end() - kStallSamples;
+  const double baseline = PercentileOf({samples_.begin(), recent}, 50);
+  if (baseline < kMinStallBaselineBps)
+    return false;
+  double recent_sum = 0;
+  for (auto it = recent; it != samples_.end(); ++it)
+    recent_sum += *it;
+  return recent_sum / kStallSamples < baseline * kStallFraction;
+}
+
+TimeDelta RetryBackoffDelay(TimeDelta base,
+                            TimeDelta max,
+                            int attempt,
+                            double jitter) {
+  TimeDelta delay = base;
+  for (int i = 1; i < attempt && delay < max; i++)
+    delay = delay * 2;
+  delay = std::min(delay, max);
+  jitter = std::max(0.0, std::min(1.0, jitter));
+  const int64_t half_ms = delay.InMilliseconds() / 2;
+  return TimeDelta::FromMilliseconds(half_ms +
+                                     static_cast<int64_t>(half_ms * jitter));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_THROUGHPUT_TRACKER_H_
+#define UPDATE_ENGINE_COMMON_THROUGHPUT_TRACKER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// Measures the throughput of a connection as one sample per second, and tells
+// when it stalled compared to its own recent rate. Fast connections which
+// stall are worth reconnecting well before a fixed low speed limit would give
+// up on them, while slow ones are left alone.
+class ThroughputTracker {
+ public:
+  // The most recent samples kept, one per second.
+  static constexpr size_t kMaxSamples = 30;
+  // A stall is the mean of the last |kStallSamples| samples falling under
+  // |kStallFraction| of the median of the |kMinBaselineSamples| or more
+  // samples before them, that median being at least |kMinStallBaselineBps|.
+  static constexpr size_t kStallSamples = 5;
+  static constexpr size_t kMinBaselineSamples = 5;
+  static constexpr double kStallFraction = 0.1;
+  static constexpr double kMinStallBaselineBps = 64 * 1024;
+
+  ThroughputTracker() = default;
+
+  // Forgets all the samples and starts the next one at |now|.
+  void Reset(base::TimeTicks now);
+
+  // Counts |bytes| received at |now|.
+  void AddBytes(size_t bytes, base::TimeTicks now);
+
+  // Adds the samples of the intervals which ended by |now|, without any bytes
+  // if none were received since.
+  void Update(base::TimeTicks now);
+
+  // The exponentially weighted moving average of the samples, in bytes per
+  // second, or 0 without any sample.
+  double average() const { return average_; }
+
+  // The |percentile| (0 to 100) of the kept samples, or 0 without any.
+  double Percentile(int percentile) const;
+
+  // Whether the connection stalled, as of the last Update() or AddBytes().
+  bool IsStalled() const;
+
+  size_t num_samples() const { return samples_.size(); }
+
+ private:
+  // Adds the sample of the current interval and starts the next one.
+  void AddSample(double bytes_per_second);
+
+  base::TimeTicks interval_start_;
+  uint64_t interval_bytes_{0};
+  // In bytes per second, the most recent last.
+  std::deque<double> samples_;
+  double average_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ThroughputTracker);
+};
+
+// The delay before the |attempt|th retry in a row (1 for the first one):
+// |base| doubled for each retry after the first, up to |max|. Only half of it
+// is certain, the other half is scaled by |jitter|, from 0 to 1, so the
+// clients failing at the same time don't all retry at the same time.
+base::TimeDelta RetryBackoffDelay(base::TimeDelta base,
+                                  base::TimeDelta max,
+                                  int attempt,
+                                  double jitter);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_THROUGHPUT_TRACKER_H_
@@ -0,0 +1,88 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/throughput_tracker.h"
+
+#include <gtest/gtest.h>
+
+using base::TimeDelta;
+using base::TimeTicks;
+
+namespace chromeos_update_engine {
+
+class ThroughputTrackerTest : public ::testing::Test {
+ protected:
+  void SetUp() override { tracker_.Reset(now_); }
+
+  // Receives |bytes_per_second| for |seconds|, in two writes per second.
+  void Receive(size_t bytes_per_second, int seconds) {
+    for (int i = 0; i < seconds * 2; i++) {
+      tracker_.AddBytes(bytes_per_second / 2, now_);
+      now_ += TimeDelta::FromMilliseconds(500);
+    }
+    tracker_.Update(now_);
+  }
+
+  TimeTicks now_ = TimeTicks::Now();
+  ThroughputTracker tracker_;
+};
+
+TEST_F(ThroughputTrackerTest, SamplesTest) {
+  Receive(1000, 3);
+  Receive(3000, 2);
+  EXPECT_EQ(5u, tracker_.num_samples());
+  EXPECT_DOUBLE_EQ(1000, tracker_.Percentile(0));
+  EXPECT_DOUBLE_EQ(1000, tracker_.Percentile(50));
+  EXPECT_DOUBLE_EQ(3000, tracker_.Percentile(100));
+  EXPECT_GT(tracker_.average(), 1000);
+  EXPECT_LT(tracker_.average(), 3000);
+}
+
+TEST_F(ThroughputTrackerTest, LongGapTest) {
+  Receive(1000, 3);
+  tracker_.Update(now_ + TimeDelta::FromMinutes(10));
+  EXPECT_EQ(ThroughputTracker::kMaxSamples, tracker_.num_samples());
+  EXPECT_DOUBLE_EQ(0, tracker_.Percentile(100));
+}
+
+TEST_F(ThroughputTrackerTest, StallTest) {
+  Receive(1024 * 1024, 10);
+  EXPECT_FALSE(tracker_.IsStalled());
+  Receive(1024, 4);
+  EXPECT_FALSE(tracker_.IsStalled());
+  Receive(1024, 1);
+  EXPECT_TRUE(tracker_.IsStalled());
+  Receive(1024 * 1024, 5);
+  EXPECT_FALSE(tracker_.IsStalled());
+}
+
+TEST_F(ThroughputTrackerTest, SlowConnectionNeverStallsTest) {
+  Receive(10 * 1024, 10);
+  Receive(0, 10);
+  EXPECT_FALSE(tracker_.IsStalled());
+}
+
+TEST(RetryBackoffDelayTest, ExponentialTest) {
+  const TimeDelta base = TimeDelta::FromSeconds(10);
+  const TimeDelta max = TimeDelta::FromSeconds(60);
+  EXPECT_EQ(TimeDelta::FromSeconds(5), RetryBackoffDelay(base, max, 1, 0));
+  EXPECT_EQ(TimeDelta::FromSeconds(10), RetryBackoffDelay(base, max, 1, 1));
+  EXPECT_EQ(TimeDelta::FromSeconds(30), RetryBackoffDelay(base, max, 3, 0.5));
+  EXPECT_EQ(TimeDelta::FromSeconds(60), RetryBackoffDelay(base, max, 4, 1));
+  EXPECT_EQ(TimeDelta::FromSeconds(60), RetryBackoffDelay(base, max, 20, 1));
+}
+
+}  // namespace chromeos_update_engine
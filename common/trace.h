@@ -0,0 +1,109 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_TRACE_H_
+#define UPDATE_ENGINE_COMMON_TRACE_H_
+
+// Trace spans of the update, emitted through atrace on Android where Perfetto
+// records them with the "atrace" data source, e.g.:
+//
+//   perfetto -o /data/misc/perfetto-traces/ota.trace -t 60s --app '*'
+//
+// Builds with USE_TRACE=0 compile the macros out, and their arguments aren't
+// evaluated. Otherwise, while nothing records, a span costs a load of the
+// enabled trace tags and the span names aren't formatted.
+
+#if USE_TRACE
+
+#include <string>
+
+#include <base/macros.h>
+#include <base/strings/stringprintf.h>
+#include <cutils/trace.h>
+
+namespace chromeos_update_engine {
+
+// update_engine isn't in a category of its own, its spans are recorded
+// whenever atrace is.
+constexpr uint64_t kTraceTag = ATRACE_TAG_ALWAYS;
+
+inline bool TraceEnabled() {
+  return atrace_is_tag_enabled(kTraceTag);
+}
+
+// A span from its construction to its destruction, on the calling thread.
+class ScopedTrace {
+ public:
+  explicit ScopedTrace(const char* name) : active_(TraceEnabled()) {
+    if (active_)
+      atrace_begin(kTraceTag, name);
+  }
+  explicit ScopedTrace(const std::string& name) : ScopedTrace(name.c_str()) {}
+  ~ScopedTrace() {
+    if (active_)
+      atrace_end(kTraceTag);
+  }
+
+ private:
+  // Whether the span began, so that it ends even if tracing stopped since.
+  const bool active_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTrace);
+};
+
+}  // namespace chromeos_update_engine
+
+#define UE_TRACE_CONCAT_INNER(a, b) a##b
+#define UE_TRACE_CONCAT(a, b) UE_TRACE_CONCAT_INNER(a, b)
+
+// Traces the rest of the enclosing scope as the span |name|.
+#define UE_TRACE_SCOPE(name)                                                  \
+  ::chromeos_update_engine::ScopedTrace UE_TRACE_CONCAT(ue_trace_, __LINE__)( \
+      name)
+
+// Like UE_TRACE_SCOPE(), with a printf-style name only formatted while
+// tracing.
+#define UE_TRACE_SCOPE_F(format, ...)                                         \
+  ::chromeos_update_engine::ScopedTrace UE_TRACE_CONCAT(ue_trace_, __LINE__)( \
+      ::chromeos_update_engine::TraceEnabled()                                \
+          ? base::StringPrintf(format, __VA_ARGS__)                           \
+          : std::string())
+
+// A span which may end on another thread or message loop task, identified by
+// its |name| and |cookie|.
+#define UE_TRACE_ASYNC_BEGIN(name, cookie) \
+  atrace_async_begin(::chromeos_update_engine::kTraceTag, name, cookie)
+#define UE_TRACE_ASYNC_END(name, cookie) \
+  atrace_async_end(::chromeos_update_engine::kTraceTag, name, cookie)
+
+#else  // !USE_TRACE
+
+#define UE_TRACE_SCOPE(name) \
+  do {                       \
+  } while (0)
+#define UE_TRACE_SCOPE_F(format, ...) \
+  do {                                \
+  } while (0)
+#define UE_TRACE_ASYNC_BEGIN(name, cookie) \
+  do {                                     \
+  } while (0)
+#define UE_TRACE_ASYNC_END(name, cookie) \
+  do {                                   \
+  } while (0)
+
+#endif  // USE_TRACE
+
+#endif  // UPDATE_ENGINE_COMMON_TRACE_H_
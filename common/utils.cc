@@ -58,7 +58,9 @@
 #include "update_engine/common/platform_constants.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/subprocess.h"
+#include "update_engine/common/trace.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
 
 using base::Time;
 using base::TimeDelta;
@@ -83,6 +85,7 @@ const int kGetFileFormatMaxHeaderSize = 32;
 
 // The path to the kernel's boot_id.
 const char kBootIdPath[] = "/proc/sys/kernel/random/boot_id";
+const char kIoPressurePath[] = "/proc/pressure/io";
 
 // If |path| is absolute, or explicit relative to the current working directory,
 // leaves it as is. Otherwise, uses the system's temp directory, as defined by
@@ -160,6 +163,8 @@ bool WriteAll(int fd, const void* buf, size_t count) {
 }
 
 bool PWriteAll(int fd, const void* buf, size_t count, off_t offset) {
+  UE_TRACE_SCOPE_F(
+      "pwrite %zu bytes at %jd", count, static_cast<intmax_t>(offset));
   const char* c_buf = static_cast<const char*>(buf);
   size_t bytes_written = 0;
   int num_attempts = 0;
@@ -182,6 +187,7 @@ bool PWriteAll(int fd, const void* buf, size_t count, off_t offset) {
 }
 
 bool WriteAll(FileDescriptor* fd, const void* buf, size_t count) {
+  UE_TRACE_SCOPE_F("write %zu bytes", count);
   const char* c_buf = static_cast<const char*>(buf);
   ssize_t bytes_written = 0;
   while (bytes_written < static_cast<ssize_t>(count)) {
@@ -203,6 +209,8 @@ bool WriteAll(const FileDescriptorPtr& fd,
 
 bool PReadAll(
     int fd, void* buf, size_t count, off_t offset, ssize_t* out_bytes_read) {
+  UE_TRACE_SCOPE_F(
+      "pread %zu bytes at %jd", count, static_cast<intmax_t>(offset));
   char* c_buf = static_cast<char*>(buf);
   ssize_t bytes_read = 0;
   while (bytes_read < static_cast<ssize_t>(count)) {
@@ -223,6 +231,8 @@ bool ReadAll(FileDescriptor* fd,
              size_t count,
              off_t offset,
              ssize_t* out_bytes_read) {
+  UE_TRACE_SCOPE_F(
+      "read %zu bytes at %jd", count, static_cast<intmax_t>(offset));
   TEST_AND_RETURN_FALSE_ERRNO(fd->Seek(offset, SEEK_SET) !=
                               static_cast<off_t>(-1));
   char* c_buf = static_cast<char*>(buf);
@@ -432,6 +442,24 @@ void HexDumpArray(const uint8_t* const arr, const size_t length) {
   }
 }
 
+bool IsZeroBuffer(const void* data, size_t size) {
+  auto bytes = static_cast<const uint8_t*>(data);
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    uint64_t words[4];
+    memcpy(words, bytes + i, sizeof(words));
+    // No early exit inside the 32 bytes, so that the loop body has no branch
+    // but the final one.
+    if ((words[0] | words[1] | words[2] | words[3]) != 0)
+      return false;
+  }
+  for (; i < size; i++) {
+    if (bytes[i] != 0)
+      return false;
+  }
+  return true;
+}
+
 bool SplitPartitionName(const string& partition_name,
                         string* out_disk_name,
                         int* out_partition_num) {
@@ -931,8 +959,8 @@ bool ReadExtents(const std::string& path,
                  brillo::Blob* out_data,
                  ssize_t out_data_size,
                  size_t block_size) {
-  FileDescriptorPtr fd = std::make_shared<EintrSafeFileDescriptor>();
-  fd->Open(path.c_str(), O_RDONLY);
+  FileDescriptorPtr fd = std::make_shared<IoUringFileDescriptor>();
+  TEST_AND_RETURN_FALSE_ERRNO(fd->Open(path.c_str(), O_RDONLY));
   return ReadExtents(fd, extents, out_data, out_data_size, block_size);
 }
 
@@ -955,20 +983,19 @@ bool ReadExtents(FileDescriptorPtr fd,
   brillo::Blob data(out_data_size);
   ssize_t bytes_read = 0;
 
+  std::vector<FileDescriptor::ReadRequest> requests;
+  requests.reserve(extents.size());
   for (const Extent& extent : extents) {
-    ssize_t bytes_read_this_iteration = 0;
     ssize_t bytes = extent.num_blocks() * block_size;
     TEST_LE(bytes_read + bytes, out_data_size);
-    TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
-                                          &data[bytes_read],
-                                          bytes,
-                                          extent.start_block() * block_size,
-                                          &bytes_read_this_iteration));
-    TEST_AND_RETURN_FALSE(bytes_read_this_iteration == bytes);
-    bytes_read += bytes_read_this_iteration;
+    requests.push_back({extent.start_block() * block_size,
+                        data.data() + bytes_read,
+                        static_cast<size_t>(bytes)});
+    bytes_read += bytes;
   }
   TEST_AND_RETURN_FALSE(out_data_size == bytes_read);
-  *out_data = data;
+  TEST_AND_RETURN_FALSE(fd->ReadBatch(requests));
+  *out_data = std::move(data);
   return true;
 }
 
@@ -998,6 +1025,29 @@ bool GetBootId(string* boot_id) {
   return true;
 }
 
+bool ParseIoPressure(const string& contents, double* some_avg10) {
+  // The lines look like "some avg10=1.23 avg60=0.50 avg300=0.10 total=4567".
+  for (const auto& line : base::SplitString(
+           contents, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    vector<string> fields = base::SplitString(
+        line, " ", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    if (fields.size() < 2 || fields[0] != "some")
+      continue;
+    constexpr char kAvg10[] = "avg10=";
+    if (!base::StartsWith(fields[1], kAvg10, base::CompareCase::SENSITIVE))
+      return false;
+    return base::StringToDouble(fields[1].substr(strlen(kAvg10)), some_avg10);
+  }
+  return false;
+}
+
+bool GetIoPressure(double* some_avg10) {
+  string contents;
+  if (!base::ReadFileToString(base::FilePath(kIoPressurePath), &contents))
+    return false;
+  return ParseIoPressure(contents, some_avg10);
+}
+
 int VersionPrefix(const std::string& version) {
   if (version.empty()) {
     return 0;
@@ -253,6 +253,14 @@ inline void HexDumpVector(const brillo::Blob& vect) {
   HexDumpArray(vect.data(), vect.size());
 }
 
+// Returns whether the |size| bytes at |data| are all zeros. The buffer is
+// scanned 32 bytes at a time, which the compiler turns into vector
+// instructions.
+bool IsZeroBuffer(const void* data, size_t size);
+inline bool IsZeroBuffer(const brillo::Blob& blob) {
+  return IsZeroBuffer(blob.data(), blob.size());
+}
+
 template <typename T>
 bool VectorIndexOf(const std::vector<T>& vect,
                    const T& value,
@@ -368,6 +376,15 @@ bool ReadExtents(FileDescriptorPtr path,
 // reboot. Returns whether it succeeded getting the boot_id.
 bool GetBootId(std::string* boot_id);
 
+// Parses the 10 second average of the share of time some tasks stalled on I/O,
+// in percent, from the |contents| of /proc/pressure/io. Returns false if it
+// isn't found.
+bool ParseIoPressure(const std::string& contents, double* some_avg10);
+
+// Reads the I/O pressure of the system, as ParseIoPressure(). Returns false if
+// the kernel doesn't report it.
+bool GetIoPressure(double* some_avg10);
+
 // Gets a string value from the vpd for a given key using the `vpd_get_value`
 // shell command. Returns true on success.
 bool GetVpdValue(std::string key, std::string* result);
@@ -90,6 +90,19 @@ TEST(UtilsTest, IsSymlinkTest) {
   EXPECT_FALSE(utils::IsSymlink("/non/existent/path"));
 }
 
+TEST(UtilsTest, IsZeroBufferTest) {
+  brillo::Blob data(100, 0);
+  EXPECT_TRUE(utils::IsZeroBuffer(data));
+  EXPECT_TRUE(utils::IsZeroBuffer(data.data(), 0));
+  // A non-zero byte in the 32 bytes words and in the tail.
+  for (size_t i : {0, 31, 63, 64, 99}) {
+    data[i] = 1;
+    EXPECT_FALSE(utils::IsZeroBuffer(data)) << i;
+    EXPECT_TRUE(utils::IsZeroBuffer(data.data(), i));
+    data[i] = 0;
+  }
+}
+
 TEST(UtilsTest, SplitPartitionNameTest) {
   string disk;
   int part_num;
@@ -464,6 +477,18 @@ TEST(UtilsTest, GetFilePathTest) {
   IGNORE_EINTR(close(fd));
 }
 
+TEST(UtilsTest, ParseIoPressureTest) {
+  double avg10 = 0;
+  EXPECT_TRUE(utils::ParseIoPressure(
+      "some avg10=12.50 avg60=3.00 avg300=1.00 total=123456\n"
+      "full avg10=8.25 avg60=2.00 avg300=0.50 total=65432\n",
+      &avg10));
+  EXPECT_DOUBLE_EQ(12.5, avg10);
+  EXPECT_FALSE(utils::ParseIoPressure("", &avg10));
+  EXPECT_FALSE(utils::ParseIoPressure("full avg10=1.00\n", &avg10));
+  EXPECT_FALSE(utils::ParseIoPressure("some avg60=1.00\n", &avg10));
+}
+
 TEST(UtilsTest, ValidatePerPartitionTimestamp) {
   ASSERT_EQ(ErrorCode::kPayloadTimestampError,
             utils::IsTimestampNewer("10", "5"));
@@ -0,0 +1,130 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/worker_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "update_engine/common/cpu_policy.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// A worker task blocking on another pool must not hold a slot of the
+// CpuPolicy meanwhile, or the tasks it waits for might never run.
+class ScopedYieldWorkerTask {
+ public:
+  ScopedYieldWorkerTask() : in_worker_task_(CpuPolicy::InWorkerTask()) {
+    if (in_worker_task_)
+      CpuPolicy::Get()->EndWorkerTask();
+  }
+  ~ScopedYieldWorkerTask() {
+    if (in_worker_task_)
+      CpuPolicy::Get()->BeginWorkerTask();
+  }
+
+ private:
+  const bool in_worker_task_;
+};
+}  // namespace
+
+WorkerPool::WorkerPool(size_t num_threads, size_t max_queued_tasks)
+    : max_queued_tasks_(std::max<size_t>(max_queued_tasks, 1)) {
+  num_threads = std::max<size_t>(num_threads, 1);
+  threads_.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; i++) {
+    threads_.emplace_back(&WorkerPool::WorkerLoop, this);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  ScopedYieldWorkerTask yield;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    task_done_.wait(lock,
+                    [this] { return queue_.empty() && running_tasks_ == 0; });
+    stopping_ = true;
+  }
+  task_queued_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+bool WorkerPool::Post(Task task) {
+  ScopedYieldWorkerTask yield;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    task_done_.wait(lock, [this] {
+      return failed_ || queue_.size() < max_queued_tasks_;
+    });
+    if (failed_) {
+      return false;
+    }
+    queue_.push_back(std::move(task));
+  }
+  task_queued_.notify_one();
+  return true;
+}
+
+bool WorkerPool::Wait() {
+  ScopedYieldWorkerTask yield;
+  std::unique_lock<std::mutex> lock(mutex_);
+  task_done_.wait(lock,
+                  [this] { return queue_.empty() && running_tasks_ == 0; });
+  return !failed_;
+}
+
+void WorkerPool::Reset() {
+  ScopedYieldWorkerTask yield;
+  std::unique_lock<std::mutex> lock(mutex_);
+  task_done_.wait(lock,
+                  [this] { return queue_.empty() && running_tasks_ == 0; });
+  failed_ = false;
+}
+
+void WorkerPool::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    task_queued_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      // |stopping_| is only set once the queue is drained.
+      return;
+    }
+    Task task = std::move(queue_.front());
+    queue_.pop_front();
+    running_tasks_++;
+    task_done_.notify_all();
+
+    lock.unlock();
+    CpuPolicy::Get()->BeginWorkerTask();
+    const bool result = task();
+    CpuPolicy::Get()->EndWorkerTask();
+    lock.lock();
+
+    running_tasks_--;
+    if (!result && !failed_) {
+      failed_ = true;
+      // Nothing queued after a failure may run, the caller has to recover
+      // from the last consistent state anyway.
+      queue_.clear();
+    }
+    task_done_.notify_all();
+  }
+}
+
+}  // namespace chromeos_update_engine
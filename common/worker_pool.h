@@ -0,0 +1,82 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_WORKER_POOL_H_
+#define UPDATE_ENGINE_COMMON_WORKER_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// A fixed set of worker threads consuming tasks from a bounded FIFO queue.
+// Post() blocks while the queue is full, which gives backpressure between a
+// producer (e.g. the download loop) and the workers. A task returns false on
+// failure; once any task fails, the remaining queued tasks are dropped and
+// both Post() and Wait() report the failure until Reset() is called. The
+// tasks run where and as many at a time as CpuPolicy::Get() allows.
+class WorkerPool {
+ public:
+  using Task = std::function<bool()>;
+
+  // Starts |num_threads| workers. At most |max_queued_tasks| tasks wait in the
+  // queue at any time, not counting the ones currently running.
+  WorkerPool(size_t num_threads, size_t max_queued_tasks);
+  // Waits for all posted tasks and joins the workers.
+  ~WorkerPool();
+
+  // Queues |task| for execution, blocking while the queue is full. Returns
+  // false without queuing |task| if a previous task failed.
+  bool Post(Task task);
+
+  // Blocks until every posted task finished. Returns false if any task failed
+  // since construction or the last Reset().
+  bool Wait();
+
+  // Waits for running tasks and clears the failure state.
+  void Reset();
+
+  size_t num_threads() const { return threads_.size(); }
+
+ private:
+  void WorkerLoop();
+
+  std::mutex mutex_;
+  // Signaled when a task is queued or the pool is stopping.
+  std::condition_variable task_queued_;
+  // Signaled when a task is dequeued or finishes.
+  std::condition_variable task_done_;
+
+  std::deque<Task> queue_;
+  const size_t max_queued_tasks_;
+  size_t running_tasks_{0};
+  bool failed_{false};
+  bool stopping_{false};
+
+  std::vector<std::thread> threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(WorkerPool);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_WORKER_POOL_H_
@@ -0,0 +1,87 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/worker_pool.h"
+
+#include <atomic>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(WorkerPoolTest, RunsAllTasksTest) {
+  std::atomic<int> counter{0};
+  WorkerPool pool(4, 2);
+  for (int i = 0; i < 100; i++) {
+    ASSERT_TRUE(pool.Post([&counter] {
+      counter++;
+      return true;
+    }));
+  }
+  ASSERT_TRUE(pool.Wait());
+  ASSERT_EQ(100, counter);
+}
+
+TEST(WorkerPoolTest, SingleThreadKeepsOrderTest) {
+  std::vector<int> order;
+  WorkerPool pool(1, 1);
+  for (int i = 0; i < 10; i++) {
+    ASSERT_TRUE(pool.Post([&order, i] {
+      order.push_back(i);
+      return true;
+    }));
+  }
+  ASSERT_TRUE(pool.Wait());
+  ASSERT_EQ((std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9}), order);
+}
+
+TEST(WorkerPoolTest, FailureStopsQueueTest) {
+  std::atomic<int> counter{0};
+  WorkerPool pool(1, 1);
+  ASSERT_TRUE(pool.Post([] { return false; }));
+  ASSERT_FALSE(pool.Wait());
+  ASSERT_FALSE(pool.Post([&counter] {
+    counter++;
+    return true;
+  }));
+  ASSERT_FALSE(pool.Wait());
+  ASSERT_EQ(0, counter);
+
+  pool.Reset();
+  ASSERT_TRUE(pool.Post([&counter] {
+    counter++;
+    return true;
+  }));
+  ASSERT_TRUE(pool.Wait());
+  ASSERT_EQ(1, counter);
+}
+
+TEST(WorkerPoolTest, DestructorWaitsForTasksTest) {
+  std::atomic<int> counter{0};
+  {
+    WorkerPool pool(2, 8);
+    for (int i = 0; i < 8; i++) {
+      ASSERT_TRUE(pool.Post([&counter] {
+        counter++;
+        return true;
+      }));
+    }
+  }
+  ASSERT_EQ(8, counter);
+}
+
+}  // namespace chromeos_update_engine
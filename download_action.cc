@@ -21,6 +21,7 @@
 #include <algorithm>
 #include <string>
 
+#include <base/bind.h>
 #include <base/files/file_path.h>
 #include <base/metrics/statistics_recorder.h>
 #include <base/strings/stringprintf.h>
@@ -33,10 +34,21 @@
 #include "update_engine/common/utils.h"
 
 using base::FilePath;
+using brillo::MessageLoop;
 using std::string;
 
 namespace chromeos_update_engine {
 
+namespace {
+// The most bytes of the download buffer written in one go, while the fetcher
+// waits.
+constexpr size_t kDownloadBufferWriteSize = 256 * 1024;
+// How far the download may fall behind the rate limit, and catch up at full
+// speed afterwards.
+constexpr base::TimeDelta kMaxDownloadRateBurst =
+    base::TimeDelta::FromSeconds(1);
+}  // namespace
+
 DownloadAction::DownloadAction(PrefsInterface* prefs,
                                BootControlInterface* boot_control,
                                HardwareInterface* hardware,
@@ -52,7 +64,10 @@ DownloadAction::DownloadAction(PrefsInterface* prefs,
       delegate_(nullptr),
       update_certificates_path_(std::move(update_certificates_path)) {}
 
-DownloadAction::~DownloadAction() {}
+DownloadAction::~DownloadAction() {
+  CancelWriteBufferedBytes();
+  CancelThrottle();
+}
 
 void DownloadAction::PerformAction() {
   http_fetcher_->set_delegate(this);
@@ -124,6 +139,18 @@ bool DownloadAction::LoadCachedManifest(int64_t manifest_size) {
 void DownloadAction::StartDownloading() {
   download_active_ = true;
   http_fetcher_->ClearRanges();
+  ClearDownloadBuffer();
+  SetMaxDownloadRate(install_plan_.max_download_rate);
+  if (install_plan_.download_buffer_size > 0) {
+    download_buffer_reservation_ = MemoryBudget::Get()->Reserve(
+        std::min<uint64_t>(install_plan_.download_buffer_size,
+                           kDownloadBufferWriteSize),
+        install_plan_.download_buffer_size,
+        1,
+        "download");
+    LOG(INFO) << "Buffering up to " << download_buffer_reservation_.size()
+              << " bytes of the download.";
+  }
 
   if (delta_performer_ != nullptr) {
     LOG(INFO) << "Using writer for test.";
@@ -187,18 +214,165 @@ void DownloadAction::StartDownloading() {
     }
   }
 
+  http_fetcher_->ClearMirrorUrls();
+  for (const string& url : install_plan_.mirror_urls) {
+    http_fetcher_->AddMirrorUrl(url);
+  }
+  http_fetcher_->ClearPeerUrls();
+  for (const string& url : install_plan_.peer_urls) {
+    http_fetcher_->AddPeerUrl(url);
+  }
+  http_fetcher_->ClearSplitParts();
+  for (const auto& [offset, url] : install_plan_.split_payload_parts) {
+    http_fetcher_->AddSplitPart(base_offset_ + offset, url);
+  }
   http_fetcher_->BeginTransfer(install_plan_.download_url);
 }
 
 void DownloadAction::SuspendAction() {
-  http_fetcher_->Pause();
+  suspended_ = true;
+  CancelWriteBufferedBytes();
+  UpdateFetcherPause();
 }
 
 void DownloadAction::ResumeAction() {
-  http_fetcher_->Unpause();
+  suspended_ = false;
+  if (BufferedBytes() > 0 || transfer_complete_pending_)
+    ScheduleWriteBufferedBytes();
+  UpdateFetcherPause();
+}
+
+void DownloadAction::UpdateFetcherPause() {
+  const bool pause = suspended_ || download_buffer_full_ || throttled_;
+  if (pause == fetcher_paused_)
+    return;
+  fetcher_paused_ = pause;
+  // Unpausing may deliver bytes right away.
+  if (pause)
+    http_fetcher_->Pause();
+  else
+    http_fetcher_->Unpause();
+}
+
+void DownloadAction::SetMaxDownloadRate(uint64_t bytes_per_second) {
+  LOG_IF(INFO, bytes_per_second != max_download_rate_)
+      << "Limiting the download to " << bytes_per_second
+      << " bytes per second (0 for no limit).";
+  max_download_rate_ = bytes_per_second;
+  rate_window_start_ = base::TimeTicks();
+  rate_window_bytes_ = 0;
+  if (throttled_) {
+    CancelThrottle();
+    EndThrottle();
+  }
+}
+
+void DownloadAction::ThrottleDownload(size_t length) {
+  if (max_download_rate_ == 0)
+    return;
+  const base::TimeTicks now = base::TimeTicks::Now();
+  if (rate_window_start_.is_null())
+    rate_window_start_ = now;
+  rate_window_bytes_ += length;
+  const base::TimeDelta expected = base::TimeDelta::FromMicroseconds(
+      rate_window_bytes_ * base::Time::kMicrosecondsPerSecond /
+      max_download_rate_);
+  const base::TimeDelta elapsed = now - rate_window_start_;
+  if (expected <= elapsed) {
+    // After a slow period or a pause, don't let the download go over the
+    // limit for long.
+    if (elapsed - expected > kMaxDownloadRateBurst) {
+      rate_window_start_ = now;
+      rate_window_bytes_ = 0;
+    }
+    return;
+  }
+  if (throttle_task_id_ != MessageLoop::kTaskIdNull)
+    return;
+  throttled_ = true;
+  throttle_task_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&DownloadAction::EndThrottle, base::Unretained(this)),
+      expected - elapsed);
+  UpdateFetcherPause();
+}
+
+void DownloadAction::EndThrottle() {
+  throttle_task_id_ = MessageLoop::kTaskIdNull;
+  throttled_ = false;
+  UpdateFetcherPause();
+}
+
+void DownloadAction::CancelThrottle() {
+  if (throttle_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(throttle_task_id_);
+    throttle_task_id_ = MessageLoop::kTaskIdNull;
+  }
+}
+
+void DownloadAction::ClearDownloadBuffer() {
+  CancelWriteBufferedBytes();
+  brillo::Blob().swap(download_buffer_);
+  download_buffer_offset_ = 0;
+  download_buffer_reservation_.Release();
+  download_buffer_full_ = false;
+  transfer_complete_pending_ = false;
+}
+
+void DownloadAction::ScheduleWriteBufferedBytes() {
+  if (write_task_id_ != MessageLoop::kTaskIdNull)
+    return;
+  write_task_id_ = MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&DownloadAction::WriteBufferedBytes, base::Unretained(this)));
+}
+
+void DownloadAction::CancelWriteBufferedBytes() {
+  // Without a download buffer, there may be no MessageLoop.
+  if (write_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(write_task_id_);
+    write_task_id_ = MessageLoop::kTaskIdNull;
+  }
+}
+
+void DownloadAction::WriteBufferedBytes() {
+  write_task_id_ = MessageLoop::kTaskIdNull;
+  if (suspended_)
+    return;
+  const size_t length = std::min(BufferedBytes(), kDownloadBufferWriteSize);
+  if (length > 0) {
+    auto next = download_buffer_.begin() + download_buffer_offset_;
+    if (!WriteToDeltaPerformer(&*next, length)) {
+      return;
+    }
+    download_buffer_offset_ += length;
+    if (download_buffer_offset_ == download_buffer_.size()) {
+      download_buffer_.clear();
+      download_buffer_offset_ = 0;
+    } else if (download_buffer_offset_ > download_buffer_.size() / 2) {
+      // Drop the bytes written, rather than growing the buffer forever.
+      download_buffer_.erase(download_buffer_.begin(), next + length);
+      download_buffer_offset_ = 0;
+    }
+  }
+
+  if (download_buffer_full_ &&
+      BufferedBytes() <= download_buffer_reservation_.size() / 2) {
+    download_buffer_full_ = false;
+    UpdateFetcherPause();
+  }
+  if (BufferedBytes() > 0) {
+    ScheduleWriteBufferedBytes();
+  } else if (transfer_complete_pending_) {
+    transfer_complete_pending_ = false;
+    TransferComplete(http_fetcher_.get(), transfer_successful_);
+  }
 }
 
 void DownloadAction::TerminateProcessing() {
+  ClearDownloadBuffer();
+  CancelThrottle();
+  throttled_ = false;
   if (delta_performer_) {
     delta_performer_->Close();
     delta_performer_.reset();
@@ -222,7 +396,26 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
   if (delegate_ && download_active_) {
     delegate_->BytesReceived(length, bytes_downloaded_total, bytes_total_);
   }
-  if (delta_performer_ && !delta_performer_->Write(bytes, length, &code_)) {
+  ThrottleDownload(length);
+  if (!delta_performer_) {
+    return true;
+  }
+  if (download_buffer_reservation_.size() == 0) {
+    return WriteToDeltaPerformer(bytes, length);
+  }
+
+  const uint8_t* data = static_cast<const uint8_t*>(bytes);
+  download_buffer_.insert(download_buffer_.end(), data, data + length);
+  if (BufferedBytes() >= download_buffer_reservation_.size()) {
+    download_buffer_full_ = true;
+    UpdateFetcherPause();
+  }
+  ScheduleWriteBufferedBytes();
+  return true;
+}
+
+bool DownloadAction::WriteToDeltaPerformer(const void* bytes, size_t length) {
+  if (!delta_performer_->Write(bytes, length, &code_)) {
     if (code_ != ErrorCode::kSuccess) {
       LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
                  << ") in DeltaPerformer's Write method when "
@@ -239,6 +432,15 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
 }
 
 void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
+  if (BufferedBytes() > 0) {
+    // Finish writing what was received first.
+    transfer_complete_pending_ = true;
+    transfer_successful_ = successful;
+    return;
+  }
+  ClearDownloadBuffer();
+  CancelThrottle();
+  throttled_ = false;
   if (delta_performer_) {
     LOG_IF(WARNING, delta_performer_->Close() != 0)
         << "Error closing the writer.";
@@ -267,6 +469,10 @@ void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
     }
   }
 
+  // The manifest, buffers and caches of the payload aren't needed anymore,
+  // release them before verifying.
+  delta_performer_.reset();
+
   // Write the path to the output pipe if we're successful.
   if (code == ErrorCode::kSuccess && HasOutputPipe())
     SetOutputObject(install_plan_);
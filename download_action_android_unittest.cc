@@ -18,6 +18,7 @@
 #include <cstdint>
 #include <memory>
 
+#include <brillo/message_loops/fake_message_loop.h>
 #include <gmock/gmock.h>
 #include <gmock/gmock-actions.h>
 #include <gmock/gmock-function-mocker.h>
@@ -47,6 +48,35 @@ using testing::DoAll;
 using testing::Return;
 using testing::SetArgPointee;
 
+namespace {
+// Records the bytes it is given instead of applying them.
+class RecordingDeltaPerformer : public DeltaPerformer {
+ public:
+  RecordingDeltaPerformer(PrefsInterface* prefs,
+                          BootControlInterface* boot_control,
+                          HardwareInterface* hardware,
+                          InstallPlan* install_plan,
+                          std::string* written)
+      : DeltaPerformer(prefs,
+                       boot_control,
+                       hardware,
+                       nullptr,
+                       install_plan,
+                       &install_plan->payloads[0],
+                       false),
+        written_(written) {}
+
+  bool Write(const void* bytes, size_t count, ErrorCode* error) override {
+    written_->append(static_cast<const char*>(bytes), count);
+    return true;
+  }
+  int Close() override { return 0; }
+
+ private:
+  std::string* written_;
+};
+}  // namespace
+
 class DownloadActionTest : public ::testing::Test {
  public:
   static constexpr int64_t METADATA_SIZE = 1024;
@@ -175,4 +205,91 @@ TEST_F(DownloadActionTest, CacheManifestValid) {
   // Manifest is cached, so no data should be downloaded from http fetcher.
   ASSERT_EQ(download_action->http_fetcher()->GetBytesDownloaded(), 0UL);
 }
+
+TEST_F(DownloadActionTest, BufferedDownloadWritesEveryByteInOrder) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+
+  std::string data(10 * kMockHttpFetcherChunkSize + 123, '\0');
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<char>(i * 7 + i / 251);
+  }
+  MockPrefs prefs;
+  BootControlStub boot_control;
+  FakeHardware hardware;
+  MockHttpFetcher* http_fetcher =
+      new MockHttpFetcher(data.data(), data.size(), nullptr);
+  InstallPlan install_plan;
+  auto& payload = install_plan.payloads.emplace_back();
+  install_plan.download_url = "http://fake_url.invalid";
+  payload.size = data.size();
+  payload.payload_urls.emplace_back("http://fake_url.invalid");
+  // Smaller than the payload, so the fetcher has to wait for the writes.
+  install_plan.download_buffer_size = 2 * kMockHttpFetcherChunkSize;
+  action_pipe->set_contents(install_plan);
+
+  // takes ownership of passed in HttpFetcher
+  auto download_action = std::make_unique<DownloadAction>(
+      &prefs, &boot_control, &hardware, http_fetcher, false /* interactive */);
+  std::string written;
+  download_action->SetTestFileWriter(std::make_unique<RecordingDeltaPerformer>(
+      &prefs, &boot_control, &hardware, &install_plan, &written));
+  download_action->set_in_pipe(action_pipe);
+  MockActionProcessor mock_processor;
+  download_action->SetProcessor(&mock_processor);
+  // The recorded payload doesn't verify, but only once all of it is written.
+  EXPECT_CALL(mock_processor, ActionComplete(download_action.get(), _))
+      .WillOnce([&data, &written](AbstractAction*, ErrorCode) {
+        EXPECT_EQ(data.size(), written.size());
+      });
+  download_action->PerformAction();
+  while (loop.RunOnce(true)) {
+  }
+
+  EXPECT_EQ(data, written);
+  EXPECT_EQ(data.size(), download_action->http_fetcher()->GetBytesDownloaded());
+}
+
+TEST_F(DownloadActionTest, RateLimitedDownloadWritesEveryByteInOrder) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+
+  std::string data(4 * kMockHttpFetcherChunkSize + 123, '\0');
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<char>(i * 7 + i / 251);
+  }
+  MockPrefs prefs;
+  BootControlStub boot_control;
+  FakeHardware hardware;
+  MockHttpFetcher* http_fetcher =
+      new MockHttpFetcher(data.data(), data.size(), nullptr);
+  InstallPlan install_plan;
+  auto& payload = install_plan.payloads.emplace_back();
+  install_plan.download_url = "http://fake_url.invalid";
+  payload.size = data.size();
+  payload.payload_urls.emplace_back("http://fake_url.invalid");
+  // Every chunk is received faster than that, and pauses the fetcher.
+  install_plan.max_download_rate = 100 * kMockHttpFetcherChunkSize;
+  action_pipe->set_contents(install_plan);
+
+  // takes ownership of passed in HttpFetcher
+  auto download_action = std::make_unique<DownloadAction>(
+      &prefs, &boot_control, &hardware, http_fetcher, false /* interactive */);
+  std::string written;
+  download_action->SetTestFileWriter(std::make_unique<RecordingDeltaPerformer>(
+      &prefs, &boot_control, &hardware, &install_plan, &written));
+  download_action->set_in_pipe(action_pipe);
+  MockActionProcessor mock_processor;
+  download_action->SetProcessor(&mock_processor);
+  EXPECT_CALL(mock_processor, ActionComplete(download_action.get(), _));
+  download_action->PerformAction();
+  // Lifting the limit midway ends the current pause.
+  loop.RunOnce(true);
+  download_action->SetMaxDownloadRate(0);
+  while (loop.RunOnce(true)) {
+  }
+
+  EXPECT_EQ(data, written);
+}
+
 }  // namespace chromeos_update_engine
@@ -23,11 +23,13 @@
 
 #include <algorithm>
 #include <string>
+#include <vector>
 
 #include <base/bind.h>
 #include <base/format_macros.h>
 #include <base/location.h>
 #include <base/logging.h>
+#include <base/rand_util.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
@@ -44,8 +46,8 @@
 
 using base::TimeDelta;
 using brillo::MessageLoop;
-using std::max;
 using std::string;
+using std::vector;
 
 // This is a concrete implementation of HttpFetcher that uses libcurl to do the
 // http work.
@@ -56,6 +58,17 @@ namespace {
 
 const int kNoNetworkRetrySeconds = 10;
 
+// An attempt which downloaded this much before it was interrupted resets the
+// count of retries in a row, so slow but steady links never run out of them.
+const off_t kMinRetryProgressBytes = 1024 * 1024;
+
+// How often the throughput of a transfer is checked for a stall.
+const int kStallCheckSeconds = 1;
+
+// How long a connection stays idle before TCP keep-alive probes are sent, and
+// the interval between them, in seconds.
+const long kTcpKeepAliveSeconds = 30;  // NOLINT(runtime/int) - curl needs long
+
 // libcurl's CURLOPT_SOCKOPTFUNCTION callback function. Called after the socket
 // is created but before it is connected. This callback tags the created socket
 // so the network usage can be tracked in Android.
@@ -92,6 +105,70 @@ int LibcurlHttpFetcher::LibcurlCloseSocketCallback(void* clientp,
   return 1;
 }
 
+// static
+int LibcurlHttpFetcher::LibcurlSocketCallback(CURL* /* easy */,
+                                              curl_socket_t fd,
+                                              int what,
+                                              void* clientp,
+                                              void* /* socketp */) {
+  LibcurlHttpFetcher* fetcher = static_cast<LibcurlHttpFetcher*>(clientp);
+  const bool must_track[2] = {
+      what == CURL_POLL_IN || what == CURL_POLL_INOUT,  // track 0 -- read
+      what == CURL_POLL_OUT || what == CURL_POLL_INOUT  // track 1 -- write
+  };
+  // Only the watchers of |fd| change, so that after this loop there are
+  // exactly as many tasks scheduled in fd_controller_maps_[0|1] as there are
+  // read/write fds that libcurl wants us to track.
+  for (size_t t = 0; t < base::size(fetcher->fd_controller_maps_); ++t) {
+    auto& fd_controller_map = fetcher->fd_controller_maps_[t];
+    if (!must_track[t]) {
+      // If we have an outstanding io_channel, remove it.
+      fd_controller_map.erase(fd);
+      continue;
+    }
+
+    // If we are already tracking this fd, continue -- nothing to do.
+    if (fd_controller_map.find(fd) != fd_controller_map.end())
+      continue;
+
+    // Track a new fd.
+    auto callback = base::BindRepeating(&LibcurlHttpFetcher::CurlSocketAction,
+                                        base::Unretained(fetcher),
+                                        fd,
+                                        t == 0 ? CURL_CSELECT_IN
+                                               : CURL_CSELECT_OUT);
+    fd_controller_map[fd] =
+        t == 0 ? base::FileDescriptorWatcher::WatchReadable(fd, callback)
+               : base::FileDescriptorWatcher::WatchWritable(fd, callback);
+    static int io_counter = 0;
+    io_counter++;
+    if (io_counter % 50 == 0) {
+      LOG(INFO) << "io_counter = " << io_counter;
+    }
+  }
+  return 0;
+}
+
+// static
+int LibcurlHttpFetcher::LibcurlTimerCallback(
+    CURLM* /* multi */,
+    long timeout_ms,  // NOLINT(runtime/int)
+    void* clientp) {
+  LibcurlHttpFetcher* fetcher = static_cast<LibcurlHttpFetcher*>(clientp);
+  // libcurl must not be called from its callbacks, so even a timeout of 0 is
+  // handled from the message loop.
+  MessageLoop::current()->CancelTask(fetcher->timeout_id_);
+  fetcher->timeout_id_ = MessageLoop::kTaskIdNull;
+  if (timeout_ms >= 0) {
+    fetcher->timeout_id_ = MessageLoop::current()->PostDelayedTask(
+        FROM_HERE,
+        base::Bind(&LibcurlHttpFetcher::TimeoutCallback,
+                   base::Unretained(fetcher)),
+        TimeDelta::FromMilliseconds(timeout_ms));
+  }
+  return 0;
+}
+
 LibcurlHttpFetcher::LibcurlHttpFetcher(ProxyResolver* proxy_resolver,
                                        HardwareInterface* hardware)
     : HttpFetcher(proxy_resolver), hardware_(hardware) {
@@ -101,6 +178,17 @@ LibcurlHttpFetcher::LibcurlHttpFetcher(ProxyResolver* proxy_resolver,
     low_speed_time_seconds_ = kDownloadDevModeLowSpeedTimeSeconds;
   if (hardware_->IsOOBEEnabled() && !hardware_->IsOOBEComplete(nullptr))
     max_retry_count_ = kDownloadMaxRetryCountOobeNotComplete;
+
+  // Only this fetcher uses the share handle, and always from the message loop
+  // thread, so there is no need for lock callbacks.
+  curl_share_handle_ = curl_share_init();
+  CHECK(curl_share_handle_);
+  for (curl_lock_data data : {CURL_LOCK_DATA_CONNECT,
+                              CURL_LOCK_DATA_SSL_SESSION,
+                              CURL_LOCK_DATA_DNS}) {
+    CHECK_EQ(curl_share_setopt(curl_share_handle_, CURLSHOPT_SHARE, data),
+             CURLSHE_OK);
+  }
 }
 
 LibcurlHttpFetcher::~LibcurlHttpFetcher() {
@@ -108,6 +196,9 @@ LibcurlHttpFetcher::~LibcurlHttpFetcher() {
       << "Destroying the fetcher while a transfer is in progress.";
   CancelProxyResolution();
   CleanUp();
+  // Closes the cached connections, through LibcurlCloseSocketCallback().
+  CHECK_EQ(curl_share_cleanup(curl_share_handle_), CURLSHE_OK);
+  curl_share_handle_ = nullptr;
 }
 
 bool LibcurlHttpFetcher::GetProxyType(const string& proxy,
@@ -146,6 +237,25 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
   curl_multi_handle_ = curl_multi_init();
   CHECK(curl_multi_handle_);
 
+  // When there's no |base::SingleThreadTaskRunner| on current thread, it's
+  // not possible to watch file descriptors, so libcurl is polled instead. This
+  // usually happens if |brillo::FakeMessageLoop| is used.
+  use_socket_callbacks_ = base::ThreadTaskRunnerHandle::IsSet();
+  if (use_socket_callbacks_) {
+    CHECK_EQ(curl_multi_setopt(curl_multi_handle_,
+                               CURLMOPT_SOCKETFUNCTION,
+                               LibcurlSocketCallback),
+             CURLM_OK);
+    CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_SOCKETDATA, this),
+             CURLM_OK);
+    CHECK_EQ(curl_multi_setopt(curl_multi_handle_,
+                               CURLMOPT_TIMERFUNCTION,
+                               LibcurlTimerCallback),
+             CURLM_OK);
+    CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_TIMERDATA, this),
+             CURLM_OK);
+  }
+
   curl_handle_ = curl_easy_init();
   CHECK(curl_handle_);
   ignore_failure_ = false;
@@ -157,6 +267,25 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
       curl_handle_, CURLOPT_CLOSESOCKETFUNCTION, LibcurlCloseSocketCallback);
   curl_easy_setopt(curl_handle_, CURLOPT_CLOSESOCKETDATA, this);
 
+  // Reuse the connection of the previous transfer when it is still open.
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_SHARE, curl_share_handle_),
+           CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_TCP_KEEPALIVE, 1L),
+           CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(
+               curl_handle_, CURLOPT_TCP_KEEPIDLE, kTcpKeepAliveSeconds),
+           CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(
+               curl_handle_, CURLOPT_TCP_KEEPINTVL, kTcpKeepAliveSeconds),
+           CURLE_OK);
+  // Negotiate HTTP/2 over TLS, falling back to HTTP/1.1. This fails when
+  // libcurl is built without HTTP/2 support, which is fine.
+  if (curl_easy_setopt(
+          curl_handle_, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS) !=
+      CURLE_OK) {
+    DLOG(INFO) << "HTTP/2 isn't supported, using HTTP/1.1.";
+  }
+
   CHECK(HasProxy());
   bool is_direct = (GetCurrentProxy() == kNoProxy);
   LOG(INFO) << "Using proxy: " << (is_direct ? "no" : "yes");
@@ -209,7 +338,12 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
       curl_easy_setopt(curl_handle_, CURLOPT_HTTPHEADER, curl_http_headers_),
       CURLE_OK);
 
-  if (bytes_downloaded_ > 0 || download_length_) {
+  if (!multiple_ranges_.empty()) {
+    resume_offset_ = 0;
+    CHECK_EQ(curl_easy_setopt(
+                 curl_handle_, CURLOPT_RANGE, multiple_ranges_.c_str()),
+             CURLE_OK);
+  } else if (bytes_downloaded_ > 0 || download_length_) {
     // Resume from where we left off.
     resume_offset_ = bytes_downloaded_;
     CHECK_GE(resume_offset_, 0);
@@ -283,6 +417,9 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
 
   CHECK_EQ(curl_multi_add_handle(curl_multi_handle_, curl_handle_), CURLM_OK);
   transfer_in_progress_ = true;
+  attempt_start_bytes_ = bytes_downloaded_;
+  throughput_.Reset(base::TimeTicks::Now());
+  ScheduleStallCheck();
 }
 
 // Lock down only the protocol in case of HTTP.
@@ -378,6 +515,33 @@ void LibcurlHttpFetcher::TerminateTransfer() {
   }
 }
 
+bool LibcurlHttpFetcher::SetMultipleRanges(
+    const vector<std::pair<off_t, size_t>>& ranges) {
+  vector<string> range_strs;
+  for (const auto& [offset, length] : ranges) {
+    CHECK_GT(length, 0u);
+    range_strs.push_back(base::StringPrintf(
+        "%" PRIu64 "-%" PRIu64,
+        static_cast<uint64_t>(offset),
+        static_cast<uint64_t>(offset + length - 1)));
+  }
+  multiple_ranges_ = base::JoinString(range_strs, ",");
+  if (!multiple_ranges_.empty())
+    bytes_downloaded_ = 0;
+  return true;
+}
+
+string LibcurlHttpFetcher::GetResponseContentType() const {
+  char* content_type = nullptr;
+  if (!curl_handle_ ||
+      curl_easy_getinfo(curl_handle_, CURLINFO_CONTENT_TYPE, &content_type) !=
+          CURLE_OK ||
+      !content_type) {
+    return "";
+  }
+  return content_type;
+}
+
 void LibcurlHttpFetcher::SetHeader(const string& header_name,
                                    const string& header_value) {
   string header_line = header_name + ": " + header_value;
@@ -421,13 +585,25 @@ bool LibcurlHttpFetcher::GetHeader(const string& header_name,
 }
 
 void LibcurlHttpFetcher::CurlPerformOnce() {
+  CurlSocketAction(CURL_SOCKET_TIMEOUT, 0);
+}
+
+void LibcurlHttpFetcher::CurlSocketAction(curl_socket_t fd, int ev_bitmask) {
   CHECK(transfer_in_progress_);
   int running_handles = 0;
   CURLMcode retcode = CURLM_CALL_MULTI_PERFORM;
 
+  if (use_socket_callbacks_) {
+    retcode = curl_multi_socket_action(
+        curl_multi_handle_, fd, ev_bitmask, &running_handles);
+    if (terminate_requested_) {
+      ForceTransferTermination();
+      return;
+    }
+  }
   // libcurl may request that we immediately call curl_multi_perform after it
   // returns, so we do. libcurl promises that curl_multi_perform will not block.
-  while (CURLM_CALL_MULTI_PERFORM == retcode) {
+  while (!use_socket_callbacks_ && CURLM_CALL_MULTI_PERFORM == retcode) {
     retcode = curl_multi_perform(curl_multi_handle_, &running_handles);
     if (terminate_requested_) {
       ForceTransferTermination();
@@ -455,22 +631,17 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
   }
 
   if (running_handles != 0 || transfer_paused_) {
-    // There's either more work to do or we are paused, so we just keep the
-    // file descriptors to watch up to date and exit, until we are done with the
-    // work and we are not paused.
-    //
-    // When there's no |base::SingleThreadTaskRunner| on current thread, it's
-    // not possible to watch file descriptors. Just poll it later. This usually
-    // happens if |brillo::FakeMessageLoop| is used.
-    if (!base::ThreadTaskRunnerHandle::IsSet()) {
+    // There's either more work to do or we are paused, so we exit until we are
+    // done with the work and we are not paused. libcurl already asked for the
+    // file descriptors and the timer it needs through its callbacks, or we
+    // just poll it later.
+    if (!use_socket_callbacks_) {
       MessageLoop::current()->PostDelayedTask(
           FROM_HERE,
           base::Bind(&LibcurlHttpFetcher::CurlPerformOnce,
                      base::Unretained(this)),
-          TimeDelta::FromSeconds(1));
-      return;
+          TimeDelta::FromSeconds(idle_seconds_));
     }
-    SetupMessageLoopSources();
     return;
   }
 
@@ -554,27 +725,22 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
         delegate_->TransferComplete(this, false);  // signal fail
       return;
     }
+  } else if ((transfer_size_ >= 0) && (bytes_downloaded_ < transfer_size_) &&
+             !multiple_ranges_.empty()) {
+    LOG(INFO) << "Multiple ranges transfer interrupted after downloading "
+              << bytes_downloaded_ << " of " << transfer_size_ << " bytes.";
+    if (delegate_)
+      delegate_->TransferComplete(this, false);  // signal fail
+    return;
   } else if ((transfer_size_ >= 0) && (bytes_downloaded_ < transfer_size_)) {
-    if (!ignore_failure_)
-      retry_count_++;
     LOG(INFO) << "Transfer interrupted after downloading " << bytes_downloaded_
               << " of " << transfer_size_ << " bytes. "
-              << transfer_size_ - bytes_downloaded_ << " bytes remaining "
-              << "after " << retry_count_ << " attempt(s)";
-
-    if (retry_count_ > max_retry_count_) {
-      LOG(INFO) << "Reached max attempts (" << retry_count_ << ")";
+              << transfer_size_ - bytes_downloaded_ << " bytes remaining.";
+    if (!ScheduleRetry()) {
       if (delegate_)
         delegate_->TransferComplete(this, false);  // signal fail
       return;
     }
-    // Need to restart transfer
-    LOG(INFO) << "Restarting transfer to download the remaining bytes";
-    retry_task_id_ = MessageLoop::current()->PostDelayedTask(
-        FROM_HERE,
-        base::Bind(&LibcurlHttpFetcher::RetryTimeoutCallback,
-                   base::Unretained(this)),
-        TimeDelta::FromSeconds(retry_seconds_));
   } else {
     LOG(INFO) << "Transfer completed (" << http_response_code_ << "), "
               << bytes_downloaded_ << " bytes downloaded";
@@ -615,6 +781,7 @@ size_t LibcurlHttpFetcher::LibcurlWrite(void* ptr, size_t size, size_t nmemb) {
     }
   }
   bytes_downloaded_ += payload_size;
+  throughput_.AddBytes(payload_size, base::TimeTicks::Now());
   if (delegate_) {
     in_write_callback_ = true;
     auto should_terminate = !delegate_->ReceivedBytes(this, ptr, payload_size);
@@ -643,6 +810,7 @@ void LibcurlHttpFetcher::Pause() {
   }
   CHECK(curl_handle_);
   CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_ALL), CURLE_OK);
+  ScheduleStallCheck();
 }
 
 void LibcurlHttpFetcher::Unpause() {
@@ -664,97 +832,78 @@ void LibcurlHttpFetcher::Unpause() {
   }
   CHECK(curl_handle_);
   CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_CONT), CURLE_OK);
+  // The time paused says nothing about the connection.
+  throughput_.Reset(base::TimeTicks::Now());
+  ScheduleStallCheck();
   // Since the transfer is in progress, we need to dispatch a CurlPerformOnce()
   // now to let the connection continue, otherwise it would be called by the
-  // TimeoutCallback but with a delay.
+  // TimeoutCallback but possibly with a delay.
   CurlPerformOnce();
 }
 
-// This method sets up callbacks with the MessageLoop.
-void LibcurlHttpFetcher::SetupMessageLoopSources() {
-  fd_set fd_read;
-  fd_set fd_write;
-  fd_set fd_exc;
-
-  FD_ZERO(&fd_read);
-  FD_ZERO(&fd_write);
-  FD_ZERO(&fd_exc);
-
-  int fd_max = 0;
-
-  // Ask libcurl for the set of file descriptors we should track on its
-  // behalf.
-  CHECK_EQ(curl_multi_fdset(
-               curl_multi_handle_, &fd_read, &fd_write, &fd_exc, &fd_max),
-           CURLM_OK);
-
-  // We should iterate through all file descriptors up to libcurl's fd_max or
-  // the highest one we're tracking, whichever is larger.
-  for (size_t t = 0; t < base::size(fd_controller_maps_); ++t) {
-    if (!fd_controller_maps_[t].empty())
-      fd_max = max(fd_max, fd_controller_maps_[t].rbegin()->first);
-  }
-
-  // For each fd, if we're not tracking it, track it. If we are tracking it, but
-  // libcurl doesn't care about it anymore, stop tracking it. After this loop,
-  // there should be exactly as many tasks scheduled in
-  // fd_controller_maps_[0|1] as there are read/write fds that we're tracking.
-  for (int fd = 0; fd <= fd_max; ++fd) {
-    // Note that fd_exc is unused in the current version of libcurl so is_exc
-    // should always be false.
-    bool is_exc = FD_ISSET(fd, &fd_exc) != 0;
-    bool must_track[2] = {
-        is_exc || (FD_ISSET(fd, &fd_read) != 0),  // track 0 -- read
-        is_exc || (FD_ISSET(fd, &fd_write) != 0)  // track 1 -- write
-    };
-
-    for (size_t t = 0; t < base::size(fd_controller_maps_); ++t) {
-      bool tracked =
-          fd_controller_maps_[t].find(fd) != fd_controller_maps_[t].end();
-
-      if (!must_track[t]) {
-        // If we have an outstanding io_channel, remove it.
-        fd_controller_maps_[t].erase(fd);
-        continue;
-      }
+bool LibcurlHttpFetcher::ScheduleRetry() {
+  if (bytes_downloaded_ - attempt_start_bytes_ >= kMinRetryProgressBytes)
+    retry_count_ = 0;
+  if (!ignore_failure_)
+    retry_count_++;
+  LOG(INFO) << retry_count_ << " attempt(s) in a row without progress, "
+            << "averaging " << static_cast<int64_t>(throughput_.average())
+            << " bytes/s over the last one.";
+  if (retry_count_ > max_retry_count_) {
+    LOG(INFO) << "Reached max attempts (" << retry_count_ << ")";
+    return false;
+  }
+  // Back off exponentially under sustained failure. The jitter keeps the
+  // devices which lost the same server from all coming back at once.
+  const TimeDelta delay =
+      RetryBackoffDelay(TimeDelta::FromSeconds(retry_seconds_),
+                        TimeDelta::FromSeconds(max_retry_seconds_),
+                        std::max(retry_count_, 1),
+                        base::RandDouble());
+  LOG(INFO) << "Restarting transfer to download the remaining bytes in "
+            << delay.InMilliseconds() << " ms";
+  retry_task_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&LibcurlHttpFetcher::RetryTimeoutCallback,
+                 base::Unretained(this)),
+      delay);
+  return true;
+}
 
-      // If we are already tracking this fd, continue -- nothing to do.
-      if (tracked)
-        continue;
-
-      // Track a new fd.
-      switch (t) {
-        case 0:  // Read
-          fd_controller_maps_[t][fd] =
-              base::FileDescriptorWatcher::WatchReadable(
-                  fd,
-                  base::BindRepeating(&LibcurlHttpFetcher::CurlPerformOnce,
-                                      base::Unretained(this)));
-          break;
-        case 1:  // Write
-          fd_controller_maps_[t][fd] =
-              base::FileDescriptorWatcher::WatchWritable(
-                  fd,
-                  base::BindRepeating(&LibcurlHttpFetcher::CurlPerformOnce,
-                                      base::Unretained(this)));
-      }
-      static int io_counter = 0;
-      io_counter++;
-      if (io_counter % 50 == 0) {
-        LOG(INFO) << "io_counter = " << io_counter;
-      }
-    }
+void LibcurlHttpFetcher::ScheduleStallCheck() {
+  MessageLoop::current()->CancelTask(stall_check_id_);
+  stall_check_id_ = MessageLoop::kTaskIdNull;
+  // A multiple ranges transfer can't be resumed, and local files don't stall.
+  if (!transfer_in_progress_ || transfer_paused_ ||
+      !multiple_ranges_.empty() ||
+      base::StartsWith(
+          url_, "file://", base::CompareCase::INSENSITIVE_ASCII)) {
+    return;
   }
+  stall_check_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&LibcurlHttpFetcher::CheckStall, base::Unretained(this)),
+      TimeDelta::FromSeconds(kStallCheckSeconds));
+}
 
-  // Set up a timeout callback for libcurl.
-  if (timeout_id_ == MessageLoop::kTaskIdNull) {
-    VLOG(1) << "Setting up timeout source: " << idle_seconds_ << " seconds.";
-    timeout_id_ = MessageLoop::current()->PostDelayedTask(
-        FROM_HERE,
-        base::Bind(&LibcurlHttpFetcher::TimeoutCallback,
-                   base::Unretained(this)),
-        TimeDelta::FromSeconds(idle_seconds_));
+void LibcurlHttpFetcher::CheckStall() {
+  stall_check_id_ = MessageLoop::kTaskIdNull;
+  throughput_.Update(base::TimeTicks::Now());
+  if (!throughput_.IsStalled()) {
+    ScheduleStallCheck();
+    return;
   }
+  // The connection did much better a few seconds ago, so a new one, maybe to
+  // another server behind the same name, is likely to do better than waiting
+  // for the low speed limit.
+  LOG(WARNING) << "Transfer stalled at "
+               << static_cast<int64_t>(throughput_.average())
+               << " bytes/s, down from a median of "
+               << static_cast<int64_t>(throughput_.Percentile(50))
+               << " bytes/s. Reconnecting.";
+  CleanUp();
+  if (!ScheduleRetry() && delegate_)
+    delegate_->TransferComplete(this, false);  // signal fail
 }
 
 void LibcurlHttpFetcher::RetryTimeoutCallback() {
@@ -768,16 +917,7 @@ void LibcurlHttpFetcher::RetryTimeoutCallback() {
 }
 
 void LibcurlHttpFetcher::TimeoutCallback() {
-  // We always re-schedule the callback, even if we don't want to be called
-  // anymore. We will remove the event source separately if we don't want to
-  // be called back.
-  timeout_id_ = MessageLoop::current()->PostDelayedTask(
-      FROM_HERE,
-      base::Bind(&LibcurlHttpFetcher::TimeoutCallback, base::Unretained(this)),
-      TimeDelta::FromSeconds(idle_seconds_));
-
-  // CurlPerformOnce() may call CleanUp(), so we need to schedule our callback
-  // first, since it could be canceled by this call.
+  timeout_id_ = MessageLoop::kTaskIdNull;
   if (transfer_in_progress_)
     CurlPerformOnce();
 }
@@ -785,13 +925,8 @@ void LibcurlHttpFetcher::TimeoutCallback() {
 void LibcurlHttpFetcher::CleanUp() {
   MessageLoop::current()->CancelTask(retry_task_id_);
   retry_task_id_ = MessageLoop::kTaskIdNull;
-
-  MessageLoop::current()->CancelTask(timeout_id_);
-  timeout_id_ = MessageLoop::kTaskIdNull;
-
-  for (size_t t = 0; t < base::size(fd_controller_maps_); ++t) {
-    fd_controller_maps_[t].clear();
-  }
+  MessageLoop::current()->CancelTask(stall_check_id_);
+  stall_check_id_ = MessageLoop::kTaskIdNull;
 
   if (curl_http_headers_) {
     curl_slist_free_all(curl_http_headers_);
@@ -809,6 +944,15 @@ void LibcurlHttpFetcher::CleanUp() {
     CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
     curl_multi_handle_ = nullptr;
   }
+
+  // Removing the handles above may still call LibcurlSocketCallback() and
+  // LibcurlTimerCallback().
+  MessageLoop::current()->CancelTask(timeout_id_);
+  timeout_id_ = MessageLoop::kTaskIdNull;
+
+  for (size_t t = 0; t < base::size(fd_controller_maps_); ++t) {
+    fd_controller_maps_[t].clear();
+  }
   transfer_in_progress_ = false;
   transfer_paused_ = false;
   restart_transfer_on_unpause_ = false;
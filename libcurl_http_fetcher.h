@@ -32,6 +32,7 @@
 #include "update_engine/certificate_checker.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/http_fetcher.h"
+#include "update_engine/common/throughput_tracker.h"
 
 // This is a concrete implementation of HttpFetcher that uses libcurl to do the
 // http work.
@@ -93,6 +94,13 @@ class LibcurlHttpFetcher : public HttpFetcher {
   void SetLength(size_t length) override { download_length_ = length; }
   void UnsetLength() override { SetLength(0); }
 
+  // Sends all the ranges in the Range header. The transfer isn't resumed once
+  // it delivered bytes, since the offset of the rest isn't known.
+  bool SetMultipleRanges(
+      const std::vector<std::pair<off_t, size_t>>& ranges) override;
+
+  std::string GetResponseContentType() const override;
+
   // Begins the transfer if it hasn't already begun.
   void BeginTransfer(const std::string& url) override;
 
@@ -113,20 +121,18 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // Resume the transfer by calling curl_easy_pause(CURLPAUSE_CONT).
   void Unpause() override;
 
-  // Libcurl sometimes asks to be called back after some time while
-  // leaving that time unspecified. In that case, we pick a reasonable
-  // default of one second, but it can be overridden here. This is
-  // primarily useful for testing.
-  // From http://curl.haxx.se/libcurl/c/curl_multi_timeout.html:
-  //     if libcurl returns a -1 timeout here, it just means that libcurl
-  //     currently has no stored timeout value. You must not wait too long
-  //     (more than a few seconds perhaps) before you call
-  //     curl_multi_perform() again.
+  // When the file descriptors can't be watched, i.e. there is no
+  // base::SingleThreadTaskRunner on the current thread, libcurl is polled
+  // every |seconds| instead. This is primarily useful for testing.
   void set_idle_seconds(int seconds) override { idle_seconds_ = seconds; }
 
   // Sets the retry timeout. Useful for testing.
   void set_retry_seconds(int seconds) override { retry_seconds_ = seconds; }
 
+  // Sets the longest retry timeout, which the retry timeout doubles up to
+  // while the retries make no progress. Useful for testing.
+  void set_max_retry_seconds(int seconds) { max_retry_seconds_ = seconds; }
+
   void set_no_network_max_retries(int retries) {
     no_network_max_retries_ = retries;
   }
@@ -165,6 +171,21 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // closing a socket created with the CURLOPT_OPENSOCKETFUNCTION callback.
   static int LibcurlCloseSocketCallback(void* clientp, curl_socket_t item);
 
+  // libcurl's CURLMOPT_SOCKETFUNCTION callback function. Called when libcurl
+  // wants to know about other events on |fd|, |what| being one of the
+  // CURL_POLL_* values. Updates the watchers of |fd| accordingly.
+  static int LibcurlSocketCallback(CURL* easy,
+                                   curl_socket_t fd,
+                                   int what,
+                                   void* clientp,
+                                   void* socketp);
+
+  // libcurl's CURLMOPT_TIMERFUNCTION callback function. Schedules
+  // TimeoutCallback() in |timeout_ms|, or cancels it when |timeout_ms| is -1.
+  static int LibcurlTimerCallback(CURLM* multi,
+                                  long timeout_ms,  // NOLINT(runtime/int)
+                                  void* clientp);
+
   // Callback for when proxy resolution has completed. This begins the
   // transfer.
   void ProxiesResolved();
@@ -194,18 +215,28 @@ class LibcurlHttpFetcher : public HttpFetcher {
   void TimeoutCallback();
   void RetryTimeoutCallback();
 
-  // Calls into curl_multi_perform to let libcurl do its work. Returns after
-  // curl_multi_perform is finished, which may actually be after more than
-  // one call to curl_multi_perform. This method will set up the message
-  // loop with sources for future work that libcurl will do, if any, or complete
-  // the transfer and finish the action if no work left to do.
-  // This method will not block.
+  // Schedules the next CheckStall() while the transfer is in progress, or
+  // cancels it.
+  void ScheduleStallCheck();
+  // Reconnects if the transfer stalled, as measured by |throughput_|.
+  void CheckStall();
+
+  // Schedules the retry of an interrupted transfer, counting it in
+  // |retry_count_| unless the last attempt made progress. Returns false if
+  // there were too many retries in a row.
+  bool ScheduleRetry();
+
+  // Lets libcurl do the work that is due or was just made possible, like after
+  // starting or unpausing the transfer. Same as CurlSocketAction() for a
+  // timeout.
   void CurlPerformOnce();
 
-  // Sets up message loop sources as needed by libcurl. This is generally
-  // the file descriptor of the socket and a timer in case nothing happens
-  // on the fds.
-  void SetupMessageLoopSources();
+  // Lets libcurl handle the events |ev_bitmask| (CURL_CSELECT_*) on |fd|, or
+  // its timeouts when |fd| is CURL_SOCKET_TIMEOUT. When the file descriptors
+  // can't be watched, calls curl_multi_perform instead and polls again later.
+  // Completes the transfer and finishes the action if no work is left to do.
+  // This method will not block.
+  void CurlSocketAction(curl_socket_t fd, int ev_bitmask);
 
   // Callback called by libcurl when new data has arrived on the transfer
   size_t LibcurlWrite(void* ptr, size_t size, size_t nmemb);
@@ -219,6 +250,7 @@ class LibcurlHttpFetcher : public HttpFetcher {
 
   // Cleans up the following if they are non-null:
   // curl(m) handles, fd_controller_maps_(fd_task_maps_), timeout_id_.
+  // |curl_share_handle_| is kept for the next transfer.
   void CleanUp();
 
   // Force terminate the transfer. This will invoke the delegate's (if any)
@@ -246,22 +278,32 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // Handles for the libcurl library
   CURLM* curl_multi_handle_{nullptr};
   CURL* curl_handle_{nullptr};
+  // Holds the connections, TLS sessions and DNS entries of this fetcher
+  // between transfers, so that retries and the following ranges reuse them
+  // instead of connecting again. Unlike the handles above, it lives as long as
+  // the fetcher.
+  CURLSH* curl_share_handle_{nullptr};
   struct curl_slist* curl_http_headers_{nullptr};
 
   // The extra headers that will be sent on each request.
   std::map<std::string, std::string> extra_headers_;
 
   // Lists of all read(0)/write(1) file descriptors that we're waiting on from
-  // the message loop. libcurl may open/close descriptors and switch their
-  // directions so maintain two separate lists so that watch conditions can be
-  // set appropriately.
+  // the message loop, as requested by LibcurlSocketCallback(). libcurl may
+  // open/close descriptors and switch their directions so maintain two
+  // separate lists so that watch conditions can be set appropriately.
   std::map<int, std::unique_ptr<base::FileDescriptorWatcher::Controller>>
       fd_controller_maps_[2];
 
-  // The TaskId of the timer we're waiting on. kTaskIdNull if we are not waiting
-  // on it.
+  // The TaskId of the timer libcurl asked for. kTaskIdNull if we are not
+  // waiting on it.
   brillo::MessageLoop::TaskId timeout_id_{brillo::MessageLoop::kTaskIdNull};
 
+  // Whether libcurl tells us which file descriptors to watch, through
+  // LibcurlSocketCallback(), or is polled with curl_multi_perform because
+  // the message loop can't watch file descriptors.
+  bool use_socket_callbacks_{false};
+
   bool transfer_in_progress_{false};
   bool transfer_paused_{false};
 
@@ -284,18 +326,32 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // unspecified length.
   size_t download_length_{0};
 
+  // The value of the Range header when downloading multiple ranges, e.g.
+  // "0-9,20-29", or empty.
+  std::string multiple_ranges_;
+
   // If we resumed an earlier transfer, data offset that we used for the
   // new connection.  0 otherwise.
   // In this class, resume refers to resuming a dropped HTTP connection,
   // not to resuming an interrupted download.
   off_t resume_offset_{0};
 
-  // Number of resumes performed so far and the max allowed.
+  // Number of resumes in a row without progress and the max allowed.
   int retry_count_{0};
   int max_retry_count_{kDownloadMaxRetryCount};
 
-  // Seconds to wait before retrying a resume.
+  // Seconds to wait before the first retry of a resume, doubled for each
+  // following one up to |max_retry_seconds_|, with some jitter.
   int retry_seconds_{20};
+  int max_retry_seconds_{kDownloadMaxRetrySeconds};
+
+  // The bytes downloaded when the current connection started.
+  off_t attempt_start_bytes_{0};
+
+  // The throughput of the current connection, and the task checking whether
+  // it stalled.
+  ThroughputTracker throughput_;
+  brillo::MessageLoop::TaskId stall_check_id_{brillo::MessageLoop::kTaskIdNull};
 
   // When waiting for a retry, the task id of the retry callback.
   brillo::MessageLoop::TaskId retry_task_id_{brillo::MessageLoop::kTaskIdNull};
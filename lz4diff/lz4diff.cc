@@ -26,15 +26,138 @@
 #include <lz4.h>
 #include <lz4hc.h>
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
 #include "update_engine/common/utils.h"
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/payload_generator/decoded_data_cache.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "lz4diff/lz4diff.pb.h"
 #include "lz4diff_format.h"
 
 namespace chromeos_update_engine {
 
+// Decompressing, recompressing and checking the blocks of a file is split into
+// tasks of consecutive blocks covering at least that many uncompressed bytes.
+constexpr size_t kLz4TaskSize = 2 * 1024 * 1024;
+
+Blob TryDecompressBlobConcurrently(
+    std::string_view blob,
+    const std::vector<CompressedBlock>& block_info,
+    const bool zero_padding_enabled) {
+  const auto ranges = SplitCompressedBlocks(block_info, kLz4TaskSize);
+  if (ranges.size() <= 1) {
+    return TryDecompressBlob(blob, block_info, zero_padding_enabled);
+  }
+  const auto compressed_offsets = GetCompressedOffsets(block_info);
+  if (blob.size() < compressed_offsets.back()) {
+    LOG(INFO) << "File is chunked. Skip lz4 decompress. Expected size: "
+              << compressed_offsets.back() << ", actual size: " << blob.size();
+    return {};
+  }
+  const auto& last_block = block_info.back();
+  const uint64_t uncompressed_size =
+      last_block.uncompressed_offset + last_block.uncompressed_length;
+
+  // Each task decompresses its blocks on its own, and copies them in place.
+  Blob output(uncompressed_size + blob.size() - compressed_offsets.back());
+  // Not std::vector<bool>, the tasks set their element concurrently.
+  std::vector<uint8_t> succeeded(ranges.size());
+  TaskGroup group;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    group.Post([&, i]() {
+      const auto& range = ranges[i];
+      const uint64_t begin = compressed_offsets[range.first];
+      const uint64_t end = compressed_offsets[range.second];
+      const Blob decompressed =
+          TryDecompressBlob(blob.substr(begin, end - begin),
+                            RebaseCompressedBlocks(block_info, range),
+                            zero_padding_enabled);
+      if (decompressed.empty()) {
+        return;
+      }
+      std::copy(decompressed.begin(),
+                decompressed.end(),
+                output.begin() + block_info[range.first].uncompressed_offset);
+      succeeded[i] = true;
+    });
+  }
+  group.Wait();
+  for (size_t i = 0; i < ranges.size(); i++) {
+    if (!succeeded[i]) {
+      LOG(ERROR) << "Failed to decompress blocks " << ranges[i].first << " to "
+                 << ranges[i].second;
+      return {};
+    }
+  }
+
+  // Trailing data not recorded by compressed block info is uncompressed.
+  std::copy(blob.begin() + compressed_offsets.back(),
+            blob.end(),
+            output.begin() + uncompressed_size);
+  return output;
+}
+
+Blob TryCompressBlobConcurrently(
+    std::string_view blob,
+    const std::vector<CompressedBlock>& block_info,
+    const bool zero_padding_enabled,
+    const CompressionAlgorithm compression_algo) {
+  const auto ranges = SplitCompressedBlocks(block_info, kLz4TaskSize);
+  if (ranges.size() <= 1) {
+    return TryCompressBlob(
+        blob, block_info, zero_padding_enabled, compression_algo);
+  }
+  const auto& last_block = block_info.back();
+  TEST_EQ(last_block.uncompressed_offset + last_block.uncompressed_length,
+          blob.size());
+  const auto compressed_offsets = GetCompressedOffsets(block_info);
+
+  Blob output(compressed_offsets.back());
+  std::vector<uint8_t> succeeded(ranges.size());
+  TaskGroup group;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    group.Post([&, i]() {
+      const auto& range = ranges[i];
+      // The compressor may look at the data past the last block of the range,
+      // so it is given all of it for the output to be the same as compressing
+      // the whole file at once. Only the bytes of the range are kept.
+      uint8_t* out = output.data() + compressed_offsets[range.first];
+      const uint8_t* const out_end =
+          output.data() + compressed_offsets[range.second];
+      succeeded[i] = TryCompressBlob(
+          blob.substr(block_info[range.first].uncompressed_offset),
+          RebaseCompressedBlocks(block_info, range),
+          zero_padding_enabled,
+          compression_algo,
+          [&out, out_end](const uint8_t* data, size_t size) {
+            const size_t count =
+                std::min<size_t>(size, std::max(out_end - out, ptrdiff_t{0}));
+            std::copy(data, data + count, out);
+            out += count;
+            return size;
+          });
+      succeeded[i] = succeeded[i] && out == out_end;
+    });
+  }
+  group.Wait();
+  for (size_t i = 0; i < ranges.size(); i++) {
+    if (!succeeded[i]) {
+      LOG(ERROR) << "Failed to compress blocks " << ranges[i].first << " to "
+                 << ranges[i].second;
+      return {};
+    }
+  }
+  return output;
+}
+
 bool StoreDstCompressedFileInfo(std::string_view recompressed_blob,
                                 std::string_view target_blob,
                                 const CompressedFile& dst_file_info,
@@ -43,48 +166,73 @@ bool StoreDstCompressedFileInfo(std::string_view recompressed_blob,
   output->mutable_dst_info()->set_zero_padding_enabled(
       dst_file_info.zero_padding_enabled);
   const auto& block_info = dst_file_info.blocks;
+  const auto compressed_offsets = GetCompressedOffsets(block_info);
+  if (!block_info.empty()) {
+    CHECK_LT(compressed_offsets[block_info.size() - 1],
+             recompressed_blob.size());
+  }
+
+  // Hash and diff the blocks concurrently, then fill the header in order.
+  std::vector<std::string> postfix_patches(block_info.size());
+  std::vector<Blob> hashes(block_info.size());
+  std::atomic<bool> failed{false};
+  TaskGroup group;
+  for (const auto& range : SplitCompressedBlocks(block_info, kLz4TaskSize)) {
+    group.Post([&, range]() {
+      for (size_t i = range.first; i < range.second; i++) {
+        const auto& block = block_info[i];
+        const auto offset = compressed_offsets[i];
+        auto s1 = recompressed_blob.substr(offset, block.compressed_length);
+        auto s2 = target_blob.substr(offset, block.compressed_length);
+        if (s1 != s2) {
+          ScopedTempFile patch;
+          int err = bsdiff::bsdiff(
+              reinterpret_cast<const unsigned char*>(s1.data()),
+              s1.size(),
+              reinterpret_cast<const unsigned char*>(s2.data()),
+              s2.size(),
+              patch.path().c_str(),
+              nullptr);
+          CHECK_EQ(err, 0);
+          LOG(WARNING) << "Recompress Postfix patch size: "
+                       << utils::FileSize(patch.path());
+          if (!utils::ReadFile(patch.path(), &postfix_patches[i])) {
+            LOG(ERROR) << "Failed to read the postfix patch of block " << i;
+            failed = true;
+            return;
+          }
+        }
+        // Include recompressed blob hash, so we can determine if the device
+        // produces same compressed output
+        if (!HashCalculator::RawHashOfBytes(
+                s1.data(), s1.length(), &hashes[i])) {
+          LOG(ERROR) << "Failed to hash block " << i;
+          failed = true;
+          return;
+        }
+      }
+    });
+  }
+  group.Wait();
+  TEST_AND_RETURN_FALSE(!failed);
+
   auto& dst_block_info = *output->mutable_dst_info()->mutable_block_info();
   dst_block_info.Clear();
-  size_t offset = 0;
-  for (const auto& block : block_info) {
+  for (size_t i = 0; i < block_info.size(); i++) {
+    const auto& block = block_info[i];
     auto& pb_block = *dst_block_info.Add();
     pb_block.set_uncompressed_offset(block.uncompressed_offset);
     pb_block.set_uncompressed_length(block.uncompressed_length);
     pb_block.set_compressed_length(block.compressed_length);
-    CHECK_LT(offset, recompressed_blob.size());
-    auto s1 = recompressed_blob.substr(offset, block.compressed_length);
-    auto s2 = target_blob.substr(offset, block.compressed_length);
-    if (s1 != s2) {
-      ScopedTempFile patch;
-      int err =
-          bsdiff::bsdiff(reinterpret_cast<const unsigned char*>(s1.data()),
-                         s1.size(),
-                         reinterpret_cast<const unsigned char*>(s2.data()),
-                         s2.size(),
-                         patch.path().c_str(),
-                         nullptr);
-      CHECK_EQ(err, 0);
-      LOG(WARNING) << "Recompress Postfix patch size: "
-                   << utils::FileSize(patch.path());
-      std::string patch_content;
-      TEST_AND_RETURN_FALSE(utils::ReadFile(patch.path(), &patch_content));
-      pb_block.set_postfix_bspatch(std::move(patch_content));
+    if (!postfix_patches[i].empty()) {
+      pb_block.set_postfix_bspatch(std::move(postfix_patches[i]));
     }
-    // Include recompressed blob hash, so we can determine if the device
-    // produces same compressed output
-    Blob recompressed_blob_hash;
-    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
-        s1.data(), s1.length(), &recompressed_blob_hash));
-    pb_block.set_sha256_hash(recompressed_blob_hash.data(),
-                             recompressed_blob_hash.size());
-
-    offset += block.compressed_length;
+    pb_block.set_sha256_hash(hashes[i].data(), hashes[i].size());
   }
   return true;
 }
 
-template <typename Blob>
-static bool TryBsdiff(Blob src, Blob dst, Blob* output) noexcept {
+static bool TryBsdiff(const Blob& src, const Blob& dst, Blob* output) noexcept {
   static constexpr auto kLz4diffDefaultBrotliQuality = 9;
   CHECK_NE(output, nullptr);
   ScopedTempFile patch;
@@ -106,7 +254,7 @@ static bool TryBsdiff(Blob src, Blob dst, Blob* output) noexcept {
   return true;
 }
 
-bool TryFindDeflates(puffin::Buffer data,
+bool TryFindDeflates(const puffin::Buffer& data,
                      std::vector<puffin::BitExtent>* deflates) {
   if (puffin::LocateDeflatesInZipArchive(data, deflates)) {
     return true;
@@ -138,8 +286,8 @@ static bool ConstructLz4diffPatch(Blob inner_patch,
   return true;
 }
 
-static bool TryPuffdiff(puffin::Buffer src,
-                        puffin::Buffer dst,
+static bool TryPuffdiff(const puffin::Buffer& src,
+                        const puffin::Buffer& dst,
                         Blob* output) noexcept {
   CHECK_NE(output, nullptr);
   std::vector<puffin::BitExtent> src_deflates;
@@ -177,56 +325,99 @@ static void StoreSrcCompressedFileInfo(const CompressedFile& src_file_info,
   return;
 }
 
+// Returns the result of |decode|, through the DecodedDataCache unless |key| is
+// empty.
+static DecodedDataCache::Data CachedDecode(
+    const std::string& key, const std::function<Blob()>& decode) {
+  if (key.empty()) {
+    return std::make_shared<const Blob>(decode());
+  }
+  return DecodedDataCache::Get()->GetOrDecode(key, decode);
+}
+
 bool Lz4Diff(std::string_view src,
              std::string_view dst,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type) noexcept {
+             InstallOperation::Type* op_type,
+             const Lz4DiffCacheKeys* cache_keys) noexcept {
   const auto& src_block_info = src_file_info.blocks;
   const auto& dst_block_info = dst_file_info.blocks;
+  const Lz4DiffCacheKeys keys = cache_keys ? *cache_keys : Lz4DiffCacheKeys{};
 
-  auto decompressed_src = TryDecompressBlob(
-      src, src_block_info, src_file_info.zero_padding_enabled);
-  auto decompressed_dst = TryDecompressBlob(
-      dst, dst_block_info, dst_file_info.zero_padding_enabled);
-  if (decompressed_src.empty() || decompressed_dst.empty()) {
+  DecodedDataCache::Data decompressed_src;
+  DecodedDataCache::Data decompressed_dst;
+  {
+    TaskGroup group;
+    group.Post([&]() {
+      decompressed_src = CachedDecode(keys.src_decompressed, [&]() {
+        return TryDecompressBlobConcurrently(
+            src, src_block_info, src_file_info.zero_padding_enabled);
+      });
+    });
+    decompressed_dst = CachedDecode(keys.dst_decompressed, [&]() {
+      return TryDecompressBlobConcurrently(
+          dst, dst_block_info, dst_file_info.zero_padding_enabled);
+    });
+    group.Wait();
+  }
+  if (decompressed_src->empty() || decompressed_dst->empty()) {
     LOG(ERROR) << "Failed to decompress input data";
     return false;
   }
 
+  // The inner diffs and the recompression of |decompressed_dst| only read the
+  // decompressed data, so they all run at the same time. bsdiff is the
+  // slowest and runs on this thread.
+  Blob patch_data;
+  Blob puffdiff_delta;
+  bool puffdiff_succeeded = false;
+  DecodedDataCache::Data recompressed_blob;
+  bool bsdiff_succeeded = false;
+  {
+    TaskGroup group;
+    // PUFFDIFF might fail, as the input data might not be deflate compressed.
+    group.Post([&]() {
+      puffdiff_succeeded =
+          TryPuffdiff(*decompressed_src, *decompressed_dst, &puffdiff_delta);
+    });
+    group.Post([&]() {
+      recompressed_blob = CachedDecode(keys.dst_recompressed, [&]() {
+        return TryCompressBlobConcurrently(ToStringView(*decompressed_dst),
+                                           dst_block_info,
+                                           dst_file_info.zero_padding_enabled,
+                                           dst_file_info.algo);
+      });
+    });
+    bsdiff_succeeded =
+        TryBsdiff(*decompressed_src, *decompressed_dst, &patch_data);
+    group.Wait();
+  }
+  // Free up memory used by |decompressed_src| , as we don't need it anymore,
+  // unless the cache keeps it.
+  decompressed_src.reset();
+
   Lz4diffHeader header;
   // BSDIFF isn't supposed to fail, so return error if BSDIFF failed.
-  Blob patch_data;
-  TEST_AND_RETURN_FALSE(
-      TryBsdiff(decompressed_src, decompressed_dst, &patch_data));
+  TEST_AND_RETURN_FALSE(bsdiff_succeeded);
   header.set_inner_type(InnerPatchType::BSDIFF);
   if (op_type) {
     *op_type = InstallOperation::LZ4DIFF_BSDIFF;
   }
-  // PUFFDIFF might fail, as the input data might not be deflate compressed.
-
-  Blob puffdiff_delta;
-  if (TryPuffdiff(decompressed_src, decompressed_dst, &puffdiff_delta) &&
-      puffdiff_delta.size() < patch_data.size()) {
+  if (puffdiff_succeeded && puffdiff_delta.size() < patch_data.size()) {
     patch_data = std::move(puffdiff_delta);
     header.set_inner_type(InnerPatchType::PUFFDIFF);
     if (op_type) {
       *op_type = InstallOperation::LZ4DIFF_PUFFDIFF;
     }
   }
-  // Free up memory used by |decompressed_src| , as we don't need it anymore.
-  decompressed_src = {};
 
-  auto recompressed_blob = TryCompressBlob(ToStringView(decompressed_dst),
-                                           dst_block_info,
-                                           dst_file_info.zero_padding_enabled,
-                                           dst_file_info.algo);
-  TEST_AND_RETURN_FALSE(recompressed_blob.size() > 0);
+  TEST_AND_RETURN_FALSE(recompressed_blob->size() > 0);
 
   StoreSrcCompressedFileInfo(src_file_info, &header);
-  StoreDstCompressedFileInfo(
-      ToStringView(recompressed_blob), dst, dst_file_info, &header);
+  TEST_AND_RETURN_FALSE(StoreDstCompressedFileInfo(
+      ToStringView(*recompressed_blob), dst, dst_file_info, &header));
   return ConstructLz4diffPatch(std::move(patch_data), header, output);
 }
 
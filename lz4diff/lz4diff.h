@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_LZ4DIFF_LZ4DIFF_H_
 #define UPDATE_ENGINE_LZ4DIFF_LZ4DIFF_H_
 
+#include <string>
 #include <vector>
 #include <string_view>
 
@@ -26,12 +27,22 @@
 
 namespace chromeos_update_engine {
 
+// The DecodedDataCache keys of the decoded forms of the data given to
+// Lz4Diff(), to reuse them across the diffs of the same files. The forms
+// without a key aren't cached.
+struct Lz4DiffCacheKeys {
+  std::string src_decompressed;
+  std::string dst_decompressed;
+  std::string dst_recompressed;
+};
+
 bool Lz4Diff(std::string_view src,
              std::string_view dst,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type = nullptr) noexcept;
+             InstallOperation::Type* op_type = nullptr,
+             const Lz4DiffCacheKeys* cache_keys = nullptr) noexcept;
 
 bool Lz4Diff(const Blob& src,
              const Blob& dst,
@@ -40,6 +51,18 @@ bool Lz4Diff(const Blob& src,
              Blob* output,
              InstallOperation::Type* op_type = nullptr) noexcept;
 
+// Same as TryDecompressBlob() and TryCompressBlob(), with the blocks split
+// into tasks of the TaskScheduler. The output is identical.
+Blob TryDecompressBlobConcurrently(
+    std::string_view blob,
+    const std::vector<CompressedBlock>& block_info,
+    const bool zero_padding_enabled);
+Blob TryCompressBlobConcurrently(
+    std::string_view blob,
+    const std::vector<CompressedBlock>& block_info,
+    const bool zero_padding_enabled,
+    const CompressionAlgorithm compression_algo);
+
 }  // namespace chromeos_update_engine
 
 #endif
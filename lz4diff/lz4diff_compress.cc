@@ -233,6 +233,46 @@ Blob TryDecompressBlob(const Blob& blob,
       ToStringView(blob), block_info, zero_padding_enabled);
 }
 
+std::vector<CompressedBlockRange> SplitCompressedBlocks(
+    const std::vector<CompressedBlock>& blocks, size_t min_uncompressed_size) {
+  std::vector<CompressedBlockRange> ranges;
+  size_t first = 0;
+  size_t bytes = 0;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    bytes += blocks[i].uncompressed_length;
+    if (bytes >= min_uncompressed_size || i + 1 == blocks.size()) {
+      ranges.emplace_back(first, i + 1);
+      first = i + 1;
+      bytes = 0;
+    }
+  }
+  return ranges;
+}
+
+std::vector<CompressedBlock> RebaseCompressedBlocks(
+    const std::vector<CompressedBlock>& blocks,
+    const CompressedBlockRange& range) {
+  std::vector<CompressedBlock> rebased(blocks.begin() + range.first,
+                                       blocks.begin() + range.second);
+  if (rebased.empty()) {
+    return rebased;
+  }
+  const uint64_t base = rebased.front().uncompressed_offset;
+  for (auto& block : rebased) {
+    block.uncompressed_offset -= base;
+  }
+  return rebased;
+}
+
+std::vector<uint64_t> GetCompressedOffsets(
+    const std::vector<CompressedBlock>& blocks) {
+  std::vector<uint64_t> offsets(blocks.size() + 1);
+  for (size_t i = 0; i < blocks.size(); i++) {
+    offsets[i + 1] = offsets[i] + blocks[i].compressed_length;
+  }
+  return offsets;
+}
+
 std::ostream& operator<<(std::ostream& out, const CompressedBlock& block) {
   out << "CompressedBlock{.uncompressed_offset = " << block.uncompressed_offset
       << ", .compressed_length = " << block.compressed_length
@@ -19,6 +19,7 @@
 
 #include "lz4diff_format.h"
 #include <string_view>
+#include <utility>
 
 namespace chromeos_update_engine {
 
@@ -50,6 +51,25 @@ Blob TryDecompressBlob(const Blob& blob,
                        const std::vector<CompressedBlock>& block_info,
                        const bool zero_padding_enabled);
 
+// [first, last) indices into a vector of CompressedBlocks.
+using CompressedBlockRange = std::pair<size_t, size_t>;
+
+// Splits |blocks| into ranges of consecutive blocks, each covering at least
+// |min_uncompressed_size| bytes except the last one. The ranges can be
+// compressed or decompressed independently of each other.
+std::vector<CompressedBlockRange> SplitCompressedBlocks(
+    const std::vector<CompressedBlock>& blocks, size_t min_uncompressed_size);
+
+// The blocks in |range|, with their uncompressed offsets relative to the first
+// one, to pass a part of a file to |TryCompressBlob| or |TryDecompressBlob|.
+std::vector<CompressedBlock> RebaseCompressedBlocks(
+    const std::vector<CompressedBlock>& blocks,
+    const CompressedBlockRange& range);
+
+// The offsets of |blocks| in the compressed file, followed by its size.
+std::vector<uint64_t> GetCompressedOffsets(
+    const std::vector<CompressedBlock>& blocks);
+
 std::ostream& operator<<(std::ostream& out, const CompressedBlockInfo& info);
 
 std::ostream& operator<<(std::ostream& out, const CompressedBlock& block);
@@ -112,6 +112,25 @@ TEST_F(Lz4diffCompressTest, ExtractElfBinary) {
   ASSERT_EQ(decompressed_blob, expected_blob);
 }
 
+TEST_F(Lz4diffCompressTest, SplitCompressedBlocks) {
+  const vector<CompressedBlock> blocks{{0, 4096, 16384},
+                                       {16384, 8192, 8192},
+                                       {24576, 4096, 32768},
+                                       {57344, 4096, 4096}};
+  const auto ranges = SplitCompressedBlocks(blocks, 24576);
+  ASSERT_EQ((vector<CompressedBlockRange>{{0, 2}, {2, 3}, {3, 4}}), ranges);
+
+  const auto rebased = RebaseCompressedBlocks(blocks, ranges[0]);
+  ASSERT_EQ(2UL, rebased.size());
+  ASSERT_EQ(0UL, rebased[0].uncompressed_offset);
+  ASSERT_EQ(16384UL, rebased[1].uncompressed_offset);
+  ASSERT_EQ(0UL,
+            RebaseCompressedBlocks(blocks, ranges[1])[0].uncompressed_offset);
+
+  ASSERT_EQ((vector<uint64_t>{0, 4096, 12288, 16384, 20480}),
+            GetCompressedOffsets(blocks));
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
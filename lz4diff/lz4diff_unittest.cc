@@ -105,6 +105,40 @@ TEST_F(Lz4diffTest, DiffElfBinary) {
   ASSERT_EQ(patched_new_data, new_data);
 }
 
+TEST_F(Lz4diffTest, ConcurrentCompressionMatchesSequential) {
+  const auto img = GetBuildArtifactsPath("gen/erofs.img");
+  auto fs = ErofsFilesystem::CreateFromFile(img);
+  ASSERT_NE(fs, nullptr);
+  vector<ErofsFilesystem::File> files;
+  ASSERT_TRUE(fs->GetFiles(&files));
+  const auto it =
+      std::find_if(files.begin(), files.end(), [](const auto& file) {
+        return file.name == "/delta_generator";
+      });
+  ASSERT_NE(it, files.end());
+  const auto& info = it->compressed_file_info;
+  Blob data;
+  ASSERT_TRUE(utils::ReadExtents(img, it->extents, &data, kBlockSize));
+
+  const Blob decompressed =
+      TryDecompressBlob(data, info.blocks, info.zero_padding_enabled);
+  ASSERT_FALSE(decompressed.empty());
+  ASSERT_EQ(decompressed,
+            TryDecompressBlobConcurrently(
+                ToStringView(data), info.blocks, info.zero_padding_enabled));
+
+  const Blob recompressed = TryCompressBlob(ToStringView(decompressed),
+                                            info.blocks,
+                                            info.zero_padding_enabled,
+                                            info.algo);
+  ASSERT_FALSE(recompressed.empty());
+  ASSERT_EQ(recompressed,
+            TryCompressBlobConcurrently(ToStringView(decompressed),
+                                        info.blocks,
+                                        info.zero_padding_enabled,
+                                        info.algo));
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
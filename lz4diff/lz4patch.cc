@@ -22,6 +22,7 @@
 
 #include <algorithm>
 #include <string_view>
+#include <thread>
 
 #include <bsdiff/bspatch.h>
 #include <bsdiff/memory_file.h>
@@ -35,12 +36,19 @@
 #include "lz4diff_format.h"
 #include "puffin/puffpatch.h"
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/memory_budget.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 
 namespace chromeos_update_engine {
 
 namespace {
 
+// The dst blocks are recompressed in tasks of consecutive blocks covering at
+// least that many uncompressed bytes, on at most that many threads.
+constexpr size_t kLz4PatchTaskSize = 1024 * 1024;
+constexpr size_t kMaxLz4PatchThreads = 4;
+
 template <typename T>
 constexpr void BigEndianToHost(T& t) {
   static_assert(std::is_integral_v<T>);
@@ -237,6 +245,120 @@ bool ApplyInnerPatch(Blob decompressed_src,
   return true;
 }
 
+// Checks a recompressed dst block against its hash and applies its postfix
+// patch, if it has one, passing the result to |sink|.
+size_t SinkRecompressedBlock(const CompressedBlockInfo& block_info,
+                             const uint8_t* data,
+                             size_t size,
+                             const SinkFunc& sink) {
+  TEST_EQ(size, block_info.compressed_length());
+  if (block_info.postfix_bspatch().empty()) {
+    return sink(data, size);
+  }
+  if (!block_info.sha256_hash().empty()) {
+    Blob actual_hash;
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfBytes(data, size, &actual_hash));
+    if (ToStringView(actual_hash) != block_info.sha256_hash()) {
+      LOG(ERROR) << "Block " << block_info
+                 << " is corrupted. This usually means the patch generator "
+                    "used a different version of LZ4, or an incompatible LZ4 "
+                    "patch generator was used, or LZ4 produces different "
+                    "output on different platforms. Expected hash: "
+                 << HexEncode(block_info.sha256_hash())
+                 << ", actual hash: " << HexEncode(actual_hash);
+      return 0;
+    }
+  }
+  Blob fixed_block;
+  TEST_AND_RETURN_FALSE(
+      bspatch(std::string_view(reinterpret_cast<const char*>(data), size),
+              block_info.postfix_bspatch(),
+              &fixed_block));
+  return sink(fixed_block.data(), fixed_block.size());
+}
+
+// Recompresses the dst blocks in |ranges| on worker threads, |window_size|
+// ranges at a time, and passes them to |sink| in order. The next window is
+// recompressed while the previous one is written.
+bool RecompressConcurrently(std::string_view decompressed_dst,
+                            const Lz4diffPatch& patch,
+                            const std::vector<CompressedBlock>& dst_blocks,
+                            const std::vector<CompressedBlockRange>& ranges,
+                            size_t num_threads,
+                            size_t window_size,
+                            const SinkFunc& sink) {
+  const auto& dst_info = patch.pb_header.dst_info();
+  const auto& last_block = dst_blocks.back();
+  const uint64_t uncompressed_size =
+      last_block.uncompressed_offset + last_block.uncompressed_length;
+  TEST_AND_RETURN_FALSE(uncompressed_size <= decompressed_dst.size());
+  std::vector<Blob> windows[2];
+  for (auto& window : windows) {
+    window.resize(window_size);
+  }
+  // Destroyed first, after waiting for the ranges in |windows|.
+  WorkerPool pool(num_threads, window_size);
+
+  auto write_window = [&sink](const std::vector<Blob>& window,
+                              size_t num_ranges) -> bool {
+    for (size_t i = 0; i < num_ranges; i++) {
+      TEST_EQ(sink(window[i].data(), window[i].size()), window[i].size());
+    }
+    return true;
+  };
+
+  size_t current = 0;
+  size_t pending_ranges = 0;
+  for (size_t first_range = 0; first_range < ranges.size();
+       first_range += window_size) {
+    std::vector<Blob>& window = windows[current];
+    const size_t num_ranges =
+        std::min(window_size, ranges.size() - first_range);
+    for (size_t i = 0; i < num_ranges; i++) {
+      const CompressedBlockRange& range = ranges[first_range + i];
+      Blob* output = &window[i];
+      TEST_AND_RETURN_FALSE(pool.Post([&, range, output]() {
+        output->clear();
+        const SinkFunc append = [output](const uint8_t* data, size_t size) {
+          output->insert(output->end(), data, data + size);
+          return size;
+        };
+        size_t block_idx = range.first;
+        // The whole rest of the file is passed, as the compressor may look
+        // past the last block of the range. Only the blocks of the range are
+        // kept.
+        return TryCompressBlob(
+            decompressed_dst.substr(
+                dst_blocks[range.first].uncompressed_offset),
+            RebaseCompressedBlocks(dst_blocks, range),
+            dst_info.zero_padding_enabled(),
+            dst_info.algo(),
+            [&](const uint8_t* data, size_t size) -> size_t {
+              if (block_idx >= range.second) {
+                return size;
+              }
+              return SinkRecompressedBlock(
+                  dst_info.block_info(block_idx++), data, size, append);
+            });
+      }));
+    }
+    // The previous window is done, write it while this one is recompressed.
+    TEST_AND_RETURN_FALSE(write_window(windows[current ^ 1], pending_ranges));
+    TEST_AND_RETURN_FALSE(pool.Wait());
+    pending_ranges = num_ranges;
+    current ^= 1;
+  }
+  TEST_AND_RETURN_FALSE(write_window(windows[current ^ 1], pending_ranges));
+
+  // Any trailing data is copied to the output, as TryCompressBlob() does.
+  const auto trailing_data = decompressed_dst.substr(uncompressed_size);
+  TEST_EQ(sink(reinterpret_cast<const uint8_t*>(trailing_data.data()),
+               trailing_data.size()),
+          trailing_data.size());
+  return true;
+}
+
 // TODO(zhangkelvin) Rewrite this in C++ 20 coroutine once that's available.
 // Hand coding CPS is not fun.
 bool Lz4Patch(std::string_view src_data,
@@ -252,15 +374,49 @@ bool Lz4Patch(std::string_view src_data,
       GetDecompressedSize(patch.pb_header.dst_info().block_info());
   decompressed_dst.reserve(decompressed_dst_size);
 
-  ApplyInnerPatch(std::move(decompressed_src), patch, &decompressed_dst);
+  TEST_AND_RETURN_FALSE(
+      ApplyInnerPatch(std::move(decompressed_src), patch, &decompressed_dst));
+
+  const auto dst_blocks =
+      ToCompressedBlockVec(patch.pb_header.dst_info().block_info());
+  const auto ranges = SplitCompressedBlocks(dst_blocks, kLz4PatchTaskSize);
+  if (ranges.size() > 1) {
+    // Each window holds the recompressed data of its ranges.
+    const auto compressed_offsets = GetCompressedOffsets(dst_blocks);
+    uint64_t range_size = 0;
+    for (const auto& range : ranges) {
+      range_size = std::max(range_size,
+                            compressed_offsets[range.second] -
+                                compressed_offsets[range.first]);
+    }
+    const size_t num_threads = std::min<size_t>(
+        {ranges.size(),
+         kMaxLz4PatchThreads,
+         std::max(std::thread::hardware_concurrency(), 1u)});
+    auto reservation =
+        MemoryBudget::Get()->Reserve(2 * range_size,
+                                     2 * 2 * range_size * num_threads,
+                                     2 * range_size,
+                                     "lz4diff");
+    const size_t window_size =
+        std::min<size_t>(ranges.size(), reservation.size() / (2 * range_size));
+    if (num_threads > 1 && window_size > 1) {
+      return RecompressConcurrently(ToStringView(decompressed_dst),
+                                    patch,
+                                    dst_blocks,
+                                    ranges,
+                                    std::min(num_threads, window_size),
+                                    window_size,
+                                    sink);
+    }
+  }
 
   if (!HasPosfixPatches(patch)) {
-    return TryCompressBlob(
-        ToStringView(decompressed_dst),
-        ToCompressedBlockVec(patch.pb_header.dst_info().block_info()),
-        patch.pb_header.dst_info().zero_padding_enabled(),
-        patch.pb_header.dst_info().algo(),
-        sink);
+    return TryCompressBlob(ToStringView(decompressed_dst),
+                           dst_blocks,
+                           patch.pb_header.dst_info().zero_padding_enabled(),
+                           patch.pb_header.dst_info().algo(),
+                           sink);
   }
   auto postfix_patcher =
       [&sink,
@@ -270,41 +426,15 @@ bool Lz4Patch(std::string_view src_data,
     if (block_idx >= dst_block_info.size()) {
       return sink(data, size);
     }
-    const auto& block_info = dst_block_info[block_idx];
-    TEST_EQ(size, block_info.compressed_length());
     DEFER { block_idx++; };
-    if (block_info.postfix_bspatch().empty()) {
-      return sink(data, size);
-    }
-    if (!block_info.sha256_hash().empty()) {
-      Blob actual_hash;
-      TEST_AND_RETURN_FALSE(
-          HashCalculator::RawHashOfBytes(data, size, &actual_hash));
-      if (ToStringView(actual_hash) != block_info.sha256_hash()) {
-        LOG(ERROR) << "Block " << block_info
-                   << " is corrupted. This usually means the patch generator "
-                      "used a different version of LZ4, or an incompatible LZ4 "
-                      "patch generator was used, or LZ4 produces different "
-                      "output on different platforms. Expected hash: "
-                   << HexEncode(block_info.sha256_hash())
-                   << ", actual hash: " << HexEncode(actual_hash);
-        return 0;
-      }
-    }
-    Blob fixed_block;
-    TEST_AND_RETURN_FALSE(
-        bspatch(std::string_view(reinterpret_cast<const char*>(data), size),
-                block_info.postfix_bspatch(),
-                &fixed_block));
-    return sink(fixed_block.data(), fixed_block.size());
+    return SinkRecompressedBlock(dst_block_info[block_idx], data, size, sink);
   };
 
-  return TryCompressBlob(
-      ToStringView(decompressed_dst),
-      ToCompressedBlockVec(patch.pb_header.dst_info().block_info()),
-      patch.pb_header.dst_info().zero_padding_enabled(),
-      patch.pb_header.dst_info().algo(),
-      postfix_patcher);
+  return TryCompressBlob(ToStringView(decompressed_dst),
+                         dst_blocks,
+                         patch.pb_header.dst_info().zero_padding_enabled(),
+                         patch.pb_header.dst_info().algo(),
+                         postfix_patcher);
 }
 
 bool Lz4Patch(std::string_view src_data,
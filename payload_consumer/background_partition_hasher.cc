@@ -0,0 +1,113 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/background_partition_hasher.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include <base/logging.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/filesystem_verifier_action.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kHashBufferSize = 1024 * 1024;
+}  // namespace
+
+BackgroundPartitionHasher::~BackgroundPartitionHasher() {
+  stopping_ = true;
+  pool_.reset();
+}
+
+bool BackgroundPartitionHasher::CanHash(
+    const InstallPlan::Partition& partition, bool write_verity) {
+  const bool has_verity =
+      partition.hash_tree_size > 0 || partition.fec_size > 0;
+  return !partition.target_path.empty() && partition.target_size > 0 &&
+         (!write_verity || !has_verity || partition.verity_written);
+}
+
+void BackgroundPartitionHasher::Hash(const InstallPlan::Partition& partition) {
+  if (!pool_) {
+    // One partition at a time, so that the hashes don't compete with the
+    // apply of the next partitions for more than one thread.
+    pool_ = std::make_unique<WorkerPool>(1, std::numeric_limits<size_t>::max());
+  }
+  auto job = std::make_unique<Job>();
+  job->partition = partition;
+  Job* job_ptr = job.get();
+  jobs_.push_back(std::move(job));
+  LOG(INFO) << "Hashing partition " << partition.name
+            << " in the background.";
+  CHECK(pool_->Post([this, job_ptr]() { return HashJob(job_ptr); }));
+}
+
+bool BackgroundPartitionHasher::HashJob(Job* job) {
+  const InstallPlan::Partition& partition = job->partition;
+  EintrSafeFileDescriptor fd;
+  if (!fd.Open(partition.target_path.c_str(), O_RDONLY)) {
+    PLOG(WARNING) << "Unable to open " << partition.target_path
+                  << ", leaving its hash to FilesystemVerifierAction.";
+    return true;
+  }
+  brillo::Blob buffer(kHashBufferSize);
+  while (!stopping_) {
+    // The unused extents of the partition aren't part of its target hash.
+    const uint64_t used_end =
+        partition.UsedRangeEnd(&job->offset, partition.target_size);
+    if (job->offset >= partition.target_size)
+      break;
+    const size_t count =
+        std::min<uint64_t>(buffer.size(), used_end - job->offset);
+    ssize_t bytes_read = 0;
+    if (!utils::PReadAll(&fd, buffer.data(), count, job->offset, &bytes_read) ||
+        static_cast<size_t>(bytes_read) != count) {
+      PLOG(WARNING) << "Unable to read " << partition.target_path
+                    << " at offset " << job->offset
+                    << ", leaving the rest of its hash to "
+                       "FilesystemVerifierAction.";
+      break;
+    }
+    TEST_AND_RETURN_FALSE(job->hasher.Update(buffer.data(), count));
+    job->offset += count;
+  }
+  return true;
+}
+
+void BackgroundPartitionHasher::Stop(PrefsInterface* prefs) {
+  stopping_ = true;
+  pool_.reset();
+  for (const auto& job : jobs_) {
+    if (job->offset == 0 || prefs == nullptr)
+      continue;
+    LOG(INFO) << "Hashed " << job->offset << " of "
+              << job->partition.target_size << " bytes of partition "
+              << job->partition.name << " in the background.";
+    FilesystemVerifierAction::SaveCheckpoint(
+        prefs, job->partition, job->offset, job->hasher.GetContext());
+  }
+  jobs_.clear();
+}
+
+}  // namespace chromeos_update_engine
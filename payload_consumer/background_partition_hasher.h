@@ -0,0 +1,74 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_BACKGROUND_PARTITION_HASHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_BACKGROUND_PARTITION_HASHER_H_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/prefs_interface.h"
+#include "update_engine/common/worker_pool.h"
+#include "update_engine/payload_consumer/install_plan.h"
+
+namespace chromeos_update_engine {
+
+// Hashes the target partitions that DeltaPerformer finished writing on a
+// background thread, while the next partitions are applied. The hashes are
+// handed over to FilesystemVerifierAction as verification checkpoints, so it
+// only hashes what is left of them and compares the results as usual.
+class BackgroundPartitionHasher {
+ public:
+  BackgroundPartitionHasher() = default;
+  // Stops hashing without saving anything.
+  ~BackgroundPartitionHasher();
+
+  // Whether |partition| can be hashed before FilesystemVerifierAction runs:
+  // it must be readable at its |target_path|, and have its verity data
+  // written already, if FilesystemVerifierAction would otherwise write it.
+  static bool CanHash(const InstallPlan::Partition& partition,
+                      bool write_verity);
+
+  // Queues the hash of |partition| after the partitions queued before.
+  void Hash(const InstallPlan::Partition& partition);
+
+  // Stops hashing and saves in |prefs| how far each partition got.
+  void Stop(PrefsInterface* prefs);
+
+ private:
+  struct Job {
+    InstallPlan::Partition partition;
+    uint64_t offset{0};
+    HashCalculator hasher;
+  };
+
+  // Hashes |job| until it's done or |stopping_| is set.
+  bool HashJob(Job* job);
+
+  std::vector<std::unique_ptr<Job>> jobs_;
+  std::atomic<bool> stopping_{false};
+  std::unique_ptr<WorkerPool> pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(BackgroundPartitionHasher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_BACKGROUND_PARTITION_HASHER_H_
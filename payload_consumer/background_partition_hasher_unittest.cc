@@ -0,0 +1,98 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/background_partition_hasher.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/fake_prefs.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kPartitionSize = 4 * 1024 * 1024;
+
+string CheckpointKey(const char* key) {
+  return PrefsInterface::CreateSubKey({kPrefsVerifyCheckpoint, "system", key});
+}
+}  // namespace
+
+class BackgroundPartitionHasherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    data_.resize(kPartitionSize);
+    test_utils::FillWithData(&data_);
+    ASSERT_TRUE(utils::WriteFile(
+        target_part_.path().c_str(), data_.data(), data_.size()));
+    ASSERT_TRUE(HashCalculator::RawHashOfData(data_, &partition_.target_hash));
+    partition_.name = "system";
+    partition_.target_path = target_part_.path();
+    partition_.target_size = data_.size();
+  }
+
+  brillo::Blob data_;
+  ScopedTempFile target_part_{"target.XXXXXX"};
+  InstallPlan::Partition partition_;
+  FakePrefs prefs_;
+};
+
+TEST_F(BackgroundPartitionHasherTest, CanHashTest) {
+  EXPECT_TRUE(BackgroundPartitionHasher::CanHash(partition_, true));
+  partition_.hash_tree_size = 4096;
+  EXPECT_FALSE(BackgroundPartitionHasher::CanHash(partition_, true));
+  EXPECT_TRUE(BackgroundPartitionHasher::CanHash(partition_, false));
+  partition_.verity_written = true;
+  EXPECT_TRUE(BackgroundPartitionHasher::CanHash(partition_, true));
+  partition_.target_path.clear();
+  EXPECT_FALSE(BackgroundPartitionHasher::CanHash(partition_, true));
+}
+
+TEST_F(BackgroundPartitionHasherTest, SavesResumableCheckpointTest) {
+  BackgroundPartitionHasher hasher;
+  hasher.Hash(partition_);
+  hasher.Stop(&prefs_);
+
+  // Stopping may interrupt the hash anywhere, the checkpoint must resume
+  // from there.
+  int64_t offset = 0;
+  if (!prefs_.GetInt64(CheckpointKey("offset"), &offset))
+    return;
+  ASSERT_GT(offset, 0);
+  ASSERT_LE(static_cast<uint64_t>(offset), data_.size());
+  string context;
+  ASSERT_TRUE(prefs_.GetString(CheckpointKey("sha-256-context"), &context));
+  HashCalculator resumed;
+  ASSERT_TRUE(resumed.SetContext(context));
+  ASSERT_TRUE(resumed.Update(data_.data() + offset, data_.size() - offset));
+  ASSERT_TRUE(resumed.Finalize());
+  EXPECT_EQ(partition_.target_hash, resumed.raw_hash());
+}
+
+TEST_F(BackgroundPartitionHasherTest, NoCheckpointWithoutPrefsTest) {
+  BackgroundPartitionHasher hasher;
+  hasher.Hash(partition_);
+  hasher.Stop(nullptr);
+  EXPECT_FALSE(prefs_.Exists(CheckpointKey("offset")));
+}
+
+}  // namespace chromeos_update_engine
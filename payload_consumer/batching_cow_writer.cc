@@ -0,0 +1,161 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/batching_cow_writer.h"
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+using android::snapshot::ICowWriter;
+
+namespace chromeos_update_engine {
+
+BatchingCowWriter::BatchingCowWriter(ICowWriter* cow_writer)
+    : ICowWriter(cow_writer->options()),
+      cow_writer_(cow_writer),
+      block_size_(cow_writer->options().block_size) {}
+
+bool BatchingCowWriter::Flush() {
+  const BatchType type = type_;
+  type_ = BatchType::kNone;
+  bool success = true;
+  switch (type) {
+    case BatchType::kNone:
+      return true;
+    case BatchType::kRaw:
+      success =
+          cow_writer_->AddRawBlocks(new_block_, data_.data(), data_.size());
+      break;
+    case BatchType::kXor:
+      success = cow_writer_->AddXorBlocks(
+          new_block_, data_.data(), data_.size(), old_block_, offset_);
+      break;
+    case BatchType::kZero:
+      success = cow_writer_->AddZeroBlocks(new_block_, num_blocks_);
+      break;
+  }
+  data_.clear();
+  num_blocks_ = 0;
+  return success;
+}
+
+bool BatchingCowWriter::Extends(BatchType type,
+                                uint64_t new_block,
+                                uint64_t old_block,
+                                uint16_t offset,
+                                size_t num_blocks) const {
+  if (type != type_ || new_block != new_block_ + num_blocks_) {
+    return false;
+  }
+  if (type == BatchType::kXor &&
+      (old_block != old_block_ + num_blocks_ || offset != offset_)) {
+    return false;
+  }
+  return type == BatchType::kZero ||
+         data_.size() + num_blocks * block_size_ <= kMaxCowBatchSize;
+}
+
+void BatchingCowWriter::StartBatch(BatchType type,
+                                   uint64_t new_block,
+                                   uint64_t old_block,
+                                   uint16_t offset) {
+  type_ = type;
+  new_block_ = new_block;
+  old_block_ = old_block;
+  offset_ = offset;
+  num_blocks_ = 0;
+  data_.clear();
+}
+
+bool BatchingCowWriter::EmitCopy(uint64_t new_block, uint64_t old_block) {
+  TEST_AND_RETURN_FALSE(Flush());
+  return cow_writer_->AddCopy(new_block, old_block);
+}
+
+bool BatchingCowWriter::EmitRawBlocks(uint64_t new_block_start,
+                                      const void* data,
+                                      size_t size) {
+  const size_t num_blocks = size / block_size_;
+  if (!Extends(BatchType::kRaw, new_block_start, 0, 0, num_blocks)) {
+    TEST_AND_RETURN_FALSE(Flush());
+    // Nothing to gain from copying what is already a full batch.
+    if (size >= kMaxCowBatchSize) {
+      return cow_writer_->AddRawBlocks(new_block_start, data, size);
+    }
+    StartBatch(BatchType::kRaw, new_block_start, 0, 0);
+  }
+  const auto bytes = static_cast<const uint8_t*>(data);
+  data_.insert(data_.end(), bytes, bytes + size);
+  num_blocks_ += num_blocks;
+  return true;
+}
+
+bool BatchingCowWriter::EmitXorBlocks(uint32_t new_block_start,
+                                      const void* data,
+                                      size_t size,
+                                      uint32_t old_block,
+                                      uint16_t offset) {
+  const size_t num_blocks = size / block_size_;
+  if (!Extends(
+          BatchType::kXor, new_block_start, old_block, offset, num_blocks)) {
+    TEST_AND_RETURN_FALSE(Flush());
+    if (size >= kMaxCowBatchSize) {
+      return cow_writer_->AddXorBlocks(
+          new_block_start, data, size, old_block, offset);
+    }
+    StartBatch(BatchType::kXor, new_block_start, old_block, offset);
+  }
+  const auto bytes = static_cast<const uint8_t*>(data);
+  data_.insert(data_.end(), bytes, bytes + size);
+  num_blocks_ += num_blocks;
+  return true;
+}
+
+bool BatchingCowWriter::EmitZeroBlocks(uint64_t new_block_start,
+                                       uint64_t num_blocks) {
+  if (!Extends(BatchType::kZero, new_block_start, 0, 0, num_blocks)) {
+    TEST_AND_RETURN_FALSE(Flush());
+    StartBatch(BatchType::kZero, new_block_start, 0, 0);
+  }
+  num_blocks_ += num_blocks;
+  return true;
+}
+
+bool BatchingCowWriter::EmitLabel(uint64_t label) {
+  TEST_AND_RETURN_FALSE(Flush());
+  return cow_writer_->AddLabel(label);
+}
+
+bool BatchingCowWriter::EmitSequenceData(size_t num_ops,
+                                         const uint32_t* data) {
+  TEST_AND_RETURN_FALSE(Flush());
+  return cow_writer_->AddSequenceData(num_ops, data);
+}
+
+bool BatchingCowWriter::Finalize() {
+  TEST_AND_RETURN_FALSE(Flush());
+  return cow_writer_->Finalize();
+}
+
+uint64_t BatchingCowWriter::GetCowSize() {
+  if (!Flush()) {
+    LOG(ERROR) << "Failed to flush pending COW operations.";
+  }
+  return cow_writer_->GetCowSize();
+}
+
+}  // namespace chromeos_update_engine
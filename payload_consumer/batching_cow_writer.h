@@ -0,0 +1,99 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_BATCHING_COW_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_BATCHING_COW_WRITER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include <base/macros.h>
+#include <libsnapshot/cow_writer.h>
+
+namespace chromeos_update_engine {
+
+// The most data a BatchingCowWriter keeps before passing it on.
+constexpr size_t kMaxCowBatchSize = 2 * 1024 * 1024;
+
+// An ICowWriter that sits in front of another one and coalesces consecutive
+// raw, XOR and zero operations on contiguous blocks into a single call, so the
+// underlying writer sees few large operations instead of one per extent. The
+// operations reach the underlying writer in the order they were added. A batch
+// is passed on when a different kind of operation, or a non contiguous one,
+// comes in, when it reaches kMaxCowBatchSize, and always before a label, the
+// sequence data and Finalize(), so everything before a label is on disk when
+// the label is. A failure of the underlying writer is returned by the call that
+// passed the batch on.
+class BatchingCowWriter : public android::snapshot::ICowWriter {
+ public:
+  // |cow_writer| must outlive this object.
+  explicit BatchingCowWriter(android::snapshot::ICowWriter* cow_writer);
+  ~BatchingCowWriter() override = default;
+
+  // Passes on the pending batch, if any.
+  bool Flush();
+
+  // Flushes and finalizes the underlying writer.
+  bool Finalize() override;
+  uint64_t GetCowSize() override;
+
+ protected:
+  bool EmitCopy(uint64_t new_block, uint64_t old_block) override;
+  bool EmitRawBlocks(uint64_t new_block_start,
+                     const void* data,
+                     size_t size) override;
+  bool EmitXorBlocks(uint32_t new_block_start,
+                     const void* data,
+                     size_t size,
+                     uint32_t old_block,
+                     uint16_t offset) override;
+  bool EmitZeroBlocks(uint64_t new_block_start, uint64_t num_blocks) override;
+  bool EmitLabel(uint64_t label) override;
+  bool EmitSequenceData(size_t num_ops, const uint32_t* data) override;
+
+ private:
+  enum class BatchType { kNone, kRaw, kXor, kZero };
+
+  // Whether a |type| operation of |num_blocks| starting at |new_block| (and
+  // |old_block|, for XOR) continues the pending batch.
+  bool Extends(BatchType type,
+               uint64_t new_block,
+               uint64_t old_block,
+               uint16_t offset,
+               size_t num_blocks) const;
+
+  // Starts a new pending batch, for the data of raw and XOR operations.
+  void StartBatch(BatchType type,
+                  uint64_t new_block,
+                  uint64_t old_block,
+                  uint16_t offset);
+
+  android::snapshot::ICowWriter* cow_writer_;
+  const size_t block_size_;
+
+  BatchType type_{BatchType::kNone};
+  uint64_t new_block_{0};
+  uint64_t old_block_{0};
+  uint16_t offset_{0};
+  uint64_t num_blocks_{0};
+  std::vector<uint8_t> data_;
+
+  DISALLOW_COPY_AND_ASSIGN(BatchingCowWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_BATCHING_COW_WRITER_H_
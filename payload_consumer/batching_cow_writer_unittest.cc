@@ -0,0 +1,192 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/batching_cow_writer.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <libsnapshot/cow_writer.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+
+// Records the calls that reach it.
+class RecordingCowWriter : public android::snapshot::ICowWriter {
+ public:
+  struct Call {
+    enum Type { kCopy, kRaw, kXor, kZero, kLabel, kSequence } type;
+    uint64_t new_block;
+    // Source block of copy and XOR operations.
+    uint64_t old_block;
+    uint64_t num_blocks;
+    std::vector<uint8_t> data;
+  };
+  using ICowWriter::ICowWriter;
+
+  bool Finalize() override {
+    finalized_ = true;
+    return true;
+  }
+  uint64_t GetCowSize() override { return 0; }
+
+  std::vector<Call> calls_;
+  bool finalized_{false};
+
+ protected:
+  bool EmitCopy(uint64_t new_block, uint64_t old_block) override {
+    calls_.push_back({Call::kCopy, new_block, old_block, 1, {}});
+    return true;
+  }
+  bool EmitRawBlocks(uint64_t new_block_start,
+                     const void* data,
+                     size_t size) override {
+    const auto bytes = static_cast<const uint8_t*>(data);
+    calls_.push_back({Call::kRaw,
+                      new_block_start,
+                      0,
+                      size / kBlockSize,
+                      {bytes, bytes + size}});
+    return true;
+  }
+  bool EmitXorBlocks(uint32_t new_block_start,
+                     const void* data,
+                     size_t size,
+                     uint32_t old_block,
+                     uint16_t offset) override {
+    calls_.push_back(
+        {Call::kXor, new_block_start, old_block, size / kBlockSize, {}});
+    return true;
+  }
+  bool EmitZeroBlocks(uint64_t new_block_start, uint64_t num_blocks) override {
+    calls_.push_back({Call::kZero, new_block_start, 0, num_blocks, {}});
+    return true;
+  }
+  bool EmitLabel(uint64_t label) override {
+    calls_.push_back({Call::kLabel, label, 0, 0, {}});
+    return true;
+  }
+  bool EmitSequenceData(size_t num_ops, const uint32_t* data) override {
+    calls_.push_back({Call::kSequence, 0, 0, num_ops, {}});
+    return true;
+  }
+};
+
+using Call = RecordingCowWriter::Call;
+
+}  // namespace
+
+class BatchingCowWriterTest : public ::testing::Test {
+ protected:
+  std::vector<uint8_t> Blocks(size_t num_blocks, uint8_t value) {
+    return std::vector<uint8_t>(num_blocks * kBlockSize, value);
+  }
+
+  RecordingCowWriter cow_writer_{
+      android::snapshot::CowOptions{.block_size = kBlockSize}};
+  BatchingCowWriter writer_{&cow_writer_};
+};
+
+TEST_F(BatchingCowWriterTest, CoalescesContiguousRawBlocksTest) {
+  const auto first = Blocks(1, 1);
+  const auto second = Blocks(2, 2);
+  ASSERT_TRUE(writer_.AddRawBlocks(10, first.data(), first.size()));
+  ASSERT_TRUE(writer_.AddRawBlocks(11, second.data(), second.size()));
+  ASSERT_TRUE(cow_writer_.calls_.empty());
+  // Not contiguous, the first batch is passed on.
+  ASSERT_TRUE(writer_.AddRawBlocks(20, first.data(), first.size()));
+  ASSERT_EQ(cow_writer_.calls_.size(), 1UL);
+
+  ASSERT_TRUE(writer_.Flush());
+  ASSERT_EQ(cow_writer_.calls_.size(), 2UL);
+  EXPECT_EQ(cow_writer_.calls_[0].type, Call::kRaw);
+  EXPECT_EQ(cow_writer_.calls_[0].new_block, 10UL);
+  EXPECT_EQ(cow_writer_.calls_[0].num_blocks, 3UL);
+  auto expected = first;
+  expected.insert(expected.end(), second.begin(), second.end());
+  EXPECT_EQ(cow_writer_.calls_[0].data, expected);
+  EXPECT_EQ(cow_writer_.calls_[1].new_block, 20UL);
+  EXPECT_EQ(cow_writer_.calls_[1].num_blocks, 1UL);
+}
+
+TEST_F(BatchingCowWriterTest, CoalescesXorBlocksWithContiguousSourceTest) {
+  const auto data = Blocks(2, 3);
+  ASSERT_TRUE(writer_.AddXorBlocks(10, data.data(), data.size(), 100, 5));
+  ASSERT_TRUE(writer_.AddXorBlocks(12, data.data(), data.size(), 102, 5));
+  // Not contiguous in the source.
+  ASSERT_TRUE(writer_.AddXorBlocks(14, data.data(), data.size(), 200, 5));
+  // A different offset.
+  ASSERT_TRUE(writer_.AddXorBlocks(16, data.data(), data.size(), 202, 6));
+  ASSERT_TRUE(writer_.Flush());
+
+  ASSERT_EQ(cow_writer_.calls_.size(), 3UL);
+  EXPECT_EQ(cow_writer_.calls_[0].new_block, 10UL);
+  EXPECT_EQ(cow_writer_.calls_[0].old_block, 100UL);
+  EXPECT_EQ(cow_writer_.calls_[0].num_blocks, 4UL);
+  EXPECT_EQ(cow_writer_.calls_[1].new_block, 14UL);
+  EXPECT_EQ(cow_writer_.calls_[2].new_block, 16UL);
+}
+
+TEST_F(BatchingCowWriterTest, KeepsOrderOfOperationsTest) {
+  const auto data = Blocks(1, 4);
+  ASSERT_TRUE(writer_.AddZeroBlocks(0, 2));
+  ASSERT_TRUE(writer_.AddZeroBlocks(2, 3));
+  ASSERT_TRUE(writer_.AddRawBlocks(5, data.data(), data.size()));
+  ASSERT_TRUE(writer_.AddCopy(6, 1));
+  ASSERT_TRUE(writer_.AddRawBlocks(7, data.data(), data.size()));
+  ASSERT_TRUE(writer_.AddLabel(1));
+
+  ASSERT_EQ(cow_writer_.calls_.size(), 5UL);
+  EXPECT_EQ(cow_writer_.calls_[0].type, Call::kZero);
+  EXPECT_EQ(cow_writer_.calls_[0].num_blocks, 5UL);
+  EXPECT_EQ(cow_writer_.calls_[1].type, Call::kRaw);
+  EXPECT_EQ(cow_writer_.calls_[1].new_block, 5UL);
+  EXPECT_EQ(cow_writer_.calls_[2].type, Call::kCopy);
+  EXPECT_EQ(cow_writer_.calls_[3].type, Call::kRaw);
+  EXPECT_EQ(cow_writer_.calls_[3].new_block, 7UL);
+  // Everything before the label is passed on before it.
+  EXPECT_EQ(cow_writer_.calls_[4].type, Call::kLabel);
+}
+
+TEST_F(BatchingCowWriterTest, LimitsBatchSizeTest) {
+  const size_t batch_blocks = kMaxCowBatchSize / kBlockSize;
+  const auto data = Blocks(batch_blocks / 2 + 1, 5);
+  ASSERT_TRUE(writer_.AddRawBlocks(0, data.data(), data.size()));
+  ASSERT_TRUE(
+      writer_.AddRawBlocks(batch_blocks / 2 + 1, data.data(), data.size()));
+  // The second write would make the batch too large, the first one is passed
+  // on.
+  ASSERT_EQ(cow_writer_.calls_.size(), 1UL);
+
+  // A full batch is passed on directly.
+  const auto large = Blocks(batch_blocks, 6);
+  ASSERT_TRUE(writer_.AddRawBlocks(1000, large.data(), large.size()));
+  ASSERT_EQ(cow_writer_.calls_.size(), 3UL);
+  EXPECT_EQ(cow_writer_.calls_[2].new_block, 1000UL);
+  EXPECT_EQ(cow_writer_.calls_[2].num_blocks, batch_blocks);
+}
+
+TEST_F(BatchingCowWriterTest, FinalizeFlushesTest) {
+  ASSERT_TRUE(writer_.AddZeroBlocks(0, 1));
+  ASSERT_TRUE(writer_.Finalize());
+  ASSERT_EQ(cow_writer_.calls_.size(), 1UL);
+  ASSERT_TRUE(cow_writer_.finalized_);
+}
+
+}  // namespace chromeos_update_engine
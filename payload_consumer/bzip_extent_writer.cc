@@ -21,7 +21,9 @@ using google::protobuf::RepeatedPtrField;
 namespace chromeos_update_engine {
 
 namespace {
-const brillo::Blob::size_type kOutputBufferLength = 16 * 1024;
+// The size of the decompressed chunks passed to the underlying writer, the
+// same as ZstdExtentWriter's.
+const brillo::Blob::size_type kOutputBufferLength = 128 * 1024;
 }
 
 BzipExtentWriter::~BzipExtentWriter() {
@@ -38,12 +40,11 @@ bool BzipExtentWriter::Init(const RepeatedPtrField<Extent>& extents,
 
   TEST_AND_RETURN_FALSE(rc == BZ_OK);
 
+  output_buffer_.resize(kOutputBufferLength);
   return next_->Init(extents, block_size);
 }
 
 bool BzipExtentWriter::Write(const void* bytes, size_t count) {
-  brillo::Blob output_buffer(kOutputBufferLength);
-
   // Copy the input data into |input_buffer_| only if |input_buffer_| already
   // contains unconsumed data. Otherwise, process the data directly from the
   // source.
@@ -58,17 +59,17 @@ bool BzipExtentWriter::Write(const void* bytes, size_t count) {
   stream_.avail_in = input_end - input;
 
   for (;;) {
-    stream_.next_out = reinterpret_cast<char*>(output_buffer.data());
-    stream_.avail_out = output_buffer.size();
+    stream_.next_out = reinterpret_cast<char*>(output_buffer_.data());
+    stream_.avail_out = output_buffer_.size();
 
     int rc = BZ2_bzDecompress(&stream_);
     TEST_AND_RETURN_FALSE(rc == BZ_OK || rc == BZ_STREAM_END);
 
-    if (stream_.avail_out == output_buffer.size())
+    if (stream_.avail_out == output_buffer_.size())
       break;  // got no new bytes
 
     TEST_AND_RETURN_FALSE(next_->Write(
-        output_buffer.data(), output_buffer.size() - stream_.avail_out));
+        output_buffer_.data(), output_buffer_.size() - stream_.avail_out));
 
     if (rc == BZ_STREAM_END)
       CHECK_EQ(stream_.avail_in, 0u);
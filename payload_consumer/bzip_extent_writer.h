@@ -32,7 +32,7 @@
 
 namespace chromeos_update_engine {
 
-class BzipExtentWriter : public ExtentWriter {
+class BzipExtentWriter final : public ExtentWriter {
  public:
   explicit BzipExtentWriter(std::unique_ptr<ExtentWriter> next)
       : next_(std::move(next)) {
@@ -48,6 +48,7 @@ class BzipExtentWriter : public ExtentWriter {
   std::unique_ptr<ExtentWriter> next_;  // The underlying ExtentWriter.
   bz_stream stream_;                    // the libbz2 stream
   brillo::Blob input_buffer_;
+  brillo::Blob output_buffer_;
 };
 
 }  // namespace chromeos_update_engine
@@ -20,18 +20,29 @@
 #include <errno.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
 #include <brillo/secure_blob.h>
 
+#include "update_engine/common/memory_budget.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 
 namespace chromeos_update_engine {
 
+// The smallest cache a CachedFileDescriptorBase shrinks to when the memory
+// budget is short.
+constexpr size_t kMinWriteCacheSize = 64 * 1024;
+
 class CachedFileDescriptorBase : public FileDescriptor {
  public:
-  CachedFileDescriptorBase(size_t cache_size) : cache_(cache_size) {}
+  // The cache takes up to |cache_size| bytes, less if they aren't available in
+  // MemoryBudget::Get().
+  CachedFileDescriptorBase(size_t cache_size)
+      : cache_reservation_(MemoryBudget::Get()->Reserve(
+            std::min(cache_size, kMinWriteCacheSize), cache_size)),
+        cache_(cache_reservation_.size()) {}
   ~CachedFileDescriptorBase() override = default;
 
   bool Open(const char* path, int flags, mode_t mode) override {
@@ -40,9 +51,8 @@ class CachedFileDescriptorBase : public FileDescriptor {
   bool Open(const char* path, int flags) override {
     return GetFd()->Open(path, flags);
   }
-  ssize_t Read(void* buf, size_t count) override {
-    return GetFd()->Read(buf, count);
-  }
+  // Reads see the data written before them: the cache is flushed first.
+  ssize_t Read(void* buf, size_t count) override;
   ssize_t Write(const void* buf, size_t count) override;
   off64_t Seek(off64_t offset, int whence) override;
   uint64_t BlockDevSize() override { return GetFd()->BlockDevSize(); }
@@ -64,6 +74,8 @@ class CachedFileDescriptorBase : public FileDescriptor {
   // Internal flush without the need to call |fd_->Flush()|.
   bool FlushCache();
 
+  // Declared before |cache_|, which is sized by it.
+  MemoryBudget::Reservation cache_reservation_;
   brillo::Blob cache_;
   size_t bytes_cached_{0};
   off64_t offset_{0};
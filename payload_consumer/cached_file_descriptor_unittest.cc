@@ -201,4 +201,19 @@ TEST_F(CachedFileDescriptorTest, SeekAfterWriteTest) {
   EXPECT_EQ(blob_in, blob_out);
 }
 
+TEST_F(CachedFileDescriptorTest, ReadAfterWriteTest) {
+  brillo::Blob blob_in(kFileSize, value_);
+  EXPECT_EQ(cfd_->Seek(10, SEEK_SET), 10);
+  Write(blob_in.data(), kCacheSize / 2);
+  // The written data is still in the cache.
+  brillo::Blob blob_out(kCacheSize);
+  EXPECT_EQ(cfd_->Seek(0, SEEK_SET), 0);
+  EXPECT_EQ(cfd_->Read(blob_out.data(), blob_out.size()),
+            static_cast<ssize_t>(blob_out.size()));
+  brillo::Blob expected(kCacheSize, 0);
+  std::fill_n(&expected[10], kCacheSize / 2, value_);
+  EXPECT_EQ(expected, blob_out);
+  EXPECT_EQ(cfd_->Seek(0, SEEK_CUR), static_cast<off64_t>(kCacheSize));
+}
+
 }  // namespace chromeos_update_engine
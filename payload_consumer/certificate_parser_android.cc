@@ -16,7 +16,11 @@
 
 #include "update_engine/payload_consumer/certificate_parser_android.h"
 
+#include <sys/stat.h>
+
+#include <map>
 #include <memory>
+#include <mutex>
 #include <utility>
 
 #include <base/logging.h>
@@ -27,6 +31,48 @@
 #include "update_engine/payload_consumer/certificate_parser_interface.h"
 
 namespace {
+
+using PublicKeyPtr = std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>;
+
+// The public keys read from a certificate zip file, and the file they were
+// read from.
+struct CachedPublicKeys {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  timespec mtime;
+  std::vector<PublicKeyPtr> keys;
+};
+
+// The public keys read so far, by certificate zip path. A verifier is created
+// for the metadata, the payload and every VerifyPayloadApplicable() call,
+// while the zip file, on a read-only partition, doesn't change for the
+// lifetime of the process. The entries are never modified, only replaced.
+std::mutex cached_public_keys_mutex;
+std::map<std::string, CachedPublicKeys>& CachedPublicKeysByPath() {
+  static std::map<std::string, CachedPublicKeys> cached_public_keys;
+  return cached_public_keys;
+}
+
+bool IsSameFile(const CachedPublicKeys& cached, const struct stat& st) {
+  return cached.dev == st.st_dev && cached.ino == st.st_ino &&
+         cached.size == st.st_size &&
+         cached.mtime.tv_sec == st.st_mtim.tv_sec &&
+         cached.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+// Copies |keys|, which then share the key data.
+std::vector<PublicKeyPtr> CopyPublicKeys(
+    const std::vector<PublicKeyPtr>& keys) {
+  std::vector<PublicKeyPtr> copies;
+  copies.reserve(keys.size());
+  for (const auto& key : keys) {
+    EVP_PKEY_up_ref(key.get());
+    copies.emplace_back(key.get(), EVP_PKEY_free);
+  }
+  return copies;
+}
+
 bool IterateZipEntriesAndSearchForKeys(
     const ZipArchiveHandle& handle, std::vector<std::vector<uint8_t>>* result) {
   void* cookie;
@@ -72,6 +118,39 @@ bool CertificateParserAndroid::ReadPublicKeysFromCertificates(
         out_public_keys) {
   out_public_keys->clear();
 
+  // The file is parsed again if it was replaced, e.g. by a test.
+  struct stat zip_stat;
+  const bool has_stat = stat(path.c_str(), &zip_stat) == 0;
+  if (has_stat) {
+    std::lock_guard<std::mutex> lock(cached_public_keys_mutex);
+    const auto& cache = CachedPublicKeysByPath();
+    auto it = cache.find(path);
+    if (it != cache.end() && IsSameFile(it->second, zip_stat)) {
+      *out_public_keys = CopyPublicKeys(it->second.keys);
+      return true;
+    }
+  }
+
+  std::vector<PublicKeyPtr> public_keys;
+  if (!ReadPublicKeysFromZip(path, &public_keys)) {
+    return false;
+  }
+  if (has_stat) {
+    std::lock_guard<std::mutex> lock(cached_public_keys_mutex);
+    CachedPublicKeysByPath()[path] = {zip_stat.st_dev,
+                                      zip_stat.st_ino,
+                                      zip_stat.st_size,
+                                      zip_stat.st_mtim,
+                                      CopyPublicKeys(public_keys)};
+  }
+  *out_public_keys = std::move(public_keys);
+  return true;
+}
+
+bool CertificateParserAndroid::ReadPublicKeysFromZip(
+    const std::string& path,
+    std::vector<std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>>*
+        out_public_keys) {
   ZipArchiveHandle handle;
   if (int32_t open_status = OpenArchive(path.c_str(), &handle);
       open_status != 0) {
@@ -38,6 +38,13 @@ class CertificateParserAndroid : public CertificateParserInterface {
           out_public_keys) override;
 
  private:
+  // Reads the public keys of |path| without going through the cache of
+  // ReadPublicKeysFromCertificates().
+  static bool ReadPublicKeysFromZip(
+      const std::string& path,
+      std::vector<std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>>*
+          out_public_keys);
+
   DISALLOW_COPY_AND_ASSIGN(CertificateParserAndroid);
 };
 
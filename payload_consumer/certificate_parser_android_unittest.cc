@@ -43,6 +43,20 @@ TEST(CertificateParserAndroidTest, ParseZipArchive) {
   ASSERT_EQ(1u, keys.size());
 }
 
+TEST(CertificateParserAndroidTest, ReusesParsedKeys) {
+  std::string ota_cert =
+      test_utils::GetBuildArtifactsPath(kUnittestOtacertsPath);
+  std::vector<std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>> keys;
+  std::vector<std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>> other_keys;
+  auto parser = CreateCertificateParser();
+  ASSERT_TRUE(parser->ReadPublicKeysFromCertificates(ota_cert, &keys));
+  auto other_parser = CreateCertificateParser();
+  ASSERT_TRUE(
+      other_parser->ReadPublicKeysFromCertificates(ota_cert, &other_keys));
+  ASSERT_EQ(1u, other_keys.size());
+  EXPECT_EQ(keys[0].get(), other_keys[0].get());
+}
+
 TEST(CertificateParserAndroidTest, VerifySignature) {
   brillo::Blob hash_blob;
   ASSERT_TRUE(HashCalculator::RawHashOfData({'x'}, &hash_blob));
@@ -0,0 +1,85 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/checkpoint_policy.h"
+
+#include <algorithm>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The weight of the last checkpoint in the moving average of their cost.
+constexpr double kCheckpointCostWeight = 0.25;
+
+}  // namespace
+
+CheckpointPolicy::CheckpointPolicy(const Params& params) : params_(params) {
+  stats_.checkpoint_cost = params_.initial_checkpoint_cost;
+}
+
+void CheckpointPolicy::Start(base::TimeTicks now,
+                             base::TimeDelta cpu_time,
+                             uint64_t payload_offset) {
+  last_time_ = now;
+  last_cpu_time_ = cpu_time;
+  last_payload_offset_ = payload_offset;
+}
+
+bool CheckpointPolicy::ShouldCheckpoint(base::TimeTicks now,
+                                        base::TimeDelta cpu_time,
+                                        uint64_t payload_offset) const {
+  const base::TimeDelta elapsed = now - last_time_;
+  if (elapsed < params_.min_interval)
+    return false;
+  if (elapsed >= params_.max_interval ||
+      payload_offset >= last_payload_offset_ + params_.max_redo_bytes)
+    return true;
+  return stats_.checkpoint_cost.InSecondsF() <=
+         RedoCost(cpu_time, payload_offset).InSecondsF() *
+             params_.max_overhead;
+}
+
+void CheckpointPolicy::CheckpointDone(base::TimeTicks now,
+                                      base::TimeDelta duration,
+                                      base::TimeDelta cpu_time,
+                                      uint64_t payload_offset) {
+  stats_.last_redo_cost = RedoCost(cpu_time, payload_offset);
+  stats_.total_checkpoint_time += duration;
+  stats_.checkpoint_cost =
+      stats_.checkpoints == 0
+          ? duration
+          : base::TimeDelta::FromMicroseconds(static_cast<int64_t>(
+                stats_.checkpoint_cost.InMicroseconds() *
+                    (1 - kCheckpointCostWeight) +
+                duration.InMicroseconds() * kCheckpointCostWeight));
+  stats_.checkpoints++;
+  Start(now, cpu_time, payload_offset);
+}
+
+base::TimeDelta CheckpointPolicy::RedoCost(base::TimeDelta cpu_time,
+                                           uint64_t payload_offset) const {
+  const uint64_t bytes =
+      payload_offset > last_payload_offset_
+          ? payload_offset - last_payload_offset_
+          : 0;
+  return std::max(cpu_time - last_cpu_time_, base::TimeDelta()) +
+         base::TimeDelta::FromMicroseconds(
+             bytes * base::Time::kMicrosecondsPerSecond /
+             std::max<uint64_t>(params_.redo_bytes_per_second, 1));
+}
+
+}  // namespace chromeos_update_engine
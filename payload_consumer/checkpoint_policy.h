@@ -0,0 +1,104 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_CHECKPOINT_POLICY_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_CHECKPOINT_POLICY_H_
+
+#include <cstdint>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// Decides when DeltaPerformer checkpoints the update progress, weighing the
+// work redone after a crash since the last checkpoint against what the
+// checkpoints cost. The redo cost is the CPU time spent since the last
+// checkpoint plus the time to download and write the payload bytes applied
+// since then again. The checkpoint cost is a moving average of the measured
+// checkpoints, which sync the prefs and the partition writers. A checkpoint
+// is taken once its cost is at most |max_overhead| of the redo cost, within
+// the bounds of the parameters.
+class CheckpointPolicy {
+ public:
+  struct Params {
+    // No checkpoint is taken sooner than |min_interval| after the previous
+    // one, and one is always taken after |max_interval| or once
+    // |max_redo_bytes| of payload are applied.
+    base::TimeDelta min_interval{base::TimeDelta::FromMilliseconds(250)};
+    base::TimeDelta max_interval{base::TimeDelta::FromSeconds(10)};
+    uint64_t max_redo_bytes{64 * 1024 * 1024};
+    // The rate at which the applied payload bytes are downloaded and written
+    // again after a crash.
+    uint64_t redo_bytes_per_second{20 * 1024 * 1024};
+    // The cost of the checkpoints, as a fraction of the redo cost they save.
+    double max_overhead{0.05};
+    // The checkpoint cost assumed before one is measured.
+    base::TimeDelta initial_checkpoint_cost{
+        base::TimeDelta::FromMilliseconds(10)};
+  };
+
+  struct Stats {
+    uint64_t checkpoints{0};
+    base::TimeDelta total_checkpoint_time;
+    // The moving average of the checkpoint cost.
+    base::TimeDelta checkpoint_cost;
+    // The redo cost when the last checkpoint was taken.
+    base::TimeDelta last_redo_cost;
+  };
+
+  explicit CheckpointPolicy(const Params& params);
+  CheckpointPolicy() : CheckpointPolicy(Params()) {}
+
+  // Starts counting the redo cost at |now|, with the process at |cpu_time|
+  // and |payload_offset| bytes of payload applied.
+  void Start(base::TimeTicks now,
+             base::TimeDelta cpu_time,
+             uint64_t payload_offset);
+
+  // Returns whether a checkpoint should be taken at |now|.
+  bool ShouldCheckpoint(base::TimeTicks now,
+                        base::TimeDelta cpu_time,
+                        uint64_t payload_offset) const;
+
+  // Records a checkpoint of |duration|, taken at |now|.
+  void CheckpointDone(base::TimeTicks now,
+                      base::TimeDelta duration,
+                      base::TimeDelta cpu_time,
+                      uint64_t payload_offset);
+
+  const Params& params() const { return params_; }
+  void set_params(const Params& params) { params_ = params; }
+  const Stats& stats() const { return stats_; }
+
+ private:
+  base::TimeDelta RedoCost(base::TimeDelta cpu_time,
+                           uint64_t payload_offset) const;
+
+  Params params_;
+  Stats stats_;
+
+  // The state at the last checkpoint.
+  base::TimeTicks last_time_;
+  base::TimeDelta last_cpu_time_;
+  uint64_t last_payload_offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(CheckpointPolicy);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_CHECKPOINT_POLICY_H_
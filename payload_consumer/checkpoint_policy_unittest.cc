@@ -0,0 +1,86 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/checkpoint_policy.h"
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint64_t kMiB = 1024 * 1024;
+
+}  // namespace
+
+class CheckpointPolicyTest : public ::testing::Test {
+ protected:
+  void SetUp() override { policy_.Start(start_, base::TimeDelta(), 0); }
+
+  base::TimeTicks At(int64_t milliseconds) const {
+    return start_ + base::TimeDelta::FromMilliseconds(milliseconds);
+  }
+
+  const base::TimeTicks start_ = base::TimeTicks() +
+                                 base::TimeDelta::FromSeconds(100);
+  CheckpointPolicy policy_;
+};
+
+TEST_F(CheckpointPolicyTest, HonorsTheIntervalBoundsTest) {
+  const auto& params = policy_.params();
+  EXPECT_FALSE(policy_.ShouldCheckpoint(
+      start_ + params.min_interval / 2, base::TimeDelta(), 100 * kMiB));
+  EXPECT_TRUE(policy_.ShouldCheckpoint(
+      start_ + params.max_interval, base::TimeDelta(), 0));
+  EXPECT_TRUE(policy_.ShouldCheckpoint(
+      start_ + params.min_interval, base::TimeDelta(), params.max_redo_bytes));
+}
+
+TEST_F(CheckpointPolicyTest, WaitsLongerForExpensiveCheckpointsTest) {
+  // 1 MiB of payload is 50 ms of redo, which pays for a 2.5 ms checkpoint.
+  policy_.CheckpointDone(At(0), base::TimeDelta::FromMilliseconds(2), {}, 0);
+  EXPECT_TRUE(policy_.ShouldCheckpoint(At(500), base::TimeDelta(), kMiB));
+
+  // A slow sync needs 20 times more redo.
+  CheckpointPolicy slow_policy;
+  slow_policy.CheckpointDone(
+      At(0), base::TimeDelta::FromMilliseconds(50), {}, 0);
+  EXPECT_FALSE(slow_policy.ShouldCheckpoint(At(500), base::TimeDelta(), kMiB));
+  EXPECT_TRUE(
+      slow_policy.ShouldCheckpoint(At(500), base::TimeDelta(), 21 * kMiB));
+}
+
+TEST_F(CheckpointPolicyTest, CountsTheCpuTimeTest) {
+  policy_.CheckpointDone(At(0), base::TimeDelta::FromMilliseconds(20), {}, 0);
+  EXPECT_FALSE(policy_.ShouldCheckpoint(
+      At(300), base::TimeDelta::FromMilliseconds(100), 0));
+  EXPECT_TRUE(policy_.ShouldCheckpoint(
+      At(300), base::TimeDelta::FromMilliseconds(500), 0));
+}
+
+TEST_F(CheckpointPolicyTest, RecordsStatsTest) {
+  policy_.CheckpointDone(At(0), base::TimeDelta::FromMilliseconds(40), {}, 0);
+  policy_.CheckpointDone(
+      At(1000), base::TimeDelta::FromMilliseconds(80), {}, kMiB);
+  const auto& stats = policy_.stats();
+  EXPECT_EQ(2u, stats.checkpoints);
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(120),
+            stats.total_checkpoint_time);
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(50), stats.checkpoint_cost);
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(50), stats.last_redo_cost);
+}
+
+}  // namespace chromeos_update_engine
@@ -16,6 +16,8 @@
 
 #include "update_engine/payload_consumer/cow_writer_file_descriptor.h"
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
 #include <utility>
 
@@ -25,6 +27,12 @@
 #include "update_engine/payload_consumer/file_descriptor.h"
 
 namespace chromeos_update_engine {
+
+namespace {
+// The most written data kept in memory to serve reads of it from.
+constexpr size_t kMaxOverlayBytes = 4 * 1024 * 1024;
+}  // namespace
+
 CowWriterFileDescriptor::CowWriterFileDescriptor(
     std::unique_ptr<android::snapshot::ISnapshotWriter> cow_writer)
     : cow_writer_(std::move(cow_writer)),
@@ -51,50 +59,100 @@ bool CowWriterFileDescriptor::Open(const char* path, int flags) {
 }
 
 ssize_t CowWriterFileDescriptor::Read(void* buf, size_t count) {
-  if (dirty_) {
-    // OK, CowReader provides a snapshot view of what the cow contains. Which
-    // means any writes happened after opening a CowReader isn't visible to
-    // that CowReader. Therefore, we re-open CowReader whenever we attempt a
-    // read after write. This does incur an overhead everytime you read after
-    // write.
-    // The usage of |dirty_| flag to coordinate re-open is a very coarse grained
-    // checked. This implementation has suboptimal performance. For better
-    // performance, keep track of blocks which are overwritten, and only re-open
-    // if reading a dirty block.
-    // TODO(b/173432386) Implement finer grained dirty checks
-    const auto offset = cow_reader_->Seek(0, SEEK_CUR);
-    cow_reader_.reset();
-    if (!cow_writer_->Finalize()) {
-      LOG(ERROR) << "Failed to Finalize() cow writer";
-      return -1;
-    }
-    cow_reader_ = cow_writer_->OpenReader();
-    if (cow_reader_ == nullptr) {
-      LOG(ERROR) << "Failed to re-open cow reader after writing to COW";
-      return -1;
-    }
-    const auto pos = cow_reader_->Seek(offset, SEEK_SET);
-    if (pos != offset) {
-      LOG(ERROR) << "Failed to seek to previous position after re-opening cow "
-                    "reader, expected "
-                 << offset << " actual: " << pos;
+  // OK, CowReader provides a snapshot view of what the cow contains. Which
+  // means any writes happened after opening a CowReader isn't visible to
+  // that CowReader. Reads which don't touch a block written since then are
+  // served by the CowReader as is. Reads which do are patched with the written
+  // data kept in |overlay_|, or if it didn't fit, cause the CowReader to be
+  // re-opened, which incurs finalizing the COW writer.
+  const off64_t offset = cow_reader_->Seek(0, SEEK_CUR);
+  if (offset < 0) {
+    return -1;
+  }
+  const size_t block_size = cow_writer_->options().block_size;
+  if (count == 0 || !dirty_blocks_.OverlapsWithExtent(
+                        ExtentForBytes(block_size, offset, count))) {
+    return cow_reader_->Read(buf, count);
+  }
+  if (overlay_.size() != dirty_blocks_.blocks()) {
+    if (!ReopenReader()) {
       return -1;
     }
-    dirty_ = false;
+    return cow_reader_->Read(buf, count);
+  }
+
+  const ssize_t bytes_read = cow_reader_->Read(buf, count);
+  if (bytes_read <= 0) {
+    return bytes_read;
+  }
+  const uint64_t end = offset + bytes_read;
+  for (auto it = overlay_.lower_bound(offset / block_size);
+       it != overlay_.end() && it->first * block_size < end;
+       ++it) {
+    const uint64_t block_start = it->first * block_size;
+    const uint64_t copy_start = std::max<uint64_t>(block_start, offset);
+    const uint64_t copy_end = std::min(block_start + block_size, end);
+    memcpy(static_cast<uint8_t*>(buf) + (copy_start - offset),
+           it->second.data() + (copy_start - block_start),
+           copy_end - copy_start);
   }
-  return cow_reader_->Read(buf, count);
+  return bytes_read;
+}
+
+bool CowWriterFileDescriptor::ReopenReader() {
+  const auto offset = cow_reader_->Seek(0, SEEK_CUR);
+  cow_reader_.reset();
+  if (!cow_writer_->Finalize()) {
+    LOG(ERROR) << "Failed to Finalize() cow writer";
+    return false;
+  }
+  cow_reader_ = cow_writer_->OpenReader();
+  if (cow_reader_ == nullptr) {
+    LOG(ERROR) << "Failed to re-open cow reader after writing to COW";
+    return false;
+  }
+  const auto pos = cow_reader_->Seek(offset, SEEK_SET);
+  if (pos != offset) {
+    LOG(ERROR) << "Failed to seek to previous position after re-opening cow "
+                  "reader, expected "
+               << offset << " actual: " << pos;
+    return false;
+  }
+  dirty_ = false;
+  dirty_blocks_ = ExtentRanges();
+  overlay_.clear();
+  overlay_bytes_ = 0;
+  return true;
 }
 
 ssize_t CowWriterFileDescriptor::Write(const void* buf, size_t count) {
   auto offset = cow_reader_->Seek(0, SEEK_CUR);
-  CHECK_EQ(offset % cow_writer_->options().block_size, 0);
-  auto success = cow_writer_->AddRawBlocks(
-      offset / cow_writer_->options().block_size, buf, count);
+  const size_t block_size = cow_writer_->options().block_size;
+  CHECK_EQ(offset % block_size, 0);
+  auto success = cow_writer_->AddRawBlocks(offset / block_size, buf, count);
   if (success) {
     if (cow_reader_->Seek(count, SEEK_CUR) < 0) {
       return -1;
     }
     dirty_ = true;
+    // Once a write didn't fit, the overlay is dropped until the next re-open.
+    const bool overlay_complete = overlay_.size() == dirty_blocks_.blocks();
+    const uint64_t start_block = offset / block_size;
+    const uint64_t num_blocks = count / block_size;
+    dirty_blocks_.AddExtent(ExtentForRange(start_block, num_blocks));
+    if (overlay_complete && overlay_bytes_ + count <= kMaxOverlayBytes) {
+      const uint8_t* data = static_cast<const uint8_t*>(buf);
+      for (uint64_t i = 0; i < num_blocks; i++) {
+        brillo::Blob& block = overlay_[start_block + i];
+        if (block.empty()) {
+          overlay_bytes_ += block_size;
+        }
+        block.assign(data + i * block_size, data + (i + 1) * block_size);
+      }
+    } else {
+      overlay_.clear();
+      overlay_bytes_ = 0;
+    }
     return count;
   }
   return -1;
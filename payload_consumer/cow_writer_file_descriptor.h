@@ -15,11 +15,14 @@
 //
 
 #include <cstdint>
+#include <map>
 #include <memory>
 
+#include <brillo/secure_blob.h>
 #include <libsnapshot/snapshot_writer.h>
 
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 
 namespace chromeos_update_engine {
 
@@ -64,8 +67,19 @@ class CowWriterFileDescriptor final : public FileDescriptor {
   bool IsOpen() override;
 
  private:
+  // Finalizes the COW writer and re-opens |cow_reader_| at the same offset, so
+  // that it sees all the blocks written so far.
+  bool ReopenReader();
+
   std::unique_ptr<android::snapshot::ISnapshotWriter> cow_writer_;
   FileDescriptorPtr cow_reader_;
+  // Whether anything was written since the COW writer was last finalized.
   bool dirty_ = false;
+  // The blocks written since |cow_reader_| was opened, which it doesn't see.
+  ExtentRanges dirty_blocks_;
+  // A copy of the |dirty_blocks_|, as long as they fit in kMaxOverlayBytes,
+  // which reads of them are served from instead of re-opening |cow_reader_|.
+  std::map<uint64_t, brillo::Blob> overlay_;
+  size_t overlay_bytes_ = 0;
 };
 }  // namespace chromeos_update_engine
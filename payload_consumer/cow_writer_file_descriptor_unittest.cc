@@ -117,4 +117,34 @@ TEST_F(CowWriterFileDescriptorUnittest, ReadAfterWrite) {
          "is open, Finalize() should not be called.";
 }
 
+TEST_F(CowWriterFileDescriptorUnittest, ReadInterleavedWithWrites) {
+  auto cow_writer = GetCowWriter();
+  ASSERT_TRUE(cow_writer->Initialize());
+  CowWriterFileDescriptor cow_fd{std::move(cow_writer)};
+
+  std::vector<unsigned char> block(BLOCK_SIZE, 0xAA);
+  ASSERT_EQ((ssize_t)BLOCK_SIZE * 2, cow_fd.Seek(BLOCK_SIZE * 2, SEEK_SET));
+  ASSERT_EQ((ssize_t)block.size(), cow_fd.Write(block.data(), block.size()));
+
+  // A read of the written block along with untouched ones, neither aligned.
+  std::vector<unsigned char> read_back(BLOCK_SIZE * 2);
+  ASSERT_EQ((ssize_t)BLOCK_SIZE + 10, cow_fd.Seek(BLOCK_SIZE + 10, SEEK_SET));
+  ASSERT_EQ((ssize_t)read_back.size(),
+            cow_fd.Read(read_back.data(), read_back.size()));
+  std::vector<unsigned char> expected(BLOCK_SIZE * 2, 0);
+  std::fill(expected.begin() + BLOCK_SIZE - 10, expected.end() - 10, 0xAA);
+  ASSERT_EQ(expected, read_back);
+
+  // Rewriting the block is visible to the next read of it.
+  std::fill(block.begin(), block.end(), 0xBB);
+  ASSERT_EQ((ssize_t)BLOCK_SIZE * 2, cow_fd.Seek(BLOCK_SIZE * 2, SEEK_SET));
+  ASSERT_EQ((ssize_t)block.size(), cow_fd.Write(block.data(), block.size()));
+  ASSERT_EQ((ssize_t)BLOCK_SIZE * 2, cow_fd.Seek(BLOCK_SIZE * 2, SEEK_SET));
+  read_back.resize(BLOCK_SIZE);
+  ASSERT_EQ((ssize_t)read_back.size(),
+            cow_fd.Read(read_back.data(), read_back.size()));
+  ASSERT_EQ(block, read_back);
+  ASSERT_TRUE(cow_fd.Close());
+}
+
 }  // namespace chromeos_update_engine
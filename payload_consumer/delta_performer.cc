@@ -21,10 +21,13 @@
 
 #include <algorithm>
 #include <cstring>
+#include <future>
+#include <limits>
 #include <map>
 #include <memory>
 #include <set>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -43,6 +46,9 @@
 #include "update_engine/common/error_code.h"
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/hardware_interface.h"
+#include "update_engine/common/operation_index.h"
+#include "update_engine/common/performance_recorder.h"
+#include "update_engine/common/trace.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/terminator.h"
@@ -52,6 +58,7 @@
 #include "update_engine/payload_consumer/certificate_parser_interface.h"
 #include "update_engine/payload_consumer/extent_reader.h"
 #include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/partition_update_generator_interface.h"
 #include "update_engine/payload_consumer/partition_writer.h"
 #if USE_FEC
@@ -62,6 +69,7 @@
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 
 using google::protobuf::RepeatedPtrField;
 using std::min;
@@ -73,11 +81,27 @@ const unsigned DeltaPerformer::kProgressLogMaxChunks = 10;
 const unsigned DeltaPerformer::kProgressLogTimeoutSeconds = 30;
 const unsigned DeltaPerformer::kProgressDownloadWeight = 50;
 const unsigned DeltaPerformer::kProgressOperationsWeight = 50;
-const uint64_t DeltaPerformer::kCheckpointFrequencySeconds = 1;
 
 namespace {
 const int kUpdateStateOperationInvalid = -1;
 const int kMaxResumedUpdateFailures = 10;
+// Number of validated operations allowed to wait for the apply worker when
+// pipelining. Each of them holds its blob in memory.
+const size_t kMaxPipelinedOperations = 2;
+// The smallest blob of a REPLACE operation written while it is downloaded,
+// when InstallPlan::stream_replace_operations is set.
+const uint64_t kMinStreamedOperationSize = 1024 * 1024;
+// Memory budgeted for each apply worker on top of the blobs it is given: the
+// caches, source buffers and bspatch/puffpatch scratch of its operations.
+const size_t kApplyWorkerMemory = 16 * 1024 * 1024;
+// The operations of the manifest are validated one partition per thread, with
+// at most this many threads, once there are enough of them for it to pay off.
+const size_t kMaxManifestValidationThreads = 4;
+const int kMinOperationsForParallelValidation = 10000;
+// The payload data kept in memory while the partitions are prepared in the
+// background, enough for a few seconds of a fast download.
+const size_t kMinPreparingBufferSize = 1024 * 1024;
+const size_t kPreparingBufferSize = 64 * 1024 * 1024;
 
 }  // namespace
 
@@ -96,7 +120,7 @@ void DeltaPerformer::LogProgress(const char* message_prefix) {
     // Upcasting to 64-bit to avoid overflow, back to size_t for formatting.
     completed_percentage_str = base::StringPrintf(
         " (%" PRIu64 "%%)",
-        IntRatio(next_operation_num_, num_total_operations_, 100));
+        IntRatio(NumAppliedOperations(), num_total_operations_, 100));
   }
 
   // Format download total count and percentage.
@@ -110,8 +134,9 @@ void DeltaPerformer::LogProgress(const char* message_prefix) {
         " (%" PRIu64 "%%)", IntRatio(total_bytes_received_, payload_size, 100));
   }
 
-  LOG(INFO) << (message_prefix ? message_prefix : "") << next_operation_num_
-            << "/" << total_operations_str << " operations"
+  LOG(INFO) << (message_prefix ? message_prefix : "")
+            << NumAppliedOperations() << "/" << total_operations_str
+            << " operations"
             << completed_percentage_str << ", " << total_bytes_received_ << "/"
             << payload_size_str << " bytes downloaded"
             << downloaded_percentage_str << ", overall progress "
@@ -147,9 +172,10 @@ void DeltaPerformer::UpdateOverallProgress(bool force_log,
   // Only add completed operations if their total number is known; we definitely
   // expect an update to have at least one operation, so the expectation is that
   // this will eventually reach |actual_operations_weight|.
+  const size_t applied_operations = NumAppliedOperations();
   if (num_total_operations_)
     new_overall_progress += IntRatio(
-        next_operation_num_, num_total_operations_, actual_operations_weight);
+        applied_operations, num_total_operations_, actual_operations_weight);
 
   // Progress ratio cannot recede, unless our assumptions about the total
   // payload size, total number of operations, or the monotonicity of progress
@@ -160,6 +186,14 @@ void DeltaPerformer::UpdateOverallProgress(bool force_log,
     force_log = true;
   }
   overall_progress_ = new_overall_progress;
+  if (download_delegate_ && num_total_operations_) {
+    download_delegate_->OperationsApplied(
+        current_partition_ < static_cast<size_t>(partitions_.size())
+            ? partitions_[current_partition_].partition_name()
+            : "",
+        applied_operations,
+        num_total_operations_);
+  }
 
   // Update chunk index, log as needed: if forced by called, or we completed a
   // progress chunk, or a timeout has expired.
@@ -174,9 +208,15 @@ void DeltaPerformer::UpdateOverallProgress(bool force_log,
   last_progress_chunk_ = curr_progress_chunk;
 }
 
+size_t DeltaPerformer::NumAppliedOperations() const {
+  return next_operation_num_ -
+         num_queued_operations_.load(std::memory_order_relaxed);
+}
+
 size_t DeltaPerformer::CopyDataToBuffer(const char** bytes_p,
                                         size_t* count_p,
-                                        size_t max) {
+                                        size_t max,
+                                        bool hash_op_blob) {
   const size_t count = *count_p;
   if (!count)
     return 0;  // Special case shortcut.
@@ -185,6 +225,11 @@ size_t DeltaPerformer::CopyDataToBuffer(const char** bytes_p,
   const char* bytes_end = bytes_start + read_len;
   buffer_.reserve(max);
   buffer_.insert(buffer_.end(), bytes_start, bytes_end);
+  if (hash_op_blob && buffered_op_hasher_ &&
+      !buffered_op_hasher_->Update(bytes_start, read_len)) {
+    // The blob is hashed again once received.
+    buffered_op_hasher_.reset();
+  }
   *bytes_p = bytes_end;
   *count_p = count - read_len;
   return read_len;
@@ -192,27 +237,59 @@ size_t DeltaPerformer::CopyDataToBuffer(const char** bytes_p,
 
 bool DeltaPerformer::HandleOpResult(bool op_result,
                                     const char* op_type_name,
+                                    size_t operation_num,
                                     ErrorCode* error) {
   if (op_result)
     return true;
 
+  // Pipelined operations may fail after the next partition was opened.
+  const size_t partition_index = PartitionOfOperation(operation_num);
+  const size_t partition_operation_num =
+      operation_num -
+      (partition_index ? acc_num_operations_[partition_index - 1] : 0);
   LOG(ERROR) << "Failed to perform " << op_type_name << " operation "
-             << next_operation_num_ << ", which is the operation "
-             << GetPartitionOperationNum() << " in partition \""
-             << partitions_[current_partition_].partition_name() << "\"";
+             << operation_num << ", which is the operation "
+             << partition_operation_num << " in partition \""
+             << partitions_[partition_index].partition_name() << "\"";
   if (*error == ErrorCode::kSuccess)
     *error = ErrorCode::kDownloadOperationExecutionError;
   return false;
 }
 
 int DeltaPerformer::Close() {
-  int err = -CloseCurrentPartition();
+  // The partitions may still be prepared if the download stopped meanwhile.
+  if (partitions_prepared_.valid())
+    partitions_prepared_.wait();
+  if (!bytes_received_while_preparing_.empty()) {
+    LOG(INFO) << "Discarding " << bytes_received_while_preparing_.size()
+              << " bytes received while preparing the partitions.";
+    brillo::Blob().swap(bytes_received_while_preparing_);
+    preparing_reservation_.Release();
+  }
+  // Let the operations already handed to the worker finish before closing the
+  // partition they write to.
+  apply_pool_.reset();
+  const bool streaming = streamed_op_writer_ != nullptr;
+  int err = -CloseFinishingPartition();
+  const int current_err = -CloseCurrentPartition();
+  if (err == 0)
+    err = current_err;
+  // FilesystemVerifierAction picks up the hashes from their checkpoints.
+  background_hasher_.Stop(prefs_);
   LOG_IF(ERROR,
          !payload_hash_calculator_.Finalize() ||
              !signed_hash_calculator_.Finalize())
       << "Unable to finalize the hash.";
-  if (!buffer_.empty()) {
-    LOG(INFO) << "Discarding " << buffer_.size() << " unused downloaded bytes";
+  const CheckpointPolicy::Stats& checkpoints = checkpoint_policy_.stats();
+  LOG_IF(INFO, checkpoints.checkpoints > 0)
+      << checkpoints.checkpoints << " checkpoints took "
+      << utils::FormatTimeDelta(checkpoints.total_checkpoint_time)
+      << ", the last ones about "
+      << utils::FormatTimeDelta(checkpoints.checkpoint_cost) << " each.";
+  if (!buffer_.empty() || streaming) {
+    LOG(INFO) << "Discarding "
+              << (streaming ? streamed_op_bytes_ : buffer_.size())
+              << " unused downloaded bytes";
     if (err >= 0)
       err = 1;
   }
@@ -220,16 +297,63 @@ int DeltaPerformer::Close() {
 }
 
 int DeltaPerformer::CloseCurrentPartition() {
+  // The operations in flight write to the writers closed below.
+  apply_pool_.reset();
+  apply_reservation_.Release();
+  streamed_op_writer_.reset();
+  // Only left when aborting, FinishCurrentPartition() takes it otherwise.
+  streaming_verity_writer_.reset();
+  scheduled_dst_extents_ = ExtentRanges();
+  apply_writers_.reset();
+  int err = 0;
+  for (auto& writer : extra_partition_writers_) {
+    int writer_err = writer->Close();
+    if (err == 0)
+      err = writer_err;
+  }
+  extra_partition_writers_.clear();
   if (!partition_writer_) {
-    return 0;
+    return err;
   }
-  int err = partition_writer_->Close();
+  int writer_err = partition_writer_->Close();
   partition_writer_ = nullptr;
-  return err;
+  UE_TRACE_ASYNC_END(
+      ("apply " + partitions_[current_partition_].partition_name()).c_str(),
+      current_partition_);
+  PerformanceRecorder::Get()->AddPhase(
+      "apply/" + partitions_[current_partition_].partition_name(),
+      base::TimeTicks::Now() - partition_open_time_,
+      base::TimeDelta());
+  return writer_err ? writer_err : err;
+}
+
+int DeltaPerformer::CloseFinishingPartition() {
+  if (!finishing_partition_)
+    return 0;
+  std::unique_ptr<FinishingPartition> finishing =
+      std::move(finishing_partition_);
+  // The operations in flight write to the writers closed below.
+  finishing->apply_pool.reset();
+  finishing->apply_reservation.Release();
+  int err = 0;
+  for (auto& writer : finishing->extra_writers) {
+    int writer_err = writer->Close();
+    if (err == 0)
+      err = writer_err;
+  }
+  int writer_err = finishing->partition_writer->Close();
+  const string& name =
+      partitions_[finishing->partition_index].partition_name();
+  UE_TRACE_ASYNC_END(("apply " + name).c_str(), finishing->partition_index);
+  PerformanceRecorder::Get()->AddPhase(
+      "apply/" + name,
+      base::TimeTicks::Now() - finishing->open_time,
+      base::TimeDelta());
+  return writer_err ? writer_err : err;
 }
 
 bool DeltaPerformer::OpenCurrentPartition() {
-  if (current_partition_ >= partitions_.size())
+  if (current_partition_ >= static_cast<size_t>(partitions_.size()))
     return false;
 
   const PartitionUpdate& partition = partitions_[current_partition_];
@@ -245,15 +369,86 @@ bool DeltaPerformer::OpenCurrentPartition() {
       block_size_,
       interactive_,
       IsDynamicPartition(install_part.name, install_plan_->target_slot));
+  partition_open_time_ = base::TimeTicks::Now();
+  UE_TRACE_ASYNC_BEGIN(("apply " + partition.partition_name()).c_str(),
+                       current_partition_);
   // Open source fds if we have a delta payload, or for partitions in the
   // partial update.
   const bool source_may_exist = manifest_.partial_update() ||
                                 payload_->type == InstallPayloadType::kDelta;
   const size_t partition_operation_num = GetPartitionOperationNum();
 
+  streaming_verity_writer_.reset();
+  if (install_plan_->write_verity && install_plan_->write_verity_during_apply) {
+    streaming_verity_writer_ = StreamingVerityWriter::Create(
+        install_part, install_plan_->verify_threads);
+    if (streaming_verity_writer_ &&
+        !partition_writer_->SetVerityWriter(streaming_verity_writer_.get())) {
+      streaming_verity_writer_.reset();
+    }
+    LOG_IF(INFO, streaming_verity_writer_)
+        << "Building the verity data of " << install_part.name
+        << " while applying its operations.";
+  }
+
+  if (resume_partial_op_bytes_ > 0) {
+    partition_writer_->ResumePartialOperation(resume_partial_op_bytes_ /
+                                              block_size_);
+  }
   TEST_AND_RETURN_FALSE(partition_writer_->Init(
       install_plan_, source_may_exist, partition_operation_num));
-  CheckpointUpdateProgress(true);
+  apply_writers_ = std::make_shared<ApplyWriters>();
+  apply_writers_->idle = {partition_writer_.get()};
+  if (streaming_verity_writer_) {
+    // The operations applied before resuming aren't written again.
+    for (size_t i = 0; i < partition_operation_num; i++) {
+      streaming_verity_writer_->MarkWritten(
+          partition.operations(i).dst_extents());
+    }
+  }
+
+  if (install_plan_->pipelined_apply) {
+    // Every worker gets a writer of its own, so that the operations of this
+    // partition can be applied concurrently when the writer allows it.
+    size_t num_workers = 1;
+    if (install_plan_->apply_threads > 1 &&
+        partition_writer_->AllowsConcurrentWriters()) {
+      num_workers = install_plan_->apply_threads;
+    }
+    // Run fewer workers than asked when the memory budget is short.
+    apply_reservation_ =
+        MemoryBudget::Get()->Reserve(kApplyWorkerMemory,
+                                     kApplyWorkerMemory * num_workers,
+                                     kApplyWorkerMemory,
+                                     "apply_workers");
+    num_workers = apply_reservation_.size() / kApplyWorkerMemory;
+    for (size_t i = 1; i < num_workers; i++) {
+      auto writer = CreatePartitionWriter(
+          partition,
+          install_part,
+          dynamic_control,
+          block_size_,
+          interactive_,
+          IsDynamicPartition(install_part.name, install_plan_->target_slot));
+      TEST_AND_RETURN_FALSE(writer);
+      if (streaming_verity_writer_) {
+        TEST_AND_RETURN_FALSE(
+            writer->SetVerityWriter(streaming_verity_writer_.get()));
+      }
+      TEST_AND_RETURN_FALSE(writer->Init(
+          install_plan_, source_may_exist, partition_operation_num));
+      apply_writers_->idle.push_back(writer.get());
+      extra_partition_writers_.push_back(std::move(writer));
+    }
+    LOG(INFO) << "Applying operations of partition " << install_part.name
+              << " in the background with " << num_workers << " worker(s).";
+    apply_pool_ = std::make_unique<WorkerPool>(
+        num_workers, kMaxPipelinedOperations * num_workers);
+  }
+  // A checkpoint waits for the previous partition still finishing, so it's
+  // left to the next one.
+  if (!finishing_partition_)
+    CheckpointUpdateProgress(true);
   return true;
 }
 
@@ -270,7 +465,8 @@ void LogPartitionInfoHash(const PartitionInfo& info, const string& tag) {
             << " size: " << info.size();
 }
 
-void LogPartitionInfo(const vector<PartitionUpdate>& partitions) {
+void LogPartitionInfo(
+    const google::protobuf::RepeatedPtrField<PartitionUpdate>& partitions) {
   for (const PartitionUpdate& partition : partitions) {
     if (partition.has_old_partition_info()) {
       LogPartitionInfoHash(partition.old_partition_info(),
@@ -281,6 +477,90 @@ void LogPartitionInfo(const vector<PartitionUpdate>& partitions) {
   }
 }
 
+// The result of ValidatePartitionOperations() for one partition.
+struct PartitionValidation {
+  ErrorCode error{ErrorCode::kSuccess};
+  // The range of the payload used by the blobs of the partition, empty if it
+  // has none.
+  uint64_t data_begin{0};
+  uint64_t data_end{0};
+};
+
+// Whether the REPLACE operations of a |payload_type| payload of
+// |minor_version| may share the blob of an earlier one.
+bool SharedBlobsAllowed(InstallPayloadType payload_type,
+                        uint32_t minor_version) {
+  return payload_type == InstallPayloadType::kFull ||
+         minor_version >= kSharedBlobMinorPayloadVersion;
+}
+
+// Checks the operations of |partition| on their own, without looking at the
+// other partitions, so that the partitions can be checked concurrently. With
+// |shared_blobs|, their blobs may come in any order, and are left to
+// IndexSharedBlobs() to check.
+PartitionValidation ValidatePartitionOperations(
+    const PartitionUpdate& partition,
+    InstallPayloadType payload_type,
+    bool shared_blobs) {
+  PartitionValidation result;
+  // The index is used in place of the operations, it must be an exact copy.
+  // Each operation is compared with it in the loop below, which already walks
+  // them.
+  OperationIndex index;
+  const bool has_index = partition.has_operation_index();
+  if (has_index && (!index.Init(partition.operation_index()) ||
+                    index.num_operations() !=
+                        static_cast<size_t>(partition.operations_size()))) {
+    LOG(ERROR) << "The operation index of partition "
+               << partition.partition_name()
+               << " doesn't match its operations.";
+    result.error = ErrorCode::kDownloadManifestParseError;
+    return result;
+  }
+  for (int i = 0; i < partition.operations_size(); i++) {
+    const InstallOperation& op = partition.operations(i);
+    if (has_index && !index.Matches(i, op)) {
+      LOG(ERROR) << "Operation " << i << " of partition "
+                 << partition.partition_name()
+                 << " doesn't match its operation index.";
+      result.error = ErrorCode::kDownloadManifestParseError;
+      return result;
+    }
+    if (payload_type == InstallPayloadType::kFull &&
+        (op.src_extents_size() > 0 || op.has_src_length())) {
+      LOG(ERROR) << "Operation " << i << " of partition "
+                 << partition.partition_name() << " is a "
+                 << InstallOperationTypeName(op.type())
+                 << " reading the source partition in a full payload.";
+      result.error = ErrorCode::kPayloadMismatchedType;
+      return result;
+    }
+    if (op.data_length() == 0) {
+      continue;
+    }
+    // The blobs are downloaded and applied in the order of the operations.
+    if ((!shared_blobs && op.data_offset() < result.data_end) ||
+        op.data_length() > std::numeric_limits<uint64_t>::max() -
+                               op.data_offset()) {
+      LOG(ERROR) << "Operation " << i << " of partition "
+                 << partition.partition_name() << " has its blob at "
+                 << op.data_offset() << " (" << op.data_length()
+                 << " bytes), overlapping or before the previous one ending "
+                 << "at " << result.data_end << ".";
+      result.error = ErrorCode::kDownloadManifestParseError;
+      return result;
+    }
+    if (shared_blobs) {
+      continue;
+    }
+    if (result.data_end == 0) {
+      result.data_begin = op.data_offset();
+    }
+    result.data_end = op.data_offset() + op.data_length();
+  }
+  return result;
+}
+
 }  // namespace
 
 bool DeltaPerformer::IsHeaderParsed() const {
@@ -387,6 +667,9 @@ MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
     *error = ErrorCode::kDownloadManifestParseError;
     return MetadataParseResult::kError;
   }
+  const size_t manifest_space = manifest_arena_.SpaceAllocated();
+  manifest_reservation_ = MemoryBudget::Get()->Reserve(
+      manifest_space, manifest_space, 1, "manifest");
 
   manifest_parsed_ = true;
   return MetadataParseResult::kSuccess;
@@ -433,13 +716,24 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
       return true;
     }
 
-    // Checks the integrity of the payload manifest.
+    // Checks the integrity of the payload manifest. The operations of the
+    // manifest cached when the update started were validated already, which
+    // takes most of the time for large payloads.
+    const string metadata_hash = GetMetadataHash();
+    string validated_hash;
+    manifest_operations_validated_ =
+        install_plan_->is_resume && !metadata_hash.empty() &&
+        prefs_->GetString(kPrefsManifestValidatedHash, &validated_hash) &&
+        validated_hash == metadata_hash;
     if ((*error = ValidateManifest()) != ErrorCode::kSuccess)
       return false;
     manifest_valid_ = true;
     if (!install_plan_->is_resume) {
       auto begin = reinterpret_cast<const char*>(buffer_.data());
       prefs_->SetString(kPrefsManifestBytes, {begin, buffer_.size()});
+      LOG_IF(WARNING,
+             !prefs_->SetString(kPrefsManifestValidatedHash, metadata_hash))
+          << "Unable to save the hash of the validated manifest.";
     }
 
     // Clear the download buffer.
@@ -448,46 +742,38 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     block_size_ = manifest_.block_size();
 
     // This populates |partitions_| and the |install_plan.partitions| with the
-    // list of partitions from the manifest.
-    if (!ParseManifestPartitions(error))
-      return false;
-
-    // |install_plan.partitions| was filled in, nothing need to be done here if
-    // the payload was already applied, returns false to terminate http fetcher,
-    // but keep |error| as ErrorCode::kSuccess.
-    if (payload_->already_applied)
-      return false;
-
-    num_total_operations_ = 0;
-    for (const auto& partition : partitions_) {
-      num_total_operations_ += partition.operations_size();
-      acc_num_operations_.push_back(num_total_operations_);
-    }
-
-    LOG_IF(WARNING,
-           !prefs_->SetInt64(kPrefsManifestMetadataSize, metadata_size_))
-        << "Unable to save the manifest metadata size.";
-    LOG_IF(WARNING,
-           !prefs_->SetInt64(kPrefsManifestSignatureSize,
-                             metadata_signature_size_))
-        << "Unable to save the manifest signature size.";
-
-    if (!PrimeUpdateState()) {
-      *error = ErrorCode::kDownloadStateInitializationError;
-      LOG(ERROR) << "Unable to prime the update state.";
+    // list of partitions from the manifest, unless that's done once the
+    // partitions are prepared in the background.
+    if (ShouldPreparePartitionsInBackground()) {
+      StartPreparingPartitions();
+    } else if (!ParseManifestPartitions(error) ||
+               !StartApplyingOperations(error)) {
       return false;
     }
+  }
 
-    if (next_operation_num_ < acc_num_operations_[current_partition_]) {
-      if (!OpenCurrentPartition()) {
-        *error = ErrorCode::kInstallDeviceOpenError;
-        return false;
-      }
+  // The data received while the partitions are prepared is kept until they
+  // are, or until there is too much of it.
+  brillo::Blob received_while_preparing;
+  if (partitions_prepared_.valid()) {
+    bytes_received_while_preparing_.insert(
+        bytes_received_while_preparing_.end(), c_bytes, c_bytes + count);
+    const uint64_t data_end =
+        manifest_.signatures_offset() + manifest_.signatures_size();
+    if (partitions_prepared_.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready &&
+        bytes_received_while_preparing_.size() <
+            preparing_reservation_.size() &&
+        buffer_.size() + bytes_received_while_preparing_.size() < data_end) {
+      return true;
     }
-
-    if (next_operation_num_ > 0)
-      UpdateOverallProgress(true, "Resuming after ");
-    LOG(INFO) << "Starting to apply update payload operations";
+    received_while_preparing = std::move(bytes_received_while_preparing_);
+    bytes_received_while_preparing_.clear();
+    preparing_reservation_.Release();
+    if (!FinishPreparingPartitions(error) || !StartApplyingOperations(error))
+      return false;
+    c_bytes = reinterpret_cast<const char*>(received_while_preparing.data());
+    count = received_while_preparing.size();
   }
 
   while (next_operation_num_ < num_total_operations_) {
@@ -500,13 +786,21 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     // We know there are more operations to perform because we didn't reach the
     // |num_total_operations_| limit yet.
     if (next_operation_num_ >= acc_num_operations_[current_partition_]) {
-      if (partition_writer_) {
-        if (!partition_writer_->FinishedInstallOps()) {
+      // At most one partition is left finishing at a time.
+      if (!JoinFinishingPartition(error)) {
+        return false;
+      }
+      if (CanFinishPartitionInBackground()) {
+        FinishCurrentPartitionInBackground();
+      } else {
+        if (!WaitForScheduledOperations(error)) {
+          return false;
+        }
+        if (!FinishCurrentPartition()) {
           *error = ErrorCode::kDownloadWriteError;
           return false;
         }
       }
-      CloseCurrentPartition();
       // Skip until there are operations for current_partition_.
       while (next_operation_num_ >= acc_num_operations_[current_partition_]) {
         current_partition_++;
@@ -520,11 +814,57 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     const InstallOperation& op =
         partitions_[current_partition_].operations(GetPartitionOperationNum());
 
-    CopyDataToBuffer(&c_bytes, &count, op.data_length());
+    // The blob of an earlier operation, already decoded: there is nothing to
+    // download for this one.
+    if (op.data_length() > 0 && op.data_offset() < buffer_offset_) {
+      if (!PerformSharedBlobOperation(op, nullptr, error))
+        return false;
+      next_operation_num_++;
+      UpdateOverallProgress(false, "Completed ");
+      CheckpointUpdateProgress(false);
+      continue;
+    }
 
-    // Check whether we received all of the next operation's data payload.
-    if (!CanPerformInstallOperation(op))
-      return true;
+    if (!streamed_op_writer_ &&
+        (resume_partial_op_bytes_ > 0 || ShouldStreamOperation(op)) &&
+        !StartStreamedOperation(op, error)) {
+      return false;
+    }
+    if (streamed_op_writer_) {
+      if (!StreamReplaceOperation(op, &c_bytes, &count, error))
+        return false;
+      if (streamed_op_writer_)
+        return true;  // Wait for the rest of the blob.
+      next_operation_num_++;
+      UpdateOverallProgress(false, "Completed ");
+      CheckpointUpdateProgress(false);
+      continue;
+    }
+
+    // When nothing of the operation is buffered yet and its whole blob is in
+    // this chunk, apply it straight from the caller's memory. Only possible
+    // when the operation is applied before returning.
+    const void* op_data = nullptr;
+    if (!apply_pool_ && buffer_.empty() && op.data_length() &&
+        op.data_offset() == buffer_offset_ && count >= op.data_length()) {
+      op_data = c_bytes;
+      c_bytes += op.data_length();
+      count -= op.data_length();
+    } else {
+      // The blob is hashed as it arrives, unless the buffer already had some
+      // of it without hashing it.
+      if (buffer_.empty()) {
+        buffered_op_hasher_.reset();
+        if (!op.data_sha256_hash().empty())
+          buffered_op_hasher_ = std::make_unique<HashCalculator>();
+      }
+      CopyDataToBuffer(&c_bytes, &count, op.data_length(), true);
+
+      // Check whether we received all of the next operation's data payload.
+      if (!CanPerformInstallOperation(op))
+        return true;
+      op_data = buffer_.data();
+    }
 
     // Validate the operation unconditionally. This helps prevent the
     // exploitation of vulnerabilities in the patching libraries, e.g. bspatch.
@@ -534,7 +874,13 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     // Note: Validate must be called only if CanPerformInstallOperation is
     // called. Otherwise, we might be failing operations before even if there
     // isn't sufficient data to compute the proper hash.
-    *error = ValidateOperationHash(op);
+    if (op_data == buffer_.data() && buffered_op_hasher_ &&
+        buffered_op_hasher_->Finalize()) {
+      *error = CheckOperationHash(op, buffered_op_hasher_->raw_hash());
+    } else {
+      *error = ValidateOperationHash(op, op_data);
+    }
+    buffered_op_hasher_.reset();
     if (*error != ErrorCode::kSuccess) {
       if (install_plan_->hash_checks_mandatory) {
         LOG(ERROR) << "Mandatory operation hash check failed";
@@ -550,50 +896,46 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     ScopedTerminatorExitUnblocker exit_unblocker =
         ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
 
-    base::TimeTicks op_start_time = base::TimeTicks::Now();
-
-    bool op_result;
-    const string op_name = InstallOperationTypeName(op.type());
-    switch (op.type()) {
-      case InstallOperation::REPLACE:
-      case InstallOperation::REPLACE_BZ:
-      case InstallOperation::REPLACE_XZ:
-        op_result = PerformReplaceOperation(op);
-        OP_DURATION_HISTOGRAM("REPLACE", op_start_time);
-        break;
-      case InstallOperation::ZERO:
-      case InstallOperation::DISCARD:
-        op_result = PerformZeroOrDiscardOperation(op);
-        OP_DURATION_HISTOGRAM("ZERO_OR_DISCARD", op_start_time);
-        break;
-      case InstallOperation::SOURCE_COPY:
-        op_result = PerformSourceCopyOperation(op, error);
-        OP_DURATION_HISTOGRAM("SOURCE_COPY", op_start_time);
-        break;
-      case InstallOperation::SOURCE_BSDIFF:
-      case InstallOperation::BROTLI_BSDIFF:
-      case InstallOperation::PUFFDIFF:
-      case InstallOperation::ZUCCHINI:
-      case InstallOperation::LZ4DIFF_PUFFDIFF:
-      case InstallOperation::LZ4DIFF_BSDIFF:
-        op_result = PerformDiffOperation(op, error);
-        OP_DURATION_HISTOGRAM(op_name, op_start_time);
-        break;
-      default:
-        op_result = false;
+    // Since we delete data off the beginning of the buffer as we use it, the
+    // data of this operation should be exactly at the beginning of the buffer.
+    // It is accounted in the payload hashes right away, so that the operation
+    // can be applied independently from the rest of the download.
+    brillo::Blob data;
+    if (op.data_length()) {
+      TEST_AND_RETURN_FALSE(buffer_offset_ == op.data_offset());
+      if (op_data == buffer_.data()) {
+        TEST_AND_RETURN_FALSE(buffer_.size() >= op.data_length());
+        data = ReleaseBuffer(buffer_.size());
+        op_data = data.data();
+      } else {
+        AccountData(op_data, op.data_length());
+      }
     }
-    if (!HandleOpResult(op_result, op_name.c_str(), error))
+
+    if (op.data_length() > 0 && shared_blob_refs_.count(op.data_offset())) {
+      if (!PerformSharedBlobOperation(op, op_data, error))
+        return false;
+    } else if (apply_pool_) {
+      if (!ScheduleInstallOperation(op, std::move(data), error))
+        return false;
+    } else if (!PerformInstallOperation(op,
+                                        next_operation_num_,
+                                        op_data,
+                                        op.data_length(),
+                                        partition_writer_.get(),
+                                        error)) {
       return false;
+    }
 
     next_operation_num_++;
     UpdateOverallProgress(false, "Completed ");
     CheckpointUpdateProgress(false);
   }
 
-  if (partition_writer_) {
-    TEST_AND_RETURN_FALSE(partition_writer_->FinishedInstallOps());
+  if (!WaitForScheduledOperations(error)) {
+    return false;
   }
-  CloseCurrentPartition();
+  TEST_AND_RETURN_FALSE(FinishCurrentPartition());
 
   // In major version 2, we don't add unused operation to the payload.
   // If we already extracted the signature we should skip this step.
@@ -631,10 +973,100 @@ bool DeltaPerformer::IsManifestValid() {
   return manifest_valid_;
 }
 
-bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
-  partitions_.assign(manifest_.partitions().begin(),
-                     manifest_.partitions().end());
+bool DeltaPerformer::StartApplyingOperations(ErrorCode* error) {
+  // |install_plan.partitions| was filled in, nothing need to be done here if
+  // the payload was already applied, returns false to terminate http fetcher,
+  // but keep |error| as ErrorCode::kSuccess.
+  if (payload_->already_applied)
+    return false;
+
+  num_total_operations_ = 0;
+  for (const auto& partition : partitions_) {
+    num_total_operations_ += partition.operations_size();
+    acc_num_operations_.push_back(num_total_operations_);
+  }
+
+  LOG_IF(WARNING, !prefs_->SetInt64(kPrefsManifestMetadataSize, metadata_size_))
+      << "Unable to save the manifest metadata size.";
+  LOG_IF(WARNING,
+         !prefs_->SetInt64(kPrefsManifestSignatureSize,
+                           metadata_signature_size_))
+      << "Unable to save the manifest signature size.";
+
+  if (!PrimeUpdateState()) {
+    *error = ErrorCode::kDownloadStateInitializationError;
+    LOG(ERROR) << "Unable to prime the update state.";
+    return false;
+  }
+
+  if (next_operation_num_ < acc_num_operations_[current_partition_]) {
+    if (!OpenCurrentPartition()) {
+      *error = ErrorCode::kInstallDeviceOpenError;
+      return false;
+    }
+  }
+
+  if (next_operation_num_ > 0)
+    UpdateOverallProgress(true, "Resuming after ");
+  LOG(INFO) << "Starting to apply update payload operations";
+  return true;
+}
+
+bool DeltaPerformer::ShouldPreparePartitionsInBackground() const {
+  // A resumed update reuses the partitions already prepared, which is quick,
+  // and only a new one knows where the data it receives ends.
+  return install_plan_->prepare_partitions_in_background &&
+         !install_plan_->is_resume &&
+         install_plan_->target_slot != BootControlInterface::kInvalidSlot &&
+         manifest_.has_signatures_offset() && manifest_.has_signatures_size();
+}
+
+void DeltaPerformer::StartPreparingPartitions() {
+  string update_check_response_hash;
+  ignore_result(prefs_->GetString(kPrefsUpdateCheckResponseHash,
+                                  &update_check_response_hash));
+  const bool update =
+      ShouldUpdatePartitionMetadata(prefs_, update_check_response_hash);
+  preparing_reservation_ = MemoryBudget::Get()->Reserve(
+      kMinPreparingBufferSize, kPreparingBufferSize, 1, "download");
+  LOG(INFO) << "Preparing the partitions in the background, keeping up to "
+            << preparing_reservation_.size() << " bytes received meanwhile.";
+  prepare_required_size_ = 0;
+  partitions_prepared_ = std::async(std::launch::async, [this, update] {
+    // Only the dynamic partition control is used here, the prefs stay on
+    // the main thread.
+    return PrepareDynamicPartitions(boot_control_,
+                                    install_plan_->target_slot,
+                                    manifest_,
+                                    update,
+                                    &prepare_required_size_);
+  });
+}
+
+bool DeltaPerformer::FinishPreparingPartitions(ErrorCode* error) {
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  const bool prepared = partitions_prepared_.get();
+  LOG(INFO) << "Waited "
+            << utils::FormatTimeDelta(base::TimeTicks::Now() - start_time)
+            << " for the partitions to be prepared.";
+  if (!prepared) {
+    *error = prepare_required_size_ > 0 ? ErrorCode::kNotEnoughSpace
+                                        : ErrorCode::kInstallDeviceOpenError;
+    return false;
+  }
+  string update_check_response_hash;
+  ignore_result(prefs_->GetString(kPrefsUpdateCheckResponseHash,
+                                  &update_check_response_hash));
+  if (!prefs_->SetString(kPrefsDynamicPartitionMetadataUpdated,
+                         update_check_response_hash)) {
+    *error = ErrorCode::kInstallDeviceOpenError;
+    return false;
+  }
+  LOG(INFO) << "PreparePartitionsForUpdate done.";
+  return ParsePreparedPartitions(error);
+}
 
+bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
   // For VAB and partial updates, the partition preparation will copy the
   // dynamic partitions metadata to the target metadata slot, and rename the
   // slot suffix of the partitions in the metadata.
@@ -649,9 +1081,10 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
       return false;
     }
   }
+  return ParsePreparedPartitions(error);
+}
 
-  // Partitions in manifest are no longer needed after preparing partitions.
-  manifest_.clear_partitions();
+bool DeltaPerformer::ParsePreparedPartitions(ErrorCode* error) {
   // TODO(xunchang) TBD: allow partial update only on devices with dynamic
   // partition.
   if (manifest_.partial_update()) {
@@ -669,9 +1102,9 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
             install_plan_->target_slot,
             touched_partitions,
             &untouched_static_partitions));
-    partitions_.insert(partitions_.end(),
-                       untouched_static_partitions.begin(),
-                       untouched_static_partitions.end());
+    for (auto& partition : untouched_static_partitions) {
+      *partitions_.Add() = std::move(partition);
+    }
 
     // Save the untouched dynamic partitions in install plan.
     std::vector<std::string> dynamic_partitions;
@@ -722,6 +1155,20 @@ bool DeltaPerformer::PreparePartitionsForUpdate(
     const DeltaArchiveManifest& manifest,
     const std::string& update_check_response_hash,
     uint64_t* required_size) {
+  const bool update =
+      ShouldUpdatePartitionMetadata(prefs, update_check_response_hash);
+  TEST_AND_RETURN_FALSE(PrepareDynamicPartitions(
+      boot_control, target_slot, manifest, update, required_size));
+
+  TEST_AND_RETURN_FALSE(prefs->SetString(kPrefsDynamicPartitionMetadataUpdated,
+                                         update_check_response_hash));
+  LOG(INFO) << "PreparePartitionsForUpdate done.";
+
+  return true;
+}
+
+bool DeltaPerformer::ShouldUpdatePartitionMetadata(
+    PrefsInterface* prefs, const std::string& update_check_response_hash) {
   string last_hash;
   ignore_result(
       prefs->GetString(kPrefsDynamicPartitionMetadataUpdated, &last_hash));
@@ -737,25 +1184,297 @@ bool DeltaPerformer::PreparePartitionsForUpdate(
               << last_hash << ", new hash = " << update_check_response_hash;
     ResetUpdateProgress(prefs, false);
   }
+  return !is_resume;
+}
 
+bool DeltaPerformer::PrepareDynamicPartitions(
+    BootControlInterface* boot_control,
+    BootControlInterface::Slot target_slot,
+    const DeltaArchiveManifest& manifest,
+    bool update,
+    uint64_t* required_size) {
   if (!boot_control->GetDynamicPartitionControl()->PreparePartitionsForUpdate(
           boot_control->GetCurrentSlot(),
           target_slot,
           manifest,
-          !is_resume /* should update */,
+          update /* should update */,
           required_size)) {
     LOG(ERROR) << "Unable to initialize partition metadata for slot "
                << BootControlInterface::SlotName(target_slot);
     return false;
   }
+  return true;
+}
 
-  TEST_AND_RETURN_FALSE(prefs->SetString(kPrefsDynamicPartitionMetadataUpdated,
-                                         update_check_response_hash));
-  LOG(INFO) << "PreparePartitionsForUpdate done.";
+bool DeltaPerformer::PerformInstallOperation(const InstallOperation& op,
+                                             size_t operation_num,
+                                             const void* data,
+                                             size_t count,
+                                             PartitionWriterInterface* writer,
+                                             ErrorCode* error) {
+  base::TimeTicks op_start_time = base::TimeTicks::Now();
+  const base::TimeDelta op_start_cpu_time =
+      PerformanceRecorder::ThreadCpuTime();
+
+  bool op_result;
+  const string op_name = InstallOperationTypeName(op.type());
+  UE_TRACE_SCOPE_F("%s #%zu: %zu bytes, %d src/%d dst extents",
+                   op_name.c_str(),
+                   operation_num,
+                   count,
+                   op.src_extents_size(),
+                   op.dst_extents_size());
+  // Applying the same payload again, the operation may be written already.
+  if (writer->IsTargetWritten(op))
+    return true;
+  switch (op.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+      op_result = PerformReplaceOperation(op, data, count, writer);
+      OP_DURATION_HISTOGRAM("REPLACE", op_start_time);
+      break;
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      op_result = PerformZeroOrDiscardOperation(op, writer);
+      OP_DURATION_HISTOGRAM("ZERO_OR_DISCARD", op_start_time);
+      break;
+    case InstallOperation::SOURCE_COPY:
+      op_result = PerformSourceCopyOperation(op, writer, error);
+      OP_DURATION_HISTOGRAM("SOURCE_COPY", op_start_time);
+      break;
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+    case InstallOperation::ZUCCHINI:
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+    case InstallOperation::LZ4DIFF_BSDIFF:
+      op_result = PerformDiffOperation(op, data, count, writer, error);
+      OP_DURATION_HISTOGRAM(op_name, op_start_time);
+      break;
+    default:
+      op_result = false;
+  }
+  if (op_result) {
+    PerformanceRecorder::Get()->AddOperation(
+        op_name,
+        partitions_[PartitionOfOperation(operation_num)].partition_name(),
+        utils::BlocksInExtents(op.src_extents()) * block_size_,
+        utils::BlocksInExtents(op.dst_extents()) * block_size_,
+        base::TimeTicks::Now() - op_start_time,
+        PerformanceRecorder::ThreadCpuTime() - op_start_cpu_time);
+  }
+  return HandleOpResult(op_result, op_name.c_str(), operation_num, error);
+}
+
+bool DeltaPerformer::ScheduleInstallOperation(const InstallOperation& op,
+                                              brillo::Blob data,
+                                              ErrorCode* error) {
+  // The blob is already in memory, but while the budget is short let the
+  // queued operations release theirs before downloading more, and only then go
+  // over it.
+  auto data_reservation = std::make_shared<MemoryBudget::Reservation>();
+  if (!MemoryBudget::Get()->TryReserve(
+          data.size(), data_reservation.get(), "operation_data")) {
+    if (!WaitForScheduledOperations(error))
+      return false;
+    *data_reservation = MemoryBudget::Get()->Reserve(
+        data.size(), data.size(), 1, "operation_data");
+  }
+
+  // With several workers the operations may complete in any order, which is
+  // only fine as long as they don't write the same blocks.
+  if (apply_pool_->num_threads() > 1) {
+    for (const Extent& extent : op.dst_extents()) {
+      if (scheduled_dst_extents_.OverlapsWithExtent(extent)) {
+        if (!WaitForScheduledOperations(error))
+          return false;
+        break;
+      }
+    }
+    scheduled_dst_extents_.AddRepeatedExtents(op.dst_extents());
+  }
+
+  // A failure of the previous partition is only known once it's joined.
+  if (finishing_partition_ &&
+      finishing_partition_->error != ErrorCode::kSuccess) {
+    *error = finishing_partition_->error;
+    return false;
+  }
+
+  // |op| points into |partitions_|, which doesn't change until all the
+  // operations are applied. The current partition may change before it is,
+  // so the task keeps the writers of this one.
+  const size_t operation_num = next_operation_num_;
+  auto task = [this,
+               &op,
+               operation_num,
+               apply_writers = apply_writers_,
+               data = std::move(data),
+               data_reservation = std::move(data_reservation)]() {
+    PartitionWriterInterface* writer =
+        AcquireIdlePartitionWriter(apply_writers.get());
+    ErrorCode op_error = ErrorCode::kSuccess;
+    const bool result = PerformInstallOperation(
+        op, operation_num, data.data(), data.size(), writer, &op_error);
+    num_queued_operations_.fetch_sub(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(apply_writers->mutex);
+    apply_writers->idle.push_back(writer);
+    if (!result && apply_writers->error == ErrorCode::kSuccess)
+      apply_writers->error = op_error;
+    return result;
+  };
+  num_queued_operations_.fetch_add(1, std::memory_order_relaxed);
+  if (!apply_pool_->Post(std::move(task))) {
+    num_queued_operations_.fetch_sub(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(apply_writers_->mutex);
+    *error = apply_writers_->error;
+    return false;
+  }
+  return true;
+}
+
+PartitionWriterInterface* DeltaPerformer::AcquireIdlePartitionWriter(
+    ApplyWriters* apply_writers) {
+  std::lock_guard<std::mutex> lock(apply_writers->mutex);
+  // There is one writer per worker, so a task never has to wait for one.
+  CHECK(!apply_writers->idle.empty());
+  PartitionWriterInterface* writer = apply_writers->idle.back();
+  apply_writers->idle.pop_back();
+  return writer;
+}
+
+size_t DeltaPerformer::PartitionOfOperation(size_t operation_num) const {
+  return std::upper_bound(acc_num_operations_.begin(),
+                          acc_num_operations_.end(),
+                          operation_num) -
+         acc_num_operations_.begin();
+}
+
+bool DeltaPerformer::WaitForScheduledOperations(ErrorCode* error) {
+  if (!JoinFinishingPartition(error))
+    return false;
+  if (!apply_pool_ || apply_pool_->Wait()) {
+    scheduled_dst_extents_ = ExtentRanges();
+    // The writers are idle, and the next operation may overwrite the blocks
+    // of an operation another writer deferred.
+    bool flushed = true;
+    if (apply_pool_ && partition_writer_) {
+      for (auto& writer : extra_partition_writers_)
+        flushed = writer->FlushDeferredOperations() && flushed;
+      flushed = partition_writer_->FlushDeferredOperations() && flushed;
+    }
+    if (flushed)
+      return true;
+    *error = ErrorCode::kDownloadOperationExecutionError;
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(apply_writers_->mutex);
+  *error = apply_writers_->error;
+  return false;
+}
+
+bool DeltaPerformer::FinishedCurrentPartitionInstallOps() {
+  if (!partition_writer_)
+    return true;
+  for (auto& writer : extra_partition_writers_) {
+    TEST_AND_RETURN_FALSE(writer->FinishedInstallOps());
+  }
+  return partition_writer_->FinishedInstallOps();
+}
+
+bool DeltaPerformer::FinishCurrentPartition() {
+  TEST_AND_RETURN_FALSE(FinishedCurrentPartitionInstallOps());
+  // Every write reaches the partition once its writers are closed.
+  auto verity_writer = std::move(streaming_verity_writer_);
+  CloseCurrentPartition();
+  FinishWrittenPartition(current_partition_, std::move(verity_writer));
+  return true;
+}
 
+bool DeltaPerformer::CanFinishPartitionInBackground() const {
+  // A streamed operation is applied by |partition_writer_| itself.
+  return install_plan_->concurrent_partitions && apply_pool_ &&
+         partition_writer_ && !streamed_op_writer_;
+}
+
+void DeltaPerformer::FinishCurrentPartitionInBackground() {
+  LOG(INFO) << "Opening the next partition while the last operations of "
+            << partitions_[current_partition_].partition_name()
+            << " are applied.";
+  auto finishing = std::make_unique<FinishingPartition>();
+  finishing->partition_index = current_partition_;
+  finishing->open_time = partition_open_time_;
+  finishing->verity_writer = std::move(streaming_verity_writer_);
+  finishing->partition_writer = std::move(partition_writer_);
+  finishing->extra_writers.swap(extra_partition_writers_);
+  finishing->apply_writers = std::move(apply_writers_);
+  finishing->apply_reservation = std::move(apply_reservation_);
+  finishing->apply_pool = std::move(apply_pool_);
+  // The partitions don't share any block.
+  scheduled_dst_extents_ = ExtentRanges();
+  finishing_partition_ = std::move(finishing);
+}
+
+bool DeltaPerformer::JoinFinishingPartition(ErrorCode* error) {
+  if (!finishing_partition_)
+    return true;
+  FinishingPartition* finishing = finishing_partition_.get();
+  if (finishing->error == ErrorCode::kSuccess &&
+      !finishing->apply_pool->Wait()) {
+    std::lock_guard<std::mutex> lock(finishing->apply_writers->mutex);
+    finishing->error = finishing->apply_writers->error;
+  }
+  std::vector<PartitionWriterInterface*> writers = {
+      finishing->partition_writer.get()};
+  for (auto& writer : finishing->extra_writers)
+    writers.push_back(writer.get());
+  if (finishing->error == ErrorCode::kSuccess) {
+    bool flushed = true;
+    for (PartitionWriterInterface* writer : writers)
+      flushed = writer->FlushDeferredOperations() && flushed;
+    if (!flushed)
+      finishing->error = ErrorCode::kDownloadOperationExecutionError;
+  }
+  for (PartitionWriterInterface* writer : writers) {
+    if (finishing->error != ErrorCode::kSuccess)
+      break;
+    if (!writer->FinishedInstallOps())
+      finishing->error = ErrorCode::kDownloadWriteError;
+  }
+  if (finishing->error != ErrorCode::kSuccess) {
+    *error = finishing->error;
+    return false;
+  }
+  const size_t partition_index = finishing->partition_index;
+  // Every write reaches the partition once its writers are closed.
+  auto verity_writer = std::move(finishing->verity_writer);
+  CloseFinishingPartition();
+  FinishWrittenPartition(partition_index, std::move(verity_writer));
   return true;
 }
 
+void DeltaPerformer::FinishWrittenPartition(
+    size_t partition_index,
+    std::unique_ptr<StreamingVerityWriter> verity_writer) {
+  size_t num_previous_partitions =
+      install_plan_->partitions.size() - partitions_.size();
+  InstallPlan::Partition& install_part =
+      install_plan_->partitions[num_previous_partitions + partition_index];
+  if (verity_writer) {
+    install_part.verity_written = verity_writer->Finalize();
+    LOG_IF(WARNING, !install_part.verity_written)
+        << "Unable to write the verity data of " << install_part.name
+        << ", leaving it to FilesystemVerifierAction.";
+  }
+  if (install_plan_->verify_during_apply &&
+      BackgroundPartitionHasher::CanHash(install_part,
+                                         install_plan_->write_verity)) {
+    background_hasher_.Hash(install_part);
+  }
+}
+
 bool DeltaPerformer::CanPerformInstallOperation(
     const chromeos_update_engine::InstallOperation& operation) {
   // If we don't have a data blob we can apply it right away.
@@ -772,25 +1491,228 @@ bool DeltaPerformer::CanPerformInstallOperation(
           buffer_offset_ + buffer_.size());
 }
 
-bool DeltaPerformer::PerformReplaceOperation(
-    const InstallOperation& operation) {
+bool DeltaPerformer::ShouldStreamOperation(
+    const InstallOperation& operation) const {
+  return install_plan_->stream_replace_operations &&
+         (operation.type() == InstallOperation::REPLACE ||
+          operation.type() == InstallOperation::REPLACE_BZ ||
+          operation.type() == InstallOperation::REPLACE_XZ ||
+          operation.type() == InstallOperation::REPLACE_ZSTD) &&
+         operation.data_length() >= kMinStreamedOperationSize &&
+         buffer_.empty() && operation.data_offset() == buffer_offset_ &&
+         !shared_blob_refs_.count(operation.data_offset()) &&
+         // The target blocks are checked before the blob is applied.
+         !(install_plan_->skip_written_operations &&
+           operation.has_dst_sha256_hash());
+}
+
+bool DeltaPerformer::StartStreamedOperation(const InstallOperation& operation,
+                                            ErrorCode* error) {
+  // The streamed operation is applied on this thread through
+  // |partition_writer_|, which may be in use by a worker.
+  if (!WaitForScheduledOperations(error))
+    return false;
+  const uint64_t resumed_bytes = resume_partial_op_bytes_;
+  resume_partial_op_bytes_ = 0;
+  if (resumed_bytes == 0) {
+    streamed_op_writer_ = partition_writer_->CreateReplaceWriter(operation);
+    if (!streamed_op_writer_) {
+      LOG(WARNING) << "Buffering the blob of operation "
+                   << next_operation_num_ + 1 << ", it can't be streamed";
+      return true;
+    }
+    streamed_op_hasher_ = std::make_unique<HashCalculator>();
+    streamed_op_bytes_ = 0;
+    return true;
+  }
+
+  // Resuming in the middle of the operation, only the blocks not written yet
+  // are left to write.
+  *error = ErrorCode::kDownloadStateInitializationError;
+  if (!CanCheckpointPartialOperation(operation) ||
+      resumed_bytes >= operation.data_length() ||
+      resumed_bytes % block_size_ != 0 || !buffer_.empty() ||
+      operation.data_offset() != buffer_offset_) {
+    LOG(ERROR) << "Unable to resume operation " << next_operation_num_ + 1
+               << " after " << resumed_bytes << " bytes.";
+    return false;
+  }
+  InstallOperation remaining = operation;
+  remaining.clear_dst_extents();
+  RepeatedPtrField<Extent> written;
+  uint64_t skipped_blocks = resumed_bytes / block_size_;
+  for (const Extent& extent : operation.dst_extents()) {
+    const uint64_t skipped = min<uint64_t>(skipped_blocks, extent.num_blocks());
+    if (skipped > 0)
+      *written.Add() = ExtentForRange(extent.start_block(), skipped);
+    if (skipped < extent.num_blocks()) {
+      *remaining.add_dst_extents() = ExtentForRange(
+          extent.start_block() + skipped, extent.num_blocks() - skipped);
+    }
+    skipped_blocks -= skipped;
+  }
+  streamed_op_writer_ = partition_writer_->CreateReplaceWriter(remaining);
+  streamed_op_hasher_ = std::make_unique<HashCalculator>();
+  if (!streamed_op_writer_ ||
+      !streamed_op_hasher_->SetContext(resume_partial_op_hash_context_)) {
+    LOG(ERROR) << "Unable to resume operation " << next_operation_num_ + 1
+               << " after " << resumed_bytes << " bytes.";
+    streamed_op_writer_.reset();
+    streamed_op_hasher_.reset();
+    return false;
+  }
+  if (streaming_verity_writer_)
+    streaming_verity_writer_->MarkWritten(written);
+  streamed_op_bytes_ = resumed_bytes;
+  LOG(INFO) << "Resuming operation " << next_operation_num_ + 1 << " after "
+            << resumed_bytes << " bytes of its blob.";
+  *error = ErrorCode::kSuccess;
+  return true;
+}
+
+bool DeltaPerformer::CanCheckpointPartialOperation(
+    const InstallOperation& operation) const {
+  return operation.type() == InstallOperation::REPLACE &&
+         extra_partition_writers_.empty();
+}
+
+bool DeltaPerformer::StreamReplaceOperation(const InstallOperation& operation,
+                                            const char** bytes_p,
+                                            size_t* count_p,
+                                            ErrorCode* error) {
+  while (*count_p > 0 && streamed_op_bytes_ < operation.data_length()) {
+    size_t length =
+        min<uint64_t>(*count_p, operation.data_length() - streamed_op_bytes_);
+    // A checkpoint due is taken at the last block boundary in these bytes.
+    bool checkpoint = false;
+    if (CanCheckpointPartialOperation(operation) && ShouldCheckpoint()) {
+      const uint64_t boundary =
+          (streamed_op_bytes_ + length) / block_size_ * block_size_;
+      if (boundary > streamed_op_bytes_ && boundary < operation.data_length()) {
+        length = boundary - streamed_op_bytes_;
+        checkpoint = true;
+      }
+    }
+    payload_hash_calculator_.Update(*bytes_p, length);
+    signed_hash_calculator_.Update(*bytes_p, length);
+    if (!streamed_op_hasher_->Update(*bytes_p, length) ||
+        !streamed_op_writer_->Write(*bytes_p, length)) {
+      LOG(ERROR) << "Failed to write " << length << " bytes of operation "
+                 << next_operation_num_ + 1;
+      *error = ErrorCode::kDownloadOperationExecutionError;
+      return false;
+    }
+    streamed_op_bytes_ += length;
+    *bytes_p += length;
+    *count_p -= length;
+    if (checkpoint)
+      CheckpointPartialOperation(operation);
+  }
+  if (streamed_op_bytes_ < operation.data_length())
+    return true;
+
+  // Releases the decompressor before the hash check. It has written all its
+  // output as the blob came in; the hash of the blob is what catches a
+  // truncated or corrupt stream.
+  streamed_op_writer_.reset();
+  TEST_AND_RETURN_FALSE(streamed_op_hasher_->Finalize());
+  *error = CheckOperationHash(operation, streamed_op_hasher_->raw_hash());
+  streamed_op_hasher_.reset();
+  streamed_op_bytes_ = 0;
+  if (*error != ErrorCode::kSuccess) {
+    if (install_plan_->hash_checks_mandatory) {
+      // The blocks written stay unaccounted, a resumed update writes this
+      // operation again.
+      LOG(ERROR) << "Mandatory operation hash check failed";
+      return false;
+    }
+    LOG(WARNING) << "Ignoring operation validation errors";
+    *error = ErrorCode::kSuccess;
+  }
+  buffer_offset_ += operation.data_length();
+  return true;
+}
+
+bool DeltaPerformer::PerformReplaceOperation(const InstallOperation& operation,
+                                             const void* data,
+                                             size_t count,
+                                             PartitionWriterInterface* writer) {
   CHECK(operation.type() == InstallOperation::REPLACE ||
         operation.type() == InstallOperation::REPLACE_BZ ||
-        operation.type() == InstallOperation::REPLACE_XZ);
+        operation.type() == InstallOperation::REPLACE_XZ ||
+        operation.type() == InstallOperation::REPLACE_ZSTD);
+
+  TEST_AND_RETURN_FALSE(count >= operation.data_length());
+
+  return writer->PerformReplaceOperation(operation, data, count);
+}
+
+bool DeltaPerformer::PerformSharedBlobOperation(const InstallOperation& op,
+                                                const void* data,
+                                                ErrorCode* error) {
+  // The operation is applied on this thread through |partition_writer_|,
+  // which may be in use by a worker.
+  if (!WaitForScheduledOperations(error))
+    return false;
 
-  // Since we delete data off the beginning of the buffer as we use it,
-  // the data we need should be exactly at the beginning of the buffer.
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  auto it = shared_blob_cache_.find(op.data_offset());
+  if (data) {
+    const uint64_t size =
+        utils::BlocksInExtents(op.dst_extents()) * block_size_;
+    it = shared_blob_cache_.emplace(op.data_offset(), SharedBlob()).first;
+    SharedBlob& blob = it->second;
+    blob.refs_left = shared_blob_refs_[op.data_offset()];
+    blob.reservation =
+        MemoryBudget::Get()->Reserve(size, size, 1, "shared_blobs");
+    InstallOperationExecutor executor(block_size_);
+    if (op.type() == InstallOperation::REPLACE_ZSTD &&
+        !executor.SetZstdDictionary(
+            partitions_[current_partition_].zstd_dictionary())) {
+      *error = ErrorCode::kDownloadOperationExecutionError;
+      return false;
+    }
+    if (!executor.ExecuteReplaceOperation(
+            op,
+            std::make_unique<BlobExtentWriter>(&blob.data),
+            data,
+            op.data_length()) ||
+        blob.data.size() != size) {
+      LOG(ERROR) << "Unable to decode the shared blob of operation "
+                 << next_operation_num_ + 1 << ".";
+      shared_blob_cache_.erase(it);
+      *error = ErrorCode::kDownloadOperationExecutionError;
+      return false;
+    }
+  } else if (it == shared_blob_cache_.end()) {
+    LOG(ERROR) << "The shared blob of operation " << next_operation_num_ + 1
+               << " wasn't decoded by an earlier operation.";
+    *error = ErrorCode::kDownloadOperationExecutionError;
+    return false;
+  } else {
+    it->second.refs_left--;
+  }
 
-  TEST_AND_RETURN_FALSE(partition_writer_->PerformReplaceOperation(
-      operation, buffer_.data(), buffer_.size()));
-  // Update buffer
-  DiscardBuffer(true, buffer_.size());
+  // The decoded data is written as the blob of a REPLACE operation.
+  const brillo::Blob& decoded = it->second.data;
+  InstallOperation replace;
+  replace.set_type(InstallOperation::REPLACE);
+  replace.set_data_length(decoded.size());
+  *replace.mutable_dst_extents() = op.dst_extents();
+  if (!PerformInstallOperation(replace,
+                               next_operation_num_,
+                               decoded.data(),
+                               decoded.size(),
+                               partition_writer_.get(),
+                               error)) {
+    return false;
+  }
+  if (it->second.refs_left == 0)
+    shared_blob_cache_.erase(it);
   return true;
 }
 
 bool DeltaPerformer::PerformZeroOrDiscardOperation(
-    const InstallOperation& operation) {
+    const InstallOperation& operation, PartitionWriterInterface* writer) {
   CHECK(operation.type() == InstallOperation::DISCARD ||
         operation.type() == InstallOperation::ZERO);
 
@@ -798,16 +1720,18 @@ bool DeltaPerformer::PerformZeroOrDiscardOperation(
   TEST_AND_RETURN_FALSE(!operation.has_data_offset());
   TEST_AND_RETURN_FALSE(!operation.has_data_length());
 
-  return partition_writer_->PerformZeroOrDiscardOperation(operation);
+  return writer->PerformZeroOrDiscardOperation(operation);
 }
 
 bool DeltaPerformer::PerformSourceCopyOperation(
-    const InstallOperation& operation, ErrorCode* error) {
+    const InstallOperation& operation,
+    PartitionWriterInterface* writer,
+    ErrorCode* error) {
   if (operation.has_src_length())
     TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
   if (operation.has_dst_length())
     TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
-  return partition_writer_->PerformSourceCopyOperation(operation, error);
+  return writer->PerformSourceCopyOperation(operation, error);
 }
 
 bool DeltaPerformer::ExtentsToBsdiffPositionsString(
@@ -833,20 +1757,17 @@ bool DeltaPerformer::ExtentsToBsdiffPositionsString(
 }
 
 bool DeltaPerformer::PerformDiffOperation(const InstallOperation& operation,
+                                          const void* data,
+                                          size_t count,
+                                          PartitionWriterInterface* writer,
                                           ErrorCode* error) {
-  // Since we delete data off the beginning of the buffer as we use it,
-  // the data we need should be exactly at the beginning of the buffer.
-  TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(count >= operation.data_length());
   if (operation.has_src_length())
     TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
   if (operation.has_dst_length())
     TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
 
-  TEST_AND_RETURN_FALSE(partition_writer_->PerformDiffOperation(
-      operation, error, buffer_.data(), buffer_.size()));
-  DiscardBuffer(true, buffer_.size());
-  return true;
+  return writer->PerformDiffOperation(operation, error, data, count);
 }
 
 bool DeltaPerformer::ExtractSignatureMessage() {
@@ -974,6 +1895,173 @@ ErrorCode DeltaPerformer::ValidateManifest() {
   // TODO(crbug.com/37661) we should be adding more and more manifest checks,
   // such as partition boundaries, etc.
 
+  if (manifest_operations_validated_) {
+    LOG(INFO) << "Skipping the validation of the manifest operations, done "
+                 "before the update was resumed.";
+  } else {
+    const ErrorCode error = ValidateManifestOperations(actual_payload_type);
+    if (error != ErrorCode::kSuccess)
+      return error;
+  }
+  // The shared blobs are needed to apply the operations, even when resuming.
+  return IndexSharedBlobs();
+}
+
+string DeltaPerformer::GetMetadataHash() const {
+  brillo::Blob hash;
+  if (!HashCalculator::RawHashOfBytes(buffer_.data(), buffer_.size(), &hash))
+    return "";
+  return base::HexEncode(hash.data(), hash.size());
+}
+
+ErrorCode DeltaPerformer::ValidateManifestOperations(
+    InstallPayloadType payload_type) const {
+  const base::TimeTicks start = base::TimeTicks::Now();
+  const auto& partitions = manifest_.partitions();
+  int num_operations = 0;
+  for (const auto& partition : partitions) {
+    num_operations += partition.operations_size();
+    if (partition.has_zstd_dictionary() &&
+        payload_type != InstallPayloadType::kFull &&
+        manifest_.minor_version() < kZstdDictionaryMinorPayloadVersion) {
+      LOG(ERROR) << "Partition " << partition.partition_name()
+                 << " has a zstd dictionary, which minor version "
+                 << manifest_.minor_version() << " doesn't support.";
+      return ErrorCode::kPayloadMismatchedType;
+    }
+  }
+  const bool shared_blobs =
+      SharedBlobsAllowed(payload_type, manifest_.minor_version());
+  vector<PartitionValidation> results(partitions.size());
+  size_t num_threads = std::min<size_t>(
+      {static_cast<size_t>(partitions.size()),
+       kMaxManifestValidationThreads,
+       std::max(std::thread::hardware_concurrency(), 1u)});
+  if (num_operations < kMinOperationsForParallelValidation) {
+    num_threads = 1;
+  }
+  if (num_threads > 1) {
+    WorkerPool pool(num_threads, partitions.size());
+    for (int i = 0; i < partitions.size(); i++) {
+      CHECK(pool.Post([&partitions, &results, payload_type, shared_blobs, i]() {
+        results[i] = ValidatePartitionOperations(
+            partitions[i], payload_type, shared_blobs);
+        return true;
+      }));
+    }
+    CHECK(pool.Wait());
+  } else {
+    for (int i = 0; i < partitions.size(); i++) {
+      results[i] = ValidatePartitionOperations(
+          partitions[i], payload_type, shared_blobs);
+    }
+  }
+
+  // The partitions are applied in order too, so their blobs must follow each
+  // other.
+  uint64_t data_end = 0;
+  for (int i = 0; i < partitions.size(); i++) {
+    const PartitionValidation& result = results[i];
+    if (result.error != ErrorCode::kSuccess) {
+      return result.error;
+    }
+    if (result.data_end == 0) {
+      continue;
+    }
+    if (result.data_begin < data_end) {
+      LOG(ERROR) << "The blobs of partition " << partitions[i].partition_name()
+                 << " start at " << result.data_begin
+                 << ", before the end of the previous partition's at "
+                 << data_end << ".";
+      return ErrorCode::kDownloadManifestParseError;
+    }
+    data_end = result.data_end;
+  }
+  const base::TimeDelta duration = base::TimeTicks::Now() - start;
+  LOG(INFO) << "Validated " << num_operations << " operations of "
+            << partitions.size() << " partitions with " << num_threads
+            << " thread(s) in " << utils::FormatTimeDelta(duration);
+  return ErrorCode::kSuccess;
+}
+
+ErrorCode DeltaPerformer::IndexSharedBlobs() {
+  shared_blob_refs_.clear();
+  if (!SharedBlobsAllowed(payload_->type, manifest_.minor_version()))
+    return ErrorCode::kSuccess;
+
+  // The operations using each blob: the first one, and the indexes of the
+  // first and last ones in the payload.
+  struct BlobUses {
+    const InstallOperation* op;
+    size_t first;
+    size_t last;
+  };
+  std::map<uint64_t, BlobUses> blobs;
+  uint64_t data_end = 0;
+  size_t index = 0;
+  for (const PartitionUpdate& partition : manifest_.partitions()) {
+    for (int i = 0; i < partition.operations_size(); i++, index++) {
+      const InstallOperation& op = partition.operations(i);
+      if (op.data_length() == 0)
+        continue;
+      if (op.data_offset() >= data_end) {
+        blobs[op.data_offset()] = {&op, index, index};
+        data_end = op.data_offset() + op.data_length();
+        continue;
+      }
+      // Only an identical REPLACE operation may use the blob again, so that
+      // its decoded data can be written as is.
+      auto it = blobs.find(op.data_offset());
+      const InstallOperation* first =
+          it == blobs.end() ? nullptr : it->second.op;
+      if (!first || first->type() != op.type() ||
+          (op.type() != InstallOperation::REPLACE &&
+           op.type() != InstallOperation::REPLACE_BZ &&
+           op.type() != InstallOperation::REPLACE_XZ &&
+           op.type() != InstallOperation::REPLACE_ZSTD) ||
+          first->data_length() != op.data_length() ||
+          first->data_sha256_hash() != op.data_sha256_hash() ||
+          utils::BlocksInExtents(first->dst_extents()) !=
+              utils::BlocksInExtents(op.dst_extents())) {
+        LOG(ERROR) << "Operation " << i << " of partition "
+                   << partition.partition_name() << " has its blob at "
+                   << op.data_offset() << " (" << op.data_length()
+                   << " bytes), before the previous one ending at "
+                   << data_end << " but not shared with an identical "
+                   << "operation.";
+        return ErrorCode::kDownloadManifestParseError;
+      }
+      it->second.last = index;
+      shared_blob_refs_[op.data_offset()]++;
+    }
+  }
+
+  // The decoded data of a shared blob is kept from its first operation to its
+  // last one. The blobs are in the order of their first operation.
+  std::multimap<size_t, uint64_t> cached;
+  uint64_t cached_bytes = 0;
+  for (const auto& [offset, uses] : blobs) {
+    if (uses.last == uses.first)
+      continue;
+    while (!cached.empty() && cached.begin()->first < uses.first) {
+      cached_bytes -= cached.begin()->second;
+      cached.erase(cached.begin());
+    }
+    const uint64_t size = utils::BlocksInExtents(uses.op->dst_extents()) *
+                          manifest_.block_size();
+    cached.emplace(uses.last, size);
+    cached_bytes += size;
+    if (cached_bytes > kMaxSharedBlobCacheSize) {
+      LOG(ERROR) << "The shared blobs need " << cached_bytes
+                 << " bytes of decoded data at once, more than "
+                 << kMaxSharedBlobCacheSize << ".";
+      return ErrorCode::kDownloadManifestParseError;
+    }
+  }
+  if (!shared_blob_refs_.empty()) {
+    LOG(INFO) << shared_blob_refs_.size() << " blobs are shared by several "
+              << "operations.";
+  }
   return ErrorCode::kSuccess;
 }
 
@@ -1068,7 +2156,20 @@ ErrorCode DeltaPerformer::CheckTimestampError() const {
 }
 
 ErrorCode DeltaPerformer::ValidateOperationHash(
-    const InstallOperation& operation) {
+    const InstallOperation& operation, const void* data) {
+  brillo::Blob calculated_op_hash;
+  if (operation.data_sha256_hash().size() &&
+      !HashCalculator::RawHashOfBytes(
+          data, operation.data_length(), &calculated_op_hash)) {
+    LOG(ERROR) << "Unable to compute actual hash of operation "
+               << next_operation_num_;
+    return ErrorCode::kDownloadOperationHashVerificationError;
+  }
+  return CheckOperationHash(operation, calculated_op_hash);
+}
+
+ErrorCode DeltaPerformer::CheckOperationHash(
+    const InstallOperation& operation, const brillo::Blob& calculated_op_hash) {
   if (!operation.data_sha256_hash().size()) {
     if (!operation.data_length()) {
       // Operations that do not have any data blob won't have any operation
@@ -1110,14 +2211,6 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
                           (operation.data_sha256_hash().data() +
                            operation.data_sha256_hash().size()));
 
-  brillo::Blob calculated_op_hash;
-  if (!HashCalculator::RawHashOfBytes(
-          buffer_.data(), operation.data_length(), &calculated_op_hash)) {
-    LOG(ERROR) << "Unable to compute actual hash of operation "
-               << next_operation_num_;
-    return ErrorCode::kDownloadOperationHashVerificationError;
-  }
-
   if (calculated_op_hash != expected_op_hash) {
     LOG(ERROR) << "Hash verification failed for operation "
                << next_operation_num_
@@ -1206,6 +2299,22 @@ void DeltaPerformer::DiscardBuffer(bool do_advance_offset,
   brillo::Blob().swap(buffer_);
 }
 
+void DeltaPerformer::AccountData(const void* data, size_t count) {
+  CHECK(buffer_.empty());
+  buffer_offset_ += count;
+  payload_hash_calculator_.Update(data, count);
+  signed_hash_calculator_.Update(data, count);
+}
+
+brillo::Blob DeltaPerformer::ReleaseBuffer(size_t signed_hash_buffer_size) {
+  buffer_offset_ += buffer_.size();
+  payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
+  signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+  brillo::Blob data;
+  data.swap(buffer_);
+  return data;
+}
+
 bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
                                      const string& update_check_response_hash) {
   int64_t next_operation = kUpdateStateOperationInvalid;
@@ -1257,6 +2366,10 @@ bool DeltaPerformer::ResetUpdateProgress(
     bool skip_dynamic_partititon_metadata_updated) {
   TEST_AND_RETURN_FALSE(prefs->SetInt64(kPrefsUpdateStateNextOperation,
                                         kUpdateStateOperationInvalid));
+  if (prefs->Exists(kPrefsUpdateStatePartialOperationBytes)) {
+    prefs->Delete(kPrefsUpdateStatePartialOperationBytes);
+    prefs->Delete(kPrefsUpdateStatePartialOperationSHA256Context);
+  }
   if (!quick) {
     prefs->SetInt64(kPrefsUpdateStateNextDataOffset, -1);
     prefs->SetInt64(kPrefsUpdateStateNextDataLength, 0);
@@ -1265,9 +2378,20 @@ bool DeltaPerformer::ResetUpdateProgress(
     prefs->SetString(kPrefsUpdateStateSignatureBlob, "");
     prefs->SetInt64(kPrefsManifestMetadataSize, -1);
     prefs->SetInt64(kPrefsManifestSignatureSize, -1);
+    prefs->Delete(kPrefsManifestValidatedHash);
     prefs->SetInt64(kPrefsResumedUpdateFailures, 0);
     prefs->Delete(kPrefsPostInstallSucceeded);
     prefs->Delete(kPrefsVerityWritten);
+    std::vector<std::string> verify_checkpoint_keys;
+    prefs->GetSubKeys(kPrefsVerifyCheckpoint, &verify_checkpoint_keys);
+    for (const auto& key : verify_checkpoint_keys) {
+      prefs->Delete(key);
+    }
+    std::vector<std::string> postinstall_done_keys;
+    prefs->GetSubKeys(kPrefsPostinstallDone, &postinstall_done_keys);
+    for (const auto& key : postinstall_done_keys) {
+      prefs->Delete(key);
+    }
 
     if (!skip_dynamic_partititon_metadata_updated) {
       LOG(INFO) << "Resetting recorded hash for prepared partitions.";
@@ -1278,19 +2402,103 @@ bool DeltaPerformer::ResetUpdateProgress(
 }
 
 bool DeltaPerformer::ShouldCheckpoint() {
-  base::TimeTicks curr_time = base::TimeTicks::Now();
-  if (curr_time > update_checkpoint_time_) {
-    update_checkpoint_time_ = curr_time + update_checkpoint_wait_;
-    return true;
-  }
-  return false;
+  // The bytes of the operation being streamed are applied too.
+  return checkpoint_policy_.ShouldCheckpoint(
+      base::TimeTicks::Now(),
+      PerformanceRecorder::ProcessCpuTime(),
+      buffer_offset_ + streamed_op_bytes_);
 }
 
 bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
   if (!force && !ShouldCheckpoint()) {
     return false;
   }
+  // The payload hashes already include part of the streamed operation, which
+  // can't be resumed from the middle.
+  if (streamed_op_writer_) {
+    return false;
+  }
+  // The decoded data of the shared blobs is lost when interrupted, so the
+  // update resumes from before their first operation.
+  if (!shared_blob_cache_.empty()) {
+    return false;
+  }
+  // Everything up to |next_operation_num_| was already accounted in the payload
+  // hashes and |buffer_offset_|, so the operations still in flight must be
+  // applied before that state can be persisted, as well as the last ones of
+  // the previous partition. A failure is reported to the caller of Write() by
+  // the next operation scheduled.
+  ErrorCode finishing_error;
+  if (!JoinFinishingPartition(&finishing_error)) {
+    return false;
+  }
+  if (apply_pool_ && !apply_pool_->Wait()) {
+    return false;
+  }
+  // So are the operations the writers deferred to merge them. A failure is
+  // reported by FinishedInstallOps().
+  if (partition_writer_) {
+    bool flushed = true;
+    for (auto& writer : extra_partition_writers_)
+      flushed = writer->FlushDeferredOperations() && flushed;
+    if (!partition_writer_->FlushDeferredOperations() || !flushed)
+      return false;
+  }
   Terminator::set_exit_blocked(true);
+  // The keys of a checkpoint are stored all at once, so that an interrupted
+  // checkpoint leaves the previous one.
+  const base::TimeTicks start = base::TimeTicks::Now();
+  TEST_AND_RETURN_FALSE(prefs_->StartTransaction());
+  const bool saved = SaveUpdateProgress(force);
+  TEST_AND_RETURN_FALSE(prefs_->SubmitTransaction());
+  const base::TimeTicks end = base::TimeTicks::Now();
+  checkpoint_policy_.CheckpointDone(
+      end, end - start, PerformanceRecorder::ProcessCpuTime(), buffer_offset_);
+  return saved;
+}
+
+bool DeltaPerformer::CheckpointPartialOperation(
+    const InstallOperation& operation) {
+  Terminator::set_exit_blocked(true);
+  ScopedTerminatorExitUnblocker exit_unblocker;
+  const base::TimeTicks start = base::TimeTicks::Now();
+  // The written blocks must be persisted before the checkpoint pointing past
+  // them.
+  if (!partition_writer_->CheckpointPartialOperation(
+          GetPartitionOperationNum(), streamed_op_bytes_ / block_size_)) {
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(prefs_->StartTransaction());
+  ResetUpdateProgress(prefs_, true);
+  TEST_AND_RETURN_FALSE(prefs_->SetString(
+      kPrefsUpdateStateSHA256Context, payload_hash_calculator_.GetContext()));
+  TEST_AND_RETURN_FALSE(
+      prefs_->SetString(kPrefsUpdateStateSignedSHA256Context,
+                        signed_hash_calculator_.GetContext()));
+  TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextDataOffset,
+                                         buffer_offset_ + streamed_op_bytes_));
+  TEST_AND_RETURN_FALSE(
+      prefs_->SetInt64(kPrefsUpdateStateNextDataLength,
+                       operation.data_length() - streamed_op_bytes_));
+  TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStatePartialOperationBytes,
+                                         streamed_op_bytes_));
+  TEST_AND_RETURN_FALSE(
+      prefs_->SetString(kPrefsUpdateStatePartialOperationSHA256Context,
+                        streamed_op_hasher_->GetContext()));
+  TEST_AND_RETURN_FALSE(
+      prefs_->SetInt64(kPrefsUpdateStateNextOperation, next_operation_num_));
+  TEST_AND_RETURN_FALSE(prefs_->SubmitTransaction());
+  // The next full checkpoint must save the state again.
+  last_updated_operation_num_ = std::numeric_limits<uint64_t>::max();
+  const base::TimeTicks end = base::TimeTicks::Now();
+  checkpoint_policy_.CheckpointDone(end,
+                                    end - start,
+                                    PerformanceRecorder::ProcessCpuTime(),
+                                    buffer_offset_ + streamed_op_bytes_);
+  return true;
+}
+
+bool DeltaPerformer::SaveUpdateProgress(bool force) {
   if (last_updated_operation_num_ != next_operation_num_ || force) {
     // Resets the progress in case we die in the middle of the state update.
     ResetUpdateProgress(prefs_, true);
@@ -1335,6 +2543,9 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
           prefs_->SetInt64(kPrefsUpdateStateNextDataLength, 0));
     }
     if (partition_writer_) {
+      for (auto& writer : extra_partition_writers_) {
+        writer->CheckpointUpdateProgress(GetPartitionOperationNum());
+      }
       partition_writer_->CheckpointUpdateProgress(GetPartitionOperationNum());
     } else {
       CHECK_EQ(next_operation_num_, num_total_operations_)
@@ -1366,6 +2577,20 @@ bool DeltaPerformer::PrimeUpdateState() {
       next_data_offset >= 0);
   buffer_offset_ = next_data_offset;
 
+  // A checkpoint in the middle of a streamed operation points past the bytes
+  // of its blob already written, |buffer_offset_| is still where it starts.
+  int64_t partial_op_bytes = 0;
+  if (prefs_->GetInt64(kPrefsUpdateStatePartialOperationBytes,
+                       &partial_op_bytes) &&
+      partial_op_bytes > 0) {
+    TEST_AND_RETURN_FALSE(partial_op_bytes <= next_data_offset);
+    TEST_AND_RETURN_FALSE(
+        prefs_->GetString(kPrefsUpdateStatePartialOperationSHA256Context,
+                          &resume_partial_op_hash_context_));
+    buffer_offset_ = next_data_offset - partial_op_bytes;
+    resume_partial_op_bytes_ = partial_op_bytes;
+  }
+
   // The signed hash context and the signature blob may be empty if the
   // interrupted update didn't reach the signature.
   string signed_hash_context;
@@ -1396,7 +2621,7 @@ bool DeltaPerformer::PrimeUpdateState() {
 
   // Advance the download progress to reflect what doesn't need to be
   // re-downloaded.
-  total_bytes_received_ += buffer_offset_;
+  total_bytes_received_ += next_data_offset;
 
   // Speculatively count the resume as a failure.
   int64_t resumed_update_failures;
@@ -19,25 +19,37 @@
 
 #include <inttypes.h>
 
+#include <atomic>
 #include <limits>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <base/time/time.h>
 #include <brillo/secure_blob.h>
+#include <google/protobuf/arena.h>
 #include <google/protobuf/repeated_field.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/memory_budget.h"
 #include "update_engine/common/platform_constants.h"
+#include "update_engine/common/worker_pool.h"
+#include "update_engine/payload_consumer/background_partition_hasher.h"
+#include "update_engine/payload_consumer/checkpoint_policy.h"
+#include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_writer.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/partition_writer.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
+#include "update_engine/payload_consumer/streaming_verity_writer.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -63,7 +75,6 @@ class DeltaPerformer : public FileWriter {
   // operations. They must add up to one hundred (100).
   static const unsigned kProgressDownloadWeight;
   static const unsigned kProgressOperationsWeight;
-  static const uint64_t kCheckpointFrequencySeconds;
 
   DeltaPerformer(
       PrefsInterface* prefs,
@@ -109,6 +120,10 @@ class DeltaPerformer : public FileWriter {
   // or -errno on error.
   int CloseCurrentPartition();
 
+  // Closes the writers of |finishing_partition_|, if any, once its operations
+  // in flight are applied. Returns 0 on success or -errno on error.
+  int CloseFinishingPartition();
+
   // Returns |true| only if the manifest has been processed and it's valid.
   bool IsManifestValid();
 
@@ -174,6 +189,9 @@ class DeltaPerformer : public FileWriter {
   // Exposed for testing purposes.
   bool CheckpointUpdateProgress(bool force);
 
+  // The policy throttling the checkpoints, see CheckpointPolicy.
+  CheckpointPolicy* checkpoint_policy() { return &checkpoint_policy_; }
+
   // Initialize partitions and allocate required space for an update with the
   // given |manifest|. |update_check_response_hash| is used to check if the
   // previous call to this function corresponds to the same payload.
@@ -211,6 +229,7 @@ class DeltaPerformer : public FileWriter {
   friend class DeltaPerformerIntegrationTest;
   FRIEND_TEST(DeltaPerformerTest, BrilloMetadataSignatureSizeTest);
   FRIEND_TEST(DeltaPerformerTest, BrilloParsePayloadMetadataTest);
+  FRIEND_TEST(DeltaPerformerTest, SharedBlobReplaceOperationTest);
   FRIEND_TEST(DeltaPerformerTest, UsePublicKeyFromResponse);
 
   // Obtain the operation index for current partition. If all operations for
@@ -219,21 +238,46 @@ class DeltaPerformer : public FileWriter {
   // needs to know the current operation number to properly checkpoint update.
   size_t GetPartitionOperationNum();
 
+  // Stores the keys of the checkpoint, in the transaction started by
+  // CheckpointUpdateProgress().
+  bool SaveUpdateProgress(bool force);
+
   // Parse and move the update instructions of all partitions into our local
   // |partitions_| variable based on the version of the payload. Requires the
   // manifest to be parsed and valid.
   bool ParseManifestPartitions(ErrorCode* error);
+  // The part of ParseManifestPartitions() once the partitions are prepared.
+  bool ParsePreparedPartitions(ErrorCode* error);
+
+  // Sets up the apply of the operations of |partitions_|, resuming from the
+  // checkpoint if any. Returns false if there is nothing to apply.
+  bool StartApplyingOperations(ErrorCode* error);
+
+  // Whether the partitions are prepared in the background, while the payload
+  // data downloads, instead of before any more data is accepted.
+  bool ShouldPreparePartitionsInBackground() const;
+  // Starts preparing the partitions in |partitions_prepared_|. Write() keeps
+  // the data received meanwhile in |bytes_received_while_preparing_|.
+  void StartPreparingPartitions();
+  // Waits for |partitions_prepared_| and parses the prepared partitions.
+  bool FinishPreparingPartitions(ErrorCode* error);
 
   // Appends up to |*count_p| bytes from |*bytes_p| to |buffer_|, but only to
   // the extent that the size of |buffer_| does not exceed |max|. Advances
   // |*cbytes_p| and decreases |*count_p| by the actual number of bytes copied,
-  // and returns this number.
-  size_t CopyDataToBuffer(const char** bytes_p, size_t* count_p, size_t max);
+  // and returns this number. With |hash_op_blob|, the bytes copied are also
+  // added to |buffered_op_hasher_|, if any.
+  size_t CopyDataToBuffer(const char** bytes_p,
+                          size_t* count_p,
+                          size_t max,
+                          bool hash_op_blob = false);
 
   // If |op_result| is false, emits an error message using |op_type_name| and
-  // sets |*error| accordingly. Otherwise does nothing. Returns |op_result|.
+  // the global index |operation_num| of the failed operation, and sets
+  // |*error| accordingly. Otherwise does nothing. Returns |op_result|.
   bool HandleOpResult(bool op_result,
                       const char* op_type_name,
+                      size_t operation_num,
                       ErrorCode* error);
 
   // Logs the progress of downloading/applying an update.
@@ -242,6 +286,10 @@ class DeltaPerformer : public FileWriter {
   // Update overall progress metrics, log as necessary.
   void UpdateOverallProgress(bool force_log, const char* message_prefix);
 
+  // The operations before |next_operation_num_| which are applied, i.e. not
+  // queued on a worker anymore.
+  size_t NumAppliedOperations() const;
+
   // Returns true if enough of the delta file has been passed via Write()
   // to be able to perform a given install operation.
   bool CanPerformInstallOperation(const InstallOperation& operation);
@@ -250,24 +298,136 @@ class DeltaPerformer : public FileWriter {
   // false otherwise.
   ErrorCode ValidateManifest();
 
+  // Returns the hex encoded SHA-256 hash of the metadata and its signature in
+  // |buffer_|, saved once their operations are validated so that a resumed
+  // update doesn't validate them again.
+  std::string GetMetadataHash() const;
+
+  // Checks the operations of every partition of the manifest of a
+  // |payload_type| payload, several partitions at a time for large payloads.
+  ErrorCode ValidateManifestOperations(InstallPayloadType payload_type) const;
+
   // Validates that the hash of the blobs corresponding to the given |operation|
-  // matches what's specified in the manifest in the payload.
+  // matches what's specified in the manifest in the payload. |data| points to
+  // the blob of the operation.
   // Returns ErrorCode::kSuccess on match or a suitable error code otherwise.
-  ErrorCode ValidateOperationHash(const InstallOperation& operation);
-
-  // Returns true on success.
-  bool PerformInstallOperation(const InstallOperation& operation);
+  ErrorCode ValidateOperationHash(const InstallOperation& operation,
+                                  const void* data);
+  // Same as ValidateOperationHash(), for a blob whose hash is
+  // |calculated_op_hash|, or empty if it wasn't calculated.
+  ErrorCode CheckOperationHash(const InstallOperation& operation,
+                               const brillo::Blob& calculated_op_hash);
+
+  // Applies |operation|, the |operation_num|-th operation of the payload, to
+  // its partition through |writer| using the |count| bytes at |data| as its
+  // blob. Only touches |writer|, so it may run off the main thread while
+  // operations are pipelined. Returns true on success.
+  bool PerformInstallOperation(const InstallOperation& operation,
+                               size_t operation_num,
+                               const void* data,
+                               size_t count,
+                               PartitionWriterInterface* writer,
+                               ErrorCode* error);
 
   // These perform a specific type of operation and return true on success.
   // |error| will be set if source hash mismatch, otherwise |error| might not be
   // set even if it fails.
-  bool PerformReplaceOperation(const InstallOperation& operation);
-  bool PerformZeroOrDiscardOperation(const InstallOperation& operation);
+  bool PerformReplaceOperation(const InstallOperation& operation,
+                               const void* data,
+                               size_t count,
+                               PartitionWriterInterface* writer);
+  bool PerformZeroOrDiscardOperation(const InstallOperation& operation,
+                                     PartitionWriterInterface* writer);
   bool PerformSourceCopyOperation(const InstallOperation& operation,
+                                  PartitionWriterInterface* writer,
                                   ErrorCode* error);
   bool PerformDiffOperation(const InstallOperation& operation,
+                            const void* data,
+                            size_t count,
+                            PartitionWriterInterface* writer,
                             ErrorCode* error);
 
+  // The writers of a partition, shared between DeltaPerformer and the workers
+  // applying its operations.
+  struct ApplyWriters {
+    // Protects |idle| and |error|.
+    std::mutex mutex;
+    // The writers not used by any worker right now.
+    std::vector<PartitionWriterInterface*> idle;
+    // The error of the first failed operation, only read after the workers
+    // reported the failure.
+    ErrorCode error{ErrorCode::kSuccess};
+  };
+
+  // A partition whose operations were all scheduled, still being applied by
+  // its workers while the next partition is opened.
+  struct FinishingPartition {
+    // The index of the partition in |partitions_|.
+    size_t partition_index{0};
+    base::TimeTicks open_time;
+    // Set once joining the partition failed, which is then reported again.
+    ErrorCode error{ErrorCode::kSuccess};
+    std::unique_ptr<StreamingVerityWriter> verity_writer;
+    std::unique_ptr<PartitionWriterInterface> partition_writer;
+    std::vector<std::unique_ptr<PartitionWriterInterface>> extra_writers;
+    std::shared_ptr<ApplyWriters> apply_writers;
+    MemoryBudget::Reservation apply_reservation;
+    // Declared last, so it's drained before the writers are destroyed.
+    std::unique_ptr<WorkerPool> apply_pool;
+  };
+
+  // Queues |operation| and its blob |data| on |apply_pool_|, so the next
+  // operation can be downloaded and validated while this one is applied.
+  // Waits for the queued operations first if |operation| writes any block they
+  // write. Returns false and sets |error| if a previously queued operation
+  // failed.
+  bool ScheduleInstallOperation(const InstallOperation& operation,
+                                brillo::Blob data,
+                                ErrorCode* error);
+
+  // Blocks until all the operations queued with ScheduleInstallOperation()
+  // are applied, including the ones of |finishing_partition_|. Returns false
+  // and sets |error| if any of them failed.
+  bool WaitForScheduledOperations(ErrorCode* error);
+
+  // Takes a writer from |apply_writers| that no other worker is using. The
+  // caller must return it to |apply_writers->idle| once the operation is
+  // applied.
+  static PartitionWriterInterface* AcquireIdlePartitionWriter(
+      ApplyWriters* apply_writers);
+
+  // The index in |partitions_| of the partition of the |operation_num|-th
+  // operation of the payload.
+  size_t PartitionOfOperation(size_t operation_num) const;
+
+  // Whether the current partition, whose operations were all scheduled, may
+  // be left to finish in the background while the next one is opened.
+  bool CanFinishPartitionInBackground() const;
+
+  // Moves the current partition to |finishing_partition_|, without waiting
+  // for its operations still queued.
+  void FinishCurrentPartitionInBackground();
+
+  // Blocks until the operations of |finishing_partition_| are applied, then
+  // finishes it like FinishCurrentPartition(). Returns false and sets |error|
+  // if any of them failed, leaving |finishing_partition_| to report it again.
+  bool JoinFinishingPartition(ErrorCode* error);
+
+  // Writes the verity data of the |partition_index|-th partition in
+  // |partitions_| with |verity_writer|, if it was built while applying, and
+  // starts hashing it when |install_plan_->verify_during_apply| is set. Its
+  // writers must be closed.
+  void FinishWrittenPartition(
+      size_t partition_index,
+      std::unique_ptr<StreamingVerityWriter> verity_writer);
+
+  // Calls FinishedInstallOps() on every writer of the current partition.
+  bool FinishedCurrentPartitionInstallOps();
+
+  // Called once all the operations of the current partition are applied:
+  // closes it, and writes its verity data if it was built while applying.
+  bool FinishCurrentPartition();
+
   // Extracts the payload signature message from the current |buffer_| if the
   // offset matches the one specified by the manifest. Returns whether the
   // signature was extracted.
@@ -280,6 +440,62 @@ class DeltaPerformer : public FileWriter {
   // accordingly.
   void DiscardBuffer(bool do_advance_offset, size_t signed_hash_buffer_size);
 
+  // Accounts the |count| bytes at |data| in the payload hashes and the
+  // internal offset counter, as if they went through |buffer_|. Used for the
+  // blobs applied without being copied to |buffer_|, which must be empty.
+  void AccountData(const void* data, size_t count);
+
+  // Checks the REPLACE operations of the manifest sharing the blob of an
+  // earlier one, when the payload allows it, and counts them in
+  // |shared_blob_refs_|. The other blobs are checked to be in order, like
+  // ValidateManifestOperations() does otherwise. Runs on resume too.
+  ErrorCode IndexSharedBlobs();
+
+  // Applies |operation|, whose blob is shared with later operations, from
+  // its decoded data: decoding the blob at |data| into |shared_blob_cache_|
+  // first, or taking it from there when |data| is null. Returns false and
+  // sets |error| on failure.
+  bool PerformSharedBlobOperation(const InstallOperation& operation,
+                                  const void* data,
+                                  ErrorCode* error);
+
+  // Returns whether the blob of |operation| should be written while it is
+  // downloaded instead of buffered, see InstallPlan::stream_replace_operations.
+  bool ShouldStreamOperation(const InstallOperation& operation) const;
+
+  // Creates |streamed_op_writer_| for |operation|, once the operations queued
+  // on |apply_pool_| are done with the partition writer. Returns false and
+  // sets |error| if one of them failed; when the writer doesn't support
+  // streaming, returns true leaving |streamed_op_writer_| null.
+  bool StartStreamedOperation(const InstallOperation& operation,
+                              ErrorCode* error);
+
+  // Writes the bytes of the blob of the streamed |operation| at |*bytes_p| to
+  // |streamed_op_writer_|, advancing |*bytes_p| and |*count_p| like
+  // CopyDataToBuffer(). The bytes are accounted in the payload hashes right
+  // away, but |buffer_offset_| only moves once the whole blob is written and
+  // its hash is checked, which also resets |streamed_op_writer_|. Until then,
+  // progress is only checkpointed by CheckpointPartialOperation(). Returns
+  // false and sets |error| on failure.
+  bool StreamReplaceOperation(const InstallOperation& operation,
+                              const char** bytes_p,
+                              size_t* count_p,
+                              ErrorCode* error);
+
+  // Whether the progress of the streamed |operation| can be checkpointed in
+  // the middle of its blob: only for REPLACE, whose output blocks match the
+  // bytes of the blob, and when the partition writer supports it.
+  bool CanCheckpointPartialOperation(const InstallOperation& operation) const;
+
+  // Saves the progress in the middle of the streamed operation, whose first
+  // |streamed_op_bytes_| bytes are written, a multiple of the block size.
+  // A resumed update downloads and writes the rest of its blob only.
+  bool CheckpointPartialOperation(const InstallOperation& operation);
+
+  // Same as DiscardBuffer(true, |signed_hash_buffer_size|), but hands the
+  // content of |buffer_| over to the caller instead of releasing it.
+  brillo::Blob ReleaseBuffer(size_t signed_hash_buffer_size);
+
   // Primes the required update state. Returns true if the update state was
   // successfully initialized to a saved resume state or if the update is a new
   // update. Returns false otherwise.
@@ -303,6 +519,18 @@ class DeltaPerformer : public FileWriter {
   // Also see comment for the static PreparePartitionsForUpdate().
   bool PreparePartitionsForUpdate(uint64_t* required_size);
 
+  // The steps of the static PreparePartitionsForUpdate(). The first one
+  // returns whether the partition metadata must be updated for the payload of
+  // |update_check_response_hash|, resetting the progress of the previous one
+  // if so. Only the second one can run off the main thread.
+  static bool ShouldUpdatePartitionMetadata(
+      PrefsInterface* prefs, const std::string& update_check_response_hash);
+  static bool PrepareDynamicPartitions(BootControlInterface* boot_control,
+                                       BootControlInterface::Slot target_slot,
+                                       const DeltaArchiveManifest& manifest,
+                                       bool update,
+                                       uint64_t* required_size);
+
   // Check if current manifest contains timestamp errors.
   // Return:
   // - kSuccess if update is valid.
@@ -334,11 +562,22 @@ class DeltaPerformer : public FileWriter {
 
   PayloadMetadata payload_metadata_;
 
+  // The arena of |manifest_|, so that its many operations and extents are
+  // allocated in a few large blocks and freed at once with the DeltaPerformer.
+  google::protobuf::Arena manifest_arena_;
+
   // Parsed manifest. Set after enough bytes to parse the manifest were
   // downloaded.
-  DeltaArchiveManifest manifest_;
+  DeltaArchiveManifest& manifest_{
+      *google::protobuf::Arena::CreateMessage<DeltaArchiveManifest>(
+          &manifest_arena_)};
+  // The space of |manifest_arena_|, accounted for once the manifest is parsed.
+  MemoryBudget::Reservation manifest_reservation_;
   bool manifest_parsed_{false};
   bool manifest_valid_{false};
+  // True if the operations of |manifest_| were validated before the update
+  // was resumed, so ValidateManifest() skips them.
+  bool manifest_operations_validated_{false};
   uint64_t metadata_size_{0};
   uint32_t metadata_signature_size_{0};
   uint64_t major_payload_version_{0};
@@ -354,13 +593,24 @@ class DeltaPerformer : public FileWriter {
 
   // The list of partitions to update as found in the manifest major
   // version 2. When parsing an older manifest format, the information is
-  // converted over to this format instead.
-  std::vector<PartitionUpdate> partitions_;
+  // converted over to this format instead. They are kept in |manifest_|, and
+  // its arena, once ParseManifestPartitions() added the generated ones.
+  google::protobuf::RepeatedPtrField<PartitionUpdate>& partitions_{
+      *manifest_.mutable_partitions()};
 
   // Index in the list of partitions (|partitions_| member) of the current
   // partition being processed.
   size_t current_partition_{0};
 
+  // The partitions being prepared in the background, when
+  // |install_plan_->prepare_partitions_in_background| is set, and the payload
+  // data received meanwhile, within |preparing_reservation_|. Declared after
+  // |manifest_|, which the preparation reads, so it's waited for first.
+  std::future<bool> partitions_prepared_;
+  uint64_t prepare_required_size_{0};
+  brillo::Blob bytes_received_while_preparing_;
+  MemoryBudget::Reservation preparing_reservation_;
+
   // Index of the next operation to perform in the manifest. The index is
   // linear on the total number of operation on the manifest.
   size_t next_operation_num_{0};
@@ -371,6 +621,37 @@ class DeltaPerformer : public FileWriter {
   brillo::Blob buffer_;
   // Offset of buffer_ in the binary blobs section of the update.
   uint64_t buffer_offset_{0};
+  // The hash of the blob of the next operation, updated as its bytes are
+  // copied to |buffer_|, so only its finalization is left once the whole blob
+  // is received. Null when it doesn't cover all the bytes in |buffer_|.
+  std::unique_ptr<HashCalculator> buffered_op_hasher_;
+
+  // The writer the blob of the operation currently streamed is passed to, see
+  // StreamReplaceOperation(). Null when no operation is streamed.
+  std::unique_ptr<ExtentWriter> streamed_op_writer_;
+  // The hash of the bytes of the streamed operation written so far, and their
+  // count.
+  std::unique_ptr<HashCalculator> streamed_op_hasher_;
+  uint64_t streamed_op_bytes_{0};
+  // When resuming from a checkpoint in the middle of the streamed operation
+  // |next_operation_num_|, the bytes of its blob already written and the
+  // context of their hash. See CheckpointPartialOperation().
+  uint64_t resume_partial_op_bytes_{0};
+  std::string resume_partial_op_hash_context_;
+
+  // The number of operations using the blob at each data offset after the
+  // first one, for the blobs shared by several operations.
+  std::map<uint64_t, uint32_t> shared_blob_refs_;
+  // The decoded data of the shared blobs whose first operation was applied,
+  // by data offset, until their last operation is. Progress isn't
+  // checkpointed while it's not empty, so that a resumed update decodes them
+  // again.
+  struct SharedBlob {
+    brillo::Blob data;
+    uint32_t refs_left{0};
+    MemoryBudget::Reservation reservation;
+  };
+  std::map<uint64_t, SharedBlob> shared_blob_cache_;
 
   // Last |next_operation_num_| value updated as part of the progress update.
   uint64_t last_updated_operation_num_{std::numeric_limits<uint64_t>::max()};
@@ -416,13 +697,51 @@ class DeltaPerformer : public FileWriter {
       base::TimeDelta::FromSeconds(kProgressLogTimeoutSeconds)};
   base::TimeTicks forced_progress_log_time_;
 
-  // The frequency that we should write an update checkpoint (constant), and
-  // the point in time at which the next checkpoint should be written.
-  const base::TimeDelta update_checkpoint_wait_{
-      base::TimeDelta::FromSeconds(kCheckpointFrequencySeconds)};
-  base::TimeTicks update_checkpoint_time_;
+  // Decides when the update progress is checkpointed.
+  CheckpointPolicy checkpoint_policy_;
+
+  // When the current partition was opened, for its "apply/" phase.
+  base::TimeTicks partition_open_time_;
+
+  // Builds the verity data of the current partition from the blocks its
+  // writers write, when |install_plan_->write_verity_during_apply| is set.
+  // Declared before the writers using it.
+  std::unique_ptr<StreamingVerityWriter> streaming_verity_writer_;
+
+  // Hashes the partitions already written, when
+  // |install_plan_->verify_during_apply| is set.
+  BackgroundPartitionHasher background_hasher_;
 
   std::unique_ptr<PartitionWriterInterface> partition_writer_;
+  // The writers of the current partition used only by the additional workers
+  // of |apply_pool_|, when |install_plan_->apply_threads| is greater than one
+  // and |partition_writer_| allows concurrent writers.
+  std::vector<std::unique_ptr<PartitionWriterInterface>>
+      extra_partition_writers_;
+
+  // The operations queued on the workers and not applied yet, of all the
+  // partitions. The workers only count them down, without a lock, and the
+  // progress subtracts them from |next_operation_num_| when it's updated.
+  std::atomic<size_t> num_queued_operations_{0};
+
+  // Workers applying the operations of the current partition in the
+  // background when |install_plan_->pipelined_apply| is set, null otherwise.
+  // Declared after everything the queued operations use, so it's destroyed
+  // (and drained) first.
+  std::unique_ptr<WorkerPool> apply_pool_;
+  // The share of the memory budget sizing |apply_pool_|.
+  MemoryBudget::Reservation apply_reservation_;
+  // The writers of the current partition, shared with the workers of
+  // |apply_pool_|.
+  std::shared_ptr<ApplyWriters> apply_writers_;
+  // The blocks written by the operations queued since |apply_pool_| was last
+  // drained. Only tracked when there is more than one worker.
+  ExtentRanges scheduled_dst_extents_;
+
+  // The previous partition while its last operations are applied, when
+  // |install_plan_->concurrent_partitions| is set. Declared last, so it's
+  // drained before everything its operations use is destroyed.
+  std::unique_ptr<FinishingPartition> finishing_partition_;
 
   DISALLOW_COPY_AND_ASSIGN(DeltaPerformer);
 };
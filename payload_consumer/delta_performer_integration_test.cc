@@ -756,6 +756,8 @@ static void ApplyDeltaFile(bool full_kernel,
                         testing::SizeIs(state->metadata_signature_size +
                                         state->metadata_size)))
       .WillRepeatedly(Return(true));
+  EXPECT_CALL(prefs, SetString(kPrefsManifestValidatedHash, Not(IsEmpty())))
+      .WillRepeatedly(Return(true));
   if (op_hash_test == kValidOperationData && signature_test != kSignatureNone) {
     EXPECT_CALL(prefs,
                 SetString(kPrefsUpdateStateSignatureBlob, Not(IsEmpty())))
@@ -211,6 +211,7 @@ class DeltaPerformerTest : public ::testing::Test {
     PayloadGenerationConfig config;
     config.version.major = major_version;
     config.version.minor = minor_version;
+    config.version.share_blobs = share_blobs_;
 
     PayloadFile payload;
     EXPECT_TRUE(payload.Init(config));
@@ -233,11 +234,18 @@ class DeltaPerformerTest : public ::testing::Test {
 
     payload.AddPartition(*old_part, new_part, aops, {}, 0);
 
-    // We include a kernel partition without operations.
+    // We include a kernel partition, without operations unless the test set
+    // |kernel_aops_|.
     old_part->name = kPartitionNameKernel;
     new_part.name = kPartitionNameKernel;
     new_part.size = 0;
-    payload.AddPartition(*old_part, new_part, {}, {}, 0);
+    for (const AnnotatedOperation& aop : kernel_aops_) {
+      for (const Extent& extent : aop.op.dst_extents()) {
+        new_part.size = std::max<uint64_t>(
+            new_part.size, (extent.start_block() + extent.num_blocks()) * 4096);
+      }
+    }
+    payload.AddPartition(*old_part, new_part, kernel_aops_, {}, 0);
 
     ScopedTempFile payload_file("Payload-XXXXXX");
     string private_key =
@@ -291,13 +299,16 @@ class DeltaPerformerTest : public ::testing::Test {
   // Apply the payload provided in |payload_data| reading from the |source_path|
   // file and writing the contents to a new partition. The existing data in the
   // new target file are set to |target_data| before applying the payload.
-  // Expect result of performer_.Write() to be |expect_success|.
+  // The payload is passed to Write() in chunks of |write_size| bytes, or all
+  // at once if it is 0. Expect the result of the last performer_.Write() to be
+  // |expect_success|.
   // Returns the result of the payload application.
   brillo::Blob ApplyPayloadToData(DeltaPerformer* delta_performer,
                                   const brillo::Blob& payload_data,
                                   const string& source_path,
                                   const brillo::Blob& target_data,
-                                  bool expect_success) {
+                                  bool expect_success,
+                                  size_t write_size = 0) {
     ScopedTempFile new_part("Partition-XXXXXX");
     EXPECT_TRUE(test_utils::WriteFileVector(new_part.path(), target_data));
 
@@ -313,8 +324,17 @@ class DeltaPerformerTest : public ::testing::Test {
     fake_boot_control_.SetPartitionDevice(
         kPartitionNameKernel, install_plan_.source_slot, "/dev/null");
 
-    EXPECT_EQ(expect_success,
-              delta_performer->Write(payload_data.data(), payload_data.size()));
+    if (write_size == 0) {
+      write_size = payload_data.size();
+    }
+    bool result = true;
+    for (size_t offset = 0; result && offset < payload_data.size();
+         offset += write_size) {
+      result = delta_performer->Write(
+          payload_data.data() + offset,
+          std::min(write_size, payload_data.size() - offset));
+    }
+    EXPECT_EQ(expect_success, result);
     EXPECT_EQ(0, performer_.Close());
 
     brillo::Blob partition_data;
@@ -432,6 +452,11 @@ class DeltaPerformerTest : public ::testing::Test {
   FakePrefs prefs_;
   InstallPlan install_plan_;
   InstallPlan::Payload payload_;
+  // Whether GeneratePayload() shares identical blobs.
+  bool share_blobs_{false};
+  // The operations of the kernel partition in GeneratePayload(), which is
+  // written to /dev/null.
+  vector<AnnotatedOperation> kernel_aops_;
   FakeBootControl fake_boot_control_;
   FakeHardware fake_hardware_;
   MockDownloadActionDelegate mock_delegate_;
@@ -512,6 +537,213 @@ TEST_F(DeltaPerformerTest, ReplaceOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+// The blob of the operation doesn't arrive in a single Write() call here, so it
+// is buffered instead of being applied from the caller's memory.
+TEST_F(DeltaPerformerTest, ReplaceOperationSplitWriteTest) {
+  brillo::Blob expected_data(2 * 4096);
+  test_utils::FillWithData(&expected_data);
+  vector<AnnotatedOperation> aops;
+  for (uint64_t block = 0; block < 2; block++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(block, 1);
+    aop.op.set_data_offset(block * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(
+                &performer_, payload_data, "/dev/null", {}, true, 1000));
+}
+
+TEST_F(DeltaPerformerTest, SharedBlobReplaceOperationTest) {
+  payload_.type = InstallPayloadType::kFull;
+  share_blobs_ = true;
+  brillo::Blob blob(4096);
+  test_utils::FillWithData(&blob);
+  // Both blocks have the same content, stored once.
+  vector<AnnotatedOperation> aops;
+  for (uint64_t block = 0; block < 2; block++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(block, 1);
+    aop.op.set_data_offset(0);
+    aop.op.set_data_length(blob.size());
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+
+  brillo::Blob payload_data = GeneratePayload(blob,
+                                              aops,
+                                              false,
+                                              kBrilloMajorPayloadVersion,
+                                              kFullPayloadMinorVersion);
+
+  brillo::Blob expected_data = blob;
+  expected_data.insert(expected_data.end(), blob.begin(), blob.end());
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+  EXPECT_EQ(1U, performer_.shared_blob_refs_.size());
+  EXPECT_TRUE(performer_.shared_blob_cache_.empty());
+}
+
+TEST_F(DeltaPerformerTest, StreamedReplaceOperationTest) {
+  install_plan_.stream_replace_operations = true;
+  // Big enough to be streamed.
+  brillo::Blob expected_data(256 * 4096);
+  test_utils::FillWithData(&expected_data);
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 256);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(aop);
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(
+                &performer_, payload_data, "/dev/null", {}, true, 64 * 1024));
+}
+
+TEST_F(DeltaPerformerTest, PipelinedApplyTest) {
+  install_plan_.pipelined_apply = true;
+  brillo::Blob expected_data =
+      brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
+  expected_data.resize(4096 * 4);  // 4 blocks
+  vector<AnnotatedOperation> aops;
+  for (uint64_t i = 0; i < 4; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, ConcurrentPartitionsTest) {
+  install_plan_.pipelined_apply = true;
+  install_plan_.concurrent_partitions = true;
+  brillo::Blob expected_data =
+      brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
+  expected_data.resize(4096 * 4);  // 4 blocks
+  vector<AnnotatedOperation> aops;
+  for (uint64_t i = 0; i < 4; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+  // The kernel partition is opened while the operations of the root partition
+  // may still be applied.
+  brillo::Blob blob_data = expected_data;
+  blob_data.resize(4096 * 5);
+  AnnotatedOperation kernel_aop;
+  *(kernel_aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  kernel_aop.op.set_data_offset(4096 * 4);
+  kernel_aop.op.set_data_length(4096);
+  kernel_aop.op.set_type(InstallOperation::REPLACE);
+  kernel_aops_.push_back(kernel_aop);
+
+  brillo::Blob payload_data = GeneratePayload(blob_data, aops, false);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, PreparePartitionsInBackgroundTest) {
+  install_plan_.prepare_partitions_in_background = true;
+  brillo::Blob expected_data =
+      brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
+  expected_data.resize(4096 * 4);  // 4 blocks
+  vector<AnnotatedOperation> aops;
+  for (uint64_t i = 0; i < 4; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+
+  // Only a signed payload tells where its data ends.
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, true);
+
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(
+                &performer_, payload_data, "/dev/null", {}, true, 1000));
+}
+
+TEST_F(DeltaPerformerTest, PipelinedApplyFailureTest) {
+  install_plan_.pipelined_apply = true;
+  brillo::Blob expected_data =
+      brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
+  expected_data.resize(4096);  // block size
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  // Not a valid bzip2 stream, so applying the operation fails in the worker.
+  aop.op.set_type(InstallOperation::REPLACE_BZ);
+  aops.push_back(aop);
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  ApplyPayload(payload_data, "/dev/null", false);
+}
+
+TEST_F(DeltaPerformerTest, ParallelApplyTest) {
+  install_plan_.pipelined_apply = true;
+  install_plan_.apply_threads = 4;
+  const size_t kNumBlocks = 8;
+  brillo::Blob source_data;
+  for (size_t i = 0; i < kNumBlocks; i++) {
+    source_data.insert(source_data.end(), 4096, static_cast<uint8_t>(i));
+  }
+  // Copies the blocks in reverse order. The last operation writes the last
+  // block again, so it has to wait for the ones in flight.
+  vector<AnnotatedOperation> aops;
+  brillo::Blob expected_data;
+  for (size_t i = 0; i <= kNumBlocks; i++) {
+    const size_t src_block = i % kNumBlocks;
+    const size_t dst_block = kNumBlocks - 1 - src_block;
+    AnnotatedOperation aop;
+    *(aop.op.add_src_extents()) = ExtentForRange(src_block, 1);
+    *(aop.op.add_dst_extents()) = ExtentForRange(dst_block, 1);
+    aop.op.set_type(InstallOperation::SOURCE_COPY);
+    brillo::Blob src_hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+        source_data.data() + src_block * 4096, 4096, &src_hash));
+    aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+    aops.push_back(aop);
+  }
+  for (size_t i = 0; i < kNumBlocks; i++) {
+    expected_data.insert(
+        expected_data.end(), 4096, static_cast<uint8_t>(kNumBlocks - 1 - i));
+  }
+
+  ScopedTempFile source("Source-XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileVector(source.path(), source_data));
+
+  PartitionConfig old_part(kPartitionNameRoot);
+  old_part.path = source.path();
+  old_part.size = source_data.size();
+
+  brillo::Blob payload_data =
+      GeneratePayload(brillo::Blob(), aops, false, &old_part);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, source.path(), true));
+}
+
 TEST_F(DeltaPerformerTest, ReplaceBzOperationTest) {
   brillo::Blob expected_data =
       brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
@@ -827,6 +1059,105 @@ TEST_F(DeltaPerformerTest, ValidatePerPartitionTimestampSuccess) {
                         ErrorCode::kSuccess);
 }
 
+TEST_F(DeltaPerformerTest, ValidateManifestManyOperationsTest) {
+  // Enough operations for the partitions to be validated concurrently.
+  DeltaArchiveManifest manifest;
+  manifest.set_minor_version(kFullPayloadMinorVersion);
+  uint64_t data_offset = 0;
+  for (const auto& part_name : {"boot", "system", "vendor", "product"}) {
+    auto part = manifest.add_partitions();
+    part->set_partition_name(part_name);
+    part->mutable_new_partition_info();
+    for (int i = 0; i < 5000; i++) {
+      auto op = part->add_operations();
+      op->set_type(InstallOperation::REPLACE);
+      op->set_data_offset(data_offset);
+      op->set_data_length(10);
+      *op->add_dst_extents() = ExtentForRange(i, 1);
+      data_offset += 10;
+    }
+  }
+
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kFull,
+                        ErrorCode::kSuccess);
+
+  // The blobs of the last partition overlap with the ones before.
+  manifest.mutable_partitions(3)->mutable_operations(0)->set_data_offset(
+      data_offset - 5000 * 10 - 1);
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kFull,
+                        ErrorCode::kDownloadManifestParseError);
+}
+
+TEST_F(DeltaPerformerTest, ValidateManifestUnorderedBlobsTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_minor_version(kFullPayloadMinorVersion);
+  auto part = manifest.add_partitions();
+  part->set_partition_name("system");
+  part->mutable_new_partition_info();
+  for (uint64_t data_offset : {100, 0}) {
+    auto op = part->add_operations();
+    op->set_type(InstallOperation::REPLACE);
+    op->set_data_offset(data_offset);
+    op->set_data_length(100);
+  }
+
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kFull,
+                        ErrorCode::kDownloadManifestParseError);
+}
+
+TEST_F(DeltaPerformerTest, ValidateManifestSharedBlobsTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_minor_version(kFullPayloadMinorVersion);
+  manifest.set_block_size(4096);
+  for (const auto& part_name : {"system", "vendor"}) {
+    auto part = manifest.add_partitions();
+    part->set_partition_name(part_name);
+    part->mutable_new_partition_info();
+    auto op = part->add_operations();
+    op->set_type(InstallOperation::REPLACE_XZ);
+    op->set_data_offset(0);
+    op->set_data_length(100);
+    op->set_data_sha256_hash("hash");
+    *op->add_dst_extents() = ExtentForRange(0, 1);
+  }
+
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kFull,
+                        ErrorCode::kSuccess);
+
+  // Only an identical operation can share the blob.
+  manifest.mutable_partitions(1)->mutable_operations(0)->set_type(
+      InstallOperation::REPLACE_BZ);
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kFull,
+                        ErrorCode::kDownloadManifestParseError);
+}
+
+TEST_F(DeltaPerformerTest, ValidateManifestFullSourceOperationTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_minor_version(kFullPayloadMinorVersion);
+  auto part = manifest.add_partitions();
+  part->set_partition_name("system");
+  part->mutable_new_partition_info();
+  auto op = part->add_operations();
+  op->set_type(InstallOperation::SOURCE_COPY);
+  *op->add_src_extents() = ExtentForRange(0, 1);
+  *op->add_dst_extents() = ExtentForRange(1, 1);
+
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kFull,
+                        ErrorCode::kPayloadMismatchedType);
+}
+
 TEST_F(DeltaPerformerTest, BrilloMetadataSignatureSizeTest) {
   unsigned int seed = time(nullptr);
   EXPECT_TRUE(performer_.Write(kDeltaMagic, sizeof(kDeltaMagic)));
@@ -1111,6 +1442,38 @@ TEST_F(DeltaPerformerTest, FullPayloadCanResumeTest) {
   ASSERT_TRUE(DeltaPerformer::CanResumeUpdate(&prefs_, payload_id));
 }
 
+TEST_F(DeltaPerformerTest, ValidatedManifestHashTest) {
+  payload_.type = InstallPayloadType::kFull;
+  brillo::Blob expected_data(4096);
+  test_utils::FillWithData(&expected_data);
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(aop);
+
+  brillo::Blob payload_data = GeneratePayload(expected_data,
+                                              aops,
+                                              false,
+                                              kBrilloMajorPayloadVersion,
+                                              kFullPayloadMinorVersion);
+  ASSERT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+
+  // The hash of the cached manifest is saved along with it.
+  string manifest_bytes, validated_hash;
+  ASSERT_TRUE(prefs_.GetString(kPrefsManifestBytes, &manifest_bytes));
+  ASSERT_TRUE(prefs_.GetString(kPrefsManifestValidatedHash, &validated_hash));
+  brillo::Blob hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfBytes(
+      manifest_bytes.data(), manifest_bytes.size(), &hash));
+  EXPECT_EQ(base::HexEncode(hash.data(), hash.size()), validated_hash);
+
+  ASSERT_TRUE(DeltaPerformer::ResetUpdateProgress(&prefs_, false));
+  EXPECT_FALSE(prefs_.Exists(kPrefsManifestValidatedHash));
+}
+
 class TestDeltaPerformer : public DeltaPerformer {
  public:
   using DeltaPerformer::DeltaPerformer;
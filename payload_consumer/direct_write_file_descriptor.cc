@@ -0,0 +1,244 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/direct_write_file_descriptor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// The most aligned buffers kept for reuse.
+constexpr size_t kMaxFreeBuffers = 4;
+
+bool IsAligned(uint64_t value) {
+  return value % DirectWriteFileDescriptor::kAlignment == 0;
+}
+}  // namespace
+
+DirectWriteFileDescriptor::~DirectWriteFileDescriptor() {
+  // The base destructor would only close the regular descriptor.
+  if (IsOpen()) {
+    Close();
+  }
+}
+
+bool DirectWriteFileDescriptor::Open(const char* path,
+                                     int flags,
+                                     mode_t mode) {
+  if (!EintrSafeFileDescriptor::Open(path, flags, mode)) {
+    return false;
+  }
+  OpenDirect(path, flags);
+  return true;
+}
+
+bool DirectWriteFileDescriptor::Open(const char* path, int flags) {
+  if (!EintrSafeFileDescriptor::Open(path, flags)) {
+    return false;
+  }
+  OpenDirect(path, flags);
+  return true;
+}
+
+void DirectWriteFileDescriptor::OpenDirect(const char* path, int flags) {
+  dirty_bytes_ = 0;
+  if ((flags & O_ACCMODE) == O_RDONLY) {
+    return;
+  }
+  // The file was already created or truncated by the regular descriptor.
+  flags &= ~(O_CREAT | O_EXCL | O_TRUNC);
+  direct_fd_ = HANDLE_EINTR(open(path, flags | O_DIRECT | O_CLOEXEC));
+  if (direct_fd_ < 0) {
+    PLOG(INFO) << "O_DIRECT isn't supported on " << path
+               << ", writing through the page cache";
+  }
+}
+
+void DirectWriteFileDescriptor::CloseDirect() {
+  if (direct_fd_ >= 0) {
+    IGNORE_EINTR(close(direct_fd_));
+    direct_fd_ = -1;
+  }
+}
+
+ssize_t DirectWriteFileDescriptor::Write(const void* buf, size_t count) {
+  CHECK_GE(fd_, 0);
+  const off64_t offset = lseek64(fd_, 0, SEEK_CUR);
+  if (offset < 0 ||
+      !WriteBatch({{static_cast<uint64_t>(offset), buf, count}}) ||
+      lseek64(fd_, offset + count, SEEK_SET) < 0) {
+    return -1;
+  }
+  return count;
+}
+
+bool DirectWriteFileDescriptor::WriteBatch(
+    const std::vector<WriteRequest>& requests) {
+  CHECK_GE(fd_, 0);
+  std::vector<const WriteRequest*> aligned;
+  std::vector<WriteRequest> unaligned;
+  for (const auto& request : requests) {
+    if (UsesDirectWrites() && IsAligned(request.offset) &&
+        IsAligned(request.count)) {
+      aligned.push_back(&request);
+    } else if (request.count > 0) {
+      unaligned.push_back(request);
+    }
+  }
+  std::sort(aligned.begin(),
+            aligned.end(),
+            [](const WriteRequest* a, const WriteRequest* b) {
+              return a->offset < b->offset;
+            });
+  return WriteDirect(aligned) && WriteBuffered(unaligned);
+}
+
+bool DirectWriteFileDescriptor::WriteDirect(
+    const std::vector<const WriteRequest*>& requests) {
+  if (requests.empty()) {
+    return true;
+  }
+  AlignedBuffer buffer = AcquireBuffer();
+  TEST_AND_RETURN_FALSE(buffer != nullptr);
+  // The bytes of |buffer| to write at |buffer_offset|.
+  size_t buffered = 0;
+  uint64_t buffer_offset = 0;
+  bool success = true;
+  for (const WriteRequest* request : requests) {
+    auto data = static_cast<const uint8_t*>(request->buffer);
+    uint64_t offset = request->offset;
+    size_t count = request->count;
+    while (success && count > 0) {
+      if (buffered > 0 && (buffer_offset + buffered != offset ||
+                           buffered == kBufferSize)) {
+        success = WriteAligned(buffer.get(), buffered, buffer_offset);
+        buffered = 0;
+      }
+      if (buffered == 0) {
+        buffer_offset = offset;
+      }
+      const size_t chunk = std::min(count, kBufferSize - buffered);
+      std::copy(data, data + chunk, buffer.get() + buffered);
+      buffered += chunk;
+      data += chunk;
+      offset += chunk;
+      count -= chunk;
+    }
+  }
+  if (success && buffered > 0) {
+    success = WriteAligned(buffer.get(), buffered, buffer_offset);
+  }
+  ReleaseBuffer(std::move(buffer));
+  return success;
+}
+
+bool DirectWriteFileDescriptor::WriteAligned(const uint8_t* buffer,
+                                             size_t count,
+                                             uint64_t offset) {
+  if (!UsesDirectWrites()) {
+    return WriteBuffered({{offset, buffer, count}});
+  }
+  size_t written = 0;
+  while (written < count) {
+    const ssize_t rc = HANDLE_EINTR(pwrite64(
+        direct_fd_, buffer + written, count - written, offset + written));
+    if (rc < 0 && errno == EINVAL && written == 0) {
+      PLOG(WARNING) << "O_DIRECT write failed, writing through the page cache";
+      CloseDirect();
+      return WriteBuffered({{offset, buffer, count}});
+    }
+    if (rc <= 0) {
+      PLOG(ERROR) << "Failed to write " << count - written
+                  << " bytes at offset " << offset + written;
+      return false;
+    }
+    written += rc;
+  }
+  return true;
+}
+
+bool DirectWriteFileDescriptor::WriteBuffered(
+    const std::vector<WriteRequest>& requests) {
+  if (requests.empty()) {
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(EintrSafeFileDescriptor::WriteBatch(requests));
+  size_t bytes = 0;
+  for (const auto& request : requests) {
+    bytes += request.count;
+  }
+  bool writeback = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dirty_bytes_ += bytes;
+    if (dirty_bytes_ >= kWritebackBytes) {
+      dirty_bytes_ = 0;
+      writeback = true;
+    }
+  }
+  if (writeback) {
+    // Waits for the previous writeback, so at most twice |kWritebackBytes|
+    // are dirty, and starts the next one without waiting for it.
+    sync_file_range(
+        fd_, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE);
+  }
+  return true;
+}
+
+DirectWriteFileDescriptor::AlignedBuffer
+DirectWriteFileDescriptor::AcquireBuffer() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_buffers_.empty()) {
+      AlignedBuffer buffer = std::move(free_buffers_.back());
+      free_buffers_.pop_back();
+      return buffer;
+    }
+  }
+  void* buffer = nullptr;
+  if (posix_memalign(&buffer, kAlignment, kBufferSize) != 0) {
+    LOG(ERROR) << "Failed to allocate an aligned buffer of " << kBufferSize
+               << " bytes";
+    return nullptr;
+  }
+  return AlignedBuffer(static_cast<uint8_t*>(buffer));
+}
+
+void DirectWriteFileDescriptor::ReleaseBuffer(AlignedBuffer buffer) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (free_buffers_.size() < kMaxFreeBuffers) {
+    free_buffers_.push_back(std::move(buffer));
+  }
+}
+
+bool DirectWriteFileDescriptor::Close() {
+  CloseDirect();
+  free_buffers_.clear();
+  return EintrSafeFileDescriptor::Close();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,97 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_DIRECT_WRITE_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_DIRECT_WRITE_FILE_DESCRIPTOR_H_
+
+#include <stdlib.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// An EintrSafeFileDescriptor which writes the aligned blocks with O_DIRECT
+// through a second descriptor on the same file, so that writing a whole
+// partition doesn't evict the page cache of the rest of the device, like the
+// source blocks about to be read. The contiguous aligned writes of a
+// WriteBatch() are copied together into aligned buffers, reused from a pool.
+// The unaligned writes, and all of them if the file doesn't support O_DIRECT,
+// go through the page cache, whose writeback is started every
+// |kWritebackBytes| so that Flush() has little left to write. Everything
+// else uses the regular descriptor.
+class DirectWriteFileDescriptor : public EintrSafeFileDescriptor {
+ public:
+  // The alignment of the offset, size and memory of the direct writes.
+  static constexpr size_t kAlignment = 4096;
+  // The size of each aligned buffer.
+  static constexpr size_t kBufferSize = 1024 * 1024;
+  // The bytes written through the page cache between two writebacks.
+  static constexpr size_t kWritebackBytes = 16 * 1024 * 1024;
+
+  DirectWriteFileDescriptor() = default;
+  ~DirectWriteFileDescriptor() override;
+
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  bool WriteBatch(const std::vector<WriteRequest>& requests) override;
+  bool Close() override;
+
+  // Whether the aligned writes of the file currently open use O_DIRECT.
+  bool UsesDirectWrites() const { return direct_fd_ >= 0; }
+
+ private:
+  struct FreeDeleter {
+    void operator()(void* buffer) const { free(buffer); }
+  };
+  using AlignedBuffer = std::unique_ptr<uint8_t, FreeDeleter>;
+
+  // Opens |direct_fd_| on |path| after the regular descriptor, leaving it
+  // closed if O_DIRECT isn't supported.
+  void OpenDirect(const char* path, int flags);
+  void CloseDirect();
+
+  // Writes the aligned |requests|, sorted by offset, with |direct_fd_|.
+  bool WriteDirect(const std::vector<const WriteRequest*>& requests);
+  // Writes the |count| bytes of the aligned |buffer| at |offset|. Once a
+  // write fails with EINVAL, which means O_DIRECT isn't usable after all,
+  // |direct_fd_| is closed and the bytes go through the page cache instead.
+  bool WriteAligned(const uint8_t* buffer, size_t count, uint64_t offset);
+  // Writes |requests| through the page cache, and starts the writeback once
+  // |kWritebackBytes| are dirty.
+  bool WriteBuffered(const std::vector<WriteRequest>& requests);
+
+  AlignedBuffer AcquireBuffer();
+  void ReleaseBuffer(AlignedBuffer buffer);
+
+  int direct_fd_{-1};
+  // The bytes written through the page cache since the last writeback.
+  size_t dirty_bytes_{0};
+
+  std::mutex mutex_;
+  // The aligned buffers not in use.
+  std::vector<AlignedBuffer> free_buffers_;
+
+  DISALLOW_COPY_AND_ASSIGN(DirectWriteFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_DIRECT_WRITE_FILE_DESCRIPTOR_H_
@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/direct_write_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = DirectWriteFileDescriptor::kAlignment;
+constexpr size_t kFileSize = 1024 * kBlockSize;
+}  // namespace
+
+class DirectWriteFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(test_utils::WriteFileString(temp_file_.path(),
+                                            string(kFileSize, '.')));
+    // Whether or not the temporary directory supports O_DIRECT, the writes
+    // must land the same.
+    ASSERT_TRUE(fd_.Open(temp_file_.path().c_str(), O_RDWR));
+  }
+
+  string FileContents() {
+    string contents;
+    EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &contents));
+    return contents;
+  }
+
+  ScopedTempFile temp_file_{"DirectWriteFileDescriptorTest-XXXXXX"};
+  DirectWriteFileDescriptor fd_;
+};
+
+TEST_F(DirectWriteFileDescriptorTest, WriteBatchTest) {
+  // Two contiguous aligned writes larger than a buffer, an unaligned one and
+  // an aligned one elsewhere.
+  const size_t large = DirectWriteFileDescriptor::kBufferSize + kBlockSize;
+  const string a(large, 'a'), b(kBlockSize, 'b');
+  const string c(10, 'c'), d(kBlockSize, 'd');
+  ASSERT_TRUE(fd_.WriteBatch({{800 * kBlockSize, d.data(), d.size()},
+                              {0, a.data(), a.size()},
+                              {large, b.data(), b.size()},
+                              {700 * kBlockSize + 1, c.data(), c.size()}}));
+  ASSERT_TRUE(fd_.Flush());
+
+  string expected(kFileSize, '.');
+  expected.replace(0, large, a);
+  expected.replace(large, kBlockSize, b);
+  expected.replace(700 * kBlockSize + 1, c.size(), c);
+  expected.replace(800 * kBlockSize, kBlockSize, d);
+  EXPECT_EQ(expected, FileContents());
+  EXPECT_TRUE(fd_.Close());
+}
+
+TEST_F(DirectWriteFileDescriptorTest, WriteMovesTheOffsetTest) {
+  const string a(kBlockSize, 'a'), b(3, 'b');
+  ASSERT_EQ(static_cast<off64_t>(kBlockSize), fd_.Seek(kBlockSize, SEEK_SET));
+  ASSERT_EQ(static_cast<ssize_t>(a.size()), fd_.Write(a.data(), a.size()));
+  ASSERT_EQ(static_cast<ssize_t>(b.size()), fd_.Write(b.data(), b.size()));
+  EXPECT_EQ(static_cast<off64_t>(kBlockSize + a.size() + b.size()),
+            fd_.Seek(0, SEEK_CUR));
+
+  string buffer(a.size() + b.size(), '\0');
+  ASSERT_EQ(static_cast<off64_t>(kBlockSize), fd_.Seek(kBlockSize, SEEK_SET));
+  ASSERT_EQ(static_cast<ssize_t>(buffer.size()),
+            fd_.Read(buffer.data(), buffer.size()));
+  EXPECT_EQ(a + b, buffer);
+  EXPECT_TRUE(fd_.Close());
+}
+
+}  // namespace chromeos_update_engine
@@ -17,55 +17,124 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_MAP_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_MAP_H_
 
-#include <functional>
-#include <map>
+#include <algorithm>
+#include <optional>
 #include <utility>
 #include <vector>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
 
-// Data structure for storing a disjoint set of extents.
+// Data structure for storing a disjoint set of extents, each mapped to a value.
 // Currently the only usecase is for VABCPartitionWriter to keep track of which
 // block belongs to which merge operation. Therefore this class only contains
 // the minimal set of functions needed.
-template <typename T, typename Comparator = ExtentLess>
+// The entries are kept sorted by start block in a flat vector, so every query
+// is a binary search followed by a walk over the k entries it returns.
+template <typename T>
 class ExtentMap {
  public:
+  using Entry = std::pair<BlockExtent, T>;
+  using Entries = std::vector<Entry>;
+
+  ExtentMap() = default;
+
+  // Builds the map from all of |entries| at once, sorting them instead of
+  // inserting them one by one. The result is the same as calling AddExtent()
+  // on each entry in order: an entry overlapping one before it is dropped.
+  explicit ExtentMap(std::vector<std::pair<Extent, T>> entries) {
+    std::vector<size_t> order;
+    order.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+      if (!IsEmptyOrSparse(entries[i].first))
+        order.push_back(i);
+    }
+    std::stable_sort(
+        order.begin(), order.end(), [&entries](size_t a, size_t b) {
+          return entries[a].first.start_block() <
+                 entries[b].first.start_block();
+        });
+    const bool overlapping =
+        std::adjacent_find(
+            order.begin(), order.end(), [&entries](size_t a, size_t b) {
+              const Extent& first = entries[a].first;
+              return first.start_block() + first.num_blocks() >
+                     entries[b].first.start_block();
+            }) != order.end();
+    if (overlapping) {
+      // Only when the target has duplicate blocks. Which of the overlapping
+      // entries is kept depends on the order they come in, so add them one at
+      // a time.
+      for (auto& [extent, value] : entries) {
+        AddExtent(extent, std::move(value));
+      }
+      return;
+    }
+    entries_.reserve(order.size());
+    for (size_t i : order) {
+      const Extent& extent = entries[i].first;
+      entries_.push_back({{extent.start_block(), extent.num_blocks()},
+                          std::move(entries[i].second)});
+    }
+  }
+
   bool AddExtent(const Extent& extent, T&& value) {
-    if (set_.OverlapsWithExtent(extent)) {
+    if (IsEmptyOrSparse(extent)) {
       return false;
     }
-    const auto& [it, inserted] = map_.insert({extent, std::forward<T>(value)});
-    if (inserted) {
-      set_.AddExtent(extent);
+    const auto it = FirstEndingAfter(extent.start_block());
+    if (it != entries_.end() &&
+        it->first.start_block() < extent.start_block() + extent.num_blocks()) {
+      return false;
     }
-    return inserted;
+    entries_.insert(
+        it,
+        {{extent.start_block(), extent.num_blocks()}, std::forward<T>(value)});
+    return true;
   }
 
-  size_t size() const { return map_.size(); }
+  size_t size() const { return entries_.size(); }
 
   // Return a pointer to entry which is intersecting |extent|. If T is already
   // a pointer type, return T on success. This function always return
   // |nullptr| on failure. Therefore you cannot store nullptr as an entry.
   std::optional<T> Get(const Extent& extent) const {
-    const auto it = map_.find(extent);
-    if (it == map_.end()) {
-      for (const auto& ext : set_.GetCandidateRange(extent)) {
-        if (ExtentRanges::ExtentsOverlap(ext, extent)) {
-          LOG(WARNING) << "Looking up a partially intersecting extent isn't "
-                          "supported by "
-                          "this data structure. Querying extent: "
-                       << extent << ", partial match in map: " << ext;
-        }
+    const auto entries = GetIntersectingEntries(extent);
+    for (const auto& [ext, value] : entries) {
+      if (ext.start_block() == extent.start_block() &&
+          ext.num_blocks() == extent.num_blocks()) {
+        return {value};
       }
-      return {};
     }
-    return {it->second};
+    for (const auto& entry : entries) {
+      LOG(WARNING) << "Looking up a partially intersecting extent isn't "
+                      "supported by "
+                      "this data structure. Querying extent: "
+                   << extent << ", partial match in map: "
+                   << Extent(entry.first);
+    }
+    return {};
+  }
+
+  // Return every entry overlapping |extent|, in block order. The extents of
+  // the entries are returned whole, even when they extend past |extent|.
+  Range<typename Entries::const_iterator> GetIntersectingEntries(
+      const Extent& extent) const {
+    if (IsEmptyOrSparse(extent)) {
+      return {entries_.end(), entries_.end()};
+    }
+    const auto begin = FirstEndingAfter(extent.start_block());
+    const uint64_t end_block = extent.start_block() + extent.num_blocks();
+    const auto end = std::partition_point(
+        begin, entries_.end(), [end_block](const Entry& entry) {
+          return entry.first.start_block() < end_block;
+        });
+    return {begin, end};
   }
 
   // Return a set of extents that are contained in this extent map.
@@ -78,19 +147,54 @@ class ExtentMap {
   // E.g. extent map contains [0,5] and [10,15], GetIntersectingExtents([3, 12])
   // would return [3,5] and [10,12]
   std::vector<Extent> GetIntersectingExtents(const Extent& extent) const {
-    return set_.GetIntersectingExtents(extent);
+    std::vector<Extent> result;
+    const uint64_t end_block = extent.start_block() + extent.num_blocks();
+    for (const auto& entry : GetIntersectingEntries(extent)) {
+      const uint64_t start =
+          std::max(entry.first.start_block(), extent.start_block());
+      const uint64_t end = std::min(entry.first.end_block(), end_block);
+      result.push_back(ExtentForRange(start, end - start));
+    }
+    return result;
   }
 
   // Complement of |GetIntersectingExtents|, return vector of extents which are
   // part of |extent| but not covered by this map.
   std::vector<Extent> GetNonIntersectingExtents(const Extent& extent) const {
-    return FilterExtentRanges({extent}, set_);
+    std::vector<Extent> result;
+    if (IsEmptyOrSparse(extent)) {
+      return result;
+    }
+    uint64_t start = extent.start_block();
+    const uint64_t end_block = start + extent.num_blocks();
+    for (const auto& entry : GetIntersectingEntries(extent)) {
+      if (entry.first.start_block() > start) {
+        result.push_back(
+            ExtentForRange(start, entry.first.start_block() - start));
+      }
+      start = entry.first.end_block();
+    }
+    if (start < end_block) {
+      result.push_back(ExtentForRange(start, end_block - start));
+    }
+    return result;
   }
 
  private:
-  // Get a range of exents that potentially intersect with parameter |extent|
-  std::map<Extent, T, Comparator> map_;
-  ExtentRanges set_{false};
+  static bool IsEmptyOrSparse(const Extent& extent) {
+    return extent.num_blocks() == 0 || extent.start_block() == kSparseHole;
+  }
+
+  // The first entry that could overlap an extent starting at |block|.
+  typename Entries::const_iterator FirstEndingAfter(uint64_t block) const {
+    return std::partition_point(
+        entries_.begin(), entries_.end(), [block](const Entry& entry) {
+          return entry.first.end_block() <= block;
+        });
+  }
+
+  // Sorted by start block, and disjoint.
+  Entries entries_;
 };
 }  // namespace chromeos_update_engine
 
@@ -15,7 +15,9 @@
 //
 
 #include <gtest/gtest.h>
+#include <iterator>
 #include <optional>
+#include <utility>
 #include <vector>
 
 #include "update_engine/payload_consumer/extent_map.h"
@@ -148,4 +150,51 @@ TEST_F(ExtentMapTest, GetTouchingExtents) {
   ASSERT_EQ(extents[1], ExtentForRange(10, 5));
 }
 
+TEST_F(ExtentMapTest, GetIntersectingEntries) {
+  ASSERT_TRUE(map_.AddExtent(ExtentForRange(10, 5), 2));
+  ASSERT_TRUE(map_.AddExtent(ExtentForRange(0, 5), 1));
+  ASSERT_TRUE(map_.AddExtent(ExtentForRange(20, 5), 3));
+  ASSERT_FALSE(map_.AddExtent(ExtentForRange(4, 2), 4));
+  ASSERT_FALSE(map_.AddExtent(ExtentForRange(30, 0), 5));
+
+  std::vector<int> values;
+  for (const auto& [extent, value] :
+       map_.GetIntersectingEntries(ExtentForRange(3, 18))) {
+    values.push_back(value);
+  }
+  ASSERT_EQ(values, (std::vector<int>{1, 2, 3}));
+
+  // The whole extents of the entries are returned.
+  const auto entries = map_.GetIntersectingEntries(ExtentForRange(12, 1));
+  ASSERT_EQ(std::distance(entries.begin(), entries.end()), 1);
+  ASSERT_EQ(Extent(entries.begin()->first), ExtentForRange(10, 5));
+
+  const auto none = map_.GetIntersectingEntries(ExtentForRange(5, 5));
+  ASSERT_EQ(none.begin(), none.end());
+}
+
+TEST_F(ExtentMapTest, BulkConstruction) {
+  std::vector<std::pair<Extent, int>> entries;
+  for (int i = 0; i < 100; i++) {
+    // Added in reverse block order.
+    entries.emplace_back(ExtentForRange((99 - i) * 10, 5), i);
+  }
+  ExtentMap<int> map(entries);
+  ASSERT_EQ(map.size(), 100UL);
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(map.Get(ExtentForRange((99 - i) * 10, 5)), i);
+  }
+
+  // Overlapping entries are dropped like with AddExtent(), the first one
+  // added wins.
+  entries = {{ExtentForRange(10, 10), 1},
+             {ExtentForRange(0, 11), 2},
+             {ExtentForRange(25, 5), 3},
+             {ExtentForRange(19, 7), 4}};
+  ExtentMap<int> overlapping(entries);
+  ASSERT_EQ(overlapping.size(), 2UL);
+  ASSERT_EQ(overlapping.Get(ExtentForRange(10, 10)), 1);
+  ASSERT_EQ(overlapping.Get(ExtentForRange(25, 5)), 3);
+}
+
 }  // namespace chromeos_update_engine
@@ -16,11 +16,12 @@
 
 #include "update_engine/payload_consumer/extent_reader.h"
 
-#include <algorithm>
-
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 
@@ -67,6 +68,9 @@ bool DirectExtentReader::Seek(uint64_t offset) {
 bool DirectExtentReader::Read(void* buffer, size_t count) {
   auto bytes = reinterpret_cast<uint8_t*>(buffer);
   uint64_t bytes_read = 0;
+  // Collect the pieces of all the extents covered by this read first, so the
+  // file descriptor can have them in flight at the same time.
+  std::vector<FileDescriptor::ReadRequest> requests;
   while (bytes_read < count) {
     if (cur_extent_ == extents_.end()) {
       TEST_AND_RETURN_FALSE(bytes_read == count);
@@ -76,15 +80,10 @@ bool DirectExtentReader::Read(void* buffer, size_t count) {
     uint64_t bytes_to_read =
         std::min(count - bytes_read, cur_extent_bytes_left);
 
-    ssize_t out_bytes_read;
-    TEST_AND_RETURN_FALSE(utils::ReadAll(
-        fd_,
-        bytes + bytes_read,
-        bytes_to_read,
-        cur_extent_->start_block() * block_size_ + cur_extent_bytes_read_,
-        &out_bytes_read));
-    TEST_AND_RETURN_FALSE(out_bytes_read ==
-                          static_cast<ssize_t>(bytes_to_read));
+    requests.push_back(
+        {cur_extent_->start_block() * block_size_ + cur_extent_bytes_read_,
+         bytes + bytes_read,
+         bytes_to_read});
 
     bytes_read += bytes_to_read;
     cur_extent_bytes_read_ += bytes_to_read;
@@ -95,6 +94,54 @@ bool DirectExtentReader::Read(void* buffer, size_t count) {
       cur_extent_bytes_read_ = 0;
     }
   }
+  return fd_->ReadBatch(requests);
+}
+
+bool BufferedExtentReader::Init(FileDescriptorPtr fd,
+                                const RepeatedPtrField<Extent>& extents,
+                                uint32_t block_size) {
+  TEST_AND_RETURN_FALSE(buffer_size_ > 0);
+  total_size_ = 0;
+  for (const auto& extent : extents)
+    total_size_ += extent.num_blocks() * block_size;
+  offset_ = 0;
+  window_size_ = 0;
+  return reader_.Init(fd, extents, block_size);
+}
+
+bool BufferedExtentReader::Seek(uint64_t offset) {
+  TEST_AND_RETURN_FALSE(offset <= total_size_);
+  offset_ = offset;
+  return true;
+}
+
+bool BufferedExtentReader::Read(void* bytes, size_t count) {
+  TEST_AND_RETURN_FALSE(count <= total_size_ - offset_);
+  auto out = static_cast<uint8_t*>(bytes);
+  while (count > 0) {
+    if (offset_ >= window_offset_ && offset_ < window_offset_ + window_size_) {
+      const size_t size =
+          std::min<uint64_t>(count, window_offset_ + window_size_ - offset_);
+      memcpy(out, buffer_.data() + (offset_ - window_offset_), size);
+      out += size;
+      count -= size;
+      offset_ += size;
+      continue;
+    }
+    if (count >= buffer_size_) {
+      TEST_AND_RETURN_FALSE(reader_.Seek(offset_));
+      TEST_AND_RETURN_FALSE(reader_.Read(out, count));
+      offset_ += count;
+      return true;
+    }
+    buffer_.resize(buffer_size_);
+    window_offset_ = offset_;
+    window_size_ = 0;
+    const size_t size = std::min<uint64_t>(buffer_size_, total_size_ - offset_);
+    TEST_AND_RETURN_FALSE(reader_.Seek(window_offset_));
+    TEST_AND_RETURN_FALSE(reader_.Read(buffer_.data(), size));
+    window_size_ = size;
+  }
   return true;
 }
 
@@ -19,6 +19,8 @@
 
 #include <vector>
 
+#include <brillo/secure_blob.h>
+
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -77,6 +79,37 @@ class DirectExtentReader : public ExtentReader {
   DISALLOW_COPY_AND_ASSIGN(DirectExtentReader);
 };
 
+// BufferedExtentReader reads ahead of a DirectExtentReader: a read outside of
+// its window refills the window with the |buffer_size| bytes from there in one
+// batch, so that the many small reads of bspatch and puffpatch are mostly
+// served from memory. Reads at least as large as the window go straight to
+// the extents.
+class BufferedExtentReader : public ExtentReader {
+ public:
+  explicit BufferedExtentReader(size_t buffer_size)
+      : buffer_size_(buffer_size) {}
+  ~BufferedExtentReader() override = default;
+
+  bool Init(FileDescriptorPtr fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* bytes, size_t count) override;
+
+ private:
+  DirectExtentReader reader_;
+  uint64_t total_size_{0};
+  uint64_t offset_{0};
+
+  // The bytes of the extents at |window_offset_|, |window_size_| of them.
+  const size_t buffer_size_;
+  brillo::Blob buffer_;
+  uint64_t window_offset_{0};
+  size_t window_size_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BufferedExtentReader);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_READER_H_
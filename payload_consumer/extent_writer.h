@@ -48,7 +48,7 @@ class ExtentWriter {
 // DirectExtentWriter is probably the simplest ExtentWriter implementation.
 // It writes the data directly into the extents.
 
-class DirectExtentWriter : public ExtentWriter {
+class DirectExtentWriter final : public ExtentWriter {
  public:
   explicit DirectExtentWriter(FileDescriptorPtr fd) : fd_(fd) {}
   ~DirectExtentWriter() override = default;
@@ -73,6 +73,30 @@ class DirectExtentWriter : public ExtentWriter {
   google::protobuf::RepeatedPtrField<Extent>::iterator cur_extent_;
 };
 
+// BlobExtentWriter collects the data written into the extents in a blob
+// instead, in the order of the extents.
+
+class BlobExtentWriter final : public ExtentWriter {
+ public:
+  explicit BlobExtentWriter(brillo::Blob* out) : out_(out) {}
+  ~BlobExtentWriter() override = default;
+
+  bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override {
+    out_->clear();
+    out_->reserve(utils::BlocksInExtents(extents) * block_size);
+    return true;
+  }
+  bool Write(const void* bytes, size_t count) override {
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    out_->insert(out_->end(), data, data + count);
+    return true;
+  }
+
+ private:
+  brillo::Blob* out_;
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_WRITER_H_
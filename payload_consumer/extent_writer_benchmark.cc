@@ -0,0 +1,189 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Measures the writers at the bottom of every operation: plain extents on a
+// file, extents of a snapshot through a COW writer, and XOR blocks.
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+#include <libsnapshot/cow_writer.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/extent_map.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/snapshot_extent_writer.h"
+#include "update_engine/payload_consumer/xor_extent_writer.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/merge_sequence_generator.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kNumBlocks = 4096;
+// The size of the chunks given to the writers, like a downloaded chunk.
+constexpr size_t kWriteSize = 64 * 1024;
+
+// Extents covering |kNumBlocks| blocks, in runs of |run_blocks| blocks
+// separated by a one block hole, and in random order when |shuffle|.
+google::protobuf::RepeatedPtrField<Extent> MakeExtents(uint64_t run_blocks,
+                                                       bool shuffle) {
+  std::vector<Extent> extents;
+  for (uint64_t blocks = 0; blocks < kNumBlocks; blocks += run_blocks) {
+    extents.push_back(
+        ExtentForRange(extents.size() * (run_blocks + 1), run_blocks));
+  }
+  if (shuffle) {
+    std::mt19937 rng(0);
+    std::shuffle(extents.begin(), extents.end(), rng);
+  }
+  google::protobuf::RepeatedPtrField<Extent> result;
+  StoreExtents(extents, &result);
+  return result;
+}
+
+brillo::Blob MakeData() {
+  brillo::Blob data(kNumBlocks * kBlockSize);
+  std::mt19937 rng(1);
+  // Half random, half zeros, so that compressing COW writers have some work.
+  std::generate(data.begin(), data.begin() + data.size() / 2, rng);
+  return data;
+}
+
+// Writes |data| to |writer| in |kWriteSize| chunks.
+bool WriteAll(ExtentWriter* writer, const brillo::Blob& data) {
+  for (size_t pos = 0; pos < data.size(); pos += kWriteSize) {
+    TEST_AND_RETURN_FALSE(writer->Write(
+        data.data() + pos, std::min(kWriteSize, data.size() - pos)));
+  }
+  return true;
+}
+
+// Arguments: the blocks per extent, and whether the extents are shuffled.
+void BM_DirectExtentWriter(benchmark::State& state) {
+  ScopedTempFile file("extent_writer_bench.XXXXXX");
+  FileDescriptorPtr fd = std::make_shared<EintrSafeFileDescriptor>();
+  CHECK(fd->Open(file.path().c_str(), O_RDWR));
+  const auto extents = MakeExtents(state.range(0), state.range(1));
+  const brillo::Blob data = MakeData();
+  for (auto _ : state) {
+    DirectExtentWriter writer(fd);
+    CHECK(writer.Init(extents, kBlockSize));
+    CHECK(WriteAll(&writer, data));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_DirectExtentWriter)
+    ->ArgNames({"run_blocks", "shuffled"})
+    ->Args({kNumBlocks, false})
+    ->Args({16, false})
+    ->Args({16, true})
+    ->Args({1, true});
+
+// A COW writer throwing away what it's given, so that only producing the COW
+// operations is measured.
+std::unique_ptr<android::snapshot::CowWriter> CreateCowWriter(
+    const std::string& compression) {
+  auto cow_writer = std::make_unique<android::snapshot::CowWriter>(
+      android::snapshot::CowOptions{
+          .block_size = static_cast<uint32_t>(kBlockSize),
+          .compression = compression});
+  CHECK(cow_writer->Initialize(android::base::borrowed_fd{-1}));
+  return cow_writer;
+}
+
+void BM_SnapshotExtentWriter(benchmark::State& state,
+                             const std::string& compression) {
+  const auto extents = MakeExtents(16, true);
+  const brillo::Blob data = MakeData();
+  auto cow_writer = CreateCowWriter(compression);
+  for (auto _ : state) {
+    SnapshotExtentWriter writer(cow_writer.get());
+    CHECK(writer.Init(extents, kBlockSize));
+    CHECK(WriteAll(&writer, data));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK_CAPTURE(BM_SnapshotExtentWriter, none, std::string());
+BENCHMARK_CAPTURE(BM_SnapshotExtentWriter, gz, std::string("gz"));
+BENCHMARK_CAPTURE(BM_SnapshotExtentWriter, lz4, std::string("lz4"));
+BENCHMARK_CAPTURE(BM_SnapshotExtentWriter, brotli, std::string("brotli"));
+
+// Argument: the percentage of the target blocks covered by XOR merge
+// operations, the others being written as plain replace blocks.
+void BM_XORExtentWriter(benchmark::State& state) {
+  ScopedTempFile source("xor_writer_bench.XXXXXX");
+  const brillo::Blob data = MakeData();
+  CHECK(utils::WriteFile(source.path().c_str(), data.data(), data.size()));
+  FileDescriptorPtr source_fd = std::make_shared<EintrSafeFileDescriptor>();
+  CHECK(source_fd->Open(source.path().c_str(), O_RDONLY));
+
+  // The operation moves the first half of the source blocks to the second
+  // half of the target, and the other way around.
+  InstallOperation op;
+  *op.add_src_extents() = ExtentForRange(0, kNumBlocks);
+  *op.add_dst_extents() = ExtentForRange(kNumBlocks / 2, kNumBlocks / 2);
+  *op.add_dst_extents() = ExtentForRange(0, kNumBlocks / 2);
+  std::vector<CowMergeOperation> merge_ops;
+  const uint64_t xor_blocks = kNumBlocks * state.range(0) / 100;
+  constexpr uint64_t kMergeOpBlocks = 16;
+  merge_ops.reserve(xor_blocks / kMergeOpBlocks);
+  // The unaligned XOR operations read one block past their source extent, so
+  // the last source block is left out.
+  for (uint64_t block = 0; block + kMergeOpBlocks <= xor_blocks &&
+                           block + kMergeOpBlocks < kNumBlocks;
+       block += kMergeOpBlocks) {
+    const uint64_t dst_block = (block + kNumBlocks / 2) % kNumBlocks;
+    merge_ops.push_back(
+        CreateCowMergeOperation(ExtentForRange(block, kMergeOpBlocks),
+                                ExtentForRange(dst_block, kMergeOpBlocks),
+                                CowMergeOperation::COW_XOR,
+                                123));
+  }
+  ExtentMap<const CowMergeOperation*> xor_map;
+  for (const auto& merge_op : merge_ops) {
+    CHECK(xor_map.AddExtent(merge_op.dst_extent(), &merge_op));
+  }
+
+  auto cow_writer = CreateCowWriter("");
+  for (auto _ : state) {
+    XORExtentWriter writer(op, source_fd, cow_writer.get(), xor_map);
+    CHECK(writer.Init(op.dst_extents(), kBlockSize));
+    CHECK(WriteAll(&writer, data));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_XORExtentWriter)
+    ->ArgName("xor_percent")
+    ->Arg(0)
+    ->Arg(50)
+    ->Arg(100);
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
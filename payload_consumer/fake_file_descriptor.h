@@ -60,6 +60,11 @@ class FakeFileDescriptor : public FileDescriptor {
 
   off64_t Seek(off64_t offset, int whence) override;
 
+  bool Readahead(uint64_t offset, uint64_t count) override {
+    readahead_ops_.emplace_back(offset, count);
+    return true;
+  }
+
   uint64_t BlockDevSize() override { return size_; }
 
   bool BlkIoctl(int request,
@@ -101,6 +106,12 @@ class FakeFileDescriptor : public FileDescriptor {
     return read_ops_;
   }
 
+  // Return the list of ranges of bytes passed to Readahead() as (offset,
+  // length).
+  std::vector<std::pair<uint64_t, uint64_t>> GetReadaheadOps() const {
+    return readahead_ops_;
+  }
+
  private:
   // Whether the fake file is open.
   bool open_{false};
@@ -118,6 +129,9 @@ class FakeFileDescriptor : public FileDescriptor {
   // List of reads performed as (offset, length) of the read request.
   std::vector<std::pair<uint64_t, uint64_t>> read_ops_;
 
+  // List of Readahead() calls as (offset, length).
+  std::vector<std::pair<uint64_t, uint64_t>> readahead_ops_;
+
   DISALLOW_COPY_AND_ASSIGN(FakeFileDescriptor);
 };
 
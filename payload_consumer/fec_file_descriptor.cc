@@ -16,10 +16,63 @@
 
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <utility>
+
 #include <base/logging.h>
 
+#include "update_engine/common/worker_pool.h"
+
+using google::protobuf::RepeatedPtrField;
+
 namespace chromeos_update_engine {
 
+namespace {
+// The bytes decoded by each task of ParallelRead(), and the most threads
+// decoding them.
+constexpr size_t kDecodeChunkSize = 256 * 1024;
+constexpr size_t kMaxDecodeThreads = 8;
+}  // namespace
+
+bool FecFileDescriptor::Prefetch(const RepeatedPtrField<Extent>& extents,
+                                 size_t block_size) {
+  decoded_ranges_.clear();
+  decoded_reservation_.Release();
+  uint64_t size = 0;
+  for (const Extent& extent : extents)
+    size += extent.num_blocks() * block_size;
+  MemoryBudget::Reservation reservation = MemoryBudget::Get()->Reserve(
+      0, std::min<uint64_t>(size, kMaxDecodedSize), block_size, "fec");
+
+  std::map<uint64_t, brillo::Blob> ranges;
+  std::vector<ReadRequest> requests;
+  size_t remaining = reservation.size();
+  for (const Extent& extent : extents) {
+    if (remaining == 0)
+      break;
+    const uint64_t offset = extent.start_block() * block_size;
+    const size_t count =
+        std::min<uint64_t>(extent.num_blocks() * block_size, remaining);
+    if (count == 0 || ranges.count(offset) > 0)
+      continue;
+    brillo::Blob& data = ranges[offset];
+    data.resize(count);
+    requests.push_back({offset, data.data(), count});
+    remaining -= count;
+  }
+  if (!ParallelRead(requests)) {
+    LOG(ERROR) << "Unable to decode " << requests.size() << " extents.";
+    return false;
+  }
+  decoded_ranges_ = std::move(ranges);
+  decoded_reservation_ = std::move(reservation);
+  return true;
+}
+
 bool FecFileDescriptor::Open(const char* path, int flags) {
   return Open(path, flags, 0600);
 }
@@ -46,7 +99,10 @@ bool FecFileDescriptor::Open(const char* path, int flags, mode_t mode) {
 }
 
 ssize_t FecFileDescriptor::Read(void* buf, size_t count) {
-  return fh_.read(buf, count);
+  const ssize_t bytes_read = ReadAt(buf, count, offset_);
+  if (bytes_read > 0)
+    offset_ += bytes_read;
+  return bytes_read;
 }
 
 ssize_t FecFileDescriptor::Write(const void* buf, size_t count) {
@@ -55,10 +111,21 @@ ssize_t FecFileDescriptor::Write(const void* buf, size_t count) {
 }
 
 off64_t FecFileDescriptor::Seek(off64_t offset, int whence) {
-  if (fh_.seek(offset, whence)) {
-    return offset;
+  if (!fh_.seek(offset, whence)) {
+    return -1;
   }
-  return -1;
+  if (whence == SEEK_SET) {
+    offset_ = offset;
+  } else if (whence == SEEK_CUR) {
+    offset_ += offset;
+  } else {
+    offset_ = dev_size_ + offset;
+  }
+  return offset_;
+}
+
+bool FecFileDescriptor::ReadBatch(const std::vector<ReadRequest>& requests) {
+  return ParallelRead(requests);
 }
 
 uint64_t FecFileDescriptor::BlockDevSize() {
@@ -74,7 +141,84 @@ bool FecFileDescriptor::BlkIoctl(int request,
 }
 
 bool FecFileDescriptor::Close() {
+  decoded_ranges_.clear();
+  decoded_reservation_.Release();
+  offset_ = 0;
   return fh_.close();
 }
 
+ssize_t FecFileDescriptor::ReadAt(void* buf, size_t count, uint64_t offset) {
+  auto bytes = static_cast<uint8_t*>(buf);
+  size_t total_bytes_read = 0;
+  while (total_bytes_read < count) {
+    const uint64_t read_offset = offset + total_bytes_read;
+    auto next = decoded_ranges_.upper_bound(read_offset);
+    if (next != decoded_ranges_.begin()) {
+      auto range = std::prev(next);
+      const uint64_t range_end = range->first + range->second.size();
+      if (read_offset < range_end) {
+        const size_t size = std::min<uint64_t>(count - total_bytes_read,
+                                               range_end - read_offset);
+        memcpy(bytes + total_bytes_read,
+               range->second.data() + (read_offset - range->first),
+               size);
+        total_bytes_read += size;
+        continue;
+      }
+    }
+    // Decode up to the next decoded range.
+    size_t size = count - total_bytes_read;
+    if (next != decoded_ranges_.end())
+      size = std::min<uint64_t>(size, next->first - read_offset);
+    const ssize_t bytes_read =
+        fh_.pread(bytes + total_bytes_read, size, read_offset);
+    if (bytes_read < 0)
+      return total_bytes_read > 0 ? total_bytes_read : -1;
+    total_bytes_read += bytes_read;
+    if (static_cast<size_t>(bytes_read) < size)
+      break;
+  }
+  return total_bytes_read;
+}
+
+bool FecFileDescriptor::ParallelRead(const std::vector<ReadRequest>& requests) {
+  // Decoding is CPU bound, the requests are split in chunks decoded side by
+  // side. fec::io::pread() is safe to call concurrently.
+  std::vector<ReadRequest> chunks;
+  for (const ReadRequest& request : requests) {
+    for (size_t done = 0; done < request.count; done += kDecodeChunkSize) {
+      chunks.push_back({request.offset + done,
+                        static_cast<uint8_t*>(request.buffer) + done,
+                        std::min(kDecodeChunkSize, request.count - done)});
+    }
+  }
+  auto read_chunk = [this](const ReadRequest& chunk) {
+    const ssize_t bytes_read = ReadAt(chunk.buffer, chunk.count, chunk.offset);
+    if (bytes_read < 0 || static_cast<size_t>(bytes_read) != chunk.count) {
+      PLOG(ERROR) << "Unable to read " << chunk.count << " bytes at offset "
+                  << chunk.offset;
+      return false;
+    }
+    return true;
+  };
+
+  const size_t num_threads = std::min<size_t>(
+      {chunks.size(),
+       kMaxDecodeThreads,
+       std::max(std::thread::hardware_concurrency(), 1u)});
+  if (num_threads <= 1) {
+    for (const ReadRequest& chunk : chunks) {
+      if (!read_chunk(chunk))
+        return false;
+    }
+    return true;
+  }
+  WorkerPool pool(num_threads, num_threads * 2);
+  for (const ReadRequest& chunk : chunks) {
+    if (!pool.Post([&read_chunk, chunk]() { return read_chunk(chunk); }))
+      break;
+  }
+  return pool.Wait();
+}
+
 }  // namespace chromeos_update_engine
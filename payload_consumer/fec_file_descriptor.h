@@ -17,9 +17,19 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_FEC_FILE_DESCRIPTOR_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_FEC_FILE_DESCRIPTOR_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+#include <brillo/secure_blob.h>
 #include <fec/io.h>
+#include <google/protobuf/repeated_field.h>
 
+#include "update_engine/common/memory_budget.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
 
 // A FileDescriptor implementation with error correction based on the "libfec"
 // library. The libfec on the running system allows to parse the error
@@ -35,12 +45,21 @@ class FecFileDescriptor : public FileDescriptor {
   FecFileDescriptor() = default;
   ~FecFileDescriptor() = default;
 
+  // Decodes the blocks of |extents| on several threads and keeps them,
+  // replacing the ones of the previous call, so the next reads of them don't
+  // decode them again. At most kMaxDecodedSize bytes are kept, the others are
+  // decoded when read. Returns false if any of them can't be decoded.
+  bool Prefetch(const google::protobuf::RepeatedPtrField<Extent>& extents,
+                size_t block_size);
+
   // Interface methods.
   bool Open(const char* path, int flags, mode_t mode) override;
   bool Open(const char* path, int flags) override;
   ssize_t Read(void* buf, size_t count) override;
   ssize_t Write(const void* buf, size_t count) override;
   off64_t Seek(off64_t offset, int whence) override;
+  // Decodes the requests on several threads.
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override;
   uint64_t BlockDevSize() override;
   bool BlkIoctl(int request,
                 uint64_t start,
@@ -56,8 +75,22 @@ class FecFileDescriptor : public FileDescriptor {
   }
 
  protected:
+  // The most bytes kept by Prefetch().
+  static constexpr size_t kMaxDecodedSize = 16 * 1024 * 1024;
+
+  // Reads up to |count| bytes at |offset|, from the decoded ranges when there.
+  // Returns the bytes read, or -1 on error. Safe to call concurrently.
+  ssize_t ReadAt(void* buf, size_t count, uint64_t offset);
+  // Performs all the |requests| with ReadAt(), split among several threads.
+  bool ParallelRead(const std::vector<ReadRequest>& requests);
+
   fec::io fh_;
   uint64_t dev_size_{0};
+  off64_t offset_{0};
+
+  // The ranges decoded by Prefetch(), by offset.
+  std::map<uint64_t, brillo::Blob> decoded_ranges_;
+  MemoryBudget::Reservation decoded_reservation_;
 };
 
 }  // namespace chromeos_update_engine
@@ -16,19 +16,48 @@
 
 #include "update_engine/payload_consumer/file_descriptor.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <numeric>
+
 #include <base/posix/eintr_wrapper.h>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/read_planner.h"
 
 namespace chromeos_update_engine {
 
+bool FileDescriptor::ReadBatch(const std::vector<ReadRequest>& requests) {
+  for (const auto& request : requests) {
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        this, request.buffer, request.count, request.offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(request.count));
+  }
+  return true;
+}
+
+bool FileDescriptor::WriteBatch(const std::vector<WriteRequest>& requests) {
+  const off64_t old_offset = Seek(0, SEEK_CUR);
+  TEST_AND_RETURN_FALSE_ERRNO(old_offset >= 0);
+  for (const auto& request : requests) {
+    TEST_AND_RETURN_FALSE_ERRNO(Seek(request.offset, SEEK_SET) ==
+                                static_cast<off64_t>(request.offset));
+    TEST_AND_RETURN_FALSE(utils::WriteAll(this, request.buffer, request.count));
+  }
+  TEST_AND_RETURN_FALSE_ERRNO(Seek(old_offset, SEEK_SET) == old_offset);
+  return true;
+}
+
 EintrSafeFileDescriptor::~EintrSafeFileDescriptor() {
   if (IsOpen()) {
     Close();
@@ -74,6 +103,145 @@ off64_t EintrSafeFileDescriptor::Seek(off64_t offset, int whence) {
   return lseek64(fd_, offset, whence);
 }
 
+bool EintrSafeFileDescriptor::ReadBatch(
+    const std::vector<ReadRequest>& requests) {
+  CHECK_GE(fd_, 0);
+  for (auto& read : PlanReads(requests)) {
+    while (read.count > 0) {
+      const ssize_t rc = HANDLE_EINTR(
+          preadv(fd_, read.iov(), read.iovcnt(), read.offset));
+      if (rc <= 0) {
+        if (read.gap_bytes > 0) {
+          // The blocks between two requests may be unreadable (e.g. corrupted
+          // under dm-verity) without the requested ones being so.
+          return FileDescriptor::ReadBatch(requests);
+        }
+        if (rc < 0) {
+          PLOG(ERROR) << "Failed to read " << read.count << " bytes at offset "
+                      << read.offset;
+        } else {
+          LOG(ERROR) << "Unexpected end of file at offset " << read.offset;
+        }
+        return false;
+      }
+      read.Advance(rc);
+    }
+  }
+  return true;
+}
+
+bool EintrSafeFileDescriptor::WriteBatch(
+    const std::vector<WriteRequest>& requests) {
+  CHECK_GE(fd_, 0);
+#ifdef IOV_MAX
+  constexpr size_t kMaxIovecs = IOV_MAX;
+#else
+  constexpr size_t kMaxIovecs = 1024;
+#endif
+  std::vector<size_t> order(requests.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&requests](size_t a, size_t b) {
+    return requests[a].offset < requests[b].offset;
+  });
+
+  std::vector<iovec> iovecs;
+  for (size_t i = 0; i < order.size();) {
+    // The requests from |i| on which are contiguous in the file.
+    const uint64_t offset = requests[order[i]].offset;
+    uint64_t end = offset;
+    iovecs.clear();
+    for (; i < order.size() && iovecs.size() < kMaxIovecs; i++) {
+      const WriteRequest& request = requests[order[i]];
+      if (request.offset != end)
+        break;
+      iovecs.push_back({const_cast<void*>(request.buffer), request.count});
+      end += request.count;
+    }
+    size_t first_iovec = 0;
+    uint64_t written = offset;
+    while (written < end) {
+      const ssize_t rc = HANDLE_EINTR(pwritev(fd_,
+                                              iovecs.data() + first_iovec,
+                                              iovecs.size() - first_iovec,
+                                              written));
+      if (rc <= 0) {
+        PLOG(ERROR) << "Failed to write " << end - written
+                    << " bytes at offset " << written;
+        return false;
+      }
+      written += rc;
+      // Skip the vectors written, and the part of the one written partially.
+      for (size_t bytes = rc; bytes > 0;) {
+        iovec& vec = iovecs[first_iovec];
+        if (bytes < vec.iov_len) {
+          vec.iov_base = static_cast<uint8_t*>(vec.iov_base) + bytes;
+          vec.iov_len -= bytes;
+          break;
+        }
+        bytes -= vec.iov_len;
+        first_iovec++;
+      }
+    }
+  }
+  return true;
+}
+
+bool EintrSafeFileDescriptor::CopyFrom(FileDescriptor* source,
+                                       uint64_t src_offset,
+                                       uint64_t dst_offset,
+                                       size_t count) {
+  CHECK_GE(fd_, 0);
+  return !copy_unsupported_ &&
+         source->CopyTo(this, src_offset, dst_offset, count);
+}
+
+bool EintrSafeFileDescriptor::CopyTo(EintrSafeFileDescriptor* target,
+                                     uint64_t src_offset,
+                                     uint64_t dst_offset,
+                                     size_t count) {
+  if (fd_ < 0)
+    return false;
+  off64_t in_offset = src_offset;
+  off64_t out_offset = dst_offset;
+  while (count > 0) {
+    const ssize_t rc = HANDLE_EINTR(copy_file_range(
+        fd_, &in_offset, target->fd_, &out_offset, count, 0));
+    if (rc < 0 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                   errno == EOPNOTSUPP || errno == EBADF)) {
+      // Not an I/O error, the files just can't be copied this way.
+      target->copy_unsupported_ = true;
+      return false;
+    }
+    if (rc <= 0) {
+      PLOG(ERROR) << "Failed to copy " << count << " bytes from offset "
+                  << in_offset << " to " << out_offset;
+      return false;
+    }
+    count -= rc;
+  }
+  return true;
+}
+
+bool EintrSafeFileDescriptor::MapReadOnly(uint64_t offset,
+                                          size_t size,
+                                          base::MemoryMappedFile* mapping) {
+  CHECK_GE(fd_, 0);
+  const int fd = HANDLE_EINTR(fcntl(fd_, F_DUPFD_CLOEXEC, 0));
+  if (fd < 0) {
+    PLOG(WARNING) << "Failed to duplicate the descriptor to map it";
+    return false;
+  }
+  return mapping->Initialize(
+      base::File(fd),
+      base::MemoryMappedFile::Region{static_cast<int64_t>(offset), size},
+      base::MemoryMappedFile::READ_ONLY);
+}
+
+bool EintrSafeFileDescriptor::Readahead(uint64_t offset, uint64_t count) {
+  CHECK_GE(fd_, 0);
+  return posix_fadvise(fd_, offset, count, POSIX_FADV_WILLNEED) == 0;
+}
+
 uint64_t EintrSafeFileDescriptor::BlockDevSize() {
   if (fd_ < 0)
     return 0;
@@ -20,7 +20,9 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <memory>
+#include <vector>
 
+#include <base/files/memory_mapped_file.h>
 #include <base/macros.h>
 
 // Abstraction for managing opening, reading, writing and closing of file
@@ -42,12 +44,27 @@
 
 namespace chromeos_update_engine {
 
+class EintrSafeFileDescriptor;
 class FileDescriptor;
 using FileDescriptorPtr = std::shared_ptr<FileDescriptor>;
 
 // An abstract class defining the file descriptor API.
 class FileDescriptor {
  public:
+  // A read of |count| bytes at |offset| into |buffer|, see ReadBatch().
+  struct ReadRequest {
+    uint64_t offset;
+    void* buffer;
+    size_t count;
+  };
+
+  // A write of the |count| bytes of |buffer| at |offset|, see WriteBatch().
+  struct WriteRequest {
+    uint64_t offset;
+    const void* buffer;
+    size_t count;
+  };
+
   FileDescriptor() {}
   virtual ~FileDescriptor() {}
 
@@ -72,6 +89,61 @@ class FileDescriptor {
   // may set errno accordingly.
   virtual off64_t Seek(off64_t offset, int whence) = 0;
 
+  // Performs all the |requests|, in any order and possibly several at a time.
+  // The descriptor must be open prior to this call, and the file offset is
+  // preserved. Returns false if any request fails or hits the end of the file
+  // before reading |count| bytes. The default implementation performs them one
+  // by one with Seek() and Read().
+  virtual bool ReadBatch(const std::vector<ReadRequest>& requests);
+
+  // Performs all the |requests|, which must not overlap, in any order. The
+  // descriptor must be open prior to this call, and the file offset is
+  // preserved. Returns false if any request fails. The default implementation
+  // performs them one by one with Seek() and Write().
+  virtual bool WriteBatch(const std::vector<WriteRequest>& requests);
+
+  // Copies the |count| bytes of |source| at |src_offset| to |dst_offset| in
+  // this file within the kernel, without going through a userspace buffer.
+  // Both descriptors must be open and their file offsets are preserved.
+  // Returns false if the copy isn't supported between them or fails, in which
+  // case the destination bytes are undefined and the caller must write them
+  // itself. The default implementation doesn't support any copy.
+  virtual bool CopyFrom(FileDescriptor* source,
+                        uint64_t src_offset,
+                        uint64_t dst_offset,
+                        size_t count) {
+    return false;
+  }
+
+  // The source side of CopyFrom(), once it reached the |target| descriptor
+  // of the file: copies the |count| bytes of this file at |src_offset| to
+  // |dst_offset| in |target| within the kernel. The descriptors reading the
+  // file they wrap unchanged pass the copy to it. The default implementation
+  // doesn't support any copy.
+  virtual bool CopyTo(EintrSafeFileDescriptor* target,
+                      uint64_t src_offset,
+                      uint64_t dst_offset,
+                      size_t count) {
+    return false;
+  }
+
+  // Maps the |size| bytes of the file at |offset| read-only in |mapping|, so
+  // that they are read in place through the page cache instead of copied into
+  // a buffer. Returns false if the file can't be mapped, in which case the
+  // caller must read the bytes itself. The default implementation doesn't map
+  // anything.
+  virtual bool MapReadOnly(uint64_t offset,
+                           size_t size,
+                           base::MemoryMappedFile* mapping) {
+    return false;
+  }
+
+  // Hints that the |count| bytes of the file at |offset| are about to be read,
+  // so they are read into the page cache in the background. Returns false if
+  // the hint isn't supported or failed, which is harmless. The default
+  // implementation doesn't support it.
+  virtual bool Readahead(uint64_t offset, uint64_t count) { return false; }
+
   // Return the size of the block device in bytes, or 0 if the device is not a
   // block device or an error occurred.
   virtual uint64_t BlockDevSize() = 0;
@@ -119,6 +191,26 @@ class EintrSafeFileDescriptor : public FileDescriptor {
   ssize_t Read(void* buf, size_t count) override;
   ssize_t Write(const void* buf, size_t count) override;
   off64_t Seek(off64_t offset, int whence) override;
+  // Merges nearby requests and reads them with preadv().
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override;
+  // Writes the requests contiguous in the file with pwritev().
+  bool WriteBatch(const std::vector<WriteRequest>& requests) override;
+  // Copies with copy_file_range() from the EintrSafeFileDescriptor which
+  // |source| reads, through the CopyTo() of its wrappers.
+  bool CopyFrom(FileDescriptor* source,
+                uint64_t src_offset,
+                uint64_t dst_offset,
+                size_t count) override;
+  bool CopyTo(EintrSafeFileDescriptor* target,
+              uint64_t src_offset,
+              uint64_t dst_offset,
+              size_t count) override;
+  // Maps a duplicate of the descriptor, which the mapping owns.
+  bool MapReadOnly(uint64_t offset,
+                   size_t size,
+                   base::MemoryMappedFile* mapping) override;
+  // Advises the kernel with posix_fadvise(POSIX_FADV_WILLNEED).
+  bool Readahead(uint64_t offset, uint64_t count) override;
   uint64_t BlockDevSize() override;
   bool BlkIoctl(int request,
                 uint64_t start,
@@ -131,6 +223,9 @@ class EintrSafeFileDescriptor : public FileDescriptor {
 
  protected:
   int fd_;
+  // Set once copy_file_range() is found not to work on this file, e.g. on
+  // block devices of kernels which only copy between regular files.
+  bool copy_unsupported_{false};
 };
 
 }  // namespace chromeos_update_engine
@@ -17,6 +17,7 @@
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 
 #include <algorithm>
+#include <future>
 
 #include <base/logging.h>
 
@@ -44,29 +45,57 @@ bool CommonHashExtents(FileDescriptorPtr source,
                        uint64_t block_size,
                        brillo::Blob* hash_out) {
   auto total_blocks = utils::BlocksInExtents(src_extents);
-  auto buffer_blocks = kMaxCopyBufferSize / block_size;
-  // Ensure we copy at least one block at a time.
-  if (buffer_blocks < 1)
-    buffer_blocks = 1;
-  brillo::Blob buf(buffer_blocks * block_size);
+  // Ensure we copy at least one block at a time, and no more than the extents
+  // hold.
+  const uint64_t buffer_blocks = std::clamp<uint64_t>(
+      kMaxCopyBufferSize / block_size, 1, std::max<uint64_t>(total_blocks, 1));
 
   DirectExtentReader reader;
   TEST_AND_RETURN_FALSE(reader.Init(source, src_extents, block_size));
 
   HashCalculator source_hasher;
-  while (total_blocks > 0) {
-    auto read_blocks = std::min(total_blocks, buffer_blocks);
-    TEST_AND_RETURN_FALSE(reader.Read(buf.data(), read_blocks * block_size));
+  auto consume = [&](const brillo::Blob& buf, uint64_t num_blocks) {
     if (hash_out != nullptr) {
       TEST_AND_RETURN_FALSE(
-          source_hasher.Update(buf.data(), read_blocks * block_size));
+          source_hasher.Update(buf.data(), num_blocks * block_size));
     }
     if (writer) {
-      TEST_AND_RETURN_FALSE(
-          writer->Write(buf.data(), read_blocks * block_size));
+      TEST_AND_RETURN_FALSE(writer->Write(buf.data(), num_blocks * block_size));
     }
+    return true;
+  };
+
+  // When the extents don't fit in one buffer, the next one is read on another
+  // thread while the current one is hashed and written.
+  brillo::Blob bufs[2];
+  size_t current = 0;
+  uint64_t read_blocks = std::min(total_blocks, buffer_blocks);
+  if (read_blocks > 0) {
+    bufs[current].resize(buffer_blocks * block_size);
+    TEST_AND_RETURN_FALSE(
+        reader.Read(bufs[current].data(), read_blocks * block_size));
     total_blocks -= read_blocks;
   }
+  while (read_blocks > 0) {
+    const uint64_t current_blocks = read_blocks;
+    const size_t next = 1 - current;
+    read_blocks = std::min(total_blocks, buffer_blocks);
+    std::future<bool> next_read;
+    if (read_blocks > 0) {
+      bufs[next].resize(buffer_blocks * block_size);
+      next_read = std::async(std::launch::async, [&, next, read_blocks] {
+        return reader.Read(bufs[next].data(), read_blocks * block_size);
+      });
+      total_blocks -= read_blocks;
+    }
+    const bool consumed = consume(bufs[current], current_blocks);
+    // The pending read uses |reader| and |bufs|, so always wait for it.
+    if (next_read.valid()) {
+      TEST_AND_RETURN_FALSE(next_read.get());
+    }
+    TEST_AND_RETURN_FALSE(consumed);
+    current = next;
+  }
 
   if (hash_out != nullptr) {
     TEST_AND_RETURN_FALSE(source_hasher.Finalize());
@@ -90,6 +119,42 @@ bool CopyAndHashExtents(FileDescriptorPtr source,
   return true;
 }
 
+bool CopyExtentsInKernel(FileDescriptorPtr source,
+                         const RepeatedPtrField<Extent>& src_extents,
+                         FileDescriptorPtr target,
+                         const RepeatedPtrField<Extent>& tgt_extents,
+                         uint64_t block_size) {
+  TEST_AND_RETURN_FALSE(utils::BlocksInExtents(src_extents) ==
+                        utils::BlocksInExtents(tgt_extents));
+  auto src_it = src_extents.begin();
+  auto tgt_it = tgt_extents.begin();
+  // The blocks of |*src_it| and |*tgt_it| already copied.
+  uint64_t src_done = 0;
+  uint64_t tgt_done = 0;
+  while (src_it != src_extents.end() && tgt_it != tgt_extents.end()) {
+    const uint64_t num_blocks = min(src_it->num_blocks() - src_done,
+                                    tgt_it->num_blocks() - tgt_done);
+    if (num_blocks > 0 &&
+        !target->CopyFrom(source.get(),
+                          (src_it->start_block() + src_done) * block_size,
+                          (tgt_it->start_block() + tgt_done) * block_size,
+                          num_blocks * block_size)) {
+      return false;
+    }
+    src_done += num_blocks;
+    tgt_done += num_blocks;
+    if (src_done == src_it->num_blocks()) {
+      ++src_it;
+      src_done = 0;
+    }
+    if (tgt_done == tgt_it->num_blocks()) {
+      ++tgt_it;
+      tgt_done = 0;
+    }
+  }
+  return true;
+}
+
 bool ReadAndHashExtents(FileDescriptorPtr source,
                         const RepeatedPtrField<Extent>& extents,
                         uint64_t block_size,
@@ -26,6 +26,10 @@
 namespace chromeos_update_engine {
 namespace fd_utils {
 
+// Reads the blocks of |src_extents| from |source|, writing them to |writer| and
+// hashing them into |hash_out|, either of which may be null. When the extents
+// span several buffers, the next one is read while the current one is written,
+// on another thread, so |source| must not be used by |writer| or concurrently.
 bool CommonHashExtents(
     FileDescriptorPtr source,
     const google::protobuf::RepeatedPtrField<Extent>& src_extents,
@@ -50,6 +54,20 @@ bool CopyAndHashExtents(
     uint64_t block_size,
     brillo::Blob* hash_out);
 
+// Copies the blocks of |src_extents| in |source| to the blocks of
+// |tgt_extents| in |target| with FileDescriptor::CopyFrom(), one run of blocks
+// contiguous in both at a time, without hashing them. The extents must have
+// the same length in number of blocks. Returns false as soon as a run can't
+// be copied this way, in which case the caller must copy all the blocks
+// again, e.g. with CopyAndHashExtents(). The same constraints on overlapping
+// extents apply.
+bool CopyExtentsInKernel(
+    FileDescriptorPtr source,
+    const google::protobuf::RepeatedPtrField<Extent>& src_extents,
+    FileDescriptorPtr target,
+    const google::protobuf::RepeatedPtrField<Extent>& tgt_extents,
+    uint64_t block_size);
+
 // Reads blocks from |source| and calculates the hash. The blocks to read are
 // specified by |extents|. Stores the hash in |hash_out| if it is not null. The
 // block sizes are passed as |block_size|. In case of error reading, it returns
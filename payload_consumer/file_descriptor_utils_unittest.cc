@@ -18,6 +18,7 @@
 
 #include <fcntl.h>
 
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
@@ -165,6 +166,52 @@ TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsManyToManyTest) {
   EXPECT_EQ(expected_hash, hash_out);
 }
 
+// Extents spanning several copy buffers are read ahead of the writes, which
+// must still see the blocks in order.
+TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsSeveralBuffersTest) {
+  constexpr uint64_t kBlockSize = 4096;
+  brillo::Blob hash_out;
+  auto src_extents = CreateExtentList({{1000, 100}, {0, 600}});
+  auto tgt_extents = CreateExtentList({{0, 700}});
+
+  EXPECT_TRUE(fd_utils::CopyAndHashExtents(
+      source_, src_extents, target_, tgt_extents, kBlockSize, &hash_out));
+
+  const brillo::Blob data = FakeFileDescriptorData(1100 * kBlockSize);
+  std::string expected(data.begin() + 1000 * kBlockSize, data.end());
+  expected.append(data.begin(), data.begin() + 600 * kBlockSize);
+  ExpectTarget(expected);
+
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+      expected.data(), expected.size(), &expected_hash));
+  EXPECT_EQ(expected_hash, hash_out);
+}
+
+TEST_F(FileDescriptorUtilsTest, CopyExtentsInKernelManyToManyTest) {
+  ScopedTempFile src_file("fd_src.XXXXXX");
+  const std::string kSourceContents = "00000001000200030004";
+  ASSERT_TRUE(utils::WriteFile(src_file.path().c_str(),
+                               kSourceContents.data(),
+                               kSourceContents.size()));
+  FileDescriptorPtr source = std::make_shared<EintrSafeFileDescriptor>();
+  ASSERT_TRUE(source->Open(src_file.path().c_str(), O_RDONLY));
+  auto src_extents = CreateExtentList({{1, 1}, {4, 1}, {2, 2}, {0, 1}});
+  auto tgt_extents = CreateExtentList({{2, 3}, {0, 2}});
+
+  EXPECT_TRUE(fd_utils::CopyExtentsInKernel(
+      source, src_extents, target_, tgt_extents, 4));
+  ExpectTarget("00030000000100040002");
+}
+
+// Only the files the kernel can copy between are copied that way.
+TEST_F(FileDescriptorUtilsTest, CopyExtentsInKernelUnsupportedTest) {
+  auto extents = CreateExtentList({{0, 5}});
+  EXPECT_FALSE(
+      fd_utils::CopyExtentsInKernel(source_, extents, target_, extents, 4));
+  EXPECT_TRUE(fake_source_->GetReadOps().empty());
+}
+
 // Failing to read from the source should fail the hash calculation.
 TEST_F(FileDescriptorUtilsTest, ReadAndHashExtentsReadFailureTest) {
   auto extents = CreateExtentList({{0, 5}});
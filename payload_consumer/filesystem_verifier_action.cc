@@ -27,17 +27,25 @@
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <base/bind.h>
 #include <base/strings/string_util.h>
+#include <base/time/time.h>
 #include <brillo/data_encoding.h>
 #include <brillo/message_loops/message_loop.h>
 #include <brillo/secure_blob.h>
 #include <brillo/streams/file_stream.h>
 
 #include "common/error_code.h"
+#include "update_engine/common/constants.h"
+#include "update_engine/common/performance_recorder.h"
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/instrumented_file_descriptor.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+#include "update_engine/payload_consumer/source_hash_cache.h"
 
 using brillo::data_encoding::Base64Encode;
 using std::string;
@@ -77,7 +85,40 @@ namespace chromeos_update_engine {
 
 namespace {
 const off_t kReadFileBufferSize = 128 * 1024;
+// Size of the individual requests a buffer read is split into, so that an
+// io_uring backed file descriptor can keep several of them in flight.
+const size_t kReadRequestSize = 32 * 1024;
+
+// Fills |buffer| with |count| bytes of |fd| starting at |offset|.
+bool ReadAt(FileDescriptor* fd, void* buffer, size_t count, off64_t offset) {
+  UE_TRACE_SCOPE_F(
+      "ReadAt %zu bytes at %jd", count, static_cast<intmax_t>(offset));
+  std::vector<FileDescriptor::ReadRequest> requests;
+  auto bytes = static_cast<uint8_t*>(buffer);
+  for (size_t pos = 0; pos < count; pos += kReadRequestSize) {
+    requests.push_back({static_cast<uint64_t>(offset + pos),
+                        bytes + pos,
+                        std::min(kReadRequestSize, count - pos)});
+  }
+  return fd->ReadBatch(requests);
+}
+
 constexpr float kVerityProgressPercent = 0.6;
+// The number of bytes of each partition hashed by one step of
+// HashPartitionsInParallel(), before returning to the message loop.
+constexpr uint64_t kParallelHashStepSize = 4 * 1024 * 1024;
+
+// How often the progress of the target hashes is saved to prefs.
+constexpr int64_t kCheckpointFrequencySeconds = 5;
+// The keys of a checkpoint under kPrefsVerifyCheckpoint/<partition name>/.
+constexpr char kCheckpointOffset[] = "offset";
+constexpr char kCheckpointContext[] = "sha-256-context";
+constexpr char kCheckpointTargetHash[] = "target-hash";
+
+string CheckpointKey(const string& partition_name, const char* key) {
+  return PrefsInterface::CreateSubKey(
+      {kPrefsVerifyCheckpoint, partition_name, key});
+}
 }  // namespace
 
 void FilesystemVerifierAction::PerformAction() {
@@ -98,6 +139,8 @@ void FilesystemVerifierAction::PerformAction() {
     return;
   }
   install_plan_.Dump();
+  LoadCheckpoints();
+  parallel_verity_pass_ = install_plan_.verify_threads > 1;
   StartPartitionHashing();
   abort_action_completer.set_should_complete(false);
 }
@@ -109,8 +152,11 @@ void FilesystemVerifierAction::TerminateProcessing() {
 
 void FilesystemVerifierAction::Cleanup(ErrorCode code) {
   partition_fd_.reset();
+  hash_pool_.reset();
+  hash_jobs_.clear();
   // This memory is not used anymore.
-  buffer_.clear();
+  brillo::Blob().swap(buffer_);
+  buffer_reservation_.Release();
 
   // If we didn't write verity, partitions were maped. Releaase resource now.
   if (!install_plan_.write_verity &&
@@ -138,6 +184,13 @@ void FilesystemVerifierAction::UpdatePartitionProgress(double progress) {
   // We don't consider sizes of each partition. Every partition
   // has the same length on progress bar.
   // TODO(b/186087589): Take sizes of each partition into account.
+  if (parallel_verity_pass_) {
+    // Only the verity part of the progress is reported for each partition,
+    // the hashing of all of them comes after.
+    UpdateProgress((progress + partition_index_ * kVerityProgressPercent) /
+                   install_plan_.partitions.size());
+    return;
+  }
   UpdateProgress((progress + partition_index_) /
                  install_plan_.partitions.size());
 }
@@ -182,7 +235,7 @@ bool FilesystemVerifierAction::InitializeFdVABC(bool should_write_verity) {
 }
 
 bool FilesystemVerifierAction::InitializeFd(const std::string& part_path) {
-  partition_fd_ = std::make_unique<EintrSafeFileDescriptor>();
+  partition_fd_ = std::make_unique<IoUringFileDescriptor>();
   const bool write_verity = ShouldWriteVerity();
   int flags = write_verity ? O_RDWR : O_RDONLY;
   if (!utils::SetBlockDeviceReadOnly(part_path, !write_verity)) {
@@ -212,6 +265,27 @@ void FilesystemVerifierAction::WriteVerityAndHashPartition(
       Cleanup(ErrorCode::kVerityCalculationError);
       return;
     }
+    // A checkpoint of this partition makes the next run skip its verity data,
+    // so it must be on disk before the first one is saved.
+    if (!fd->Flush()) {
+      PLOG(ERROR) << "Failed to flush verity data";
+      Cleanup(ErrorCode::kVerityCalculationError);
+      return;
+    }
+    RecordPartitionStep("verity");
+    const InstallPlan::Partition& partition =
+        install_plan_.partitions[partition_index_];
+    if (parallel_verity_pass_) {
+      // The partition is hashed later, together with all the other ones.
+      partition_fd_->Close();
+      partition_fd_.reset();
+      SaveCheckpoint(partition, 0, HashCalculator().GetContext());
+      UE_TRACE_ASYNC_END(("verify " + partition.name).c_str(),
+                         partition_index_);
+      partition_index_++;
+      StartPartitionHashing();
+      return;
+    }
     if (dynamic_control_->UpdateUsesSnapshotCompression()) {
       // Spin up snapuserd to read fs.
       if (!InitializeFdVABC(false)) {
@@ -220,6 +294,7 @@ void FilesystemVerifierAction::WriteVerityAndHashPartition(
         return;
       }
     }
+    SaveCheckpoint(partition, 0, hasher_->GetContext());
     HashPartition(0, partition_size_, buffer, buffer_size);
     return;
   }
@@ -238,6 +313,8 @@ void FilesystemVerifierAction::WriteVerityAndHashPartition(
     Cleanup(ErrorCode::kVerityCalculationError);
     return;
   }
+  PerformanceRecorder::Get()->AddPartitionIo(
+      install_plan_.partitions[partition_index_].name, read_size, 0);
   if (!verity_writer_->Update(
           start_offset, static_cast<const uint8_t*>(buffer), read_size)) {
     LOG(ERROR) << "VerityWriter::Update() failed";
@@ -262,41 +339,47 @@ void FilesystemVerifierAction::HashPartition(const off64_t start_offset,
                                              const size_t buffer_size) {
   auto fd = partition_fd_.get();
   TEST_AND_RETURN(fd != nullptr);
-  if (start_offset >= end_offset) {
+  uint64_t offset = start_offset;
+  uint64_t used_end = end_offset;
+  if (verifier_step_ == VerifierStep::kVerifyTargetHash) {
+    // The unused extents of a target partition aren't part of its hash.
+    used_end = install_plan_.partitions[partition_index_].UsedRangeEnd(
+        &offset, used_end);
+  }
+  if (offset >= used_end) {
     LOG_IF(WARNING, start_offset > end_offset)
         << "start_offset is greater than end_offset : " << start_offset << " > "
         << end_offset;
     FinishPartitionHashing();
     return;
   }
-  const auto cur_offset = fd->Seek(start_offset, SEEK_SET);
-  if (cur_offset != start_offset) {
-    PLOG(ERROR) << "Failed to seek to offset: " << start_offset;
-    Cleanup(ErrorCode::kFilesystemVerifierError);
-    return;
-  }
-  const auto read_size =
-      std::min<size_t>(buffer_size, end_offset - start_offset);
-  const auto bytes_read = fd->Read(buffer, read_size);
-  if (bytes_read < 0 || static_cast<size_t>(bytes_read) != read_size) {
-    PLOG(ERROR) << "Failed to read offset " << start_offset << " expected "
-                << read_size << " bytes, actual: " << bytes_read;
+  const auto read_size = std::min<size_t>(buffer_size, used_end - offset);
+  if (!ReadAt(fd, buffer, read_size, offset)) {
+    PLOG(ERROR) << "Failed to read " << read_size << " bytes at offset "
+                << offset;
     Cleanup(ErrorCode::kFilesystemVerifierError);
     return;
   }
+  PerformanceRecorder::Get()->AddPartitionIo(
+      install_plan_.partitions[partition_index_].name, read_size, 0);
   if (!hasher_->Update(buffer, read_size)) {
-    LOG(ERROR) << "Hasher updated failed on offset" << start_offset;
+    LOG(ERROR) << "Hasher updated failed on offset" << offset;
     Cleanup(ErrorCode::kFilesystemVerifierError);
     return;
   }
-  const auto progress = (start_offset + bytes_read) * 1.0f / partition_size_;
+  if (verifier_step_ == VerifierStep::kVerifyTargetHash && ShouldCheckpoint()) {
+    SaveCheckpoint(install_plan_.partitions[partition_index_],
+                   offset + read_size,
+                   hasher_->GetContext());
+  }
+  const auto progress = (offset + read_size) * 1.0f / partition_size_;
   UpdatePartitionProgress(progress * (1 - kVerityProgressPercent) +
                           kVerityProgressPercent);
   CHECK(pending_task_id_.PostTask(
       FROM_HERE,
       base::BindOnce(&FilesystemVerifierAction::HashPartition,
                      base::Unretained(this),
-                     start_offset + bytes_read,
+                     offset + read_size,
                      end_offset,
                      buffer,
                      buffer_size)));
@@ -304,6 +387,11 @@ void FilesystemVerifierAction::HashPartition(const off64_t start_offset,
 
 void FilesystemVerifierAction::StartPartitionHashing() {
   if (partition_index_ == install_plan_.partitions.size()) {
+    if (parallel_verity_pass_) {
+      parallel_verity_pass_ = false;
+      StartParallelHashing();
+      return;
+    }
     if (!install_plan_.untouched_dynamic_partitions.empty()) {
       LOG(INFO) << "Verifying extents of untouched dynamic partitions ["
                 << base::JoinString(install_plan_.untouched_dynamic_partitions,
@@ -326,6 +414,20 @@ void FilesystemVerifierAction::StartPartitionHashing() {
   const auto& part_path = GetPartitionPath();
   partition_size_ = GetPartitionSize();
 
+  if (verifier_step_ == VerifierStep::kVerifySourceHash &&
+      IsSourceHashVerified(prefs_, partition.name, partition.source_hash)) {
+    LOG(INFO) << "Source partition " << partition.name
+              << " already matched its hash since the last reboot.";
+    Cleanup(ErrorCode::kNewRootfsVerificationError);
+    return;
+  }
+
+  if (parallel_verity_pass_ && !ShouldWriteVerity()) {
+    partition_index_++;
+    StartPartitionHashing();
+    return;
+  }
+
   LOG(INFO) << "Hashing partition " << partition_index_ << " ("
             << partition.name << ") on device " << part_path;
   auto success = false;
@@ -352,8 +454,25 @@ void FilesystemVerifierAction::StartPartitionHashing() {
     Cleanup(ErrorCode::kFilesystemVerifierError);
     return;
   }
-  buffer_.resize(kReadFileBufferSize);
+  if (install_plan_.instrument_file_io) {
+    // Writing verity on a VABC partition goes to its COW.
+    const bool cow = IsVABC(partition) && ShouldWriteVerity();
+    partition_fd_ = std::make_unique<InstrumentedFileDescriptor>(
+        FileDescriptorPtr(std::move(partition_fd_)),
+        partition.name + (cow ? "/cow" : "/target"));
+  }
+  buffer_reservation_ = MemoryBudget::Get()->Reserve(
+      kReadRequestSize, kReadFileBufferSize, kReadRequestSize, "verify");
+  buffer_.resize(buffer_reservation_.size());
   hasher_ = std::make_unique<HashCalculator>();
+  uint64_t hash_offset = 0;
+  const HashCheckpoint* checkpoint = GetCheckpoint(partition);
+  if (checkpoint) {
+    LOG(INFO) << "Resuming the hash of " << partition.name << " at offset "
+              << checkpoint->offset << " of " << partition_size_;
+    CHECK(hasher_->SetContext(checkpoint->context));
+    hash_offset = checkpoint->offset;
+  }
 
   offset_ = 0;
   filesystem_data_end_ = partition_size_;
@@ -367,18 +486,24 @@ void FilesystemVerifierAction::StartPartitionHashing() {
   } else if (partition.fec_offset != 0) {
     filesystem_data_end_ = partition.fec_offset;
   }
+  step_start_time_ = base::TimeTicks::Now();
+  step_start_cpu_time_ = PerformanceRecorder::ProcessCpuTime();
+  UE_TRACE_ASYNC_BEGIN(("verify " + partition.name).c_str(), partition_index_);
   if (ShouldWriteVerity()) {
     LOG(INFO) << "Verity writes enabled on partition " << partition.name;
+    verity_writer_->SetHashThreads(install_plan_.verify_threads);
     if (!verity_writer_->Init(partition)) {
       LOG(INFO) << "Verity writes enabled on partition " << partition.name;
       Cleanup(ErrorCode::kVerityCalculationError);
       return;
     }
+    verity_writer_->SetFecThreads(install_plan_.verify_threads);
     WriteVerityAndHashPartition(
         0, filesystem_data_end_, buffer_.data(), buffer_.size());
   } else {
     LOG(INFO) << "Verity writes disabled on partition " << partition.name;
-    HashPartition(0, partition_size_, buffer_.data(), buffer_.size());
+    HashPartition(
+        hash_offset, partition_size_, buffer_.data(), buffer_.size());
   }
 }
 
@@ -417,14 +542,303 @@ size_t FilesystemVerifierAction::GetPartitionSize() const {
 }
 
 bool FilesystemVerifierAction::ShouldWriteVerity() {
-  const InstallPlan::Partition& partition =
-      install_plan_.partitions[partition_index_];
+  return ShouldWriteVerity(install_plan_.partitions[partition_index_]);
+}
+
+bool FilesystemVerifierAction::ShouldWriteVerity(
+    const InstallPlan::Partition& partition) const {
+  // A checkpoint is only saved once the verity data is written.
   return verifier_step_ == VerifierStep::kVerifyTargetHash &&
-         install_plan_.write_verity &&
-         (partition.hash_tree_size > 0 || partition.fec_size > 0);
+         install_plan_.write_verity && !partition.verity_written &&
+         (partition.hash_tree_size > 0 || partition.fec_size > 0) &&
+         !GetCheckpoint(partition);
+}
+
+void FilesystemVerifierAction::LoadCheckpoints() {
+  checkpoints_.clear();
+  if (!prefs_) {
+    return;
+  }
+  for (const auto& partition : install_plan_.partitions) {
+    int64_t offset = -1;
+    string context, target_hash;
+    if (!prefs_->GetInt64(CheckpointKey(partition.name, kCheckpointOffset),
+                          &offset) ||
+        !prefs_->GetString(CheckpointKey(partition.name, kCheckpointContext),
+                           &context) ||
+        !prefs_->GetString(
+            CheckpointKey(partition.name, kCheckpointTargetHash),
+            &target_hash)) {
+      continue;
+    }
+    // Checkpoints of another update, or of a partition that grew or shrank,
+    // are ignored.
+    if (offset < 0 || static_cast<uint64_t>(offset) > partition.target_size ||
+        target_hash != ToStringView(partition.target_hash) ||
+        !HashCalculator().SetContext(context)) {
+      LOG(WARNING) << "Ignoring the verification checkpoint of "
+                   << partition.name;
+      continue;
+    }
+    checkpoints_[partition.name] = {static_cast<uint64_t>(offset),
+                                    std::move(context)};
+  }
+}
+
+const FilesystemVerifierAction::HashCheckpoint*
+FilesystemVerifierAction::GetCheckpoint(
+    const InstallPlan::Partition& partition) const {
+  if (verifier_step_ != VerifierStep::kVerifyTargetHash) {
+    return nullptr;
+  }
+  const auto it = checkpoints_.find(partition.name);
+  return it == checkpoints_.end() ? nullptr : &it->second;
+}
+
+void FilesystemVerifierAction::SaveCheckpoint(
+    const InstallPlan::Partition& partition,
+    uint64_t offset,
+    const string& context) {
+  if (prefs_) {
+    SaveCheckpoint(prefs_, partition, offset, context);
+  }
+}
+
+void FilesystemVerifierAction::SaveCheckpoint(
+    PrefsInterface* prefs,
+    const InstallPlan::Partition& partition,
+    uint64_t offset,
+    const string& context) {
+  // The offset is written last, so that a checkpoint interrupted while being
+  // saved is never loaded.
+  const string offset_key = CheckpointKey(partition.name, kCheckpointOffset);
+  prefs->Delete(offset_key);
+  if (!prefs->SetString(CheckpointKey(partition.name, kCheckpointContext),
+                        context) ||
+      !prefs->SetString(
+          CheckpointKey(partition.name, kCheckpointTargetHash),
+          ToStringView(partition.target_hash)) ||
+      !prefs->SetInt64(offset_key, offset)) {
+    LOG(WARNING) << "Unable to save the verification checkpoint of "
+                 << partition.name;
+  }
+}
+
+void FilesystemVerifierAction::ResetCheckpoints() {
+  checkpoints_.clear();
+  if (!prefs_) {
+    return;
+  }
+  std::vector<string> keys;
+  prefs_->GetSubKeys(kPrefsVerifyCheckpoint, &keys);
+  for (const auto& key : keys) {
+    prefs_->Delete(key);
+  }
+}
+
+bool FilesystemVerifierAction::ShouldCheckpoint() {
+  const base::TimeTicks now = base::TimeTicks::Now();
+  if (now < next_checkpoint_time_) {
+    return false;
+  }
+  next_checkpoint_time_ =
+      now + base::TimeDelta::FromSeconds(kCheckpointFrequencySeconds);
+  return true;
+}
+
+void FilesystemVerifierAction::StartParallelHashing() {
+  bool uses_vabc = false;
+  for (const auto& partition : install_plan_.partitions) {
+    uses_vabc = uses_vabc || IsVABC(partition);
+  }
+  if (uses_vabc) {
+    // Same as InitializeFdVABC(false), but once for all the partitions, so
+    // that snapuserd sees the verity data written so far.
+    dynamic_control_->UnmapAllPartitions();
+    dynamic_control_->MapAllPartitions();
+  }
+
+  parallel_hashed_bytes_ = 0;
+  parallel_total_bytes_ = 0;
+  for (size_t i = 0; i < install_plan_.partitions.size(); i++) {
+    const InstallPlan::Partition& partition = install_plan_.partitions[i];
+    const string& part_path = IsVABC(partition)
+                                  ? partition.readonly_target_path
+                                  : partition.target_path;
+    if (part_path.empty()) {
+      if (partition.target_size == 0) {
+        LOG(INFO) << "Skip hashing partition " << i << " (" << partition.name
+                  << ") because size is 0.";
+        continue;
+      }
+      LOG(ERROR) << "Cannot hash partition " << i << " (" << partition.name
+                 << ") because its device path cannot be determined.";
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
+    const bool write_verity = ShouldWriteVerity(partition);
+    if (!IsVABC(partition) &&
+        !utils::SetBlockDeviceReadOnly(part_path, !write_verity)) {
+      LOG(WARNING) << "Failed to set block device " << part_path << " as "
+                   << (write_verity ? "writable" : "readonly");
+    }
+    auto job = std::make_unique<ParallelHashJob>();
+    job->partition_index = i;
+    job->size = partition.target_size;
+    job->fd = std::make_unique<IoUringFileDescriptor>();
+    if (!job->fd->Open(part_path.c_str(), O_RDONLY)) {
+      LOG(ERROR) << "Unable to open " << part_path << " for reading.";
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
+    // Smaller buffers only mean more reads when the budget is short.
+    job->buffer_reservation = MemoryBudget::Get()->Reserve(
+        kReadRequestSize, kReadFileBufferSize, kReadRequestSize, "verify");
+    job->buffer.resize(job->buffer_reservation.size());
+    const HashCheckpoint* checkpoint = GetCheckpoint(partition);
+    if (checkpoint) {
+      LOG(INFO) << "Resuming the hash of " << partition.name << " at offset "
+                << checkpoint->offset << " of " << job->size;
+      CHECK(job->hasher.SetContext(checkpoint->context));
+      job->offset = checkpoint->offset;
+    }
+    parallel_total_bytes_ += job->size - job->offset;
+    hash_jobs_.push_back(std::move(job));
+  }
+
+  LOG(INFO) << "Hashing " << hash_jobs_.size() << " partitions with "
+            << install_plan_.verify_threads << " threads";
+  hash_pool_ = std::make_unique<WorkerPool>(install_plan_.verify_threads,
+                                            hash_jobs_.size());
+  HashPartitionsInParallel();
+}
+
+void FilesystemVerifierAction::HashPartitionsInParallel() {
+  const base::TimeTicks step_start = base::TimeTicks::Now();
+  uint64_t step_bytes = 0;
+  for (auto& job : hash_jobs_) {
+    if (job->offset >= job->size) {
+      continue;
+    }
+    const uint64_t step_end =
+        std::min(job->size, job->offset + kParallelHashStepSize);
+    step_bytes += step_end - job->offset;
+    const InstallPlan::Partition& partition =
+        install_plan_.partitions[job->partition_index];
+    CHECK(hash_pool_->Post([job = job.get(), step_end, &partition]() {
+      while (true) {
+        const uint64_t used_end =
+            partition.UsedRangeEnd(&job->offset, step_end);
+        if (job->offset >= step_end)
+          break;
+        const auto read_size =
+            std::min<size_t>(job->buffer.size(), used_end - job->offset);
+        if (!ReadAt(job->fd.get(),
+                    job->buffer.data(),
+                    read_size,
+                    job->offset)) {
+          PLOG(ERROR) << "Failed to read " << read_size
+                      << " bytes at offset " << job->offset;
+          return false;
+        }
+        TEST_AND_RETURN_FALSE(
+            job->hasher.Update(job->buffer.data(), read_size));
+        job->offset += read_size;
+        PerformanceRecorder::Get()->AddPartitionIo(
+            partition.name, read_size, 0);
+      }
+      return true;
+    }));
+  }
+  if (!hash_pool_->Wait()) {
+    Cleanup(ErrorCode::kFilesystemVerifierError);
+    return;
+  }
+  if (step_bytes == 0) {
+    FinishParallelHashing();
+    return;
+  }
+  if (ShouldCheckpoint()) {
+    for (const auto& job : hash_jobs_) {
+      SaveCheckpoint(install_plan_.partitions[job->partition_index],
+                     job->offset,
+                     job->hasher.GetContext());
+    }
+  }
+
+  parallel_hashed_bytes_ += step_bytes;
+  UpdateProgress(kVerityProgressPercent +
+                 (1 - kVerityProgressPercent) * parallel_hashed_bytes_ /
+                     parallel_total_bytes_);
+
+  // Throttle the next step so that the reads of all the workers together stay
+  // under |install_plan_.verify_read_bandwidth|.
+  base::TimeDelta delay;
+  if (install_plan_.verify_read_bandwidth > 0) {
+    const auto min_step_duration = base::TimeDelta::FromMicroseconds(
+        step_bytes * base::Time::kMicrosecondsPerSecond /
+        install_plan_.verify_read_bandwidth);
+    delay = std::max(base::TimeDelta(),
+                     min_step_duration - (base::TimeTicks::Now() - step_start));
+  }
+  CHECK(pending_task_id_.PostTask(
+      FROM_HERE,
+      base::BindOnce(&FilesystemVerifierAction::HashPartitionsInParallel,
+                     base::Unretained(this)),
+      delay));
+}
+
+void FilesystemVerifierAction::FinishParallelHashing() {
+  hash_pool_.reset();
+  auto hash_jobs = std::move(hash_jobs_);
+  for (auto& job : hash_jobs) {
+    job->fd->Close();
+    const string context = job->hasher.GetContext();
+    if (!job->hasher.Finalize()) {
+      LOG(ERROR) << "Unable to finalize the hash.";
+      Cleanup(ErrorCode::kError);
+      return;
+    }
+    const InstallPlan::Partition& partition =
+        install_plan_.partitions[job->partition_index];
+    LOG(INFO) << "Hash of " << partition.name << ": "
+              << HexEncode(job->hasher.raw_hash());
+    if (partition.target_hash != job->hasher.raw_hash()) {
+      LOG(ERROR) << "New '" << partition.name
+                 << "' partition verification failed.";
+      ResetCheckpoints();
+      if (partition.source_hash.empty()) {
+        // No need to verify source if it is a full payload.
+        Cleanup(ErrorCode::kNewRootfsVerificationError);
+        return;
+      }
+      // Check whether the source partition is the root cause of the mismatch,
+      // see FinishPartitionHashing().
+      partition_index_ = job->partition_index;
+      verifier_step_ = VerifierStep::kVerifySourceHash;
+      StartPartitionHashing();
+      return;
+    }
+    // A later run only needs to finalize the hash of this partition again.
+    SaveCheckpoint(partition, job->size, context);
+  }
+  partition_index_ = install_plan_.partitions.size();
+  StartPartitionHashing();
+}
+
+void FilesystemVerifierAction::RecordPartitionStep(const string& phase) {
+  const base::TimeTicks now = base::TimeTicks::Now();
+  const base::TimeDelta cpu_time = PerformanceRecorder::ProcessCpuTime();
+  PerformanceRecorder::Get()->AddPhase(
+      phase + "/" + install_plan_.partitions[partition_index_].name,
+      now - step_start_time_,
+      cpu_time - step_start_cpu_time_);
+  step_start_time_ = now;
+  step_start_cpu_time_ = cpu_time;
 }
 
 void FilesystemVerifierAction::FinishPartitionHashing() {
+  const string context = hasher_->GetContext();
   if (!hasher_->Finalize()) {
     LOG(ERROR) << "Unable to finalize the hash.";
     Cleanup(ErrorCode::kError);
@@ -434,12 +848,15 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
       install_plan_.partitions[partition_index_];
   LOG(INFO) << "Hash of " << partition.name << ": "
             << HexEncode(hasher_->raw_hash());
+  RecordPartitionStep("verify");
+  UE_TRACE_ASYNC_END(("verify " + partition.name).c_str(), partition_index_);
 
   switch (verifier_step_) {
     case VerifierStep::kVerifyTargetHash:
       if (partition.target_hash != hasher_->raw_hash()) {
         LOG(ERROR) << "New '" << partition.name
                    << "' partition verification failed.";
+        ResetCheckpoints();
         if (partition.source_hash.empty()) {
           // No need to verify source if it is a full payload.
           Cleanup(ErrorCode::kNewRootfsVerificationError);
@@ -451,6 +868,8 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
         // source partition does not match either.
         verifier_step_ = VerifierStep::kVerifySourceHash;
       } else {
+        // A later run only needs to finalize the hash of this partition again.
+        SaveCheckpoint(partition, partition_size_, context);
         partition_index_++;
       }
       break;
@@ -482,6 +901,7 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
         Cleanup(ErrorCode::kDownloadStateInitializationError);
         return;
       }
+      SaveVerifiedSourceHash(prefs_, partition.name, partition.source_hash);
       // The action will skip kVerifySourceHash step if target partition hash
       // matches, if we are in this step, it means target hash does not match,
       // and now that the source partition hash matches, we should set the
@@ -20,16 +20,21 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <map>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/memory_budget.h"
+#include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/scoped_task_id.h"
+#include "update_engine/common/worker_pool.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/verity_writer_interface.h"
@@ -60,10 +65,15 @@ class FilesystemVerifyDelegate {
 
 class FilesystemVerifierAction : public InstallPlanAction {
  public:
+  // When |prefs| is not null, the progress of the target partition hashes is
+  // checkpointed in it, and an interrupted verification of the same update
+  // resumes from the last checkpoint.
   explicit FilesystemVerifierAction(
-      DynamicPartitionControlInterface* dynamic_control)
+      DynamicPartitionControlInterface* dynamic_control,
+      PrefsInterface* prefs = nullptr)
       : verity_writer_(verity_writer::CreateVerityWriter()),
-        dynamic_control_(dynamic_control) {
+        dynamic_control_(dynamic_control),
+        prefs_(prefs) {
     CHECK(dynamic_control_);
   }
 
@@ -80,6 +90,15 @@ class FilesystemVerifierAction : public InstallPlanAction {
     return this->delegate_;
   }
 
+  // Saves in |prefs| that the first |offset| bytes of the target |partition|
+  // are hashed into a hasher with |context|, so that the verification of the
+  // same update resumes from there. The verity data of the partition, if any,
+  // must already be written and flushed.
+  static void SaveCheckpoint(PrefsInterface* prefs,
+                             const InstallPlan::Partition& partition,
+                             uint64_t offset,
+                             const std::string& context);
+
   // Debugging/logging
   static std::string StaticType() { return "FilesystemVerifierAction"; }
   std::string Type() const override { return StaticType(); }
@@ -97,6 +116,7 @@ class FilesystemVerifierAction : public InstallPlanAction {
 
   // Return true if we need to write verity bytes.
   bool ShouldWriteVerity();
+  bool ShouldWriteVerity(const InstallPlan::Partition& partition) const;
   // Starts the hashing of the current partition. If there aren't any partitions
   // remaining to be hashed, it finishes the action.
   void StartPartitionHashing();
@@ -111,6 +131,25 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // and continue checking the next one.
   void FinishPartitionHashing();
 
+  // Records the time since |step_start_time_| as the |phase| of the current
+  // partition, and starts the next step.
+  void RecordPartitionStep(const std::string& phase);
+
+  // Opens all the target partitions and hashes them concurrently on
+  // |hash_pool_|. Used instead of hashing the partitions one by one when
+  // |install_plan_.verify_threads| is greater than one, once the verity data of
+  // every partition is written.
+  void StartParallelHashing();
+
+  // Hashes the next chunk of every partition in |hash_jobs_| and waits for
+  // them, then schedules itself again until all the partitions are hashed.
+  void HashPartitionsInParallel();
+
+  // Verifies the hashes computed by HashPartitionsInParallel(). On a mismatch,
+  // continues with the source hash check of that partition as the serial path
+  // does.
+  void FinishParallelHashing();
+
   // Cleans up all the variables we use for async operations and tells the
   // ActionProcessor we're done w/ |code| as passed in. |cancelled_| should be
   // true if TerminateProcessing() was called.
@@ -127,18 +166,77 @@ class FilesystemVerifierAction : public InstallPlanAction {
   bool InitializeFd(const std::string& part_path);
   bool InitializeFdVABC(bool should_write_verity);
 
+  // The target hash progress of a partition saved by a previous run.
+  struct HashCheckpoint {
+    // The number of bytes of the partition hashed into |context|. The verity
+    // data of the partition, if any, was already written and flushed.
+    uint64_t offset{0};
+    std::string context;
+  };
+
+  // Loads into |checkpoints_| the checkpoints in |prefs_| that match the
+  // partitions of the install plan.
+  void LoadCheckpoints();
+
+  // Returns the checkpoint loaded for |partition|, or nullptr if its target
+  // hash starts from scratch.
+  const HashCheckpoint* GetCheckpoint(
+      const InstallPlan::Partition& partition) const;
+
+  // Saves that the first |offset| bytes of |partition| are hashed into a
+  // hasher with |context|. Does nothing without |prefs_|.
+  void SaveCheckpoint(const InstallPlan::Partition& partition,
+                      uint64_t offset,
+                      const std::string& context);
+
+  // Deletes all the checkpoints, when the target hash of a partition doesn't
+  // match.
+  void ResetCheckpoints();
+
+  // Returns true when it's time to save the next checkpoint.
+  bool ShouldCheckpoint();
+
+  // The state of one partition hashed by HashPartitionsInParallel(). Only
+  // accessed by one worker at a time.
+  struct ParallelHashJob {
+    size_t partition_index{0};
+    uint64_t size{0};
+    uint64_t offset{0};
+    std::unique_ptr<FileDescriptor> fd;
+    HashCalculator hasher;
+    MemoryBudget::Reservation buffer_reservation;
+    brillo::Blob buffer;
+  };
+
   // The type of the partition that we are verifying.
   VerifierStep verifier_step_ = VerifierStep::kVerifyTargetHash;
 
+  // True while going through the partitions only to write their verity data,
+  // before StartParallelHashing() hashes all of them at once.
+  bool parallel_verity_pass_{false};
+
+  // The partitions being hashed by HashPartitionsInParallel(), and the workers
+  // hashing them.
+  std::vector<std::unique_ptr<ParallelHashJob>> hash_jobs_;
+  std::unique_ptr<WorkerPool> hash_pool_;
+  uint64_t parallel_hashed_bytes_{0};
+  uint64_t parallel_total_bytes_{0};
+
   // The index in the install_plan_.partitions vector of the partition currently
   // being hashed.
   size_t partition_index_{0};
 
+  // When the current step of that partition started, for its "verity/" and
+  // "verify/" performance phases.
+  base::TimeTicks step_start_time_;
+  base::TimeDelta step_start_cpu_time_;
+
   // If not null, the FileDescriptor used to read from the device.
   // verity writer might attempt to write to this fd, if verity is enabled.
   std::unique_ptr<FileDescriptor> partition_fd_;
 
-  // Buffer for storing data we read.
+  // Buffer for storing data we read, and its share of the memory budget.
+  MemoryBudget::Reservation buffer_reservation_;
   brillo::Blob buffer_;
 
   bool cancelled_{false};  // true if the action has been cancelled.
@@ -152,6 +250,15 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // Verifies the untouched dynamic partitions for partial updates.
   DynamicPartitionControlInterface* dynamic_control_{nullptr};
 
+  // If not null, where the hash checkpoints are saved.
+  PrefsInterface* prefs_{nullptr};
+
+  // The checkpoints loaded when the action started, by partition name.
+  std::map<std::string, HashCheckpoint> checkpoints_;
+
+  // The next time a checkpoint may be saved.
+  base::TimeTicks next_checkpoint_time_;
+
   // Reads and hashes this many bytes from the head of the input stream. When
   // the partition starts to be hashed, this field is initialized from the
   // corresponding InstallPlan::Partition size which is the total size
@@ -32,7 +32,9 @@
 #include <libsnapshot/snapshot_writer.h>
 #include <sys/stat.h>
 
+#include "update_engine/common/constants.h"
 #include "update_engine/common/dynamic_partition_control_stub.h"
+#include "update_engine/common/fake_prefs.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/mock_dynamic_partition_control.h"
 #include "update_engine/common/test_utils.h"
@@ -190,9 +192,37 @@ class FilesystemVerifierActionTest : public ::testing::Test {
     ZeroRange(fd, fec_start_offset / BLOCK_SIZE, fec_size / BLOCK_SIZE);
   }
 
+  // Saves a checkpoint of the target hash of |partition| in |fake_prefs_|,
+  // with the hash of its first |offset| bytes of |data|.
+  void SaveCheckpoint(const InstallPlan::Partition& partition,
+                      const brillo::Blob& data,
+                      uint64_t offset) {
+    HashCalculator hasher;
+    ASSERT_TRUE(hasher.Update(data.data(), offset));
+    ASSERT_TRUE(fake_prefs_.SetInt64(
+        CheckpointKey(partition.name, "offset"), offset));
+    ASSERT_TRUE(fake_prefs_.SetString(
+        CheckpointKey(partition.name, "sha-256-context"), hasher.GetContext()));
+    ASSERT_TRUE(
+        fake_prefs_.SetString(CheckpointKey(partition.name, "target-hash"),
+                              ToStringView(partition.target_hash)));
+  }
+
+  static string CheckpointKey(const string& partition_name, const string& key) {
+    return PrefsInterface::CreateSubKey(
+        {kPrefsVerifyCheckpoint, partition_name, key});
+  }
+
+  // Runs the actions built for |install_plan_| and returns the error code of
+  // the verifier.
+  ErrorCode RunActions();
+
   brillo::FakeMessageLoop loop_{nullptr};
   ActionProcessor processor_;
   DynamicPartitionControlStub dynamic_control_stub_;
+  FakePrefs fake_prefs_;
+  // The prefs given to the verifier, if any.
+  PrefsInterface* prefs_{nullptr};
   std::vector<unsigned char> fec_data_;
   std::vector<unsigned char> hash_tree_data_;
   static ScopedTempFile source_part_;
@@ -348,7 +378,7 @@ void FilesystemVerifierActionTest::BuildActions(
     DynamicPartitionControlInterface* dynamic_control) {
   auto feeder_action = std::make_unique<ObjectFeederAction<InstallPlan>>();
   auto verifier_action =
-      std::make_unique<FilesystemVerifierAction>(dynamic_control);
+      std::make_unique<FilesystemVerifierAction>(dynamic_control, prefs_);
   auto collector_action =
       std::make_unique<ObjectCollectorAction<InstallPlan>>();
 
@@ -367,6 +397,19 @@ void FilesystemVerifierActionTest::BuildActions(
   BuildActions(install_plan, &dynamic_control_stub_);
 }
 
+ErrorCode FilesystemVerifierActionTest::RunActions() {
+  BuildActions(install_plan_);
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(FROM_HERE,
+                 base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+  EXPECT_FALSE(processor_.IsRunning());
+  EXPECT_TRUE(delegate.ran());
+  return delegate.code();
+}
+
 class FilesystemVerifierActionTest2Delegate : public ActionProcessorDelegate {
  public:
   void ActionCompleted(ActionProcessor* processor,
@@ -686,4 +729,123 @@ TEST_F(FilesystemVerifierActionTest, VABC_Verity_Target_Mismatch) {
   DoTestVABC(true, true);
 }
 
+TEST_F(FilesystemVerifierActionTest, VABC_Verity_Parallel_Success) {
+  install_plan_.verify_threads = 2;
+  DoTestVABC(false, true);
+}
+
+TEST_F(FilesystemVerifierActionTest, ParallelHashTest) {
+  install_plan_.verify_threads = 2;
+  AddFakePartition(&install_plan_, "part_a");
+  AddFakePartition(&install_plan_, "part_b");
+  AddFakePartition(&install_plan_, "part_c");
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(FROM_HERE,
+                 base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, ParallelHashTargetMismatchTest) {
+  install_plan_.verify_threads = 2;
+  AddFakePartition(&install_plan_, "part_a");
+  AddFakePartition(&install_plan_, "part_b")->target_hash.clear();
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(FROM_HERE,
+                 base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  // The source partition matches, so the target one is reported as broken.
+  ASSERT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, SavesCheckpointTest) {
+  prefs_ = &fake_prefs_;
+  AddFakePartition(&install_plan_);
+  ASSERT_EQ(ErrorCode::kSuccess, RunActions());
+
+  // The checkpoint of a verified partition covers all of it.
+  int64_t offset = 0;
+  ASSERT_TRUE(
+      fake_prefs_.GetInt64(CheckpointKey("fake_part", "offset"), &offset));
+  EXPECT_EQ(static_cast<int64_t>(PARTITION_SIZE), offset);
+}
+
+TEST_F(FilesystemVerifierActionTest, RunAsRootResumeSkipsVerityTest) {
+  prefs_ = &fake_prefs_;
+  install_plan_.write_verity = true;
+  auto partition = AddFakePartition(&install_plan_);
+  SetHashWithVerity(partition);
+  brillo::Blob data;
+  ASSERT_TRUE(utils::ReadFile(target_part_.path(), &data));
+
+  // The checkpoint says the verity data is written, so the one zeroed by
+  // SetHashWithVerity() stays zeroed and the hash doesn't match.
+  SaveCheckpoint(*partition, data, HASH_TREE_START_OFFSET);
+  ASSERT_EQ(ErrorCode::kNewRootfsVerificationError, RunActions());
+  // A failed verification starts from scratch next time, verity included.
+  EXPECT_FALSE(fake_prefs_.Exists(CheckpointKey("fake_part", "offset")));
+  ASSERT_EQ(ErrorCode::kSuccess, RunActions());
+}
+
+TEST_F(FilesystemVerifierActionTest, ResumeWithWrongContextTest) {
+  prefs_ = &fake_prefs_;
+  auto partition = AddFakePartition(&install_plan_);
+  brillo::Blob data;
+  ASSERT_TRUE(utils::ReadFile(target_part_.path(), &data));
+  SaveCheckpoint(*partition, data, PARTITION_SIZE / 2);
+  ASSERT_EQ(ErrorCode::kSuccess, RunActions());
+
+  // The hash only matches if the checkpoint is used.
+  brillo::Blob zeros(PARTITION_SIZE);
+  SaveCheckpoint(*partition, zeros, PARTITION_SIZE / 2);
+  ASSERT_EQ(ErrorCode::kNewRootfsVerificationError, RunActions());
+}
+
+TEST_F(FilesystemVerifierActionTest, IgnoresCheckpointOfOtherUpdateTest) {
+  prefs_ = &fake_prefs_;
+  auto partition = AddFakePartition(&install_plan_);
+  brillo::Blob zeros(PARTITION_SIZE);
+  SaveCheckpoint(*partition, zeros, PARTITION_SIZE / 2);
+  ASSERT_TRUE(fake_prefs_.SetString(CheckpointKey("fake_part", "target-hash"),
+                                    "other update"));
+  ASSERT_EQ(ErrorCode::kSuccess, RunActions());
+}
+
+TEST_F(FilesystemVerifierActionTest, ParallelResumeFromCheckpointTest) {
+  prefs_ = &fake_prefs_;
+  install_plan_.verify_threads = 2;
+  AddFakePartition(&install_plan_, "part_a");
+  AddFakePartition(&install_plan_, "part_b");
+  const auto part_a = &install_plan_.partitions[0];
+  const auto part_b = &install_plan_.partitions[1];
+  brillo::Blob data;
+  ASSERT_TRUE(utils::ReadFile(target_part_.path(), &data));
+  SaveCheckpoint(*part_a, data, PARTITION_SIZE);
+  brillo::Blob zeros(PARTITION_SIZE);
+  SaveCheckpoint(*part_b, zeros, BLOCK_SIZE);
+  ASSERT_EQ(ErrorCode::kNewRootfsVerificationError, RunActions());
+
+  SaveCheckpoint(*part_a, zeros, PARTITION_SIZE);
+  SaveCheckpoint(*part_b, data, BLOCK_SIZE);
+  ASSERT_EQ(ErrorCode::kNewRootfsVerificationError, RunActions());
+
+  SaveCheckpoint(*part_a, data, PARTITION_SIZE / 2);
+  SaveCheckpoint(*part_b, data, BLOCK_SIZE);
+  ASSERT_EQ(ErrorCode::kSuccess, RunActions());
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,231 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/gathering_file_descriptor.h"
+
+#include <errno.h>
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+GatheringFileDescriptor::GatheringFileDescriptor(FileDescriptorPtr fd,
+                                                 size_t cache_size,
+                                                 bool write_behind)
+    : fd_(std::move(fd)),
+      cache_reservation_(
+          MemoryBudget::Get()->Reserve(std::min(cache_size, kMinWriteCacheSize),
+                                       cache_size,
+                                       1,
+                                       "write_cache")),
+      cache_size_(cache_reservation_.size()),
+      write_behind_(write_behind) {}
+
+GatheringFileDescriptor::~GatheringFileDescriptor() {
+  WaitForWriteBehind();
+}
+
+bool GatheringFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  offset_ = 0;
+  return fd_->Open(path, flags, mode);
+}
+
+bool GatheringFileDescriptor::Open(const char* path, int flags) {
+  offset_ = 0;
+  return fd_->Open(path, flags);
+}
+
+ssize_t GatheringFileDescriptor::Read(void* buf, size_t count) {
+  if (!FlushPending() || fd_->Seek(offset_, SEEK_SET) != offset_) {
+    return -1;
+  }
+  const ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read > 0) {
+    offset_ += bytes_read;
+  }
+  return bytes_read;
+}
+
+ssize_t GatheringFileDescriptor::Write(const void* buf, size_t count) {
+  if (count == 0) {
+    return 0;
+  }
+  if (OverlapsPending(offset_, count) && !FlushPending()) {
+    return -1;
+  }
+  auto bytes = static_cast<const uint8_t*>(buf);
+  if (count >= cache_size_) {
+    // Too large to be worth copying, and not ordered with the pending writes
+    // since they don't overlap. It may overlap the batch written behind.
+    if (!WaitForWriteBehind() ||
+        !fd_->WriteBatch({{static_cast<uint64_t>(offset_), buf, count}})) {
+      return -1;
+    }
+  } else {
+    // Appended to the pending write which ends at |offset_|, if any.
+    auto it = pending_.lower_bound(offset_);
+    if (it != pending_.begin() &&
+        std::prev(it)->first + std::prev(it)->second.size() ==
+            static_cast<uint64_t>(offset_)) {
+      brillo::Blob& data = std::prev(it)->second;
+      data.insert(data.end(), bytes, bytes + count);
+    } else {
+      pending_.emplace_hint(it, offset_, brillo::Blob(bytes, bytes + count));
+    }
+    pending_bytes_ += count;
+    if (pending_bytes_ >= cache_size_ && !FlushPending(true)) {
+      return -1;
+    }
+  }
+  offset_ += count;
+  return count;
+}
+
+off64_t GatheringFileDescriptor::Seek(off64_t offset, int whence) {
+  // The offset only matters to the next Read() or Write(), so nothing is
+  // flushed here.
+  CHECK(whence == SEEK_SET || whence == SEEK_CUR);
+  const off64_t next_offset = whence == SEEK_SET ? offset : offset_ + offset;
+  if (next_offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  offset_ = next_offset;
+  return offset_;
+}
+
+bool GatheringFileDescriptor::ReadBatch(
+    const std::vector<ReadRequest>& requests) {
+  return FlushPending() && fd_->ReadBatch(requests);
+}
+
+bool GatheringFileDescriptor::WriteBatch(
+    const std::vector<WriteRequest>& requests) {
+  return FlushPending() && fd_->WriteBatch(requests);
+}
+
+bool GatheringFileDescriptor::CopyFrom(FileDescriptor* source,
+                                       uint64_t src_offset,
+                                       uint64_t dst_offset,
+                                       size_t count) {
+  return FlushPending() &&
+         fd_->CopyFrom(source, src_offset, dst_offset, count);
+}
+
+bool GatheringFileDescriptor::CopyTo(EintrSafeFileDescriptor* target,
+                                     uint64_t src_offset,
+                                     uint64_t dst_offset,
+                                     size_t count) {
+  return FlushPending() && fd_->CopyTo(target, src_offset, dst_offset, count);
+}
+
+bool GatheringFileDescriptor::BlkIoctl(int request,
+                                       uint64_t start,
+                                       uint64_t length,
+                                       int* result) {
+  return FlushPending() && fd_->BlkIoctl(request, start, length, result);
+}
+
+bool GatheringFileDescriptor::Flush() {
+  return FlushPending() && fd_->Flush();
+}
+
+bool GatheringFileDescriptor::Close() {
+  const bool success = FlushPending() && fd_->Close();
+  pending_.clear();
+  pending_bytes_ = 0;
+  offset_ = 0;
+  write_behind_failed_ = false;
+  return success;
+}
+
+bool GatheringFileDescriptor::FlushPending(bool in_background) {
+  // The pending writes may overwrite the batch written behind.
+  if (!WaitForWriteBehind()) {
+    return false;
+  }
+  if (pending_.empty()) {
+    return true;
+  }
+  num_flushes_++;
+  if (in_background && write_behind_ &&
+      MemoryBudget::Get()->TryReserve(
+          pending_bytes_, &writing_reservation_, "write_cache")) {
+    writing_.swap(pending_);
+    const size_t count = pending_bytes_;
+    pending_bytes_ = 0;
+    written_ = std::async(std::launch::async, [this, count] {
+      return WritePieces(writing_, count);
+    });
+    return true;
+  }
+  if (!WritePieces(pending_, pending_bytes_)) {
+    return false;
+  }
+  pending_.clear();
+  pending_bytes_ = 0;
+  return true;
+}
+
+bool GatheringFileDescriptor::WaitForWriteBehind() {
+  if (written_.valid()) {
+    if (!written_.get())
+      write_behind_failed_ = true;
+    writing_.clear();
+    writing_reservation_.Release();
+  }
+  // The writes of the failed batch are lost.
+  if (write_behind_failed_) {
+    errno = EIO;
+    return false;
+  }
+  return true;
+}
+
+bool GatheringFileDescriptor::WritePieces(
+    const std::map<uint64_t, brillo::Blob>& writes, size_t count) {
+  std::vector<WriteRequest> requests;
+  requests.reserve(writes.size());
+  for (const auto& [offset, data] : writes) {
+    requests.push_back({offset, data.data(), data.size()});
+  }
+  if (!fd_->WriteBatch(requests)) {
+    PLOG(ERROR) << "Failed to write " << count << " bytes in "
+                << writes.size() << " pieces";
+    return false;
+  }
+  return true;
+}
+
+bool GatheringFileDescriptor::OverlapsPending(uint64_t offset,
+                                              size_t count) const {
+  // The first pending write ending after |offset| is either the last one
+  // starting before it, or the first one starting at or after it.
+  auto it = pending_.lower_bound(offset);
+  if (it != pending_.begin() &&
+      std::prev(it)->first + std::prev(it)->second.size() > offset) {
+    return true;
+  }
+  return it != pending_.end() && it->first < offset + count;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,129 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_GATHERING_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_GATHERING_FILE_DESCRIPTOR_H_
+
+#include <sys/types.h>
+
+#include <future>
+#include <map>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/memory_budget.h"
+#include "update_engine/payload_consumer/cached_file_descriptor.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// Keeps the writes to |fd| in memory, wherever they are in the file, and
+// writes them sorted by offset with a single WriteBatch() once they take
+// |cache_size| bytes, or when flushed. The writes contiguous in the file are
+// merged, so the small scattered extents of many operations become a few
+// large writes.
+//
+// The writes still pending are written before any read, CopyFrom(),
+// CopyTo(), BlkIoctl(), Flush() or Close(), and before a write which overlaps
+// one of them, so they are never seen out of order through this instance. A
+// checkpoint must Flush() it before recording the writes as done.
+//
+// With |write_behind|, the pending writes which filled the cache are written
+// by a background thread while the next ones are gathered, so the caller
+// decompressing or patching the data doesn't wait for the device. Only one
+// batch is written at a time, and everything else waits for it. A failure is
+// reported by the next operation waiting for it, and all that follow.
+class GatheringFileDescriptor : public FileDescriptor {
+ public:
+  // The pending writes take up to |cache_size| bytes, less if they aren't
+  // available in MemoryBudget::Get(). The batch written behind takes as many
+  // more, or is written synchronously if they aren't available.
+  GatheringFileDescriptor(FileDescriptorPtr fd,
+                          size_t cache_size,
+                          bool write_behind = false);
+  ~GatheringFileDescriptor() override;
+
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override;
+  bool WriteBatch(const std::vector<WriteRequest>& requests) override;
+  bool CopyFrom(FileDescriptor* source,
+                uint64_t src_offset,
+                uint64_t dst_offset,
+                size_t count) override;
+  bool CopyTo(EintrSafeFileDescriptor* target,
+              uint64_t src_offset,
+              uint64_t dst_offset,
+              size_t count) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool Flush() override;
+  bool Close() override;
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+  // The number of WriteBatch() calls made to |fd| so far.
+  size_t num_flushes() const { return num_flushes_; }
+
+ private:
+  // Writes the pending writes to |fd_|, once the batch written behind is
+  // written. With |in_background| and |write_behind_|, they become that batch
+  // instead, unless the memory budget is short.
+  bool FlushPending(bool in_background = false);
+
+  // Waits for the batch written behind, if any. Returns false if writing it,
+  // or any before, failed.
+  bool WaitForWriteBehind();
+
+  // Writes the |count| bytes of |writes| to |fd_| with a single WriteBatch().
+  bool WritePieces(const std::map<uint64_t, brillo::Blob>& writes,
+                   size_t count);
+
+  // Whether a pending write overlaps [offset, offset + count).
+  bool OverlapsPending(uint64_t offset, size_t count) const;
+
+  FileDescriptorPtr fd_;
+  MemoryBudget::Reservation cache_reservation_;
+  const size_t cache_size_;
+
+  // The pending writes by offset, none of them overlapping.
+  std::map<uint64_t, brillo::Blob> pending_;
+  size_t pending_bytes_{0};
+  off64_t offset_{0};
+  size_t num_flushes_{0};
+
+  const bool write_behind_;
+  bool write_behind_failed_{false};
+  // The batch written behind, and the memory budget it takes.
+  std::map<uint64_t, brillo::Blob> writing_;
+  MemoryBudget::Reservation writing_reservation_;
+  // Whether |writing_| was written, valid until WaitForWriteBehind(). Declared
+  // after |writing_|, so it's waited for before |writing_| is destroyed.
+  std::future<bool> written_;
+
+  DISALLOW_COPY_AND_ASSIGN(GatheringFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_GATHERING_FILE_DESCRIPTOR_H_
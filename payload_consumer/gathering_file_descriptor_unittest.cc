@@ -0,0 +1,143 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/gathering_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kCacheSize = 100;
+constexpr size_t kFileSize = 1024;
+}  // namespace
+
+class GatheringFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(test_utils::WriteFileString(temp_file_.path(),
+                                            string(kFileSize, '.')));
+    EXPECT_TRUE(gfd_.Open(temp_file_.path().c_str(), O_RDWR));
+  }
+
+  void WriteAt(off64_t offset, const string& data) {
+    ASSERT_EQ(offset, gfd_.Seek(offset, SEEK_SET));
+    ASSERT_EQ(static_cast<ssize_t>(data.size()),
+              gfd_.Write(data.data(), data.size()));
+  }
+
+  string FileContents() {
+    string contents;
+    EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &contents));
+    return contents;
+  }
+
+  ScopedTempFile temp_file_{"GatheringFileDescriptorTest-XXXXXX"};
+  GatheringFileDescriptor gfd_{std::make_shared<EintrSafeFileDescriptor>(),
+                               kCacheSize};
+};
+
+TEST_F(GatheringFileDescriptorTest, ScatteredWritesTest) {
+  // Out of order, with contiguous pieces.
+  WriteAt(500, "cc");
+  WriteAt(10, "aa");
+  WriteAt(12, "bb");
+  WriteAt(502, "dd");
+  EXPECT_EQ(string(kFileSize, '.'), FileContents());
+  EXPECT_EQ(0u, gfd_.num_flushes());
+
+  EXPECT_TRUE(gfd_.Flush());
+  EXPECT_EQ(1u, gfd_.num_flushes());
+  string expected(kFileSize, '.');
+  expected.replace(10, 4, "aabb");
+  expected.replace(500, 4, "ccdd");
+  EXPECT_EQ(expected, FileContents());
+  EXPECT_TRUE(gfd_.Close());
+}
+
+TEST_F(GatheringFileDescriptorTest, OverlappingWritesTest) {
+  WriteAt(10, "aaaa");
+  WriteAt(12, "bb");
+  WriteAt(8, "cc");
+  EXPECT_TRUE(gfd_.Close());
+  string expected(kFileSize, '.');
+  expected.replace(8, 6, "ccaabb");
+  EXPECT_EQ(expected, FileContents());
+}
+
+TEST_F(GatheringFileDescriptorTest, ReadSeesPendingWritesTest) {
+  WriteAt(20, "abc");
+  ASSERT_EQ(19, gfd_.Seek(19, SEEK_SET));
+  char buf[5];
+  ASSERT_EQ(5, gfd_.Read(buf, sizeof(buf)));
+  EXPECT_EQ(".abc.", string(buf, sizeof(buf)));
+  EXPECT_EQ(24, gfd_.Seek(0, SEEK_CUR));
+  EXPECT_TRUE(gfd_.Close());
+}
+
+TEST_F(GatheringFileDescriptorTest, FlushesWhenFullTest) {
+  WriteAt(200, string(kCacheSize / 2, 'a'));
+  WriteAt(300, string(kCacheSize / 2, 'b'));
+  EXPECT_EQ(1u, gfd_.num_flushes());
+  // Larger than the cache, written right away.
+  WriteAt(0, string(kCacheSize, 'c'));
+  EXPECT_EQ(1u, gfd_.num_flushes());
+  string expected(kFileSize, '.');
+  expected.replace(0, kCacheSize, kCacheSize, 'c');
+  expected.replace(200, kCacheSize / 2, kCacheSize / 2, 'a');
+  expected.replace(300, kCacheSize / 2, kCacheSize / 2, 'b');
+  EXPECT_EQ(expected, FileContents());
+  EXPECT_TRUE(gfd_.Close());
+}
+
+TEST_F(GatheringFileDescriptorTest, WriteBehindTest) {
+  EXPECT_TRUE(gfd_.Close());
+  GatheringFileDescriptor gfd(
+      std::make_shared<EintrSafeFileDescriptor>(), kCacheSize, true);
+  EXPECT_TRUE(gfd.Open(temp_file_.path().c_str(), O_RDWR));
+  // Fills the cache, so the first batch is written in the background.
+  ASSERT_EQ(200, gfd.Seek(200, SEEK_SET));
+  const string half(kCacheSize / 2, 'a');
+  ASSERT_EQ(static_cast<ssize_t>(half.size()),
+            gfd.Write(half.data(), half.size()));
+  ASSERT_EQ(static_cast<ssize_t>(half.size()),
+            gfd.Write(half.data(), half.size()));
+  EXPECT_EQ(1u, gfd.num_flushes());
+  // Overwrites part of the batch, after it's written.
+  ASSERT_EQ(210, gfd.Seek(210, SEEK_SET));
+  ASSERT_EQ(2, gfd.Write("bb", 2));
+  ASSERT_EQ(209, gfd.Seek(209, SEEK_SET));
+  char buf[4];
+  ASSERT_EQ(4, gfd.Read(buf, sizeof(buf)));
+  EXPECT_EQ("abba", string(buf, sizeof(buf)));
+  EXPECT_TRUE(gfd.Close());
+  string expected(kFileSize, '.');
+  expected.replace(200, kCacheSize, kCacheSize, 'a');
+  expected.replace(210, 2, "bb");
+  EXPECT_EQ(expected, FileContents());
+}
+
+}  // namespace chromeos_update_engine
@@ -29,9 +29,12 @@
 #include <bsdiff/bspatch.h>
 #include <puffin/brotli_util.h>
 #include <puffin/puffpatch.h>
+#include <zucchini/buffer_view.h>
 #include <zucchini/patch_reader.h>
 #include <zucchini/zucchini.h>
 
+#include "update_engine/common/memory_budget.h"
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/lz4diff/lz4patch.h"
 #include "update_engine/lz4diff/lz4diff_compress.h"
@@ -41,7 +44,9 @@
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -175,28 +180,62 @@ class PuffinExtentStream : public puffin::StreamInterface {
   DISALLOW_COPY_AND_ASSIGN(PuffinExtentStream);
 };
 
+bool InstallOperationExecutor::SetZstdDictionary(
+    const std::string& dictionary) {
+  zstd_ddict_.reset();
+  if (dictionary.empty())
+    return true;
+  ZSTD_DDict* ddict = ZSTD_createDDict(dictionary.data(), dictionary.size());
+  if (ddict == nullptr) {
+    LOG(ERROR) << "Unable to load the zstd dictionary of " << dictionary.size()
+               << " bytes.";
+    return false;
+  }
+  zstd_ddict_.reset(ddict, ZSTD_freeDDict);
+  return true;
+}
+
 bool InstallOperationExecutor::ExecuteReplaceOperation(
     const InstallOperation& operation,
     std::unique_ptr<ExtentWriter> writer,
     const void* data,
     size_t count) {
-  TEST_AND_RETURN_FALSE(operation.type() == InstallOperation::REPLACE ||
-                        operation.type() == InstallOperation::REPLACE_BZ ||
-                        operation.type() == InstallOperation::REPLACE_XZ);
+  UE_TRACE_SCOPE("ExecuteReplaceOperation");
+  writer = CreateReplaceWriter(operation, std::move(writer));
+  TEST_AND_RETURN_FALSE(writer != nullptr);
+  TEST_AND_RETURN_FALSE(writer->Write(data, operation.data_length()));
+
+  return true;
+}
+
+std::unique_ptr<ExtentWriter> InstallOperationExecutor::CreateReplaceWriter(
+    const InstallOperation& operation, std::unique_ptr<ExtentWriter> writer) {
+  if (operation.type() != InstallOperation::REPLACE &&
+      operation.type() != InstallOperation::REPLACE_BZ &&
+      operation.type() != InstallOperation::REPLACE_XZ &&
+      operation.type() != InstallOperation::REPLACE_ZSTD) {
+    LOG(ERROR) << "Not a replace operation: "
+               << InstallOperationTypeName(operation.type());
+    return nullptr;
+  }
   // Setup the ExtentWriter stack based on the operation type.
   if (operation.type() == InstallOperation::REPLACE_BZ) {
     writer.reset(new BzipExtentWriter(std::move(writer)));
   } else if (operation.type() == InstallOperation::REPLACE_XZ) {
     writer.reset(new XzExtentWriter(std::move(writer)));
+  } else if (operation.type() == InstallOperation::REPLACE_ZSTD) {
+    writer.reset(new ZstdExtentWriter(std::move(writer), zstd_ddict_.get()));
   }
-  TEST_AND_RETURN_FALSE(writer->Init(operation.dst_extents(), block_size_));
-  TEST_AND_RETURN_FALSE(writer->Write(data, operation.data_length()));
-
-  return true;
+  if (!writer->Init(operation.dst_extents(), block_size_)) {
+    LOG(ERROR) << "Failed to initialize the writer of the replace operation";
+    return nullptr;
+  }
+  return writer;
 }
 
 bool InstallOperationExecutor::ExecuteZeroOrDiscardOperation(
     const InstallOperation& operation, std::unique_ptr<ExtentWriter> writer) {
+  UE_TRACE_SCOPE("ExecuteZeroOrDiscardOperation");
   TEST_AND_RETURN_FALSE(operation.type() == InstallOperation::ZERO ||
                         operation.type() == InstallOperation::DISCARD);
   using base::MemoryMappedFile;
@@ -223,6 +262,7 @@ bool InstallOperationExecutor::ExecuteSourceCopyOperation(
     const InstallOperation& operation,
     std::unique_ptr<ExtentWriter> writer,
     FileDescriptorPtr source_fd) {
+  UE_TRACE_SCOPE("ExecuteSourceCopyOperation");
   TEST_AND_RETURN_FALSE(operation.type() == InstallOperation::SOURCE_COPY);
   TEST_AND_RETURN_FALSE(writer->Init(operation.dst_extents(), block_size_));
   return fd_utils::CommonHashExtents(
@@ -267,6 +307,7 @@ bool InstallOperationExecutor::ExecuteLz4diffOperation(
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
+  UE_TRACE_SCOPE("ExecuteLz4diffOperation");
   brillo::Blob src_data;
 
   TEST_AND_RETURN_FALSE(utils::ReadExtents(
@@ -283,13 +324,23 @@ bool InstallOperationExecutor::ExecuteLz4diffOperation(
   return true;
 }
 
+// Reserves the read-ahead buffer of the source of a diff operation, from at
+// least one block up to 1 MiB depending on the memory budget.
+static MemoryBudget::Reservation ReserveReadAhead(size_t block_size) {
+  constexpr size_t kReadAheadSize = 1024 * 1024;
+  return MemoryBudget::Get()->Reserve(
+      block_size, kReadAheadSize, block_size, "read_ahead");
+}
+
 bool InstallOperationExecutor::ExecuteSourceBsdiffOperation(
     const InstallOperation& operation,
     std::unique_ptr<ExtentWriter> writer,
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  auto reader = std::make_unique<DirectExtentReader>();
+  UE_TRACE_SCOPE("ExecuteSourceBsdiffOperation");
+  const auto read_ahead = ReserveReadAhead(block_size_);
+  auto reader = std::make_unique<BufferedExtentReader>(read_ahead.size());
   TEST_AND_RETURN_FALSE(
       reader->Init(source_fd, operation.src_extents(), block_size_));
   auto src_file = std::make_unique<BsdiffExtentFile>(
@@ -313,7 +364,9 @@ bool InstallOperationExecutor::ExecutePuffDiffOperation(
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  auto reader = std::make_unique<DirectExtentReader>();
+  UE_TRACE_SCOPE("ExecutePuffDiffOperation");
+  const auto read_ahead = ReserveReadAhead(block_size_);
+  auto reader = std::make_unique<BufferedExtentReader>(read_ahead.size());
   TEST_AND_RETURN_FALSE(
       reader->Init(source_fd, operation.src_extents(), block_size_));
   puffin::UniqueStreamPtr src_stream(new PuffinExtentStream(
@@ -324,13 +377,17 @@ bool InstallOperationExecutor::ExecutePuffDiffOperation(
       std::move(writer),
       utils::BlocksInExtents(operation.dst_extents()) * block_size_));
 
-  constexpr size_t kMaxCacheSize = 5 * 1024 * 1024;  // Total 5MB cache.
+  // The cache of puffed source streams shrinks with the memory budget.
+  constexpr size_t kMinCacheSize = 1024 * 1024;
+  constexpr size_t kMaxCacheSize = 5 * 1024 * 1024;
+  const auto cache =
+      MemoryBudget::Get()->Reserve(kMinCacheSize, kMaxCacheSize, 1, "puffin");
   TEST_AND_RETURN_FALSE(
       puffin::PuffPatch(std::move(src_stream),
                         std::move(dst_stream),
                         reinterpret_cast<const uint8_t*>(data),
                         count,
-                        kMaxCacheSize));
+                        cache.size()));
   return true;
 }
 
@@ -340,43 +397,56 @@ bool InstallOperationExecutor::ExecuteZucchiniOperation(
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  uint64_t src_size =
-      utils::BlocksInExtents(operation.src_extents()) * block_size_;
-  brillo::Blob source_bytes(src_size);
+  UE_TRACE_SCOPE("ExecuteZucchiniOperation");
+  const uint64_t dst_size =
+      utils::BlocksInExtents(operation.dst_extents()) * block_size_;
+  brillo::Blob patched_data;
+  {
+    // Zucchini reads the source and writes the patched data at random, so
+    // both must be in memory. A contiguous source is mapped, which keeps it in
+    // the page cache instead of a copy in a buffer.
+    const uint64_t src_size =
+        utils::BlocksInExtents(operation.src_extents()) * block_size_;
+    base::MemoryMappedFile source_mapping;
+    brillo::Blob source_bytes;
+    zucchini::ConstBufferView source;
+    if (operation.src_extents_size() == 1 &&
+        source_fd->MapReadOnly(
+            operation.src_extents(0).start_block() * block_size_,
+            src_size,
+            &source_mapping)) {
+      source = {source_mapping.data(), source_mapping.length()};
+    } else {
+      source_bytes.resize(src_size);
+      auto reader = std::make_unique<DirectExtentReader>();
+      TEST_AND_RETURN_FALSE(
+          reader->Init(source_fd, operation.src_extents(), block_size_));
+      TEST_AND_RETURN_FALSE(reader->Seek(0));
+      TEST_AND_RETURN_FALSE(reader->Read(source_bytes.data(), src_size));
+      source = {source_bytes.data(), source_bytes.size()};
+    }
 
-  // TODO(197361113) either make zucchini stream the read, or use memory mapped
-  // files.
-  auto reader = std::make_unique<DirectExtentReader>();
-  TEST_AND_RETURN_FALSE(
-      reader->Init(source_fd, operation.src_extents(), block_size_));
-  TEST_AND_RETURN_FALSE(reader->Seek(0));
-  TEST_AND_RETURN_FALSE(reader->Read(source_bytes.data(), src_size));
-
-  brillo::Blob zucchini_patch;
-  TEST_AND_RETURN_FALSE(puffin::BrotliDecode(
-      static_cast<const uint8_t*>(data), count, &zucchini_patch));
-  auto patch_reader = zucchini::EnsemblePatchReader::Create(
-      {zucchini_patch.data(), zucchini_patch.size()});
-  if (!patch_reader.has_value()) {
-    LOG(ERROR) << "Failed to parse the zucchini patch.";
-    return false;
-  }
+    brillo::Blob zucchini_patch;
+    TEST_AND_RETURN_FALSE(puffin::BrotliDecode(
+        static_cast<const uint8_t*>(data), count, &zucchini_patch));
+    auto patch_reader = zucchini::EnsemblePatchReader::Create(
+        {zucchini_patch.data(), zucchini_patch.size()});
+    if (!patch_reader.has_value()) {
+      LOG(ERROR) << "Failed to parse the zucchini patch.";
+      return false;
+    }
+    TEST_AND_RETURN_FALSE(patch_reader->header().new_size == dst_size);
 
-  auto dst_size = patch_reader->header().new_size;
-  TEST_AND_RETURN_FALSE(dst_size ==
-                        utils::BlocksInExtents(operation.dst_extents()) *
-                            block_size_);
-
-  brillo::Blob patched_data(dst_size);
-  auto status =
-      zucchini::ApplyBuffer({source_bytes.data(), source_bytes.size()},
-                            *patch_reader,
-                            {patched_data.data(), patched_data.size()});
-  if (status != zucchini::status::kStatusSuccess) {
-    LOG(ERROR) << "Failed to apply the zucchini patch: " << status;
-    return false;
+    patched_data.resize(dst_size);
+    auto status = zucchini::ApplyBuffer(
+        source, *patch_reader, {patched_data.data(), patched_data.size()});
+    if (status != zucchini::status::kStatusSuccess) {
+      LOG(ERROR) << "Failed to apply the zucchini patch: " << status;
+      return false;
+    }
   }
 
+  // The source and the patch are released before the writer runs.
   TEST_AND_RETURN_FALSE(
       writer->Write(patched_data.data(), patched_data.size()));
   return true;
@@ -17,7 +17,10 @@
 #ifndef UPDATE_ENGINE_INSTALL_OPERATION_EXECUTOR_H
 #define UPDATE_ENGINE_INSTALL_OPERATION_EXECUTOR_H
 
+#include <zstd.h>
+
 #include <memory>
+#include <string>
 
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
@@ -30,10 +33,19 @@ class InstallOperationExecutor {
   explicit InstallOperationExecutor(size_t block_size)
       : block_size_(block_size) {}
 
+  // Sets the zstd |dictionary| of the partition, which its REPLACE_ZSTD
+  // operations are decompressed with, or none if it is empty.
+  bool SetZstdDictionary(const std::string& dictionary);
+
   bool ExecuteReplaceOperation(const InstallOperation& operation,
                                std::unique_ptr<ExtentWriter> writer,
                                const void* data,
                                size_t count);
+  // Stacks the decompressor of the REPLACE* |operation| on top of |writer|
+  // and initializes it, so the blob can be written in several calls. Returns
+  // null on failure.
+  std::unique_ptr<ExtentWriter> CreateReplaceWriter(
+      const InstallOperation& operation, std::unique_ptr<ExtentWriter> writer);
   bool ExecuteZeroOrDiscardOperation(const InstallOperation& operation,
                                      std::unique_ptr<ExtentWriter> writer);
   bool ExecuteSourceCopyOperation(const InstallOperation& operation,
@@ -69,6 +81,9 @@ class InstallOperationExecutor {
                                size_t count);
 
   size_t block_size_;
+  // The zstd dictionary digested for decompression, shared by the copies of
+  // this executor.
+  std::shared_ptr<ZSTD_DDict> zstd_ddict_;
 };
 
 }  // namespace chromeos_update_engine
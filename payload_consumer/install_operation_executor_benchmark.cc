@@ -0,0 +1,386 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Measures how fast InstallOperationExecutor applies each type of operation,
+// on synthesized images. The images stay in the page cache, so this is mostly
+// the CPU cost of the decompressors and patchers plus the writer stack.
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+#include <puffin/utils.h>
+#include <zlib.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/lz4diff/lz4diff.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/install_operation_executor.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/erofs_filesystem.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/xz.h"
+#include "update_engine/payload_generator/zstd.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// 8 MiB images, small enough to generate the diffs in a few seconds.
+constexpr size_t kNumBlocks = 2048;
+
+// Fills |data| with text-like bytes, words of a small dictionary, which
+// compress and diff about as well as the bulk of a system image.
+void FillImage(std::mt19937* rng, brillo::Blob* data) {
+  static const char* const kWords[] = {
+      "update", "engine", "payload", "partition", "extent", "block",
+      "android", "system", "vendor", "operation", "source", "target",
+      "\n", " ", "0x7f454c46", "libc.so", "/system/bin/", "zygote64"};
+  size_t pos = 0;
+  while (pos < data->size()) {
+    const std::string word = kWords[(*rng)() % std::size(kWords)];
+    const size_t size = std::min(word.size(), data->size() - pos);
+    std::copy(word.begin(), word.begin() + size, data->begin() + pos);
+    pos += size;
+  }
+}
+
+// Rewrites one block out of eight of |data|, and shifts the rest of it by a
+// few bytes in the middle, like a rebuilt binary.
+brillo::Blob MutateImage(std::mt19937* rng, const brillo::Blob& data) {
+  brillo::Blob result = data;
+  brillo::Blob block(kBlockSize);
+  for (size_t i = 0; i < result.size() / kBlockSize; i += 8) {
+    FillImage(rng, &block);
+    std::copy(block.begin(), block.end(), result.begin() + i * kBlockSize);
+  }
+  const size_t middle = result.size() / 2;
+  std::copy_backward(
+      result.begin() + middle, result.end() - 100, result.end());
+  return result;
+}
+
+// Compresses |data| as a raw deflate stream and pads it to a whole number of
+// blocks, with the location of the deflates in |deflates|.
+bool DeflateImage(const brillo::Blob& data,
+                  brillo::Blob* out,
+                  std::vector<puffin::BitExtent>* deflates) {
+  z_stream stream{};
+  TEST_AND_RETURN_FALSE(deflateInit2(&stream,
+                                     Z_DEFAULT_COMPRESSION,
+                                     Z_DEFLATED,
+                                     -15,
+                                     8,
+                                     Z_DEFAULT_STRATEGY) == Z_OK);
+  out->resize(deflateBound(&stream, data.size()));
+  stream.next_in = const_cast<uint8_t*>(data.data());
+  stream.avail_in = data.size();
+  stream.next_out = out->data();
+  stream.avail_out = out->size();
+  const int ret = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  TEST_AND_RETURN_FALSE(ret == Z_STREAM_END);
+  out->resize(utils::DivRoundUp(stream.total_out, kBlockSize) * kBlockSize);
+  uint64_t compressed_size = 0;
+  return puffin::LocateDeflatesInDeflateStream(
+      out->data(), out->size(), 0, deflates, &compressed_size);
+}
+
+// Returns the directory of the benchmark binary, where its data files are.
+base::FilePath GetDataDir() {
+  base::FilePath exe_path;
+  base::ReadSymbolicLink(base::FilePath("/proc/self/exe"), &exe_path);
+  return exe_path.DirName();
+}
+
+// Reads the data of |name| in the erofs image |path|, with its compression
+// details.
+bool ReadErofsFile(const std::string& path,
+                   const std::string& name,
+                   brillo::Blob* data,
+                   CompressedFile* info) {
+  auto fs = ErofsFilesystem::CreateFromFile(path);
+  TEST_AND_RETURN_FALSE(fs != nullptr);
+  std::vector<FilesystemInterface::File> files;
+  TEST_AND_RETURN_FALSE(fs->GetFiles(&files));
+  const auto it = std::find_if(files.begin(), files.end(), [&name](auto& f) {
+    return f.name == name;
+  });
+  TEST_AND_RETURN_FALSE(it != files.end());
+  *info = it->compressed_file_info;
+  return utils::ReadExtents(path, it->extents, data, kBlockSize);
+}
+
+// An operation ready to be applied, with the images it applies to.
+struct PreparedOperation {
+  InstallOperation op;
+  brillo::Blob blob;
+  size_t target_size{0};
+  ScopedTempFile source_file{"bench_source.XXXXXX"};
+  ScopedTempFile target_file{"bench_target.XXXXXX"};
+};
+
+// Generates the blob of a diff operation of type |type| from |source| to
+// |target|, with BestDiffGenerator limited to that type.
+bool GenerateDiff(InstallOperation::Type type,
+                  uint32_t minor_version,
+                  const brillo::Blob& source,
+                  const brillo::Blob& target,
+                  const FilesystemInterface::File& old_file,
+                  const FilesystemInterface::File& new_file,
+                  PreparedOperation* prepared) {
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion, minor_version)};
+  const std::vector<Extent> src_extents{
+      ExtentForRange(0, source.size() / kBlockSize)};
+  const std::vector<Extent> dst_extents{
+      ExtentForRange(0, target.size() / kBlockSize)};
+  diff_utils::BestDiffGenerator generator(
+      source, target, src_extents, dst_extents, old_file, new_file, config);
+  AnnotatedOperation aop;
+  aop.name = new_file.name;
+  aop.op.set_type(InstallOperation::REPLACE);
+  prepared->blob = target;
+  const InstallOperation::Type candidate =
+      type == InstallOperation::BROTLI_BSDIFF ? InstallOperation::SOURCE_BSDIFF
+                                              : type;
+  TEST_AND_RETURN_FALSE(generator.GenerateBestDiffOperation(
+      {{candidate, std::numeric_limits<size_t>::max()}},
+      &aop,
+      &prepared->blob));
+  if (aop.op.type() != type) {
+    LOG(ERROR) << "Generated a " << InstallOperationTypeName(aop.op.type())
+               << " instead of a " << InstallOperationTypeName(type);
+    return false;
+  }
+  StoreExtents(src_extents, prepared->op.mutable_src_extents());
+  return true;
+}
+
+bool PrepareOperation(InstallOperation::Type type,
+                      PreparedOperation* prepared) {
+  std::mt19937 rng(type);
+  brillo::Blob source(kNumBlocks * kBlockSize);
+  FillImage(&rng, &source);
+  brillo::Blob target = MutateImage(&rng, source);
+  FilesystemInterface::File old_file, new_file;
+  new_file.name = "bench";
+
+  prepared->op.set_type(type);
+  switch (type) {
+    case InstallOperation::REPLACE:
+      prepared->blob = target;
+      break;
+    case InstallOperation::REPLACE_BZ:
+      TEST_AND_RETURN_FALSE(BzipCompress(target, &prepared->blob));
+      break;
+    case InstallOperation::REPLACE_XZ:
+      XzCompressInit();
+      TEST_AND_RETURN_FALSE(XzCompress(target, &prepared->blob));
+      break;
+    case InstallOperation::REPLACE_ZSTD:
+      TEST_AND_RETURN_FALSE(ZstdCompress(target, &prepared->blob));
+      break;
+    case InstallOperation::ZERO:
+      break;
+    case InstallOperation::SOURCE_COPY:
+      *prepared->op.add_src_extents() = ExtentForRange(0, kNumBlocks);
+      break;
+    case InstallOperation::SOURCE_BSDIFF:
+      TEST_AND_RETURN_FALSE(GenerateDiff(type,
+                                         kSourceMinorPayloadVersion,
+                                         source,
+                                         target,
+                                         old_file,
+                                         new_file,
+                                         prepared));
+      break;
+    case InstallOperation::BROTLI_BSDIFF:
+      TEST_AND_RETURN_FALSE(GenerateDiff(type,
+                                         kBrotliBsdiffMinorPayloadVersion,
+                                         source,
+                                         target,
+                                         old_file,
+                                         new_file,
+                                         prepared));
+      break;
+    case InstallOperation::PUFFDIFF: {
+      brillo::Blob deflated_source, deflated_target;
+      TEST_AND_RETURN_FALSE(
+          DeflateImage(source, &deflated_source, &old_file.deflates));
+      TEST_AND_RETURN_FALSE(
+          DeflateImage(target, &deflated_target, &new_file.deflates));
+      source = std::move(deflated_source);
+      target = std::move(deflated_target);
+      TEST_AND_RETURN_FALSE(GenerateDiff(type,
+                                         kMaxSupportedMinorPayloadVersion,
+                                         source,
+                                         target,
+                                         old_file,
+                                         new_file,
+                                         prepared));
+      break;
+    }
+    case InstallOperation::ZUCCHINI:
+      // Zucchini is only tried on some file extensions.
+      new_file.name = "bench.so";
+      TEST_AND_RETURN_FALSE(GenerateDiff(type,
+                                         kMaxSupportedMinorPayloadVersion,
+                                         source,
+                                         target,
+                                         old_file,
+                                         new_file,
+                                         prepared));
+      break;
+    case InstallOperation::LZ4DIFF_BSDIFF:
+    case InstallOperation::LZ4DIFF_PUFFDIFF: {
+      // LZ4 compressed data is only found in real EROFS images. Use the ones
+      // of the unittests, built at the same time. They decide which of the
+      // LZ4DIFF types is used.
+      const base::FilePath dir = GetDataDir();
+      CompressedFile old_info, new_info;
+      TEST_AND_RETURN_FALSE(ReadErofsFile(dir.Append("gen/erofs.img").value(),
+                                          "/delta_generator",
+                                          &source,
+                                          &old_info));
+      TEST_AND_RETURN_FALSE(
+          ReadErofsFile(dir.Append("gen/erofs_new.img").value(),
+                        "/delta_generator",
+                        &target,
+                        &new_info));
+      // Recompress the target differently so that the patch isn't trivial.
+      new_info.mutable_algo()->set_level(5);
+      InstallOperation::Type op_type;
+      TEST_AND_RETURN_FALSE(Lz4Diff(
+          source, target, old_info, new_info, &prepared->blob, &op_type));
+      prepared->op.set_type(op_type);
+      *prepared->op.add_src_extents() =
+          ExtentForRange(0, source.size() / kBlockSize);
+      break;
+    }
+    default:
+      LOG(ERROR) << "No benchmark for " << InstallOperationTypeName(type);
+      return false;
+  }
+  *prepared->op.add_dst_extents() =
+      ExtentForRange(0, utils::DivRoundUp(target.size(), kBlockSize));
+  prepared->op.set_data_length(prepared->blob.size());
+  prepared->target_size = target.size();
+  TEST_AND_RETURN_FALSE(utils::WriteFile(
+      prepared->source_file.path().c_str(), source.data(), source.size()));
+  return true;
+}
+
+// The operations are generated once for all the runs of a benchmark, some of
+// them take a while to diff.
+const PreparedOperation* GetOperation(InstallOperation::Type type) {
+  static std::map<InstallOperation::Type, std::unique_ptr<PreparedOperation>>
+      operations;
+  auto& prepared = operations[type];
+  if (!prepared) {
+    prepared = std::make_unique<PreparedOperation>();
+    if (!PrepareOperation(type, prepared.get())) {
+      prepared.reset();
+    }
+  }
+  return prepared.get();
+}
+
+void BM_ApplyOperation(benchmark::State& state, InstallOperation::Type type) {
+  const PreparedOperation* prepared = GetOperation(type);
+  if (!prepared) {
+    state.SkipWithError("Unable to generate the operation");
+    return;
+  }
+  FileDescriptorPtr source_fd = std::make_shared<EintrSafeFileDescriptor>();
+  FileDescriptorPtr target_fd = std::make_shared<EintrSafeFileDescriptor>();
+  CHECK(source_fd->Open(prepared->source_file.path().c_str(), O_RDONLY));
+  CHECK(target_fd->Open(prepared->target_file.path().c_str(), O_RDWR));
+  InstallOperationExecutor executor(kBlockSize);
+  const InstallOperation& op = prepared->op;
+  for (auto _ : state) {
+    auto writer = std::make_unique<DirectExtentWriter>(target_fd);
+    bool result = false;
+    switch (op.type()) {
+      case InstallOperation::REPLACE:
+      case InstallOperation::REPLACE_BZ:
+      case InstallOperation::REPLACE_XZ:
+      case InstallOperation::REPLACE_ZSTD:
+        result = executor.ExecuteReplaceOperation(op,
+                                                  std::move(writer),
+                                                  prepared->blob.data(),
+                                                  prepared->blob.size());
+        break;
+      case InstallOperation::ZERO:
+        result = executor.ExecuteZeroOrDiscardOperation(op, std::move(writer));
+        break;
+      case InstallOperation::SOURCE_COPY:
+        result = executor.ExecuteSourceCopyOperation(
+            op, std::move(writer), source_fd);
+        break;
+      default:
+        result = executor.ExecuteDiffOperation(op,
+                                               std::move(writer),
+                                               source_fd,
+                                               prepared->blob.data(),
+                                               prepared->blob.size());
+    }
+    if (!result) {
+      state.SkipWithError("Failed to apply the operation");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * prepared->target_size);
+  state.counters["blob_bytes"] = prepared->blob.size();
+}
+
+#define BENCHMARK_OPERATION(type)                                    \
+  BENCHMARK_CAPTURE(BM_ApplyOperation, type, InstallOperation::type) \
+      ->Unit(benchmark::kMillisecond)
+
+BENCHMARK_OPERATION(REPLACE);
+BENCHMARK_OPERATION(REPLACE_BZ);
+BENCHMARK_OPERATION(REPLACE_XZ);
+BENCHMARK_OPERATION(REPLACE_ZSTD);
+BENCHMARK_OPERATION(ZERO);
+BENCHMARK_OPERATION(SOURCE_COPY);
+BENCHMARK_OPERATION(SOURCE_BSDIFF);
+BENCHMARK_OPERATION(BROTLI_BSDIFF);
+BENCHMARK_OPERATION(PUFFDIFF);
+BENCHMARK_OPERATION(ZUCCHINI);
+BENCHMARK_CAPTURE(BM_ApplyOperation, LZ4DIFF, InstallOperation::LZ4DIFF_BSDIFF)
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
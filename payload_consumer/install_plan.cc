@@ -17,7 +17,9 @@
 #include "update_engine/payload_consumer/install_plan.h"
 
 #include <algorithm>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include <base/format_macros.h>
 #include <base/logging.h>
@@ -25,8 +27,10 @@
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 
+#include "update_engine/common/dynamic_partition_control_interface.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::string;
@@ -40,6 +44,15 @@ string PayloadUrlsToString(
   return "(" + base::JoinString(payload_urls, ",") + ")";
 }
 
+string SplitPartsToString(
+    const decltype(InstallPlan::split_payload_parts)& parts) {
+  vector<string> entries;
+  for (const auto& [offset, url] : parts) {
+    entries.push_back(std::to_string(offset) + ":" + url);
+  }
+  return "(" + base::JoinString(entries, ",") + ")";
+}
+
 string VectorToString(const vector<std::pair<string, string>>& input,
                       const string& separator) {
   vector<string> vec;
@@ -104,6 +117,34 @@ string InstallPlan::ToString() const {
           {"rollback_data_save_requested",
            utils::ToString(rollback_data_save_requested)},
           {"write_verity", utils::ToString(write_verity)},
+          {"write_verity_during_apply",
+           utils::ToString(write_verity_during_apply)},
+          {"reuse_source_verity", utils::ToString(reuse_source_verity)},
+          {"verify_during_apply", utils::ToString(verify_during_apply)},
+          {"pipelined_apply", utils::ToString(pipelined_apply)},
+          {"apply_threads", base::NumberToString(apply_threads)},
+          {"concurrent_partitions", utils::ToString(concurrent_partitions)},
+          {"verify_threads", base::NumberToString(verify_threads)},
+          {"verify_read_bandwidth",
+           base::NumberToString(verify_read_bandwidth)},
+          {"stream_replace_operations",
+           utils::ToString(stream_replace_operations)},
+          {"prepare_partitions_in_background",
+           utils::ToString(prepare_partitions_in_background)},
+          {"download_connections",
+           base::NumberToString(download_connections)},
+          {"mirror_urls", PayloadUrlsToString(mirror_urls)},
+          {"peer_urls", PayloadUrlsToString(peer_urls)},
+          {"split_payload_parts", SplitPartsToString(split_payload_parts)},
+          {"download_buffer_size",
+           base::NumberToString(download_buffer_size)},
+          {"prefetch_to_disk", utils::ToString(prefetch_to_disk)},
+          {"max_download_rate", base::NumberToString(max_download_rate)},
+          {"direct_target_writes", utils::ToString(direct_target_writes)},
+          {"write_behind", utils::ToString(write_behind)},
+          {"instrument_file_io", utils::ToString(instrument_file_io)},
+          {"skip_written_operations",
+           utils::ToString(skip_written_operations)},
       },
       "\n"));
 
@@ -152,6 +193,21 @@ string InstallPlan::ToString() const {
 
 bool InstallPlan::LoadPartitionsFromSlots(BootControlInterface* boot_control) {
   bool result = true;
+  // Map the target partitions side by side first, mapping them one by one
+  // below takes seconds on devices with many partitions.
+  if (target_slot != BootControlInterface::kInvalidSlot &&
+      boot_control->GetDynamicPartitionControl()) {
+    std::vector<std::string> target_partitions;
+    for (const Partition& partition : partitions) {
+      if (partition.target_size > 0)
+        target_partitions.push_back(partition.name);
+    }
+    if (!target_partitions.empty() &&
+        !boot_control->GetDynamicPartitionControl()->MapTargetPartitions(
+            target_partitions, target_slot)) {
+      LOG(WARNING) << "Unable to map all the target partitions at once.";
+    }
+  }
   for (Partition& partition : partitions) {
     if (source_slot != BootControlInterface::kInvalidSlot &&
         partition.source_size > 0) {
@@ -225,6 +281,123 @@ bool InstallPlan::Partition::ParseVerityConfig(
   return true;
 }
 
+void InstallPlan::Partition::ParseUnusedExtents(
+    const PartitionUpdate& partition) {
+  unused_extents.clear();
+  if (partition.unused_extents().empty())
+    return;
+  const string& hash = partition.new_partition_hash_without_unused();
+  if (hash.size() != target_hash.size()) {
+    LOG(WARNING) << "Ignoring the unused extents of " << name
+                 << ", they have no valid alternate hash.";
+    return;
+  }
+  // The verity data is always written and hashed.
+  const vector<std::pair<uint64_t, uint64_t>> verity_ranges = {
+      {hash_tree_data_offset, hash_tree_data_size},
+      {hash_tree_offset, hash_tree_size},
+      {fec_data_offset, fec_data_size},
+      {fec_offset, fec_size}};
+  const uint64_t num_blocks = target_size / block_size;
+  uint64_t next_block = 0;
+  for (const Extent& extent : partition.unused_extents()) {
+    const uint64_t start = extent.start_block();
+    bool valid = extent.num_blocks() > 0 && start >= next_block &&
+                 start < num_blocks &&
+                 extent.num_blocks() <= num_blocks - start;
+    const uint64_t end = start + extent.num_blocks();
+    for (const auto& [offset, size] : verity_ranges) {
+      valid = valid && (size == 0 || offset + size <= start * block_size ||
+                        end * block_size <= offset);
+    }
+    if (!valid) {
+      LOG(WARNING) << "Ignoring the unused extents of " << name
+                   << ", invalid extent " << start << ":"
+                   << extent.num_blocks();
+      unused_extents.clear();
+      return;
+    }
+    unused_extents.push_back(extent);
+    next_block = end;
+  }
+  target_hash.assign(hash.begin(), hash.end());
+}
+
+void InstallPlan::Partition::ParseUnchangedExtents(
+    const PartitionUpdate& partition) {
+  ExtentRanges unchanged;
+  ExtentRanges written;
+  for (const InstallOperation& operation : partition.operations()) {
+    bool same_blocks =
+        operation.type() == InstallOperation::SOURCE_COPY &&
+        operation.src_extents_size() == operation.dst_extents_size();
+    for (int i = 0; same_blocks && i < operation.src_extents_size(); i++) {
+      const Extent& src = operation.src_extents(i);
+      const Extent& dst = operation.dst_extents(i);
+      same_blocks = src.start_block() == dst.start_block() &&
+                    src.num_blocks() == dst.num_blocks();
+    }
+    if (same_blocks) {
+      unchanged.AddRepeatedExtents(operation.dst_extents());
+    } else {
+      written.AddRepeatedExtents(operation.dst_extents());
+    }
+  }
+  // The verity data is never the same as in the source partition.
+  if (hash_tree_size != 0) {
+    written.AddExtent(
+        ExtentForBytes(block_size, hash_tree_offset, hash_tree_size));
+  }
+  if (fec_size != 0) {
+    written.AddExtent(ExtentForBytes(block_size, fec_offset, fec_size));
+  }
+  unchanged.SubtractRanges(written);
+  unchanged_extents = unchanged.GetExtentsForBlockCount(unchanged.blocks());
+}
+
+void InstallPlan::Partition::AppendUsedExtents(const Extent& extent,
+                                               vector<Extent>* used) const {
+  uint64_t start = extent.start_block();
+  const uint64_t end = start + extent.num_blocks();
+  for (const Extent& unused : unused_extents) {
+    const uint64_t unused_end = unused.start_block() + unused.num_blocks();
+    if (unused_end <= start)
+      continue;
+    if (unused.start_block() >= end)
+      break;
+    if (unused.start_block() > start) {
+      used->emplace_back();
+      used->back().set_start_block(start);
+      used->back().set_num_blocks(unused.start_block() - start);
+    }
+    start = unused_end;
+    if (start >= end)
+      return;
+  }
+  if (start < end) {
+    used->emplace_back();
+    used->back().set_start_block(start);
+    used->back().set_num_blocks(end - start);
+  }
+}
+
+uint64_t InstallPlan::Partition::UsedRangeEnd(uint64_t* offset,
+                                              uint64_t end) const {
+  for (const Extent& extent : unused_extents) {
+    const uint64_t unused_start = extent.start_block() * block_size;
+    if (unused_start >= end)
+      break;
+    const uint64_t unused_end =
+        unused_start + extent.num_blocks() * block_size;
+    if (unused_end <= *offset)
+      continue;
+    if (unused_start > *offset)
+      return unused_start;
+    *offset = unused_end;
+  }
+  return end;
+}
+
 template <typename PartitinoUpdateArray>
 bool InstallPlan::ParseManifestToInstallPlan(
     const PartitinoUpdateArray& partitions,
@@ -270,6 +443,10 @@ bool InstallPlan::ParseManifestToInstallPlan(
                 << "` verity configs";
       return false;
     }
+    install_part.ParseUnusedExtents(partition);
+    if (install_plan->reuse_source_verity && install_part.source_size > 0) {
+      install_part.ParseUnchangedExtents(partition);
+    }
 
     install_plan->partitions.push_back(install_part);
   }
@@ -18,6 +18,7 @@
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_PLAN_H_
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <base/macros.h>
@@ -157,7 +158,33 @@ struct InstallPlan {
     uint64_t fec_size{0};
     uint32_t fec_roots{0};
 
+    // True once DeltaPerformer wrote the hash tree and FEC data while applying
+    // the operations, so FilesystemVerifierAction doesn't write them again.
+    bool verity_written{false};
+
+    // Blocks of the target partition whose content doesn't matter, sorted and
+    // disjoint. They are neither written nor part of |target_hash|.
+    std::vector<Extent> unused_extents;
+
+    // Blocks of the target partition which SOURCE_COPY operations copy from
+    // the same blocks of the source partition, sorted and disjoint. Only set
+    // with |reuse_source_verity|.
+    std::vector<Extent> unchanged_extents;
+
     bool ParseVerityConfig(const PartitionUpdate&);
+    // Uses the unused extents of |partition| and their alternate hash, if
+    // they are valid for this partition, or ignores them with a warning. Must
+    // run after ParseVerityConfig().
+    void ParseUnusedExtents(const PartitionUpdate& partition);
+    // Finds the |unchanged_extents| in the operations of |partition|. Must run
+    // after ParseVerityConfig().
+    void ParseUnchangedExtents(const PartitionUpdate& partition);
+    // Appends the blocks of |extent| which aren't unused to |used|.
+    void AppendUsedExtents(const Extent& extent,
+                           std::vector<Extent>* used) const;
+    // Moves the byte |*offset| past the unused extent it is in, if any, and
+    // returns where the used bytes from there end, at most |end|.
+    uint64_t UsedRangeEnd(uint64_t* offset, uint64_t end) const;
   };
   std::vector<Partition> partitions;
 
@@ -187,6 +214,107 @@ struct InstallPlan {
   // False otherwise.
   bool write_verity{true};
 
+  // True if the hash tree of the partitions should be built from the blocks
+  // written while the operations are applied, instead of read back from the
+  // whole partition afterwards. Only some partition writers support it.
+  bool write_verity_during_apply{false};
+
+  // True if the hash tree and FEC data of the blocks which the operations copy
+  // unchanged from the source partitions should be read from there, when they
+  // are valid, instead of computed again.
+  bool reuse_source_verity{false};
+
+  // True if the target partitions should be hashed in the background as soon
+  // as they are written, while the next ones are applied. The hashes are
+  // handed over to FilesystemVerifierAction, which finishes them.
+  bool verify_during_apply{false};
+
+  // True if the install operations should be applied by a background worker,
+  // overlapping with the download and validation of the next operations.
+  bool pipelined_apply{false};
+
+  // The number of workers applying the operations of a partition concurrently
+  // when |pipelined_apply| is set. Only operations writing disjoint blocks run
+  // at the same time.
+  uint32_t apply_threads{1};
+
+  // True if the next partition should be opened and its operations applied
+  // while the last operations of the previous partition are still applied,
+  // when |pipelined_apply| is set. Partitions never share blocks, so at most
+  // two of them are written at the same time.
+  bool concurrent_partitions{false};
+
+  // The number of workers hashing the target partitions in
+  // FilesystemVerifierAction. With more than one, all the partitions are
+  // hashed concurrently once their verity data is written, and as many
+  // threads hash the blocks of each hash tree.
+  uint32_t verify_threads{1};
+
+  // The maximum number of bytes per second read by all the workers hashing
+  // partitions concurrently, or 0 for no limit.
+  uint64_t verify_read_bandwidth{0};
+
+  // True if large REPLACE, REPLACE_BZ, REPLACE_XZ and REPLACE_ZSTD operations
+  // should be decompressed and written as their blob is downloaded, instead of
+  // once the whole blob is buffered. Their hash is still checked before moving
+  // on to the next operation.
+  bool stream_replace_operations{false};
+
+  // True if the dynamic partitions of a new update should be allocated and
+  // mapped in the background, while the payload data received meanwhile is
+  // kept in memory, instead of before the download goes on.
+  bool prepare_partitions_in_background{false};
+
+  // The number of connections downloading the payload at the same time. This
+  // only applies to HTTP(S) payload URLs.
+  uint32_t download_connections{1};
+
+  // URLs serving the same payload as |download_url|, which the parts
+  // downloaded by the |download_connections| are also downloaded from.
+  std::vector<std::string> mirror_urls;
+
+  // URLs of local peers serving the same payload, which the parts downloaded
+  // by the |download_connections| are downloaded from first. The other URLs
+  // are only used once all the peers failed or stalled.
+  std::vector<std::string> peer_urls;
+
+  // The offset in the payload and URL of each file of a split payload, see
+  // kPayloadPropertySplitPayloadParts. Empty if the payload is one file.
+  std::vector<std::pair<uint64_t, std::string>> split_payload_parts;
+
+  // The most bytes downloaded ahead of DeltaPerformer::Write(), or 0 to
+  // write the bytes as they are received.
+  uint64_t download_buffer_size{0};
+
+  // True if an HTTP(S) payload should be downloaded into a cache file ahead of
+  // the apply, which reads it from that file.
+  bool prefetch_to_disk{false};
+
+  // The most bytes per second downloaded, on average, or 0 for no limit.
+  uint64_t max_download_rate{0};
+
+  // True if the target partitions should be written with O_DIRECT, bypassing
+  // the page cache, where supported. Only applies to the partitions written
+  // directly, not through a COW.
+  bool direct_target_writes{false};
+
+  // True if the blocks gathered for the target partitions should be written
+  // by a background thread, while the next operations are decompressed or
+  // patched. Only applies to the partitions written directly, not through a
+  // COW.
+  bool write_behind{false};
+
+  // True if the reads and writes of the source, target and COW devices should
+  // be counted in the PerformanceReport of the update.
+  bool instrument_file_io{false};
+
+  // True if the operations whose target blocks already hold the data of their
+  // dst_sha256_hash should be skipped instead of applied again. Set when the
+  // same payload is applied again from scratch, e.g. after a failed
+  // verification or postinstall, when most target blocks are already written.
+  // Only applies to the partitions written directly, not through a COW.
+  bool skip_written_operations{false};
+
   // If not blank, a base-64 encoded representation of the PEM-encoded
   // public key in the response.
   std::string public_key_rsa;
@@ -14,9 +14,14 @@
 // limitations under the License.
 //
 
+#include <vector>
+
 #include <gtest/gtest.h>
 
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
 
@@ -58,6 +63,27 @@ run_post_install: true
 is_rollback: false
 rollback_data_save_requested: false
 write_verity: true
+write_verity_during_apply: false
+reuse_source_verity: false
+verify_during_apply: false
+pipelined_apply: false
+apply_threads: 1
+concurrent_partitions: false
+verify_threads: 1
+verify_read_bandwidth: 0
+stream_replace_operations: false
+prepare_partitions_in_background: false
+download_connections: 1
+mirror_urls: ()
+peer_urls: ()
+split_payload_parts: ()
+download_buffer_size: 0
+prefetch_to_disk: false
+max_download_rate: 0
+direct_target_writes: false
+write_behind: false
+instrument_file_io: false
+skip_written_operations: false
 Partition: foo-partition_name
   source_size: 0
   source_path: foo-source-path
@@ -81,4 +107,92 @@ Payload: 0
   already_applied: false)");
 }
 
+TEST(InstallPlanTest, ParseUnusedExtentsTest) {
+  PartitionUpdate update;
+  *update.add_unused_extents() = ExtentForRange(10, 5);
+  *update.add_unused_extents() = ExtentForRange(20, 12);
+  update.set_new_partition_hash_without_unused("\x01\x02");
+  InstallPlan::Partition partition{
+      .name = "foo",
+      .target_size = 32 * 4096,
+      .target_hash = {0xb3, 0xb4},
+      .block_size = 4096,
+  };
+  partition.ParseUnusedExtents(update);
+  EXPECT_EQ(2u, partition.unused_extents.size());
+  EXPECT_EQ((brillo::Blob{0x01, 0x02}), partition.target_hash);
+
+  std::vector<Extent> used;
+  partition.AppendUsedExtents(ExtentForRange(0, 32), &used);
+  EXPECT_EQ((std::vector<Extent>{ExtentForRange(0, 10),
+                                 ExtentForRange(15, 5)}),
+            used);
+  used.clear();
+  partition.AppendUsedExtents(ExtentForRange(12, 2), &used);
+  EXPECT_TRUE(used.empty());
+}
+
+TEST(InstallPlanTest, IgnoresInvalidUnusedExtentsTest) {
+  PartitionUpdate update;
+  *update.add_unused_extents() = ExtentForRange(20, 12);
+  update.set_new_partition_hash_without_unused("\x01\x02");
+  InstallPlan::Partition partition{
+      .name = "foo",
+      .target_size = 32 * 4096,
+      .target_hash = {0xb3, 0xb4},
+      .block_size = 4096,
+      .hash_tree_offset = 24 * 4096,
+      .hash_tree_size = 4096,
+  };
+  partition.ParseUnusedExtents(update);
+  EXPECT_TRUE(partition.unused_extents.empty());
+  EXPECT_EQ((brillo::Blob{0xb3, 0xb4}), partition.target_hash);
+
+  // Past the end of the partition.
+  partition.hash_tree_size = 0;
+  *update.mutable_unused_extents(0) = ExtentForRange(20, 13);
+  partition.ParseUnusedExtents(update);
+  EXPECT_TRUE(partition.unused_extents.empty());
+
+  // Without an alternate hash.
+  *update.mutable_unused_extents(0) = ExtentForRange(20, 12);
+  update.clear_new_partition_hash_without_unused();
+  partition.ParseUnusedExtents(update);
+  EXPECT_TRUE(partition.unused_extents.empty());
+}
+
+TEST(InstallPlanTest, ParseUnchangedExtentsTest) {
+  PartitionUpdate update;
+  // Copied to the same blocks.
+  InstallOperation* op = update.add_operations();
+  op->set_type(InstallOperation::SOURCE_COPY);
+  *op->add_src_extents() = ExtentForRange(0, 10);
+  *op->add_dst_extents() = ExtentForRange(0, 10);
+  // Moved.
+  op = update.add_operations();
+  op->set_type(InstallOperation::SOURCE_COPY);
+  *op->add_src_extents() = ExtentForRange(10, 4);
+  *op->add_dst_extents() = ExtentForRange(12, 4);
+  // Copied to the same blocks, partly over the hash tree.
+  op = update.add_operations();
+  op->set_type(InstallOperation::SOURCE_COPY);
+  *op->add_src_extents() = ExtentForRange(20, 8);
+  *op->add_dst_extents() = ExtentForRange(20, 8);
+  // Written over the blocks of the first operation.
+  op = update.add_operations();
+  op->set_type(InstallOperation::REPLACE);
+  *op->add_dst_extents() = ExtentForRange(8, 1);
+  InstallPlan::Partition partition{
+      .name = "foo",
+      .block_size = 4096,
+      .hash_tree_offset = 24 * 4096,
+      .hash_tree_size = 8 * 4096,
+  };
+  partition.ParseUnchangedExtents(update);
+  EXPECT_EQ((std::vector<Extent>{ExtentForRange(0, 8),
+                                 ExtentForRange(9, 1),
+                                 ExtentForRange(20, 4)}),
+            partition.unchanged_extents);
+}
+
 }  // namespace chromeos_update_engine
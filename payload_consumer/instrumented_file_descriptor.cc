@@ -0,0 +1,136 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/instrumented_file_descriptor.h"
+
+#include <utility>
+
+namespace chromeos_update_engine {
+
+InstrumentedFileDescriptor::InstrumentedFileDescriptor(FileDescriptorPtr fd,
+                                                       std::string name)
+    : fd_(std::move(fd)), name_(std::move(name)) {}
+
+InstrumentedFileDescriptor::~InstrumentedFileDescriptor() {
+  Record();
+}
+
+bool InstrumentedFileDescriptor::Open(const char* path,
+                                      int flags,
+                                      mode_t mode) {
+  return fd_->Open(path, flags, mode);
+}
+
+bool InstrumentedFileDescriptor::Open(const char* path, int flags) {
+  return fd_->Open(path, flags);
+}
+
+ssize_t InstrumentedFileDescriptor::Read(void* buf, size_t count) {
+  const base::TimeTicks start = base::TimeTicks::Now();
+  const ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read >= 0)
+    AddRead(bytes_read, start);
+  return bytes_read;
+}
+
+ssize_t InstrumentedFileDescriptor::Write(const void* buf, size_t count) {
+  const base::TimeTicks start = base::TimeTicks::Now();
+  const ssize_t bytes_written = fd_->Write(buf, count);
+  if (bytes_written >= 0)
+    AddWrite(bytes_written, start);
+  return bytes_written;
+}
+
+bool InstrumentedFileDescriptor::ReadBatch(
+    const std::vector<ReadRequest>& requests) {
+  const base::TimeTicks start = base::TimeTicks::Now();
+  if (!fd_->ReadBatch(requests))
+    return false;
+  uint64_t bytes = 0;
+  for (const auto& request : requests)
+    bytes += request.count;
+  AddRead(bytes, start);
+  return true;
+}
+
+bool InstrumentedFileDescriptor::WriteBatch(
+    const std::vector<WriteRequest>& requests) {
+  const base::TimeTicks start = base::TimeTicks::Now();
+  if (!fd_->WriteBatch(requests))
+    return false;
+  uint64_t bytes = 0;
+  for (const auto& request : requests)
+    bytes += request.count;
+  AddWrite(bytes, start);
+  return true;
+}
+
+bool InstrumentedFileDescriptor::CopyFrom(FileDescriptor* source,
+                                          uint64_t src_offset,
+                                          uint64_t dst_offset,
+                                          size_t count) {
+  const base::TimeTicks start = base::TimeTicks::Now();
+  if (!fd_->CopyFrom(source, src_offset, dst_offset, count))
+    return false;
+  AddWrite(count, start);
+  return true;
+}
+
+bool InstrumentedFileDescriptor::CopyTo(EintrSafeFileDescriptor* target,
+                                        uint64_t src_offset,
+                                        uint64_t dst_offset,
+                                        size_t count) {
+  const base::TimeTicks start = base::TimeTicks::Now();
+  if (!fd_->CopyTo(target, src_offset, dst_offset, count))
+    return false;
+  AddRead(count, start);
+  return true;
+}
+
+bool InstrumentedFileDescriptor::Close() {
+  const bool success = fd_->Close();
+  Record();
+  return success;
+}
+
+PerformanceReport::FileIo InstrumentedFileDescriptor::io() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return io_;
+}
+
+void InstrumentedFileDescriptor::AddRead(uint64_t bytes,
+                                         base::TimeTicks start) {
+  const base::TimeDelta latency = base::TimeTicks::Now() - start;
+  std::lock_guard<std::mutex> lock(mutex_);
+  io_.AddRead(bytes, latency);
+}
+
+void InstrumentedFileDescriptor::AddWrite(uint64_t bytes,
+                                          base::TimeTicks start) {
+  const base::TimeDelta latency = base::TimeTicks::Now() - start;
+  std::lock_guard<std::mutex> lock(mutex_);
+  io_.AddWrite(bytes, latency);
+}
+
+void InstrumentedFileDescriptor::Record() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (io_.reads == 0 && io_.writes == 0)
+    return;
+  PerformanceRecorder::Get()->AddFileIo(name_, io_);
+  io_ = PerformanceReport::FileIo();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,101 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTRUMENTED_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTRUMENTED_FILE_DESCRIPTOR_H_
+
+#include <sys/types.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "update_engine/common/performance_recorder.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// Counts the reads and writes through |fd|, their size and latency, and adds
+// them to the PerformanceReport::file_io of |name| when closed or destroyed.
+// Wrapping the descriptor closest to the device shows the I/O it actually
+// gets, wrapping the outermost one the I/O its users ask for. It can be used
+// from several threads at once if |fd| can.
+class InstrumentedFileDescriptor : public FileDescriptor {
+ public:
+  InstrumentedFileDescriptor(FileDescriptorPtr fd, std::string name);
+  ~InstrumentedFileDescriptor() override;
+
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override {
+    return fd_->Seek(offset, whence);
+  }
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override;
+  bool WriteBatch(const std::vector<WriteRequest>& requests) override;
+  // A copy counts as a write of the target and a read of the source, each
+  // by the instance wrapping it.
+  bool CopyFrom(FileDescriptor* source,
+                uint64_t src_offset,
+                uint64_t dst_offset,
+                size_t count) override;
+  bool CopyTo(EintrSafeFileDescriptor* target,
+              uint64_t src_offset,
+              uint64_t dst_offset,
+              size_t count) override;
+  // The pages mapped are read later, so they aren't counted.
+  bool MapReadOnly(uint64_t offset,
+                   size_t size,
+                   base::MemoryMappedFile* mapping) override {
+    return fd_->MapReadOnly(offset, size, mapping);
+  }
+  bool Readahead(uint64_t offset, uint64_t count) override {
+    return fd_->Readahead(offset, count);
+  }
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return fd_->BlkIoctl(request, start, length, result);
+  }
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override;
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+  // The I/O counted since opened, not yet added to the report.
+  PerformanceReport::FileIo io();
+
+ private:
+  void AddRead(uint64_t bytes, base::TimeTicks start);
+  void AddWrite(uint64_t bytes, base::TimeTicks start);
+  // Adds |io_| to the report and starts counting again.
+  void Record();
+
+  FileDescriptorPtr fd_;
+  const std::string name_;
+
+  std::mutex mutex_;
+  PerformanceReport::FileIo io_;
+
+  DISALLOW_COPY_AND_ASSIGN(InstrumentedFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTRUMENTED_FILE_DESCRIPTOR_H_
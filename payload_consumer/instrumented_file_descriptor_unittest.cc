@@ -0,0 +1,95 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/instrumented_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kFileSize = 8192;
+}  // namespace
+
+class InstrumentedFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    PerformanceRecorder::Get()->TakeReport();
+    ASSERT_TRUE(test_utils::WriteFileString(temp_file_.path(),
+                                            string(kFileSize, '.')));
+    EXPECT_TRUE(fd_.Open(temp_file_.path().c_str(), O_RDWR));
+  }
+  void TearDown() override { PerformanceRecorder::Get()->TakeReport(); }
+
+  ScopedTempFile temp_file_{"InstrumentedFileDescriptorTest-XXXXXX"};
+  InstrumentedFileDescriptor fd_{std::make_shared<EintrSafeFileDescriptor>(),
+                                 "system/target"};
+};
+
+TEST_F(InstrumentedFileDescriptorTest, CountsReadsAndWritesTest) {
+  char buffer[4096];
+  EXPECT_EQ(100, fd_.Read(buffer, 100));
+  EXPECT_EQ(4096, fd_.Write(buffer, 4096));
+  EXPECT_TRUE(fd_.ReadBatch({{0, buffer, 1000}, {5000, buffer + 1000, 1000}}));
+
+  PerformanceReport::FileIo io = fd_.io();
+  EXPECT_EQ(2u, io.reads);
+  EXPECT_EQ(2100u, io.bytes_read);
+  EXPECT_EQ(1u, io.writes);
+  EXPECT_EQ(4096u, io.bytes_written);
+  // 100 bytes, 2000 bytes and 4096 bytes.
+  EXPECT_EQ(1u, io.size_histogram[0]);
+  EXPECT_EQ(1u, io.size_histogram[2]);
+  EXPECT_EQ(1u, io.size_histogram[3]);
+  EXPECT_GT(io.LatencyPercentile(100), base::TimeDelta());
+
+  // Nothing is reported before the descriptor is closed.
+  EXPECT_TRUE(PerformanceRecorder::Get()->TakeReport().file_io.empty());
+  EXPECT_TRUE(fd_.Close());
+  PerformanceReport report = PerformanceRecorder::Get()->TakeReport();
+  ASSERT_EQ(1u, report.file_io.count("system/target"));
+  EXPECT_EQ(2u, report.file_io["system/target"].reads);
+  EXPECT_EQ(0u, fd_.io().reads);
+}
+
+TEST_F(InstrumentedFileDescriptorTest, FailedReadsArentCountedTest) {
+  char buffer[100];
+  EXPECT_FALSE(fd_.ReadBatch({{kFileSize, buffer, sizeof(buffer)}}));
+  EXPECT_EQ(0u, fd_.io().reads);
+}
+
+TEST(FileIoTest, LatencyPercentileTest) {
+  PerformanceReport::FileIo io;
+  EXPECT_EQ(base::TimeDelta(), io.LatencyPercentile(50));
+  for (int i = 0; i < 9; i++)
+    io.AddRead(4096, base::TimeDelta::FromMicroseconds(10));
+  io.AddWrite(4096, base::TimeDelta::FromMilliseconds(1));
+  EXPECT_EQ(base::TimeDelta::FromMicroseconds(16), io.LatencyPercentile(50));
+  EXPECT_EQ(base::TimeDelta::FromMicroseconds(16), io.LatencyPercentile(90));
+  EXPECT_EQ(base::TimeDelta::FromMicroseconds(1024), io.LatencyPercentile(99));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,388 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/read_planner.h"
+
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#define UE_HAVE_IO_URING 1
+#endif
+
+namespace chromeos_update_engine {
+
+namespace {
+// Whether we already logged that io_uring is not available.
+std::atomic<bool> io_uring_unavailable_logged{false};
+}  // namespace
+
+#ifdef UE_HAVE_IO_URING
+
+// The submission and completion queues of an io_uring instance, mapped from
+// the kernel. Only used from one thread at a time.
+class IoUringFileDescriptor::Ring {
+ public:
+  // Returns null and sets errno if io_uring can't be set up.
+  static std::unique_ptr<Ring> Create(unsigned entries) {
+    io_uring_params params{};
+    int ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0) {
+      return nullptr;
+    }
+    std::unique_ptr<Ring> ring(new Ring(ring_fd, params));
+    if (!ring->Map()) {
+      return nullptr;
+    }
+    return ring;
+  }
+
+  ~Ring() {
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, params_.sq_entries * sizeof(io_uring_sqe));
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+    close(ring_fd_);
+  }
+
+  // Performs all the |reads| on |fd|. Returns false if any of them fails.
+  bool Read(int fd, std::vector<CoalescedRead>* reads) {
+    return Submit(IORING_OP_READV, fd, reads);
+  }
+
+  // Performs all the |writes| planned by PlanWrites() on |fd|. Returns false
+  // if any of them fails.
+  bool Write(int fd, std::vector<CoalescedRead>* writes) {
+    return Submit(IORING_OP_WRITEV, fd, writes);
+  }
+
+  // Returns true once the ring can't be used anymore, because the kernel
+  // rejected a submission.
+  bool broken() const { return broken_; }
+
+ private:
+  Ring(int ring_fd, const io_uring_params& params)
+      : ring_fd_(ring_fd), params_(params) {}
+
+  // Performs all the |reads|, vectored reads or writes depending on |opcode|,
+  // on |fd|. Returns false if any of them fails.
+  bool Submit(uint8_t opcode, int fd, std::vector<CoalescedRead>* reads) {
+    const char* verb = opcode == IORING_OP_READV ? "read" : "write";
+    // Requests which were done partially and have to be submitted again.
+    std::deque<size_t> pending;
+    size_t next_read = 0;
+    size_t in_flight = 0;
+    unsigned to_submit = 0;
+    bool failed = false;
+
+    const unsigned max_in_flight =
+        std::min(params_.sq_entries, params_.cq_entries);
+    while (true) {
+      while (!failed && in_flight < max_in_flight &&
+             (!pending.empty() || next_read < reads->size())) {
+        size_t index;
+        if (!pending.empty()) {
+          index = pending.front();
+          pending.pop_front();
+        } else {
+          index = next_read++;
+        }
+        const auto& read = (*reads)[index];
+        Queue(opcode, fd, read.iov(), read.iovcnt(), read.offset, index);
+        in_flight++;
+        to_submit++;
+      }
+      if (in_flight == 0) {
+        break;
+      }
+
+      int ret = syscall(__NR_io_uring_enter,
+                        ring_fd_,
+                        to_submit,
+                        1,
+                        IORING_ENTER_GETEVENTS,
+                        nullptr,
+                        0);
+      if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+          // Whatever was consumed before the error is in flight already.
+          to_submit = PendingSubmissions();
+          continue;
+        }
+        PLOG(ERROR) << "io_uring_enter() failed";
+        // The kernel may still write to the buffers of the requests it
+        // consumed, so wait for them before giving up on this ring.
+        in_flight -= PendingSubmissions();
+        while (in_flight > 0) {
+          usleep(1000);
+          in_flight -= ReapCompletions([](const io_uring_cqe&) {});
+        }
+        broken_ = true;
+        return false;
+      }
+      to_submit -= ret;
+
+      in_flight -= ReapCompletions([&](const io_uring_cqe& cqe) {
+        const size_t index = cqe.user_data;
+        auto& read = (*reads)[index];
+        if (cqe.res < 0) {
+          errno = -cqe.res;
+          PLOG(ERROR) << "Failed to " << verb << " " << read.count
+                      << " bytes at offset " << read.offset;
+          failed = true;
+        } else if (cqe.res == 0) {
+          LOG(ERROR) << "Unable to " << verb << " past offset " << read.offset;
+          failed = true;
+        } else {
+          read.Advance(cqe.res);
+          if (read.count > 0) {
+            pending.push_back(index);
+          }
+        }
+      });
+    }
+    return !failed;
+  }
+
+  bool Map() {
+    sq_ring_size_ = params_.sq_off.array + params_.sq_entries * sizeof(__u32);
+    cq_ring_size_ =
+        params_.cq_off.cqes + params_.cq_entries * sizeof(io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+    const bool single_mmap = params_.features & IORING_FEAT_SINGLE_MMAP;
+#else
+    const bool single_mmap = false;
+#endif
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = mmap(nullptr,
+                    sq_ring_size_,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    ring_fd_,
+                    IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      return false;
+    }
+    cq_ring_ = single_mmap ? sq_ring_
+                           : mmap(nullptr,
+                                  cq_ring_size_,
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE,
+                                  ring_fd_,
+                                  IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      return false;
+    }
+    sqes_ = mmap(nullptr,
+                 params_.sq_entries * sizeof(io_uring_sqe),
+                 PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE,
+                 ring_fd_,
+                 IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+      return false;
+    }
+
+    auto sq = static_cast<uint8_t*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.array);
+    auto cq = static_cast<uint8_t*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params_.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params_.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params_.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params_.cq_off.cqes);
+    return true;
+  }
+
+  void Queue(uint8_t opcode,
+             int fd,
+             const iovec* iov,
+             unsigned iovcnt,
+             uint64_t offset,
+             uint64_t data) {
+    const unsigned tail = *sq_tail_;
+    const unsigned index = tail & *sq_mask_;
+    io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes_) + index;
+    *sqe = {};
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(iov);
+    sqe->len = iovcnt;
+    sqe->off = offset;
+    sqe->user_data = data;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  // Calls |handle_completion| for every completion available and consumes
+  // them. Returns the number of completions.
+  template <typename Callback>
+  unsigned ReapCompletions(Callback handle_completion) {
+    unsigned head = *cq_head_;
+    const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    const unsigned count = tail - head;
+    for (; head != tail; head++) {
+      handle_completion(cqes_[head & *cq_mask_]);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return count;
+  }
+
+  // Returns the number of queued entries the kernel didn't consume yet.
+  unsigned PendingSubmissions() const {
+    return *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  }
+
+  const int ring_fd_;
+  const io_uring_params params_;
+  bool broken_{false};
+
+  void* sq_ring_{MAP_FAILED};
+  size_t sq_ring_size_{0};
+  void* cq_ring_{MAP_FAILED};
+  size_t cq_ring_size_{0};
+  void* sqes_{MAP_FAILED};
+
+  unsigned* sq_head_{nullptr};
+  unsigned* sq_tail_{nullptr};
+  unsigned* sq_mask_{nullptr};
+  unsigned* sq_array_{nullptr};
+  unsigned* cq_head_{nullptr};
+  unsigned* cq_tail_{nullptr};
+  unsigned* cq_mask_{nullptr};
+  io_uring_cqe* cqes_{nullptr};
+
+  DISALLOW_COPY_AND_ASSIGN(Ring);
+};
+
+#else  // !UE_HAVE_IO_URING
+
+class IoUringFileDescriptor::Ring {
+ public:
+  static std::unique_ptr<Ring> Create(unsigned entries) {
+    errno = ENOSYS;
+    return nullptr;
+  }
+
+  bool Read(int fd, std::vector<CoalescedRead>* reads) { return false; }
+  bool Write(int fd, std::vector<CoalescedRead>* writes) { return false; }
+
+  bool broken() const { return true; }
+};
+
+#endif  // UE_HAVE_IO_URING
+
+IoUringFileDescriptor::IoUringFileDescriptor(unsigned queue_depth)
+    : queue_depth_(std::max(queue_depth, 1u)) {}
+
+IoUringFileDescriptor::~IoUringFileDescriptor() {
+  ring_.reset();
+}
+
+bool IoUringFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  if (!EintrSafeFileDescriptor::Open(path, flags, mode)) {
+    return false;
+  }
+  SetupRing();
+  return true;
+}
+
+bool IoUringFileDescriptor::Open(const char* path, int flags) {
+  if (!EintrSafeFileDescriptor::Open(path, flags)) {
+    return false;
+  }
+  SetupRing();
+  return true;
+}
+
+void IoUringFileDescriptor::SetupRing() {
+  ring_ = Ring::Create(queue_depth_);
+  if (!ring_ && !io_uring_unavailable_logged.exchange(true)) {
+    PLOG(INFO) << "io_uring is not available, using preadv()";
+  }
+}
+
+bool IoUringFileDescriptor::ReadBatch(
+    const std::vector<ReadRequest>& requests) {
+  CHECK_GE(fd_, 0);
+  if (!ring_) {
+    return EintrSafeFileDescriptor::ReadBatch(requests);
+  }
+  std::vector<CoalescedRead> reads = PlanReads(requests);
+  if (ring_->Read(fd_, &reads)) {
+    return true;
+  }
+  if (ring_->broken()) {
+    LOG(WARNING) << "Falling back to reading without io_uring";
+    ring_.reset();
+    return EintrSafeFileDescriptor::ReadBatch(requests);
+  }
+  // Reading the holes between the requests might be what failed, see
+  // EintrSafeFileDescriptor::ReadBatch().
+  if (std::any_of(reads.begin(), reads.end(), [](const CoalescedRead& read) {
+        return read.gap_bytes > 0;
+      })) {
+    return FileDescriptor::ReadBatch(requests);
+  }
+  return false;
+}
+
+bool IoUringFileDescriptor::WriteBatch(
+    const std::vector<WriteRequest>& requests) {
+  CHECK_GE(fd_, 0);
+  if (!ring_) {
+    return EintrSafeFileDescriptor::WriteBatch(requests);
+  }
+  std::vector<CoalescedRead> writes = PlanWrites(requests);
+  if (ring_->Write(fd_, &writes)) {
+    return true;
+  }
+  if (ring_->broken()) {
+    // The writes done before the ring broke are simply done again.
+    LOG(WARNING) << "Falling back to writing without io_uring";
+    ring_.reset();
+    return EintrSafeFileDescriptor::WriteBatch(requests);
+  }
+  return false;
+}
+
+bool IoUringFileDescriptor::Close() {
+  ring_.reset();
+  return EintrSafeFileDescriptor::Close();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,65 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+
+#include <memory>
+#include <vector>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// An EintrSafeFileDescriptor which submits the reads planned by ReadBatch()
+// and the writes of WriteBatch() through an io_uring instance, keeping up to
+// |queue_depth| of them in flight at once. All the other operations use the
+// regular system calls. When io_uring isn't available (old kernel, seccomp or
+// SELinux policy), they fall back to EintrSafeFileDescriptor's preadv() and
+// pwritev() loops.
+class IoUringFileDescriptor : public EintrSafeFileDescriptor {
+ public:
+  static constexpr unsigned kDefaultQueueDepth = 64;
+
+  explicit IoUringFileDescriptor(unsigned queue_depth = kDefaultQueueDepth);
+  ~IoUringFileDescriptor() override;
+
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override;
+  bool WriteBatch(const std::vector<WriteRequest>& requests) override;
+  bool Close() override;
+
+  // Returns whether ReadBatch() and WriteBatch() go through io_uring for the
+  // file currently open.
+  bool UsesIoUring() const { return ring_ != nullptr; }
+
+ private:
+  class Ring;
+
+  // Sets up |ring_| after the file is opened, leaving it null if io_uring is
+  // not supported.
+  void SetupRing();
+
+  const unsigned queue_depth_;
+  std::unique_ptr<Ring> ring_;
+
+  DISALLOW_COPY_AND_ASSIGN(IoUringFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
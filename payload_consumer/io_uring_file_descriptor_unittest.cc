@@ -0,0 +1,128 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kNumBlocks = 64;
+}  // namespace
+
+class IoUringFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    data_.resize(kBlockSize * kNumBlocks);
+    for (size_t i = 0; i < data_.size(); i++) {
+      data_[i] = static_cast<uint8_t>(i * 7 + i / kBlockSize);
+    }
+    ASSERT_TRUE(
+        utils::WriteFile(file_.path().c_str(), data_.data(), data_.size()));
+    ASSERT_TRUE(fd_.Open(file_.path().c_str(), O_RDONLY));
+  }
+
+  ScopedTempFile file_{"io_uring_fd.XXXXXX"};
+  brillo::Blob data_;
+  IoUringFileDescriptor fd_{4};
+};
+
+TEST_F(IoUringFileDescriptorTest, ReadBatchOutOfOrderTest) {
+  // More requests than the queue depth, in reverse block order.
+  brillo::Blob buffer(data_.size());
+  std::vector<FileDescriptor::ReadRequest> requests;
+  for (size_t i = kNumBlocks; i > 0; i--) {
+    const size_t offset = (i - 1) * kBlockSize;
+    requests.push_back({offset, buffer.data() + offset, kBlockSize});
+  }
+  ASSERT_TRUE(fd_.ReadBatch(requests));
+  ASSERT_EQ(data_, buffer);
+  // The file offset isn't moved by ReadBatch().
+  ASSERT_EQ(0, fd_.Seek(0, SEEK_CUR));
+}
+
+TEST_F(IoUringFileDescriptorTest, ReadBatchUnalignedTest) {
+  brillo::Blob buffer(3 * kBlockSize);
+  std::vector<FileDescriptor::ReadRequest> requests{
+      {10 * kBlockSize + 17, buffer.data(), 2 * kBlockSize},
+      {1, buffer.data() + 2 * kBlockSize, kBlockSize}};
+  ASSERT_TRUE(fd_.ReadBatch(requests));
+  ASSERT_TRUE(std::equal(buffer.begin(),
+                         buffer.begin() + 2 * kBlockSize,
+                         data_.begin() + 10 * kBlockSize + 17));
+  ASSERT_TRUE(std::equal(buffer.begin() + 2 * kBlockSize,
+                         buffer.end(),
+                         data_.begin() + 1));
+}
+
+TEST_F(IoUringFileDescriptorTest, ReadBatchPastEndOfFileTest) {
+  brillo::Blob buffer(2 * kBlockSize);
+  std::vector<FileDescriptor::ReadRequest> requests{
+      {(kNumBlocks - 1) * kBlockSize, buffer.data(), 2 * kBlockSize}};
+  ASSERT_FALSE(fd_.ReadBatch(requests));
+
+  // A failed batch doesn't prevent later reads.
+  requests = {{0, buffer.data(), kBlockSize}};
+  ASSERT_TRUE(fd_.ReadBatch(requests));
+  ASSERT_TRUE(
+      std::equal(buffer.begin(), buffer.begin() + kBlockSize, data_.begin()));
+}
+
+TEST_F(IoUringFileDescriptorTest, WriteBatchTest) {
+  IoUringFileDescriptor fd{4};
+  ASSERT_TRUE(fd.Open(file_.path().c_str(), O_RDWR));
+  // More requests than the queue depth, one block out of two, in reverse
+  // order.
+  brillo::Blob buffer(data_.size(), 0xa5);
+  std::vector<FileDescriptor::WriteRequest> requests;
+  for (size_t i = kNumBlocks; i > 0; i -= 2) {
+    const size_t offset = (i - 1) * kBlockSize;
+    requests.push_back({offset, buffer.data() + offset, kBlockSize});
+    std::fill_n(data_.begin() + offset, kBlockSize, 0xa5);
+  }
+  ASSERT_TRUE(fd.WriteBatch(requests));
+  // The file offset isn't moved by WriteBatch().
+  ASSERT_EQ(0, fd.Seek(0, SEEK_CUR));
+  ASSERT_TRUE(fd.Close());
+
+  brillo::Blob written;
+  ASSERT_TRUE(utils::ReadFile(file_.path(), &written));
+  ASSERT_EQ(data_, written);
+}
+
+TEST_F(IoUringFileDescriptorTest, ReadBatchAfterReopenTest) {
+  ASSERT_TRUE(fd_.Close());
+  ASSERT_FALSE(fd_.UsesIoUring());
+  ASSERT_TRUE(fd_.Open(file_.path().c_str(), O_RDONLY));
+  brillo::Blob buffer(kBlockSize);
+  std::vector<FileDescriptor::ReadRequest> requests{
+      {5 * kBlockSize, buffer.data(), kBlockSize}};
+  ASSERT_TRUE(fd_.ReadBatch(requests));
+  ASSERT_TRUE(
+      std::equal(buffer.begin(), buffer.end(), data_.begin() + 5 * kBlockSize));
+}
+
+}  // namespace chromeos_update_engine
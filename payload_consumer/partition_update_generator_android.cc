@@ -16,8 +16,12 @@
 
 #include "update_engine/payload_consumer/partition_update_generator_android.h"
 
+#include <algorithm>
 #include <filesystem>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <tuple>
 #include <utility>
 
 #include <android-base/properties.h>
@@ -28,9 +32,29 @@
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// The most partitions hashed at the same time. They are on different block
+// devices, which are read faster together than one after the other.
+constexpr size_t kMaxHashThreads = 4;
+
+// The hashes of the source partitions computed so far, by build fingerprint,
+// device and size. The source slot is the running one, so its partitions
+// don't change for the lifetime of the process: the hashes are reused by the
+// next partial updates instead of reading the whole partitions again.
+using SourceHashKey = std::tuple<std::string, std::string, int64_t>;
+std::mutex source_hashes_mutex;
+std::map<SourceHashKey, brillo::Blob>& SourceHashes() {
+  static std::map<SourceHashKey, brillo::Blob> source_hashes;
+  return source_hashes;
+}
+
+}  // namespace
+
 PartitionUpdateGeneratorAndroid::PartitionUpdateGeneratorAndroid(
     BootControlInterface* boot_control, size_t block_size)
     : boot_control_(boot_control), block_size_(block_size) {}
@@ -52,7 +76,14 @@ bool PartitionUpdateGeneratorAndroid::
     return false;
   }
 
-  std::vector<PartitionUpdate> partition_updates;
+  // The partitions to copy, whose updates are created below.
+  struct PartitionToCopy {
+    std::string name;
+    std::string source_device;
+    std::string target_device;
+    int64_t size;
+  };
+  std::vector<PartitionToCopy> partitions_to_copy;
   for (const auto& partition_name : ab_partitions) {
     if (partitions_in_payload.find(partition_name) !=
         partitions_in_payload.end()) {
@@ -95,13 +126,39 @@ bool PartitionUpdateGeneratorAndroid::
       return false;
     }
 
-    auto partition_update = CreatePartitionUpdate(
-        partition_name, source_device, target_device, source_size);
-    if (!partition_update.has_value()) {
-      LOG(ERROR) << "Failed to create partition update for " << partition_name;
+    partitions_to_copy.push_back(
+        {partition_name, source_device, target_device, source_size});
+  }
+
+  // Each update hashes its whole source partition, so they are created in
+  // parallel.
+  std::vector<std::optional<PartitionUpdate>> created(
+      partitions_to_copy.size());
+  {
+    const size_t num_threads = std::max<size_t>(
+        std::min(partitions_to_copy.size(), kMaxHashThreads), 1);
+    WorkerPool pool(num_threads, partitions_to_copy.size());
+    for (size_t i = 0; i < partitions_to_copy.size(); i++) {
+      pool.Post([this, &partitions_to_copy, &created, i] {
+        const PartitionToCopy& partition = partitions_to_copy[i];
+        created[i] = CreatePartitionUpdate(partition.name,
+                                           partition.source_device,
+                                           partition.target_device,
+                                           partition.size);
+        return true;
+      });
+    }
+    pool.Wait();
+  }
+
+  std::vector<PartitionUpdate> partition_updates;
+  for (size_t i = 0; i < created.size(); i++) {
+    if (!created[i].has_value()) {
+      LOG(ERROR) << "Failed to create partition update for "
+                 << partitions_to_copy[i].name;
       return false;
     }
-    partition_updates.push_back(partition_update.value());
+    partition_updates.push_back(std::move(created[i].value()));
   }
   *update_list = std::move(partition_updates);
   return true;
@@ -160,6 +217,19 @@ PartitionUpdateGeneratorAndroid::CalculateHashForPartition(
   // An alternative way is to verify the written bytes match the read bytes
   // during filesystem verification. This could probably save us a read of
   // partitions here.
+  const SourceHashKey key{
+      android::base::GetProperty("ro.build.fingerprint", ""),
+      block_device,
+      partition_size};
+  {
+    std::lock_guard<std::mutex> lock(source_hashes_mutex);
+    auto it = SourceHashes().find(key);
+    if (it != SourceHashes().end()) {
+      LOG(INFO) << "Reusing the hash of " << block_device;
+      return it->second;
+    }
+  }
+
   brillo::Blob raw_hash;
   if (HashCalculator::RawHashOfFile(block_device, partition_size, &raw_hash) !=
       partition_size) {
@@ -167,6 +237,8 @@ PartitionUpdateGeneratorAndroid::CalculateHashForPartition(
     return std::nullopt;
   }
 
+  std::lock_guard<std::mutex> lock(source_hashes_mutex);
+  SourceHashes()[key] = raw_hash;
   return raw_hash;
 }
 
@@ -156,4 +156,28 @@ TEST_F(PartitionUpdateGeneratorAndroidTest, GenerateOperations) {
   CheckPartitionUpdate("system", system_contents, update_list[1]);
 }
 
+TEST_F(PartitionUpdateGeneratorAndroidTest, ReusesSourceHashes) {
+  auto system_contents = std::string(4096 * 3, 's');
+  SetUpBlockDevice({
+      {"system_a", system_contents},
+      {"system_b", std::string(4096 * 3, 0)},
+  });
+
+  std::vector<PartitionUpdate> update_list;
+  ASSERT_TRUE(generator_->GenerateOperationsForPartitionsNotInPayload(
+      0, 1, {}, &update_list));
+  ASSERT_EQ(1u, update_list.size());
+  CheckPartitionUpdate("system", system_contents, update_list[0]);
+
+  // The source partition isn't read again by the next update.
+  auto other_contents = std::string(4096 * 3, 'o');
+  ASSERT_TRUE(utils::WriteFile(device_map_["system_a"].c_str(),
+                               other_contents.data(),
+                               other_contents.size()));
+  ASSERT_TRUE(generator_->GenerateOperationsForPartitionsNotInPayload(
+      0, 1, {}, &update_list));
+  ASSERT_EQ(1u, update_list.size());
+  CheckPartitionUpdate("system", system_contents, update_list[0]);
+}
+
 }  // namespace chromeos_update_engine
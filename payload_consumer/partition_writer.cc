@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <linux/fs.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <inttypes.h>
 
@@ -35,21 +36,30 @@
 #include "update_engine/common/terminator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/bzip_extent_writer.h"
-#include "update_engine/payload_consumer/cached_file_descriptor.h"
+#include "update_engine/payload_consumer/direct_write_file_descriptor.h"
 #include "update_engine/payload_consumer/extent_reader.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/gathering_file_descriptor.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/instrumented_file_descriptor.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
 #include "update_engine/payload_consumer/mount_history.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/streaming_verity_writer.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 
 namespace chromeos_update_engine {
 
 namespace {
-constexpr uint64_t kCacheSize = 1024 * 1024;  // 1MB
+// The most bytes of writes to the target partition kept in memory, to be
+// written sorted and merged.
+constexpr uint64_t kCacheSize = 4 * 1024 * 1024;
+// The most blocks of consecutive SOURCE_COPY operations merged into one copy.
+constexpr uint64_t kMaxPendingCopyBlocks = 16384;
 
 // Discard the tail of the block device referenced by |fd|, from the offset
 // |data_size| until the end of the block device. Returns whether the data was
@@ -84,23 +94,101 @@ bool DiscardPartitionTail(const FileDescriptorPtr& fd, uint64_t data_size) {
   return false;
 }
 
+// Returns whether |path1| and |path2| are the same file or block device.
+bool IsSameFile(const std::string& path1, const std::string& path2) {
+  struct stat stat1, stat2;
+  if (stat(path1.c_str(), &stat1) != 0 || stat(path2.c_str(), &stat2) != 0)
+    return false;
+  if (S_ISBLK(stat1.st_mode) && S_ISBLK(stat2.st_mode))
+    return stat1.st_rdev == stat2.st_rdev;
+  return stat1.st_dev == stat2.st_dev && stat1.st_ino == stat2.st_ino;
+}
+
+// Appends |extents| to |out|, merging the ones contiguous with the last one.
+template <typename Extents>
+void AppendMergedExtents(const Extents& extents,
+                         google::protobuf::RepeatedPtrField<Extent>* out) {
+  for (const Extent& extent : extents) {
+    if (!out->empty()) {
+      Extent* last = out->Mutable(out->size() - 1);
+      if (last->start_block() + last->num_blocks() == extent.start_block()) {
+        last->set_num_blocks(last->num_blocks() + extent.num_blocks());
+        continue;
+      }
+    }
+    *out->Add() = extent;
+  }
+}
+
+// Returns the blocks that |operation| copies to themselves. The ones it
+// copies elsewhere are added to the extents of |remaining|, if not null.
+std::vector<Extent> SplitIdenticalBlocks(const InstallOperation& operation,
+                                         InstallOperation* remaining) {
+  std::vector<Extent> identical;
+  auto src = operation.src_extents().begin();
+  auto dst = operation.dst_extents().begin();
+  uint64_t src_offset = 0, dst_offset = 0;
+  while (src != operation.src_extents().end() &&
+         dst != operation.dst_extents().end()) {
+    const uint64_t num_blocks = std::min(src->num_blocks() - src_offset,
+                                         dst->num_blocks() - dst_offset);
+    const uint64_t src_block = src->start_block() + src_offset;
+    const uint64_t dst_block = dst->start_block() + dst_offset;
+    if (src_block == dst_block) {
+      identical.push_back(ExtentForRange(src_block, num_blocks));
+    } else if (remaining) {
+      *remaining->add_src_extents() = ExtentForRange(src_block, num_blocks);
+      *remaining->add_dst_extents() = ExtentForRange(dst_block, num_blocks);
+    }
+    src_offset += num_blocks;
+    dst_offset += num_blocks;
+    if (src_offset == src->num_blocks()) {
+      ++src;
+      src_offset = 0;
+    }
+    if (dst_offset == dst->num_blocks()) {
+      ++dst;
+      dst_offset = 0;
+    }
+  }
+  return identical;
+}
+
 }  // namespace
 
 // Opens path for read/write. On success returns an open FileDescriptor
 // and sets *err to 0. On failure, sets *err to errno and returns nullptr.
+// The aligned writes bypass the page cache if |direct_writes|. The cached
+// writes are written in the background if |write_behind|. The I/O of the file
+// is counted as |io_name|, unless empty.
 FileDescriptorPtr OpenFile(const char* path,
                            int mode,
                            bool cache_writes,
+                           bool write_behind,
+                           bool direct_writes,
+                           const std::string& io_name,
                            int* err) {
   // Try to mark the block device read-only based on the mode. Ignore any
   // failure since this won't work when passing regular files.
   bool read_only = (mode & O_ACCMODE) == O_RDONLY;
   utils::SetBlockDeviceReadOnly(path, read_only);
 
-  FileDescriptorPtr fd(new EintrSafeFileDescriptor());
+  // The writes gathered are written with WriteBatch(), which io_uring keeps
+  // in flight together.
+  FileDescriptorPtr fd;
+  if (direct_writes && !read_only)
+    fd = std::make_shared<DirectWriteFileDescriptor>();
+  else if (cache_writes && !read_only)
+    fd = std::make_shared<IoUringFileDescriptor>();
+  else
+    fd = std::make_shared<EintrSafeFileDescriptor>();
+  if (!io_name.empty())
+    fd = std::make_shared<InstrumentedFileDescriptor>(fd, io_name);
   if (cache_writes && !read_only) {
-    fd = FileDescriptorPtr(new CachedFileDescriptor(fd, kCacheSize));
-    LOG(INFO) << "Caching writes.";
+    fd = std::make_shared<GatheringFileDescriptor>(
+        fd, kCacheSize, write_behind);
+    LOG(INFO) << "Gathering writes"
+              << (write_behind ? ", written behind." : ".");
   }
   if (!fd->Open(path, mode, 000)) {
     *err = errno;
@@ -130,14 +218,16 @@ PartitionWriter::~PartitionWriter() {
 }
 
 bool PartitionWriter::OpenSourcePartition(uint32_t source_slot,
-                                          bool source_may_exist) {
+                                          bool source_may_exist,
+                                          bool instrument_io) {
   source_path_.clear();
   if (!source_may_exist) {
     return true;
   }
   if (install_part_.source_size > 0 && !install_part_.source_path.empty()) {
     source_path_ = install_part_.source_path;
-    if (!verified_source_fd_.Open()) {
+    if (!verified_source_fd_.Open(
+            instrument_io ? install_part_.name + "/source" : "")) {
       LOG(ERROR) << "Unable to open source partition " << install_part_.name
                  << " on slot " << BootControlInterface::SlotName(source_slot)
                  << ", file " << source_path_;
@@ -153,7 +243,8 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
   const PartitionUpdate& partition = partition_update_;
   uint32_t source_slot = install_plan->source_slot;
   uint32_t target_slot = install_plan->target_slot;
-  TEST_AND_RETURN_FALSE(OpenSourcePartition(source_slot, source_may_exist));
+  TEST_AND_RETURN_FALSE(OpenSourcePartition(
+      source_slot, source_may_exist, install_plan->instrument_file_io));
 
   // We shouldn't open the source partition in certain cases, e.g. some dynamic
   // partitions in delta payload, partitions included in the full payload for
@@ -169,7 +260,23 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
   LOG(INFO) << "Opening " << target_path_ << " partition with"
             << (interactive_ ? "out" : "") << " O_DSYNC";
 
-  target_fd_ = OpenFile(target_path_.c_str(), flags, true, &err);
+  // The writes are reported to |verity_writer_| when they leave the cache,
+  // once the data can be read back from the partition.
+  target_fd_ = OpenFile(
+      target_path_.c_str(),
+      flags,
+      !verity_writer_,
+      install_plan->write_behind,
+      install_plan->direct_target_writes,
+      install_plan->instrument_file_io ? install_part_.name + "/target" : "",
+      &err);
+  if (target_fd_ && verity_writer_) {
+    target_fd_ = std::make_shared<GatheringFileDescriptor>(
+        std::make_shared<StreamingVerityFileDescriptor>(target_fd_,
+                                                        verity_writer_),
+        kCacheSize,
+        install_plan->write_behind);
+  }
   if (!target_fd_) {
     LOG(ERROR) << "Unable to open target partition "
                << partition.partition_name() << " on slot "
@@ -181,31 +288,84 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
   LOG(INFO) << "Applying " << partition.operations().size()
             << " operations to partition \"" << partition.partition_name()
             << "\"";
+  TEST_AND_RETURN_FALSE(
+      install_op_executor_.SetZstdDictionary(partition.zstd_dictionary()));
+
+  // Updating a partition in place, the blocks copied to themselves are
+  // already there.
+  identical_blocks_ = ExtentRanges();
+  if (!source_path_.empty() && IsSameFile(source_path_, target_path_)) {
+    for (size_t i = next_op_index;
+         i < static_cast<size_t>(partition.operations_size());
+         i++) {
+      const InstallOperation& op = partition.operations(i);
+      if (op.type() == InstallOperation::SOURCE_COPY)
+        identical_blocks_.AddExtents(SplitIdenticalBlocks(op, nullptr));
+    }
+    LOG_IF(INFO, identical_blocks_.blocks())
+        << "Skipping the copy of " << identical_blocks_.blocks()
+        << " blocks identical in the source and target partitions.";
+  } else if (!source_path_.empty()) {
+    // The source partition doesn't change, its blocks can be cached.
+    verified_source_fd_.SetOperations(partition, next_op_index);
+  }
 
   // Discard the end of the partition, but ignore failures.
   DiscardPartitionTail(target_fd_, install_part_.target_size);
 
+  skip_written_operations_ = install_plan->skip_written_operations;
   return true;
 }
 
 bool PartitionWriter::PerformReplaceOperation(const InstallOperation& operation,
                                               const void* data,
                                               size_t count) {
+  TEST_AND_RETURN_FALSE(FlushPendingOperations());
   // Setup the ExtentWriter stack based on the operation type.
   std::unique_ptr<ExtentWriter> writer = CreateBaseExtentWriter();
   return install_op_executor_.ExecuteReplaceOperation(
       operation, std::move(writer), data, count);
 }
 
+std::unique_ptr<ExtentWriter> PartitionWriter::CreateReplaceWriter(
+    const InstallOperation& operation) {
+  if (!FlushPendingOperations())
+    return nullptr;
+  return install_op_executor_.CreateReplaceWriter(operation,
+                                                  CreateBaseExtentWriter());
+}
+
 bool PartitionWriter::PerformZeroOrDiscardOperation(
     const InstallOperation& operation) {
+  // The consecutive ZERO or DISCARD operations are coalesced into one, whose
+  // contiguous extents are merged: the generator emits one operation per
+  // extent of zeros, and each ioctl has a fixed cost.
+  TEST_AND_RETURN_FALSE(FlushPendingCopyOperation());
+  if (pending_zero_op_.dst_extents_size() > 0 &&
+      pending_zero_op_.type() != operation.type()) {
+    TEST_AND_RETURN_FALSE(FlushPendingZeroOperation());
+  }
+  pending_zero_op_.set_type(operation.type());
+  auto* extents = pending_zero_op_.mutable_dst_extents();
+  // The unused blocks of the partition are left as they are.
+  std::vector<Extent> used_extents;
+  for (const Extent& extent : operation.dst_extents())
+    install_part_.AppendUsedExtents(extent, &used_extents);
+  AppendMergedExtents(used_extents, extents);
+  return true;
+}
+
+bool PartitionWriter::FlushPendingZeroOperation() {
+  if (pending_zero_op_.dst_extents_size() == 0)
+    return true;
+  InstallOperation operation;
+  operation.Swap(&pending_zero_op_);
 #ifdef BLKZEROOUT
   int request =
       (operation.type() == InstallOperation::ZERO ? BLKZEROOUT : BLKDISCARD);
 #else   // !defined(BLKZEROOUT)
-  auto writer = CreateBaseExtentWriter();
-  return install_op_executor_.ExecuteZeroOrDiscardOperation(operation,
-                                                            writer.get());
+  return install_op_executor_.ExecuteZeroOrDiscardOperation(
+      operation, CreateBaseExtentWriter());
 #endif  // !defined(BLKZEROOUT)
 
   for (const Extent& extent : operation.dst_extents()) {
@@ -227,11 +387,35 @@ bool PartitionWriter::PerformZeroOrDiscardOperation(
 
 bool PartitionWriter::PerformSourceCopyOperation(
     const InstallOperation& operation, ErrorCode* error) {
+  TEST_AND_RETURN_FALSE(FlushPendingZeroOperation());
   // The device may optimize the SOURCE_COPY operation.
   // Being this a device-specific optimization let DynamicPartitionController
   // decide it the operation should be skipped.
   const PartitionUpdate& partition = partition_update_;
 
+  if (identical_blocks_.blocks() &&
+      std::any_of(operation.dst_extents().begin(),
+                  operation.dst_extents().end(),
+                  [this](const Extent& extent) {
+                    return identical_blocks_.OverlapsWithExtent(extent);
+                  })) {
+    InstallOperation remaining;
+    remaining.set_type(operation.type());
+    for (const Extent& extent : SplitIdenticalBlocks(operation, &remaining)) {
+      if (verity_writer_) {
+        verity_writer_->MarkWritten(extent.start_block() * block_size_,
+                                    extent.num_blocks() * block_size_);
+      }
+    }
+    // The source hash covers all the blocks, so with none left to copy it
+    // isn't checked: FilesystemVerifierAction checks the target anyway.
+    if (remaining.dst_extents().empty())
+      return true;
+    auto source_fd = ChooseSourceFD(operation, error);
+    TEST_AND_RETURN_FALSE(source_fd != nullptr);
+    return CopySourceBlocks(remaining, source_fd);
+  }
+
   InstallOperation buf;
   const bool should_optimize = dynamic_control_->OptimizeOperation(
       partition.partition_name(), operation, &buf);
@@ -248,15 +432,80 @@ bool PartitionWriter::PerformSourceCopyOperation(
     return false;
   }
 
-  auto writer = CreateBaseExtentWriter();
+  // Updating in place, the next operations may read the copied blocks.
+  if (source_path_ == target_path_)
+    return CopySourceBlocks(optimized, source_fd);
+  return DeferSourceCopy(optimized, std::move(source_fd));
+}
+
+bool PartitionWriter::DeferSourceCopy(const InstallOperation& operation,
+                                      FileDescriptorPtr source_fd) {
+  // The consecutive SOURCE_COPY operations are merged into one copy, as long
+  // as they read the same file: each one verified its source blocks already,
+  // and copying their contiguous extents at once saves a read and a write per
+  // operation. The checkpoints flush the copy, so they still cover every
+  // operation before them.
+  if (pending_copy_op_.dst_extents_size() > 0 &&
+      (pending_copy_fd_ != source_fd ||
+       utils::BlocksInExtents(pending_copy_op_.dst_extents()) +
+               utils::BlocksInExtents(operation.dst_extents()) >
+           kMaxPendingCopyBlocks)) {
+    TEST_AND_RETURN_FALSE(FlushPendingCopyOperation());
+  }
+  pending_copy_op_.set_type(InstallOperation::SOURCE_COPY);
+  pending_copy_fd_ = std::move(source_fd);
+  AppendMergedExtents(operation.src_extents(),
+                      pending_copy_op_.mutable_src_extents());
+  AppendMergedExtents(operation.dst_extents(),
+                      pending_copy_op_.mutable_dst_extents());
+  return true;
+}
+
+bool PartitionWriter::FlushPendingCopyOperation() {
+  if (pending_copy_op_.dst_extents_size() == 0)
+    return true;
+  InstallOperation operation;
+  operation.Swap(&pending_copy_op_);
+  FileDescriptorPtr source_fd = std::move(pending_copy_fd_);
+  if (!CopySourceBlocks(operation, source_fd)) {
+    LOG(ERROR) << "Failed to copy the source blocks "
+               << ExtentsToString(operation.src_extents()) << " to "
+               << ExtentsToString(operation.dst_extents());
+    return false;
+  }
+  return true;
+}
+
+bool PartitionWriter::FlushPendingOperations() {
+  if (FlushPendingZeroOperation() && FlushPendingCopyOperation())
+    return true;
+  // The failed operations are dropped, so whoever flushes again, e.g. the
+  // next checkpoint, must not succeed.
+  deferred_flush_failed_ = true;
+  return false;
+}
+
+bool PartitionWriter::CopySourceBlocks(const InstallOperation& operation,
+                                       FileDescriptorPtr source_fd) {
+  // Updating in place, the blocks go through a buffer: the kernel doesn't
+  // copy between overlapping ranges of a file.
+  if (source_path_ != target_path_ &&
+      fd_utils::CopyExtentsInKernel(source_fd,
+                                    operation.src_extents(),
+                                    target_fd_,
+                                    operation.dst_extents(),
+                                    block_size_)) {
+    return true;
+  }
   return install_op_executor_.ExecuteSourceCopyOperation(
-      optimized, std::move(writer), source_fd);
+      operation, CreateBaseExtentWriter(), source_fd);
 }
 
 bool PartitionWriter::PerformDiffOperation(const InstallOperation& operation,
                                            ErrorCode* error,
                                            const void* data,
                                            size_t count) {
+  TEST_AND_RETURN_FALSE(FlushPendingOperations());
   FileDescriptorPtr source_fd = ChooseSourceFD(operation, error);
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
 
@@ -267,12 +516,55 @@ bool PartitionWriter::PerformDiffOperation(const InstallOperation& operation,
 
 FileDescriptorPtr PartitionWriter::ChooseSourceFD(
     const InstallOperation& operation, ErrorCode* error) {
+  // Updating in place, the source reads must see the writes gathered so far.
+  if (source_path_ == target_path_ && target_fd_ && !target_fd_->Flush()) {
+    LOG(ERROR) << "Failed to flush the writes to " << target_path_;
+    return nullptr;
+  }
   return verified_source_fd_.ChooseSourceFD(operation, error);
 }
 
+bool PartitionWriter::FinishedInstallOps() {
+  return FlushDeferredOperations();
+}
+
+bool PartitionWriter::FlushDeferredOperations() {
+  TEST_AND_RETURN_FALSE(!deferred_flush_failed_);
+  TEST_AND_RETURN_FALSE(FlushPendingOperations());
+  // The writes gathered in |target_fd_|.
+  TEST_AND_RETURN_FALSE(!target_fd_ || target_fd_->Flush());
+  return true;
+}
+
+bool PartitionWriter::IsTargetWritten(const InstallOperation& operation) {
+  if (!skip_written_operations_ || !operation.has_dst_sha256_hash())
+    return false;
+  brillo::Blob hash;
+  if (!fd_utils::ReadAndHashExtents(
+          target_fd_, operation.dst_extents(), block_size_, &hash)) {
+    LOG(WARNING) << "Unable to read the target blocks of an operation of "
+                 << partition_update_.partition_name() << ", applying it.";
+    return false;
+  }
+  if (ToStringView(hash) != operation.dst_sha256_hash())
+    return false;
+  if (verity_writer_)
+    verity_writer_->MarkWritten(operation.dst_extents());
+  return true;
+}
+
 int PartitionWriter::Close() {
   int err = 0;
 
+  if (target_fd_ && !FlushPendingOperations()) {
+    LOG(ERROR) << "Error writing the deferred operations to the target "
+                  "partition";
+    err = 1;
+  }
+  pending_zero_op_.Clear();
+  pending_copy_op_.Clear();
+  pending_copy_fd_.reset();
+
   source_path_.clear();
 
   if (target_fd_ && !target_fd_->Close()) {
@@ -288,9 +580,20 @@ int PartitionWriter::Close() {
 }
 
 void PartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
+  // The checkpoint covers the operations deferred so far. A failure is
+  // reported by FinishedInstallOps().
+  if (!FlushPendingOperations())
+    LOG(ERROR) << "Failed to flush the deferred operations at a checkpoint.";
   target_fd_->Flush();
 }
 
+bool PartitionWriter::CheckpointPartialOperation(size_t op_index,
+                                                 uint64_t num_blocks) {
+  // The blocks are written in place, so a resumed update only needs them on
+  // disk. CreateReplaceWriter() already flushed the deferred operations.
+  return target_fd_ && target_fd_->Flush();
+}
+
 std::unique_ptr<ExtentWriter> PartitionWriter::CreateBaseExtentWriter() {
   return std::make_unique<DirectExtentWriter>(target_fd_);
 }
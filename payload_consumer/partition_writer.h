@@ -31,6 +31,7 @@
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/partition_writer_interface.h"
 #include "update_engine/payload_consumer/verified_source_fd.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -63,6 +64,8 @@ class PartitionWriter : public PartitionWriterInterface {
   //   |next_op_index| is index of next operation that should be applied.
   // |next_op_index-1| is the last operation that is already applied.
   void CheckpointUpdateProgress(size_t next_op_index) override;
+  [[nodiscard]] bool CheckpointPartialOperation(size_t op_index,
+                                                uint64_t num_blocks) override;
 
   // Close partition writer, when calling this function there's no guarantee
   // that all |InstallOperations| are sent to |PartitionWriter|. This function
@@ -75,6 +78,8 @@ class PartitionWriter : public PartitionWriterInterface {
   [[nodiscard]] bool PerformReplaceOperation(const InstallOperation& operation,
                                              const void* data,
                                              size_t count) override;
+  [[nodiscard]] std::unique_ptr<ExtentWriter> CreateReplaceWriter(
+      const InstallOperation& operation) override;
   [[nodiscard]] bool PerformZeroOrDiscardOperation(
       const InstallOperation& operation) override;
 
@@ -88,19 +93,59 @@ class PartitionWriter : public PartitionWriterInterface {
   // |DeltaPerformer| calls this when all Install Ops are sent to partition
   // writer. No |Perform*Operation| methods will be called in the future, and
   // the partition writer is expected to be closed soon.
-  [[nodiscard]] bool FinishedInstallOps() override { return true; }
+  [[nodiscard]] bool FinishedInstallOps() override;
+  // Zeroes or discards the extents of the ZERO and DISCARD operations, and
+  // copies those of the SOURCE_COPY operations, deferred to be merged, and
+  // writes the data gathered in the target file descriptor.
+  [[nodiscard]] bool FlushDeferredOperations() override;
+  // With InstallPlan::skip_written_operations, reads and hashes the target
+  // blocks of the operations with a dst_sha256_hash.
+  bool IsTargetWritten(const InstallOperation& operation) override;
+  // Each writer has its own source and target file descriptors.
+  bool AllowsConcurrentWriters() const override { return true; }
+  bool SetVerityWriter(StreamingVerityWriter* verity_writer) override {
+    verity_writer_ = verity_writer;
+    return true;
+  }
 
  private:
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
+  FRIEND_TEST(PartitionWriterTest, CopiesSourceBlocksInKernelTest);
+  FRIEND_TEST(PartitionWriterTest, InPlaceSourceCopySkipsIdenticalBlocksTest);
+  FRIEND_TEST(PartitionWriterTest, MergesZeroOperationsTest);
+  FRIEND_TEST(PartitionWriterTest, MergesSourceCopyOperationsTest);
 
+  // Opens the source partition, with its I/O counted if |instrument_io|.
   [[nodiscard]] bool OpenSourcePartition(uint32_t source_slot,
-                                         bool source_may_exist);
+                                         bool source_may_exist,
+                                         bool instrument_io);
   FileDescriptorPtr ChooseSourceFD(const InstallOperation& op,
                                    ErrorCode* error);
 
   [[nodiscard]] std::unique_ptr<ExtentWriter> CreateBaseExtentWriter();
 
+  // Copies the blocks of the SOURCE_COPY |operation| from |source_fd| to the
+  // target, within the kernel when both files support it.
+  [[nodiscard]] bool CopySourceBlocks(const InstallOperation& operation,
+                                      FileDescriptorPtr source_fd);
+
+  // Zeroes or discards the extents of |pending_zero_op_|, if any, and clears
+  // it.
+  [[nodiscard]] bool FlushPendingZeroOperation();
+
+  // Adds the SOURCE_COPY |operation|, whose source was verified in
+  // |source_fd|, to |pending_copy_op_|.
+  [[nodiscard]] bool DeferSourceCopy(const InstallOperation& operation,
+                                     FileDescriptorPtr source_fd);
+
+  // Copies the blocks of |pending_copy_op_|, if any, and clears it.
+  [[nodiscard]] bool FlushPendingCopyOperation();
+
+  // Flushes both kinds of deferred operations, only one of which is pending
+  // at a time.
+  [[nodiscard]] bool FlushPendingOperations();
+
   const PartitionUpdate& partition_update_;
   const InstallPlan::Partition& install_part_;
   DynamicPartitionControlInterface* dynamic_control_;
@@ -110,6 +155,23 @@ class PartitionWriter : public PartitionWriterInterface {
   // Path to target partition
   std::string target_path_;
   FileDescriptorPtr target_fd_;
+  // Sees every write to |target_fd_| if not null.
+  StreamingVerityWriter* verity_writer_{nullptr};
+  // When the target partition is the source one, the blocks the remaining
+  // SOURCE_COPY operations copy to themselves, which aren't copied.
+  ExtentRanges identical_blocks_;
+  // The ZERO or DISCARD operations performed since the last other operation,
+  // merged and not applied yet.
+  InstallOperation pending_zero_op_;
+  // The SOURCE_COPY operations performed since the last other operation,
+  // merged and not copied yet from |pending_copy_fd_|.
+  InstallOperation pending_copy_op_;
+  FileDescriptorPtr pending_copy_fd_;
+  // Whether flushing the deferred operations failed where it couldn't be
+  // reported.
+  bool deferred_flush_failed_{false};
+  // Whether IsTargetWritten() checks the target blocks.
+  bool skip_written_operations_{false};
   const bool interactive_;
   const size_t block_size_;
 
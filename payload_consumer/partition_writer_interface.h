@@ -18,6 +18,7 @@
 #define UPDATE_ENGINE_PARTITION_WRITER_INTERFACE_H_
 
 #include <cstdint>
+#include <memory>
 #include <string>
 
 #include <brillo/secure_blob.h>
@@ -30,6 +31,8 @@
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
+class StreamingVerityWriter;
+
 class PartitionWriterInterface {
  public:
   virtual ~PartitionWriterInterface() = default;
@@ -47,6 +50,17 @@ class PartitionWriterInterface {
   // |next_op_index-1| is the last operation that is already applied.
   virtual void CheckpointUpdateProgress(size_t next_op_index) = 0;
 
+  // Like CheckpointUpdateProgress(), in the middle of the operation
+  // |op_index|, a REPLACE whose writer from CreateReplaceWriter() wrote its
+  // first |num_blocks| blocks. Returns false if not supported.
+  [[nodiscard]] virtual bool CheckpointPartialOperation(size_t op_index,
+                                                        uint64_t num_blocks) {
+    return false;
+  }
+  // Called before Init() when the update resumes from such a checkpoint of
+  // the operation |next_op_index| passed to Init().
+  virtual void ResumePartialOperation(uint64_t num_blocks) {}
+
   // Close partition writer, when calling this function there's no guarantee
   // that all |InstallOperations| are sent to |PartitionWriter|. This function
   // will be called even if we are pausing/aborting the update.
@@ -59,6 +73,14 @@ class PartitionWriterInterface {
       const InstallOperation& operation, const void* data, size_t count) = 0;
   [[nodiscard]] virtual bool PerformZeroOrDiscardOperation(
       const InstallOperation& operation) = 0;
+  // Alternative to PerformReplaceOperation() for blobs which are passed in
+  // pieces: returns an initialized writer that takes the blob of the REPLACE,
+  // REPLACE_BZ, REPLACE_XZ or REPLACE_ZSTD |operation| in its Write() calls.
+  // Returns null if not supported.
+  [[nodiscard]] virtual std::unique_ptr<ExtentWriter> CreateReplaceWriter(
+      const InstallOperation& operation) {
+    return nullptr;
+  }
 
   [[nodiscard]] virtual bool PerformSourceCopyOperation(
       const InstallOperation& operation, ErrorCode* error) = 0;
@@ -72,6 +94,31 @@ class PartitionWriterInterface {
   // writer. No |Perform*Operation| methods will be called in the future, and
   // the partition writer is expected to be closed soon.
   [[nodiscard]] virtual bool FinishedInstallOps() = 0;
+
+  // Applies the operations the writer deferred, e.g. to merge them, so that
+  // another writer of the partition can write their blocks. Flushing is
+  // implied by CheckpointUpdateProgress(), FinishedInstallOps() and any
+  // Perform*Operation() call which isn't deferred.
+  [[nodiscard]] virtual bool FlushDeferredOperations() { return true; }
+
+  // Returns true if the target blocks of |operation| already hold the data of
+  // its dst_sha256_hash, so that it needn't be applied. They are then reported
+  // written to the verity writer, if any.
+  virtual bool IsTargetWritten(const InstallOperation& operation) {
+    return false;
+  }
+
+  // Returns true if several writers of the same partition, each used from its
+  // own thread, may apply operations with disjoint |dst_extents| at the same
+  // time.
+  virtual bool AllowsConcurrentWriters() const { return false; }
+
+  // Makes the writer report everything it writes to the target partition to
+  // |verity_writer|, which must outlive it. Must be called before Init().
+  // Returns false if not supported.
+  virtual bool SetVerityWriter(StreamingVerityWriter* verity_writer) {
+    return false;
+  }
 };
 }  // namespace chromeos_update_engine
 
@@ -14,7 +14,9 @@
 // limitations under the License.
 //
 
+#include <algorithm>
 #include <memory>
+#include <utility>
 #include <vector>
 
 #include <brillo/secure_blob.h>
@@ -31,6 +33,7 @@
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/fake_file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
@@ -219,4 +222,189 @@ TEST_F(PartitionWriterTest, ChooseSourceFDTest) {
   ASSERT_EQ(1U, GetSourceEccRecoveredFailures());
 }
 
+TEST_F(PartitionWriterTest, PrefetchesNextSourceExtentsTest) {
+  auto source_fd = std::make_shared<FakeFileDescriptor>();
+  source_fd->Open("", 0);
+  writer_.verified_source_fd_.source_fd_ = source_fd;
+  SetFakeECCFile(16 * kBlockSize);
+
+  for (const auto& extent : {ExtentForRange(0, 1),
+                             ExtentForRange(4, 2),
+                             ExtentForRange(10, 1),
+                             ExtentForRange(12, 1)}) {
+    InstallOperation* op = partition_update_.add_operations();
+    op->set_type(InstallOperation::SOURCE_COPY);
+    *op->add_src_extents() = extent;
+    *op->add_dst_extents() = extent;
+  }
+  writer_.verified_source_fd_.SetOperations(partition_update_, 0);
+  // Two blocks ahead of each operation.
+  writer_.verified_source_fd_.prefetch_window_ = 2 * kBlockSize;
+
+  ErrorCode error = ErrorCode::kSuccess;
+  ASSERT_NE(nullptr, writer_.ChooseSourceFD(partition_update_.operations(0),
+                                            &error));
+  using Range = std::pair<uint64_t, uint64_t>;
+  EXPECT_EQ(std::vector<Range>({{4 * kBlockSize, 2 * kBlockSize}}),
+            source_fd->GetReadaheadOps());
+  ASSERT_NE(nullptr, writer_.ChooseSourceFD(partition_update_.operations(1),
+                                            &error));
+  EXPECT_EQ(std::vector<Range>({{4 * kBlockSize, 2 * kBlockSize},
+                                {10 * kBlockSize, kBlockSize},
+                                {12 * kBlockSize, kBlockSize}}),
+            source_fd->GetReadaheadOps());
+}
+
+TEST_F(PartitionWriterTest, InPlaceSourceCopySkipsIdenticalBlocksTest) {
+  // Updating the source partition in place, blocks 0 and 1 are copied to
+  // themselves and block 2 to block 3.
+  brillo::Blob data = FakeFileDescriptorData(4 * kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(source_partition.path(), data));
+  install_part_.target_path = source_partition.path();
+  install_part_.source_size = data.size();
+  install_part_.target_size = data.size();
+
+  InstallOperation* op = partition_update_.add_operations();
+  op->set_type(InstallOperation::SOURCE_COPY);
+  *op->add_src_extents() = ExtentForRange(0, 3);
+  *op->add_dst_extents() = ExtentForRange(0, 2);
+  *op->add_dst_extents() = ExtentForRange(3, 1);
+
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+  EXPECT_EQ(2u, writer_.identical_blocks_.blocks());
+  ErrorCode error;
+  ASSERT_TRUE(writer_.PerformSourceCopyOperation(*op, &error));
+  writer_.CheckpointUpdateProgress(1);
+  ASSERT_EQ(0, writer_.Close());
+
+  std::copy(data.begin() + 2 * kBlockSize,
+            data.begin() + 3 * kBlockSize,
+            data.begin() + 3 * kBlockSize);
+  brillo::Blob output_data;
+  ASSERT_TRUE(utils::ReadFile(source_partition.path(), &output_data));
+  EXPECT_EQ(data, output_data);
+}
+
+TEST_F(PartitionWriterTest, MergesZeroOperationsTest) {
+  brillo::Blob data = FakeFileDescriptorData(4 * kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(target_partition.path(), data));
+  install_part_.target_size = data.size();
+  ASSERT_TRUE(writer_.Init(&install_plan_, false, 0));
+
+  InstallOperation op;
+  op.set_type(InstallOperation::ZERO);
+  for (uint64_t block : {0, 1, 3}) {
+    op.clear_dst_extents();
+    *op.add_dst_extents() = ExtentForRange(block, 1);
+    ASSERT_TRUE(writer_.PerformZeroOrDiscardOperation(op));
+  }
+  // Nothing is zeroed until the next flush, and blocks 0 and 1 are merged.
+  ASSERT_EQ(2, writer_.pending_zero_op_.dst_extents_size());
+  EXPECT_EQ(2u, writer_.pending_zero_op_.dst_extents(0).num_blocks());
+  ASSERT_TRUE(writer_.FinishedInstallOps());
+  EXPECT_EQ(0, writer_.pending_zero_op_.dst_extents_size());
+  ASSERT_EQ(0, writer_.Close());
+
+  std::fill(data.begin(), data.begin() + 2 * kBlockSize, 0);
+  std::fill(data.begin() + 3 * kBlockSize, data.end(), 0);
+  brillo::Blob output_data;
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  EXPECT_EQ(data, output_data);
+}
+
+TEST_F(PartitionWriterTest, MergesSourceCopyOperationsTest) {
+  brillo::Blob data = FakeFileDescriptorData(4 * kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(source_partition.path(), data));
+  install_part_.source_size = data.size();
+  install_part_.target_size = 3 * kBlockSize;
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+
+  ErrorCode error;
+  InstallOperation op;
+  op.set_type(InstallOperation::SOURCE_COPY);
+  const std::vector<std::pair<uint64_t, uint64_t>> copies = {
+      {0, 0}, {1, 1}, {3, 2}};
+  for (auto [src_block, dst_block] : copies) {
+    op.clear_src_extents();
+    op.clear_dst_extents();
+    *op.add_src_extents() = ExtentForRange(src_block, 1);
+    *op.add_dst_extents() = ExtentForRange(dst_block, 1);
+    ASSERT_TRUE(writer_.PerformSourceCopyOperation(op, &error));
+  }
+  // Nothing is copied until the next flush, and the contiguous extents are
+  // merged.
+  ASSERT_EQ(2, writer_.pending_copy_op_.src_extents_size());
+  EXPECT_EQ(2u, writer_.pending_copy_op_.src_extents(0).num_blocks());
+  ASSERT_EQ(1, writer_.pending_copy_op_.dst_extents_size());
+  EXPECT_EQ(3u, writer_.pending_copy_op_.dst_extents(0).num_blocks());
+  ASSERT_TRUE(writer_.FinishedInstallOps());
+  EXPECT_EQ(0, writer_.pending_copy_op_.dst_extents_size());
+  ASSERT_EQ(0, writer_.Close());
+
+  std::copy(data.begin() + 3 * kBlockSize,
+            data.end(),
+            data.begin() + 2 * kBlockSize);
+  data.resize(3 * kBlockSize);
+  brillo::Blob output_data;
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  EXPECT_EQ(data, output_data);
+}
+
+// The source descriptor of the VerifiedSourceFd, wrapped in its block cache,
+// is copied from within the kernel.
+TEST_F(PartitionWriterTest, CopiesSourceBlocksInKernelTest) {
+  brillo::Blob data = FakeFileDescriptorData(2 * kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(source_partition.path(), data));
+  install_part_.source_size = data.size();
+  install_part_.target_size = 3 * kBlockSize;
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+
+  InstallOperation op;
+  *op.add_src_extents() = ExtentForRange(0, 2);
+  *op.add_dst_extents() = ExtentForRange(1, 2);
+  EXPECT_TRUE(
+      fd_utils::CopyExtentsInKernel(writer_.verified_source_fd_.source_fd_,
+                                    op.src_extents(),
+                                    writer_.target_fd_,
+                                    op.dst_extents(),
+                                    kBlockSize));
+  ASSERT_EQ(0, writer_.Close());
+
+  brillo::Blob output_data;
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  ASSERT_EQ(3 * kBlockSize, output_data.size());
+  EXPECT_EQ(data, brillo::Blob(output_data.begin() + kBlockSize,
+                               output_data.end()));
+}
+
+TEST_F(PartitionWriterTest, SkipsWrittenOperationsTest) {
+  brillo::Blob data = FakeFileDescriptorData(2 * kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(source_partition.path(), data));
+  ASSERT_TRUE(test_utils::WriteFileVector(target_partition.path(), data));
+  install_part_.source_size = data.size();
+  install_part_.target_size = data.size();
+
+  InstallOperation op;
+  op.set_type(InstallOperation::REPLACE);
+  *op.add_dst_extents() = ExtentForRange(1, 1);
+  brillo::Blob hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfBytes(
+      data.data() + kBlockSize, kBlockSize, &hash));
+  op.set_dst_sha256_hash(hash.data(), hash.size());
+
+  // Only a retry checks the target blocks.
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+  EXPECT_FALSE(writer_.IsTargetWritten(op));
+  ASSERT_EQ(0, writer_.Close());
+
+  install_plan_.skip_written_operations = true;
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+  EXPECT_TRUE(writer_.IsTargetWritten(op));
+  op.mutable_dst_extents(0)->set_start_block(0);
+  EXPECT_FALSE(writer_.IsTargetWritten(op));
+  op.clear_dst_sha256_hash();
+  EXPECT_FALSE(writer_.IsTargetWritten(op));
+  ASSERT_EQ(0, writer_.Close());
+}
+
 }  // namespace chromeos_update_engine
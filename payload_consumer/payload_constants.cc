@@ -22,9 +22,11 @@ namespace chromeos_update_engine {
 
 // const uint64_t kChromeOSMajorPayloadVersion = 1;  DEPRECATED
 const uint64_t kBrilloMajorPayloadVersion = 2;
+const uint64_t kCompressedManifestMajorPayloadVersion = 3;
 
 const uint64_t kMinSupportedMajorPayloadVersion = kBrilloMajorPayloadVersion;
-const uint64_t kMaxSupportedMajorPayloadVersion = kBrilloMajorPayloadVersion;
+const uint64_t kMaxSupportedMajorPayloadVersion =
+    kCompressedManifestMajorPayloadVersion;
 
 const uint32_t kFullPayloadMinorVersion = 0;
 // const uint32_t kInPlaceMinorPayloadVersion = 1;  DEPRECATED
@@ -37,7 +39,8 @@ const uint32_t kPartialUpdateMinorPayloadVersion = 7;
 const uint32_t kZucchiniMinorPayloadVersion = 8;
 
 const uint32_t kMinSupportedMinorPayloadVersion = kSourceMinorPayloadVersion;
-const uint32_t kMaxSupportedMinorPayloadVersion = kLZ4DIFFMinorPayloadVersion;
+const uint32_t kMaxSupportedMinorPayloadVersion =
+    kZstdDictionaryMinorPayloadVersion;
 
 const uint64_t kMaxPayloadHeaderSize = 24;
 
@@ -72,6 +75,8 @@ const char* InstallOperationTypeName(InstallOperation::Type op_type) {
       return "LZ4DIFF_BSDIFF";
     case InstallOperation::LZ4DIFF_PUFFDIFF:
       return "LZ4DIFF_PUFFIDFF";
+    case InstallOperation::REPLACE_ZSTD:
+      return "REPLACE_ZSTD";
     case InstallOperation::BSDIFF:
     case InstallOperation::MOVE:
       NOTREACHED();
@@ -31,6 +31,10 @@ namespace chromeos_update_engine {
 // The major version used by Brillo.
 extern const uint64_t kBrilloMajorPayloadVersion;
 
+// The major version whose manifest is stored compressed with zstd, after its
+// uncompressed size as a big endian uint64.
+extern const uint64_t kCompressedManifestMajorPayloadVersion;
+
 // The minimum and maximum supported major version.
 extern const uint64_t kMinSupportedMajorPayloadVersion;
 extern const uint64_t kMaxSupportedMajorPayloadVersion;
@@ -65,6 +69,21 @@ extern const uint32_t kZucchiniMinorPayloadVersion;
 // THe minor version that allows LZ4DIFF operation
 constexpr uint32_t kLZ4DIFFMinorPayloadVersion = 9;
 
+// The minor version that allows REPLACE_ZSTD operation.
+constexpr uint32_t kZstdMinorPayloadVersion = 10;
+
+// The minor version that allows REPLACE operations to share the blob of an
+// earlier one.
+constexpr uint32_t kSharedBlobMinorPayloadVersion = 11;
+
+// The minor version that allows a partition to have a zstd dictionary, which
+// its REPLACE_ZSTD operations are compressed against.
+constexpr uint32_t kZstdDictionaryMinorPayloadVersion = 12;
+
+// The most bytes of decoded data of shared blobs that a device applying a
+// payload keeps in memory at once, waiting for the operations sharing them.
+constexpr uint64_t kMaxSharedBlobCacheSize = 64 * 1024 * 1024;
+
 // The minimum and maximum supported minor version.
 extern const uint32_t kMinSupportedMinorPayloadVersion;
 extern const uint32_t kMaxSupportedMinorPayloadVersion;
@@ -72,6 +91,9 @@ extern const uint32_t kMaxSupportedMinorPayloadVersion;
 // The maximum size of the payload header (anything before the protobuf).
 extern const uint64_t kMaxPayloadHeaderSize;
 
+// The largest uncompressed manifest accepted in a compressed manifest payload.
+constexpr uint64_t kMaxUncompressedManifestSize = 1024 * 1024 * 1024;
+
 // The kernel and rootfs partition names used by the BootControlInterface when
 // handling update payloads with a major version 1. The names of the updated
 // partitions are include in the payload itself for major version 2.
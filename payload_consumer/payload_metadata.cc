@@ -20,6 +20,7 @@
 
 #include <base/strings/stringprintf.h>
 #include <brillo/data_encoding.h>
+#include <zstd.h>
 
 #include "update_engine/common/constants.h"
 #include "update_engine/common/hash_calculator.h"
@@ -38,6 +39,52 @@ const uint64_t PayloadMetadata::kDeltaManifestSizeOffset =
 const uint64_t PayloadMetadata::kDeltaManifestSizeSize = 8;
 const uint64_t PayloadMetadata::kDeltaMetadataSignatureSizeSize = 4;
 
+namespace {
+
+// The compression level of the manifest. It is compressed once per payload
+// but may be downloaded by every client, so it's worth a slower level.
+const int kManifestCompressionLevel = 19;
+
+// Parses |manifest| stored compressed in |data|, as written by
+// SerializeManifest(): its uncompressed size followed by a zstd frame.
+bool ParseCompressedManifest(const unsigned char* data,
+                             size_t size,
+                             DeltaArchiveManifest* manifest) {
+  uint64_t uncompressed_size;
+  if (size < sizeof(uncompressed_size)) {
+    LOG(ERROR) << "Compressed manifest too small: " << size;
+    return false;
+  }
+  memcpy(&uncompressed_size, data, sizeof(uncompressed_size));
+  uncompressed_size = be64toh(uncompressed_size);
+  // The size is covered by the metadata signature, but a bound on it keeps a
+  // corrupted unsigned payload from allocating without limit.
+  if (uncompressed_size > kMaxUncompressedManifestSize) {
+    LOG(ERROR) << "Uncompressed manifest size too large: "
+               << uncompressed_size;
+    return false;
+  }
+  data += sizeof(uncompressed_size);
+  size -= sizeof(uncompressed_size);
+
+  string manifest_data(uncompressed_size, '\0');
+  const size_t ret =
+      ZSTD_decompress(manifest_data.data(), manifest_data.size(), data, size);
+  if (ZSTD_isError(ret)) {
+    LOG(ERROR) << "Unable to decompress the manifest: "
+               << ZSTD_getErrorName(ret);
+    return false;
+  }
+  if (ret != uncompressed_size) {
+    LOG(ERROR) << "Decompressed manifest size " << ret
+               << " doesn't match the expected size " << uncompressed_size;
+    return false;
+  }
+  return manifest->ParseFromString(manifest_data);
+}
+
+}  // namespace
+
 uint64_t PayloadMetadata::GetMetadataSignatureSizeOffset() const {
   return kDeltaManifestSizeOffset + kDeltaManifestSizeSize;
 }
@@ -149,10 +196,40 @@ bool PayloadMetadata::GetManifest(const unsigned char* payload,
                                   DeltaArchiveManifest* out_manifest) const {
   uint64_t manifest_offset = GetManifestOffset();
   CHECK_GE(size, manifest_offset + manifest_size_);
+  if (major_payload_version_ == kCompressedManifestMajorPayloadVersion) {
+    return ParseCompressedManifest(
+        &payload[manifest_offset], manifest_size_, out_manifest);
+  }
   return out_manifest->ParseFromArray(&payload[manifest_offset],
                                       manifest_size_);
 }
 
+bool PayloadMetadata::SerializeManifest(uint64_t major_version,
+                                        const DeltaArchiveManifest& manifest,
+                                        string* out) {
+  if (major_version != kCompressedManifestMajorPayloadVersion)
+    return manifest.SerializeToString(out);
+
+  string manifest_data;
+  TEST_AND_RETURN_FALSE(manifest.SerializeToString(&manifest_data));
+  TEST_AND_RETURN_FALSE(manifest_data.size() <= kMaxUncompressedManifestSize);
+  const uint64_t size_be = htobe64(manifest_data.size());
+  out->assign(reinterpret_cast<const char*>(&size_be), sizeof(size_be));
+  out->resize(sizeof(size_be) + ZSTD_compressBound(manifest_data.size()));
+  const size_t ret = ZSTD_compress(out->data() + sizeof(size_be),
+                                   out->size() - sizeof(size_be),
+                                   manifest_data.data(),
+                                   manifest_data.size(),
+                                   kManifestCompressionLevel);
+  if (ZSTD_isError(ret)) {
+    LOG(ERROR) << "Unable to compress the manifest: "
+               << ZSTD_getErrorName(ret);
+    return false;
+  }
+  out->resize(sizeof(size_be) + ret);
+  return true;
+}
+
 ErrorCode PayloadMetadata::ValidateMetadataSignature(
     const brillo::Blob& payload,
     const string& metadata_signature,
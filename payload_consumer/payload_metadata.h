@@ -95,6 +95,13 @@ class PayloadMetadata {
                    size_t size,
                    DeltaArchiveManifest* out_manifest) const;
 
+  // Serializes |manifest| into |out| the way it is stored in a payload of the
+  // |major_version|, compressed for kCompressedManifestMajorPayloadVersion.
+  // Returns true on success.
+  static bool SerializeManifest(uint64_t major_version,
+                                const DeltaArchiveManifest& manifest,
+                                std::string* out);
+
   // Parses a payload file |payload_path| and prepares the metadata properties,
   // manifest and metadata signatures. Can be used as an easy to use utility to
   // get the payload information without manually the process.
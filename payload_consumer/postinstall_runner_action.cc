@@ -24,6 +24,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <string>
@@ -37,6 +38,7 @@
 
 #include "update_engine/common/action_processor.h"
 #include "update_engine/common/boot_control_interface.h"
+#include "update_engine/common/constants.h"
 #include "update_engine/common/platform_constants.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/utils.h"
@@ -49,6 +51,14 @@ namespace {
 // sample_images.sh file.
 const int kPostinstallStatusFd = 3;
 
+#ifdef __ANDROID__
+// The postinstall programs run from /postinstall, the only mountpoint, so they
+// run one after the other.
+constexpr size_t kMaxConcurrentPostinstalls = 1;
+#else
+constexpr size_t kMaxConcurrentPostinstalls = 2;
+#endif  // __ANDROID__
+
 static constexpr bool Contains(std::string_view haystack,
                                std::string_view needle) {
   return haystack.find(needle) != std::string::npos;
@@ -81,9 +91,21 @@ namespace chromeos_update_engine {
 using std::string;
 using std::vector;
 
+namespace {
+
+// The key under which the target hash of a partition is recorded once its
+// postinstall succeeded.
+string PostinstallDoneKey(const string& partition_name) {
+  return PrefsInterface::CreateSubKey({kPrefsPostinstallDone, partition_name});
+}
+
+}  // namespace
+
 PostinstallRunnerAction::PostinstallRunnerAction(
-    BootControlInterface* boot_control, HardwareInterface* hardware)
-    : boot_control_(boot_control), hardware_(hardware) {
+    BootControlInterface* boot_control,
+    HardwareInterface* hardware,
+    PrefsInterface* prefs)
+    : boot_control_(boot_control), hardware_(hardware), prefs_(prefs) {
 #ifdef __ANDROID__
   fs_mount_dir_ = "/postinstall";
 #else   // __ANDROID__
@@ -92,14 +114,14 @@ PostinstallRunnerAction::PostinstallRunnerAction(
   fs_mount_dir_ = temp_dir.value();
 #endif  // __ANDROID__
   CHECK(!fs_mount_dir_.empty());
-  EnsureUnmounted();
+  EnsureUnmounted(fs_mount_dir_);
   LOG(INFO) << "postinstall mount point: " << fs_mount_dir_;
 }
 
-void PostinstallRunnerAction::EnsureUnmounted() {
-  if (utils::IsMountpoint(fs_mount_dir_)) {
-    LOG(INFO) << "Found previously mounted filesystem at " << fs_mount_dir_;
-    utils::UnmountFilesystem(fs_mount_dir_);
+void PostinstallRunnerAction::EnsureUnmounted(const string& mount_dir) {
+  if (utils::IsMountpoint(mount_dir)) {
+    LOG(INFO) << "Found previously mounted filesystem at " << mount_dir;
+    utils::UnmountFilesystem(mount_dir);
   }
 }
 
@@ -152,16 +174,14 @@ void PostinstallRunnerAction::PerformAction() {
     total_weight_ += partition_weight_[i];
   }
   accumulated_weight_ = 0;
-  ReportProgress(0);
+  free_mount_dirs_ = {fs_mount_dir_};
+  ReportProgress();
 
   PerformPartitionPostinstall();
 }
 
 bool PostinstallRunnerAction::MountPartition(
-    const InstallPlan::Partition& partition) noexcept {
-  // Perform post-install for the current_partition_ partition. At this point we
-  // need to call CompletePartitionPostinstall to complete the operation and
-  // cleanup.
+    const InstallPlan::Partition& partition, const string& mount_dir) noexcept {
   const auto mountable_device = partition.readonly_target_path;
   if (!utils::FileExists(mountable_device.c_str())) {
     LOG(ERROR) << "Mountable device " << mountable_device << " for partition "
@@ -169,14 +189,14 @@ bool PostinstallRunnerAction::MountPartition(
     return false;
   }
 
-  if (!utils::FileExists(fs_mount_dir_.c_str())) {
-    LOG(ERROR) << "Mount point " << fs_mount_dir_
+  if (!utils::FileExists(mount_dir.c_str())) {
+    LOG(ERROR) << "Mount point " << mount_dir
                << " does not exist, mount call will fail";
     return false;
   }
   // Double check that the fs_mount_dir is not busy with a previous mounted
   // filesystem from a previous crashed postinstall step.
-  EnsureUnmounted();
+  EnsureUnmounted(mount_dir);
 
 #ifdef __ANDROID__
 #if !defined(__ANDROID_RECOVERY__)
@@ -221,7 +241,7 @@ bool PostinstallRunnerAction::MountPartition(
     }
     // Mount the target partition R/W
     LOG(INFO) << "Running backuptool scripts";
-    utils::MountFilesystem(mountable_device, fs_mount_dir_, MS_NOATIME | MS_NODEV | MS_NODIRATIME,
+    utils::MountFilesystem(mountable_device, mount_dir, MS_NOATIME | MS_NODEV | MS_NODIRATIME,
                            partition.filesystem_type, "seclabel");
 
     // Switch to a permissive domain
@@ -245,7 +265,7 @@ bool PostinstallRunnerAction::MountPartition(
     LOG(INFO) << "Skipping backuptool scripts";
   }
 
-  utils::UnmountFilesystem(fs_mount_dir_);
+  utils::UnmountFilesystem(mount_dir);
 #endif  // !__ANDROID_RECOVERY__
 
   // In Chromium OS, the postinstall step is allowed to write to the block
@@ -260,7 +280,7 @@ bool PostinstallRunnerAction::MountPartition(
 
   if (!utils::MountFilesystem(
           mountable_device,
-          fs_mount_dir_,
+          mount_dir,
           MS_RDONLY,
           partition.filesystem_type,
           hardware_->GetPartitionMountOptions(partition.name))) {
@@ -275,11 +295,24 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
     return CompletePostinstall(ErrorCode::kSuccess);
   }
 
-  // Skip all the partitions that don't have a post-install step.
-  while (current_partition_ < install_plan_.partitions.size() &&
-         !install_plan_.partitions[current_partition_].run_postinstall) {
-    VLOG(1) << "Skipping post-install on partition "
-            << install_plan_.partitions[current_partition_].name;
+  while (next_partition_ < install_plan_.partitions.size()) {
+    const auto& partition = install_plan_.partitions[next_partition_];
+    if (partition.run_postinstall && IsPostinstallDone(partition)) {
+      LOG(INFO) << "Skipping post-install on partition " << partition.name
+                << ", it already succeeded for this update.";
+      accumulated_weight_ += partition_weight_[next_partition_++];
+      continue;
+    }
+    if (partition.run_postinstall) {
+      if (!CanStartPostinstall(partition))
+        break;
+      if (!StartPartitionPostinstall(next_partition_++))
+        return;
+      continue;
+    }
+
+    // Skip all the partitions that don't have a post-install step.
+    VLOG(1) << "Skipping post-install on partition " << partition.name;
     // Attempt to mount a device if it has postinstall script configured, even
     // if we want to skip running postinstall script.
     // This is because we've seen bugs like b/198787355 which is only triggered
@@ -289,51 +322,110 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
     // It's possible that some of the partitions aren't mountable, but these
     // partitions shouldn't have postinstall configured. Therefore we guard this
     // logic with |postinstall_path.empty()|.
-    const auto& partition = install_plan_.partitions[current_partition_];
     if (!partition.postinstall_path.empty()) {
-      const auto mountable_device = partition.readonly_target_path;
-      if (!MountPartition(partition)) {
+      // Wait for a running postinstall to free its mountpoint.
+      if (free_mount_dirs_.empty())
+        break;
+      const string mount_dir = free_mount_dirs_.back();
+      if (!MountPartition(partition, mount_dir)) {
         return CompletePostinstall(ErrorCode::kPostInstallMountError);
       }
-      LogBuildInfoForPartition(fs_mount_dir_);
-      if (!utils::UnmountFilesystem(fs_mount_dir_)) {
-        return CompletePartitionPostinstall(
-            1, "Error unmounting the device " + mountable_device);
+      LogBuildInfoForPartition(mount_dir);
+      if (!utils::UnmountFilesystem(mount_dir)) {
+        LOG(ERROR) << "Error unmounting the device "
+                   << partition.readonly_target_path;
+        if (!partition.postinstall_optional)
+          return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
       }
     }
-    current_partition_++;
+    next_partition_++;
   }
-  if (current_partition_ == install_plan_.partitions.size())
+  if (next_partition_ == install_plan_.partitions.size() && runs_.empty())
     return CompletePostinstall(ErrorCode::kSuccess);
+}
 
-  const InstallPlan::Partition& partition =
-      install_plan_.partitions[current_partition_];
+bool PostinstallRunnerAction::IsPostinstallDone(
+    const InstallPlan::Partition& partition) const {
+  if (!prefs_ || partition.target_hash.empty())
+    return false;
+  string target_hash;
+  return prefs_->GetString(PostinstallDoneKey(partition.name), &target_hash) &&
+         target_hash == utils::HexEncode(partition.target_hash);
+}
 
-  const string mountable_device = partition.readonly_target_path;
-  // Perform post-install for the current_partition_ partition. At this point we
-  // need to call CompletePartitionPostinstall to complete the operation and
-  // cleanup.
+void PostinstallRunnerAction::SavePostinstallDone(
+    const InstallPlan::Partition& partition) {
+  if (!prefs_ || partition.target_hash.empty())
+    return;
+  if (!prefs_->SetString(PostinstallDoneKey(partition.name),
+                         utils::HexEncode(partition.target_hash))) {
+    LOG(WARNING) << "Unable to record the post-install of " << partition.name;
+  }
+}
+
+bool PostinstallRunnerAction::CanStartPostinstall(
+    const InstallPlan::Partition& partition) {
+  if (!runs_.empty()) {
+    if (runs_.size() >= kMaxConcurrentPostinstalls)
+      return false;
+    // The required postinstall programs run one after the other, in order.
+    bool required_running =
+        std::any_of(runs_.begin(), runs_.end(), [this](const auto& run) {
+          return !install_plan_.partitions[run->partition].postinstall_optional;
+        });
+    if (required_running && !partition.postinstall_optional)
+      return false;
+  }
+  if (free_mount_dirs_.empty()) {
+#ifdef __ANDROID__
+    return false;
+#else
+    base::FilePath temp_dir;
+    if (!base::CreateNewTempDirectory("au_postint_mount", &temp_dir)) {
+      LOG(WARNING) << "Unable to create another postinstall mount point.";
+      return false;
+    }
+    extra_mount_dirs_.push_back(temp_dir.value());
+    free_mount_dirs_.push_back(temp_dir.value());
+#endif  // __ANDROID__
+  }
+  return true;
+}
 
-  if (!MountPartition(partition)) {
+bool PostinstallRunnerAction::StartPartitionPostinstall(size_t index) {
+  const InstallPlan::Partition& partition = install_plan_.partitions[index];
+
+  const string mountable_device = partition.readonly_target_path;
+  const string mount_dir = free_mount_dirs_.back();
+  // Perform post-install for the partition. Once it is mounted, we need to
+  // call CompletePartitionPostinstall or CompletePostinstall to complete the
+  // operation and cleanup.
+  if (!MountPartition(partition, mount_dir)) {
     CompletePostinstall(ErrorCode::kPostInstallMountError);
-    return;
+    return false;
   }
-  LogBuildInfoForPartition(fs_mount_dir_);
+  free_mount_dirs_.pop_back();
+  runs_.push_back(std::make_unique<PostinstallRun>());
+  PostinstallRun* run = runs_.back().get();
+  run->partition = index;
+  run->mount_dir = mount_dir;
+
+  LogBuildInfoForPartition(mount_dir);
   base::FilePath postinstall_path(partition.postinstall_path);
   if (postinstall_path.IsAbsolute()) {
     LOG(ERROR) << "Invalid absolute path passed to postinstall, use a relative"
                   "path instead: "
                << partition.postinstall_path;
-    return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    return false;
   }
 
-  string abs_path =
-      base::FilePath(fs_mount_dir_).Append(postinstall_path).value();
-  if (!base::StartsWith(
-          abs_path, fs_mount_dir_, base::CompareCase::SENSITIVE)) {
+  string abs_path = base::FilePath(mount_dir).Append(postinstall_path).value();
+  if (!base::StartsWith(abs_path, mount_dir, base::CompareCase::SENSITIVE)) {
     LOG(ERROR) << "Invalid relative postinstall path: "
                << partition.postinstall_path;
-    return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    return false;
   }
 
   LOG(INFO) << "Performing postinst (" << partition.postinstall_path << " at "
@@ -358,147 +450,205 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
   command.push_back(partition.target_path);
 #endif  // __ANDROID__
 
-  current_command_ = Subprocess::Get().ExecFlags(
+  run->command = Subprocess::Get().ExecFlags(
       command,
       Subprocess::kRedirectStderrToStdout,
       {kPostinstallStatusFd},
       base::Bind(&PostinstallRunnerAction::CompletePartitionPostinstall,
-                 base::Unretained(this)));
+                 base::Unretained(this),
+                 base::Unretained(run)));
   // Subprocess::Exec should never return a negative process id.
-  CHECK_GE(current_command_, 0);
+  CHECK_GE(run->command, 0);
 
-  if (!current_command_) {
-    CompletePartitionPostinstall(1, "Postinstall didn't launch");
-    return;
+  if (!run->command) {
+    LOG(ERROR) << "Postinstall didn't launch";
+    ErrorCode error_code = FinishRun(run, 1);
+    if (error_code != ErrorCode::kSuccess) {
+      CompletePostinstall(error_code);
+      return false;
+    }
+    return true;
   }
 
   // Monitor the status file descriptor.
-  progress_fd_ =
-      Subprocess::Get().GetPipeFd(current_command_, kPostinstallStatusFd);
-  int fd_flags = fcntl(progress_fd_, F_GETFL, 0) | O_NONBLOCK;
-  if (HANDLE_EINTR(fcntl(progress_fd_, F_SETFL, fd_flags)) < 0) {
-    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd " << progress_fd_;
+  run->progress_fd =
+      Subprocess::Get().GetPipeFd(run->command, kPostinstallStatusFd);
+  int fd_flags = fcntl(run->progress_fd, F_GETFL, 0) | O_NONBLOCK;
+  if (HANDLE_EINTR(fcntl(run->progress_fd, F_SETFL, fd_flags)) < 0) {
+    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd "
+                << run->progress_fd;
   }
 
-  progress_controller_ = base::FileDescriptorWatcher::WatchReadable(
-      progress_fd_,
+  run->progress_controller = base::FileDescriptorWatcher::WatchReadable(
+      run->progress_fd,
       base::BindRepeating(&PostinstallRunnerAction::OnProgressFdReady,
-                          base::Unretained(this)));
+                          base::Unretained(this),
+                          base::Unretained(run)));
+  return true;
 }
 
-void PostinstallRunnerAction::OnProgressFdReady() {
+void PostinstallRunnerAction::OnProgressFdReady(PostinstallRun* run) {
   char buf[1024];
   size_t bytes_read;
   do {
     bytes_read = 0;
     bool eof;
-    bool ok =
-        utils::ReadAll(progress_fd_, buf, base::size(buf), &bytes_read, &eof);
-    progress_buffer_.append(buf, bytes_read);
+    bool ok = utils::ReadAll(
+        run->progress_fd, buf, base::size(buf), &bytes_read, &eof);
+    run->progress_buffer.append(buf, bytes_read);
     // Process every line.
-    vector<string> lines = base::SplitString(
-        progress_buffer_, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
+    vector<string> lines = base::SplitString(run->progress_buffer,
+                                             "\n",
+                                             base::KEEP_WHITESPACE,
+                                             base::SPLIT_WANT_ALL);
     if (!lines.empty()) {
-      progress_buffer_ = lines.back();
+      run->progress_buffer = lines.back();
       lines.pop_back();
       for (const auto& line : lines) {
-        ProcessProgressLine(line);
+        ProcessProgressLine(run, line);
       }
     }
     if (!ok || eof) {
       // There was either an error or an EOF condition, so we are done watching
       // the file descriptor.
-      progress_controller_.reset();
+      run->progress_controller.reset();
       return;
     }
   } while (bytes_read);
 }
 
-bool PostinstallRunnerAction::ProcessProgressLine(const string& line) {
+bool PostinstallRunnerAction::ProcessProgressLine(PostinstallRun* run,
+                                                  const string& line) {
   double frac = 0;
   if (sscanf(line.c_str(), "global_progress %lf", &frac) == 1 &&
       !std::isnan(frac)) {
-    ReportProgress(frac);
+    if (!std::isfinite(frac) || frac < 0)
+      frac = 0;
+    if (frac > 1)
+      frac = 1;
+    run->progress = frac;
+    ReportProgress();
     return true;
   }
 
   return false;
 }
 
-void PostinstallRunnerAction::ReportProgress(double frac) {
+void PostinstallRunnerAction::ReportProgress() {
   if (!delegate_)
     return;
-  if (current_partition_ >= partition_weight_.size() || total_weight_ == 0) {
+  if (total_weight_ == 0) {
     delegate_->ProgressUpdate(1.);
     return;
   }
-  if (!std::isfinite(frac) || frac < 0)
-    frac = 0;
-  if (frac > 1)
-    frac = 1;
-  double postinst_action_progress =
-      (accumulated_weight_ + partition_weight_[current_partition_] * frac) /
-      total_weight_;
-  delegate_->ProgressUpdate(postinst_action_progress);
+  double weight = accumulated_weight_;
+  for (const auto& run : runs_) {
+    weight += partition_weight_[run->partition] * run->progress;
+  }
+  delegate_->ProgressUpdate(weight / total_weight_);
 }
 
-void PostinstallRunnerAction::Cleanup() {
-  utils::UnmountFilesystem(fs_mount_dir_);
-#ifndef __ANDROID__
-#if BASE_VER < 800000
-  if (!base::DeleteFile(base::FilePath(fs_mount_dir_), true)) {
-#else
-  if (!base::DeleteFile(base::FilePath(fs_mount_dir_))) {
-#endif
-    PLOG(WARNING) << "Not removing temporary mountpoint " << fs_mount_dir_;
-  }
-#endif
+void PostinstallRunnerAction::Cleanup(PostinstallRun* run) {
+  utils::UnmountFilesystem(run->mount_dir);
+  free_mount_dirs_.push_back(run->mount_dir);
 
-  progress_fd_ = -1;
-  progress_controller_.reset();
+  run->progress_fd = -1;
+  run->progress_controller.reset();
 
-  progress_buffer_.clear();
+  run->progress_buffer.clear();
 }
 
-void PostinstallRunnerAction::CompletePartitionPostinstall(
-    int return_code, const string& output) {
-  current_command_ = 0;
-  Cleanup();
-
-  if (return_code != 0) {
-    LOG(ERROR) << "Postinst command failed with code: " << return_code;
-    ErrorCode error_code = ErrorCode::kPostinstallRunnerError;
-
-    if (return_code == 3) {
-      // This special return code means that we tried to update firmware,
-      // but couldn't because we booted from FW B, and we need to reboot
-      // to get back to FW A.
-      error_code = ErrorCode::kPostinstallBootedFromFirmwareB;
-    }
+ErrorCode PostinstallRunnerAction::FinishRun(PostinstallRun* run,
+                                             int return_code) {
+  const size_t index = run->partition;
+  Cleanup(run);
+  runs_.erase(std::find_if(runs_.begin(), runs_.end(), [run](const auto& r) {
+    return r.get() == run;
+  }));
+  accumulated_weight_ += partition_weight_[index];
+
+  if (return_code == 0) {
+    SavePostinstallDone(install_plan_.partitions[index]);
+    return ErrorCode::kSuccess;
+  }
 
-    if (return_code == 4) {
-      // This special return code means that we tried to update firmware,
-      // but couldn't because we booted from FW B, and we need to reboot
-      // to get back to FW A.
-      error_code = ErrorCode::kPostinstallFirmwareRONotUpdatable;
+  LOG(ERROR) << "Postinst command failed with code: " << return_code;
+  ErrorCode error_code = ErrorCode::kPostinstallRunnerError;
+
+  if (return_code == 3) {
+    // This special return code means that we tried to update firmware,
+    // but couldn't because we booted from FW B, and we need to reboot
+    // to get back to FW A.
+    error_code = ErrorCode::kPostinstallBootedFromFirmwareB;
+  }
+
+  if (return_code == 4) {
+    // This special return code means that we tried to update firmware,
+    // but couldn't because we booted from FW B, and we need to reboot
+    // to get back to FW A.
+    error_code = ErrorCode::kPostinstallFirmwareRONotUpdatable;
+  }
+
+  // If postinstall script for this partition is optional we can ignore the
+  // result.
+  if (install_plan_.partitions[index].postinstall_optional) {
+    LOG(INFO) << "Ignoring postinstall failure since it is optional";
+    return ErrorCode::kSuccess;
+  }
+  return error_code;
+}
+
+void PostinstallRunnerAction::StopRuns() {
+  for (const auto& run : runs_) {
+    if (run->command) {
+      // Calling KillExec() will discard the callback we registered and
+      // therefore the unretained reference to this object.
+      Subprocess::Get().KillExec(run->command);
+
+      // If the command has been suspended, resume it after KillExec() so that
+      // the process can process the SIGTERM sent by KillExec().
+      if (run->suspended && kill(run->command, SIGCONT) != 0) {
+        PLOG(ERROR) << "Couldn't resume child process " << run->command;
+      }
+      run->command = 0;
     }
+    Cleanup(run.get());
+  }
+  runs_.clear();
+}
 
-    // If postinstall script for this partition is optional we can ignore the
-    // result.
-    if (install_plan_.partitions[current_partition_].postinstall_optional) {
-      LOG(INFO) << "Ignoring postinstall failure since it is optional";
-    } else {
-      return CompletePostinstall(error_code);
+void PostinstallRunnerAction::RemoveMountDirs() {
+#ifndef __ANDROID__
+  extra_mount_dirs_.push_back(fs_mount_dir_);
+  for (const auto& mount_dir : extra_mount_dirs_) {
+#if BASE_VER < 800000
+    if (!base::DeleteFile(base::FilePath(mount_dir), true)) {
+#else
+    if (!base::DeleteFile(base::FilePath(mount_dir))) {
+#endif
+      PLOG(WARNING) << "Not removing temporary mountpoint " << mount_dir;
     }
   }
-  accumulated_weight_ += partition_weight_[current_partition_];
-  current_partition_++;
-  ReportProgress(0);
+  extra_mount_dirs_.clear();
+  free_mount_dirs_.clear();
+#endif  // __ANDROID__
+}
+
+void PostinstallRunnerAction::CompletePartitionPostinstall(
+    PostinstallRun* run, int return_code, const string& output) {
+  run->command = 0;
+  ErrorCode error_code = FinishRun(run, return_code);
+  if (error_code != ErrorCode::kSuccess)
+    return CompletePostinstall(error_code);
+  ReportProgress();
 
   PerformPartitionPostinstall();
 }
 
 void PostinstallRunnerAction::CompletePostinstall(ErrorCode error_code) {
+  StopRuns();
+  RemoveMountDirs();
+
   // We only attempt to mark the new slot as active if all the postinstall
   // steps succeeded.
   if (error_code == ErrorCode::kSuccess) {
@@ -544,40 +694,34 @@ void PostinstallRunnerAction::CompletePostinstall(ErrorCode error_code) {
 }
 
 void PostinstallRunnerAction::SuspendAction() {
-  if (!current_command_)
-    return;
-  if (kill(current_command_, SIGSTOP) != 0) {
-    PLOG(ERROR) << "Couldn't pause child process " << current_command_;
-  } else {
-    is_current_command_suspended_ = true;
+  for (const auto& run : runs_) {
+    if (!run->command)
+      continue;
+    if (kill(run->command, SIGSTOP) != 0) {
+      PLOG(ERROR) << "Couldn't pause child process " << run->command;
+    } else {
+      run->suspended = true;
+    }
   }
 }
 
 void PostinstallRunnerAction::ResumeAction() {
-  if (!current_command_)
-    return;
-  if (kill(current_command_, SIGCONT) != 0) {
-    PLOG(ERROR) << "Couldn't resume child process " << current_command_;
-  } else {
-    is_current_command_suspended_ = false;
+  for (const auto& run : runs_) {
+    if (!run->command)
+      continue;
+    if (kill(run->command, SIGCONT) != 0) {
+      PLOG(ERROR) << "Couldn't resume child process " << run->command;
+    } else {
+      run->suspended = false;
+    }
   }
 }
 
 void PostinstallRunnerAction::TerminateProcessing() {
-  if (!current_command_)
+  if (runs_.empty())
     return;
-  // Calling KillExec() will discard the callback we registered and therefore
-  // the unretained reference to this object.
-  Subprocess::Get().KillExec(current_command_);
-
-  // If the command has been suspended, resume it after KillExec() so that the
-  // process can process the SIGTERM sent by KillExec().
-  if (is_current_command_suspended_) {
-    ResumeAction();
-  }
-
-  current_command_ = 0;
-  Cleanup();
+  StopRuns();
+  RemoveMountDirs();
 }
 
 }  // namespace chromeos_update_engine
@@ -29,6 +29,7 @@
 #include "update_engine/common/action.h"
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/hardware_interface.h"
+#include "update_engine/common/prefs_interface.h"
 #include "update_engine/payload_consumer/install_plan.h"
 
 // The Postinstall Runner Action is responsible for running the postinstall
@@ -40,8 +41,11 @@ class BootControlInterface;
 
 class PostinstallRunnerAction : public InstallPlanAction {
  public:
+  // The postinstall programs that succeeded are recorded in |prefs|, if any,
+  // so that they aren't run again when the update is resumed.
   PostinstallRunnerAction(BootControlInterface* boot_control,
-                          HardwareInterface* hardware);
+                          HardwareInterface* hardware,
+                          PrefsInterface* prefs);
 
   // InstallPlanAction overrides.
   void PerformAction() override;
@@ -68,36 +72,92 @@ class PostinstallRunnerAction : public InstallPlanAction {
   friend class PostinstallRunnerActionTest;
   FRIEND_TEST(PostinstallRunnerActionTest, ProcessProgressLineTest);
 
+  // A postinstall program running for a partition.
+  struct PostinstallRun {
+    // The index of the partition in the InstallPlan.
+    size_t partition{0};
+
+    // The path where the partition is mounted.
+    std::string mount_dir;
+
+    // The postinstall command, or 0 if it isn't running.
+    pid_t command{0};
+
+    // True if |command| has been suspended by SuspendAction().
+    bool suspended{false};
+
+    // The parent progress file descriptor used to watch for progress reports
+    // from the postinstall program and the task watching for them.
+    int progress_fd{-1};
+    std::unique_ptr<base::FileDescriptorWatcher::Controller>
+        progress_controller;
+
+    // A buffer of a partial read line from the progress file descriptor.
+    std::string progress_buffer;
+
+    // The last progress reported by the program, between 0 and 1.
+    double progress{0};
+  };
+
   // exposed for testing purposes only
   void SetMountDir(std::string dir) { fs_mount_dir_ = std::move(dir); }
-  void EnsureUnmounted();
+  void EnsureUnmounted(const std::string& mount_dir);
 
+  // Starts the postinstall of the next partitions, as many as can run at the
+  // same time, or completes the action once they are all done.
   void PerformPartitionPostinstall();
-  [[nodiscard]] bool MountPartition(
-      const InstallPlan::Partition& partition) noexcept;
+  [[nodiscard]] bool MountPartition(const InstallPlan::Partition& partition,
+                                    const std::string& mount_dir) noexcept;
+
+  // Whether the postinstall of |partition| already succeeded for its target
+  // hash, as recorded by SavePostinstallDone().
+  bool IsPostinstallDone(const InstallPlan::Partition& partition) const;
+  void SavePostinstallDone(const InstallPlan::Partition& partition);
+
+  // Whether the postinstall of |partition| can start alongside the running
+  // ones. Only the optional postinstall programs, which don't depend on the
+  // others, run alongside another one, and only on a mount point of their own.
+  bool CanStartPostinstall(const InstallPlan::Partition& partition);
+
+  // Mounts the partition at |index| in the InstallPlan and starts its
+  // postinstall program. Returns false if the action was completed because of
+  // an error.
+  bool StartPartitionPostinstall(size_t index);
 
-  // Called whenever the |progress_fd_| has data available to read.
-  void OnProgressFdReady();
+  // Called whenever the |progress_fd| of |run| has data available to read.
+  void OnProgressFdReady(PostinstallRun* run);
 
-  // Updates the action progress according to the |line| passed from the
+  // Updates the progress of |run| according to the |line| passed from its
   // postinstall program. Valid lines are:
   //     global_progress <frac>
   //         <frac> should be between 0.0 and 1.0; sets the progress to the
   //         <frac> value.
-  bool ProcessProgressLine(const std::string& line);
+  bool ProcessProgressLine(PostinstallRun* run, const std::string& line);
 
-  // Report the progress to the delegate given that the postinstall operation
-  // for |current_partition_| has a current progress of |frac|, a value between
-  // 0 and 1 for that step.
-  void ReportProgress(double frac);
+  // Report the overall progress to the delegate, from the partitions done and
+  // the progress of the running ones.
+  void ReportProgress();
 
   // Cleanup the setup made when running postinstall for a given partition.
-  // Unmount and remove the mountpoint directory if needed and cleanup the
-  // status file descriptor and message loop task watching for it.
-  void Cleanup();
+  // Unmount the partition, free its mountpoint and cleanup the status file
+  // descriptor and message loop task watching for it.
+  void Cleanup(PostinstallRun* run);
+
+  // Cleans up and removes |run|, whose program exited with |return_code|.
+  // Returns the error for that code, or kSuccess if the program succeeded or
+  // is optional.
+  ErrorCode FinishRun(PostinstallRun* run, int return_code);
+
+  // Kills the running postinstall programs and cleans them up.
+  void StopRuns();
+
+  // Removes the temporary mountpoint directories, when not on Android.
+  void RemoveMountDirs();
 
   // Subprocess::Exec callback.
-  void CompletePartitionPostinstall(int return_code, const std::string& output);
+  void CompletePartitionPostinstall(PostinstallRun* run,
+                                    int return_code,
+                                    const std::string& output);
 
   // Complete the Action with the passed |error_code| and mark the new slot as
   // ready. Called when the post-install script was run for all the partitions.
@@ -106,9 +166,17 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // The path where the filesystem will be mounted during post-install.
   std::string fs_mount_dir_;
 
-  // The partition being processed on the list of partitions specified in the
+  // The mountpoints not used by a running postinstall, and the ones created
+  // besides |fs_mount_dir_| to run several postinstall programs at once.
+  std::vector<std::string> free_mount_dirs_;
+  std::vector<std::string> extra_mount_dirs_;
+
+  // The next partition to process on the list of partitions specified in the
   // InstallPlan.
-  size_t current_partition_{0};
+  size_t next_partition_{0};
+
+  // The postinstall programs running.
+  std::vector<std::unique_ptr<PostinstallRun>> runs_;
 
   // A non-negative value representing the estimated weight of each partition
   // passed in the install plan. The weight is used to predict the overall
@@ -119,8 +187,8 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // The sum of all the weights in |partition_weight_|.
   double total_weight_{0};
 
-  // The sum of all the weights in |partition_weight_| up to but not including
-  // the |current_partition_|.
+  // The sum of the weights in |partition_weight_| of the partitions whose
+  // postinstall is done.
   double accumulated_weight_{0};
 
   // The delegate used to notify of progress updates, if any.
@@ -132,25 +200,13 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // HardwareInterface used to signal powerwash.
   HardwareInterface* hardware_;
 
+  // The prefs where the partitions post-installed are recorded, if any.
+  PrefsInterface* prefs_;
+
   // Whether the Powerwash was scheduled before invoking post-install script.
   // Used for cleaning up if post-install fails.
   bool powerwash_scheduled_{false};
 
-  // Postinstall command currently running, or 0 if no program running.
-  pid_t current_command_{0};
-
-  // True if |current_command_| has been suspended by SuspendAction().
-  bool is_current_command_suspended_{false};
-
-  // The parent progress file descriptor used to watch for progress reports from
-  // the postinstall program and the task watching for them.
-  int progress_fd_{-1};
-
-  std::unique_ptr<base::FileDescriptorWatcher::Controller> progress_controller_;
-
-  // A buffer of a partial read line from the progress file descriptor.
-  std::string progress_buffer_;
-
   DISALLOW_COPY_AND_ASSIGN(PostinstallRunnerAction);
 };
 
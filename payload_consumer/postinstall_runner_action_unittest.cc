@@ -42,6 +42,7 @@
 #include "update_engine/common/constants.h"
 #include "update_engine/common/fake_boot_control.h"
 #include "update_engine/common/fake_hardware.h"
+#include "update_engine/common/fake_prefs.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
@@ -110,16 +111,22 @@ class PostinstallRunnerActionTest : public ::testing::Test {
   void RunPostinstallActionWithInstallPlan(const InstallPlan& install_plan);
 
  public:
+  // The command of the first running postinstall, or 0 if none is running.
+  pid_t RunningCommand() const {
+    if (!postinstall_action_ || postinstall_action_->runs_.empty())
+      return 0;
+    return postinstall_action_->runs_.front()->command;
+  }
+
   void ResumeRunningAction() {
     ASSERT_NE(nullptr, postinstall_action_);
     postinstall_action_->ResumeAction();
   }
 
   void SuspendRunningAction() {
-    if (!postinstall_action_ || !postinstall_action_->current_command_ ||
+    if (!RunningCommand() ||
         test_utils::Readlink(base::StringPrintf(
-            "/proc/%d/fd/0", postinstall_action_->current_command_)) !=
-            "/dev/zero") {
+            "/proc/%d/fd/0", RunningCommand())) != "/dev/zero") {
       // We need to wait for the postinstall command to start and flag that it
       // is ready by redirecting its input to /dev/zero.
       loop_.PostDelayedTask(
@@ -139,7 +146,7 @@ class PostinstallRunnerActionTest : public ::testing::Test {
   }
 
   void CancelWhenStarted() {
-    if (!postinstall_action_ || !postinstall_action_->current_command_) {
+    if (!RunningCommand()) {
       // Wait for the postinstall command to run.
       loop_.PostDelayedTask(
           FROM_HERE,
@@ -175,6 +182,7 @@ class PostinstallRunnerActionTest : public ::testing::Test {
 
   FakeBootControl fake_boot_control_;
   FakeHardware fake_hardware_;
+  FakePrefs fake_prefs_;
   PostinstActionProcessorDelegate processor_delegate_;
 
   // The PostinstallRunnerAction delegate receiving the progress updates.
@@ -213,7 +221,7 @@ void PostinstallRunnerActionTest::RunPostinstallActionWithInstallPlan(
   auto feeder_action = std::make_unique<ObjectFeederAction<InstallPlan>>();
   feeder_action->set_obj(install_plan);
   auto runner_action = std::make_unique<PostinstallRunnerAction>(
-      &fake_boot_control_, &fake_hardware_);
+      &fake_boot_control_, &fake_hardware_, &fake_prefs_);
   postinstall_action_ = runner_action.get();
   base::FilePath temp_dir;
   TEST_AND_RETURN(base::CreateNewTempDirectory("postinstall", &temp_dir));
@@ -246,32 +254,47 @@ void PostinstallRunnerActionTest::RunPostinstallActionWithInstallPlan(
 }
 
 TEST_F(PostinstallRunnerActionTest, ProcessProgressLineTest) {
-  PostinstallRunnerAction action(&fake_boot_control_, &fake_hardware_);
+  PostinstallRunnerAction action(
+      &fake_boot_control_, &fake_hardware_, &fake_prefs_);
   testing::StrictMock<MockPostinstallRunnerActionDelegate> mock_delegate_;
   action.set_delegate(&mock_delegate_);
 
-  action.current_partition_ = 1;
+  action.runs_.push_back(
+      std::make_unique<PostinstallRunnerAction::PostinstallRun>());
+  auto* run = action.runs_.back().get();
+  run->partition = 1;
   action.partition_weight_ = {1, 2, 5};
   action.accumulated_weight_ = 1;
   action.total_weight_ = 8;
 
   // 50% of the second action is 2/8 = 0.25 of the total.
   EXPECT_CALL(mock_delegate_, ProgressUpdate(0.25));
-  action.ProcessProgressLine("global_progress 0.5");
+  action.ProcessProgressLine(run, "global_progress 0.5");
   testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
 
   // 1.5 should be read as 100%, to catch rounding error cases like 1.000001.
   // 100% of the second is 3/8 of the total.
   EXPECT_CALL(mock_delegate_, ProgressUpdate(0.375));
-  action.ProcessProgressLine("global_progress 1.5");
+  action.ProcessProgressLine(run, "global_progress 1.5");
+  testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
+
+  // The progress of the other running partitions adds up: 50% of the third
+  // one is 2.5/8 more.
+  action.runs_.push_back(
+      std::make_unique<PostinstallRunnerAction::PostinstallRun>());
+  auto* other_run = action.runs_.back().get();
+  other_run->partition = 2;
+  EXPECT_CALL(mock_delegate_, ProgressUpdate(0.6875));
+  action.ProcessProgressLine(other_run, "global_progress 0.5");
   testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
 
   // None of these should trigger a progress update.
-  action.ProcessProgressLine("foo_bar");
-  action.ProcessProgressLine("global_progress");
-  action.ProcessProgressLine("global_progress ");
-  action.ProcessProgressLine("global_progress NaN");
-  action.ProcessProgressLine("global_progress Exception in ... :)");
+  action.ProcessProgressLine(run, "foo_bar");
+  action.ProcessProgressLine(run, "global_progress");
+  action.ProcessProgressLine(run, "global_progress ");
+  action.ProcessProgressLine(run, "global_progress NaN");
+  action.ProcessProgressLine(run, "global_progress Exception in ... :)");
+  action.runs_.clear();
 }
 
 // Test that postinstall succeeds in the simple case of running the default
@@ -289,6 +312,33 @@ TEST_F(PostinstallRunnerActionTest, RunAsRootSimpleTest) {
   EXPECT_FALSE(fake_hardware_.GetIsRollbackPowerwashScheduled());
 }
 
+// Check that a partition already post-installed isn't run again when the
+// update is resumed, unless its target hash changed.
+TEST_F(PostinstallRunnerActionTest, RunAsRootSkipPostinstallDoneTest) {
+  ScopedLoopbackDeviceBinder loop(postinstall_image_, false, nullptr);
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.target_path = loop.dev();
+  part.readonly_target_path = loop.dev();
+  part.run_postinstall = true;
+  part.postinstall_path = kPostinstallDefaultScript;
+  part.target_hash = {0x12, 0x34};
+  InstallPlan install_plan;
+  install_plan.partitions = {part};
+  install_plan.download_url = "http://127.0.0.1:8080/update";
+  RunPostinstallActionWithInstallPlan(install_plan);
+  EXPECT_EQ(ErrorCode::kSuccess, processor_delegate_.code_);
+
+  // The failing program isn't run, the partition is already done.
+  install_plan.partitions[0].postinstall_path = "bin/postinst_fail1";
+  RunPostinstallActionWithInstallPlan(install_plan);
+  EXPECT_EQ(ErrorCode::kSuccess, processor_delegate_.code_);
+
+  install_plan.partitions[0].target_hash = {0x56, 0x78};
+  RunPostinstallActionWithInstallPlan(install_plan);
+  EXPECT_EQ(ErrorCode::kPostinstallRunnerError, processor_delegate_.code_);
+}
+
 TEST_F(PostinstallRunnerActionTest, RunAsRootRunSymlinkFileTest) {
   ScopedLoopbackDeviceBinder loop(postinstall_image_, false, nullptr);
   RunPostinstallAction(loop.dev(), "bin/postinst_link", false, false, false);
@@ -378,6 +428,29 @@ TEST_F(PostinstallRunnerActionTest, RunAsRootSkipOptionalPostinstallTest) {
   EXPECT_EQ(ErrorCode::kPostinstallRunnerError, processor_delegate_.code_);
 }
 
+#ifndef __ANDROID__
+// Check that an optional postinstall runs alongside the required one, from
+// another mount point.
+TEST_F(PostinstallRunnerActionTest, RunAsRootConcurrentOptionalTest) {
+  ScopedLoopbackDeviceBinder loop(postinstall_image_, false, nullptr);
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.target_path = loop.dev();
+  part.readonly_target_path = loop.dev();
+  part.run_postinstall = true;
+  part.postinstall_path = kPostinstallDefaultScript;
+  InstallPlan::Partition optional_part = part;
+  optional_part.name = "optional_part";
+  optional_part.postinstall_optional = true;
+  InstallPlan install_plan;
+  install_plan.partitions = {part, optional_part};
+  install_plan.download_url = "http://127.0.0.1:8080/update";
+
+  RunPostinstallActionWithInstallPlan(install_plan);
+  EXPECT_EQ(ErrorCode::kSuccess, processor_delegate_.code_);
+}
+#endif  // __ANDROID__
+
 // Check that the failures from the postinstall script cause the action to
 // fail.
 TEST_F(PostinstallRunnerActionTest, RunAsRootErrScriptTest) {
@@ -0,0 +1,120 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/read_planner.h"
+
+#include <limits.h>
+
+#include <algorithm>
+#include <numeric>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+#ifdef IOV_MAX
+constexpr size_t kMaxIovecs = IOV_MAX;
+#else
+constexpr size_t kMaxIovecs = 1024;
+#endif
+
+// Destination of the holes between merged requests. Only the kernel writes to
+// it and nothing reads it back, so it is shared by all the reads in flight.
+uint8_t gap_buffer[kMaxReadGap];
+}  // namespace
+
+void CoalescedRead::Advance(size_t bytes) {
+  CHECK_LE(bytes, count);
+  offset += bytes;
+  count -= bytes;
+  while (bytes > 0) {
+    iovec& vec = iovecs[first_iovec];
+    if (bytes < vec.iov_len) {
+      vec.iov_base = static_cast<uint8_t*>(vec.iov_base) + bytes;
+      vec.iov_len -= bytes;
+      break;
+    }
+    bytes -= vec.iov_len;
+    first_iovec++;
+  }
+}
+
+std::vector<CoalescedRead> PlanReads(
+    const std::vector<FileDescriptor::ReadRequest>& requests,
+    size_t max_gap) {
+  max_gap = std::min(max_gap, kMaxReadGap);
+
+  std::vector<size_t> order(requests.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&requests](size_t a, size_t b) {
+    return requests[a].offset < requests[b].offset;
+  });
+
+  std::vector<CoalescedRead> reads;
+  for (size_t index : order) {
+    const auto& request = requests[index];
+    if (request.count == 0) {
+      continue;
+    }
+    CoalescedRead* read = reads.empty() ? nullptr : &reads.back();
+    if (read) {
+      const uint64_t end = read->offset + read->count;
+      const uint64_t gap = request.offset - end;
+      if (request.offset < end || gap > max_gap ||
+          read->count + gap + request.count > kMaxCoalescedReadSize ||
+          read->iovecs.size() + 2 > kMaxIovecs) {
+        read = nullptr;
+      } else if (gap > 0) {
+        read->iovecs.push_back({gap_buffer, gap});
+        read->count += gap;
+        read->gap_bytes += gap;
+      }
+    }
+    if (!read) {
+      reads.emplace_back();
+      read = &reads.back();
+      read->offset = request.offset;
+    }
+    iovec& last = read->iovecs.empty() ? read->iovecs.emplace_back()
+                                       : read->iovecs.back();
+    if (last.iov_len == 0) {
+      last = {request.buffer, request.count};
+    } else if (last.iov_base != gap_buffer &&
+               static_cast<uint8_t*>(last.iov_base) + last.iov_len ==
+                   request.buffer) {
+      // Contiguous in the file and in memory, extend the last vector.
+      last.iov_len += request.count;
+    } else {
+      read->iovecs.push_back({request.buffer, request.count});
+    }
+    read->count += request.count;
+  }
+  return reads;
+}
+
+std::vector<CoalescedRead> PlanWrites(
+    const std::vector<FileDescriptor::WriteRequest>& requests) {
+  std::vector<FileDescriptor::ReadRequest> ranges;
+  ranges.reserve(requests.size());
+  for (const auto& request : requests) {
+    ranges.push_back(
+        {request.offset, const_cast<void*>(request.buffer), request.count});
+  }
+  return PlanReads(ranges, 0);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,71 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_READ_PLANNER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_READ_PLANNER_H_
+
+#include <sys/uio.h>
+
+#include <vector>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// The largest hole between two requests that PlanReads() reads and discards
+// to merge them into a single read.
+constexpr size_t kMaxReadGap = 16 * 1024;
+
+// The most bytes a single CoalescedRead covers, so one read doesn't hold up
+// the others in a batch for too long.
+constexpr size_t kMaxCoalescedReadSize = 4 * 1024 * 1024;
+
+// A single vectored read of a contiguous range of the file, scattering it into
+// the buffers of one or more ReadRequests.
+struct CoalescedRead {
+  // Moves the start of the read forward by |bytes|, after a short read.
+  void Advance(size_t bytes);
+
+  // The vectors left to read into, for preadv() and friends.
+  const iovec* iov() const { return iovecs.data() + first_iovec; }
+  int iovcnt() const { return iovecs.size() - first_iovec; }
+
+  uint64_t offset{0};
+  // Bytes left to read, including |gap_bytes|.
+  size_t count{0};
+  // Bytes read only to fill the holes between the requests.
+  size_t gap_bytes{0};
+  std::vector<iovec> iovecs;
+  size_t first_iovec{0};
+};
+
+// Turns |requests| into as few reads as possible: requests are sorted by
+// offset, and merged while they are at most |max_gap| bytes apart (capped at
+// kMaxReadGap) and don't overlap. The holes are read into a scratch buffer
+// nobody looks at.
+std::vector<CoalescedRead> PlanReads(
+    const std::vector<FileDescriptor::ReadRequest>& requests,
+    size_t max_gap = kMaxReadGap);
+
+// Plans |requests| the same way for pwritev() and friends, without any hole:
+// only the requests contiguous in the file are merged. The vectors point to
+// the buffers of the requests, which are only read.
+std::vector<CoalescedRead> PlanWrites(
+    const std::vector<FileDescriptor::WriteRequest>& requests);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_READ_PLANNER_H_
@@ -0,0 +1,180 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Compares reading fragmented extents one at a time against the batched
+// ReadBatch() paths, over a few synthetic fragmentation patterns.
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+#include "update_engine/payload_consumer/read_planner.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+constexpr uint64_t kNumBlocks = 16 * 1024;
+
+enum Pattern {
+  // One large extent.
+  kContiguous,
+  // Every other block, so no two extents touch.
+  kAlternating,
+  // Runs of 7 blocks separated by single block holes.
+  kSmallHoles,
+  // A random half of the blocks, in random order like the src_extents of a
+  // SOURCE_BSDIFF operation.
+  kRandom,
+};
+
+std::vector<Extent> MakeExtents(Pattern pattern) {
+  ExtentRanges ranges;
+  std::mt19937 rng(42);
+  switch (pattern) {
+    case kContiguous:
+      ranges.AddExtent(ExtentForRange(0, kNumBlocks));
+      break;
+    case kAlternating:
+      for (uint64_t block = 0; block < kNumBlocks; block += 2) {
+        ranges.AddBlock(block);
+      }
+      break;
+    case kSmallHoles:
+      ranges.AddExtent(ExtentForRange(0, kNumBlocks));
+      for (uint64_t block = 7; block < kNumBlocks; block += 8) {
+        ranges.SubtractBlock(block);
+      }
+      break;
+    case kRandom:
+      for (uint64_t block = 0; block < kNumBlocks; block++) {
+        if (rng() % 2) {
+          ranges.AddBlock(block);
+        }
+      }
+      break;
+  }
+  auto extents = ranges.GetExtentsForBlockCount(ranges.blocks());
+  if (pattern == kRandom) {
+    std::shuffle(extents.begin(), extents.end(), rng);
+  }
+  return extents;
+}
+
+class ReadPlannerBenchmark : public benchmark::Fixture {
+ public:
+  void SetUp(const benchmark::State& state) override {
+    file_ = std::make_unique<ScopedTempFile>("read_planner_bench.XXXXXX");
+    brillo::Blob data(kNumBlocks * kBlockSize);
+    std::mt19937 rng(0);
+    std::generate(data.begin(), data.end(), rng);
+    CHECK(utils::WriteFile(file_->path().c_str(), data.data(), data.size()));
+    extents_ = MakeExtents(static_cast<Pattern>(state.range(0)));
+    bytes_ = utils::BlocksInExtents(extents_) * kBlockSize;
+  }
+
+  void TearDown(const benchmark::State& state) override { file_.reset(); }
+
+ protected:
+  template <typename FD>
+  FileDescriptorPtr OpenFile() {
+    FileDescriptorPtr fd = std::make_shared<FD>();
+    CHECK(fd->Open(file_->path().c_str(), O_RDONLY));
+    return fd;
+  }
+
+  std::unique_ptr<ScopedTempFile> file_;
+  std::vector<Extent> extents_;
+  uint64_t bytes_{0};
+};
+
+// The behavior before ReadBatch(): one PReadAll() per extent.
+BENCHMARK_DEFINE_F(ReadPlannerBenchmark, PerExtentPRead)
+(benchmark::State& state) {
+  auto fd = OpenFile<EintrSafeFileDescriptor>();
+  brillo::Blob data(bytes_);
+  for (auto _ : state) {
+    uint8_t* out = data.data();
+    for (const auto& extent : extents_) {
+      ssize_t bytes_read = 0;
+      const size_t count = extent.num_blocks() * kBlockSize;
+      CHECK(utils::PReadAll(
+          fd, out, count, extent.start_block() * kBlockSize, &bytes_read));
+      out += count;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * bytes_);
+}
+
+BENCHMARK_DEFINE_F(ReadPlannerBenchmark, PlanReads)(benchmark::State& state) {
+  brillo::Blob data(bytes_);
+  std::vector<FileDescriptor::ReadRequest> requests;
+  uint8_t* out = data.data();
+  for (const auto& extent : extents_) {
+    const size_t count = extent.num_blocks() * kBlockSize;
+    requests.push_back({extent.start_block() * kBlockSize, out, count});
+    out += count;
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(PlanReads(requests));
+  }
+  state.counters["reads"] = PlanReads(requests).size();
+}
+
+BENCHMARK_DEFINE_F(ReadPlannerBenchmark, ReadExtentsPreadv)
+(benchmark::State& state) {
+  auto fd = OpenFile<EintrSafeFileDescriptor>();
+  brillo::Blob data;
+  for (auto _ : state) {
+    CHECK(utils::ReadExtents(fd, extents_, &data, bytes_, kBlockSize));
+  }
+  state.SetBytesProcessed(state.iterations() * bytes_);
+}
+
+BENCHMARK_DEFINE_F(ReadPlannerBenchmark, ReadExtentsIoUring)
+(benchmark::State& state) {
+  auto fd = OpenFile<IoUringFileDescriptor>();
+  brillo::Blob data;
+  for (auto _ : state) {
+    CHECK(utils::ReadExtents(fd, extents_, &data, bytes_, kBlockSize));
+  }
+  state.SetBytesProcessed(state.iterations() * bytes_);
+}
+
+#define REGISTER_PATTERNS(name)                     \
+  BENCHMARK_REGISTER_F(ReadPlannerBenchmark, name) \
+      ->ArgName("pattern")                          \
+      ->DenseRange(kContiguous, kRandom)
+
+REGISTER_PATTERNS(PerExtentPRead);
+REGISTER_PATTERNS(PlanReads);
+REGISTER_PATTERNS(ReadExtentsPreadv);
+REGISTER_PATTERNS(ReadExtentsIoUring);
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,149 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/read_planner.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+}  // namespace
+
+TEST(ReadPlannerTest, MergesContiguousBuffersTest) {
+  brillo::Blob buffer(3 * kBlockSize);
+  std::vector<FileDescriptor::ReadRequest> requests{
+      {kBlockSize, buffer.data() + kBlockSize, kBlockSize},
+      {0, buffer.data(), kBlockSize},
+      {2 * kBlockSize, buffer.data() + 2 * kBlockSize, kBlockSize}};
+  auto reads = PlanReads(requests);
+  ASSERT_EQ(1u, reads.size());
+  EXPECT_EQ(0u, reads[0].offset);
+  EXPECT_EQ(3 * kBlockSize, reads[0].count);
+  EXPECT_EQ(0u, reads[0].gap_bytes);
+  ASSERT_EQ(1, reads[0].iovcnt());
+  EXPECT_EQ(buffer.data(), reads[0].iov()[0].iov_base);
+  EXPECT_EQ(3 * kBlockSize, reads[0].iov()[0].iov_len);
+}
+
+TEST(ReadPlannerTest, FillsSmallGapsTest) {
+  brillo::Blob buffer(3 * kBlockSize);
+  std::vector<FileDescriptor::ReadRequest> requests{
+      // A hole of one block with the next request, merged.
+      {10 * kBlockSize, buffer.data(), kBlockSize},
+      {12 * kBlockSize, buffer.data() + 2 * kBlockSize, kBlockSize},
+      // Too far from the others.
+      {100 * kBlockSize, buffer.data() + kBlockSize, kBlockSize}};
+  auto reads = PlanReads(requests, kBlockSize);
+  ASSERT_EQ(2u, reads.size());
+  EXPECT_EQ(10 * kBlockSize, reads[0].offset);
+  EXPECT_EQ(3 * kBlockSize, reads[0].count);
+  EXPECT_EQ(kBlockSize, reads[0].gap_bytes);
+  ASSERT_EQ(3, reads[0].iovcnt());
+  EXPECT_EQ(buffer.data() + 2 * kBlockSize, reads[0].iov()[2].iov_base);
+  EXPECT_EQ(100 * kBlockSize, reads[1].offset);
+  EXPECT_EQ(1, reads[1].iovcnt());
+
+  // Without holes allowed, nothing is merged.
+  EXPECT_EQ(3u, PlanReads(requests, 0).size());
+}
+
+TEST(ReadPlannerTest, DoesNotMergeOverlappingRequestsTest) {
+  brillo::Blob buffer(2 * kBlockSize);
+  std::vector<FileDescriptor::ReadRequest> requests{
+      {0, buffer.data(), 2 * kBlockSize},
+      {kBlockSize, buffer.data(), kBlockSize},
+      {0, buffer.data(), 0}};
+  EXPECT_EQ(2u, PlanReads(requests).size());
+}
+
+TEST(ReadPlannerTest, PlanWritesOnlyMergesContiguousRequestsTest) {
+  brillo::Blob buffer(3 * kBlockSize);
+  std::vector<FileDescriptor::WriteRequest> requests{
+      {kBlockSize, buffer.data() + kBlockSize, kBlockSize},
+      {0, buffer.data(), kBlockSize},
+      {3 * kBlockSize, buffer.data() + 2 * kBlockSize, kBlockSize}};
+  auto writes = PlanWrites(requests);
+  ASSERT_EQ(2u, writes.size());
+  EXPECT_EQ(0u, writes[0].offset);
+  EXPECT_EQ(2 * kBlockSize, writes[0].count);
+  EXPECT_EQ(0u, writes[0].gap_bytes);
+  EXPECT_EQ(3 * kBlockSize, writes[1].offset);
+  EXPECT_EQ(kBlockSize, writes[1].count);
+}
+
+TEST(ReadPlannerTest, AdvanceTest) {
+  brillo::Blob buffer(2 * kBlockSize);
+  std::vector<FileDescriptor::ReadRequest> requests{
+      {0, buffer.data() + kBlockSize, kBlockSize},
+      {kBlockSize, buffer.data(), kBlockSize}};
+  auto reads = PlanReads(requests);
+  ASSERT_EQ(1u, reads.size());
+  auto& read = reads[0];
+  ASSERT_EQ(2, read.iovcnt());
+
+  read.Advance(100);
+  EXPECT_EQ(100u, read.offset);
+  EXPECT_EQ(2 * kBlockSize - 100, read.count);
+  ASSERT_EQ(2, read.iovcnt());
+  EXPECT_EQ(buffer.data() + kBlockSize + 100, read.iov()[0].iov_base);
+  EXPECT_EQ(kBlockSize - 100, read.iov()[0].iov_len);
+
+  read.Advance(kBlockSize - 100);
+  ASSERT_EQ(1, read.iovcnt());
+  EXPECT_EQ(buffer.data(), read.iov()[0].iov_base);
+
+  read.Advance(kBlockSize);
+  EXPECT_EQ(0u, read.count);
+  EXPECT_EQ(0, read.iovcnt());
+}
+
+TEST(ReadPlannerTest, ReadBatchScattersDataTest) {
+  ScopedTempFile file("read_planner.XXXXXX");
+  brillo::Blob data(32 * kBlockSize);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i * 13 + i / kBlockSize);
+  }
+  ASSERT_TRUE(utils::WriteFile(file.path().c_str(), data.data(), data.size()));
+
+  // Every other block, read into the buffer in reverse order.
+  brillo::Blob buffer(16 * kBlockSize);
+  std::vector<FileDescriptor::ReadRequest> requests;
+  for (size_t i = 0; i < 16; i++) {
+    requests.push_back({2 * i * kBlockSize,
+                        buffer.data() + (15 - i) * kBlockSize,
+                        kBlockSize});
+  }
+  EintrSafeFileDescriptor fd;
+  ASSERT_TRUE(fd.Open(file.path().c_str(), O_RDONLY));
+  ASSERT_TRUE(fd.ReadBatch(requests));
+  for (size_t i = 0; i < 16; i++) {
+    ASSERT_TRUE(std::equal(data.begin() + 2 * i * kBlockSize,
+                           data.begin() + (2 * i + 1) * kBlockSize,
+                           buffer.begin() + (15 - i) * kBlockSize));
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,220 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_block_cache_file_descriptor.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using google::protobuf::RepeatedPtrField;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr uint16_t kMaxReaders = std::numeric_limits<uint16_t>::max();
+// The most bytes read from the partition at once.
+constexpr size_t kMaxReadSize = 1024 * 1024;
+}  // namespace
+
+SourceBlockCacheFileDescriptor::SourceBlockCacheFileDescriptor(
+    FileDescriptorPtr fd, size_t block_size, size_t max_size)
+    : fd_(std::move(fd)),
+      block_size_(block_size),
+      max_blocks_(max_size / block_size) {}
+
+void SourceBlockCacheFileDescriptor::AddReaders(
+    const RepeatedPtrField<Extent>& extents) {
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole)
+      continue;
+    const uint64_t end = extent.start_block() + extent.num_blocks();
+    if (end > readers_.size())
+      readers_.resize(end);
+    for (uint64_t block = extent.start_block(); block < end; block++) {
+      if (readers_[block] < kMaxReaders)
+        readers_[block]++;
+    }
+  }
+}
+
+void SourceBlockCacheFileDescriptor::RemoveReaders(
+    const RepeatedPtrField<Extent>& extents) {
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole)
+      continue;
+    const uint64_t end = std::min<uint64_t>(
+        extent.start_block() + extent.num_blocks(), readers_.size());
+    for (uint64_t block = extent.start_block(); block < end; block++) {
+      if (readers_[block] == 0 || readers_[block] == kMaxReaders)
+        continue;
+      if (--readers_[block] == 0)
+        EraseBlock(block);
+    }
+  }
+}
+
+void SourceBlockCacheFileDescriptor::Drop(
+    const RepeatedPtrField<Extent>& extents) {
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole)
+      continue;
+    for (uint64_t i = 0; i < extent.num_blocks() && !cache_.empty(); i++)
+      EraseBlock(extent.start_block() + i);
+  }
+}
+
+ssize_t SourceBlockCacheFileDescriptor::Read(void* buf, size_t count) {
+  const ssize_t bytes_read =
+      ReadAt(offset_, static_cast<uint8_t*>(buf), count);
+  if (bytes_read > 0)
+    offset_ += bytes_read;
+  return bytes_read;
+}
+
+off64_t SourceBlockCacheFileDescriptor::Seek(off64_t offset, int whence) {
+  off64_t next_offset;
+  if (whence == SEEK_SET) {
+    next_offset = offset;
+  } else if (whence == SEEK_CUR) {
+    next_offset = offset_ + offset;
+  } else {
+    next_offset = fd_->Seek(offset, whence);
+  }
+  if (next_offset < 0)
+    return -1;
+  offset_ = next_offset;
+  return offset_;
+}
+
+bool SourceBlockCacheFileDescriptor::ReadBatch(
+    const std::vector<ReadRequest>& requests) {
+  std::vector<ReadRequest> uncached_requests;
+  for (const ReadRequest& request : requests) {
+    if (!UsesCache(request.offset, request.count)) {
+      uncached_requests.push_back(request);
+      continue;
+    }
+    const ssize_t bytes_read = ReadAt(
+        request.offset, static_cast<uint8_t*>(request.buffer), request.count);
+    if (bytes_read < 0 || static_cast<size_t>(bytes_read) != request.count)
+      return false;
+  }
+  return uncached_requests.empty() || fd_->ReadBatch(uncached_requests);
+}
+
+bool SourceBlockCacheFileDescriptor::Close() {
+  cache_.clear();
+  readers_.clear();
+  reservation_.Release();
+  offset_ = 0;
+  return fd_->Close();
+}
+
+ssize_t SourceBlockCacheFileDescriptor::ReadAt(uint64_t offset,
+                                               uint8_t* buf,
+                                               size_t count) {
+  if (count == 0)
+    return 0;
+  const uint64_t last_block = (offset + count - 1) / block_size_;
+  size_t total_bytes_read = 0;
+  while (total_bytes_read < count) {
+    const uint64_t block = (offset + total_bytes_read) / block_size_;
+    const size_t offset_in_block = (offset + total_bytes_read) % block_size_;
+    auto it = cache_.find(block);
+    if (it != cache_.end()) {
+      stats_.hits++;
+      const size_t size = std::min(count - total_bytes_read,
+                                   block_size_ - offset_in_block);
+      memcpy(buf + total_bytes_read, it->second.data() + offset_in_block, size);
+      total_bytes_read += size;
+      continue;
+    }
+
+    // Read the blocks up to the next cached one at once.
+    const uint64_t max_end_block =
+        block + std::max<size_t>(kMaxReadSize / block_size_, 1);
+    uint64_t end_block = block + 1;
+    while (end_block <= last_block && end_block < max_end_block &&
+           cache_.count(end_block) == 0) {
+      end_block++;
+    }
+    stats_.misses += end_block - block;
+    brillo::Blob data((end_block - block) * block_size_);
+    ssize_t bytes_read = 0;
+    if (!utils::PReadAll(fd_.get(),
+                         data.data(),
+                         data.size(),
+                         block * block_size_,
+                         &bytes_read)) {
+      return total_bytes_read > 0 ? total_bytes_read : -1;
+    }
+    // Only whole blocks are cached, not the end of the file.
+    for (size_t i = 0; (i + 1) * block_size_ <= static_cast<size_t>(bytes_read);
+         i++) {
+      if (Readers(block + i) > 0)
+        InsertBlock(block + i, data.data() + i * block_size_);
+    }
+    if (static_cast<size_t>(bytes_read) <= offset_in_block)
+      break;
+    const size_t size =
+        std::min(count - total_bytes_read, bytes_read - offset_in_block);
+    memcpy(buf + total_bytes_read, data.data() + offset_in_block, size);
+    total_bytes_read += size;
+    if (static_cast<size_t>(bytes_read) < data.size())
+      break;
+  }
+  return total_bytes_read;
+}
+
+bool SourceBlockCacheFileDescriptor::UsesCache(uint64_t offset,
+                                               size_t count) const {
+  if (count == 0 || (readers_.empty() && cache_.empty()))
+    return false;
+  const uint64_t last_block = (offset + count - 1) / block_size_;
+  for (uint64_t block = offset / block_size_; block <= last_block; block++) {
+    if (Readers(block) > 0 || cache_.count(block) > 0)
+      return true;
+  }
+  return false;
+}
+
+void SourceBlockCacheFileDescriptor::InsertBlock(uint64_t block,
+                                                 const uint8_t* data) {
+  if (cache_.size() >= max_blocks_ ||
+      !MemoryBudget::Get()->TryReserve(
+          (cache_.size() + 1) * block_size_, &reservation_, "source_cache")) {
+    return;
+  }
+  cache_.emplace(block, brillo::Blob(data, data + block_size_));
+}
+
+void SourceBlockCacheFileDescriptor::EraseBlock(uint64_t block) {
+  if (cache_.erase(block) == 0)
+    return;
+  // Shrinking always fits.
+  MemoryBudget::Get()->TryReserve(cache_.size() * block_size_, &reservation_);
+}
+
+}  // namespace chromeos_update_engine
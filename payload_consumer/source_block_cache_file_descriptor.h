@@ -0,0 +1,134 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_BLOCK_CACHE_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_BLOCK_CACHE_FILE_DESCRIPTOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/common/memory_budget.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A read-only file descriptor over a source partition, keeping the blocks the
+// remaining operations will read again. Each block counts its readers, added
+// with AddReaders() for every operation left to apply and removed with
+// RemoveReaders() once the operation is done, and leaves the cache with its
+// last reader. The cache is bounded by |max_size| and by the MemoryBudget:
+// the blocks that don't fit are read from the partition every time.
+class SourceBlockCacheFileDescriptor : public FileDescriptor {
+ public:
+  // The blocks read from the cache and from the partition, only counting the
+  // reads involving the cache.
+  struct Stats {
+    uint64_t hits{0};
+    uint64_t misses{0};
+  };
+
+  SourceBlockCacheFileDescriptor(FileDescriptorPtr fd,
+                                 size_t block_size,
+                                 size_t max_size);
+  ~SourceBlockCacheFileDescriptor() override = default;
+
+  // Counts one more, or one less, reader of each block of |extents|.
+  void AddReaders(const google::protobuf::RepeatedPtrField<Extent>& extents);
+  void RemoveReaders(
+      const google::protobuf::RepeatedPtrField<Extent>& extents);
+  // Drops the cached blocks of |extents|, for instance because their hash
+  // mismatched, so they are read from the partition again.
+  void Drop(const google::protobuf::RepeatedPtrField<Extent>& extents);
+
+  size_t cached_bytes() const { return cache_.size() * block_size_; }
+  const Stats& stats() const { return stats_; }
+
+  // FileDescriptor overrides.
+  bool Open(const char* path, int flags, mode_t mode) override {
+    return fd_->Open(path, flags, mode);
+  }
+  bool Open(const char* path, int flags) override {
+    return fd_->Open(path, flags);
+  }
+  ssize_t Read(void* buf, size_t count) override;
+  // The descriptor is read-only.
+  ssize_t Write(const void* buf, size_t count) override { return -1; }
+  off64_t Seek(off64_t offset, int whence) override;
+  // The requests without any block to cache are passed to the wrapped
+  // descriptor, the others served one by one.
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override;
+  // The blocks cached are the ones of the partition, so a copy reads them
+  // from the partition.
+  bool CopyTo(EintrSafeFileDescriptor* target,
+              uint64_t src_offset,
+              uint64_t dst_offset,
+              size_t count) override {
+    return fd_->CopyTo(target, src_offset, dst_offset, count);
+  }
+  bool Readahead(uint64_t offset, uint64_t count) override {
+    return fd_->Readahead(offset, count);
+  }
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return false;
+  }
+  bool Flush() override { return true; }
+  bool Close() override;
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+ private:
+  // Reads up to |count| bytes at |offset| into |buf|, serving the cached
+  // blocks and caching the read ones that have readers. Returns the bytes
+  // read, fewer than |count| at the end of the file, or -1 on error.
+  ssize_t ReadAt(uint64_t offset, uint8_t* buf, size_t count);
+  // Whether reading |count| bytes at |offset| involves the cache.
+  bool UsesCache(uint64_t offset, size_t count) const;
+  uint16_t Readers(uint64_t block) const {
+    return block < readers_.size() ? readers_[block] : 0;
+  }
+  void InsertBlock(uint64_t block, const uint8_t* data);
+  void EraseBlock(uint64_t block);
+
+  FileDescriptorPtr fd_;
+  const size_t block_size_;
+  // The most blocks in |cache_|.
+  const size_t max_blocks_;
+
+  // The readers of each block, saturated at the largest value: those blocks
+  // stay cached until Drop().
+  std::vector<uint16_t> readers_;
+  std::unordered_map<uint64_t, brillo::Blob> cache_;
+  MemoryBudget::Reservation reservation_;
+  off64_t offset_{0};
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(SourceBlockCacheFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_BLOCK_CACHE_FILE_DESCRIPTOR_H_
@@ -0,0 +1,143 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_block_cache_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using google::protobuf::RepeatedPtrField;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kFileSize = 8 * kBlockSize;
+}  // namespace
+
+class SourceBlockCacheFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override { Open(16 * kBlockSize); }
+
+  void Open(size_t max_size) {
+    fake_fd_ = new FakeFileDescriptor();
+    fake_fd_->SetFileSize(kFileSize);
+    cache_fd_ = std::make_unique<SourceBlockCacheFileDescriptor>(
+        FileDescriptorPtr(fake_fd_), kBlockSize, max_size);
+    ASSERT_TRUE(cache_fd_->Open("", O_RDONLY));
+  }
+
+  static RepeatedPtrField<Extent> Extents(uint64_t start_block,
+                                          uint64_t num_blocks) {
+    RepeatedPtrField<Extent> extents;
+    *extents.Add() = ExtentForRange(start_block, num_blocks);
+    return extents;
+  }
+
+  // Reads |num_blocks| blocks at |start_block| and checks their data.
+  void ReadBlocks(uint64_t start_block, uint64_t num_blocks) {
+    brillo::Blob data(num_blocks * kBlockSize);
+    ASSERT_EQ(static_cast<off64_t>(start_block * kBlockSize),
+              cache_fd_->Seek(start_block * kBlockSize, SEEK_SET));
+    ASSERT_EQ(static_cast<ssize_t>(data.size()),
+              cache_fd_->Read(data.data(), data.size()));
+    brillo::Blob expected = FakeFileDescriptorData(kFileSize);
+    EXPECT_EQ(brillo::Blob(expected.begin() + start_block * kBlockSize,
+                           expected.begin() +
+                               (start_block + num_blocks) * kBlockSize),
+              data);
+  }
+
+  FakeFileDescriptor* fake_fd_;
+  std::unique_ptr<SourceBlockCacheFileDescriptor> cache_fd_;
+};
+
+TEST_F(SourceBlockCacheFileDescriptorTest, KeepsBlocksUntilTheLastReaderTest) {
+  cache_fd_->AddReaders(Extents(0, 2));
+  cache_fd_->AddReaders(Extents(1, 2));
+
+  ReadBlocks(0, 3);
+  EXPECT_EQ(1u, fake_fd_->GetReadOps().size());
+  EXPECT_EQ(3 * kBlockSize, cache_fd_->cached_bytes());
+  ReadBlocks(1, 2);
+  EXPECT_EQ(1u, fake_fd_->GetReadOps().size());
+  EXPECT_EQ(2u, cache_fd_->stats().hits);
+
+  // Block 1 still has a reader.
+  cache_fd_->RemoveReaders(Extents(0, 2));
+  EXPECT_EQ(2 * kBlockSize, cache_fd_->cached_bytes());
+  cache_fd_->RemoveReaders(Extents(1, 2));
+  EXPECT_EQ(0u, cache_fd_->cached_bytes());
+}
+
+TEST_F(SourceBlockCacheFileDescriptorTest, SkipsBlocksWithoutReadersTest) {
+  ReadBlocks(3, 1);
+  ReadBlocks(3, 1);
+  EXPECT_EQ(2u, fake_fd_->GetReadOps().size());
+  EXPECT_EQ(0u, cache_fd_->cached_bytes());
+}
+
+TEST_F(SourceBlockCacheFileDescriptorTest, DropTest) {
+  cache_fd_->AddReaders(Extents(0, 2));
+  ReadBlocks(0, 2);
+  cache_fd_->Drop(Extents(1, 1));
+  EXPECT_EQ(kBlockSize, cache_fd_->cached_bytes());
+  // Only the dropped block is read again.
+  ReadBlocks(0, 2);
+  ASSERT_EQ(2u, fake_fd_->GetReadOps().size());
+  EXPECT_EQ(std::make_pair(uint64_t{kBlockSize}, uint64_t{kBlockSize}),
+            fake_fd_->GetReadOps()[1]);
+}
+
+TEST_F(SourceBlockCacheFileDescriptorTest, RespectsTheMaxSizeTest) {
+  Open(kBlockSize);
+  cache_fd_->AddReaders(Extents(0, 2));
+  ReadBlocks(0, 2);
+  EXPECT_EQ(kBlockSize, cache_fd_->cached_bytes());
+  ReadBlocks(0, 2);
+  EXPECT_EQ(2u, fake_fd_->GetReadOps().size());
+}
+
+TEST_F(SourceBlockCacheFileDescriptorTest, ReadBatchTest) {
+  cache_fd_->AddReaders(Extents(0, 1));
+  ReadBlocks(0, 1);
+  ASSERT_EQ(1u, fake_fd_->GetReadOps().size());
+
+  // The cached block isn't read again, the other one is.
+  brillo::Blob data(2 * kBlockSize);
+  ASSERT_TRUE(cache_fd_->ReadBatch({{0, data.data(), kBlockSize},
+                                    {5 * kBlockSize,
+                                     data.data() + kBlockSize,
+                                     kBlockSize}}));
+  ASSERT_EQ(2u, fake_fd_->GetReadOps().size());
+  EXPECT_EQ(5 * kBlockSize, fake_fd_->GetReadOps()[1].first);
+  brillo::Blob expected = FakeFileDescriptorData(kFileSize);
+  EXPECT_TRUE(std::equal(
+      data.begin(), data.begin() + kBlockSize, expected.begin()));
+  EXPECT_TRUE(std::equal(data.begin() + kBlockSize,
+                         data.end(),
+                         expected.begin() + 5 * kBlockSize));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_hash_cache.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The most hashes kept for each partition.
+constexpr size_t kMaxHashesPerPartition = 4;
+
+string CacheKey(const string& partition_name) {
+  return PrefsInterface::CreateSubKey(
+      {kPrefsVerifiedSourceHashes, partition_name});
+}
+
+// Loads the boot id and the hashes saved for |partition_name|, the boot id
+// first. Returns an empty list if there are none.
+vector<string> LoadEntries(PrefsInterface* prefs,
+                           const string& partition_name) {
+  string value;
+  if (!prefs->GetString(CacheKey(partition_name), &value))
+    return {};
+  return base::SplitString(
+      value, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+}
+}  // namespace
+
+void SaveVerifiedSourceHash(PrefsInterface* prefs,
+                            const string& partition_name,
+                            const brillo::Blob& hash) {
+  string boot_id;
+  if (!prefs || hash.empty() || !utils::GetBootId(&boot_id))
+    return;
+  vector<string> entries = LoadEntries(prefs, partition_name);
+  if (entries.empty() || entries[0] != boot_id)
+    entries = {boot_id};
+  const string hex_hash = base::HexEncode(hash.data(), hash.size());
+  if (std::find(entries.begin() + 1, entries.end(), hex_hash) !=
+      entries.end()) {
+    return;
+  }
+  // Forget the oldest hash.
+  if (entries.size() > kMaxHashesPerPartition)
+    entries.erase(entries.begin() + 1);
+  entries.push_back(hex_hash);
+  if (!prefs->SetString(CacheKey(partition_name),
+                        base::JoinString(entries, "\n"))) {
+    LOG(WARNING) << "Unable to save the verified hash of " << partition_name;
+  }
+}
+
+bool IsSourceHashVerified(PrefsInterface* prefs,
+                          const string& partition_name,
+                          const brillo::Blob& hash) {
+  string boot_id;
+  if (!prefs || hash.empty() || !utils::GetBootId(&boot_id))
+    return false;
+  const vector<string> entries = LoadEntries(prefs, partition_name);
+  if (entries.empty() || entries[0] != boot_id)
+    return false;
+  return std::find(entries.begin() + 1,
+                   entries.end(),
+                   base::HexEncode(hash.data(), hash.size())) != entries.end();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,45 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_CACHE_H_
+
+#include <string>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/prefs_interface.h"
+
+namespace chromeos_update_engine {
+
+// Remembers in prefs, until the next reboot, that the source partition
+// |partition_name| matched |hash|, so checking it again is free. |hash|
+// identifies whatever was checked: the hash of the whole partition or a digest
+// of the hashes of the blocks read by an update. A few of them are kept for
+// each partition.
+void SaveVerifiedSourceHash(PrefsInterface* prefs,
+                            const std::string& partition_name,
+                            const brillo::Blob& hash);
+
+// Whether SaveVerifiedSourceHash() was called for |partition_name| and |hash|
+// since the last reboot.
+bool IsSourceHashVerified(PrefsInterface* prefs,
+                          const std::string& partition_name,
+                          const brillo::Blob& hash);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_CACHE_H_
@@ -0,0 +1,56 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_hash_cache.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/fake_prefs.h"
+
+namespace chromeos_update_engine {
+
+class SourceHashCacheTest : public ::testing::Test {
+ protected:
+  FakePrefs prefs_;
+  const brillo::Blob hash_{1, 2, 3, 4};
+};
+
+TEST_F(SourceHashCacheTest, RemembersVerifiedHashesTest) {
+  EXPECT_FALSE(IsSourceHashVerified(&prefs_, "system", hash_));
+  SaveVerifiedSourceHash(&prefs_, "system", hash_);
+  EXPECT_TRUE(IsSourceHashVerified(&prefs_, "system", hash_));
+  EXPECT_FALSE(IsSourceHashVerified(&prefs_, "vendor", hash_));
+  EXPECT_FALSE(IsSourceHashVerified(&prefs_, "system", {5, 6, 7, 8}));
+}
+
+TEST_F(SourceHashCacheTest, ForgetsHashesOfAnotherBootTest) {
+  prefs_.SetString(
+      PrefsInterface::CreateSubKey({kPrefsVerifiedSourceHashes, "system"}),
+      "another-boot-id\n01020304");
+  EXPECT_FALSE(IsSourceHashVerified(&prefs_, "system", hash_));
+}
+
+TEST_F(SourceHashCacheTest, KeepsTheLatestHashesTest) {
+  for (uint8_t i = 0; i < 8; i++)
+    SaveVerifiedSourceHash(&prefs_, "system", {i});
+  EXPECT_FALSE(IsSourceHashVerified(&prefs_, "system", {0}));
+  EXPECT_TRUE(IsSourceHashVerified(&prefs_, "system", {7}));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,262 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/streaming_verity_writer.h"
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// The most blocks read back at once.
+constexpr uint64_t kMaxReadBackBlocks = 256;
+}  // namespace
+
+std::unique_ptr<StreamingVerityWriter> StreamingVerityWriter::Create(
+    const InstallPlan::Partition& partition, size_t fec_threads) {
+  const uint64_t block_size = partition.block_size;
+  if (partition.hash_tree_size == 0 || block_size == 0 ||
+      partition.hash_tree_data_offset % block_size != 0 ||
+      partition.hash_tree_data_size % block_size != 0) {
+    return nullptr;
+  }
+  auto verity_writer = verity_writer::CreateVerityWriter();
+  if (!verity_writer->Init(partition)) {
+    return nullptr;
+  }
+  verity_writer->SetFecThreads(fec_threads);
+  std::unique_ptr<StreamingVerityWriter> writer(
+      new StreamingVerityWriter(partition, std::move(verity_writer)));
+  if (!writer->read_fd_.Open(partition.target_path.c_str(), O_RDONLY)) {
+    PLOG(ERROR) << "Unable to open " << partition.target_path;
+    return nullptr;
+  }
+  return writer;
+}
+
+StreamingVerityWriter::StreamingVerityWriter(
+    const InstallPlan::Partition& partition,
+    std::unique_ptr<VerityWriterInterface> verity_writer)
+    : partition_(partition),
+      block_size_(partition.block_size),
+      data_end_block_(
+          (partition.hash_tree_data_offset + partition.hash_tree_data_size) /
+          partition.block_size),
+      verity_writer_(std::move(verity_writer)),
+      next_block_(0) {}
+
+void StreamingVerityWriter::Write(uint64_t offset,
+                                  const void* data,
+                                  size_t size) {
+  AddWrittenBlocks(offset, static_cast<const uint8_t*>(data), size);
+}
+
+void StreamingVerityWriter::MarkWritten(uint64_t offset, uint64_t size) {
+  AddWrittenBlocks(offset, nullptr, size);
+}
+
+void StreamingVerityWriter::MarkWritten(
+    const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  for (const auto& extent : extents) {
+    AddWrittenBlocks(extent.start_block() * block_size_,
+                     nullptr,
+                     extent.num_blocks() * block_size_);
+  }
+}
+
+void StreamingVerityWriter::AddWrittenBlocks(uint64_t offset,
+                                             const uint8_t* data,
+                                             uint64_t size) {
+  const uint64_t data_end = data_end_block_ * block_size_;
+  if (size == 0 || offset >= data_end) {
+    return;
+  }
+  // Only whole blocks are tracked, the ones written in several pieces are
+  // read back in Finalize().
+  const uint64_t first_block = utils::DivRoundUp(offset, block_size_);
+  const uint64_t end_block = std::min(offset + size, data_end) / block_size_;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (failed_) {
+    return;
+  }
+  if (offset < next_block_ * block_size_) {
+    LOG(WARNING) << "Block " << offset / block_size_ << " of "
+                 << partition_.name << " written again after it was hashed, "
+                 << "its verity data will be written after the update.";
+    failed_ = true;
+    return;
+  }
+  if (first_block >= end_block) {
+    return;
+  }
+  const bool hash_now = data && !hashing_ && first_block == next_block_;
+  if (!hash_now) {
+    written_blocks_.AddExtent(
+        ExtentForRange(first_block, end_block - first_block));
+    if (hashing_) {
+      // The thread hashing blocks picks them up when it gets there.
+      return;
+    }
+  }
+  hashing_ = true;
+  if (hash_now) {
+    // Moved first, so that writing these blocks again fails from now on.
+    next_block_ = end_block;
+    lock.unlock();
+    const bool success = verity_writer_->Update(
+        first_block * block_size_,
+        data + first_block * block_size_ - offset,
+        (end_block - first_block) * block_size_);
+    lock.lock();
+    failed_ = failed_ || !success;
+  }
+  HashWrittenBlocks(&lock);
+  hashing_ = false;
+}
+
+void StreamingVerityWriter::HashWrittenBlocks(
+    std::unique_lock<std::mutex>* lock) {
+  while (!failed_ && written_blocks_.ContainsBlock(next_block_)) {
+    const uint64_t num_blocks =
+        written_blocks_
+            .GetIntersectingExtents(
+                ExtentForRange(next_block_, kMaxReadBackBlocks))
+            .front()
+            .num_blocks();
+    const uint64_t first_block = next_block_;
+    written_blocks_.SubtractExtent(ExtentForRange(first_block, num_blocks));
+    next_block_ += num_blocks;
+    lock->unlock();
+    const bool success = HashBlocksFromFd(first_block, num_blocks);
+    lock->lock();
+    failed_ = failed_ || !success;
+  }
+}
+
+bool StreamingVerityWriter::HashBlocksFromFd(uint64_t first_block,
+                                             uint64_t num_blocks) {
+  brillo::Blob buffer(num_blocks * block_size_);
+  ssize_t bytes_read = 0;
+  const off64_t offset = first_block * block_size_;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(
+      &read_fd_, buffer.data(), buffer.size(), offset, &bytes_read));
+  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buffer.size()));
+  return verity_writer_->Update(offset, buffer.data(), buffer.size());
+}
+
+bool StreamingVerityWriter::Finalize() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  CHECK(!hashing_);
+  // The rest of the partition is complete, no need to track the blocks.
+  written_blocks_ = ExtentRanges();
+  const uint64_t read_back_blocks = data_end_block_ - next_block_;
+  while (!failed_ && next_block_ < data_end_block_) {
+    const uint64_t num_blocks =
+        std::min(kMaxReadBackBlocks, data_end_block_ - next_block_);
+    failed_ = !HashBlocksFromFd(next_block_, num_blocks);
+    next_block_ += num_blocks;
+  }
+  TEST_AND_RETURN_FALSE(!failed_);
+  LOG(INFO) << "Read back " << read_back_blocks << " of " << data_end_block_
+            << " blocks of " << partition_.name
+            << " after the update, writing its verity data.";
+
+  EintrSafeFileDescriptor fd;
+  if (!fd.Open(partition_.target_path.c_str(), O_RDWR)) {
+    PLOG(ERROR) << "Unable to open " << partition_.target_path;
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(verity_writer_->Finalize(&fd, &fd));
+  // FilesystemVerifierAction doesn't write it again, even after a reboot.
+  TEST_AND_RETURN_FALSE_ERRNO(fd.Flush());
+  TEST_AND_RETURN_FALSE_ERRNO(fd.Close());
+  read_fd_.Close();
+  return true;
+}
+
+ssize_t StreamingVerityFileDescriptor::Read(void* buf, size_t count) {
+  const ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read > 0) {
+    offset_ += bytes_read;
+  }
+  return bytes_read;
+}
+
+ssize_t StreamingVerityFileDescriptor::Write(const void* buf, size_t count) {
+  const ssize_t bytes_written = fd_->Write(buf, count);
+  if (bytes_written > 0) {
+    verity_writer_->Write(offset_, buf, bytes_written);
+    offset_ += bytes_written;
+  }
+  return bytes_written;
+}
+
+bool StreamingVerityFileDescriptor::WriteBatch(
+    const std::vector<WriteRequest>& requests) {
+  if (!fd_->WriteBatch(requests)) {
+    return false;
+  }
+  for (const auto& request : requests) {
+    verity_writer_->Write(request.offset, request.buffer, request.count);
+  }
+  return true;
+}
+
+bool StreamingVerityFileDescriptor::CopyFrom(FileDescriptor* source,
+                                             uint64_t src_offset,
+                                             uint64_t dst_offset,
+                                             size_t count) {
+  if (!fd_->CopyFrom(source, src_offset, dst_offset, count)) {
+    return false;
+  }
+  verity_writer_->MarkWritten(dst_offset, count);
+  return true;
+}
+
+off64_t StreamingVerityFileDescriptor::Seek(off64_t offset, int whence) {
+  const off64_t new_offset = fd_->Seek(offset, whence);
+  if (new_offset >= 0) {
+    offset_ = new_offset;
+  }
+  return new_offset;
+}
+
+bool StreamingVerityFileDescriptor::BlkIoctl(int request,
+                                             uint64_t start,
+                                             uint64_t length,
+                                             int* result) {
+  if (!fd_->BlkIoctl(request, start, length, result)) {
+    return false;
+  }
+  if (*result == 0 && (request == BLKZEROOUT || request == BLKDISCARD ||
+                       request == BLKSECDISCARD)) {
+    verity_writer_->MarkWritten(start, length);
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
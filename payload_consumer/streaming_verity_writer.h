@@ -0,0 +1,168 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_STREAMING_VERITY_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_STREAMING_VERITY_WRITER_H_
+
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/verity_writer_interface.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Builds the verity data of a partition from the blocks written to it while
+// the operations are applied, instead of reading the whole partition back in
+// FilesystemVerifierAction.
+//
+// The hash tree can only be fed in block order. A write that starts at the
+// first block not hashed yet is hashed right away from the written buffer;
+// the blocks written further away are read back, usually from the page cache,
+// once all the blocks before them are written. The blocks never written are
+// read back in Finalize().
+//
+// All the writers of a partition report to the same instance, from any
+// thread.
+class StreamingVerityWriter {
+ public:
+  // Returns null if |partition| has no hash tree, or if its hash tree data
+  // isn't made of whole blocks. |partition| must outlive the returned writer.
+  // The FEC data is encoded by |fec_threads| threads.
+  static std::unique_ptr<StreamingVerityWriter> Create(
+      const InstallPlan::Partition& partition, size_t fec_threads = 1);
+
+  ~StreamingVerityWriter() = default;
+
+  // Reports that |size| bytes of |data| were written to the target partition
+  // at |offset|.
+  void Write(uint64_t offset, const void* data, size_t size);
+
+  // Reports that the bytes in [offset, offset + size) were written without
+  // going through Write(), e.g. zeroed with an ioctl. They are read back.
+  void MarkWritten(uint64_t offset, uint64_t size);
+  // Same as above for the blocks of |extents|.
+  void MarkWritten(const google::protobuf::RepeatedPtrField<Extent>& extents);
+
+  // Hashes the blocks not hashed yet, and writes the hash tree and FEC data
+  // to the target partition. Must be called once every writer reporting to
+  // this instance is closed. Returns false if the operations wrote the same
+  // block twice, or on any error, in which case the verity data is left to
+  // FilesystemVerifierAction.
+  bool Finalize();
+
+ private:
+  StreamingVerityWriter(const InstallPlan::Partition& partition,
+                        std::unique_ptr<VerityWriterInterface> verity_writer);
+
+  // Reports the whole blocks of the hash tree data in [offset, offset + size)
+  // as written, and hashes them from |data| if not null and they are next.
+  void AddWrittenBlocks(uint64_t offset, const uint8_t* data, uint64_t size);
+
+  // Reads back and hashes the written blocks from |next_block_| on, while
+  // they are contiguous. |lock| is released while the data is being hashed.
+  void HashWrittenBlocks(std::unique_lock<std::mutex>* lock);
+
+  // Reads back and hashes |num_blocks| blocks from |first_block|.
+  bool HashBlocksFromFd(uint64_t first_block, uint64_t num_blocks);
+
+  const InstallPlan::Partition& partition_;
+  const uint64_t block_size_;
+  // The end of the hash tree data, in blocks. The hash tree is fed from
+  // block 0 on, even when the data doesn't start there.
+  const uint64_t data_end_block_;
+
+  // Reads back the blocks that aren't hashed when they are written.
+  EintrSafeFileDescriptor read_fd_;
+
+  std::mutex mutex_;
+  // Only used by one thread at a time, the one which set |hashing_|.
+  std::unique_ptr<VerityWriterInterface> verity_writer_;
+  // The first block not being or already given to |verity_writer_|.
+  uint64_t next_block_;
+  // The blocks from |next_block_| on which are written but not hashed yet.
+  ExtentRanges written_blocks_;
+  // True while a thread is hashing blocks.
+  bool hashing_{false};
+  // Set when the verity data can't be built from the writes anymore.
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(StreamingVerityWriter);
+};
+
+// Passes through to |fd|, and reports the writes to |verity_writer|.
+class StreamingVerityFileDescriptor : public FileDescriptor {
+ public:
+  StreamingVerityFileDescriptor(FileDescriptorPtr fd,
+                                StreamingVerityWriter* verity_writer)
+      : fd_(std::move(fd)), verity_writer_(verity_writer) {}
+  ~StreamingVerityFileDescriptor() override = default;
+
+  bool Open(const char* path, int flags, mode_t mode) override {
+    offset_ = 0;
+    return fd_->Open(path, flags, mode);
+  }
+  bool Open(const char* path, int flags) override {
+    offset_ = 0;
+    return fd_->Open(path, flags);
+  }
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override {
+    return fd_->ReadBatch(requests);
+  }
+  bool WriteBatch(const std::vector<WriteRequest>& requests) override;
+  // The copied bytes are reported as written, and read back to be hashed.
+  bool CopyFrom(FileDescriptor* source,
+                uint64_t src_offset,
+                uint64_t dst_offset,
+                size_t count) override;
+  bool CopyTo(EintrSafeFileDescriptor* target,
+              uint64_t src_offset,
+              uint64_t dst_offset,
+              size_t count) override {
+    return fd_->CopyTo(target, src_offset, dst_offset, count);
+  }
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override { return fd_->Close(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+ private:
+  FileDescriptorPtr fd_;
+  StreamingVerityWriter* verity_writer_;
+  off64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(StreamingVerityFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_STREAMING_VERITY_WRITER_H_
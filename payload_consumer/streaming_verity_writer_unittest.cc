@@ -0,0 +1,171 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/streaming_verity_writer.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/verity_writer_android.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr uint64_t kNumDataBlocks = 32;
+}  // namespace
+
+class StreamingVerityWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    partition_.name = "system";
+    partition_.target_path = temp_file_.path();
+    partition_.block_size = kBlockSize;
+    partition_.hash_tree_data_offset = 0;
+    partition_.hash_tree_data_size = kNumDataBlocks * kBlockSize;
+    partition_.hash_tree_offset = kNumDataBlocks * kBlockSize;
+    partition_.hash_tree_size = kBlockSize;
+    partition_.hash_tree_algorithm = "sha256";
+
+    data_.resize(kNumDataBlocks * kBlockSize);
+    std::mt19937 rng(0);
+    std::generate(data_.begin(), data_.end(), rng);
+    // Nothing is written yet.
+    ASSERT_TRUE(test_utils::WriteFileVector(
+        partition_.target_path, brillo::Blob(data_.size() + kBlockSize)));
+    ASSERT_TRUE(fd_->Open(partition_.target_path.c_str(), O_RDWR));
+  }
+
+  // Returns the partition with the verity data written by
+  // VerityWriterAndroid from the whole |data_|.
+  brillo::Blob ExpectedPartition() {
+    ScopedTempFile file("streaming_verity_expected.XXXXXX");
+    brillo::Blob part_data = data_;
+    part_data.resize(data_.size() + kBlockSize);
+    EXPECT_TRUE(test_utils::WriteFileVector(file.path(), part_data));
+    InstallPlan::Partition partition = partition_;
+    partition.target_path = file.path();
+    VerityWriterAndroid verity_writer;
+    EXPECT_TRUE(verity_writer.Init(partition));
+    EXPECT_TRUE(verity_writer.Update(0, data_.data(), data_.size()));
+    EintrSafeFileDescriptor fd;
+    EXPECT_TRUE(fd.Open(file.path().c_str(), O_RDWR));
+    EXPECT_TRUE(verity_writer.Finalize(&fd, &fd));
+    EXPECT_TRUE(fd.Close());
+    EXPECT_TRUE(utils::ReadFile(file.path(), &part_data));
+    return part_data;
+  }
+
+  // Writes the blocks [first_block, first_block + num_blocks) of |data_| to
+  // the partition and reports them to |verity_writer|.
+  void WriteBlocks(StreamingVerityWriter* verity_writer,
+                   uint64_t first_block,
+                   uint64_t num_blocks) {
+    const uint64_t offset = first_block * kBlockSize;
+    const size_t size = num_blocks * kBlockSize;
+    ASSERT_TRUE(utils::PWriteAll(fd_, data_.data() + offset, size, offset));
+    verity_writer->Write(offset, data_.data() + offset, size);
+  }
+
+  brillo::Blob ActualPartition() {
+    brillo::Blob part_data;
+    EXPECT_TRUE(utils::ReadFile(partition_.target_path, &part_data));
+    return part_data;
+  }
+
+  ScopedTempFile temp_file_{"streaming_verity.XXXXXX"};
+  InstallPlan::Partition partition_;
+  brillo::Blob data_;
+  FileDescriptorPtr fd_{std::make_shared<EintrSafeFileDescriptor>()};
+};
+
+TEST_F(StreamingVerityWriterTest, SequentialWritesTest) {
+  auto verity_writer = StreamingVerityWriter::Create(partition_);
+  ASSERT_NE(nullptr, verity_writer);
+  for (uint64_t block = 0; block < kNumDataBlocks; block += 4) {
+    WriteBlocks(verity_writer.get(), block, 4);
+  }
+  ASSERT_TRUE(verity_writer->Finalize());
+  ASSERT_EQ(ExpectedPartition(), ActualPartition());
+}
+
+TEST_F(StreamingVerityWriterTest, OutOfOrderWritesTest) {
+  std::vector<uint64_t> blocks(kNumDataBlocks);
+  for (uint64_t block = 0; block < kNumDataBlocks; block++) {
+    blocks[block] = block;
+  }
+  std::shuffle(blocks.begin(), blocks.end(), std::mt19937(42));
+  auto verity_writer = StreamingVerityWriter::Create(partition_);
+  ASSERT_NE(nullptr, verity_writer);
+  for (uint64_t block : blocks) {
+    WriteBlocks(verity_writer.get(), block, 1);
+  }
+  ASSERT_TRUE(verity_writer->Finalize());
+  ASSERT_EQ(ExpectedPartition(), ActualPartition());
+}
+
+TEST_F(StreamingVerityWriterTest, UnreportedBlocksAreReadBackTest) {
+  ASSERT_TRUE(utils::PWriteAll(fd_, data_.data(), data_.size(), 0));
+  auto verity_writer = StreamingVerityWriter::Create(partition_);
+  ASSERT_NE(nullptr, verity_writer);
+  // Only a few blocks in the middle are reported.
+  verity_writer->MarkWritten(10 * kBlockSize, 5 * kBlockSize);
+  // Not a whole block.
+  verity_writer->Write(
+      20 * kBlockSize + 100, data_.data() + 20 * kBlockSize + 100, kBlockSize);
+  ASSERT_TRUE(verity_writer->Finalize());
+  ASSERT_EQ(ExpectedPartition(), ActualPartition());
+}
+
+TEST_F(StreamingVerityWriterTest, RewriteAfterHashFailsTest) {
+  auto verity_writer = StreamingVerityWriter::Create(partition_);
+  ASSERT_NE(nullptr, verity_writer);
+  WriteBlocks(verity_writer.get(), 0, 2);
+  WriteBlocks(verity_writer.get(), 1, 1);
+  ASSERT_FALSE(verity_writer->Finalize());
+}
+
+TEST_F(StreamingVerityWriterTest, NoHashTreeTest) {
+  partition_.hash_tree_size = 0;
+  ASSERT_EQ(nullptr, StreamingVerityWriter::Create(partition_));
+}
+
+TEST_F(StreamingVerityWriterTest, FileDescriptorReportsWritesTest) {
+  auto verity_writer = StreamingVerityWriter::Create(partition_);
+  ASSERT_NE(nullptr, verity_writer);
+  StreamingVerityFileDescriptor fd(
+      std::make_shared<EintrSafeFileDescriptor>(), verity_writer.get());
+  ASSERT_TRUE(fd.Open(partition_.target_path.c_str(), O_RDWR));
+  const size_t half = data_.size() / 2;
+  ASSERT_EQ(static_cast<off64_t>(half), fd.Seek(half, SEEK_SET));
+  ASSERT_TRUE(utils::WriteAll(&fd, data_.data() + half, half));
+  ASSERT_EQ(0, fd.Seek(0, SEEK_SET));
+  ASSERT_TRUE(utils::WriteAll(&fd, data_.data(), half));
+  ASSERT_TRUE(fd.Close());
+  ASSERT_TRUE(verity_writer->Finalize());
+  ASSERT_EQ(ExpectedPartition(), ActualPartition());
+}
+
+}  // namespace chromeos_update_engine
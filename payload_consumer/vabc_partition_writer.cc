@@ -29,12 +29,14 @@
 
 #include "update_engine/common/cow_operation_convert.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/batching_cow_writer.h"
 #include "update_engine/payload_consumer/block_extent_writer.h"
 #include "update_engine/payload_consumer/extent_map.h"
 #include "update_engine/payload_consumer/extent_reader.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/instrumented_file_descriptor.h"
 #include "update_engine/payload_consumer/partition_writer.h"
 #include "update_engine/payload_consumer/snapshot_extent_writer.h"
 #include "update_engine/payload_consumer/xor_extent_writer.h"
@@ -66,20 +68,51 @@ namespace chromeos_update_engine {
 // label to |InitializeWithAppend|. The CowWriter will retain all data before
 // label 3, Which contains all operation 2's data, but none of operation 3's
 // data.
+// A checkpoint in the middle of operation 3 adds a label of its own instead,
+// see PartialOperationLabel(), which keeps the blocks of operation 3 written
+// before it.
 
 using android::snapshot::ICowWriter;
 using ::google::protobuf::RepeatedPtrField;
 
+// The block numbers of the merge sequence passed to the COW writer at once, a
+// multiple of the 16383 a sequence operation of the COW holds.
+constexpr size_t kMergeSequenceChunkSize = 16383 * 64;
+
+// The label of the checkpoint taken after the first |num_blocks| blocks of the
+// operation |op_index|. It's above the operation labels and
+// kEndOfInstallLabel, and unique for each checkpoint: the COW is only appended
+// to after the first label of a given value.
+static bool PartialOperationLabel(size_t op_index,
+                                  uint64_t num_blocks,
+                                  uint64_t* label) {
+  TEST_AND_RETURN_FALSE(op_index < (1ULL << 31));
+  TEST_AND_RETURN_FALSE(num_blocks < (1ULL << 32));
+  *label = (1ULL << 63) | (uint64_t{op_index} << 32) | num_blocks;
+  return true;
+}
+
 // Compute XOR map, a map from dst extent to corresponding merge operation
-static ExtentMap<const CowMergeOperation*, ExtentLess> ComputeXorMap(
+static ExtentMap<const CowMergeOperation*> ComputeXorMap(
     const RepeatedPtrField<CowMergeOperation>& merge_ops) {
-  ExtentMap<const CowMergeOperation*, ExtentLess> xor_map;
+  std::vector<std::pair<Extent, const CowMergeOperation*>> entries;
+  entries.reserve(merge_ops.size());
   for (const auto& merge_op : merge_ops) {
     if (merge_op.type() == CowMergeOperation::COW_XOR) {
-      xor_map.AddExtent(merge_op.dst_extent(), &merge_op);
+      entries.emplace_back(merge_op.dst_extent(), &merge_op);
     }
   }
-  return xor_map;
+  return ExtentMap<const CowMergeOperation*>(std::move(entries));
+}
+
+// Whether any of |merge_ops| is a COW_XOR, without building the XOR map.
+static bool HasXorOperation(
+    const RepeatedPtrField<CowMergeOperation>& merge_ops) {
+  return std::any_of(
+      merge_ops.begin(), merge_ops.end(), [](const CowMergeOperation& op) {
+        return op.type() == CowMergeOperation::COW_XOR &&
+               op.dst_extent().num_blocks() > 0;
+      });
 }
 
 VABCPartitionWriter::VABCPartitionWriter(
@@ -98,8 +131,9 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
                                bool source_may_exist,
                                size_t next_op_index) {
   if (dynamic_control_->GetVirtualAbCompressionXorFeatureFlag().IsEnabled()) {
-    xor_map_ = ComputeXorMap(partition_update_.merge_operations());
-    if (xor_map_.size() > 0) {
+    // The XOR map is only built by the first diff operation, see XorMap().
+    xor_enabled_ = HasXorOperation(partition_update_.merge_operations());
+    if (xor_enabled_) {
       LOG(INFO) << "Virtual AB Compression with XOR is enabled";
     } else {
       LOG(INFO) << "Device supports Virtual AB compression with XOR, but OTA "
@@ -109,9 +143,14 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
     LOG(INFO) << "Virtual AB Compression with XOR is disabled.";
   }
   TEST_AND_RETURN_FALSE(install_plan != nullptr);
+  TEST_AND_RETURN_FALSE(
+      executor_.SetZstdDictionary(partition_update_.zstd_dictionary()));
+  source_io_name_ =
+      install_plan->instrument_file_io ? install_part_.name + "/source" : "";
   if (source_may_exist && install_part_.source_size > 0) {
     TEST_AND_RETURN_FALSE(!install_part_.source_path.empty());
-    TEST_AND_RETURN_FALSE(verified_source_fd_.Open());
+    TEST_AND_RETURN_FALSE(verified_source_fd_.Open(source_io_name_));
+    verified_source_fd_.SetOperations(partition_update_, next_op_index);
   }
   std::optional<std::string> source_path;
   if (!install_part_.source_path.empty()) {
@@ -121,11 +160,23 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
   cow_writer_ = dynamic_control_->OpenCowWriter(
       install_part_.name, source_path, install_plan->is_resume);
   TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  batching_cow_writer_ = std::make_unique<BatchingCowWriter>(cow_writer_.get());
 
   // ===== Resume case handling code goes here ====
   // It is possible that the SOURCE_COPY are already written but
   // |next_op_index_| is still 0. In this case we discard previously written
   // SOURCE_COPY, and start over.
+  if (install_plan->is_resume && resume_partial_blocks_ > 0) {
+    LOG(INFO) << "Resuming update on partition `"
+              << partition_update_.partition_name() << "` op index "
+              << next_op_index << " after " << resume_partial_blocks_
+              << " blocks";
+    uint64_t label = 0;
+    TEST_AND_RETURN_FALSE(
+        PartialOperationLabel(next_op_index, resume_partial_blocks_, &label));
+    TEST_AND_RETURN_FALSE(cow_writer_->InitializeAppend(label));
+    return true;
+  }
   if (install_plan->is_resume && next_op_index > 0) {
     LOG(INFO) << "Resuming update on partition `"
               << partition_update_.partition_name() << "` op index "
@@ -149,19 +200,27 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
   // TODO(zhangkelvin) Rewrite this in C++20 coroutine once that's available.
   // TODO(177104308) Don't write all COPY ops up-front if merge sequence is
   // written
-  const auto converted = ConvertToCowOperations(
-      partition_update_.operations(), partition_update_.merge_operations());
+  // The operation index, checked against the operations with the manifest,
+  // spares walking their protobuf messages.
+  OperationIndex operation_index;
+  const auto converted =
+      partition_update_.has_operation_index() &&
+              operation_index.Init(partition_update_.operation_index())
+          ? ConvertToCowOperations(operation_index,
+                                   partition_update_.merge_operations())
+          : ConvertToCowOperations(partition_update_.operations(),
+                                   partition_update_.merge_operations());
 
   if (!converted.empty()) {
     // Use source fd directly. Ideally we want to verify all extents used in
     // source copy, but then what do we do if some extents contain correct
     // hashes and some don't?
-    auto source_fd = std::make_shared<EintrSafeFileDescriptor>();
+    FileDescriptorPtr source_fd = NewSourceFd();
     TEST_AND_RETURN_FALSE_ERRNO(
         source_fd->Open(install_part_.source_path.c_str(), O_RDONLY));
     TEST_AND_RETURN_FALSE(WriteSourceCopyCowOps(
-        block_size_, converted, cow_writer_.get(), source_fd));
-    cow_writer_->AddLabel(0);
+        block_size_, converted, batching_cow_writer_.get(), source_fd));
+    batching_cow_writer_->AddLabel(0);
   }
   return true;
 }
@@ -169,7 +228,23 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
 bool VABCPartitionWriter::WriteMergeSequence(
     const RepeatedPtrField<CowMergeOperation>& merge_sequence,
     ICowWriter* cow_writer) {
+  // TODO(193863443) Remove this check once this feature
+  // lands on all pixel devices.
+  const bool is_ascending = android::base::GetBoolProperty(
+      "ro.virtual_ab.userspace.snapshots.enabled", false);
+  // The sequence is passed in chunks, rather than a block number for every
+  // block of the partition at once. A chunk fills whole sequence operations
+  // of the COW, so it stores the same operations either way.
   std::vector<uint32_t> blocks_merge_order;
+  const auto add_block = [&](uint32_t block) {
+    blocks_merge_order.push_back(block);
+    if (blocks_merge_order.size() < kMergeSequenceChunkSize)
+      return true;
+    TEST_AND_RETURN_FALSE(cow_writer->AddSequenceData(
+        blocks_merge_order.size(), blocks_merge_order.data()));
+    blocks_merge_order.clear();
+    return true;
+  };
   for (const auto& merge_op : merge_sequence) {
     const auto& dst_extent = merge_op.dst_extent();
     const auto& src_extent = merge_op.src_extent();
@@ -182,10 +257,6 @@ bool VABCPartitionWriter::WriteMergeSequence(
 
     const bool extent_overlap =
         ExtentRanges::ExtentsOverlap(src_extent, dst_extent);
-    // TODO(193863443) Remove this check once this feature
-    // lands on all pixel devices.
-    const bool is_ascending = android::base::GetBoolProperty(
-        "ro.virtual_ab.userspace.snapshots.enabled", false);
 
     // If this is a self-overlapping op and |dst_extent| comes after
     // |src_extent|, we must write in reverse order for correctness.
@@ -195,28 +266,16 @@ bool VABCPartitionWriter::WriteMergeSequence(
     //
     // If this isn't a self overlapping op, write block in ascending order
     // if userspace snapshots are enabled
-    if (extent_overlap) {
-      if (dst_extent.start_block() <= src_extent.start_block()) {
-        for (size_t i = 0; i < dst_extent.num_blocks(); i++) {
-          blocks_merge_order.push_back(dst_extent.start_block() + i);
-        }
-      } else {
-        for (int i = dst_extent.num_blocks() - 1; i >= 0; i--) {
-          blocks_merge_order.push_back(dst_extent.start_block() + i);
-        }
-      }
-    } else {
-      if (is_ascending) {
-        for (size_t i = 0; i < dst_extent.num_blocks(); i++) {
-          blocks_merge_order.push_back(dst_extent.start_block() + i);
-        }
-      } else {
-        for (int i = dst_extent.num_blocks() - 1; i >= 0; i--) {
-          blocks_merge_order.push_back(dst_extent.start_block() + i);
-        }
-      }
+    const bool ascending =
+        extent_overlap ? dst_extent.start_block() <= src_extent.start_block()
+                       : is_ascending;
+    for (uint64_t i = 0; i < dst_extent.num_blocks(); i++) {
+      const uint64_t offset = ascending ? i : dst_extent.num_blocks() - 1 - i;
+      TEST_AND_RETURN_FALSE(add_block(dst_extent.start_block() + offset));
     }
   }
+  if (blocks_merge_order.empty())
+    return true;
   return cow_writer->AddSequenceData(blocks_merge_order.size(),
                                      blocks_merge_order.data());
 }
@@ -264,23 +323,34 @@ bool VABCPartitionWriter::WriteSourceCopyCowOps(
 }
 
 std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
-  return std::make_unique<SnapshotExtentWriter>(cow_writer_.get());
+  return std::make_unique<SnapshotExtentWriter>(batching_cow_writer_.get());
 }
 
 [[nodiscard]] bool VABCPartitionWriter::PerformZeroOrDiscardOperation(
     const InstallOperation& operation) {
-  for (const auto& extent : operation.dst_extents()) {
-    TEST_AND_RETURN_FALSE(
-        cow_writer_->AddZeroBlocks(extent.start_block(), extent.num_blocks()));
+  // The unused blocks of the partition are left as they are.
+  std::vector<Extent> used_extents;
+  for (const auto& extent : operation.dst_extents())
+    install_part_.AppendUsedExtents(extent, &used_extents);
+  for (const auto& extent : used_extents) {
+    TEST_AND_RETURN_FALSE(batching_cow_writer_->AddZeroBlocks(
+        extent.start_block(), extent.num_blocks()));
   }
   return true;
 }
 
+FileDescriptorPtr VABCPartitionWriter::NewSourceFd() const {
+  FileDescriptorPtr fd = std::make_shared<EintrSafeFileDescriptor>();
+  if (!source_io_name_.empty())
+    fd = std::make_shared<InstrumentedFileDescriptor>(fd, source_io_name_);
+  return fd;
+}
+
 [[nodiscard]] bool VABCPartitionWriter::PerformSourceCopyOperation(
     const InstallOperation& operation, ErrorCode* error) {
   // COPY ops are already handled during Init(), no need to do actual work, but
   // we still want to verify that all blocks contain expected data.
-  auto source_fd = std::make_shared<EintrSafeFileDescriptor>();
+  FileDescriptorPtr source_fd = NewSourceFd();
   TEST_AND_RETURN_FALSE_ERRNO(
       source_fd->Open(install_part_.source_path.c_str(), O_RDONLY));
   if (!operation.has_src_sha256_hash()) {
@@ -299,6 +369,11 @@ bool VABCPartitionWriter::PerformReplaceOperation(const InstallOperation& op,
   return executor_.ExecuteReplaceOperation(op, std::move(writer), data, count);
 }
 
+std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateReplaceWriter(
+    const InstallOperation& op) {
+  return executor_.CreateReplaceWriter(op, CreateBaseExtentWriter());
+}
+
 bool VABCPartitionWriter::PerformDiffOperation(
     const InstallOperation& operation,
     ErrorCode* error,
@@ -310,28 +385,44 @@ bool VABCPartitionWriter::PerformDiffOperation(
   TEST_AND_RETURN_FALSE(source_fd->IsOpen());
 
   std::unique_ptr<ExtentWriter> writer =
-      IsXorEnabled() ? std::make_unique<XORExtentWriter>(
-                           operation, source_fd, cow_writer_.get(), xor_map_)
-                     : CreateBaseExtentWriter();
+      IsXorEnabled()
+          ? std::make_unique<XORExtentWriter>(
+                operation, source_fd, batching_cow_writer_.get(), XorMap())
+          : CreateBaseExtentWriter();
   return executor_.ExecuteDiffOperation(
       operation, std::move(writer), source_fd, data, count);
 }
 
+const ExtentMap<const CowMergeOperation*>& VABCPartitionWriter::XorMap() {
+  if (!xor_map_) {
+    xor_map_.emplace(ComputeXorMap(partition_update_.merge_operations()));
+  }
+  return *xor_map_;
+}
+
 void VABCPartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
   // No need to call fsync/sync, as CowWriter flushes after a label is added
   // added.
   // if cow_writer_ failed, that means Init() failed. This function shouldn't be
   // called if Init() fails.
   TEST_AND_RETURN(cow_writer_ != nullptr);
-  cow_writer_->AddLabel(next_op_index);
+  batching_cow_writer_->AddLabel(next_op_index);
+}
+
+bool VABCPartitionWriter::CheckpointPartialOperation(size_t op_index,
+                                                     uint64_t num_blocks) {
+  TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  uint64_t label = 0;
+  TEST_AND_RETURN_FALSE(PartialOperationLabel(op_index, num_blocks, &label));
+  return batching_cow_writer_->AddLabel(label);
 }
 
 [[nodiscard]] bool VABCPartitionWriter::FinishedInstallOps() {
   // Add a hardcoded magic label to indicate end of all install ops. This label
   // is needed by filesystem verification, don't remove.
   TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
-  TEST_AND_RETURN_FALSE(cow_writer_->AddLabel(kEndOfInstallLabel));
-  TEST_AND_RETURN_FALSE(cow_writer_->Finalize());
+  TEST_AND_RETURN_FALSE(batching_cow_writer_->AddLabel(kEndOfInstallLabel));
+  TEST_AND_RETURN_FALSE(batching_cow_writer_->Finalize());
   TEST_AND_RETURN_FALSE(cow_writer_->VerifyMergeOps());
   return true;
 }
@@ -342,7 +433,8 @@ VABCPartitionWriter::~VABCPartitionWriter() {
 
 int VABCPartitionWriter::Close() {
   if (cow_writer_) {
-    cow_writer_->Finalize();
+    batching_cow_writer_->Finalize();
+    batching_cow_writer_ = nullptr;
     cow_writer_ = nullptr;
   }
   return 0;
@@ -19,12 +19,14 @@
 
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
 #include <libsnapshot/snapshot_writer.h>
 
 #include "update_engine/common/cow_operation_convert.h"
+#include "update_engine/payload_consumer/batching_cow_writer.h"
 #include "update_engine/payload_consumer/extent_map.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
@@ -54,6 +56,8 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
   [[nodiscard]] bool PerformReplaceOperation(const InstallOperation& operation,
                                              const void* data,
                                              size_t count) override;
+  [[nodiscard]] std::unique_ptr<ExtentWriter> CreateReplaceWriter(
+      const InstallOperation& operation) override;
 
   [[nodiscard]] bool PerformDiffOperation(const InstallOperation& operation,
                                           ErrorCode* error,
@@ -61,6 +65,11 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
                                           size_t count) override;
 
   void CheckpointUpdateProgress(size_t next_op_index) override;
+  [[nodiscard]] bool CheckpointPartialOperation(size_t op_index,
+                                                uint64_t num_blocks) override;
+  void ResumePartialOperation(uint64_t num_blocks) override {
+    resume_partial_blocks_ = num_blocks;
+  }
 
   [[nodiscard]] static bool WriteSourceCopyCowOps(
       size_t block_size,
@@ -76,10 +85,18 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
       android::snapshot::ICowWriter* cow_writer);
 
  private:
-  bool IsXorEnabled() const noexcept { return xor_map_.size() > 0; }
+  bool IsXorEnabled() const noexcept { return xor_enabled_; }
+  // The map from the dst extents of the COW_XOR merge operations to them,
+  // built on the first call rather than before the first operation.
+  const ExtentMap<const CowMergeOperation*>& XorMap();
   std::unique_ptr<android::snapshot::ISnapshotWriter> cow_writer_;
+  // All the COW operations go through this, to be coalesced before reaching
+  // |cow_writer_|.
+  std::unique_ptr<BatchingCowWriter> batching_cow_writer_;
 
   [[nodiscard]] std::unique_ptr<ExtentWriter> CreateBaseExtentWriter();
+  // A new descriptor for the source partition, to be opened.
+  FileDescriptorPtr NewSourceFd() const;
 
   const PartitionUpdate& partition_update_;
   const InstallPlan::Partition& install_part_;
@@ -90,7 +107,13 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
   const size_t block_size_;
   InstallOperationExecutor executor_;
   VerifiedSourceFd verified_source_fd_;
-  ExtentMap<const CowMergeOperation*, ExtentLess> xor_map_;
+  // The name the I/O of the source partition is counted as, if instrumented.
+  std::string source_io_name_;
+  bool xor_enabled_{false};
+  std::optional<ExtentMap<const CowMergeOperation*>> xor_map_;
+  // The blocks of the operation passed to Init() already in the COW, see
+  // ResumePartialOperation().
+  uint64_t resume_partial_blocks_{0};
 };
 
 }  // namespace chromeos_update_engine
@@ -136,6 +136,37 @@ TEST_F(VABCPartitionWriterTest, MergeSequenceXorSameBlock) {
   ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
 }
 
+TEST_F(VABCPartitionWriterTest, MergeSequenceChunksTest) {
+  // More blocks than a chunk of the merge sequence.
+  static constexpr uint64_t kChunkBlocks = 16383 * 64;
+  AddMergeOp(&partition_update_,
+             {0, kChunkBlocks + 3},
+             {kChunkBlocks + 3, kChunkBlocks + 3},
+             CowMergeOperation::COW_XOR);
+  VABCPartitionWriter writer_{
+      partition_update_, install_part_, &dynamic_control_, kBlockSize};
+  EXPECT_CALL(dynamic_control_, OpenCowWriter(fake_part_name, _, false))
+      .WillOnce(Invoke(
+          [](const std::string&, const std::optional<std::string>&, bool) {
+            auto cow_writer =
+                std::make_unique<android::snapshot::MockSnapshotWriter>(
+                    android::snapshot::CowOptions{});
+            Sequence s;
+            EXPECT_CALL(*cow_writer, Initialize()).WillOnce(Return(true));
+            EXPECT_CALL(*cow_writer, EmitSequenceData(kChunkBlocks, _))
+                .InSequence(s)
+                .WillOnce(Return(true));
+            EXPECT_CALL(*cow_writer, EmitSequenceData(3, _))
+                .InSequence(s)
+                .WillOnce(Return(true));
+            ON_CALL(*cow_writer, EmitLabel(_)).WillByDefault(Return(true));
+            return cow_writer;
+          }));
+  EXPECT_CALL(dynamic_control_, GetVirtualAbCompressionXorFeatureFlag())
+      .WillRepeatedly(Return(FeatureFlag(FeatureFlag::Value::LAUNCH)));
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+}
+
 TEST_F(VABCPartitionWriterTest, EmitBlockTest) {
   AddMergeOp(&partition_update_, {5, 1}, {10, 1}, CowMergeOperation::COW_COPY);
   AddMergeOp(&partition_update_, {10, 1}, {15, 1}, CowMergeOperation::COW_COPY);
@@ -243,6 +274,28 @@ TEST_F(VABCPartitionWriterTest, StreamXORBlockTest) {
       *install_op, nullptr, patch_data.data(), patch_data.size()));
 }
 
+TEST_F(VABCPartitionWriterTest, ResumePartialOperationTest) {
+  install_plan_.is_resume = true;
+  EXPECT_CALL(dynamic_control_, OpenCowWriter(fake_part_name, _, true))
+      .WillOnce(Invoke(
+          [](const std::string&, const std::optional<std::string>&, bool) {
+            auto cow_writer =
+                std::make_unique<android::snapshot::MockSnapshotWriter>(
+                    android::snapshot::CowOptions{});
+            // The label of the checkpoint after 5 blocks of operation 3.
+            EXPECT_CALL(*cow_writer, InitializeAppend((1ULL << 63) |
+                                                      (3ULL << 32) | 5))
+                .WillOnce(Return(true));
+            EXPECT_CALL(*cow_writer, Initialize()).Times(0);
+            EXPECT_CALL(*cow_writer, EmitCopy(_, _)).Times(0);
+            return cow_writer;
+          }));
+  VABCPartitionWriter writer_{
+      partition_update_, install_part_, &dynamic_control_, kBlockSize};
+  writer_.ResumePartialOperation(5);
+  ASSERT_TRUE(writer_.Init(&install_plan_, false, 3));
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <memory>
 #include <utility>
 #include <vector>
@@ -29,12 +30,39 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/instrumented_file_descriptor.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
 #include "update_engine/payload_consumer/mount_history.h"
 #include "update_engine/payload_consumer/partition_writer.h"
 
 namespace chromeos_update_engine {
 using std::string;
 
+namespace {
+// The most source blocks cached, in bytes.
+constexpr size_t kSourceCacheSize = 16 * 1024 * 1024;
+
+// The bounds of the source bytes read ahead of the current operation, and
+// where it starts.
+constexpr uint64_t kMinPrefetchWindow = 1024 * 1024;
+constexpr uint64_t kMaxPrefetchWindow = 64 * 1024 * 1024;
+constexpr uint64_t kInitialPrefetchWindow = 4 * 1024 * 1024;
+// Reading and hashing source blocks which were read ahead goes at least this
+// fast, the page cache being much faster than the partition.
+constexpr double kPrefetchedBytesPerSecond = 256.0 * 1024 * 1024;
+// Reads quicker than this are too short to tell whether they were read ahead.
+const base::TimeDelta kMinPrefetchLatency =
+    base::TimeDelta::FromMilliseconds(1);
+
+// Identifies the source blocks of |operation| and their expected hash.
+string SourceKey(const InstallOperation& operation) {
+  string key = operation.src_sha256_hash();
+  for (const Extent& extent : operation.src_extents())
+    key += extent.SerializeAsString();
+  return key;
+}
+}  // namespace
+
 bool VerifiedSourceFd::OpenCurrentECCPartition() {
   // No support for ECC for full payloads.
   // Full payload should not have any opeartion that requires ECC partitions.
@@ -45,13 +73,14 @@ bool VerifiedSourceFd::OpenCurrentECCPartition() {
     return false;
 
 #if USE_FEC
-  FileDescriptorPtr fd(new FecFileDescriptor());
+  auto fd = std::make_shared<FecFileDescriptor>();
   if (!fd->Open(source_path_.c_str(), O_RDONLY, 0)) {
     PLOG(ERROR) << "Unable to open ECC source partition " << source_path_;
     source_ecc_open_failure_ = true;
     return false;
   }
-  source_ecc_fd_ = fd;
+  source_fec_fd_ = fd.get();
+  source_ecc_fd_ = std::move(fd);
 #else
   // No support for ECC compiled.
   source_ecc_open_failure_ = true;
@@ -66,6 +95,8 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
     LOG(ERROR) << "ChooseSourceFD fail: source_fd_ == nullptr";
     return nullptr;
   }
+  ReleaseBlocksBefore(operation);
+  PrefetchAfter(operation);
   if (!operation.has_src_sha256_hash()) {
     // When the operation doesn't include a source hash, we attempt the error
     // corrected device first since we can't verify the block in the raw device
@@ -79,14 +110,32 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
     return source_fd_;
   }
 
+  string source_key;
+  if (!repeated_sources_.empty()) {
+    source_key = SourceKey(operation);
+    if (verified_sources_.count(source_key) > 0)
+      return source_fd_;
+  }
+
   brillo::Blob source_hash;
   brillo::Blob expected_source_hash(operation.src_sha256_hash().begin(),
                                     operation.src_sha256_hash().end());
-  if (fd_utils::ReadAndHashExtents(
-          source_fd_, operation.src_extents(), block_size_, &source_hash) &&
-      source_hash == expected_source_hash) {
+  const base::TimeTicks read_start = base::TimeTicks::Now();
+  const bool read = fd_utils::ReadAndHashExtents(
+      source_fd_, operation.src_extents(), block_size_, &source_hash);
+  if (read) {
+    UpdatePrefetchWindow(
+        utils::BlocksInExtents(operation.src_extents()) * block_size_,
+        base::TimeTicks::Now() - read_start);
+  }
+  if (read && source_hash == expected_source_hash) {
+    if (repeated_sources_.count(source_key) > 0)
+      verified_sources_.insert(std::move(source_key));
     return source_fd_;
   }
+  // Don't let the next operations read the mismatched blocks from the cache.
+  if (source_cache_)
+    source_cache_->Drop(operation.src_extents());
   // We fall back to use the error corrected device if the hash of the raw
   // device doesn't match or there was an error reading the source partition.
   if (!OpenCurrentECCPartition()) {
@@ -103,6 +152,11 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
                << base::HexEncode(expected_source_hash.data(),
                                   expected_source_hash.size());
 
+#if USE_FEC
+  // Decode all the blocks at once, for the hash and then the operation.
+  if (source_fec_fd_)
+    source_fec_fd_->Prefetch(operation.src_extents(), block_size_);
+#endif  // USE_FEC
   if (fd_utils::ReadAndHashExtents(
           source_ecc_fd_, operation.src_extents(), block_size_, &source_hash) &&
       PartitionWriter::ValidateSourceHash(
@@ -113,12 +167,88 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
   return nullptr;
 }
 
-bool VerifiedSourceFd::Open() {
-  source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
-  if (source_fd_ == nullptr)
-    return false;
+bool VerifiedSourceFd::Open(const string& io_name) {
+  FileDescriptorPtr fd = std::make_shared<IoUringFileDescriptor>();
+  if (!io_name.empty())
+    fd = std::make_shared<InstrumentedFileDescriptor>(fd, io_name);
+  source_cache_ = std::make_shared<SourceBlockCacheFileDescriptor>(
+      fd, block_size_, kSourceCacheSize);
+  source_fd_ = source_cache_;
   TEST_AND_RETURN_FALSE_ERRNO(source_fd_->Open(source_path_.c_str(), O_RDONLY));
   return true;
 }
 
+void VerifiedSourceFd::SetOperations(const PartitionUpdate& partition,
+                                     size_t next_op_index) {
+  cached_ops_.clear();
+  cached_op_indexes_.clear();
+  next_cached_op_ = 0;
+  cached_op_offsets_ = {0};
+  next_prefetch_op_ = 0;
+  prefetch_window_ = kInitialPrefetchWindow;
+  repeated_sources_.clear();
+  verified_sources_.clear();
+
+  std::unordered_set<string> sources;
+  for (size_t i = next_op_index;
+       i < static_cast<size_t>(partition.operations_size());
+       i++) {
+    const InstallOperation& operation = partition.operations(i);
+    if (operation.src_extents().empty())
+      continue;
+    if (source_cache_)
+      source_cache_->AddReaders(operation.src_extents());
+    cached_op_indexes_[&operation] = cached_ops_.size();
+    cached_ops_.push_back(&operation);
+    cached_op_offsets_.push_back(
+        cached_op_offsets_.back() +
+        utils::BlocksInExtents(operation.src_extents()) * block_size_);
+    if (operation.has_src_sha256_hash()) {
+      string key = SourceKey(operation);
+      if (!sources.insert(key).second)
+        repeated_sources_.insert(std::move(key));
+    }
+  }
+}
+
+void VerifiedSourceFd::ReleaseBlocksBefore(const InstallOperation& operation) {
+  auto it = cached_op_indexes_.find(&operation);
+  if (it == cached_op_indexes_.end())
+    return;
+  for (; next_cached_op_ < it->second; next_cached_op_++) {
+    if (source_cache_)
+      source_cache_->RemoveReaders(cached_ops_[next_cached_op_]->src_extents());
+  }
+}
+
+void VerifiedSourceFd::PrefetchAfter(const InstallOperation& operation) {
+  auto it = cached_op_indexes_.find(&operation);
+  if (it == cached_op_indexes_.end())
+    return;
+  const size_t next = it->second + 1;
+  next_prefetch_op_ = std::max(next_prefetch_op_, next);
+  const uint64_t window_end = cached_op_offsets_[next] + prefetch_window_;
+  for (; next_prefetch_op_ < cached_ops_.size() &&
+         cached_op_offsets_[next_prefetch_op_] < window_end;
+       next_prefetch_op_++) {
+    for (const Extent& extent : cached_ops_[next_prefetch_op_]->src_extents()) {
+      source_fd_->Readahead(extent.start_block() * block_size_,
+                            extent.num_blocks() * block_size_);
+    }
+  }
+}
+
+void VerifiedSourceFd::UpdatePrefetchWindow(uint64_t bytes,
+                                            base::TimeDelta latency) {
+  if (latency < kMinPrefetchLatency)
+    return;
+  if (bytes < kPrefetchedBytesPerSecond * latency.InSecondsF()) {
+    // The blocks came from the partition: read further ahead.
+    prefetch_window_ = std::min(prefetch_window_ * 2, kMaxPrefetchWindow);
+  } else {
+    prefetch_window_ =
+        std::max(prefetch_window_ - prefetch_window_ / 4, kMinPrefetchWindow);
+  }
+}
+
 }  // namespace chromeos_update_engine
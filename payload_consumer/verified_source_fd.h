@@ -18,17 +18,25 @@
 
 #include <cstddef>
 
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
+#include <base/time/time.h>
 #include <gtest/gtest_prod.h>
 #include <update_engine/update_metadata.pb.h>
 
 #include "update_engine/common/error_code.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/source_block_cache_file_descriptor.h"
 
 namespace chromeos_update_engine {
 
+class FecFileDescriptor;
+
 class VerifiedSourceFd {
  public:
   explicit VerifiedSourceFd(size_t block_size, std::string source_path)
@@ -36,17 +44,60 @@ class VerifiedSourceFd {
   FileDescriptorPtr ChooseSourceFD(const InstallOperation& operation,
                                    ErrorCode* error);
 
-  [[nodiscard]] bool Open();
+  // Opens the source partition, counting its I/O as |io_name| in the
+  // PerformanceReport unless empty.
+  [[nodiscard]] bool Open(const std::string& io_name);
+
+  // Counts the source blocks read by the operations of |partition| from
+  // |next_op_index| on, so the blocks read by several of them are only read
+  // from the partition once, and the blocks of each operation are read once
+  // to check their hash and to apply it. The source blocks of the next
+  // operations are also read ahead while each one is applied. The source
+  // partition must not be written while the operations are applied.
+  void SetOperations(const PartitionUpdate& partition, size_t next_op_index);
 
  private:
   bool OpenCurrentECCPartition();
+  // Releases the blocks of the operations applied before |operation|, the
+  // ones skipped being applied elsewhere.
+  void ReleaseBlocksBefore(const InstallOperation& operation);
+  // Reads ahead the source blocks of the operations after |operation|, up to
+  // |prefetch_window_| bytes of them.
+  void PrefetchAfter(const InstallOperation& operation);
+  // Grows |prefetch_window_| if reading |bytes| of an operation took
+  // |latency|, too long for them to have been read ahead, or shrinks it.
+  void UpdatePrefetchWindow(uint64_t bytes, base::TimeDelta latency);
   const size_t block_size_;
   const std::string source_path_;
   FileDescriptorPtr source_ecc_fd_;
+  // The |source_ecc_fd_| opened by OpenCurrentECCPartition(), used to decode
+  // the blocks of an operation at once.
+  FecFileDescriptor* source_fec_fd_{nullptr};
   FileDescriptorPtr source_fd_;
+  // The cache |source_fd_| reads through, if opened by Open().
+  std::shared_ptr<SourceBlockCacheFileDescriptor> source_cache_;
+
+  // The operations counted by SetOperations(), in order, and their index.
+  std::vector<const InstallOperation*> cached_ops_;
+  std::unordered_map<const InstallOperation*, size_t> cached_op_indexes_;
+  // The first operation in |cached_ops_| whose blocks are still counted.
+  size_t next_cached_op_{0};
+  // The source bytes of the operations in |cached_ops_| before each of them,
+  // and of all of them last.
+  std::vector<uint64_t> cached_op_offsets_;
+  // The first operation in |cached_ops_| not read ahead yet.
+  size_t next_prefetch_op_{0};
+  // The most source bytes read ahead of the current operation.
+  uint64_t prefetch_window_{0};
+  // The source extents and hash shared by several of the operations, and the
+  // ones among them that already matched, which aren't checked again.
+  std::unordered_set<std::string> repeated_sources_;
+  std::unordered_set<std::string> verified_sources_;
 
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
+  FRIEND_TEST(PartitionWriterTest, CopiesSourceBlocksInKernelTest);
+  FRIEND_TEST(PartitionWriterTest, PrefetchesNextSourceExtentsTest);
   // The total number of operations that failed source hash verification but
   // passed after falling back to the error-corrected |source_ecc_fd_| device.
   uint64_t source_ecc_recovered_failures_{0};
@@ -20,15 +20,19 @@
 
 #include <algorithm>
 #include <memory>
+#include <vector>
 
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
 #include <fec/ecc.h>
+#include <openssl/evp.h>
 extern "C" {
 #include <fec.h>
 }
 
+#include "update_engine/common/memory_budget.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 #include "update_engine/payload_consumer/cached_file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 
@@ -40,19 +44,169 @@ std::unique_ptr<VerityWriterInterface> CreateVerityWriter() {
 }
 }  // namespace verity_writer
 
+namespace {
+// The data and parity of one FEC round, see EncodeFEC().
+struct FecRound {
+  brillo::Blob data;
+  brillo::Blob fec;
+  // Set when |fec| was read from the source partition instead.
+  bool reused = false;
+};
+
+bool ReadExactly(FileDescriptor* fd, void* buf, size_t count, uint64_t offset) {
+  ssize_t bytes_read = 0;
+  return utils::PReadAll(fd, buf, count, offset, &bytes_read) &&
+         bytes_read >= 0 && static_cast<size_t>(bytes_read) == count;
+}
+
+// Writes to |digest| the hash of the |size| bytes of |data| after |salt|, the
+// way dm-verity hashes the blocks of each level of the hash tree.
+bool HashBlock(EVP_MD_CTX* ctx,
+               const EVP_MD* md,
+               const brillo::Blob& salt,
+               const uint8_t* data,
+               size_t size,
+               uint8_t* digest) {
+  unsigned int digest_size = 0;
+  return EVP_DigestInit_ex(ctx, md, nullptr) == 1 &&
+         EVP_DigestUpdate(ctx, salt.data(), salt.size()) == 1 &&
+         EVP_DigestUpdate(ctx, data, size) == 1 &&
+         EVP_DigestFinal_ex(ctx, digest, &digest_size) == 1;
+}
+
+using ScopedEvpMdCtx = std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>;
+
+// Reads the |rs_n| blocks of FEC |round| out of |rounds| into |data|, one
+// after the other. The blocks past |data_size| are zeros.
+bool ReadFecRound(FileDescriptor* read_fd,
+                  uint64_t data_offset,
+                  uint64_t data_size,
+                  uint64_t round,
+                  uint64_t rounds,
+                  size_t rs_n,
+                  uint32_t block_size,
+                  brillo::Blob* data) {
+  std::vector<FileDescriptor::ReadRequest> requests;
+  requests.reserve(rs_n);
+  for (size_t j = 0; j < rs_n; j++) {
+    uint8_t* buffer = data->data() + j * block_size;
+    uint64_t offset =
+        fec_ecc_interleave(round * rs_n * block_size + j, rs_n, rounds);
+    // Don't read past |data_size|, treat them as 0.
+    if (offset < data_size) {
+      requests.push_back({data_offset + offset, buffer, block_size});
+    } else {
+      std::fill(buffer, buffer + block_size, 0);
+    }
+  }
+  return read_fd->ReadBatch(requests);
+}
+
+// Computes the parity of |round|. Encodes |block_size| number of rs blocks
+// each round so that we can read one block each time instead of 1 byte to
+// increase random read performance.
+void EncodeFecRound(void* rs_char,
+                    size_t rs_n,
+                    uint32_t block_size,
+                    uint32_t fec_roots,
+                    FecRound* round) {
+  // The k-th rs block is made of the k-th byte of every block.
+  brillo::Blob rs_blocks(block_size * rs_n);
+  for (size_t j = 0; j < rs_n; j++) {
+    const uint8_t* buffer = round->data.data() + j * block_size;
+    for (size_t k = 0; k < block_size; k++) {
+      rs_blocks[k * rs_n + j] = buffer[k];
+    }
+  }
+  for (size_t j = 0; j < block_size; j++) {
+    // Encode [j * rs_n : (j + 1) * rs_n) in |rs_blocks| and write |fec_roots|
+    // number of parity bytes to |j * fec_roots| in |fec|.
+    encode_rs_char(rs_char,
+                   rs_blocks.data() + j * rs_n,
+                   round->fec.data() + j * fec_roots);
+  }
+}
+
+// Sets |reused| to whether each of the |rounds| FEC rounds is made only of
+// blocks in |unchanged_blocks|, if the parity |source_fd| has at |fec_offset|
+// for the first of them is the one encoded from its data there. Returns the
+// number of rounds set.
+uint64_t FindReusableFecRounds(FileDescriptor* source_fd,
+                               const ExtentRanges& unchanged_blocks,
+                               void* rs_char,
+                               uint64_t data_offset,
+                               uint64_t data_size,
+                               uint64_t fec_offset,
+                               uint64_t rounds,
+                               size_t rs_n,
+                               uint32_t fec_roots,
+                               uint32_t block_size,
+                               std::vector<bool>* reused) {
+  reused->assign(rounds, false);
+  uint64_t num_reused = 0;
+  for (uint64_t round = 0; round < rounds; round++) {
+    bool unchanged = true;
+    for (size_t j = 0; unchanged && j < rs_n; j++) {
+      uint64_t offset =
+          fec_ecc_interleave(round * rs_n * block_size + j, rs_n, rounds);
+      // The blocks past |data_size| are zeros in both partitions.
+      unchanged = offset >= data_size ||
+                  unchanged_blocks.ContainsBlock((data_offset + offset) /
+                                                 block_size);
+    }
+    (*reused)[round] = unchanged;
+    num_reused += unchanged ? 1 : 0;
+  }
+  if (num_reused == 0)
+    return 0;
+
+  const uint64_t first = std::find(reused->begin(), reused->end(), true) -
+                         reused->begin();
+  FecRound round;
+  round.data.resize(rs_n * block_size);
+  round.fec.resize(fec_roots * block_size);
+  brillo::Blob source_fec(round.fec.size());
+  if (!ReadFecRound(source_fd,
+                    data_offset,
+                    data_size,
+                    first,
+                    rounds,
+                    rs_n,
+                    block_size,
+                    &round.data) ||
+      !ReadExactly(source_fd,
+                   source_fec.data(),
+                   source_fec.size(),
+                   fec_offset + first * source_fec.size())) {
+    PLOG(WARNING) << "Unable to read the source FEC data, encoding it all.";
+    reused->assign(rounds, false);
+    return 0;
+  }
+  EncodeFecRound(rs_char, rs_n, block_size, fec_roots, &round);
+  if (round.fec != source_fec) {
+    LOG(WARNING) << "The source FEC data doesn't match, encoding it all.";
+    reused->assign(rounds, false);
+    return 0;
+  }
+  return num_reused;
+}
+}  // namespace
+
 bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
   partition_ = &partition;
+  hash_tree_builder_.reset();
+  hash_function_ = nullptr;
 
   if (partition_->hash_tree_size != 0) {
-    auto hash_function =
+    hash_function_ =
         HashTreeBuilder::HashFunction(partition_->hash_tree_algorithm);
-    if (hash_function == nullptr) {
+    if (hash_function_ == nullptr) {
       LOG(ERROR) << "Verity hash algorithm not supported: "
                  << partition_->hash_tree_algorithm;
       return false;
     }
     hash_tree_builder_ = std::make_unique<HashTreeBuilder>(
-        partition_->block_size, hash_function);
+        partition_->block_size, hash_function_);
     TEST_AND_RETURN_FALSE(hash_tree_builder_->Initialize(
         partition_->hash_tree_data_size, partition_->hash_tree_salt));
     if (hash_tree_builder_->CalculateSize(partition_->hash_tree_data_size) !=
@@ -65,9 +219,281 @@ bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
     }
   }
   total_offset_ = 0;
+
+  if (source_fd_.IsOpen())
+    source_fd_.Close();
+  unchanged_blocks_ = ExtentRanges();
+  build_hash_tree_ = false;
+  reuse_source_hashes_ = false;
+  leaf_hashes_.clear();
+  pending_block_.clear();
+  num_reused_hashes_ = 0;
+  if (!partition_->unchanged_extents.empty() &&
+      !partition_->source_path.empty()) {
+    if (source_fd_.Open(partition_->source_path.c_str(), O_RDONLY)) {
+      unchanged_blocks_.AddExtents(partition_->unchanged_extents);
+    } else {
+      PLOG(WARNING) << "Unable to open " << partition_->source_path
+                    << ", computing all the verity data of "
+                    << partition_->name;
+    }
+  }
+  if (hash_tree_builder_ && ComputeHashTreeLayout()) {
+    reuse_source_hashes_ = source_fd_.IsOpen() && CanReuseSourceHashes();
+    build_hash_tree_ = reuse_source_hashes_ || hash_threads_ > 1;
+  }
+  if (build_hash_tree_) {
+    hash_tree_builder_.reset();
+    leaf_hashes_.reserve(partition_->hash_tree_data_size /
+                         partition_->block_size *
+                         EVP_MD_size(hash_function_));
+    if (hash_threads_ > 1 && !hash_pool_)
+      hash_pool_ = std::make_unique<WorkerPool>(hash_threads_, hash_threads_);
+  }
   return true;
 }
 
+bool VerityWriterAndroid::ComputeHashTreeLayout() {
+  const uint32_t block_size = partition_->block_size;
+  const size_t digest_size = EVP_MD_size(hash_function_);
+  // The layout is only computed here when the hashes fill the blocks of each
+  // level without padding between them.
+  if (block_size % digest_size != 0 ||
+      partition_->hash_tree_data_offset % block_size != 0 ||
+      partition_->hash_tree_data_size % block_size != 0) {
+    return false;
+  }
+  // The first level is the last one in the hash tree, after all the others.
+  const uint64_t leaves_size = utils::RoundUp(
+      partition_->hash_tree_data_size / block_size * digest_size, block_size);
+  uint64_t level_size = leaves_size;
+  uint64_t upper_levels_size = 0;
+  while (level_size > block_size) {
+    level_size =
+        utils::RoundUp(level_size / block_size * digest_size, block_size);
+    upper_levels_size += level_size;
+  }
+  if (upper_levels_size + leaves_size != partition_->hash_tree_size)
+    return false;
+  leaves_offset_ = partition_->hash_tree_offset + upper_levels_size;
+  return true;
+}
+
+bool VerityWriterAndroid::CanReuseSourceHashes() {
+  const uint32_t block_size = partition_->block_size;
+  const size_t digest_size = EVP_MD_size(hash_function_);
+  const uint64_t first_block = partition_->hash_tree_data_offset / block_size;
+  const uint64_t end_block =
+      first_block + partition_->hash_tree_data_size / block_size;
+  std::vector<uint64_t> samples;
+  for (const auto& extent : unchanged_blocks_.extent_set()) {
+    const uint64_t start = std::max(extent.start_block(), first_block);
+    const uint64_t end = std::min(extent.end_block(), end_block);
+    if (start >= end)
+      continue;
+    if (samples.empty())
+      samples.push_back(start);
+    if (samples.size() == 2)
+      samples.pop_back();
+    samples.push_back(end - 1);
+  }
+  if (samples.empty())
+    return false;
+
+  ScopedEvpMdCtx ctx(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+  TEST_AND_RETURN_FALSE(ctx != nullptr);
+  brillo::Blob block(block_size);
+  brillo::Blob digest(digest_size);
+  brillo::Blob source_digest(digest_size);
+  for (uint64_t sample : samples) {
+    if (!ReadExactly(&source_fd_,
+                     block.data(),
+                     block.size(),
+                     sample * block_size) ||
+        !ReadExactly(&source_fd_,
+                     source_digest.data(),
+                     source_digest.size(),
+                     leaves_offset_ + (sample - first_block) * digest_size)) {
+      PLOG(WARNING) << "Unable to read the source hash tree of "
+                    << partition_->name;
+      return false;
+    }
+    TEST_AND_RETURN_FALSE(HashBlock(ctx.get(),
+                                    hash_function_,
+                                    partition_->hash_tree_salt,
+                                    block.data(),
+                                    block.size(),
+                                    digest.data()));
+    if (digest != source_digest) {
+      LOG(INFO) << "The source hash tree of " << partition_->name
+                << " doesn't match, computing all the hashes.";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool VerityWriterAndroid::UpdateLeafHashes(const uint8_t* data, size_t size) {
+  const uint32_t block_size = partition_->block_size;
+  while (size > 0) {
+    if (pending_block_.empty() && size >= block_size) {
+      const size_t num_blocks = size / block_size;
+      TEST_AND_RETURN_FALSE(HashLeafBlocks(data, num_blocks));
+      data += num_blocks * block_size;
+      size -= num_blocks * block_size;
+      continue;
+    }
+    const size_t count =
+        std::min<size_t>(size, block_size - pending_block_.size());
+    pending_block_.insert(pending_block_.end(), data, data + count);
+    data += count;
+    size -= count;
+    if (pending_block_.size() == block_size) {
+      TEST_AND_RETURN_FALSE(HashLeafBlocks(pending_block_.data(), 1));
+      pending_block_.clear();
+    }
+  }
+  return true;
+}
+
+bool VerityWriterAndroid::HashLeafBlocks(const uint8_t* data,
+                                         size_t num_blocks) {
+  const uint32_t block_size = partition_->block_size;
+  const size_t digest_size = EVP_MD_size(hash_function_);
+  const uint64_t first_block = partition_->hash_tree_data_offset / block_size;
+  size_t i = 0;
+  while (i < num_blocks) {
+    const uint64_t index = leaf_hashes_.size() / digest_size;
+    const size_t old_size = leaf_hashes_.size();
+    const bool reused =
+        reuse_source_hashes_ &&
+        unchanged_blocks_.ContainsBlock(first_block + index);
+    size_t run = 1;
+    while (i + run < num_blocks &&
+           reused == (reuse_source_hashes_ &&
+                      unchanged_blocks_.ContainsBlock(first_block + index +
+                                                      run))) {
+      run++;
+    }
+    leaf_hashes_.resize(old_size + run * digest_size);
+    if (!reused) {
+      TEST_AND_RETURN_FALSE(HashBlocks(
+          data + i * block_size, run, leaf_hashes_.data() + old_size));
+    } else if (ReadExactly(&source_fd_,
+                           leaf_hashes_.data() + old_size,
+                           run * digest_size,
+                           leaves_offset_ + index * digest_size)) {
+      num_reused_hashes_ += run;
+    } else {
+      PLOG(ERROR) << "Unable to read the source hash tree of "
+                  << partition_->name;
+      return false;
+    }
+    i += run;
+  }
+  return true;
+}
+
+bool VerityWriterAndroid::HashBlocks(const uint8_t* data,
+                                     size_t num_blocks,
+                                     uint8_t* digests) {
+  const uint32_t block_size = partition_->block_size;
+  const size_t digest_size = EVP_MD_size(hash_function_);
+  const EVP_MD* hash_function = hash_function_;
+  const brillo::Blob* salt = &partition_->hash_tree_salt;
+  auto hash_range = [=](size_t first, size_t count) {
+    ScopedEvpMdCtx ctx(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+    TEST_AND_RETURN_FALSE(ctx != nullptr);
+    for (size_t i = first; i < first + count; i++) {
+      TEST_AND_RETURN_FALSE(HashBlock(ctx.get(),
+                                      hash_function,
+                                      *salt,
+                                      data + i * block_size,
+                                      block_size,
+                                      digests + i * digest_size));
+    }
+    return true;
+  };
+  // Below this many blocks per worker, handing them over costs more than
+  // hashing them right away.
+  constexpr size_t kMinBlocksPerTask = 64;
+  const size_t num_tasks =
+      hash_pool_ ? std::min(hash_threads_, num_blocks / kMinBlocksPerTask) : 1;
+  if (num_tasks <= 1)
+    return hash_range(0, num_blocks);
+  const size_t blocks_per_task = utils::DivRoundUp(num_blocks, num_tasks);
+  for (size_t first = 0; first < num_blocks; first += blocks_per_task) {
+    const size_t count = std::min(blocks_per_task, num_blocks - first);
+    TEST_AND_RETURN_FALSE(hash_pool_->Post(
+        [hash_range, first, count]() { return hash_range(first, count); }));
+  }
+  return hash_pool_->Wait();
+}
+
+bool VerityWriterAndroid::WriteHashTree(FileDescriptor* write_fd) {
+  TEST_AND_RETURN_FALSE(pending_block_.empty());
+  const uint32_t block_size = partition_->block_size;
+  const size_t digest_size = EVP_MD_size(hash_function_);
+  std::vector<brillo::Blob> levels;
+  levels.push_back(std::move(leaf_hashes_));
+  leaf_hashes_.clear();
+  levels.back().resize(utils::RoundUp(levels.back().size(), block_size));
+  while (levels.back().size() > block_size) {
+    const brillo::Blob& below = levels.back();
+    const size_t num_blocks = below.size() / block_size;
+    brillo::Blob level(utils::RoundUp(num_blocks * digest_size, block_size));
+    TEST_AND_RETURN_FALSE(HashBlocks(below.data(), num_blocks, level.data()));
+    levels.push_back(std::move(level));
+  }
+  LOG_IF(INFO, reuse_source_hashes_)
+      << "Reused the hashes of " << num_reused_hashes_ << " of "
+      << partition_->hash_tree_data_size / block_size << " blocks of "
+      << partition_->name << " from the source hash tree.";
+
+  // The top level comes first.
+  TEST_AND_RETURN_FALSE_ERRNO(
+      write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
+  uint64_t offset = partition_->hash_tree_offset;
+  for (auto level = levels.rbegin(); level != levels.rend(); ++level) {
+    TEST_AND_RETURN_FALSE(
+        utils::WriteAll(write_fd, level->data(), level->size()));
+    AddUnchangedHashTreeBlocks(level->data(), level->size(), offset);
+    offset += level->size();
+  }
+  return true;
+}
+
+void VerityWriterAndroid::AddUnchangedHashTreeBlocks(const uint8_t* data,
+                                                     size_t size,
+                                                     uint64_t offset) {
+  const uint32_t block_size = partition_->block_size;
+  if (!source_fd_.IsOpen() || partition_->fec_size == 0 ||
+      offset % block_size != 0) {
+    return;
+  }
+  // The source hash tree is read 1 MiB at a time.
+  const size_t chunk_size = std::max<size_t>(block_size, 1 << 20) /
+                            block_size * block_size;
+  brillo::Blob source_data;
+  for (size_t i = 0; i + block_size <= size; i += chunk_size) {
+    source_data.resize(std::min(chunk_size, size - i) / block_size *
+                       block_size);
+    if (!ReadExactly(&source_fd_,
+                     source_data.data(),
+                     source_data.size(),
+                     offset + i)) {
+      return;
+    }
+    for (size_t j = 0; j < source_data.size(); j += block_size) {
+      if (std::equal(source_data.begin() + j,
+                     source_data.begin() + j + block_size,
+                     data + i + j)) {
+        unchanged_blocks_.AddBlock((offset + i + j) / block_size);
+      }
+    }
+  }
+}
+
 bool VerityWriterAndroid::Update(const uint64_t offset,
                                  const uint8_t* buffer,
                                  size_t size) {
@@ -90,8 +516,13 @@ bool VerityWriterAndroid::Update(const uint64_t offset,
     }
     const uint64_t end_offset = std::min(offset + size, hash_tree_data_end);
     if (start_offset < end_offset) {
-      TEST_AND_RETURN_FALSE(hash_tree_builder_->Update(
-          buffer + start_offset - offset, end_offset - start_offset));
+      if (build_hash_tree_) {
+        TEST_AND_RETURN_FALSE(UpdateLeafHashes(
+            buffer + start_offset - offset, end_offset - start_offset));
+      } else {
+        TEST_AND_RETURN_FALSE(hash_tree_builder_->Update(
+            buffer + start_offset - offset, end_offset - start_offset));
+      }
 
       if (end_offset == hash_tree_data_end) {
         LOG(INFO)
@@ -118,12 +549,18 @@ bool VerityWriterAndroid::Finalize(FileDescriptor* read_fd,
   // All hash tree data blocks has been hashed, write hash tree to disk.
   LOG(INFO) << "Writing verity hash tree to "
             << partition_->readonly_target_path;
-  if (hash_tree_builder_) {
+  if (build_hash_tree_) {
+    TEST_AND_RETURN_FALSE(WriteHashTree(write_fd));
+  } else if (hash_tree_builder_) {
     TEST_AND_RETURN_FALSE(hash_tree_builder_->BuildHashTree());
     TEST_AND_RETURN_FALSE_ERRNO(
         write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
-    auto success =
-        hash_tree_builder_->WriteHashTree([write_fd](auto data, auto size) {
+    uint64_t offset = partition_->hash_tree_offset;
+    auto success = hash_tree_builder_->WriteHashTree(
+        [this, write_fd, &offset](auto data, auto size) {
+          const auto* bytes = static_cast<const uint8_t*>(data);
+          AddUnchangedHashTreeBlocks(bytes, size, offset);
+          offset += size;
           return utils::WriteAll(write_fd, data, size);
         });
     // hashtree builder already prints error messages.
@@ -140,7 +577,10 @@ bool VerityWriterAndroid::Finalize(FileDescriptor* read_fd,
                                     partition_->fec_size,
                                     partition_->fec_roots,
                                     partition_->block_size,
-                                    false /* verify_mode */));
+                                    false /* verify_mode */,
+                                    fec_threads_,
+                                    source_fd_.IsOpen() ? &source_fd_ : nullptr,
+                                    &unchanged_blocks_));
   }
   return true;
 }
@@ -153,7 +593,10 @@ bool VerityWriterAndroid::EncodeFEC(FileDescriptor* read_fd,
                                     uint64_t fec_size,
                                     uint32_t fec_roots,
                                     uint32_t block_size,
-                                    bool verify_mode) {
+                                    bool verify_mode,
+                                    size_t num_threads,
+                                    FileDescriptor* source_fd,
+                                    const ExtentRanges* unchanged_blocks) {
   TEST_AND_RETURN_FALSE(data_size % block_size == 0);
   TEST_AND_RETURN_FALSE(fec_roots >= 0 && fec_roots < FEC_RSM);
   // This is the N in RS(M, N), which is the number of bytes for each rs block.
@@ -164,63 +607,141 @@ bool VerityWriterAndroid::EncodeFEC(FileDescriptor* read_fd,
   std::unique_ptr<void, decltype(&free_rs_char)> rs_char(
       init_rs_char(FEC_PARAMS(fec_roots)), &free_rs_char);
   TEST_AND_RETURN_FALSE(rs_char != nullptr);
+
+  std::vector<bool> reused_rounds;
+  if (source_fd && unchanged_blocks && !verify_mode &&
+      data_offset % block_size == 0) {
+    const uint64_t num_reused = FindReusableFecRounds(source_fd,
+                                                      *unchanged_blocks,
+                                                      rs_char.get(),
+                                                      data_offset,
+                                                      data_size,
+                                                      fec_offset,
+                                                      rounds,
+                                                      rs_n,
+                                                      fec_roots,
+                                                      block_size,
+                                                      &reused_rounds);
+    LOG(INFO) << "Copying the FEC data of " << num_reused << " of " << rounds
+              << " rounds from the source partition.";
+  }
+  const uint64_t first_fec_offset = fec_offset;
+
   // Cache at most 1MB of fec data, in VABC, we need to re-open fd if we
   // perform a read() operation after write(). So reduce the number of writes
   // can save unnecessary re-opens.
   UnownedCachedFileDescriptor cache_fd(write_fd, 1 * (1 << 20));
   write_fd = &cache_fd;
 
-  for (size_t i = 0; i < rounds; i++) {
-    // Encodes |block_size| number of rs blocks each round so that we can read
-    // one block each time instead of 1 byte to increase random read
-    // performance. This uses about 1 MiB memory for 4K block size.
-    brillo::Blob rs_blocks(block_size * rs_n);
-    for (size_t j = 0; j < rs_n; j++) {
-      brillo::Blob buffer(block_size, 0);
-      uint64_t offset =
-          fec_ecc_interleave(i * rs_n * block_size + j, rs_n, rounds);
-      // Don't read past |data_size|, treat them as 0.
-      if (offset < data_size) {
+  // Rounds are encoded in windows of up to |num_threads| rounds, one per
+  // worker, while the data of the next window is read. Each round in flight
+  // holds its data, the transposed copy being encoded and its parity.
+  const size_t round_memory = (2 * rs_n + fec_roots) * block_size;
+  num_threads = std::max<uint64_t>(1, std::min<uint64_t>(num_threads, rounds));
+  auto reservation =
+      MemoryBudget::Get()->Reserve(2 * round_memory,
+                                   2 * round_memory * num_threads,
+                                   2 * round_memory,
+                                   "verity");
+  const size_t window_size = reservation.size() / (2 * round_memory);
+  std::vector<FecRound> windows[2];
+  for (auto& window : windows) {
+    window.resize(window_size);
+    for (auto& round : window) {
+      round.data.resize(rs_n * block_size);
+      round.fec.resize(fec_roots * block_size);
+    }
+  }
+  // Destroyed first, after waiting for the rounds in |windows|.
+  std::unique_ptr<WorkerPool> pool;
+  if (window_size > 1) {
+    pool = std::make_unique<WorkerPool>(window_size, window_size);
+  }
+
+  // Waits for the |num_rounds| rounds of |window| and writes their parity,
+  // or compares it with the one on disk if |verify_mode|.
+  auto finish_window = [&](const std::vector<FecRound>& window,
+                           size_t num_rounds) {
+    if (pool) {
+      TEST_AND_RETURN_FALSE(pool->Wait());
+    }
+    for (size_t i = 0; i < num_rounds; i++) {
+      const brillo::Blob& fec = window[i].fec;
+      if (verify_mode) {
+        brillo::Blob fec_read(fec.size());
         ssize_t bytes_read = 0;
         TEST_AND_RETURN_FALSE(utils::PReadAll(read_fd,
-                                              buffer.data(),
-                                              buffer.size(),
-                                              data_offset + offset,
+                                              fec_read.data(),
+                                              fec_read.size(),
+                                              fec_offset,
                                               &bytes_read));
         TEST_AND_RETURN_FALSE(bytes_read >= 0);
-        TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == buffer.size());
+        TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) ==
+                              fec_read.size());
+        TEST_AND_RETURN_FALSE(fec == fec_read);
+      } else {
+        CHECK(write_fd);
+        write_fd->Seek(fec_offset, SEEK_SET);
+        if (!utils::WriteAll(write_fd, fec.data(), fec.size())) {
+          PLOG(ERROR) << "EncodeFEC write() failed";
+          return false;
+        }
       }
-      for (size_t k = 0; k < buffer.size(); k++) {
-        rs_blocks[k * rs_n + j] = buffer[k];
+      fec_offset += fec.size();
+    }
+    return true;
+  };
+
+  size_t current = 0;
+  size_t pending_rounds = 0;
+  for (uint64_t first_round = 0; first_round < rounds;
+       first_round += window_size) {
+    std::vector<FecRound>& window = windows[current];
+    const size_t num_rounds =
+        std::min<uint64_t>(window_size, rounds - first_round);
+    for (size_t i = 0; i < num_rounds; i++) {
+      const uint64_t round = first_round + i;
+      window[i].reused = !reused_rounds.empty() && reused_rounds[round];
+      if (window[i].reused) {
+        brillo::Blob& fec = window[i].fec;
+        TEST_AND_RETURN_FALSE(ReadExactly(source_fd,
+                                          fec.data(),
+                                          fec.size(),
+                                          first_fec_offset +
+                                              round * fec.size()));
+        continue;
       }
+      TEST_AND_RETURN_FALSE(ReadFecRound(read_fd,
+                                         data_offset,
+                                         data_size,
+                                         round,
+                                         rounds,
+                                         rs_n,
+                                         block_size,
+                                         &window[i].data));
     }
-    brillo::Blob fec(block_size * fec_roots);
-    for (size_t j = 0; j < block_size; j++) {
-      // Encode [j * rs_n : (j + 1) * rs_n) in |rs_blocks| and write |fec_roots|
-      // number of parity bytes to |j * fec_roots| in |fec|.
-      encode_rs_char(rs_char.get(),
-                     rs_blocks.data() + j * rs_n,
-                     fec.data() + j * fec_roots);
-    }
-
-    if (verify_mode) {
-      brillo::Blob fec_read(fec.size());
-      ssize_t bytes_read = 0;
-      TEST_AND_RETURN_FALSE(utils::PReadAll(
-          read_fd, fec_read.data(), fec_read.size(), fec_offset, &bytes_read));
-      TEST_AND_RETURN_FALSE(bytes_read >= 0);
-      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == fec_read.size());
-      TEST_AND_RETURN_FALSE(fec == fec_read);
-    } else {
-      CHECK(write_fd);
-      write_fd->Seek(fec_offset, SEEK_SET);
-      if (!utils::WriteAll(write_fd, fec.data(), fec.size())) {
-        PLOG(ERROR) << "EncodeFEC write() failed";
-        return false;
+    TEST_AND_RETURN_FALSE(finish_window(windows[current ^ 1], pending_rounds));
+    for (size_t i = 0; i < num_rounds; i++) {
+      FecRound* round = &window[i];
+      if (round->reused)
+        continue;
+      if (!pool) {
+        EncodeFecRound(rs_char.get(), rs_n, block_size, fec_roots, round);
+        continue;
       }
+      TEST_AND_RETURN_FALSE(pool->Post([round, rs_n, block_size, fec_roots]() {
+        // Each worker has its own codec.
+        std::unique_ptr<void, decltype(&free_rs_char)> rs_char(
+            init_rs_char(FEC_PARAMS(fec_roots)), &free_rs_char);
+        TEST_AND_RETURN_FALSE(rs_char != nullptr);
+        EncodeFecRound(rs_char.get(), rs_n, block_size, fec_roots, round);
+        return true;
+      }));
     }
-    fec_offset += fec.size();
+    pending_rounds = num_rounds;
+    current ^= 1;
   }
+  TEST_AND_RETURN_FALSE(finish_window(windows[current ^ 1], pending_rounds));
   write_fd->Flush();
   return true;
 }
@@ -232,7 +753,8 @@ bool VerityWriterAndroid::EncodeFEC(const std::string& path,
                                     uint64_t fec_size,
                                     uint32_t fec_roots,
                                     uint32_t block_size,
-                                    bool verify_mode) {
+                                    bool verify_mode,
+                                    size_t num_threads) {
   EintrSafeFileDescriptor fd;
   TEST_AND_RETURN_FALSE(fd.Open(path.c_str(), verify_mode ? O_RDONLY : O_RDWR));
   return EncodeFEC(&fd,
@@ -243,6 +765,7 @@ bool VerityWriterAndroid::EncodeFEC(const std::string& path,
                    fec_size,
                    fec_roots,
                    block_size,
-                   verify_mode);
+                   verify_mode,
+                   num_threads);
 }
 }  // namespace chromeos_update_engine
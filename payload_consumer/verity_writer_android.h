@@ -17,13 +17,17 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_VERITY_WRITER_ANDROID_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_VERITY_WRITER_ANDROID_H_
 
+#include <algorithm>
 #include <memory>
 #include <string>
 
+#include <brillo/secure_blob.h>
 #include <verity/hash_tree_builder.h>
 
 #include "payload_consumer/file_descriptor.h"
+#include "update_engine/common/worker_pool.h"
 #include "update_engine/payload_consumer/verity_writer_interface.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 
 namespace chromeos_update_engine {
 
@@ -35,6 +39,12 @@ class VerityWriterAndroid : public VerityWriterInterface {
   bool Init(const InstallPlan::Partition& partition);
   bool Update(uint64_t offset, const uint8_t* buffer, size_t size) override;
   bool Finalize(FileDescriptor* read_fd, FileDescriptor* write_fd) override;
+  void SetFecThreads(size_t num_threads) override {
+    fec_threads_ = num_threads;
+  }
+  void SetHashThreads(size_t num_threads) override {
+    hash_threads_ = std::max<size_t>(1, num_threads);
+  }
 
   // Read [data_offset : data_offset + data_size) from |path| and encode FEC
   // data, if |verify_mode|, then compare the encoded FEC with the one in
@@ -42,6 +52,14 @@ class VerityWriterAndroid : public VerityWriterInterface {
   // in each Update() like hash tree, because for every rs block, its data are
   // spreaded across entire |data_size|, unless we can cache all data in
   // memory, we have to re-read them from disk.
+  // The rounds are independent: with |num_threads| greater than one, that
+  // many of them are encoded concurrently while the data of the next ones is
+  // read, as far as the memory budget allows. |read_fd| and |write_fd| are
+  // only used from the calling thread.
+  // With |source_fd|, the parity of the rounds whose blocks are all in
+  // |unchanged_blocks|, the blocks of the partition with the same content in
+  // |source_fd|, is copied from |source_fd| instead of encoded, provided the
+  // parity it has for the first of them is valid.
   static bool EncodeFEC(FileDescriptor* read_fd,
                         FileDescriptor* write_fd,
                         uint64_t data_offset,
@@ -50,7 +68,10 @@ class VerityWriterAndroid : public VerityWriterInterface {
                         uint64_t fec_size,
                         uint32_t fec_roots,
                         uint32_t block_size,
-                        bool verify_mode);
+                        bool verify_mode,
+                        size_t num_threads = 1,
+                        FileDescriptor* source_fd = nullptr,
+                        const ExtentRanges* unchanged_blocks = nullptr);
   static bool EncodeFEC(const std::string& path,
                         uint64_t data_offset,
                         uint64_t data_size,
@@ -58,13 +79,60 @@ class VerityWriterAndroid : public VerityWriterInterface {
                         uint64_t fec_size,
                         uint32_t fec_roots,
                         uint32_t block_size,
-                        bool verify_mode);
+                        bool verify_mode,
+                        size_t num_threads = 1);
 
  private:
+  // Whether the hash tree has the layout computed here, which sets
+  // |leaves_offset_|.
+  bool ComputeHashTreeLayout();
+  // Whether the first level of the hash tree of the source partition can be
+  // read for the |unchanged_blocks_|: it has the valid hash of the first and
+  // last unchanged blocks at the same place as the target one.
+  bool CanReuseSourceHashes();
+  // Appends the hashes of the next |size| bytes of hash tree data to
+  // |leaf_hashes_|, keeping the last partial block in |pending_block_|.
+  bool UpdateLeafHashes(const uint8_t* data, size_t size);
+  bool HashLeafBlocks(const uint8_t* data, size_t num_blocks);
+  // Writes the hashes of the |num_blocks| blocks of |data| to |digests|,
+  // spread over the workers of |hash_pool_| if there are enough of them.
+  bool HashBlocks(const uint8_t* data, size_t num_blocks, uint8_t* digests);
+  // Builds the levels of the hash tree above |leaf_hashes_| and writes them
+  // all to |write_fd|.
+  bool WriteHashTree(FileDescriptor* write_fd);
+  // Adds to |unchanged_blocks_| the blocks of the hash tree in |data|, written
+  // at |offset|, which the source partition has at the same offset.
+  void AddUnchangedHashTreeBlocks(const uint8_t* data,
+                                  size_t size,
+                                  uint64_t offset);
+
   const InstallPlan::Partition* partition_ = nullptr;
 
   std::unique_ptr<HashTreeBuilder> hash_tree_builder_;
+  const EVP_MD* hash_function_ = nullptr;
   uint64_t total_offset_ = 0;
+  size_t fec_threads_ = 1;
+  size_t hash_threads_ = 1;
+
+  // Open when the partition has |unchanged_extents| and its source can be
+  // read, see InstallPlan::reuse_source_verity.
+  EintrSafeFileDescriptor source_fd_;
+  // In blocks of the partition. The blocks of the hash tree identical to the
+  // source ones are added once it is written, for the FEC data.
+  ExtentRanges unchanged_blocks_;
+  // When set, the hash tree is built from |leaf_hashes_| instead of
+  // |hash_tree_builder_|, to reuse the source hashes or to hash with several
+  // threads.
+  bool build_hash_tree_ = false;
+  // When set, the hashes of the unchanged blocks are read from |source_fd_|.
+  bool reuse_source_hashes_ = false;
+  // The offset of the first level in the hash tree of both partitions.
+  uint64_t leaves_offset_ = 0;
+  brillo::Blob leaf_hashes_;
+  brillo::Blob pending_block_;
+  uint64_t num_reused_hashes_ = 0;
+  // Set with more than one |hash_threads_|.
+  std::unique_ptr<WorkerPool> hash_pool_;
   DISALLOW_COPY_AND_ASSIGN(VerityWriterAndroid);
 };
 
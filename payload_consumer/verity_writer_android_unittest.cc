@@ -24,6 +24,7 @@
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 
 namespace chromeos_update_engine {
 
@@ -165,6 +166,53 @@ TEST_F(VerityWriterAndroidTest, FECTest) {
   ASSERT_EQ(part_data, actual_part);
 }
 
+TEST_F(VerityWriterAndroidTest, ParallelFECTest) {
+  // 253 data blocks per round with 2 roots, so 4 rounds.
+  constexpr uint64_t kDataSize = 1000 * 4096;
+  constexpr uint64_t kFecSize = 4 * 2 * 4096;
+  brillo::Blob part_data(kDataSize + kFecSize);
+  for (size_t i = 0; i < kDataSize; i++) {
+    part_data[i] = static_cast<uint8_t>(i * 7 + i / 4096);
+  }
+  test_utils::WriteFileVector(partition_.target_path, part_data);
+  ASSERT_TRUE(VerityWriterAndroid::EncodeFEC(partition_.target_path,
+                                             0,
+                                             kDataSize,
+                                             kDataSize,
+                                             kFecSize,
+                                             2,
+                                             4096,
+                                             false /* verify_mode */));
+  brillo::Blob expected_part;
+  utils::ReadFile(partition_.target_path, &expected_part);
+
+  // More threads than rounds.
+  for (size_t num_threads : {2, 3, 8}) {
+    test_utils::WriteFileVector(partition_.target_path, part_data);
+    ASSERT_TRUE(VerityWriterAndroid::EncodeFEC(partition_.target_path,
+                                               0,
+                                               kDataSize,
+                                               kDataSize,
+                                               kFecSize,
+                                               2,
+                                               4096,
+                                               false /* verify_mode */,
+                                               num_threads));
+    brillo::Blob actual_part;
+    utils::ReadFile(partition_.target_path, &actual_part);
+    ASSERT_EQ(expected_part, actual_part);
+    ASSERT_TRUE(VerityWriterAndroid::EncodeFEC(partition_.target_path,
+                                               0,
+                                               kDataSize,
+                                               kDataSize,
+                                               kFecSize,
+                                               2,
+                                               4096,
+                                               true /* verify_mode */,
+                                               num_threads));
+  }
+}
+
 TEST_F(VerityWriterAndroidTest, HashTreeDisabled) {
   partition_.hash_tree_size = 0;
   partition_.hash_tree_data_size = 0;
@@ -183,4 +231,97 @@ TEST_F(VerityWriterAndroidTest, HashTreeDisabled) {
       verity_writer_.Finalize(partition_fd_.get(), partition_fd_.get()));
 }
 
+TEST_F(VerityWriterAndroidTest, ReuseSourceVerityTest) {
+  // 600 data blocks, 6 hash tree blocks and 3 FEC rounds of 253 blocks.
+  constexpr uint64_t kBlockSize = 4096;
+  constexpr uint64_t kDataBlocks = 600;
+  partition_.hash_tree_algorithm = "sha256";
+  partition_.hash_tree_data_size = kDataBlocks * kBlockSize;
+  partition_.hash_tree_offset = kDataBlocks * kBlockSize;
+  partition_.hash_tree_size = 6 * kBlockSize;
+  partition_.fec_data_offset = 0;
+  partition_.fec_data_size = (kDataBlocks + 6) * kBlockSize;
+  partition_.fec_offset = partition_.fec_data_size;
+  partition_.fec_size = 3 * 2 * kBlockSize;
+  brillo::Blob source_data(partition_.fec_offset + partition_.fec_size);
+  for (size_t i = 0; i < kDataBlocks * kBlockSize; i++) {
+    source_data[i] = static_cast<uint8_t>(i * 7 + i / kBlockSize);
+  }
+  // Block 258, its hash tree block 603 and the top one 600 are all in the
+  // first FEC round, so the other two can be reused.
+  constexpr uint64_t kChangedBlock = 258;
+  brillo::Blob target_data = source_data;
+  std::fill_n(
+      target_data.begin() + kChangedBlock * kBlockSize, kBlockSize, 0x5a);
+
+  // Writes the verity data of |partition| over |data| in its target file.
+  auto write_verity = [](const InstallPlan::Partition& partition,
+                         const brillo::Blob& data,
+                         brillo::Blob* result) {
+    test_utils::WriteFileVector(partition.target_path, data);
+    EintrSafeFileDescriptor fd;
+    ASSERT_TRUE(fd.Open(partition.target_path.c_str(), O_RDWR));
+    VerityWriterAndroid verity_writer;
+    ASSERT_TRUE(verity_writer.Init(partition));
+    ASSERT_TRUE(verity_writer.Update(0, data.data(), partition.fec_offset));
+    ASSERT_TRUE(verity_writer.Finalize(&fd, &fd));
+    ASSERT_TRUE(fd.Close());
+    ASSERT_TRUE(utils::ReadFile(partition.target_path, result));
+  };
+  brillo::Blob expected;
+  write_verity(partition_, target_data, &expected);
+
+  ScopedTempFile source_file;
+  for (const brillo::Blob& salt : {brillo::Blob{}, brillo::Blob{0x01}}) {
+    // The source verity data only matches with the same salt.
+    InstallPlan::Partition source_partition = partition_;
+    source_partition.target_path = source_file.path();
+    source_partition.hash_tree_salt = salt;
+    brillo::Blob source;
+    write_verity(source_partition, source_data, &source);
+
+    InstallPlan::Partition partition = partition_;
+    partition.source_path = source_file.path();
+    partition.unchanged_extents = {
+        ExtentForRange(0, kChangedBlock),
+        ExtentForRange(kChangedBlock + 1, kDataBlocks - kChangedBlock - 1)};
+    brillo::Blob actual;
+    write_verity(partition, target_data, &actual);
+    EXPECT_EQ(expected, actual);
+  }
+}
+
+TEST_F(VerityWriterAndroidTest, ParallelHashTreeTest) {
+  // 1000 data blocks, whose hash tree has 8 + 1 blocks.
+  constexpr uint64_t kDataSize = 1000 * 4096;
+  partition_.hash_tree_algorithm = "sha256";
+  partition_.hash_tree_salt = {0x01, 0x02};
+  partition_.hash_tree_data_size = kDataSize;
+  partition_.hash_tree_offset = kDataSize;
+  partition_.hash_tree_size = 9 * 4096;
+  brillo::Blob part_data(kDataSize + partition_.hash_tree_size);
+  for (size_t i = 0; i < kDataSize; i++) {
+    part_data[i] = static_cast<uint8_t>(i * 7 + i / 4096);
+  }
+  brillo::Blob expected_part;
+  for (size_t num_threads : {1, 4}) {
+    test_utils::WriteFileVector(partition_.target_path, part_data);
+    VerityWriterAndroid verity_writer;
+    verity_writer.SetHashThreads(num_threads);
+    ASSERT_TRUE(verity_writer.Init(partition_));
+    // A partial block first.
+    ASSERT_TRUE(verity_writer.Update(0, part_data.data(), 100));
+    ASSERT_TRUE(
+        verity_writer.Update(100, part_data.data() + 100, kDataSize - 100));
+    ASSERT_TRUE(
+        verity_writer.Finalize(partition_fd_.get(), partition_fd_.get()));
+    brillo::Blob actual_part;
+    utils::ReadFile(partition_.target_path, &actual_part);
+    if (expected_part.empty()) {
+      expected_part = actual_part;
+    }
+    ASSERT_EQ(expected_part, actual_part);
+  }
+}
+
 }  // namespace chromeos_update_engine
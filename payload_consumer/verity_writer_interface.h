@@ -41,6 +41,14 @@ class VerityWriterInterface {
   // Write hash tree && FEC data to underlying fd, if they are present
   virtual bool Finalize(FileDescriptor* read_fd, FileDescriptor* write_fd) = 0;
 
+  // Sets the number of threads encoding the FEC data in Finalize(), 1 by
+  // default.
+  virtual void SetFecThreads(size_t num_threads) {}
+
+  // Sets the number of threads hashing the blocks of the hash tree, 1 by
+  // default. Must be called before Init().
+  virtual void SetHashThreads(size_t num_threads) {}
+
  protected:
   VerityWriterInterface() = default;
 
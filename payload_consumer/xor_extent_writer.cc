@@ -14,6 +14,8 @@
 // limitations under the License.
 //
 
+#include <string.h>
+
 #include <algorithm>
 #include <optional>
 #include <vector>
@@ -24,28 +26,52 @@
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// XORs the |size| bytes at |src| into |dst|. Done on 8 bytes words, 32 bytes
+// at a time, which the compiler turns into vector instructions.
+void XorInto(uint8_t* dst, const uint8_t* src, size_t size) {
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    uint64_t a[4], b[4];
+    memcpy(a, dst + i, sizeof(a));
+    memcpy(b, src + i, sizeof(b));
+    for (size_t j = 0; j < 4; j++)
+      a[j] ^= b[j];
+    memcpy(dst + i, a, sizeof(a));
+  }
+  for (; i < size; i++)
+    dst[i] ^= src[i];
+}
+
+}  // namespace
+
 // Returns true on success.
 bool XORExtentWriter::WriteExtent(const void* bytes,
                                   const Extent& extent,
                                   const size_t size) {
-  brillo::Blob xor_block_data;
-  const auto xor_extents = xor_map_.GetIntersectingExtents(extent);
-  for (const auto& xor_ext : xor_extents) {
-    const auto merge_op_opt = xor_map_.Get(xor_ext);
-    if (!merge_op_opt.has_value()) {
+  // The merge ops of |extent|, in block order, and where their source data
+  // goes in |xor_block_data|.
+  std::vector<const CowMergeOperation*> merge_ops;
+  std::vector<FileDescriptor::ReadRequest> reads;
+  size_t total_blocks = 0;
+  for (const auto& [entry_extent, merge_op] :
+       xor_map_.GetIntersectingEntries(extent)) {
+    const Extent xor_ext = entry_extent;
+    if (xor_ext.start_block() < extent.start_block() ||
+        xor_ext.start_block() + xor_ext.num_blocks() >
+            extent.start_block() + extent.num_blocks()) {
       // If a file in the target build contains duplicate blocks, e.g.
       // [120503-120514], [120503-120503], we can end up here. If that's the
       // case then there's no bug, just some annoying edge cases.
-      LOG(ERROR)
-          << xor_ext
-          << " isn't in XOR map but it's returned by GetIntersectingExtents(), "
-             "this is either a bug inside GetIntersectingExtents, or some "
-             "duplicate blocks are present in target build. OTA extent: "
-          << extent;
+      LOG(ERROR) << "CowXor merge op extent should be completely inside "
+                    "InstallOp's extent, this is either a bug in the XOR map "
+                    "or some duplicate blocks are present in target build. "
+                    "merge op extent: "
+                 << xor_ext << " InstallOp extent: " << extent;
       return false;
     }
 
-    const auto merge_op = merge_op_opt.value();
     TEST_AND_RETURN_FALSE(merge_op->has_src_extent());
     TEST_AND_RETURN_FALSE(merge_op->has_dst_extent());
     if (merge_op->dst_extent() != xor_ext) {
@@ -54,42 +80,56 @@ bool XORExtentWriter::WriteExtent(const void* bytes,
                  << merge_op->dst_extent() << " extent in key: " << xor_ext;
       return false;
     }
-    if (xor_ext.start_block() + xor_ext.num_blocks() >
-        extent.start_block() + extent.num_blocks()) {
-      LOG(ERROR) << "CowXor merge op extent should be completely inside "
-                    "InstallOp's extent. merge op extent: "
-                 << xor_ext << " InstallOp extent: " << extent;
-      return false;
+    merge_ops.push_back(merge_op);
+    reads.push_back({merge_op->src_offset() +
+                         merge_op->src_extent().start_block() * BlockSize(),
+                     nullptr,
+                     xor_ext.num_blocks() * BlockSize()});
+    total_blocks += xor_ext.num_blocks();
+  }
+
+  if (!merge_ops.empty()) {
+    // The source data of all the merge ops is read at once, with the nearby
+    // reads merged.
+    brillo::Blob xor_block_data(total_blocks * BlockSize());
+    size_t data_offset = 0;
+    for (auto& read : reads) {
+      read.buffer = xor_block_data.data() + data_offset;
+      data_offset += read.count;
     }
-    const auto src_offset = merge_op->src_offset();
-    const auto src_block = merge_op->src_extent().start_block();
-    xor_block_data.resize(BlockSize() * xor_ext.num_blocks());
-    ssize_t bytes_read = 0;
-    TEST_AND_RETURN_FALSE_ERRNO(
-        utils::PReadAll(source_fd_,
-                        xor_block_data.data(),
-                        xor_block_data.size(),
-                        src_offset + src_block * BlockSize(),
-                        &bytes_read));
-    if (bytes_read != static_cast<ssize_t>(xor_block_data.size())) {
-      LOG(ERROR) << "bytes_read: " << bytes_read;
+    if (!source_fd_->ReadBatch(reads)) {
+      PLOG(ERROR) << "Failed to read the source blocks of " << reads.size()
+                  << " XOR merge ops";
       return false;
     }
 
-    const auto i = xor_ext.start_block() - extent.start_block();
-
-    const auto dst_block_data =
-        static_cast<const unsigned char*>(bytes) + i * BlockSize();
-    std::transform(xor_block_data.cbegin(),
-                   xor_block_data.cbegin() + xor_block_data.size(),
-                   dst_block_data,
-                   xor_block_data.begin(),
-                   std::bit_xor<unsigned char>{});
-    TEST_AND_RETURN_FALSE(cow_writer_->AddXorBlocks(xor_ext.start_block(),
-                                                    xor_block_data.data(),
-                                                    xor_block_data.size(),
-                                                    src_block,
-                                                    src_offset));
+    // The merge ops contiguous in both the source and the target with the
+    // same |src_offset|, whose data is contiguous in |xor_block_data| too,
+    // are written with a single AddXorBlocks().
+    for (size_t first = 0; first < merge_ops.size();) {
+      const CowMergeOperation* first_op = merge_ops[first];
+      const uint64_t dst_block = first_op->dst_extent().start_block();
+      const uint64_t src_block = first_op->src_extent().start_block();
+      uint64_t num_blocks = first_op->dst_extent().num_blocks();
+      size_t last = first + 1;
+      for (; last < merge_ops.size(); last++) {
+        const CowMergeOperation* op = merge_ops[last];
+        if (op->src_offset() != first_op->src_offset() ||
+            op->dst_extent().start_block() != dst_block + num_blocks ||
+            op->src_extent().start_block() != src_block + num_blocks)
+          break;
+        num_blocks += op->dst_extent().num_blocks();
+      }
+      auto data = static_cast<uint8_t*>(reads[first].buffer);
+      const size_t data_size = num_blocks * BlockSize();
+      XorInto(data,
+              static_cast<const uint8_t*>(bytes) +
+                  (dst_block - extent.start_block()) * BlockSize(),
+              data_size);
+      TEST_AND_RETURN_FALSE(cow_writer_->AddXorBlocks(
+          dst_block, data, data_size, src_block, first_op->src_offset()));
+      first = last;
+    }
   }
   const auto replace_extents = xor_map_.GetNonIntersectingExtents(extent);
   return WriteReplaceExtents(replace_extents, extent, bytes, size);
@@ -33,7 +33,7 @@ namespace chromeos_update_engine {
 
 // An extent writer that will selectively convert some of the blocks into an XOR
 // block. All blocks that appear in |xor_map| will be converted,
-class XORExtentWriter : public BlockExtentWriter {
+class XORExtentWriter final : public BlockExtentWriter {
  public:
   XORExtentWriter(const InstallOperation& op,
                   FileDescriptorPtr source_fd,
@@ -131,4 +131,35 @@ TEST_F(XorExtentWriterTest, StreamTest) {
   ASSERT_TRUE(writer_.Write(zeros->data(), 9 * kBlockSize));
 }
 
+TEST_F(XorExtentWriterTest, MergesContiguousXorOpsTest) {
+  constexpr auto COW_XOR = CowMergeOperation::COW_XOR;
+  // [10-11] => [100-101] and [12-13] => [102-103] are contiguous on both
+  // sides, [20] => [104] isn't in the source.
+  const auto op1 = CreateCowMergeOperation(
+      ExtentForRange(10, 2), ExtentForRange(100, 2), COW_XOR);
+  const auto op2 = CreateCowMergeOperation(
+      ExtentForRange(12, 2), ExtentForRange(102, 2), COW_XOR);
+  const auto op3 = CreateCowMergeOperation(
+      ExtentForRange(20, 1), ExtentForRange(104, 1), COW_XOR);
+  for (const auto* op : {&op1, &op2, &op3}) {
+    ASSERT_TRUE(xor_map_.AddExtent(op->dst_extent(), op));
+  }
+  *op_.add_src_extents() = ExtentForRange(10, 5);
+  *op_.add_dst_extents() = ExtentForRange(100, 5);
+  XORExtentWriter writer_{op_, source_fd_, &cow_writer_, xor_map_};
+
+  // The source is all 1s, so XORing zeros gives 1s.
+  auto zeros = utils::GetReadonlyZeroBlock(kBlockSize * 5);
+  const brillo::Blob ones(kBlockSize * 4, 1);
+  EXPECT_CALL(cow_writer_, EmitXorBlocks(100, _, kBlockSize * 4, 10, 0))
+      .With(Args<1, 2>(BytesEqual(ones.data(), ones.size())))
+      .WillOnce(Return(true));
+  EXPECT_CALL(cow_writer_, EmitXorBlocks(104, _, kBlockSize, 20, 0))
+      .With(Args<1, 2>(BytesEqual(ones.data(), kBlockSize)))
+      .WillOnce(Return(true));
+
+  ASSERT_TRUE(writer_.Init(op_.dst_extents(), kBlockSize));
+  ASSERT_TRUE(writer_.Write(zeros->data(), 5 * kBlockSize));
+}
+
 }  // namespace chromeos_update_engine
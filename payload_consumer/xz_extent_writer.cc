@@ -21,7 +21,9 @@ using google::protobuf::RepeatedPtrField;
 namespace chromeos_update_engine {
 
 namespace {
-const brillo::Blob::size_type kOutputBufferLength = 16 * 1024;
+// The size of the decompressed chunks passed to the underlying writer, the
+// same as ZstdExtentWriter's.
+const brillo::Blob::size_type kOutputBufferLength = 128 * 1024;
 
 // xz uses a variable dictionary size which impacts on the compression ratio
 // and is required to be reconstructed in RAM during decompression. While we
@@ -61,6 +63,7 @@ bool XzExtentWriter::Init(const RepeatedPtrField<Extent>& extents,
                           uint32_t block_size) {
   stream_.reset(xz_dec_init(XZ_DYNALLOC, kXzMaxDictSize));
   TEST_AND_RETURN_FALSE(stream_ != nullptr);
+  output_buffer_.resize(kOutputBufferLength);
   return underlying_writer_->Init(extents, block_size);
 }
 
@@ -80,9 +83,8 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
   request.in_pos = 0;
   request.in_size = count;
 
-  brillo::Blob output_buffer(kOutputBufferLength);
-  request.out = output_buffer.data();
-  request.out_size = output_buffer.size();
+  request.out = output_buffer_.data();
+  request.out_size = output_buffer_.size();
   for (;;) {
     request.out_pos = 0;
 
@@ -96,13 +98,12 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
       break;
 
     TEST_AND_RETURN_FALSE(
-        underlying_writer_->Write(output_buffer.data(), request.out_pos));
+        underlying_writer_->Write(output_buffer_.data(), request.out_pos));
     if (ret == XZ_STREAM_END)
       CHECK_EQ(request.in_size, request.in_pos);
     if (request.in_size == request.in_pos)
       break;  // No more input to process.
   }
-  output_buffer.clear();
 
   // Store unconsumed data (if any) in |input_buffer_|. Since |input| can point
   // to the existing |input_buffer_| we create a new one before assigning it.
@@ -33,7 +33,7 @@
 
 namespace chromeos_update_engine {
 
-class XzExtentWriter : public ExtentWriter {
+class XzExtentWriter final : public ExtentWriter {
   struct xz_deleter {
     constexpr void operator()(xz_dec* p) { xz_dec_end(p); }
   };
@@ -53,6 +53,7 @@ class XzExtentWriter : public ExtentWriter {
   // The opaque xz decompressor struct.
   std::unique_ptr<xz_dec, xz_deleter> stream_{nullptr};
   brillo::Blob input_buffer_;
+  brillo::Blob output_buffer_;
 
   DISALLOW_COPY_AND_ASSIGN(XzExtentWriter);
 };
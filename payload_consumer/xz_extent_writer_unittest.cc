@@ -29,6 +29,7 @@
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/fake_extent_writer.h"
+#include "update_engine/payload_generator/xz.h"
 
 namespace chromeos_update_engine {
 
@@ -60,7 +61,7 @@ const uint8_t kCompressedDataNoCheck[] = {
     0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x59, 0x5a,
 };
 
-// Highly redundant data bigger than the internal buffer, generated with:
+// Highly redundant data, generated with:
 // dd if=/dev/zero bs=30K count=1 | tr '\0' 'a' | xz -9 --check=crc32 |
 // hexdump -v -e '"    " 12/1 "0x%02x, " "\n"'
 const uint8_t kCompressed30KiBofA[] = {
@@ -121,14 +122,24 @@ TEST_F(XzExtentWriterTest, CompressedSampleDataWithCrc) {
 }
 
 TEST_F(XzExtentWriterTest, CompressedDataBiggerThanTheBuffer) {
-  // Test that even if the output data is bigger than the internal buffer, all
-  // the data is written.
+  // Test that all the data is written, even when it's much bigger than its
+  // compressed size.
   WriteAll(brillo::Blob(std::begin(kCompressed30KiBofA),
                         std::end(kCompressed30KiBofA)));
   brillo::Blob expected_data(30 * 1024, 'a');
   EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
 }
 
+TEST_F(XzExtentWriterTest, OutputBiggerThanTheBuffer) {
+  // Decompressed through the internal buffer in several pieces.
+  brillo::Blob expected_data(1024 * 1024, 'a');
+  brillo::Blob compressed;
+  XzCompressInit();
+  ASSERT_TRUE(XzCompress(expected_data, &compressed));
+  WriteAll(compressed);
+  EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
+}
+
 TEST_F(XzExtentWriterTest, GarbageDataRejected) {
   EXPECT_TRUE(xz_writer_->Init({}, 1024));
   // The sample_data_ is an uncompressed string.
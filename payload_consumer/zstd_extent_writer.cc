@@ -0,0 +1,79 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+using google::protobuf::RepeatedPtrField;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The size of the decompressed chunks passed to the underlying writer.
+const size_t kOutputBufferLength = 128 * 1024;
+
+// The decompressor keeps a window of the last decompressed bytes, up to 2 to
+// the power of this. Frames requiring a larger window are rejected, so the
+// generator must not use more: with 64 MiB, the same limit as xz, any
+// compression level is accepted unless a long window is requested.
+const int kZstdMaxWindowLog = 26;
+}  // namespace
+
+bool ZstdExtentWriter::Init(const RepeatedPtrField<Extent>& extents,
+                            uint32_t block_size) {
+  dctx_.reset(ZSTD_createDCtx());
+  TEST_AND_RETURN_FALSE(dctx_ != nullptr);
+  const size_t ret = ZSTD_DCtx_setParameter(
+      dctx_.get(), ZSTD_d_windowLogMax, kZstdMaxWindowLog);
+  if (ZSTD_isError(ret)) {
+    LOG(ERROR) << "Unable to limit the zstd window size: "
+               << ZSTD_getErrorName(ret);
+    return false;
+  }
+  if (ddict_) {
+    const size_t ref = ZSTD_DCtx_refDDict(dctx_.get(), ddict_);
+    if (ZSTD_isError(ref)) {
+      LOG(ERROR) << "Unable to reference the zstd dictionary: "
+                 << ZSTD_getErrorName(ref);
+      return false;
+    }
+  }
+  output_buffer_.resize(kOutputBufferLength);
+  return underlying_writer_->Init(extents, block_size);
+}
+
+bool ZstdExtentWriter::Write(const void* bytes, size_t count) {
+  ZSTD_inBuffer input{bytes, count, 0};
+  for (;;) {
+    ZSTD_outBuffer output{output_buffer_.data(), output_buffer_.size(), 0};
+    const size_t ret = ZSTD_decompressStream(dctx_.get(), &output, &input);
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "ZSTD_decompressStream returned "
+                 << ZSTD_getErrorName(ret);
+      return false;
+    }
+    if (output.pos > 0) {
+      TEST_AND_RETURN_FALSE(
+          underlying_writer_->Write(output_buffer_.data(), output.pos));
+    }
+    // With a full output buffer, the decompressor may have more to flush even
+    // once all the input is consumed.
+    if (input.pos == input.size && output.pos < output.size)
+      break;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
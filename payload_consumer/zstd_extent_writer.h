@@ -0,0 +1,69 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
+
+#include <zstd.h>
+
+#include <memory>
+#include <utility>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/extent_writer.h"
+
+// ZstdExtentWriter is a concrete ExtentWriter subclass that zstd-decompresses
+// what it's given in Write, as it's given, and passes the decompressed data to
+// an underlying ExtentWriter. Decompressing zstd is several times faster than
+// xz or bzip2, which makes REPLACE_ZSTD operations cheap to apply. Blobs
+// compressed against the zstd dictionary of their partition are decompressed
+// with that dictionary, digested once per partition into a ZSTD_DDict.
+
+namespace chromeos_update_engine {
+
+class ZstdExtentWriter final : public ExtentWriter {
+  struct dctx_deleter {
+    void operator()(ZSTD_DCtx* p) { ZSTD_freeDCtx(p); }
+  };
+
+ public:
+  // |ddict|, if not null, must outlive this writer.
+  explicit ZstdExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer,
+                            const ZSTD_DDict* ddict = nullptr)
+      : underlying_writer_(std::move(underlying_writer)), ddict_(ddict) {}
+  ~ZstdExtentWriter() override = default;
+
+  bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Write(const void* bytes, size_t count) override;
+
+ private:
+  // The underlying ExtentWriter.
+  std::unique_ptr<ExtentWriter> underlying_writer_;
+  // The dictionary of the partition, or null without one.
+  const ZSTD_DDict* ddict_;
+  // The zstd decompression context, which buffers the input it can't decode
+  // yet.
+  std::unique_ptr<ZSTD_DCtx, dctx_deleter> dctx_{nullptr};
+  brillo::Blob output_buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(ZstdExtentWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
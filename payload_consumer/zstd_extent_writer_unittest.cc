@@ -0,0 +1,146 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+#include <string.h>
+
+#include <memory>
+
+#include <base/memory/ptr_util.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char kSampleData[] = "Redundaaaaaaaaaaaaaant\n";
+
+brillo::Blob ZstdCompress(const brillo::Blob& data) {
+  brillo::Blob compressed(ZSTD_compressBound(data.size()));
+  const size_t size = ZSTD_compress(
+      compressed.data(), compressed.size(), data.data(), data.size(), 19);
+  EXPECT_FALSE(ZSTD_isError(size));
+  compressed.resize(size);
+  return compressed;
+}
+
+brillo::Blob ZstdCompressWithDictionary(const brillo::Blob& data,
+                                        const brillo::Blob& dictionary) {
+  std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(),
+                                                            ZSTD_freeCCtx);
+  brillo::Blob compressed(ZSTD_compressBound(data.size()));
+  const size_t size = ZSTD_compress_usingDict(cctx.get(),
+                                              compressed.data(),
+                                              compressed.size(),
+                                              data.data(),
+                                              data.size(),
+                                              dictionary.data(),
+                                              dictionary.size(),
+                                              19);
+  EXPECT_FALSE(ZSTD_isError(size));
+  compressed.resize(size);
+  return compressed;
+}
+
+}  // namespace
+
+class ZstdExtentWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    fake_extent_writer_ = new FakeExtentWriter();
+    zstd_writer_.reset(
+        new ZstdExtentWriter(base::WrapUnique(fake_extent_writer_)));
+  }
+
+  void WriteAll(const brillo::Blob& compressed) {
+    EXPECT_TRUE(zstd_writer_->Init({}, 1024));
+    EXPECT_TRUE(zstd_writer_->Write(compressed.data(), compressed.size()));
+
+    EXPECT_TRUE(fake_extent_writer_->InitCalled());
+  }
+
+  // Owned by |zstd_writer_|. This object is invalidated after |zstd_writer_|
+  // is deleted.
+  FakeExtentWriter* fake_extent_writer_{nullptr};
+  std::unique_ptr<ZstdExtentWriter> zstd_writer_;
+
+  const brillo::Blob sample_data_{
+      std::begin(kSampleData), std::begin(kSampleData) + strlen(kSampleData)};
+};
+
+TEST_F(ZstdExtentWriterTest, CreateAndDestroy) {
+  // Test that no Init() or End() called doesn't crash the program.
+  EXPECT_FALSE(fake_extent_writer_->InitCalled());
+}
+
+TEST_F(ZstdExtentWriterTest, CompressedSampleData) {
+  WriteAll(ZstdCompress(sample_data_));
+  EXPECT_EQ(sample_data_, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(ZstdExtentWriterTest, CompressedDataBiggerThanTheBuffer) {
+  // Test that even if the output data is bigger than the internal buffer, all
+  // the data is written.
+  brillo::Blob expected_data(300 * 1024, 'a');
+  WriteAll(ZstdCompress(expected_data));
+  EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(ZstdExtentWriterTest, GarbageDataRejected) {
+  EXPECT_TRUE(zstd_writer_->Init({}, 1024));
+  // The sample_data_ is an uncompressed string.
+  EXPECT_FALSE(zstd_writer_->Write(sample_data_.data(), sample_data_.size()));
+}
+
+TEST_F(ZstdExtentWriterTest, PartialDataIsKept) {
+  brillo::Blob expected_data(300 * 1024, 'a');
+  brillo::Blob compressed = ZstdCompress(expected_data);
+  EXPECT_TRUE(zstd_writer_->Init({}, 1024));
+  for (uint8_t byte : compressed) {
+    EXPECT_TRUE(zstd_writer_->Write(&byte, 1));
+  }
+  EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(ZstdExtentWriterTest, CompressedWithDictionary) {
+  brillo::Blob dictionary;
+  for (int i = 0; i < 100; i++)
+    dictionary.push_back(static_cast<uint8_t>(i * 37 + i / 5));
+  brillo::Blob expected_data = dictionary;
+  expected_data.insert(
+      expected_data.end(), sample_data_.begin(), sample_data_.end());
+  const brillo::Blob compressed =
+      ZstdCompressWithDictionary(expected_data, dictionary);
+
+  std::unique_ptr<ZSTD_DDict, decltype(&ZSTD_freeDDict)> ddict(
+      ZSTD_createDDict(dictionary.data(), dictionary.size()), ZSTD_freeDDict);
+  ASSERT_NE(nullptr, ddict);
+  fake_extent_writer_ = new FakeExtentWriter();
+  zstd_writer_.reset(new ZstdExtentWriter(
+      base::WrapUnique(fake_extent_writer_), ddict.get()));
+  WriteAll(compressed);
+  EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
+
+  // The blob can't be decompressed without the dictionary.
+  SetUp();
+  EXPECT_TRUE(zstd_writer_->Init({}, 1024));
+  EXPECT_FALSE(zstd_writer_->Write(compressed.data(), compressed.size()));
+}
+
+}  // namespace chromeos_update_engine
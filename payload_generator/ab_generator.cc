@@ -17,12 +17,14 @@
 #include "update_engine/payload_generator/ab_generator.h"
 
 #include <algorithm>
+#include <thread>  // NOLINT(build/c++11) -- for hardware_concurrency
 #include <utility>
 
 #include <base/strings/stringprintf.h>
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/bzip.h"
@@ -35,6 +37,108 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Splits |original_aop| into one operation per destination extent, without
+// their data. The operations split from a REPLACE point to the matching part
+// of its blob.
+void SplitReplaceExtents(const AnnotatedOperation& original_aop,
+                         vector<AnnotatedOperation>* result_aops) {
+  const InstallOperation& original_op = original_aop.op;
+  const bool is_replace = original_op.type() == InstallOperation::REPLACE;
+
+  uint64_t data_offset = original_op.data_offset();
+  for (int i = 0; i < original_op.dst_extents_size(); i++) {
+    const Extent& dst_ext = original_op.dst_extents(i);
+    // Make a new operation with only one dst extent.
+    AnnotatedOperation new_aop;
+    InstallOperation& new_op = new_aop.op;
+    *(new_op.add_dst_extents()) = dst_ext;
+    uint64_t data_size = dst_ext.num_blocks() * kBlockSize;
+    // If this is a REPLACE, attempt to reuse portions of the existing blob.
+    if (is_replace) {
+      new_op.set_type(InstallOperation::REPLACE);
+      new_op.set_data_length(data_size);
+      new_op.set_data_offset(data_offset);
+      data_offset += data_size;
+    }
+    new_aop.name = base::StringPrintf("%s:%d", original_aop.name.c_str(), i);
+    result_aops->push_back(std::move(new_aop));
+  }
+}
+
+// Runs ABGenerator::AddDataAndSetType() on each of |aops|, compressing their
+// data on several threads.
+bool AddDataAndSetTypes(const vector<AnnotatedOperation*>& aops,
+                        const PayloadVersion& version,
+                        const string& target_part_path,
+                        BlobFileWriter* blob_file,
+                        const ZstdDictionary* zstd_dictionary) {
+  const size_t num_threads = std::min<size_t>(
+      aops.size(), std::max(std::thread::hardware_concurrency(), 1u));
+  if (num_threads <= 1) {
+    for (AnnotatedOperation* aop : aops) {
+      TEST_AND_RETURN_FALSE(ABGenerator::AddDataAndSetType(
+          aop, version, target_part_path, blob_file, zstd_dictionary));
+    }
+    return true;
+  }
+  WorkerPool pool(num_threads, num_threads);
+  for (AnnotatedOperation* aop : aops) {
+    if (!pool.Post([aop,
+                    &version,
+                    &target_part_path,
+                    blob_file,
+                    zstd_dictionary] {
+          return ABGenerator::AddDataAndSetType(
+              aop, version, target_part_path, blob_file, zstd_dictionary);
+        }))
+      break;
+  }
+  return pool.Wait();
+}
+
+// Merges touching extents of |extents| in place, like NormalizeExtents().
+void NormalizeExtentsInPlace(
+    google::protobuf::RepeatedPtrField<Extent>* extents) {
+  int size = 0;
+  for (int i = 0; i < extents->size(); i++) {
+    const Extent& curr = extents->Get(i);
+    if (size > 0) {
+      Extent* last_ext = extents->Mutable(size - 1);
+      if (last_ext->start_block() + last_ext->num_blocks() ==
+          curr.start_block()) {
+        last_ext->set_num_blocks(last_ext->num_blocks() + curr.num_blocks());
+        continue;
+      }
+    }
+    if (size != i)
+      extents->SwapElements(size, i);
+    size++;
+  }
+  extents->DeleteSubrange(size, extents->size() - size);
+}
+
+// Appends |extents_to_add| to the normalized |extents|, merging the touching
+// ones. Same as ExtendExtents(), without rebuilding |extents|.
+void AppendExtents(
+    google::protobuf::RepeatedPtrField<Extent>* extents,
+    const google::protobuf::RepeatedPtrField<Extent>& extents_to_add) {
+  for (const Extent& extent : extents_to_add) {
+    if (!extents->empty()) {
+      Extent* last_ext = extents->Mutable(extents->size() - 1);
+      if (last_ext->start_block() + last_ext->num_blocks() ==
+          extent.start_block()) {
+        last_ext->set_num_blocks(last_ext->num_blocks() + extent.num_blocks());
+        continue;
+      }
+    }
+    *extents->Add() = extent;
+  }
+}
+
+}  // namespace
+
 bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
                                      const PartitionConfig& old_part,
                                      const PartitionConfig& new_part,
@@ -69,8 +173,12 @@ bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
   }
 
   LOG(INFO) << "Merging " << aops->size() << " operations.";
-  TEST_AND_RETURN_FALSE(MergeOperations(
-      aops, config.version, merge_chunk_blocks, new_part.path, blob_file));
+  TEST_AND_RETURN_FALSE(MergeOperations(aops,
+                                        config.version,
+                                        merge_chunk_blocks,
+                                        new_part.path,
+                                        blob_file,
+                                        new_part.zstd_dictionary.get()));
   LOG(INFO) << aops->size() << " operations after merge.";
 
   if (config.version.minor >= kOpSrcHashMinorPayloadVersion)
@@ -87,9 +195,14 @@ void ABGenerator::SortOperationsByDestination(
 bool ABGenerator::FragmentOperations(const PayloadVersion& version,
                                      vector<AnnotatedOperation>* aops,
                                      const string& target_part_path,
-                                     BlobFileWriter* blob_file) {
+                                     BlobFileWriter* blob_file,
+                                     const ZstdDictionary* zstd_dictionary) {
   vector<AnnotatedOperation> fragmented_aops;
-  for (const AnnotatedOperation& aop : *aops) {
+  fragmented_aops.reserve(aops->size());
+  // The indexes in |fragmented_aops| of the operations split from a REPLACE,
+  // whose data is added once they are all split.
+  vector<size_t> split_replace_aops;
+  for (AnnotatedOperation& aop : *aops) {
     // Only do split if the operation has more than one dst extents.
     if (aop.op.dst_extents_size() > 1) {
       if (aop.op.type() == InstallOperation::SOURCE_COPY) {
@@ -97,20 +210,28 @@ bool ABGenerator::FragmentOperations(const PayloadVersion& version,
         continue;
       }
       if (IsAReplaceOperation(aop.op.type())) {
-        TEST_AND_RETURN_FALSE(SplitAReplaceOp(
-            version, aop, target_part_path, &fragmented_aops, blob_file));
+        const size_t first_split_aop = fragmented_aops.size();
+        SplitReplaceExtents(aop, &fragmented_aops);
+        for (size_t i = first_split_aop; i < fragmented_aops.size(); i++)
+          split_replace_aops.push_back(i);
         continue;
       }
     }
-    fragmented_aops.push_back(aop);
+    fragmented_aops.push_back(std::move(aop));
   }
+  vector<AnnotatedOperation*> add_data_aops;
+  add_data_aops.reserve(split_replace_aops.size());
+  for (size_t i : split_replace_aops)
+    add_data_aops.push_back(&fragmented_aops[i]);
+  TEST_AND_RETURN_FALSE(AddDataAndSetTypes(
+      add_data_aops, version, target_part_path, blob_file, zstd_dictionary));
   *aops = std::move(fragmented_aops);
   return true;
 }
 
 bool ABGenerator::SplitSourceCopy(const AnnotatedOperation& original_aop,
                                   vector<AnnotatedOperation>* result_aops) {
-  InstallOperation original_op = original_aop.op;
+  const InstallOperation& original_op = original_aop.op;
   TEST_AND_RETURN_FALSE(original_op.type() == InstallOperation::SOURCE_COPY);
   // Keeps track of the index of curr_src_ext.
   int curr_src_ext_index = 0;
@@ -147,9 +268,9 @@ bool ABGenerator::SplitSourceCopy(const AnnotatedOperation& original_aop,
     *(new_op.add_dst_extents()) = dst_ext;
 
     AnnotatedOperation new_aop;
-    new_aop.op = new_op;
+    new_aop.op = std::move(new_op);
     new_aop.name = base::StringPrintf("%s:%d", original_aop.name.c_str(), i);
-    result_aops->push_back(new_aop);
+    result_aops->push_back(std::move(new_aop));
   }
   if (curr_src_ext_index != original_op.src_extents().size() - 1) {
     LOG(FATAL) << "Incorrectly split SOURCE_COPY operation. Did not use all "
@@ -162,46 +283,33 @@ bool ABGenerator::SplitAReplaceOp(const PayloadVersion& version,
                                   const AnnotatedOperation& original_aop,
                                   const string& target_part_path,
                                   vector<AnnotatedOperation>* result_aops,
-                                  BlobFileWriter* blob_file) {
-  InstallOperation original_op = original_aop.op;
-  TEST_AND_RETURN_FALSE(IsAReplaceOperation(original_op.type()));
-  const bool is_replace = original_op.type() == InstallOperation::REPLACE;
-
-  uint64_t data_offset = original_op.data_offset();
-  for (int i = 0; i < original_op.dst_extents_size(); i++) {
-    const Extent& dst_ext = original_op.dst_extents(i);
-    // Make a new operation with only one dst extent.
-    InstallOperation new_op;
-    *(new_op.add_dst_extents()) = dst_ext;
-    uint64_t data_size = dst_ext.num_blocks() * kBlockSize;
-    // If this is a REPLACE, attempt to reuse portions of the existing blob.
-    if (is_replace) {
-      new_op.set_type(InstallOperation::REPLACE);
-      new_op.set_data_length(data_size);
-      new_op.set_data_offset(data_offset);
-      data_offset += data_size;
-    }
-
-    AnnotatedOperation new_aop;
-    new_aop.op = new_op;
-    new_aop.name = base::StringPrintf("%s:%d", original_aop.name.c_str(), i);
-    TEST_AND_RETURN_FALSE(
-        AddDataAndSetType(&new_aop, version, target_part_path, blob_file));
-
-    result_aops->push_back(new_aop);
-  }
-  return true;
+                                  BlobFileWriter* blob_file,
+                                  const ZstdDictionary* zstd_dictionary) {
+  TEST_AND_RETURN_FALSE(IsAReplaceOperation(original_aop.op.type()));
+  const size_t first_split_aop = result_aops->size();
+  SplitReplaceExtents(original_aop, result_aops);
+  vector<AnnotatedOperation*> split_aops;
+  for (size_t i = first_split_aop; i < result_aops->size(); i++)
+    split_aops.push_back(&(*result_aops)[i]);
+  return AddDataAndSetTypes(
+      split_aops, version, target_part_path, blob_file, zstd_dictionary);
 }
 
 bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
                                   const PayloadVersion& version,
                                   size_t chunk_blocks,
                                   const string& target_part_path,
-                                  BlobFileWriter* blob_file) {
+                                  BlobFileWriter* blob_file,
+                                  const ZstdDictionary* zstd_dictionary) {
   vector<AnnotatedOperation> new_aops;
-  for (const AnnotatedOperation& curr_aop : *aops) {
+  new_aops.reserve(aops->size());
+  // Whether |new_aops.back()| had an operation merged into it, and so has its
+  // extents normalized.
+  bool last_merged = false;
+  for (AnnotatedOperation& curr_aop : *aops) {
     if (new_aops.empty()) {
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
+      last_merged = false;
       continue;
     }
     AnnotatedOperation& last_aop = new_aops.back();
@@ -209,7 +317,8 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
 
     if (last_aop.op.dst_extents_size() <= 0 ||
         curr_aop.op.dst_extents_size() <= 0) {
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
+      last_merged = false;
       continue;
     }
     uint32_t last_dst_idx = last_aop.op.dst_extents_size() - 1;
@@ -231,42 +340,55 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
       // merge), are contiguous, are fragmented to have one destination extent,
       // and their combined block count would be less than chunk size, merge
       // them.
-      last_aop.name = base::StringPrintf(
-          "%s,%s", last_aop.name.c_str(), curr_aop.name.c_str());
-
+      last_aop.name.append(",").append(curr_aop.name);
+
+      // The extents are extended in place, which gives the same result as
+      // ExtendExtents() once they are normalized.
+      if (!last_merged) {
+        NormalizeExtentsInPlace(last_aop.op.mutable_src_extents());
+        NormalizeExtentsInPlace(last_aop.op.mutable_dst_extents());
+        last_merged = true;
+      }
       if (is_delta_op) {
-        ExtendExtents(last_aop.op.mutable_src_extents(),
+        AppendExtents(last_aop.op.mutable_src_extents(),
                       curr_aop.op.src_extents());
       }
-      ExtendExtents(last_aop.op.mutable_dst_extents(),
+      AppendExtents(last_aop.op.mutable_dst_extents(),
                     curr_aop.op.dst_extents());
       // Set the data length to zero so we know to add the blob later.
       if (is_a_replace)
         last_aop.op.set_data_length(0);
     } else {
       // Otherwise just include the extent as is.
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
+      last_merged = false;
     }
   }
 
-  // Set the blobs for REPLACE/REPLACE_BZ/REPLACE_XZ operations that have been
-  // merged.
+  // Set the blobs for the REPLACE_* operations that have been merged,
+  // compressing them in parallel.
+  vector<AnnotatedOperation*> merged_replace_aops;
   for (AnnotatedOperation& curr_aop : new_aops) {
     if (curr_aop.op.data_length() == 0 &&
         IsAReplaceOperation(curr_aop.op.type())) {
-      TEST_AND_RETURN_FALSE(
-          AddDataAndSetType(&curr_aop, version, target_part_path, blob_file));
+      merged_replace_aops.push_back(&curr_aop);
     }
   }
+  TEST_AND_RETURN_FALSE(AddDataAndSetTypes(merged_replace_aops,
+                                           version,
+                                           target_part_path,
+                                           blob_file,
+                                           zstd_dictionary));
 
-  *aops = new_aops;
+  *aops = std::move(new_aops);
   return true;
 }
 
 bool ABGenerator::AddDataAndSetType(AnnotatedOperation* aop,
                                     const PayloadVersion& version,
                                     const string& target_part_path,
-                                    BlobFileWriter* blob_file) {
+                                    BlobFileWriter* blob_file,
+                                    const ZstdDictionary* zstd_dictionary) {
   TEST_AND_RETURN_FALSE(IsAReplaceOperation(aop->op.type()));
 
   vector<Extent> dst_extents;
@@ -277,8 +399,8 @@ bool ABGenerator::AddDataAndSetType(AnnotatedOperation* aop,
 
   brillo::Blob blob;
   InstallOperation::Type op_type;
-  TEST_AND_RETURN_FALSE(
-      diff_utils::GenerateBestFullOperation(data, version, &blob, &op_type));
+  TEST_AND_RETURN_FALSE(diff_utils::GenerateBestFullOperation(
+      data, version, &blob, &op_type, nullptr, zstd_dictionary));
 
   // If the operation doesn't point to a data blob or points to a data blob of
   // a different type then we add it.
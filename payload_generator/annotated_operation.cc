@@ -20,6 +20,7 @@
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/stringprintf.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 
@@ -41,12 +42,18 @@ bool AnnotatedOperation::SetOperationBlob(const brillo::Blob& blob,
   if (blob.empty()) {
     op.clear_data_offset();
     op.clear_data_length();
+    op.clear_data_sha256_hash();
     return true;
   }
   off_t data_offset = blob_file->StoreBlob(blob);
   TEST_AND_RETURN_FALSE(data_offset != -1);
   op.set_data_offset(data_offset);
   op.set_data_length(blob.size());
+  // Hashed here while the blob is in memory, on the thread that made it, so
+  // the payload writer doesn't need to read it back to hash it.
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(blob, &hash));
+  op.set_data_sha256_hash(hash.data(), hash.size());
   return true;
 }
 
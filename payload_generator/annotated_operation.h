@@ -43,7 +43,7 @@ struct AnnotatedOperation {
 
   // Writes |blob| to the end of |blob_file|. It sets the data_offset and
   // data_length in AnnotatedOperation to match the offset and size of |blob|
-  // in |blob_file|.
+  // in |blob_file|, and the data_sha256_hash to the hash of |blob|.
   bool SetOperationBlob(const brillo::Blob& blob, BlobFileWriter* blob_file);
 };
 
@@ -0,0 +1,248 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/base_payload.h"
+
+#include <fcntl.h>
+
+#include <iterator>
+#include <memory>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/install_operation_executor.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Applies |op| with its |blob| to |source_fd|, storing the data it writes in
+// |out|.
+bool ApplyOperation(const InstallOperation& op,
+                    const brillo::Blob& blob,
+                    size_t block_size,
+                    FileDescriptorPtr source_fd,
+                    brillo::Blob* out) {
+  InstallOperationExecutor executor(block_size);
+  auto writer = std::make_unique<BlobExtentWriter>(out);
+  switch (op.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+      return executor.ExecuteReplaceOperation(
+          op, std::move(writer), blob.data(), blob.size());
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      return executor.ExecuteZeroOrDiscardOperation(op, std::move(writer));
+    case InstallOperation::SOURCE_COPY:
+      TEST_AND_RETURN_FALSE(source_fd != nullptr);
+      return executor.ExecuteSourceCopyOperation(
+          op, std::move(writer), source_fd);
+    default:
+      TEST_AND_RETURN_FALSE(source_fd != nullptr);
+      return executor.ExecuteDiffOperation(
+          op, std::move(writer), source_fd, blob.data(), blob.size());
+  }
+}
+
+}  // namespace
+
+bool BasePayload::Load(const std::string& path) {
+  PayloadMetadata payload_metadata;
+  Signatures metadata_signatures;
+  TEST_AND_RETURN_FALSE(payload_metadata.ParsePayloadFile(
+      path, &manifest_, &metadata_signatures));
+  path_ = path;
+  blobs_offset_ = payload_metadata.GetMetadataSize() +
+                  payload_metadata.GetMetadataSignatureSize();
+
+  partitions_.clear();
+  for (const PartitionUpdate& update : manifest_.partitions()) {
+    Partition& partition = partitions_[update.partition_name()];
+    partition.update = &update;
+    for (int i = 0; i < update.operations_size(); i++) {
+      for (const Extent& extent : update.operations(i).dst_extents())
+        partition.operations_by_block[extent.start_block()] = i;
+    }
+  }
+  LOG(INFO) << "Loaded base payload " << path << " with "
+            << partitions_.size() << " partitions.";
+  return true;
+}
+
+bool BasePayload::ReadBlob(const InstallOperation& op,
+                           brillo::Blob* blob) const {
+  blob->clear();
+  if (op.data_length() == 0)
+    return true;
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+      path_, blobs_offset_ + op.data_offset(), op.data_length(), blob));
+  TEST_AND_RETURN_FALSE(blob->size() == op.data_length());
+  if (op.has_data_sha256_hash()) {
+    brillo::Blob hash;
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(*blob, &hash));
+    TEST_AND_RETURN_FALSE(hash == brillo::Blob(op.data_sha256_hash().begin(),
+                                               op.data_sha256_hash().end()));
+  }
+  return true;
+}
+
+bool BasePayload::ReuseOperations(const PayloadGenerationConfig& config,
+                                  const PartitionConfig& old_part,
+                                  const PartitionConfig& new_part,
+                                  const vector<Extent>& new_extents,
+                                  BlobFileWriter* blob_file,
+                                  vector<AnnotatedOperation>* aops) const {
+  const auto it = partitions_.find(new_part.name);
+  if (it == partitions_.end() || new_extents.empty())
+    return false;
+  const Partition& partition = it->second;
+
+  // The operations writing into |new_extents|, in the order of the payload.
+  std::set<int> indices;
+  for (const Extent& extent : new_extents) {
+    for (auto op_it =
+             partition.operations_by_block.lower_bound(extent.start_block());
+         op_it != partition.operations_by_block.end() &&
+         op_it->first < extent.start_block() + extent.num_blocks();
+         ++op_it) {
+      indices.insert(op_it->second);
+    }
+  }
+  if (indices.empty())
+    return false;
+
+  // The destination extents of the operations don't overlap, so they write
+  // exactly |new_extents| if they are all within it and as many blocks.
+  ExtentRanges new_blocks;
+  new_blocks.AddExtents(new_extents);
+  uint64_t num_blocks = 0;
+  for (int index : indices) {
+    const InstallOperation& op = partition.update->operations(index);
+    if (!config.OperationEnabled(op.type()))
+      return false;
+    if (!diff_utils::IsNoSourceOperation(op.type()) && old_part.path.empty())
+      return false;
+    for (const Extent& extent : op.dst_extents()) {
+      if (utils::BlocksInExtents(new_blocks.GetIntersectingExtents(extent)) !=
+          extent.num_blocks())
+        return false;
+    }
+    num_blocks += utils::BlocksInExtents(op.dst_extents());
+  }
+  if (num_blocks != new_blocks.blocks())
+    return false;
+  return ReuseIndices(
+      config, old_part, new_part, partition, indices, blob_file, aops);
+}
+
+bool BasePayload::ReuseFullOperation(const PayloadGenerationConfig& config,
+                                     const PartitionConfig& new_part,
+                                     const Extent& extent,
+                                     BlobFileWriter* blob_file,
+                                     AnnotatedOperation* aop) const {
+  const auto it = partitions_.find(new_part.name);
+  if (it == partitions_.end())
+    return false;
+  const Partition& partition = it->second;
+  const auto op_it = partition.operations_by_block.find(extent.start_block());
+  if (op_it == partition.operations_by_block.end())
+    return false;
+  const InstallOperation& op = partition.update->operations(op_it->second);
+  if (op.dst_extents_size() != 1 ||
+      op.dst_extents(0).num_blocks() != extent.num_blocks() ||
+      !diff_utils::IsNoSourceOperation(op.type()) ||
+      !config.OperationEnabled(op.type()))
+    return false;
+
+  vector<AnnotatedOperation> aops;
+  if (!ReuseIndices(config,
+                    PartitionConfig(new_part.name),
+                    new_part,
+                    partition,
+                    {op_it->second},
+                    blob_file,
+                    &aops))
+    return false;
+  aop->op = std::move(aops[0].op);
+  return true;
+}
+
+bool BasePayload::ReuseIndices(const PayloadGenerationConfig& config,
+                               const PartitionConfig& old_part,
+                               const PartitionConfig& new_part,
+                               const Partition& partition,
+                               const std::set<int>& indices,
+                               BlobFileWriter* blob_file,
+                               vector<AnnotatedOperation>* aops) const {
+  FileDescriptorPtr source_fd;
+  if (!old_part.path.empty()) {
+    source_fd = std::make_shared<EintrSafeFileDescriptor>();
+    TEST_AND_RETURN_FALSE(source_fd->Open(old_part.path.c_str(), O_RDONLY));
+  }
+  vector<AnnotatedOperation> reused;
+  vector<brillo::Blob> blobs;
+  for (int index : indices) {
+    const InstallOperation& op = partition.update->operations(index);
+    brillo::Blob blob;
+    brillo::Blob new_data;
+    brillo::Blob applied_data;
+    if (!ReadBlob(op, &blob) ||
+        !utils::ReadExtents(
+            new_part.path, op.dst_extents(), &new_data, config.block_size) ||
+        !ApplyOperation(
+            op, blob, config.block_size, source_fd, &applied_data) ||
+        applied_data != new_data) {
+      return false;
+    }
+
+    AnnotatedOperation aop;
+    aop.name = new_part.name + "-base-operation-" + std::to_string(index);
+    aop.op = op;
+    aop.op.clear_data_offset();
+    aop.op.clear_data_length();
+    aop.op.clear_data_sha256_hash();
+    // The source hash is computed again for the whole partition later.
+    aop.op.clear_src_sha256_hash();
+    if ((op.type() == InstallOperation::SOURCE_BSDIFF ||
+         op.type() == InstallOperation::BROTLI_BSDIFF) &&
+        config.enable_vabc_xor) {
+      diff_utils::PopulateXorOps(&aop, blob);
+    }
+    reused.push_back(std::move(aop));
+    blobs.push_back(std::move(blob));
+  }
+
+  for (size_t i = 0; i < reused.size(); i++) {
+    if (!blobs[i].empty())
+      TEST_AND_RETURN_FALSE(reused[i].SetOperationBlob(blobs[i], blob_file));
+  }
+  std::move(reused.begin(), reused.end(), std::back_inserter(*aops));
+  return true;
+}
+
+}  // namespace chromeos_update_engine
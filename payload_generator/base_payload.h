@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BASE_PAYLOAD_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_BASE_PAYLOAD_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A payload generated earlier, for instance from the same source to the
+// previous build, whose operations delta_generator --base_payload reuses for
+// the data which didn't change since, instead of diffing or compressing it
+// again. An operation is only reused when applying it to the current source
+// partition yields exactly the current target data, so a stale or unrelated
+// base payload only makes the generation slower, never the payload wrong.
+class BasePayload {
+ public:
+  BasePayload() = default;
+
+  // Parses the manifest of the payload at |path|.
+  bool Load(const std::string& path);
+
+  // Looks for the operations of the partition |new_part| in the base payload
+  // which together write exactly the blocks of |new_extents|. When there are
+  // some, and applying them to |old_part| yields the data of |new_part|,
+  // stores their blobs in |blob_file|, appends the operations to |aops| and
+  // returns true. Returns false otherwise, without changing either. Safe to
+  // call from several threads.
+  bool ReuseOperations(const PayloadGenerationConfig& config,
+                       const PartitionConfig& old_part,
+                       const PartitionConfig& new_part,
+                       const std::vector<Extent>& new_extents,
+                       BlobFileWriter* blob_file,
+                       std::vector<AnnotatedOperation>* aops) const;
+
+  // Like ReuseOperations(), for a chunk of a full payload: reuses the single
+  // operation of the base payload writing exactly |extent| of |new_part|, if
+  // there is one, and stores it in |aop|.
+  bool ReuseFullOperation(const PayloadGenerationConfig& config,
+                          const PartitionConfig& new_part,
+                          const Extent& extent,
+                          BlobFileWriter* blob_file,
+                          AnnotatedOperation* aop) const;
+
+ private:
+  struct Partition;
+
+  // Checks that the operations at |indices| of |partition| yield the data of
+  // |new_part| when applied to |old_part|, and if so, reuses them as in
+  // ReuseOperations().
+  bool ReuseIndices(const PayloadGenerationConfig& config,
+                    const PartitionConfig& old_part,
+                    const PartitionConfig& new_part,
+                    const Partition& partition,
+                    const std::set<int>& indices,
+                    BlobFileWriter* blob_file,
+                    std::vector<AnnotatedOperation>* aops) const;
+
+  // Reads the blob of |op| from the payload and checks its hash.
+  bool ReadBlob(const InstallOperation& op, brillo::Blob* blob) const;
+
+  std::string path_;
+  // The offset of the blobs in the payload.
+  uint64_t blobs_offset_{0};
+  DeltaArchiveManifest manifest_;
+
+  struct Partition {
+    const PartitionUpdate* update;
+    // The index of the operation writing each destination extent, by start
+    // block.
+    std::map<uint64_t, int> operations_by_block;
+  };
+  std::map<std::string, Partition> partitions_;
+
+  DISALLOW_COPY_AND_ASSIGN(BasePayload);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_BASE_PAYLOAD_H_
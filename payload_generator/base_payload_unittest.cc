@@ -0,0 +1,148 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/base_payload.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/full_update_generator.h"
+#include "update_engine/payload_generator/payload_file.h"
+
+using chromeos_update_engine::test_utils::FillWithData;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class BasePayloadTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    config_.is_delta = false;
+    config_.version.major = kBrilloMajorPayloadVersion;
+    config_.version.minor = kFullPayloadMinorVersion;
+    config_.hard_chunk_size = 16 * 4096;
+    config_.block_size = 4096;
+
+    new_part_.path = part_file_.path();
+    new_part_.size = 64 * 4096;
+    new_data_.resize(new_part_.size);
+    FillWithData(&new_data_);
+    ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path, new_data_));
+  }
+
+  // Generates the full operations of |new_part_| into |aops|, and a payload
+  // of them into |payload_path| if not empty.
+  void GenerateFullPayload(const std::string& payload_path,
+                           vector<AnnotatedOperation>* aops) {
+    ScopedTempFile blob_file("BasePayloadTest_blobs.XXXXXX", true);
+    off_t blobs_length = 0;
+    BlobFileWriter blob_file_writer(blob_file.fd(), &blobs_length);
+    FullUpdateGenerator generator;
+    ASSERT_TRUE(generator.GenerateOperations(
+        config_, new_part_, new_part_, &blob_file_writer, aops));
+    if (payload_path.empty())
+      return;
+    PayloadFile payload;
+    ASSERT_TRUE(payload.Init(config_));
+    ASSERT_TRUE(payload.AddPartition(new_part_, new_part_, *aops, {}, 0));
+    uint64_t metadata_size;
+    ASSERT_TRUE(payload.WritePayload(
+        payload_path, blob_file.path(), "", &metadata_size));
+  }
+
+  PayloadGenerationConfig config_;
+  PartitionConfig new_part_{"part"};
+  brillo::Blob new_data_;
+  ScopedTempFile part_file_{"BasePayloadTest_partition.XXXXXX"};
+};
+
+TEST_F(BasePayloadTest, ReusesUnchangedChunksTest) {
+  ScopedTempFile payload_file("BasePayloadTest_payload.XXXXXX");
+  vector<AnnotatedOperation> base_aops;
+  GenerateFullPayload(payload_file.path(), &base_aops);
+  ASSERT_EQ(4u, base_aops.size());
+
+  // Change the third chunk only.
+  new_data_[2 * config_.hard_chunk_size + 10] ^= 0xff;
+  ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path, new_data_));
+
+  auto base_payload = std::make_shared<BasePayload>();
+  ASSERT_TRUE(base_payload->Load(payload_file.path()));
+  config_.base_payload = base_payload;
+  vector<AnnotatedOperation> aops;
+  GenerateFullPayload("", &aops);
+  ASSERT_EQ(4u, aops.size());
+  for (size_t i = 0; i < aops.size(); i++) {
+    EXPECT_EQ(base_aops[i].op.dst_extents(0).start_block(),
+              aops[i].op.dst_extents(0).start_block());
+    if (i == 2) {
+      EXPECT_NE(base_aops[i].op.data_sha256_hash(),
+                aops[i].op.data_sha256_hash());
+    } else {
+      EXPECT_EQ(base_aops[i].op.type(), aops[i].op.type()) << "i = " << i;
+      EXPECT_EQ(base_aops[i].op.data_sha256_hash(),
+                aops[i].op.data_sha256_hash())
+          << "i = " << i;
+    }
+  }
+}
+
+TEST_F(BasePayloadTest, ReuseOperationsNeedsExactExtentsTest) {
+  ScopedTempFile payload_file("BasePayloadTest_payload.XXXXXX");
+  vector<AnnotatedOperation> base_aops;
+  GenerateFullPayload(payload_file.path(), &base_aops);
+  BasePayload base_payload;
+  ASSERT_TRUE(base_payload.Load(payload_file.path()));
+
+  ScopedTempFile blob_file("BasePayloadTest_blobs.XXXXXX", true);
+  off_t blobs_length = 0;
+  BlobFileWriter blob_file_writer(blob_file.fd(), &blobs_length);
+  const PartitionConfig old_part("part");
+  vector<AnnotatedOperation> aops;
+  // Two whole chunks are written by two operations.
+  EXPECT_TRUE(base_payload.ReuseOperations(config_,
+                                           old_part,
+                                           new_part_,
+                                           {ExtentForRange(16, 32)},
+                                           &blob_file_writer,
+                                           &aops));
+  EXPECT_EQ(2u, aops.size());
+  // Only part of a chunk can't be.
+  aops.clear();
+  EXPECT_FALSE(base_payload.ReuseOperations(config_,
+                                            old_part,
+                                            new_part_,
+                                            {ExtentForRange(16, 8)},
+                                            &blob_file_writer,
+                                            &aops));
+  EXPECT_TRUE(aops.empty());
+  // Nor a partition missing from the base payload.
+  EXPECT_FALSE(base_payload.ReuseOperations(config_,
+                                            old_part,
+                                            PartitionConfig("other"),
+                                            {ExtentForRange(0, 16)},
+                                            &blob_file_writer,
+                                            &aops));
+}
+
+}  // namespace chromeos_update_engine
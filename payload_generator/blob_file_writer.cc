@@ -21,13 +21,18 @@
 namespace chromeos_update_engine {
 
 off_t BlobFileWriter::StoreBlob(const brillo::Blob& blob) {
-  base::AutoLock auto_lock(blob_mutex_);
-  if (!utils::PWriteAll(blob_fd_, blob.data(), blob.size(), *blob_file_size_))
+  // Only reserving the range of the blob is serialized, the threads write
+  // their blobs at the same time.
+  off_t result;
+  {
+    base::AutoLock auto_lock(blob_mutex_);
+    result = *blob_file_size_;
+    *blob_file_size_ += blob.size();
+  }
+  if (!utils::PWriteAll(blob_fd_, blob.data(), blob.size(), result))
     return -1;
 
-  off_t result = *blob_file_size_;
-  *blob_file_size_ += blob.size();
-
+  base::AutoLock auto_lock(blob_mutex_);
   stored_blobs_++;
   if (total_blobs_ > 0 && (10 * (stored_blobs_ - 1) / total_blobs_) !=
                               (10 * stored_blobs_ / total_blobs_)) {
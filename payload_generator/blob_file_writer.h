@@ -32,7 +32,8 @@ class BlobFileWriter {
       : blob_fd_(blob_fd), blob_file_size_(blob_file_size) {}
 
   // Store the passed |blob| in the blob file. Returns the offset at which it
-  // was stored, or -1 in case of failure.
+  // was stored, or -1 in case of failure. Blobs stored from several threads
+  // are written concurrently.
   off_t StoreBlob(const brillo::Blob& blob);
 
   // Increase |total_blobs| by |increment|. Thread safe.
@@ -42,7 +43,8 @@ class BlobFileWriter {
   size_t total_blobs_{0};
   size_t stored_blobs_{0};
 
-  // The file and its size are protected with the |blob_mutex_|.
+  // The size of the file and the counters are protected with the
+  // |blob_mutex_|.
   int blob_fd_;
   off_t* blob_file_size_;
 
@@ -20,29 +20,67 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#include <functional>
+#include <algorithm>
+#include <cstring>
 #include <string>
+#include <thread>  // NOLINT(build/c++11) -- for hardware_concurrency
 #include <utility>
 #include <vector>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 
 using std::string;
 using std::vector;
 
+namespace chromeos_update_engine {
+
 namespace {
 
-size_t HashValue(const brillo::Blob& blob) {
-  std::hash<string> hash_fn;
-  return hash_fn(string(blob.begin(), blob.end()));
+// How many bytes of blocks AddManyDiskBlocks() reads and hashes in one go on
+// each thread.
+constexpr size_t kReadChunkSize = 2 * 1024 * 1024;
+
+constexpr uint64_t kHashMultiplier = 0x9fb21c651e98df25ULL;
+
+inline uint64_t HashMix(uint64_t hash, uint64_t word) {
+  hash = (hash ^ word) * kHashMultiplier;
+  return hash ^ (hash >> 29);
 }
 
 }  // namespace
 
-namespace chromeos_update_engine {
+uint64_t BlockMapping::HashBlock(const uint8_t* data, size_t size) {
+  // Four independent lanes of 8 bytes words, so that the multiplications of
+  // one lane don't wait for the previous one.
+  uint64_t lanes[4] = {0x243f6a8885a308d3ULL ^ size,
+                       0x13198a2e03707344ULL,
+                       0xa4093822299f31d0ULL,
+                       0x082efa98ec4e6c89ULL};
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    uint64_t words[4];
+    memcpy(words, data + i, sizeof(words));
+    for (size_t lane = 0; lane < 4; lane++)
+      lanes[lane] = HashMix(lanes[lane], words[lane]);
+  }
+  uint64_t hash = lanes[0];
+  for (size_t lane = 1; lane < 4; lane++)
+    hash = HashMix(hash, lanes[lane]);
+  for (; i < size; i++)
+    hash = HashMix(hash, data[i]);
+  return hash;
+}
 
 BlockMapping::BlockId BlockMapping::AddBlock(const brillo::Blob& block_data) {
-  return AddBlock(-1, 0, block_data);
+  if (block_data.size() != block_size_)
+    return -1;
+  if (utils::IsZeroBuffer(block_data))
+    return AddZeroBlock(-1, 0, block_data.data());
+  return AddBlock(-1,
+                  0,
+                  block_data.data(),
+                  HashBlock(block_data.data(), block_data.size()));
 }
 
 BlockMapping::BlockId BlockMapping::AddDiskBlock(int fd, off_t byte_offset) {
@@ -52,47 +90,114 @@ BlockMapping::BlockId BlockMapping::AddDiskBlock(int fd, off_t byte_offset) {
     return -1;
   if (static_cast<size_t>(bytes_read) != block_size_)
     return -1;
-  return AddBlock(fd, byte_offset, blob);
+  if (utils::IsZeroBuffer(blob))
+    return AddZeroBlock(fd, byte_offset, blob.data());
+  return AddBlock(
+      fd, byte_offset, blob.data(), HashBlock(blob.data(), blob.size()));
 }
 
 bool BlockMapping::AddManyDiskBlocks(int fd,
                                      off_t initial_byte_offset,
                                      size_t num_blocks,
                                      vector<BlockId>* block_ids) {
-  bool ret = true;
-  block_ids->resize(num_blocks);
-  for (size_t block = 0; block < num_blocks; block++) {
-    (*block_ids)[block] =
-        AddDiskBlock(fd, initial_byte_offset + block * block_size_);
-    ret = ret && (*block_ids)[block] != -1;
+  block_ids->assign(num_blocks, -1);
+  if (num_blocks == 0)
+    return true;
+  const size_t chunk_blocks = std::max<size_t>(kReadChunkSize / block_size_, 1);
+  const size_t num_chunks = (num_blocks + chunk_blocks - 1) / chunk_blocks;
+  const size_t num_threads = std::min<size_t>(
+      num_chunks, std::max(std::thread::hardware_concurrency(), 1u));
+
+  // A chunk of contiguous blocks, read and hashed by one thread.
+  struct Chunk {
+    size_t first_block{0};
+    size_t num_blocks{0};
+    brillo::Blob data;
+    vector<uint64_t> hashes;
+    // Whether each block is all zeros, in which case it has no hash.
+    vector<uint8_t> zero;
+  };
+  vector<Chunk> chunks(num_threads);
+  auto read_chunk = [this, fd, initial_byte_offset](Chunk* chunk) {
+    const size_t size = chunk->num_blocks * block_size_;
+    chunk->data.resize(size);
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        fd,
+        chunk->data.data(),
+        size,
+        initial_byte_offset + chunk->first_block * block_size_,
+        &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == size);
+    chunk->hashes.resize(chunk->num_blocks);
+    chunk->zero.resize(chunk->num_blocks);
+    for (size_t i = 0; i < chunk->num_blocks; i++) {
+      const uint8_t* block_data = chunk->data.data() + i * block_size_;
+      chunk->zero[i] = utils::IsZeroBuffer(block_data, block_size_);
+      if (!chunk->zero[i])
+        chunk->hashes[i] = HashBlock(block_data, block_size_);
+    }
+    return true;
+  };
+
+  // The chunks are read and hashed in batches of one chunk per thread, then
+  // their blocks are added in order: the block ids don't depend on the number
+  // of threads.
+  WorkerPool pool(num_threads, num_threads);
+  for (size_t block = 0; block < num_blocks;) {
+    size_t batch_size = 0;
+    for (; batch_size < num_threads && block < num_blocks; batch_size++) {
+      Chunk* chunk = &chunks[batch_size];
+      chunk->first_block = block;
+      chunk->num_blocks = std::min(chunk_blocks, num_blocks - block);
+      block += chunk->num_blocks;
+      if (!pool.Post([&read_chunk, chunk] { return read_chunk(chunk); }))
+        break;
+    }
+    TEST_AND_RETURN_FALSE(pool.Wait());
+    for (size_t i = 0; i < batch_size; i++) {
+      const Chunk& chunk = chunks[i];
+      for (size_t j = 0; j < chunk.num_blocks; j++) {
+        const size_t block_index = chunk.first_block + j;
+        const off_t byte_offset =
+            initial_byte_offset + block_index * block_size_;
+        const uint8_t* block_data = chunk.data.data() + j * block_size_;
+        BlockId block_id =
+            chunk.zero[j]
+                ? AddZeroBlock(fd, byte_offset, block_data)
+                : AddBlock(fd, byte_offset, block_data, chunk.hashes[j]);
+        TEST_AND_RETURN_FALSE(block_id != -1);
+        (*block_ids)[block_index] = block_id;
+      }
+    }
+  }
+  return true;
+}
+
+BlockMapping::BlockId BlockMapping::AddZeroBlock(int fd,
+                                                 off_t byte_offset,
+                                                 const uint8_t* block_data) {
+  if (zero_block_id_ == -1) {
+    zero_block_id_ = AddBlock(
+        fd, byte_offset, block_data, HashBlock(block_data, block_size_));
   }
-  return ret;
+  return zero_block_id_;
 }
 
 BlockMapping::BlockId BlockMapping::AddBlock(int fd,
                                              off_t byte_offset,
-                                             const brillo::Blob& block_data) {
-  if (block_data.size() != block_size_)
-    return -1;
-  size_t h = HashValue(block_data);
-
+                                             const uint8_t* block_data,
+                                             uint64_t hash) {
   // We either reuse a UniqueBlock or create a new one. If we need a new
   // UniqueBlock it could also be part of a new or existing bucket (if there is
   // a hash collision).
-  vector<UniqueBlock>* bucket = nullptr;
-
-  auto mapping_it = mapping_.find(h);
-  if (mapping_it == mapping_.end()) {
-    bucket = &mapping_[h];
-  } else {
-    for (UniqueBlock& existing_block : mapping_it->second) {
-      bool equals = false;
-      if (!existing_block.CompareData(block_data, &equals))
-        return -1;
-      if (equals)
-        return existing_block.block_id;
-    }
-    bucket = &mapping_it->second;
+  vector<UniqueBlock>* bucket = &mapping_[hash];
+  for (UniqueBlock& existing_block : *bucket) {
+    bool equals = false;
+    if (!existing_block.CompareData(block_data, block_size_, &equals))
+      return -1;
+    if (equals)
+      return existing_block.block_id;
   }
 
   // No existing block was found at this point, so we create and fill in a new
@@ -106,25 +211,25 @@ BlockMapping::BlockId BlockMapping::AddBlock(int fd,
   new_ublock->block_id = used_block_ids++;
   // We need to cache blocks that are not referencing any disk location.
   if (fd == -1)
-    new_ublock->block_data = block_data;
+    new_ublock->block_data.assign(block_data, block_data + block_size_);
 
   return new_ublock->block_id;
 }
 
-bool BlockMapping::UniqueBlock::CompareData(const brillo::Blob& other_block,
+bool BlockMapping::UniqueBlock::CompareData(const uint8_t* other_block,
+                                            size_t block_size,
                                             bool* equals) {
   if (!block_data.empty()) {
-    *equals = block_data == other_block;
+    *equals = memcmp(block_data.data(), other_block, block_size) == 0;
     return true;
   }
-  const size_t block_size = other_block.size();
   brillo::Blob blob(block_size);
   ssize_t bytes_read = 0;
   if (!utils::PReadAll(fd, blob.data(), block_size, byte_offset, &bytes_read))
     return false;
   if (static_cast<size_t>(bytes_read) != block_size)
     return false;
-  *equals = blob == other_block;
+  *equals = memcmp(blob.data(), other_block, block_size) == 0;
 
   // We increase the number of times we had to read this block from disk and
   // we cache this block based on that. This caching method is optimized for
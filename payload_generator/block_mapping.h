@@ -17,8 +17,8 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_MAPPING_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_MAPPING_H_
 
-#include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <brillo/secure_blob.h>
@@ -52,7 +52,8 @@ class BlockMapping {
   // This is a helper method to add |num_blocks| contiguous blocks reading them
   // from the file descriptor |fd| starting at offset |initial_byte_offset|.
   // Returns whether it succeeded to add all the disk blocks and stores in
-  // |block_ids| the block id for each one of the added blocks.
+  // |block_ids| the block id for each one of the added blocks. The blocks are
+  // read and hashed in large chunks on several threads, and added in order.
   bool AddManyDiskBlocks(int fd,
                          off_t initial_byte_offset,
                          size_t num_blocks,
@@ -60,16 +61,31 @@ class BlockMapping {
 
  private:
   FRIEND_TEST(BlockMappingTest, BlocksAreNotKeptInMemory);
+  FRIEND_TEST(BlockMappingTest, ZeroBlocksShareOneId);
 
-  // Add a single block passed in |block_data|. If |fd| is not -1, the block
-  // can be discarded to save RAM and retrieved later from |fd| at the position
-  // |byte_offset|.
-  BlockId AddBlock(int fd, off_t byte_offset, const brillo::Blob& block_data);
+  // Add a single block of |block_size_| bytes passed in |block_data|, whose
+  // HashBlock() is |hash|. If |fd| is not -1, the block can be discarded to
+  // save RAM and retrieved later from |fd| at the position |byte_offset|.
+  BlockId AddBlock(int fd,
+                   off_t byte_offset,
+                   const uint8_t* block_data,
+                   uint64_t hash);
+
+  // Same as AddBlock() for a |block_data| of all zeros, which is only hashed
+  // and looked up the first time. Most partitions have many zero blocks.
+  BlockId AddZeroBlock(int fd, off_t byte_offset, const uint8_t* block_data);
+
+  // A fast non-cryptographic hash of the |size| bytes at |data|. Blocks with
+  // the same hash are compared byte by byte, so collisions only cost time.
+  static uint64_t HashBlock(const uint8_t* data, size_t size);
 
   size_t block_size_;
 
   BlockId used_block_ids{0};
 
+  // The block id of the block with all zeros, or -1 if none was added yet.
+  BlockId zero_block_id_{-1};
+
   // The UniqueBlock represents the data of a block associated to a unique
   // block id.
   struct UniqueBlock {
@@ -85,14 +101,16 @@ class BlockMapping {
     // Number of times we have seen this data block. Used for caching.
     uint32_t times_read{0};
 
-    // Compares the UniqueBlock data with the other_block data and stores if
-    // they are equal in |equals|. Returns whether there was an error reading
-    // the block from disk while comparing it.
-    bool CompareData(const brillo::Blob& other_block, bool* equals);
+    // Compares the UniqueBlock data with the |block_size| bytes of
+    // other_block and stores if they are equal in |equals|. Returns whether
+    // there was an error reading the block from disk while comparing it.
+    bool CompareData(const uint8_t* other_block,
+                     size_t block_size,
+                     bool* equals);
   };
 
   // A mapping from hash values to possible block ids.
-  std::map<size_t, std::vector<UniqueBlock>> mapping_;
+  std::unordered_map<uint64_t, std::vector<UniqueBlock>> mapping_;
 };
 
 // Maps the blocks of the old and new partitions |old_part| and |new_part| whose
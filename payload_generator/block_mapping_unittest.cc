@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -112,4 +113,47 @@ TEST_F(BlockMappingTest, MapPartitionBlocks) {
   EXPECT_EQ((vector<BlockMapping::BlockId>{0, 11, 12, 13, 1, 2}), new_ids);
 }
 
+TEST_F(BlockMappingTest, AddManyDiskBlocksMatchesAddDiskBlock) {
+  // Enough blocks for several read chunks, with repeated blocks across them.
+  const size_t num_blocks = 3 * 2 * 1024 * 1024 / block_size_ + 5;
+  string contents(num_blocks * block_size_, '\0');
+  for (size_t i = 0; i < contents.size(); ++i)
+    contents[i] = (i / block_size_) % 37 + (i % block_size_ == 0 ? 1 : 0);
+  test_utils::WriteFileString(old_part_.path(), contents);
+  int fd = HANDLE_EINTR(open(old_part_.path().c_str(), O_RDONLY));
+  ScopedFdCloser fd_closer(&fd);
+
+  vector<BlockMapping::BlockId> block_ids;
+  EXPECT_TRUE(bm_.AddManyDiskBlocks(fd, 0, num_blocks, &block_ids));
+  ASSERT_EQ(num_blocks, block_ids.size());
+
+  BlockMapping expected_mapping(block_size_);
+  for (size_t i = 0; i < num_blocks; ++i) {
+    EXPECT_EQ(expected_mapping.AddDiskBlock(fd, i * block_size_),
+              block_ids[i]);
+  }
+  // The 37 different blocks get the first 37 ids.
+  EXPECT_EQ(36, *std::max_element(block_ids.begin(), block_ids.end()));
+}
+
+TEST_F(BlockMappingTest, ZeroBlocksShareOneId) {
+  // Zero blocks on both sides of a non-zero one.
+  string contents(5 * block_size_, '\0');
+  contents[2 * block_size_] = 1;
+  test_utils::WriteFileString(old_part_.path(), contents);
+  int fd = HANDLE_EINTR(open(old_part_.path().c_str(), O_RDONLY));
+  ScopedFdCloser fd_closer(&fd);
+
+  EXPECT_EQ(0, bm_.AddBlock(brillo::Blob(block_size_, 0)));
+  vector<BlockMapping::BlockId> block_ids;
+  EXPECT_TRUE(bm_.AddManyDiskBlocks(fd, 0, 5, &block_ids));
+  EXPECT_EQ((vector<BlockMapping::BlockId>{0, 0, 1, 0, 0}), block_ids);
+  EXPECT_EQ(0, bm_.AddDiskBlock(fd, 4 * block_size_));
+
+  size_t num_unique_blocks = 0;
+  for (const auto& it : bm_.mapping_)
+    num_unique_blocks += it.second.size();
+  EXPECT_EQ(2u, num_unique_blocks);
+}
+
 }  // namespace chromeos_update_engine
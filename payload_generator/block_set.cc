@@ -0,0 +1,136 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/block_set.h"
+
+#include <algorithm>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint64_t kWordBlocks = 64;
+
+// The bits of the |count| blocks from bit |bit| of a word.
+uint64_t WordMask(uint64_t bit, uint64_t count) {
+  return (count == kWordBlocks ? ~0ULL : (1ULL << count) - 1) << bit;
+}
+
+}  // namespace
+
+BlockSet::BlockSet(uint64_t num_blocks)
+    : words_((num_blocks + kWordBlocks - 1) / kWordBlocks) {}
+
+void BlockSet::AddBlock(uint64_t block) {
+  AddRange(block, 1);
+}
+
+void BlockSet::AddExtent(const Extent& extent) {
+  AddRange(extent.start_block(), extent.num_blocks());
+}
+
+void BlockSet::AddRange(uint64_t start, uint64_t num) {
+  if (start == kSparseHole || num == 0)
+    return;
+  const uint64_t end = start + num;
+  const uint64_t num_words = (end + kWordBlocks - 1) / kWordBlocks;
+  if (words_.size() < num_words)
+    words_.resize(num_words);
+  for (uint64_t block = start; block < end;) {
+    const uint64_t bit = block % kWordBlocks;
+    const uint64_t count = std::min(kWordBlocks - bit, end - block);
+    const uint64_t mask = WordMask(bit, count);
+    uint64_t& word = words_[block / kWordBlocks];
+    blocks_ += __builtin_popcountll(mask & ~word);
+    word |= mask;
+    block += count;
+  }
+}
+
+void BlockSet::AddSet(const BlockSet& other) {
+  if (words_.size() < other.words_.size())
+    words_.resize(other.words_.size());
+  for (size_t i = 0; i < other.words_.size(); i++) {
+    blocks_ += __builtin_popcountll(other.words_[i] & ~words_[i]);
+    words_[i] |= other.words_[i];
+  }
+}
+
+void BlockSet::SubtractSet(const BlockSet& other) {
+  const size_t num_words = std::min(words_.size(), other.words_.size());
+  for (size_t i = 0; i < num_words; i++) {
+    blocks_ -= __builtin_popcountll(words_[i] & other.words_[i]);
+    words_[i] &= ~other.words_[i];
+  }
+}
+
+bool BlockSet::ContainsBlock(uint64_t block) const {
+  const uint64_t index = block / kWordBlocks;
+  return index < words_.size() &&
+         (words_[index] >> (block % kWordBlocks) & 1) != 0;
+}
+
+uint64_t BlockSet::FindNext(uint64_t block, uint64_t end, bool in_set) const {
+  while (block < end) {
+    const uint64_t index = block / kWordBlocks;
+    // No block past the bitmap is in the set.
+    if (index >= words_.size())
+      return in_set ? end : block;
+    uint64_t word = in_set ? words_[index] : ~words_[index];
+    word &= ~0ULL << (block % kWordBlocks);
+    if (word != 0)
+      return std::min(end, index * kWordBlocks + __builtin_ctzll(word));
+    block = (index + 1) * kWordBlocks;
+  }
+  return end;
+}
+
+vector<Extent> BlockSet::FilterExtents(const vector<Extent>& extents) const {
+  vector<Extent> result;
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole || extent.num_blocks() == 0) {
+      if (extent.num_blocks() > 0)
+        result.push_back(extent);
+      continue;
+    }
+    const uint64_t end = extent.start_block() + extent.num_blocks();
+    uint64_t block = FindNext(extent.start_block(), end, false);
+    while (block < end) {
+      const uint64_t next = FindNext(block, end, true);
+      result.push_back(ExtentForRange(block, next - block));
+      block = FindNext(next, end, false);
+    }
+  }
+  return result;
+}
+
+vector<BlockExtent> BlockSet::GetExtents() const {
+  vector<BlockExtent> result;
+  const uint64_t end = words_.size() * kWordBlocks;
+  uint64_t block = FindNext(0, end, true);
+  while (block < end) {
+    const uint64_t next = FindNext(block, end, false);
+    result.push_back({block, next - block});
+    block = FindNext(next, end, true);
+  }
+  return result;
+}
+
+}  // namespace chromeos_update_engine
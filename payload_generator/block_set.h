@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_SET_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_SET_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A set of blocks of a partition, stored as a bitmap of one bit per block.
+// Unlike ExtentRanges, adding and looking up blocks takes constant time and the
+// set takes the same memory however fragmented it is, so it suits the sets
+// built block by block or file by file while diffing a whole partition. The
+// sets are combined a word of 64 blocks at a time, and only turned into extents
+// for the operations.
+class BlockSet {
+ public:
+  BlockSet() = default;
+  // Reserves the bitmap of the blocks [0, |num_blocks|). The set grows past
+  // them as blocks are added anyway.
+  explicit BlockSet(uint64_t num_blocks);
+
+  void AddBlock(uint64_t block);
+  void AddExtent(const Extent& extent);
+  // Adds the blocks of each of |extents|, which may be Extent or BlockExtent,
+  // in any order. Sparse holes are skipped.
+  template <typename Container>
+  void AddExtents(const Container& extents) {
+    for (const auto& extent : extents)
+      AddRange(extent.start_block(), extent.num_blocks());
+  }
+  void AddSet(const BlockSet& other);
+  void SubtractSet(const BlockSet& other);
+
+  bool ContainsBlock(uint64_t block) const;
+
+  // The number of blocks in the set.
+  uint64_t blocks() const { return blocks_; }
+
+  // Returns the blocks of |extents| not in the set, in the order of |extents|,
+  // like FilterExtentRanges(). Sparse holes are kept.
+  std::vector<Extent> FilterExtents(const std::vector<Extent>& extents) const;
+
+  // Returns the set as sorted, disjoint extents.
+  std::vector<BlockExtent> GetExtents() const;
+
+ private:
+  // Adds the blocks [start, start + num) unless it is a sparse hole.
+  void AddRange(uint64_t start, uint64_t num);
+
+  // Returns the first block from |block| up to |end| which is in the set if
+  // |in_set|, or not in it otherwise, or |end| if there is none.
+  uint64_t FindNext(uint64_t block, uint64_t end, bool in_set) const;
+
+  // Bit b of word w is block w * 64 + b.
+  std::vector<uint64_t> words_;
+  uint64_t blocks_{0};
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_SET_H_
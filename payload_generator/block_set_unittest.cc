@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/block_set.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+TEST(BlockSetTest, AddAndContainsTest) {
+  BlockSet set(100);
+  set.AddBlock(3);
+  set.AddExtent(ExtentForRange(60, 10));
+  set.AddExtents(vector<Extent>{ExtentForRange(65, 10),
+                                ExtentForRange(kSparseHole, 4)});
+  // Past the reserved blocks.
+  set.AddBlock(200);
+  EXPECT_EQ(17u, set.blocks());
+  EXPECT_TRUE(set.ContainsBlock(3));
+  EXPECT_FALSE(set.ContainsBlock(4));
+  EXPECT_TRUE(set.ContainsBlock(74));
+  EXPECT_FALSE(set.ContainsBlock(75));
+  EXPECT_TRUE(set.ContainsBlock(200));
+  EXPECT_FALSE(set.ContainsBlock(1000));
+  EXPECT_EQ((vector<BlockExtent>{{3, 1}, {60, 15}, {200, 1}}),
+            set.GetExtents());
+}
+
+TEST(BlockSetTest, CombineTest) {
+  BlockSet set;
+  set.AddExtent(ExtentForRange(0, 130));
+  BlockSet other;
+  other.AddExtent(ExtentForRange(10, 20));
+  other.AddExtent(ExtentForRange(120, 80));
+  set.SubtractSet(other);
+  EXPECT_EQ(100u, set.blocks());
+  EXPECT_EQ((vector<BlockExtent>{{0, 10}, {30, 90}}), set.GetExtents());
+  set.AddSet(other);
+  EXPECT_EQ(200u, set.blocks());
+  EXPECT_EQ((vector<BlockExtent>{{0, 200}}), set.GetExtents());
+}
+
+TEST(BlockSetTest, FilterExtentsTest) {
+  BlockSet set;
+  set.AddExtent(ExtentForRange(10, 10));
+  set.AddBlock(64);
+  set.AddExtent(ExtentForRange(127, 2));
+  // The order of the extents is kept.
+  EXPECT_EQ((vector<Extent>{ExtentForRange(100, 27),
+                            ExtentForRange(129, 11),
+                            ExtentForRange(kSparseHole, 2),
+                            ExtentForRange(5, 5),
+                            ExtentForRange(20, 44),
+                            ExtentForRange(65, 5)}),
+            set.FilterExtents({ExtentForRange(100, 40),
+                               ExtentForRange(kSparseHole, 2),
+                               ExtentForRange(5, 65),
+                               ExtentForRange(12, 3)}));
+}
+
+}  // namespace chromeos_update_engine
@@ -16,6 +16,8 @@
 
 #include "update_engine/payload_generator/boot_img_filesystem.h"
 
+#include <string.h>
+
 #include <base/logging.h>
 #include <bootimg.h>
 #include <brillo/secure_blob.h>
@@ -24,6 +26,7 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 
 using std::string;
 using std::unique_ptr;
@@ -36,12 +39,30 @@ unique_ptr<BootImgFilesystem> BootImgFilesystem::CreateFromFile(
   if (filename.empty())
     return nullptr;
 
-  if (brillo::Blob header_magic;
-      !utils::ReadFileChunk(filename, 0, BOOT_MAGIC_SIZE, &header_magic) ||
-      memcmp(header_magic.data(), BOOT_MAGIC, BOOT_MAGIC_SIZE) != 0) {
+  static_assert(BOOT_MAGIC_SIZE == VENDOR_BOOT_MAGIC_SIZE);
+  brillo::Blob header_magic;
+  if (!utils::ReadFileChunk(filename, 0, BOOT_MAGIC_SIZE, &header_magic) ||
+      header_magic.size() != BOOT_MAGIC_SIZE) {
     return nullptr;
   }
+  unique_ptr<BootImgFilesystem> result(new BootImgFilesystem());
+  result->filename_ = filename;
+  if (memcmp(header_magic.data(), BOOT_MAGIC, BOOT_MAGIC_SIZE) == 0) {
+    if (!ReadBootImgSections(filename, &result->sections_))
+      return nullptr;
+  } else if (memcmp(header_magic.data(),
+                    VENDOR_BOOT_MAGIC,
+                    VENDOR_BOOT_MAGIC_SIZE) == 0) {
+    if (!ReadVendorBootImgSections(filename, &result->sections_))
+      return nullptr;
+  } else {
+    return nullptr;
+  }
+  return result;
+}
 
+bool BootImgFilesystem::ReadBootImgSections(const string& filename,
+                                            vector<Section>* sections) {
   // The order of image header fields are different in version 3 from the
   // previous versions. But the position of "header_version" is fixed at #9
   // across all image headers.
@@ -53,14 +74,14 @@ unique_ptr<BootImgFilesystem> BootImgFilesystem::CreateFromFile(
                             header_version_offset,
                             sizeof(uint32_t),
                             &header_version_blob)) {
-    return nullptr;
+    return false;
   }
   uint32_t header_version =
       *reinterpret_cast<uint32_t*>(header_version_blob.data());
   if (header_version > 4) {
     LOG(WARNING) << "Boot image header version " << header_version
                  << " isn't supported for parsing";
-    return nullptr;
+    return false;
   }
 
   // Read the bytes of boot image header based on the header version.
@@ -68,39 +89,130 @@ unique_ptr<BootImgFilesystem> BootImgFilesystem::CreateFromFile(
       header_version == 3 ? sizeof(boot_img_hdr_v3) : sizeof(boot_img_hdr_v0);
   brillo::Blob header_blob;
   if (!utils::ReadFileChunk(filename, 0, header_size, &header_blob)) {
-    return nullptr;
+    return false;
   }
 
-  unique_ptr<BootImgFilesystem> result(new BootImgFilesystem());
-  result->filename_ = filename;
+  uint32_t kernel_size = 0;
+  uint32_t ramdisk_size = 0;
+  uint32_t signature_size = 0;
+  uint32_t page_size = 0;
   if (header_version < 3) {
     auto hdr_v0 = reinterpret_cast<boot_img_hdr_v0*>(header_blob.data());
     CHECK_EQ(0, memcmp(hdr_v0->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE));
     CHECK_LT(hdr_v0->header_version, 3u);
-    result->kernel_size_ = hdr_v0->kernel_size;
-    result->ramdisk_size_ = hdr_v0->ramdisk_size;
-    result->page_size_ = hdr_v0->page_size;
+    kernel_size = hdr_v0->kernel_size;
+    ramdisk_size = hdr_v0->ramdisk_size;
+    page_size = hdr_v0->page_size;
   } else if (header_version == 3) {
     auto hdr_v3 = reinterpret_cast<boot_img_hdr_v3*>(header_blob.data());
     CHECK_EQ(0, memcmp(hdr_v3->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE));
     CHECK_EQ(3u, hdr_v3->header_version);
-    result->kernel_size_ = hdr_v3->kernel_size;
-    result->ramdisk_size_ = hdr_v3->ramdisk_size;
-    result->page_size_ = 4096;
+    kernel_size = hdr_v3->kernel_size;
+    ramdisk_size = hdr_v3->ramdisk_size;
+    page_size = 4096;
   } else {
     auto hdr_v4 = reinterpret_cast<boot_img_hdr_v4*>(header_blob.data());
     CHECK_EQ(0, memcmp(hdr_v4->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE));
     CHECK_EQ(hdr_v4->header_version, 4u);
-    result->kernel_size_ = hdr_v4->kernel_size;
-    result->ramdisk_size_ = hdr_v4->ramdisk_size;
+    kernel_size = hdr_v4->kernel_size;
+    ramdisk_size = hdr_v4->ramdisk_size;
     // In boot image v3 and v4, page size is hard coded as 4096
-    result->page_size_ = 4096;
-    result->signature_size_ = hdr_v4->signature_size;
+    page_size = 4096;
+    signature_size = hdr_v4->signature_size;
   }
 
-  CHECK_GT(result->page_size_, 0u);
+  CHECK_GT(page_size, 0u);
 
-  return result;
+  // The first page is header.
+  uint64_t offset = page_size;
+  sections->push_back({"<kernel>", offset, kernel_size});
+  offset += utils::RoundUp(kernel_size, page_size);
+  sections->push_back({"<ramdisk>", offset, ramdisk_size});
+  offset += utils::RoundUp(ramdisk_size, page_size);
+  sections->push_back({"<boot signature>", offset, signature_size});
+  return true;
+}
+
+bool BootImgFilesystem::ReadVendorBootImgSections(const string& filename,
+                                                  vector<Section>* sections) {
+  // Version 4 only appends fields to the version 3 header.
+  brillo::Blob header_blob;
+  if (!utils::ReadFileChunk(
+          filename, 0, sizeof(vendor_boot_img_hdr_v4), &header_blob) ||
+      header_blob.size() < sizeof(vendor_boot_img_hdr_v3)) {
+    return false;
+  }
+  vendor_boot_img_hdr_v4 hdr{};
+  memcpy(&hdr, header_blob.data(), header_blob.size());
+  if (hdr.header_version != 3 && hdr.header_version != 4) {
+    LOG(WARNING) << "Vendor boot image header version " << hdr.header_version
+                 << " isn't supported for parsing";
+    return false;
+  }
+  if (hdr.page_size == 0) {
+    LOG(ERROR) << "Vendor boot image " << filename << " has no page size";
+    return false;
+  }
+
+  // The sections follow the header, each aligned to a page.
+  const uint64_t page_size = hdr.page_size;
+  const uint64_t ramdisk_offset = utils::RoundUp(hdr.header_size, page_size);
+  const uint64_t dtb_offset =
+      ramdisk_offset + utils::RoundUp(hdr.vendor_ramdisk_size, page_size);
+  const uint64_t table_offset =
+      dtb_offset + utils::RoundUp(hdr.dtb_size, page_size);
+
+  // Version 4 images may hold several ramdisk fragments, which are diffed as
+  // separate files when the table describing them is valid.
+  vector<Section> fragments;
+  bool valid_table = hdr.header_version == 4 &&
+                     hdr.vendor_ramdisk_table_entry_num > 0 &&
+                     hdr.vendor_ramdisk_table_entry_size >=
+                         sizeof(vendor_ramdisk_table_entry_v4);
+  brillo::Blob table;
+  if (valid_table) {
+    const uint64_t table_size = uint64_t{hdr.vendor_ramdisk_table_entry_num} *
+                                hdr.vendor_ramdisk_table_entry_size;
+    valid_table =
+        table_size <= hdr.vendor_ramdisk_table_size &&
+        utils::ReadFileChunk(filename, table_offset, table_size, &table) &&
+        table.size() == table_size;
+  }
+  for (uint32_t i = 0; valid_table && i < hdr.vendor_ramdisk_table_entry_num;
+       i++) {
+    vendor_ramdisk_table_entry_v4 entry;
+    memcpy(&entry,
+           table.data() + i * hdr.vendor_ramdisk_table_entry_size,
+           sizeof(entry));
+    if (uint64_t{entry.ramdisk_offset} + entry.ramdisk_size >
+        hdr.vendor_ramdisk_size) {
+      LOG(WARNING) << "Vendor ramdisk fragment " << i << " of " << filename
+                   << " is outside of the vendor ramdisk, not splitting it.";
+      valid_table = false;
+      break;
+    }
+    const char* name = reinterpret_cast<const char*>(entry.ramdisk_name);
+    const string fragment_name(name, strnlen(name, sizeof(entry.ramdisk_name)));
+    fragments.push_back(
+        {"<vendor ramdisk " +
+             (fragment_name.empty() ? std::to_string(i) : fragment_name) + ">",
+         ramdisk_offset + entry.ramdisk_offset,
+         entry.ramdisk_size});
+  }
+  if (valid_table) {
+    sections->insert(sections->end(), fragments.begin(), fragments.end());
+  } else {
+    sections->push_back(
+        {"<vendor ramdisk>", ramdisk_offset, hdr.vendor_ramdisk_size});
+  }
+  sections->push_back({"<dtb>", dtb_offset, hdr.dtb_size});
+  if (hdr.header_version == 4) {
+    const uint64_t bootconfig_offset =
+        table_offset + utils::RoundUp(hdr.vendor_ramdisk_table_size, page_size);
+    sections->push_back(
+        {"<bootconfig>", bootconfig_offset, hdr.bootconfig_size});
+  }
+  return true;
 }
 
 size_t BootImgFilesystem::GetBlockSize() const {
@@ -141,19 +253,21 @@ FilesystemInterface::File BootImgFilesystem::GetFile(const string& name,
 bool BootImgFilesystem::GetFiles(vector<File>* files) const {
   files->clear();
   const uint64_t file_size = utils::FileSize(filename_);
-  // The first page is header.
-  uint64_t offset = page_size_;
-  if (kernel_size_ > 0 && offset + kernel_size_ <= file_size) {
-    files->emplace_back(GetFile("<kernel>", offset, kernel_size_));
-  }
-  offset += utils::RoundUp(kernel_size_, page_size_);
-  if (ramdisk_size_ > 0 && offset + ramdisk_size_ <= file_size) {
-    files->emplace_back(GetFile("<ramdisk>", offset, ramdisk_size_));
+  vector<const Section*> sections;
+  for (const Section& section : sections_) {
+    if (section.size > 0 && section.offset + section.size <= file_size)
+      sections.push_back(&section);
   }
-  offset += utils::RoundUp(ramdisk_size_, page_size_);
-  if (signature_size_ > 0) {
-    files->emplace_back(GetFile("<boot signature>", offset, signature_size_));
+  // Locating the deflates of a large ramdisk takes a while, so the sections
+  // are read in parallel.
+  files->resize(sections.size());
+  TaskGroup group;
+  for (size_t i = 0; i < sections.size(); i++) {
+    group.Post([this, section = sections[i], file = &(*files)[i]] {
+      *file = GetFile(section->name, section->offset, section->size);
+    });
   }
+  group.Wait();
   return true;
 }
 
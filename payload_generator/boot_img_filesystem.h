@@ -27,7 +27,8 @@ namespace chromeos_update_engine {
 
 class BootImgFilesystem : public FilesystemInterface {
  public:
-  // Creates an BootImgFilesystem from an Android boot.img file.
+  // Creates an BootImgFilesystem from an Android boot.img or vendor_boot.img
+  // file.
   static std::unique_ptr<BootImgFilesystem> CreateFromFile(
       const std::string& filename);
   ~BootImgFilesystem() override = default;
@@ -37,7 +38,8 @@ class BootImgFilesystem : public FilesystemInterface {
   size_t GetBlockCount() const override;
 
   // GetFiles will return one FilesystemInterface::File for kernel and one for
-  // ramdisk.
+  // ramdisk, or for a vendor_boot.img, one for each vendor ramdisk fragment and
+  // one for the dtb.
   bool GetFiles(std::vector<File>* files) const override;
 
   bool LoadSettings(brillo::KeyValueStore* store) const override;
@@ -45,17 +47,30 @@ class BootImgFilesystem : public FilesystemInterface {
  private:
   friend class BootImgFilesystemTest;
 
+  // A part of the image exposed as a file.
+  struct Section {
+    std::string name;
+    uint64_t offset;
+    uint64_t size;
+  };
+
   BootImgFilesystem() = default;
 
+  // Parse the header of a boot.img or a vendor_boot.img file into the
+  // |sections| it holds.
+  static bool ReadBootImgSections(const std::string& filename,
+                                  std::vector<Section>* sections);
+  static bool ReadVendorBootImgSections(const std::string& filename,
+                                        std::vector<Section>* sections);
+
   File GetFile(const std::string& name, uint64_t offset, uint64_t size) const;
 
   // The boot.img file path.
   std::string filename_;
 
-  uint32_t kernel_size_ = 0;    /* size in bytes */
-  uint32_t ramdisk_size_ = 0;   /* size in bytes */
-  uint32_t signature_size_ = 0; /* size in bytes */
-  uint32_t page_size_ = 4096;   /* flash page size we assume */
+  // The parts of the image, in order. Empty ones and those past the end of
+  // the file aren't returned by GetFiles().
+  std::vector<Section> sections_;
 
   DISALLOW_COPY_AND_ASSIGN(BootImgFilesystem);
 };
@@ -16,6 +16,7 @@
 
 #include "update_engine/payload_generator/boot_img_filesystem.h"
 
+#include <string>
 #include <vector>
 
 #include <bootimg.h>
@@ -27,6 +28,7 @@
 
 namespace chromeos_update_engine {
 
+using std::string;
 using std::unique_ptr;
 using std::vector;
 
@@ -63,6 +65,46 @@ class BootImgFilesystemTest : public ::testing::Test {
     return boot_img;
   }
 
+  // A version 4 vendor_boot.img with a fragment for each of |ramdisks|, named
+  // after |names|, and a dtb.
+  brillo::Blob GetVendorBootImg(const vector<brillo::Blob>& ramdisks,
+                                const vector<string>& names,
+                                const brillo::Blob& dtb) {
+    brillo::Blob vendor_boot_img(32 * 1024);
+    constexpr uint32_t page_size = 4096;
+
+    vendor_boot_img_hdr_v4 hdr{};
+    memcpy(hdr.magic, VENDOR_BOOT_MAGIC, VENDOR_BOOT_MAGIC_SIZE);
+    hdr.header_version = 4;
+    hdr.page_size = page_size;
+    hdr.header_size = sizeof(hdr);
+    hdr.dtb_size = dtb.size();
+    hdr.vendor_ramdisk_table_entry_num = ramdisks.size();
+    hdr.vendor_ramdisk_table_entry_size = sizeof(vendor_ramdisk_table_entry_v4);
+    hdr.vendor_ramdisk_table_size =
+        ramdisks.size() * sizeof(vendor_ramdisk_table_entry_v4);
+
+    size_t offset = utils::RoundUp(sizeof(hdr), page_size);
+    vector<vendor_ramdisk_table_entry_v4> table(ramdisks.size());
+    for (size_t i = 0; i < ramdisks.size(); i++) {
+      table[i].ramdisk_size = ramdisks[i].size();
+      table[i].ramdisk_offset = hdr.vendor_ramdisk_size;
+      memcpy(table[i].ramdisk_name, names[i].data(), names[i].size());
+      memcpy(vendor_boot_img.data() + offset + hdr.vendor_ramdisk_size,
+             ramdisks[i].data(),
+             ramdisks[i].size());
+      hdr.vendor_ramdisk_size += ramdisks[i].size();
+    }
+    offset += utils::RoundUp(hdr.vendor_ramdisk_size, page_size);
+    memcpy(vendor_boot_img.data() + offset, dtb.data(), dtb.size());
+    offset += utils::RoundUp(dtb.size(), page_size);
+    memcpy(vendor_boot_img.data() + offset,
+           table.data(),
+           hdr.vendor_ramdisk_table_size);
+    memcpy(vendor_boot_img.data(), &hdr, sizeof(hdr));
+    return vendor_boot_img;
+  }
+
   ScopedTempFile boot_file_;
 };
 
@@ -116,6 +158,38 @@ TEST_F(BootImgFilesystemTest, ImageHeaderVersion3) {
   EXPECT_TRUE(files[1].deflates.empty());
 }
 
+TEST_F(BootImgFilesystemTest, VendorBootFragmentsTest) {
+  test_utils::WriteFileVector(
+      boot_file_.path(),
+      GetVendorBootImg({brillo::Blob(5000, 'a'), brillo::Blob(3000, 'b')},
+                       {"first", ""},
+                       brillo::Blob(100, 'd')));
+  unique_ptr<BootImgFilesystem> fs =
+      BootImgFilesystem::CreateFromFile(boot_file_.path());
+  ASSERT_NE(nullptr, fs);
+
+  vector<FilesystemInterface::File> files;
+  EXPECT_TRUE(fs->GetFiles(&files));
+  ASSERT_EQ(3u, files.size());
+
+  // The fragments start right after the header page.
+  EXPECT_EQ("<vendor ramdisk first>", files[0].name);
+  ASSERT_EQ(1u, files[0].extents.size());
+  EXPECT_EQ(1u, files[0].extents[0].start_block());
+  EXPECT_EQ(2u, files[0].extents[0].num_blocks());
+
+  // Unnamed fragments are named after their index.
+  EXPECT_EQ("<vendor ramdisk 1>", files[1].name);
+  ASSERT_EQ(1u, files[1].extents.size());
+  EXPECT_EQ(2u, files[1].extents[0].start_block());
+  EXPECT_EQ(1u, files[1].extents[0].num_blocks());
+
+  EXPECT_EQ("<dtb>", files[2].name);
+  ASSERT_EQ(1u, files[2].extents.size());
+  EXPECT_EQ(3u, files[2].extents[0].start_block());
+  EXPECT_EQ(1u, files[2].extents[0].num_blocks());
+}
+
 TEST_F(BootImgFilesystemTest, BadImageTest) {
   brillo::Blob boot_img = GetBootImg({}, {});
   boot_img[7] = '?';
@@ -26,7 +26,7 @@
 
 namespace chromeos_update_engine {
 
-bool BzipCompress(const brillo::Blob& in, brillo::Blob* out) {
+bool BzipCompress(std::string_view in, brillo::Blob* out) {
   TEST_AND_RETURN_FALSE(out);
   out->clear();
   if (in.size() == 0)
@@ -45,7 +45,7 @@ bool BzipCompress(const brillo::Blob& in, brillo::Blob* out) {
     int rc = BZ2_bzBuffToBuffCompress(
         reinterpret_cast<char*>(out->data()),
         &data_size,
-        reinterpret_cast<char*>(const_cast<uint8_t*>(in.data())),
+        const_cast<char*>(in.data()),
         in.size(),
         9,   // Best compression
         0,   // Silent verbosity
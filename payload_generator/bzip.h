@@ -17,12 +17,20 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BZIP_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_BZIP_H_
 
+#include <string_view>
+
 #include <brillo/secure_blob.h>
 
+#include "update_engine/common/utils.h"
+
 namespace chromeos_update_engine {
 
 // Compresses the input buffer |in| into |out| with bzip2.
-bool BzipCompress(const brillo::Blob& in, brillo::Blob* out);
+bool BzipCompress(std::string_view in, brillo::Blob* out);
+
+inline bool BzipCompress(const brillo::Blob& in, brillo::Blob* out) {
+  return BzipCompress(ToStringView(in), out);
+}
 
 }  // namespace chromeos_update_engine
 
@@ -17,7 +17,9 @@
 #include "update_engine/payload_generator/cow_size_estimator.h"
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
@@ -27,6 +29,7 @@
 
 #include "update_engine/common/cow_operation_convert.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 #include "update_engine/payload_consumer/vabc_partition_writer.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
@@ -35,6 +38,131 @@
 namespace chromeos_update_engine {
 using android::snapshot::CowWriter;
 
+namespace {
+// Raw blocks are handed out to the estimation threads in chunks of at most
+// this many blocks, so one large unvisited extent doesn't end up on a single
+// thread.
+constexpr uint64_t kRawBlocksPerTask = 256;
+
+// A piece of the dry run which needs reading and compressing data: either a
+// COW_XOR merge operation or a chunk of blocks written as raw data.
+struct DryRunTask {
+  const CowMergeOperation* xor_op;
+  Extent raw_extent;
+};
+
+// Everything one estimation thread wrote. The dry run writers discard the data
+// and only count its size, so the sizes of the shards add up, apart from the
+// header and footer every writer has.
+struct DryRunShard {
+  std::unique_ptr<CowWriter> cow_writer;
+  // Receives the raw blocks sampled for compressibility, if sampling.
+  std::unique_ptr<CowWriter> sample_writer;
+  uint64_t sampled_blocks{0};
+};
+
+std::unique_ptr<CowWriter> CreateDryRunWriter(size_t block_size,
+                                              const std::string& compression) {
+  auto cow_writer = std::make_unique<CowWriter>(android::snapshot::CowOptions{
+      .block_size = static_cast<uint32_t>(block_size),
+      .compression = compression});
+  // CowWriter treats -1 as special value, will discard all the data but still
+  // reports Cow size. Good for estimation purposes
+  cow_writer->Initialize(android::base::borrowed_fd{-1});
+  return cow_writer;
+}
+
+bool AddXorOperation(FileDescriptorPtr source_fd,
+                     FileDescriptorPtr target_fd,
+                     const CowMergeOperation& op,
+                     size_t block_size,
+                     CowWriter* cow_writer) {
+  CHECK_NE(source_fd, nullptr) << "Source fd is required to enable XOR ops";
+  CHECK(source_fd->IsOpen());
+  // dst block count is used, because
+  // src block count is probably(if src_offset > 0) 1 block
+  // larger than dst extent. Using it might lead to intreseting out of bound
+  // disk reads.
+  std::vector<unsigned char> old_data(op.dst_extent().num_blocks() *
+                                      block_size);
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(
+          source_fd,
+          old_data.data(),
+          old_data.size(),
+          op.src_extent().start_block() * block_size + op.src_offset(),
+          &bytes_read)) {
+    PLOG(ERROR) << "Failed to read source data at " << op.src_extent();
+    return false;
+  }
+  std::vector<unsigned char> new_data(op.dst_extent().num_blocks() *
+                                      block_size);
+  if (!utils::PReadAll(target_fd,
+                       new_data.data(),
+                       new_data.size(),
+                       op.dst_extent().start_block() * block_size,
+                       &bytes_read)) {
+    PLOG(ERROR) << "Failed to read target data at " << op.dst_extent();
+    return false;
+  }
+  CHECK_GT(old_data.size(), 0UL);
+  CHECK_GT(new_data.size(), 0UL);
+  std::transform(new_data.begin(),
+                 new_data.end(),
+                 old_data.begin(),
+                 new_data.begin(),
+                 std::bit_xor<unsigned char>{});
+  CHECK(cow_writer->AddXorBlocks(op.dst_extent().start_block(),
+                                 new_data.data(),
+                                 new_data.size(),
+                                 op.src_extent().start_block(),
+                                 op.src_offset()));
+  return true;
+}
+
+bool AddRawExtent(FileDescriptorPtr target_fd,
+                  const Extent& ext,
+                  size_t block_size,
+                  CowWriter* cow_writer) {
+  std::vector<unsigned char> data(ext.num_blocks() * block_size);
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(target_fd,
+                       data.data(),
+                       data.size(),
+                       ext.start_block() * block_size,
+                       &bytes_read)) {
+    PLOG(ERROR) << "Failed to read new block data at " << ext;
+    return false;
+  }
+  return cow_writer->AddRawBlocks(ext.start_block(), data.data(), data.size());
+}
+
+// Returns the blocks of the partition not written by a COW_COPY, COW_XOR or
+// ZERO operation, which are written to the COW as raw data.
+std::vector<Extent> GetRawExtents(
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    const google::protobuf::RepeatedPtrField<CowMergeOperation>&
+        merge_operations,
+    size_t block_size,
+    size_t partition_size,
+    bool xor_enabled) {
+  ExtentRanges visited;
+  for (const auto& op : merge_operations) {
+    if (op.type() == CowMergeOperation::COW_COPY ||
+        (op.type() == CowMergeOperation::COW_XOR && xor_enabled)) {
+      visited.AddExtent(op.dst_extent());
+    }
+  }
+  for (const auto& op : operations) {
+    if (op.type() == InstallOperation::ZERO) {
+      visited.AddRepeatedExtents(op.dst_extents());
+    }
+  }
+  const size_t last_block = partition_size / block_size;
+  return FilterExtentRanges({ExtentForRange(0, last_block)}, visited);
+}
+}  // namespace
+
 bool CowDryRun(
     FileDescriptorPtr source_fd,
     FileDescriptorPtr target_fd,
@@ -48,56 +176,15 @@ bool CowDryRun(
   CHECK_NE(target_fd, nullptr);
   CHECK(target_fd->IsOpen());
   VABCPartitionWriter::WriteMergeSequence(merge_operations, cow_writer);
-  ExtentRanges visited;
   for (const auto& op : merge_operations) {
     if (op.type() == CowMergeOperation::COW_COPY) {
-      visited.AddExtent(op.dst_extent());
       for (size_t i = 0; i < op.dst_extent().num_blocks(); i++) {
         cow_writer->AddCopy(op.dst_extent().start_block() + i,
                             op.src_extent().start_block() + i);
       }
     } else if (op.type() == CowMergeOperation::COW_XOR && xor_enabled) {
-      CHECK_NE(source_fd, nullptr) << "Source fd is required to enable XOR ops";
-      CHECK(source_fd->IsOpen());
-      visited.AddExtent(op.dst_extent());
-      // dst block count is used, because
-      // src block count is probably(if src_offset > 0) 1 block
-      // larger than dst extent. Using it might lead to intreseting out of bound
-      // disk reads.
-      std::vector<unsigned char> old_data(op.dst_extent().num_blocks() *
-                                          block_size);
-      ssize_t bytes_read = 0;
-      if (!utils::PReadAll(
-              source_fd,
-              old_data.data(),
-              old_data.size(),
-              op.src_extent().start_block() * block_size + op.src_offset(),
-              &bytes_read)) {
-        PLOG(ERROR) << "Failed to read source data at " << op.src_extent();
-        return false;
-      }
-      std::vector<unsigned char> new_data(op.dst_extent().num_blocks() *
-                                          block_size);
-      if (!utils::PReadAll(target_fd,
-                           new_data.data(),
-                           new_data.size(),
-                           op.dst_extent().start_block() * block_size,
-                           &bytes_read)) {
-        PLOG(ERROR) << "Failed to read target data at " << op.dst_extent();
-        return false;
-      }
-      CHECK_GT(old_data.size(), 0UL);
-      CHECK_GT(new_data.size(), 0UL);
-      std::transform(new_data.begin(),
-                     new_data.end(),
-                     old_data.begin(),
-                     new_data.begin(),
-                     std::bit_xor<unsigned char>{});
-      CHECK(cow_writer->AddXorBlocks(op.dst_extent().start_block(),
-                                     new_data.data(),
-                                     new_data.size(),
-                                     op.src_extent().start_block(),
-                                     op.src_offset()));
+      TEST_AND_RETURN_FALSE(
+          AddXorOperation(source_fd, target_fd, op, block_size, cow_writer));
     }
     // The value of label doesn't really matter, we just want to write some
     // labels to simulate bahvior of update_engine. As update_engine writes
@@ -108,27 +195,18 @@ bool CowDryRun(
   for (const auto& op : operations) {
     if (op.type() == InstallOperation::ZERO) {
       for (const auto& ext : op.dst_extents()) {
-        visited.AddExtent(ext);
         cow_writer->AddZeroBlocks(ext.start_block(), ext.num_blocks());
       }
       cow_writer->AddLabel(0);
     }
   }
-  const size_t last_block = partition_size / block_size;
-  const auto unvisited_extents =
-      FilterExtentRanges({ExtentForRange(0, last_block)}, visited);
-  for (const auto& ext : unvisited_extents) {
-    std::vector<unsigned char> data(ext.num_blocks() * block_size);
-    ssize_t bytes_read = 0;
-    if (!utils::PReadAll(target_fd,
-                         data.data(),
-                         data.size(),
-                         ext.start_block() * block_size,
-                         &bytes_read)) {
-      PLOG(ERROR) << "Failed to read new block data at " << ext;
-      return false;
-    }
-    cow_writer->AddRawBlocks(ext.start_block(), data.data(), data.size());
+  for (const auto& ext : GetRawExtents(operations,
+                                       merge_operations,
+                                       block_size,
+                                       partition_size,
+                                       xor_enabled)) {
+    TEST_AND_RETURN_FALSE(
+        AddRawExtent(target_fd, ext, block_size, cow_writer));
     cow_writer->AddLabel(0);
   }
 
@@ -144,22 +222,134 @@ size_t EstimateCowSize(
     const size_t block_size,
     std::string compression,
     const size_t partition_size,
-    const bool xor_enabled) {
-  android::snapshot::CowWriter cow_writer{
-      {.block_size = static_cast<uint32_t>(block_size),
-       .compression = std::move(compression)}};
-  // CowWriter treats -1 as special value, will discard all the data but still
-  // reports Cow size. Good for estimation purposes
-  cow_writer.Initialize(android::base::borrowed_fd{-1});
-  CHECK(CowDryRun(source_fd,
-                  target_fd,
-                  operations,
-                  merge_operations,
-                  block_size,
-                  &cow_writer,
-                  partition_size,
-                  xor_enabled));
-  return cow_writer.GetCowSize();
+    const bool xor_enabled,
+    const size_t num_threads,
+    const size_t raw_block_sample_interval) {
+  if (num_threads <= 1 && raw_block_sample_interval <= 1) {
+    auto cow_writer = CreateDryRunWriter(block_size, compression);
+    CHECK(CowDryRun(source_fd,
+                    target_fd,
+                    operations,
+                    merge_operations,
+                    block_size,
+                    cow_writer.get(),
+                    partition_size,
+                    xor_enabled));
+    return cow_writer->GetCowSize();
+  }
+  CHECK_NE(target_fd, nullptr);
+  CHECK(target_fd->IsOpen());
+
+  // The cheap parts of the dry run, which only write COW operations, are done
+  // here in the same order as CowDryRun(). Reading and compressing data is
+  // split in tasks for the threads.
+  auto cow_writer = CreateDryRunWriter(block_size, compression);
+  std::vector<DryRunTask> tasks;
+  VABCPartitionWriter::WriteMergeSequence(merge_operations, cow_writer.get());
+  for (const auto& op : merge_operations) {
+    if (op.type() == CowMergeOperation::COW_COPY) {
+      for (size_t i = 0; i < op.dst_extent().num_blocks(); i++) {
+        cow_writer->AddCopy(op.dst_extent().start_block() + i,
+                            op.src_extent().start_block() + i);
+      }
+    } else if (op.type() == CowMergeOperation::COW_XOR && xor_enabled) {
+      tasks.push_back({&op, {}});
+    }
+    cow_writer->AddLabel(0);
+  }
+  for (const auto& op : operations) {
+    if (op.type() == InstallOperation::ZERO) {
+      for (const auto& ext : op.dst_extents()) {
+        cow_writer->AddZeroBlocks(ext.start_block(), ext.num_blocks());
+      }
+      cow_writer->AddLabel(0);
+    }
+  }
+  uint64_t raw_blocks = 0;
+  for (const auto& ext : GetRawExtents(operations,
+                                       merge_operations,
+                                       block_size,
+                                       partition_size,
+                                       xor_enabled)) {
+    for (uint64_t offset = 0; offset < ext.num_blocks();
+         offset += kRawBlocksPerTask) {
+      tasks.push_back(
+          {nullptr,
+           ExtentForRange(
+               ext.start_block() + offset,
+               std::min(kRawBlocksPerTask, ext.num_blocks() - offset))});
+    }
+    raw_blocks += ext.num_blocks();
+    cow_writer->AddLabel(0);
+  }
+
+  const size_t num_shards = std::max<size_t>(num_threads, 1);
+  std::vector<DryRunShard> shards(num_shards);
+  std::atomic<size_t> next_task{0};
+  {
+    WorkerPool pool(num_shards, num_shards);
+    for (auto& shard : shards) {
+      shard.cow_writer = CreateDryRunWriter(block_size, compression);
+      shard.sample_writer = CreateDryRunWriter(block_size, compression);
+      const bool posted = pool.Post([&, shard = &shard]() {
+        for (size_t i = next_task++; i < tasks.size(); i = next_task++) {
+          const DryRunTask& task = tasks[i];
+          if (task.xor_op) {
+            TEST_AND_RETURN_FALSE(AddXorOperation(source_fd,
+                                                  target_fd,
+                                                  *task.xor_op,
+                                                  block_size,
+                                                  shard->cow_writer.get()));
+            continue;
+          }
+          if (raw_block_sample_interval <= 1) {
+            TEST_AND_RETURN_FALSE(AddRawExtent(target_fd,
+                                               task.raw_extent,
+                                               block_size,
+                                               shard->cow_writer.get()));
+            continue;
+          }
+          // Only compress the first block of every
+          // |raw_block_sample_interval| ones; the size of the rest is
+          // extrapolated from those.
+          for (uint64_t block = 0; block < task.raw_extent.num_blocks();
+               block += raw_block_sample_interval) {
+            TEST_AND_RETURN_FALSE(AddRawExtent(
+                target_fd,
+                ExtentForRange(task.raw_extent.start_block() + block, 1),
+                block_size,
+                shard->sample_writer.get()));
+            shard->sampled_blocks++;
+          }
+        }
+        return true;
+      });
+      if (!posted) {
+        break;
+      }
+    }
+    CHECK(pool.Wait()) << "Failed to estimate the COW size";
+  }
+
+  // Every writer has its own header and footer, only one of them is counted.
+  auto empty_writer = CreateDryRunWriter(block_size, compression);
+  CHECK(empty_writer->Finalize());
+  const uint64_t overhead = empty_writer->GetCowSize();
+  CHECK(cow_writer->Finalize());
+  uint64_t cow_size = cow_writer->GetCowSize();
+  uint64_t sampled_size = 0;
+  uint64_t sampled_blocks = 0;
+  for (auto& shard : shards) {
+    CHECK(shard.cow_writer->Finalize());
+    CHECK(shard.sample_writer->Finalize());
+    cow_size += shard.cow_writer->GetCowSize() - overhead;
+    sampled_size += shard.sample_writer->GetCowSize() - overhead;
+    sampled_blocks += shard.sampled_blocks;
+  }
+  if (sampled_blocks > 0) {
+    cow_size += sampled_size * raw_blocks / sampled_blocks;
+  }
+  return cow_size;
 }
 
 }  // namespace chromeos_update_engine
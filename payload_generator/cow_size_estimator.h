@@ -28,6 +28,10 @@ namespace chromeos_update_engine {
 // generators to put an estimate cow size in OTA payload. When installing an OTA
 // update, libsnapshot will take this estimate as a hint to allocate spaces.
 // If |xor_enabled| is true, then |source_fd| must be non-null.
+// The data is read and compressed on |num_threads| threads. With a
+// |raw_block_sample_interval| larger than one, only one in that many of the
+// blocks written as raw data is compressed and the size of the others is
+// extrapolated from them, which is faster but less exact.
 size_t EstimateCowSize(
     FileDescriptorPtr source_fd,
     FileDescriptorPtr target_fd,
@@ -37,7 +41,9 @@ size_t EstimateCowSize(
     const size_t block_size,
     std::string compression,
     const size_t partition_size,
-    bool xor_enabled);
+    bool xor_enabled,
+    size_t num_threads = 1,
+    size_t raw_block_sample_interval = 1);
 
 // Convert InstallOps to CowOps and apply the converted cow op to |cow_writer|
 bool CowDryRun(
@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/cow_size_estimator.h"
+
+#include <fcntl.h>
+
+#include <memory>
+#include <random>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kNumBlocks = 1024;
+}  // namespace
+
+class CowSizeEstimatorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Every block is half random bytes and half zeros, so they all compress
+    // about as well.
+    brillo::Blob data(kNumBlocks * kBlockSize);
+    std::mt19937 rng(0);
+    for (size_t i = 0; i < data.size(); i++) {
+      data[i] = (i % kBlockSize) < kBlockSize / 2 ? rng() : 0;
+    }
+    ASSERT_TRUE(
+        utils::WriteFile(file_.path().c_str(), data.data(), data.size()));
+    target_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+    ASSERT_TRUE(target_fd_->Open(file_.path().c_str(), O_RDONLY));
+
+    auto* zero = operations_.Add();
+    zero->set_type(InstallOperation::ZERO);
+    *zero->add_dst_extents() = ExtentForRange(10, 20);
+    auto* copy = merge_operations_.Add();
+    copy->set_type(CowMergeOperation::COW_COPY);
+    *copy->mutable_src_extent() = ExtentForRange(100, 50);
+    *copy->mutable_dst_extent() = ExtentForRange(200, 50);
+  }
+
+  size_t Estimate(size_t num_threads, size_t sample_interval) {
+    return EstimateCowSize(nullptr,
+                           target_fd_,
+                           operations_,
+                           merge_operations_,
+                           kBlockSize,
+                           "gz",
+                           kNumBlocks * kBlockSize,
+                           false,
+                           num_threads,
+                           sample_interval);
+  }
+
+  ScopedTempFile file_{"cow_size_estimator.XXXXXX"};
+  FileDescriptorPtr target_fd_;
+  google::protobuf::RepeatedPtrField<InstallOperation> operations_;
+  google::protobuf::RepeatedPtrField<CowMergeOperation> merge_operations_;
+};
+
+TEST_F(CowSizeEstimatorTest, ThreadsMatchSingleThreadTest) {
+  const size_t expected = Estimate(1, 1);
+  ASSERT_GT(expected, kNumBlocks * kBlockSize / 4);
+  // Only the COW cluster boundaries can differ between the shards.
+  ASSERT_NEAR(expected, Estimate(4, 1), expected / 100);
+}
+
+TEST_F(CowSizeEstimatorTest, SamplingExtrapolatesTest) {
+  const size_t expected = Estimate(1, 1);
+  ASSERT_NEAR(expected, Estimate(1, 8), expected / 20);
+  ASSERT_NEAR(expected, Estimate(4, 8), expected / 20);
+}
+
+}  // namespace chromeos_update_engine
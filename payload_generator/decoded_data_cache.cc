@@ -0,0 +1,114 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/decoded_data_cache.h"
+
+#include <inttypes.h>
+
+#include <utility>
+
+#include <base/strings/stringprintf.h>
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+DecodedDataCache* DecodedDataCache::Get() {
+  static DecodedDataCache* cache = new DecodedDataCache();
+  return cache;
+}
+
+void DecodedDataCache::set_capacity(uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = bytes;
+  ShrinkLocked(capacity_);
+}
+
+uint64_t DecodedDataCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_;
+}
+
+DecodedDataCache::Data DecodedDataCache::GetOrDecode(
+    const string& key, const std::function<brillo::Blob()>& decode) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (capacity_ == 0) {
+    lock.unlock();
+    return std::make_shared<const brillo::Blob>(decode());
+  }
+  auto entry = entries_.find(key);
+  if (entry != entries_.end()) {
+    lru_.splice(lru_.begin(), lru_, entry->second.lru);
+    return entry->second.data;
+  }
+  auto pending_it = pending_.find(key);
+  if (pending_it != pending_.end()) {
+    std::shared_ptr<Pending> pending = pending_it->second;
+    pending_done_.wait(lock, [&pending] { return pending->done; });
+    return pending->data;
+  }
+
+  auto pending = std::make_shared<Pending>();
+  pending_.emplace(key, pending);
+  lock.unlock();
+  Data data = std::make_shared<const brillo::Blob>(decode());
+  lock.lock();
+  pending->data = data;
+  pending->done = true;
+  pending_.erase(key);
+  if (!data->empty()) {
+    InsertLocked(key, data);
+  }
+  pending_done_.notify_all();
+  return data;
+}
+
+void DecodedDataCache::InsertLocked(const string& key, Data data) {
+  if (data->size() > capacity_) {
+    return;
+  }
+  ShrinkLocked(capacity_ - data->size());
+  size_ += data->size();
+  lru_.push_front(key);
+  entries_[key] = {std::move(data), lru_.begin()};
+}
+
+void DecodedDataCache::ShrinkLocked(uint64_t bytes) {
+  while (size_ > bytes) {
+    auto it = entries_.find(lru_.back());
+    size_ -= it->second.data->size();
+    entries_.erase(it);
+    lru_.pop_back();
+  }
+}
+
+string DecodedDataCache::Key(std::string_view kind,
+                             const string& path,
+                             const std::vector<Extent>& extents) {
+  string key(kind);
+  key.push_back('\0');
+  key += path;
+  key.push_back('\0');
+  for (const Extent& extent : extents) {
+    base::StringAppendF(&key,
+                        "%" PRIu64 ":%" PRIu64 ",",
+                        extent.start_block(),
+                        extent.num_blocks());
+  }
+  return key;
+}
+
+}  // namespace chromeos_update_engine
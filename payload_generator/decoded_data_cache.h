@@ -0,0 +1,103 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DECODED_DATA_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DECODED_DATA_CACHE_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Keeps the decoded forms of the files of the images, like the decompressed
+// and recompressed data of an LZ4 compressed file, which are expensive to
+// compute and needed again by every diff of the same file: a target file
+// diffed against the source images of several payloads, or a source file
+// matched by several target files. The entries are keyed by where the data
+// comes from, so looking them up doesn't read or hash the data, or for
+// results as slow as zucchini patches by a hash of the data. The least
+// recently used ones are dropped to stay within the capacity. Thread safe.
+class DecodedDataCache {
+ public:
+  using Data = std::shared_ptr<const brillo::Blob>;
+
+  DecodedDataCache() = default;
+
+  // The cache shared by the whole payload generation. Never destroyed.
+  static DecodedDataCache* Get();
+
+  // The most bytes kept, 0 disabling the cache.
+  void set_capacity(uint64_t bytes);
+  uint64_t size() const;
+
+  // Returns the data of |key|, computing it with |decode| if it isn't cached.
+  // Concurrent calls with the same key wait for the first one instead of
+  // decoding the data again. An empty result isn't kept.
+  Data GetOrDecode(const std::string& key,
+                   const std::function<brillo::Blob()>& decode);
+
+  // The key of the |kind| of decoded form of the data at |extents| of the
+  // image at |path|, e.g. "lz4-decompressed".
+  static std::string Key(std::string_view kind,
+                         const std::string& path,
+                         const std::vector<Extent>& extents);
+
+ private:
+  // A decoding in progress, which the other callers with its key wait for.
+  struct Pending {
+    bool done{false};
+    Data data;
+  };
+  struct Entry {
+    Data data;
+    std::list<std::string>::iterator lru;
+  };
+
+  // Adds |data| unless it doesn't fit at all, dropping the least recently
+  // used entries to make room.
+  void InsertLocked(const std::string& key, Data data);
+  // Drops the least recently used entries until they take at most |bytes|.
+  void ShrinkLocked(uint64_t bytes);
+
+  mutable std::mutex mutex_;
+  std::condition_variable pending_done_;
+  uint64_t capacity_{0};
+  uint64_t size_{0};
+  std::map<std::string, Entry> entries_;
+  // The keys of |entries_|, the most recently used first.
+  std::list<std::string> lru_;
+  std::map<std::string, std::shared_ptr<Pending>> pending_;
+
+  DISALLOW_COPY_AND_ASSIGN(DecodedDataCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DECODED_DATA_CACHE_H_
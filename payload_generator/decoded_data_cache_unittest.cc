@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/decoded_data_cache.h"
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/extent_utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Decodes |size| bytes of |value|, counting the calls in |calls|.
+std::function<brillo::Blob()> Decoder(size_t size, uint8_t value, int* calls) {
+  return [size, value, calls] {
+    (*calls)++;
+    return brillo::Blob(size, value);
+  };
+}
+
+}  // namespace
+
+TEST(DecodedDataCacheTest, DisabledTest) {
+  DecodedDataCache cache;
+  int calls = 0;
+  const brillo::Blob a(10, 1);
+  EXPECT_EQ(a, *cache.GetOrDecode("a", Decoder(10, 1, &calls)));
+  EXPECT_EQ(a, *cache.GetOrDecode("a", Decoder(10, 1, &calls)));
+  EXPECT_EQ(2, calls);
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST(DecodedDataCacheTest, LeastRecentlyUsedTest) {
+  DecodedDataCache cache;
+  cache.set_capacity(25);
+  int calls = 0;
+  cache.GetOrDecode("a", Decoder(10, 1, &calls));
+  cache.GetOrDecode("b", Decoder(10, 2, &calls));
+  EXPECT_EQ(2, calls);
+  // "a" becomes the most recently used, so "b" is dropped for "c".
+  EXPECT_EQ(brillo::Blob(10, 1),
+            *cache.GetOrDecode("a", Decoder(10, 1, &calls)));
+  EXPECT_EQ(2, calls);
+  cache.GetOrDecode("c", Decoder(10, 3, &calls));
+  EXPECT_EQ(20u, cache.size());
+  cache.GetOrDecode("a", Decoder(10, 1, &calls));
+  EXPECT_EQ(3, calls);
+  cache.GetOrDecode("b", Decoder(10, 2, &calls));
+  EXPECT_EQ(4, calls);
+
+  // Too large and empty data isn't kept.
+  cache.GetOrDecode("d", Decoder(30, 4, &calls));
+  cache.GetOrDecode("d", Decoder(30, 4, &calls));
+  cache.GetOrDecode("e", Decoder(0, 0, &calls));
+  cache.GetOrDecode("e", Decoder(0, 0, &calls));
+  EXPECT_EQ(8, calls);
+
+  cache.set_capacity(10);
+  EXPECT_EQ(10u, cache.size());
+}
+
+TEST(DecodedDataCacheTest, ConcurrentDecodeTest) {
+  DecodedDataCache cache;
+  cache.set_capacity(1000);
+  int calls = 0;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([&cache, &calls] {
+      EXPECT_EQ(brillo::Blob(100, 7),
+                *cache.GetOrDecode("a", Decoder(100, 7, &calls)));
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  EXPECT_EQ(1, calls);
+}
+
+TEST(DecodedDataCacheTest, KeyTest) {
+  const std::vector<Extent> extents = {ExtentForRange(1, 2),
+                                       ExtentForRange(5, 1)};
+  const auto key = DecodedDataCache::Key("lz4-decompressed", "/a", extents);
+  EXPECT_EQ(key, DecodedDataCache::Key("lz4-decompressed", "/a", extents));
+  EXPECT_NE(key, DecodedDataCache::Key("lz4-recompressed", "/a", extents));
+  EXPECT_NE(key, DecodedDataCache::Key("lz4-decompressed", "/b", extents));
+  EXPECT_NE(key,
+            DecodedDataCache::Key(
+                "lz4-decompressed", "/a", {ExtentForRange(1, 3)}));
+}
+
+}  // namespace chromeos_update_engine
@@ -16,19 +16,30 @@
 
 #include "update_engine/payload_generator/deflate_utils.h"
 
+#include <string.h>
+
 #include <algorithm>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 
 #include <base/files/file_util.h>
 #include <base/logging.h>
 #include <base/strings/string_util.h>
+#include <ziparchive/zip_archive.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
+#include "update_engine/payload_generator/erofs_filesystem.h"
+#include "update_engine/payload_generator/ext2_filesystem.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/generation_report.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/update_metadata.pb.h"
 
 using puffin::BitExtent;
@@ -43,6 +54,16 @@ namespace {
 // The minimum size for a squashfs image to be processed.
 const uint64_t kMinimumSquashfsImageSize = 1 * 1024 * 1024;  // bytes
 
+// The entry of an APEX holding its filesystem image.
+constexpr char kApexPayloadEntry[] = "apex_payload.img";
+// Where the ext4 and erofs superblocks start, both right after 1 KiB, and
+// their magic numbers.
+constexpr size_t kSuperblockOffset = 1024;
+constexpr size_t kExtMagicOffset = kSuperblockOffset + 56;
+constexpr uint16_t kExtMagic = 0xEF53;
+constexpr size_t kErofsMagicOffset = kSuperblockOffset;
+constexpr uint32_t kErofsMagic = 0xE0F5E1E2;
+
 // TODO(*): Optimize this so we don't have to read all extents into memory in
 // case it is large.
 bool CopyExtentsToFile(const string& in_path,
@@ -105,6 +126,103 @@ bool RealignSplittedFiles(const FilesystemInterface::File& file,
   return true;
 }
 
+// Opens the ext4 or erofs image |path|, as told by the start of its |data|.
+std::unique_ptr<FilesystemInterface> OpenFilesystemImage(
+    const string& path, const uint8_t* data, size_t size) {
+  uint16_t ext_magic = 0;
+  uint32_t erofs_magic = 0;
+  if (size >= kExtMagicOffset + sizeof(ext_magic)) {
+    memcpy(&ext_magic, data + kExtMagicOffset, sizeof(ext_magic));
+    memcpy(&erofs_magic, data + kErofsMagicOffset, sizeof(erofs_magic));
+  }
+  if (erofs_magic == kErofsMagic)
+    return ErofsFilesystem::CreateFromFile(path);
+  if (ext_magic == kExtMagic)
+    return Ext2Filesystem::CreateFromFile(path);
+  return nullptr;
+}
+
+// Splits the APEX |file| of the partition |part_path| into the files of the
+// filesystem image it holds and a pseudo-file with the rest of the APEX, so
+// the files inside are diffed individually like those of the partition.
+// Returns false if |file| can't be split, in which case it is diffed as a
+// whole.
+bool SplitApexFile(const string& part_path,
+                   const FilesystemInterface::File& file,
+                   vector<FilesystemInterface::File>* files) {
+  const uint64_t apex_blocks = utils::BlocksInExtents(file.extents);
+  brillo::Blob data;
+  TEST_AND_RETURN_FALSE(utils::ReadExtents(
+      part_path, file.extents, &data, apex_blocks * kBlockSize, kBlockSize));
+  if (file.file_stat.st_size > 0 &&
+      static_cast<size_t>(file.file_stat.st_size) < data.size()) {
+    data.resize(file.file_stat.st_size);
+  }
+  uint64_t offset = 0, size = 0;
+  TEST_AND_RETURN_FALSE(LocateApexPayload(data, &offset, &size));
+  // The blocks of the image have to be blocks of the APEX too.
+  if (offset % kBlockSize != 0) {
+    LOG(WARNING) << "The payload of " << file.name << " isn't block aligned.";
+    return false;
+  }
+  base::FilePath path;
+  TEST_AND_RETURN_FALSE(base::CreateTemporaryFile(&path));
+  ScopedPathUnlinker unlinker(path.value());
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile(path.value().c_str(), data.data() + offset, size));
+  std::unique_ptr<FilesystemInterface> fs =
+      OpenFilesystemImage(path.value(), data.data() + offset, size);
+  brillo::Blob().swap(data);
+  if (!fs) {
+    LOG(WARNING) << "The payload of " << file.name
+                 << " isn't an ext4 or erofs image.";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(fs->GetBlockSize() == kBlockSize);
+  const uint64_t payload_start_block = offset / kBlockSize;
+  const uint64_t payload_blocks = fs->GetBlockCount();
+  TEST_AND_RETURN_FALSE(payload_start_block + payload_blocks <= apex_blocks);
+
+  vector<FilesystemInterface::File> inner_files;
+  TEST_AND_RETURN_FALSE(fs->GetFiles(&inner_files));
+  // Each block goes to the first file listing it, as the split files have to
+  // cover the APEX exactly once.
+  ExtentRanges used;
+  files->clear();
+  for (auto& inner_file : inner_files) {
+    vector<Extent> extents;
+    for (const Extent& extent : inner_file.extents) {
+      if (extent.start_block() == kSparseHole)
+        continue;
+      TEST_AND_RETURN_FALSE(extent.start_block() + extent.num_blocks() <=
+                            payload_blocks);
+      extents.push_back(ExtentForRange(
+          payload_start_block + extent.start_block(), extent.num_blocks()));
+    }
+    extents = FilterExtentRanges(extents, used);
+    if (extents.empty())
+      continue;
+    used.AddExtents(extents);
+    inner_file.extents = std::move(extents);
+    inner_file.deflates.clear();
+    inner_file.name.erase(0, inner_file.name.find_first_not_of('/'));
+    files->push_back(std::move(inner_file));
+  }
+  ExtentRanges rest;
+  rest.AddExtent(ExtentForRange(0, apex_blocks));
+  rest.SubtractRanges(used);
+  if (rest.blocks() > 0) {
+    FilesystemInterface::File container;
+    container.name = "<apex-container>";
+    container.extents = rest.GetExtentsForBlockCount(rest.blocks());
+    files->push_back(std::move(container));
+  }
+  TEST_AND_RETURN_FALSE(RealignSplittedFiles(file, files));
+  LOG(INFO) << "Split APEX " << file.name << " into " << files->size()
+            << " files.";
+  return true;
+}
+
 bool IsBitExtentInExtent(const Extent& extent, const BitExtent& bit_extent) {
   return (bit_extent.offset / 8) >= (extent.start_block() * kBlockSize) &&
          ((bit_extent.offset + bit_extent.length + 7) / 8) <=
@@ -297,15 +415,185 @@ bool DeflatePreprocessFileData(const std::string_view filename,
   return true;
 }
 
+bool LocateApexPayload(const brillo::Blob& apex,
+                       uint64_t* offset,
+                       uint64_t* size) {
+  ZipArchiveHandle handle;
+  int32_t error =
+      OpenArchiveFromMemory(apex.data(), apex.size(), "apex", &handle);
+  ZipEntry entry;
+  if (error == 0)
+    error = FindEntry(handle, kApexPayloadEntry, &entry);
+  // The handle has to be closed even if opening it failed.
+  CloseArchive(handle);
+  if (error != 0) {
+    LOG(WARNING) << "Failed to find " << kApexPayloadEntry << ": "
+                 << ErrorCodeString(error);
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(entry.method == kCompressStored);
+  TEST_AND_RETURN_FALSE(entry.offset >= 0 &&
+                        static_cast<uint64_t>(entry.offset) +
+                                entry.uncompressed_length <=
+                            apex.size());
+  *offset = entry.offset;
+  *size = entry.uncompressed_length;
+  return true;
+}
+
+namespace {
+
+// Bump when DeflatePreprocessFileData finds different deflates, to drop the
+// old cache entries.
+constexpr char kDeflateCacheKeyPrefix[] = "deflates-v1";
+
+// The cache key of the deflates of a file with |data|. Only the content and
+// the kind of archive matter, so a file that didn't change is found again in
+// another partition or in another build.
+brillo::Blob DeflateCacheKey(std::string_view filename,
+                             const brillo::Blob& data) {
+  HashCalculator hasher;
+  const bool is_zip = IsFileExtensions(
+      filename, {".apk", ".zip", ".jar", ".zvoice", ".apex", "capex"});
+  CHECK(hasher.Update(kDeflateCacheKeyPrefix, sizeof(kDeflateCacheKeyPrefix)));
+  CHECK(hasher.Update(&is_zip, sizeof(is_zip)));
+  CHECK(hasher.Update(data.data(), data.size()));
+  CHECK(hasher.Finalize());
+  return hasher.raw_hash();
+}
+
+// Deflates are stored in the diff cache as pairs of uint64_t offset and
+// length, under the PUFFDIFF type.
+brillo::Blob SerializeDeflates(const vector<BitExtent>& deflates) {
+  brillo::Blob out;
+  out.reserve(deflates.size() * 2 * sizeof(uint64_t));
+  for (const auto& deflate : deflates) {
+    for (const uint64_t value : {deflate.offset, deflate.length}) {
+      const auto bytes = reinterpret_cast<const uint8_t*>(&value);
+      out.insert(out.end(), bytes, bytes + sizeof(value));
+    }
+  }
+  return out;
+}
+
+bool ParseDeflates(const brillo::Blob& in, vector<BitExtent>* deflates) {
+  constexpr size_t kEntrySize = 2 * sizeof(uint64_t);
+  TEST_AND_RETURN_FALSE(in.size() % kEntrySize == 0);
+  deflates->clear();
+  deflates->reserve(in.size() / kEntrySize);
+  for (size_t pos = 0; pos < in.size(); pos += kEntrySize) {
+    uint64_t offset, length;
+    memcpy(&offset, in.data() + pos, sizeof(offset));
+    memcpy(&length, in.data() + pos + sizeof(offset), sizeof(length));
+    deflates->emplace_back(offset, length);
+  }
+  return true;
+}
+
+// Reads the zip or gzip |file| from the partition and sets its deflates,
+// looking them up in the cache at |cache_dir| first if it isn't empty.
+bool FindFileDeflates(const PartitionConfig& part,
+                      const string& cache_dir,
+                      FilesystemInterface::File* file) {
+  brillo::Blob data;
+  TEST_AND_RETURN_FALSE(
+      utils::ReadExtents(part.path,
+                         file->extents,
+                         &data,
+                         kBlockSize * utils::BlocksInExtents(file->extents),
+                         kBlockSize));
+  // |data| read from disk always has size multiple of kBlockSize. So it
+  // might contain trailing garbage data and confuse the gzip/zip
+  // processors. Trim them.
+  if (file->file_stat.st_size > 0 &&
+      static_cast<size_t>(file->file_stat.st_size) < data.size()) {
+    data.resize(file->file_stat.st_size);
+  }
+
+  vector<BitExtent> deflates;
+  bool cached = false;
+  brillo::Blob key;
+  if (!cache_dir.empty()) {
+    key = DeflateCacheKey(file->name, data);
+    InstallOperation::Type type;
+    brillo::Blob entry;
+    cached = DiffCache(cache_dir).Get(key, &type, &entry) &&
+             type == InstallOperation::PUFFDIFF &&
+             ParseDeflates(entry, &deflates);
+  }
+  if (!cached) {
+    TEST_AND_RETURN_FALSE(
+        DeflatePreprocessFileData(file->name, data, &deflates));
+    if (!cache_dir.empty()) {
+      DiffCache(cache_dir).Put(
+          key, InstallOperation::PUFFDIFF, SerializeDeflates(deflates));
+    }
+  }
+  // Shift the deflate's extent to the offset starting from the beginning
+  // of the current partition; and the delta processor will align the
+  // extents in a continuous buffer later.
+  TEST_AND_RETURN_FALSE(ShiftBitExtentsOverExtents(file->extents, &deflates));
+  file->deflates = std::move(deflates);
+  return true;
+}
+
+}  // namespace
+
 bool PreprocessPartitionFiles(const PartitionConfig& part,
                               vector<FilesystemInterface::File>* result_files,
-                              bool extract_deflates) {
+                              bool extract_deflates,
+                              const string& cache_dir) {
   // Get the file system files.
   vector<FilesystemInterface::File> tmp_files;
-  part.fs_interface->GetFiles(&tmp_files);
+  {
+    GenerationReport::ScopedStage stage("filesystem_walk");
+    part.fs_interface->GetFiles(&tmp_files);
+  }
+  GenerationReport::ScopedStage stage("deflate_preprocessing");
   result_files->reserve(tmp_files.size());
 
-  for (auto& file : tmp_files) {
+  // The APEX files are opened in parallel, the largest first, to be replaced
+  // with the files inside them.
+  vector<vector<FilesystemInterface::File>> apex_files(tmp_files.size());
+  TaskGroup apex_group;
+  for (size_t i = 0; i < tmp_files.size(); i++) {
+    const FilesystemInterface::File* file = &tmp_files[i];
+    if (!IsRegularFile(*file) || !IsFileExtensions(file->name, {".apex"}))
+      continue;
+    apex_group.Post(
+        [&part, file, files = &apex_files[i]] {
+          if (!SplitApexFile(part.path, *file, files)) {
+            LOG(WARNING) << "Diffing APEX " << file->name << " as a whole.";
+            files->clear();
+          }
+        },
+        utils::BlocksInExtents(file->extents));
+  }
+  apex_group.Wait();
+
+  // Indexes in |result_files| of the zip and gzip files to search deflates in.
+  vector<size_t> deflate_files;
+  auto add_file = [&](const FilesystemInterface::File& file) {
+    if (IsRegularFile(file) && extract_deflates && !file.is_compressed) {
+      // Search for deflates if the file is in zip or gzip format.
+      // .zvoice files may eventually move out of rootfs. If that happens,
+      // remove ".zvoice" (crbug.com/782918).
+      bool is_zip = IsFileExtensions(
+          file.name, {".apk", ".zip", ".jar", ".zvoice", ".apex", "capex"});
+      bool is_gzip = IsFileExtensions(file.name, {".gz", ".gzip", ".tgz"});
+      if (is_zip || is_gzip) {
+        deflate_files.push_back(result_files->size());
+      }
+    }
+    result_files->push_back(file);
+  };
+  for (size_t i = 0; i < tmp_files.size(); i++) {
+    const FilesystemInterface::File& file = tmp_files[i];
+    if (!apex_files[i].empty()) {
+      for (const auto& inner_file : apex_files[i])
+        add_file(inner_file);
+      continue;
+    }
     auto is_regular_file = IsRegularFile(file);
 
     if (is_regular_file && IsSquashfsImage(part.path, file)) {
@@ -339,47 +627,53 @@ bool PreprocessPartitionFiles(const PartitionConfig& part,
       }
     }
 
-    if (is_regular_file && extract_deflates && !file.is_compressed) {
-      // Search for deflates if the file is in zip or gzip format.
-      // .zvoice files may eventually move out of rootfs. If that happens,
-      // remove ".zvoice" (crbug.com/782918).
-      bool is_zip = IsFileExtensions(
-          file.name, {".apk", ".zip", ".jar", ".zvoice", ".apex", "capex"});
-      bool is_gzip = IsFileExtensions(file.name, {".gz", ".gzip", ".tgz"});
-      if (is_zip || is_gzip) {
-        brillo::Blob data;
-        TEST_AND_RETURN_FALSE(utils::ReadExtents(
-            part.path,
-            file.extents,
-            &data,
-            kBlockSize * utils::BlocksInExtents(file.extents),
-            kBlockSize));
-        // |data| read from disk always has size multiple of kBlockSize. So it
-        // might contain trailing garbage data and confuse the gzip/zip
-        // processors. Trim them.
-        if (file.file_stat.st_size > 0 &&
-            static_cast<size_t>(file.file_stat.st_size) < data.size()) {
-          data.resize(file.file_stat.st_size);
-        }
-        vector<puffin::BitExtent> deflates;
-        if (!DeflatePreprocessFileData(file.name, data, &deflates)) {
-          LOG(ERROR) << "Failed to preprocess deflate data in partition "
-                     << part.name;
-          return false;
-        }
-        // Shift the deflate's extent to the offset starting from the beginning
-        // of the current partition; and the delta processor will align the
-        // extents in a continuous buffer later.
-        TEST_AND_RETURN_FALSE(
-            ShiftBitExtentsOverExtents(file.extents, &deflates));
-        file.deflates = std::move(deflates);
-      }
-    }
+    add_file(file);
+  }
 
-    result_files->push_back(file);
+  // Reading and parsing the archives is independent for each file, so it runs
+  // on the shared generator threads, the largest files first.
+  vector<uint8_t> succeeded(deflate_files.size(), false);
+  TaskGroup deflate_group;
+  for (size_t i = 0; i < deflate_files.size(); i++) {
+    FilesystemInterface::File* file = &(*result_files)[deflate_files[i]];
+    deflate_group.Post(
+        [&part, &cache_dir, file, result = &succeeded[i]] {
+          *result = FindFileDeflates(part, cache_dir, file);
+        },
+        utils::BlocksInExtents(file->extents));
+  }
+  deflate_group.Wait();
+  for (size_t i = 0; i < deflate_files.size(); i++) {
+    if (!succeeded[i]) {
+      LOG(ERROR) << "Failed to preprocess deflate data of "
+                 << (*result_files)[deflate_files[i]].name << " in partition "
+                 << part.name;
+      return false;
+    }
   }
   return true;
 }
 
+std::shared_ptr<const vector<FilesystemInterface::File>> GetPartitionFiles(
+    const PartitionConfig& part,
+    bool extract_deflates,
+    const string& cache_dir) {
+  auto preprocess = [&part, extract_deflates, &cache_dir] {
+    auto files = std::make_shared<vector<FilesystemInterface::File>>();
+    if (!PreprocessPartitionFiles(
+            part, files.get(), extract_deflates, cache_dir)) {
+      files.reset();
+    }
+    return files;
+  };
+  if (!part.files_cache)
+    return preprocess();
+  PartitionFilesCache::Entry& entry =
+      part.files_cache->entries[extract_deflates ? 1 : 0];
+  std::call_once(entry.once,
+                 [&entry, &preprocess] { entry.files = preprocess(); });
+  return entry.files;
+}
+
 }  // namespace deflate_utils
 }  // namespace chromeos_update_engine
@@ -17,6 +17,8 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DEFLATE_UTILS_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_DEFLATE_UTILS_H_
 
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -26,15 +28,40 @@
 #include "update_engine/payload_generator/payload_generation_config.h"
 
 namespace chromeos_update_engine {
+
+// The files of a partition preprocessed once by
+// deflate_utils::GetPartitionFiles() for all the payloads generated from it,
+// with and without the deflates extracted.
+struct PartitionFilesCache {
+  struct Entry {
+    std::once_flag once;
+    std::shared_ptr<const std::vector<FilesystemInterface::File>> files;
+  };
+  Entry entries[2];
+};
+
 namespace deflate_utils {
 
 // Gets the files from the partition and processes all its files. Processing
 // includes:
 //  - splitting large Squashfs containers into its smaller files.
+//  - splitting APEX files into the files of their ext4 or erofs image.
 //  - extracting deflates in zip and gzip files.
+// The APEX, zip and gzip files are processed in parallel on the TaskScheduler.
+// When |cache_dir| isn't empty the deflates are cached there by file content,
+// as DiffCache entries.
 bool PreprocessPartitionFiles(const PartitionConfig& part,
                               std::vector<FilesystemInterface::File>* result,
-                              bool extract_deflates);
+                              bool extract_deflates,
+                              const std::string& cache_dir = "");
+
+// Returns the files of |part| as PreprocessPartitionFiles() does, or null on
+// failure. When |part| has a |files_cache|, they are only preprocessed the
+// first time, which the concurrent callers wait for.
+std::shared_ptr<const std::vector<FilesystemInterface::File>>
+GetPartitionFiles(const PartitionConfig& part,
+                  bool extract_deflates,
+                  const std::string& cache_dir);
 
 // Spreads all extents in |over_extents| over |base_extents|. Here we assume the
 // |over_extents| are non-overlapping and sorted by their offset.
@@ -103,6 +130,13 @@ bool DeflatePreprocessFileData(const std::string_view filename,
                                const brillo::Blob& data,
                                std::vector<puffin::BitExtent>* deflates);
 
+// Finds the filesystem image stored uncompressed in the APEX |apex|, at
+// |offset| bytes for |size| bytes. APEX files are split into the files of this
+// image by PreprocessPartitionFiles() when it is block aligned.
+bool LocateApexPayload(const brillo::Blob& apex,
+                       uint64_t* offset,
+                       uint64_t* size);
+
 }  // namespace deflate_utils
 }  // namespace chromeos_update_engine
 #endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DEFLATE_UTILS_H_
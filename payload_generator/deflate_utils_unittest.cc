@@ -16,18 +16,23 @@
 
 #include "update_engine/payload_generator/deflate_utils.h"
 
+#include <stdio.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <memory>
 #include <utility>
 #include <vector>
 
 #include <gtest/gtest.h>
+#include <ziparchive/zip_writer.h>
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/fake_filesystem.h"
 
 using puffin::BitExtent;
 using puffin::ByteExtent;
@@ -186,5 +191,57 @@ TEST(DeflateUtilsTest, CompactBoundaryTest) {
   EXPECT_EQ(out_deflates, expected_out_deflates);
 }
 
+TEST(DeflateUtilsTest, GetPartitionFilesSharedByCopiesTest) {
+  PartitionConfig part("part");
+  auto fs = std::make_shared<FakeFilesystem>(kBlockSize, 10);
+  fs->AddFile("/file", {ExtentForRange(1, 4)});
+  part.fs_interface = fs;
+  part.files_cache = std::make_shared<PartitionFilesCache>();
+  const PartitionConfig copy = part;
+
+  const auto files = GetPartitionFiles(part, false, "");
+  ASSERT_NE(nullptr, files);
+  ASSERT_EQ(1u, files->size());
+  EXPECT_EQ("/file", (*files)[0].name);
+  EXPECT_EQ(files, GetPartitionFiles(copy, false, ""));
+
+  // Without a cache, the files are preprocessed again.
+  part.files_cache.reset();
+  const auto uncached_files = GetPartitionFiles(part, false, "");
+  ASSERT_NE(nullptr, uncached_files);
+  EXPECT_NE(files, uncached_files);
+}
+
+TEST(DeflateUtilsTest, LocateApexPayloadTest) {
+  ScopedTempFile apex_file("DeflateUtilsTest_apex.XXXXXX");
+  FILE* fp = fopen(apex_file.path().c_str(), "wb");
+  ASSERT_NE(nullptr, fp);
+  const std::string manifest = "manifest";
+  const brillo::Blob payload(2 * kBlockSize, 'p');
+  {
+    ZipWriter writer(fp);
+    ASSERT_EQ(0, writer.StartEntry("apex_manifest.pb", ZipWriter::kCompress));
+    ASSERT_EQ(0, writer.WriteBytes(manifest.data(), manifest.size()));
+    ASSERT_EQ(0, writer.FinishEntry());
+    ASSERT_EQ(0, writer.StartAlignedEntry("apex_payload.img", 0, kBlockSize));
+    ASSERT_EQ(0, writer.WriteBytes(payload.data(), payload.size()));
+    ASSERT_EQ(0, writer.FinishEntry());
+    ASSERT_EQ(0, writer.Finish());
+  }
+  ASSERT_EQ(0, fclose(fp));
+  brillo::Blob apex;
+  ASSERT_TRUE(utils::ReadFile(apex_file.path(), &apex));
+
+  uint64_t offset = 0, size = 0;
+  ASSERT_TRUE(LocateApexPayload(apex, &offset, &size));
+  EXPECT_EQ(0u, offset % kBlockSize);
+  ASSERT_EQ(payload.size(), size);
+  EXPECT_TRUE(
+      std::equal(payload.begin(), payload.end(), apex.begin() + offset));
+
+  // Without a zip, there is no payload.
+  EXPECT_FALSE(LocateApexPayload(payload, &offset, &size));
+}
+
 }  // namespace deflate_utils
 }  // namespace chromeos_update_engine
@@ -29,7 +29,6 @@
 #include <vector>
 
 #include <base/logging.h>
-#include <base/threading/simple_thread.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
@@ -41,8 +40,12 @@
 #include "update_engine/payload_generator/cow_size_estimator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/full_update_generator.h"
+#include "update_engine/payload_generator/generation_report.h"
 #include "update_engine/payload_generator/merge_sequence_generator.h"
+#include "update_engine/payload_generator/partition_checkpoint.h"
 #include "update_engine/payload_generator/payload_file.h"
+#include "update_engine/payload_generator/task_scheduler.h"
+#include "update_engine/payload_generator/zstd.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::string;
@@ -54,7 +57,7 @@ namespace chromeos_update_engine {
 // bytes
 const size_t kRootFSPartitionSize = static_cast<size_t>(2) * 1024 * 1024 * 1024;
 
-class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
+class PartitionProcessor {
   bool IsDynamicPartition(const std::string& partition_name) {
     for (const auto& group :
          config_.target.dynamic_partition_metadata->groups()) {
@@ -73,6 +76,8 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
       const PartitionConfig& old_part,
       const PartitionConfig& new_part,
       BlobFileWriter* file_writer,
+      int blob_fd,
+      const PartitionCheckpoints* checkpoints,
       std::vector<AnnotatedOperation>* aops,
       std::vector<CowMergeOperation>* cow_merge_sequence,
       size_t* cow_size,
@@ -81,15 +86,61 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
         old_part_(old_part),
         new_part_(new_part),
         file_writer_(file_writer),
+        blob_fd_(blob_fd),
+        checkpoints_(checkpoints),
         aops_(aops),
         cow_merge_sequence_(cow_merge_sequence),
         cow_size_(cow_size),
         strategy_(std::move(strategy)) {}
   PartitionProcessor(PartitionProcessor&&) noexcept = default;
 
-  void Run() override {
+  void Run() {
     LOG(INFO) << "Started an async task to process partition "
               << new_part_.name;
+    brillo::Blob key;
+    if (checkpoints_ &&
+        !PartitionCheckpointKey(config_, old_part_, new_part_, &key)) {
+      LOG(WARNING) << "Failed to compute the checkpoint key of partition "
+                   << new_part_.name;
+      key.clear();
+    }
+    PartitionCheckpointData data;
+    if (!key.empty() && checkpoints_->Load(key, file_writer_, &data)) {
+      LOG(INFO) << "Resumed partition " << new_part_.name
+                << " from its checkpoint.";
+      *aops_ = std::move(data.aops);
+      *cow_merge_sequence_ = std::move(data.merge_sequence);
+      *cow_size_ = data.cow_size;
+      if (!data.zstd_dictionary.empty()) {
+        new_part_.zstd_dictionary =
+            ZstdDictionary::Load(std::move(data.zstd_dictionary));
+        if (!new_part_.zstd_dictionary)
+          LOG(FATAL) << "Failed to load the zstd dictionary of the checkpoint";
+      }
+      return;
+    }
+
+    Generate();
+
+    if (key.empty())
+      return;
+    data.aops = *aops_;
+    data.merge_sequence = *cow_merge_sequence_;
+    data.cow_size = *cow_size_;
+    if (new_part_.zstd_dictionary)
+      data.zstd_dictionary = new_part_.zstd_dictionary->data();
+    checkpoints_->Save(key, blob_fd_, data);
+  }
+
+  // The new partition, with the zstd dictionary trained by Run(), if any.
+  const PartitionConfig& new_part() const { return new_part_; }
+
+ private:
+  // Generates the operations, the merge sequence and the COW size estimate
+  // of the partition.
+  void Generate() {
+    if (config_.version.ZstdDictionariesAllowed())
+      new_part_.zstd_dictionary = diff_utils::TrainZstdDictionary(new_part_);
     bool success = strategy_->GenerateOperations(
         config_, old_part_, new_part_, file_writer_, aops_);
     if (!success) {
@@ -98,6 +149,10 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
       LOG(FATAL) << "GenerateOperations(" << old_part_.name << ", "
                  << new_part_.name << ") failed";
     }
+    if (config_.order_operations_by_apply_cost) {
+      diff_utils::OrderOperationsByApplyCost(aops_,
+                                             config_.apply_cost_profile);
+    }
 
     bool snapshot_enabled =
         config_.target.dynamic_partition_metadata &&
@@ -110,13 +165,21 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
       return;
     }
     if (!old_part_.path.empty()) {
+      ExtentRanges hot_blocks;
+      if (!new_part_.hot_blocks_path.empty() &&
+          !ReadHotBlocks(new_part_.hot_blocks_path, &hot_blocks)) {
+        LOG(FATAL) << "Failed to read the hot blocks of " << new_part_.name;
+      }
+      GenerationReport::ScopedStage stage("merge_sequence");
       auto generator = MergeSequenceGenerator::Create(*aops_);
-      if (!generator || !generator->Generate(cow_merge_sequence_)) {
+      if (!generator ||
+          !generator->Generate(cow_merge_sequence_, &hot_blocks)) {
         LOG(FATAL) << "Failed to generate merge sequence";
       }
     }
 
     LOG(INFO) << "Estimating COW size for partition: " << new_part_.name;
+    GenerationReport::ScopedStage stage("cow_estimate");
     // Need the contents of source/target image bytes when doing
     // dry run.
     auto target_fd = std::make_unique<EintrSafeFileDescriptor>();
@@ -142,16 +205,22 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
         config_.block_size,
         config_.target.dynamic_partition_metadata->vabc_compression_param(),
         new_part_.size,
-        config_.enable_vabc_xor);
+        config_.enable_vabc_xor,
+        diff_utils::GetMaxThreads(),
+        config_.cow_estimate_sample_interval);
     LOG(INFO) << "Estimated COW size for partition: " << new_part_.name << " "
               << *cow_size_;
   }
 
- private:
   const PayloadGenerationConfig& config_;
   const PartitionConfig& old_part_;
-  const PartitionConfig& new_part_;
+  // A copy, which shares the image and the files of the config.
+  PartitionConfig new_part_;
   BlobFileWriter* file_writer_;
+  // The file |file_writer_| stores the blobs in, to save them in checkpoints.
+  int blob_fd_;
+  // Not owned, null without checkpoints.
+  const PartitionCheckpoints* checkpoints_;
   std::vector<AnnotatedOperation>* aops_;
   std::vector<CowMergeOperation>* cow_merge_sequence_;
   size_t* cow_size_;
@@ -190,11 +259,13 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
 
     std::vector<size_t> all_cow_sizes(config.target.partitions.size(), 0);
 
+    std::unique_ptr<PartitionCheckpoints> checkpoints;
+    if (!config.checkpoint_dir.empty()) {
+      checkpoints =
+          std::make_unique<PartitionCheckpoints>(config.checkpoint_dir);
+    }
+
     std::vector<PartitionProcessor> partition_tasks{};
-    auto thread_count = std::min<int>(diff_utils::GetMaxThreads(),
-                                      config.target.partitions.size());
-    base::DelegateSimpleThreadPool thread_pool{"partition-thread-pool",
-                                               thread_count};
     for (size_t i = 0; i < config.target.partitions.size(); i++) {
       const PartitionConfig& old_part =
           config.is_delta ? config.source.partitions[i] : empty_part;
@@ -221,24 +292,29 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
                                                    old_part,
                                                    new_part,
                                                    &blob_file,
+                                                   data_file.fd(),
+                                                   checkpoints.get(),
                                                    &all_aops[i],
                                                    &all_merge_sequences[i],
                                                    &all_cow_sizes[i],
                                                    std::move(strategy)));
     }
-    thread_pool.Start();
-    for (auto& processor : partition_tasks) {
-      thread_pool.AddWork(&processor);
+    // The partitions share the process wide scheduler with the files and
+    // chunks they are split into, the largest partitions start first.
+    TaskGroup partition_group;
+    for (size_t i = 0; i < partition_tasks.size(); i++) {
+      PartitionProcessor* processor = &partition_tasks[i];
+      partition_group.Post([processor] { processor->Run(); },
+                           config.target.partitions[i].size);
     }
-    thread_pool.JoinAll();
+    partition_group.Wait();
 
     for (size_t i = 0; i < config.target.partitions.size(); i++) {
       const PartitionConfig& old_part =
           config.is_delta ? config.source.partitions[i] : empty_part;
-      const PartitionConfig& new_part = config.target.partitions[i];
       TEST_AND_RETURN_FALSE(
           payload.AddPartition(old_part,
-                               new_part,
+                               partition_tasks[i].new_part(),
                                std::move(all_aops[i]),
                                std::move(all_merge_sequences[i]),
                                all_cow_sizes[i]));
@@ -248,8 +324,11 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
 
   LOG(INFO) << "Writing payload file...";
   // Write payload file to disk.
-  TEST_AND_RETURN_FALSE(payload.WritePayload(
-      output_path, data_file.path(), private_key_path, metadata_size));
+  {
+    GenerationReport::ScopedStage stage("assembly");
+    TEST_AND_RETURN_FALSE(payload.WritePayload(
+        output_path, data_file.path(), private_key_path, metadata_size));
+  }
 
   LOG(INFO) << "All done. Successfully created delta file with "
             << "metadata size = " << *metadata_size;
@@ -27,15 +27,16 @@
 #if defined(__clang__)
 #pragma clang diagnostic pop
 #endif
+#include <string.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <functional>
-#include <limits>
 #include <list>
 #include <map>
 #include <memory>
 #include <numeric>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -43,7 +44,6 @@
 #include <base/format_macros.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
-#include <base/threading/simple_thread.h>
 #include <brillo/data_encoding.h>
 #include <bsdiff/bsdiff.h>
 #include <bsdiff/constants.h>
@@ -57,19 +57,26 @@
 #include <zucchini/zucchini.h>
 
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/performance_recorder.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/ab_generator.h"
+#include "update_engine/payload_generator/base_payload.h"
 #include "update_engine/payload_generator/block_mapping.h"
 #include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/decoded_data_cache.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/generation_report.h"
 #include "update_engine/payload_generator/merge_sequence_generator.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/payload_generator/xz.h"
+#include "update_engine/payload_generator/zstd.h"
 #include "update_engine/lz4diff/lz4diff.h"
 
 using std::list;
@@ -96,21 +103,45 @@ const uint64_t kMaxPuffdiffDestinationSize = 150 * 1024 * 1024;  // bytes
 // as zucchini tends to use more peak memory.
 const uint64_t kMaxZucchiniDestinationSize = 150 * 1024 * 1024;  // bytes
 
+// Diff candidates for inputs up to this size run concurrently. Above it they
+// run one after the other, as each of them can take several times the input
+// size in memory.
+const uint64_t kMaxConcurrentDiffInputSize = 64 * 1024 * 1024;  // bytes
+
+// REPLACE blobs of at least this size are compressed with xz and bzip2 at the
+// same time. Below it, the task overhead isn't worth it.
+const uint64_t kMinConcurrentCompressSize = 256 * 1024;  // bytes
+
+// The zstd dictionary of a partition is trained on up to this many samples of
+// this many blocks each, evenly spaced over the partition, and holds at most
+// this many bytes, the zstd default.
+const uint64_t kZstdDictionaryMaxSamples = 1024;
+const uint64_t kZstdDictionarySampleBlocks = 2;
+const size_t kZstdDictionarySize = 112 * 1024;  // bytes
+
+// The estimated seconds to download a |blob_size| bytes blob of a |type|
+// operation and to write the |data_size| bytes it produces on the devices of
+// |profile|.
+double OperationSeconds(const ApplyCostProfile& profile,
+                        InstallOperation::Type type,
+                        size_t blob_size,
+                        size_t data_size) {
+  return profile.DownloadSeconds(blob_size) +
+         profile.ApplySeconds(type, data_size);
+}
+
 const int kBrotliCompressionQuality = 11;
 
 // Storing a diff operation has more overhead over replace operation in the
 // manifest, we need to store an additional src_sha256_hash which is 32 bytes
 // and not compressible, and also src_extents which could use anywhere from a
 // few bytes to hundreds of bytes depending on the number of extents.
-// This function evaluates the overhead tradeoff and determines if it's worth to
-// use a diff operation with data blob of |diff_size| and |num_src_extents|
-// extents over an existing |op| with data blob of |old_blob_size|.
-bool IsDiffOperationBetter(const InstallOperation& op,
-                           size_t old_blob_size,
-                           size_t diff_size,
-                           size_t num_src_extents) {
+// Returns the bytes a diff operation with |num_src_extents| extents adds to
+// the manifest over the existing |op|.
+size_t DiffOperationOverhead(const InstallOperation& op,
+                             size_t num_src_extents) {
   if (!diff_utils::IsAReplaceOperation(op.type()))
-    return diff_size < old_blob_size;
+    return 0;
 
   // Reference: https://developers.google.com/protocol-buffers/docs/encoding
   // For |src_sha256_hash| we need 1 byte field number/type, 1 byte size and 32
@@ -122,10 +153,52 @@ bool IsDiffOperationBetter(const InstallOperation& op,
   // very small.
   constexpr size_t kDiffOverheadPerExtent = 6;
 
-  return diff_size + kDiffOverhead + num_src_extents * kDiffOverheadPerExtent <
+  return kDiffOverhead + num_src_extents * kDiffOverheadPerExtent;
+}
+
+// Evaluates the overhead tradeoff and determines if it's worth to use a diff
+// operation with data blob of |diff_size| and |num_src_extents| extents over
+// an existing |op| with data blob of |old_blob_size|.
+bool IsDiffOperationBetter(const InstallOperation& op,
+                           size_t old_blob_size,
+                           size_t diff_size,
+                           size_t num_src_extents) {
+  return diff_size + DiffOperationOverhead(op, num_src_extents) <
          old_blob_size;
 }
 
+// Same, but for a |diff_type| operation, determines if it downloads and
+// applies faster on the devices of |profile|, both operations writing
+// |dst_size| bytes.
+bool IsDiffOperationFaster(const ApplyCostProfile& profile,
+                           const InstallOperation& op,
+                           size_t old_blob_size,
+                           InstallOperation::Type diff_type,
+                           size_t diff_size,
+                           size_t num_src_extents,
+                           uint64_t dst_size) {
+  const size_t diff_blob_size =
+      diff_size + DiffOperationOverhead(op, num_src_extents);
+  return OperationSeconds(profile, diff_type, diff_blob_size, dst_size) <
+         OperationSeconds(profile, op.type(), old_blob_size, dst_size);
+}
+
+// Sets |out| to the bytes of |extents| in |part|, from its mapped image if it
+// has one. Otherwise, or if the blocks aren't contiguous, they are read or
+// gathered into |buffer|.
+bool ReadPartitionExtents(const PartitionConfig& part,
+                          const vector<Extent>& extents,
+                          brillo::Blob* buffer,
+                          std::string_view* out) {
+  if (part.image)
+    return part.image->ReadExtents(extents, kBlockSize, buffer, out);
+  const uint64_t bytes = utils::BlocksInExtents(extents) * kBlockSize;
+  TEST_AND_RETURN_FALSE(
+      utils::ReadExtents(part.path, extents, buffer, bytes, kBlockSize));
+  *out = ToStringView(*buffer);
+  return true;
+}
+
 // Returns the levenshtein distance between string |a| and |b|.
 // https://en.wikipedia.org/wiki/Levenshtein_distance
 int LevenshteinDistance(const string& a, const string& b) {
@@ -147,52 +220,171 @@ int LevenshteinDistance(const string& a, const string& b) {
   return distances.back();
 }
 
-static bool ShouldCreateNewOp(const std::vector<CowMergeOperation>& ops,
-                              size_t src_block,
-                              size_t dst_block,
-                              size_t src_offset) {
-  if (ops.empty()) {
-    return true;
+// A run of target blocks XORed with as many consecutive source blocks, read
+// |src_offset| bytes into them.
+struct XorRange {
+  uint64_t src_block;
+  uint64_t dst_block;
+  uint64_t num_blocks;
+  uint64_t src_offset;
+};
+
+// Looks up the blocks of the extents of an operation by their index, with a
+// binary search instead of walking the extents for each block.
+class ExtentBlockIndex {
+ public:
+  explicit ExtentBlockIndex(
+      const google::protobuf::RepeatedPtrField<Extent>& extents)
+      : extents_(extents) {
+    uint64_t blocks = 0;
+    ends_.reserve(extents.size());
+    for (const auto& extent : extents) {
+      blocks += extent.num_blocks();
+      ends_.push_back(blocks);
+    }
   }
-  const auto& op = ops.back();
-  if (op.src_offset() != src_offset) {
+
+  // Sets |block| to the |index|th block of the extents, and |run| to the
+  // number of blocks from it to the end of its extent. Returns false past the
+  // last extent.
+  bool Lookup(uint64_t index, uint64_t* block, uint64_t* run) const {
+    const auto it = std::upper_bound(ends_.begin(), ends_.end(), index);
+    if (it == ends_.end())
+      return false;
+    const size_t i = it - ends_.begin();
+    const uint64_t first = i == 0 ? 0 : ends_[i - 1];
+    *block = extents_[i].start_block() + index - first;
+    *run = *it - index;
     return true;
   }
-  const auto& src_extent = op.src_extent();
-  const auto& dst_extent = op.dst_extent();
-  return src_extent.start_block() + src_extent.num_blocks() != src_block ||
-         dst_extent.start_block() + dst_extent.num_blocks() != dst_block;
-}
 
-void AppendXorBlock(std::vector<CowMergeOperation>* ops,
-                    size_t src_block,
-                    size_t dst_block,
-                    size_t src_offset) {
-  if (!ops->empty() && ExtentContains(ops->back().dst_extent(), dst_block)) {
-    return;
+ private:
+  const google::protobuf::RepeatedPtrField<Extent>& extents_;
+  // The number of blocks up to the end of each extent.
+  vector<uint64_t> ends_;
+};
+
+// Appends the XOR of |num_blocks| blocks, from the |dst_index|th target block
+// and the |src_index|th source block, to |ranges|: one range per run of blocks
+// contiguous in both the source and the target extents.
+void AppendXorRanges(const ExtentBlockIndex& src,
+                     const ExtentBlockIndex& dst,
+                     uint64_t src_index,
+                     uint64_t dst_index,
+                     uint64_t num_blocks,
+                     uint64_t src_offset,
+                     vector<XorRange>* ranges) {
+  while (num_blocks > 0) {
+    uint64_t src_block, src_run, dst_block, dst_run;
+    CHECK(src.Lookup(src_index, &src_block, &src_run));
+    CHECK(dst.Lookup(dst_index, &dst_block, &dst_run));
+    const uint64_t blocks = std::min({num_blocks, src_run, dst_run});
+    ranges->push_back({src_block, dst_block, blocks, src_offset});
+    src_index += blocks;
+    dst_index += blocks;
+    num_blocks -= blocks;
   }
-  CHECK_NE(src_block, std::numeric_limits<uint64_t>::max());
-  CHECK_NE(dst_block, std::numeric_limits<uint64_t>::max());
-  if (ShouldCreateNewOp(*ops, src_block, dst_block, src_offset)) {
+}
+
+// Appends |ranges| to |ops| in one pass, extending the last operation with the
+// ranges which continue it, and dropping the target blocks it already has.
+void MergeXorRanges(const vector<XorRange>& ranges,
+                    vector<CowMergeOperation>* ops) {
+  for (XorRange range : ranges) {
+    if (!ops->empty()) {
+      CowMergeOperation& op = ops->back();
+      auto& src_extent = *op.mutable_src_extent();
+      auto& dst_extent = *op.mutable_dst_extent();
+      const uint64_t dst_end =
+          dst_extent.start_block() + dst_extent.num_blocks();
+      if (ExtentContains(dst_extent, range.dst_block)) {
+        const uint64_t skip =
+            std::min(range.num_blocks, dst_end - range.dst_block);
+        range.src_block += skip;
+        range.dst_block += skip;
+        range.num_blocks -= skip;
+        if (range.num_blocks == 0)
+          continue;
+      }
+      if (op.src_offset() == range.src_offset &&
+          src_extent.start_block() + src_extent.num_blocks() ==
+              range.src_block &&
+          dst_end == range.dst_block) {
+        src_extent.set_num_blocks(src_extent.num_blocks() + range.num_blocks);
+        dst_extent.set_num_blocks(dst_extent.num_blocks() + range.num_blocks);
+        continue;
+      }
+    }
     auto& op = ops->emplace_back();
-    op.mutable_src_extent()->set_start_block(src_block);
-    op.mutable_src_extent()->set_num_blocks(1);
-    op.mutable_dst_extent()->set_start_block(dst_block);
-    op.mutable_dst_extent()->set_num_blocks(1);
-    op.set_src_offset(src_offset);
+    op.mutable_src_extent()->set_start_block(range.src_block);
+    op.mutable_src_extent()->set_num_blocks(range.num_blocks);
+    op.mutable_dst_extent()->set_start_block(range.dst_block);
+    op.mutable_dst_extent()->set_num_blocks(range.num_blocks);
+    op.set_src_offset(range.src_offset);
     op.set_type(CowMergeOperation::COW_XOR);
-  } else {
-    auto& op = ops->back();
-    auto& src_extent = *op.mutable_src_extent();
-    auto& dst_extent = *op.mutable_dst_extent();
-    src_extent.set_num_blocks(src_extent.num_blocks() + 1);
-    dst_extent.set_num_blocks(dst_extent.num_blocks() + 1);
   }
 }
 
 }  // namespace
 
 namespace diff_utils {
+BestDiffGenerator::BestDiffGenerator(std::string_view old_data,
+                                     std::string_view new_data,
+                                     const vector<Extent>& src_extents,
+                                     const vector<Extent>& dst_extents,
+                                     const File& old_file,
+                                     const File& new_file,
+                                     const PayloadGenerationConfig& config)
+    : old_data_(old_data),
+      new_data_(new_data),
+      src_extents_(src_extents),
+      dst_extents_(dst_extents),
+      old_deflates_(old_file.deflates),
+      new_deflates_(new_file.deflates),
+      old_block_info_(old_file.compressed_file_info),
+      new_block_info_(new_file.compressed_file_info),
+      config_(config) {
+  // Find all deflate positions inside the given extents and then put all
+  // deflates together because we have already read all the extents into
+  // one buffer.
+  vector<puffin::BitExtent> src_deflates;
+  TEST_AND_RETURN(deflate_utils::FindAndCompactDeflates(
+      src_extents_, old_deflates_, &src_deflates));
+
+  vector<puffin::BitExtent> dst_deflates;
+  TEST_AND_RETURN(deflate_utils::FindAndCompactDeflates(
+      dst_extents_, new_deflates_, &dst_deflates));
+  if (!src_deflates.empty() || !dst_deflates.empty()) {
+    old_deflate_data_.assign(old_data_.begin(), old_data_.end());
+    new_deflate_data_.assign(new_data_.begin(), new_data_.end());
+    puffin::RemoveEqualBitExtents(
+        old_deflate_data_, new_deflate_data_, &src_deflates, &dst_deflates);
+    // See crbug.com/915559.
+    if (config.version.minor <= kPuffdiffMinorPayloadVersion) {
+      CHECK(puffin::RemoveDeflatesWithBadDistanceCaches(old_deflate_data_,
+                                                        &src_deflates));
+
+      CHECK(puffin::RemoveDeflatesWithBadDistanceCaches(new_deflate_data_,
+                                                        &dst_deflates));
+    }
+  }
+  old_deflates_ = std::move(src_deflates);
+  new_deflates_ = std::move(dst_deflates);
+}
+
+void BestDiffGenerator::SetImagePaths(const string& old_path,
+                                      const string& new_path) {
+  lz4_cache_keys_.src_decompressed =
+      DecodedDataCache::Key("lz4-decompressed", old_path, src_extents_);
+  lz4_cache_keys_.dst_decompressed =
+      DecodedDataCache::Key("lz4-decompressed", new_path, dst_extents_);
+  // The recompression also depends on the compression settings.
+  lz4_cache_keys_.dst_recompressed =
+      DecodedDataCache::Key("lz4-recompressed", new_path, dst_extents_) +
+      new_block_info_.algo.SerializeAsString() +
+      (new_block_info_.zero_padding_enabled ? "+zero-padding" : "");
+}
+
 bool BestDiffGenerator::GenerateBestDiffOperation(AnnotatedOperation* aop,
                                                   brillo::Blob* data_blob) {
   std::vector<std::pair<InstallOperation_Type, size_t>> diff_candidates = {
@@ -216,21 +408,169 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
     brillo::Blob* data_blob) {
   CHECK(aop);
   CHECK(data_blob);
+  if (config_.diff_cache_dir.empty()) {
+    return TryDiffCandidates(diff_candidates, aop, data_blob);
+  }
+
+  const DiffCache cache(config_.diff_cache_dir);
+  const brillo::Blob key = GetDiffCacheKey(diff_candidates, *aop, *data_blob);
+  InstallOperation::Type op_type;
+  brillo::Blob patch;
+  if (cache.Get(key, &op_type, &patch)) {
+    InstallOperation& operation = aop->op;
+    if ((op_type == InstallOperation::SOURCE_BSDIFF ||
+         op_type == InstallOperation::BROTLI_BSDIFF) &&
+        config_.enable_vabc_xor) {
+      StoreExtents(src_extents_, operation.mutable_src_extents());
+      diff_utils::PopulateXorOps(aop, patch);
+    }
+    operation.set_type(op_type);
+    *data_blob = std::move(patch);
+    if (GenerationReport::Get()->enabled()) {
+      GenerationReport::DiffRecord record = NewDiffRecord(*aop, *data_blob);
+      record.cached = true;
+      GenerationReport::Get()->AddDiff(std::move(record));
+    }
+    return true;
+  }
+  if (config_.diff_shard_count > 1) {
+    uint64_t key_prefix;
+    memcpy(&key_prefix, key.data(), sizeof(key_prefix));
+    if (key_prefix % config_.diff_shard_count != config_.diff_shard_index) {
+      return true;
+    }
+  }
+  TEST_AND_RETURN_FALSE(TryDiffCandidates(diff_candidates, aop, data_blob));
+  cache.Put(key, aop->op.type(), *data_blob);
+  return true;
+}
+
+brillo::Blob BestDiffGenerator::GetDiffCacheKey(
+    const std::vector<std::pair<InstallOperation_Type, size_t>>&
+        diff_candidates,
+    const AnnotatedOperation& aop,
+    const brillo::Blob& data_blob) const {
+  // Bump when the way diffs are generated changes, to drop the old entries.
+  constexpr uint64_t kDiffCacheKeyVersion = 1;
+  HashCalculator hasher;
+  auto add_value = [&hasher](uint64_t value) {
+    CHECK(hasher.Update(&value, sizeof(value)));
+  };
+  auto add_blob = [&hasher, &add_value](const void* data, size_t size) {
+    add_value(size);
+    CHECK(hasher.Update(data, size));
+  };
+  auto add_deflates = [&add_value](const vector<puffin::BitExtent>& deflates) {
+    add_value(deflates.size());
+    for (const auto& deflate : deflates) {
+      add_value(deflate.offset);
+      add_value(deflate.length);
+    }
+  };
+  auto add_block_info = [&add_value, &add_blob](const CompressedFile& info) {
+    add_value(info.blocks.size());
+    for (const auto& block : info.blocks) {
+      add_value(block.uncompressed_offset);
+      add_value(block.compressed_length);
+      add_value(block.uncompressed_length);
+    }
+    const string algo = info.algo.SerializeAsString();
+    add_blob(algo.data(), algo.size());
+    add_value(info.zero_padding_enabled);
+  };
+
+  add_value(kDiffCacheKeyVersion);
+  add_value(config_.version.major);
+  add_value(config_.version.minor);
+  for (const auto& [op_type, limit] : diff_candidates) {
+    add_value(op_type);
+    add_value(limit);
+  }
+  for (const auto op_type : {InstallOperation::SOURCE_BSDIFF,
+                             InstallOperation::BROTLI_BSDIFF,
+                             InstallOperation::PUFFDIFF,
+                             InstallOperation::ZUCCHINI,
+                             InstallOperation::LZ4DIFF_BSDIFF,
+                             InstallOperation::LZ4DIFF_PUFFDIFF}) {
+    add_value(config_.OperationEnabled(op_type));
+  }
+  add_value(config_.compressors.size());
+  for (const auto compressor : config_.compressors) {
+    add_value(static_cast<uint64_t>(compressor));
+  }
+  if (config_.minimize_apply_time) {
+    // Only added when set, so the keys of the size objective don't change.
+    const ApplyCostProfile& profile = config_.apply_cost_profile;
+    auto add_double = [&add_value](double value) {
+      uint64_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      add_value(bits);
+    };
+    add_double(profile.download_bytes_per_second);
+    for (const auto& [op_type, bytes_per_second] :
+         profile.apply_bytes_per_second) {
+      add_value(op_type);
+      add_double(bytes_per_second);
+    }
+  }
+  // Zucchini is only tried for some file names, and the diffs are compared to
+  // the full operation and its number of source extents.
+  add_blob(aop.name.data(), aop.name.size());
+  add_value(aop.op.type());
+  add_value(data_blob.size());
+  add_value(src_extents_.size());
+  add_value(utils::BlocksInExtents(dst_extents_));
+
+  add_blob(old_data_.data(), old_data_.size());
+  add_blob(new_data_.data(), new_data_.size());
+  add_deflates(old_deflates_);
+  add_deflates(new_deflates_);
+  add_block_info(old_block_info_);
+  add_block_info(new_block_info_);
+  CHECK(hasher.Finalize());
+  return hasher.raw_hash();
+}
+
+bool BestDiffGenerator::TryDiffCandidates(
+    const std::vector<std::pair<InstallOperation_Type, size_t>>&
+        diff_candidates,
+    AnnotatedOperation* aop,
+    brillo::Blob* data_blob) {
+  const bool report = GenerationReport::Get()->enabled();
+  vector<GenerationReport::DiffAttempt> attempts;
+  auto add_report = [this, report, aop, data_blob, &attempts] {
+    if (!report)
+      return;
+    GenerationReport::DiffRecord record = NewDiffRecord(*aop, *data_blob);
+    record.attempts = std::move(attempts);
+    GenerationReport::Get()->AddDiff(std::move(record));
+  };
+
   if (!old_block_info_.blocks.empty() && !new_block_info_.blocks.empty() &&
       config_.OperationEnabled(InstallOperation::LZ4DIFF_BSDIFF) &&
       config_.OperationEnabled(InstallOperation::LZ4DIFF_PUFFDIFF)) {
     brillo::Blob patch;
-    InstallOperation::Type op_type;
-    if (Lz4Diff(old_data_,
-                new_data_,
-                old_block_info_,
-                new_block_info_,
-                &patch,
-                &op_type)) {
+    InstallOperation::Type op_type = InstallOperation::LZ4DIFF_BSDIFF;
+    const base::TimeTicks start = base::TimeTicks::Now();
+    const base::TimeDelta cpu_start = PerformanceRecorder::ThreadCpuTime();
+    const bool succeeded = Lz4Diff(old_data_,
+                                   new_data_,
+                                   old_block_info_,
+                                   new_block_info_,
+                                   &patch,
+                                   &op_type,
+                                   &lz4_cache_keys_);
+    attempts.push_back({op_type,
+                        base::TimeTicks::Now() - start,
+                        PerformanceRecorder::ThreadCpuTime() - cpu_start,
+                        patch.size(),
+                        succeeded});
+    if (succeeded) {
       aop->op.set_type(op_type);
       // LZ4DIFF is likely significantly better than BSDIFF/PUFFDIFF when
       // working with EROFS. So no need to even try other diffing algorithms.
       *data_blob = std::move(patch);
+      add_report();
       return true;
     }
   }
@@ -239,6 +579,14 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
                                         utils::BlocksInExtents(dst_extents_)) *
                                kBlockSize;
 
+  struct Candidate {
+    InstallOperation::Type type;
+    brillo::Blob patch;
+    bool succeeded = false;
+    base::TimeDelta wall_time;
+    base::TimeDelta cpu_time;
+  };
+  vector<Candidate> candidates;
   for (auto [op_type, limit] : diff_candidates) {
     if (!config_.OperationEnabled(op_type)) {
       continue;
@@ -256,31 +604,136 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
         config_.OperationEnabled(InstallOperation::BROTLI_BSDIFF)) {
       op_type = InstallOperation::BROTLI_BSDIFF;
     }
+    if (!IsCandidateUseful(op_type, *aop)) {
+      continue;
+    }
+    candidates.push_back({op_type});
+  }
 
-    switch (op_type) {
+  auto generate_patch = [this](Candidate* candidate) {
+    const base::TimeTicks start = base::TimeTicks::Now();
+    const base::TimeDelta cpu_start = PerformanceRecorder::ThreadCpuTime();
+    switch (candidate->type) {
       case InstallOperation::SOURCE_BSDIFF:
       case InstallOperation::BROTLI_BSDIFF:
-        TEST_AND_RETURN_FALSE(
-            TryBsdiffAndUpdateOperation(op_type, aop, data_blob));
+        candidate->succeeded =
+            GenerateBsdiffPatch(candidate->type, &candidate->patch);
         break;
       case InstallOperation::PUFFDIFF:
-        TEST_AND_RETURN_FALSE(TryPuffdiffAndUpdateOperation(aop, data_blob));
+        candidate->succeeded = GeneratePuffdiffPatch(&candidate->patch);
         break;
       case InstallOperation::ZUCCHINI:
-        TEST_AND_RETURN_FALSE(TryZucchiniAndUpdateOperation(aop, data_blob));
+        candidate->succeeded = GenerateZucchiniPatch(&candidate->patch);
         break;
       default:
         NOTREACHED();
     }
+    candidate->wall_time = base::TimeTicks::Now() - start;
+    candidate->cpu_time = PerformanceRecorder::ThreadCpuTime() - cpu_start;
+  };
+  if (candidates.size() > 1 && input_bytes <= kMaxConcurrentDiffInputSize) {
+    TaskGroup candidate_group;
+    for (auto& candidate : candidates) {
+      candidate_group.Post(
+          [&generate_patch, &candidate] { generate_patch(&candidate); });
+    }
+  } else {
+    for (auto& candidate : candidates) {
+      generate_patch(&candidate);
+    }
   }
 
+  // Pick the best patch in the order of |diff_candidates|, which decides ties,
+  // so the result doesn't depend on which candidate finished first.
+  InstallOperation& operation = aop->op;
+  const uint64_t dst_bytes = utils::BlocksInExtents(dst_extents_) * kBlockSize;
+  for (const auto& candidate : candidates) {
+    attempts.push_back({candidate.type,
+                        candidate.wall_time,
+                        candidate.cpu_time,
+                        candidate.patch.size(),
+                        candidate.succeeded});
+  }
+  for (auto& candidate : candidates) {
+    TEST_AND_RETURN_FALSE(candidate.succeeded);
+    const bool better =
+        config_.minimize_apply_time
+            ? IsDiffOperationFaster(config_.apply_cost_profile,
+                                    operation,
+                                    data_blob->size(),
+                                    candidate.type,
+                                    candidate.patch.size(),
+                                    src_extents_.size(),
+                                    dst_bytes)
+            : IsDiffOperationBetter(operation,
+                                    data_blob->size(),
+                                    candidate.patch.size(),
+                                    src_extents_.size());
+    if (!better) {
+      continue;
+    }
+    if (candidate.type == InstallOperation::SOURCE_BSDIFF ||
+        candidate.type == InstallOperation::BROTLI_BSDIFF) {
+      // VABC XOR won't work with compressed files just yet.
+      if (config_.enable_vabc_xor) {
+        StoreExtents(src_extents_, operation.mutable_src_extents());
+        diff_utils::PopulateXorOps(aop, candidate.patch);
+      }
+    }
+    operation.set_type(candidate.type);
+    *data_blob = std::move(candidate.patch);
+  }
+
+  // The XOR operations only apply to a bsdiff patch, which might have been
+  // beaten by one of the later candidates.
+  if (aop->op.type() != InstallOperation::SOURCE_BSDIFF &&
+      aop->op.type() != InstallOperation::BROTLI_BSDIFF) {
+    aop->xor_ops.clear();
+  }
+  add_report();
   return true;
 }
 
-bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
-    InstallOperation_Type operation_type,
-    AnnotatedOperation* aop,
-    brillo::Blob* data_blob) {
+GenerationReport::DiffRecord BestDiffGenerator::NewDiffRecord(
+    const AnnotatedOperation& aop, const brillo::Blob& data_blob) const {
+  GenerationReport::DiffRecord record;
+  record.name = aop.name;
+  record.src_bytes = utils::BlocksInExtents(src_extents_) * kBlockSize;
+  record.dst_bytes = utils::BlocksInExtents(dst_extents_) * kBlockSize;
+  record.memory_estimate =
+      EstimateDiffMemory(record.src_bytes, record.dst_bytes, config_);
+  record.chosen_type = aop.op.type();
+  record.blob_bytes = data_blob.size();
+  return record;
+}
+
+bool BestDiffGenerator::IsCandidateUseful(InstallOperation_Type operation_type,
+                                          const AnnotatedOperation& aop) const {
+  switch (operation_type) {
+    case InstallOperation::PUFFDIFF:
+      // Only Puffdiff if both files have at least one deflate left.
+      return !old_deflates_.empty() && !new_deflates_.empty();
+    case InstallOperation::ZUCCHINI:
+      // zip files are ignored for now. We expect puffin to perform better on
+      // those. Investigate whether puffin over zucchini yields better results
+      // on those.
+      return deflate_utils::IsFileExtensions(
+          aop.name,
+          {".ko",
+           ".so",
+           ".art",
+           ".odex",
+           ".vdex",
+           "<kernel>",
+           "<modem-partition>",
+           /*, ".capex",".jar", ".apk", ".apex"*/});
+    default:
+      return true;
+  }
+}
+
+bool BestDiffGenerator::GenerateBsdiffPatch(
+    InstallOperation_Type operation_type, brillo::Blob* patch_data) const {
   base::FilePath patch;
   TEST_AND_RETURN_FALSE(base::CreateTemporaryFile(&patch));
   ScopedPathUnlinker unlinker(patch.value());
@@ -293,79 +746,42 @@ bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
     bsdiff_patch_writer = bsdiff::CreateBsdiffPatchWriter(patch.value());
   }
 
-  brillo::Blob bsdiff_delta;
-  TEST_AND_RETURN_FALSE(0 == bsdiff::bsdiff(old_data_.data(),
-                                            old_data_.size(),
-                                            new_data_.data(),
-                                            new_data_.size(),
-                                            bsdiff_patch_writer.get(),
-                                            nullptr));
-
-  TEST_AND_RETURN_FALSE(utils::ReadFile(patch.value(), &bsdiff_delta));
-  TEST_AND_RETURN_FALSE(!bsdiff_delta.empty());
-
-  InstallOperation& operation = aop->op;
-  if (IsDiffOperationBetter(operation,
-                            data_blob->size(),
-                            bsdiff_delta.size(),
-                            src_extents_.size())) {
-    // VABC XOR won't work with compressed files just yet.
-    if (config_.enable_vabc_xor) {
-      StoreExtents(src_extents_, operation.mutable_src_extents());
-      diff_utils::PopulateXorOps(aop, bsdiff_delta);
-    }
-    operation.set_type(operation_type);
-    *data_blob = std::move(bsdiff_delta);
-  }
+  TEST_AND_RETURN_FALSE(
+      0 == bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(old_data_.data()),
+                          old_data_.size(),
+                          reinterpret_cast<const uint8_t*>(new_data_.data()),
+                          new_data_.size(),
+                          bsdiff_patch_writer.get(),
+                          nullptr));
+
+  TEST_AND_RETURN_FALSE(utils::ReadFile(patch.value(), patch_data));
+  TEST_AND_RETURN_FALSE(!patch_data->empty());
   return true;
 }
 
-bool BestDiffGenerator::TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
-                                                      brillo::Blob* data_blob) {
-  // Only Puffdiff if both files have at least one deflate left.
-  if (!old_deflates_.empty() && !new_deflates_.empty()) {
-    brillo::Blob puffdiff_delta;
-    ScopedTempFile temp_file("puffdiff-delta.XXXXXX");
-    // Perform PuffDiff operation.
-    TEST_AND_RETURN_FALSE(puffin::PuffDiff(old_data_,
-                                           new_data_,
-                                           old_deflates_,
-                                           new_deflates_,
-                                           GetUsableCompressorTypes(),
-                                           temp_file.path(),
-                                           &puffdiff_delta));
-    TEST_AND_RETURN_FALSE(!puffdiff_delta.empty());
-
-    InstallOperation& operation = aop->op;
-    if (IsDiffOperationBetter(operation,
-                              data_blob->size(),
-                              puffdiff_delta.size(),
-                              src_extents_.size())) {
-      operation.set_type(InstallOperation::PUFFDIFF);
-      *data_blob = std::move(puffdiff_delta);
-    }
-  }
+bool BestDiffGenerator::GeneratePuffdiffPatch(brillo::Blob* patch) const {
+  ScopedTempFile temp_file("puffdiff-delta.XXXXXX");
+  // Perform PuffDiff operation.
+  TEST_AND_RETURN_FALSE(puffin::PuffDiff(old_deflate_data_,
+                                         new_deflate_data_,
+                                         old_deflates_,
+                                         new_deflates_,
+                                         GetUsableCompressorTypes(),
+                                         temp_file.path(),
+                                         patch));
+  TEST_AND_RETURN_FALSE(!patch->empty());
   return true;
 }
 
-bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
-                                                      brillo::Blob* data_blob) {
-  // zip files are ignored for now. We expect puffin to perform better on those.
-  // Investigate whether puffin over zucchini yields better results on those.
-  if (!deflate_utils::IsFileExtensions(
-          aop->name,
-          {".ko",
-           ".so",
-           ".art",
-           ".odex",
-           ".vdex",
-           "<kernel>",
-           "<modem-partition>",
-           /*, ".capex",".jar", ".apk", ".apex"*/})) {
-    return true;
-  }
-  zucchini::ConstBufferView src_bytes(old_data_.data(), old_data_.size());
-  zucchini::ConstBufferView dst_bytes(new_data_.data(), new_data_.size());
+// Generates the brotli compressed zucchini patch from |old_data| to
+// |new_data|.
+static bool ZucchiniDiff(std::string_view old_data,
+                         std::string_view new_data,
+                         brillo::Blob* patch) {
+  zucchini::ConstBufferView src_bytes(
+      reinterpret_cast<const uint8_t*>(old_data.data()), old_data.size());
+  zucchini::ConstBufferView dst_bytes(
+      reinterpret_cast<const uint8_t*>(new_data.data()), new_data.size());
 
   zucchini::EnsemblePatchWriter patch_writer(src_bytes, dst_bytes);
   auto status = zucchini::GenerateBuffer(src_bytes, dst_bytes, &patch_writer);
@@ -377,29 +793,60 @@ bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
   // Compress the delta with brotli.
   // TODO(197361113) support compressing the delta with different algorithms,
   // similar to the usage in puffin.
-  brillo::Blob compressed_delta;
   TEST_AND_RETURN_FALSE(puffin::BrotliEncode(
-      zucchini_delta.data(), zucchini_delta.size(), &compressed_delta));
-
-  InstallOperation& operation = aop->op;
-  if (IsDiffOperationBetter(operation,
-                            data_blob->size(),
-                            compressed_delta.size(),
-                            src_extents_.size())) {
-    operation.set_type(InstallOperation::ZUCCHINI);
-    *data_blob = std::move(compressed_delta);
-  }
+      zucchini_delta.data(), zucchini_delta.size(), patch));
+  return true;
+}
 
+bool BestDiffGenerator::GenerateZucchiniPatch(brillo::Blob* patch) const {
+  // Zucchini disassembles both files, which makes it the slowest diff. Its
+  // patch only depends on their contents, so the same pair of files, like an
+  // unchanged library of the sources of several payloads, is diffed once per
+  // process, and once per --diff_cache_dir.
+  constexpr char kZucchiniKeyTag[] = "zucchini-patch-v1";
+  HashCalculator hasher;
+  auto add_blob = [&hasher](std::string_view data) {
+    const uint64_t size = data.size();
+    CHECK(hasher.Update(&size, sizeof(size)));
+    CHECK(hasher.Update(data.data(), data.size()));
+  };
+  add_blob(kZucchiniKeyTag);
+  add_blob(old_data_);
+  add_blob(new_data_);
+  CHECK(hasher.Finalize());
+  const brillo::Blob& key = hasher.raw_hash();
+
+  const DecodedDataCache::Data cached = DecodedDataCache::Get()->GetOrDecode(
+      kZucchiniKeyTag + string(key.begin(), key.end()), [this, &key] {
+        const bool use_disk_cache = !config_.diff_cache_dir.empty();
+        const DiffCache disk_cache(config_.diff_cache_dir);
+        InstallOperation::Type type;
+        brillo::Blob result;
+        if (use_disk_cache && disk_cache.Get(key, &type, &result) &&
+            type == InstallOperation::ZUCCHINI) {
+          return result;
+        }
+        result.clear();
+        if (!ZucchiniDiff(old_data_, new_data_, &result)) {
+          return brillo::Blob();
+        }
+        if (use_disk_cache) {
+          disk_cache.Put(key, InstallOperation::ZUCCHINI, result);
+        }
+        return result;
+      });
+  TEST_AND_RETURN_FALSE(!cached->empty());
+  *patch = *cached;
   return true;
 }
 
 // This class encapsulates a file delta processing thread work. The
 // processor computes the delta between the source and target files;
 // and write the compressed delta to the blob.
-class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
+class FileDeltaProcessor {
  public:
-  FileDeltaProcessor(const string& old_part,
-                     const string& new_part,
+  FileDeltaProcessor(const PartitionConfig& old_part,
+                     const PartitionConfig& new_part,
                      const PayloadGenerationConfig& config,
                      const File& old_extents,
                      const File& new_extents,
@@ -416,23 +863,21 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
         chunk_blocks_(chunk_blocks),
         blob_file_(blob_file) {}
 
-  bool operator>(const FileDeltaProcessor& other) const {
-    return new_extents_blocks_ > other.new_extents_blocks_;
-  }
+  size_t new_extents_blocks() const { return new_extents_blocks_; }
 
-  ~FileDeltaProcessor() override = default;
-
-  // Overrides DelegateSimpleThread::Delegate.
   // Calculate the list of operations and write their corresponding deltas to
   // the blob_file.
-  void Run() override;
+  void Run();
 
   // Merge each file processor's ops list to aops.
   bool MergeOperation(vector<AnnotatedOperation>* aops);
 
  private:
-  const string& old_part_;  // NOLINT(runtime/member_string_references)
-  const string& new_part_;  // NOLINT(runtime/member_string_references)
+  // Adds the file to the GenerationReport, |start| being when Run() started.
+  void ReportFile(base::TimeTicks start, bool reused) const;
+
+  const PartitionConfig& old_part_;
+  const PartitionConfig& new_part_;
   const PayloadGenerationConfig& config_;
 
   // The block ranges of the old/new file within the src/tgt image
@@ -456,22 +901,40 @@ void FileDeltaProcessor::Run() {
   TEST_AND_RETURN(blob_file_ != nullptr);
   base::TimeTicks start = base::TimeTicks::Now();
 
-  if (!DeltaReadFile(&file_aops_,
-                     old_part_,
-                     new_part_,
-                     old_extents_,
-                     new_extents_,
-                     chunk_blocks_,
-                     config_,
-                     blob_file_)) {
+  if (config_.base_payload &&
+      config_.base_payload->ReuseOperations(config_,
+                                            old_part_,
+                                            new_part_,
+                                            new_extents_.extents,
+                                            blob_file_,
+                                            &file_aops_)) {
+    LOG(INFO) << "Reused the base payload operations of " << name_ << " ("
+              << new_extents_blocks_ << " blocks)";
+    ReportFile(start, true);
+    return;
+  }
+
+  if (!DeltaReadFileInSegments(&file_aops_,
+                               old_part_,
+                               new_part_,
+                               old_extents_,
+                               new_extents_,
+                               chunk_blocks_,
+                               config_.file_segment_size / kBlockSize,
+                               config_.max_segment_size_ratio,
+                               config_,
+                               blob_file_)) {
     LOG(ERROR) << "Failed to generate delta for " << name_ << " ("
                << new_extents_blocks_ << " blocks)";
     failed_ = true;
     return;
   }
 
-  if (!ABGenerator::FragmentOperations(
-          config_.version, &file_aops_, new_part_, blob_file_)) {
+  if (!ABGenerator::FragmentOperations(config_.version,
+                                       &file_aops_,
+                                       new_part_.path,
+                                       blob_file_,
+                                       new_part_.zstd_dictionary.get())) {
     LOG(ERROR) << "Failed to fragment operations for " << name_;
     failed_ = true;
     return;
@@ -479,6 +942,22 @@ void FileDeltaProcessor::Run() {
 
   LOG(INFO) << "Encoded file " << name_ << " (" << new_extents_blocks_
             << " blocks) in " << (base::TimeTicks::Now() - start);
+  ReportFile(start, false);
+}
+
+void FileDeltaProcessor::ReportFile(base::TimeTicks start, bool reused) const {
+  if (!GenerationReport::Get()->enabled())
+    return;
+  GenerationReport::FileRecord record;
+  record.partition = new_part_.name;
+  record.name = name_;
+  record.blocks = new_extents_blocks_;
+  record.wall_time = base::TimeTicks::Now() - start;
+  record.operations = file_aops_.size();
+  for (const auto& aop : file_aops_)
+    record.blob_bytes += aop.op.data_length();
+  record.reused = reused;
+  GenerationReport::Get()->AddFile(std::move(record));
 }
 
 bool FileDeltaProcessor::MergeOperation(vector<AnnotatedOperation>* aops) {
@@ -488,34 +967,101 @@ bool FileDeltaProcessor::MergeOperation(vector<AnnotatedOperation>* aops) {
   return true;
 }
 
-FilesystemInterface::File GetOldFile(
-    const map<string, FilesystemInterface::File>& old_files_map,
-    const string& new_file_name) {
-  if (old_files_map.empty())
+namespace {
+
+// Calls |callback| with each distinct trigram of |name|, packed in an integer.
+template <typename Callback>
+void ForEachTrigram(const string& name, Callback callback) {
+  vector<uint32_t> trigrams;
+  for (size_t i = 0; i + 3 <= name.size(); i++) {
+    trigrams.push_back(static_cast<uint8_t>(name[i]) << 16 |
+                       static_cast<uint8_t>(name[i + 1]) << 8 |
+                       static_cast<uint8_t>(name[i + 2]));
+  }
+  std::sort(trigrams.begin(), trigrams.end());
+  trigrams.erase(std::unique(trigrams.begin(), trigrams.end()),
+                 trigrams.end());
+  for (uint32_t trigram : trigrams)
+    callback(trigram);
+}
+
+}  // namespace
+
+OldFileIndex::OldFileIndex(
+    const map<string, FilesystemInterface::File>& old_files_map)
+    : old_files_map_(old_files_map) {
+  files_.reserve(old_files_map.size());
+  for (const auto& pair : old_files_map) {
+    const uint32_t index = files_.size();
+    files_.push_back(&pair.second);
+    ForEachTrigram(pair.first, [this, index](uint32_t trigram) {
+      trigram_files_[trigram].push_back(index);
+    });
+  }
+}
+
+FilesystemInterface::File OldFileIndex::GetOldFile(
+    const string& new_file_name) const {
+  if (files_.empty())
     return {};
 
-  auto old_file_iter = old_files_map.find(new_file_name);
-  if (old_file_iter != old_files_map.end())
+  auto old_file_iter = old_files_map_.find(new_file_name);
+  if (old_file_iter != old_files_map_.end())
     return old_file_iter->second;
 
   // No old file matches the new file name. Use a similar file with the
   // shortest levenshtein distance instead.
   // This works great if the file has version number in it, but even for
   // a completely new file, using a similar file can still help.
-  int min_distance =
-      LevenshteinDistance(new_file_name, old_files_map.begin()->first);
-  const FilesystemInterface::File* old_file = &old_files_map.begin()->second;
-  for (const auto& pair : old_files_map) {
-    int distance = LevenshteinDistance(new_file_name, pair.first);
-    if (distance < min_distance) {
+  // Only the files sharing the most trigrams with the new file are compared,
+  // in the order of the map so that ties are broken like without the index.
+  std::unordered_map<uint32_t, uint32_t> shared_trigrams;
+  ForEachTrigram(new_file_name, [this, &shared_trigrams](uint32_t trigram) {
+    auto it = trigram_files_.find(trigram);
+    if (it == trigram_files_.end())
+      return;
+    for (uint32_t index : it->second)
+      shared_trigrams[index]++;
+  });
+  vector<uint32_t> candidates;
+  if (shared_trigrams.empty()) {
+    candidates.resize(files_.size());
+    std::iota(candidates.begin(), candidates.end(), 0);
+  } else {
+    vector<std::pair<uint32_t, uint32_t>> ranked(shared_trigrams.begin(),
+                                                 shared_trigrams.end());
+    const size_t num_candidates = std::min(kMaxCandidates, ranked.size());
+    std::partial_sort(
+        ranked.begin(),
+        ranked.begin() + num_candidates,
+        ranked.end(),
+        [](const auto& a, const auto& b) {
+          return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+    for (size_t i = 0; i < num_candidates; i++)
+      candidates.push_back(ranked[i].first);
+    std::sort(candidates.begin(), candidates.end());
+  }
+
+  const FilesystemInterface::File* old_file = nullptr;
+  int min_distance = 0;
+  for (uint32_t index : candidates) {
+    int distance = LevenshteinDistance(new_file_name, files_[index]->name);
+    if (!old_file || distance < min_distance) {
       min_distance = distance;
-      old_file = &pair.second;
+      old_file = files_[index];
     }
   }
   LOG(INFO) << "Using " << old_file->name << " as source for " << new_file_name;
   return *old_file;
 }
 
+FilesystemInterface::File GetOldFile(
+    const map<string, FilesystemInterface::File>& old_files_map,
+    const string& new_file_name) {
+  return OldFileIndex(old_files_map).GetOldFile(new_file_name);
+}
+
 std::vector<Extent> RemoveDuplicateBlocks(const std::vector<Extent>& extents) {
   ExtentRanges extent_set;
   std::vector<Extent> ret;
@@ -537,8 +1083,8 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                         const PayloadGenerationConfig& config,
                         BlobFileWriter* blob_file) {
   const auto& version = config.version;
-  ExtentRanges old_visited_blocks;
-  ExtentRanges new_visited_blocks;
+  BlockSet old_visited_blocks(old_part.size / kBlockSize);
+  BlockSet new_visited_blocks(new_part.size / kBlockSize);
 
   // If verity is enabled, mark those blocks as visited to skip generating
   // operations for them.
@@ -556,11 +1102,13 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
       config.OperationEnabled(InstallOperation::PUFFDIFF);
 
   TEST_AND_RETURN_FALSE(new_part.fs_interface);
-  vector<FilesystemInterface::File> new_files;
-  TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
-      new_part, &new_files, puffdiff_allowed));
+  // The target files are shared with the other payloads generated from them.
+  const auto new_files_ptr = deflate_utils::GetPartitionFiles(
+      new_part, puffdiff_allowed, config.diff_cache_dir);
+  TEST_AND_RETURN_FALSE(new_files_ptr);
+  const vector<FilesystemInterface::File>& new_files = *new_files_ptr;
 
-  ExtentRanges old_zero_blocks;
+  BlockSet old_zero_blocks;
   // Prematurely removing moved blocks will render compression info useless.
   // Even if a single block inside a 100MB file is filtered out, the entire
   // 100MB file can't be decompressed. In this case we will fallback to BSDIFF,
@@ -590,11 +1138,12 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
   if (old_part.fs_interface) {
     vector<FilesystemInterface::File> old_files;
     TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
-        old_part, &old_files, puffdiff_allowed));
+        old_part, &old_files, puffdiff_allowed, config.diff_cache_dir));
     for (const FilesystemInterface::File& file : old_files)
       old_files_map[file.name] = file;
   }
 
+  const OldFileIndex old_file_index(old_files_map);
   list<FileDeltaProcessor> file_delta_processors;
 
   // The processing is very straightforward here, we generate operations for
@@ -610,14 +1159,14 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     // handled as normal files. We also ignore blocks that were already
     // processed by a previous file.
     vector<Extent> new_file_extents =
-        FilterExtentRanges(new_file.extents, new_visited_blocks);
+        new_visited_blocks.FilterExtents(new_file.extents);
     new_visited_blocks.AddExtents(new_file_extents);
 
     if (new_file_extents.empty())
       continue;
 
     FilesystemInterface::File old_file =
-        GetOldFile(old_files_map, new_file.name);
+        old_file_index.GetOldFile(new_file.name);
     old_visited_blocks.AddExtents(old_file.extents);
 
     // TODO(b/177104308) Filtering |new_file_extents| might confuse puffdiff, as
@@ -637,8 +1186,8 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     // whatsoever.
     auto filtered_new_file = new_file;
     filtered_new_file.extents = RemoveDuplicateBlocks(new_file_extents);
-    file_delta_processors.emplace_back(old_part.path,
-                                       new_part.path,
+    file_delta_processors.emplace_back(old_part,
+                                       new_part,
                                        config,
                                        std::move(old_file),
                                        std::move(filtered_new_file),
@@ -650,12 +1199,12 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
   // blocks in the old partition as available data.
   vector<Extent> new_unvisited = {
       ExtentForRange(0, new_part.size / kBlockSize)};
-  new_unvisited = FilterExtentRanges(new_unvisited, new_visited_blocks);
+  new_unvisited = new_visited_blocks.FilterExtents(new_unvisited);
   if (!new_unvisited.empty()) {
     vector<Extent> old_unvisited;
     if (old_part.fs_interface) {
       old_unvisited.push_back(ExtentForRange(0, old_part.size / kBlockSize));
-      old_unvisited = FilterExtentRanges(old_unvisited, old_visited_blocks);
+      old_unvisited = old_visited_blocks.FilterExtents(old_unvisited);
     }
 
     LOG(INFO) << "Scanning " << utils::BlocksInExtents(new_unvisited)
@@ -668,8 +1217,8 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     old_file.extents = old_unvisited;
     File new_file;
     new_file.extents = RemoveDuplicateBlocks(new_unvisited);
-    file_delta_processors.emplace_back(old_part.path,
-                                       new_part.path,
+    file_delta_processors.emplace_back(old_part,
+                                       new_part,
                                        config,
                                        old_file,
                                        new_file,
@@ -678,21 +1227,17 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                                        blob_file);
   }
 
-  size_t max_threads = GetMaxThreads();
-
-  // Sort the files in descending order based on number of new blocks to make
-  // sure we start the largest ones first.
-  if (file_delta_processors.size() > max_threads) {
-    file_delta_processors.sort(std::greater<FileDeltaProcessor>());
-  }
-
-  base::DelegateSimpleThreadPool thread_pool("incremental-update-generator",
-                                             max_threads);
-  thread_pool.Start();
-  for (auto& processor : file_delta_processors) {
-    thread_pool.AddWork(&processor);
+  // The files are prioritized by number of new blocks to make sure we start
+  // the largest ones first, also before smaller files of other partitions.
+  {
+    GenerationReport::ScopedStage stage("diffing");
+    TaskGroup file_group;
+    for (auto& processor : file_delta_processors) {
+      file_group.Post([&processor] { processor.Run(); },
+                      processor.new_extents_blocks() * kBlockSize);
+    }
+    file_group.Wait();
   }
-  thread_pool.JoinAll();
 
   for (auto& processor : file_delta_processors) {
     TEST_AND_RETURN_FALSE(processor.MergeOperation(aops));
@@ -709,11 +1254,12 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
                              ssize_t chunk_blocks,
                              const PayloadGenerationConfig& config,
                              BlobFileWriter* blob_file,
-                             ExtentRanges* old_visited_blocks,
-                             ExtentRanges* new_visited_blocks,
-                             ExtentRanges* old_zero_blocks) {
+                             BlockSet* old_visited_blocks,
+                             BlockSet* new_visited_blocks,
+                             BlockSet* old_zero_blocks) {
   vector<BlockMapping::BlockId> old_block_ids;
   vector<BlockMapping::BlockId> new_block_ids;
+  GenerationReport::ScopedStage stage("block_mapping");
   TEST_AND_RETURN_FALSE(MapPartitionBlocks(old_part,
                                            new_part,
                                            old_num_blocks * kBlockSize,
@@ -738,17 +1284,19 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
     if (old_block_ids[block] == 0)
       old_zero_blocks->AddBlock(block);
   }
-  old_visited_blocks->AddRanges(*old_zero_blocks);
+  old_visited_blocks->AddSet(*old_zero_blocks);
 
   // The collection of blocks in the new partition with just zeros. This is a
   // common case for free-space that's also problematic for bsdiff, so we want
   // to optimize it using REPLACE_BZ operations. The blob for a REPLACE_BZ of
   // just zeros is so small that it doesn't make sense to spend the I/O reading
   // zeros from the old partition.
-  vector<Extent> new_zeros;
+  // These lists are built one block at a time, so they are kept packed until
+  // they are stored in the operations.
+  vector<BlockExtent> new_zeros;
 
-  vector<Extent> old_identical_blocks;
-  vector<Extent> new_identical_blocks;
+  vector<BlockExtent> old_identical_blocks;
+  vector<BlockExtent> new_identical_blocks;
 
   for (uint64_t block = 0; block < new_num_blocks; block++) {
     // Only produce operations for blocks that were not yet visited.
@@ -776,7 +1324,7 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
   // Produce operations for the zero blocks split per output extent.
   size_t num_ops = aops->size();
   new_visited_blocks->AddExtents(new_zeros);
-  for (const Extent& extent : new_zeros) {
+  for (const BlockExtent& extent : new_zeros) {
     if (config.OperationEnabled(InstallOperation::ZERO)) {
       for (uint64_t offset = 0; offset < extent.num_blocks();
            offset += chunk_blocks) {
@@ -793,7 +1341,7 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
       File old_file;
       File new_file;
       new_file.name = "<zeros>";
-      new_file.extents = {extent};
+      new_file.extents = {Extent(extent)};
       TEST_AND_RETURN_FALSE(DeltaReadFile(aops,
                                           "",
                                           new_part,
@@ -812,7 +1360,7 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
   uint64_t used_blocks = 0;
   old_visited_blocks->AddExtents(old_identical_blocks);
   new_visited_blocks->AddExtents(new_identical_blocks);
-  for (const Extent& extent : new_identical_blocks) {
+  for (const BlockExtent& extent : new_identical_blocks) {
     // We split the operation at the extent boundary or when bigger than
     // chunk_blocks.
     for (uint64_t op_block_offset = 0; op_block_offset < extent.num_blocks();
@@ -837,9 +1385,10 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
       Extent* op_dst_extent = aop->op.add_dst_extents();
       op_dst_extent->set_start_block(extent.start_block() + op_block_offset);
       op_dst_extent->set_num_blocks(chunk_num_blocks);
-      CHECK(
-          vector<Extent>{*op_dst_extent} ==  // NOLINT(whitespace/braces)
-          ExtentsSublist(new_identical_blocks, used_blocks, chunk_num_blocks));
+      CHECK(vector<BlockExtent>{{op_dst_extent->start_block(),  // NOLINT
+                                 op_dst_extent->num_blocks()}} ==
+            ExtentsSublist(
+                new_identical_blocks, used_blocks, chunk_num_blocks));
 
       used_blocks += chunk_num_blocks;
     }
@@ -850,21 +1399,83 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
   return true;
 }
 
-bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
-                   const std::string& old_part,
-                   const std::string& new_part,
+namespace {
+// Generates the operation for the |num_blocks| blocks of |new_file| starting
+// at |block_offset|, from the blocks at the same offset in |old_file|. The
+// data blob of the operation is stored in |data| and not written anywhere.
+bool DiffFileChunk(const PartitionConfig& old_part,
+                   const PartitionConfig& new_part,
                    const File& old_file,
                    const File& new_file,
-                   ssize_t chunk_blocks,
+                   uint64_t block_offset,
+                   uint64_t num_blocks,
                    const PayloadGenerationConfig& config,
-                   BlobFileWriter* blob_file) {
-  const auto& old_extents = old_file.extents;
-  const auto& new_extents = new_file.extents;
-  const auto& name = new_file.name;
+                   brillo::Blob* data,
+                   AnnotatedOperation* aop) {
+  // Split the old/new file in the same chunks. Note that this could drop
+  // some information from the old file used for the new chunk. If the old
+  // file is smaller (or even empty when there's no old file) the chunk will
+  // also be empty.
+  vector<Extent> old_extents_chunk =
+      ExtentsSublist(old_file.extents, block_offset, num_blocks);
+  vector<Extent> new_extents_chunk =
+      ExtentsSublist(new_file.extents, block_offset, num_blocks);
+  NormalizeExtents(&old_extents_chunk);
+  NormalizeExtents(&new_extents_chunk);
+
+  aop->name = new_file.name;
+  TEST_AND_RETURN_FALSE(ReadExtentsToDiff(old_part,
+                                          new_part,
+                                          old_extents_chunk,
+                                          new_extents_chunk,
+                                          old_file,
+                                          new_file,
+                                          config,
+                                          data,
+                                          aop));
 
+  // Check if the operation writes nothing.
+  if (aop->op.dst_extents_size() == 0) {
+    LOG(ERROR) << "Empty non-MOVE operation";
+    return false;
+  }
+  return true;
+}
+
+// The memory estimate of DiffFileChunk() for the same chunk.
+uint64_t EstimateChunkMemory(const File& old_file,
+                             uint64_t block_offset,
+                             uint64_t num_blocks,
+                             const PayloadGenerationConfig& config) {
+  const uint64_t old_blocks = utils::BlocksInExtents(old_file.extents);
+  const uint64_t old_chunk_blocks =
+      old_blocks > block_offset
+          ? std::min(num_blocks, old_blocks - block_offset)
+          : 0;
+  return EstimateDiffMemory(
+      old_chunk_blocks * kBlockSize, num_blocks * kBlockSize, config);
+}
+
+// A chunk of a file diffed ahead of DeltaReadFileChunks().
+struct DiffedChunk {
   brillo::Blob data;
+  AnnotatedOperation aop;
+};
 
-  uint64_t total_blocks = utils::BlocksInExtents(new_extents);
+// DeltaReadFile(), with the first chunks of the file taken from
+// |diffed_chunks| instead of diffing them again.
+bool DeltaReadFileChunks(std::vector<AnnotatedOperation>* aops,
+                         const PartitionConfig& old_part,
+                         const PartitionConfig& new_part,
+                         const File& old_file,
+                         const File& new_file,
+                         ssize_t chunk_blocks,
+                         const PayloadGenerationConfig& config,
+                         BlobFileWriter* blob_file,
+                         std::vector<DiffedChunk> diffed_chunks) {
+  const auto& name = new_file.name;
+
+  uint64_t total_blocks = utils::BlocksInExtents(new_file.extents);
   if (chunk_blocks == 0) {
     LOG(ERROR) << "Invalid number of chunk_blocks. Cannot be 0.";
     return false;
@@ -873,60 +1484,207 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
   if (chunk_blocks == -1)
     chunk_blocks = total_blocks;
 
-  for (uint64_t block_offset = 0; block_offset < total_blocks;
-       block_offset += chunk_blocks) {
-    // Split the old/new file in the same chunks. Note that this could drop
-    // some information from the old file used for the new chunk. If the old
-    // file is smaller (or even empty when there's no old file) the chunk will
-    // also be empty.
-    vector<Extent> old_extents_chunk =
-        ExtentsSublist(old_extents, block_offset, chunk_blocks);
-    vector<Extent> new_extents_chunk =
-        ExtentsSublist(new_extents, block_offset, chunk_blocks);
-    NormalizeExtents(&old_extents_chunk);
-    NormalizeExtents(&new_extents_chunk);
-
-    // Now, insert into the list of operations.
+  // The chunks are diffed independently of each other, so they run in
+  // parallel.
+  struct ChunkResult {
     AnnotatedOperation aop;
-    aop.name = new_file.name;
-    TEST_AND_RETURN_FALSE(ReadExtentsToDiff(old_part,
-                                            new_part,
-                                            old_extents_chunk,
-                                            new_extents_chunk,
-                                            old_file,
-                                            new_file,
-                                            config,
-                                            &data,
-                                            &aop));
+    bool succeeded = false;
+  };
+  const uint64_t num_chunks = utils::DivRoundUp(total_blocks, chunk_blocks);
+  vector<ChunkResult> chunks(num_chunks);
+  {
+    TaskGroup chunk_group;
+    for (uint64_t i = 0; i < num_chunks; i++) {
+      if (i < diffed_chunks.size()) {
+        ChunkResult* chunk = &chunks[i];
+        chunk->aop = std::move(diffed_chunks[i].aop);
+        chunk->succeeded =
+            chunk->aop.SetOperationBlob(diffed_chunks[i].data, blob_file);
+        continue;
+      }
+      const uint64_t chunk_offset = i * chunk_blocks;
+      const uint64_t chunk_size =
+          std::min<uint64_t>(chunk_blocks, total_blocks - chunk_offset);
+      chunk_group.Post(
+          [&, i] {
+            brillo::Blob data;
+            ChunkResult* chunk = &chunks[i];
+            chunk->succeeded = DiffFileChunk(old_part,
+                                             new_part,
+                                             old_file,
+                                             new_file,
+                                             i * chunk_blocks,
+                                             chunk_blocks,
+                                             config,
+                                             &data,
+                                             &chunk->aop) &&
+                               chunk->aop.SetOperationBlob(data, blob_file);
+          },
+          chunk_size * kBlockSize,
+          EstimateChunkMemory(old_file, chunk_offset, chunk_size, config));
+    }
+  }
 
-    // Check if the operation writes nothing.
-    if (aop.op.dst_extents_size() == 0) {
-      LOG(ERROR) << "Empty non-MOVE operation";
-      return false;
+  for (uint64_t i = 0; i < num_chunks; i++) {
+    TEST_AND_RETURN_FALSE(chunks[i].succeeded);
+    if (num_chunks > 1) {
+      chunks[i].aop.name = base::StringPrintf("%s:%" PRIu64, name.c_str(), i);
     }
+    aops->emplace_back(std::move(chunks[i].aop));
+  }
+  return true;
+}
+}  // namespace
 
-    if (static_cast<uint64_t>(chunk_blocks) < total_blocks) {
-      aop.name = base::StringPrintf(
-          "%s:%" PRIu64, name.c_str(), block_offset / chunk_blocks);
+bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
+                   const PartitionConfig& old_part,
+                   const PartitionConfig& new_part,
+                   const File& old_file,
+                   const File& new_file,
+                   ssize_t chunk_blocks,
+                   const PayloadGenerationConfig& config,
+                   BlobFileWriter* blob_file) {
+  return DeltaReadFileChunks(aops,
+                             old_part,
+                             new_part,
+                             old_file,
+                             new_file,
+                             chunk_blocks,
+                             config,
+                             blob_file,
+                             {});
+}
+
+bool DeltaReadFileInSegments(std::vector<AnnotatedOperation>* aops,
+                             const PartitionConfig& old_part,
+                             const PartitionConfig& new_part,
+                             const File& old_file,
+                             const File& new_file,
+                             ssize_t chunk_blocks,
+                             size_t segment_blocks,
+                             double max_size_ratio,
+                             const PayloadGenerationConfig& config,
+                             BlobFileWriter* blob_file) {
+  const uint64_t total_blocks = utils::BlocksInExtents(new_file.extents);
+  const uint64_t file_chunk_blocks =
+      chunk_blocks == -1 ? total_blocks : chunk_blocks;
+  if (segment_blocks == 0 || file_chunk_blocks < 3 * segment_blocks) {
+    return DeltaReadFile(aops,
+                         old_part,
+                         new_part,
+                         old_file,
+                         new_file,
+                         chunk_blocks,
+                         config,
+                         blob_file);
+  }
+
+  // Splitting loses the redundancy between the segments. Estimate how much by
+  // diffing the first two segments both separately and together. If the file
+  // is split, the first two are reused rather than diffed again.
+  brillo::Blob probe_data[3];
+  AnnotatedOperation probe_aops[3];
+  bool probe_succeeded[3] = {};
+  {
+    TaskGroup probe_group;
+    for (size_t i = 0; i < 3; i++) {
+      const uint64_t offset = i == 1 ? segment_blocks : 0;
+      const uint64_t num_blocks = i == 2 ? 2 * segment_blocks : segment_blocks;
+      probe_group.Post(
+          [&, i, offset, num_blocks] {
+            probe_succeeded[i] = DiffFileChunk(old_part,
+                                               new_part,
+                                               old_file,
+                                               new_file,
+                                               offset,
+                                               num_blocks,
+                                               config,
+                                               &probe_data[i],
+                                               &probe_aops[i]);
+          },
+          num_blocks * kBlockSize,
+          EstimateChunkMemory(old_file, offset, num_blocks, config));
     }
+  }
+  TEST_AND_RETURN_FALSE(probe_succeeded[0] && probe_succeeded[1] &&
+                        probe_succeeded[2]);
+  const size_t split_size = probe_data[0].size() + probe_data[1].size();
+  const size_t whole_size = probe_data[2].size();
+  if (split_size > whole_size * max_size_ratio) {
+    LOG(INFO) << "Not splitting " << new_file.name << " (" << total_blocks
+              << " blocks) in segments, two segments take " << split_size
+              << " bytes instead of " << whole_size;
+    return DeltaReadFile(aops,
+                         old_part,
+                         new_part,
+                         old_file,
+                         new_file,
+                         chunk_blocks,
+                         config,
+                         blob_file);
+  }
+  vector<DiffedChunk> diffed_segments(2);
+  for (size_t i = 0; i < diffed_segments.size(); i++) {
+    diffed_segments[i].data = std::move(probe_data[i]);
+    diffed_segments[i].aop = std::move(probe_aops[i]);
+  }
+  return DeltaReadFileChunks(aops,
+                             old_part,
+                             new_part,
+                             old_file,
+                             new_file,
+                             segment_blocks,
+                             config,
+                             blob_file,
+                             std::move(diffed_segments));
+}
 
-    // Write the data
-    TEST_AND_RETURN_FALSE(aop.SetOperationBlob(data, blob_file));
-    aops->emplace_back(aop);
+uint32_t ReplaceCodecPredictor::GetDataClass(std::string_view data) {
+  const std::string_view kElfMagic("\x7f"
+                                   "ELF");
+  const bool is_elf = data.substr(0, kElfMagic.size()) == kElfMagic;
+  uint32_t size_log2 = 0;
+  while ((data.size() >> size_log2) > 1)
+    size_log2++;
+  return (size_log2 << 1) | is_elf;
+}
+
+InstallOperation::Type ReplaceCodecPredictor::Predict(
+    std::string_view new_data) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = streaks_.find(GetDataClass(new_data));
+  if (it == streaks_.end() || it->second.length < min_streak_)
+    return InstallOperation::REPLACE;
+  return it->second.type;
+}
+
+void ReplaceCodecPredictor::Record(std::string_view new_data,
+                                   InstallOperation::Type type) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Streak& streak = streaks_[GetDataClass(new_data)];
+  if (type != InstallOperation::REPLACE_XZ &&
+      type != InstallOperation::REPLACE_BZ) {
+    // Random data can't be told apart from the rest by its class, so a
+    // REPLACE only breaks the streak.
+    streak = {InstallOperation::REPLACE, 0};
+  } else if (streak.type == type) {
+    streak.length++;
+  } else {
+    streak = {type, 1};
   }
-  return true;
 }
 
-bool GenerateBestFullOperation(const brillo::Blob& new_data,
+bool GenerateBestFullOperation(std::string_view new_data,
                                const PayloadVersion& version,
                                brillo::Blob* out_blob,
-                               InstallOperation::Type* out_type) {
+                               InstallOperation::Type* out_type,
+                               ReplaceCodecPredictor* predictor,
+                               const ZstdDictionary* zstd_dictionary) {
   if (new_data.empty())
     return false;
 
   if (version.OperationAllowed(InstallOperation::ZERO) &&
-      std::all_of(
-          new_data.begin(), new_data.end(), [](uint8_t x) { return x == 0; })) {
+      utils::IsZeroBuffer(new_data)) {
     // The read buffer is all zeros, so produce a ZERO operation. No need to
     // check other types of operations in this case.
     *out_blob = brillo::Blob();
@@ -934,30 +1692,52 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
     return true;
   }
 
-  bool out_blob_set = false;
-
-  // Try compressing |new_data| with xz first.
-  if (version.OperationAllowed(InstallOperation::REPLACE_XZ)) {
-    brillo::Blob new_data_xz;
-    if (XzCompress(new_data, &new_data_xz) && !new_data_xz.empty()) {
-      *out_type = InstallOperation::REPLACE_XZ;
-      *out_blob = std::move(new_data_xz);
-      out_blob_set = true;
+  bool try_xz = version.OperationAllowed(InstallOperation::REPLACE_XZ);
+  bool try_bz = version.OperationAllowed(InstallOperation::REPLACE_BZ);
+  if (predictor && try_xz && try_bz) {
+    const InstallOperation::Type predicted = predictor->Predict(new_data);
+    if (predicted != InstallOperation::REPLACE) {
+      try_xz = predicted == InstallOperation::REPLACE_XZ;
+      try_bz = predicted == InstallOperation::REPLACE_BZ;
     }
   }
 
-  // Try compressing it with bzip2.
-  if (version.OperationAllowed(InstallOperation::REPLACE_BZ)) {
-    brillo::Blob new_data_bz;
-    // TODO(deymo): Implement some heuristic to determine if it is worth trying
-    // to compress the blob with bzip2 if we already have a good REPLACE_XZ.
-    if (BzipCompress(new_data, &new_data_bz) && !new_data_bz.empty() &&
-        (!out_blob_set || out_blob->size() > new_data_bz.size())) {
-      // A REPLACE_BZ is better or nothing else was set.
-      *out_type = InstallOperation::REPLACE_BZ;
-      *out_blob = std::move(new_data_bz);
-      out_blob_set = true;
-    }
+  brillo::Blob new_data_xz;
+  bool xz_set = false;
+  auto compress_xz = [&new_data, &new_data_xz, &xz_set] {
+    xz_set = XzCompress(new_data, &new_data_xz) && !new_data_xz.empty();
+  };
+  brillo::Blob new_data_bz;
+  bool bz_set = false;
+  auto compress_bz = [&new_data, &new_data_bz, &bz_set] {
+    bz_set = BzipCompress(new_data, &new_data_bz) && !new_data_bz.empty();
+  };
+  if (try_xz && try_bz && new_data.size() >= kMinConcurrentCompressSize) {
+    // Run bzip2 on another thread while this one runs xz.
+    TaskGroup compress_group;
+    compress_group.Post(compress_bz);
+    compress_xz();
+    compress_group.Wait();
+  } else {
+    if (try_xz)
+      compress_xz();
+    if (try_bz)
+      compress_bz();
+  }
+
+  bool out_blob_set = false;
+
+  // Prefer xz over bzip2 when both are the same size.
+  if (xz_set) {
+    *out_type = InstallOperation::REPLACE_XZ;
+    *out_blob = std::move(new_data_xz);
+    out_blob_set = true;
+  }
+  if (bz_set && (!out_blob_set || out_blob->size() > new_data_bz.size())) {
+    // A REPLACE_BZ is better or nothing else was set.
+    *out_type = InstallOperation::REPLACE_BZ;
+    *out_blob = std::move(new_data_bz);
+    out_blob_set = true;
   }
 
   // If nothing else worked or it was badly compressed we try a REPLACE.
@@ -966,7 +1746,31 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
     // This needs to make a copy of the data in the case bzip or xz didn't
     // compress well, which is not the common case so the performance hit is
     // low.
-    *out_blob = new_data;
+    out_blob->assign(new_data.begin(), new_data.end());
+  }
+  // Only what won against all the codecs says something about the class.
+  if (predictor && try_xz && try_bz)
+    predictor->Record(new_data, *out_type);
+
+  // zstd compresses less than xz, but decompresses about ten times faster, so
+  // it is picked whenever that saves more apply time than the larger blob
+  // takes to download. Against the dictionary of the partition, it often
+  // compresses small blobs better than xz.
+  static const ApplyCostProfile kDefaultProfile;
+  brillo::Blob new_data_zstd;
+  if (version.OperationAllowed(InstallOperation::REPLACE_ZSTD) &&
+      ZstdCompress(new_data, &new_data_zstd, zstd_dictionary) &&
+      !new_data_zstd.empty() &&
+      OperationSeconds(kDefaultProfile,
+                       InstallOperation::REPLACE_ZSTD,
+                       new_data_zstd.size(),
+                       new_data.size()) <
+          OperationSeconds(kDefaultProfile,
+                           *out_type,
+                           out_blob->size(),
+                           new_data.size())) {
+    *out_type = InstallOperation::REPLACE_ZSTD;
+    *out_blob = std::move(new_data_zstd);
   }
   return true;
 }
@@ -984,6 +1788,10 @@ bool PopulateXorOps(AnnotatedOperation* aop, const uint8_t* data, size_t size) {
   size_t total_xor_blocks = 0;
   const auto new_file_size =
       utils::BlocksInExtents(aop->op.dst_extents()) * kBlockSize;
+  const ExtentBlockIndex src_index(aop->op.src_extents());
+  const ExtentBlockIndex dst_index(aop->op.dst_extents());
+  // The ranges of each control entry, merged once they are all known.
+  vector<XorRange> ranges;
   while (new_off < new_file_size) {
     if (!patch_reader.ParseControlEntry(&entry)) {
       LOG(ERROR)
@@ -993,29 +1801,28 @@ bool PopulateXorOps(AnnotatedOperation* aop, const uint8_t* data, size_t size) {
       return false;
     }
     if (old_off >= 0) {
-      auto dst_off_aligned = utils::RoundUp(new_off, kBlockSize);
+      const auto dst_off_aligned = utils::RoundUp(new_off, kBlockSize);
       const auto skip = dst_off_aligned - new_off;
-      auto src_off = old_off + skip;
+      const auto src_off = old_off + skip;
       const size_t chunk_size =
           entry.diff_size - std::min(skip, entry.diff_size);
-      const auto xor_blocks = (chunk_size + kBlockSize / 2) / kBlockSize;
-      total_xor_blocks += xor_blocks;
       // Append chunk_size/kBlockSize number of XOR blocks, subject to rounding
       // rules: if decimal part of that division is >= 0.5, round up.
-      for (size_t i = 0; i < xor_blocks; i++) {
-        AppendXorBlock(
-            &xor_ops,
-            GetNthBlock(aop->op.src_extents(), src_off / kBlockSize),
-            GetNthBlock(aop->op.dst_extents(), dst_off_aligned / kBlockSize),
-            src_off % kBlockSize);
-        src_off += kBlockSize;
-        dst_off_aligned += kBlockSize;
-      }
+      const auto xor_blocks = (chunk_size + kBlockSize / 2) / kBlockSize;
+      total_xor_blocks += xor_blocks;
+      AppendXorRanges(src_index,
+                      dst_index,
+                      src_off / kBlockSize,
+                      dst_off_aligned / kBlockSize,
+                      xor_blocks,
+                      src_off % kBlockSize,
+                      &ranges);
     }
 
     old_off += entry.diff_size + entry.offset_increment;
     new_off += entry.diff_size + entry.extra_size;
   }
+  MergeXorRanges(ranges, &xor_ops);
 
   for (auto& op : xor_ops) {
     CHECK_EQ(op.src_extent().num_blocks(), op.dst_extent().num_blocks());
@@ -1046,6 +1853,30 @@ bool ReadExtentsToDiff(const string& old_part,
                        const PayloadGenerationConfig& config,
                        brillo::Blob* out_data,
                        AnnotatedOperation* out_op) {
+  PartitionConfig old_config("");
+  old_config.path = old_part;
+  PartitionConfig new_config("");
+  new_config.path = new_part;
+  return ReadExtentsToDiff(old_config,
+                           new_config,
+                           src_extents,
+                           dst_extents,
+                           old_file,
+                           new_file,
+                           config,
+                           out_data,
+                           out_op);
+}
+
+bool ReadExtentsToDiff(const PartitionConfig& old_part,
+                       const PartitionConfig& new_part,
+                       const vector<Extent>& src_extents,
+                       const vector<Extent>& dst_extents,
+                       const File& old_file,
+                       const File& new_file,
+                       const PayloadGenerationConfig& config,
+                       brillo::Blob* out_data,
+                       AnnotatedOperation* out_op) {
   const auto& version = config.version;
   AnnotatedOperation& aop = *out_op;
   InstallOperation& operation = aop.op;
@@ -1058,41 +1889,43 @@ bool ReadExtentsToDiff(const string& old_part,
   StoreExtents(dst_extents, operation.mutable_dst_extents());
 
   // Read in bytes from new data.
-  brillo::Blob new_data;
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(new_part,
-                                           dst_extents,
-                                           &new_data,
-                                           kBlockSize * blocks_to_write,
-                                           kBlockSize));
+  brillo::Blob new_buffer;
+  std::string_view new_data;
+  TEST_AND_RETURN_FALSE(
+      ReadPartitionExtents(new_part, dst_extents, &new_buffer, &new_data));
   TEST_AND_RETURN_FALSE(!new_data.empty());
 
+  brillo::Blob old_buffer;
+  std::string_view old_data;
+  if (blocks_to_read > 0) {
+    TEST_AND_RETURN_FALSE(
+        ReadPartitionExtents(old_part, src_extents, &old_buffer, &old_data));
+  }
+
   // Data blob that will be written to delta file.
   brillo::Blob data_blob;
 
-  // Try generating a full operation for the given new data, regardless of the
-  // old_data.
-  InstallOperation::Type op_type;
-  TEST_AND_RETURN_FALSE(
-      GenerateBestFullOperation(new_data, version, &data_blob, &op_type));
-  operation.set_type(op_type);
-
-  if (blocks_to_read > 0) {
-    brillo::Blob old_data;
-    // Read old data.
-    TEST_AND_RETURN_FALSE(utils::ReadExtents(old_part,
-                                             src_extents,
-                                             &old_data,
-                                             kBlockSize * blocks_to_read,
-                                             kBlockSize));
-    if (old_data == new_data) {
-      // No change in data.
-      operation.set_type(InstallOperation::SOURCE_COPY);
-      data_blob = brillo::Blob();
-    } else if (IsDiffOperationBetter(
-                   operation, data_blob.size(), 0, src_extents.size())) {
-      // No point in trying diff if zero blob size diff operation is
-      // still worse than replace.
-
+  if (blocks_to_read > 0 && old_data == new_data) {
+    // No change in data.
+    operation.set_type(InstallOperation::SOURCE_COPY);
+  } else {
+    // Try generating a full operation for the given new data, regardless of
+    // the old_data.
+    InstallOperation::Type op_type;
+    TEST_AND_RETURN_FALSE(
+        GenerateBestFullOperation(new_data,
+                                  version,
+                                  &data_blob,
+                                  &op_type,
+                                  nullptr,
+                                  new_part.zstd_dictionary.get()));
+    operation.set_type(op_type);
+
+    // No point in trying diff if zero blob size diff operation is still worse
+    // than replace.
+    if (blocks_to_read > 0 &&
+        IsDiffOperationBetter(
+            operation, data_blob.size(), 0, src_extents.size())) {
       BestDiffGenerator best_diff_generator(old_data,
                                             new_data,
                                             src_extents,
@@ -1100,6 +1933,7 @@ bool ReadExtentsToDiff(const string& old_part,
                                             old_file,
                                             new_file,
                                             config);
+      best_diff_generator.SetImagePaths(old_part.path, new_part.path);
       if (!best_diff_generator.GenerateBestDiffOperation(&aop, &data_blob)) {
         LOG(INFO) << "Failed to generate diff for " << new_file.name;
         return false;
@@ -1134,10 +1968,37 @@ bool ReadExtentsToDiff(const string& old_part,
   return true;
 }
 
+std::shared_ptr<const ZstdDictionary> TrainZstdDictionary(
+    const PartitionConfig& part) {
+  const uint64_t num_blocks = part.size / kBlockSize;
+  const uint64_t num_samples = std::min(
+      kZstdDictionaryMaxSamples, num_blocks / kZstdDictionarySampleBlocks);
+  vector<brillo::Blob> samples;
+  for (uint64_t i = 0; i < num_samples; i++) {
+    const vector<Extent> extents = {ExtentForRange(
+        i * num_blocks / num_samples, kZstdDictionarySampleBlocks)};
+    brillo::Blob buffer;
+    std::string_view data;
+    if (!ReadPartitionExtents(part, extents, &buffer, &data))
+      return nullptr;
+    if (!utils::IsZeroBuffer(data))
+      samples.emplace_back(data.begin(), data.end());
+  }
+  std::shared_ptr<const ZstdDictionary> dictionary =
+      ZstdDictionary::Train(samples, kZstdDictionarySize);
+  if (dictionary) {
+    LOG(INFO) << "Trained a zstd dictionary of " << dictionary->data().size()
+              << " bytes on " << samples.size() << " samples of partition "
+              << part.name;
+  }
+  return dictionary;
+}
+
 bool IsAReplaceOperation(InstallOperation::Type op_type) {
   return (op_type == InstallOperation::REPLACE ||
           op_type == InstallOperation::REPLACE_BZ ||
-          op_type == InstallOperation::REPLACE_XZ);
+          op_type == InstallOperation::REPLACE_XZ ||
+          op_type == InstallOperation::REPLACE_ZSTD);
 }
 
 bool IsNoSourceOperation(InstallOperation::Type op_type) {
@@ -1158,6 +2019,112 @@ bool InitializePartitionInfo(const PartitionConfig& part, PartitionInfo* info) {
   return true;
 }
 
+namespace {
+// The shortest run of zeroed blocks worth marking as unused, 1 MiB.
+constexpr uint64_t kMinUnusedExtentBlocks = 256;
+}  // namespace
+
+bool FindUnusedExtents(const PartitionConfig& part,
+                       vector<Extent>* unused_extents) {
+  unused_extents->clear();
+  if (!part.fs_interface)
+    return true;
+  const uint64_t num_blocks = part.size / kBlockSize;
+  const uint64_t fs_end_block = utils::DivRoundUp(
+      part.fs_interface->GetBlockCount() * part.fs_interface->GetBlockSize(),
+      kBlockSize);
+  if (fs_end_block >= num_blocks)
+    return true;
+
+  ExtentRanges candidates;
+  candidates.AddExtent(ExtentForRange(fs_end_block, num_blocks - fs_end_block));
+  for (const Extent& extent : {part.verity.hash_tree_data_extent,
+                               part.verity.hash_tree_extent,
+                               part.verity.fec_data_extent,
+                               part.verity.fec_extent}) {
+    candidates.SubtractExtent(extent);
+  }
+
+  brillo::Blob buffer;
+  vector<BlockExtent> zero_extents;
+  for (const auto& candidate : candidates.extent_set()) {
+    for (uint64_t block = candidate.start_block();
+         block < candidate.end_block();
+         block += kMinUnusedExtentBlocks) {
+      const uint64_t count =
+          std::min(kMinUnusedExtentBlocks, candidate.end_block() - block);
+      std::string_view data;
+      TEST_AND_RETURN_FALSE(ReadPartitionExtents(
+          part, {ExtentForRange(block, count)}, &buffer, &data));
+      for (uint64_t i = 0; i < count; i++) {
+        const auto block_data = data.substr(i * kBlockSize, kBlockSize);
+        if (std::all_of(block_data.begin(), block_data.end(), [](char c) {
+              return c == 0;
+            }))
+          AppendBlockToExtents(&zero_extents, block + i);
+      }
+    }
+  }
+  for (const BlockExtent& extent : zero_extents) {
+    if (extent.num_blocks() >= kMinUnusedExtentBlocks)
+      unused_extents->push_back(extent);
+  }
+  LOG_IF(INFO, !unused_extents->empty())
+      << part.name << ": " << utils::BlocksInExtents(*unused_extents)
+      << " unused blocks " << ExtentsToString(*unused_extents);
+  return true;
+}
+
+bool HashPartitionWithoutExtents(const PartitionConfig& part,
+                                 const vector<Extent>& extents,
+                                 brillo::Blob* hash) {
+  ExtentRanges used;
+  used.AddExtent(ExtentForRange(0, part.size / kBlockSize));
+  used.SubtractExtents(extents);
+  HashCalculator hasher;
+  brillo::Blob buffer;
+  for (const auto& extent : used.extent_set()) {
+    for (uint64_t block = extent.start_block(); block < extent.end_block();
+         block += kMinUnusedExtentBlocks) {
+      const uint64_t count =
+          std::min(kMinUnusedExtentBlocks, extent.end_block() - block);
+      std::string_view data;
+      TEST_AND_RETURN_FALSE(ReadPartitionExtents(
+          part, {ExtentForRange(block, count)}, &buffer, &data));
+      TEST_AND_RETURN_FALSE(hasher.Update(data.data(), data.size()));
+    }
+  }
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  *hash = hasher.raw_hash();
+  return true;
+}
+
+bool HashOperationTargets(const PartitionConfig& part,
+                          vector<AnnotatedOperation>* aops) {
+  brillo::Blob buffer;
+  for (AnnotatedOperation& aop : *aops) {
+    if (aop.op.dst_extents().empty())
+      continue;
+    HashCalculator hasher;
+    for (const auto& extent : aop.op.dst_extents()) {
+      const uint64_t end_block = extent.start_block() + extent.num_blocks();
+      for (uint64_t block = extent.start_block(); block < end_block;
+           block += kMinUnusedExtentBlocks) {
+        const uint64_t count =
+            std::min(kMinUnusedExtentBlocks, end_block - block);
+        std::string_view data;
+        TEST_AND_RETURN_FALSE(ReadPartitionExtents(
+            part, {ExtentForRange(block, count)}, &buffer, &data));
+        TEST_AND_RETURN_FALSE(hasher.Update(data.data(), data.size()));
+      }
+    }
+    TEST_AND_RETURN_FALSE(hasher.Finalize());
+    const brillo::Blob& hash = hasher.raw_hash();
+    aop.op.set_dst_sha256_hash(hash.data(), hash.size());
+  }
+  return true;
+}
+
 bool CompareAopsByDestination(AnnotatedOperation first_aop,
                               AnnotatedOperation second_aop) {
   // We want empty operations to be at the end of the payload.
@@ -1169,6 +2136,110 @@ bool CompareAopsByDestination(AnnotatedOperation first_aop,
   return first_dst_start < second_dst_start;
 }
 
+namespace {
+struct OperationCost {
+  // The estimated seconds to download the blob and to apply the operation.
+  double download;
+  double apply;
+};
+
+OperationCost EstimateOperationCost(const InstallOperation& op,
+                                    const ApplyCostProfile& profile) {
+  const uint64_t dst_bytes =
+      utils::BlocksInExtents(op.dst_extents()) * kBlockSize;
+  return {profile.DownloadSeconds(op.data_length()),
+          profile.ApplySeconds(op.type(), dst_bytes)};
+}
+}  // namespace
+
+void OrderOperationsByApplyCost(vector<AnnotatedOperation>* aops,
+                                const ApplyCostProfile& profile) {
+  vector<OperationCost> costs;
+  costs.reserve(aops->size());
+  for (const AnnotatedOperation& aop : *aops)
+    costs.push_back(EstimateOperationCost(aop.op, profile));
+
+  // Split the operations as in Johnson's rule for a two stage flow shop. The
+  // ones applying slower than they download, shortest download first, and the
+  // others, longest apply first. Ties keep the destination order.
+  vector<size_t> apply_bound, download_bound;
+  for (size_t i = 0; i < aops->size(); i++) {
+    (costs[i].download < costs[i].apply ? apply_bound : download_bound)
+        .push_back(i);
+  }
+  std::stable_sort(
+      apply_bound.begin(), apply_bound.end(), [&costs](size_t a, size_t b) {
+        return costs[a].download < costs[b].download;
+      });
+  std::stable_sort(download_bound.begin(),
+                   download_bound.end(),
+                   [&costs](size_t a, size_t b) {
+                     return costs[a].apply > costs[b].apply;
+                   });
+
+  // The client only buffers a few operations ahead of the apply, so instead
+  // of running all of |apply_bound| first, interleave the two lists: take from
+  // |apply_bound| when the apply would be idle by the time the next blob is
+  // downloaded, and from |download_bound| while the apply is busy.
+  vector<AnnotatedOperation> ordered;
+  ordered.reserve(aops->size());
+  double download_done = 0, apply_done = 0;
+  auto next_apply = apply_bound.begin();
+  auto next_download = download_bound.begin();
+  while (next_apply != apply_bound.end() ||
+         next_download != download_bound.end()) {
+    size_t index;
+    if (next_download == download_bound.end() ||
+        (next_apply != apply_bound.end() &&
+         download_done + costs[*next_apply].download >= apply_done)) {
+      index = *next_apply++;
+    } else {
+      index = *next_download++;
+    }
+    download_done += costs[index].download;
+    apply_done = std::max(apply_done, download_done) + costs[index].apply;
+    ordered.push_back(std::move((*aops)[index]));
+  }
+  LOG(INFO) << "Estimated apply time of " << aops->size()
+            << " operations ordered by apply cost: " << apply_done << "s";
+  *aops = std::move(ordered);
+}
+
+PartitionApplyCost EstimateApplyCost(const PartitionUpdate& partition,
+                                     const ApplyCostProfile& profile) {
+  PartitionApplyCost cost;
+  double apply_seconds = 0;
+  for (const InstallOperation& op : partition.operations()) {
+    const uint64_t dst_bytes =
+        utils::BlocksInExtents(op.dst_extents()) * kBlockSize;
+    switch (op.type()) {
+      case InstallOperation::DISCARD:
+        continue;
+      case InstallOperation::REPLACE_BZ:
+      case InstallOperation::REPLACE_XZ:
+      case InstallOperation::REPLACE_ZSTD:
+        cost.set_decompressed_bytes(cost.decompressed_bytes() + dst_bytes);
+        break;
+      case InstallOperation::SOURCE_BSDIFF:
+      case InstallOperation::BROTLI_BSDIFF:
+      case InstallOperation::PUFFDIFF:
+      case InstallOperation::ZUCCHINI:
+      case InstallOperation::LZ4DIFF_BSDIFF:
+      case InstallOperation::LZ4DIFF_PUFFDIFF:
+        cost.set_diff_bytes(cost.diff_bytes() + dst_bytes);
+        break;
+      default:
+        break;
+    }
+    cost.set_bytes_read(cost.bytes_read() +
+                        utils::BlocksInExtents(op.src_extents()) * kBlockSize);
+    cost.set_bytes_written(cost.bytes_written() + dst_bytes);
+    apply_seconds += EstimateOperationCost(op, profile).apply;
+  }
+  cost.set_apply_time_ms(static_cast<uint64_t>(apply_seconds * 1000));
+  return cost;
+}
+
 bool IsExtFilesystem(const string& device) {
   brillo::Blob header;
   // See include/linux/ext2_fs.h for more details on the structure. We obtain
@@ -1212,6 +2283,40 @@ size_t GetMaxThreads() {
   return std::max(sysconf(_SC_NPROCESSORS_ONLN), 4L);
 }
 
+uint64_t EstimateDiffMemory(uint64_t old_bytes,
+                            uint64_t new_bytes,
+                            const PayloadGenerationConfig& config) {
+  // The data read, and the full operation compressed with two codecs.
+  const uint64_t base_memory = old_bytes + 3 * new_bytes;
+  if (old_bytes == 0) {
+    return base_memory;
+  }
+  const uint64_t input_bytes = std::max(old_bytes, new_bytes);
+  std::vector<uint64_t> candidates;
+  if (config.OperationEnabled(InstallOperation::SOURCE_BSDIFF) &&
+      input_bytes <= kMaxBsdiffDestinationSize) {
+    // The suffix array of the old data, and the patch.
+    candidates.push_back(8 * old_bytes + new_bytes);
+  }
+  if (config.OperationEnabled(InstallOperation::PUFFDIFF) &&
+      input_bytes <= kMaxPuffdiffDestinationSize) {
+    // Bsdiff of the puffed data, a few times larger than the deflated one.
+    candidates.push_back(4 * (8 * old_bytes + new_bytes));
+  }
+  if (config.OperationEnabled(InstallOperation::ZUCCHINI) &&
+      input_bytes <= kMaxZucchiniDestinationSize) {
+    candidates.push_back(12 * (old_bytes + new_bytes));
+  }
+  uint64_t diff_memory = 0;
+  for (uint64_t candidate : candidates) {
+    // The candidates run concurrently for small inputs.
+    diff_memory = input_bytes <= kMaxConcurrentDiffInputSize
+                      ? diff_memory + candidate
+                      : std::max(diff_memory, candidate);
+  }
+  return base_memory + diff_memory;
+}
+
 }  // namespace diff_utils
 
 }  // namespace chromeos_update_engine
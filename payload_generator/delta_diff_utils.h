@@ -18,16 +18,25 @@
 #define PAYLOAD_GENERATOR_DELTA_DIFF_UTILS_H_
 
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include <base/macros.h>
 #include <brillo/secure_blob.h>
 #include <puffin/puffdiff.h>
 
 #include "payload_generator/deflate_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/lz4diff/lz4diff.h"
 #include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/block_set.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/generation_report.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -72,27 +81,44 @@ bool DeltaMovedAndZeroBlocks(std::vector<AnnotatedOperation>* aops,
                              ssize_t chunk_blocks,
                              const PayloadGenerationConfig& version,
                              BlobFileWriter* blob_file,
-                             ExtentRanges* old_visited_blocks,
-                             ExtentRanges* new_visited_blocks,
-                             ExtentRanges* old_zero_blocks);
+                             BlockSet* old_visited_blocks,
+                             BlockSet* new_visited_blocks,
+                             BlockSet* old_zero_blocks);
 
 // For a given file |name| append operations to |aops| to produce it in the
 // |new_part|. The file will be split in chunks of |chunk_blocks| blocks each
-// or treated as a single chunk if |chunk_blocks| is -1. The file data is
+// or treated as a single chunk if |chunk_blocks| is -1, the chunks are diffed
+// in parallel. The file data is
 // stored in |new_part| in the blocks described by |new_extents| and, if it
 // exists, the old version exists in |old_part| in the blocks described by
 // |old_extents|. The operations added to |aops| reference the data blob
 // in the |blob_file|. |old_deflates| and |new_deflates| are all deflate
 // locations in |old_part| and |new_part|. Returns true on success.
 bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
-                   const std::string& old_part,
-                   const std::string& new_part,
+                   const PartitionConfig& old_part,
+                   const PartitionConfig& new_part,
                    const File& old_file,
                    const File& new_file,
                    ssize_t chunk_blocks,
                    const PayloadGenerationConfig& config,
                    BlobFileWriter* blob_file);
 
+// Like DeltaReadFile(), but splits the chunks of |chunk_blocks| blocks further
+// in segments of |segment_blocks| blocks, which are diffed in parallel. Only
+// done if diffing two segments separately produces at most |max_size_ratio|
+// times the data of diffing them together, since the redundancy between the
+// segments is lost. A |segment_blocks| of 0 disables splitting.
+bool DeltaReadFileInSegments(std::vector<AnnotatedOperation>* aops,
+                             const PartitionConfig& old_part,
+                             const PartitionConfig& new_part,
+                             const File& old_file,
+                             const File& new_file,
+                             ssize_t chunk_blocks,
+                             size_t segment_blocks,
+                             double max_size_ratio,
+                             const PayloadGenerationConfig& config,
+                             BlobFileWriter* blob_file);
+
 // Reads the blocks |old_extents| from |old_part| (if it exists) and the
 // |new_extents| from |new_part| and determines the smallest way to encode
 // this |new_extents| for the diff. It stores necessary data in |out_data| and
@@ -113,14 +139,83 @@ bool ReadExtentsToDiff(const std::string& old_part,
                        brillo::Blob* out_data,
                        AnnotatedOperation* out_op);
 
+// Same, but reads the blocks through the |image| of the partitions when they
+// are mapped, which doesn't copy them unless they are fragmented.
+bool ReadExtentsToDiff(const PartitionConfig& old_part,
+                       const PartitionConfig& new_part,
+                       const std::vector<Extent>& old_extents,
+                       const std::vector<Extent>& new_extents,
+                       const File& old_file,
+                       const File& new_file,
+                       const PayloadGenerationConfig& config,
+                       brillo::Blob* out_data,
+                       AnnotatedOperation* out_op);
+
+// Remembers which codec GenerateBestFullOperation() picked for each class of
+// data, so that blobs of a class that picked the same codec for the last
+// |min_streak| blobs only try that codec. Thread-safe. Since what was seen
+// before depends on the thread timing, the operations aren't reproducible
+// across runs.
+class ReplaceCodecPredictor {
+ public:
+  explicit ReplaceCodecPredictor(size_t min_streak) : min_streak_(min_streak) {}
+
+  // Returns the codec to only try for |new_data|, or REPLACE if all of them
+  // should be tried.
+  InstallOperation::Type Predict(std::string_view new_data) const;
+  // Records that |type| was the best operation for |new_data|.
+  void Record(std::string_view new_data, InstallOperation::Type type);
+
+ private:
+  struct Streak {
+    InstallOperation::Type type;
+    size_t length;
+  };
+  // The class of |data|: whether it is an ELF file and its size magnitude.
+  static uint32_t GetDataClass(std::string_view data);
+
+  const size_t min_streak_;
+  mutable std::mutex mutex_;
+  std::map<uint32_t, Streak> streaks_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReplaceCodecPredictor);
+};
+
 // Generates the best allowed full operation to produce |new_data|. The allowed
 // operations are based on |payload_version|. The operation blob will be stored
 // in |out_blob| and the resulting operation type in |out_type|. Returns whether
-// a valid full operation was generated.
-bool GenerateBestFullOperation(const brillo::Blob& new_data,
-                               const PayloadVersion& version,
-                               brillo::Blob* out_blob,
-                               InstallOperation::Type* out_type);
+// a valid full operation was generated. If |predictor| is not null, only the
+// codec it predicts is tried when it has one. A REPLACE_ZSTD, when allowed,
+// replaces the smallest operation if it is estimated to download and apply
+// faster. It is compressed against |zstd_dictionary|, if not null.
+bool GenerateBestFullOperation(
+    std::string_view new_data,
+    const PayloadVersion& version,
+    brillo::Blob* out_blob,
+    InstallOperation::Type* out_type,
+    ReplaceCodecPredictor* predictor = nullptr,
+    const ZstdDictionary* zstd_dictionary = nullptr);
+
+inline bool GenerateBestFullOperation(
+    const brillo::Blob& new_data,
+    const PayloadVersion& version,
+    brillo::Blob* out_blob,
+    InstallOperation::Type* out_type,
+    ReplaceCodecPredictor* predictor = nullptr,
+    const ZstdDictionary* zstd_dictionary = nullptr) {
+  return GenerateBestFullOperation(ToStringView(new_data),
+                                   version,
+                                   out_blob,
+                                   out_type,
+                                   predictor,
+                                   zstd_dictionary);
+}
+
+// Trains the zstd dictionary of |part| on evenly spaced samples of its blocks,
+// leaving out the zeroed ones. Returns null if there aren't enough to train
+// one on.
+std::shared_ptr<const ZstdDictionary> TrainZstdDictionary(
+    const PartitionConfig& part);
 
 // Returns whether |op_type| is one of the REPLACE full operations.
 bool IsAReplaceOperation(InstallOperation::Type op_type);
@@ -131,11 +226,44 @@ bool IsNoSourceOperation(InstallOperation::Type op_type);
 bool InitializePartitionInfo(const PartitionConfig& partition,
                              PartitionInfo* info);
 
+// Stores in |unused_extents| the runs of zeroed blocks of |part| past the end
+// of its filesystem and outside of its verity data, which the device doesn't
+// need to write nor hash. See PartitionUpdate.unused_extents.
+bool FindUnusedExtents(const PartitionConfig& part,
+                       std::vector<Extent>* unused_extents);
+
+// Stores in |hash| the hash of |part| with the blocks of the sorted, disjoint
+// |extents| left out.
+bool HashPartitionWithoutExtents(const PartitionConfig& part,
+                                 const std::vector<Extent>& extents,
+                                 brillo::Blob* hash);
+
+// Sets the dst_sha256_hash of each of the |aops| writing blocks to the hash
+// of its dst_extents in |part|.
+bool HashOperationTargets(const PartitionConfig& part,
+                          std::vector<AnnotatedOperation>* aops);
+
 // Compare two AnnotatedOperations by the start block of the first Extent in
 // their destination extents.
 bool CompareAopsByDestination(AnnotatedOperation first_aop,
                               AnnotatedOperation second_aop);
 
+// Reorders |aops|, which the client applies in order while downloading their
+// blobs in the same order, so that the download of the blobs keeps going while
+// the CPU-heavy operations are applied. The client has to apply the operations
+// in the background (pipelined apply) for this to pay off. The estimated
+// download and apply times of every operation on the devices of |profile|
+// pick the next one greedily:
+// an operation cheap to download but expensive to apply whenever the apply
+// would otherwise wait for data, one expensive to download otherwise.
+void OrderOperationsByApplyCost(std::vector<AnnotatedOperation>* aops,
+                                const ApplyCostProfile& profile);
+
+// Returns the estimated cost for the devices of |profile| to apply the
+// operations of |partition|.
+PartitionApplyCost EstimateApplyCost(const PartitionUpdate& partition,
+                                     const ApplyCostProfile& profile);
+
 // Returns whether the filesystem is an ext[234] filesystem. In case of failure,
 // such as if the file |device| doesn't exists or can't be read, it returns
 // false.
@@ -144,8 +272,43 @@ bool IsExtFilesystem(const std::string& device);
 // Returns the max number of threads to process the files(chunks) in parallel.
 size_t GetMaxThreads();
 
+// Returns a rough estimate of the most memory, in bytes, generating the
+// operation of |new_bytes| of new data from |old_bytes| of old data takes with
+// the diff algorithms enabled in |config|.
+uint64_t EstimateDiffMemory(uint64_t old_bytes,
+                            uint64_t new_bytes,
+                            const PayloadGenerationConfig& config);
+
+// An index of the names of the old files by their trigrams, the 3 characters
+// substrings, to find the old files named like a new file without computing
+// the levenshtein distance to every one of them. |old_files_map| must outlive
+// the index.
+class OldFileIndex {
+ public:
+  explicit OldFileIndex(
+      const std::map<std::string, FilesystemInterface::File>& old_files_map);
+
+  // Returns the old file named |new_file_name| if any. Otherwise, returns the
+  // old file which name has the shortest levenshtein distance to it among the
+  // |kMaxCandidates| ones sharing the most trigrams with it, or among all
+  // the old files if none shares any.
+  FilesystemInterface::File GetOldFile(const std::string& new_file_name) const;
+
+  static constexpr size_t kMaxCandidates = 32;
+
+ private:
+  const std::map<std::string, FilesystemInterface::File>& old_files_map_;
+  // The old files, in the order of |old_files_map_|.
+  std::vector<const FilesystemInterface::File*> files_;
+  // The indexes in |files_| of the files with each trigram in their name.
+  std::unordered_map<uint32_t, std::vector<uint32_t>> trigram_files_;
+
+  DISALLOW_COPY_AND_ASSIGN(OldFileIndex);
+};
+
 // Returns the old file which file name has the shortest levenshtein distance to
-// |new_file_name|.
+// |new_file_name|, looked up in an OldFileIndex of |old_files_map|. Build an
+// OldFileIndex instead to look up many file names.
 FilesystemInterface::File GetOldFile(
     const std::map<std::string, FilesystemInterface::File>& old_files_map,
     const std::string& new_file_name);
@@ -164,6 +327,14 @@ inline bool PopulateXorOps(AnnotatedOperation* aop,
 
 class BestDiffGenerator {
  public:
+  // |old_data| and |new_data| must outlive the generator.
+  BestDiffGenerator(std::string_view old_data,
+                    std::string_view new_data,
+                    const std::vector<Extent>& src_extents,
+                    const std::vector<Extent>& dst_extents,
+                    const File& old_file,
+                    const File& new_file,
+                    const PayloadGenerationConfig& config);
   BestDiffGenerator(const brillo::Blob& old_data,
                     const brillo::Blob& new_data,
                     const std::vector<Extent>& src_extents,
@@ -171,39 +342,18 @@ class BestDiffGenerator {
                     const File& old_file,
                     const File& new_file,
                     const PayloadGenerationConfig& config)
-      : old_data_(old_data),
-        new_data_(new_data),
-        src_extents_(src_extents),
-        dst_extents_(dst_extents),
-        old_deflates_(old_file.deflates),
-        new_deflates_(new_file.deflates),
-        old_block_info_(old_file.compressed_file_info),
-        new_block_info_(new_file.compressed_file_info),
-        config_(config) {
-    using std::vector;
-    // Find all deflate positions inside the given extents and then put all
-    // deflates together because we have already read all the extents into
-    // one buffer.
-    vector<puffin::BitExtent> src_deflates;
-    TEST_AND_RETURN(deflate_utils::FindAndCompactDeflates(
-        src_extents_, old_deflates_, &src_deflates));
-
-    vector<puffin::BitExtent> dst_deflates;
-    TEST_AND_RETURN(deflate_utils::FindAndCompactDeflates(
-        dst_extents_, new_deflates_, &dst_deflates));
-    puffin::RemoveEqualBitExtents(
-        old_data_, new_data_, &src_deflates, &dst_deflates);
-    // See crbug.com/915559.
-    if (config.version.minor <= kPuffdiffMinorPayloadVersion) {
-      CHECK(
-          puffin::RemoveDeflatesWithBadDistanceCaches(old_data, &src_deflates));
-
-      CHECK(
-          puffin::RemoveDeflatesWithBadDistanceCaches(new_data, &dst_deflates));
-    }
-    old_deflates_ = std::move(src_deflates);
-    new_deflates_ = std::move(dst_deflates);
-  }
+      : BestDiffGenerator(ToStringView(old_data),
+                          ToStringView(new_data),
+                          src_extents,
+                          dst_extents,
+                          old_file,
+                          new_file,
+                          config) {}
+
+  // Reuses the decoded forms of the old and new data, like the decompressed
+  // LZ4 files, from the DecodedDataCache for the diffs of the same extents of
+  // the images at |old_path| and |new_path|.
+  void SetImagePaths(const std::string& old_path, const std::string& new_path);
 
   // Tries different algorithms and compares their patch sizes with the
   // compressed full operation data in |data_blob|. If the size is smaller,
@@ -211,6 +361,11 @@ class BestDiffGenerator {
   bool GenerateBestDiffOperation(AnnotatedOperation* aop,
                                  brillo::Blob* data_blob);
 
+  // Same, but only with the algorithms in |diff_candidates|, each skipped for
+  // data larger than its size limit. If the config has a |diff_cache_dir|,
+  // the result is looked up there first and stored there after. A result
+  // missing from another diff shard than the config's is left to that shard,
+  // keeping the full operation.
   bool GenerateBestDiffOperation(
       const std::vector<std::pair<InstallOperation_Type, size_t>>&
           diff_candidates,
@@ -218,17 +373,39 @@ class BestDiffGenerator {
       brillo::Blob* data_blob);
 
  private:
+  bool TryDiffCandidates(
+      const std::vector<std::pair<InstallOperation_Type, size_t>>&
+          diff_candidates,
+      AnnotatedOperation* aop,
+      brillo::Blob* data_blob);
+  // Hashes everything the result of GenerateBestDiffOperation() depends on.
+  brillo::Blob GetDiffCacheKey(
+      const std::vector<std::pair<InstallOperation_Type, size_t>>&
+          diff_candidates,
+      const AnnotatedOperation& aop,
+      const brillo::Blob& data_blob) const;
+  // The report of the diff of this chunk, which ended with |aop| and
+  // |data_blob|, without its attempts.
+  GenerationReport::DiffRecord NewDiffRecord(
+      const AnnotatedOperation& aop, const brillo::Blob& data_blob) const;
   std::vector<bsdiff::CompressorType> GetUsableCompressorTypes() const;
-  bool TryBsdiffAndUpdateOperation(InstallOperation_Type operation_type,
-                                   AnnotatedOperation* aop,
-                                   brillo::Blob* data_blob);
-  bool TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
-                                     brillo::Blob* data_blob);
-  bool TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
-                                     brillo::Blob* data_blob);
-
-  const brillo::Blob& old_data_;
-  const brillo::Blob& new_data_;
+  // Returns whether |operation_type| can give a useful patch for the data of
+  // |aop|, without running it.
+  bool IsCandidateUseful(InstallOperation_Type operation_type,
+                         const AnnotatedOperation& aop) const;
+  // Generate the patch of one diff algorithm into |patch|. These only read
+  // the members, so the candidates can run concurrently.
+  bool GenerateBsdiffPatch(InstallOperation_Type operation_type,
+                           brillo::Blob* patch) const;
+  bool GeneratePuffdiffPatch(brillo::Blob* patch) const;
+  bool GenerateZucchiniPatch(brillo::Blob* patch) const;
+
+  const std::string_view old_data_;
+  const std::string_view new_data_;
+  // Copies of the data for puffin, which only reads from buffers. Only made
+  // when the data has deflates.
+  brillo::Blob old_deflate_data_;
+  brillo::Blob new_deflate_data_;
   const std::vector<Extent>& src_extents_;
   const std::vector<Extent>& dst_extents_;
   std::vector<puffin::BitExtent> old_deflates_;
@@ -236,6 +413,8 @@ class BestDiffGenerator {
   const CompressedFile& old_block_info_;
   const CompressedFile& new_block_info_;
   const PayloadGenerationConfig& config_;
+  // Empty unless SetImagePaths() was called.
+  Lz4DiffCacheKeys lz4_cache_keys_;
 };
 
 }  // namespace diff_utils
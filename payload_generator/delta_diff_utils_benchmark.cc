@@ -0,0 +1,232 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Measures the diff algorithms of BestDiffGenerator and Lz4Diff on single
+// files, and the whole delta generation of the ext2 sample image.
+
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/lz4diff/lz4diff.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/ab_generator.h"
+#include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/erofs_filesystem.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+
+// Returns the directory of the benchmark binary, where its data files are.
+base::FilePath GetDataDir() {
+  base::FilePath exe_path;
+  base::ReadSymbolicLink(base::FilePath("/proc/self/exe"), &exe_path);
+  return exe_path.DirName();
+}
+
+// A file of |size| bytes of text-like data: runs copied from earlier in the
+// file mixed with random bytes of a small alphabet.
+brillo::Blob MakeFile(size_t size, std::mt19937* rng) {
+  brillo::Blob data;
+  data.reserve(size);
+  while (data.size() < size) {
+    const size_t run = 16 + (*rng)() % 240;
+    if (data.size() > run && (*rng)() % 2) {
+      const size_t from = (*rng)() % (data.size() - run);
+      for (size_t i = 0; i < run; i++) {
+        data.push_back(data[from + i]);
+      }
+    } else {
+      for (size_t i = 0; i < run; i++) {
+        data.push_back('a' + (*rng)() % 32);
+      }
+    }
+  }
+  data.resize(size);
+  return data;
+}
+
+// The next version of |source|: a few bytes changed in a quarter of the
+// blocks, and some bytes inserted in the middle.
+brillo::Blob MutateFile(const brillo::Blob& source, std::mt19937* rng) {
+  brillo::Blob target = source;
+  for (size_t block = 0; block < target.size() / kBlockSize; block += 4) {
+    for (size_t i = 0; i < 16; i++) {
+      target[block * kBlockSize + (*rng)() % kBlockSize] = (*rng)();
+    }
+  }
+  const brillo::Blob inserted = MakeFile(1000, rng);
+  target.insert(
+      target.begin() + target.size() / 2, inserted.begin(), inserted.end());
+  target.resize(source.size());
+  return target;
+}
+
+// Argument: the size of the file in KiB.
+void BM_BestDiff(benchmark::State& state,
+                 InstallOperation::Type type,
+                 const char* name) {
+  std::mt19937 rng(type);
+  const size_t size = state.range(0) * 1024;
+  const brillo::Blob source = MakeFile(size, &rng);
+  const brillo::Blob target = MutateFile(source, &rng);
+  const std::vector<Extent> extents{ExtentForRange(0, size / kBlockSize)};
+  FilesystemInterface::File old_file, new_file;
+  new_file.name = name;
+  const PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kMaxSupportedMinorPayloadVersion)};
+  size_t blob_size = 0;
+  for (auto _ : state) {
+    diff_utils::BestDiffGenerator generator(
+        source, target, extents, extents, old_file, new_file, config);
+    AnnotatedOperation aop;
+    aop.op.set_type(InstallOperation::REPLACE);
+    brillo::Blob blob = target;
+    CHECK(generator.GenerateBestDiffOperation(
+        {{type, std::numeric_limits<size_t>::max()}}, &aop, &blob));
+    if (aop.op.type() != type) {
+      state.SkipWithError("The diff wasn't picked");
+      return;
+    }
+    blob_size = blob.size();
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+  state.counters["blob_size"] = blob_size;
+}
+// Zucchini is only tried on some file extensions.
+BENCHMARK_CAPTURE(BM_BestDiff, Bsdiff, InstallOperation::SOURCE_BSDIFF, "f")
+    ->ArgName("kib")
+    ->RangeMultiplier(4)
+    ->Range(256, 4096)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_BestDiff,
+                  BrotliBsdiff,
+                  InstallOperation::BROTLI_BSDIFF,
+                  "f")
+    ->ArgName("kib")
+    ->RangeMultiplier(4)
+    ->Range(256, 4096)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_BestDiff, Zucchini, InstallOperation::ZUCCHINI, "f.so")
+    ->ArgName("kib")
+    ->RangeMultiplier(4)
+    ->Range(256, 4096)
+    ->Unit(benchmark::kMillisecond);
+
+// Reads the data of |name| in the erofs image |path|, with its compression
+// details.
+bool ReadErofsFile(const std::string& path,
+                   const std::string& name,
+                   brillo::Blob* data,
+                   CompressedFile* info) {
+  auto fs = ErofsFilesystem::CreateFromFile(path);
+  TEST_AND_RETURN_FALSE(fs != nullptr);
+  std::vector<FilesystemInterface::File> files;
+  TEST_AND_RETURN_FALSE(fs->GetFiles(&files));
+  const auto it = std::find_if(files.begin(), files.end(), [&name](auto& f) {
+    return f.name == name;
+  });
+  TEST_AND_RETURN_FALSE(it != files.end());
+  *info = it->compressed_file_info;
+  return utils::ReadExtents(path, it->extents, data, kBlockSize);
+}
+
+// Diffs the LZ4 compressed delta_generator of the EROFS images of the
+// unittests, recompressed at another level.
+void BM_Lz4Diff(benchmark::State& state) {
+  const base::FilePath dir = GetDataDir();
+  brillo::Blob source, target;
+  CompressedFile old_info, new_info;
+  if (!ReadErofsFile(dir.Append("gen/erofs.img").value(),
+                     "/delta_generator",
+                     &source,
+                     &old_info) ||
+      !ReadErofsFile(dir.Append("gen/erofs_new.img").value(),
+                     "/delta_generator",
+                     &target,
+                     &new_info)) {
+    state.SkipWithError("Unable to read the EROFS images");
+    return;
+  }
+  new_info.mutable_algo()->set_level(5);
+  brillo::Blob blob;
+  for (auto _ : state) {
+    CHECK(Lz4Diff(source, target, old_info, new_info, &blob));
+  }
+  state.SetBytesProcessed(state.iterations() * target.size());
+  state.counters["blob_size"] = blob.size();
+}
+BENCHMARK(BM_Lz4Diff)->Unit(benchmark::kMillisecond);
+
+bool OpenPartition(const base::FilePath& path, PartitionConfig* part) {
+  part->path = path.value();
+  const off_t size = utils::FileSize(part->path);
+  TEST_AND_RETURN_FALSE(size > 0);
+  part->size = size;
+  return part->OpenFilesystem();
+}
+
+// Generates the operations of the ext2 sample image of the unittests from its
+// empty version, on the TaskScheduler shared by the process like in
+// delta_generator.
+void BM_GenerateOperationsExt2(benchmark::State& state) {
+  const base::FilePath dir = GetDataDir();
+  PartitionConfig old_part("system"), new_part("system");
+  if (!OpenPartition(dir.Append("gen/disk_ext2_4k_empty.img"), &old_part) ||
+      !OpenPartition(dir.Append("gen/disk_ext2_4k.img"), &new_part)) {
+    state.SkipWithError("Unable to open the sample images");
+    return;
+  }
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kMaxSupportedMinorPayloadVersion)};
+  config.is_delta = true;
+  size_t num_operations = 0;
+  for (auto _ : state) {
+    ScopedTempFile blob_file("generate_operations_bench.XXXXXX", true);
+    off_t blob_file_size = 0;
+    BlobFileWriter blob_file_writer(blob_file.fd(), &blob_file_size);
+    std::vector<AnnotatedOperation> aops;
+    CHECK(ABGenerator().GenerateOperations(
+        config, old_part, new_part, &blob_file_writer, &aops));
+    num_operations = aops.size();
+  }
+  state.SetBytesProcessed(state.iterations() * new_part.size);
+  state.counters["operations"] = num_operations;
+}
+BENCHMARK(BM_GenerateOperationsExt2)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
@@ -21,19 +21,23 @@
 #include <string>
 #include <vector>
 
+#include <base/files/file_enumerator.h>
 #include <base/files/scoped_file.h>
+#include <base/files/scoped_temp_dir.h>
 #include <base/format_macros.h>
 #include <base/strings/stringprintf.h>
 #include <bsdiff/patch_writer.h>
 #include <gtest/gtest.h>
 
 #include "payload_generator/filesystem_interface.h"
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/fake_filesystem.h"
+#include "update_engine/payload_generator/zstd.h"
 
 using std::string;
 using std::vector;
@@ -128,7 +132,7 @@ class DeltaDiffUtilsTest : public ::testing::Test {
                                   uint32_t minor_version) {
     BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
     PayloadVersion version(kBrilloMajorPayloadVersion, minor_version);
-    ExtentRanges old_zero_blocks;
+    BlockSet old_zero_blocks;
     return diff_utils::DeltaMovedAndZeroBlocks(&aops_,
                                                old_part_.path,
                                                new_part_.path,
@@ -157,8 +161,8 @@ class DeltaDiffUtilsTest : public ::testing::Test {
 
   // Default input/output arguments used when calling DeltaMovedAndZeroBlocks().
   vector<AnnotatedOperation> aops_;
-  ExtentRanges old_visited_blocks_;
-  ExtentRanges new_visited_blocks_;
+  BlockSet old_visited_blocks_;
+  BlockSet new_visited_blocks_;
 };
 
 TEST_F(DeltaDiffUtilsTest, SkipVerityExtentsTest) {
@@ -176,9 +180,9 @@ TEST_F(DeltaDiffUtilsTest, SkipVerityExtentsTest) {
                                  kVerityMinorPayloadVersion)},
       &blob_file));
   for (const auto& aop : aops_) {
-    new_visited_blocks_.AddRepeatedExtents(aop.op.dst_extents());
+    new_visited_blocks_.AddExtents(aop.op.dst_extents());
   }
-  for (const auto& extent : new_visited_blocks_.extent_set()) {
+  for (const auto& extent : new_visited_blocks_.GetExtents()) {
     ASSERT_FALSE(ExtentRanges::ExtentsOverlap(
         extent, new_part_.verity.hash_tree_extent));
     ASSERT_FALSE(
@@ -186,6 +190,41 @@ TEST_F(DeltaDiffUtilsTest, SkipVerityExtentsTest) {
   }
 }
 
+TEST_F(DeltaDiffUtilsTest, FindUnusedExtentsTest) {
+  const uint64_t num_blocks = 2048;
+  new_part_.size = num_blocks * block_size_;
+  new_part_.fs_interface.reset(new FakeFilesystem(block_size_, 512));
+  new_part_.verity.hash_tree_extent = ExtentForRange(512, 8);
+  brillo::Blob data(new_part_.size);
+  std::fill_n(data.begin(), 512 * block_size_, 'f');
+  data[1000 * block_size_] = 'x';
+  data[2047 * block_size_ + 10] = 'x';
+  ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path, data));
+
+  vector<Extent> unused_extents;
+  ASSERT_TRUE(diff_utils::FindUnusedExtents(new_part_, &unused_extents));
+  EXPECT_EQ((vector<Extent>{ExtentForRange(520, 480),
+                            ExtentForRange(1001, 1046)}),
+            unused_extents);
+
+  brillo::Blob hash;
+  ASSERT_TRUE(diff_utils::HashPartitionWithoutExtents(
+      new_part_, unused_extents, &hash));
+  brillo::Blob used_data(data.begin(), data.begin() + 520 * block_size_);
+  used_data.insert(used_data.end(),
+                   data.begin() + 1000 * block_size_,
+                   data.begin() + 1001 * block_size_);
+  used_data.insert(used_data.end(), data.end() - block_size_, data.end());
+  brillo::Blob expected_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(used_data, &expected_hash));
+  EXPECT_EQ(expected_hash, hash);
+
+  // The filesystem spans the whole partition.
+  new_part_.fs_interface.reset(new FakeFilesystem(block_size_, num_blocks));
+  ASSERT_TRUE(diff_utils::FindUnusedExtents(new_part_, &unused_extents));
+  EXPECT_TRUE(unused_extents.empty());
+}
+
 TEST_F(DeltaDiffUtilsTest, ReplaceSmallTest) {
   // The old file is on a different block than the new one.
   vector<Extent> old_extents = {ExtentForRange(1, 1)};
@@ -345,6 +384,38 @@ TEST_F(DeltaDiffUtilsTest, BrotliBsdiffTest) {
   ASSERT_EQ(InstallOperation::BROTLI_BSDIFF, op.type());
 }
 
+TEST_F(DeltaDiffUtilsTest, MinimizeApplyTimeTest) {
+  // The same setup as SourceBsdiffTest, on devices much slower to patch.
+  brillo::Blob data_blob(kBlockSize);
+  test_utils::FillWithData(&data_blob);
+  vector<Extent> old_extents = {ExtentForRange(1, 1)};
+  vector<Extent> new_extents = {ExtentForRange(2, 1)};
+  ASSERT_TRUE(WriteExtents(old_part_.path, old_extents, kBlockSize, data_blob));
+  data_blob[0]++;
+  ASSERT_TRUE(WriteExtents(new_part_.path, new_extents, kBlockSize, data_blob));
+
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kSourceMinorPayloadVersion),
+      .minimize_apply_time = true};
+  brillo::KeyValueStore store;
+  store.SetString("SOURCE_BSDIFF", "1000");
+  ASSERT_TRUE(config.apply_cost_profile.Load(store));
+
+  brillo::Blob data;
+  AnnotatedOperation aop;
+  ASSERT_TRUE(diff_utils::ReadExtentsToDiff(old_part_.path,
+                                            new_part_.path,
+                                            old_extents,
+                                            new_extents,
+                                            {},  // old_file
+                                            {},  // new_file
+                                            config,
+                                            &data,
+                                            &aop));
+  EXPECT_TRUE(diff_utils::IsAReplaceOperation(aop.op.type()));
+}
+
 TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_Zucchini) {
   // Makes sure SOURCE_BSDIFF operations are emitted whenever src_ops_allowed
   // is true. It is the same setup as BsdiffSmallTest, which checks
@@ -433,6 +504,103 @@ TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_FullOperationBetter) {
   ASSERT_EQ(InstallOperation::REPLACE_XZ, op.type());
 }
 
+TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_DiffShardTest) {
+  brillo::Blob dst_data_blob(kBlockSize);
+  test_utils::FillWithData(&dst_data_blob);
+  brillo::Blob src_data_blob = dst_data_blob;
+  src_data_blob[0]++;
+  vector<Extent> old_extents = {ExtentForRange(1, 1)};
+  vector<Extent> new_extents = {ExtentForRange(2, 1)};
+
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  const FilesystemInterface::File empty;
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kZucchiniMinorPayloadVersion)};
+  config.diff_cache_dir = cache_dir.GetPath().value();
+  auto generate = [&](uint32_t shard_index, uint32_t shard_count) {
+    config.diff_shard_index = shard_index;
+    config.diff_shard_count = shard_count;
+    brillo::Blob data = dst_data_blob;  // Fake the full operation
+    AnnotatedOperation aop;
+    aop.name = "data.so";
+    aop.op.set_type(InstallOperation::REPLACE);
+    diff_utils::BestDiffGenerator best_diff_generator(src_data_blob,
+                                                      dst_data_blob,
+                                                      old_extents,
+                                                      new_extents,
+                                                      empty,
+                                                      empty,
+                                                      config);
+    EXPECT_TRUE(best_diff_generator.GenerateBestDiffOperation(
+        {{InstallOperation::ZUCCHINI, 1024 * 1024}}, &aop, &data));
+    return aop.op.type();
+  };
+
+  // Only one of the shards runs the diff, the other keeps the full operation.
+  const InstallOperation::Type shard0 = generate(0, 2);
+  const InstallOperation::Type shard1 = generate(1, 2);
+  EXPECT_NE(shard0, shard1);
+  EXPECT_TRUE(shard0 == InstallOperation::ZUCCHINI ||
+              shard1 == InstallOperation::ZUCCHINI);
+  // The diff is then found in the cache, by all the shards.
+  EXPECT_EQ(InstallOperation::ZUCCHINI, generate(0, 2));
+  EXPECT_EQ(InstallOperation::ZUCCHINI, generate(1, 2));
+  EXPECT_EQ(InstallOperation::ZUCCHINI, generate(0, 1));
+}
+
+TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_ZucchiniCacheTest) {
+  brillo::Blob dst_data_blob(kBlockSize);
+  test_utils::FillWithData(&dst_data_blob);
+  brillo::Blob src_data_blob = dst_data_blob;
+  src_data_blob[0]++;
+  vector<Extent> old_extents = {ExtentForRange(1, 1)};
+  vector<Extent> new_extents = {ExtentForRange(2, 1)};
+
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  const FilesystemInterface::File empty;
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kZucchiniMinorPayloadVersion)};
+  config.diff_cache_dir = cache_dir.GetPath().value();
+  auto generate = [&]() {
+    brillo::Blob data = dst_data_blob;  // Fake the full operation
+    AnnotatedOperation aop;
+    aop.name = "data.so";
+    aop.op.set_type(InstallOperation::REPLACE);
+    diff_utils::BestDiffGenerator best_diff_generator(src_data_blob,
+                                                      dst_data_blob,
+                                                      old_extents,
+                                                      new_extents,
+                                                      empty,
+                                                      empty,
+                                                      config);
+    EXPECT_TRUE(best_diff_generator.GenerateBestDiffOperation(
+        {{InstallOperation::ZUCCHINI, 1024 * 1024}}, &aop, &data));
+    EXPECT_EQ(InstallOperation::ZUCCHINI, aop.op.type());
+    return data;
+  };
+  auto count_entries = [&cache_dir] {
+    size_t entries = 0;
+    base::FileEnumerator enumerator(
+        cache_dir.GetPath(), false, base::FileEnumerator::FILES);
+    for (auto path = enumerator.Next(); !path.empty(); path = enumerator.Next())
+      entries++;
+    return entries;
+  };
+
+  // The operation and the zucchini patch are both cached.
+  const brillo::Blob patch = generate();
+  EXPECT_EQ(2u, count_entries());
+  // Other bsdiff compressors make another operation, with the same zucchini
+  // patch.
+  config.compressors = {bsdiff::CompressorType::kBZ2};
+  EXPECT_EQ(patch, generate());
+  EXPECT_EQ(3u, count_entries());
+}
+
 TEST_F(DeltaDiffUtilsTest, PreferReplaceTest) {
   brillo::Blob data_blob(kBlockSize);
   vector<Extent> extents = {ExtentForRange(1, 1)};
@@ -512,8 +680,8 @@ TEST_F(DeltaDiffUtilsTest, IdenticalBlocksAreCopiedFromSource) {
   expected_ranges.AddExtent(ExtentForRange(0, 50));
   expected_ranges.SubtractExtents(different_blocks);
 
-  ASSERT_EQ(expected_ranges.extent_set(), old_visited_blocks_.extent_set());
-  ASSERT_EQ(expected_ranges.extent_set(), new_visited_blocks_.extent_set());
+  ASSERT_EQ(expected_ranges.extent_set(), old_visited_blocks_.GetExtents());
+  ASSERT_EQ(expected_ranges.extent_set(), new_visited_blocks_.GetExtents());
   ASSERT_EQ(0, blob_size_);
 
   // We expect all the blocks that we didn't override with |different_blocks|
@@ -605,14 +773,12 @@ TEST_F(DeltaDiffUtilsTest, ZeroBlocksUseReplaceBz) {
                                          kSourceMinorPayloadVersion));
 
   // Zeroed blocks from |old_visited_blocks_| were copied over.
-  ASSERT_EQ(old_zeros,
-            old_visited_blocks_.GetExtentsForBlockCount(
-                old_visited_blocks_.blocks()));
+  const auto old_visited = old_visited_blocks_.GetExtents();
+  ASSERT_EQ(old_zeros, vector<Extent>(old_visited.begin(), old_visited.end()));
 
   // All the new zeroed blocks should be used with REPLACE_BZ.
-  ASSERT_EQ(new_zeros,
-            new_visited_blocks_.GetExtentsForBlockCount(
-                new_visited_blocks_.blocks()));
+  const auto new_visited = new_visited_blocks_.GetExtents();
+  ASSERT_EQ(new_zeros, vector<Extent>(new_visited.begin(), new_visited.end()));
 
   vector<Extent> expected_op_extents = {
       ExtentForRange(10, 1),
@@ -675,6 +841,85 @@ TEST_F(DeltaDiffUtilsTest, ShuffledBlocksAreTracked) {
   ASSERT_EQ(0, blob_size_);
 }
 
+TEST_F(DeltaDiffUtilsTest, DeltaReadFileKeepsChunkOrderTest) {
+  brillo::Blob data_blob(12 * kBlockSize);
+  std::mt19937 gen(12345);
+  std::generate(data_blob.begin(), data_blob.end(), gen);
+  FilesystemInterface::File new_file;
+  new_file.name = "file";
+  new_file.extents = {ExtentForRange(20, 5), ExtentForRange(10, 7)};
+  ASSERT_TRUE(
+      WriteExtents(new_part_.path, new_file.extents, kBlockSize, data_blob));
+
+  BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
+  ASSERT_TRUE(diff_utils::DeltaReadFile(
+      &aops_,
+      old_part_,
+      new_part_,
+      {},
+      new_file,
+      4,
+      {.version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                 kSourceMinorPayloadVersion)},
+      &blob_file));
+  ASSERT_EQ(3u, aops_.size());
+  for (size_t i = 0; i < aops_.size(); i++) {
+    EXPECT_EQ(base::StringPrintf("file:%" PRIuS, i), aops_[i].name);
+  }
+  EXPECT_EQ(ExtentForRange(20, 4), aops_[0].op.dst_extents(0));
+  EXPECT_EQ(ExtentForRange(24, 1), aops_[1].op.dst_extents(0));
+  EXPECT_EQ(ExtentForRange(10, 3), aops_[1].op.dst_extents(1));
+  EXPECT_EQ(ExtentForRange(13, 4), aops_[2].op.dst_extents(0));
+}
+
+TEST_F(DeltaDiffUtilsTest, DeltaReadFileInSegmentsTest) {
+  // The second segment repeats the first one, which can only be found when
+  // diffing them together.
+  brillo::Blob data_blob(12 * kBlockSize);
+  std::mt19937 gen(12345);
+  std::generate(data_blob.begin(), data_blob.end(), gen);
+  std::copy(data_blob.begin(),
+            data_blob.begin() + 3 * kBlockSize,
+            data_blob.begin() + 3 * kBlockSize);
+  FilesystemInterface::File new_file;
+  new_file.name = "file";
+  new_file.extents = {ExtentForRange(10, 12)};
+  ASSERT_TRUE(
+      WriteExtents(new_part_.path, new_file.extents, kBlockSize, data_blob));
+  const PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kMaxSupportedMinorPayloadVersion)};
+
+  BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
+  ASSERT_TRUE(diff_utils::DeltaReadFileInSegments(&aops_,
+                                                  old_part_,
+                                                  new_part_,
+                                                  {},
+                                                  new_file,
+                                                  -1,
+                                                  3,
+                                                  100.0,
+                                                  config,
+                                                  &blob_file));
+  ASSERT_EQ(4u, aops_.size());
+  EXPECT_EQ(ExtentForRange(19, 3), aops_[3].op.dst_extents(0));
+
+  // Splitting doubles the size of the first two segments.
+  aops_.clear();
+  ASSERT_TRUE(diff_utils::DeltaReadFileInSegments(&aops_,
+                                                  old_part_,
+                                                  new_part_,
+                                                  {},
+                                                  new_file,
+                                                  -1,
+                                                  3,
+                                                  1.5,
+                                                  config,
+                                                  &blob_file));
+  ASSERT_EQ(1u, aops_.size());
+  EXPECT_EQ(ExtentForRange(10, 12), aops_[0].op.dst_extents(0));
+}
+
 TEST_F(DeltaDiffUtilsTest, IsExtFilesystemTest) {
   ASSERT_TRUE(diff_utils::IsExtFilesystem(
       test_utils::GetBuildArtifactsPath("gen/disk_ext2_1k.img")));
@@ -725,6 +970,28 @@ TEST_F(DeltaDiffUtilsTest, GetOldFileTest) {
   ASSERT_EQ(diff_utils::GetOldFile(old_files_map, "a").name, "filename");
 }
 
+TEST_F(DeltaDiffUtilsTest, OldFileIndexTest) {
+  std::map<string, FilesystemInterface::File> old_files_map;
+  for (int i = 0; i < 1000; i++) {
+    FilesystemInterface::File file;
+    file.name = base::StringPrintf("app/App%d/App%d.apk", i, i);
+    old_files_map.emplace(file.name, file);
+  }
+  FilesystemInterface::File file;
+  file.name = "lib/libupdate_engine.so.1";
+  old_files_map.emplace(file.name, file);
+  diff_utils::OldFileIndex index(old_files_map);
+
+  EXPECT_EQ(index.GetOldFile("app/App42/App42.apk").name,
+            "app/App42/App42.apk");
+  EXPECT_EQ(index.GetOldFile("lib/libupdate_engine.so.2").name,
+            "lib/libupdate_engine.so.1");
+  EXPECT_EQ(index.GetOldFile("app/App123x/App123x.apk").name,
+            "app/App123/App123.apk");
+  // Without any trigram in common, all the old files are compared.
+  EXPECT_EQ(index.GetOldFile("z").name, "app/App0/App0.apk");
+}
+
 TEST_F(DeltaDiffUtilsTest, XorOpsSourceNotAligned) {
   ScopedTempFile patch_file;
   bsdiff::BsdiffPatchWriter writer{patch_file.path()};
@@ -845,4 +1112,215 @@ TEST_F(DeltaDiffUtilsTest, XorOpsStrided) {
   ASSERT_EQ(aop.xor_ops[3].dst_extent().start_block(), 702UL);
 }
 
+TEST_F(DeltaDiffUtilsTest, XorOpsMergedAcrossEntries) {
+  ScopedTempFile patch_file;
+  bsdiff::BsdiffPatchWriter writer{patch_file.path()};
+  ASSERT_TRUE(writer.Init(kBlockSize * 10));
+  ASSERT_TRUE(writer.AddControlEntry(ControlEntry(kBlockSize * 2, 0, 0)));
+  ASSERT_TRUE(writer.AddControlEntry(ControlEntry(kBlockSize * 3, 0, 0)));
+  ASSERT_TRUE(writer.AddControlEntry(ControlEntry(kBlockSize * 3, 0, 0)));
+  ASSERT_TRUE(writer.Close());
+
+  std::string patch_data;
+  utils::ReadFile(patch_file.path(), &patch_data);
+
+  AnnotatedOperation aop;
+  *aop.op.add_src_extents() = ExtentForRange(50, 4);
+  *aop.op.add_src_extents() = ExtentForRange(60, 4);
+  *aop.op.add_dst_extents() = ExtentForRange(500, 8);
+
+  ASSERT_TRUE(diff_utils::PopulateXorOps(
+      &aop,
+      reinterpret_cast<const uint8_t*>(patch_data.data()),
+      patch_data.size()));
+  // The entries are contiguous, only the source extents split them.
+  ASSERT_EQ(aop.xor_ops.size(), 2UL);
+  EXPECT_EQ(aop.xor_ops[0].src_extent(), ExtentForRange(50, 4));
+  EXPECT_EQ(aop.xor_ops[0].dst_extent(), ExtentForRange(500, 4));
+  EXPECT_EQ(aop.xor_ops[1].src_extent(), ExtentForRange(60, 4));
+  EXPECT_EQ(aop.xor_ops[1].dst_extent(), ExtentForRange(504, 4));
+  for (const auto& op : aop.xor_ops) {
+    EXPECT_EQ(op.type(), CowMergeOperation::COW_XOR);
+    EXPECT_EQ(op.src_offset(), 0UL);
+  }
+}
+
+TEST_F(DeltaDiffUtilsTest, ReplaceCodecPredictorTest) {
+  diff_utils::ReplaceCodecPredictor predictor(2);
+  const std::string data(kBlockSize, 'a');
+  std::string elf_data = data;
+  elf_data.replace(0, 4, "\x7f"
+                         "ELF");
+
+  EXPECT_EQ(InstallOperation::REPLACE, predictor.Predict(data));
+  predictor.Record(data, InstallOperation::REPLACE_XZ);
+  EXPECT_EQ(InstallOperation::REPLACE, predictor.Predict(data));
+  predictor.Record(data, InstallOperation::REPLACE_XZ);
+  EXPECT_EQ(InstallOperation::REPLACE_XZ, predictor.Predict(data));
+  // Other kinds of data have their own streak.
+  EXPECT_EQ(InstallOperation::REPLACE, predictor.Predict(elf_data));
+  EXPECT_EQ(InstallOperation::REPLACE,
+            predictor.Predict(std::string(4 * kBlockSize, 'a')));
+
+  predictor.Record(data, InstallOperation::REPLACE_BZ);
+  EXPECT_EQ(InstallOperation::REPLACE, predictor.Predict(data));
+  predictor.Record(data, InstallOperation::REPLACE_BZ);
+  predictor.Record(data, InstallOperation::REPLACE_BZ);
+  EXPECT_EQ(InstallOperation::REPLACE_BZ, predictor.Predict(data));
+  predictor.Record(data, InstallOperation::REPLACE);
+  EXPECT_EQ(InstallOperation::REPLACE, predictor.Predict(data));
+}
+
+TEST_F(DeltaDiffUtilsTest, GenerateBestFullOperationPredictedTest) {
+  PayloadVersion version(kBrilloMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  diff_utils::ReplaceCodecPredictor predictor(1);
+  brillo::Blob data(1024 * 1024);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i / 7 + i % 3);
+  }
+  brillo::Blob blob;
+  InstallOperation::Type type;
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      data, version, &blob, &type, &predictor));
+  ASSERT_TRUE(diff_utils::IsAReplaceOperation(type));
+  EXPECT_NE(InstallOperation::REPLACE, type);
+  EXPECT_EQ(type, predictor.Predict(ToStringView(data)));
+
+  // The predicted codec gives the same blob.
+  brillo::Blob predicted_blob;
+  InstallOperation::Type predicted_type;
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      data, version, &predicted_blob, &predicted_type, &predictor));
+  EXPECT_EQ(type, predicted_type);
+  EXPECT_EQ(blob, predicted_blob);
+}
+
+TEST_F(DeltaDiffUtilsTest, GenerateBestFullOperationZstdTest) {
+  PayloadVersion version(kBrilloMajorPayloadVersion, kZstdMinorPayloadVersion);
+  brillo::Blob data(1024 * 1024);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i / 7 + i % 3);
+  }
+  brillo::Blob blob;
+  InstallOperation::Type type;
+  ASSERT_TRUE(
+      diff_utils::GenerateBestFullOperation(data, version, &blob, &type));
+  EXPECT_NE(InstallOperation::REPLACE_ZSTD, type);
+
+  // Well compressed data is much faster to decompress from zstd.
+  version.enable_zstd = true;
+  ASSERT_TRUE(
+      diff_utils::GenerateBestFullOperation(data, version, &blob, &type));
+  EXPECT_EQ(InstallOperation::REPLACE_ZSTD, type);
+
+  // Older clients don't support it.
+  version.minor = kLZ4DIFFMinorPayloadVersion;
+  EXPECT_FALSE(version.OperationAllowed(InstallOperation::REPLACE_ZSTD));
+  version.minor = kFullPayloadMinorVersion;
+  EXPECT_TRUE(version.OperationAllowed(InstallOperation::REPLACE_ZSTD));
+}
+
+TEST_F(DeltaDiffUtilsTest, TrainZstdDictionaryTest) {
+  // Many small records sharing most of their text, like the files of a
+  // partition sharing their structure.
+  std::string records;
+  for (int i = 0; records.size() < 4 * 1024 * 1024; i++) {
+    records += base::StringPrintf(
+        "<resource id=\"%d\" type=\"string\" locale=\"en-US\">value %d"
+        "</resource>\n",
+        i,
+        i * 7919 % 10007);
+  }
+  brillo::Blob data(records.begin(), records.end());
+  data.resize(data.size() / kBlockSize * kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path, data));
+  new_part_.size = data.size();
+
+  std::shared_ptr<const ZstdDictionary> dictionary =
+      diff_utils::TrainZstdDictionary(new_part_);
+  ASSERT_NE(nullptr, dictionary);
+  EXPECT_FALSE(dictionary->data().empty());
+
+  // A single block compresses much better against the dictionary.
+  brillo::Blob block(data.begin() + 100 * kBlockSize,
+                     data.begin() + 101 * kBlockSize);
+  brillo::Blob compressed, compressed_with_dictionary;
+  ASSERT_TRUE(ZstdCompress(block, &compressed));
+  ASSERT_TRUE(
+      ZstdCompress(block, &compressed_with_dictionary, dictionary.get()));
+  EXPECT_LT(compressed_with_dictionary.size(), compressed.size());
+
+  // An all zeros partition has nothing to train on.
+  brillo::Blob zeros(data.size());
+  ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path, zeros));
+  EXPECT_EQ(nullptr, diff_utils::TrainZstdDictionary(new_part_));
+}
+
+TEST_F(DeltaDiffUtilsTest, ZstdDictionariesAllowedTest) {
+  PayloadVersion version(kBrilloMajorPayloadVersion,
+                         kZstdDictionaryMinorPayloadVersion);
+  version.zstd_dictionaries = true;
+  // They are only used for REPLACE_ZSTD operations.
+  EXPECT_FALSE(version.ZstdDictionariesAllowed());
+  version.enable_zstd = true;
+  EXPECT_TRUE(version.ZstdDictionariesAllowed());
+  version.minor = kSharedBlobMinorPayloadVersion;
+  EXPECT_FALSE(version.ZstdDictionariesAllowed());
+  version.minor = kFullPayloadMinorVersion;
+  EXPECT_TRUE(version.ZstdDictionariesAllowed());
+}
+
+TEST_F(DeltaDiffUtilsTest, OrderOperationsByApplyCostTest) {
+  // Blobs of 10 MiB cheap to apply, and of 1 MiB expensive to apply, both
+  // writing 10 MiB.
+  const uint64_t num_blocks = 10 * 1024 * 1024 / kBlockSize;
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < 6; i++) {
+    AnnotatedOperation aop;
+    const bool diff = i >= 3;
+    aop.op.set_type(diff ? InstallOperation::SOURCE_BSDIFF
+                         : InstallOperation::REPLACE);
+    aop.op.set_data_length(diff ? 1024 * 1024 : 10 * 1024 * 1024);
+    *aop.op.add_dst_extents() = ExtentForRange(i * num_blocks, num_blocks);
+    aops.push_back(aop);
+  }
+
+  diff_utils::OrderOperationsByApplyCost(&aops, ApplyCostProfile());
+  // Each diff applies while the next full blob downloads, in destination
+  // order within each kind.
+  ASSERT_EQ(6u, aops.size());
+  const vector<uint64_t> expected_order{3, 0, 4, 1, 5, 2};
+  for (size_t i = 0; i < aops.size(); i++) {
+    EXPECT_EQ(expected_order[i] * num_blocks,
+              aops[i].op.dst_extents(0).start_block());
+  }
+}
+
+TEST_F(DeltaDiffUtilsTest, EstimateApplyCostTest) {
+  PartitionUpdate partition;
+  auto add_op = [&partition](InstallOperation::Type type,
+                             uint64_t src_blocks,
+                             uint64_t dst_blocks) {
+    InstallOperation* op = partition.add_operations();
+    op->set_type(type);
+    if (src_blocks)
+      *op->add_src_extents() = ExtentForRange(0, src_blocks);
+    *op->add_dst_extents() = ExtentForRange(0, dst_blocks);
+  };
+  add_op(InstallOperation::REPLACE_XZ, 0, 10);
+  add_op(InstallOperation::SOURCE_BSDIFF, 5, 5);
+  add_op(InstallOperation::SOURCE_COPY, 3, 3);
+  add_op(InstallOperation::DISCARD, 0, 4);
+
+  const PartitionApplyCost cost =
+      diff_utils::EstimateApplyCost(partition, ApplyCostProfile());
+  EXPECT_EQ(8 * kBlockSize, cost.bytes_read());
+  EXPECT_EQ(18 * kBlockSize, cost.bytes_written());
+  EXPECT_EQ(5 * kBlockSize, cost.diff_bytes());
+  EXPECT_EQ(10 * kBlockSize, cost.decompressed_bytes());
+  // 1 ms to decompress, 2 ms to patch and a little to copy, rounded down.
+  EXPECT_EQ(2u, cost.apply_time_ms());
+}
+
 }  // namespace chromeos_update_engine
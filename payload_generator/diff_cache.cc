@@ -0,0 +1,116 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// On disk format of an entry:
+//   char magic[8] = kDiffCacheMagic;
+//   uint32_t type;
+//   char patch[];
+//   char sha256_of_patch[32];
+constexpr char kDiffCacheMagic[] = "UEDIFF01";
+constexpr size_t kMagicSize = sizeof(kDiffCacheMagic) - 1;
+constexpr size_t kHeaderSize = kMagicSize + sizeof(uint32_t);
+constexpr size_t kHashSize = 32;
+}  // namespace
+
+DiffCache::DiffCache(const std::string& dir) : dir_(dir) {}
+
+bool DiffCache::Get(const brillo::Blob& key,
+                    InstallOperation::Type* type,
+                    brillo::Blob* patch) const {
+  brillo::Blob entry;
+  if (!utils::ReadFile(EntryPath(key), &entry)) {
+    return false;
+  }
+  if (entry.size() < kHeaderSize + kHashSize ||
+      memcmp(entry.data(), kDiffCacheMagic, kMagicSize) != 0) {
+    LOG(WARNING) << "Ignoring invalid diff cache entry " << EntryPath(key);
+    return false;
+  }
+  uint32_t raw_type;
+  memcpy(&raw_type, entry.data() + kMagicSize, sizeof(raw_type));
+  brillo::Blob data(entry.begin() + kHeaderSize, entry.end() - kHashSize);
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(data, &hash));
+  if (!InstallOperation::Type_IsValid(raw_type) ||
+      !std::equal(hash.begin(), hash.end(), entry.end() - kHashSize)) {
+    LOG(WARNING) << "Ignoring corrupted diff cache entry " << EntryPath(key);
+    return false;
+  }
+  *type = static_cast<InstallOperation::Type>(raw_type);
+  *patch = std::move(data);
+  return true;
+}
+
+bool DiffCache::Put(const brillo::Blob& key,
+                    InstallOperation::Type type,
+                    const brillo::Blob& patch) const {
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(patch, &hash));
+  brillo::Blob entry(kDiffCacheMagic, kDiffCacheMagic + kMagicSize);
+  const uint32_t raw_type = type;
+  entry.insert(entry.end(),
+               reinterpret_cast<const uint8_t*>(&raw_type),
+               reinterpret_cast<const uint8_t*>(&raw_type) + sizeof(raw_type));
+  entry.insert(entry.end(), patch.begin(), patch.end());
+  entry.insert(entry.end(), hash.begin(), hash.end());
+
+  if (!base::CreateDirectory(base::FilePath(dir_))) {
+    PLOG(WARNING) << "Failed to create diff cache directory " << dir_;
+    return false;
+  }
+  // Written to a temporary file first, so other processes never read a
+  // partial entry.
+  const std::string path = EntryPath(key);
+  std::string temp_path = path + ".XXXXXX";
+  int fd = mkstemp(temp_path.data());
+  if (fd < 0) {
+    PLOG(WARNING) << "Failed to create " << temp_path;
+    return false;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  if (!utils::WriteAll(fd, entry.data(), entry.size()) ||
+      rename(temp_path.c_str(), path.c_str()) != 0) {
+    PLOG(WARNING) << "Failed to write diff cache entry " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::string DiffCache::EntryPath(const brillo::Blob& key) const {
+  return dir_ + "/" + utils::HexEncode(key);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,58 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+
+#include <string>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// An on disk cache of the operations picked by BestDiffGenerator, so that
+// generating several payloads with the same source and target files doesn't
+// run the same diffs again. Each entry is a file in |dir| named after its
+// key, which is a hash of everything the diff depends on. Entries are written
+// atomically, so several delta_generator processes can share a directory.
+// Errors are only logged: a broken cache makes the diff run again, it doesn't
+// fail the payload generation.
+class DiffCache {
+ public:
+  explicit DiffCache(const std::string& dir);
+
+  // Looks up the operation type and patch stored under |key|. Returns false
+  // if there is no valid entry.
+  bool Get(const brillo::Blob& key,
+           InstallOperation::Type* type,
+           brillo::Blob* patch) const;
+
+  // Stores |type| and |patch| under |key|, replacing any previous entry.
+  bool Put(const brillo::Blob& key,
+           InstallOperation::Type type,
+           const brillo::Blob& patch) const;
+
+ private:
+  std::string EntryPath(const brillo::Blob& key) const;
+
+  const std::string dir_;
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
@@ -0,0 +1,86 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <string>
+
+#include <base/files/file_path.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+class DiffCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override { ASSERT_TRUE(tempdir_.CreateUniqueTempDir()); }
+
+  std::string CacheDir() const {
+    return tempdir_.GetPath().Append("cache").value();
+  }
+
+  base::ScopedTempDir tempdir_;
+  const brillo::Blob key_{1, 2, 3, 4};
+  const brillo::Blob patch_{'p', 'a', 't', 'c', 'h'};
+};
+
+TEST_F(DiffCacheTest, PutThenGetTest) {
+  DiffCache cache(CacheDir());
+  InstallOperation::Type type;
+  brillo::Blob patch;
+  ASSERT_FALSE(cache.Get(key_, &type, &patch));
+
+  ASSERT_TRUE(cache.Put(key_, InstallOperation::BROTLI_BSDIFF, patch_));
+  ASSERT_TRUE(cache.Get(key_, &type, &patch));
+  EXPECT_EQ(InstallOperation::BROTLI_BSDIFF, type);
+  EXPECT_EQ(patch_, patch);
+
+  // Other keys still miss, and the entry is visible to other instances.
+  ASSERT_FALSE(cache.Get({1, 2, 3}, &type, &patch));
+  ASSERT_TRUE(DiffCache(CacheDir()).Get(key_, &type, &patch));
+}
+
+TEST_F(DiffCacheTest, EmptyPatchTest) {
+  DiffCache cache(CacheDir());
+  ASSERT_TRUE(cache.Put(key_, InstallOperation::SOURCE_COPY, {}));
+  InstallOperation::Type type;
+  brillo::Blob patch{1};
+  ASSERT_TRUE(cache.Get(key_, &type, &patch));
+  EXPECT_EQ(InstallOperation::SOURCE_COPY, type);
+  EXPECT_TRUE(patch.empty());
+}
+
+TEST_F(DiffCacheTest, CorruptedEntryTest) {
+  DiffCache cache(CacheDir());
+  ASSERT_TRUE(cache.Put(key_, InstallOperation::PUFFDIFF, patch_));
+  const std::string path = CacheDir() + "/" + utils::HexEncode(key_);
+  brillo::Blob entry;
+  ASSERT_TRUE(utils::ReadFile(path, &entry));
+  entry[entry.size() / 2] ^= 1;
+  ASSERT_TRUE(utils::WriteFile(path.c_str(), entry.data(), entry.size()));
+
+  InstallOperation::Type type;
+  brillo::Blob patch;
+  ASSERT_FALSE(cache.Get(key_, &type, &patch));
+
+  // A truncated entry is ignored too.
+  ASSERT_TRUE(utils::WriteFile(path.c_str(), entry.data(), 10));
+  ASSERT_FALSE(cache.Get(key_, &type, &patch));
+}
+
+}  // namespace chromeos_update_engine
@@ -16,10 +16,16 @@
 
 #include "update_engine/payload_generator/erofs_filesystem.h"
 
+#include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 
-#include <string>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
 
 #include <erofs/internal.h>
 #include <erofs/dir.h>
@@ -29,8 +35,10 @@
 #include "lz4diff/lz4diff.pb.h"
 #include "lz4diff/lz4patch.h"
 #include "lz4diff/lz4diff.h"
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
@@ -135,16 +143,179 @@ static void FillCompressedBlockInfo(FilesystemInterface::File* p_file,
   return;
 }
 
+// Bump when the walk finds different files or extents, to drop the old
+// persisted indexes.
+constexpr char kErofsIndexKeyPrefix[] = "erofs-index-v1";
+
+// The files of an image, as found by walking it with erofs-utils. The
+// compression algorithm isn't part of it, it is set on a copy of the files.
+struct ErofsIndex {
+  size_t fs_size;
+  std::vector<FilesystemInterface::File> files;
+};
+
+// Identifies an image file on disk for the in-process index cache, so an
+// image changed or replaced under the same path is walked again.
+using ImageId = std::tuple<std::string, dev_t, ino_t, off_t, time_t, long>;
+
+ImageId GetImageId(const std::string& filename, const struct stat& st) {
+  return {filename,
+          st.st_dev,
+          st.st_ino,
+          st.st_size,
+          st.st_mtim.tv_sec,
+          st.st_mtim.tv_nsec};
+}
+
+std::mutex index_cache_mutex;
+std::map<ImageId, std::shared_ptr<const ErofsIndex>>& IndexCache() {
+  static auto* cache =
+      new std::map<ImageId, std::shared_ptr<const ErofsIndex>>();
+  return *cache;
+}
+
+void AppendValue(uint64_t value, brillo::Blob* out) {
+  const auto bytes = reinterpret_cast<const uint8_t*>(&value);
+  out->insert(out->end(), bytes, bytes + sizeof(value));
+}
+
+// Reads the values of a serialized index, failing once past its end.
+class IndexReader {
+ public:
+  explicit IndexReader(const brillo::Blob& data) : data_(data) {}
+
+  bool Read(uint64_t* value) {
+    TEST_AND_RETURN_FALSE(data_.size() - pos_ >= sizeof(*value));
+    memcpy(value, data_.data() + pos_, sizeof(*value));
+    pos_ += sizeof(*value);
+    return true;
+  }
+  bool Read(std::string* value) {
+    uint64_t size;
+    TEST_AND_RETURN_FALSE(Read(&size));
+    TEST_AND_RETURN_FALSE(data_.size() - pos_ >= size);
+    value->assign(reinterpret_cast<const char*>(data_.data() + pos_), size);
+    pos_ += size;
+    return true;
+  }
+  bool done() const { return pos_ == data_.size(); }
+
+ private:
+  const brillo::Blob& data_;
+  size_t pos_{0};
+};
+
+// Serialized indexes are little endian uint64_t values, with the strings
+// prefixed by their size:
+//   fs_size, number of files, then for every file:
+//   name, st_size, st_ino, is_compressed, zero_padding_enabled,
+//   number of extents, (start_block, num_blocks) of each extent,
+//   number of compressed blocks, (uncompressed_offset, compressed_length,
+//   uncompressed_length) of each compressed block.
+brillo::Blob SerializeIndex(const ErofsIndex& index) {
+  brillo::Blob out;
+  AppendValue(index.fs_size, &out);
+  AppendValue(index.files.size(), &out);
+  for (const auto& file : index.files) {
+    AppendValue(file.name.size(), &out);
+    out.insert(out.end(), file.name.begin(), file.name.end());
+    AppendValue(file.file_stat.st_size, &out);
+    AppendValue(file.file_stat.st_ino, &out);
+    AppendValue(file.is_compressed, &out);
+    AppendValue(file.compressed_file_info.zero_padding_enabled, &out);
+    AppendValue(file.extents.size(), &out);
+    for (const auto& extent : file.extents) {
+      AppendValue(extent.start_block(), &out);
+      AppendValue(extent.num_blocks(), &out);
+    }
+    const auto& blocks = file.compressed_file_info.blocks;
+    AppendValue(blocks.size(), &out);
+    for (const auto& block : blocks) {
+      AppendValue(block.uncompressed_offset, &out);
+      AppendValue(block.compressed_length, &out);
+      AppendValue(block.uncompressed_length, &out);
+    }
+  }
+  return out;
+}
+
+bool ParseIndex(const brillo::Blob& data, ErofsIndex* index) {
+  IndexReader reader(data);
+  uint64_t fs_size, num_files;
+  TEST_AND_RETURN_FALSE(reader.Read(&fs_size));
+  TEST_AND_RETURN_FALSE(reader.Read(&num_files));
+  index->fs_size = fs_size;
+  index->files.clear();
+  for (uint64_t i = 0; i < num_files; i++) {
+    FilesystemInterface::File file;
+    uint64_t st_size, st_ino, is_compressed, zero_padding, count;
+    TEST_AND_RETURN_FALSE(reader.Read(&file.name));
+    TEST_AND_RETURN_FALSE(reader.Read(&st_size));
+    TEST_AND_RETURN_FALSE(reader.Read(&st_ino));
+    TEST_AND_RETURN_FALSE(reader.Read(&is_compressed));
+    TEST_AND_RETURN_FALSE(reader.Read(&zero_padding));
+    file.file_stat.st_size = st_size;
+    file.file_stat.st_ino = st_ino;
+    file.is_compressed = is_compressed;
+    file.compressed_file_info.zero_padding_enabled = zero_padding;
+    TEST_AND_RETURN_FALSE(reader.Read(&count));
+    for (uint64_t j = 0; j < count; j++) {
+      uint64_t start_block, num_blocks;
+      TEST_AND_RETURN_FALSE(reader.Read(&start_block));
+      TEST_AND_RETURN_FALSE(reader.Read(&num_blocks));
+      file.extents.push_back(ExtentForRange(start_block, num_blocks));
+    }
+    TEST_AND_RETURN_FALSE(reader.Read(&count));
+    for (uint64_t j = 0; j < count; j++) {
+      CompressedBlock block;
+      TEST_AND_RETURN_FALSE(reader.Read(&block.uncompressed_offset));
+      TEST_AND_RETURN_FALSE(reader.Read(&block.compressed_length));
+      TEST_AND_RETURN_FALSE(reader.Read(&block.uncompressed_length));
+      file.compressed_file_info.blocks.push_back(block);
+    }
+    index->files.push_back(std::move(file));
+  }
+  TEST_AND_RETURN_FALSE(reader.done());
+  return true;
+}
+
+// The key of the persisted index of an image, a hash of its whole content so
+// the same image is found again in another build. Files that aren't EROFS
+// images have no key, to not hash them for nothing.
+bool GetIndexKey(const std::string& filename, brillo::Blob* key) {
+  brillo::Blob magic;
+  uint32_t value;
+  if (!utils::ReadFileChunk(
+          filename, EROFS_SUPER_OFFSET, sizeof(value), &magic) ||
+      magic.size() != sizeof(value)) {
+    return false;
+  }
+  memcpy(&value, magic.data(), sizeof(value));
+  if (le32_to_cpu(value) != EROFS_SUPER_MAGIC_V1) {
+    return false;
+  }
+  HashCalculator hasher;
+  TEST_AND_RETURN_FALSE(
+      hasher.Update(kErofsIndexKeyPrefix, sizeof(kErofsIndexKeyPrefix)));
+  TEST_AND_RETURN_FALSE(hasher.UpdateFile(filename, -1) >= 0);
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  *key = hasher.raw_hash();
+  return true;
+}
+
 }  // namespace
 
 static_assert(kBlockSize == EROFS_BLKSIZ);
 
-std::unique_ptr<ErofsFilesystem> ErofsFilesystem::CreateFromFile(
-    const std::string& filename, const CompressionAlgorithm& algo) {
+namespace {
+
+// Walks the EROFS image |filename| with erofs-utils into |index|.
+bool WalkImage(const std::string& filename, ErofsIndex* index) {
   // erofs-utils makes heavy use of global variables. Hence its functions aren't
   // thread safe. For example, it stores a global int holding file descriptors
   // to the opened EROFS image. It doesn't even support opening more than 1
-  // imaeg at a time.
+  // imaeg at a time. Only the walk holds the lock, images whose index is
+  // already known load concurrently.
   // TODO(b/202784930) Replace erofs-utils with a cleaner and more C++ friendly
   // library. (Or turn erofs-utils into one)
   static std::mutex m;
@@ -152,30 +323,86 @@ std::unique_ptr<ErofsFilesystem> ErofsFilesystem::CreateFromFile(
 
   if (const auto err = dev_open_ro(filename.c_str()); err) {
     PLOG(INFO) << "Failed to open " << filename;
-    return nullptr;
+    return false;
   }
   DEFER { dev_close(); };
 
   if (const auto err = erofs_read_superblock(); err) {
     PLOG(INFO) << "Failed to parse " << filename << " as EROFS image";
-    return nullptr;
+    return false;
   }
   struct stat st;
   if (const auto err = fstat(erofs_devfd, &st); err) {
     PLOG(ERROR) << "Failed to stat() " << filename;
-    return nullptr;
+    return false;
   }
   const time_t time = sbi.build_time;
   LOG(INFO) << "Parsed EROFS image of size " << st.st_size << " built in "
             << ctime(&time) << " " << filename;
-  std::vector<File> files;
-  if (!ErofsFilesystem::GetFiles(filename, &files, algo)) {
+  index->fs_size = st.st_size;
+  return ErofsFilesystem::GetFiles(
+      filename, &index->files, PartitionConfig::GetDefaultCompressionParam());
+}
+
+}  // namespace
+
+std::unique_ptr<ErofsFilesystem> ErofsFilesystem::CreateFromFile(
+    const std::string& filename,
+    const CompressionAlgorithm& algo,
+    const std::string& index_cache_dir) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    PLOG(INFO) << "Failed to stat() " << filename;
     return nullptr;
   }
+  const ImageId image_id = GetImageId(filename, st);
+  std::shared_ptr<const ErofsIndex> index;
+  {
+    std::lock_guard lock{index_cache_mutex};
+    auto it = IndexCache().find(image_id);
+    if (it != IndexCache().end()) {
+      index = it->second;
+    }
+  }
+
+  brillo::Blob key;
+  if (!index && !index_cache_dir.empty() && GetIndexKey(filename, &key)) {
+    InstallOperation::Type type;
+    brillo::Blob data;
+    auto persisted = std::make_shared<ErofsIndex>();
+    if (DiffCache(index_cache_dir).Get(key, &type, &data) &&
+        ParseIndex(data, persisted.get())) {
+      LOG(INFO) << "Loaded the EROFS index of " << filename << " from "
+                << index_cache_dir;
+      index = std::move(persisted);
+    }
+  }
+
+  if (!index) {
+    auto walked = std::make_shared<ErofsIndex>();
+    if (!WalkImage(filename, walked.get())) {
+      return nullptr;
+    }
+    // The entry type is unused, the index is the whole entry.
+    if (!key.empty()) {
+      DiffCache(index_cache_dir)
+          .Put(key, InstallOperation::REPLACE, SerializeIndex(*walked));
+    }
+    index = std::move(walked);
+  }
+  {
+    std::lock_guard lock{index_cache_mutex};
+    IndexCache().emplace(image_id, index);
+  }
+
+  std::vector<File> files = index->files;
+  for (auto& file : files) {
+    file.compressed_file_info.algo = algo;
+  }
   LOG(INFO) << "Using compression algo " << algo << " for " << filename;
   // private ctor doesn't work with make_unique
   return std::unique_ptr<ErofsFilesystem>(
-      new ErofsFilesystem(filename, st.st_size, std::move(files)));
+      new ErofsFilesystem(filename, index->fs_size, std::move(files)));
 }
 
 bool ErofsFilesystem::GetFiles(std::vector<File>* files) const {
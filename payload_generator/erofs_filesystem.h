@@ -28,11 +28,16 @@ class ErofsFilesystem final : public FilesystemInterface {
   // file. The file doesn't need to be loop-back mounted. Since erofs-utils
   // library functions are not concurrency safe(can't be used in multi-threaded
   // context, can't even work with multiple EROFS images concurrently on 1
-  // thread), this function takes a global mutex.
+  // thread), walking the image takes a global mutex. The files found are kept
+  // for the life of the process, so opening the same image again doesn't walk
+  // it again. When |index_cache_dir| isn't empty they are also stored there,
+  // keyed by the image content, and an image already stored isn't walked at
+  // all.
   static std::unique_ptr<ErofsFilesystem> CreateFromFile(
       const std::string& filename,
       const CompressionAlgorithm& algo =
-          PartitionConfig::GetDefaultCompressionParam());
+          PartitionConfig::GetDefaultCompressionParam(),
+      const std::string& index_cache_dir = "");
   virtual ~ErofsFilesystem() = default;
 
   // FilesystemInterface overrides.
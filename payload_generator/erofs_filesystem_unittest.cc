@@ -21,6 +21,8 @@
 #include <string>
 #include <vector>
 
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
 #include <base/format_macros.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
@@ -124,4 +126,44 @@ TEST_F(ErofsFilesystemTest, ParseGeneratedImages) {
   ASSERT_EQ(compressed_size, total_blocks * kBlockSize);
 }
 
+TEST_F(ErofsFilesystemTest, PersistedIndexTest) {
+  base::ScopedTempDir tempdir;
+  ASSERT_TRUE(tempdir.CreateUniqueTempDir());
+  const string cache_dir = tempdir.GetPath().Append("cache").value();
+  const auto build_path = GetBuildArtifactsPath("gen/erofs.img");
+  auto fs = ErofsFilesystem::CreateFromFile(
+      build_path, PartitionConfig::GetDefaultCompressionParam(), cache_dir);
+  ASSERT_NE(fs, nullptr);
+  vector<ErofsFilesystem::File> files;
+  ASSERT_TRUE(fs->GetFiles(&files));
+
+  // A copy of the image at another path isn't in the in-process cache, so its
+  // files come from the persisted index.
+  const auto copy_path = tempdir.GetPath().Append("erofs.img");
+  ASSERT_TRUE(base::CopyFile(base::FilePath(build_path), copy_path));
+  auto copy_fs = ErofsFilesystem::CreateFromFile(
+      copy_path.value(),
+      PartitionConfig::GetDefaultCompressionParam(),
+      cache_dir);
+  ASSERT_NE(copy_fs, nullptr);
+  ASSERT_EQ(fs->GetBlockCount(), copy_fs->GetBlockCount());
+  vector<ErofsFilesystem::File> copy_files;
+  ASSERT_TRUE(copy_fs->GetFiles(&copy_files));
+  ASSERT_EQ(files.size(), copy_files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    EXPECT_EQ(files[i].name, copy_files[i].name);
+    EXPECT_EQ(files[i].file_stat.st_size, copy_files[i].file_stat.st_size);
+    EXPECT_EQ(files[i].is_compressed, copy_files[i].is_compressed);
+    EXPECT_EQ(files[i].extents, copy_files[i].extents);
+    const auto& blocks = files[i].compressed_file_info.blocks;
+    const auto& copy_blocks = copy_files[i].compressed_file_info.blocks;
+    ASSERT_EQ(blocks.size(), copy_blocks.size());
+    for (size_t j = 0; j < blocks.size(); j++) {
+      EXPECT_EQ(blocks[j].compressed_length, copy_blocks[j].compressed_length);
+      EXPECT_EQ(blocks[j].uncompressed_length,
+                copy_blocks[j].uncompressed_length);
+    }
+  }
+}
+
 }  // namespace chromeos_update_engine
@@ -28,6 +28,10 @@
 #pragma clang diagnostic pop
 #endif
 
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
 #include <map>
 #include <set>
 
@@ -37,6 +41,7 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::set;
@@ -60,70 +65,212 @@ int ProcessInodeAllBlocks(ext2_filsys fs,
   return 0;
 }
 
-// Processes only indirect, double indirect or triple indirect metadata
-// blocks belonging to an inode. This function should match the prototype of
-// ext2fs_block_iterate2().
-int AddMetadataBlocks(ext2_filsys fs,
+vector<Extent> UnpackExtents(const vector<BlockExtent>& packed) {
+  return vector<Extent>(packed.begin(), packed.end());
+}
+
+// An in-use inode found by the scan.
+struct ScannedInode {
+  ext2_ino_t ino;
+  bool is_dir;
+  struct stat file_stat;
+  // Packed while scanning, being much smaller than Extent messages.
+  vector<BlockExtent> extents;
+};
+
+// What the scan of a range of block groups found.
+struct InodeScanResult {
+  bool ok = false;
+  vector<ScannedInode> inodes;
+  // The indirect, double indirect and triple indirect blocks of the files.
+  vector<uint64_t> inode_blocks;
+};
+
+struct BlockIterateState {
+  ScannedInode* inode;
+  InodeScanResult* result;
+  // Whether all the blocks are data of the inode.
+  bool all_blocks;
+};
+
+// Sorts the blocks of an inode in its data or in the inode blocks. This
+// function should match the prototype of ext2fs_block_iterate2().
+int ProcessInodeBlock(ext2_filsys fs,
                       blk_t* blocknr,
                       e2_blkcnt_t blockcnt,
                       blk_t ref_blk,
                       int ref_offset,
                       void* priv) {
-  set<uint64_t>* blocks = static_cast<set<uint64_t>*>(priv);
+  auto state = static_cast<BlockIterateState*>(priv);
   // If |blockcnt| is non-negative, |blocknr| points to the physical block
   // number.
   // If |blockcnt| is negative, it is one of the values: BLOCK_COUNT_IND,
   // BLOCK_COUNT_DIND, BLOCK_COUNT_TIND or BLOCK_COUNT_TRANSLATOR and
   // |blocknr| points to a block in the first three cases. The last case is
   // only used by GNU Hurd, so we shouldn't see those cases here.
-  if (blockcnt == BLOCK_COUNT_IND || blockcnt == BLOCK_COUNT_DIND ||
-      blockcnt == BLOCK_COUNT_TIND) {
-    blocks->insert(*blocknr);
+  if (state->all_blocks || blockcnt >= 0) {
+    AppendBlockToExtents(&state->inode->extents, *blocknr);
+  } else if (blockcnt == BLOCK_COUNT_IND || blockcnt == BLOCK_COUNT_DIND ||
+             blockcnt == BLOCK_COUNT_TIND) {
+    state->result->inode_blocks.push_back(*blocknr);
   }
   return 0;
 }
 
-struct UpdateFileAndAppendState {
-  std::map<ext2_ino_t, FilesystemInterface::File>* inodes = nullptr;
-  set<ext2_ino_t>* used_inodes = nullptr;
-  vector<FilesystemInterface::File>* files = nullptr;
-  ext2_filsys filsys;
+// Owns an ext2_filsys opened read-only. libext2fs handles can't be shared by
+// threads, so every task opens its own.
+struct Ext2fsFreer {
+  void operator()(ext2_filsys fs) const { ext2fs_free(fs); }
 };
+using ScopedExt2fs = unique_ptr<struct struct_ext2_filsys, Ext2fsFreer>;
 
-int UpdateFileAndAppend(ext2_ino_t dir,
-                        int entry,
-                        struct ext2_dir_entry* dirent,
-                        int offset,
-                        int blocksize,
-                        char* buf,
-                        void* priv_data) {
-  UpdateFileAndAppendState* state =
-      static_cast<UpdateFileAndAppendState*>(priv_data);
-  uint32_t file_type = dirent->name_len >> 8;
-  // Directories can't have hard links, and they are added from the outer loop.
-  if (file_type == EXT2_FT_DIR)
-    return 0;
+ScopedExt2fs OpenExt2fs(const string& filename) {
+  ext2_filsys fs = nullptr;
+  errcode_t err = ext2fs_open(filename.c_str(),
+                              0,  // flags (read only)
+                              0,  // superblock block number
+                              0,  // block_size (autodetect)
+                              unix_io_manager,
+                              &fs);
+  if (err) {
+    LOG(ERROR) << "Opening ext2fs " << filename << " (error " << err << ")";
+    return nullptr;
+  }
+  return ScopedExt2fs(fs);
+}
 
-  auto ino_file = state->inodes->find(dirent->inode);
-  if (ino_file == state->inodes->end())
-    return 0;
-  auto dir_file = state->inodes->find(dir);
-  if (dir_file == state->inodes->end())
+// Scans the inodes of the block groups [first_group, end_group) of |filename|.
+// |used_inodes| tells the inodes in use, indexed by inode number.
+void ScanInodes(const string& filename,
+                const vector<bool>& used_inodes,
+                dgrp_t first_group,
+                dgrp_t end_group,
+                InodeScanResult* result) {
+  ScopedExt2fs fs = OpenExt2fs(filename);
+  if (!fs)
+    return;
+  ext2_inode_scan iscan;
+  errcode_t error = ext2fs_open_inode_scan(fs.get(), 0, &iscan);
+  if (error) {
+    LOG(ERROR) << "Failed to open the inode scan (" << error << ")";
+    return;
+  }
+  DEFER { ext2fs_close_inode_scan(iscan); };
+  if (first_group > 0) {
+    error = ext2fs_inode_scan_goto_blockgroup(iscan, first_group);
+    if (error) {
+      LOG(ERROR) << "Failed to go to block group " << first_group << " ("
+                 << error << ")";
+      return;
+    }
+  }
+  const uint64_t end_ino =
+      uint64_t{end_group} * fs->super->s_inodes_per_group + 1;
+
+  // Iterator
+  ext2_ino_t it_ino;
+  ext2_inode it_inode;
+  while (true) {
+    error = ext2fs_get_next_inode(iscan, &it_ino, &it_inode);
+    if (error) {
+      LOG(ERROR) << "Failed to retrieve next inode (" << error << ")";
+      return;
+    }
+    if (it_ino == 0 || it_ino >= end_ino)
+      break;
+
+    // Skip inodes that are not in use.
+    if (it_ino >= used_inodes.size() || !used_inodes[it_ino])
+      continue;
+
+    result->inodes.emplace_back();
+    ScannedInode& inode = result->inodes.back();
+    inode.ino = it_ino;
+    inode.is_dir = LINUX_S_ISDIR(it_inode.i_mode);
+    struct stat& file_stat = inode.file_stat;
+    memset(&file_stat, 0, sizeof(file_stat));
+    file_stat.st_ino = it_ino;
+    file_stat.st_mode = it_inode.i_mode;
+    file_stat.st_nlink = it_inode.i_links_count;
+    file_stat.st_uid = it_inode.i_uid;
+    file_stat.st_gid = it_inode.i_gid;
+    file_stat.st_size = it_inode.i_size;
+    file_stat.st_blksize = fs->blocksize;
+    file_stat.st_blocks = it_inode.i_blocks;
+    file_stat.st_atime = it_inode.i_atime;
+    file_stat.st_mtime = it_inode.i_mtime;
+    file_stat.st_ctime = it_inode.i_ctime;
+
+    if (!ext2fs_inode_has_valid_blocks(&it_inode))
+      continue;
+
+    // Process the inode data and metadata blocks in one pass.
+    // For normal files, inode blocks are indirect, double indirect
+    // and triple indirect blocks (no data blocks). For directories and
+    // the journal, all blocks are considered metadata blocks.
+    BlockIterateState state{
+        &inode, result, it_ino < EXT2_GOOD_OLD_FIRST_INO};
+    error = ext2fs_block_iterate2(fs.get(),
+                                  it_ino,
+                                  0,        // flags
+                                  nullptr,  // block_buf
+                                  ProcessInodeBlock,
+                                  &state);
+    if (error) {
+      LOG(ERROR) << "Failed to enumerate inode " << it_ino << " blocks ("
+                 << error << ")";
+    }
+  }
+  result->ok = true;
+}
+
+// An entry of a directory, other than "." and "..".
+struct DirEntry {
+  ext2_ino_t ino;
+  uint32_t file_type;
+  string name;
+};
+
+int CollectDirEntry(ext2_ino_t dir,
+                    int entry,
+                    struct ext2_dir_entry* dirent,
+                    int offset,
+                    int blocksize,
+                    char* buf,
+                    void* priv_data) {
+  if (entry == DIRENT_DOT_FILE || entry == DIRENT_DOT_DOT_FILE)
     return 0;
-  string basename(dirent->name, dirent->name_len & 0xff);
-  ino_file->second.name = dir_file->second.name;
-  if (dir_file->second.name != "/")
-    ino_file->second.name += "/";
-  ino_file->second.name += basename;
-
-  // Append this file to the output. If the file has a hard link, it will be
-  // added twice to the output, but with different names, which is ok. That will
-  // help identify all the versions of the same file.
-  state->files->push_back(ino_file->second);
-  state->used_inodes->insert(dirent->inode);
+  static_cast<vector<DirEntry>*>(priv_data)->push_back(
+      {dirent->inode,
+       static_cast<uint32_t>(dirent->name_len >> 8),
+       string(dirent->name, dirent->name_len & 0xff)});
   return 0;
 }
 
+// Lists the entries of the directories [begin, end) of |dir_inos| of
+// |filename| into the matching elements of |entries|.
+void ListDirectories(const string& filename,
+                     const vector<ext2_ino_t>& dir_inos,
+                     size_t begin,
+                     size_t end,
+                     vector<vector<DirEntry>>* entries) {
+  ScopedExt2fs fs = OpenExt2fs(filename);
+  if (!fs)
+    return;
+  for (size_t i = begin; i < end; i++) {
+    errcode_t error = ext2fs_dir_iterate2(fs.get(),
+                                          dir_inos[i],
+                                          0,
+                                          nullptr /* block_buf */,
+                                          CollectDirEntry,
+                                          &(*entries)[i]);
+    if (error) {
+      LOG(WARNING) << "Failed to enumerate files in directory inode "
+                   << dir_inos[i] << " (error " << error << ")";
+    }
+  }
+}
+
 }  // namespace
 
 unique_ptr<Ext2Filesystem> Ext2Filesystem::CreateFromFile(
@@ -160,129 +307,152 @@ size_t Ext2Filesystem::GetBlockCount() const {
 
 bool Ext2Filesystem::GetFiles(vector<File>* files) const {
   TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode_bitmap(filsys_));
+  // The bitmap can't be tested from several threads, so it is copied first.
+  const uint64_t num_inodes = filsys_->super->s_inodes_count;
+  vector<bool> used_inodes(num_inodes + 1, false);
+  for (uint64_t ino = 1; ino <= num_inodes; ino++) {
+    used_inodes[ino] = ext2fs_test_inode_bitmap2(filsys_->inode_map, ino);
+  }
 
-  ext2_inode_scan iscan;
-  TEST_AND_RETURN_FALSE_ERRCODE(
-      ext2fs_open_inode_scan(filsys_, 0 /* buffer_blocks */, &iscan));
-
-  std::map<ext2_ino_t, File> inodes;
+  // The inodes are scanned in ranges of block groups, in parallel. Each range
+  // finds its inodes in increasing order, so the ranges are merged in order.
+  const dgrp_t num_groups = filsys_->group_desc_count;
+  const dgrp_t num_ranges = std::max<dgrp_t>(
+      1,
+      std::min<uint64_t>(num_groups,
+                         TaskScheduler::Get()->num_threads() * 4));
+  vector<InodeScanResult> scan_results(num_ranges);
+  {
+    TaskGroup scan_group;
+    for (dgrp_t i = 0; i < num_ranges; i++) {
+      const dgrp_t first_group = uint64_t{num_groups} * i / num_ranges;
+      const dgrp_t end_group = uint64_t{num_groups} * (i + 1) / num_ranges;
+      scan_group.Post([this, &used_inodes, first_group, end_group, i,
+                       &scan_results] {
+        ScanInodes(
+            filename_, used_inodes, first_group, end_group, &scan_results[i]);
+      });
+    }
+  }
+  vector<ScannedInode> inodes;
+  vector<uint64_t> inode_blocks;
+  for (auto& result : scan_results) {
+    TEST_AND_RETURN_FALSE(result.ok);
+    std::move(result.inodes.begin(),
+              result.inodes.end(),
+              std::back_inserter(inodes));
+    inode_blocks.insert(inode_blocks.end(),
+                        result.inode_blocks.begin(),
+                        result.inode_blocks.end());
+  }
+  scan_results.clear();
+  std::sort(inode_blocks.begin(), inode_blocks.end());
+  inode_blocks.erase(std::unique(inode_blocks.begin(), inode_blocks.end()),
+                     inode_blocks.end());
+  auto find_inode = [&inodes](ext2_ino_t ino) -> ScannedInode* {
+    auto it = std::lower_bound(
+        inodes.begin(), inodes.end(), ino, [](const auto& inode, auto ino) {
+          return inode.ino < ino;
+        });
+    return it != inodes.end() && it->ino == ino ? &*it : nullptr;
+  };
 
   // List of directories. We need to first parse all the files in a directory
   // to later fix the absolute paths.
   vector<ext2_ino_t> directories;
-
-  set<uint64_t> inode_blocks;
-
-  // Iterator
-  ext2_ino_t it_ino;
-  ext2_inode it_inode;
-
-  bool ok = true;
-  while (true) {
-    errcode_t error = ext2fs_get_next_inode(iscan, &it_ino, &it_inode);
-    if (error) {
-      LOG(ERROR) << "Failed to retrieve next inode (" << error << ")";
-      ok = false;
-      break;
-    }
-    if (it_ino == 0)
-      break;
-
-    // Skip inodes that are not in use.
-    if (!ext2fs_test_inode_bitmap(filsys_->inode_map, it_ino))
-      continue;
-
-    File& file = inodes[it_ino];
-    if (it_ino == EXT2_RESIZE_INO) {
-      file.name = "<group-descriptors>";
-    } else {
-      file.name = base::StringPrintf("<inode-%u>", it_ino);
+  for (const auto& inode : inodes) {
+    if (inode.is_dir)
+      directories.push_back(inode.ino);
+  }
+  vector<vector<DirEntry>> dir_entries(directories.size());
+  {
+    TaskGroup list_group;
+    const size_t num_chunks = std::max<size_t>(
+        1,
+        std::min(directories.size(), TaskScheduler::Get()->num_threads() * 4));
+    for (size_t i = 0; i < num_chunks; i++) {
+      const size_t begin = directories.size() * i / num_chunks;
+      const size_t end = directories.size() * (i + 1) / num_chunks;
+      list_group.Post([this, &directories, begin, end, &dir_entries] {
+        ListDirectories(filename_, directories, begin, end, &dir_entries);
+      });
     }
+  }
 
-    memset(&file.file_stat, 0, sizeof(file.file_stat));
-    file.file_stat.st_ino = it_ino;
-    file.file_stat.st_mode = it_inode.i_mode;
-    file.file_stat.st_nlink = it_inode.i_links_count;
-    file.file_stat.st_uid = it_inode.i_uid;
-    file.file_stat.st_gid = it_inode.i_gid;
-    file.file_stat.st_size = it_inode.i_size;
-    file.file_stat.st_blksize = filsys_->blocksize;
-    file.file_stat.st_blocks = it_inode.i_blocks;
-    file.file_stat.st_atime = it_inode.i_atime;
-    file.file_stat.st_mtime = it_inode.i_mtime;
-    file.file_stat.st_ctime = it_inode.i_ctime;
-
-    bool is_dir = (ext2fs_check_directory(filsys_, it_ino) == 0);
-    if (is_dir)
-      directories.push_back(it_ino);
-
-    if (!ext2fs_inode_has_valid_blocks(&it_inode))
-      continue;
-
-    // Process the inode data and metadata blocks.
-    // For normal files, inode blocks are indirect, double indirect
-    // and triple indirect blocks (no data blocks). For directories and
-    // the journal, all blocks are considered metadata blocks.
-    int flags = it_ino < EXT2_GOOD_OLD_FIRST_INO ? 0 : BLOCK_FLAG_DATA_ONLY;
-    error = ext2fs_block_iterate2(filsys_,
-                                  it_ino,
-                                  flags,
-                                  nullptr,  // block_buf
-                                  ProcessInodeAllBlocks,
-                                  &file.extents);
-
-    if (error) {
-      LOG(ERROR) << "Failed to enumerate inode " << it_ino << " blocks ("
-                 << error << ")";
-      continue;
-    }
-    if (it_ino >= EXT2_GOOD_OLD_FIRST_INO) {
-      ext2fs_block_iterate2(
-          filsys_, it_ino, 0, nullptr, AddMetadataBlocks, &inode_blocks);
+  // The names of the directories, from the root down the entries, rather than
+  // asking libext2fs the path of every directory. Directories not reachable
+  // from the root keep an empty name.
+  std::map<ext2_ino_t, size_t> dir_index;
+  for (size_t i = 0; i < directories.size(); i++)
+    dir_index[directories[i]] = i;
+  vector<string> dir_names(directories.size());
+  vector<size_t> pending;
+  if (auto it = dir_index.find(EXT2_ROOT_INO); it != dir_index.end()) {
+    dir_names[it->second] = "/";
+    pending.push_back(it->second);
+  }
+  while (!pending.empty()) {
+    const size_t parent = pending.back();
+    pending.pop_back();
+    for (const auto& entry : dir_entries[parent]) {
+      auto it = dir_index.find(entry.ino);
+      if (it == dir_index.end() || !dir_names[it->second].empty())
+        continue;
+      dir_names[it->second] = dir_names[parent];
+      if (dir_names[parent] != "/")
+        dir_names[it->second] += "/";
+      dir_names[it->second] += entry.name;
+      pending.push_back(it->second);
     }
   }
-  ext2fs_close_inode_scan(iscan);
-  if (!ok)
-    return false;
+
+  // Names of the inodes not added by their directory.
+  auto default_name = [](ext2_ino_t ino) {
+    return ino == EXT2_RESIZE_INO ? string("<group-descriptors>")
+                                  : base::StringPrintf("<inode-%u>", ino);
+  };
+  auto make_file = [](const ScannedInode& inode, string name) {
+    File file;
+    file.name = std::move(name);
+    file.file_stat = inode.file_stat;
+    file.extents = UnpackExtents(inode.extents);
+    return file;
+  };
 
   // The set of inodes already added to the output. There can be less elements
   // here than in files since the later can contain repeated inodes due to
   // hardlink files.
-  set<ext2_ino_t> used_inodes;
-
-  UpdateFileAndAppendState priv_data;
-  priv_data.inodes = &inodes;
-  priv_data.used_inodes = &used_inodes;
-  priv_data.files = files;
-  priv_data.filsys = filsys_;
+  set<ext2_ino_t> used_inodes_set;
 
   files->clear();
   // Iterate over all the files of each directory to update the name and add it.
-  for (ext2_ino_t dir_ino : directories) {
-    char* dir_name = nullptr;
-    errcode_t error = ext2fs_get_pathname(filsys_, dir_ino, 0, &dir_name);
-    if (error) {
-      // Not being able to read a directory name is not a fatal error, it is
+  for (size_t i = 0; i < directories.size(); i++) {
+    const ext2_ino_t dir_ino = directories[i];
+    string dir_name = dir_names[i];
+    if (dir_name.empty()) {
+      // Not being able to find a directory name is not a fatal error, it is
       // just skiped.
-      LOG(WARNING) << "Reading directory name on inode " << dir_ino
-                   << " (error " << error << ")";
-      inodes[dir_ino].name = base::StringPrintf("<dir-%u>", dir_ino);
+      LOG(WARNING) << "Reading directory name on inode " << dir_ino;
+      dir_name = base::StringPrintf("<dir-%u>", dir_ino);
     } else {
-      inodes[dir_ino].name = dir_name;
-      files->push_back(inodes[dir_ino]);
-      used_inodes.insert(dir_ino);
+      files->push_back(make_file(*find_inode(dir_ino), dir_name));
+      used_inodes_set.insert(dir_ino);
     }
-    ext2fs_free_mem(&dir_name);
-
-    error = ext2fs_dir_iterate2(filsys_,
-                                dir_ino,
-                                0,
-                                nullptr /* block_buf */,
-                                UpdateFileAndAppend,
-                                &priv_data);
-    if (error) {
-      LOG(WARNING) << "Failed to enumerate files in directory "
-                   << inodes[dir_ino].name << " (error " << error << ")";
+
+    for (const auto& entry : dir_entries[i]) {
+      // Directories can't have hard links, and they are added from the outer
+      // loop.
+      if (entry.file_type == EXT2_FT_DIR)
+        continue;
+      const ScannedInode* inode = find_inode(entry.ino);
+      if (!inode)
+        continue;
+      // Append this file to the output. If the file has a hard link, it will
+      // be added twice to the output, but with different names, which is ok.
+      // That will help identify all the versions of the same file.
+      files->push_back(make_file(
+          *inode, dir_name + (dir_name != "/" ? "/" : "") + entry.name));
+      used_inodes_set.insert(entry.ino);
     }
   }
 
@@ -312,13 +482,18 @@ bool Ext2Filesystem::GetFiles(vector<File>* files) const {
 
   // Add all the unreachable files plus the pseudo-files with an inode. Since
   // these inodes aren't files in the filesystem, ignore the empty ones.
-  for (const auto& ino_file : inodes) {
-    if (used_inodes.find(ino_file.first) != used_inodes.end())
+  for (size_t i = 0; i < inodes.size(); i++) {
+    const ScannedInode& inode = inodes[i];
+    if (used_inodes_set.find(inode.ino) != used_inodes_set.end())
       continue;
-    if (ino_file.second.extents.empty())
+    if (inode.extents.empty())
       continue;
 
-    File file = ino_file.second;
+    const auto dir_it = dir_index.find(inode.ino);
+    File file = make_file(inode,
+                          dir_it != dir_index.end()
+                              ? base::StringPrintf("<dir-%u>", inode.ino)
+                              : default_name(inode.ino));
     ExtentRanges ranges;
     ranges.AddExtents(file.extents);
     file.extents = ranges.GetExtentsForBlockCount(ranges.blocks());
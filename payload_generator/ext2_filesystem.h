@@ -58,6 +58,8 @@ class Ext2Filesystem : public FilesystemInterface {
   //    space.
   //  <metadata>: With the rest of ext2 metadata blocks, such as superblocks
   //    and bitmap tables.
+  // The inodes and the directories are read in parallel on the TaskScheduler,
+  // each task opening the image on its own.
   bool GetFiles(std::vector<File>* files) const override;
 
   bool LoadSettings(brillo::KeyValueStore* store) const override;
@@ -17,7 +17,7 @@
 #include "update_engine/payload_generator/extent_ranges.h"
 
 #include <algorithm>
-#include <set>
+#include <iterator>
 #include <utility>
 #include <vector>
 
@@ -66,182 +66,263 @@ void ExtentRanges::SubtractBlock(uint64_t block) {
 
 namespace {
 
-Extent UnionOverlappingExtents(const Extent& first, const Extent& second) {
-  CHECK_NE(kSparseHole, first.start_block());
-  CHECK_NE(kSparseHole, second.start_block());
-  uint64_t start = std::min(first.start_block(), second.start_block());
-  uint64_t end = std::max(first.start_block() + first.num_blocks(),
-                          second.start_block() + second.num_blocks());
-  return ExtentForRange(start, end - start);
+bool IsEmptyOrSparse(uint64_t start_block, uint64_t num_blocks) {
+  return start_block == kSparseHole || num_blocks == 0;
+}
+
+// Binary searches in the sorted and disjoint |extent_set|. The extents that
+// overlap the blocks [start, end) are the ones from FirstEndingAfter(start) up
+// to FirstStartingAt(end); the ones that overlap or touch them are the ones
+// from FirstEndingAtOrAfter(start) up to FirstStartingAfter(end).
+ExtentRanges::ExtentSet::const_iterator FirstEndingAtOrAfter(
+    const ExtentRanges::ExtentSet& extent_set, uint64_t block) {
+  return std::partition_point(
+      extent_set.begin(), extent_set.end(), [block](const auto& ext) {
+        return ext.end_block() < block;
+      });
+}
+
+ExtentRanges::ExtentSet::const_iterator FirstEndingAfter(
+    const ExtentRanges::ExtentSet& extent_set, uint64_t block) {
+  return std::partition_point(
+      extent_set.begin(), extent_set.end(), [block](const auto& ext) {
+        return ext.end_block() <= block;
+      });
+}
+
+ExtentRanges::ExtentSet::const_iterator FirstStartingAt(
+    const ExtentRanges::ExtentSet& extent_set, uint64_t block) {
+  return std::partition_point(
+      extent_set.begin(), extent_set.end(), [block](const auto& ext) {
+        return ext.start_block() < block;
+      });
+}
+
+ExtentRanges::ExtentSet::const_iterator FirstStartingAfter(
+    const ExtentRanges::ExtentSet& extent_set, uint64_t block) {
+  return std::partition_point(
+      extent_set.begin(), extent_set.end(), [block](const auto& ext) {
+        return ext.start_block() <= block;
+      });
 }
 
 }  // namespace
 
 void ExtentRanges::AddExtent(Extent extent) {
-  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+  if (IsEmptyOrSparse(extent.start_block(), extent.num_blocks()))
     return;
 
-  ExtentSet::iterator begin_del = extent_set_.end();
-  ExtentSet::iterator end_del = extent_set_.end();
-  uint64_t del_blocks = 0;
-  for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
-       it != e;
-       ++it) {
-    const bool should_merge = merge_touching_extents_
-                                  ? ExtentsOverlapOrTouch(*it, extent)
-                                  : ExtentsOverlap(*it, extent);
-    if (should_merge) {
-      end_del = it;
-      ++end_del;
-      del_blocks += it->num_blocks();
-      if (begin_del == extent_set_.end())
-        begin_del = it;
-
-      extent = UnionOverlappingExtents(extent, *it);
-    }
-  }
-  extent_set_.erase(begin_del, end_del);
-  extent_set_.insert(extent);
-  blocks_ -= del_blocks;
-  blocks_ += extent.num_blocks();
-}
+  uint64_t start = extent.start_block();
+  uint64_t end = start + extent.num_blocks();
+  auto begin_it = merge_touching_extents_
+                      ? FirstEndingAtOrAfter(extent_set_, start)
+                      : FirstEndingAfter(extent_set_, start);
+  auto end_it = merge_touching_extents_ ? FirstStartingAfter(extent_set_, end)
+                                        : FirstStartingAt(extent_set_, end);
 
-namespace {
-// Returns base - subtractee (set subtraction).
-ExtentRanges::ExtentSet SubtractOverlappingExtents(const Extent& base,
-                                                   const Extent& subtractee) {
-  ExtentRanges::ExtentSet ret;
-  if (subtractee.start_block() > base.start_block()) {
-    ret.insert(ExtentForRange(base.start_block(),
-                              subtractee.start_block() - base.start_block()));
+  uint64_t del_blocks = 0;
+  for (auto it = begin_it; it != end_it; ++it) {
+    del_blocks += it->num_blocks();
   }
-  uint64_t base_end = base.start_block() + base.num_blocks();
-  uint64_t subtractee_end = subtractee.start_block() + subtractee.num_blocks();
-  if (base_end > subtractee_end) {
-    ret.insert(ExtentForRange(subtractee_end, base_end - subtractee_end));
+  if (begin_it != end_it) {
+    start = std::min(start, begin_it->start_block());
+    end = std::max(end, std::prev(end_it)->end_block());
   }
-  return ret;
+  auto it = extent_set_.erase(begin_it, end_it);
+  extent_set_.insert(it, {start, end - start});
+  blocks_ -= del_blocks;
+  blocks_ += end - start;
 }
-}  // namespace
 
 void ExtentRanges::SubtractExtent(const Extent& extent) {
-  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+  if (IsEmptyOrSparse(extent.start_block(), extent.num_blocks()))
     return;
 
-  ExtentSet::iterator begin_del = extent_set_.end();
-  ExtentSet::iterator end_del = extent_set_.end();
-  uint64_t del_blocks = 0;
-  ExtentSet new_extents;
-  for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
-       it != e;
-       ++it) {
-    if (!ExtentsOverlap(*it, extent))
-      continue;
+  const uint64_t start = extent.start_block();
+  const uint64_t end = start + extent.num_blocks();
+  auto begin_it = FirstEndingAfter(extent_set_, start);
+  auto end_it = FirstStartingAt(extent_set_, end);
+  if (begin_it == end_it)
+    return;
 
-    if (begin_del == extent_set_.end())
-      begin_del = it;
-    end_del = it;
-    ++end_del;
+  // What is left of the first and last overlapping extents, on either side of
+  // |extent|.
+  BlockExtent remainders[2];
+  size_t num_remainders = 0;
+  if (begin_it->start_block() < start) {
+    remainders[num_remainders++] = {begin_it->start_block(),
+                                    start - begin_it->start_block()};
+  }
+  const uint64_t last_end = std::prev(end_it)->end_block();
+  if (last_end > end) {
+    remainders[num_remainders++] = {end, last_end - end};
+  }
 
+  uint64_t del_blocks = 0;
+  for (auto it = begin_it; it != end_it; ++it) {
     del_blocks += it->num_blocks();
+  }
+  for (size_t i = 0; i < num_remainders; i++) {
+    del_blocks -= remainders[i].num_blocks();
+  }
+  auto it = extent_set_.erase(begin_it, end_it);
+  extent_set_.insert(it, remainders, remainders + num_remainders);
+  blocks_ -= del_blocks;
+}
+
+template <typename Container>
+ExtentRanges::ExtentSet ExtentRanges::PackExtents(const Container& extents) {
+  ExtentSet packed;
+  packed.reserve(extents.size());
+  for (const auto& extent : extents) {
+    if (!IsEmptyOrSparse(extent.start_block(), extent.num_blocks()))
+      packed.push_back({extent.start_block(), extent.num_blocks()});
+  }
+  std::sort(packed.begin(), packed.end(), [](const auto& a, const auto& b) {
+    return a.start_block() < b.start_block();
+  });
+  return packed;
+}
 
-    ExtentSet subtraction = SubtractOverlappingExtents(*it, extent);
-    for (ExtentSet::iterator jt = subtraction.begin(), je = subtraction.end();
-         jt != je;
-         ++jt) {
-      new_extents.insert(*jt);
-      del_blocks -= jt->num_blocks();
+void ExtentRanges::AddSortedExtents(const ExtentSet& extents) {
+  if (extents.empty())
+    return;
+  ExtentSet merged;
+  merged.reserve(extent_set_.size() + extents.size());
+  auto it = extent_set_.begin();
+  auto jt = extents.begin();
+  blocks_ = 0;
+  while (it != extent_set_.end() || jt != extents.end()) {
+    // Whichever starts first goes next, so |merged| stays sorted.
+    const BlockExtent next =
+        (jt == extents.end() ||
+         (it != extent_set_.end() && it->start_block() <= jt->start_block()))
+            ? *it++
+            : *jt++;
+    if (!merged.empty()) {
+      BlockExtent& last = merged.back();
+      const bool should_merge = merge_touching_extents_
+                                    ? next.start_block() <= last.end_block()
+                                    : next.start_block() < last.end_block();
+      if (should_merge) {
+        if (next.end_block() > last.end_block()) {
+          blocks_ += next.end_block() - last.end_block();
+          last.num = next.end_block() - last.start;
+        }
+        continue;
+      }
     }
+    merged.push_back(next);
+    blocks_ += next.num_blocks();
   }
-  extent_set_.erase(begin_del, end_del);
-  extent_set_.insert(new_extents.begin(), new_extents.end());
-  blocks_ -= del_blocks;
+  extent_set_ = std::move(merged);
+}
+
+void ExtentRanges::SubtractSortedExtents(const ExtentSet& extents) {
+  if (extents.empty() || extent_set_.empty())
+    return;
+  ExtentSet result;
+  result.reserve(extent_set_.size() + extents.size());
+  auto jt = extents.begin();
+  blocks_ = 0;
+  for (const auto& extent : extent_set_) {
+    uint64_t start = extent.start_block();
+    const uint64_t end = extent.end_block();
+    // Skip what ends before this extent. Both lists are sorted so none of it
+    // can overlap the following extents either.
+    while (jt != extents.end() && jt->end_block() <= start)
+      ++jt;
+    // Cut out every subtracted extent overlapping this one. The last one may
+    // also overlap the next extent, so it isn't skipped.
+    for (auto kt = jt; kt != extents.end() && kt->start_block() < end; ++kt) {
+      if (kt->start_block() > start) {
+        result.push_back({start, kt->start_block() - start});
+        blocks_ += kt->start_block() - start;
+      }
+      start = std::max(start, kt->end_block());
+      if (start >= end)
+        break;
+    }
+    if (start < end) {
+      result.push_back({start, end - start});
+      blocks_ += end - start;
+    }
+  }
+  extent_set_ = std::move(result);
 }
 
 void ExtentRanges::AddRanges(const ExtentRanges& ranges) {
   // Remember to respect |merge_touching_extents_| setting
-  for (ExtentSet::const_iterator it = ranges.extent_set_.begin(),
-                                 e = ranges.extent_set_.end();
-       it != e;
-       ++it) {
-    AddExtent(*it);
-  }
+  AddSortedExtents(ranges.extent_set_);
 }
 
 void ExtentRanges::SubtractRanges(const ExtentRanges& ranges) {
-  for (ExtentSet::const_iterator it = ranges.extent_set_.begin(),
-                                 e = ranges.extent_set_.end();
-       it != e;
-       ++it) {
-    SubtractExtent(*it);
-  }
+  SubtractSortedExtents(ranges.extent_set_);
 }
 
 void ExtentRanges::AddExtents(const vector<Extent>& extents) {
   // Remember to respect |merge_touching_extents_| setting
-  for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
-       it != e;
-       ++it) {
-    AddExtent(*it);
+  if (extents.size() == 1) {
+    AddExtent(extents[0]);
+    return;
   }
+  AddSortedExtents(PackExtents(extents));
+}
+
+void ExtentRanges::AddExtents(const vector<BlockExtent>& extents) {
+  AddSortedExtents(PackExtents(extents));
 }
 
 void ExtentRanges::SubtractExtents(const vector<Extent>& extents) {
-  for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
-       it != e;
-       ++it) {
-    SubtractExtent(*it);
+  if (extents.size() == 1) {
+    SubtractExtent(extents[0]);
+    return;
   }
+  SubtractSortedExtents(PackExtents(extents));
 }
 
 void ExtentRanges::AddRepeatedExtents(
     const ::google::protobuf::RepeatedPtrField<Extent>& exts) {
   // Remember to respect |merge_touching_extents_| setting
-  for (int i = 0, e = exts.size(); i != e; ++i) {
-    AddExtent(exts.Get(i));
+  if (exts.size() == 1) {
+    AddExtent(exts.Get(0));
+    return;
   }
+  AddSortedExtents(PackExtents(exts));
 }
 
 void ExtentRanges::SubtractRepeatedExtents(
     const ::google::protobuf::RepeatedPtrField<Extent>& exts) {
-  for (int i = 0, e = exts.size(); i != e; ++i) {
-    SubtractExtent(exts.Get(i));
+  if (exts.size() == 1) {
+    SubtractExtent(exts.Get(0));
+    return;
   }
+  SubtractSortedExtents(PackExtents(exts));
 }
 
 bool ExtentRanges::OverlapsWithExtent(const Extent& extent) const {
-  for (const auto& entry : GetCandidateRange(extent)) {
-    if (ExtentsOverlap(entry, extent)) {
-      return true;
-    }
-  }
-  return false;
+  if (IsEmptyOrSparse(extent.start_block(), extent.num_blocks()))
+    return false;
+  auto it = FirstEndingAfter(extent_set_, extent.start_block());
+  return it != extent_set_.end() &&
+         it->start_block() < extent.start_block() + extent.num_blocks();
 }
 
 bool ExtentRanges::ContainsBlock(uint64_t block) const {
-  auto lower = extent_set_.lower_bound(ExtentForRange(block, 1));
-  // The block could be on the extent before the one in |lower|.
-  if (lower != extent_set_.begin())
-    lower--;
-  // Any extent starting at block+1 or later is not interesting, so this is the
-  // upper limit.
-  auto upper = extent_set_.lower_bound(ExtentForRange(block + 1, 0));
-  for (auto iter = lower; iter != upper; ++iter) {
-    if (iter->start_block() <= block &&
-        block < iter->start_block() + iter->num_blocks()) {
-      return true;
-    }
-  }
-  return false;
+  // The only extent that can contain |block| is the last one starting at or
+  // before it.
+  auto it = FirstStartingAfter(extent_set_, block);
+  if (it == extent_set_.begin())
+    return false;
+  --it;
+  return block < it->end_block();
 }
 
 void ExtentRanges::Dump() const {
   LOG(INFO) << "ExtentRanges Dump. blocks: " << blocks_;
-  for (ExtentSet::const_iterator it = extent_set_.begin(),
-                                 e = extent_set_.end();
-       it != e;
-       ++it) {
-    LOG(INFO) << "{" << it->start_block() << ", " << it->num_blocks() << "}";
+  for (const auto& extent : extent_set_) {
+    LOG(INFO) << "{" << extent.start_block() << ", " << extent.num_blocks()
+              << "}";
   }
 }
 
@@ -266,12 +347,8 @@ vector<Extent> ExtentRanges::GetExtentsForBlockCount(uint64_t count) const {
     return out;
   uint64_t out_blocks = 0;
   CHECK(count <= blocks_);
-  for (ExtentSet::const_iterator it = extent_set_.begin(),
-                                 e = extent_set_.end();
-       it != e;
-       ++it) {
+  for (const auto& extent : extent_set_) {
     const uint64_t blocks_needed = count - out_blocks;
-    const Extent& extent = *it;
     out.push_back(extent);
     out_blocks += extent.num_blocks();
     if (extent.num_blocks() < blocks_needed)
@@ -290,13 +367,14 @@ vector<Extent> ExtentRanges::GetExtentsForBlockCount(uint64_t count) const {
 
 Range<ExtentRanges::ExtentSet::const_iterator> ExtentRanges::GetCandidateRange(
     const Extent& extent) const {
-  auto lower_it = extent_set_.lower_bound(extent);
+  // From the last extent starting before |extent| to the last one starting at
+  // its end.
+  auto lower_it = FirstStartingAt(extent_set_, extent.start_block());
   if (lower_it != extent_set_.begin()) {
     --lower_it;
   }
-
-  const auto upper_it = extent_set_.upper_bound(
-      ExtentForRange(extent.start_block() + extent.num_blocks(), 1));
+  const auto upper_it = FirstStartingAfter(
+      extent_set_, extent.start_block() + extent.num_blocks());
   return {lower_it, upper_it};
 }
 
@@ -317,48 +395,30 @@ vector<Extent> FilterExtentRanges(const vector<Extent>& extents,
                                   const ExtentRanges& ranges) {
   vector<Extent> result;
   const ExtentRanges::ExtentSet& extent_set = ranges.extent_set();
-  for (Extent extent : extents) {
-    // The extents are sorted by the start_block. We want to iterate all the
-    // Extents in the ExtentSet possibly overlapping the current |extent|. This
-    // is achieved by looking from the extent whose start_block is *lower* than
-    // the extent.start_block() up to the greatest extent whose start_block is
-    // lower than extent.start_block() + extent.num_blocks().
-    auto lower = extent_set.lower_bound(extent);
-    // We need to decrement the lower_bound to look at the extent that could
-    // overlap the beginning of the current |extent|.
-    if (lower != extent_set.begin())
-      lower--;
-    auto upper = extent_set.lower_bound(
-        ExtentForRange(extent.start_block() + extent.num_blocks(), 0));
-    for (auto iter = lower; iter != upper; ++iter) {
-      if (!ExtentRanges::ExtentsOverlap(extent, *iter))
-        continue;
-      if (iter->start_block() <= extent.start_block()) {
-        // We need to cut blocks from the beginning of the |extent|.
-        uint64_t cut_blocks =
-            iter->start_block() + iter->num_blocks() - extent.start_block();
-        if (cut_blocks >= extent.num_blocks()) {
-          extent.set_num_blocks(0);
-          break;
-        }
-        extent = ExtentForRange(extent.start_block() + cut_blocks,
-                                extent.num_blocks() - cut_blocks);
-      } else {
+  for (const Extent& extent : extents) {
+    if (IsEmptyOrSparse(extent.start_block(), extent.num_blocks())) {
+      if (extent.num_blocks() > 0)
+        result.push_back(extent);
+      continue;
+    }
+    uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
+    // The extents are sorted by the start_block and disjoint, so the ones
+    // overlapping |extent| are the ones from the first ending after its start
+    // up to the last one starting before its end.
+    auto iter = FirstEndingAfter(extent_set, start);
+    for (; iter != extent_set.end() && iter->start_block() < end; ++iter) {
+      if (iter->start_block() > start) {
         // We need to cut blocks on the middle of the extent, possible up to the
         // end of it.
-        result.push_back(ExtentForRange(
-            extent.start_block(), iter->start_block() - extent.start_block()));
-        uint64_t new_start = iter->start_block() + iter->num_blocks();
-        uint64_t old_end = extent.start_block() + extent.num_blocks();
-        if (new_start >= old_end) {
-          extent.set_num_blocks(0);
-          break;
-        }
-        extent = ExtentForRange(new_start, old_end - new_start);
+        result.push_back(ExtentForRange(start, iter->start_block() - start));
       }
+      start = iter->end_block();
+      if (start >= end)
+        break;
     }
-    if (extent.num_blocks() > 0)
-      result.push_back(extent);
+    if (start < end)
+      result.push_back(ExtentForRange(start, end - start));
   }
   return result;
 }
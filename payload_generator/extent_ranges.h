@@ -18,7 +18,6 @@
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_EXTENT_RANGES_H_
 
 #include <map>
-#include <set>
 #include <vector>
 
 #include <base/macros.h>
@@ -49,9 +48,31 @@ Extent ExtentForBytes(uint64_t block_size,
                       uint64_t start_bytes,
                       uint64_t size_bytes);
 
+// An extent as two integers instead of a protobuf message, so that a vector of
+// them is dense in memory and cheap to build. ExtentRanges keeps its extents in
+// this form, and the generator builds lists of blocks in it, converting them to
+// Extent messages only when storing them in an operation. It has the same
+// accessors as Extent and converts to one, so code iterating over them can
+// treat the elements as extents.
+struct BlockExtent {
+  uint64_t start_block() const { return start; }
+  uint64_t num_blocks() const { return num; }
+  uint64_t end_block() const { return start + num; }
+  operator Extent() const { return ExtentForRange(start, num); }
+
+  bool operator==(const BlockExtent& other) const {
+    return start == other.start && num == other.num;
+  }
+  bool operator!=(const BlockExtent& other) const { return !(*this == other); }
+
+  uint64_t start;
+  uint64_t num;
+};
+
 class ExtentRanges {
  public:
-  typedef std::set<Extent, ExtentLess> ExtentSet;
+  // Sorted by start block, and disjoint.
+  typedef std::vector<BlockExtent> ExtentSet;
 
   ExtentRanges() = default;
   // When |merge_touching_extents| is set to false, extents that are only
@@ -66,6 +87,7 @@ class ExtentRanges {
   void AddExtent(Extent extent);
   void SubtractExtent(const Extent& extent);
   void AddExtents(const std::vector<Extent>& extents);
+  void AddExtents(const std::vector<BlockExtent>& extents);
   void SubtractExtents(const std::vector<Extent>& extents);
   void AddRepeatedExtents(
       const ::google::protobuf::RepeatedPtrField<Extent>& exts);
@@ -108,6 +130,18 @@ class ExtentRanges {
       const Extent& extent) const;
 
  private:
+  // Merges the sorted, possibly overlapping, |extents| into |extent_set_| in a
+  // single pass over both.
+  void AddSortedExtents(const ExtentSet& extents);
+  // Removes the blocks of the sorted |extents| from |extent_set_| in a single
+  // pass over both.
+  void SubtractSortedExtents(const ExtentSet& extents);
+
+  // Copies and sorts |extents|, dropping sparse holes and empty extents, to
+  // pass to the bulk operations above.
+  template <typename Container>
+  static ExtentSet PackExtents(const Container& extents);
+
   ExtentSet extent_set_;
   uint64_t blocks_ = 0;
   bool merge_touching_extents_ = true;
@@ -0,0 +1,146 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Measures the ExtentRanges set operations and BlockMapping, which the delta
+// generator runs over all the blocks and files of the partitions.
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <base/logging.h>
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/block_mapping.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+
+// |count| disjoint extents of 1 to 8 blocks, 1 to 8 blocks apart, in random
+// order like the extents of the files of a filesystem.
+std::vector<Extent> RandomExtents(size_t count, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<Extent> extents;
+  extents.reserve(count);
+  uint64_t block = 0;
+  for (size_t i = 0; i < count; i++) {
+    block += 1 + rng() % 8;
+    const uint64_t num_blocks = 1 + rng() % 8;
+    extents.push_back(ExtentForRange(block, num_blocks));
+    block += num_blocks;
+  }
+  std::shuffle(extents.begin(), extents.end(), rng);
+  return extents;
+}
+
+// Argument: the number of extents, added one at a time.
+void BM_ExtentRangesAddExtent(benchmark::State& state) {
+  const std::vector<Extent> extents = RandomExtents(state.range(0), 0);
+  for (auto _ : state) {
+    ExtentRanges ranges;
+    for (const Extent& extent : extents) {
+      ranges.AddExtent(extent);
+    }
+    benchmark::DoNotOptimize(ranges.blocks());
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+BENCHMARK(BM_ExtentRangesAddExtent)
+    ->ArgName("extents")
+    ->RangeMultiplier(8)
+    ->Range(1 << 10, 1 << 16);
+
+// Argument: the number of extents, subtracted one at a time from a range
+// covering all of them.
+void BM_ExtentRangesSubtractExtent(benchmark::State& state) {
+  const std::vector<Extent> extents = RandomExtents(state.range(0), 0);
+  uint64_t end_block = 0;
+  for (const Extent& extent : extents) {
+    end_block =
+        std::max(end_block, extent.start_block() + extent.num_blocks());
+  }
+  for (auto _ : state) {
+    ExtentRanges ranges;
+    ranges.AddExtent(ExtentForRange(0, end_block));
+    for (const Extent& extent : extents) {
+      ranges.SubtractExtent(extent);
+    }
+    benchmark::DoNotOptimize(ranges.blocks());
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+BENCHMARK(BM_ExtentRangesSubtractExtent)
+    ->ArgName("extents")
+    ->RangeMultiplier(8)
+    ->Range(1 << 10, 1 << 16);
+
+// Argument: the number of extents of each of two unrelated sets, the first
+// added and the second subtracted in bulk.
+void BM_ExtentRangesAddSubtractExtents(benchmark::State& state) {
+  const std::vector<Extent> added = RandomExtents(state.range(0), 1);
+  const std::vector<Extent> subtracted = RandomExtents(state.range(0), 2);
+  for (auto _ : state) {
+    ExtentRanges ranges;
+    ranges.AddExtents(added);
+    ranges.SubtractExtents(subtracted);
+    benchmark::DoNotOptimize(ranges.blocks());
+  }
+  state.SetItemsProcessed(state.iterations() *
+                          (added.size() + subtracted.size()));
+}
+BENCHMARK(BM_ExtentRangesAddSubtractExtents)
+    ->ArgName("extents")
+    ->RangeMultiplier(8)
+    ->Range(1 << 10, 1 << 16);
+
+// Argument: the number of blocks of the image, a quarter of them copies of
+// other blocks, the way identical blocks are found in the partitions.
+void BM_BlockMappingAddManyDiskBlocks(benchmark::State& state) {
+  const size_t num_blocks = state.range(0);
+  brillo::Blob data(num_blocks * kBlockSize);
+  std::mt19937 rng(0);
+  std::generate(data.begin(), data.end(), rng);
+  for (size_t i = 0; i < num_blocks / 4; i++) {
+    const size_t from = rng() % num_blocks;
+    const size_t to = rng() % num_blocks;
+    std::copy_n(data.begin() + from * kBlockSize,
+                kBlockSize,
+                data.begin() + to * kBlockSize);
+  }
+  ScopedTempFile file("block_mapping_bench.XXXXXX", true);
+  CHECK(utils::WriteFile(file.path().c_str(), data.data(), data.size()));
+  std::vector<BlockMapping::BlockId> block_ids;
+  for (auto _ : state) {
+    BlockMapping mapping(kBlockSize);
+    CHECK(mapping.AddManyDiskBlocks(file.fd(), 0, num_blocks, &block_ids));
+    benchmark::DoNotOptimize(block_ids);
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_BlockMappingAddManyDiskBlocks)
+    ->ArgName("blocks")
+    ->RangeMultiplier(4)
+    ->Range(1 << 10, 1 << 14);
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
@@ -390,4 +390,60 @@ TEST(ExtentRangesTest, OverlapsWithExtent) {
   ASSERT_TRUE(ranges.OverlapsWithExtent(ExtentForRange(19, 1)));
 }
 
+TEST(ExtentRangesTest, BulkOperationsMatchSingleExtentOperations) {
+  for (bool merge_touching : {true, false}) {
+    std::vector<Extent> extents;
+    for (uint64_t i = 0; i < 200; i++) {
+      // Overlapping, touching and disjoint extents, out of order.
+      extents.push_back(ExtentForRange((i * 37) % 500, i % 7 + 1));
+    }
+    extents.push_back(ExtentForRange(kSparseHole, 4));
+    extents.push_back(ExtentForRange(10, 0));
+
+    ExtentRanges bulk{merge_touching};
+    ExtentRanges single{merge_touching};
+    bulk.AddExtents(extents);
+    for (const auto& extent : extents) {
+      single.AddExtent(extent);
+    }
+    ASSERT_EQ(single.blocks(), bulk.blocks());
+    ASSERT_EQ(single.extent_set(), bulk.extent_set());
+
+    std::vector<Extent> subtract;
+    for (uint64_t i = 0; i < 50; i++) {
+      subtract.push_back(ExtentForRange((i * 53) % 520, i % 11 + 1));
+    }
+    ExtentRanges subtract_ranges;
+    subtract_ranges.AddExtents(subtract);
+    ExtentRanges bulk_ranges = bulk;
+    bulk.SubtractExtents(subtract);
+    bulk_ranges.SubtractRanges(subtract_ranges);
+    for (const auto& extent : subtract) {
+      single.SubtractExtent(extent);
+    }
+    ASSERT_EQ(single.blocks(), bulk.blocks());
+    ASSERT_EQ(single.extent_set(), bulk.extent_set());
+    ASSERT_EQ(single.blocks(), bulk_ranges.blocks());
+    ASSERT_EQ(single.extent_set(), bulk_ranges.extent_set());
+
+    for (uint64_t block = 0; block < 520; block++) {
+      ASSERT_EQ(!FilterExtentRanges({ExtentForRange(block, 1)}, single).empty(),
+                !single.ContainsBlock(block));
+    }
+  }
+}
+
+TEST(ExtentRangesTest, AddRangesTest) {
+  ExtentRanges ranges;
+  ranges.AddExtent(ExtentForRange(10, 10));
+  ranges.AddExtent(ExtentForRange(30, 10));
+  ExtentRanges other;
+  other.AddExtent(ExtentForRange(0, 5));
+  other.AddExtent(ExtentForRange(15, 10));
+  other.AddExtent(ExtentForRange(40, 5));
+  ranges.AddRanges(other);
+  static const uint64_t kExpected[] = {0, 5, 10, 15, 30, 15};
+  ASSERT_RANGE_EQ(ranges, kExpected);
+}
+
 }  // namespace chromeos_update_engine
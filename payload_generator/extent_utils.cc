@@ -18,6 +18,7 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
@@ -36,106 +37,100 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
-void AppendBlockToExtents(vector<Extent>* extents, uint64_t block) {
+namespace {
+
+// Let the templates below work on both Extent and BlockExtent lists.
+void SetNumBlocks(Extent* extent, uint64_t num_blocks) {
+  extent->set_num_blocks(num_blocks);
+}
+void SetNumBlocks(BlockExtent* extent, uint64_t num_blocks) {
+  extent->num = num_blocks;
+}
+
+void PushExtent(vector<Extent>* extents, uint64_t start, uint64_t num) {
+  extents->push_back(ExtentForRange(start, num));
+}
+void PushExtent(vector<BlockExtent>* extents, uint64_t start, uint64_t num) {
+  extents->push_back({start, num});
+}
+
+template <typename T>
+void AppendBlockToExtentsTemplate(vector<T>* extents, uint64_t block) {
   // First try to extend the last extent in |extents|, if any.
   if (!extents->empty()) {
-    Extent& extent = extents->back();
+    T& extent = extents->back();
     uint64_t next_block = extent.start_block() == kSparseHole
                               ? kSparseHole
                               : extent.start_block() + extent.num_blocks();
     if (next_block == block) {
-      extent.set_num_blocks(extent.num_blocks() + 1);
+      SetNumBlocks(&extent, extent.num_blocks() + 1);
       return;
     }
   }
   // If unable to extend the last extent, append a new single-block extent.
-  Extent new_extent;
-  new_extent.set_start_block(block);
-  new_extent.set_num_blocks(1);
-  extents->push_back(new_extent);
-}
-
-void ExtendExtents(
-    google::protobuf::RepeatedPtrField<Extent>* extents,
-    const google::protobuf::RepeatedPtrField<Extent>& extents_to_add) {
-  vector<Extent> extents_vector;
-  vector<Extent> extents_to_add_vector;
-  ExtentsToVector(*extents, &extents_vector);
-  ExtentsToVector(extents_to_add, &extents_to_add_vector);
-  extents_vector.insert(extents_vector.end(),
-                        extents_to_add_vector.begin(),
-                        extents_to_add_vector.end());
-  NormalizeExtents(&extents_vector);
-  extents->Clear();
-  StoreExtents(extents_vector, extents);
+  PushExtent(extents, block, 1);
 }
 
-// Stores all Extents in 'extents' into 'out'.
-void StoreExtents(const vector<Extent>& extents,
-                  google::protobuf::RepeatedPtrField<Extent>* out) {
-  for (const Extent& extent : extents) {
+template <typename Container>
+void StoreExtentsTemplate(const Container& extents,
+                          google::protobuf::RepeatedPtrField<Extent>* out) {
+  out->Reserve(out->size() + extents.size());
+  for (const auto& extent : extents) {
     Extent* new_extent = out->Add();
-    *new_extent = extent;
+    new_extent->set_start_block(extent.start_block());
+    new_extent->set_num_blocks(extent.num_blocks());
   }
 }
 
-// Stores all extents in |extents| into |out_vector|.
-void ExtentsToVector(const google::protobuf::RepeatedPtrField<Extent>& extents,
-                     vector<Extent>* out_vector) {
-  out_vector->clear();
-  for (int i = 0; i < extents.size(); i++) {
-    out_vector->push_back(extents.Get(i));
-  }
+void AppendPacked(const google::protobuf::RepeatedPtrField<Extent>& extents,
+                  vector<BlockExtent>* out) {
+  for (const Extent& extent : extents)
+    out->push_back({extent.start_block(), extent.num_blocks()});
 }
 
 template <typename Container>
 string ExtentsToStringTemplate(const Container& extents) {
   string ext_str;
-  for (const Extent& e : extents)
+  for (const auto& e : extents)
     ext_str += base::StringPrintf("[%" PRIu64 ", %" PRIu64 "] ",
                                   static_cast<uint64_t>(e.start_block()),
                                   static_cast<uint64_t>(e.num_blocks()));
   return ext_str;
 }
 
-std::string ExtentsToString(const std::vector<Extent>& extents) {
-  return ExtentsToStringTemplate(extents);
-}
-
-std::string ExtentsToString(
-    const google::protobuf::RepeatedPtrField<Extent>& extents) {
-  return ExtentsToStringTemplate(extents);
-}
-
-void NormalizeExtents(vector<Extent>* extents) {
-  vector<Extent> new_extents;
-  for (const Extent& curr_ext : *extents) {
-    if (new_extents.empty()) {
-      new_extents.push_back(curr_ext);
-      continue;
-    }
-    Extent& last_ext = new_extents.back();
-    if (last_ext.start_block() + last_ext.num_blocks() ==
-        curr_ext.start_block()) {
-      // If the extents are touching, we want to combine them.
-      last_ext.set_num_blocks(last_ext.num_blocks() + curr_ext.num_blocks());
-    } else {
-      // Otherwise just include the extent as is.
-      new_extents.push_back(curr_ext);
+// Merges the touching extents in place, keeping the first of each run.
+template <typename T>
+void NormalizeExtentsTemplate(vector<T>* extents) {
+  size_t size = 0;
+  for (size_t i = 0; i < extents->size(); i++) {
+    const T& curr_ext = (*extents)[i];
+    if (size > 0) {
+      T& last_ext = (*extents)[size - 1];
+      if (last_ext.start_block() + last_ext.num_blocks() ==
+          curr_ext.start_block()) {
+        // If the extents are touching, we want to combine them.
+        SetNumBlocks(&last_ext, last_ext.num_blocks() + curr_ext.num_blocks());
+        continue;
+      }
     }
+    // Otherwise just include the extent as is.
+    if (size != i)
+      (*extents)[size] = curr_ext;
+    size++;
   }
-  *extents = new_extents;
+  extents->resize(size);
 }
 
-vector<Extent> ExtentsSublist(const vector<Extent>& extents,
-                              uint64_t block_offset,
-                              uint64_t block_count) {
-  vector<Extent> result;
+template <typename T>
+vector<T> ExtentsSublistTemplate(const vector<T>& extents,
+                                 uint64_t block_offset,
+                                 uint64_t block_count) {
+  vector<T> result;
   uint64_t scanned_blocks = 0;
   if (block_count == 0)
     return result;
   uint64_t end_block_offset = block_offset + block_count;
-  for (const Extent& extent : extents) {
+  for (const T& extent : extents) {
     // The loop invariant is that if |extents| has enough blocks, there's
     // still some extent to add to |result|. This implies that at the beginning
     // of the loop scanned_blocks < block_offset + block_count.
@@ -153,7 +148,7 @@ vector<Extent> ExtentsSublist(const vector<Extent>& extents,
         new_num_blocks -= block_offset - scanned_blocks;
         new_start += block_offset - scanned_blocks;
       }
-      result.push_back(ExtentForRange(new_start, new_num_blocks));
+      PushExtent(&result, new_start, new_num_blocks);
     }
     scanned_blocks += extent.num_blocks();
     if (scanned_blocks >= end_block_offset)
@@ -162,6 +157,104 @@ vector<Extent> ExtentsSublist(const vector<Extent>& extents,
   return result;
 }
 
+}  // namespace
+
+void AppendBlockToExtents(vector<Extent>* extents, uint64_t block) {
+  AppendBlockToExtentsTemplate(extents, block);
+}
+
+void AppendBlockToExtents(vector<BlockExtent>* extents, uint64_t block) {
+  AppendBlockToExtentsTemplate(extents, block);
+}
+
+void ExtendExtents(
+    google::protobuf::RepeatedPtrField<Extent>* extents,
+    const google::protobuf::RepeatedPtrField<Extent>& extents_to_add) {
+  vector<BlockExtent> packed;
+  packed.reserve(extents->size() + extents_to_add.size());
+  AppendPacked(*extents, &packed);
+  AppendPacked(extents_to_add, &packed);
+  NormalizeExtents(&packed);
+  extents->Clear();
+  StoreExtents(packed, extents);
+}
+
+// Stores all Extents in 'extents' into 'out'.
+void StoreExtents(const vector<Extent>& extents,
+                  google::protobuf::RepeatedPtrField<Extent>* out) {
+  StoreExtentsTemplate(extents, out);
+}
+
+void StoreExtents(const vector<BlockExtent>& extents,
+                  google::protobuf::RepeatedPtrField<Extent>* out) {
+  StoreExtentsTemplate(extents, out);
+}
+
+// Stores all extents in |extents| into |out_vector|.
+void ExtentsToVector(const google::protobuf::RepeatedPtrField<Extent>& extents,
+                     vector<Extent>* out_vector) {
+  out_vector->assign(extents.begin(), extents.end());
+}
+
+std::string ExtentsToString(const std::vector<Extent>& extents) {
+  return ExtentsToStringTemplate(extents);
+}
+
+std::string ExtentsToString(const std::vector<BlockExtent>& extents) {
+  return ExtentsToStringTemplate(extents);
+}
+
+std::string ExtentsToString(
+    const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  return ExtentsToStringTemplate(extents);
+}
+
+void NormalizeExtents(vector<Extent>* extents) {
+  NormalizeExtentsTemplate(extents);
+}
+
+void NormalizeExtents(vector<BlockExtent>* extents) {
+  NormalizeExtentsTemplate(extents);
+}
+
+void SortAndMergeExtents(vector<BlockExtent>* extents) {
+  extents->erase(std::remove_if(extents->begin(),
+                                extents->end(),
+                                [](const BlockExtent& extent) {
+                                  return extent.start == kSparseHole ||
+                                         extent.num == 0;
+                                }),
+                 extents->end());
+  std::sort(extents->begin(),
+            extents->end(),
+            [](const BlockExtent& a, const BlockExtent& b) {
+              return a.start < b.start;
+            });
+  size_t size = 0;
+  for (size_t i = 0; i < extents->size(); i++) {
+    const BlockExtent extent = (*extents)[i];
+    if (size > 0 && extent.start <= (*extents)[size - 1].end_block()) {
+      BlockExtent& last = (*extents)[size - 1];
+      last.num = std::max(last.end_block(), extent.end_block()) - last.start;
+    } else {
+      (*extents)[size++] = extent;
+    }
+  }
+  extents->resize(size);
+}
+
+vector<Extent> ExtentsSublist(const vector<Extent>& extents,
+                              uint64_t block_offset,
+                              uint64_t block_count) {
+  return ExtentsSublistTemplate(extents, block_offset, block_count);
+}
+
+vector<BlockExtent> ExtentsSublist(const vector<BlockExtent>& extents,
+                                   uint64_t block_offset,
+                                   uint64_t block_count) {
+  return ExtentsSublistTemplate(extents, block_offset, block_count);
+}
+
 bool operator==(const Extent& a, const Extent& b) noexcept {
   return a.start_block() == b.start_block() && a.num_blocks() == b.num_blocks();
 }
@@ -25,6 +25,7 @@
 
 #include "google/protobuf/repeated_field.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
 
 // Utility functions for manipulating Extents and lists of blocks.
@@ -35,6 +36,7 @@ namespace chromeos_update_engine {
 // in the next extent. This function will not handle inserting block
 // into an arbitrary place in the extents.
 void AppendBlockToExtents(std::vector<Extent>* extents, uint64_t block);
+void AppendBlockToExtents(std::vector<BlockExtent>* extents, uint64_t block);
 
 // Takes a collection (vector or RepeatedPtrField) of Extent and
 // returns a vector of the blocks referenced, in order.
@@ -58,6 +60,8 @@ std::vector<uint64_t> ExpandExtents(const T& extents) {
 // Stores all Extents in 'extents' into 'out'.
 void StoreExtents(const std::vector<Extent>& extents,
                   google::protobuf::RepeatedPtrField<Extent>* out);
+void StoreExtents(const std::vector<BlockExtent>& extents,
+                  google::protobuf::RepeatedPtrField<Extent>* out);
 
 // Stores all extents in |extents| into |out_vector|.
 void ExtentsToVector(const google::protobuf::RepeatedPtrField<Extent>& extents,
@@ -65,6 +69,7 @@ void ExtentsToVector(const google::protobuf::RepeatedPtrField<Extent>& extents,
 
 // Returns a string representing all extents in |extents|.
 std::string ExtentsToString(const std::vector<Extent>& extents);
+std::string ExtentsToString(const std::vector<BlockExtent>& extents);
 std::string ExtentsToString(
     const google::protobuf::RepeatedPtrField<Extent>& extents);
 
@@ -78,6 +83,12 @@ void ExtendExtents(
 // to be sorted by start block. E.g. if |extents| is [(1, 2), (3, 5), (10, 2)]
 // then |extents| will be changed to [(1, 7), (10, 2)].
 void NormalizeExtents(std::vector<Extent>* extents);
+void NormalizeExtents(std::vector<BlockExtent>* extents);
+
+// Sorts |extents| by start block and merges the ones that overlap or touch, so
+// that they become disjoint. Sparse holes and empty extents are dropped, like
+// in ExtentRanges. E.g. [(10, 2), (1, 2), (2, 3)] becomes [(1, 4), (10, 2)].
+void SortAndMergeExtents(std::vector<BlockExtent>* extents);
 
 // Return a subsequence of the list of blocks passed. Both the passed list of
 // blocks |extents| and the return value are expressed as a list of Extent, not
@@ -86,6 +97,9 @@ void NormalizeExtents(std::vector<Extent>* extents);
 std::vector<Extent> ExtentsSublist(const std::vector<Extent>& extents,
                                    uint64_t block_offset,
                                    uint64_t block_count);
+std::vector<BlockExtent> ExtentsSublist(const std::vector<BlockExtent>& extents,
+                                        uint64_t block_offset,
+                                        uint64_t block_count);
 
 bool operator==(const Extent& a, const Extent& b) noexcept;
 
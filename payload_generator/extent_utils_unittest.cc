@@ -154,4 +154,39 @@ TEST(ExtentUtilsTest, ExtentsSublistTest) {
             ExtentsSublist(extents, 14, 100));
 }
 
+TEST(ExtentUtilsTest, BlockExtentsTest) {
+  vector<BlockExtent> extents;
+  for (uint64_t block : {3, 4, 5, 8, 9, 20})
+    AppendBlockToExtents(&extents, block);
+  EXPECT_EQ((vector<BlockExtent>{{3, 3}, {8, 2}, {20, 1}}), extents);
+
+  EXPECT_EQ((vector<BlockExtent>{{4, 2}, {8, 1}}),
+            ExtentsSublist(extents, 1, 3));
+
+  extents.push_back({21, 4});
+  NormalizeExtents(&extents);
+  EXPECT_EQ((vector<BlockExtent>{{3, 3}, {8, 2}, {20, 5}}), extents);
+
+  google::protobuf::RepeatedPtrField<Extent> stored;
+  *stored.Add() = ExtentForRange(1, 1);
+  StoreExtents(extents, &stored);
+  ASSERT_EQ(4, stored.size());
+  EXPECT_EQ(ExtentForRange(1, 1), stored[0]);
+  EXPECT_EQ(ExtentForRange(3, 3), stored[1]);
+  EXPECT_EQ(ExtentForRange(20, 5), stored[3]);
+  EXPECT_EQ("[3, 3] [8, 2] [20, 5] ", ExtentsToString(extents));
+}
+
+TEST(ExtentUtilsTest, SortAndMergeExtentsTest) {
+  vector<BlockExtent> extents = {
+      {10, 2}, {1, 2}, {kSparseHole, 3}, {2, 3}, {7, 0}, {12, 1}, {30, 5}};
+  SortAndMergeExtents(&extents);
+  EXPECT_EQ((vector<BlockExtent>{{1, 4}, {10, 3}, {30, 5}}), extents);
+
+  // Extents within others are absorbed.
+  extents = {{5, 10}, {6, 2}, {0, 1}};
+  SortAndMergeExtents(&extents);
+  EXPECT_EQ((vector<BlockExtent>{{0, 1}, {5, 10}}), extents);
+}
+
 }  // namespace chromeos_update_engine
@@ -18,20 +18,26 @@
 
 #include <fcntl.h>
 #include <inttypes.h>
+#include <string.h>
 
 #include <algorithm>
 #include <deque>
 #include <memory>
+#include <string_view>
+#include <utility>
 
 #include <base/format_macros.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <base/synchronization/lock.h>
-#include <base/threading/simple_thread.h>
 #include <brillo/secure_blob.h>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/base_payload.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/mapped_image.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 
 using std::vector;
 
@@ -40,46 +46,133 @@ namespace chromeos_update_engine {
 namespace {
 
 const size_t kDefaultFullChunkSize = 1024 * 1024;  // 1 MiB
+// Without a chunk size in the config, partitions of at least this many default
+// chunks use chunks up to kMaxDefaultFullChunkSize instead, which compress
+// better and still keep all the threads busy.
+const size_t kMinDefaultFullChunks = 512;
+const size_t kMaxDefaultFullChunkSize = 4 * 1024 * 1024;  // 4 MiB
+// How much of the partition is read at once to split it in content defined
+// chunks when it isn't mapped.
+const size_t kChunkingReadSize = 1024 * 1024;  // 1 MiB
+
+// A hash of the content of |block|, which picks the blocks ending a content
+// defined chunk. It only needs to be stable across builds and well mixed.
+uint64_t BlockFingerprint(std::string_view block) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i + sizeof(uint64_t) <= block.size();
+       i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, block.data() + i, sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3;
+    hash ^= hash >> 47;
+  }
+  hash *= 0xff51afd7ed558ccd;
+  return hash ^ (hash >> 33);
+}
+
+// Splits the |num_blocks| blocks read from |image|, or |fd| if it is null, in
+// chunks of at most |max_blocks| blocks. Past a quarter of that, a chunk ends
+// after the block whose fingerprint is a multiple of a quarter of it, so the
+// boundaries only depend on the content around them: data moved by blocks
+// inserted or removed before it is split in the same chunks as before, which
+// compress to the same blobs, instead of all the chunks after the change
+// being shifted.
+bool SplitContentDefinedChunks(const MappedImage* image,
+                               int fd,
+                               size_t block_size,
+                               size_t num_blocks,
+                               size_t max_blocks,
+                               vector<Extent>* chunks) {
+  const size_t min_blocks = std::max<size_t>(1, max_blocks / 4);
+  const uint64_t divisor = min_blocks;
+  const size_t read_blocks =
+      std::max<size_t>(1, kChunkingReadSize / block_size);
+  brillo::Blob buffer;
+  uint64_t chunk_start = 0;
+  for (uint64_t block = 0; block < num_blocks; block += read_blocks) {
+    const size_t count = std::min<uint64_t>(read_blocks, num_blocks - block);
+    std::string_view data;
+    if (image) {
+      TEST_AND_RETURN_FALSE((block + count) * block_size <=
+                            image->data().size());
+      data = image->data().substr(block * block_size, count * block_size);
+    } else {
+      buffer.resize(count * block_size);
+      ssize_t bytes_read = -1;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          fd, buffer.data(), buffer.size(), block * block_size, &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buffer.size()));
+      data = ToStringView(buffer);
+    }
+    for (size_t i = 0; i < count; i++) {
+      const uint64_t chunk_blocks = block + i + 1 - chunk_start;
+      if (chunk_blocks < min_blocks)
+        continue;
+      const std::string_view block_data =
+          data.substr(i * block_size, block_size);
+      if (chunk_blocks < max_blocks &&
+          BlockFingerprint(block_data) % divisor != 0) {
+        continue;
+      }
+      chunks->push_back(ExtentForRange(chunk_start, chunk_blocks));
+      chunk_start += chunk_blocks;
+    }
+  }
+  if (chunk_start < num_blocks)
+    chunks->push_back(ExtentForRange(chunk_start, num_blocks - chunk_start));
+  return true;
+}
 
 // This class encapsulates a full update chunk processing thread work. The
-// processor reads a chunk of data from the input file descriptor and compresses
-// it. The processor will destroy itself when the work is done.
-class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
+// processor reads a chunk of data from the mapped image, or the input file
+// descriptor, and compresses it. The processor will destroy itself when the
+// work is done.
+class ChunkProcessor {
  public:
-  // Read a chunk of |size| bytes from |fd| starting at offset |offset|.
-  ChunkProcessor(const PayloadVersion& version,
+  // Read a chunk of |size| bytes from |image|, or |fd| if it is null, starting
+  // at offset |offset|.
+  ChunkProcessor(const PayloadGenerationConfig& config,
+                 const PartitionConfig& new_part,
+                 const MappedImage* image,
                  int fd,
                  off_t offset,
                  size_t size,
                  BlobFileWriter* blob_file,
-                 AnnotatedOperation* aop)
-      : version_(version),
+                 AnnotatedOperation* aop,
+                 diff_utils::ReplaceCodecPredictor* predictor)
+      : config_(config),
+        new_part_(new_part),
+        image_(image),
         fd_(fd),
         offset_(offset),
         size_(size),
         blob_file_(blob_file),
-        aop_(aop) {}
+        aop_(aop),
+        predictor_(predictor) {}
   // We use a default move constructor since all the data members are POD types.
   ChunkProcessor(ChunkProcessor&&) = default;
-  ~ChunkProcessor() override = default;
+  ~ChunkProcessor() = default;
 
-  // Overrides DelegateSimpleThread::Delegate.
   // Run() handles the read from |fd| in a thread-safe way, and stores the
   // new operation to generate the region starting at |offset| of size |size|
   // in the output operation |aop|. The associated blob data is stored in
   // |blob_fd| and |blob_file_size| is updated.
-  void Run() override;
+  void Run();
 
  private:
   bool ProcessChunk();
 
   // Work parameters.
-  const PayloadVersion& version_;
+  const PayloadGenerationConfig& config_;
+  const PartitionConfig& new_part_;
+  const MappedImage* image_;
   int fd_;
   off_t offset_;
   size_t size_;
   BlobFileWriter* blob_file_;
   AnnotatedOperation* aop_;
+  // Shared by all the chunks of the partition, may be null.
+  diff_utils::ReplaceCodecPredictor* predictor_;
 
   DISALLOW_COPY_AND_ASSIGN(ChunkProcessor);
 };
@@ -92,16 +185,38 @@ void ChunkProcessor::Run() {
 }
 
 bool ChunkProcessor::ProcessChunk() {
-  brillo::Blob buffer_in_(size_);
-  brillo::Blob op_blob;
-  ssize_t bytes_read = -1;
-  TEST_AND_RETURN_FALSE(utils::PReadAll(
-      fd_, buffer_in_.data(), buffer_in_.size(), offset_, &bytes_read));
-  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size_));
+  // A chunk written by a single operation of the base payload doesn't need to
+  // be compressed again.
+  if (config_.base_payload &&
+      config_.base_payload->ReuseFullOperation(
+          config_, new_part_, aop_->op.dst_extents(0), blob_file_, aop_)) {
+    return true;
+  }
 
+  // The chunk is compressed straight from the mapping, without a copy.
+  std::string_view data;
+  brillo::Blob buffer_in_;
+  if (image_) {
+    TEST_AND_RETURN_FALSE(offset_ + size_ <= image_->data().size());
+    data = image_->data().substr(offset_, size_);
+  } else {
+    buffer_in_.resize(size_);
+    ssize_t bytes_read = -1;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        fd_, buffer_in_.data(), buffer_in_.size(), offset_, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size_));
+    data = ToStringView(buffer_in_);
+  }
+
+  brillo::Blob op_blob;
   InstallOperation::Type op_type;
-  TEST_AND_RETURN_FALSE(diff_utils::GenerateBestFullOperation(
-      buffer_in_, version_, &op_blob, &op_type));
+  TEST_AND_RETURN_FALSE(
+      diff_utils::GenerateBestFullOperation(data,
+                                            config_.version,
+                                            &op_blob,
+                                            &op_type,
+                                            predictor_,
+                                            new_part_.zstd_dictionary.get()));
 
   aop_->op.set_type(op_type);
   TEST_AND_RETURN_FALSE(aop_->SetOperationBlob(op_blob, blob_file_));
@@ -128,7 +243,12 @@ bool FullUpdateGenerator::GenerateOperations(
     full_chunk_size = std::min(static_cast<size_t>(config.hard_chunk_size),
                                config.soft_chunk_size);
   } else {
-    full_chunk_size = std::min(kDefaultFullChunkSize, config.soft_chunk_size);
+    full_chunk_size = kDefaultFullChunkSize;
+    while (full_chunk_size < kMaxDefaultFullChunkSize &&
+           new_part.size / (full_chunk_size * 2) >= kMinDefaultFullChunks) {
+      full_chunk_size *= 2;
+    }
+    full_chunk_size = std::min(full_chunk_size, config.soft_chunk_size);
     LOG(INFO) << "No chunk_size provided, using the default chunk_size for the "
               << "full operations: " << full_chunk_size << " bytes.";
   }
@@ -136,7 +256,7 @@ bool FullUpdateGenerator::GenerateOperations(
   TEST_AND_RETURN_FALSE(full_chunk_size % config.block_size == 0);
 
   size_t chunk_blocks = full_chunk_size / config.block_size;
-  size_t max_threads = diff_utils::GetMaxThreads();
+  size_t max_threads = TaskScheduler::Get()->num_threads();
   LOG(INFO) << "Compressing partition " << new_part.name << " from "
             << new_part.path << " splitting in chunks of " << chunk_blocks
             << " blocks (" << config.block_size << " bytes each) using "
@@ -145,47 +265,83 @@ bool FullUpdateGenerator::GenerateOperations(
   int in_fd = open(new_part.path.c_str(), O_RDONLY, 0);
   TEST_AND_RETURN_FALSE(in_fd >= 0);
   ScopedFdCloser in_fd_closer(&in_fd);
+  // The chunks are read from a mapping of the image when it can be mapped.
+  std::shared_ptr<const MappedImage> image = new_part.image;
+  if (!image) {
+    auto mapped_image = std::make_shared<MappedImage>();
+    if (mapped_image->Open(new_part.path, new_part.size)) {
+      image = std::move(mapped_image);
+    } else {
+      LOG(WARNING) << "Failed to map " << new_part.path << ", reading it.";
+    }
+  }
 
-  // We potentially have all the ChunkProcessors in memory but only
-  // |max_threads| will actually hold a block in memory while we process.
   size_t partition_blocks = new_part.size / config.block_size;
-  size_t num_chunks = utils::DivRoundUp(partition_blocks, chunk_blocks);
+  vector<Extent> chunks;
+  if (config.content_defined_chunks) {
+    TEST_AND_RETURN_FALSE(SplitContentDefinedChunks(image.get(),
+                                                    in_fd,
+                                                    config.block_size,
+                                                    partition_blocks,
+                                                    chunk_blocks,
+                                                    &chunks));
+    LOG(INFO) << "Split " << new_part.name << " in " << chunks.size()
+              << " content defined chunks.";
+  } else {
+    for (size_t start_block = 0; start_block < partition_blocks;
+         start_block += chunk_blocks) {
+      // The last chunk could be smaller.
+      chunks.push_back(ExtentForRange(
+          start_block, std::min(chunk_blocks, partition_blocks - start_block)));
+    }
+  }
+
+  // We potentially have all the ChunkProcessors in memory but only
+  // |max_threads| of them run at once, each holding at most its input chunk,
+  // if not mapped, and its output blob. The blobs are written to |blob_file|
+  // as soon as they are compressed.
+  size_t num_chunks = chunks.size();
   aops->resize(num_chunks);
+  std::unique_ptr<diff_utils::ReplaceCodecPredictor> predictor;
+  if (config.replace_codec_streak > 0) {
+    predictor = std::make_unique<diff_utils::ReplaceCodecPredictor>(
+        config.replace_codec_streak);
+  }
   vector<ChunkProcessor> chunk_processors;
   chunk_processors.reserve(num_chunks);
   blob_file->IncTotalBlobs(num_chunks);
 
   for (size_t i = 0; i < num_chunks; ++i) {
-    size_t start_block = i * chunk_blocks;
-    // The last chunk could be smaller.
-    size_t num_blocks =
-        std::min(chunk_blocks, partition_blocks - i * chunk_blocks);
+    const Extent& chunk = chunks[i];
 
     // Preset all the static information about the operations. The
     // ChunkProcessor will set the rest.
     AnnotatedOperation* aop = aops->data() + i;
     aop->name = base::StringPrintf(
         "<%s-operation-%" PRIuS ">", new_part.name.c_str(), i);
-    Extent* dst_extent = aop->op.add_dst_extents();
-    dst_extent->set_start_block(start_block);
-    dst_extent->set_num_blocks(num_blocks);
+    *aop->op.add_dst_extents() = chunk;
 
     chunk_processors.emplace_back(
-        config.version,
+        config,
+        new_part,
+        image.get(),
         in_fd,
-        static_cast<off_t>(start_block) * config.block_size,
-        num_blocks * config.block_size,
+        static_cast<off_t>(chunk.start_block()) * config.block_size,
+        chunk.num_blocks() * config.block_size,
         blob_file,
-        aop);
+        aop,
+        predictor.get());
   }
 
-  // Thread pool used for worker threads.
-  base::DelegateSimpleThreadPool thread_pool("full-update-generator",
-                                             max_threads);
-  thread_pool.Start();
-  for (ChunkProcessor& processor : chunk_processors)
-    thread_pool.AddWork(&processor);
-  thread_pool.JoinAll();
+  // The chunks share the process wide scheduler with the other partitions.
+  TaskGroup chunk_group;
+  for (size_t i = 0; i < chunk_processors.size(); i++) {
+    ChunkProcessor* processor = &chunk_processors[i];
+    chunk_group.Post([processor] { processor->Run(); },
+                     (*aops)[i].op.dst_extents(0).num_blocks() *
+                         config.block_size);
+  }
+  chunk_group.Wait();
 
   // All the operations must have a type set at this point. Otherwise, a
   // ChunkProcessor failed to complete.
@@ -17,6 +17,8 @@
 #include "update_engine/payload_generator/full_update_generator.h"
 
 #include <memory>
+#include <random>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -133,4 +135,48 @@ TEST_F(FullUpdateGeneratorTest, ImageSizeTooSmall) {
             utils::BlocksInExtents(aops[0].op.dst_extents()));
 }
 
+// Test that the content defined chunks of data keep their boundaries when
+// blocks are inserted before it.
+TEST_F(FullUpdateGeneratorTest, ContentDefinedChunksTest) {
+  config_.content_defined_chunks = true;
+  const size_t chunk_blocks = config_.hard_chunk_size / config_.block_size;
+  std::mt19937 gen(42);
+  brillo::Blob data(4 * 1024 * 1024);
+  for (uint8_t& b : data)
+    b = gen();
+
+  // The contents of the chunks of |part|.
+  auto chunk_contents = [&](const brillo::Blob& part) {
+    new_part_conf.size = part.size();
+    EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, part));
+    aops.clear();
+    EXPECT_TRUE(generator_.GenerateOperations(
+        config_, new_part_conf, new_part_conf, blob_file_writer_.get(), &aops));
+    std::set<string> contents;
+    uint64_t next_block = 0;
+    for (const AnnotatedOperation& aop : aops) {
+      EXPECT_EQ(1, aop.op.dst_extents_size());
+      const Extent& extent = aop.op.dst_extents(0);
+      EXPECT_EQ(next_block, extent.start_block());
+      EXPECT_LE(extent.num_blocks(), chunk_blocks);
+      next_block += extent.num_blocks();
+      contents.emplace(
+          part.begin() + extent.start_block() * config_.block_size,
+          part.begin() + next_block * config_.block_size);
+    }
+    EXPECT_EQ(part.size() / config_.block_size, next_block);
+    return contents;
+  };
+
+  std::set<string> old_contents = chunk_contents(data);
+  EXPECT_GT(old_contents.size(), data.size() / config_.hard_chunk_size);
+  data.insert(data.begin(), 3 * config_.block_size, 0);
+  std::set<string> new_contents = chunk_contents(data);
+  size_t shared = 0;
+  for (const string& content : new_contents)
+    shared += old_contents.count(content);
+  // Only the chunks around the inserted blocks change.
+  EXPECT_GE(shared + 2, old_contents.size());
+}
+
 }  // namespace chromeos_update_engine
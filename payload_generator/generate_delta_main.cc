@@ -15,7 +15,11 @@
 //
 
 #include <map>
+#include <memory>
+#include <algorithm>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <base/bind.h>
@@ -30,6 +34,7 @@
 #include <brillo/message_loops/base_message_loop.h>
 #include <xz.h>
 
+#include "update_engine/common/constants.h"
 #include "update_engine/common/download_action.h"
 #include "update_engine/common/fake_boot_control.h"
 #include "update_engine/common/fake_hardware.h"
@@ -39,10 +44,16 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/base_payload.h"
+#include "update_engine/payload_generator/decoded_data_cache.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/generation_report.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/payload_generator/payload_properties.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/payload_splitter.h"
+#include "update_engine/payload_generator/sparse_image.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/payload_generator/xz.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -247,6 +258,19 @@ bool ApplyPayload(const string& payload_file,
   return true;
 }
 
+bool WriteSplitPayload(const string& payload_path, const string& out_dir) {
+  string property;
+  TEST_AND_RETURN_FALSE(SplitPayload(payload_path, out_dir, &property));
+  const string properties =
+      string(kPayloadPropertySplitPayloadParts) + "=" + property + "\n";
+  const string props_file =
+      base::FilePath(out_dir).Append("split_payload_properties.txt").value();
+  TEST_AND_RETURN_FALSE(utils::WriteFile(
+      props_file.c_str(), properties.c_str(), properties.length()));
+  LOG(INFO) << "Generated split payload properties file at " << props_file;
+  return true;
+}
+
 bool ExtractProperties(const string& payload_path,
                        const string& props_file,
                        const string& props_format) {
@@ -303,6 +327,59 @@ bool ParsePerPartitionTimestamps(const string& partition_timestamps,
   return true;
 }
 
+// Replaces the Android sparse images of |image| by raw ones expanded into
+// temporary files, which are kept in |temp_files| while they are used.
+bool ExpandSparsePartitions(
+    ImageConfig* image,
+    vector<std::unique_ptr<ScopedTempFile>>* temp_files) {
+  for (auto& partition : image->partitions) {
+    if (partition.path.empty() ||
+        !sparse_image::IsSparseImage(partition.path))
+      continue;
+    temp_files->push_back(
+        std::make_unique<ScopedTempFile>(partition.name + ".img.XXXXXX"));
+    TEST_AND_RETURN_FALSE(sparse_image::ExpandSparseImage(
+        partition.path, temp_files->back()->path()));
+    partition.path = temp_files->back()->path();
+  }
+  return true;
+}
+
+// Detects the minor version from the update_engine.conf in the |source| image.
+bool DetectMinorVersion(const ImageConfig& source, uint32_t* minor_version) {
+  brillo::KeyValueStore store;
+  for (const PartitionConfig& part : source.partitions) {
+    if (part.fs_interface && part.fs_interface->LoadSettings(&store) &&
+        utils::GetMinorVersion(store, minor_version)) {
+      LOG(INFO) << "Auto-detected minor_version=" << *minor_version;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Opens and maps the partitions of |images|. The partitions are opened in
+// parallel, walking their file systems is independent.
+void OpenPartitions(const vector<ImageConfig*>& images,
+                    const string& cache_dir) {
+  TaskGroup open_group;
+  for (ImageConfig* image : images) {
+    for (PartitionConfig& part : image->partitions) {
+      open_group.Post(
+          [&part, &cache_dir] { CHECK(part.OpenFilesystem(cache_dir)); });
+    }
+  }
+  open_group.Wait();
+  // The diffs read the images through mappings rather than copies when
+  // they can. Reading them from the files still works otherwise.
+  for (ImageConfig* image : images) {
+    for (PartitionConfig& part : image->partitions) {
+      LOG_IF(WARNING, !part.MapImage())
+          << "Failed to map " << part.path << ", reading it instead.";
+    }
+  }
+}
+
 int Main(int argc, char** argv) {
   DEFINE_string(old_image, "", "Path to the old rootfs");
   DEFINE_string(new_image, "", "Path to the new rootfs");
@@ -331,6 +408,13 @@ int Main(int argc, char** argv) {
                 "",
                 "Path to the .map files associated with the partition files "
                 "in the new partition, similar to the -old_mapfiles flag.");
+  DEFINE_string(new_hot_blocks_files,
+                "",
+                "Path to the lists of the blocks of the new partitions read "
+                "early during boot, one block or FIRST-LAST range of blocks "
+                "per line, whose COW operations should merge first. Pass "
+                "multiple files separated by a colon as with "
+                "-new_partitions, empty for none.");
   DEFINE_string(partition_names,
                 string(kPartitionNameRoot) + ":" + kPartitionNameKernel,
                 "Names of the partitions. To pass multiple names, use a single "
@@ -372,11 +456,22 @@ int Main(int argc, char** argv) {
                 "e.g. /path/to/sig:/path/to/next:/path/to/last_sig .");
   DEFINE_int32(
       chunk_size, 200 * 1024 * 1024, "Payload chunk size (-1 for whole files)");
+  DEFINE_uint64(file_segment_size,
+                0,
+                "Diff large files in segments of this many bytes in parallel "
+                "(0 to disable).");
+  DEFINE_double(max_segment_size_ratio,
+                1.1,
+                "Don't split files in segments if that makes two segments "
+                "take more than this ratio of their size diffed together.");
   DEFINE_uint64(rootfs_partition_size,
                 chromeos_update_engine::kRootFSPartitionSize,
                 "RootFS partition size for the image once installed");
   DEFINE_uint64(
-      major_version, 2, "The major version of the payload being generated.");
+      major_version,
+      2,
+      "The major version of the payload being generated. Version 3 stores "
+      "the manifest compressed.");
   DEFINE_int32(minor_version,
                -1,
                "The minor version of the payload being generated "
@@ -389,6 +484,12 @@ int Main(int argc, char** argv) {
                 kPayloadPropertiesFormatKeyValue,
                 "Defines the format of the --properties_file. The acceptable "
                 "values are: key-value (default) and json");
+  DEFINE_string(split_payload_dir,
+                "",
+                "If passed, writes the payload passed in --in_file into this "
+                "existing directory split in one file for the metadata, one "
+                "per partition and one for the signatures, along with the "
+                "SPLIT_PAYLOAD_PARTS property listing them, and exits.");
   DEFINE_int64(max_timestamp,
                0,
                "The maximum timestamp of the OS allowed to apply this "
@@ -428,8 +529,125 @@ int Main(int argc, char** argv) {
   DEFINE_bool(enable_vabc_xor,
               false,
               "Whether to use Virtual AB Compression XOR feature");
+  DEFINE_uint64(cow_estimate_sample_interval,
+                1,
+                "Estimate the COW size by compressing only one in this many "
+                "of the blocks written as raw data. Faster, but less exact.");
   DEFINE_string(
       apex_info_file, "", "Path to META/apex_info.pb found in target build");
+  DEFINE_string(diff_cache_dir,
+                "",
+                "Directory where diffs, deflates and EROFS file lists are "
+                "cached, to reuse them when generating other payloads from "
+                "the same files.");
+  DEFINE_int32(diff_shard_index,
+               0,
+               "With --diff_shard_count, the shard of the diffs run into "
+               "--diff_cache_dir, from 0.");
+  DEFINE_int32(diff_shard_count,
+               1,
+               "Split the diffs missing from --diff_cache_dir into this many "
+               "shards, and only run the --diff_shard_index one. The other "
+               "shards are run by other delta_generator processes, possibly "
+               "on other machines sharing the cache directory, and the "
+               "output payload only serves to fill the cache: a last run "
+               "without shards generates the payload from the cache.");
+  DEFINE_string(checkpoint_dir,
+                "",
+                "Directory where the operations of each partition are saved "
+                "once generated. Running again with the same inputs and "
+                "flags, for example after a crash or a preemption, reuses "
+                "them instead of generating the partitions again. Combine it "
+                "with --diff_cache_dir to also reuse the diffs of the "
+                "partition that was interrupted.");
+  DEFINE_string(report_file,
+                "",
+                "Path to write a JSON report of where the generation time "
+                "went: the wall time of each stage, and for each file and "
+                "each diffed chunk the bytes in and out, the algorithms tried "
+                "with their wall and CPU time, and the one chosen. The "
+                "stages of the partitions generated in parallel add up.");
+  DEFINE_string(extra_old_partitions,
+                "",
+                "Semicolon separated list of more --old_partitions values, "
+                "each generating another delta payload to the same target "
+                "into the matching --extra_out_files entry, in the same "
+                "process. Mapfiles aren't supported for them.");
+  DEFINE_string(extra_out_files,
+                "",
+                "Colon separated paths of the payloads generated from "
+                "--extra_old_partitions.");
+  DEFINE_string(base_payload,
+                "",
+                "Path to a payload generated earlier, e.g. to the previous "
+                "build, whose operations are reused for the files and chunks "
+                "they still produce instead of diffing them again.");
+  DEFINE_uint64(replace_codec_streak,
+                0,
+                "When not zero, the full operations only try the codec that "
+                "was the best for this many chunks in a row of similar data. "
+                "Faster, but the payload may differ between runs.");
+  DEFINE_bool(content_defined_chunks,
+              false,
+              "Whether the full operations split the partitions in chunks "
+              "whose boundaries depend on their content rather than on their "
+              "offset, so that consecutive builds share more identical blobs "
+              "for caches to reuse.");
+  DEFINE_uint64(diff_memory_budget_mb,
+                0,
+                "The most memory, in MiB, the diffs running at the same time "
+                "are estimated to use, from the size of their data and the "
+                "diff algorithms. Larger diffs wait for smaller ones to "
+                "finish, or run alone. 0 for no limit.");
+  DEFINE_uint64(decoded_cache_mb,
+                256,
+                "The most memory, in MiB, kept for the decompressed and "
+                "recompressed LZ4 files, to reuse them when the same file is "
+                "diffed again, like for each of the --extra_old_partitions. "
+                "Taken out of --diff_memory_budget_mb if set, up to half of "
+                "it. 0 to disable.");
+  DEFINE_bool(order_operations_by_apply_cost,
+              false,
+              "Order the operations of each partition so that the blobs of "
+              "the operations cheap to apply download while the expensive "
+              "ones apply. Only pays off when the payload is applied with "
+              "PIPELINED_APPLY=1.");
+  DEFINE_bool(annotate_apply_cost,
+              false,
+              "Add to each partition in the manifest the estimated bytes "
+              "read and written and time to apply it, also summed up in the "
+              "payload properties.");
+  DEFINE_bool(minimize_apply_time,
+              false,
+              "Pick the diff operations that are the fastest to download and "
+              "apply on the target devices, instead of the smallest ones.");
+  DEFINE_string(apply_cost_profile,
+                "",
+                "A key-value file with the throughputs of the target devices "
+                "in bytes per second: DOWNLOAD, the name of operation types, "
+                "HASH_TREE and FEC, as measured by update_engine_benchmarks. "
+                "Used by --minimize_apply_time, "
+                "--order_operations_by_apply_cost, --annotate_apply_cost and "
+                "--choose_verity_computation.");
+  DEFINE_bool(choose_verity_computation,
+              false,
+              "Ship the verity hash tree or FEC data of a partition in the "
+              "payload instead of computing it on the device, when that is "
+              "estimated to be faster on the target devices.");
+  DEFINE_bool(operation_index,
+              false,
+              "Add to each partition in the manifest a packed index of its "
+              "operations, which the device can walk without parsing them.");
+  DEFINE_bool(mark_unused_extents,
+              false,
+              "Mark the zeroed blocks past the end of the filesystem of each "
+              "partition as unused, so that the device neither writes nor "
+              "verifies them. Older devices ignore the marks.");
+  DEFINE_bool(dst_operation_hashes,
+              false,
+              "Add to each operation the hash of the blocks it writes, so "
+              "that a device retrying the payload skips the operations whose "
+              "blocks are already written. Older devices ignore the hashes.");
   DEFINE_string(compressor_types,
                 "bz2:brotli",
                 "Colon ':' separated list of compressors. Allowed valures are "
@@ -444,6 +662,28 @@ int Main(int argc, char** argv) {
       true,
       "Whether to enable zucchini feature when processing executable files.");
 
+  DEFINE_bool(enable_zstd,
+              false,
+              "Whether to compress REPLACE operations with zstd when it is "
+              "cheaper to download and decompress. Only set it for clients "
+              "supporting REPLACE_ZSTD, which delta payloads also need minor "
+              "version 10 or newer for.");
+
+  DEFINE_bool(share_blobs,
+              false,
+              "Whether REPLACE operations with identical blobs should share "
+              "one, which is downloaded and decompressed once. Only set it "
+              "for clients supporting shared blobs, which delta payloads also "
+              "need minor version 11 or newer for.");
+
+  DEFINE_bool(zstd_dictionaries,
+              false,
+              "Whether to train a zstd dictionary for each partition, which "
+              "its REPLACE_ZSTD blobs are compressed against. Needs "
+              "--enable_zstd. Only set it for clients supporting zstd "
+              "dictionaries, which delta payloads also need minor version 12 "
+              "or newer for.");
+
   DEFINE_string(erofs_compression_param,
                 "",
                 "Compression parameter passed to mkfs.erofs's -z option. "
@@ -473,6 +713,10 @@ int Main(int argc, char** argv) {
   // Initialize the Xz compressor.
   XzCompressInit();
 
+  if (!FLAGS_report_file.empty()) {
+    GenerationReport::Get()->Enable();
+  }
+
   if (!FLAGS_out_maximum_signature_size_file.empty()) {
     LOG_IF(FATAL, FLAGS_private_key.empty())
         << "Private key is not provided when calculating the maximum signature "
@@ -531,11 +775,17 @@ int Main(int argc, char** argv) {
                : 1;
   }
 
+  if (!FLAGS_split_payload_dir.empty()) {
+    LOG_IF(FATAL, FLAGS_in_file.empty())
+        << "Must pass --in_file to split a payload.";
+    return WriteSplitPayload(FLAGS_in_file, FLAGS_split_payload_dir) ? 0 : 1;
+  }
+
   // A payload generation was requested. Convert the flags to a
   // PayloadGenerationConfig.
   PayloadGenerationConfig payload_config;
   vector<string> partition_names, old_partitions, new_partitions;
-  vector<string> old_mapfiles, new_mapfiles;
+  vector<string> old_mapfiles, new_mapfiles, new_hot_blocks_files;
 
   if (!FLAGS_old_mapfiles.empty()) {
     old_mapfiles = base::SplitString(
@@ -545,6 +795,12 @@ int Main(int argc, char** argv) {
     new_mapfiles = base::SplitString(
         FLAGS_new_mapfiles, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
   }
+  if (!FLAGS_new_hot_blocks_files.empty()) {
+    new_hot_blocks_files = base::SplitString(FLAGS_new_hot_blocks_files,
+                                             ":",
+                                             base::TRIM_WHITESPACE,
+                                             base::SPLIT_WANT_ALL);
+  }
 
   partition_names = base::SplitString(
       FLAGS_partition_names, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
@@ -565,9 +821,61 @@ int Main(int argc, char** argv) {
   }
 
   payload_config.enable_vabc_xor = FLAGS_enable_vabc_xor;
+  payload_config.cow_estimate_sample_interval =
+      FLAGS_cow_estimate_sample_interval;
   payload_config.enable_lz4diff = FLAGS_enable_lz4diff;
   payload_config.enable_zucchini = FLAGS_enable_zucchini;
-
+  payload_config.version.enable_zstd = FLAGS_enable_zstd;
+  payload_config.version.share_blobs = FLAGS_share_blobs;
+  payload_config.version.zstd_dictionaries = FLAGS_zstd_dictionaries;
+
+  payload_config.diff_cache_dir = FLAGS_diff_cache_dir;
+  CHECK_GE(FLAGS_diff_shard_index, 0);
+  CHECK_GE(FLAGS_diff_shard_count, 1);
+  payload_config.diff_shard_index = FLAGS_diff_shard_index;
+  payload_config.diff_shard_count = FLAGS_diff_shard_count;
+  payload_config.checkpoint_dir = FLAGS_checkpoint_dir;
+  // The output paths, the checkpoint directory and the report don't change
+  // the operations.
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (base::StartsWith(arg, "--out_", base::CompareCase::SENSITIVE) ||
+        base::StartsWith(
+            arg, "--checkpoint_dir", base::CompareCase::SENSITIVE) ||
+        base::StartsWith(arg, "--report_file", base::CompareCase::SENSITIVE)) {
+      continue;
+    }
+    payload_config.checkpoint_salt += arg;
+    payload_config.checkpoint_salt.push_back('\0');
+  }
+  if (!FLAGS_base_payload.empty()) {
+    auto base_payload = std::make_shared<BasePayload>();
+    CHECK(base_payload->Load(FLAGS_base_payload))
+        << "Failed to load the base payload " << FLAGS_base_payload;
+    payload_config.base_payload = std::move(base_payload);
+  }
+  payload_config.replace_codec_streak = FLAGS_replace_codec_streak;
+  payload_config.content_defined_chunks = FLAGS_content_defined_chunks;
+  uint64_t decoded_cache_bytes = FLAGS_decoded_cache_mb * 1024 * 1024;
+  uint64_t diff_memory_budget = FLAGS_diff_memory_budget_mb * 1024 * 1024;
+  if (diff_memory_budget > 0) {
+    decoded_cache_bytes = std::min(decoded_cache_bytes, diff_memory_budget / 2);
+    diff_memory_budget -= decoded_cache_bytes;
+  }
+  DecodedDataCache::Get()->set_capacity(decoded_cache_bytes);
+  TaskScheduler::Get()->set_memory_budget(diff_memory_budget);
+  payload_config.order_operations_by_apply_cost =
+      FLAGS_order_operations_by_apply_cost;
+  payload_config.annotate_apply_cost = FLAGS_annotate_apply_cost;
+  payload_config.minimize_apply_time = FLAGS_minimize_apply_time;
+  if (!FLAGS_apply_cost_profile.empty()) {
+    brillo::KeyValueStore store;
+    CHECK(store.Load(base::FilePath(FLAGS_apply_cost_profile)));
+    CHECK(payload_config.apply_cost_profile.Load(store));
+  }
+  payload_config.operation_index = FLAGS_operation_index;
+  payload_config.mark_unused_extents = FLAGS_mark_unused_extents;
+  payload_config.dst_operation_hashes = FLAGS_dst_operation_hashes;
   payload_config.ParseCompressorTypes(FLAGS_compressor_types);
 
   if (!FLAGS_new_partitions.empty()) {
@@ -605,6 +913,10 @@ int Main(int argc, char** argv) {
     }
     if (i < new_mapfiles.size())
       payload_config.target.partitions.back().mapfile_path = new_mapfiles[i];
+    if (i < new_hot_blocks_files.size()) {
+      payload_config.target.partitions.back().hot_blocks_path =
+          new_hot_blocks_files[i];
+    }
   }
 
   if (payload_config.is_delta) {
@@ -643,8 +955,17 @@ int Main(int argc, char** argv) {
 
   // Use the default soft_chunk_size defined in the config.
   payload_config.hard_chunk_size = FLAGS_chunk_size;
+  payload_config.file_segment_size = FLAGS_file_segment_size;
+  payload_config.max_segment_size_ratio = FLAGS_max_segment_size_ratio;
   payload_config.block_size = kBlockSize;
 
+  // The images are read in place, so the sparse ones are expanded first.
+  vector<std::unique_ptr<ScopedTempFile>> expanded_images;
+  if (payload_config.is_delta) {
+    CHECK(ExpandSparsePartitions(&payload_config.source, &expanded_images));
+  }
+  CHECK(ExpandSparsePartitions(&payload_config.target, &expanded_images));
+
   // The partition size is never passed to the delta_generator, so we
   // need to detect those from the provided files.
   if (payload_config.is_delta) {
@@ -671,10 +992,8 @@ int Main(int argc, char** argv) {
 
   if (payload_config.is_delta) {
     // Avoid opening the filesystem interface for full payloads.
-    for (PartitionConfig& part : payload_config.target.partitions)
-      CHECK(part.OpenFilesystem());
-    for (PartitionConfig& part : payload_config.source.partitions)
-      CHECK(part.OpenFilesystem());
+    OpenPartitions({&payload_config.target, &payload_config.source},
+                   payload_config.diff_cache_dir);
   }
 
   payload_config.version.major = FLAGS_major_version;
@@ -684,20 +1003,8 @@ int Main(int argc, char** argv) {
     // Autodetect minor_version by looking at the update_engine.conf in the old
     // image.
     if (payload_config.is_delta) {
-      brillo::KeyValueStore store;
-      uint32_t minor_version;
-      bool minor_version_found = false;
-      for (const PartitionConfig& part : payload_config.source.partitions) {
-        if (part.fs_interface && part.fs_interface->LoadSettings(&store) &&
-            utils::GetMinorVersion(store, &minor_version)) {
-          payload_config.version.minor = minor_version;
-          minor_version_found = true;
-          LOG(INFO) << "Auto-detected minor_version="
-                    << payload_config.version.minor;
-          break;
-        }
-      }
-      if (!minor_version_found) {
+      if (!DetectMinorVersion(payload_config.source,
+                              &payload_config.version.minor)) {
         LOG(FATAL) << "Failed to detect the minor version.";
         return 1;
       }
@@ -726,21 +1033,105 @@ int Main(int argc, char** argv) {
 
   if (payload_config.is_delta &&
       payload_config.version.minor >= kVerityMinorPayloadVersion &&
-      !FLAGS_disable_verity_computation)
+      !FLAGS_disable_verity_computation) {
     CHECK(payload_config.target.LoadVerityConfig());
+    if (FLAGS_choose_verity_computation)
+      payload_config.ChooseVerityComputation();
+  }
+
+  // Each of --extra_old_partitions is the source of another delta payload to
+  // the same target, whose opened partitions they share.
+  vector<PayloadGenerationConfig> extra_configs;
+  vector<string> extra_out_files;
+  if (!FLAGS_extra_old_partitions.empty()) {
+    LOG_IF(FATAL, !payload_config.is_delta || !FLAGS_in_file.empty())
+        << "--extra_old_partitions needs a delta payload.";
+    const vector<string> extra_sources =
+        base::SplitString(FLAGS_extra_old_partitions,
+                          ";",
+                          base::TRIM_WHITESPACE,
+                          base::SPLIT_WANT_ALL);
+    extra_out_files = base::SplitString(FLAGS_extra_out_files,
+                                        ":",
+                                        base::TRIM_WHITESPACE,
+                                        base::SPLIT_WANT_ALL);
+    CHECK_EQ(extra_sources.size(), extra_out_files.size())
+        << "--extra_out_files must have an entry per --extra_old_partitions.";
+    for (const string& extra_source : extra_sources) {
+      const vector<string> paths = base::SplitString(
+          extra_source, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+      CHECK_EQ(paths.size(), partition_names.size());
+      PayloadGenerationConfig extra_config = payload_config;
+      extra_config.source = ImageConfig();
+      for (size_t i = 0; i < partition_names.size(); i++) {
+        extra_config.source.partitions.emplace_back(partition_names[i]);
+        extra_config.source.partitions.back().path = paths[i];
+      }
+      CHECK(ExpandSparsePartitions(&extra_config.source, &expanded_images));
+      CHECK(extra_config.source.LoadImageSize());
+      OpenPartitions({&extra_config.source}, extra_config.diff_cache_dir);
+      if (FLAGS_minor_version == -1) {
+        CHECK(DetectMinorVersion(extra_config.source,
+                                 &extra_config.version.minor))
+            << "Failed to detect the minor version of " << extra_source;
+      }
+      if (extra_config.version.minor >= kVerityMinorPayloadVersion &&
+          payload_config.version.minor < kVerityMinorPayloadVersion &&
+          !FLAGS_disable_verity_computation) {
+        CHECK(extra_config.target.LoadVerityConfig());
+        if (FLAGS_choose_verity_computation)
+          extra_config.ChooseVerityComputation();
+      }
+      extra_configs.push_back(std::move(extra_config));
+    }
+  }
 
   LOG(INFO) << "Generating " << (payload_config.is_delta ? "delta" : "full")
             << " update";
 
   // From this point, all the options have been parsed.
-  if (!payload_config.Validate()) {
+  if (!payload_config.Validate() ||
+      !std::all_of(extra_configs.begin(),
+                   extra_configs.end(),
+                   [](const PayloadGenerationConfig& extra_config) {
+                     return extra_config.Validate();
+                   })) {
     LOG(ERROR) << "Invalid options passed. See errors above.";
     return 1;
   }
 
+  // The extra payloads are generated at the same time, their partitions and
+  // files sharing the process wide TaskScheduler, which bounds how many diffs
+  // run, and so the memory they take, whatever the number of payloads.
+  vector<std::thread> extra_threads;
+  vector<char> extra_succeeded(extra_configs.size(), false);
+  for (size_t i = 0; i < extra_configs.size(); i++) {
+    extra_threads.emplace_back([&, i] {
+      uint64_t extra_metadata_size;
+      extra_succeeded[i] = GenerateUpdatePayloadFile(extra_configs[i],
+                                                     extra_out_files[i],
+                                                     FLAGS_private_key,
+                                                     &extra_metadata_size);
+    });
+  }
   uint64_t metadata_size;
-  if (!GenerateUpdatePayloadFile(
-          payload_config, FLAGS_out_file, FLAGS_private_key, &metadata_size)) {
+  const bool succeeded = GenerateUpdatePayloadFile(
+      payload_config, FLAGS_out_file, FLAGS_private_key, &metadata_size);
+  for (std::thread& thread : extra_threads) {
+    thread.join();
+  }
+  if (!FLAGS_report_file.empty() &&
+      !GenerationReport::Get()->WriteJson(FLAGS_report_file)) {
+    LOG(ERROR) << "Failed to write the generation report to "
+               << FLAGS_report_file;
+  }
+  for (size_t i = 0; i < extra_configs.size(); i++) {
+    if (!extra_succeeded[i]) {
+      LOG(ERROR) << "Failed to generate " << extra_out_files[i];
+      return 1;
+    }
+  }
+  if (!succeeded) {
     return 1;
   }
   if (!FLAGS_out_metadata_size_file.empty()) {
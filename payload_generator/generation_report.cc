@@ -0,0 +1,181 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/generation_report.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+
+#include <base/json/json_writer.h>
+#include <base/logging.h>
+#include <base/values.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The wall time of all the attempts of a diff.
+base::TimeDelta DiffWallTime(const GenerationReport::DiffRecord& record) {
+  base::TimeDelta wall_time;
+  for (const auto& attempt : record.attempts)
+    wall_time += attempt.wall_time;
+  return wall_time;
+}
+
+}  // namespace
+
+GenerationReport::ScopedStage::ScopedStage(const char* stage)
+    : stage_(stage) {
+  if (GenerationReport::Get()->enabled())
+    start_ = base::TimeTicks::Now();
+}
+
+GenerationReport::ScopedStage::~ScopedStage() {
+  if (!start_.is_null())
+    GenerationReport::Get()->AddStageTime(stage_,
+                                          base::TimeTicks::Now() - start_);
+}
+
+GenerationReport* GenerationReport::Get() {
+  static GenerationReport* report = new GenerationReport();
+  return report;
+}
+
+void GenerationReport::Enable() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (start_.is_null())
+    start_ = base::TimeTicks::Now();
+  enabled_ = true;
+}
+
+void GenerationReport::AddStageTime(const string& stage,
+                                    base::TimeDelta wall_time) {
+  if (!enabled_)
+    return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  stage_times_[stage] += wall_time;
+}
+
+void GenerationReport::AddDiff(DiffRecord record) {
+  if (!enabled_)
+    return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  diffs_.push_back(std::move(record));
+}
+
+void GenerationReport::AddFile(FileRecord record) {
+  if (!enabled_)
+    return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  files_.push_back(std::move(record));
+}
+
+bool GenerationReport::ToJson(string* json) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  base::DictionaryValue report;
+  if (!start_.is_null()) {
+    report.SetDouble("wall_ms",
+                     (base::TimeTicks::Now() - start_).InMillisecondsF());
+  }
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    report.SetDouble("peak_rss_bytes",
+                     static_cast<double>(usage.ru_maxrss) * 1024);
+  }
+
+  auto stages = std::make_unique<base::DictionaryValue>();
+  for (const auto& [stage, wall_time] : stage_times_)
+    stages->SetDouble(stage + ".wall_ms", wall_time.InMillisecondsF());
+  report.Set("stages", std::move(stages));
+
+  vector<const FileRecord*> files;
+  for (const auto& file : files_)
+    files.push_back(&file);
+  std::stable_sort(files.begin(),
+                   files.end(),
+                   [](const FileRecord* a, const FileRecord* b) {
+                     return a->wall_time > b->wall_time;
+                   });
+  auto file_list = std::make_unique<base::ListValue>();
+  for (const FileRecord* file : files) {
+    auto value = std::make_unique<base::DictionaryValue>();
+    value->SetString("partition", file->partition);
+    value->SetString("name", file->name);
+    value->SetDouble("blocks", file->blocks);
+    value->SetDouble("wall_ms", file->wall_time.InMillisecondsF());
+    value->SetInteger("operations", file->operations);
+    value->SetDouble("blob_bytes", file->blob_bytes);
+    value->SetBoolean("reused", file->reused);
+    file_list->Append(std::move(value));
+  }
+  report.Set("files", std::move(file_list));
+
+  vector<const DiffRecord*> diffs;
+  for (const auto& diff : diffs_)
+    diffs.push_back(&diff);
+  std::stable_sort(diffs.begin(),
+                   diffs.end(),
+                   [](const DiffRecord* a, const DiffRecord* b) {
+                     return DiffWallTime(*a) > DiffWallTime(*b);
+                   });
+  auto diff_list = std::make_unique<base::ListValue>();
+  for (const DiffRecord* diff : diffs) {
+    auto value = std::make_unique<base::DictionaryValue>();
+    value->SetString("name", diff->name);
+    value->SetDouble("src_bytes", diff->src_bytes);
+    value->SetDouble("dst_bytes", diff->dst_bytes);
+    value->SetDouble("memory_estimate_bytes", diff->memory_estimate);
+    value->SetString("chosen", InstallOperationTypeName(diff->chosen_type));
+    value->SetDouble("blob_bytes", diff->blob_bytes);
+    value->SetBoolean("cached", diff->cached);
+    auto attempts = std::make_unique<base::ListValue>();
+    for (const auto& attempt : diff->attempts) {
+      auto attempt_value = std::make_unique<base::DictionaryValue>();
+      attempt_value->SetString("type", InstallOperationTypeName(attempt.type));
+      attempt_value->SetDouble("wall_ms", attempt.wall_time.InMillisecondsF());
+      attempt_value->SetDouble("cpu_ms", attempt.cpu_time.InMillisecondsF());
+      attempt_value->SetDouble("patch_bytes", attempt.patch_bytes);
+      attempt_value->SetBoolean("succeeded", attempt.succeeded);
+      attempts->Append(std::move(attempt_value));
+    }
+    value->Set("attempts", std::move(attempts));
+    diff_list->Append(std::move(value));
+  }
+  report.Set("diffs", std::move(diff_list));
+
+  return base::JSONWriter::WriteWithOptions(
+      report, base::JSONWriter::OPTIONS_PRETTY_PRINT, json);
+}
+
+bool GenerationReport::WriteJson(const string& path) const {
+  string json;
+  TEST_AND_RETURN_FALSE(ToJson(&json));
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile(path.c_str(), json.data(), json.size()));
+  LOG(INFO) << "Wrote the generation report to " << path;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
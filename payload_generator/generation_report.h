@@ -0,0 +1,124 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_REPORT_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_REPORT_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Collects where the time of a payload generation went: the total of each
+// stage, and the cost of each file and of each diffed chunk, so the slowest
+// ones can be found and the compressors or diff algorithms tuned for them.
+// Nothing is recorded until it is enabled. Thread safe.
+class GenerationReport {
+ public:
+  // One diff algorithm tried on a chunk.
+  struct DiffAttempt {
+    InstallOperation::Type type{InstallOperation::REPLACE};
+    base::TimeDelta wall_time;
+    // The CPU time of the thread generating the patch.
+    base::TimeDelta cpu_time;
+    uint64_t patch_bytes{0};
+    bool succeeded{false};
+  };
+
+  // The diff of a chunk, named after its operation (e.g. "/system/foo:2").
+  struct DiffRecord {
+    std::string name;
+    uint64_t src_bytes{0};
+    uint64_t dst_bytes{0};
+    // The memory estimate the chunk was scheduled with.
+    uint64_t memory_estimate{0};
+    std::vector<DiffAttempt> attempts;
+    // The operation picked, which might be a full one if no patch beat it.
+    InstallOperation::Type chosen_type{InstallOperation::REPLACE};
+    uint64_t blob_bytes{0};
+    // Whether the patch came from the diff cache, without any attempt.
+    bool cached{false};
+  };
+
+  // A file of a partition, with all its chunks.
+  struct FileRecord {
+    std::string partition;
+    std::string name;
+    uint64_t blocks{0};
+    base::TimeDelta wall_time;
+    size_t operations{0};
+    uint64_t blob_bytes{0};
+    // Whether the operations were reused from the base payload.
+    bool reused{false};
+  };
+
+  // Times a stage from construction to destruction, if the report was
+  // enabled when it started. Stages running in parallel, like the partitions,
+  // add up.
+  class ScopedStage {
+   public:
+    explicit ScopedStage(const char* stage);
+    ~ScopedStage();
+
+   private:
+    const char* stage_;
+    base::TimeTicks start_;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedStage);
+  };
+
+  GenerationReport() = default;
+
+  // The report of the whole payload generation. Never destroyed.
+  static GenerationReport* Get();
+
+  void Enable();
+  bool enabled() const { return enabled_; }
+
+  void AddStageTime(const std::string& stage, base::TimeDelta wall_time);
+  void AddDiff(DiffRecord record);
+  void AddFile(FileRecord record);
+
+  // Writes the stages, files and diffs recorded so far as JSON, with the
+  // slowest files and diffs first.
+  bool ToJson(std::string* json) const;
+  bool WriteJson(const std::string& path) const;
+
+ private:
+  std::atomic<bool> enabled_{false};
+  base::TimeTicks start_;
+
+  mutable std::mutex mutex_;
+  std::map<std::string, base::TimeDelta> stage_times_;
+  std::vector<DiffRecord> diffs_;
+  std::vector<FileRecord> files_;
+
+  DISALLOW_COPY_AND_ASSIGN(GenerationReport);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_REPORT_H_
@@ -0,0 +1,78 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/generation_report.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+using base::TimeDelta;
+using std::string;
+
+namespace chromeos_update_engine {
+
+TEST(GenerationReportTest, DisabledTest) {
+  GenerationReport report;
+  report.AddStageTime("diffing", TimeDelta::FromSeconds(1));
+  report.AddFile({.name = "/foo"});
+  string json;
+  EXPECT_TRUE(report.ToJson(&json));
+  EXPECT_EQ(string::npos, json.find("diffing"));
+  EXPECT_EQ(string::npos, json.find("/foo"));
+}
+
+TEST(GenerationReportTest, JsonTest) {
+  GenerationReport report;
+  report.Enable();
+  report.AddStageTime("diffing", TimeDelta::FromSeconds(1));
+  report.AddStageTime("diffing", TimeDelta::FromSeconds(2));
+  report.AddFile({.partition = "system",
+                  .name = "/fast",
+                  .blocks = 1,
+                  .wall_time = TimeDelta::FromMilliseconds(1)});
+  report.AddFile({.partition = "system",
+                  .name = "/slow",
+                  .blocks = 100,
+                  .wall_time = TimeDelta::FromSeconds(10)});
+  GenerationReport::DiffRecord diff;
+  diff.name = "/slow:0";
+  diff.src_bytes = 4096;
+  diff.dst_bytes = 8192;
+  diff.attempts = {{.type = InstallOperation::BROTLI_BSDIFF,
+                    .wall_time = TimeDelta::FromSeconds(3),
+                    .patch_bytes = 100,
+                    .succeeded = true},
+                   {.type = InstallOperation::ZUCCHINI,
+                    .wall_time = TimeDelta::FromSeconds(4),
+                    .patch_bytes = 50,
+                    .succeeded = true}};
+  diff.chosen_type = InstallOperation::ZUCCHINI;
+  diff.blob_bytes = 50;
+  report.AddDiff(diff);
+
+  string json;
+  EXPECT_TRUE(report.ToJson(&json));
+  EXPECT_NE(string::npos, json.find("\"diffing\""));
+  EXPECT_NE(string::npos, json.find("3000"));
+  EXPECT_NE(string::npos, json.find("\"chosen\": \"ZUCCHINI\""));
+  EXPECT_NE(string::npos, json.find("\"type\": \"BROTLI_BSDIFF\""));
+  EXPECT_NE(string::npos, json.find("peak_rss_bytes"));
+  // The slowest files come first.
+  EXPECT_LT(json.find("/slow"), json.find("/fast"));
+}
+
+}  // namespace chromeos_update_engine
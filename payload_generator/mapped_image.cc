@@ -0,0 +1,86 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/mapped_image.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/files/file.h>
+#include <base/files/file_path.h>
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+bool MappedImage::Open(const std::string& path, uint64_t size) {
+  TEST_AND_RETURN_FALSE(size > 0);
+  base::File file(base::FilePath(path),
+                  base::File::FLAG_OPEN | base::File::FLAG_READ);
+  TEST_AND_RETURN_FALSE(file.IsValid());
+  // An explicit region, as the length of a block device isn't its file size.
+  TEST_AND_RETURN_FALSE_ERRNO(
+      file_.Initialize(std::move(file),
+                       {0, static_cast<size_t>(size)},
+                       base::MemoryMappedFile::READ_ONLY));
+  return true;
+}
+
+std::string_view MappedImage::data() const {
+  if (!file_.IsValid())
+    return {};
+  return ToStringView(file_.data(), file_.length());
+}
+
+bool MappedImage::ReadExtents(const std::vector<Extent>& extents,
+                              size_t block_size,
+                              brillo::Blob* buffer,
+                              std::string_view* out) const {
+  const std::string_view image = data();
+  uint64_t total_bytes = 0;
+  bool contiguous = true;
+  uint64_t next_offset = 0;
+  for (const Extent& extent : extents) {
+    if (extent.num_blocks() == 0)
+      continue;
+    const uint64_t offset = extent.start_block() * block_size;
+    const uint64_t bytes = extent.num_blocks() * block_size;
+    TEST_AND_RETURN_FALSE(offset + bytes <= image.size());
+    if (total_bytes > 0 && offset != next_offset)
+      contiguous = false;
+    if (total_bytes == 0)
+      next_offset = offset;
+    next_offset += bytes;
+    total_bytes += bytes;
+  }
+  if (contiguous) {
+    *out = image.substr(next_offset - total_bytes, total_bytes);
+    return true;
+  }
+
+  buffer->resize(total_bytes);
+  uint8_t* dest = buffer->data();
+  for (const Extent& extent : extents) {
+    const auto part = image.substr(extent.start_block() * block_size,
+                                   extent.num_blocks() * block_size);
+    dest = std::copy(part.begin(), part.end(), dest);
+  }
+  *out = ToStringView(*buffer);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,60 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_IMAGE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_IMAGE_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <base/files/memory_mapped_file.h>
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A read-only memory mapping of a partition image, to read its blocks without
+// copying them. The pages are backed by the file, so the kernel can drop them
+// under memory pressure instead of the generator running out of memory.
+class MappedImage {
+ public:
+  MappedImage() = default;
+
+  // Maps the first |size| bytes of the file or block device at |path|.
+  bool Open(const std::string& path, uint64_t size);
+
+  std::string_view data() const;
+
+  // Sets |out| to the bytes of |extents|, in order. When they are contiguous
+  // in the image, |out| points in the mapping. Otherwise the blocks are
+  // gathered in |buffer| and |out| points there.
+  bool ReadExtents(const std::vector<Extent>& extents,
+                   size_t block_size,
+                   brillo::Blob* buffer,
+                   std::string_view* out) const;
+
+ private:
+  base::MemoryMappedFile file_;
+
+  DISALLOW_COPY_AND_ASSIGN(MappedImage);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_IMAGE_H_
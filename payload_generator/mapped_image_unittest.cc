@@ -0,0 +1,82 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/mapped_image.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+}  // namespace
+
+class MappedImageTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    data_.resize(8 * kBlockSize);
+    for (size_t i = 0; i < data_.size(); i++) {
+      data_[i] = static_cast<uint8_t>(i * 11 + i / kBlockSize);
+    }
+    ASSERT_TRUE(
+        utils::WriteFile(file_.path().c_str(), data_.data(), data_.size()));
+    ASSERT_TRUE(image_.Open(file_.path(), data_.size()));
+  }
+
+  ScopedTempFile file_{"mapped_image.XXXXXX"};
+  brillo::Blob data_;
+  MappedImage image_;
+};
+
+TEST_F(MappedImageTest, ContiguousExtentsAreNotCopiedTest) {
+  brillo::Blob buffer;
+  std::string_view out;
+  ASSERT_TRUE(image_.ReadExtents(
+      {ExtentForRange(2, 1), ExtentForRange(3, 2)}, kBlockSize, &buffer, &out));
+  EXPECT_TRUE(buffer.empty());
+  EXPECT_EQ(image_.data().data() + 2 * kBlockSize, out.data());
+  EXPECT_EQ(3 * kBlockSize, out.size());
+}
+
+TEST_F(MappedImageTest, FragmentedExtentsAreGatheredTest) {
+  brillo::Blob buffer;
+  std::string_view out;
+  ASSERT_TRUE(image_.ReadExtents(
+      {ExtentForRange(5, 2), ExtentForRange(1, 1)}, kBlockSize, &buffer, &out));
+  EXPECT_EQ(ToStringView(buffer), out);
+  ASSERT_EQ(3 * kBlockSize, buffer.size());
+  EXPECT_TRUE(std::equal(data_.begin() + 5 * kBlockSize,
+                         data_.begin() + 7 * kBlockSize,
+                         buffer.begin()));
+  EXPECT_TRUE(std::equal(data_.begin() + kBlockSize,
+                         data_.begin() + 2 * kBlockSize,
+                         buffer.begin() + 2 * kBlockSize));
+}
+
+TEST_F(MappedImageTest, ExtentsPastTheEndTest) {
+  brillo::Blob buffer;
+  std::string_view out;
+  EXPECT_FALSE(image_.ReadExtents(
+      {ExtentForRange(7, 2)}, kBlockSize, &buffer, &out));
+}
+
+}  // namespace chromeos_update_engine
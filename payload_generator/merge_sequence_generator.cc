@@ -17,8 +17,16 @@
 #include "update_engine/payload_generator/merge_sequence_generator.h"
 
 #include <algorithm>
+#include <functional>
 #include <limits>
+#include <queue>
+#include <string>
+#include <utility>
 
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+
+#include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
@@ -197,141 +205,156 @@ std::unique_ptr<MergeSequenceGenerator> MergeSequenceGenerator::Create(
       new MergeSequenceGenerator(sequence));
 }
 
+std::vector<MergeSequenceGenerator::IndexRange>
+MergeSequenceGenerator::FindBlockedRanges() const {
+  // The dst extents are disjoint and |operations_| is sorted by them, so both
+  // their start and end blocks are sorted and the operations writing to a
+  // src extent are a contiguous range found with two binary searches.
+  const size_t num_operations = operations_.size();
+  std::vector<uint64_t> dst_starts(num_operations);
+  std::vector<uint64_t> dst_ends(num_operations);
+  for (size_t i = 0; i < num_operations; i++) {
+    dst_starts[i] = operations_[i].dst_extent().start_block();
+    dst_ends[i] = dst_starts[i] + operations_[i].dst_extent().num_blocks();
+  }
+
+  std::vector<IndexRange> blocked(num_operations);
+  for (size_t i = 0; i < num_operations; i++) {
+    const Extent& src_extent = operations_[i].src_extent();
+    const uint64_t src_start = src_extent.start_block();
+    const uint64_t src_end = src_start + src_extent.num_blocks();
+    const auto lower =
+        std::upper_bound(dst_ends.begin(), dst_ends.end(), src_start);
+    const auto upper = std::lower_bound(
+        dst_starts.begin() + (lower - dst_ends.begin()),
+        dst_starts.end(),
+        src_end);
+    blocked[i] = {static_cast<size_t>(lower - dst_ends.begin()),
+                  static_cast<size_t>(upper - dst_starts.begin())};
+  }
+  return blocked;
+}
+
 bool MergeSequenceGenerator::FindDependency(
     std::map<CowMergeOperation, std::set<CowMergeOperation>>* result) const {
   CHECK(result);
-  LOG(INFO) << "Finding dependencies";
-
-  // Since the OTA operation may reuse some source blocks, use the binary
-  // search on sorted dst extents to find overlaps.
+  const std::vector<IndexRange> blocked = FindBlockedRanges();
   std::map<CowMergeOperation, std::set<CowMergeOperation>> merge_after;
-  for (const auto& op : operations_) {
-    // lower bound (inclusive): dst extent's end block >= src extent's start
-    // block.
-    const auto lower_it = std::lower_bound(
-        operations_.begin(),
-        operations_.end(),
-        op,
-        [](const CowMergeOperation& it, const CowMergeOperation& op) {
-          auto dst_end_block =
-              it.dst_extent().start_block() + it.dst_extent().num_blocks() - 1;
-          return dst_end_block < op.src_extent().start_block();
-        });
-    // upper bound: dst extent's start block > src extent's end block
-    const auto upper_it = std::upper_bound(
-        lower_it,
-        operations_.end(),
-        op,
-        [](const CowMergeOperation& op, const CowMergeOperation& it) {
-          auto src_end_block =
-              op.src_extent().start_block() + op.src_extent().num_blocks() - 1;
-          return src_end_block < it.dst_extent().start_block();
-        });
-
-    // TODO(xunchang) skip inserting the empty set to merge_after.
-    if (lower_it == upper_it) {
-      merge_after.insert({op, {}});
-    } else {
-      std::set<CowMergeOperation> operations(lower_it, upper_it);
-      auto it = operations.find(op);
-      if (it != operations.end()) {
-        LOG(INFO) << "Self overlapping " << op;
-        operations.erase(it);
+  for (size_t i = 0; i < operations_.size(); i++) {
+    std::set<CowMergeOperation>& operations = merge_after[operations_[i]];
+    for (size_t j = blocked[i].first; j < blocked[i].second; j++) {
+      if (j != i) {
+        operations.insert(operations_[j]);
       }
-      auto ret = merge_after.emplace(op, std::move(operations));
-      // Check the insertion indeed happens.
-      CHECK(ret.second) << op;
     }
   }
-
   *result = std::move(merge_after);
   return true;
 }
 
-bool MergeSequenceGenerator::Generate(
-    std::vector<CowMergeOperation>* sequence) const {
+bool MergeSequenceGenerator::Generate(std::vector<CowMergeOperation>* sequence,
+                                      const ExtentRanges* hot_blocks) const {
   sequence->clear();
-  std::map<CowMergeOperation, std::set<CowMergeOperation>> merge_after;
-  if (!FindDependency(&merge_after)) {
-    LOG(ERROR) << "Failed to find dependencies";
-    return false;
-  }
+  LOG(INFO) << "Finding dependencies";
+  const std::vector<IndexRange> blocked = FindBlockedRanges();
+  const size_t num_operations = operations_.size();
 
   LOG(INFO) << "Generating sequence";
 
-  // Use the non-DFS version of the topology sort. So we can control the
-  // operations to discard to break cycles; thus yielding a deterministic
-  // sequence.
-  std::map<CowMergeOperation, int> incoming_edges;
-  for (const auto& it : merge_after) {
-    for (const auto& blocked : it.second) {
-      // Value is default initialized to 0.
-      incoming_edges[blocked] += 1;
+  // Every operation blocks the ones in its range, except itself when it is
+  // self overlapping. The number of operations blocking each one is summed
+  // from the ranges in linear time.
+  std::vector<int64_t> incoming_edges(num_operations + 1);
+  for (size_t i = 0; i < num_operations; i++) {
+    incoming_edges[blocked[i].first]++;
+    incoming_edges[blocked[i].second]--;
+  }
+  for (size_t i = 1; i < num_operations; i++) {
+    incoming_edges[i] += incoming_edges[i - 1];
+  }
+  for (size_t i = 0; i < num_operations; i++) {
+    if (blocked[i].first <= i && i < blocked[i].second) {
+      LOG(INFO) << "Self overlapping " << operations_[i];
+      incoming_edges[i]--;
     }
   }
 
-  // Technically, we can use std::unordered_set or just a std::vector. but
-  // std::set gives the benefit where operations are sorted by dst blocks. This
-  // will ensure that operations that do not have dependency constraints appear
-  // in increasing block order. Such order would help snapuserd batch merges and
-  // improve boot time, but isn't strictly needed for correctness.
-  std::set<CowMergeOperation> free_operations;
-  for (const auto& op : operations_) {
-    if (incoming_edges.find(op) == incoming_edges.end()) {
-      free_operations.insert(op);
+  // Use the non-DFS version of the topology sort, so we can control the
+  // operations to discard to break cycles; thus yielding a deterministic
+  // sequence. The next operation merged is always the free one with the
+  // smallest dst blocks, the ones writing |hot_blocks| first, instead of all
+  // the free operations of a round before those they unblock. So the
+  // operations without dependency constraints appear in increasing block
+  // order across rounds, which makes the source reads and the writes of the
+  // merge sequential, helps snapuserd batch merges and improves boot time, and
+  // the blocks read early during boot are merged as soon as their
+  // dependencies allow. None of this is strictly needed for correctness.
+  // |pending| marks the operations still blocked or not merged yet, like the
+  // keys left in the |incoming_edges| map of a textbook Kahn's algorithm.
+  std::vector<bool> cold(num_operations, true);
+  if (hot_blocks) {
+    for (size_t i = 0; i < num_operations; i++) {
+      cold[i] = !hot_blocks->OverlapsWithExtent(operations_[i].dst_extent());
+    }
+  }
+  // Ordered by (cold, index), |operations_| being sorted by dst blocks.
+  using FreeOperation = std::pair<bool, size_t>;
+  std::priority_queue<FreeOperation,
+                      std::vector<FreeOperation>,
+                      std::greater<FreeOperation>>
+      free_operations;
+  std::vector<bool> pending(num_operations);
+  size_t remaining = 0;
+  for (size_t i = 0; i < num_operations; i++) {
+    if (incoming_edges[i] == 0) {
+      free_operations.emplace(cold[i], i);
+    } else {
+      pending[i] = true;
+      remaining++;
     }
   }
 
+  // All the operations before it are no longer pending.
+  size_t first_pending = 0;
   std::vector<CowMergeOperation> merge_sequence;
-  std::set<CowMergeOperation> convert_to_raw;
-  while (!incoming_edges.empty()) {
+  merge_sequence.reserve(num_operations);
+  std::vector<size_t> convert_to_raw;
+  while (!free_operations.empty() || remaining > 0) {
+    size_t i;
     if (!free_operations.empty()) {
-      merge_sequence.insert(
-          merge_sequence.end(), free_operations.begin(), free_operations.end());
+      i = free_operations.top().second;
+      free_operations.pop();
+      merge_sequence.push_back(operations_[i]);
     } else {
-      auto to_convert = incoming_edges.begin()->first;
-      free_operations.insert(to_convert);
-      convert_to_raw.insert(to_convert);
-      LOG(INFO) << "Converting operation to raw " << to_convert;
+      while (!pending[first_pending]) {
+        first_pending++;
+      }
+      i = first_pending;
+      convert_to_raw.push_back(i);
+      LOG(INFO) << "Converting operation to raw " << operations_[i];
+    }
+    if (pending[i]) {
+      pending[i] = false;
+      remaining--;
     }
 
-    std::set<CowMergeOperation> next_free_operations;
-    for (const auto& op : free_operations) {
-      incoming_edges.erase(op);
-
-      // Now that this particular operation is merged, other operations
-      // blocked by this one may be free. Decrement the count of blocking
-      // operations, and set up the free operations for the next iteration.
-      for (const auto& blocked : merge_after[op]) {
-        auto it = incoming_edges.find(blocked);
-        if (it == incoming_edges.end()) {
-          continue;
-        }
-
-        auto blocking_transfer_count = &it->second;
-        if (*blocking_transfer_count <= 0) {
-          LOG(ERROR) << "Unexpected count in merge after map "
-                     << blocking_transfer_count;
-          return false;
-        }
-        // This operation is no longer blocked by anyone. Add it to the merge
-        // sequence in the next iteration.
-        *blocking_transfer_count -= 1;
-        if (*blocking_transfer_count == 0) {
-          next_free_operations.insert(blocked);
-        }
+    // Now that this particular operation is merged, other operations
+    // blocked by this one may be free. Decrement the count of blocking
+    // operations, and add the free operations to the queue.
+    for (size_t j = blocked[i].first; j < blocked[i].second; j++) {
+      if (j == i || !pending[j]) {
+        continue;
+      }
+      if (incoming_edges[j] <= 0) {
+        LOG(ERROR) << "Unexpected count in merge after map "
+                   << incoming_edges[j];
+        return false;
+      }
+      // This operation is no longer blocked by anyone.
+      if (--incoming_edges[j] == 0) {
+        free_operations.emplace(cold[j], j);
       }
     }
-
-    LOG(INFO) << "Remaining transfers " << incoming_edges.size()
-              << ", free transfers " << free_operations.size()
-              << ", merge_sequence size " << merge_sequence.size();
-    free_operations = std::move(next_free_operations);
-  }
-
-  if (!free_operations.empty()) {
-    merge_sequence.insert(
-        merge_sequence.end(), free_operations.begin(), free_operations.end());
   }
 
   CHECK_EQ(operations_.size(), merge_sequence.size() + convert_to_raw.size());
@@ -342,8 +365,8 @@ bool MergeSequenceGenerator::Generate(
   }
 
   size_t blocks_in_raw = 0;
-  for (const CowMergeOperation& transfer : convert_to_raw) {
-    blocks_in_raw += transfer.dst_extent().num_blocks();
+  for (size_t i : convert_to_raw) {
+    blocks_in_raw += operations_[i].dst_extent().num_blocks();
   }
 
   LOG(INFO) << "Blocks in merge sequence " << blocks_in_sequence
@@ -356,11 +379,35 @@ bool MergeSequenceGenerator::Generate(
   *sequence = std::move(merge_sequence);
   return true;
 }
+}  // namespace chromeos_update_engine
 
 bool MergeSequenceGenerator::ValidateSequence(
     const std::vector<CowMergeOperation>& sequence) {
   LOG(INFO) << "Validating merge sequence";
-  ExtentRanges visited;
+  // One bit per block written so far, so each check is linear in the size of
+  // the extent instead of logarithmic in the number of visited extents.
+  uint64_t num_blocks = 0;
+  for (const auto& op : sequence) {
+    for (const Extent& extent : {op.src_extent(), op.dst_extent()}) {
+      num_blocks =
+          std::max(num_blocks, extent.start_block() + extent.num_blocks());
+    }
+  }
+  std::vector<uint64_t> visited((num_blocks + 63) / 64);
+  const auto is_visited = [&visited](uint64_t block) {
+    return (visited[block / 64] >> (block % 64)) & 1;
+  };
+  const auto overlaps_visited = [&is_visited](const Extent& extent) {
+    for (uint64_t block = extent.start_block();
+         block < extent.start_block() + extent.num_blocks();
+         block++) {
+      if (is_visited(block)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
   for (const auto& op : sequence) {
     // If |src_offset| is greater than zero, dependency should include 1 extra
     // block at end of src_extent, as the OP actually references data past
@@ -372,19 +419,40 @@ bool MergeSequenceGenerator::ValidateSequence(
       CHECK_EQ(op.src_extent().num_blocks(), op.dst_extent().num_blocks())
           << op;
     }
-    if (visited.OverlapsWithExtent(op.src_extent())) {
-      LOG(ERROR) << "Transfer violates the merge sequence " << op
-                 << "Visited extent ranges: ";
-      visited.Dump();
+    if (overlaps_visited(op.src_extent())) {
+      LOG(ERROR) << "Transfer violates the merge sequence " << op;
       return false;
     }
 
-    CHECK(!visited.OverlapsWithExtent(op.dst_extent()))
+    CHECK(!overlaps_visited(op.dst_extent()))
         << "dst extent should write only once.";
-    visited.AddExtent(op.dst_extent());
+    const Extent& dst_extent = op.dst_extent();
+    for (uint64_t block = dst_extent.start_block();
+         block < dst_extent.start_block() + dst_extent.num_blocks();
+         block++) {
+      visited[block / 64] |= uint64_t{1} << (block % 64);
+    }
   }
 
   return true;
 }
 
+bool ReadHotBlocks(const std::string& path, ExtentRanges* hot_blocks) {
+  std::string contents;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(path, &contents));
+  for (const auto& line : base::SplitStringPiece(
+           contents, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    const auto range = base::SplitStringPiece(
+        line, "-", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+    uint64_t first = 0, last = 0;
+    if (range.size() > 2 || !base::StringToUint64(range[0], &first) ||
+        !base::StringToUint64(range.back(), &last) || last < first) {
+      LOG(ERROR) << "Invalid hot blocks line in " << path << ": " << line;
+      return false;
+    }
+    hot_blocks->AddExtent(ExtentForRange(first, last - first + 1));
+  }
+  return true;
+}
+
 }  // namespace chromeos_update_engine
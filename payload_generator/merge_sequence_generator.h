@@ -20,6 +20,7 @@
 #include <map>
 #include <memory>
 #include <set>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -56,14 +57,24 @@ class MergeSequenceGenerator {
   static bool ValidateSequence(const std::vector<CowMergeOperation>& sequence);
 
   // Generates a merge sequence from |operations_|, puts the result in
-  // |sequence|. Returns false on failure.
-  bool Generate(std::vector<CowMergeOperation>* sequence) const;
+  // |sequence|. The operations writing |hot_blocks|, if not null, are merged
+  // as early as possible. Returns false on failure.
+  bool Generate(std::vector<CowMergeOperation>* sequence,
+                const ExtentRanges* hot_blocks = nullptr) const;
 
  private:
   friend class MergeSequenceGeneratorTest;
   explicit MergeSequenceGenerator(std::vector<CowMergeOperation> transfers)
       : operations_(std::move(transfers)) {}
 
+  // [first, second) indices into |operations_|.
+  using IndexRange = std::pair<size_t, size_t>;
+
+  // For each operation, finds the range of operations whose dst extents
+  // overlap with its src extent, i.e. the ones that should merge after it.
+  // The range includes the operation itself when it is self overlapping.
+  std::vector<IndexRange> FindBlockedRanges() const;
+
   // For a given merge operation, finds all the operations that should merge
   // after myself. Put the result in |merge_after|.
   bool FindDependency(std::map<CowMergeOperation, std::set<CowMergeOperation>>*
@@ -72,6 +83,10 @@ class MergeSequenceGenerator {
   const std::vector<CowMergeOperation> operations_;
 };
 
+// Reads the blocks of |path|, one block or FIRST-LAST range of blocks per
+// line, to |hot_blocks|.
+bool ReadHotBlocks(const std::string& path, ExtentRanges* hot_blocks);
+
 void SplitSelfOverlapping(const Extent& src_extent,
                           const Extent& dst_extent,
                           std::vector<CowMergeOperation>* sequence);
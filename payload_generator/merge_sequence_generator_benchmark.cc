@@ -0,0 +1,187 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Measures the Virtual A/B steps of the generator on synthetic SOURCE_COPY
+// operations: the merge sequence, its conversion to COW operations and the
+// COW size estimate.
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <base/logging.h>
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/cow_operation_convert.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/cow_size_estimator.h"
+#include "update_engine/payload_generator/merge_sequence_generator.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+
+// |count| SOURCE_COPY operations of 1 to 16 blocks writing the partition in
+// order, each reading its blocks up to 64 blocks away, the way files move a
+// little when the ones before them change. Many of them depend on each other.
+std::vector<AnnotatedOperation> MakeCopyOperations(size_t count) {
+  std::mt19937 rng(count);
+  std::vector<AnnotatedOperation> aops(count);
+  uint64_t block = 0;
+  for (auto& aop : aops) {
+    const uint64_t num_blocks = 1 + rng() % 16;
+    const int64_t shift = static_cast<int64_t>(rng() % 129) - 64;
+    const uint64_t src_block =
+        std::max<int64_t>(0, static_cast<int64_t>(block) + shift);
+    aop.op.set_type(InstallOperation::SOURCE_COPY);
+    *aop.op.add_src_extents() = ExtentForRange(src_block, num_blocks);
+    *aop.op.add_dst_extents() = ExtentForRange(block, num_blocks);
+    block += num_blocks;
+  }
+  return aops;
+}
+
+uint64_t NumBlocks(const std::vector<AnnotatedOperation>& aops) {
+  uint64_t num_blocks = 0;
+  for (const auto& aop : aops) {
+    for (const Extent& extent :
+         {aop.op.src_extents(0), aop.op.dst_extents(0)}) {
+      num_blocks =
+          std::max(num_blocks, extent.start_block() + extent.num_blocks());
+    }
+  }
+  return num_blocks;
+}
+
+// Argument: the number of operations.
+void BM_MergeSequenceGenerate(benchmark::State& state) {
+  const std::vector<AnnotatedOperation> aops =
+      MakeCopyOperations(state.range(0));
+  std::vector<CowMergeOperation> sequence;
+  for (auto _ : state) {
+    auto generator = MergeSequenceGenerator::Create(aops);
+    CHECK(generator);
+    CHECK(generator->Generate(&sequence));
+    benchmark::DoNotOptimize(sequence);
+  }
+  state.SetItemsProcessed(state.iterations() * aops.size());
+  state.counters["merge_ops"] = sequence.size();
+}
+BENCHMARK(BM_MergeSequenceGenerate)
+    ->ArgName("operations")
+    ->RangeMultiplier(8)
+    ->Range(1 << 10, 1 << 16)
+    ->Unit(benchmark::kMillisecond);
+
+// Argument: the number of operations.
+void BM_ConvertToCowOperations(benchmark::State& state) {
+  const std::vector<AnnotatedOperation> aops =
+      MakeCopyOperations(state.range(0));
+  std::vector<CowMergeOperation> sequence;
+  auto generator = MergeSequenceGenerator::Create(aops);
+  CHECK(generator);
+  CHECK(generator->Generate(&sequence));
+  google::protobuf::RepeatedPtrField<InstallOperation> operations;
+  for (const auto& aop : aops) {
+    *operations.Add() = aop.op;
+  }
+  const google::protobuf::RepeatedPtrField<CowMergeOperation> merge_operations(
+      sequence.begin(), sequence.end());
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        ConvertToCowOperations(operations, merge_operations));
+  }
+  state.SetItemsProcessed(state.iterations() * aops.size());
+}
+BENCHMARK(BM_ConvertToCowOperations)
+    ->ArgName("operations")
+    ->RangeMultiplier(8)
+    ->Range(1 << 10, 1 << 16)
+    ->Unit(benchmark::kMillisecond);
+
+// Argument: the number of threads estimating the COW size of 2048 operations,
+// about 64 MiB, written with a target image the operations produce.
+void BM_EstimateCowSize(benchmark::State& state) {
+  const std::vector<AnnotatedOperation> aops = MakeCopyOperations(2048);
+  const uint64_t num_blocks = NumBlocks(aops);
+  brillo::Blob source(num_blocks * kBlockSize);
+  std::mt19937 rng(0);
+  std::generate(source.begin(), source.end(), [&rng] { return rng() % 16; });
+  brillo::Blob target(source.size());
+  for (const auto& aop : aops) {
+    const Extent& src = aop.op.src_extents(0);
+    const Extent& dst = aop.op.dst_extents(0);
+    std::copy_n(source.begin() + src.start_block() * kBlockSize,
+                src.num_blocks() * kBlockSize,
+                target.begin() + dst.start_block() * kBlockSize);
+  }
+  ScopedTempFile source_file("cow_estimate_source.XXXXXX");
+  ScopedTempFile target_file("cow_estimate_target.XXXXXX");
+  CHECK(utils::WriteFile(
+      source_file.path().c_str(), source.data(), source.size()));
+  CHECK(utils::WriteFile(
+      target_file.path().c_str(), target.data(), target.size()));
+
+  std::vector<CowMergeOperation> sequence;
+  auto generator = MergeSequenceGenerator::Create(aops);
+  CHECK(generator);
+  CHECK(generator->Generate(&sequence));
+  google::protobuf::RepeatedPtrField<InstallOperation> operations;
+  for (const auto& aop : aops) {
+    *operations.Add() = aop.op;
+  }
+  const google::protobuf::RepeatedPtrField<CowMergeOperation> merge_operations(
+      sequence.begin(), sequence.end());
+  size_t cow_size = 0;
+  for (auto _ : state) {
+    auto source_fd = std::make_shared<EintrSafeFileDescriptor>();
+    auto target_fd = std::make_shared<EintrSafeFileDescriptor>();
+    CHECK(source_fd->Open(source_file.path().c_str(), O_RDONLY));
+    CHECK(target_fd->Open(target_file.path().c_str(), O_RDONLY));
+    cow_size = EstimateCowSize(std::move(source_fd),
+                               std::move(target_fd),
+                               operations,
+                               merge_operations,
+                               kBlockSize,
+                               "gz",
+                               target.size(),
+                               /*xor_enabled=*/false,
+                               state.range(0));
+    benchmark::DoNotOptimize(cow_size);
+  }
+  state.SetBytesProcessed(state.iterations() * target.size());
+  state.counters["cow_size"] = cow_size;
+}
+BENCHMARK(BM_EstimateCowSize)
+    ->ArgName("threads")
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(4)
+    ->Arg(8)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
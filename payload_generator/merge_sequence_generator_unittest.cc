@@ -19,6 +19,8 @@
 
 #include <gtest/gtest.h>
 
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
@@ -48,11 +50,12 @@ class MergeSequenceGeneratorTest : public ::testing::Test {
   }
 
   void GenerateSequence(std::vector<CowMergeOperation> transfers,
-                        const std::vector<CowMergeOperation>& expected) {
+                        const std::vector<CowMergeOperation>& expected,
+                        const ExtentRanges* hot_blocks = nullptr) {
     std::sort(transfers.begin(), transfers.end());
     MergeSequenceGenerator generator(std::move(transfers));
     std::vector<CowMergeOperation> sequence;
-    ASSERT_TRUE(generator.Generate(&sequence));
+    ASSERT_TRUE(generator.Generate(&sequence, hot_blocks));
     ASSERT_EQ(expected, sequence);
   }
 };
@@ -215,6 +218,71 @@ TEST_F(MergeSequenceGeneratorTest, GenerateSequenceMultipleCycles) {
   GenerateSequence(transfers, expected);
 }
 
+TEST_F(MergeSequenceGeneratorTest, GenerateSequenceLongChain) {
+  // Every operation reads the block the next one writes, so it has to merge
+  // before that one. The last one reads block 0 and closes a single cycle.
+  constexpr uint64_t kNumOperations = 1000;
+  std::vector<CowMergeOperation> transfers;
+  for (uint64_t i = 0; i < kNumOperations; i++) {
+    transfers.push_back(
+        CreateCowMergeOperation(ExtentForRange((i + 1) % kNumOperations, 1),
+                                ExtentForRange(i, 1)));
+  }
+
+  // The first operation is converted to raw to break the cycle.
+  std::vector<CowMergeOperation> expected(transfers.begin() + 1,
+                                          transfers.end());
+  GenerateSequence(transfers, expected);
+}
+
+TEST_F(MergeSequenceGeneratorTest, GenerateSequenceInBlockOrder) {
+  std::vector<CowMergeOperation> transfers = {
+      // Reads the dst blocks of the next one, which merges after it.
+      CreateCowMergeOperation(ExtentForRange(20, 5), ExtentForRange(10, 5)),
+      CreateCowMergeOperation(ExtentForRange(50, 5), ExtentForRange(20, 5)),
+      CreateCowMergeOperation(ExtentForRange(60, 5), ExtentForRange(30, 5)),
+  };
+
+  // The unblocked operation still merges in block order, not with the other
+  // operations free from the start.
+  std::vector<CowMergeOperation> expected{
+      transfers[0], transfers[1], transfers[2]};
+  GenerateSequence(transfers, expected);
+}
+
+TEST_F(MergeSequenceGeneratorTest, GenerateSequenceHotBlocksFirst) {
+  std::vector<CowMergeOperation> transfers = {
+      CreateCowMergeOperation(ExtentForRange(20, 5), ExtentForRange(10, 5)),
+      CreateCowMergeOperation(ExtentForRange(50, 5), ExtentForRange(20, 5)),
+      CreateCowMergeOperation(ExtentForRange(60, 5), ExtentForRange(30, 5)),
+  };
+  ExtentRanges hot_blocks;
+  hot_blocks.AddExtent(ExtentForRange(22, 1));
+  hot_blocks.AddExtent(ExtentForRange(34, 1));
+
+  // The hot operations merge first, as allowed by their dependencies.
+  std::vector<CowMergeOperation> expected{
+      transfers[2], transfers[0], transfers[1]};
+  GenerateSequence(transfers, expected, &hot_blocks);
+}
+
+TEST_F(MergeSequenceGeneratorTest, ReadHotBlocksTest) {
+  ScopedTempFile hot_blocks_file("MergeSequenceGeneratorTest.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileString(hot_blocks_file.path(),
+                                          "10\n 20-29\n\n40-40\n"));
+  ExtentRanges hot_blocks;
+  ASSERT_TRUE(ReadHotBlocks(hot_blocks_file.path(), &hot_blocks));
+  EXPECT_EQ(12u, hot_blocks.blocks());
+  EXPECT_TRUE(hot_blocks.ContainsBlock(10));
+  EXPECT_TRUE(hot_blocks.ContainsBlock(29));
+  EXPECT_FALSE(hot_blocks.ContainsBlock(30));
+  EXPECT_TRUE(hot_blocks.ContainsBlock(40));
+
+  ASSERT_TRUE(
+      test_utils::WriteFileString(hot_blocks_file.path(), "30-20\n"));
+  EXPECT_FALSE(ReadHotBlocks(hot_blocks_file.path(), &hot_blocks));
+}
+
 void ValidateSplitSequence(const Extent& src_extent, const Extent& dst_extent) {
   std::vector<CowMergeOperation> sequence;
   SplitSelfOverlapping(src_extent, dst_extent, &sequence);
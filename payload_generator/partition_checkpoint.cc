@@ -0,0 +1,259 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/partition_checkpoint.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+// On disk format of a checkpoint:
+//   char magic[8] = kCheckpointMagic;
+//   uint64_t header_size;
+//   char header[header_size];
+//   char sha256_of_header[32];
+//   char blobs[];
+// The header is a serialized PartitionUpdate with the operations, whose
+// data_offset is relative to |blobs|, the merge sequence, the COW size and
+// the zstd dictionary, followed by the names of the operations, each ended by
+// a '\0'. Each blob is checked against the data_sha256_hash of its operation.
+constexpr char kCheckpointMagic[] = "UECKPT01";
+constexpr size_t kMagicSize = sizeof(kCheckpointMagic) - 1;
+constexpr size_t kHashSize = 32;
+// Anything larger isn't a header.
+constexpr uint64_t kMaxHeaderSize = 1024 * 1024 * 1024;
+
+// Reads exactly |count| bytes at |offset| of |fd|.
+bool ReadAt(int fd, void* buf, size_t count, off_t offset) {
+  ssize_t bytes_read = 0;
+  return utils::PReadAll(fd, buf, count, offset, &bytes_read) &&
+         bytes_read == static_cast<ssize_t>(count);
+}
+
+bool ReadHeader(int fd,
+                PartitionUpdate* partition,
+                std::vector<string>* names,
+                uint64_t* blobs_offset) {
+  char magic[kMagicSize];
+  uint64_t header_size = 0;
+  TEST_AND_RETURN_FALSE(ReadAt(fd, magic, sizeof(magic), 0) &&
+                        memcmp(magic, kCheckpointMagic, kMagicSize) == 0);
+  TEST_AND_RETURN_FALSE(
+      ReadAt(fd, &header_size, sizeof(header_size), kMagicSize));
+  TEST_AND_RETURN_FALSE(header_size <= kMaxHeaderSize);
+  brillo::Blob header(header_size + kHashSize);
+  TEST_AND_RETURN_FALSE(ReadAt(
+      fd, header.data(), header.size(), kMagicSize + sizeof(header_size)));
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfBytes(header.data(), header_size, &hash));
+  TEST_AND_RETURN_FALSE(
+      std::equal(hash.begin(), hash.end(), header.begin() + header_size));
+
+  uint64_t proto_size = 0;
+  TEST_AND_RETURN_FALSE(header_size >= sizeof(proto_size));
+  memcpy(&proto_size, header.data(), sizeof(proto_size));
+  TEST_AND_RETURN_FALSE(proto_size <= header_size - sizeof(proto_size));
+  const uint8_t* proto = header.data() + sizeof(proto_size);
+  TEST_AND_RETURN_FALSE(partition->ParseFromArray(proto, proto_size));
+  const char* name = reinterpret_cast<const char*>(proto + proto_size);
+  const char* end = reinterpret_cast<const char*>(header.data() + header_size);
+  names->clear();
+  while (name < end) {
+    const char* name_end =
+        static_cast<const char*>(memchr(name, 0, end - name));
+    TEST_AND_RETURN_FALSE(name_end);
+    names->emplace_back(name, name_end);
+    name = name_end + 1;
+  }
+  TEST_AND_RETURN_FALSE(names->size() ==
+                        static_cast<size_t>(partition->operations_size()));
+  *blobs_offset = kMagicSize + sizeof(header_size) + header.size();
+  return true;
+}
+}  // namespace
+
+PartitionCheckpoints::PartitionCheckpoints(const string& dir) : dir_(dir) {}
+
+bool PartitionCheckpoints::Load(const brillo::Blob& key,
+                                BlobFileWriter* blob_file,
+                                PartitionCheckpointData* data) const {
+  const string path = CheckpointPath(key);
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  if (fd < 0)
+    return false;
+  ScopedFdCloser fd_closer(&fd);
+
+  PartitionUpdate partition;
+  std::vector<string> names;
+  uint64_t blobs_offset = 0;
+  if (!ReadHeader(fd, &partition, &names, &blobs_offset)) {
+    LOG(WARNING) << "Ignoring invalid partition checkpoint " << path;
+    return false;
+  }
+  std::vector<AnnotatedOperation> aops(partition.operations_size());
+  for (int i = 0; i < partition.operations_size(); i++) {
+    AnnotatedOperation& aop = aops[i];
+    aop.name = std::move(names[i]);
+    aop.op = partition.operations(i);
+    if (!aop.op.has_data_offset())
+      continue;
+    brillo::Blob blob(aop.op.data_length());
+    brillo::Blob hash;
+    if (!ReadAt(fd,
+                blob.data(),
+                blob.size(),
+                blobs_offset + aop.op.data_offset()) ||
+        !HashCalculator::RawHashOfData(blob, &hash) ||
+        ToStringView(hash) != aop.op.data_sha256_hash()) {
+      LOG(WARNING) << "Ignoring corrupted partition checkpoint " << path;
+      return false;
+    }
+    TEST_AND_RETURN_FALSE(aop.SetOperationBlob(blob, blob_file));
+  }
+  data->aops = std::move(aops);
+  data->merge_sequence.assign(partition.merge_operations().begin(),
+                              partition.merge_operations().end());
+  data->cow_size = partition.estimate_cow_size();
+  data->zstd_dictionary.assign(partition.zstd_dictionary().begin(),
+                               partition.zstd_dictionary().end());
+  return true;
+}
+
+bool PartitionCheckpoints::Save(const brillo::Blob& key,
+                                int blob_fd,
+                                const PartitionCheckpointData& data) const {
+  PartitionUpdate partition;
+  string names;
+  uint64_t blobs_size = 0;
+  for (const AnnotatedOperation& aop : data.aops) {
+    InstallOperation* op = partition.add_operations();
+    *op = aop.op;
+    if (op->has_data_offset()) {
+      op->set_data_offset(blobs_size);
+      blobs_size += op->data_length();
+    }
+    names += aop.name;
+    names.push_back('\0');
+  }
+  for (const CowMergeOperation& merge_op : data.merge_sequence)
+    *partition.add_merge_operations() = merge_op;
+  partition.set_estimate_cow_size(data.cow_size);
+  if (!data.zstd_dictionary.empty()) {
+    partition.set_zstd_dictionary(data.zstd_dictionary.data(),
+                                  data.zstd_dictionary.size());
+  }
+  string proto;
+  TEST_AND_RETURN_FALSE(partition.SerializeToString(&proto));
+
+  const uint64_t proto_size = proto.size();
+  brillo::Blob header(reinterpret_cast<const uint8_t*>(&proto_size),
+                      reinterpret_cast<const uint8_t*>(&proto_size + 1));
+  header.insert(header.end(), proto.begin(), proto.end());
+  header.insert(header.end(), names.begin(), names.end());
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(header, &hash));
+  const uint64_t header_size = header.size();
+  header.insert(header.end(), hash.begin(), hash.end());
+
+  if (!base::CreateDirectory(base::FilePath(dir_))) {
+    PLOG(WARNING) << "Failed to create partition checkpoint directory "
+                  << dir_;
+    return false;
+  }
+  // Written to a temporary file first, so that an interrupted save leaves no
+  // partial checkpoint.
+  const string path = CheckpointPath(key);
+  string temp_path = path + ".XXXXXX";
+  int fd = mkstemp(temp_path.data());
+  if (fd < 0) {
+    PLOG(WARNING) << "Failed to create " << temp_path;
+    return false;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  bool success =
+      utils::WriteAll(fd, kCheckpointMagic, kMagicSize) &&
+      utils::WriteAll(fd, &header_size, sizeof(header_size)) &&
+      utils::WriteAll(fd, header.data(), header.size());
+  brillo::Blob blob;
+  for (const AnnotatedOperation& aop : data.aops) {
+    if (!success)
+      break;
+    if (!aop.op.has_data_offset())
+      continue;
+    blob.resize(aop.op.data_length());
+    success =
+        ReadAt(blob_fd, blob.data(), blob.size(), aop.op.data_offset()) &&
+        utils::WriteAll(fd, blob.data(), blob.size());
+  }
+  if (!success || fsync(fd) != 0 ||
+      rename(temp_path.c_str(), path.c_str()) != 0) {
+    PLOG(WARNING) << "Failed to write partition checkpoint " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  LOG(INFO) << "Saved the checkpoint of " << data.aops.size()
+            << " operations to " << path;
+  return true;
+}
+
+string PartitionCheckpoints::CheckpointPath(const brillo::Blob& key) const {
+  return dir_ + "/" + utils::HexEncode(key);
+}
+
+bool PartitionCheckpointKey(const PayloadGenerationConfig& config,
+                            const PartitionConfig& old_part,
+                            const PartitionConfig& new_part,
+                            brillo::Blob* key) {
+  PartitionInfo old_info, new_info;
+  if (!old_part.path.empty()) {
+    TEST_AND_RETURN_FALSE(
+        diff_utils::InitializePartitionInfo(old_part, &old_info));
+  }
+  TEST_AND_RETURN_FALSE(
+      diff_utils::InitializePartitionInfo(new_part, &new_info));
+  string input = kCheckpointMagic;
+  for (const string& field : {config.checkpoint_salt,
+                              new_part.name,
+                              old_info.SerializeAsString(),
+                              new_info.SerializeAsString()}) {
+    const uint64_t size = field.size();
+    input.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    input += field;
+  }
+  return HashCalculator::RawHashOfBytes(input.data(), input.size(), key);
+}
+
+}  // namespace chromeos_update_engine
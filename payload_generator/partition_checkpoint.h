@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PARTITION_CHECKPOINT_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PARTITION_CHECKPOINT_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// What was generated for a partition, as saved in a checkpoint.
+struct PartitionCheckpointData {
+  std::vector<AnnotatedOperation> aops;
+  std::vector<CowMergeOperation> merge_sequence;
+  size_t cow_size{0};
+  // The zstd dictionary of the partition, empty without one.
+  brillo::Blob zstd_dictionary;
+};
+
+// An on disk store of the operations generated for each partition, with their
+// blobs, so that a payload generation interrupted after some partitions were
+// done skips them when it runs again. Each checkpoint is a file in |dir| named
+// after its key, see PartitionCheckpointKey(). Like DiffCache, checkpoints
+// are written atomically and errors are only logged: a missing or broken
+// checkpoint makes the partition generate again.
+class PartitionCheckpoints {
+ public:
+  explicit PartitionCheckpoints(const std::string& dir);
+
+  // Loads the checkpoint saved under |key| into |data|, storing the blobs of
+  // its operations in |blob_file|. Returns false if there is no valid one.
+  bool Load(const brillo::Blob& key,
+            BlobFileWriter* blob_file,
+            PartitionCheckpointData* data) const;
+
+  // Saves |data| under |key|, reading the blobs of its operations from
+  // |blob_fd|, where they were stored.
+  bool Save(const brillo::Blob& key,
+            int blob_fd,
+            const PartitionCheckpointData& data) const;
+
+ private:
+  std::string CheckpointPath(const brillo::Blob& key) const;
+
+  const std::string dir_;
+};
+
+// Returns the key of the checkpoint of |new_part|, a hash of the contents of
+// |old_part| and |new_part| and of |config.checkpoint_salt|, which should
+// cover everything else the operations depend on.
+bool PartitionCheckpointKey(const PayloadGenerationConfig& config,
+                            const PartitionConfig& old_part,
+                            const PartitionConfig& new_part,
+                            brillo::Blob* key);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PARTITION_CHECKPOINT_H_
@@ -0,0 +1,143 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/partition_checkpoint.h"
+
+#include <string>
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+class PartitionCheckpointsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(tempdir_.CreateUniqueTempDir());
+    // Something unrelated is stored first, so the blobs don't start at 0.
+    ASSERT_EQ(0, blob_file_.StoreBlob({9, 9, 9}));
+
+    AnnotatedOperation replace;
+    replace.name = "replace";
+    replace.op.set_type(InstallOperation::REPLACE);
+    *replace.op.add_dst_extents() = ExtentForRange(0, 1);
+    ASSERT_TRUE(replace.SetOperationBlob({'b', 'l', 'o', 'b'}, &blob_file_));
+    AnnotatedOperation copy;
+    copy.name = "copy";
+    copy.op.set_type(InstallOperation::SOURCE_COPY);
+    *copy.op.add_src_extents() = ExtentForRange(1, 1);
+    *copy.op.add_dst_extents() = ExtentForRange(2, 1);
+    data_.aops = {replace, copy};
+    data_.merge_sequence.emplace_back();
+    data_.merge_sequence[0].set_type(CowMergeOperation::COW_COPY);
+    data_.cow_size = 12345;
+    data_.zstd_dictionary = {'d', 'i', 'c', 't'};
+  }
+
+  std::string CheckpointDir() const {
+    return tempdir_.GetPath().Append("checkpoints").value();
+  }
+
+  base::ScopedTempDir tempdir_;
+  ScopedTempFile blob_fd_file_{"PartitionCheckpointsTest.XXXXXX", true};
+  off_t blob_file_size_{0};
+  BlobFileWriter blob_file_{blob_fd_file_.fd(), &blob_file_size_};
+  const brillo::Blob key_{1, 2, 3, 4};
+  PartitionCheckpointData data_;
+};
+
+TEST_F(PartitionCheckpointsTest, SaveThenLoadTest) {
+  PartitionCheckpoints checkpoints(CheckpointDir());
+  ScopedTempFile other_file("PartitionCheckpointsTest.XXXXXX", true);
+  off_t other_file_size = 0;
+  BlobFileWriter other_blob_file(other_file.fd(), &other_file_size);
+  PartitionCheckpointData data;
+  ASSERT_FALSE(checkpoints.Load(key_, &other_blob_file, &data));
+
+  ASSERT_TRUE(checkpoints.Save(key_, blob_fd_file_.fd(), data_));
+  ASSERT_TRUE(checkpoints.Load(key_, &other_blob_file, &data));
+  ASSERT_EQ(2u, data.aops.size());
+  EXPECT_EQ("replace", data.aops[0].name);
+  EXPECT_EQ("copy", data.aops[1].name);
+  EXPECT_EQ(0u, data.aops[0].op.data_offset());
+  EXPECT_EQ(data_.aops[0].op.data_sha256_hash(),
+            data.aops[0].op.data_sha256_hash());
+  EXPECT_EQ(data_.aops[1].op.SerializeAsString(),
+            data.aops[1].op.SerializeAsString());
+  ASSERT_EQ(1u, data.merge_sequence.size());
+  EXPECT_EQ(CowMergeOperation::COW_COPY, data.merge_sequence[0].type());
+  EXPECT_EQ(12345u, data.cow_size);
+  EXPECT_EQ(data_.zstd_dictionary, data.zstd_dictionary);
+
+  // The blob was stored again in the other blob file.
+  brillo::Blob blob;
+  ASSERT_TRUE(utils::ReadFile(other_file.path(), &blob));
+  EXPECT_EQ((brillo::Blob{'b', 'l', 'o', 'b'}), blob);
+
+  // Other keys still miss.
+  ASSERT_FALSE(checkpoints.Load({1, 2, 3}, &other_blob_file, &data));
+}
+
+TEST_F(PartitionCheckpointsTest, CorruptedCheckpointTest) {
+  PartitionCheckpoints checkpoints(CheckpointDir());
+  ASSERT_TRUE(checkpoints.Save(key_, blob_fd_file_.fd(), data_));
+  const std::string path = CheckpointDir() + "/" + utils::HexEncode(key_);
+  brillo::Blob checkpoint;
+  ASSERT_TRUE(utils::ReadFile(path, &checkpoint));
+
+  // Both a corrupted header and a corrupted blob are detected.
+  for (size_t offset : {size_t{20}, checkpoint.size() - 1}) {
+    brillo::Blob corrupted = checkpoint;
+    corrupted[offset] ^= 1;
+    ASSERT_TRUE(
+        utils::WriteFile(path.c_str(), corrupted.data(), corrupted.size()));
+    PartitionCheckpointData data;
+    EXPECT_FALSE(checkpoints.Load(key_, &blob_file_, &data)) << offset;
+  }
+
+  // A truncated checkpoint is ignored too.
+  ASSERT_TRUE(
+      utils::WriteFile(path.c_str(), checkpoint.data(), checkpoint.size() - 1));
+  PartitionCheckpointData data;
+  EXPECT_FALSE(checkpoints.Load(key_, &blob_file_, &data));
+}
+
+TEST(PartitionCheckpointKeyTest, SaltTest) {
+  ScopedTempFile part_file("PartitionCheckpointKeyTest.XXXXXX");
+  const brillo::Blob contents(8192, 'x');
+  ASSERT_TRUE(utils::WriteFile(
+      part_file.path().c_str(), contents.data(), contents.size()));
+  PartitionConfig old_part("system");
+  PartitionConfig new_part("system");
+  new_part.path = part_file.path();
+  new_part.size = contents.size();
+
+  PayloadGenerationConfig config;
+  config.checkpoint_salt = "--flag=1";
+  brillo::Blob key, other_key;
+  ASSERT_TRUE(PartitionCheckpointKey(config, old_part, new_part, &key));
+  ASSERT_TRUE(PartitionCheckpointKey(config, old_part, new_part, &other_key));
+  EXPECT_EQ(key, other_key);
+
+  config.checkpoint_salt = "--flag=2";
+  ASSERT_TRUE(PartitionCheckpointKey(config, old_part, new_part, &other_key));
+  EXPECT_NE(key, other_key);
+}
+
+}  // namespace chromeos_update_engine
@@ -17,21 +17,35 @@
 #include "update_engine/payload_generator/payload_file.h"
 
 #include <endian.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <deque>
 #include <map>
+#include <memory>
+#include <numeric>
+#include <set>
+#include <tuple>
 #include <utility>
 
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/stringprintf.h>
 
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/operation_index.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/file_writer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/generation_report.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/zstd.h"
 
 using std::string;
 using std::vector;
@@ -40,6 +54,17 @@ namespace chromeos_update_engine {
 
 namespace {
 
+// How many bytes of data blobs OrderDataBlobs() hashes in one go.
+constexpr size_t kHashBatchSize = 64 * 1024 * 1024;
+
+// How many bytes of data blobs CopyBlobRanges() copies in one go.
+constexpr size_t kCopyBufferSize = 4 * 1024 * 1024;
+
+// How far apart in the payload, at most, the operations sharing a blob are.
+// The client doesn't checkpoint its progress while it keeps the decoded data
+// of a shared blob, so this bounds what it downloads again when interrupted.
+constexpr uint64_t kMaxSharedBlobSpan = 64 * 1024 * 1024;
+
 struct DeltaObject {
   DeltaObject(const string& in_name, const int in_type, const off_t in_size)
       : name(in_name), type(in_type), size(in_size) {}
@@ -59,11 +84,144 @@ bool WriteUint64AsBigEndian(FileWriter* writer, const uint64_t value) {
   return true;
 }
 
+// A FileWriter hashing the bytes it passes to another writer, so the payload
+// is hashed for signing while being written.
+class HashingFileWriter : public FileWriter {
+ public:
+  HashingFileWriter(FileWriter* writer, HashCalculator* hasher)
+      : writer_(writer), hasher_(hasher) {}
+
+  bool Write(const void* bytes, size_t count) override {
+    TEST_AND_RETURN_FALSE(hasher_->Update(bytes, count));
+    bytes_written_ += count;
+    return writer_->Write(bytes, count);
+  }
+
+  // |writer_| is closed by its owner.
+  int Close() override { return 0; }
+
+  uint64_t bytes_written() const { return bytes_written_; }
+
+ private:
+  FileWriter* writer_;
+  HashCalculator* hasher_;
+  uint64_t bytes_written_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(HashingFileWriter);
+};
+
+// Copies the |*length| bytes at |*offset| in |in_fd| to the current position of
+// |out_fd| with copy_file_range(), so they don't go through user space and
+// filesystems that can share extents don't copy them at all. |*offset| and
+// |*length| are updated as bytes are copied. If the files can't be copied this
+// way, |*supported| is set to false and the rest is left to copy.
+bool CopyFileRange(int in_fd,
+                   int out_fd,
+                   uint64_t* offset,
+                   uint64_t* length,
+                   bool* supported) {
+  while (*length > 0) {
+    off64_t in_offset = *offset;
+    const ssize_t rc = HANDLE_EINTR(
+        copy_file_range(in_fd, &in_offset, out_fd, nullptr, *length, 0));
+    if (rc < 0 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                   errno == EOPNOTSUPP || errno == EBADF)) {
+      // Not an I/O error, the files just can't be copied this way.
+      *supported = false;
+      return true;
+    }
+    if (rc <= 0) {
+      PLOG(ERROR) << "Failed to copy " << *length << " bytes from offset "
+                  << *offset;
+      return false;
+    }
+    *offset += rc;
+    *length -= rc;
+  }
+  return true;
+}
+
+// Returns, for each of the |ops| with a blob, the index of the operation whose
+// blob it uses: its own, or the identical one of an earlier REPLACE operation,
+// as long as the client keeps at most kMaxSharedBlobCacheSize bytes of decoded
+// data for the operations sharing blobs. Only the operations with the same
+// |dictionaries|, which tell which zstd dictionary each one is decoded with,
+// may share a blob.
+vector<size_t> FindSharedBlobs(const vector<InstallOperation*>& ops,
+                               const vector<size_t>& dictionaries,
+                               size_t block_size) {
+  vector<size_t> owners(ops.size());
+  std::iota(owners.begin(), owners.end(), 0);
+
+  // The REPLACE operations with the same blob, in order, and where each blob
+  // would be in the payload if none was shared.
+  using BlobKey =
+      std::tuple<InstallOperation::Type, uint64_t, string, size_t>;
+  std::map<BlobKey, std::deque<size_t>> same_blobs;
+  vector<std::deque<size_t>*> groups(ops.size(), nullptr);
+  vector<uint64_t> offsets(ops.size());
+  uint64_t offset = 0;
+  for (size_t i = 0; i < ops.size(); i++) {
+    const InstallOperation& op = *ops[i];
+    offsets[i] = offset;
+    offset += op.data_length();
+    if (diff_utils::IsAReplaceOperation(op.type())) {
+      groups[i] = &same_blobs[{op.type(),
+                               op.data_length(),
+                               op.data_sha256_hash(),
+                               dictionaries[i]}];
+      groups[i]->push_back(i);
+    }
+  }
+
+  // The bytes of decoded data the client keeps, by the last operation using
+  // them.
+  std::multimap<size_t, uint64_t> cached;
+  uint64_t cached_bytes = 0;
+  for (size_t i = 0; i < ops.size(); i++) {
+    while (!cached.empty() && cached.begin()->first < i) {
+      cached_bytes -= cached.begin()->second;
+      cached.erase(cached.begin());
+    }
+    if (owners[i] != i || !groups[i])
+      continue;
+    std::deque<size_t>* group = groups[i];
+    DCHECK_EQ(group->front(), i);
+    group->pop_front();
+    size_t num_sharing = 0;
+    while (num_sharing < group->size() &&
+           offsets[(*group)[num_sharing]] - offsets[i] <= kMaxSharedBlobSpan) {
+      num_sharing++;
+    }
+    const uint64_t decoded_size =
+        utils::BlocksInExtents(ops[i]->dst_extents()) * block_size;
+    if (num_sharing == 0 ||
+        cached_bytes + decoded_size > kMaxSharedBlobCacheSize) {
+      continue;
+    }
+    size_t last = i;
+    for (size_t n = 0; n < num_sharing; n++) {
+      last = group->front();
+      owners[last] = i;
+      group->pop_front();
+    }
+    cached.emplace(last, decoded_size);
+    cached_bytes += decoded_size;
+  }
+  return owners;
+}
+
 }  // namespace
 
 bool PayloadFile::Init(const PayloadGenerationConfig& config) {
   TEST_AND_RETURN_FALSE(config.version.Validate());
   major_version_ = config.version.major;
+  annotate_apply_cost_ = config.annotate_apply_cost;
+  apply_cost_profile_ = config.apply_cost_profile;
+  operation_index_ = config.operation_index;
+  mark_unused_extents_ = config.mark_unused_extents;
+  dst_operation_hashes_ = config.dst_operation_hashes;
+  share_blobs_ = config.version.SharedBlobsAllowed();
   manifest_.set_minor_version(config.version.minor);
   manifest_.set_block_size(config.block_size);
   manifest_.set_max_timestamp(config.max_timestamp);
@@ -101,16 +259,34 @@ bool PayloadFile::AddPartition(const PartitionConfig& old_conf,
   part.cow_size = cow_size;
   part.name = new_conf.name;
   part.aops = std::move(aops);
+  if (dst_operation_hashes_)
+    TEST_AND_RETURN_FALSE(
+        diff_utils::HashOperationTargets(new_conf, &part.aops));
   part.cow_merge_sequence = std::move(merge_sequence);
   part.postinstall = new_conf.postinstall;
   part.verity = new_conf.verity;
   part.version = new_conf.version;
+  // The dictionary is only shipped if any operation was compressed against it.
+  if (new_conf.zstd_dictionary &&
+      std::any_of(part.aops.begin(), part.aops.end(), [](const auto& aop) {
+        return aop.op.type() == InstallOperation::REPLACE_ZSTD;
+      })) {
+    part.zstd_dictionary = new_conf.zstd_dictionary->data();
+  }
   // Initialize the PartitionInfo objects if present.
   if (!old_conf.path.empty())
     TEST_AND_RETURN_FALSE(
         diff_utils::InitializePartitionInfo(old_conf, &part.old_info));
   TEST_AND_RETURN_FALSE(
       diff_utils::InitializePartitionInfo(new_conf, &part.new_info));
+  if (mark_unused_extents_) {
+    TEST_AND_RETURN_FALSE(
+        diff_utils::FindUnusedExtents(new_conf, &part.unused_extents));
+    if (!part.unused_extents.empty()) {
+      TEST_AND_RETURN_FALSE(diff_utils::HashPartitionWithoutExtents(
+          new_conf, part.unused_extents, &part.new_hash_without_unused));
+    }
+  }
   part_vec_.push_back(std::move(part));
   return true;
 }
@@ -119,10 +295,10 @@ bool PayloadFile::WritePayload(const string& payload_file,
                                const string& data_blobs_path,
                                const string& private_key_path,
                                uint64_t* metadata_size_out) {
-  // Reorder the data blobs with the manifest_.
-  ScopedTempFile ordered_blobs_file("CrAU_temp_data.ordered.XXXXXX");
-  TEST_AND_RETURN_FALSE(
-      ReorderDataBlobs(data_blobs_path, ordered_blobs_file.path()));
+  // Order the data blobs with the manifest_. They are copied in that order
+  // straight from |data_blobs_path| to the payload.
+  vector<BlobRange> blob_ranges;
+  TEST_AND_RETURN_FALSE(OrderDataBlobs(data_blobs_path, &blob_ranges));
 
   // Check that install op blobs are in order.
   uint64_t next_blob_offset = 0;
@@ -130,6 +306,11 @@ bool PayloadFile::WritePayload(const string& payload_file,
     for (const auto& aop : part.aops) {
       if (!aop.op.has_data_offset())
         continue;
+      // A shared blob is already in the payload.
+      if (share_blobs_ &&
+          aop.op.data_offset() + aop.op.data_length() <= next_blob_offset) {
+        continue;
+      }
       if (aop.op.data_offset() != next_blob_offset) {
         LOG(FATAL) << "bad blob offset! " << aop.op.data_offset()
                    << " != " << next_blob_offset;
@@ -179,11 +360,29 @@ bool PayloadFile::WritePayload(const string& payload_file,
     for (const auto& merge_op : part.cow_merge_sequence) {
       *partition->add_merge_operations() = merge_op;
     }
+    if (annotate_apply_cost_) {
+      *partition->mutable_apply_cost() =
+          diff_utils::EstimateApplyCost(*partition, apply_cost_profile_);
+    }
+    if (operation_index_) {
+      TEST_AND_RETURN_FALSE(BuildOperationIndex(
+          *partition, partition->mutable_operation_index()));
+    }
 
     if (part.old_info.has_size() || part.old_info.has_hash())
       *(partition->mutable_old_partition_info()) = part.old_info;
     if (part.new_info.has_size() || part.new_info.has_hash())
       *(partition->mutable_new_partition_info()) = part.new_info;
+    if (!part.unused_extents.empty()) {
+      StoreExtents(part.unused_extents, partition->mutable_unused_extents());
+      partition->set_new_partition_hash_without_unused(
+          part.new_hash_without_unused.data(),
+          part.new_hash_without_unused.size());
+    }
+    if (!part.zstd_dictionary.empty()) {
+      partition->set_zstd_dictionary(part.zstd_dictionary.data(),
+                                     part.zstd_dictionary.size());
+    }
   }
 
   // Signatures appear at the end of the blobs. Note the offset in the
@@ -195,12 +394,15 @@ bool PayloadFile::WritePayload(const string& payload_file,
     PayloadSigner::AddSignatureToManifest(
         next_blob_offset, signature_blob_length, &manifest_);
   }
-  WritePayload(payload_file,
-               ordered_blobs_file.path(),
-               private_key_path,
-               major_version_,
-               manifest_,
-               metadata_size_out);
+  TEST_AND_RETURN_FALSE(WritePayload(
+      payload_file,
+      [&data_blobs_path, &blob_ranges](FileWriter* writer) {
+        return CopyBlobRanges(data_blobs_path, blob_ranges, writer);
+      },
+      private_key_path,
+      major_version_,
+      manifest_,
+      metadata_size_out));
 
   ReportPayloadUsage(*metadata_size_out);
   return true;
@@ -212,9 +414,31 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
                                uint64_t major_version_,
                                const DeltaArchiveManifest& manifest,
                                uint64_t* metadata_size_out) {
+  return WritePayload(
+      payload_file,
+      [&ordered_blobs_file](FileWriter* writer) {
+        const off_t size = utils::FileSize(ordered_blobs_file);
+        TEST_AND_RETURN_FALSE(size >= 0);
+        return CopyBlobRanges(ordered_blobs_file,
+                              {{0, static_cast<uint64_t>(size)}},
+                              writer);
+      },
+      private_key_path,
+      major_version_,
+      manifest,
+      metadata_size_out);
+}
+
+bool PayloadFile::WritePayload(const std::string& payload_file,
+                               const BlobWriter& write_blobs,
+                               const std::string& private_key_path,
+                               uint64_t major_version_,
+                               const DeltaArchiveManifest& manifest,
+                               uint64_t* metadata_size_out) {
   std::string serialized_manifest;
 
-  TEST_AND_RETURN_FALSE(manifest.SerializeToString(&serialized_manifest));
+  TEST_AND_RETURN_FALSE(PayloadMetadata::SerializeManifest(
+      major_version_, manifest, &serialized_manifest));
   uint64_t metadata_size =
       sizeof(kDeltaMagic) + 2 * sizeof(uint64_t) + serialized_manifest.size();
   LOG(INFO) << "Writing final delta file header...";
@@ -224,15 +448,24 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
                                           0644) == 0);
   ScopedFileWriterCloser writer_closer(&writer);
 
+  // When signing, everything but the signatures is hashed as it is written,
+  // so the payload isn't read back to be signed.
+  const bool sign = !private_key_path.empty();
+  HashCalculator payload_hasher;
+  HashingFileWriter hashing_writer(&writer, &payload_hasher);
+  FileWriter* hashed_writer =
+      sign ? static_cast<FileWriter*>(&hashing_writer) : &writer;
+
   // Write header
-  TEST_AND_RETURN_FALSE_ERRNO(writer.Write(kDeltaMagic, sizeof(kDeltaMagic)));
+  TEST_AND_RETURN_FALSE_ERRNO(
+      hashed_writer->Write(kDeltaMagic, sizeof(kDeltaMagic)));
 
   // Write major version number
-  TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(&writer, major_version_));
+  TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(hashed_writer, major_version_));
 
   // Write protobuf length
   TEST_AND_RETURN_FALSE(
-      WriteUint64AsBigEndian(&writer, serialized_manifest.size()));
+      WriteUint64AsBigEndian(hashed_writer, serialized_manifest.size()));
 
   // Metadata signature has the same size as payload signature, because they
   // are both the same kind of signature for the same kind of hash.
@@ -242,55 +475,50 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
   // endianess.
   {
     const uint32_t metadata_signature_size = htobe32(signature_blob_length);
-    TEST_AND_RETURN_FALSE_ERRNO(writer.Write(&metadata_signature_size,
-                                             sizeof(metadata_signature_size)));
+    TEST_AND_RETURN_FALSE_ERRNO(hashed_writer->Write(
+        &metadata_signature_size, sizeof(metadata_signature_size)));
     metadata_size += sizeof(metadata_signature_size);
   }
 
   // Write protobuf
   LOG(INFO) << "Writing final delta file protobuf... "
             << serialized_manifest.size();
-  TEST_AND_RETURN_FALSE_ERRNO(
-      writer.Write(serialized_manifest.data(), serialized_manifest.size()));
+  TEST_AND_RETURN_FALSE_ERRNO(hashed_writer->Write(
+      serialized_manifest.data(), serialized_manifest.size()));
 
-  // Write metadata signature blob.
-  if (!private_key_path.empty()) {
-    brillo::Blob metadata_hash;
-    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfFile(
-        payload_file, metadata_size, &metadata_hash));
+  // Write metadata signature blob. It isn't part of the payload hash.
+  if (sign) {
+    // The metadata hash is finalized from a copy of the payload hash state.
+    HashCalculator metadata_hasher;
+    TEST_AND_RETURN_FALSE(
+        metadata_hasher.SetContext(payload_hasher.GetContext()));
+    TEST_AND_RETURN_FALSE(metadata_hasher.Finalize());
     string metadata_signature;
-    TEST_AND_RETURN_FALSE(PayloadSigner::SignHashWithKeys(
-        metadata_hash, {private_key_path}, &metadata_signature));
+    {
+      GenerationReport::ScopedStage stage("signing");
+      TEST_AND_RETURN_FALSE(PayloadSigner::SignHashWithKeys(
+          metadata_hasher.raw_hash(), {private_key_path}, &metadata_signature));
+    }
     TEST_AND_RETURN_FALSE_ERRNO(
         writer.Write(metadata_signature.data(), metadata_signature.size()));
   }
 
   // Append the data blobs.
   LOG(INFO) << "Writing final delta file data blobs...";
-  int blobs_fd = open(ordered_blobs_file.c_str(), O_RDONLY, 0);
-  ScopedFdCloser blobs_fd_closer(&blobs_fd);
-  TEST_AND_RETURN_FALSE(blobs_fd >= 0);
-  for (;;) {
-    vector<char> buf(1024 * 1024);
-    ssize_t rc = read(blobs_fd, buf.data(), buf.size());
-    if (0 == rc) {
-      // EOF
-      break;
-    }
-    TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
-    TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), rc));
-  }
+  TEST_AND_RETURN_FALSE(write_blobs(hashed_writer));
   // Write payload signature blob.
-  if (!private_key_path.empty()) {
+  if (sign) {
     LOG(INFO) << "Signing the update...";
+    // The signature must directly follow the hashed blobs.
+    TEST_AND_RETURN_FALSE(hashing_writer.bytes_written() ==
+                          metadata_size + manifest.signatures_offset());
+    TEST_AND_RETURN_FALSE(payload_hasher.Finalize());
     string signature;
-    TEST_AND_RETURN_FALSE(PayloadSigner::SignPayload(
-        payload_file,
-        {private_key_path},
-        metadata_size,
-        signature_blob_length,
-        metadata_size + signature_blob_length + manifest.signatures_offset(),
-        &signature));
+    {
+      GenerationReport::ScopedStage stage("signing");
+      TEST_AND_RETURN_FALSE(PayloadSigner::SignHashWithKeys(
+          payload_hasher.raw_hash(), {private_key_path}, &signature));
+    }
     TEST_AND_RETURN_FALSE_ERRNO(
         writer.Write(signature.data(), signature.size()));
   }
@@ -302,9 +530,8 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
 
 bool PayloadFile::ReorderDataBlobs(const string& data_blobs_path,
                                    const string& new_data_blobs_path) {
-  int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
-  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
-  ScopedFdCloser in_fd_closer(&in_fd);
+  vector<BlobRange> blob_ranges;
+  TEST_AND_RETURN_FALSE(OrderDataBlobs(data_blobs_path, &blob_ranges));
 
   DirectFileWriter writer;
   int rc = writer.Open(
@@ -314,23 +541,132 @@ bool PayloadFile::ReorderDataBlobs(const string& data_blobs_path,
     return false;
   }
   ScopedFileWriterCloser writer_closer(&writer);
-  uint64_t out_file_size = 0;
+  return CopyBlobRanges(data_blobs_path, blob_ranges, &writer);
+}
+
+bool PayloadFile::OrderDataBlobs(const string& data_blobs_path,
+                                 vector<BlobRange>* blob_ranges) {
+  int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
 
-  for (auto& part : part_vec_) {
+  // Most blobs were hashed when they were stored. The others are read and
+  // hashed a batch at a time on all the cores.
+  std::unique_ptr<WorkerPool> pool;
+  vector<InstallOperation*> batch_ops;
+  vector<brillo::Blob> batch_blobs;
+  size_t batch_bytes = 0;
+  auto flush_batch = [&]() {
+    if (batch_ops.empty())
+      return true;
+    if (!pool) {
+      const size_t num_threads = diff_utils::GetMaxThreads();
+      pool = std::make_unique<WorkerPool>(num_threads, num_threads);
+    }
+    vector<brillo::Blob> hashes;
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfBlobs(batch_blobs, &hashes, pool.get()));
+    for (size_t i = 0; i < batch_ops.size(); i++) {
+      batch_ops[i]->set_data_sha256_hash(hashes[i].data(), hashes[i].size());
+    }
+    batch_ops.clear();
+    batch_blobs.clear();
+    batch_bytes = 0;
+    return true;
+  };
+
+  vector<InstallOperation*> ops;
+  // 0 for the operations decoded without a zstd dictionary, otherwise one
+  // more than the index of the partition whose dictionary they use.
+  vector<size_t> dictionaries;
+  for (size_t p = 0; p < part_vec_.size(); p++) {
+    Partition& part = part_vec_[p];
     for (AnnotatedOperation& aop : part.aops) {
       if (!aop.op.has_data_offset())
         continue;
       CHECK(aop.op.has_data_length());
-      brillo::Blob buf(aop.op.data_length());
-      ssize_t rc = pread(in_fd, buf.data(), buf.size(), aop.op.data_offset());
-      TEST_AND_RETURN_FALSE(rc == static_cast<ssize_t>(buf.size()));
+      ops.push_back(&aop.op);
+      dictionaries.push_back(
+          aop.op.type() == InstallOperation::REPLACE_ZSTD &&
+                  !part.zstd_dictionary.empty()
+              ? p + 1
+              : 0);
+      if (!aop.op.has_data_sha256_hash()) {
+        brillo::Blob buf(aop.op.data_length());
+        ssize_t rc = pread(in_fd, buf.data(), buf.size(), aop.op.data_offset());
+        TEST_AND_RETURN_FALSE(rc == static_cast<ssize_t>(buf.size()));
+
+        batch_bytes += buf.size();
+        batch_ops.push_back(&aop.op);
+        batch_blobs.push_back(std::move(buf));
+        if (batch_bytes >= kHashBatchSize) {
+          TEST_AND_RETURN_FALSE(flush_batch());
+        }
+      }
+    }
+  }
+  TEST_AND_RETURN_FALSE(flush_batch());
+
+  // The blobs are shared by their hash, so only once all of them are hashed.
+  const vector<size_t> owners =
+      share_blobs_ ? FindSharedBlobs(ops, dictionaries, manifest_.block_size())
+                   : vector<size_t>();
+  blob_ranges->clear();
+  uint64_t out_file_size = 0;
+  for (size_t i = 0; i < ops.size(); i++) {
+    InstallOperation* op = ops[i];
+    if (!owners.empty() && owners[i] != i) {
+      // The owner of the blob comes first, so it already has its offset in the
+      // payload.
+      op->set_data_offset(ops[owners[i]]->data_offset());
+      continue;
+    }
+    blob_ranges->push_back({op->data_offset(), op->data_length()});
+    op->set_data_offset(out_file_size);
+    out_file_size += op->data_length();
+  }
+  return true;
+}
 
-      // Add the hash of the data blobs for this operation
-      TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, buf));
+bool PayloadFile::CopyBlobRanges(const string& data_blobs_path,
+                                 const vector<BlobRange>& blob_ranges,
+                                 FileWriter* writer) {
+  int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
 
-      aop.op.set_data_offset(out_file_size);
-      TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), buf.size()));
-      out_file_size += buf.size();
+  // Unless the blobs have to be hashed on the way, the kernel copies them.
+  auto direct_writer = dynamic_cast<DirectFileWriter*>(writer);
+  bool copy_file_range_supported = direct_writer != nullptr;
+  brillo::Blob buf;
+  for (size_t i = 0; i < blob_ranges.size();) {
+    // Blobs that follow each other in the file are copied in one go, so when
+    // they were stored in order this is a plain sequential copy.
+    uint64_t offset = blob_ranges[i].offset;
+    uint64_t length = blob_ranges[i].length;
+    for (i++; i < blob_ranges.size() &&
+              blob_ranges[i].offset == offset + length;
+         i++) {
+      length += blob_ranges[i].length;
+    }
+    if (copy_file_range_supported) {
+      TEST_AND_RETURN_FALSE(CopyFileRange(in_fd,
+                                          direct_writer->fd(),
+                                          &offset,
+                                          &length,
+                                          &copy_file_range_supported));
+    }
+    if (length > 0 && buf.empty())
+      buf.resize(kCopyBufferSize);
+    while (length > 0) {
+      const size_t count = std::min<uint64_t>(length, buf.size());
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(
+          utils::PReadAll(in_fd, buf.data(), count, offset, &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(count));
+      TEST_AND_RETURN_FALSE_ERRNO(writer->Write(buf.data(), count));
+      offset += count;
+      length -= count;
     }
   }
   return true;
@@ -348,14 +684,20 @@ void PayloadFile::ReportPayloadUsage(uint64_t metadata_size) const {
   std::map<DeltaObject, int> object_counts;
   off_t total_size = 0;
   int total_op = 0;
+  // A shared blob is only once in the payload.
+  std::set<uint64_t> blob_offsets;
 
   for (const auto& part : part_vec_) {
     string part_prefix = "<" + part.name + ">:";
     for (const AnnotatedOperation& aop : part.aops) {
-      DeltaObject delta(
-          part_prefix + aop.name, aop.op.type(), aop.op.data_length());
+      const uint64_t size =
+          aop.op.data_length() > 0 &&
+                  !blob_offsets.insert(aop.op.data_offset()).second
+              ? 0
+              : aop.op.data_length();
+      DeltaObject delta(part_prefix + aop.name, aop.op.type(), size);
       object_counts[delta]++;
-      total_size += aop.op.data_length();
+      total_size += size;
     }
     total_op += part.aops.size();
   }
@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_FILE_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_FILE_H_
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -29,6 +30,8 @@
 
 namespace chromeos_update_engine {
 
+class FileWriter;
+
 // Class to handle the creation of a payload file. This class is the only one
 // dealing with writing the payload and its format, but has no logic about what
 // should be on it.
@@ -64,7 +67,27 @@ class PayloadFile {
                            uint64_t* out_metadata_size);
 
  private:
+  FRIEND_TEST(PayloadFileTest, CopyBlobRangesAfterHeaderTest);
   FRIEND_TEST(PayloadFileTest, ReorderBlobsTest);
+  FRIEND_TEST(PayloadFileTest, OrderDataBlobsKeepsStoredHashesTest);
+  FRIEND_TEST(PayloadFileTest, OrderDataBlobsSharesBlobsTest);
+
+  // A blob in the data blobs file.
+  struct BlobRange {
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  // Writes the data blobs of the payload, in order, to the passed writer.
+  using BlobWriter = std::function<bool(FileWriter*)>;
+
+  // Same as the above, but the data blobs are written by |write_blobs|.
+  static bool WritePayload(const std::string& payload_file,
+                           const BlobWriter& write_blobs,
+                           const std::string& private_key_path,
+                           uint64_t major_version_,
+                           const DeltaArchiveManifest& manifest,
+                           uint64_t* out_metadata_size);
 
   // Computes a SHA256 hash of the given buf and sets the hash value in the
   // operation so that update_engine could verify. This hash should be set
@@ -84,12 +107,45 @@ class PayloadFile {
   bool ReorderDataBlobs(const std::string& data_blobs_path,
                         const std::string& new_data_blobs_path);
 
+  // Sets the data_offset of the install operations to the offset of their
+  // blob in the payload, where they are in the order of the operations, and
+  // the data_sha256_hash of those that don't have one yet. The blob of each
+  // operation in |data_blobs_path| is stored in |blob_ranges|, in order. With
+  // |share_blobs_|, a REPLACE operation may get the data_offset of an earlier
+  // one with the same blob instead, which isn't stored again.
+  bool OrderDataBlobs(const std::string& data_blobs_path,
+                      std::vector<BlobRange>* blob_ranges);
+
+  // Copies the |blob_ranges| of |data_blobs_path| to |writer|, in order. If
+  // |writer| is a DirectFileWriter, they are copied with copy_file_range()
+  // where the files support it.
+  static bool CopyBlobRanges(const std::string& data_blobs_path,
+                             const std::vector<BlobRange>& blob_ranges,
+                             FileWriter* writer);
+
   // Print in stderr the Payload usage report.
   void ReportPayloadUsage(uint64_t metadata_size) const;
 
   // The major_version of the requested payload.
   uint64_t major_version_;
 
+  // Whether the partitions get their PartitionApplyCost, estimated for the
+  // devices of |apply_cost_profile_|.
+  bool annotate_apply_cost_{false};
+  ApplyCostProfile apply_cost_profile_;
+
+  // Whether the partitions get their operation index.
+  bool operation_index_{false};
+
+  // Whether the partitions get their unused extents.
+  bool mark_unused_extents_{false};
+
+  // Whether the operations get the hash of the data they write.
+  bool dst_operation_hashes_{false};
+
+  // Whether REPLACE operations with identical blobs share one.
+  bool share_blobs_{false};
+
   DeltaArchiveManifest manifest_;
 
   // Struct has necessary information to write PartitionUpdate in protobuf.
@@ -103,6 +159,11 @@ class PayloadFile {
 
     PartitionInfo old_info;
     PartitionInfo new_info;
+    // The unused blocks of the new partition and its hash without them.
+    std::vector<Extent> unused_extents;
+    brillo::Blob new_hash_without_unused;
+    // The zstd dictionary of the REPLACE_ZSTD operations, if any.
+    brillo::Blob zstd_dictionary;
 
     PostInstallConfig postinstall;
     VerityConfig verity;
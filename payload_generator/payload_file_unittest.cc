@@ -16,13 +16,19 @@
 
 #include "update_engine/payload_generator/payload_file.h"
 
+#include <fcntl.h>
+
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <gtest/gtest.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
+#include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 
 using std::string;
@@ -35,6 +41,25 @@ class PayloadFileTest : public ::testing::Test {
   PayloadFile payload_;
 };
 
+TEST_F(PayloadFileTest, CopyBlobRangesAfterHeaderTest) {
+  ScopedTempFile blobs("CopyBlobRangesTest.blobs.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(blobs.path(), "kernel abcd"));
+  ScopedTempFile out("CopyBlobRangesTest.out.XXXXXX");
+
+  // The blobs follow what was already written, whichever way they are copied.
+  DirectFileWriter writer;
+  ASSERT_EQ(0, writer.Open(out.path().c_str(), O_WRONLY | O_TRUNC, 0644));
+  ASSERT_TRUE(writer.Write("header ", 7));
+  ASSERT_TRUE(PayloadFile::CopyBlobRanges(
+      blobs.path(), {{8, 3}, {7, 1}, {0, 6}}, &writer));
+  ASSERT_TRUE(writer.Write(" end", 4));
+  ASSERT_EQ(0, writer.Close());
+
+  string data;
+  EXPECT_TRUE(utils::ReadFile(out.path(), &data));
+  EXPECT_EQ("header bcdakernel end", data);
+}
+
 TEST_F(PayloadFileTest, ReorderBlobsTest) {
   ScopedTempFile orig_blobs("ReorderBlobsTest.orig.XXXXXX");
 
@@ -84,4 +109,104 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   EXPECT_EQ(6U, part1_aops[0].op.data_length());
 }
 
+TEST_F(PayloadFileTest, OrderDataBlobsKeepsStoredHashesTest) {
+  ScopedTempFile orig_blobs("OrderDataBlobsTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "abcdef"));
+
+  payload_.part_vec_.resize(1);
+  AnnotatedOperation aop;
+  // Already hashed when it was stored.
+  aop.op.set_data_offset(3);
+  aop.op.set_data_length(3);
+  aop.op.set_data_sha256_hash("stored");
+  payload_.part_vec_[0].aops.push_back(aop);
+
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(3);
+  aop.op.clear_data_sha256_hash();
+  payload_.part_vec_[0].aops.push_back(aop);
+
+  vector<PayloadFile::BlobRange> blob_ranges;
+  ASSERT_TRUE(payload_.OrderDataBlobs(orig_blobs.path(), &blob_ranges));
+  ASSERT_EQ(2U, blob_ranges.size());
+  EXPECT_EQ(3U, blob_ranges[0].offset);
+  EXPECT_EQ(0U, blob_ranges[1].offset);
+
+  const vector<AnnotatedOperation>& aops = payload_.part_vec_[0].aops;
+  EXPECT_EQ("stored", aops[0].op.data_sha256_hash());
+  EXPECT_EQ(0U, aops[0].op.data_offset());
+  brillo::Blob expected_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData({'a', 'b', 'c'}, &expected_hash));
+  EXPECT_EQ(ToStringView(expected_hash), aops[1].op.data_sha256_hash());
+  EXPECT_EQ(3U, aops[1].op.data_offset());
+}
+
+TEST_F(PayloadFileTest, OrderDataBlobsSharesBlobsTest) {
+  ScopedTempFile orig_blobs("OrderDataBlobsTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "abcabcxyz"));
+  payload_.share_blobs_ = true;
+  payload_.manifest_.set_block_size(4096);
+
+  payload_.part_vec_.resize(2);
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  *aop.op.add_dst_extents() = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(3);
+  payload_.part_vec_[0].aops.push_back(aop);
+
+  // The same blob in another partition, after a different one.
+  aop.op.set_data_offset(6);
+  payload_.part_vec_[1].aops.push_back(aop);
+  aop.op.set_data_offset(3);
+  payload_.part_vec_[1].aops.push_back(aop);
+
+  vector<PayloadFile::BlobRange> blob_ranges;
+  ASSERT_TRUE(payload_.OrderDataBlobs(orig_blobs.path(), &blob_ranges));
+  ASSERT_EQ(2U, blob_ranges.size());
+  EXPECT_EQ(0U, blob_ranges[0].offset);
+  EXPECT_EQ(6U, blob_ranges[1].offset);
+
+  EXPECT_EQ(0U, payload_.part_vec_[0].aops[0].op.data_offset());
+  EXPECT_EQ(3U, payload_.part_vec_[1].aops[0].op.data_offset());
+  EXPECT_EQ(0U, payload_.part_vec_[1].aops[1].op.data_offset());
+}
+
+TEST_F(PayloadFileTest, CompressedManifestTest) {
+  ScopedTempFile blobs("CompressedManifestTest.blobs.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(blobs.path(), "blob"));
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(4096);
+  manifest.set_minor_version(kFullPayloadMinorVersion);
+  PartitionUpdate* partition = manifest.add_partitions();
+  partition->set_partition_name("system");
+  for (uint64_t i = 0; i < 100; i++) {
+    InstallOperation* op = partition->add_operations();
+    op->set_type(InstallOperation::REPLACE);
+    *op->add_dst_extents() = ExtentForRange(i, 1);
+  }
+
+  uint64_t metadata_sizes[2];
+  const uint64_t versions[] = {kBrilloMajorPayloadVersion,
+                               kCompressedManifestMajorPayloadVersion};
+  for (size_t i = 0; i < 2; i++) {
+    ScopedTempFile payload("CompressedManifestTest.payload.XXXXXX");
+    ASSERT_TRUE(PayloadFile::WritePayload(payload.path(),
+                                          blobs.path(),
+                                          "",
+                                          versions[i],
+                                          manifest,
+                                          &metadata_sizes[i]));
+    PayloadMetadata payload_metadata;
+    DeltaArchiveManifest parsed_manifest;
+    ASSERT_TRUE(payload_metadata.ParsePayloadFile(
+        payload.path(), &parsed_manifest, nullptr));
+    EXPECT_EQ(versions[i], payload_metadata.GetMajorVersion());
+    EXPECT_EQ(metadata_sizes[i], payload_metadata.GetMetadataSize());
+    EXPECT_EQ(manifest.SerializeAsString(),
+              parsed_manifest.SerializeAsString());
+  }
+  EXPECT_LT(metadata_sizes[1], metadata_sizes[0]);
+}
+
 }  // namespace chromeos_update_engine
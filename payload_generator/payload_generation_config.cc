@@ -31,10 +31,12 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_generator/boot_img_filesystem.h"
+#include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/erofs_filesystem.h"
 #include "update_engine/payload_generator/ext2_filesystem.h"
+#include "update_engine/payload_generator/generation_report.h"
 #include "update_engine/payload_generator/mapfile_filesystem.h"
 #include "update_engine/payload_generator/raw_filesystem.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
@@ -64,10 +66,23 @@ bool PartitionConfig::ValidateExists() const {
   return true;
 }
 
-bool PartitionConfig::OpenFilesystem() {
+bool PartitionConfig::MapImage() {
+  if (path.empty() || size == 0)
+    return true;
+  image = std::make_unique<MappedImage>();
+  if (!image->Open(path, size)) {
+    image.reset();
+    return false;
+  }
+  return true;
+}
+
+bool PartitionConfig::OpenFilesystem(const std::string& index_cache_dir) {
   if (path.empty())
     return true;
+  GenerationReport::ScopedStage stage("filesystem_walk");
   fs_interface.reset();
+  files_cache = std::make_shared<PartitionFilesCache>();
   if (diff_utils::IsExtFilesystem(path)) {
     fs_interface = Ext2Filesystem::CreateFromFile(path);
     // TODO(deymo): The delta generator algorithm doesn't support a block size
@@ -77,7 +92,8 @@ bool PartitionConfig::OpenFilesystem() {
       return true;
     }
   }
-  fs_interface = ErofsFilesystem::CreateFromFile(path, erofs_compression_param);
+  fs_interface = ErofsFilesystem::CreateFromFile(
+      path, erofs_compression_param, index_cache_dir);
   if (fs_interface) {
     TEST_AND_RETURN_FALSE(fs_interface->GetBlockSize() == kBlockSize);
     return true;
@@ -248,7 +264,8 @@ PayloadVersion::PayloadVersion(uint64_t major_version, uint32_t minor_version) {
 }
 
 bool PayloadVersion::Validate() const {
-  TEST_AND_RETURN_FALSE(major == kBrilloMajorPayloadVersion);
+  TEST_AND_RETURN_FALSE(major == kBrilloMajorPayloadVersion ||
+                        major == kCompressedManifestMajorPayloadVersion);
   TEST_AND_RETURN_FALSE(minor == kFullPayloadMinorVersion ||
                         minor == kSourceMinorPayloadVersion ||
                         minor == kOpSrcHashMinorPayloadVersion ||
@@ -257,7 +274,10 @@ bool PayloadVersion::Validate() const {
                         minor == kVerityMinorPayloadVersion ||
                         minor == kPartialUpdateMinorPayloadVersion ||
                         minor == kZucchiniMinorPayloadVersion ||
-                        minor == kLZ4DIFFMinorPayloadVersion);
+                        minor == kLZ4DIFFMinorPayloadVersion ||
+                        minor == kZstdMinorPayloadVersion ||
+                        minor == kSharedBlobMinorPayloadVersion ||
+                        minor == kZstdDictionaryMinorPayloadVersion);
   return true;
 }
 
@@ -295,6 +315,10 @@ bool PayloadVersion::OperationAllowed(InstallOperation::Type operation) const {
     case InstallOperation::LZ4DIFF_PUFFDIFF:
       return minor >= kLZ4DIFFMinorPayloadVersion;
 
+    case InstallOperation::REPLACE_ZSTD:
+      return enable_zstd && (minor == kFullPayloadMinorVersion ||
+                             minor >= kZstdMinorPayloadVersion);
+
     case InstallOperation::MOVE:
     case InstallOperation::BSDIFF:
       NOTREACHED();
@@ -302,10 +326,130 @@ bool PayloadVersion::OperationAllowed(InstallOperation::Type operation) const {
   return false;
 }
 
+bool PayloadVersion::SharedBlobsAllowed() const {
+  return share_blobs && (minor == kFullPayloadMinorVersion ||
+                         minor >= kSharedBlobMinorPayloadVersion);
+}
+
+bool PayloadVersion::ZstdDictionariesAllowed() const {
+  return zstd_dictionaries &&
+         OperationAllowed(InstallOperation::REPLACE_ZSTD) &&
+         (minor == kFullPayloadMinorVersion ||
+          minor >= kZstdDictionaryMinorPayloadVersion);
+}
+
 bool PayloadVersion::IsDeltaOrPartial() const {
   return minor != kFullPayloadMinorVersion;
 }
 
+ApplyCostProfile::ApplyCostProfile()
+    : download_bytes_per_second(10.0 * 1024 * 1024),
+      hash_tree_bytes_per_second(100.0 * 1024 * 1024),
+      fec_bytes_per_second(20.0 * 1024 * 1024) {
+  constexpr double kWriteBytesPerSecond = 200.0 * 1024 * 1024;
+  constexpr double kDecompressBytesPerSecond = 40.0 * 1024 * 1024;
+  constexpr double kZstdDecompressBytesPerSecond = 400.0 * 1024 * 1024;
+  constexpr double kDiffBytesPerSecond = 10.0 * 1024 * 1024;
+  for (const auto type : {InstallOperation::REPLACE,
+                          InstallOperation::SOURCE_COPY}) {
+    apply_bytes_per_second[type] = kWriteBytesPerSecond;
+  }
+  for (const auto type : {InstallOperation::REPLACE_BZ,
+                          InstallOperation::REPLACE_XZ}) {
+    apply_bytes_per_second[type] = kDecompressBytesPerSecond;
+  }
+  apply_bytes_per_second[InstallOperation::REPLACE_ZSTD] =
+      kZstdDecompressBytesPerSecond;
+  for (const auto type : {InstallOperation::SOURCE_BSDIFF,
+                          InstallOperation::BROTLI_BSDIFF,
+                          InstallOperation::PUFFDIFF,
+                          InstallOperation::ZUCCHINI,
+                          InstallOperation::LZ4DIFF_BSDIFF,
+                          InstallOperation::LZ4DIFF_PUFFDIFF}) {
+    apply_bytes_per_second[type] = kDiffBytesPerSecond;
+  }
+}
+
+bool ApplyCostProfile::Load(const brillo::KeyValueStore& store) {
+  for (const string& key : store.GetKeys()) {
+    string value;
+    double bytes_per_second;
+    if (!store.GetString(key, &value) ||
+        !base::StringToDouble(value, &bytes_per_second) ||
+        !(bytes_per_second > 0)) {
+      LOG(ERROR) << "Invalid throughput " << key << "=" << value;
+      return false;
+    }
+    InstallOperation::Type type;
+    if (key == "DOWNLOAD") {
+      download_bytes_per_second = bytes_per_second;
+    } else if (key == "HASH_TREE") {
+      hash_tree_bytes_per_second = bytes_per_second;
+    } else if (key == "FEC") {
+      fec_bytes_per_second = bytes_per_second;
+    } else if (InstallOperation::Type_Parse(key, &type) &&
+               type != InstallOperation::ZERO &&
+               type != InstallOperation::DISCARD) {
+      apply_bytes_per_second[type] = bytes_per_second;
+    } else {
+      LOG(ERROR) << "Unknown throughput " << key;
+      return false;
+    }
+  }
+  return true;
+}
+
+double ApplyCostProfile::DownloadSeconds(uint64_t blob_bytes) const {
+  return blob_bytes / download_bytes_per_second;
+}
+
+double ApplyCostProfile::ApplySeconds(InstallOperation::Type type,
+                                      uint64_t dst_bytes) const {
+  // ZERO and DISCARD don't write any data.
+  const auto it = apply_bytes_per_second.find(type);
+  return it == apply_bytes_per_second.end() ? 0 : dst_bytes / it->second;
+}
+
+double ApplyCostProfile::HashTreeSeconds(uint64_t data_bytes) const {
+  return data_bytes / hash_tree_bytes_per_second;
+}
+
+double ApplyCostProfile::FecSeconds(uint64_t data_bytes) const {
+  return data_bytes / fec_bytes_per_second;
+}
+
+void PayloadGenerationConfig::ChooseVerityComputation() {
+  // The verity data looks random, so shipping it costs at most a REPLACE of
+  // the same size, less for the blocks unchanged from the source partition.
+  const auto ship_seconds = [this](const Extent& extent) {
+    const uint64_t bytes = extent.num_blocks() * block_size;
+    return apply_cost_profile.DownloadSeconds(bytes) +
+           apply_cost_profile.ApplySeconds(InstallOperation::REPLACE, bytes);
+  };
+  for (PartitionConfig& part : target.partitions) {
+    VerityConfig& verity = part.verity;
+    if (verity.hash_tree_extent.num_blocks() != 0 &&
+        ship_seconds(verity.hash_tree_extent) <
+            apply_cost_profile.HashTreeSeconds(
+                verity.hash_tree_data_extent.num_blocks() * block_size)) {
+      LOG(INFO) << "Shipping the hash tree of " << part.name;
+      verity.hash_tree_data_extent = Extent();
+      verity.hash_tree_extent = Extent();
+      verity.hash_tree_algorithm.clear();
+      verity.hash_tree_salt.clear();
+    }
+    if (verity.fec_extent.num_blocks() != 0 &&
+        ship_seconds(verity.fec_extent) <
+            apply_cost_profile.FecSeconds(verity.fec_data_extent.num_blocks() *
+                                          block_size)) {
+      LOG(INFO) << "Shipping the FEC data of " << part.name;
+      verity.fec_data_extent = Extent();
+      verity.fec_extent = Extent();
+      verity.fec_roots = 0;
+    }
+  }
+}
+
 bool PayloadGenerationConfig::Validate() const {
   TEST_AND_RETURN_FALSE(version.Validate());
   TEST_AND_RETURN_FALSE(version.IsDeltaOrPartial() ==
@@ -338,9 +482,14 @@ bool PayloadGenerationConfig::Validate() const {
     TEST_AND_RETURN_FALSE(!is_partial_update);
   }
 
+  TEST_AND_RETURN_FALSE(diff_shard_index < diff_shard_count);
+  TEST_AND_RETURN_FALSE(diff_shard_count == 1 || !diff_cache_dir.empty());
+
   TEST_AND_RETURN_FALSE(hard_chunk_size == -1 ||
                         hard_chunk_size % block_size == 0);
   TEST_AND_RETURN_FALSE(soft_chunk_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(file_segment_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(max_segment_size_ratio >= 1.0);
 
   TEST_AND_RETURN_FALSE(rootfs_partition_size % block_size == 0);
 
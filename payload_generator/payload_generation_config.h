@@ -19,6 +19,7 @@
 
 #include <cstddef>
 
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -29,10 +30,15 @@
 #include "bsdiff/constants.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/mapped_image.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
 
+class BasePayload;
+struct PartitionFilesCache;
+class ZstdDictionary;
+
 struct PostInstallConfig {
   // Whether the postinstall config is empty.
   bool IsEmpty() const;
@@ -96,8 +102,13 @@ struct PartitionConfig {
   bool ValidateExists() const;
 
   // Open then filesystem stored in this partition and stores it in
-  // |fs_interface|. Returns whether opening the filesystem worked.
-  bool OpenFilesystem();
+  // |fs_interface|. Returns whether opening the filesystem worked. The files
+  // of EROFS images are cached in |index_cache_dir| if it isn't empty.
+  bool OpenFilesystem(const std::string& index_cache_dir = "");
+
+  // Maps the image at |path| in |image|, so the diff algorithms read its
+  // blocks without copying them.
+  bool MapImage();
 
   // The path to the partition file. This can be a regular file or a block
   // device such as a loop device.
@@ -108,6 +119,11 @@ struct PartitionConfig {
   // filesystem and describes the blocks used by each file.
   std::string mapfile_path;
 
+  // The path to a list of the blocks of |path| read early during boot, one
+  // block or FIRST-LAST range of blocks per line, if any. Their COW operations
+  // are merged first, see MergeSequenceGenerator::Generate().
+  std::string hot_blocks_path;
+
   // The size of the data in |path|. If rootfs verification is used (verity)
   // this value should match the size of the verity device for the rootfs, and
   // the size of the whole kernel. This value could be smaller than the
@@ -117,8 +133,22 @@ struct PartitionConfig {
   uint64_t size = 0;
 
   // The FilesystemInterface implementation used to access this partition's
-  // files.
-  std::unique_ptr<FilesystemInterface> fs_interface;
+  // files. Copies of this config share it, as well as |image| and
+  // |files_cache|, so that several payloads can be generated from the same
+  // partition at once, opening and walking it only once.
+  std::shared_ptr<FilesystemInterface> fs_interface;
+
+  // The image mapped in memory by MapImage(), if that was called. Otherwise
+  // the blocks are read from |path|.
+  std::shared_ptr<MappedImage> image;
+
+  // The files of |fs_interface| as preprocessed for the diffs, set by
+  // OpenFilesystem(). See deflate_utils::GetPartitionFiles().
+  std::shared_ptr<PartitionFilesCache> files_cache;
+
+  // The zstd dictionary trained on this partition, which its REPLACE_ZSTD
+  // blobs are compressed against, if any.
+  std::shared_ptr<const ZstdDictionary> zstd_dictionary;
 
   std::string name;
 
@@ -167,7 +197,7 @@ struct ImageConfig {
   std::vector<PartitionConfig> partitions;
 
   // The super partition metadata.
-  std::unique_ptr<DynamicPartitionMetadata> dynamic_partition_metadata;
+  std::shared_ptr<DynamicPartitionMetadata> dynamic_partition_metadata;
 };
 
 struct PayloadVersion {
@@ -180,6 +210,13 @@ struct PayloadVersion {
   // Return whether the passed |operation| is allowed by this payload.
   bool OperationAllowed(InstallOperation::Type operation) const;
 
+  // Whether REPLACE operations with identical blobs may share one.
+  bool SharedBlobsAllowed() const;
+
+  // Whether the REPLACE_ZSTD operations of each partition may be compressed
+  // against a zstd dictionary trained on it.
+  bool ZstdDictionariesAllowed() const;
+
   // Whether this payload version is a delta or partial payload.
   bool IsDeltaOrPartial() const;
 
@@ -188,6 +225,51 @@ struct PayloadVersion {
 
   // The minor version of the payload.
   uint32_t minor;
+
+  // Whether REPLACE_ZSTD operations may be used. Full payloads have no minor
+  // version telling whether the client supports them, so they are only
+  // generated when requested.
+  bool enable_zstd{false};
+
+  // Whether REPLACE operations with identical blobs should share one, which
+  // the client keeps the decoded data of. Like |enable_zstd|, only done when
+  // requested.
+  bool share_blobs{false};
+
+  // Whether to train a zstd dictionary for each partition, shipped in the
+  // manifest. Like |enable_zstd|, only done when requested.
+  bool zstd_dictionaries{false};
+};
+
+// The estimated throughputs of the devices installing a payload, used to weigh
+// the size of the operation blobs against the time the operations take to
+// apply. Only their ratios matter. The defaults are rough figures for a
+// low-end device.
+struct ApplyCostProfile {
+  ApplyCostProfile();
+
+  // Overrides the throughputs with the ones in |store|, in bytes per second:
+  // DOWNLOAD for the blobs, the name of an operation type, for example
+  // PUFFDIFF, for the data it writes, and HASH_TREE and FEC for the data the
+  // verity hash tree and FEC data are computed from. These are the
+  // bytes_per_second reported by update_engine_benchmarks on the device.
+  bool Load(const brillo::KeyValueStore& store);
+
+  // The estimated seconds to download a blob of |blob_bytes|.
+  double DownloadSeconds(uint64_t blob_bytes) const;
+
+  // The estimated seconds to apply a |type| operation writing |dst_bytes|.
+  double ApplySeconds(InstallOperation::Type type, uint64_t dst_bytes) const;
+
+  // The estimated seconds to compute the hash tree or the FEC data of
+  // |data_bytes| on the device.
+  double HashTreeSeconds(uint64_t data_bytes) const;
+  double FecSeconds(uint64_t data_bytes) const;
+
+  double download_bytes_per_second;
+  std::map<InstallOperation::Type, double> apply_bytes_per_second;
+  double hash_tree_bytes_per_second;
+  double fec_bytes_per_second;
 };
 
 // The PayloadGenerationConfig struct encapsulates all the configuration to
@@ -200,6 +282,13 @@ struct PayloadGenerationConfig {
 
   void ParseCompressorTypes(const std::string& compressor_types);
 
+  // Picks, for the hash tree and the FEC data of each target partition, the
+  // fastest option on the devices of |apply_cost_profile|: computing it on
+  // the device, or shipping it in the payload like the rest of the partition.
+  // The verity config of the data to ship is cleared, so that its blocks get
+  // operations. Must run after ImageConfig::LoadVerityConfig().
+  void ChooseVerityComputation();
+
   // Image information about the new image that's the target of this payload.
   ImageConfig target;
 
@@ -237,6 +326,13 @@ struct PayloadGenerationConfig {
   // chunks.
   size_t soft_chunk_size = 2 * 1024 * 1024;
 
+  // Files are diffed in parallel segments of |file_segment_size| bytes when
+  // diffing two segments separately takes at most |max_segment_size_ratio|
+  // times the payload size of diffing them together. Only done for files of
+  // at least three segments, and a size of 0 disables it.
+  size_t file_segment_size = 0;
+  double max_segment_size_ratio = 1.1;
+
   // TODO(deymo): Remove the block_size member and maybe replace it with a
   // minimum alignment size for blocks (if needed). Algorithms should be able to
   // pick the block_size they want, but for now only 4 KiB is supported.
@@ -253,12 +349,82 @@ struct PayloadGenerationConfig {
   // Whether to enable VABC xor op
   bool enable_vabc_xor = false;
 
+  // When larger than one, estimate the COW size by compressing only one in
+  // this many of the blocks written as raw data.
+  size_t cow_estimate_sample_interval = 1;
+
   // Whether to enable LZ4diff ops
   bool enable_lz4diff = false;
 
   // Whether to enable zucchini ops
   bool enable_zucchini = true;
 
+  // If not empty, a directory caching the diffs between identical old and new
+  // data across runs. See DiffCache.
+  std::string diff_cache_dir;
+
+  // With more than one shard, only the diffs missing from |diff_cache_dir|
+  // whose key falls in the shard |diff_shard_index| are run, the others keep
+  // the full operation. Runs on several machines sharing the cache directory,
+  // one per shard, split the diffs between them, and a last run without
+  // shards then finds all its diffs in the cache.
+  uint32_t diff_shard_index = 0;
+  uint32_t diff_shard_count = 1;
+
+  // If not empty, a directory where the operations generated for each
+  // partition are saved, so that generating the same payload again, for
+  // example after a crash, skips the partitions already done. See
+  // PartitionCheckpoints.
+  std::string checkpoint_dir;
+  // Everything the operations depend on besides the partition contents,
+  // usually the command line, for the checkpoint keys.
+  std::string checkpoint_salt;
+
+  // If not null, a previous payload whose operations are reused for the data
+  // they still produce. See BasePayload.
+  std::shared_ptr<const BasePayload> base_payload;
+
+  // When not zero, full operations only try the codec that was the best for
+  // the last |replace_codec_streak| chunks of the same kind of data. Faster,
+  // but the payload may differ between runs. See ReplaceCodecPredictor.
+  size_t replace_codec_streak = 0;
+
+  // Whether full operations split the partitions in chunks ending where their
+  // content says instead of every chunk size, so that the unchanged data of
+  // consecutive builds compresses to the same blobs even after data before it
+  // grew or shrank. The chunks are at most the usual chunk size.
+  bool content_defined_chunks = false;
+
+  // Whether the operations of each partition are ordered so that the download
+  // of the blobs of some overlaps the apply of the others, instead of by
+  // destination. See diff_utils::OrderOperationsByApplyCost().
+  bool order_operations_by_apply_cost = false;
+
+  // Whether each partition in the manifest gets the estimated cost of
+  // applying it. See diff_utils::EstimateApplyCost().
+  bool annotate_apply_cost = false;
+
+  // Whether diff operations are picked by their estimated download and apply
+  // time on the devices of |apply_cost_profile|, instead of by size.
+  bool minimize_apply_time = false;
+
+  // The devices the operations are ordered, annotated and picked for.
+  ApplyCostProfile apply_cost_profile;
+
+  // Whether each partition in the manifest gets a packed index of its
+  // operations. See common/operation_index.h.
+  bool operation_index = false;
+
+  // Whether each operation in the manifest gets the hash of the data it
+  // writes, so that a device retrying the payload skips the operations whose
+  // target blocks are already written. See InstallOperation.dst_sha256_hash.
+  bool dst_operation_hashes = false;
+
+  // Whether the zeroed blocks past the end of the filesystem of each new
+  // partition are marked as unused in the manifest, so that the device can
+  // skip them. See diff_utils::FindUnusedExtents().
+  bool mark_unused_extents = false;
+
   std::vector<bsdiff::CompressorType> compressors{
       bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli};
 
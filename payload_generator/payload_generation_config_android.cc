@@ -26,6 +26,7 @@
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/verity_writer_android.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 
 namespace chromeos_update_engine {
@@ -122,7 +123,8 @@ bool VerifyVerityConfig(const PartitionConfig& part) {
         part.verity.fec_extent.num_blocks() * block_size,
         part.verity.fec_roots,
         block_size,
-        true /* verify_mode */));
+        true /* verify_mode */,
+        diff_utils::GetMaxThreads()));
   }
   return true;
 }
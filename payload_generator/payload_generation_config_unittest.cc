@@ -20,6 +20,8 @@
 
 #include <gtest/gtest.h>
 
+#include "update_engine/payload_generator/extent_ranges.h"
+
 namespace chromeos_update_engine {
 
 class PayloadGenerationConfigTest : public ::testing::Test {};
@@ -142,4 +144,56 @@ TEST_F(PayloadGenerationConfigTest, ValidateDynamicPartitionMetadataTooBig) {
 
   EXPECT_FALSE(image_config.ValidateDynamicPartitionMetadata());
 }
+
+TEST_F(PayloadGenerationConfigTest, LoadApplyCostProfileTest) {
+  ApplyCostProfile profile;
+  brillo::KeyValueStore store;
+  ASSERT_TRUE(
+      store.LoadFromString("DOWNLOAD=1000\n"
+                           "PUFFDIFF=500\n"));
+  EXPECT_TRUE(profile.Load(store));
+  EXPECT_DOUBLE_EQ(2.0, profile.DownloadSeconds(2000));
+  EXPECT_DOUBLE_EQ(4.0, profile.ApplySeconds(InstallOperation::PUFFDIFF, 2000));
+  EXPECT_DOUBLE_EQ(0.0, profile.ApplySeconds(InstallOperation::ZERO, 2000));
+  EXPECT_LT(0.0, profile.ApplySeconds(InstallOperation::REPLACE_XZ, 2000));
+
+  brillo::KeyValueStore zero_store;
+  ASSERT_TRUE(zero_store.LoadFromString("PUFFDIFF=0\n"));
+  EXPECT_FALSE(profile.Load(zero_store));
+  brillo::KeyValueStore unknown_store;
+  ASSERT_TRUE(unknown_store.LoadFromString("FOO=100\n"));
+  EXPECT_FALSE(profile.Load(unknown_store));
+}
+
+TEST_F(PayloadGenerationConfigTest, ChooseVerityComputationTest) {
+  PayloadGenerationConfig config;
+  brillo::KeyValueStore store;
+  // Downloading and writing the 8 hash tree blocks takes 2 seconds, and
+  // computing them from the 1000 data blocks 4 seconds. The 16 FEC blocks
+  // take 4 seconds to ship and 1 second to compute.
+  ASSERT_TRUE(
+      store.LoadFromString("DOWNLOAD=32768
+"
+                           "REPLACE=32768
+"
+                           "HASH_TREE=1024000
+"
+                           "FEC=4096000
+"));
+  ASSERT_TRUE(config.apply_cost_profile.Load(store));
+  config.target.partitions.emplace_back("system");
+  VerityConfig& verity = config.target.partitions.back().verity;
+  verity.hash_tree_data_extent = ExtentForRange(0, 1000);
+  verity.hash_tree_extent = ExtentForRange(1000, 8);
+  verity.hash_tree_algorithm = "sha256";
+  verity.fec_data_extent = ExtentForRange(0, 1008);
+  verity.fec_extent = ExtentForRange(1008, 16);
+  verity.fec_roots = 2;
+
+  config.ChooseVerityComputation();
+  EXPECT_EQ(0u, verity.hash_tree_extent.num_blocks());
+  EXPECT_TRUE(verity.hash_tree_algorithm.empty());
+  EXPECT_EQ(16u, verity.fec_extent.num_blocks());
+  EXPECT_EQ(2u, verity.fec_roots);
+}
 }  // namespace chromeos_update_engine
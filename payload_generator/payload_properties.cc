@@ -76,6 +76,16 @@ bool PayloadProperties::GetPropertiesAsKeyValue(string* key_value_str) {
                        std::to_string(metadata_size_));
   properties.SetString(kPayloadPropertyFileHash, payload_hash_);
   properties.SetString(kPayloadPropertyMetadataHash, metadata_hash_);
+  if (has_apply_cost_) {
+    properties.SetString(kPayloadPropertyApplyBytesRead,
+                         std::to_string(apply_cost_.bytes_read()));
+    properties.SetString(kPayloadPropertyApplyBytesWritten,
+                         std::to_string(apply_cost_.bytes_written()));
+    properties.SetString(kPayloadPropertyApplyDiffBytes,
+                         std::to_string(apply_cost_.diff_bytes()));
+    properties.SetString(kPayloadPropertyApplyTimeMs,
+                         std::to_string(apply_cost_.apply_time_ms()));
+  }
 
   *key_value_str = properties.SaveToString();
   return true;
@@ -118,6 +128,23 @@ bool PayloadProperties::LoadFromPayload() {
                           [](const PartitionUpdate& part) {
                             return part.has_old_partition_info();
                           });
+
+  apply_cost_.Clear();
+  has_apply_cost_ = false;
+  for (const PartitionUpdate& part : manifest.partitions()) {
+    if (!part.has_apply_cost())
+      continue;
+    has_apply_cost_ = true;
+    const PartitionApplyCost& cost = part.apply_cost();
+    apply_cost_.set_bytes_read(apply_cost_.bytes_read() + cost.bytes_read());
+    apply_cost_.set_bytes_written(apply_cost_.bytes_written() +
+                                  cost.bytes_written());
+    apply_cost_.set_diff_bytes(apply_cost_.diff_bytes() + cost.diff_bytes());
+    apply_cost_.set_decompressed_bytes(apply_cost_.decompressed_bytes() +
+                                       cost.decompressed_bytes());
+    apply_cost_.set_apply_time_ms(apply_cost_.apply_time_ms() +
+                                  cost.apply_time_ms());
+  }
   return true;
 }
 
@@ -22,6 +22,8 @@
 #include <brillo/key_value_store.h>
 #include <brillo/secure_blob.h>
 
+#include "update_engine/update_metadata.pb.h"
+
 namespace chromeos_update_engine {
 
 // A class for extracting information about a payload from the payload file
@@ -62,6 +64,10 @@ class PayloadProperties {
   // Whether the payload is a delta (true) or full (false).
   bool is_delta_;
 
+  // The PartitionApplyCost of the partitions summed up, if they have one.
+  bool has_apply_cost_{false};
+  PartitionApplyCost apply_cost_;
+
   DISALLOW_COPY_AND_ASSIGN(PayloadProperties);
 };
 
@@ -17,11 +17,16 @@
 #include "update_engine/payload_generator/payload_signer.h"
 
 #include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <utility>
 
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
@@ -33,7 +38,9 @@
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/common/worker_pool.h"
 #include "update_engine/payload_consumer/delta_performer.h"
+#include "update_engine/payload_consumer/file_writer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
@@ -79,31 +86,60 @@ bool ConvertSignaturesToProtobuf(const vector<brillo::Blob>& signatures,
   return true;
 }
 
+// How many bytes of payload data blobs are hashed or copied in one go.
+constexpr size_t kPayloadBufferSize = 4 * 1024 * 1024;
+
+// The layout of a payload once signed: its new metadata, followed by the data
+// blobs of the unsigned payload and the payload signature.
+struct SignedPayloadLayout {
+  // The header, manifest and metadata signature of the signed payload.
+  brillo::Blob metadata;
+  uint64_t metadata_size;
+  uint32_t metadata_signature_size;
+  // The data blobs, in the unsigned payload.
+  uint64_t blobs_offset;
+  uint64_t blobs_size;
+  // The offset of the payload signature in the signed payload.
+  uint64_t signatures_offset;
+};
+
 // Given an unsigned payload under |payload_path| and the |payload_signature|
-// and |metadata_signature| generates an updated payload that includes the
-// signatures. It populates |out_metadata_size| with the size of the final
-// manifest after adding the fake signature operation, and
-// |out_signatures_offset| with the expected offset for the new blob, and
-// |out_metadata_signature_size| which will be size of |metadata_signature|
-// if the payload major version supports metadata signature, 0 otherwise.
-// Returns true on success, false otherwise.
+// and |metadata_signature| figures out the layout of the payload including
+// the signatures, in |out_layout|. Only the metadata of the payload is read:
+// the data blobs are left in |payload_path|. The metadata includes the
+// signature operation, added to the manifest if missing, and
+// |metadata_signature| if the payload major version supports it. Returns true
+// on success, false otherwise.
 bool AddSignatureBlobToPayload(const string& payload_path,
                                const string& payload_signature,
                                const string& metadata_signature,
-                               brillo::Blob* out_payload,
-                               uint64_t* out_metadata_size,
-                               uint32_t* out_metadata_signature_size,
-                               uint64_t* out_signatures_offset) {
+                               SignedPayloadLayout* out_layout) {
   uint64_t manifest_offset = 20;
   const int kProtobufSizeOffset = 12;
 
-  brillo::Blob payload;
-  TEST_AND_RETURN_FALSE(utils::ReadFile(payload_path, &payload));
+  int fd = HANDLE_EINTR(open(payload_path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  const off_t file_size = utils::FileSize(fd);
+  TEST_AND_RETURN_FALSE(file_size >= 0);
+
+  brillo::Blob payload(manifest_offset + sizeof(uint32_t));
+  ssize_t bytes_read;
+  TEST_AND_RETURN_FALSE(
+      utils::PReadAll(fd, payload.data(), payload.size(), 0, &bytes_read));
+  TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == payload.size());
   PayloadMetadata payload_metadata;
   TEST_AND_RETURN_FALSE(payload_metadata.ParsePayloadHeader(payload));
   uint64_t metadata_size = payload_metadata.GetMetadataSize();
   uint32_t metadata_signature_size =
       payload_metadata.GetMetadataSignatureSize();
+  const uint64_t blobs_offset = metadata_size + metadata_signature_size;
+  TEST_AND_RETURN_FALSE(static_cast<uint64_t>(file_size) >= blobs_offset);
+  payload.resize(blobs_offset);
+  TEST_AND_RETURN_FALSE(
+      utils::PReadAll(fd, payload.data(), payload.size(), 0, &bytes_read));
+  TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == payload.size());
+
   // Write metadata signature size in header.
   uint32_t metadata_signature_size_be = htobe32(metadata_signature.size());
   memcpy(payload.data() + manifest_offset,
@@ -122,6 +158,7 @@ bool AddSignatureBlobToPayload(const string& payload_path,
   DeltaArchiveManifest manifest;
   TEST_AND_RETURN_FALSE(payload_metadata.GetManifest(payload, &manifest));
 
+  uint64_t blobs_size = file_size - blobs_offset;
   // Is there already a signature op in place?
   if (manifest.has_signatures_size()) {
     // The signature op is tied to the size of the signature blob, but not it's
@@ -136,16 +173,17 @@ bool AddSignatureBlobToPayload(const string& payload_path,
     }
 
     LOG(INFO) << "Matching signature sizes already present.";
+    TEST_AND_RETURN_FALSE(manifest.signatures_offset() <= blobs_size);
+    blobs_size = manifest.signatures_offset();
   } else {
     // Updates the manifest to include the signature operation.
     PayloadSigner::AddSignatureToManifest(
-        payload.size() - metadata_size - metadata_signature_size,
-        payload_signature.size(),
-        &manifest);
+        blobs_size, payload_signature.size(), &manifest);
 
     // Updates the payload to include the new manifest.
     string serialized_manifest;
-    TEST_AND_RETURN_FALSE(manifest.AppendToString(&serialized_manifest));
+    TEST_AND_RETURN_FALSE(PayloadMetadata::SerializeManifest(
+        payload_metadata.GetMajorVersion(), manifest, &serialized_manifest));
     LOG(INFO) << "Updated protobuf size: " << serialized_manifest.size();
     payload.erase(payload.begin() + manifest_offset,
                   payload.begin() + metadata_size);
@@ -158,21 +196,70 @@ bool AddSignatureBlobToPayload(const string& payload_path,
     memcpy(&payload[kProtobufSizeOffset], &size_be, sizeof(size_be));
     metadata_size = serialized_manifest.size() + manifest_offset;
 
-    LOG(INFO) << "Updated payload size: " << payload.size();
     LOG(INFO) << "Updated metadata size: " << metadata_size;
   }
   uint64_t signatures_offset =
       metadata_size + metadata_signature_size + manifest.signatures_offset();
   LOG(INFO) << "Signature Blob Offset: " << signatures_offset;
-  payload.resize(signatures_offset);
-  payload.insert(payload.begin() + signatures_offset,
-                 payload_signature.begin(),
-                 payload_signature.end());
-
-  *out_payload = std::move(payload);
-  *out_metadata_size = metadata_size;
-  *out_metadata_signature_size = metadata_signature_size;
-  *out_signatures_offset = signatures_offset;
+
+  out_layout->metadata = std::move(payload);
+  out_layout->metadata_size = metadata_size;
+  out_layout->metadata_signature_size = metadata_signature_size;
+  out_layout->blobs_offset = blobs_offset;
+  out_layout->blobs_size = blobs_size;
+  out_layout->signatures_offset = signatures_offset;
+  return true;
+}
+
+// Passes the |size| bytes at |offset| in |fd| to |consume|, in chunks.
+// Returns false if they can't be read or |consume| fails.
+bool ReadFileRange(int fd,
+                   uint64_t offset,
+                   uint64_t size,
+                   const std::function<bool(const uint8_t*, size_t)>& consume) {
+  brillo::Blob buffer(std::min<uint64_t>(size, kPayloadBufferSize));
+  while (size > 0) {
+    const size_t count = std::min<uint64_t>(size, buffer.size());
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(
+        utils::PReadAll(fd, buffer.data(), count, offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == count);
+    TEST_AND_RETURN_FALSE(consume(buffer.data(), count));
+    offset += count;
+    size -= count;
+  }
+  return true;
+}
+
+// Calculates the hashes of the payload under |payload_path| once signed as
+// described by |layout|, into |out_hash_data| and |out_metadata_hash|. The
+// data blobs are hashed straight from the file.
+bool CalculateHashFromLayout(const string& payload_path,
+                             const SignedPayloadLayout& layout,
+                             brillo::Blob* out_hash_data,
+                             brillo::Blob* out_metadata_hash) {
+  if (out_metadata_hash) {
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+        layout.metadata.data(), layout.metadata_size, out_metadata_hash));
+  }
+  if (out_hash_data) {
+    // Note that we skip metadata signature and payload signature.
+    HashCalculator calc;
+    TEST_AND_RETURN_FALSE(
+        calc.Update(layout.metadata.data(), layout.metadata_size));
+    int fd = HANDLE_EINTR(open(payload_path.c_str(), O_RDONLY));
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    ScopedFdCloser fd_closer(&fd);
+    TEST_AND_RETURN_FALSE(ReadFileRange(
+        fd,
+        layout.blobs_offset,
+        layout.blobs_size,
+        [&calc](const uint8_t* data, size_t size) {
+          return calc.Update(data, size);
+        }));
+    TEST_AND_RETURN_FALSE(calc.Finalize());
+    *out_hash_data = calc.raw_hash();
+  }
   return true;
 }
 
@@ -359,17 +446,25 @@ bool PayloadSigner::SignHash(const brillo::Blob& hash,
 bool PayloadSigner::SignHashWithKeys(const brillo::Blob& hash_data,
                                      const vector<string>& private_key_paths,
                                      string* out_serialized_signature) {
-  vector<brillo::Blob> signatures;
-  vector<size_t> padded_signature_sizes;
-  for (const string& path : private_key_paths) {
-    brillo::Blob signature;
-    TEST_AND_RETURN_FALSE(SignHash(hash_data, path, &signature));
-    signatures.push_back(signature);
-
-    size_t padded_signature_size;
+  vector<brillo::Blob> signatures(private_key_paths.size());
+  vector<size_t> padded_signature_sizes(private_key_paths.size());
+  auto sign = [&](size_t i) {
     TEST_AND_RETURN_FALSE(
-        GetMaximumSignatureSize(path, &padded_signature_size));
-    padded_signature_sizes.push_back(padded_signature_size);
+        SignHash(hash_data, private_key_paths[i], &signatures[i]));
+    TEST_AND_RETURN_FALSE(GetMaximumSignatureSize(private_key_paths[i],
+                                                  &padded_signature_sizes[i]));
+    return true;
+  };
+  if (private_key_paths.size() > 1) {
+    // Each key signs on its own thread.
+    WorkerPool pool(private_key_paths.size(), private_key_paths.size());
+    for (size_t i = 0; i < private_key_paths.size(); i++) {
+      if (!pool.Post([&sign, i] { return sign(i); }))
+        break;
+    }
+    TEST_AND_RETURN_FALSE(pool.Wait());
+  } else if (!private_key_paths.empty()) {
+    TEST_AND_RETURN_FALSE(sign(0));
   }
   TEST_AND_RETURN_FALSE(ConvertSignaturesToProtobuf(
       signatures, padded_signature_sizes, out_serialized_signature));
@@ -422,23 +517,12 @@ bool PayloadSigner::HashPayloadForSigning(const string& payload_path,
   TEST_AND_RETURN_FALSE(
       ConvertSignaturesToProtobuf(signatures, signature_sizes, &signature));
 
-  brillo::Blob payload;
-  uint64_t metadata_size, signatures_offset;
-  uint32_t metadata_signature_size;
   // Prepare payload for hashing.
-  TEST_AND_RETURN_FALSE(AddSignatureBlobToPayload(payload_path,
-                                                  signature,
-                                                  signature,
-                                                  &payload,
-                                                  &metadata_size,
-                                                  &metadata_signature_size,
-                                                  &signatures_offset));
-  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(payload,
-                                                 metadata_size,
-                                                 metadata_signature_size,
-                                                 signatures_offset,
-                                                 out_payload_hash_data,
-                                                 out_metadata_hash));
+  SignedPayloadLayout layout;
+  TEST_AND_RETURN_FALSE(
+      AddSignatureBlobToPayload(payload_path, signature, signature, &layout));
+  TEST_AND_RETURN_FALSE(CalculateHashFromLayout(
+      payload_path, layout, out_payload_hash_data, out_metadata_hash));
   return true;
 }
 
@@ -449,9 +533,7 @@ bool PayloadSigner::AddSignatureToPayload(
     const vector<brillo::Blob>& metadata_signatures,
     const string& signed_payload_path,
     uint64_t* out_metadata_size) {
-  // TODO(petkov): Reduce memory usage -- the payload is manipulated in memory.
-
-  // Loads the payload and adds the signature op to it.
+  // Works out the layout of the signed payload, with the signature op.
   string payload_signature, metadata_signature;
   TEST_AND_RETURN_FALSE(ConvertSignaturesToProtobuf(
       payload_signatures, padded_signature_sizes, &payload_signature));
@@ -459,20 +541,62 @@ bool PayloadSigner::AddSignatureToPayload(
     TEST_AND_RETURN_FALSE(ConvertSignaturesToProtobuf(
         metadata_signatures, padded_signature_sizes, &metadata_signature));
   }
-  brillo::Blob payload;
-  uint64_t signatures_offset;
-  uint32_t metadata_signature_size;
-  TEST_AND_RETURN_FALSE(AddSignatureBlobToPayload(payload_path,
-                                                  payload_signature,
-                                                  metadata_signature,
-                                                  &payload,
-                                                  out_metadata_size,
-                                                  &metadata_signature_size,
-                                                  &signatures_offset));
-
-  LOG(INFO) << "Signed payload size: " << payload.size();
-  TEST_AND_RETURN_FALSE(utils::WriteFile(
-      signed_payload_path.c_str(), payload.data(), payload.size()));
+  SignedPayloadLayout layout;
+  TEST_AND_RETURN_FALSE(AddSignatureBlobToPayload(
+      payload_path, payload_signature, metadata_signature, &layout));
+  const uint64_t signed_payload_size =
+      layout.signatures_offset + payload_signature.size();
+  LOG(INFO) << "Signed payload size: " << signed_payload_size;
+
+  if (signed_payload_path == payload_path &&
+      layout.metadata.size() == layout.blobs_offset) {
+    // The payload already has room for the signatures: they are written in
+    // place and the data blobs aren't moved.
+    LOG(INFO) << "Inserting the signatures in place.";
+    int fd = HANDLE_EINTR(open(payload_path.c_str(), O_WRONLY));
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    ScopedFdCloser fd_closer(&fd);
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(
+        fd, layout.metadata.data(), layout.metadata.size(), 0));
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(fd,
+                                           payload_signature.data(),
+                                           payload_signature.size(),
+                                           layout.signatures_offset));
+    TEST_AND_RETURN_FALSE_ERRNO(ftruncate(fd, signed_payload_size) == 0);
+    TEST_AND_RETURN_FALSE_ERRNO(fsync(fd) == 0);
+    *out_metadata_size = layout.metadata_size;
+    return true;
+  }
+
+  // Otherwise the data blobs are copied after the new metadata, through a
+  // temporary file when signing the payload in place.
+  const string output_path = signed_payload_path == payload_path
+                                 ? signed_payload_path + ".signing"
+                                 : signed_payload_path;
+  int in_fd = HANDLE_EINTR(open(payload_path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
+  DirectFileWriter writer;
+  TEST_AND_RETURN_FALSE_ERRNO(
+      writer.Open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) ==
+      0);
+  ScopedFileWriterCloser writer_closer(&writer);
+  TEST_AND_RETURN_FALSE(
+      writer.Write(layout.metadata.data(), layout.metadata.size()));
+  TEST_AND_RETURN_FALSE(ReadFileRange(
+      in_fd,
+      layout.blobs_offset,
+      layout.blobs_size,
+      [&writer](const uint8_t* data, size_t size) {
+        return writer.Write(data, size);
+      }));
+  TEST_AND_RETURN_FALSE(
+      writer.Write(payload_signature.data(), payload_signature.size()));
+  if (output_path != signed_payload_path) {
+    TEST_AND_RETURN_FALSE_ERRNO(
+        rename(output_path.c_str(), signed_payload_path.c_str()) == 0);
+  }
+  *out_metadata_size = layout.metadata_size;
   return true;
 }
 
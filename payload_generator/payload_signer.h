@@ -51,7 +51,7 @@ class PayloadSigner {
                        brillo::Blob* out_signature);
 
   // Sign |hash_data| blob with all private keys in |private_key_paths|, then
-  // convert the signatures to serialized protobuf.
+  // convert the signatures to serialized protobuf. The keys sign in parallel.
   static bool SignHashWithKeys(
       const brillo::Blob& hash_data,
       const std::vector<std::string>& private_key_paths,
@@ -78,13 +78,14 @@ class PayloadSigner {
 
   // Given an unsigned payload in |payload_path|,
   // this method does two things:
-  // 1. It loads the payload into memory, and inserts placeholder signature
-  //    operations and placeholder metadata signature to make the header and
-  //    the manifest match what the final signed payload will look like based
-  //    on |signatures_sizes|, if needed.
+  // 1. It loads the payload metadata into memory, and inserts placeholder
+  //    signature operations and placeholder metadata signature to make the
+  //    header and the manifest match what the final signed payload will look
+  //    like based on |signatures_sizes|, if needed.
   // 2. It calculates the raw SHA256 hash of the payload and the metadata in
   //    |payload_path| (except signatures) and returns the result in
-  //    |out_hash_data| and |out_metadata_hash| respectively.
+  //    |out_hash_data| and |out_metadata_hash| respectively. The data blobs
+  //    are hashed straight from |payload_path|.
   //
   // The changes to payload are not preserved or written to disk.
   static bool HashPayloadForSigning(const std::string& payload_path,
@@ -96,7 +97,8 @@ class PayloadSigner {
   // and the raw |payload_signatures| and |metadata_signatures| updates the
   // payload to include the signature thus turning it into a signed payload. The
   // new payload is stored in |signed_payload_path|. |payload_path| and
-  // |signed_payload_path| can point to the same file. Populates
+  // |signed_payload_path| can point to the same file: if it already has room
+  // for the signatures, they are then written in place. Populates
   // |out_metadata_size| with the size of the metadata after adding the
   // signature operation in the manifest. Returns true on success, false
   // otherwise.
@@ -201,4 +201,39 @@ TEST_F(PayloadSignerTest, VerifySignedPayloadTest) {
       payload_file.path(), GetBuildArtifactsPath(kUnittestPublicKeyPath)));
 }
 
+TEST_F(PayloadSignerTest, ResignPayloadInPlaceTest) {
+  ScopedTempFile payload_file("payload.XXXXXX");
+  PayloadGenerationConfig config;
+  config.version.major = kBrilloMajorPayloadVersion;
+  PayloadFile payload;
+  EXPECT_TRUE(payload.Init(config));
+  uint64_t metadata_size;
+  const string private_key = GetBuildArtifactsPath(kUnittestPrivateKeyPath);
+  EXPECT_TRUE(payload.WritePayload(
+      payload_file.path(), "/dev/null", private_key, &metadata_size));
+  const off_t payload_size = utils::FileSize(payload_file.path());
+
+  // The signatures of a signed payload are replaced in place.
+  const vector<size_t> sizes = {256};
+  brillo::Blob payload_hash, metadata_hash;
+  EXPECT_TRUE(PayloadSigner::HashPayloadForSigning(
+      payload_file.path(), sizes, &payload_hash, &metadata_hash));
+  brillo::Blob payload_signature, metadata_signature;
+  EXPECT_TRUE(
+      PayloadSigner::SignHash(payload_hash, private_key, &payload_signature));
+  EXPECT_TRUE(
+      PayloadSigner::SignHash(metadata_hash, private_key, &metadata_signature));
+  uint64_t signed_metadata_size;
+  EXPECT_TRUE(PayloadSigner::AddSignatureToPayload(payload_file.path(),
+                                                   sizes,
+                                                   {payload_signature},
+                                                   {metadata_signature},
+                                                   payload_file.path(),
+                                                   &signed_metadata_size));
+  EXPECT_EQ(metadata_size, signed_metadata_size);
+  EXPECT_EQ(payload_size, utils::FileSize(payload_file.path()));
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      payload_file.path(), GetBuildArtifactsPath(kUnittestPublicKeyPath)));
+}
+
 }  // namespace chromeos_update_engine
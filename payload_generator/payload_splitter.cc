@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_splitter.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+
+#include <base/files/file_path.h>
+#include <base/strings/string_util.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr char kMetadataPartName[] = "metadata";
+constexpr char kSignaturesPartName[] = "signatures";
+constexpr size_t kCopyBufferSize = 1024 * 1024;
+
+// Copies the |size| bytes at |offset| in |source| into a new file at |path|.
+bool WritePart(const FileDescriptorPtr& source,
+               uint64_t offset,
+               uint64_t size,
+               const string& path) {
+  FileDescriptorPtr target = std::make_shared<EintrSafeFileDescriptor>();
+  TEST_AND_RETURN_FALSE_ERRNO(
+      target->Open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  if (!target->CopyFrom(source.get(), offset, 0, size)) {
+    vector<uint8_t> buffer(std::min<uint64_t>(size, kCopyBufferSize));
+    for (uint64_t copied = 0; copied < size; copied += buffer.size()) {
+      buffer.resize(std::min<uint64_t>(size - copied, kCopyBufferSize));
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::ReadAll(
+          source, buffer.data(), buffer.size(), offset + copied, &bytes_read));
+      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == buffer.size());
+      TEST_AND_RETURN_FALSE(
+          utils::PWriteAll(target, buffer.data(), buffer.size(), copied));
+    }
+  }
+  return target->Close();
+}
+
+}  // namespace
+
+bool GetSplitPayloadParts(const DeltaArchiveManifest& manifest,
+                          uint64_t data_offset,
+                          uint64_t payload_size,
+                          vector<SplitPayloadPart>* parts) {
+  TEST_AND_RETURN_FALSE(data_offset <= payload_size);
+  parts->clear();
+  parts->push_back({kMetadataPartName, 0, data_offset});
+  // The operations of a partition may use the data of the partitions before
+  // it, e.g. a shared blob, so a part ends with the last byte used so far.
+  uint64_t end = data_offset;
+  for (const PartitionUpdate& partition : manifest.partitions()) {
+    uint64_t partition_end = end;
+    for (const InstallOperation& op : partition.operations()) {
+      if (op.data_length() > 0) {
+        partition_end = std::max(
+            partition_end, data_offset + op.data_offset() + op.data_length());
+      }
+    }
+    TEST_AND_RETURN_FALSE(partition_end <= payload_size);
+    if (partition_end > end) {
+      parts->push_back(
+          {partition.partition_name() + ".data", end, partition_end - end});
+      end = partition_end;
+    }
+  }
+  if (payload_size > end) {
+    parts->push_back({kSignaturesPartName, end, payload_size - end});
+  }
+  return true;
+}
+
+bool SplitPayload(const string& payload_path,
+                  const string& out_dir,
+                  string* property) {
+  PayloadMetadata payload_metadata;
+  DeltaArchiveManifest manifest;
+  Signatures metadata_signatures;
+  TEST_AND_RETURN_FALSE(payload_metadata.ParsePayloadFile(
+      payload_path, &manifest, &metadata_signatures));
+  const uint64_t data_offset = payload_metadata.GetMetadataSize() +
+                               payload_metadata.GetMetadataSignatureSize();
+  vector<SplitPayloadPart> parts;
+  TEST_AND_RETURN_FALSE(GetSplitPayloadParts(
+      manifest, data_offset, utils::FileSize(payload_path), &parts));
+
+  FileDescriptorPtr source = std::make_shared<EintrSafeFileDescriptor>();
+  TEST_AND_RETURN_FALSE_ERRNO(source->Open(payload_path.c_str(), O_RDONLY));
+  vector<string> entries;
+  for (const SplitPayloadPart& part : parts) {
+    const string path = base::FilePath(out_dir).Append(part.name).value();
+    TEST_AND_RETURN_FALSE(WritePart(source, part.offset, part.size, path));
+    LOG(INFO) << "Wrote " << part.size << " bytes of the payload from offset "
+              << part.offset << " to " << path;
+    entries.push_back(std::to_string(part.offset) + ":" + part.name);
+  }
+  *property = base::JoinString(entries, " ");
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,56 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_SPLITTER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_SPLITTER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A file of a split payload, holding the |size| bytes of the payload from
+// |offset| on. The files of all the parts put together are the payload.
+struct SplitPayloadPart {
+  std::string name;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Splits a payload of |payload_size| bytes with |manifest| into |parts|: the
+// metadata and its signature, up to |data_offset|; the data of each partition,
+// from the end of the data of the partitions before it to the end of its own;
+// and the rest, the payload signature. The partitions whose operations only
+// use data of the partitions before them get no part.
+bool GetSplitPayloadParts(const DeltaArchiveManifest& manifest,
+                          uint64_t data_offset,
+                          uint64_t payload_size,
+                          std::vector<SplitPayloadPart>* parts);
+
+// Writes the parts of the payload at |payload_path| into |out_dir|, one file
+// named after each part, and returns in |property| the value of the
+// SPLIT_PAYLOAD_PARTS payload property listing them.
+bool SplitPayload(const std::string& payload_path,
+                  const std::string& out_dir,
+                  std::string* property);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_SPLITTER_H_
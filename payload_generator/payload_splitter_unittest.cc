@@ -0,0 +1,76 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_splitter.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+void AddOperation(PartitionUpdate* partition,
+                  uint64_t data_offset,
+                  uint64_t data_length) {
+  InstallOperation* op = partition->add_operations();
+  op->set_type(InstallOperation::REPLACE);
+  op->set_data_offset(data_offset);
+  op->set_data_length(data_length);
+}
+
+}  // namespace
+
+TEST(PayloadSplitterTest, GetSplitPayloadPartsTest) {
+  DeltaArchiveManifest manifest;
+  PartitionUpdate* system = manifest.add_partitions();
+  system->set_partition_name("system");
+  AddOperation(system, 0, 100);
+  system->add_operations()->set_type(InstallOperation::ZERO);
+  AddOperation(system, 100, 50);
+  // Only uses a blob of system.
+  PartitionUpdate* vendor = manifest.add_partitions();
+  vendor->set_partition_name("vendor");
+  AddOperation(vendor, 20, 30);
+  PartitionUpdate* product = manifest.add_partitions();
+  product->set_partition_name("product");
+  AddOperation(product, 20, 30);
+  AddOperation(product, 150, 10);
+
+  vector<SplitPayloadPart> parts;
+  ASSERT_TRUE(GetSplitPayloadParts(manifest, 40, 220, &parts));
+  ASSERT_EQ(4u, parts.size());
+  EXPECT_EQ("metadata", parts[0].name);
+  EXPECT_EQ(0u, parts[0].offset);
+  EXPECT_EQ(40u, parts[0].size);
+  EXPECT_EQ("system.data", parts[1].name);
+  EXPECT_EQ(40u, parts[1].offset);
+  EXPECT_EQ(150u, parts[1].size);
+  EXPECT_EQ("product.data", parts[2].name);
+  EXPECT_EQ(190u, parts[2].offset);
+  EXPECT_EQ(10u, parts[2].size);
+  EXPECT_EQ("signatures", parts[3].name);
+  EXPECT_EQ(200u, parts[3].offset);
+  EXPECT_EQ(20u, parts[3].size);
+
+  // The operations can't use data past the end of the payload.
+  EXPECT_FALSE(GetSplitPayloadParts(manifest, 40, 199, &parts));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,196 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/sparse_image.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+namespace sparse_image {
+
+namespace {
+
+// The format of system/core/libsparse/sparse_format.h, little endian.
+constexpr uint32_t kSparseHeaderMagic = 0xed26ff3a;
+constexpr uint16_t kSparseMajorVersion = 1;
+constexpr uint16_t kChunkTypeRaw = 0xcac1;
+constexpr uint16_t kChunkTypeFill = 0xcac2;
+constexpr uint16_t kChunkTypeDontCare = 0xcac3;
+constexpr uint16_t kChunkTypeCrc32 = 0xcac4;
+
+struct SparseHeader {
+  uint32_t magic;
+  uint16_t major_version;
+  uint16_t minor_version;
+  uint16_t file_hdr_sz;
+  uint16_t chunk_hdr_sz;
+  uint32_t blk_sz;
+  uint32_t total_blks;
+  uint32_t total_chunks;
+  uint32_t image_checksum;
+};
+
+struct ChunkHeader {
+  uint16_t chunk_type;
+  uint16_t reserved1;
+  // In blocks of the output image.
+  uint32_t chunk_sz;
+  // In bytes of the sparse image, including this header.
+  uint32_t total_sz;
+};
+
+static_assert(sizeof(SparseHeader) == 28, "Unexpected padding");
+static_assert(sizeof(ChunkHeader) == 12, "Unexpected padding");
+
+// The raw chunks are copied in pieces of this size.
+constexpr size_t kCopyBufferSize = 1024 * 1024;
+
+bool ReadAt(int fd, void* buf, size_t count, off_t offset) {
+  ssize_t bytes_read;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(fd, buf, count, offset, &bytes_read));
+  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(count));
+  return true;
+}
+
+bool ReadHeader(int fd, SparseHeader* header) {
+  if (!ReadAt(fd, header, sizeof(*header), 0))
+    return false;
+  return header->magic == kSparseHeaderMagic &&
+         header->major_version == kSparseMajorVersion;
+}
+
+}  // namespace
+
+bool IsSparseImage(const std::string& path) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0)
+    return false;
+  ScopedFdCloser fd_closer(&fd);
+  SparseHeader header;
+  return ReadHeader(fd, &header);
+}
+
+bool ExpandSparseImage(const std::string& sparse_path,
+                       const std::string& raw_path) {
+  int in_fd = HANDLE_EINTR(open(sparse_path.c_str(), O_RDONLY | O_CLOEXEC));
+  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
+  SparseHeader header;
+  if (!ReadHeader(in_fd, &header)) {
+    LOG(ERROR) << sparse_path << " isn't an Android sparse image.";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(header.file_hdr_sz >= sizeof(SparseHeader));
+  TEST_AND_RETURN_FALSE(header.chunk_hdr_sz >= sizeof(ChunkHeader));
+  TEST_AND_RETURN_FALSE(header.blk_sz > 0 && header.blk_sz % 4 == 0);
+
+  int out_fd = HANDLE_EINTR(
+      open(raw_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+  TEST_AND_RETURN_FALSE_ERRNO(out_fd >= 0);
+  ScopedFdCloser out_fd_closer(&out_fd);
+  const uint64_t raw_size = uint64_t{header.total_blks} * header.blk_sz;
+  // Everything not written below stays a hole, which reads as zeros.
+  TEST_AND_RETURN_FALSE_ERRNO(ftruncate(out_fd, raw_size) == 0);
+
+  brillo::Blob buffer;
+  off_t in_offset = header.file_hdr_sz;
+  uint64_t out_block = 0;
+  for (uint32_t i = 0; i < header.total_chunks; i++) {
+    ChunkHeader chunk;
+    TEST_AND_RETURN_FALSE(ReadAt(in_fd, &chunk, sizeof(chunk), in_offset));
+    TEST_AND_RETURN_FALSE(chunk.total_sz >= header.chunk_hdr_sz);
+    const off_t data_offset = in_offset + header.chunk_hdr_sz;
+    const uint64_t data_size = chunk.total_sz - header.chunk_hdr_sz;
+    const uint64_t chunk_bytes = uint64_t{chunk.chunk_sz} * header.blk_sz;
+    if (chunk.chunk_type != kChunkTypeCrc32) {
+      TEST_AND_RETURN_FALSE(out_block + chunk.chunk_sz <= header.total_blks);
+    }
+    const off_t out_offset = out_block * header.blk_sz;
+    switch (chunk.chunk_type) {
+      case kChunkTypeRaw: {
+        TEST_AND_RETURN_FALSE(data_size == chunk_bytes);
+        buffer.resize(std::min<uint64_t>(chunk_bytes, kCopyBufferSize));
+        for (uint64_t done = 0; done < chunk_bytes;) {
+          const size_t size =
+              std::min<uint64_t>(chunk_bytes - done, buffer.size());
+          TEST_AND_RETURN_FALSE(
+              ReadAt(in_fd, buffer.data(), size, data_offset + done));
+          TEST_AND_RETURN_FALSE(
+              utils::PWriteAll(out_fd, buffer.data(), size, out_offset + done));
+          done += size;
+        }
+        out_block += chunk.chunk_sz;
+        break;
+      }
+      case kChunkTypeFill: {
+        uint32_t fill;
+        TEST_AND_RETURN_FALSE(data_size == sizeof(fill));
+        TEST_AND_RETURN_FALSE(
+            ReadAt(in_fd, &fill, sizeof(fill), data_offset));
+        if (fill != 0) {
+          buffer.resize(std::min<uint64_t>(chunk_bytes, kCopyBufferSize));
+          for (size_t j = 0; j + sizeof(fill) <= buffer.size();
+               j += sizeof(fill)) {
+            memcpy(buffer.data() + j, &fill, sizeof(fill));
+          }
+          for (uint64_t done = 0; done < chunk_bytes;) {
+            const size_t size =
+                std::min<uint64_t>(chunk_bytes - done, buffer.size());
+            TEST_AND_RETURN_FALSE(utils::PWriteAll(
+                out_fd, buffer.data(), size, out_offset + done));
+            done += size;
+          }
+        }
+        out_block += chunk.chunk_sz;
+        break;
+      }
+      case kChunkTypeDontCare:
+        TEST_AND_RETURN_FALSE(data_size == 0);
+        out_block += chunk.chunk_sz;
+        break;
+      case kChunkTypeCrc32:
+        // The checksums are optional, and the payload has its own hashes.
+        break;
+      default:
+        LOG(ERROR) << "Unknown chunk type " << chunk.chunk_type << " in "
+                   << sparse_path;
+        return false;
+    }
+    in_offset = data_offset + data_size;
+  }
+  if (out_block != header.total_blks) {
+    LOG(ERROR) << "The chunks of " << sparse_path << " have " << out_block
+               << " blocks instead of " << header.total_blks;
+    return false;
+  }
+  TEST_AND_RETURN_FALSE_ERRNO(fsync(out_fd) == 0);
+  LOG(INFO) << "Expanded sparse image " << sparse_path << " to " << raw_path
+            << " (" << raw_size << " bytes)";
+  return true;
+}
+
+}  // namespace sparse_image
+}  // namespace chromeos_update_engine
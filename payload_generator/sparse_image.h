@@ -0,0 +1,45 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_SPARSE_IMAGE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_SPARSE_IMAGE_H_
+
+#include <string>
+
+namespace chromeos_update_engine {
+
+// Android sparse images, as written by img2simg and the build system. The
+// payload generation reads partition images in place, so a sparse image is
+// first expanded into a raw one. The "don't care" chunks and the chunks
+// filled with zeros are left as holes of the raw file rather than written, so
+// expanding doesn't take the disk space nor the time to write the zeros.
+namespace sparse_image {
+
+// Returns whether the file at |path| starts with an Android sparse image
+// header.
+bool IsSparseImage(const std::string& path);
+
+// Expands the sparse image |sparse_path| into the raw image |raw_path|, which
+// is created or truncated. Returns false if |sparse_path| isn't a valid
+// sparse image or on I/O errors.
+bool ExpandSparseImage(const std::string& sparse_path,
+                       const std::string& raw_path);
+
+}  // namespace sparse_image
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_SPARSE_IMAGE_H_
@@ -0,0 +1,136 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/sparse_image.h"
+
+#include <string.h>
+
+#include <string>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint32_t kTestBlockSize = 4096;
+
+template <typename T>
+void Append(const T& value, brillo::Blob* out) {
+  auto data = reinterpret_cast<const uint8_t*>(&value);
+  out->insert(out->end(), data, data + sizeof(value));
+}
+
+void AppendHeader(uint32_t total_blocks,
+                  uint32_t total_chunks,
+                  brillo::Blob* out) {
+  Append(uint32_t{0xed26ff3a}, out);
+  Append(uint16_t{1}, out);   // major_version
+  Append(uint16_t{0}, out);   // minor_version
+  Append(uint16_t{28}, out);  // file_hdr_sz
+  Append(uint16_t{12}, out);  // chunk_hdr_sz
+  Append(kTestBlockSize, out);
+  Append(total_blocks, out);
+  Append(total_chunks, out);
+  Append(uint32_t{0}, out);  // image_checksum
+}
+
+void AppendChunk(uint16_t type,
+                 uint32_t num_blocks,
+                 uint32_t data_size,
+                 brillo::Blob* out) {
+  Append(type, out);
+  Append(uint16_t{0}, out);
+  Append(num_blocks, out);
+  Append(12 + data_size, out);
+}
+
+}  // namespace
+
+class SparseImageTest : public ::testing::Test {
+ protected:
+  // Writes a sparse image of 6 blocks: one raw block, two blocks filled with
+  // a pattern, two "don't care" blocks, a checksum and a zero filled block.
+  void SetUp() override {
+    AppendHeader(6, 5, &sparse_);
+    AppendChunk(0xcac1, 1, kTestBlockSize, &sparse_);
+    for (uint32_t i = 0; i < kTestBlockSize; i++)
+      sparse_.push_back(i % 251);
+    AppendChunk(0xcac2, 2, 4, &sparse_);
+    Append(uint32_t{0x12345678}, &sparse_);
+    AppendChunk(0xcac3, 2, 0, &sparse_);
+    AppendChunk(0xcac4, 0, 4, &sparse_);
+    Append(uint32_t{0}, &sparse_);
+    AppendChunk(0xcac2, 1, 4, &sparse_);
+    Append(uint32_t{0}, &sparse_);
+    ASSERT_TRUE(utils::WriteFile(
+        sparse_file_.path().c_str(), sparse_.data(), sparse_.size()));
+  }
+
+  brillo::Blob sparse_;
+  ScopedTempFile sparse_file_{"SparseImageTest.sparse.XXXXXX"};
+  ScopedTempFile raw_file_{"SparseImageTest.raw.XXXXXX"};
+};
+
+TEST_F(SparseImageTest, ExpandTest) {
+  EXPECT_TRUE(sparse_image::IsSparseImage(sparse_file_.path()));
+  ASSERT_TRUE(
+      sparse_image::ExpandSparseImage(sparse_file_.path(), raw_file_.path()));
+
+  brillo::Blob raw;
+  ASSERT_TRUE(utils::ReadFile(raw_file_.path(), &raw));
+  ASSERT_EQ(6u * kTestBlockSize, raw.size());
+  for (uint32_t i = 0; i < kTestBlockSize; i++)
+    ASSERT_EQ(i % 251, raw[i]);
+  uint32_t word;
+  for (uint32_t i = kTestBlockSize; i < 3 * kTestBlockSize; i += 4) {
+    memcpy(&word, raw.data() + i, sizeof(word));
+    ASSERT_EQ(0x12345678u, word);
+  }
+  for (uint32_t i = 3 * kTestBlockSize; i < raw.size(); i++)
+    ASSERT_EQ(0, raw[i]);
+}
+
+TEST_F(SparseImageTest, RawImageTest) {
+  // A raw image doesn't start with the sparse magic.
+  EXPECT_FALSE(sparse_image::IsSparseImage(raw_file_.path()));
+  EXPECT_FALSE(
+      sparse_image::ExpandSparseImage(raw_file_.path(), sparse_file_.path()));
+}
+
+TEST_F(SparseImageTest, TruncatedImageTest) {
+  sparse_.resize(sparse_.size() - 10);
+  ASSERT_TRUE(utils::WriteFile(
+      sparse_file_.path().c_str(), sparse_.data(), sparse_.size()));
+  EXPECT_FALSE(
+      sparse_image::ExpandSparseImage(sparse_file_.path(), raw_file_.path()));
+}
+
+TEST_F(SparseImageTest, TooManyBlocksTest) {
+  // The header claims fewer blocks than the chunks have.
+  sparse_[16] = 5;
+  ASSERT_TRUE(utils::WriteFile(
+      sparse_file_.path().c_str(), sparse_.data(), sparse_.size()));
+  EXPECT_FALSE(
+      sparse_image::ExpandSparseImage(sparse_file_.path(), raw_file_.path()));
+}
+
+}  // namespace chromeos_update_engine
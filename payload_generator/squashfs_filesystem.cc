@@ -17,8 +17,12 @@
 #include "update_engine/payload_generator/squashfs_filesystem.h"
 
 #include <fcntl.h>
+#include <string.h>
 
 #include <algorithm>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
 #include <utility>
 
@@ -28,6 +32,9 @@
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
 #include <brillo/streams/file_stream.h>
+#include <lz4.h>
+#include <xz.h>
+#include <zlib.h>
 
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/utils.h"
@@ -71,6 +78,446 @@ bool CheckHeader(const SquashfsFilesystem::SquashfsHeader& header) {
   return header.magic == 0x73717368 && header.major_version == 4;
 }
 
+// The compression types of squashfs 4 that are parsed in process. Images
+// using another one are parsed with unsquashfs.
+constexpr uint16_t kSquashfsXzCompression = 4;
+constexpr uint16_t kSquashfsLz4Compression = 5;
+
+// The fields of the squashfs 4 super block used to parse the image, as
+// defined in fs/squashfs/squashfs_fs.h.
+struct SquashfsSuperBlock {
+  uint32_t block_size;
+  uint32_t fragment_entry_count;
+  uint16_t compression_type;
+  uint64_t root_inode_ref;
+  uint64_t inode_table_start;
+  uint64_t directory_table_start;
+  uint64_t fragment_table_start;
+};
+
+bool ReadSquashfsSuperBlock(const brillo::Blob& blob,
+                            SquashfsSuperBlock* super_block) {
+  TEST_AND_RETURN_FALSE(blob.size() >= kSquashfsSuperBlockSize);
+  memcpy(&super_block->block_size, blob.data() + 12, 4);
+  memcpy(&super_block->fragment_entry_count, blob.data() + 16, 4);
+  memcpy(&super_block->compression_type, blob.data() + 20, 2);
+  memcpy(&super_block->root_inode_ref, blob.data() + 32, 8);
+  memcpy(&super_block->inode_table_start, blob.data() + 64, 8);
+  memcpy(&super_block->directory_table_start, blob.data() + 72, 8);
+  memcpy(&super_block->fragment_table_start, blob.data() + 80, 8);
+  return true;
+}
+
+// Reads the files of a squashfs 4 image directly, without unsquashfs. It has
+// no global state, so several images can be read at the same time, but one
+// reader must not be used by several threads.
+class SquashfsReader {
+ public:
+  SquashfsReader(int fd, uint64_t image_size, const SquashfsSuperBlock& sb)
+      : fd_(fd), image_size_(image_size), sb_(sb) {}
+
+  static bool IsSupported(uint16_t compression_type) {
+    return compression_type == kSquashfsZlibCompression ||
+           compression_type == kSquashfsXzCompression ||
+           compression_type == kSquashfsLz4Compression;
+  }
+
+  // Produces the same entries as the map of `unsquashfs -m`: one for the
+  // blocks of every regular file and one for every fragment block.
+  bool ReadFileMap(vector<SquashfsFilesystem::FileMapEntry>* entries) {
+    Inode root;
+    TEST_AND_RETURN_FALSE(ReadInode(sb_.root_inode_ref, &root));
+    TEST_AND_RETURN_FALSE(root.is_dir);
+    std::set<uint64_t> visited_dirs;
+    TEST_AND_RETURN_FALSE(WalkDirectory(root, "", &visited_dirs, entries));
+    for (uint32_t i = 0; i < sb_.fragment_entry_count; i++) {
+      Fragment fragment;
+      TEST_AND_RETURN_FALSE(ReadFragment(i, &fragment));
+      entries->push_back({"<fragment-" + std::to_string(i) + ">",
+                          fragment.start,
+                          {fragment.size}});
+    }
+    return true;
+  }
+
+  // Reads the content of the regular file at |path|, relative to the root of
+  // the image.
+  bool ReadFileContent(const string& path, string* content) {
+    Inode inode;
+    TEST_AND_RETURN_FALSE(ReadInode(sb_.root_inode_ref, &inode));
+    for (const auto& name : base::SplitString(path,
+                                              "/",
+                                              base::TRIM_WHITESPACE,
+                                              base::SPLIT_WANT_NONEMPTY)) {
+      TEST_AND_RETURN_FALSE(inode.is_dir);
+      vector<DirEntry> dir_entries;
+      TEST_AND_RETURN_FALSE(ReadDirectory(inode, &dir_entries));
+      auto it = std::find_if(
+          dir_entries.begin(), dir_entries.end(), [&name](const auto& entry) {
+            return entry.name == name;
+          });
+      TEST_AND_RETURN_FALSE(it != dir_entries.end());
+      TEST_AND_RETURN_FALSE(ReadInode(it->inode_ref, &inode));
+    }
+    TEST_AND_RETURN_FALSE(inode.is_file);
+
+    content->clear();
+    uint64_t pos = inode.blocks_start;
+    for (const uint32_t block_size : inode.block_sizes) {
+      brillo::Blob block;
+      TEST_AND_RETURN_FALSE(ReadDataBlock(pos, block_size, &block));
+      // Sparse blocks aren't stored, they are full of zeros.
+      if (block.empty()) {
+        block.resize(sb_.block_size);
+      }
+      content->append(block.begin(), block.end());
+      pos += block_size & ~kSquashfsCompressedBit;
+    }
+    if (inode.fragment != kNoFragment) {
+      Fragment fragment;
+      TEST_AND_RETURN_FALSE(ReadFragment(inode.fragment, &fragment));
+      brillo::Blob block;
+      TEST_AND_RETURN_FALSE(
+          ReadDataBlock(fragment.start, fragment.size, &block));
+      const uint64_t tail_size = inode.file_size % sb_.block_size;
+      TEST_AND_RETURN_FALSE(inode.fragment_offset + tail_size <= block.size());
+      content->append(block.begin() + inode.fragment_offset,
+                      block.begin() + inode.fragment_offset + tail_size);
+    }
+    content->resize(std::min<uint64_t>(content->size(), inode.file_size));
+    return true;
+  }
+
+ private:
+  static constexpr uint32_t kNoFragment = 0xffffffff;
+  static constexpr size_t kMetadataBlockSize = 8192;
+  static constexpr uint16_t kMetadataUncompressedBit = 1 << 15;
+  static constexpr size_t kFragmentEntrySize = 16;
+
+  struct Inode {
+    bool is_dir{false};
+    bool is_file{false};
+    // Directories: where their entries are in the directory table.
+    uint32_t dir_block{0};
+    uint16_t dir_offset{0};
+    uint32_t dir_size{0};
+    // Regular files.
+    uint64_t blocks_start{0};
+    uint64_t file_size{0};
+    uint32_t fragment{kNoFragment};
+    uint32_t fragment_offset{0};
+    vector<uint32_t> block_sizes;
+  };
+
+  struct DirEntry {
+    string name;
+    uint64_t inode_ref;
+  };
+
+  struct Fragment {
+    uint64_t start;
+    uint32_t size;
+  };
+
+  // Reads consecutive bytes of the metadata blocks starting at the block at
+  // |pos| in the image, |offset| bytes into its uncompressed content.
+  class MetadataCursor {
+   public:
+    MetadataCursor(SquashfsReader* reader, uint64_t pos, size_t offset)
+        : reader_(reader), pos_(pos), offset_(offset) {}
+
+    bool Read(void* out, size_t size) {
+      auto dst = static_cast<uint8_t*>(out);
+      while (size > 0) {
+        const MetadataBlock* block;
+        TEST_AND_RETURN_FALSE(reader_->GetMetadataBlock(pos_, &block));
+        if (offset_ >= block->data.size()) {
+          TEST_AND_RETURN_FALSE(offset_ == block->data.size());
+          pos_ = block->next_pos;
+          offset_ = 0;
+          continue;
+        }
+        const size_t chunk = std::min(size, block->data.size() - offset_);
+        memcpy(dst, block->data.data() + offset_, chunk);
+        dst += chunk;
+        offset_ += chunk;
+        size -= chunk;
+      }
+      return true;
+    }
+
+    template <typename T>
+    bool Read(T* value) {
+      return Read(static_cast<void*>(value), sizeof(*value));
+    }
+
+   private:
+    SquashfsReader* reader_;
+    uint64_t pos_;
+    size_t offset_;
+  };
+
+  struct MetadataBlock {
+    brillo::Blob data;
+    uint64_t next_pos;
+  };
+
+  bool GetMetadataBlock(uint64_t pos, const MetadataBlock** out) {
+    auto it = metadata_blocks_.find(pos);
+    if (it == metadata_blocks_.end()) {
+      uint16_t header;
+      TEST_AND_RETURN_FALSE(ReadImage(pos, sizeof(header), &header));
+      const size_t size = header & ~kMetadataUncompressedBit;
+      TEST_AND_RETURN_FALSE(size > 0 && size <= kMetadataBlockSize);
+      brillo::Blob raw(size);
+      TEST_AND_RETURN_FALSE(ReadImage(pos + sizeof(header), size, raw.data()));
+      MetadataBlock block;
+      if (header & kMetadataUncompressedBit) {
+        block.data = std::move(raw);
+      } else {
+        TEST_AND_RETURN_FALSE(Decompress(raw, kMetadataBlockSize, &block.data));
+      }
+      block.next_pos = pos + sizeof(header) + size;
+      it = metadata_blocks_.emplace(pos, std::move(block)).first;
+    }
+    *out = &it->second;
+    return true;
+  }
+
+  bool ReadImage(uint64_t offset, size_t size, void* out) {
+    TEST_AND_RETURN_FALSE(offset <= image_size_ &&
+                          size <= image_size_ - offset);
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(
+        utils::PReadAll(fd_, out, size, offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size));
+    return true;
+  }
+
+  bool Decompress(const brillo::Blob& in, size_t max_size, brillo::Blob* out) {
+    out->resize(max_size);
+    size_t out_size = 0;
+    switch (sb_.compression_type) {
+      case kSquashfsZlibCompression: {
+        uLongf size = max_size;
+        TEST_AND_RETURN_FALSE(
+            uncompress(out->data(), &size, in.data(), in.size()) == Z_OK);
+        out_size = size;
+        break;
+      }
+      case kSquashfsXzCompression: {
+        std::unique_ptr<xz_dec, decltype(&xz_dec_end)> xz(
+            xz_dec_init(XZ_SINGLE, 0), xz_dec_end);
+        TEST_AND_RETURN_FALSE(xz);
+        xz_buf buf{in.data(), 0, in.size(), out->data(), 0, max_size};
+        TEST_AND_RETURN_FALSE(xz_dec_run(xz.get(), &buf) == XZ_STREAM_END);
+        out_size = buf.out_pos;
+        break;
+      }
+      case kSquashfsLz4Compression: {
+        const int size =
+            LZ4_decompress_safe(reinterpret_cast<const char*>(in.data()),
+                                reinterpret_cast<char*>(out->data()),
+                                in.size(),
+                                max_size);
+        TEST_AND_RETURN_FALSE(size >= 0);
+        out_size = size;
+        break;
+      }
+      default:
+        LOG(ERROR) << "Unsupported squashfs compression "
+                   << sb_.compression_type;
+        return false;
+    }
+    out->resize(out_size);
+    return true;
+  }
+
+  // Reads the data block of raw size |raw_size| (as stored in the inodes) at
+  // |pos|. Sparse blocks are returned empty.
+  bool ReadDataBlock(uint64_t pos, uint32_t raw_size, brillo::Blob* out) {
+    const uint32_t size = raw_size & ~kSquashfsCompressedBit;
+    TEST_AND_RETURN_FALSE(size <= sb_.block_size);
+    brillo::Blob raw(size);
+    TEST_AND_RETURN_FALSE(ReadImage(pos, size, raw.data()));
+    if (size == 0 || (raw_size & kSquashfsCompressedBit)) {
+      *out = std::move(raw);
+      return true;
+    }
+    return Decompress(raw, sb_.block_size, out);
+  }
+
+  bool ReadInode(uint64_t ref, Inode* inode) {
+    MetadataCursor cursor(
+        this, sb_.inode_table_start + (ref >> 16), ref & 0xffff);
+    // The common header: type, mode, uid, gid, mtime and inode number.
+    uint16_t type;
+    uint8_t common[14];
+    TEST_AND_RETURN_FALSE(cursor.Read(&type));
+    TEST_AND_RETURN_FALSE(cursor.Read(common, sizeof(common)));
+    *inode = Inode();
+    switch (type) {
+      case 1: {  // SQUASHFS_DIR_TYPE
+        uint32_t start_block, nlink, parent;
+        uint16_t file_size, offset;
+        TEST_AND_RETURN_FALSE(cursor.Read(&start_block) &&
+                              cursor.Read(&nlink) && cursor.Read(&file_size) &&
+                              cursor.Read(&offset) && cursor.Read(&parent));
+        inode->is_dir = true;
+        inode->dir_block = start_block;
+        inode->dir_offset = offset;
+        inode->dir_size = file_size;
+        return true;
+      }
+      case 8: {  // SQUASHFS_LDIR_TYPE
+        uint32_t nlink, file_size, start_block, parent;
+        uint16_t index_count, offset;
+        TEST_AND_RETURN_FALSE(cursor.Read(&nlink) && cursor.Read(&file_size) &&
+                              cursor.Read(&start_block) &&
+                              cursor.Read(&parent) &&
+                              cursor.Read(&index_count) &&
+                              cursor.Read(&offset));
+        inode->is_dir = true;
+        inode->dir_block = start_block;
+        inode->dir_offset = offset;
+        inode->dir_size = file_size;
+        return true;
+      }
+      case 2: {  // SQUASHFS_REG_TYPE
+        uint32_t start_block, fragment, offset, file_size;
+        TEST_AND_RETURN_FALSE(cursor.Read(&start_block) &&
+                              cursor.Read(&fragment) && cursor.Read(&offset) &&
+                              cursor.Read(&file_size));
+        inode->blocks_start = start_block;
+        inode->file_size = file_size;
+        inode->fragment = fragment;
+        inode->fragment_offset = offset;
+        break;
+      }
+      case 9: {  // SQUASHFS_LREG_TYPE
+        uint64_t start_block, file_size, sparse;
+        uint32_t nlink, fragment, offset, xattr;
+        TEST_AND_RETURN_FALSE(cursor.Read(&start_block) &&
+                              cursor.Read(&file_size) && cursor.Read(&sparse) &&
+                              cursor.Read(&nlink) && cursor.Read(&fragment) &&
+                              cursor.Read(&offset) && cursor.Read(&xattr));
+        inode->blocks_start = start_block;
+        inode->file_size = file_size;
+        inode->fragment = fragment;
+        inode->fragment_offset = offset;
+        break;
+      }
+      default:
+        // Symlinks, devices, fifos and sockets have no data blocks.
+        return true;
+    }
+    inode->is_file = true;
+    TEST_AND_RETURN_FALSE(sb_.block_size > 0);
+    uint64_t num_blocks = inode->file_size / sb_.block_size;
+    if (inode->fragment == kNoFragment &&
+        inode->file_size % sb_.block_size != 0) {
+      num_blocks++;
+    }
+    for (uint64_t i = 0; i < num_blocks; i++) {
+      uint32_t block_size;
+      TEST_AND_RETURN_FALSE(cursor.Read(&block_size));
+      inode->block_sizes.push_back(block_size);
+    }
+    return true;
+  }
+
+  bool ReadDirectory(const Inode& dir, vector<DirEntry>* entries) {
+    // The size of a directory counts the "." and ".." entries, which aren't
+    // stored.
+    if (dir.dir_size <= 3) {
+      return true;
+    }
+    MetadataCursor cursor(
+        this, sb_.directory_table_start + dir.dir_block, dir.dir_offset);
+    uint64_t remaining = dir.dir_size - 3;
+    while (remaining > 0) {
+      uint32_t count, start, inode_number;
+      TEST_AND_RETURN_FALSE(remaining >= 3 * sizeof(uint32_t));
+      TEST_AND_RETURN_FALSE(cursor.Read(&count) && cursor.Read(&start) &&
+                            cursor.Read(&inode_number));
+      remaining -= 3 * sizeof(uint32_t);
+      // |count| is one less than the number of entries, at most 256.
+      TEST_AND_RETURN_FALSE(count < 256);
+      for (uint32_t i = 0; i <= count; i++) {
+        uint16_t offset, type, name_size;
+        int16_t inode_offset;
+        TEST_AND_RETURN_FALSE(remaining >= 4 * sizeof(uint16_t));
+        TEST_AND_RETURN_FALSE(cursor.Read(&offset) &&
+                              cursor.Read(&inode_offset) &&
+                              cursor.Read(&type) && cursor.Read(&name_size));
+        remaining -= 4 * sizeof(uint16_t);
+        // |name_size| is one less than the size of the name.
+        TEST_AND_RETURN_FALSE(remaining >= name_size + 1u);
+        DirEntry entry;
+        entry.name.resize(name_size + 1);
+        TEST_AND_RETURN_FALSE(cursor.Read(entry.name.data(), name_size + 1));
+        remaining -= name_size + 1;
+        TEST_AND_RETURN_FALSE(entry.name.find('/') == string::npos &&
+                              entry.name != "." && entry.name != "..");
+        entry.inode_ref = (uint64_t{start} << 16) | offset;
+        entries->push_back(std::move(entry));
+      }
+    }
+    return true;
+  }
+
+  bool WalkDirectory(const Inode& dir,
+                     const string& prefix,
+                     std::set<uint64_t>* visited_dirs,
+                     vector<SquashfsFilesystem::FileMapEntry>* entries) {
+    // A directory is identified by where its entries are, so a corrupted
+    // image can't make the walk loop.
+    const uint64_t dir_id = (uint64_t{dir.dir_block} << 16) | dir.dir_offset;
+    TEST_AND_RETURN_FALSE(visited_dirs->insert(dir_id).second);
+
+    vector<DirEntry> dir_entries;
+    TEST_AND_RETURN_FALSE(ReadDirectory(dir, &dir_entries));
+    for (const auto& dir_entry : dir_entries) {
+      const string path = prefix + dir_entry.name;
+      Inode inode;
+      TEST_AND_RETURN_FALSE(ReadInode(dir_entry.inode_ref, &inode));
+      if (inode.is_dir) {
+        TEST_AND_RETURN_FALSE(
+            WalkDirectory(inode, path + "/", visited_dirs, entries));
+      } else if (inode.is_file) {
+        entries->push_back(
+            {path, inode.blocks_start, std::move(inode.block_sizes)});
+      }
+    }
+    return true;
+  }
+
+  bool ReadFragment(uint32_t index, Fragment* fragment) {
+    TEST_AND_RETURN_FALSE(index < sb_.fragment_entry_count);
+    // The fragment table is a list of the positions of the metadata blocks
+    // holding the fragment entries.
+    const uint64_t entries_per_block = kMetadataBlockSize / kFragmentEntrySize;
+    uint64_t block_pos;
+    const uint64_t index_pos = sb_.fragment_table_start +
+                               index / entries_per_block * sizeof(block_pos);
+    TEST_AND_RETURN_FALSE(
+        ReadImage(index_pos, sizeof(block_pos), &block_pos));
+    MetadataCursor cursor(
+        this, block_pos, index % entries_per_block * kFragmentEntrySize);
+    uint32_t unused;
+    TEST_AND_RETURN_FALSE(cursor.Read(&fragment->start) &&
+                          cursor.Read(&fragment->size) &&
+                          cursor.Read(&unused));
+    return true;
+  }
+
+  const int fd_;
+  const uint64_t image_size_;
+  const SquashfsSuperBlock sb_;
+  // The metadata blocks already read, by their position in the image.
+  std::map<uint64_t, MetadataBlock> metadata_blocks_;
+};
+
 bool GetFileMapContent(const string& sqfs_path, string* map) {
   ScopedTempFile map_file("squashfs_file_map.XXXXXX");
   // Run unsquashfs to get the system file map.
@@ -131,19 +578,8 @@ bool GetUpdateEngineConfig(const std::string& sqfs_path, string* config) {
 
 }  // namespace
 
-bool SquashfsFilesystem::Init(const string& map,
-                              const string& sqfs_path,
-                              size_t size,
-                              const SquashfsHeader& header,
-                              bool extract_deflates) {
-  size_ = size;
-
-  bool is_zlib = header.compression_type == kSquashfsZlibCompression;
-  if (!is_zlib) {
-    LOG(WARNING) << "Filesystem is not Gzipped. Not filling deflates!";
-  }
-  vector<puffin::ByteExtent> zlib_blks;
-
+bool SquashfsFilesystem::ParseFileMap(const string& map,
+                                      vector<FileMapEntry>* entries) {
   // Reading files map. For the format of the file map look at the comments for
   // |CreateFromFileMap()|.
   auto lines = base::SplitStringPiece(map,
@@ -158,13 +594,37 @@ bool SquashfsFilesystem::Init(const string& map,
                                base::SplitResult::SPLIT_WANT_NONEMPTY);
     // Only filename is invalid.
     TEST_AND_RETURN_FALSE(splits.size() > 1);
-    uint64_t start;
-    TEST_AND_RETURN_FALSE(base::StringToUint64(splits[1], &start));
+    FileMapEntry entry;
+    entry.name = splits[0].as_string();
+    TEST_AND_RETURN_FALSE(base::StringToUint64(splits[1], &entry.start));
+    for (size_t i = 2; i < splits.size(); ++i) {
+      uint32_t blk_size;
+      TEST_AND_RETURN_FALSE(base::StringToUint(splits[i], &blk_size));
+      entry.block_sizes.push_back(blk_size);
+    }
+    entries->push_back(std::move(entry));
+  }
+  return true;
+}
+
+bool SquashfsFilesystem::Init(const vector<FileMapEntry>& entries,
+                              const string& sqfs_path,
+                              size_t size,
+                              const SquashfsHeader& header,
+                              bool extract_deflates) {
+  size_ = size;
+
+  bool is_zlib = header.compression_type == kSquashfsZlibCompression;
+  if (!is_zlib) {
+    LOG(WARNING) << "Filesystem is not Gzipped. Not filling deflates!";
+  }
+  vector<puffin::ByteExtent> zlib_blks;
+
+  for (const auto& entry : entries) {
+    const uint64_t start = entry.start;
     uint64_t cur_offset = start;
     bool is_compressed = false;
-    for (size_t i = 2; i < splits.size(); ++i) {
-      uint64_t blk_size;
-      TEST_AND_RETURN_FALSE(base::StringToUint64(splits[i], &blk_size));
+    for (const uint64_t blk_size : entry.block_sizes) {
       // TODO(ahassani): For puffin push it into a proper list if uncompressed.
       auto new_blk_size = blk_size & ~kSquashfsCompressedBit;
       TEST_AND_RETURN_FALSE(new_blk_size <= header.block_size);
@@ -181,7 +641,7 @@ bool SquashfsFilesystem::Init(const string& map,
     // If size is zero do not add the file.
     if (cur_offset - start > 0) {
       File file;
-      file.name = splits[0].as_string();
+      file.name = entry.name;
       file.extents = {ExtentForBytes(kBlockSize, start, cur_offset - start)};
       file.is_compressed = is_compressed;
       files_.emplace_back(file);
@@ -317,22 +777,66 @@ unique_ptr<SquashfsFilesystem> SquashfsFilesystem::CreateFromFile(
     return nullptr;
   }
 
-  // Read the map file.
-  string filemap;
-  if (!GetFileMapContent(sqfs_path, &filemap)) {
-    LOG(ERROR) << "Failed to produce squashfs map file: " << sqfs_path;
+  const uint64_t image_size = sqfs_file->GetSize();
+  SquashfsSuperBlock super_block;
+  if (!ReadSquashfsSuperBlock(blob, &super_block)) {
     return nullptr;
   }
+  // The images compressed with a supported algorithm are read directly. The
+  // others still go through unsquashfs.
+  const bool read_natively =
+      SquashfsReader::IsSupported(header.compression_type);
+  int fd = -1;
+  ScopedFdCloser fd_closer(&fd);
+  std::unique_ptr<SquashfsReader> reader;
+  if (read_natively) {
+    fd = HANDLE_EINTR(open(sqfs_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd < 0) {
+      PLOG(ERROR) << "Unable to open " << sqfs_path << " for reading.";
+      return nullptr;
+    }
+    reader = std::make_unique<SquashfsReader>(fd, image_size, super_block);
+  }
+
+  vector<FileMapEntry> entries;
+  if (read_natively) {
+    if (!reader->ReadFileMap(&entries)) {
+      LOG(ERROR) << "Failed to read the files of squashfs image: " << sqfs_path;
+      return nullptr;
+    }
+  } else {
+    // Read the map file.
+    string filemap;
+    if (!GetFileMapContent(sqfs_path, &filemap)) {
+      LOG(ERROR) << "Failed to produce squashfs map file: " << sqfs_path;
+      return nullptr;
+    }
+    if (!ParseFileMap(filemap, &entries)) {
+      LOG(ERROR) << "Failed to parse squashfs map file of: " << sqfs_path;
+      return nullptr;
+    }
+  }
 
   unique_ptr<SquashfsFilesystem> sqfs(new SquashfsFilesystem());
-  if (!sqfs->Init(
-          filemap, sqfs_path, sqfs_file->GetSize(), header, extract_deflates)) {
+  if (!sqfs->Init(entries, sqfs_path, image_size, header, extract_deflates)) {
     LOG(ERROR) << "Failed to initialized the Squashfs file system";
     return nullptr;
   }
 
   if (load_settings) {
-    if (!GetUpdateEngineConfig(sqfs_path, &sqfs->update_engine_config_)) {
+    if (read_natively) {
+      if (!reader->ReadFileContent(kUpdateEngineConf,
+                                   &sqfs->update_engine_config_)) {
+        LOG(ERROR) << "Failed to read " << kUpdateEngineConf << " from "
+                   << sqfs_path;
+        return nullptr;
+      }
+      if (sqfs->update_engine_config_.empty()) {
+        LOG(ERROR) << "update_engine config file was empty!!";
+        return nullptr;
+      }
+    } else if (!GetUpdateEngineConfig(sqfs_path,
+                                      &sqfs->update_engine_config_)) {
       return nullptr;
     }
   }
@@ -347,8 +851,13 @@ unique_ptr<SquashfsFilesystem> SquashfsFilesystem::CreateFromFileMap(
     return nullptr;
   }
 
+  vector<FileMapEntry> entries;
+  if (!ParseFileMap(filemap, &entries)) {
+    LOG(ERROR) << "Failed to parse the squashfs filemap";
+    return nullptr;
+  }
   unique_ptr<SquashfsFilesystem> sqfs(new SquashfsFilesystem());
-  if (!sqfs->Init(filemap, "", size, header, false)) {
+  if (!sqfs->Init(entries, "", size, header, false)) {
     LOG(ERROR) << "Failed to initialize the Squashfs file system using filemap";
     return nullptr;
   }
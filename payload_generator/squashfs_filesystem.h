@@ -53,11 +53,20 @@ class SquashfsFilesystem : public FilesystemInterface {
     uint16_t major_version;
   };
 
+  // A line of the file map described in |CreateFromFileMap()|.
+  struct FileMapEntry {
+    std::string name;
+    uint64_t start;
+    std::vector<uint32_t> block_sizes;
+  };
+
   ~SquashfsFilesystem() override = default;
 
   // Creates the file system from the Squashfs file itself. If
   // |extract_deflates| is true, it will process files to find location of all
-  // deflate streams.
+  // deflate streams. Images compressed with gzip, xz or lz4 are parsed in
+  // process, so several can be read concurrently; the others need the
+  // `unsquashfs -m` of Chrome OS.
   static std::unique_ptr<SquashfsFilesystem> CreateFromFile(
       const std::string& sqfs_path, bool extract_deflates, bool load_settings);
 
@@ -100,8 +109,12 @@ class SquashfsFilesystem : public FilesystemInterface {
  private:
   SquashfsFilesystem() = default;
 
+  // Parses the file map |map| into |entries|.
+  static bool ParseFileMap(const std::string& map,
+                           std::vector<FileMapEntry>* entries);
+
   // Initialize and populates the files in the file system.
-  bool Init(const std::string& map,
+  bool Init(const std::vector<FileMapEntry>& entries,
             const std::string& sqfs_path,
             size_t size,
             const SquashfsHeader& header,
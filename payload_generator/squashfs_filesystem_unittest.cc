@@ -68,6 +68,94 @@ SquashfsFilesystem::SquashfsHeader GetSimpleHeader() {
   };
 }
 
+// Appends |value| to |blob| in little endian.
+template <typename T>
+void Append(brillo::Blob* blob, T value) {
+  const auto bytes = reinterpret_cast<const uint8_t*>(&value);
+  blob->insert(blob->end(), bytes, bytes + sizeof(value));
+}
+
+void AppendString(brillo::Blob* blob, const string& str) {
+  blob->insert(blob->end(), str.begin(), str.end());
+}
+
+// Builds a squashfs image with |content| in etc/update_engine.conf, stored in
+// one uncompressed block at 4096. The metadata blocks are stored uncompressed
+// too, so the image doesn't depend on a compressor.
+brillo::Blob BuildSimpleImage(const string& content) {
+  constexpr uint64_t kInodeTableStart = 2 * kTestBlockSize;
+  // The inode table: the root directory, etc/ and etc/update_engine.conf,
+  // at the offsets 0, 32 and 64 of its only metadata block.
+  brillo::Blob inodes;
+  auto append_dir_inode = [&inodes](uint16_t dir_offset, uint16_t dir_size) {
+    Append<uint16_t>(&inodes, 1);                // type: directory
+    inodes.resize(inodes.size() + 14);           // mode, uid, gid, mtime, ino
+    Append<uint32_t>(&inodes, 0);                // directory block
+    Append<uint32_t>(&inodes, 2);                // nlink
+    Append<uint16_t>(&inodes, dir_size + 3);     // file size
+    Append<uint16_t>(&inodes, dir_offset);       // directory offset
+    Append<uint32_t>(&inodes, 1);                // parent inode
+  };
+  // The directory table: the entries of the root and of etc/, at the offsets
+  // 0 and 23 of its only metadata block.
+  brillo::Blob dirs;
+  auto append_dir = [&dirs](uint16_t inode_offset,
+                            uint16_t type,
+                            const string& name) {
+    Append<uint32_t>(&dirs, 0);  // count - 1
+    Append<uint32_t>(&dirs, 0);  // inode metadata block
+    Append<uint32_t>(&dirs, 1);  // base inode number
+    Append<uint16_t>(&dirs, inode_offset);
+    Append<int16_t>(&dirs, 0);
+    Append<uint16_t>(&dirs, type);
+    Append<uint16_t>(&dirs, name.size() - 1);
+    AppendString(&dirs, name);
+  };
+  append_dir(32, 1, "etc");
+  append_dir(64, 2, "update_engine.conf");
+  append_dir_inode(0, 23);
+  append_dir_inode(23, 38);
+  Append<uint16_t>(&inodes, 2);                  // type: regular file
+  inodes.resize(inodes.size() + 14);
+  Append<uint32_t>(&inodes, kTestBlockSize);     // blocks start
+  Append<uint32_t>(&inodes, 0xffffffff);         // no fragment
+  Append<uint32_t>(&inodes, 0);                  // fragment offset
+  Append<uint32_t>(&inodes, content.size());     // file size
+  Append<uint32_t>(&inodes, content.size() | (1 << 24));
+
+  brillo::Blob image;
+  Append<uint32_t>(&image, 0x73717368);          // magic
+  Append<uint32_t>(&image, 3);                   // inode count
+  Append<uint32_t>(&image, 0);                   // mtime
+  Append<uint32_t>(&image, kTestBlockSize);      // block size
+  Append<uint32_t>(&image, 0);                   // fragment count
+  Append<uint16_t>(&image, 1);                   // compression: gzip
+  Append<uint16_t>(&image, 12);                  // block log
+  Append<uint16_t>(&image, 0);                   // flags
+  Append<uint16_t>(&image, 1);                   // id count
+  Append<uint16_t>(&image, 4);                   // major version
+  Append<uint16_t>(&image, 0);                   // minor version
+  Append<uint64_t>(&image, 0);                   // root inode
+  const uint64_t dir_table_start = kInodeTableStart + 2 + inodes.size();
+  const uint64_t bytes_used = dir_table_start + 2 + dirs.size();
+  Append<uint64_t>(&image, bytes_used);
+  Append<uint64_t>(&image, ~0ULL);               // id table
+  Append<uint64_t>(&image, ~0ULL);               // xattr table
+  Append<uint64_t>(&image, kInodeTableStart);
+  Append<uint64_t>(&image, dir_table_start);
+  Append<uint64_t>(&image, ~0ULL);               // fragment table
+  Append<uint64_t>(&image, ~0ULL);               // export table
+
+  image.resize(kTestBlockSize);
+  AppendString(&image, content);
+  image.resize(kInodeTableStart);
+  Append<uint16_t>(&image, inodes.size() | 0x8000);
+  image.insert(image.end(), inodes.begin(), inodes.end());
+  Append<uint16_t>(&image, dirs.size() | 0x8000);
+  image.insert(image.end(), dirs.begin(), dirs.end());
+  image.resize(3 * kTestBlockSize);
+  return image;
+}
 }  // namespace
 
 class SquashfsFilesystemTest : public ::testing::Test {
@@ -108,7 +196,7 @@ class SquashfsFilesystemTest : public ::testing::Test {
   }
 };
 
-// CreateFromFile() depends on unsquashfs -m, which only exists in Chrome OS.
+// The sample squashfs images are only generated in Chrome OS.
 #ifdef __CHROMEOS__
 TEST_F(SquashfsFilesystemTest, EmptyFilesystemTest) {
   unique_ptr<SquashfsFilesystem> fs = SquashfsFilesystem::CreateFromFile(
@@ -296,6 +384,45 @@ TEST_F(SquashfsFilesystemTest, FailLargerThanBlockSizeTest) {
   EXPECT_FALSE(fs);
 }
 
+TEST_F(SquashfsFilesystemTest, NativeParsingTest) {
+  ScopedTempFile image_file("SquashfsFilesystemTest-XXXXXX");
+  const string config = "PAYLOAD_MINOR_VERSION=1234\n";
+  ASSERT_TRUE(utils::WriteFile(
+      image_file.path().c_str(), BuildSimpleImage(config).data(), 3 * 4096));
+  unique_ptr<SquashfsFilesystem> fs =
+      SquashfsFilesystem::CreateFromFile(image_file.path(), false, true);
+  CheckSquashfs(fs);
+
+  vector<FilesystemInterface::File> files;
+  ASSERT_TRUE(fs->GetFiles(&files));
+  ASSERT_EQ(3u, files.size());
+  EXPECT_EQ("<metadata-0>", files[0].name);
+  EXPECT_EQ("etc/update_engine.conf", files[1].name);
+  EXPECT_EQ(vector<Extent>{ExtentForRange(1, 1)}, files[1].extents);
+  EXPECT_FALSE(files[1].is_compressed);
+  EXPECT_EQ("<metadata-1>", files[2].name);
+
+  brillo::KeyValueStore kvs;
+  EXPECT_TRUE(fs->LoadSettings(&kvs));
+  string minor_version;
+  EXPECT_TRUE(kvs.GetString("PAYLOAD_MINOR_VERSION", &minor_version));
+  EXPECT_EQ("1234", minor_version);
+}
+
+TEST_F(SquashfsFilesystemTest, NativeParsingCorruptedTest) {
+  ScopedTempFile image_file("SquashfsFilesystemTest-XXXXXX");
+  brillo::Blob image = BuildSimpleImage("A=1\n");
+  // Point the entry of etc/update_engine.conf to the root directory inode,
+  // making a loop. The entry is after the 100 bytes of inodes, the 23 bytes
+  // of entries of the root and the 12 bytes of header of etc/.
+  image[2 * kTestBlockSize + 2 + 100 + 2 + 23 + 12] = 0;
+  image[2 * kTestBlockSize + 2 + 100 + 2 + 23 + 12 + 4] = 1;
+  ASSERT_TRUE(
+      utils::WriteFile(image_file.path().c_str(), image.data(), image.size()));
+  EXPECT_FALSE(
+      SquashfsFilesystem::CreateFromFile(image_file.path(), false, false));
+}
+
 // Test is squashfs image.
 TEST_F(SquashfsFilesystemTest, IsSquashfsImageTest) {
   // Some sample from a recent squashfs file.
@@ -0,0 +1,156 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/task_scheduler.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_generator/delta_diff_utils.h"
+
+namespace chromeos_update_engine {
+
+TaskScheduler::TaskScheduler(size_t num_threads) {
+  num_threads = std::max<size_t>(num_threads, 1);
+  threads_.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; i++) {
+    threads_.emplace_back(&TaskScheduler::WorkerLoop, this);
+  }
+}
+
+TaskScheduler::~TaskScheduler() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  state_changed_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+TaskScheduler* TaskScheduler::Get() {
+  static TaskScheduler* scheduler =
+      new TaskScheduler(diff_utils::GetMaxThreads());
+  return scheduler;
+}
+
+void TaskScheduler::set_memory_budget(uint64_t bytes) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    memory_budget_ = bytes;
+  }
+  state_changed_.notify_all();
+}
+
+bool TaskScheduler::FitsMemoryBudget(uint64_t memory) const {
+  // A task larger than the whole budget runs alone.
+  return memory == 0 || memory_budget_ == 0 || memory_in_use_ == 0 ||
+         memory_in_use_ + memory <= memory_budget_;
+}
+
+void TaskScheduler::Post(TaskGroup* group,
+                         Task task,
+                         uint64_t priority,
+                         uint64_t memory) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const TaskKey key{priority, next_sequence_++};
+    queue_.emplace(key, QueuedTask{std::move(task), group, memory});
+    group->queued_tasks_.insert(key);
+    group->pending_tasks_++;
+  }
+  state_changed_.notify_all();
+}
+
+void TaskScheduler::Wait(TaskGroup* group) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (group->pending_tasks_ > 0) {
+    auto it = queue_.end();
+    for (const TaskKey& key : group->queued_tasks_) {
+      auto queued = queue_.find(key);
+      if (FitsMemoryBudget(queued->second.memory)) {
+        it = queued;
+        break;
+      }
+    }
+    if (it == queue_.end()) {
+      // The rest of the group is running on other threads, or waits for
+      // memory.
+      state_changed_.wait(lock);
+      continue;
+    }
+    RunTask(it, &lock);
+  }
+}
+
+void TaskScheduler::RunTask(std::map<TaskKey, QueuedTask>::iterator it,
+                            std::unique_lock<std::mutex>* lock) {
+  CHECK(it != queue_.end());
+  TaskGroup* group = it->second.group;
+  Task task = std::move(it->second.task);
+  const uint64_t memory = it->second.memory;
+  group->queued_tasks_.erase(it->first);
+  queue_.erase(it);
+  memory_in_use_ += memory;
+
+  lock->unlock();
+  task();
+  lock->lock();
+
+  memory_in_use_ -= memory;
+  group->pending_tasks_--;
+  state_changed_.notify_all();
+}
+
+void TaskScheduler::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    auto it = queue_.end();
+    state_changed_.wait(lock, [this, &it] {
+      for (it = queue_.begin(); it != queue_.end(); ++it) {
+        if (FitsMemoryBudget(it->second.memory)) {
+          return true;
+        }
+      }
+      return stopping_ && queue_.empty();
+    });
+    if (it == queue_.end()) {
+      return;
+    }
+    RunTask(it, &lock);
+  }
+}
+
+TaskGroup::TaskGroup(TaskScheduler* scheduler) : scheduler_(scheduler) {}
+
+TaskGroup::~TaskGroup() {
+  Wait();
+}
+
+void TaskGroup::Post(TaskScheduler::Task task,
+                     uint64_t priority,
+                     uint64_t memory) {
+  scheduler_->Post(this, std::move(task), priority, memory);
+}
+
+void TaskGroup::Wait() {
+  scheduler_->Wait(this);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,143 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_TASK_SCHEDULER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_TASK_SCHEDULER_H_
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+class TaskGroup;
+
+// A set of worker threads running the tasks of all the TaskGroups in the
+// process. Queued tasks start in order of decreasing priority, then in the
+// order they were posted, regardless of their group. A thread waiting for a
+// group runs the queued tasks of that group meanwhile, so a task can post more
+// tasks and wait for them (e.g. a partition waiting for its files) without
+// holding up a worker thread or starting a thread pool of its own.
+//
+// With a memory budget, a task only starts if the memory estimates of the
+// running tasks leave room for its own, or if no task with an estimate is
+// running: the next queued tasks which fit, usually smaller ones, run
+// meanwhile. A task with an estimate must not wait for other tasks with one.
+class TaskScheduler {
+ public:
+  using Task = std::function<void()>;
+
+  explicit TaskScheduler(size_t num_threads);
+  // Runs the queued tasks and joins the workers. All the groups must be done.
+  ~TaskScheduler();
+
+  // The scheduler shared by the whole payload generation, with
+  // diff_utils::GetMaxThreads() workers. Never destroyed.
+  static TaskScheduler* Get();
+
+  size_t num_threads() const { return threads_.size(); }
+
+  // The most memory, in bytes, the estimates of the running tasks add up to,
+  // or 0 for no limit.
+  void set_memory_budget(uint64_t bytes);
+
+ private:
+  friend class TaskGroup;
+
+  // Orders the queued tasks: the first one is the next to run.
+  struct TaskKey {
+    bool operator<(const TaskKey& other) const {
+      return priority != other.priority ? priority > other.priority
+                                        : sequence < other.sequence;
+    }
+    uint64_t priority;
+    uint64_t sequence;
+  };
+  struct QueuedTask {
+    Task task;
+    TaskGroup* group;
+    uint64_t memory;
+  };
+
+  void Post(TaskGroup* group, Task task, uint64_t priority, uint64_t memory);
+  // Blocks until |group| has no task queued or running, running its queued
+  // tasks on the calling thread.
+  void Wait(TaskGroup* group);
+
+  // Whether a task with a memory estimate of |memory| can start now.
+  bool FitsMemoryBudget(uint64_t memory) const;
+
+  // Removes the task at |it| from the queue and runs it with |lock| released.
+  void RunTask(std::map<TaskKey, QueuedTask>::iterator it,
+               std::unique_lock<std::mutex>* lock);
+  void WorkerLoop();
+
+  std::mutex mutex_;
+  // Signaled when a task is queued or finishes, or the scheduler is stopping.
+  std::condition_variable state_changed_;
+  std::map<TaskKey, QueuedTask> queue_;
+  uint64_t next_sequence_{0};
+  bool stopping_{false};
+  uint64_t memory_budget_{0};
+  // The sum of the memory estimates of the running tasks.
+  uint64_t memory_in_use_{0};
+
+  std::vector<std::thread> threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(TaskScheduler);
+};
+
+// Tasks posted together so they can be waited for, e.g. the files of one
+// partition.
+class TaskGroup {
+ public:
+  explicit TaskGroup(TaskScheduler* scheduler = TaskScheduler::Get());
+  // Waits for the tasks of the group.
+  ~TaskGroup();
+
+  // Queues |task|. Tasks with a higher |priority| start first, so expensive
+  // tasks should have a higher one to not be left alone running at the end.
+  // |memory| is the estimate of the most memory the task uses, in bytes,
+  // checked against the scheduler's memory budget.
+  void Post(TaskScheduler::Task task,
+            uint64_t priority = 0,
+            uint64_t memory = 0);
+
+  // Blocks until every task posted to the group finished, helping run them.
+  void Wait();
+
+ private:
+  friend class TaskScheduler;
+
+  TaskScheduler* scheduler_;
+  // The tasks of this group still in the scheduler queue, the first one is the
+  // next to run. Guarded by the scheduler's mutex, as |pending_tasks_|.
+  std::set<TaskScheduler::TaskKey> queued_tasks_;
+  // Queued and running tasks.
+  size_t pending_tasks_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(TaskGroup);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_TASK_SCHEDULER_H_
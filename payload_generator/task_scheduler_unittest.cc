@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/task_scheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(TaskSchedulerTest, RunsAllTasksTest) {
+  TaskScheduler scheduler(4);
+  std::atomic<int> counter{0};
+  TaskGroup group(&scheduler);
+  for (int i = 0; i < 100; i++) {
+    group.Post([&counter] { counter++; });
+  }
+  group.Wait();
+  ASSERT_EQ(100, counter);
+}
+
+TEST(TaskSchedulerTest, HigherPriorityStartsFirstTest) {
+  TaskScheduler scheduler(1);
+  TaskGroup group(&scheduler);
+  // Keep the only worker busy until every task is queued.
+  std::atomic<bool> started{false};
+  std::atomic<bool> release{false};
+  group.Post([&] {
+    started = true;
+    while (!release) {
+      std::this_thread::yield();
+    }
+  });
+  while (!started) {
+    std::this_thread::yield();
+  }
+  std::vector<int> order;
+  std::atomic<size_t> done{0};
+  for (int priority : {0, 2, 3, 1, 2}) {
+    group.Post(
+        [&order, &done, priority] {
+          order.push_back(priority);
+          done++;
+        },
+        priority);
+  }
+  release = true;
+  // Let the worker run all of them, without helping from this thread.
+  while (done < 5) {
+    std::this_thread::yield();
+  }
+  group.Wait();
+  ASSERT_EQ((std::vector<int>{3, 2, 2, 1, 0}), order);
+}
+
+TEST(TaskSchedulerTest, NestedGroupsTest) {
+  // Every worker runs a task waiting for tasks of its own, which only the
+  // waiting threads can run.
+  TaskScheduler scheduler(2);
+  std::atomic<int> counter{0};
+  TaskGroup outer(&scheduler);
+  for (int i = 0; i < 4; i++) {
+    outer.Post([&scheduler, &counter] {
+      TaskGroup inner(&scheduler);
+      for (int j = 0; j < 10; j++) {
+        inner.Post([&counter] { counter++; });
+      }
+      inner.Wait();
+    });
+  }
+  outer.Wait();
+  ASSERT_EQ(40, counter);
+}
+
+TEST(TaskSchedulerTest, MemoryBudgetTest) {
+  TaskScheduler scheduler(4);
+  scheduler.set_memory_budget(100);
+  std::mutex mutex;
+  uint64_t memory_in_use = 0, max_memory_in_use = 0;
+  std::atomic<int> counter{0};
+  auto task = [&](uint64_t memory) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      memory_in_use += memory;
+      max_memory_in_use = std::max(max_memory_in_use, memory_in_use);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      memory_in_use -= memory;
+    }
+    counter++;
+  };
+  TaskGroup group(&scheduler);
+  // The task over the budget runs alone, the small ones fill the gaps left
+  // by the large ones.
+  group.Post([&task] { task(150); }, 3, 150);
+  for (int i = 0; i < 10; i++) {
+    group.Post([&task] { task(60); }, 2, 60);
+    group.Post([&task] { task(10); }, 1, 10);
+  }
+  group.Wait();
+  EXPECT_EQ(21, counter);
+  EXPECT_EQ(150u, max_memory_in_use);
+
+  // Tasks without an estimate aren't held back.
+  group.Post([&task] { task(100); }, 1, 100);
+  group.Post([&task] { task(0); });
+  group.Wait();
+  EXPECT_EQ(23, counter);
+}
+
+}  // namespace chromeos_update_engine
@@ -17,17 +17,28 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_XZ_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_XZ_H_
 
+#include <string_view>
+
 #include <brillo/secure_blob.h>
 
+#include "update_engine/common/utils.h"
+
 namespace chromeos_update_engine {
 
 // Initialize the xz compression unit. Call once before any call to
 // XzCompress().
 void XzCompressInit();
 
+// Inputs of at least this size are compressed with more than one thread.
+constexpr size_t kXzMultiThreadMinSize = 4 * 1024 * 1024;  // 4 MiB
+
 // Compresses the input buffer |in| into |out| with xz. The compressed stream
 // will be the equivalent of running xz -9 --check=none
-bool XzCompress(const brillo::Blob& in, brillo::Blob* out);
+bool XzCompress(std::string_view in, brillo::Blob* out);
+
+inline bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
+  return XzCompress(ToStringView(in), out);
+}
 
 }  // namespace chromeos_update_engine
 
@@ -30,9 +30,10 @@ namespace {
 
 bool xz_initialized = false;
 
-// An ISeqInStream implementation that reads all the data from the passed Blob.
+// An ISeqInStream implementation that reads all the data from the passed
+// buffer.
 struct BlobReaderStream : public ISeqInStream {
-  explicit BlobReaderStream(const brillo::Blob& data) : data_(data) {
+  explicit BlobReaderStream(std::string_view data) : data_(data) {
     Read = &BlobReaderStream::ReadStatic;
   }
 
@@ -44,7 +45,7 @@ struct BlobReaderStream : public ISeqInStream {
     return SZ_OK;
   }
 
-  const brillo::Blob& data_;
+  std::string_view data_;
 
   // The current reader position.
   size_t pos_ = 0;
@@ -70,7 +71,7 @@ struct BlobWriterStream : public ISeqOutStream {
 
 // Returns the filter id to be used to compress |data|.
 // Only BCJ filter for x86 and ARM ELF file are supported, returns 0 otherwise.
-int GetFilterID(const brillo::Blob& data) {
+int GetFilterID(std::string_view data) {
   if (data.size() < sizeof(Elf32_Ehdr) ||
       memcmp(data.data(), ELFMAG, SELFMAG) != 0)
     return 0;
@@ -113,7 +114,7 @@ void XzCompressInit() {
   CrcGenerateTable();
 }
 
-bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
+bool XzCompress(std::string_view in, brillo::Blob* out) {
   CHECK(xz_initialized) << "Initialize XzCompress first";
   out->clear();
   if (in.empty())
@@ -133,7 +134,9 @@ bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
   // LZMA compression "level 6" requires 9 MB of RAM to decompress in the worst
   // case.
   lzma2Props.lzmaProps.level = 6;
-  lzma2Props.lzmaProps.numThreads = 1;
+  // Large inputs run the match finder on its own thread, which doesn't change
+  // the compressed stream.
+  lzma2Props.lzmaProps.numThreads = in.size() >= kXzMultiThreadMinSize ? 2 : 1;
   // The input size data is used to reduce the dictionary size if possible.
   lzma2Props.lzmaProps.reduceSize = in.size();
   Lzma2EncProps_Normalize(&lzma2Props);
@@ -16,28 +16,72 @@
 
 #include "update_engine/payload_generator/xz.h"
 
+#include <algorithm>
+
 #include <base/logging.h>
 #include <lzma.h>
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Compresses |in| with liblzma's multi-threaded encoder, which splits the
+// input in independently compressed xz blocks.
+bool XzCompressMultiThreaded(std::string_view in,
+                             uint32_t preset,
+                             brillo::Blob* out) {
+  lzma_mt mt_options = {};
+  mt_options.threads = std::max(lzma_cputhreads(), 1u);
+  mt_options.preset = preset;
+  mt_options.check = LZMA_CHECK_NONE;
+
+  lzma_stream stream = LZMA_STREAM_INIT;
+  int rc = lzma_stream_encoder_mt(&stream, &mt_options);
+  if (rc != LZMA_OK) {
+    LOG(ERROR) << "Failed to initialize the LZMA encoder with return code: "
+               << rc;
+    return false;
+  }
+  out->resize(lzma_stream_buffer_bound(in.size()));
+  stream.next_in = reinterpret_cast<const uint8_t*>(in.data());
+  stream.avail_in = in.size();
+  stream.next_out = out->data();
+  stream.avail_out = out->size();
+  do {
+    rc = lzma_code(&stream, LZMA_FINISH);
+  } while (rc == LZMA_OK && stream.avail_out > 0);
+  out->resize(stream.total_out);
+  lzma_end(&stream);
+  if (rc != LZMA_STREAM_END) {
+    LOG(ERROR) << "Failed to compress data to LZMA stream with return code: "
+               << rc;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
 void XzCompressInit() {}
 
-bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
+bool XzCompress(std::string_view in, brillo::Blob* out) {
   out->clear();
   if (in.empty())
     return true;
 
+  const uint32_t kLzmaPreset = 6;
+  if (in.size() >= kXzMultiThreadMinSize)
+    return XzCompressMultiThreaded(in, kLzmaPreset, out);
+
   // Resize the output buffer to get enough memory for writing the compressed
   // data.
   out->resize(lzma_stream_buffer_bound(in.size()));
 
-  const uint32_t kLzmaPreset = 6;
   size_t out_pos = 0;
   int rc = lzma_easy_buffer_encode(kLzmaPreset,
                                    LZMA_CHECK_NONE,  // We do not need CRC.
                                    nullptr,
-                                   in.data(),
+                                   reinterpret_cast<const uint8_t*>(in.data()),
                                    in.size(),
                                    out->data(),
                                    &out_pos,
@@ -0,0 +1,125 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/zstd.h"
+
+#include <zdict.h>
+#include <zstd.h>
+
+#include <memory>
+#include <utility>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr int kZstdCompressionLevel = 19;
+
+// Inputs of at least this size are compressed with more than one thread.
+constexpr size_t kZstdMultiThreadMinSize = 4 * 1024 * 1024;  // 4 MiB
+
+struct CctxDeleter {
+  void operator()(ZSTD_CCtx* p) { ZSTD_freeCCtx(p); }
+};
+
+bool CheckZstd(size_t ret, const char* what) {
+  if (ZSTD_isError(ret)) {
+    LOG(ERROR) << what << " failed: " << ZSTD_getErrorName(ret);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+std::unique_ptr<ZstdDictionary> ZstdDictionary::Train(
+    const std::vector<brillo::Blob>& samples, size_t max_size) {
+  brillo::Blob samples_buffer;
+  std::vector<size_t> sample_sizes;
+  for (const brillo::Blob& sample : samples) {
+    samples_buffer.insert(samples_buffer.end(), sample.begin(), sample.end());
+    sample_sizes.push_back(sample.size());
+  }
+  brillo::Blob data(max_size);
+  const size_t size = ZDICT_trainFromBuffer(data.data(),
+                                            data.size(),
+                                            samples_buffer.data(),
+                                            sample_sizes.data(),
+                                            sample_sizes.size());
+  if (ZDICT_isError(size)) {
+    LOG(WARNING) << "Unable to train a zstd dictionary on " << samples.size()
+                 << " samples: " << ZDICT_getErrorName(size);
+    return nullptr;
+  }
+  data.resize(size);
+  return Load(std::move(data));
+}
+
+std::unique_ptr<ZstdDictionary> ZstdDictionary::Load(brillo::Blob data) {
+  ZSTD_CDict* cdict =
+      ZSTD_createCDict(data.data(), data.size(), kZstdCompressionLevel);
+  if (cdict == nullptr) {
+    LOG(ERROR) << "Unable to load a zstd dictionary of " << data.size()
+               << " bytes.";
+    return nullptr;
+  }
+  return std::unique_ptr<ZstdDictionary>(
+      new ZstdDictionary(std::move(data), cdict));
+}
+
+ZstdDictionary::~ZstdDictionary() {
+  ZSTD_freeCDict(cdict_);
+}
+
+bool ZstdCompress(std::string_view in,
+                  brillo::Blob* out,
+                  const ZstdDictionary* dictionary) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in.size() == 0)
+    return true;
+
+  std::unique_ptr<ZSTD_CCtx, CctxDeleter> cctx(ZSTD_createCCtx());
+  TEST_AND_RETURN_FALSE(cctx != nullptr);
+  TEST_AND_RETURN_FALSE(CheckZstd(
+      ZSTD_CCtx_setParameter(
+          cctx.get(), ZSTD_c_compressionLevel, kZstdCompressionLevel),
+      "Setting the zstd compression level"));
+  TEST_AND_RETURN_FALSE(
+      CheckZstd(ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_checksumFlag, 0),
+                "Disabling the zstd checksum"));
+  if (dictionary) {
+    TEST_AND_RETURN_FALSE(
+        CheckZstd(ZSTD_CCtx_refCDict(cctx.get(), dictionary->cdict()),
+                  "Referencing the zstd dictionary"));
+  }
+  if (in.size() >= kZstdMultiThreadMinSize) {
+    // Large inputs are compressed in jobs run by two worker threads. This is
+    // ignored when libzstd is built without multi-threading, so the error is.
+    ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_nbWorkers, 2);
+  }
+
+  out->resize(ZSTD_compressBound(in.size()));
+  const size_t size = ZSTD_compress2(
+      cctx.get(), out->data(), out->size(), in.data(), in.size());
+  TEST_AND_RETURN_FALSE(CheckZstd(size, "ZSTD_compress2"));
+  out->resize(size);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
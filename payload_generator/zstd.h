@@ -0,0 +1,77 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_ZSTD_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_ZSTD_H_
+
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <zstd.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+// A zstd dictionary trained on samples of the data of a partition, shipped
+// once in its PartitionUpdate, which small blobs of similar data compress
+// much better against than on their own.
+class ZstdDictionary {
+ public:
+  // Trains a dictionary of at most |max_size| bytes on |samples|. Returns
+  // nullptr if there isn't enough to train one on.
+  static std::unique_ptr<ZstdDictionary> Train(
+      const std::vector<brillo::Blob>& samples, size_t max_size);
+
+  // Loads the already trained dictionary |data|.
+  static std::unique_ptr<ZstdDictionary> Load(brillo::Blob data);
+
+  ~ZstdDictionary();
+
+  const brillo::Blob& data() const { return data_; }
+  // The dictionary digested for compression, shared by all the compressions.
+  const ZSTD_CDict* cdict() const { return cdict_; }
+
+ private:
+  ZstdDictionary(brillo::Blob data, ZSTD_CDict* cdict)
+      : data_(std::move(data)), cdict_(cdict) {}
+
+  brillo::Blob data_;
+  ZSTD_CDict* cdict_;
+
+  DISALLOW_COPY_AND_ASSIGN(ZstdDictionary);
+};
+
+// Compresses the input buffer |in| into |out| with zstd. The compressed frame
+// will be the equivalent of running zstd -19 --no-check, which stays within
+// the window size accepted by ZstdExtentWriter. With a |dictionary|, the
+// frame can only be decompressed with the same one.
+bool ZstdCompress(std::string_view in,
+                  brillo::Blob* out,
+                  const ZstdDictionary* dictionary = nullptr);
+
+inline bool ZstdCompress(const brillo::Blob& in,
+                         brillo::Blob* out,
+                         const ZstdDictionary* dictionary = nullptr) {
+  return ZstdCompress(ToStringView(in), out, dictionary);
+}
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_ZSTD_H_
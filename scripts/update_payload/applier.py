@@ -44,6 +44,11 @@ except ImportError:
     from backports import lzma
   except ImportError:
     pass
+# Likewise, the zstandard module is only needed by REPLACE_ZSTD operations.
+try:
+  import zstandard
+except ImportError:
+  pass
 import os
 import subprocess
 import sys
@@ -52,6 +57,9 @@ import tempfile
 from update_payload import common
 from update_payload.error import PayloadError
 
+# The largest window the REPLACE_ZSTD frames may need, as on the device.
+_ZSTD_MAX_WINDOW_SIZE = 64 * 1024 * 1024
+
 #
 # Helper functions.
 #
@@ -228,8 +236,9 @@ class PayloadApplier(object):
     self.puffpatch_path = puffpatch_path or 'puffin'
     self.truncate_to_expected_size = truncate_to_expected_size
 
-  def _ApplyReplaceOperation(self, op, op_name, out_data, part_file, part_size):
-    """Applies a REPLACE{,_BZ,_XZ} operation.
+  def _ApplyReplaceOperation(self, op, op_name, out_data, part_file, part_size,
+                             zstd_dictionary=None):
+    """Applies a REPLACE{,_BZ,_XZ,_ZSTD} operation.
 
     Args:
       op: the operation object
@@ -237,6 +246,7 @@ class PayloadApplier(object):
       out_data: the data to be written
       part_file: the partition file object
       part_size: the size of the partition
+      zstd_dictionary: the zstd dictionary of the partition (optional)
 
     Raises:
       PayloadError if something goes wrong.
@@ -252,6 +262,16 @@ class PayloadApplier(object):
       # pylint: disable=no-member
       out_data = lzma.decompress(out_data)
       data_length = len(out_data)
+    elif op.type == common.OpType.REPLACE_ZSTD:
+      # pylint: disable=no-member
+      dict_data = (zstandard.ZstdCompressionDict(zstd_dictionary)
+                   if zstd_dictionary else None)
+      decompressor = zstandard.ZstdDecompressor(
+          dict_data=dict_data, max_window_size=_ZSTD_MAX_WINDOW_SIZE)
+      with decompressor.stream_reader(out_data,
+                                      read_across_frames=True) as reader:
+        out_data = reader.read()
+      data_length = len(out_data)
 
     # Write data to blocks specified in dst extents.
     data_start = 0
@@ -482,7 +502,7 @@ class PayloadApplier(object):
     os.remove(patch_file_name)
 
   def _ApplyOperations(self, operations, base_name, old_part_file,
-                       new_part_file, part_size):
+                       new_part_file, part_size, zstd_dictionary=None):
     """Applies a sequence of update operations to a partition.
 
     Args:
@@ -491,6 +511,7 @@ class PayloadApplier(object):
       old_part_file: the old partition file object, open for reading/writing
       new_part_file: the new partition file object, open for reading/writing
       part_size: the partition size
+      zstd_dictionary: the zstd dictionary of the partition (optional)
 
     Raises:
       PayloadError if anything goes wrong while processing the payload.
@@ -500,8 +521,9 @@ class PayloadApplier(object):
       data = self.payload.ReadDataBlob(op.data_offset, op.data_length)
 
       if op.type in (common.OpType.REPLACE, common.OpType.REPLACE_BZ,
-                     common.OpType.REPLACE_XZ):
-        self._ApplyReplaceOperation(op, op_name, data, new_part_file, part_size)
+                     common.OpType.REPLACE_XZ, common.OpType.REPLACE_ZSTD):
+        self._ApplyReplaceOperation(op, op_name, data, new_part_file, part_size,
+                                    zstd_dictionary)
       elif op.type == common.OpType.ZERO:
         self._ApplyZeroOperation(op, op_name, new_part_file)
       elif op.type == common.OpType.SOURCE_COPY:
@@ -517,7 +539,8 @@ class PayloadApplier(object):
 
   def _ApplyToPartition(self, operations, part_name, base_name,
                         new_part_file_name, new_part_info,
-                        old_part_file_name=None, old_part_info=None):
+                        old_part_file_name=None, old_part_info=None,
+                        zstd_dictionary=None):
     """Applies an update to a partition.
 
     Args:
@@ -528,6 +551,7 @@ class PayloadApplier(object):
       new_part_info: size and expected hash of dest partition
       old_part_file_name: file name of source partition (optional)
       old_part_info: size and expected hash of source partition (optional)
+      zstd_dictionary: the zstd dictionary of the partition (optional)
 
     Raises:
       PayloadError if anything goes wrong with the update.
@@ -551,7 +575,8 @@ class PayloadApplier(object):
                        if old_part_file_name else None)
       try:
         self._ApplyOperations(operations, base_name, old_part_file,
-                              new_part_file, new_part_info.size)
+                              new_part_file, new_part_info.size,
+                              zstd_dictionary)
       finally:
         if old_part_file:
           old_part_file.close()
@@ -586,6 +611,7 @@ class PayloadApplier(object):
     new_part_info = {}
     old_part_info = {}
     install_operations = []
+    zstd_dictionaries = {}
 
     manifest = self.payload.manifest
     for part in manifest.partitions:
@@ -593,6 +619,7 @@ class PayloadApplier(object):
       new_part_info[name] = part.new_partition_info
       old_part_info[name] = part.old_partition_info
       install_operations.append((name, part.operations))
+      zstd_dictionaries[name] = part.zstd_dictionary
 
     part_names = set(new_part_info.keys())  # Equivalently, old_part_info.keys()
 
@@ -618,4 +645,5 @@ class PayloadApplier(object):
       # Apply update to partition.
       self._ApplyToPartition(
           operations, name, '%s_install_operations' % name, new_parts[name],
-          new_part_info[name], old_parts.get(name, None), old_part_info[name])
+          new_part_info[name], old_parts.get(name, None), old_part_info[name],
+          zstd_dictionaries[name])
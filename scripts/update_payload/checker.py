@@ -31,6 +31,7 @@ import array
 import base64
 import collections
 import hashlib
+import heapq
 import itertools
 import os
 import subprocess
@@ -60,6 +61,9 @@ _TYPE_DELTA = 'delta'
 
 _DEFAULT_BLOCK_SIZE = 4096
 
+# The most decoded data of shared blobs the client keeps at once.
+_MAX_SHARED_BLOB_CACHE_SIZE = 64 * 1024 * 1024
+
 _DEFAULT_PUBKEY_BASE_NAME = 'update-payload-key.pub.pem'
 _DEFAULT_PUBKEY_FILE_NAME = os.path.join(os.path.dirname(__file__),
                                          _DEFAULT_PUBKEY_BASE_NAME)
@@ -73,6 +77,11 @@ _SUPPORTED_MINOR_VERSIONS = {
     5: (_TYPE_DELTA,),
     6: (_TYPE_DELTA,),
     7: (_TYPE_DELTA,),
+    8: (_TYPE_DELTA,),
+    9: (_TYPE_DELTA,),
+    10: (_TYPE_DELTA,),
+    11: (_TYPE_DELTA,),
+    12: (_TYPE_DELTA,),
 }
 
 
@@ -336,6 +345,10 @@ class PayloadChecker(object):
     self.old_fs_sizes = collections.defaultdict(int)
     self.minor_version = None
     self.major_version = None
+    # The operations using each blob, by offset: the first one, and the
+    # indexes of the first and last ones in the payload.
+    self.blob_uses = collections.OrderedDict()
+    self.num_checked_ops = 0
 
   @staticmethod
   def _CheckElem(msg, name, report, is_mandatory, is_submsg, convert=str,
@@ -753,7 +766,7 @@ class PayloadChecker(object):
     return total_num_blocks
 
   def _CheckReplaceOperation(self, op, data_length, total_dst_blocks, op_name):
-    """Specific checks for REPLACE/REPLACE_BZ/REPLACE_XZ operations.
+    """Specific checks for REPLACE{,_BZ,_XZ,_ZSTD} operations.
 
     Args:
       op: The operation object from the manifest.
@@ -882,6 +895,64 @@ class PayloadChecker(object):
     if self.minor_version >= 3 and op.src_sha256_hash is None:
       raise error.PayloadError('%s: source hash missing.' % op_name)
 
+  def _CheckSharedBlob(self, op, op_name, prev_data_offset):
+    """Checks an operation using the blob of an earlier one.
+
+    Only an identical REPLACE operation may use a blob again, so that its
+    decoded data can be written as is.
+
+    Args:
+      op: The operation object from the manifest.
+      op_name: Operation name for error reporting.
+      prev_data_offset: Offset of last used data bytes.
+
+    Raises:
+      error.PayloadError if the operation may not share the blob.
+    """
+    uses = self.blob_uses.get(op.data_offset)
+    first = uses[0] if uses else None
+    if (self.payload_type != _TYPE_FULL and
+        self.minor_version < common.SHARED_BLOB_MINOR_PAYLOAD_VERSION):
+      first = None
+    if (first is None or first.type != op.type or
+        op.type not in (common.OpType.REPLACE, common.OpType.REPLACE_BZ,
+                        common.OpType.REPLACE_XZ,
+                        common.OpType.REPLACE_ZSTD) or
+        first.data_length != op.data_length or
+        first.data_sha256_hash != op.data_sha256_hash or
+        (sum(ex.num_blocks for ex in first.dst_extents) !=
+         sum(ex.num_blocks for ex in op.dst_extents))):
+      raise error.PayloadError(
+          '%s: data offset (%d) before the amount used so far (%d) but not '
+          'shared with an identical operation.' %
+          (op_name, op.data_offset, prev_data_offset))
+    uses[2] = self.num_checked_ops
+
+  def _CheckSharedBlobCache(self):
+    """Checks that the decoded shared blobs fit the cache of the client.
+
+    The decoded data of a shared blob is kept from its first operation to its
+    last one.
+
+    Raises:
+      error.PayloadError if the client would need to keep too much of it.
+    """
+    # The last use and size of the blobs cached, as a heap.
+    cached = []
+    cached_bytes = 0
+    for op, first, last in self.blob_uses.values():
+      if last == first:
+        continue
+      while cached and cached[0][0] < first:
+        cached_bytes -= heapq.heappop(cached)[1]
+      size = sum(ex.num_blocks for ex in op.dst_extents) * self.block_size
+      heapq.heappush(cached, (last, size))
+      cached_bytes += size
+      if cached_bytes > _MAX_SHARED_BLOB_CACHE_SIZE:
+        raise error.PayloadError(
+            'The shared blobs need %d bytes of decoded data at once, more '
+            'than %d.' % (cached_bytes, _MAX_SHARED_BLOB_CACHE_SIZE))
+
   def _CheckOperation(self, op, op_name, old_block_counters, new_block_counters,
                       old_usable_size, new_usable_size, prev_data_offset,
                       blob_hash_counts):
@@ -898,7 +969,8 @@ class PayloadChecker(object):
       blob_hash_counts: Counters for hashed/unhashed blobs.
 
     Returns:
-      The amount of data blob associated with the operation.
+      The amount of data blob associated with the operation, not counting a
+      blob shared with an earlier operation.
 
     Raises:
       error.PayloadError if any check has failed.
@@ -951,17 +1023,30 @@ class PayloadChecker(object):
         raise error.PayloadError('%s: unhashed operation not allowed.' %
                                  op_name)
 
+    shared_blob = False
     if data_offset is not None:
-      # Check: Contiguous use of data section.
-      if data_offset != prev_data_offset:
+      # Check: Contiguous use of data section, but for the blobs shared with an
+      # earlier identical operation.
+      if data_offset < prev_data_offset:
+        self._CheckSharedBlob(op, op_name, prev_data_offset)
+        shared_blob = True
+      elif data_offset != prev_data_offset:
         raise error.PayloadError(
             '%s: data offset (%d) not matching amount used so far (%d).' %
             (op_name, data_offset, prev_data_offset))
+      else:
+        self.blob_uses[data_offset] = [op, self.num_checked_ops,
+                                       self.num_checked_ops]
+    self.num_checked_ops += 1
 
     # Type-specific checks.
     if op.type in (common.OpType.REPLACE, common.OpType.REPLACE_BZ,
                    common.OpType.REPLACE_XZ):
       self._CheckReplaceOperation(op, data_length, total_dst_blocks, op_name)
+    elif op.type == common.OpType.REPLACE_ZSTD and (
+        self.payload_type == _TYPE_FULL or
+        self.minor_version >= common.ZSTD_MINOR_PAYLOAD_VERSION):
+      self._CheckReplaceOperation(op, data_length, total_dst_blocks, op_name)
     elif op.type == common.OpType.ZERO and self.minor_version >= 4:
       self._CheckZeroOperation(op, op_name)
     elif op.type == common.OpType.SOURCE_COPY and self.minor_version >= 2:
@@ -981,6 +1066,8 @@ class PayloadChecker(object):
       raise error.PayloadError(
           'Operation %s (type %d) not allowed in minor version %d' %
           (op_name, op.type, self.minor_version))
+    if shared_blob:
+      return 0
     return data_length if data_length is not None else 0
 
   def _SizeToNumBlocks(self, size):
@@ -1031,6 +1118,7 @@ class PayloadChecker(object):
         common.OpType.REPLACE: 0,
         common.OpType.REPLACE_BZ: 0,
         common.OpType.REPLACE_XZ: 0,
+        common.OpType.REPLACE_ZSTD: 0,
         common.OpType.ZERO: 0,
         common.OpType.SOURCE_COPY: 0,
         common.OpType.SOURCE_BSDIFF: 0,
@@ -1042,6 +1130,7 @@ class PayloadChecker(object):
         common.OpType.REPLACE: 0,
         common.OpType.REPLACE_BZ: 0,
         common.OpType.REPLACE_XZ: 0,
+        common.OpType.REPLACE_ZSTD: 0,
         # SOURCE_COPY operations don't have blobs.
         common.OpType.SOURCE_BSDIFF: 0,
         common.OpType.PUFFDIFF: 0,
@@ -1200,7 +1289,7 @@ class PayloadChecker(object):
       # Part 1: Check the file header.
       report.AddSection('header')
       # Check: Payload version is valid.
-      if self.payload.header.version not in (1, 2):
+      if self.payload.header.version not in (1, 2, 3):
         raise error.PayloadError('Unknown payload version (%d).' %
                                  self.payload.header.version)
       report.AddField('version', self.payload.header.version)
@@ -1236,6 +1325,7 @@ class PayloadChecker(object):
             operations, report, '%s_install_operations' % part,
             self.old_fs_sizes[part], self.new_fs_sizes[part],
             old_fs_usable_size, new_fs_usable_size, total_blob_size)
+      self._CheckSharedBlobCache()
 
       # Check: Operations data reach the end of the payload file.
       used_payload_size = self.payload.data_offset + total_blob_size
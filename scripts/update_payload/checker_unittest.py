@@ -54,6 +54,7 @@ def _OpTypeByName(op_name):
       'REPLACE_XZ': common.OpType.REPLACE_XZ,
       'PUFFDIFF': common.OpType.PUFFDIFF,
       'BROTLI_BSDIFF': common.OpType.BROTLI_BSDIFF,
+      'REPLACE_ZSTD': common.OpType.REPLACE_ZSTD,
   }
   return op_name_to_type[op_name]
 
@@ -744,7 +745,7 @@ class PayloadCheckerTest(unittest.TestCase):
     """Parametric testing of _CheckOperation().
 
     Args:
-      op_type_name: 'REPLACE', 'REPLACE_BZ', 'REPLACE_XZ',
+      op_type_name: 'REPLACE', 'REPLACE_BZ', 'REPLACE_XZ', 'REPLACE_ZSTD',
         'SOURCE_COPY', 'SOURCE_BSDIFF', BROTLI_BSDIFF or 'PUFFDIFF'.
       allow_unhashed: Whether we're allowing to not hash the data.
       fail_src_extents: Tamper with src extents.
@@ -803,6 +804,8 @@ class PayloadCheckerTest(unittest.TestCase):
       payload_checker.minor_version = 3 if fail_bad_minor_version else 4
     elif op_type == common.OpType.PUFFDIFF:
       payload_checker.minor_version = 4 if fail_bad_minor_version else 5
+    elif op_type == common.OpType.REPLACE_ZSTD:
+      payload_checker.minor_version = 9 if fail_bad_minor_version else 10
 
     if op_type != common.OpType.SOURCE_COPY:
       if not fail_mismatched_data_offset_length:
@@ -865,6 +868,46 @@ class PayloadCheckerTest(unittest.TestCase):
       self.assertEqual(op.data_length if op.HasField('data_length') else 0,
                        payload_checker._CheckOperation(*args))
 
+  def testCheckOperationSharedBlob(self):
+    """Tests _CheckOperation() with operations sharing a blob."""
+    payload_checker = checker.PayloadChecker(self.MockPayload(),
+                                             allow_unhashed=True)
+    payload_checker.minor_version = common.SHARED_BLOB_MINOR_PAYLOAD_VERSION
+    block_size = payload_checker.block_size
+    new_part_size = test_utils.MiB(8)
+    new_block_counters = array.array(
+        'B', [0] * ((new_part_size + block_size - 1) // block_size))
+    blob_hash_counts = collections.defaultdict(int)
+
+    def NewReplaceOp(start_block):
+      op = update_metadata_pb2.InstallOperation()
+      op.type = common.OpType.REPLACE
+      op.data_offset = 0
+      op.data_length = 2 * block_size
+      self.AddToMessage(op.dst_extents, self.NewExtentList((start_block, 2)))
+      return op
+
+    def CheckOperation(op):
+      return payload_checker._CheckOperation(
+          op, 'foo', None, new_block_counters, 0, new_part_size,
+          2 * block_size, blob_hash_counts)
+
+    self.assertEqual(2 * block_size, payload_checker._CheckOperation(
+        NewReplaceOp(0), 'foo', None, new_block_counters, 0, new_part_size, 0,
+        blob_hash_counts))
+    # Pass, an identical operation uses the blob again without more data.
+    self.assertEqual(0, CheckOperation(NewReplaceOp(2)))
+    self.assertIsNone(payload_checker._CheckSharedBlobCache())
+
+    # Fail, the operation differs from the first one.
+    op = NewReplaceOp(4)
+    op.data_length = 2 * block_size - 1
+    self.assertRaises(PayloadError, CheckOperation, op)
+
+    # Fail, the minor version doesn't allow shared blobs.
+    payload_checker.minor_version = common.ZSTD_MINOR_PAYLOAD_VERSION
+    self.assertRaises(PayloadError, CheckOperation, NewReplaceOp(6))
+
   def testAllocBlockCounters(self):
     """Tests _CheckMoveOperation()."""
     payload_checker = checker.PayloadChecker(self.MockPayload())
@@ -1001,7 +1044,8 @@ class PayloadCheckerTest(unittest.TestCase):
         (minor_version == 2 and payload_type == checker._TYPE_DELTA) or
         (minor_version == 3 and payload_type == checker._TYPE_DELTA) or
         (minor_version == 4 and payload_type == checker._TYPE_DELTA) or
-        (minor_version == 5 and payload_type == checker._TYPE_DELTA))
+        (minor_version == 5 and payload_type == checker._TYPE_DELTA) or
+        (minor_version == 10 and payload_type == checker._TYPE_DELTA))
     args = (report,)
 
     if should_succeed:
@@ -1119,6 +1163,12 @@ def ValidateCheckOperationTest(op_type_name, allow_unhashed,
                                                  fail_bad_minor_version)):
     return False
 
+  # REPLACE_ZSTD doesn't read the source partition either, but needs a recent
+  # enough minor version in delta payloads.
+  if (op_type == common.OpType.REPLACE_ZSTD and (fail_src_extents or
+                                                 fail_src_length)):
+    return False
+
   # SOURCE_COPY operation does not carry data.
   if (op_type == common.OpType.SOURCE_COPY and (
       fail_mismatched_data_offset_length or fail_data_hash or
@@ -1203,8 +1253,9 @@ def AddAllParametricTests():
   # Add all _CheckOperation() test cases.
   AddParametricTests('CheckOperation',
                      {'op_type_name': ('REPLACE', 'REPLACE_BZ', 'REPLACE_XZ',
-                                       'SOURCE_COPY', 'SOURCE_BSDIFF',
-                                       'PUFFDIFF', 'BROTLI_BSDIFF'),
+                                       'REPLACE_ZSTD', 'SOURCE_COPY',
+                                       'SOURCE_BSDIFF', 'PUFFDIFF',
+                                       'BROTLI_BSDIFF'),
                       'allow_unhashed': (True, False),
                       'fail_src_extents': (True, False),
                       'fail_dst_extents': (True, False),
@@ -1230,7 +1281,7 @@ def AddAllParametricTests():
 
   # Add all _CheckManifestMinorVersion() test cases.
   AddParametricTests('CheckManifestMinorVersion',
-                     {'minor_version': (None, 0, 2, 3, 4, 5, 555),
+                     {'minor_version': (None, 0, 2, 3, 4, 5, 10, 555),
                       'payload_type': (checker._TYPE_FULL,
                                        checker._TYPE_DELTA)})
 
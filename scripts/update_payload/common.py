@@ -35,11 +35,14 @@ SIG_ASN1_HEADER = (
 )
 
 BRILLO_MAJOR_PAYLOAD_VERSION = 2
+COMPRESSED_MANIFEST_MAJOR_PAYLOAD_VERSION = 3
 
 SOURCE_MINOR_PAYLOAD_VERSION = 2
 OPSRCHASH_MINOR_PAYLOAD_VERSION = 3
 BROTLI_BSDIFF_MINOR_PAYLOAD_VERSION = 4
 PUFFDIFF_MINOR_PAYLOAD_VERSION = 5
+ZSTD_MINOR_PAYLOAD_VERSION = 10
+SHARED_BLOB_MINOR_PAYLOAD_VERSION = 11
 
 KERNEL = 'kernel'
 ROOTFS = 'root'
@@ -63,8 +66,10 @@ class OpType(object):
   PUFFDIFF = _CLASS.PUFFDIFF
   BROTLI_BSDIFF = _CLASS.BROTLI_BSDIFF
   ZUCCHINI = _CLASS.ZUCCHINI
+  REPLACE_ZSTD = _CLASS.REPLACE_ZSTD
   ALL = (REPLACE, REPLACE_BZ, SOURCE_COPY, SOURCE_BSDIFF, ZERO,
-         DISCARD, REPLACE_XZ, PUFFDIFF, BROTLI_BSDIFF, ZUCCHINI)
+         DISCARD, REPLACE_XZ, PUFFDIFF, BROTLI_BSDIFF, ZUCCHINI,
+         REPLACE_ZSTD)
   NAMES = {
       REPLACE: 'REPLACE',
       REPLACE_BZ: 'REPLACE_BZ',
@@ -76,6 +81,7 @@ class OpType(object):
       PUFFDIFF: 'PUFFDIFF',
       BROTLI_BSDIFF: 'BROTLI_BSDIFF',
       ZUCCHINI: 'ZUCCHINI',
+      REPLACE_ZSTD: 'REPLACE_ZSTD',
   }
 
   def __init__(self):
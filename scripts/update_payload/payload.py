@@ -25,12 +25,22 @@ import mmap
 import struct
 import zipfile
 
+# The zstandard module is only needed by the payloads with a compressed
+# manifest.
+try:
+  import zstandard
+except ImportError:
+  pass
+
 from update_payload import applier
 from update_payload import checker
 from update_payload import common
 from update_payload import update_metadata_pb2
 from update_payload.error import PayloadError
 
+# The largest manifest the client decompresses.
+_MAX_UNCOMPRESSED_MANIFEST_SIZE = 1024 * 1024 * 1024
+
 
 #
 # Helper functions.
@@ -109,7 +119,8 @@ class Payload(object):
                    self._MANIFEST_LEN_SIZE)
       self.metadata_signature_len = 0
 
-      if self.version == common.BRILLO_MAJOR_PAYLOAD_VERSION:
+      if self.version in (common.BRILLO_MAJOR_PAYLOAD_VERSION,
+                          common.COMPRESSED_MANIFEST_MAJOR_PAYLOAD_VERSION):
         self.size += self._METADATA_SIGNATURE_LEN_SIZE
         self.metadata_signature_len = _ReadInt(
             payload_file, self._METADATA_SIGNATURE_LEN_SIZE, True,
@@ -178,6 +189,39 @@ class Payload(object):
     return common.Read(self.payload_file, self.header.manifest_len,
                        hasher=self.manifest_hasher)
 
+  def _DecompressManifest(self, manifest_raw):
+    """Decompresses the manifest of a payload with a compressed manifest.
+
+    Args:
+      manifest_raw: its uncompressed size, as a big endian uint64, followed by
+        a zstd frame.
+
+    Returns:
+      A string containing the payload manifest in binary form.
+
+    Raises:
+      PayloadError if the manifest can't be decompressed.
+    """
+    size_len = struct.calcsize('>Q')
+    if len(manifest_raw) < size_len:
+      raise PayloadError('compressed manifest too small: %d' %
+                         len(manifest_raw))
+    uncompressed_size = struct.unpack('>Q', manifest_raw[:size_len])[0]
+    if uncompressed_size > _MAX_UNCOMPRESSED_MANIFEST_SIZE:
+      raise PayloadError('uncompressed manifest size too large: %d' %
+                         uncompressed_size)
+    try:
+      # pylint: disable=no-member
+      manifest = zstandard.ZstdDecompressor().decompress(
+          manifest_raw[size_len:], max_output_size=uncompressed_size)
+    except zstandard.ZstdError as e:
+      raise PayloadError('unable to decompress the manifest: %s' % e)
+    if len(manifest) != uncompressed_size:
+      raise PayloadError(
+          'decompressed manifest size %d does not match the expected size %d' %
+          (len(manifest), uncompressed_size))
+    return manifest
+
   def _ReadMetadataSignature(self):
     """Reads and returns the metadata signatures.
 
@@ -233,6 +277,9 @@ class Payload(object):
 
     # Read the manifest.
     manifest_raw = self._ReadManifest()
+    if (self.header.version ==
+        common.COMPRESSED_MANIFEST_MAJOR_PAYLOAD_VERSION):
+      manifest_raw = self._DecompressManifest(manifest_raw)
     self.manifest = update_metadata_pb2.DeltaArchiveManifest()
     self.manifest.ParseFromString(manifest_raw)
 
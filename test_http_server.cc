@@ -21,6 +21,10 @@
 
 // To use this, simply make an HTTP connection to localhost:port and
 // GET a url.
+//
+// With --concurrent, each connection is handled by its own thread, and
+// /throttle/ emulates the bandwidth, latency and stalls of a remote server,
+// e.g. to benchmark the download path with many fetchers at once.
 
 #include <err.h>
 #include <errno.h>
@@ -37,7 +41,10 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <base/logging.h>
@@ -75,6 +82,7 @@ struct HttpRequest {
   string url;
   off_t start_offset{0};
   off_t end_offset{0};  // non-inclusive, zero indicates unspecified.
+  string range;         // the Range header, without "bytes=".
   HttpResponseCode return_code{kHttpResponseOk};
 };
 
@@ -125,6 +133,7 @@ bool ParseRequest(int fd, HttpRequest* request) {
       LOG(INFO) << "range attribute: " << range;
       CHECK(base::StartsWith(range, "bytes=", base::CompareCase::SENSITIVE) &&
             range.find('-') != string::npos);
+      request->range = range.substr(strlen("bytes="));
       request->start_offset = atoll(range.c_str() + strlen("bytes="));
       // Decode end offset and increment it by one (so it is non-inclusive).
       if (range.find('-') < range.length() - 1)
@@ -385,6 +394,131 @@ ssize_t HandleGet(int fd,
   return HandleGet(fd, request, total_length, 0, 0, 0);
 }
 
+// Handles /multipart/<total_length> requests like /download/<total_length>,
+// except that a Range header with several ranges gets a multipart/byteranges
+// response. Returns the total number of bytes delivered or -1 for error.
+ssize_t HandleMultipartGet(int fd,
+                           const HttpRequest& request,
+                           const size_t total_length) {
+  const vector<string> ranges = base::SplitString(
+      request.range, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  if (ranges.size() < 2)
+    return HandleGet(fd, request, total_length);
+
+  const string boundary = "UE_TEST_BOUNDARY";
+  vector<string> part_headers;
+  vector<std::pair<off_t, off_t>> part_ranges;
+  const string closing = EOL "--" + boundary + "--" EOL;
+  size_t content_length = closing.size();
+  for (const string& range : ranges) {
+    const off_t first = atoll(range.c_str());
+    const off_t last = std::min<off_t>(
+        atoll(range.c_str() + range.find('-') + 1), total_length - 1);
+    CHECK_LE(first, last);
+    part_headers.push_back((part_headers.empty() ? "" : EOL) + string("--") +
+                           boundary +
+                           EOL "Content-Type: application/octet-stream" EOL
+                               "Content-Range: bytes " +
+                           Itoa(first) + "-" + Itoa(last) + "/" +
+                           Itoa(total_length) + EOL EOL);
+    part_ranges.emplace_back(first, last + 1);
+    content_length += part_headers.back().size() + last + 1 - first;
+  }
+
+  ssize_t written = WriteString(
+      fd,
+      string("HTTP/1.1 ") + Itoa(kHttpResponsePartialContent) + " " +
+          GetHttpResponseDescription(kHttpResponsePartialContent) +
+          EOL "Content-Type: multipart/byteranges; boundary=" + boundary +
+          EOL "Connection: close" EOL "Content-Length: " +
+          Itoa(content_length) + EOL EOL);
+  if (written < 0)
+    return -1;
+  for (size_t i = 0; i < part_headers.size(); i++) {
+    if (WriteString(fd, part_headers[i]) < 0)
+      return -1;
+    written += part_headers[i].size();
+    written += WritePayload(fd, part_ranges[i].first, part_ranges[i].second);
+  }
+  if (WriteString(fd, closing) < 0)
+    return -1;
+  written += closing.size();
+  LOG(INFO) << "multipart response with " << part_ranges.size()
+            << " parts complete, " << written << " total bytes written";
+  return written;
+}
+
+// Handles /throttle/<total_length>/<bytes_per_second>/<latency_ms>/
+// <stall_every>/<stall_ms> requests like /download/<total_length>, emulating
+// a remote server: the response starts after |latency_ms|, and its payload is
+// sent at |bytes_per_second| at most, pausing for |stall_ms| after every
+// |stall_every| bytes. A zero |bytes_per_second| or |stall_every| is
+// unlimited. Returns the total number of bytes delivered or -1 for error.
+ssize_t HandleThrottledGet(int fd,
+                           const HttpRequest& request,
+                           const size_t total_length,
+                           const size_t bytes_per_second,
+                           const int latency_ms,
+                           const size_t stall_every,
+                           const int stall_ms) {
+  using Clock = std::chrono::steady_clock;
+  std::this_thread::sleep_for(std::chrono::milliseconds(latency_ms));
+
+  const size_t start_offset = request.start_offset;
+  if (start_offset >= total_length) {
+    return WriteHeaders(
+        fd, total_length, total_length, kHttpResponseReqRangeNotSat);
+  }
+  size_t end_offset =
+      (request.end_offset > 0 ? request.end_offset : total_length);
+  if (end_offset < start_offset) {
+    return WriteHeaders(fd, 0, 0, kHttpResponseBadRequest);
+  }
+  end_offset = std::min(end_offset, total_length);
+
+  ssize_t written =
+      WriteHeaders(fd, start_offset, end_offset, request.return_code);
+  if (written < 0)
+    return -1;
+
+  // The payload is sent in chunks of about 50 ms at the given rate, each one
+  // once the previous ones are due.
+  size_t chunk_size = 64 * 1024;
+  if (bytes_per_second > 0)
+    chunk_size = std::clamp<size_t>(bytes_per_second / 20, 1, chunk_size);
+  if (stall_every > 0)
+    chunk_size = std::min(chunk_size, stall_every);
+  const Clock::time_point start_time = Clock::now();
+  Clock::duration stalled{0};
+  size_t sent = 0;
+  size_t since_stall = 0;
+  while (start_offset + sent < end_offset) {
+    const size_t count = std::min(chunk_size, end_offset - start_offset - sent);
+    const ssize_t ret =
+        WritePayload(fd, start_offset + sent, start_offset + sent + count);
+    if (ret < 0 || static_cast<size_t>(ret) != count)
+      return -1;
+    sent += count;
+    written += count;
+    since_stall += count;
+    if (stall_every > 0 && since_stall >= stall_every) {
+      since_stall = 0;
+      std::this_thread::sleep_for(std::chrono::milliseconds(stall_ms));
+      stalled += std::chrono::milliseconds(stall_ms);
+    }
+    if (bytes_per_second > 0) {
+      std::this_thread::sleep_until(
+          start_time + stalled +
+          std::chrono::duration_cast<Clock::duration>(
+              std::chrono::duration<double>(static_cast<double>(sent) /
+                                            bytes_per_second)));
+    }
+  }
+  LOG(INFO) << "throttled response complete, " << written
+            << " total bytes written";
+  return written;
+}
+
 // Handles /redirect/<code>/<url> requests by returning the specified
 // redirect <code> with a location pointing to /<url>.
 void HandleRedirect(int fd, const HttpRequest& request) {
@@ -535,6 +669,10 @@ void HandleConnection(int fd) {
                  url, "/download/", base::CompareCase::SENSITIVE)) {
     const UrlTerms terms(url, 2);
     HandleGet(fd, request, terms.GetSizeT(1));
+  } else if (base::StartsWith(
+                 url, "/multipart/", base::CompareCase::SENSITIVE)) {
+    const UrlTerms terms(url, 2);
+    HandleMultipartGet(fd, request, terms.GetSizeT(1));
   } else if (base::StartsWith(url, "/flaky/", base::CompareCase::SENSITIVE)) {
     const UrlTerms terms(url, 5);
     HandleGet(fd,
@@ -543,6 +681,16 @@ void HandleConnection(int fd) {
               terms.GetSizeT(2),
               terms.GetInt(3),
               terms.GetInt(4));
+  } else if (base::StartsWith(
+                 url, "/throttle/", base::CompareCase::SENSITIVE)) {
+    const UrlTerms terms(url, 6);
+    HandleThrottledGet(fd,
+                       request,
+                       terms.GetSizeT(1),
+                       terms.GetSizeT(2),
+                       terms.GetInt(3),
+                       terms.GetSizeT(4),
+                       terms.GetInt(5));
   } else if (url.find("/redirect/") == 0) {
     HandleRedirect(fd, request);
   } else if (url == "/error") {
@@ -568,29 +716,34 @@ using namespace chromeos_update_engine;  // NOLINT(build/namespaces)
 
 void usage(const char* prog_arg) {
   fprintf(stderr,
-          "Usage: %s [ FILE ]\n"
+          "Usage: %s [ --concurrent ] [ FILE ]\n"
           "Once accepting connections, the following is written to FILE (or "
           "stdout):\n"
-          "\"%sN\" (where N is an integer port number)\n",
+          "\"%sN\" (where N is an integer port number)\n"
+          "With --concurrent, the connections are handled in parallel.\n",
           basename(prog_arg),
           kListeningMsgPrefix);
 }
 
 int main(int argc, char** argv) {
-  // Check invocation.
-  if (argc > 2)
-    errx(RC_BAD_ARGS, "unexpected number of arguments (use -h for usage)");
-
-  // Parse (optional) argument.
+  // Parse (optional) arguments.
   int report_fd = STDOUT_FILENO;
-  if (argc == 2) {
-    if (!strcmp(argv[1], "-h")) {
+  bool concurrent = false;
+  const char* report_path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-h")) {
       usage(argv[0]);
       exit(RC_OK);
+    } else if (!strcmp(argv[i], "--concurrent")) {
+      concurrent = true;
+    } else if (report_path == nullptr) {
+      report_path = argv[i];
+    } else {
+      errx(RC_BAD_ARGS, "unexpected number of arguments (use -h for usage)");
     }
-
-    report_fd = open(argv[1], O_WRONLY | O_CREAT, 00644);
   }
+  if (report_path != nullptr)
+    report_fd = open(report_path, O_WRONLY | O_CREAT, 00644);
 
   // Ignore SIGPIPE on write() to sockets.
   signal(SIGPIPE, SIG_IGN);
@@ -621,7 +774,7 @@ int main(int argc, char** argv) {
     perror("bind");
     exit(RC_ERR_BIND);
   }
-  if (listen(listen_fd, 5) < 0) {
+  if (listen(listen_fd, concurrent ? SOMAXCONN : 5) < 0) {
     perror("listen");
     exit(RC_ERR_LISTEN);
   }
@@ -658,6 +811,10 @@ int main(int argc, char** argv) {
     LOG(INFO) << "got past accept";
     if (client_fd < 0)
       LOG(FATAL) << "ERROR on accept";
-    HandleConnection(client_fd);
+    if (concurrent) {
+      std::thread(HandleConnection, client_fd).detach();
+    } else {
+      HandleConnection(client_fd);
+    }
   }
 }